@@ -0,0 +1,67 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stddef.h>
+
+#include "alloc_count.h"
+
+#if defined(COUNT_ALLOCATIONS)
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static uint64_t n_allocations;
+
+void *malloc(size_t size)
+{
+    n_allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    n_allocations++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    n_allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *ptr;
+
+    n_allocations++;
+    ptr = __libc_memalign(alignment, size);
+    if (!ptr)
+        return ENOMEM;
+
+    *memptr = ptr;
+    return 0;
+}
+
+uint64_t get_allocation_count(void) { return n_allocations; }
+#endif
@@ -0,0 +1,32 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+/* Benchmarks linking with alloc_count.c have every allocation made by Lwan
+ * (including coro_malloc()) counted, as symbols in the executable take
+ * precedence over the C library's. */
+#define COUNT_ALLOCATIONS
+
+uint64_t get_allocation_count(void);
+#endif
@@ -0,0 +1,205 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* Measures coroutine context switches: a coroutine is resumed and yields
+ * back right away, over and over, so each round trip is two switches.
+ * Creating (or resetting) a coroutine and running it to completion, as
+ * done for every connection, is measured as well.  On glibc, the same
+ * round trip is then measured with swapcontext(), which is what coroutine
+ * libraries without hand-written switching routines end up using. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__GLIBC__)
+#include <ucontext.h>
+#endif
+
+#include "lwan-private.h"
+
+#include "lwan-config.h"
+
+#include "bench.h"
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void report(const char *what, uint64_t elapsed, size_t iterations)
+{
+    printf("%-24s %8.1f ns/op\n", what,
+           (double)elapsed / (double)iterations);
+}
+
+static int yield_forever(struct coro *coro,
+                         void *data __attribute__((unused)))
+{
+    /* Values go both ways, so that a broken switch is noticed: the
+     * coroutine yields the round trip number, and is resumed with it. */
+    for (int64_t expected = 1;; expected++) {
+        int64_t value = coro_yield(coro, expected);
+
+        if (UNLIKELY(value != expected))
+            lwan_status_critical("Coroutine resumed with %" PRId64
+                                 ", expected %" PRId64,
+                                 value, expected);
+    }
+
+    __builtin_unreachable();
+}
+
+static int return_right_away(struct coro *coro __attribute__((unused)),
+                             void *data)
+{
+    return (int)(intptr_t)data;
+}
+
+static void run_switch(size_t iterations)
+{
+    struct coro_switcher switcher;
+    struct coro *coro;
+    uint64_t start;
+
+    coro = coro_new(&switcher, yield_forever, NULL);
+    if (!coro)
+        lwan_status_critical("Could not create coroutine");
+
+    start = now_ns();
+    for (size_t i = 0; i < iterations; i++) {
+        int64_t value = coro_resume_value(coro, (int64_t)i);
+
+        if (UNLIKELY(value != (int64_t)i + 1))
+            lwan_status_critical("Coroutine yielded %" PRId64
+                                 ", expected %zu",
+                                 value, i + 1);
+    }
+    report("resume+yield", now_ns() - start, iterations);
+
+    coro_free(coro);
+}
+
+static void run_lifecycle(size_t iterations)
+{
+    struct coro_switcher switcher;
+    struct coro *coro;
+    uint64_t start;
+
+    start = now_ns();
+    for (size_t i = 0; i < iterations; i++) {
+        coro = coro_new(&switcher, return_right_away, (void *)(intptr_t)42);
+        if (UNLIKELY(!coro))
+            lwan_status_critical("Could not create coroutine");
+        if (UNLIKELY(coro_resume(coro) != 42))
+            lwan_status_critical("Coroutine returned the wrong value");
+        coro_free(coro);
+    }
+    report("new+resume+free", now_ns() - start, iterations);
+
+    coro = coro_new(&switcher, return_right_away, (void *)(intptr_t)42);
+    if (!coro)
+        lwan_status_critical("Could not create coroutine");
+
+    start = now_ns();
+    for (size_t i = 0; i < iterations; i++) {
+        coro_reset(coro, return_right_away, (void *)(intptr_t)42);
+        if (UNLIKELY(coro_resume(coro) != 42))
+            lwan_status_critical("Coroutine returned the wrong value");
+    }
+    report("reset+resume", now_ns() - start, iterations);
+
+    coro_free(coro);
+}
+
+#if defined(__GLIBC__)
+static ucontext_t ucontext_caller, ucontext_callee;
+
+static void ucontext_yield_forever(void)
+{
+    while (true)
+        swapcontext(&ucontext_callee, &ucontext_caller);
+}
+
+static void run_ucontext(size_t iterations)
+{
+    const size_t stack_size = coro_get_stack_size();
+    void *stack = malloc(stack_size);
+    uint64_t start;
+
+    if (!stack)
+        lwan_status_critical("Could not allocate stack");
+
+    getcontext(&ucontext_callee);
+    ucontext_callee.uc_stack.ss_sp = stack;
+    ucontext_callee.uc_stack.ss_size = stack_size;
+    ucontext_callee.uc_link = NULL;
+    makecontext(&ucontext_callee, ucontext_yield_forever, 0);
+
+    start = now_ns();
+    for (size_t i = 0; i < iterations; i++)
+        swapcontext(&ucontext_caller, &ucontext_callee);
+    report("swapcontext (glibc)", now_ns() - start, iterations);
+
+    free(stack);
+}
+#endif
+
+static void usage(const char *argv0)
+{
+    printf("Usage: %s [-n iterations]\n", argv0);
+    printf("Measures a coroutine round trip (resume and yield), creating "
+           "and running\na coroutine to completion, and, on glibc, a "
+           "round trip with swapcontext()\nfor comparison.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    size_t iterations = 10000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hn:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = (size_t)parse_long(optarg, 10000000);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    bench_warn_if_debug();
+
+    run_switch(iterations);
+    run_lifecycle(LWAN_MAX(1u, iterations / 10));
+#if defined(__GLIBC__)
+    run_ucontext(iterations);
+#endif
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,282 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* Measures what's done for every websocket handshake and every Basic
+ * authentication request: SHA-1 and base64, with every routine the CPU
+ * supports (the first one listed is the one in use), and then both
+ * together, as in the computation of Sec-WebSocket-Accept.  Routines
+ * are checked against the scalar ones before being measured. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "base64.h"
+#include "sha1.h"
+
+#include "bench.h"
+
+/* Roughly how many bytes are processed for each measurement. */
+#define BYTES_PER_RUN (256ull << 20)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void fill_random(unsigned char *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (unsigned char)rand();
+}
+
+static void report(const char *what,
+                   const char *name,
+                   size_t size,
+                   uint64_t elapsed,
+                   size_t n_iter)
+{
+    printf("%-8s %-8s %8zu bytes: %8.2f MiB/s %10.1f ns/op\n", what, name,
+           size,
+           (double)(n_iter * size) / (double)elapsed * 1e9 / (double)(1 << 20),
+           (double)elapsed / (double)n_iter);
+}
+
+static size_t iterations_for(size_t size, unsigned int iterations)
+{
+    return iterations ? iterations
+                      : (size_t)LWAN_MAX(1ull, BYTES_PER_RUN / size);
+}
+
+static void check_sha1_kernel(const struct sha1_transform_kernel *kernel,
+                              const struct sha1_transform_kernel *scalar)
+{
+    unsigned char buf[64 * 8];
+
+    for (size_t n_blocks = 1; n_blocks <= 8; n_blocks++) {
+        uint32_t expected[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE,
+                                0x10325476, 0xC3D2E1F0};
+        uint32_t got[5];
+
+        memcpy(got, expected, sizeof(got));
+        fill_random(buf, n_blocks * 64);
+
+        scalar->transform(expected, buf, n_blocks);
+        kernel->transform(got, buf, n_blocks);
+
+        if (memcmp(expected, got, sizeof(got))) {
+            lwan_status_critical("%s hashes %zu blocks incorrectly",
+                                 kernel->name, n_blocks);
+        }
+    }
+}
+
+static void check_base64_kernel(const struct base64_kernel *kernel,
+                                const struct base64_kernel *scalar)
+{
+    unsigned char src[200], expected[300], got[300];
+
+    /* Every length up to a few vectors, so that all the remainder paths
+     * are exercised. */
+    for (size_t len = 0; len < sizeof(src); len++) {
+        size_t expected_len, got_len;
+
+        fill_random(src, len);
+
+        expected_len = scalar->encode(src, len, expected);
+        got_len = kernel->encode(src, len, got);
+        if (expected_len != got_len || memcmp(expected, got, got_len / 3 * 4))
+            lwan_status_critical("%s encodes %zu bytes incorrectly",
+                                 kernel->name, len);
+
+        /* Decode the encoded text, with a character that isn't in the
+         * alphabet somewhere in it. */
+        memcpy(src, expected, expected_len / 3 * 4);
+        if (len)
+            src[(size_t)rand() % (expected_len / 3 * 4 + 1)] = '=';
+
+        expected_len = scalar->decode(src, expected_len / 3 * 4, expected,
+                                      sizeof(expected));
+        got_len = kernel->decode(src, got_len / 3 * 4, got, sizeof(got));
+        if (expected_len != got_len || memcmp(expected, got, got_len / 4 * 3))
+            lwan_status_critical("%s decodes %zu characters incorrectly",
+                                 kernel->name, len);
+    }
+}
+
+static void run_sha1(const struct sha1_transform_kernel *kernel,
+                     const unsigned char *buf,
+                     size_t size,
+                     unsigned int iterations)
+{
+    const size_t n_iter = iterations_for(size, iterations);
+    uint32_t state[5] = {0};
+    uint64_t start = now_ns();
+
+    for (size_t i = 0; i < n_iter; i++) {
+        kernel->transform(state, buf, size / 64);
+        __asm__ __volatile__("" : : "r"(state) : "memory");
+    }
+
+    report("sha1", kernel->name, size, now_ns() - start, n_iter);
+}
+
+static void run_base64(const struct base64_kernel *kernel,
+                       unsigned char *buf,
+                       unsigned char *encoded,
+                       size_t size,
+                       unsigned int iterations)
+{
+    const size_t n_iter = iterations_for(size, iterations);
+    const size_t encoded_len = base64_encoded_len(size);
+    uint64_t start;
+
+    start = now_ns();
+    for (size_t i = 0; i < n_iter; i++) {
+        kernel->encode(buf, size, encoded);
+        __asm__ __volatile__("" : : "r"(encoded) : "memory");
+    }
+    report("encode", kernel->name, size, now_ns() - start, n_iter);
+
+    start = now_ns();
+    for (size_t i = 0; i < n_iter; i++) {
+        kernel->decode(encoded, encoded_len, buf, size);
+        __asm__ __volatile__("" : : "r"(buf) : "memory");
+    }
+    report("decode", kernel->name, size, now_ns() - start, n_iter);
+}
+
+static void run_handshake(unsigned int iterations)
+{
+    static const unsigned char key[] = "dGhlIHNhbXBsZSBub25jZQ==";
+    static const unsigned char websocket_uuid[] =
+        "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    const size_t n_iter = iterations ? iterations : 1000000;
+    unsigned char digest[20];
+    uint64_t start = now_ns();
+
+    for (size_t i = 0; i < n_iter; i++) {
+        sha1_context ctx;
+        unsigned char *encoded;
+
+        sha1_init(&ctx);
+        sha1_update(&ctx, key, sizeof(key) - 1);
+        sha1_update(&ctx, websocket_uuid, sizeof(websocket_uuid) - 1);
+        sha1_finalize(&ctx, digest);
+
+        encoded = base64_encode(digest, sizeof(digest), NULL);
+        if (i == 0 && !streq((char *)encoded, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo="))
+            lwan_status_critical("Wrong Sec-WebSocket-Accept: %s", encoded);
+        free(encoded);
+    }
+
+    printf("%-17s %8zu bytes: %30.1f ns/op\n", "websocket accept",
+           sizeof(key) - 1, (double)(now_ns() - start) / (double)n_iter);
+}
+
+static void run_basic_auth(unsigned int iterations)
+{
+    static const unsigned char header[] = "Zm9vYmFyYmF6OnNlY3JldHBhc3N3b3Jk";
+    const size_t n_iter = iterations ? iterations : 1000000;
+    uint64_t start = now_ns();
+
+    for (size_t i = 0; i < n_iter; i++) {
+        size_t decoded_len;
+        unsigned char *decoded =
+            base64_decode(header, sizeof(header) - 1, &decoded_len);
+
+        if (i == 0 && (!decoded || decoded_len != 24))
+            lwan_status_critical("Could not decode Basic auth header");
+        free(decoded);
+    }
+
+    printf("%-17s %8zu bytes: %30.1f ns/op\n", "basic auth",
+           sizeof(header) - 1, (double)(now_ns() - start) / (double)n_iter);
+}
+
+static void usage(const char *argv0)
+{
+    printf("Usage: %s [-n iterations]\n", argv0);
+    printf("Hashes blocks with every SHA-1 routine supported by this CPU, "
+           "encodes and\ndecodes base64 with every base64 routine, and "
+           "computes the responses to\nwebsocket handshakes and decodes "
+           "Basic authentication headers.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t sizes[] = {24, 64, 1024, 16384};
+    static unsigned char buf[16384], encoded[16384 / 3 * 4 + 4];
+    struct sha1_transform_kernel sha1_kernels[2];
+    struct base64_kernel base64_kernels[3];
+    unsigned int iterations = 0;
+    size_t n_sha1_kernels, n_base64_kernels;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hn:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = (unsigned int)parse_long(optarg, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    bench_warn_if_debug();
+
+    n_sha1_kernels = sha1_get_transform_kernels(sha1_kernels);
+    for (size_t k = 0; k < n_sha1_kernels; k++)
+        check_sha1_kernel(&sha1_kernels[k], &sha1_kernels[n_sha1_kernels - 1]);
+
+    n_base64_kernels = base64_get_kernels(base64_kernels);
+    for (size_t k = 0; k < n_base64_kernels; k++) {
+        check_base64_kernel(&base64_kernels[k],
+                            &base64_kernels[n_base64_kernels - 1]);
+    }
+
+    for (size_t i = 0; i < N_ELEMENTS(sizes); i++) {
+        fill_random(buf, sizes[i]);
+
+        if (sizes[i] % 64 == 0) {
+            for (size_t k = 0; k < n_sha1_kernels; k++)
+                run_sha1(&sha1_kernels[k], buf, sizes[i], iterations);
+        }
+        for (size_t k = 0; k < n_base64_kernels; k++) {
+            run_base64(&base64_kernels[k], buf, encoded, sizes[i],
+                       iterations);
+        }
+    }
+
+    run_handshake(iterations);
+    run_basic_auth(iterations);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,208 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* Measures insertions, successful and unsuccessful lookups, and removals
+ * on string and integer hash tables of a few different sizes.  String
+ * keys resemble paths that the file serving cache would see, so they
+ * share long prefixes, which is the worst case for key comparison. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "hash.h"
+#include "lwan-config.h"
+
+#include "bench.h"
+
+struct keys {
+    void **present;
+    void **absent;
+    size_t n;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void *str_key(size_t i, const char *kind)
+{
+    char *key;
+
+    if (asprintf(&key, "/var/www/static/assets/%s/%zx/file-%zu.html", kind,
+                 i % 37, i) < 0)
+        lwan_status_critical("Could not allocate key");
+
+    return key;
+}
+
+static void *int_key(size_t i, const char *kind)
+{
+    /* Keys must be non-zero, as hash_find() can't tell a NULL value from
+     * a missing key; absent keys use the odd numbers. */
+    return (void *)(uintptr_t)(i * 2 + (*kind == 'a' ? 3 : 2));
+}
+
+static void keys_init(struct keys *keys,
+                      size_t n,
+                      void *(*make_key)(size_t i, const char *kind))
+{
+    keys->present = calloc(n, sizeof(void *));
+    keys->absent = calloc(n, sizeof(void *));
+    if (!keys->present || !keys->absent)
+        lwan_status_critical("Could not allocate keys");
+
+    for (size_t i = 0; i < n; i++) {
+        keys->present[i] = make_key(i, "present");
+        keys->absent[i] = make_key(i, "absent");
+    }
+
+    keys->n = n;
+}
+
+static void keys_free(struct keys *keys, bool free_keys)
+{
+    if (free_keys) {
+        for (size_t i = 0; i < keys->n; i++) {
+            free(keys->present[i]);
+            free(keys->absent[i]);
+        }
+    }
+
+    free(keys->present);
+    free(keys->absent);
+}
+
+static void report(const char *name,
+                   size_t n,
+                   const char *op,
+                   uint64_t elapsed,
+                   size_t n_ops)
+{
+    printf("%-4s %8zu keys: %-6s %8.2f ns/op\n", name, n, op,
+           (double)elapsed / (double)n_ops);
+}
+
+static void run(const char *name,
+                struct hash *(*new_hash)(void (*free_key)(void *),
+                                         void (*free_value)(void *)),
+                const struct keys *keys,
+                unsigned int iterations)
+{
+    uint64_t insert = 0, hit = 0, miss = 0, del = 0;
+    size_t found = 0;
+
+    for (unsigned int it = 0; it < iterations; it++) {
+        struct hash *hash = new_hash(NULL, NULL);
+        uint64_t start;
+
+        if (!hash)
+            lwan_status_critical("Could not create hash table");
+
+        start = now_ns();
+        for (size_t i = 0; i < keys->n; i++)
+            hash_add(hash, keys->present[i], keys->present[i]);
+        insert += now_ns() - start;
+
+        start = now_ns();
+        for (size_t i = 0; i < keys->n; i++)
+            found += hash_find(hash, keys->present[i]) != NULL;
+        hit += now_ns() - start;
+
+        start = now_ns();
+        for (size_t i = 0; i < keys->n; i++)
+            found += hash_find(hash, keys->absent[i]) != NULL;
+        miss += now_ns() - start;
+
+        start = now_ns();
+        for (size_t i = 0; i < keys->n; i++)
+            hash_del(hash, keys->present[i]);
+        del += now_ns() - start;
+
+        hash_free(hash);
+    }
+
+    if (found != (size_t)iterations * keys->n)
+        lwan_status_critical("Found %zu keys, expected %zu", found,
+                             (size_t)iterations * keys->n);
+
+    const size_t n_ops = (size_t)iterations * keys->n;
+    report(name, keys->n, "add", insert, n_ops);
+    report(name, keys->n, "hit", hit, n_ops);
+    report(name, keys->n, "miss", miss, n_ops);
+    report(name, keys->n, "del", del, n_ops);
+}
+
+static void usage(const char *argv0)
+{
+    printf("Usage: %s [-n iterations]\n", argv0);
+    printf("Adds, finds, and removes keys from string and integer hash "
+           "tables of\nvarious sizes, printing the average time per "
+           "operation.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t sizes[] = {16, 256, 4096, 65536};
+    unsigned int iterations = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hn:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = (unsigned int)parse_long(optarg, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    bench_warn_if_debug();
+
+    for (size_t i = 0; i < N_ELEMENTS(sizes); i++) {
+        /* Roughly the same number of operations for every table size,
+         * unless overridden in the command line. */
+        unsigned int n_iter =
+            iterations ? iterations
+                       : (unsigned int)LWAN_MAX((size_t)1, 1000000 / sizes[i]);
+        struct keys keys;
+
+        keys_init(&keys, sizes[i], str_key);
+        run("str", hash_str_new, &keys, n_iter);
+        keys_free(&keys, true);
+
+        keys_init(&keys, sizes[i], int_key);
+        run("int", hash_int_new, &keys, n_iter);
+        keys_free(&keys, false);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,401 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* Measures the building blocks of most dynamic responses that aren't
+ * rendered by templates: encoding the JSON objects from the TechEmpower
+ * benchmarks with the encoder used by the TechEmpower and chatr samples,
+ * converting numbers to strings, and appending to a growing string
+ * buffer. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "int-to-str.h"
+#include "lwan-config.h"
+#include "lwan-template.h"
+
+#include "json.h"
+
+#include "alloc_count.h"
+#include "bench.h"
+
+struct hello_world_json {
+    const char *message;
+};
+static const struct json_obj_descr hello_world_json_desc[] = {
+    JSON_OBJ_DESCR_PRIM(struct hello_world_json, message, JSON_TOK_STRING),
+};
+
+struct db_json {
+    int id;
+    int randomNumber;
+};
+static const struct json_obj_descr db_json_desc[] = {
+    JSON_OBJ_DESCR_PRIM(struct db_json, id, JSON_TOK_NUMBER),
+    JSON_OBJ_DESCR_PRIM(struct db_json, randomNumber, JSON_TOK_NUMBER),
+};
+
+struct queries_json {
+    struct db_json queries[500];
+    size_t queries_len;
+};
+static const struct json_obj_descr queries_array_desc =
+    JSON_OBJ_DESCR_OBJ_ARRAY(struct queries_json,
+                             queries,
+                             500,
+                             queries_len,
+                             db_json_desc,
+                             N_ELEMENTS(db_json_desc));
+
+static struct json_encoder hello_world_json_encoder =
+    JSON_ENCODER(hello_world_json_desc);
+static struct json_encoder db_json_encoder = JSON_ENCODER(db_json_desc);
+static struct json_encoder queries_json_encoder =
+    JSON_ARR_ENCODER(queries_array_desc);
+
+static struct queries_json queries;
+
+static const char escaped_message[] =
+    "<script>alert(\"This should not be displayed in a "
+    "browser alert box.\");</script>\n\tThis \\ should.";
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int append_to_strbuf(const char *bytes, size_t len, void *data)
+{
+    struct lwan_strbuf *strbuf = data;
+
+    return !lwan_strbuf_append_str(strbuf, bytes, len);
+}
+
+static void encode_message(struct lwan_strbuf *buf,
+                           size_t i __attribute__((unused)))
+{
+    struct hello_world_json j = {.message = "Hello, World!"};
+
+    json_obj_encode_full(hello_world_json_desc,
+                         N_ELEMENTS(hello_world_json_desc), &j,
+                         append_to_strbuf, buf, false);
+}
+
+static void encode_escaped_message(struct lwan_strbuf *buf,
+                                   size_t i __attribute__((unused)))
+{
+    struct hello_world_json j = {.message = escaped_message};
+
+    json_obj_encode_full(hello_world_json_desc,
+                         N_ELEMENTS(hello_world_json_desc), &j,
+                         append_to_strbuf, buf, false);
+}
+
+static void encode_db(struct lwan_strbuf *buf, size_t i)
+{
+    struct db_json db = {.id = (int)(i % 10000) + 1,
+                         .randomNumber = (int)(i * 7919 % 10000) + 1};
+
+    json_obj_encode_full(db_json_desc, N_ELEMENTS(db_json_desc), &db,
+                         append_to_strbuf, buf, false);
+}
+
+static void encode_queries(struct lwan_strbuf *buf,
+                           size_t i __attribute__((unused)))
+{
+    json_arr_encode_full(&queries_array_desc, &queries, append_to_strbuf, buf,
+                         false);
+}
+
+static void compiled_message(struct lwan_strbuf *buf,
+                             size_t i __attribute__((unused)))
+{
+    struct hello_world_json j = {.message = "Hello, World!"};
+
+    json_encode_strbuf(&hello_world_json_encoder, &j, buf);
+}
+
+static void compiled_escaped_message(struct lwan_strbuf *buf,
+                                     size_t i __attribute__((unused)))
+{
+    struct hello_world_json j = {.message = escaped_message};
+
+    json_encode_strbuf(&hello_world_json_encoder, &j, buf);
+}
+
+static void compiled_db(struct lwan_strbuf *buf, size_t i)
+{
+    struct db_json db = {.id = (int)(i % 10000) + 1,
+                         .randomNumber = (int)(i * 7919 % 10000) + 1};
+
+    json_encode_strbuf(&db_json_encoder, &db, buf);
+}
+
+static void compiled_queries(struct lwan_strbuf *buf,
+                             size_t i __attribute__((unused)))
+{
+    json_encode_strbuf(&queries_json_encoder, &queries, buf);
+}
+
+struct request_json {
+    const char *name;
+    int quantity;
+    const char *tags[8];
+    size_t n_tags;
+    bool gift;
+};
+
+#undef JSON_STRUCT
+#define JSON_STRUCT struct request_json
+static const struct json_obj_descr request_json_desc[] = {
+    JSON_VAR_STR(name),
+    JSON_VAR_INT(quantity),
+    JSON_VAR_ARRAY(tags, n_tags, JSON_TOK_STRING),
+    JSON_VAR_BOOL(gift),
+};
+static struct json_encoder request_json_encoder =
+    JSON_ENCODER(request_json_desc);
+
+/* A pretty-printed request body, like one sent to a JSON API. */
+static const char request_body[] =
+    "{\n"
+    "    \"name\": \"Caf\\u00e9 \\\"Au Lait\\\" with a longer description "
+    "than usual\",\n"
+    "    \"quantity\": 12,\n"
+    "    \"tags\": [\n"
+    "        \"beverage\",\n"
+    "        \"hot\",\n"
+    "        \"dairy/milk\"\n"
+    "    ],\n"
+    "    \"gift\": true\n"
+    "}\n";
+
+static void parse_request(struct lwan_strbuf *buf,
+                          size_t i __attribute__((unused)))
+{
+    /* The parser works in place, like it does on request buffers, so it
+     * needs a fresh copy of the body every time. */
+    char body[sizeof(request_body)];
+    struct request_json parsed = {};
+
+    memcpy(body, request_body, sizeof(request_body));
+
+    if (json_obj_parse(body, sizeof(request_body) - 1, request_json_desc,
+                       N_ELEMENTS(request_json_desc), &parsed) < 0)
+        lwan_status_critical("Could not parse request body");
+
+    json_encode_strbuf(&request_json_encoder, &parsed, buf);
+}
+
+static void format_int(struct lwan_strbuf *buf, size_t i)
+{
+    char convertbuf[INT_TO_STR_BUFFER_SIZE];
+    size_t len;
+    char *converted;
+
+    /* Alternate signs and vary the number of digits. */
+    converted = int_to_string((ssize_t)(i * 2654435761u % 2000000001u) -
+                                  1000000000,
+                              convertbuf, &len);
+    lwan_strbuf_append_str(buf, converted, len);
+}
+
+static void format_int_template(struct lwan_strbuf *buf, size_t i)
+{
+    /* Same numbers as above, as templates append them. */
+    int value = (int)((ssize_t)(i * 2654435761u % 2000000001u) - 1000000000);
+
+    lwan_append_int_to_strbuf(buf, &value);
+}
+
+static void format_uint(struct lwan_strbuf *buf, size_t i)
+{
+    char convertbuf[INT_TO_STR_BUFFER_SIZE];
+    size_t len;
+    char *converted;
+
+    converted = uint_to_string(i * 2654435761u % 4000000000u, convertbuf, &len);
+    lwan_strbuf_append_str(buf, converted, len);
+}
+
+static void format_double(struct lwan_strbuf *buf, size_t i)
+{
+    double value = (double)(i % 3600000) / 10000.0 - 180.0;
+
+    lwan_append_double_to_strbuf(buf, &value);
+}
+
+static void format_double_printf(struct lwan_strbuf *buf, size_t i)
+{
+    double value = (double)(i % 3600000) / 10000.0 - 180.0;
+
+    /* How doubles used to be formatted, for comparison. */
+    lwan_strbuf_append_printf(buf, "%f", value);
+}
+
+static void strbuf_grow(struct lwan_strbuf *buf,
+                        size_t i __attribute__((unused)))
+{
+    static const char piece[] = "0123456789abcdef";
+
+    /* The buffer has been trimmed back to 2KiB; grow it to 64KiB, 16 bytes
+     * at a time, like a large response built piece by piece without a
+     * size hint. */
+    for (size_t len = 0; len < 65536; len += sizeof(piece) - 1)
+        lwan_strbuf_append_str(buf, piece, sizeof(piece) - 1);
+}
+
+static void strbuf_printf(struct lwan_strbuf *buf, size_t i)
+{
+    lwan_strbuf_append_printf(buf, "id=%zu, name=%s\n", i, "lwan");
+}
+
+static void run(const char *name,
+                void (*func)(struct lwan_strbuf *buf, size_t i),
+                size_t iterations,
+                bool print)
+{
+    struct lwan_strbuf buf;
+    size_t bytes = 0;
+    uint64_t start;
+#if defined(COUNT_ALLOCATIONS)
+    uint64_t start_allocations;
+#endif
+
+    lwan_strbuf_init(&buf);
+
+#if defined(COUNT_ALLOCATIONS)
+    start_allocations = get_allocation_count();
+#endif
+    start = now_ns();
+    for (size_t i = 0; i < iterations; i++) {
+        /* Response buffers are trimmed like this between requests. */
+        lwan_strbuf_reset_trim(&buf, 2048);
+
+        func(&buf, i);
+        bytes += lwan_strbuf_get_length(&buf);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    printf("%-18s %8zu bytes: %8.1f ns/op, %8.2f MiB/s", name,
+           lwan_strbuf_get_length(&buf), (double)elapsed / (double)iterations,
+           (double)bytes / (double)elapsed * 1e9 / (double)(1 << 20));
+#if defined(COUNT_ALLOCATIONS)
+    printf(", %6.2f allocations/op",
+           (double)(get_allocation_count() - start_allocations) /
+               (double)iterations);
+#endif
+    printf("\n");
+
+    if (print) {
+        fwrite(lwan_strbuf_get_buffer(&buf), 1, lwan_strbuf_get_length(&buf),
+               stdout);
+        putchar('\n');
+    }
+
+    lwan_strbuf_free(&buf);
+}
+
+static void usage(const char *argv0)
+{
+    printf("Usage: %s [-n iterations] [-p]\n", argv0);
+    printf("Encodes the JSON objects from the TechEmpower benchmarks, with "
+           "both the\ncallback-based and the compiled encoders, parses and "
+           "re-encodes a request\nbody, converts numbers to strings, and "
+           "grows string buffers, printing the\naverage time (and number of "
+           "allocations) per operation.\n"
+           "-p prints the output of the last operation of each kind.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    size_t iterations = 1000000;
+    bool print = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hn:p")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = (size_t)parse_long(optarg, 1000000);
+            break;
+        case 'p':
+            print = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    bench_warn_if_debug();
+
+    for (size_t i = 0; i < N_ELEMENTS(queries.queries); i++) {
+        queries.queries[i] = (struct db_json){
+            .id = (int)(i * 7919 % 10000) + 1,
+            .randomNumber = (int)(i * 104729 % 10000) + 1,
+        };
+    }
+
+    run("json (message)", encode_message, iterations, print);
+    run("json (escaped)", encode_escaped_message, iterations, print);
+    run("json (db)", encode_db, iterations, print);
+
+    queries.queries_len = 20;
+    run("json (20 queries)", encode_queries, LWAN_MAX(1u, iterations / 20),
+        print);
+    queries.queries_len = 500;
+    run("json (500 queries)", encode_queries, LWAN_MAX(1u, iterations / 500),
+        false);
+
+    run("compiled (message)", compiled_message, iterations, print);
+    run("compiled (escaped)", compiled_escaped_message, iterations, print);
+    run("compiled (db)", compiled_db, iterations, print);
+
+    queries.queries_len = 20;
+    run("compiled (20 q.)", compiled_queries, LWAN_MAX(1u, iterations / 20),
+        print);
+    queries.queries_len = 500;
+    run("compiled (500 q.)", compiled_queries, LWAN_MAX(1u, iterations / 500),
+        false);
+
+    run("parse+encode", parse_request, iterations, print);
+
+    run("int_to_string", format_int, iterations, print);
+    run("int (template)", format_int_template, iterations, print);
+    run("uint_to_string", format_uint, iterations, print);
+    run("double", format_double, iterations, print);
+    run("double (printf)", format_double_printf, iterations, print);
+
+    run("strbuf (64KiB)", strbuf_grow, LWAN_MAX(1u, iterations / 1000),
+        false);
+    run("strbuf (printf)", strbuf_printf, iterations, print);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,573 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* Measures how long it takes to apply the TechEmpower "fortunes" template,
+ * the same one used by the TechEmpower sample, with the fortunes coming
+ * from memory rather than from a database.  A second template, which is
+ * heavy on comments, conditionals, and plain variables, is also measured
+ * to exercise the rest of the template instruction set, followed by the
+ * default directory listing template from serve_files (with the files
+ * coming from memory rather than from a directory), and the JSON and XML
+ * templates from the freegeoip sample.  Finally, the routines used to find
+ * what needs escaping in HTML and JSON strings are measured on their
+ * own. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "lwan-config.h"
+#include "lwan-template.h"
+
+#include "alloc_count.h"
+#include "bench.h"
+
+struct fortune {
+    struct {
+        coro_function_t generator;
+
+        int id;
+        char *message;
+    } item;
+
+    size_t n_fortunes;
+};
+
+static const char *const fortune_messages[] = {
+    "fortune: No such file or directory",
+    "A computer scientist is someone who fixes things that aren't broken.",
+    "After enough decimal places, nobody gives a damn.",
+    "A bad random number generator: 1, 1, 1, 1, 1, 4.33e+67, 1, 1, 1",
+    "A computer program does what you tell it to do, not what you want it "
+    "to do.",
+    "Emacs is a nice operating system, but I prefer UNIX. — Tom Christaensen",
+    "Any program that runs right is obsolete.",
+    "A list is only as strong as its weakest link. — Donald Knuth",
+    "Feature: A bug with seniority.",
+    "Computers make very fast, very accurate mistakes.",
+    "<script>alert(\"This should not be displayed in a browser alert "
+    "box.\");</script>",
+    "フレームワークのベンチマーク",
+    "Additional fortune added at request time.",
+};
+
+static const char fortunes_template_str[] =
+    "<!DOCTYPE html>"
+    "<html>"
+    "<head><title>Fortunes</title></head>"
+    "<body>"
+    "<table>"
+    "<tr><th>id</th><th>message</th></tr>"
+    "{{#item}}"
+    "<tr><td>{{item.id}}</td><td>{{item.message}}</td></tr>"
+    "{{/item}}"
+    "</table>"
+    "</body>"
+    "</html>";
+
+static int fortune_list_generator(struct coro *coro, void *data)
+{
+    struct fortune *fortune = data;
+
+    for (size_t i = 0; i < fortune->n_fortunes; i++) {
+        fortune->item.id = (int)i + 1;
+        fortune->item.message =
+            (char *)fortune_messages[i % N_ELEMENTS(fortune_messages)];
+        coro_yield(coro, 1);
+    }
+
+    return 0;
+}
+
+#undef TPL_STRUCT
+#define TPL_STRUCT struct fortune
+static const struct lwan_var_descriptor fortune_desc[] = {
+    TPL_VAR_SEQUENCE(item,
+                     fortune_list_generator,
+                     ((const struct lwan_var_descriptor[]){
+                         TPL_VAR_INT(item.id),
+                         TPL_VAR_STR_ESCAPE(item.message),
+                         TPL_VAR_SENTINEL,
+                     })),
+    TPL_VAR_SENTINEL,
+};
+
+struct page {
+    char *title;
+    char *user;
+    char *motd;
+    int unread;
+    int visits;
+};
+
+static const char page_template_str[] =
+    "<!DOCTYPE html>\n"
+    "{{! Comments between two pieces of text shouldn't cost anything }}"
+    "<html>\n"
+    "<head><title>{{{title}}}</title></head>\n"
+    "{{! ...not even when there are a few in a row }}"
+    "{{! like this }}"
+    "<body>\n"
+    "{{user?}}<p>Hello, {{{user}}}!</p>{{/user?}}"
+    "{{^user?}}<p><a href=\"/login\">Log in</a></p>{{/user?}}\n"
+    "{{unread?}}<p>You have {{unread}} unread messages.</p>{{/unread?}}\n"
+    "{{motd?}}<p>{{motd}}</p>{{/motd?}}\n"
+    "<footer>This page has been visited {{visits}} times.</footer>\n"
+    "</body>\n"
+    "</html>\n";
+
+#undef TPL_STRUCT
+#define TPL_STRUCT struct page
+static const struct lwan_var_descriptor page_desc[] = {
+    TPL_VAR_STR(title),  TPL_VAR_STR(user),   TPL_VAR_STR(motd),
+    TPL_VAR_INT(unread), TPL_VAR_INT(visits), TPL_VAR_SENTINEL,
+};
+
+struct file_list {
+    const char *full_path;
+    const char *rel_path;
+    const char *readme;
+    struct {
+        coro_function_t generator;
+
+        const char *icon;
+        const char *icon_alt;
+        const char *name;
+        const char *type;
+
+        int size;
+        const char *unit;
+
+        const char *zebra_class;
+        const char *slash_if_dir;
+    } file_list;
+
+    size_t n_files;
+};
+
+/* Same as the default directory listing template in serve_files. */
+static const char directory_list_template_str[] =
+    "<html>\n"
+    "<head>\n"
+    "{{rel_path?}}  <title>Index of {{rel_path}}</title>{{/rel_path?}}\n"
+    "{{^rel_path?}}  <title>Index of /</title>{{/rel_path?}}\n"
+    "<style>\n"
+    "  body { background: #fff }\n"
+    "  tr.odd>td { background: #fff }\n"
+    "  tr.even>td { background: #eee }\n"
+    "</style>\n"
+    "</head>\n"
+    "<body>\n"
+    "{{rel_path?}}  <h1>Index of {{rel_path}}</h1>\n{{/rel_path?}}"
+    "{{^rel_path?}}  <h1>Index of /</h1>\n{{/rel_path?}}"
+    "{{readme?}}<pre>{{readme}}</pre>\n{{/readme?}}"
+    "  <table>\n"
+    "    <tr>\n"
+    "      <td><img src=\"?icon=back\"></td>\n"
+    "      <td colspan=\"3\"><a href=\"..\">Parent directory</a></td>\n"
+    "    </tr>\n"
+    "    <tr>\n"
+    "      <td>&nbsp;</td>\n"
+    "      <th>File name</th>\n"
+    "      <th>Type</th>\n"
+    "      <th>Size</th>\n"
+    "    </tr>\n"
+    "{{#file_list}}"
+    "    <tr class=\"{{file_list.zebra_class}}\">\n"
+    "      <td><img src=\"?icon={{file_list.icon}}\" "
+    "alt=\"{{file_list.icon_alt}}\"></td>\n"
+    "      <td><a href=\"{{{file_list.name}}}{{file_list.slash_if_dir}}\">{{{file_list.name}}}</a></td>\n"
+    "      <td>{{file_list.type}}</td>\n"
+    "      <td align=\"right\"><tt>{{file_list.size}}{{file_list.unit}}</tt></td>\n"
+    "    </tr>\n"
+    "{{/file_list}}"
+    "{{^#file_list}}"
+    "    <tr>\n"
+    "      <td colspan=\"4\">Empty directory.</td>\n"
+    "    </tr>\n"
+    "{{/file_list}}"
+    "  </table>\n"
+    "</body>\n"
+    "</html>\n";
+
+static int directory_list_generator(struct coro *coro, void *data)
+{
+    static const char *const names[] = {
+        "index.html", "style.css", "images", "README.md", "O'Reilly & Sons",
+        "lwan.tar.gz", "script.js", "docs",
+    };
+    static const char *const zebra_classes[] = {"odd", "even"};
+    struct file_list *fl = data;
+
+    for (size_t i = 0; i < fl->n_files; i++) {
+        const char *name = names[i % N_ELEMENTS(names)];
+
+        if (!strchr(name, '.')) {
+            fl->file_list.icon = "folder";
+            fl->file_list.icon_alt = "DIR";
+            fl->file_list.type = "directory";
+            fl->file_list.slash_if_dir = "/";
+        } else {
+            fl->file_list.icon = "file";
+            fl->file_list.icon_alt = "FILE";
+            fl->file_list.type = lwan_determine_mime_type_for_file_name(name);
+            fl->file_list.slash_if_dir = "";
+        }
+
+        fl->file_list.name = name;
+        fl->file_list.size = (int)(i * 37 % 1024);
+        fl->file_list.unit = i % 3 ? "KiB" : "B";
+        fl->file_list.zebra_class = zebra_classes[i % 2];
+
+        coro_yield(coro, 1);
+    }
+
+    return 0;
+}
+
+#undef TPL_STRUCT
+#define TPL_STRUCT struct file_list
+static const struct lwan_var_descriptor file_list_desc[] = {
+    TPL_VAR_STR_ESCAPE(full_path),
+    TPL_VAR_STR_ESCAPE(rel_path),
+    TPL_VAR_STR_ESCAPE(readme),
+    TPL_VAR_SEQUENCE(file_list,
+                     directory_list_generator,
+                     ((const struct lwan_var_descriptor[]){
+                         TPL_VAR_STR(file_list.icon),
+                         TPL_VAR_STR(file_list.icon_alt),
+                         TPL_VAR_STR(file_list.name),
+                         TPL_VAR_STR(file_list.type),
+                         TPL_VAR_INT(file_list.size),
+                         TPL_VAR_STR(file_list.unit),
+                         TPL_VAR_STR(file_list.zebra_class),
+                         TPL_VAR_STR(file_list.slash_if_dir),
+                         TPL_VAR_SENTINEL,
+                     })),
+    TPL_VAR_SENTINEL,
+};
+
+struct ip_info {
+    struct {
+        char *code;
+        char *name;
+    } country, region;
+    struct {
+        char *name;
+        char *zip_code;
+    } city;
+    double latitude, longitude;
+    struct {
+        char *code, *area;
+    } metro;
+    char *ip;
+    const char *callback;
+};
+
+/* Same as the JSON and XML templates in the freegeoip sample. */
+static const char ip_info_json_template_str[] =
+    "{{callback?}}{{callback}}({{/callback?}}"
+    "{"
+    "\"country_code\":\"{{country.code}}\","
+    "\"country_name\":\"{{country.name}}\","
+    "\"region_code\":\"{{region.code}}\","
+    "\"region_name\":\"{{region.name}}\","
+    "\"city\":\"{{city.name}}\","
+    "\"zipcode\":\"{{city.zip_code}}\","
+    "\"latitude\":{{latitude}},"
+    "\"longitude\":{{longitude}},"
+    "\"metro_code\":\"{{metro.code}}\","
+    "\"areacode\":\"{{metro.area}}\","
+    "\"ip\":\"{{ip}}\""
+    "}"
+    "{{callback?}});{{/callback?}}";
+
+static const char ip_info_xml_template_str[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+    "<Response>"
+    "<Ip>{{ip}}</Ip>"
+    "<CountryCode>{{country.code}}</CountryCode>"
+    "<CountryName>{{country.name}}</CountryName>"
+    "<RegionCode>{{region.code}}</RegionCode>"
+    "<RegionName>{{region.name}}</RegionName>"
+    "<City>{{city.name}}</City>"
+    "<ZipCode>{{city.zip_code}}</ZipCode>"
+    "<Latitude>{{latitude}}</Latitude>"
+    "<Longitude>{{longitude}}</Longitude>"
+    "<MetroCode>{{metro.code}}</MetroCode>"
+    "<AreaCode>{{metro.area}}</AreaCode>"
+    "</Response>";
+
+#undef TPL_STRUCT
+#define TPL_STRUCT struct ip_info
+static const struct lwan_var_descriptor ip_info_desc[] = {
+    TPL_VAR_STR(country.code), TPL_VAR_STR(country.name),
+    TPL_VAR_STR(region.code),  TPL_VAR_STR(region.name),
+    TPL_VAR_STR(city.name),    TPL_VAR_STR(city.zip_code),
+    TPL_VAR_DOUBLE(latitude),  TPL_VAR_DOUBLE(longitude),
+    TPL_VAR_STR(metro.code),   TPL_VAR_STR(metro.area),
+    TPL_VAR_STR(ip),           TPL_VAR_STR(callback),
+    TPL_VAR_SENTINEL,
+};
+
+static struct ip_info ip_info = {
+    .country = {.code = "BR", .name = "Brazil"},
+    .region = {.code = "SP", .name = "Sao Paulo"},
+    .city = {.name = "Campinas", .zip_code = "13083"},
+    .latitude = -22.8167,
+    .longitude = -47.0667,
+    .metro = {.code = "", .area = ""},
+    .ip = "200.133.0.1",
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void run(const char *name,
+                struct lwan_tpl *tpl,
+                void *variables,
+                size_t iterations,
+                bool print)
+{
+    struct lwan_strbuf buf;
+    size_t bytes = 0;
+    uint64_t start;
+#if defined(COUNT_ALLOCATIONS)
+    uint64_t start_allocations;
+#endif
+
+    lwan_strbuf_init(&buf);
+
+#if defined(COUNT_ALLOCATIONS)
+    start_allocations = get_allocation_count();
+#endif
+    start = now_ns();
+    for (size_t i = 0; i < iterations; i++) {
+        /* Response buffers are trimmed like this between requests. */
+        lwan_strbuf_reset_trim(&buf, 2048);
+
+        if (!lwan_tpl_apply_with_buffer(tpl, &buf, variables))
+            lwan_status_critical("Could not apply %s template", name);
+        bytes += lwan_strbuf_get_length(&buf);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    printf("%-16s %8zu bytes: %8.1f ns/apply, %8.2f MiB/s", name,
+           lwan_strbuf_get_length(&buf), (double)elapsed / (double)iterations,
+           (double)bytes / (double)elapsed * 1e9 / (double)(1 << 20));
+#if defined(COUNT_ALLOCATIONS)
+    printf(", %6.2f allocations/apply",
+           (double)(get_allocation_count() - start_allocations) /
+               (double)iterations);
+#endif
+    printf("\n");
+
+    if (print) {
+        fwrite(lwan_strbuf_get_buffer(&buf), 1, lwan_strbuf_get_length(&buf),
+               stdout);
+        putchar('\n');
+    }
+
+    lwan_strbuf_free(&buf);
+}
+
+/* Scans a string that only occasionally needs escaping, like most strings
+ * that end up in templates and JSON responses, with each escaping routine
+ * the CPU supports. */
+static void run_escape(size_t iterations)
+{
+    static const size_t lengths[] = {16, 64, 4096};
+    struct lwan_escape_kernel kernels[3];
+    size_t n_kernels = lwan_get_escape_kernels(kernels);
+    char str[4096];
+
+    for (size_t i = 0; i < sizeof(str); i++)
+        str[i] = (char)('a' + i % 26);
+    for (size_t i = 200; i < sizeof(str); i += 400)
+        str[i] = (i / 400) % 2 ? '&' : '\n';
+
+    for (size_t k = 0; k < n_kernels; k++) {
+        for (size_t l = 0; l < N_ELEMENTS(lengths); l++) {
+            size_t len = lengths[l];
+            size_t n = LWAN_MAX(1u, iterations * lengths[0] / len);
+            size_t spans = 0;
+            uint64_t start;
+            char name[32];
+
+            for (size_t i = 0; i < len; i++) {
+                if (kernels[k].html_span(str + i, len - i) !=
+                        kernels[n_kernels - 1].html_span(str + i, len - i) ||
+                    kernels[k].json_span(str + i, len - i) !=
+                        kernels[n_kernels - 1].json_span(str + i, len - i) ||
+                    kernels[k].ws_span(str + i, len - i) !=
+                        kernels[n_kernels - 1].ws_span(str + i, len - i)) {
+                    lwan_status_critical("%s escape routine disagrees with "
+                                         "scalar at offset %zu",
+                                         kernels[k].name, i);
+                }
+            }
+
+            start = now_ns();
+            for (size_t i = 0; i < n; i++) {
+                for (size_t pos = 0; pos < len;) {
+                    pos += kernels[k].html_span(str + pos, len - pos) + 1;
+                    spans++;
+                }
+                for (size_t pos = 0; pos < len;) {
+                    pos += kernels[k].json_span(str + pos, len - pos) + 1;
+                    spans++;
+                }
+                __asm__ __volatile__("" : : "r"(spans) : "memory");
+            }
+            uint64_t elapsed = now_ns() - start;
+
+            snprintf(name, sizeof(name), "escape %s", kernels[k].name);
+            printf("%-16s %8zu bytes: %8.1f ns/scan,  %8.2f MiB/s\n", name, len,
+                   (double)elapsed / (double)(n * 2),
+                   (double)(len * n * 2) / (double)elapsed * 1e9 /
+                       (double)(1 << 20));
+        }
+    }
+}
+
+static void usage(const char *argv0)
+{
+    printf("Usage: %s [-n iterations] [-p]\n", argv0);
+    printf("Applies the TechEmpower fortunes template, a template using "
+           "every other\ntemplate feature, the serve_files directory listing "
+           "template, and the\nfreegeoip JSON and XML templates, printing the "
+           "average time (and number\nof allocations) per application, "
+           "followed by the throughput of each HTML\nand JSON escaping "
+           "routine.\n-p prints the output of each template once.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t n_fortunes[] = {13, 100, 1000};
+    static const size_t n_files[] = {0, 10, 1000};
+    size_t iterations = 1000000;
+    bool print = false;
+    struct lwan_tpl *tpl;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hn:p")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = (size_t)parse_long(optarg, 1000000);
+            break;
+        case 'p':
+            print = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    bench_warn_if_debug();
+
+    tpl = lwan_tpl_compile_string_full(fortunes_template_str, fortune_desc,
+                                       LWAN_TPL_FLAG_CONST_TEMPLATE);
+    if (!tpl)
+        lwan_status_critical("Could not compile fortunes template");
+
+    for (size_t i = 0; i < N_ELEMENTS(n_fortunes); i++) {
+        struct fortune fortune = {.n_fortunes = n_fortunes[i]};
+        char name[32];
+
+        snprintf(name, sizeof(name), "fortunes (%zu)", n_fortunes[i]);
+        run(name, tpl, &fortune,
+            LWAN_MAX(1u, iterations * n_fortunes[0] / n_fortunes[i]),
+            print && i == 0);
+    }
+
+    lwan_tpl_free(tpl);
+
+    tpl = lwan_tpl_compile_string_full(page_template_str, page_desc,
+                                       LWAN_TPL_FLAG_CONST_TEMPLATE);
+    if (!tpl)
+        lwan_status_critical("Could not compile page template");
+
+    run("page (user)", tpl,
+        &(struct page){.title = "Home & <Away>",
+                       .user = "Bobby \"Tables\"",
+                       .motd = "Have a nice day",
+                       .unread = 42,
+                       .visits = 123456},
+        iterations, print);
+    run("page (guest)", tpl,
+        &(struct page){.title = "Home & <Away>", .visits = 654321}, iterations,
+        print);
+
+    lwan_tpl_free(tpl);
+
+    tpl = lwan_tpl_compile_string_full(directory_list_template_str,
+                                       file_list_desc,
+                                       LWAN_TPL_FLAG_CONST_TEMPLATE);
+    if (!tpl)
+        lwan_status_critical("Could not compile directory listing template");
+
+    for (size_t i = 0; i < N_ELEMENTS(n_files); i++) {
+        struct file_list fl = {
+            .full_path = "/srv/www/pub",
+            .rel_path = "/pub",
+            .n_files = n_files[i],
+        };
+        char name[32];
+
+        snprintf(name, sizeof(name), "dirlist (%zu)", n_files[i]);
+        run(name, tpl, &fl,
+            LWAN_MAX(1u, iterations * n_fortunes[0] /
+                             LWAN_MAX(n_fortunes[0], n_files[i])),
+            print && i == 1);
+    }
+
+    lwan_tpl_free(tpl);
+
+    tpl = lwan_tpl_compile_string_full(ip_info_json_template_str, ip_info_desc,
+                                       LWAN_TPL_FLAG_CONST_TEMPLATE);
+    if (!tpl)
+        lwan_status_critical("Could not compile freegeoip JSON template");
+    run("freegeoip (json)", tpl, &ip_info, iterations, print);
+    lwan_tpl_free(tpl);
+
+    tpl = lwan_tpl_compile_string_full(ip_info_xml_template_str, ip_info_desc,
+                                       LWAN_TPL_FLAG_CONST_TEMPLATE);
+    if (!tpl)
+        lwan_status_critical("Could not compile freegeoip XML template");
+    run("freegeoip (xml)", tpl, &ip_info, iterations, print);
+    lwan_tpl_free(tpl);
+
+    if (!print)
+        run_escape(iterations);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,198 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* Measures the throughput of every websocket unmasking routine the CPU
+ * supports (the first one listed is the one in use), and of UTF-8
+ * validation of text messages, for payloads of a few different sizes.
+ * Unmasking routines are checked against the scalar one before being
+ * measured. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "lwan-config.h"
+
+#include "bench.h"
+
+/* Roughly how many bytes are processed for each measurement. */
+#define BYTES_PER_RUN (1ull << 30)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void fill_random(char *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)rand();
+}
+
+static void check_kernel(const struct lwan_websocket_unmask_kernel *kernel,
+                         const struct lwan_websocket_unmask_kernel *scalar)
+{
+    char expected[300], got[300];
+    const char mask[4] = {0x12, 0x34, 0x56, 0x78};
+
+    /* Every length up to a few vectors, so that all the remainder paths
+     * are exercised. */
+    for (size_t len = 0; len < sizeof(expected); len++) {
+        fill_random(expected, len);
+        memcpy(got, expected, len);
+
+        scalar->unmask(expected, len, mask);
+        kernel->unmask(got, len, mask);
+
+        if (memcmp(expected, got, len)) {
+            lwan_status_critical("%s unmasks %zu bytes incorrectly",
+                                 kernel->name, len);
+        }
+    }
+}
+
+static void report(const char *what, size_t size, uint64_t elapsed, size_t total)
+{
+    printf("%-14s %8zu bytes: %8.2f GiB/s\n", what, size,
+           (double)total / (double)elapsed * 1e9 / (double)(1ull << 30));
+}
+
+static size_t iterations_for(size_t size, unsigned int iterations)
+{
+    return iterations ? iterations
+                      : (size_t)LWAN_MAX(1ull, BYTES_PER_RUN / size);
+}
+
+static void run_unmask(const struct lwan_websocket_unmask_kernel *kernel,
+                       char *buf,
+                       size_t size,
+                       unsigned int iterations)
+{
+    const char mask[4] = {0x12, 0x34, 0x56, 0x78};
+    const size_t n_iter = iterations_for(size, iterations);
+    uint64_t start = now_ns();
+
+    for (size_t i = 0; i < n_iter; i++) {
+        kernel->unmask(buf, size, mask);
+        __asm__ __volatile__("" : : "r"(buf) : "memory");
+    }
+
+    report(kernel->name, size, now_ns() - start, n_iter * size);
+}
+
+static void run_utf8(const char *name,
+                     const char *buf,
+                     size_t size,
+                     unsigned int iterations)
+{
+    const size_t n_iter = iterations_for(size, iterations);
+    uint64_t start = now_ns();
+    size_t valid = 0;
+
+    for (size_t i = 0; i < n_iter; i++) {
+        valid += lwan_websocket_validate_utf8(LWAN_UTF8_ACCEPT, buf, size) ==
+                 LWAN_UTF8_ACCEPT;
+        __asm__ __volatile__("" : : "r"(buf) : "memory");
+    }
+
+    if (valid != n_iter)
+        lwan_status_critical("%s text of %zu bytes isn't valid UTF-8", name, size);
+
+    report(name, size, now_ns() - start, n_iter * size);
+}
+
+static void fill_text(char *buf, size_t size, bool ascii_only)
+{
+    static const char ascii[] = "The quick brown fox jumps over the lazy dog. ";
+    static const char mixed[] = "Olá, mundo! Привет, мир! 你好，世界！ 👋 ";
+    const char *text = ascii_only ? ascii : mixed;
+    const size_t text_len = ascii_only ? sizeof(ascii) - 1 : sizeof(mixed) - 1;
+    size_t i = 0;
+
+    while (i + text_len <= size) {
+        memcpy(buf + i, text, text_len);
+        i += text_len;
+    }
+    /* Pad with ASCII so that no sequence is cut in half. */
+    memset(buf + i, ' ', size - i);
+}
+
+static void usage(const char *argv0)
+{
+    printf("Usage: %s [-n iterations]\n", argv0);
+    printf("Unmasks websocket payloads with every routine supported by this "
+           "CPU, and\nvalidates UTF-8 text, printing the throughput for "
+           "various payload sizes.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t sizes[] = {16, 125, 1024, 16384, 1 << 20, 16 << 20};
+    struct lwan_websocket_unmask_kernel kernels[4];
+    unsigned int iterations = 0;
+    size_t n_kernels;
+    char *buf;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hn:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = (unsigned int)parse_long(optarg, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    bench_warn_if_debug();
+
+    buf = malloc(sizes[N_ELEMENTS(sizes) - 1]);
+    if (!buf)
+        lwan_status_critical("Could not allocate buffer");
+
+    n_kernels = lwan_websocket_get_unmask_kernels(kernels);
+    for (size_t k = 0; k < n_kernels; k++)
+        check_kernel(&kernels[k], &kernels[n_kernels - 1]);
+
+    for (size_t i = 0; i < N_ELEMENTS(sizes); i++) {
+        fill_random(buf, sizes[i]);
+        for (size_t k = 0; k < n_kernels; k++)
+            run_unmask(&kernels[k], buf, sizes[i], iterations);
+
+        fill_text(buf, sizes[i], true);
+        run_utf8("utf8 (ascii)", buf, sizes[i], iterations);
+        fill_text(buf, sizes[i], false);
+        run_utf8("utf8 (mixed)", buf, sizes[i], iterations);
+    }
+
+    free(buf);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1189 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* HTTP (and WebSockets) load generator.  Each connection is handled by a
+ * coroutine, just like in the server: it writes requests and reads
+ * responses as if it were blocking, and yields back to the event loop of
+ * its thread whenever the socket isn't ready.  Scenarios can be given in
+ * the command line or read from files in the same format as the server
+ * configuration file; see the scenarios directory next to this file. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "lwan-config.h"
+#include "lwan-coro.h"
+
+enum {
+    BENCH_WAIT = 0,
+    BENCH_DONE = 1,
+};
+
+struct scenario {
+    char *name;
+    char *url;
+    char *path;
+    unsigned int connections;
+    unsigned int threads;
+    unsigned int pipeline;
+    unsigned int duration;
+    unsigned int message_size;
+    bool keep_alive;
+};
+
+/* Latencies, in microseconds, are kept in a log-linear histogram: values
+ * below 16us have a bucket each, and every power of 2 above that is split
+ * in 16 buckets, so percentiles are good to ~6%. */
+#define SUB_BUCKETS 16
+#define SUB_BUCKET_BITS 4
+#define N_BUCKETS (SUB_BUCKETS * 40)
+
+struct stats {
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t connects;
+    uint64_t bytes;
+    uint64_t status[6]; /* 0 for WebSockets messages, then 1xx to 5xx */
+    uint64_t latency_sum;
+    uint64_t latency_max;
+    uint64_t latency[N_BUCKETS];
+};
+
+struct target {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char *host;
+    char *path;
+    bool websocket;
+
+    /* Requests sent at once, or WebSockets frame sent for each message */
+    char *request;
+    size_t request_len;
+    /* WebSockets handshake */
+    char *handshake;
+    size_t handshake_len;
+};
+
+struct bench_thread {
+    const struct scenario *scenario;
+    const struct target *target;
+    unsigned int n_conns;
+    int epoll_fd;
+    pthread_t self;
+    struct stats stats;
+};
+
+struct bench_conn {
+    struct bench_thread *thread;
+    struct coro *coro;
+    int fd;
+    size_t len, off;
+    char buffer[16384];
+};
+
+static volatile bool stop;
+static bool json_output;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static unsigned int bucket_index(uint64_t value)
+{
+    if (value < SUB_BUCKETS)
+        return (unsigned int)value;
+
+    const unsigned int e = 63u - (unsigned int)__builtin_clzll(value);
+    const unsigned int index =
+        (e - SUB_BUCKET_BITS + 1) * SUB_BUCKETS +
+        (unsigned int)((value >> (e - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+
+    return LWAN_MIN(index, N_BUCKETS - 1u);
+}
+
+static uint64_t bucket_lower_bound(unsigned int bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+
+    const unsigned int e = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS)
+           << (e - SUB_BUCKET_BITS);
+}
+
+static void record_latency(struct stats *stats, uint64_t start_ns)
+{
+    const uint64_t us = (now_ns() - start_ns) / 1000;
+
+    stats->requests++;
+    stats->latency[bucket_index(us)]++;
+    stats->latency_sum += us;
+    if (us > stats->latency_max)
+        stats->latency_max = us;
+}
+
+static bool conn_wait(struct bench_conn *conn)
+{
+    coro_yield(conn->coro, BENCH_WAIT);
+    return !stop;
+}
+
+static bool conn_connect(struct bench_conn *conn)
+{
+    const struct target *target = conn->thread->target;
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.ptr = conn,
+    };
+    int one = 1;
+
+    conn->fd = socket(target->addr.ss_family,
+                      SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0)
+        return false;
+
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (epoll_ctl(conn->thread->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) < 0)
+        return false;
+
+    /* Calling connect() again tells if a connection in progress is done */
+    while (connect(conn->fd, (const struct sockaddr *)&target->addr,
+                   target->addr_len) < 0) {
+        if (errno == EISCONN)
+            break;
+        if (errno != EINPROGRESS && errno != EALREADY && errno != EINTR)
+            return false;
+        if (!conn_wait(conn))
+            return false;
+    }
+
+    conn->len = conn->off = 0;
+    conn->thread->stats.connects++;
+
+    return true;
+}
+
+static void conn_close(struct bench_conn *conn)
+{
+    if (conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+static bool conn_write(struct bench_conn *conn, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t written = send(conn->fd, buf, len, MSG_NOSIGNAL);
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN || !conn_wait(conn))
+                return false;
+            continue;
+        }
+
+        buf += written;
+        len -= (size_t)written;
+    }
+
+    return true;
+}
+
+/* Reads whatever is available into the buffer, waiting for at least one
+ * byte.  Returns false on errors or if the connection has been closed. */
+static bool conn_fill(struct bench_conn *conn)
+{
+    if (conn->off == conn->len) {
+        conn->off = conn->len = 0;
+    } else if (conn->off) {
+        memmove(conn->buffer, conn->buffer + conn->off, conn->len - conn->off);
+        conn->len -= conn->off;
+        conn->off = 0;
+    }
+
+    if (conn->len == sizeof(conn->buffer))
+        return false;
+
+    while (true) {
+        ssize_t r = recv(conn->fd, conn->buffer + conn->len,
+                         sizeof(conn->buffer) - conn->len, 0);
+
+        if (r > 0) {
+            conn->len += (size_t)r;
+            conn->thread->stats.bytes += (uint64_t)r;
+            return true;
+        }
+        if (r == 0)
+            return false;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN || !conn_wait(conn))
+            return false;
+    }
+}
+
+static bool conn_skip(struct bench_conn *conn, uint64_t n)
+{
+    while (true) {
+        const size_t available = LWAN_MIN(conn->len - conn->off, n);
+
+        conn->off += available;
+        n -= available;
+        if (!n)
+            return true;
+
+        if (!conn_fill(conn))
+            return false;
+    }
+}
+
+/* Returns a pointer to the end of a line (or of the headers, if `delim`
+ * is "\r\n\r\n"), starting at the current offset, reading more if
+ * necessary. */
+static char *conn_find(struct bench_conn *conn, const char *delim)
+{
+    while (true) {
+        char *end = memmem(conn->buffer + conn->off, conn->len - conn->off,
+                           delim, strlen(delim));
+
+        if (end)
+            return end;
+        if (!conn_fill(conn))
+            return NULL;
+    }
+}
+
+static const char *find_header(const char *headers,
+                               const char *end,
+                               const char *name)
+{
+    const size_t name_len = strlen(name);
+
+    for (const char *p = headers; p && p < end; p = memchr(p, '\n', (size_t)(end - p))) {
+        if (*p == '\n')
+            p++;
+        if ((size_t)(end - p) > name_len &&
+            !strncasecmp(p, name, name_len) && p[name_len] == ':') {
+            p += name_len + 1;
+            while (*p == ' ')
+                p++;
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+static bool read_chunked_body(struct bench_conn *conn)
+{
+    while (true) {
+        char *end = conn_find(conn, "\r\n");
+        unsigned long long size;
+
+        if (!end)
+            return false;
+
+        size = strtoull(conn->buffer + conn->off, NULL, 16);
+        conn->off = (size_t)(end - conn->buffer) + 2;
+
+        if (!size)
+            break;
+        if (!conn_skip(conn, size + 2))
+            return false;
+    }
+
+    /* Trailers, if any, up to an empty line */
+    while (true) {
+        char *end = conn_find(conn, "\r\n");
+
+        if (!end)
+            return false;
+        if (end == conn->buffer + conn->off) {
+            conn->off += 2;
+            return true;
+        }
+        conn->off = (size_t)(end - conn->buffer) + 2;
+    }
+}
+
+/* Reads a response, returning its status code, or 0 on errors.  If the
+ * body is delimited by the connection being closed, *closed is set. */
+static int read_response(struct bench_conn *conn, bool *closed)
+{
+    char *headers_end = conn_find(conn, "\r\n\r\n");
+    const char *headers, *value;
+    int status;
+
+    if (!headers_end)
+        return 0;
+
+    headers = conn->buffer + conn->off;
+    if (strncmp(headers, "HTTP/1.", 7))
+        return 0;
+    status = atoi(headers + 9);
+    if (status < 100 || status > 599)
+        return 0;
+
+    *closed = false;
+
+    value = find_header(headers, headers_end, "Transfer-Encoding");
+    if (value && !strncasecmp(value, "chunked", 7)) {
+        conn->off = (size_t)(headers_end - conn->buffer) + 4;
+        return read_chunked_body(conn) ? status : 0;
+    }
+
+    value = find_header(headers, headers_end, "Content-Length");
+    conn->off = (size_t)(headers_end - conn->buffer) + 4;
+    if (value)
+        return conn_skip(conn, strtoull(value, NULL, 10)) ? status : 0;
+
+    if (status < 200 || status == 204 || status == 304)
+        return status;
+
+    /* Read until the server closes the connection */
+    while (conn_fill(conn))
+        conn->off = conn->len;
+    *closed = true;
+
+    return stop ? 0 : status;
+}
+
+static bool run_http(struct bench_conn *conn)
+{
+    const struct target *target = conn->thread->target;
+    const struct scenario *scenario = conn->thread->scenario;
+    struct stats *stats = &conn->thread->stats;
+
+    while (!stop) {
+        const uint64_t start = now_ns();
+
+        if (!conn_write(conn, target->request, target->request_len))
+            return false;
+
+        for (unsigned int i = 0; i < scenario->pipeline; i++) {
+            bool closed;
+            int status = read_response(conn, &closed);
+
+            if (!status)
+                return false;
+
+            record_latency(stats, start);
+            stats->status[status / 100]++;
+
+            if (closed || !scenario->keep_alive)
+                return true;
+        }
+    }
+
+    return true;
+}
+
+static bool websocket_handshake(struct bench_conn *conn)
+{
+    const struct target *target = conn->thread->target;
+    bool closed;
+
+    if (!conn_write(conn, target->handshake, target->handshake_len))
+        return false;
+
+    /* Response to the upgrade request has no body */
+    return read_response(conn, &closed) == 101;
+}
+
+static bool read_websocket_frame(struct bench_conn *conn, bool *fin)
+{
+    unsigned char *header;
+    uint64_t len;
+    size_t header_len = 2;
+
+    while (conn->len - conn->off < 2) {
+        if (!conn_fill(conn))
+            return false;
+    }
+
+    header = (unsigned char *)conn->buffer + conn->off;
+    len = header[1] & 0x7f;
+    if (len == 126)
+        header_len += 2;
+    else if (len == 127)
+        header_len += 8;
+
+    while (conn->len - conn->off < header_len) {
+        if (!conn_fill(conn))
+            return false;
+        header = (unsigned char *)conn->buffer + conn->off;
+    }
+
+    if (len >= 126) {
+        len = 0;
+        for (size_t i = 2; i < header_len; i++)
+            len = len << 8 | header[i];
+    }
+
+    /* Close frames end the benchmark for this connection */
+    if ((header[0] & 0x0f) == 0x08)
+        return false;
+
+    *fin = header[0] & 0x80;
+    conn->off += header_len;
+
+    return conn_skip(conn, len);
+}
+
+static bool run_websocket(struct bench_conn *conn)
+{
+    const struct target *target = conn->thread->target;
+    struct stats *stats = &conn->thread->stats;
+
+    if (!websocket_handshake(conn))
+        return false;
+
+    while (!stop) {
+        const uint64_t start = now_ns();
+        bool fin = false;
+
+        if (!conn_write(conn, target->request, target->request_len))
+            return false;
+
+        while (!fin) {
+            if (!read_websocket_frame(conn, &fin))
+                return false;
+        }
+
+        record_latency(stats, start);
+        stats->status[0]++;
+    }
+
+    return true;
+}
+
+static int conn_coro(struct coro *coro __attribute__((unused)), void *data)
+{
+    struct bench_conn *conn = data;
+    struct bench_thread *thread = conn->thread;
+
+    while (!stop) {
+        bool ok;
+
+        if (!conn_connect(conn)) {
+            conn_close(conn);
+            if (!stop)
+                thread->stats.errors++;
+            /* Don't spin if the server isn't accepting connections */
+            return BENCH_DONE;
+        }
+
+        if (thread->target->websocket)
+            ok = run_websocket(conn);
+        else
+            ok = run_http(conn);
+
+        conn_close(conn);
+
+        if (!ok && !stop)
+            thread->stats.errors++;
+    }
+
+    return BENCH_DONE;
+}
+
+static void *thread_loop(void *data)
+{
+    struct bench_thread *thread = data;
+    struct coro_switcher switcher;
+    struct bench_conn *conns;
+    struct epoll_event events[256];
+    unsigned int n_active = thread->n_conns;
+
+    lwan_set_thread_name("bench");
+
+    conns = calloc(thread->n_conns, sizeof(*conns));
+    if (!conns)
+        lwan_status_critical("Could not allocate memory for connections");
+
+    for (unsigned int i = 0; i < thread->n_conns; i++) {
+        struct bench_conn *conn = &conns[i];
+
+        conn->thread = thread;
+        conn->fd = -1;
+        conn->coro = coro_new(&switcher, conn_coro, conn);
+        if (!conn->coro)
+            lwan_status_critical("Could not create coroutine");
+
+        if (coro_resume(conn->coro) == BENCH_DONE)
+            n_active--;
+    }
+
+    while (!stop && n_active) {
+        int n = epoll_wait(thread->epoll_fd, events, (int)N_ELEMENTS(events),
+                           100);
+
+        for (int i = 0; i < n; i++) {
+            struct bench_conn *conn = events[i].data.ptr;
+
+            /* Events for sockets closed in this same batch */
+            if (conn->fd < 0)
+                continue;
+
+            if (coro_resume(conn->coro) == BENCH_DONE)
+                n_active--;
+        }
+    }
+
+    /* Coroutines aren't resumed anymore once stop is set, so connections
+     * are closed here. */
+    for (unsigned int i = 0; i < thread->n_conns; i++) {
+        conn_close(&conns[i]);
+        coro_free(conns[i].coro);
+    }
+    free(conns);
+
+    return NULL;
+}
+
+static bool parse_url(const char *url, struct target *target)
+{
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+    struct addrinfo *res;
+    const char *host_start, *path;
+    char *host, *port;
+    int r;
+
+    if (!strncmp(url, "http://", 7)) {
+        host_start = url + 7;
+        target->websocket = false;
+    } else if (!strncmp(url, "ws://", 5)) {
+        host_start = url + 5;
+        target->websocket = true;
+    } else {
+        lwan_status_error("Only http:// and ws:// URLs are supported: %s", url);
+        return false;
+    }
+
+    path = strchr(host_start, '/');
+    host = path ? strndup(host_start, (size_t)(path - host_start))
+                : strdup(host_start);
+    if (!host)
+        return false;
+    target->host = host;
+    target->path = strdup(path ? path : "/");
+    if (!target->path)
+        return false;
+
+    host = strdupa(host);
+    if (host[0] == '[') {
+        char *end = strchr(host, ']');
+
+        if (!end)
+            return false;
+        *end = '\0';
+        port = end[1] == ':' ? end + 2 : "80";
+        host++;
+    } else {
+        port = strrchr(host, ':');
+        if (port)
+            *port++ = '\0';
+        else
+            port = "80";
+    }
+
+    r = getaddrinfo(host, port, &hints, &res);
+    if (r) {
+        lwan_status_error("Could not resolve %s: %s", target->host,
+                          gai_strerror(r));
+        return false;
+    }
+
+    memcpy(&target->addr, res->ai_addr, res->ai_addrlen);
+    target->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    return true;
+}
+
+static bool build_requests(const struct scenario *scenario,
+                           struct target *target)
+{
+    if (target->websocket) {
+        /* Server replies are unmasked, but client frames have to be masked;
+         * the payload is all zeros, so it ends up being the mask itself. */
+        static const unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+        const size_t size = scenario->message_size;
+        unsigned char *frame = malloc(14 + size);
+        size_t len = 0;
+
+        if (!frame)
+            return false;
+
+        frame[len++] = 0x82; /* FIN, binary */
+        if (size < 126) {
+            frame[len++] = 0x80 | (unsigned char)size;
+        } else if (size < 65536) {
+            frame[len++] = 0x80 | 126;
+            frame[len++] = (unsigned char)(size >> 8);
+            frame[len++] = (unsigned char)size;
+        } else {
+            frame[len++] = 0x80 | 127;
+            for (int shift = 56; shift >= 0; shift -= 8)
+                frame[len++] = (unsigned char)((uint64_t)size >> shift);
+        }
+        memcpy(frame + len, mask, sizeof(mask));
+        len += sizeof(mask);
+        for (size_t i = 0; i < size; i++)
+            frame[len++] = mask[i % 4];
+
+        target->request = (char *)frame;
+        target->request_len = len;
+
+        if (asprintf(&target->handshake,
+                     "GET %s HTTP/1.1\r\n"
+                     "Host: %s\r\n"
+                     "Upgrade: websocket\r\n"
+                     "Connection: Upgrade\r\n"
+                     "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                     "Sec-WebSocket-Version: 13\r\n"
+                     "\r\n",
+                     target->path, target->host) < 0)
+            return false;
+
+        target->handshake_len = strlen(target->handshake);
+        return true;
+    }
+
+    char *request;
+    int len = asprintf(&request,
+                       "GET %s HTTP/1.1\r\n"
+                       "Host: %s\r\n"
+                       "%s"
+                       "\r\n",
+                       target->path, target->host,
+                       scenario->keep_alive ? "" : "Connection: close\r\n");
+    if (len < 0)
+        return false;
+
+    /* Pipelined requests are all sent with a single system call */
+    target->request_len = (size_t)len * scenario->pipeline;
+    target->request = malloc(target->request_len);
+    if (target->request) {
+        for (unsigned int i = 0; i < scenario->pipeline; i++)
+            memcpy(target->request + (size_t)len * i, request, (size_t)len);
+    }
+    free(request);
+
+    return target->request != NULL;
+}
+
+static uint64_t percentile(const struct stats *stats, double p)
+{
+    const uint64_t wanted = (uint64_t)((double)stats->requests * p);
+    uint64_t count = 0;
+
+    for (unsigned int i = 0; i < N_BUCKETS; i++) {
+        count += stats->latency[i];
+        if (count > wanted)
+            return i + 1 < N_BUCKETS ? bucket_lower_bound(i + 1) - 1
+                                     : stats->latency_max;
+    }
+
+    return stats->latency_max;
+}
+
+static void report_json(const struct scenario *scenario,
+                        const struct target *target,
+                        const struct stats *stats,
+                        double elapsed)
+{
+    /* One object per line, so scripts can parse each scenario as soon as
+     * it finishes.  Names and paths come from scenario files and aren't
+     * escaped. */
+    printf("{\"scenario\":\"%s\",\"host\":\"%s\",\"path\":\"%s\","
+           "\"websocket\":%s,\"connections\":%u,\"threads\":%u,"
+           "\"pipeline\":%u,\"keep_alive\":%s,\"message_size\":%u,"
+           "\"duration\":%.3f,\"requests\":%" PRIu64
+           ",\"requests_per_sec\":%.1f,\"bytes\":%" PRIu64
+           ",\"connects\":%" PRIu64 ",\"errors\":%" PRIu64
+           ",\"status\":{\"1xx\":%" PRIu64 ",\"2xx\":%" PRIu64
+           ",\"3xx\":%" PRIu64 ",\"4xx\":%" PRIu64 ",\"5xx\":%" PRIu64 "},",
+           scenario->name, target->host, target->path,
+           target->websocket ? "true" : "false", scenario->connections,
+           scenario->threads, scenario->pipeline,
+           scenario->keep_alive ? "true" : "false", scenario->message_size,
+           elapsed, stats->requests, (double)stats->requests / elapsed,
+           stats->bytes, stats->connects, stats->errors, stats->status[1],
+           stats->status[2], stats->status[3], stats->status[4],
+           stats->status[5]);
+    if (stats->requests) {
+        printf("\"latency_us\":{\"mean\":%" PRIu64 ",\"p50\":%" PRIu64
+               ",\"p90\":%" PRIu64 ",\"p99\":%" PRIu64
+               ",\"p99.9\":%" PRIu64 ",\"max\":%" PRIu64 "}}\n",
+               stats->latency_sum / stats->requests, percentile(stats, 0.5),
+               percentile(stats, 0.9), percentile(stats, 0.99),
+               percentile(stats, 0.999), stats->latency_max);
+    } else {
+        printf("\"latency_us\":null}\n");
+    }
+    fflush(stdout);
+}
+
+static void report(const struct scenario *scenario,
+                   const struct target *target,
+                   const struct stats *stats,
+                   double elapsed)
+{
+    printf("%s: %s%s, %u connections, %u threads, ", scenario->name,
+           target->websocket ? "ws://" : "http://", target->host,
+           scenario->connections, scenario->threads);
+    if (target->websocket) {
+        printf("%u byte messages\n", scenario->message_size);
+    } else {
+        printf("pipeline %u, %s\n", scenario->pipeline,
+               scenario->keep_alive ? "keep-alive" : "close");
+    }
+    printf("  path        %s\n", target->path);
+    printf("  requests    %" PRIu64 " in %.2fs, %.1f/s\n", stats->requests,
+           elapsed, (double)stats->requests / elapsed);
+    printf("  received    %.2f MiB, %.2f MiB/s\n",
+           (double)stats->bytes / (1024 * 1024),
+           (double)stats->bytes / (1024 * 1024) / elapsed);
+    printf("  connections %" PRIu64 " opened, %" PRIu64 " errors\n",
+           stats->connects, stats->errors);
+    if (!target->websocket) {
+        printf("  responses   1xx %" PRIu64 ", 2xx %" PRIu64 ", 3xx %" PRIu64
+               ", 4xx %" PRIu64 ", 5xx %" PRIu64 "\n",
+               stats->status[1], stats->status[2], stats->status[3],
+               stats->status[4], stats->status[5]);
+    }
+    if (stats->requests) {
+        printf("  latency     mean %" PRIu64 "us, p50 %" PRIu64
+               "us, p90 %" PRIu64 "us, p99 %" PRIu64 "us, p99.9 %" PRIu64
+               "us, max %" PRIu64 "us\n",
+               stats->latency_sum / stats->requests,
+               percentile(stats, 0.5), percentile(stats, 0.9),
+               percentile(stats, 0.99), percentile(stats, 0.999),
+               stats->latency_max);
+    }
+}
+
+static bool run_scenario(const struct scenario *scenario)
+{
+    struct target target = {};
+    struct bench_thread *threads;
+    struct stats total = {};
+    struct timespec duration = {.tv_sec = scenario->duration};
+    uint64_t start;
+
+    if (!parse_url(scenario->url, &target))
+        return false;
+    if (scenario->path) {
+        free(target.path);
+        target.path = strdup(scenario->path);
+        if (!target.path)
+            return false;
+    }
+    if (!build_requests(scenario, &target))
+        return false;
+
+    threads = calloc(scenario->threads, sizeof(*threads));
+    if (!threads)
+        return false;
+
+    stop = false;
+    start = now_ns();
+
+    for (unsigned int i = 0; i < scenario->threads; i++) {
+        struct bench_thread *thread = &threads[i];
+
+        thread->scenario = scenario;
+        thread->target = &target;
+        thread->n_conns = scenario->connections / scenario->threads +
+                          (i < scenario->connections % scenario->threads);
+        thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (thread->epoll_fd < 0)
+            lwan_status_critical_perror("epoll_create1");
+
+        if (pthread_create(&thread->self, NULL, thread_loop, thread))
+            lwan_status_critical_perror("pthread_create");
+    }
+
+    while (nanosleep(&duration, &duration) < 0 && errno == EINTR)
+        ;
+    stop = true;
+
+    for (unsigned int i = 0; i < scenario->threads; i++) {
+        const struct stats *stats = &threads[i].stats;
+
+        pthread_join(threads[i].self, NULL);
+        close(threads[i].epoll_fd);
+
+        total.requests += stats->requests;
+        total.errors += stats->errors;
+        total.connects += stats->connects;
+        total.bytes += stats->bytes;
+        total.latency_sum += stats->latency_sum;
+        total.latency_max = LWAN_MAX(total.latency_max, stats->latency_max);
+        for (size_t s = 0; s < N_ELEMENTS(total.status); s++)
+            total.status[s] += stats->status[s];
+        for (unsigned int b = 0; b < N_BUCKETS; b++)
+            total.latency[b] += stats->latency[b];
+    }
+
+    if (json_output)
+        report_json(scenario, &target, &total, (double)(now_ns() - start) / 1e9);
+    else
+        report(scenario, &target, &total, (double)(now_ns() - start) / 1e9);
+
+    free(threads);
+    free(target.host);
+    free(target.path);
+    free(target.request);
+    free(target.handshake);
+
+    return true;
+}
+
+/* Command line options override what's in scenario files */
+struct overrides {
+    struct scenario values;
+    bool connections, threads, pipeline, duration, message_size, close;
+};
+
+static void apply_overrides(struct scenario *scenario,
+                            const struct overrides *overrides)
+{
+    if (overrides->connections)
+        scenario->connections = overrides->values.connections;
+    if (overrides->threads)
+        scenario->threads = overrides->values.threads;
+    if (overrides->pipeline)
+        scenario->pipeline = overrides->values.pipeline;
+    if (overrides->duration)
+        scenario->duration = overrides->values.duration;
+    if (overrides->message_size)
+        scenario->message_size = overrides->values.message_size;
+    if (overrides->close)
+        scenario->keep_alive = false;
+
+    scenario->threads = LWAN_MAX(1u, LWAN_MIN(scenario->threads,
+                                              scenario->connections));
+    /* Connections are closed after the first response without keep-alive,
+     * so there's no point in sending more requests before that. */
+    if (!scenario->keep_alive)
+        scenario->pipeline = 1;
+}
+
+static bool parse_scenario_line(struct config *config,
+                                const struct config_line *line,
+                                struct scenario *scenario)
+{
+    if (streq(line->key, "url")) {
+        free(scenario->url);
+        scenario->url = strdup(line->value);
+    } else if (streq(line->key, "path")) {
+        free(scenario->path);
+        scenario->path = strdup(line->value);
+    } else if (streq(line->key, "connections")) {
+        scenario->connections =
+            (unsigned int)LWAN_MAX(1, parse_int(line->value, 1));
+    } else if (streq(line->key, "threads")) {
+        scenario->threads = (unsigned int)LWAN_MAX(1, parse_int(line->value, 1));
+    } else if (streq(line->key, "pipeline")) {
+        scenario->pipeline = (unsigned int)LWAN_MAX(1, parse_int(line->value, 1));
+    } else if (streq(line->key, "duration")) {
+        scenario->duration = parse_time_period(line->value, 10);
+    } else if (streq(line->key, "message_size")) {
+        scenario->message_size =
+            (unsigned int)LWAN_MAX(0, parse_int(line->value, 0));
+    } else if (streq(line->key, "keep_alive")) {
+        scenario->keep_alive = parse_bool(line->value, true);
+    } else {
+        config_error(config, "Unknown option: %s", line->key);
+        return false;
+    }
+
+    return true;
+}
+
+static struct scenario copy_scenario(const struct scenario *defaults,
+                                     const char *name)
+{
+    struct scenario copy = *defaults;
+
+    copy.name = strdup(name);
+    copy.url = defaults->url ? strdup(defaults->url) : NULL;
+    copy.path = defaults->path ? strdup(defaults->path) : NULL;
+
+    return copy;
+}
+
+static void free_scenario(struct scenario *scenario)
+{
+    free(scenario->name);
+    free(scenario->url);
+    free(scenario->path);
+}
+
+static bool wanted(const char *name, int n_names, char *names[])
+{
+    if (!n_names)
+        return true;
+
+    for (int i = 0; i < n_names; i++) {
+        if (streq(names[i], name))
+            return true;
+    }
+
+    return false;
+}
+
+static bool run_scenario_with_overrides(struct scenario *scenario,
+                                        const struct overrides *overrides)
+{
+    if (!scenario->url) {
+        lwan_status_error("Scenario %s has no URL", scenario->name);
+        return false;
+    }
+
+    apply_overrides(scenario, overrides);
+
+    return run_scenario(scenario);
+}
+
+/* Top-level options in a scenario file are defaults for every scenario
+ * section in it. */
+static bool run_scenario_file(const char *path,
+                              const struct scenario *defaults,
+                              const struct overrides *overrides,
+                              int n_names,
+                              char *names[])
+{
+    struct scenario file_defaults = copy_scenario(defaults, "default");
+    const struct config_line *line;
+    struct config *config;
+    bool ok = true;
+    bool first = true;
+
+    config = config_open(path);
+    if (!config) {
+        lwan_status_perror("Could not open scenario file %s", path);
+        free_scenario(&file_defaults);
+        return false;
+    }
+
+    while (ok && (line = config_read_line(config))) {
+        switch (line->type) {
+        case CONFIG_LINE_TYPE_LINE:
+            ok = parse_scenario_line(config, line, &file_defaults);
+            break;
+
+        case CONFIG_LINE_TYPE_SECTION: {
+            if (!streq(line->key, "scenario")) {
+                config_error(config, "Unknown section: %s", line->key);
+                ok = false;
+                break;
+            }
+
+            struct scenario scenario = copy_scenario(&file_defaults, line->value);
+            const bool run = wanted(scenario.name, n_names, names);
+
+            while (ok && (line = config_read_line(config))) {
+                if (line->type == CONFIG_LINE_TYPE_SECTION_END)
+                    break;
+                if (line->type == CONFIG_LINE_TYPE_SECTION) {
+                    config_error(config, "Unexpected section: %s", line->key);
+                    ok = false;
+                    break;
+                }
+                ok = parse_scenario_line(config, line, &scenario);
+            }
+
+            if (ok && run) {
+                if (!first && !json_output)
+                    printf("\n");
+                first = false;
+                ok = run_scenario_with_overrides(&scenario, overrides);
+            }
+
+            free_scenario(&scenario);
+            break;
+        }
+
+        case CONFIG_LINE_TYPE_SECTION_END:
+            config_error(config, "Unexpected section end");
+            ok = false;
+            break;
+        }
+    }
+
+    if (config_last_error(config)) {
+        lwan_status_error("Error in %s, line %d: %s", path,
+                          config_cur_line(config), config_last_error(config));
+        ok = false;
+    }
+
+    config_close(config);
+    free_scenario(&file_defaults);
+
+    return ok;
+}
+
+static void print_help(const char *argv0, const struct scenario *defaults)
+{
+    printf("Usage: %s [options] URL\n", argv0);
+    printf("       %s [options] /path/to/scenarios.conf [scenario...]\n", argv0);
+    printf("Generate HTTP or WebSockets load and measure latencies.\n\n");
+    printf("Options:\n");
+    printf("\t-c, --connections  Connections to keep open (default: %u).\n",
+           defaults->connections);
+    printf("\t-t, --threads      Threads generating load (default: %u).\n",
+           defaults->threads);
+    printf("\t-d, --duration     Duration, e.g. 30s or 1m (default: %us).\n",
+           defaults->duration);
+    printf("\t-p, --pipeline     Requests sent at once on each connection "
+           "(default: %u).\n",
+           defaults->pipeline);
+    printf("\t-C, --close        Close connections after each response.\n");
+    printf("\t-s, --message-size Size of WebSockets messages (default: %u).\n",
+           defaults->message_size);
+    printf("\t-j, --json         Print results as JSON, one line per scenario.\n");
+    printf("\t-h, --help         This.\n");
+    printf("\n");
+    printf("URLs can be either http:// or ws://; for the latter, a binary\n");
+    printf("message is sent, and a reply is waited for, over and over.\n");
+    printf("Options given in the command line override the ones in\n");
+    printf("scenario files.\n");
+    printf("\n");
+    printf("Examples:\n");
+    printf("  %s -c 256 -p 16 http://127.0.0.1:8080/hello\n", argv0);
+    printf("  %s src/bin/lwan-bench/scenarios/techempower.conf json\n", argv0);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option opts[] = {
+        {.name = "connections", .has_arg = 1, .val = 'c'},
+        {.name = "threads", .has_arg = 1, .val = 't'},
+        {.name = "duration", .has_arg = 1, .val = 'd'},
+        {.name = "pipeline", .has_arg = 1, .val = 'p'},
+        {.name = "close", .val = 'C'},
+        {.name = "message-size", .has_arg = 1, .val = 's'},
+        {.name = "json", .val = 'j'},
+        {.name = "help", .val = 'h'},
+        {},
+    };
+    const struct scenario defaults = {
+        .connections = 64,
+        .threads = 2,
+        .pipeline = 1,
+        .duration = 10,
+        .message_size = 64,
+        .keep_alive = true,
+    };
+    struct overrides overrides = {.values = defaults};
+    const char *target;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "c:t:d:p:Cs:jh", opts, NULL)) != -1) {
+        switch (c) {
+        case 'c':
+            overrides.values.connections =
+                (unsigned int)LWAN_MAX(1, parse_int(optarg, 1));
+            overrides.connections = true;
+            break;
+        case 't':
+            overrides.values.threads =
+                (unsigned int)LWAN_MAX(1, parse_int(optarg, 1));
+            overrides.threads = true;
+            break;
+        case 'd':
+            overrides.values.duration = parse_time_period(optarg, 10);
+            overrides.duration = true;
+            break;
+        case 'p':
+            overrides.values.pipeline =
+                (unsigned int)LWAN_MAX(1, parse_int(optarg, 1));
+            overrides.pipeline = true;
+            break;
+        case 'C':
+            overrides.close = true;
+            break;
+        case 's':
+            overrides.values.message_size =
+                (unsigned int)LWAN_MAX(0, parse_int(optarg, 0));
+            overrides.message_size = true;
+            break;
+        case 'j':
+            json_output = true;
+            break;
+        case 'h':
+            print_help(argv[0], &defaults);
+            return 0;
+        default:
+            printf("Run %s --help for usage information.\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        print_help(argv[0], &defaults);
+        return 1;
+    }
+
+    target = argv[optind];
+
+    if (strstr(target, "://")) {
+        struct scenario scenario = copy_scenario(&defaults, "command line");
+        bool ok;
+
+        scenario.url = strdup(target);
+        ok = run_scenario_with_overrides(&scenario, &overrides);
+        free_scenario(&scenario);
+
+        return ok ? 0 : 1;
+    }
+
+    return run_scenario_file(target, &defaults, &overrides, argc - optind - 1,
+                             argv + optind + 1)
+               ? 0
+               : 1;
+}
@@ -0,0 +1 @@
+Partial for version {{version}} rendered by request {{request}}
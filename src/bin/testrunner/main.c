@@ -18,10 +18,16 @@
  */
 
 #define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "json.h"
 #include "lwan.h"
+#include "lwan-pubsub.h"
+#include "lwan-template.h"
 
 LWAN_HANDLER(quit_lwan)
 {
@@ -68,6 +74,138 @@ LWAN_HANDLER(test_chunked_encoding)
     return HTTP_OK;
 }
 
+struct chunked_template_vars {
+    struct {
+        coro_function_t generator;
+
+        int number;
+    } row;
+
+    int rows;
+};
+
+static int chunked_template_rows(struct coro *coro, void *data)
+{
+    struct chunked_template_vars *vars = data;
+
+    for (int i = 0; i < vars->rows; i++) {
+        vars->row.number = i;
+        coro_yield(coro, 1);
+    }
+
+    return 0;
+}
+
+#undef TPL_STRUCT
+#define TPL_STRUCT struct chunked_template_vars
+static const struct lwan_var_descriptor chunked_template_desc[] = {
+    TPL_VAR_SEQUENCE(row,
+                     chunked_template_rows,
+                     ((const struct lwan_var_descriptor[]){
+                         TPL_VAR_INT(row.number),
+                         TPL_VAR_SENTINEL,
+                     })),
+    TPL_VAR_INT(rows),
+    TPL_VAR_SENTINEL,
+};
+
+static struct lwan_tpl *chunked_tpl;
+
+static void compile_chunked_template(void)
+{
+    chunked_tpl = lwan_tpl_compile_string(
+        "{{rows}} rows:\n{{#row}}This is row {{row.number}}\n{{/row}}End\n",
+        chunked_template_desc);
+}
+
+LWAN_HANDLER(test_chunked_template)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    const char *rows = lwan_request_get_query_param(request, "rows");
+    struct chunked_template_vars vars = {
+        .rows = rows ? parse_int(rows, 0) : 0,
+    };
+
+    pthread_once(&once, compile_chunked_template);
+    if (!chunked_tpl)
+        return HTTP_INTERNAL_ERROR;
+
+    response->mime_type = "text/plain";
+
+    if (!lwan_tpl_apply_chunked(chunked_tpl, request, &vars))
+        return HTTP_INTERNAL_ERROR;
+
+    return HTTP_OK;
+}
+
+struct cached_partial_vars {
+    int version;
+    int request;
+};
+
+#undef TPL_STRUCT
+#define TPL_STRUCT struct cached_partial_vars
+static const struct lwan_var_descriptor cached_partial_desc[] = {
+    TPL_VAR_INT(version),
+    TPL_VAR_INT(request),
+    TPL_VAR_SENTINEL,
+};
+
+static struct lwan_tpl *cached_partial_tpl;
+
+static void compile_cached_partial_template(void)
+{
+    cached_partial_tpl = lwan_tpl_compile_string(
+        "Request {{request}}\n"
+        "{{>src/bin/testrunner/cached_partial.tpl version}}",
+        cached_partial_desc);
+}
+
+LWAN_HANDLER(test_cached_partial)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    static int requests;
+    const char *version = lwan_request_get_query_param(request, "version");
+    struct cached_partial_vars vars = {
+        .version = version ? parse_int(version, 0) : 0,
+        .request = __atomic_add_fetch(&requests, 1, __ATOMIC_SEQ_CST),
+    };
+
+    pthread_once(&once, compile_cached_partial_template);
+    if (!cached_partial_tpl)
+        return HTTP_INTERNAL_ERROR;
+
+    response->mime_type = "text/plain";
+
+    if (!lwan_tpl_apply_with_buffer(cached_partial_tpl, response->buffer,
+                                    &vars))
+        return HTTP_INTERNAL_ERROR;
+
+    return HTTP_OK;
+}
+
+LWAN_HANDLER(test_response_refs)
+{
+    static const char line[] =
+        "This line is longer than what's copied to the response buffer, so "
+        "it is referenced by the response and written from here instead.\n";
+    char *copy = strdup(line);
+
+    if (!copy)
+        return HTTP_INTERNAL_ERROR;
+
+    response->mime_type = "text/plain";
+
+    lwan_strbuf_printf(response->buffer, "First line\n");
+    lwan_response_append_ref(request, line, sizeof(line) - 1, NULL, NULL);
+    lwan_strbuf_append_printf(response->buffer, "Line %d\n", 2);
+    lwan_response_append_ref(request, copy, strlen(copy), free, copy);
+    lwan_response_append_ref(request, "Short line\n", 11, NULL, NULL);
+    lwan_strbuf_append_printf(response->buffer, "Last line\n");
+
+    return HTTP_OK;
+}
+
 LWAN_HANDLER(test_server_sent_event)
 {
     int i;
@@ -80,6 +218,187 @@ LWAN_HANDLER(test_server_sent_event)
     return HTTP_OK;
 }
 
+static void free_topic(void *data)
+{
+    lwan_pubsub_free_topic(data);
+}
+
+static void *publish_values(void *data)
+{
+    for (int i = 0; i <= 10; i++) {
+        usleep(10000);
+        lwan_pubsub_publishf(data, "Current value is %d", i);
+    }
+
+    return NULL;
+}
+
+static void join_publisher(void *data)
+{
+    pthread_join((pthread_t)(uintptr_t)data, NULL);
+}
+
+LWAN_HANDLER(test_pubsub_event)
+{
+    struct lwan_pubsub_topic *topic = lwan_pubsub_new_topic();
+    struct lwan_pubsub_subscriber *sub;
+    struct lwan_pubsub_msg *msg;
+    pthread_t publisher;
+    int received = 0;
+
+    if (!topic)
+        return HTTP_INTERNAL_ERROR;
+    coro_defer(request->conn->coro, free_topic, topic);
+
+    sub = lwan_pubsub_subscribe(topic);
+    if (!sub)
+        return HTTP_INTERNAL_ERROR;
+
+    /* Published from another thread, so that this coroutine is suspended
+     * and woken up as each value arrives. */
+    if (pthread_create(&publisher, NULL, publish_values, topic))
+        return HTTP_INTERNAL_ERROR;
+    coro_defer(request->conn->coro, join_publisher,
+               (void *)(uintptr_t)publisher);
+
+    while (received <= 10) {
+        while ((msg = lwan_pubsub_consume(sub))) {
+            lwan_pubsub_msg_send_event(request, msg);
+            received++;
+        }
+
+        if (received <= 10)
+            lwan_pubsub_wait(request, sub, 1000, false);
+    }
+
+    return HTTP_OK;
+}
+
+static struct lwan_pubsub_topic *replay_topic;
+
+static void create_replay_topic(void)
+{
+    replay_topic = lwan_pubsub_new_topic();
+    if (replay_topic && !lwan_pubsub_topic_keep_events(replay_topic, 4)) {
+        lwan_pubsub_free_topic(replay_topic);
+        replay_topic = NULL;
+    }
+}
+
+static struct lwan_pubsub_topic *get_replay_topic(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, create_replay_topic);
+
+    return replay_topic;
+}
+
+/* Another node is anything joining the same multicast group; see
+ * TestPubsubBridge in testsuite.py. */
+static struct lwan_pubsub_topic *bridged_topic;
+
+static void create_bridged_topic(void)
+{
+    bridged_topic = lwan_pubsub_new_topic();
+    if (!bridged_topic)
+        return;
+
+    if (!lwan_pubsub_topic_keep_events(bridged_topic, 4) ||
+        !lwan_pubsub_bridge_new_udp_multicast(
+            bridged_topic, "239.255.76.67:47001", "testrunner")) {
+        lwan_pubsub_free_topic(bridged_topic);
+        bridged_topic = NULL;
+    }
+}
+
+static struct lwan_pubsub_topic *get_bridged_topic(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, create_bridged_topic);
+
+    return bridged_topic;
+}
+
+static enum lwan_http_status publish_value(struct lwan_request *request,
+                                           struct lwan_response *response,
+                                           struct lwan_pubsub_topic *topic)
+{
+    const char *value = lwan_request_get_query_param(request, "value");
+
+    if (!topic)
+        return HTTP_INTERNAL_ERROR;
+    if (!value)
+        return HTTP_BAD_REQUEST;
+    if (!lwan_pubsub_publish(topic, value, strlen(value)))
+        return HTTP_INTERNAL_ERROR;
+
+    lwan_strbuf_set_staticz(response->buffer, "published\n");
+    response->mime_type = "text/plain";
+    return HTTP_OK;
+}
+
+LWAN_HANDLER(test_sse_replay_publish)
+{
+    return publish_value(request, response, get_replay_topic());
+}
+
+static void unsubscribe_replay(void *data1, void *data2)
+{
+    lwan_pubsub_unsubscribe(data1, data2);
+}
+
+static enum lwan_http_status replay_events(struct lwan_request *request,
+                                           struct lwan_response *response,
+                                           struct lwan_pubsub_topic *topic)
+{
+    struct lwan_pubsub_subscriber *sub;
+    struct lwan_pubsub_msg *msg;
+
+    if (!topic)
+        return HTTP_INTERNAL_ERROR;
+
+    sub = lwan_pubsub_subscribe_request(topic, request);
+    if (!sub)
+        return HTTP_INTERNAL_ERROR;
+    coro_defer2(request->conn->coro, unsubscribe_replay, topic, sub);
+
+    if (!lwan_response_set_event_stream(request, HTTP_OK))
+        return HTTP_INTERNAL_ERROR;
+
+    if (lwan_pubsub_subscriber_missed_events(sub)) {
+        lwan_strbuf_set_staticz(response->buffer, "missed");
+        lwan_response_send_event(request, "reset");
+    }
+
+    /* Only what was kept since the client's last event is sent, rather than
+     * waiting for new events, so that tests don't have to time out. */
+    while ((msg = lwan_pubsub_consume(sub)))
+        lwan_pubsub_msg_send_event(request, msg);
+
+    return HTTP_OK;
+}
+
+LWAN_HANDLER(test_sse_replay)
+{
+    return replay_events(request, response, get_replay_topic());
+}
+
+LWAN_HANDLER(test_bridge_publish)
+{
+    struct lwan_pubsub_topic *topic = get_bridged_topic();
+
+    return topic ? publish_value(request, response, topic) : HTTP_UNAVAILABLE;
+}
+
+LWAN_HANDLER(test_bridge_events)
+{
+    struct lwan_pubsub_topic *topic = get_bridged_topic();
+
+    return topic ? replay_events(request, response, topic) : HTTP_UNAVAILABLE;
+}
+
 LWAN_HANDLER(test_proxy)
 {
     struct lwan_key_value *headers = coro_malloc(request->conn->coro, sizeof(*headers) * 2);
@@ -130,6 +449,38 @@ LWAN_HANDLER(test_post_will_it_blend)
     return HTTP_OK;
 }
 
+struct post_json {
+    const char *name;
+    int count;
+    const char *tags[4];
+    size_t n_tags;
+    bool valid;
+};
+
+#undef JSON_STRUCT
+#define JSON_STRUCT struct post_json
+static const struct json_obj_descr post_json_descr[] = {
+    JSON_VAR_STR(name),
+    JSON_VAR_INT(count),
+    JSON_VAR_ARRAY(tags, n_tags, JSON_TOK_STRING),
+    JSON_VAR_BOOL(valid),
+};
+static struct json_encoder post_json_encoder = JSON_ENCODER(post_json_descr);
+
+LWAN_HANDLER(test_post_json)
+{
+    struct post_json post = {.name = ""};
+    enum lwan_http_status status = json_parse_request_body(
+        request, post_json_descr, N_ELEMENTS(post_json_descr), &post);
+
+    if (status != HTTP_OK)
+        return status;
+
+    return json_encode_response(&post_json_encoder, &post, response)
+               ? HTTP_OK
+               : HTTP_INTERNAL_ERROR;
+}
+
 LWAN_HANDLER(test_post_big)
 {
     static const char type[] = "x-test/trololo";
@@ -155,6 +506,98 @@ LWAN_HANDLER(test_post_big)
     return HTTP_OK;
 }
 
+LWAN_HANDLER(test_post_stream)
+{
+    char buffer[512];
+    size_t received = 0, sum = 0;
+
+    while (true) {
+        ssize_t n = lwan_request_read_body(request, buffer, sizeof(buffer));
+
+        if (n < 0)
+            return HTTP_BAD_REQUEST;
+        if (!n)
+            break;
+
+        received += (size_t)n;
+        for (ssize_t i = 0; i < n; i++)
+            sum += (size_t)buffer[i];
+    }
+
+    response->mime_type = "application/json";
+    lwan_strbuf_printf(response->buffer, "{\"received\": %zu, \"sum\": %zu}",
+                       received, sum);
+
+    return HTTP_OK;
+}
+
+LWAN_HANDLER(test_post_multipart)
+{
+    struct lwan_multipart_part part;
+    struct lwan_multipart *mp;
+    char buffer[7];
+    const char *separator = "";
+    int r;
+
+    mp = lwan_multipart_open(request);
+    if (!mp)
+        return HTTP_BAD_REQUEST;
+
+    lwan_strbuf_append_char(response->buffer, '[');
+
+    while ((r = lwan_multipart_next_part(mp, &part)) > 0) {
+        size_t size = 0, sum = 0;
+        ssize_t n;
+
+        lwan_strbuf_append_printf(
+            response->buffer, "%s{\"name\": \"%s\", \"type\": \"%s\", ",
+            separator, part.name.value ? part.name.value : "",
+            part.content_type.value);
+        separator = ", ";
+
+        if (part.filename.value) {
+            /* Files go through a temporary file to test that as well */
+            off_t file_size;
+            int fd = lwan_multipart_save_part(mp, &file_size);
+
+            if (fd < 0)
+                return HTTP_INTERNAL_ERROR;
+
+            while ((n = lwan_request_async_pread(request, fd, buffer,
+                                                 sizeof(buffer),
+                                                 (off_t)size)) > 0) {
+                size += (size_t)n;
+                for (ssize_t i = 0; i < n; i++)
+                    sum += (unsigned char)buffer[i];
+            }
+            if (n < 0 || (off_t)size != file_size)
+                return HTTP_INTERNAL_ERROR;
+
+            lwan_strbuf_append_printf(response->buffer,
+                                      "\"filename\": \"%s\", ",
+                                      part.filename.value);
+        } else {
+            while ((n = lwan_multipart_read(mp, buffer, sizeof(buffer))) > 0) {
+                size += (size_t)n;
+                for (ssize_t i = 0; i < n; i++)
+                    sum += (unsigned char)buffer[i];
+            }
+            if (n < 0)
+                return HTTP_BAD_REQUEST;
+        }
+
+        lwan_strbuf_append_printf(response->buffer,
+                                  "\"size\": %zu, \"sum\": %zu}", size, sum);
+    }
+    if (r < 0)
+        return HTTP_BAD_REQUEST;
+
+    lwan_strbuf_append_char(response->buffer, ']');
+    response->mime_type = "application/json";
+
+    return HTTP_OK;
+}
+
 LWAN_HANDLER(hello_world)
 {
     struct lwan_key_value *iter;
@@ -238,6 +681,80 @@ LWAN_HANDLER(sleep)
     return HTTP_OK;
 }
 
+static void *blocking_sleep(void *data)
+{
+    const uint64_t *ms = data;
+
+    usleep((useconds_t)(*ms * 1000));
+    return (void *)ms;
+}
+
+LWAN_HANDLER(blocking)
+{
+    const char *ms_param = lwan_request_get_query_param(request, "ms");
+    uint64_t ms;
+
+    if (!ms_param)
+        return HTTP_INTERNAL_ERROR;
+
+    ms = (uint64_t)parse_long(ms_param, 0);
+    if (lwan_request_run_blocking(request, blocking_sleep, &ms) != &ms)
+        return HTTP_INTERNAL_ERROR;
+
+    response->mime_type = "text/plain";
+    lwan_strbuf_printf(response->buffer, "Blocked for %" PRIu64 "ms", ms);
+
+    return HTTP_OK;
+}
+
+static void close_fd(void *data)
+{
+    close((int)(intptr_t)data);
+}
+
+LWAN_HANDLER(async_file)
+{
+    char path[] = "/tmp/lwan-async-file-XXXXXX";
+    char buffer[16];
+    off_t offset = 0;
+    int in_fd, out_fd;
+    ssize_t r;
+
+    /* Copies the file in small pieces to a temporary file, which is then
+     * read back into the response, so offsets are exercised both ways. */
+    in_fd = open("wwwroot/100.html", O_RDONLY | O_CLOEXEC);
+    if (in_fd < 0)
+        return HTTP_NOT_FOUND;
+    coro_defer(request->conn->coro, close_fd, (void *)(intptr_t)in_fd);
+
+    out_fd = mkostemp(path, O_CLOEXEC);
+    if (out_fd < 0)
+        return HTTP_INTERNAL_ERROR;
+    unlink(path);
+    coro_defer(request->conn->coro, close_fd, (void *)(intptr_t)out_fd);
+
+    while ((r = lwan_request_async_pread(request, in_fd, buffer,
+                                         sizeof(buffer), offset)) > 0) {
+        if (lwan_request_async_pwrite(request, out_fd, buffer, (size_t)r,
+                                      offset) != r)
+            return HTTP_INTERNAL_ERROR;
+        offset += r;
+    }
+    if (r < 0)
+        return HTTP_INTERNAL_ERROR;
+
+    for (offset = 0; (r = lwan_request_async_pread(request, out_fd, buffer,
+                                                   sizeof(buffer), offset)) > 0;
+         offset += r) {
+        lwan_strbuf_append_str(response->buffer, buffer, (size_t)r);
+    }
+    if (r < 0)
+        return HTTP_INTERNAL_ERROR;
+
+    response->mime_type = "text/html";
+    return HTTP_OK;
+}
+
 LWAN_HANDLER(custom_header)
 {
     const char *hdr = lwan_request_get_query_param(request, "hdr");
@@ -254,12 +771,86 @@ LWAN_HANDLER(custom_header)
     return HTTP_OK;
 }
 
+static unsigned int timer_ticks;
+
+static void count_timer_tick(struct lwan_timer *timer __attribute__((unused)),
+                             void *data)
+{
+    unsigned int *ticks = data;
+
+    ATOMIC_INC(*ticks);
+}
+
+LWAN_HANDLER(timer_ticks)
+{
+    response->mime_type = "text/plain";
+    lwan_strbuf_printf(response->buffer, "%u", ATOMIC_READ(timer_ticks));
+    return HTTP_OK;
+}
+
+struct timer_test {
+    struct lwan_timer *oneshot, *periodic;
+    unsigned int oneshot_fired, periodic_fired;
+};
+
+static void timer_test_oneshot(struct lwan_timer *timer __attribute__((unused)),
+                               void *data)
+{
+    struct timer_test *tt = data;
+
+    tt->oneshot_fired++;
+    tt->oneshot = NULL;
+}
+
+static void timer_test_periodic(struct lwan_timer *timer, void *data)
+{
+    struct timer_test *tt = data;
+
+    if (++tt->periodic_fired == 3) {
+        lwan_timer_cancel(timer);
+        tt->periodic = NULL;
+    }
+}
+
+static void timer_test_cancel(void *data)
+{
+    struct timer_test *tt = data;
+
+    lwan_timer_cancel(tt->oneshot);
+    lwan_timer_cancel(tt->periodic);
+}
+
+LWAN_HANDLER(timers)
+{
+    struct timer_test *tt = coro_malloc(request->conn->coro, sizeof(*tt));
+
+    if (!tt)
+        return HTTP_INTERNAL_ERROR;
+
+    *tt = (struct timer_test){};
+    coro_defer(request->conn->coro, timer_test_cancel, tt);
+
+    tt->oneshot = lwan_timer_add(50, 0, timer_test_oneshot, tt);
+    tt->periodic = lwan_timer_add(20, 20, timer_test_periodic, tt);
+    if (!tt->oneshot || !tt->periodic)
+        return HTTP_INTERNAL_ERROR;
+
+    lwan_request_sleep(request, 200);
+
+    response->mime_type = "text/plain";
+    lwan_strbuf_printf(response->buffer, "oneshot=%u periodic=%u",
+                       tt->oneshot_fired, tt->periodic_fired);
+    return HTTP_OK;
+}
+
 int
 main()
 {
     struct lwan l;
 
     lwan_init(&l);
+    if (lwan_timer_add_per_thread(&l, 100, count_timer_tick, &timer_ticks) < 0)
+        lwan_status_critical("Could not add per-thread timer");
     lwan_main_loop(&l);
     lwan_shutdown(&l);
 
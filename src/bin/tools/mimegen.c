@@ -21,28 +21,51 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#if defined(HAVE_BROTLI)
-#include <brotli/encode.h>
-#elif defined(HAVE_ZSTD)
-#include <zstd.h>
-#elif defined(HAVE_ZOPFLI)
-#include <zopfli/zopfli.h>
-#else
-#include <zlib.h>
-#endif
-
 #include "../../lib/hash.h"
 
+/* Extensions are looked up in a perfect hash table, generated here with
+ * the "hash, displace" method: the upper bits of the product of the key
+ * (the extension, lowercased, truncated to 8 characters, and packed in
+ * a 64-bit integer) with an odd constant select a bucket and a slot; every
+ * bucket then has a displacement, added to the slot of each of its keys,
+ * chosen so that no two keys end up in the same slot.  Buckets are
+ * placed from the most crowded to the least.  If that doesn't work for
+ * any constant, the table is made larger. */
+
+#define MAX_ATTEMPTS 10000
+
 struct output {
     char *ptr;
     size_t used, capacity;
 };
 
+struct key {
+    uint64_t key;
+    const char *mime_type;
+    uint32_t bucket;
+    uint32_t base;
+};
+
+struct bucket {
+    struct key **keys;
+    uint32_t n_keys;
+    uint32_t index;
+};
+
+struct table {
+    uint64_t multiplier;
+    unsigned int table_bits;
+    unsigned int bucket_bits;
+    const struct key **slots;
+    uint16_t *displacements;
+};
+
 static int
 output_append_full(struct output *output, const char *str, size_t str_len)
 {
@@ -67,22 +90,6 @@ output_append_full(struct output *output, const char *str, size_t str_len)
     return 0;
 }
 
-static int output_append_padded(struct output *output, const char *str)
-{
-    size_t str_len = strlen(str);
-
-    assert(str_len <= 8);
-
-    int r = output_append_full(output, str, str_len);
-    if (r < 0)
-        return r;
-
-    if (str_len != 8)
-        return output_append_full(output, "\0\0\0\0\0\0\0\0", 8 - str_len);
-
-    return 0;
-}
-
 static int output_append(struct output *output, const char *str)
 {
     return output_append_full(output, str, strlen(str) + 1);
@@ -93,7 +100,17 @@ static int compare_ext(const void *a, const void *b)
     const char **exta = (const char **)a;
     const char **extb = (const char **)b;
 
-    return strcasecmp(*exta, *extb);
+    return strcmp(*exta, *extb);
+}
+
+static int compare_bucket(const void *a, const void *b)
+{
+    const struct bucket *ba = a;
+    const struct bucket *bb = b;
+
+    if (ba->n_keys != bb->n_keys)
+        return ba->n_keys > bb->n_keys ? -1 : 1;
+    return ba->index < bb->index ? -1 : ba->index > bb->index;
 }
 
 static char *strend(char *str, char ch)
@@ -106,91 +123,145 @@ static char *strend(char *str, char ch)
     return NULL;
 }
 
-static char *compress_output(const struct output *output, size_t *outlen)
+static uint64_t ext_to_key(const char *ext)
 {
-    char *compressed;
+    uint64_t key = 0;
 
-#if defined(HAVE_BROTLI)
-    *outlen = BrotliEncoderMaxCompressedSize(output->used);
+    /* Same as lwan_determine_mime_type_for_file_name(). */
+    for (size_t i = 0; i < 8 && ext[i]; i++)
+        key |= (uint64_t)(unsigned char)(ext[i] | 0x20) << (i * 8);
 
-    compressed = malloc(*outlen);
-    if (!compressed) {
-        fprintf(stderr, "Could not allocate memory for compressed data\n");
-        exit(1);
-    }
+    return key;
+}
 
-    if (BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_MAX_WINDOW_BITS,
-                              BROTLI_MODE_TEXT, output->used,
-                              (const unsigned char *)output->ptr, outlen,
-                              (unsigned char *)compressed) != BROTLI_TRUE) {
-        fprintf(stderr, "Could not compress mime type table with Brotli\n");
-        exit(1);
-    }
-#elif defined(HAVE_ZSTD)
-    *outlen = ZSTD_compressBound(output->used);
+static uint64_t next_multiplier(uint64_t *state)
+{
+    /* splitmix64, so that the same table is generated every time. */
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
 
-    compressed = malloc(*outlen);
-    if (!compressed) {
-        fprintf(stderr, "Could not allocate memory for compressed data\n");
-        exit(1);
-    }
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
 
-    *outlen = ZSTD_compress(compressed, *outlen, output->ptr, output->used,
-                            ZSTD_maxCLevel());
-    if (ZSTD_isError(*outlen)) {
-        fprintf(stderr, "Could not compress mime type table with ZSTD\n");
-        exit(1);
+    return (z ^ (z >> 31)) | 1;
+}
+
+static bool try_multiplier(struct table *table,
+                           struct key *keys,
+                           size_t n_keys,
+                           struct bucket *buckets,
+                           struct key **bucket_keys)
+{
+    const uint32_t n_slots = 1u << table->table_bits;
+    const uint32_t n_buckets = 1u << table->bucket_bits;
+    const uint32_t mask = n_slots - 1;
+    size_t i;
+
+    for (i = 0; i < n_keys; i++) {
+        const uint64_t h = keys[i].key * table->multiplier;
+
+        keys[i].bucket = (uint32_t)(h >> (64 - table->bucket_bits));
+        keys[i].base = (uint32_t)(h >> (64 - table->bucket_bits -
+                                        table->table_bits)) & mask;
     }
-#elif defined(HAVE_ZOPFLI)
-    ZopfliOptions opts;
-
-    *outlen = 0;
-
-    ZopfliInitOptions(&opts);
-    ZopfliCompress(&opts, ZOPFLI_FORMAT_ZLIB,
-                   (const unsigned char *)output->ptr, output->used,
-                   (unsigned char **)&compressed, outlen);
-#else
-    *outlen = compressBound((uLong)output->used);
-    compressed = malloc(*outlen);
-    if (!compressed) {
-        fprintf(stderr, "Could not allocate memory for compressed data\n");
-        exit(1);
+
+    for (i = 0; i < n_buckets; i++)
+        buckets[i] = (struct bucket){.index = (uint32_t)i};
+    for (i = 0; i < n_keys; i++)
+        buckets[keys[i].bucket].n_keys++;
+    for (i = 0; i < n_buckets; i++) {
+        buckets[i].keys = bucket_keys;
+        bucket_keys += buckets[i].n_keys;
+        buckets[i].n_keys = 0;
     }
-    if (compress2((Bytef *)compressed, outlen, (const Bytef *)output->ptr,
-                  output->used, 9) != Z_OK) {
-        fprintf(stderr, "Could not compress data with zlib\n");
-        exit(1);
+    for (i = 0; i < n_keys; i++) {
+        struct bucket *bucket = &buckets[keys[i].bucket];
+
+        bucket->keys[bucket->n_keys++] = &keys[i];
     }
-#endif
-    if (!*outlen) {
-        free(compressed);
-        return NULL;
+
+    qsort(buckets, n_buckets, sizeof(*buckets), compare_bucket);
+
+    memset(table->slots, 0, n_slots * sizeof(*table->slots));
+    memset(table->displacements, 0, n_buckets * sizeof(*table->displacements));
+
+    for (i = 0; i < n_buckets && buckets[i].n_keys; i++) {
+        const struct bucket *bucket = &buckets[i];
+        uint32_t displacement;
+
+        for (displacement = 0; displacement < n_slots; displacement++) {
+            uint32_t k;
+
+            for (k = 0; k < bucket->n_keys; k++) {
+                const uint32_t slot =
+                    (bucket->keys[k]->base + displacement) & mask;
+
+                if (table->slots[slot])
+                    break;
+                table->slots[slot] = bucket->keys[k];
+            }
+            if (k == bucket->n_keys)
+                break;
+
+            /* Undo, including slots taken by keys of this same bucket. */
+            while (k--)
+                table->slots[(bucket->keys[k]->base + displacement) & mask] =
+                    NULL;
+        }
+        if (displacement == n_slots)
+            return false;
+
+        table->displacements[bucket->index] = (uint16_t)displacement;
     }
 
-    return compressed;
+    return true;
 }
 
-static bool is_builtin_mime_type(const char *mime)
+static bool build_table(struct table *table, struct key *keys, size_t n_keys)
 {
-    /* These are the mime types supported by Lwan without having to perform
-     * a bsearch().  application/octet-stream is the fallback. */
-    if (streq(mime, "application/octet-stream"))
-        return true;
-    if (streq(mime, "application/javascript"))
-        return true;
-    if (streq(mime, "image/jpeg"))
-        return true;
-    if (streq(mime, "image/gif"))
-        return true;
-    if (streq(mime, "image/png"))
-        return true;
-    if (streq(mime, "text/html"))
-        return true;
-    if (streq(mime, "text/css"))
-        return true;
-    if (streq(mime, "text/plain"))
-        return true;
+    unsigned int min_bits = 1;
+
+    while ((1u << min_bits) < n_keys)
+        min_bits++;
+
+    for (table->table_bits = min_bits; table->table_bits <= 16;
+         table->table_bits++) {
+        const uint32_t n_slots = 1u << table->table_bits;
+        uint64_t state = 0;
+        struct bucket *buckets;
+        struct key **bucket_keys;
+        bool built = false;
+
+        table->bucket_bits = table->table_bits - 1;
+
+        table->slots = calloc(n_slots, sizeof(*table->slots));
+        table->displacements = calloc(n_slots / 2, sizeof(uint16_t));
+        buckets = calloc(n_slots / 2, sizeof(*buckets));
+        bucket_keys = calloc(n_keys, sizeof(*bucket_keys));
+        if (!table->slots || !table->displacements || !buckets ||
+            !bucket_keys) {
+            fprintf(stderr, "Could not allocate hash table\n");
+            exit(1);
+        }
+
+        for (int attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+            table->multiplier = next_multiplier(&state);
+
+            if (try_multiplier(table, keys, n_keys, buckets, bucket_keys)) {
+                built = true;
+                break;
+            }
+        }
+
+        free(buckets);
+        free(bucket_keys);
+
+        if (built)
+            return true;
+
+        free(table->slots);
+        free(table->displacements);
+    }
+
     return false;
 }
 
@@ -199,12 +270,13 @@ int main(int argc, char *argv[])
     FILE *fp;
     char buffer[256];
     struct output output = { .capacity = 1024 };
-    size_t compressed_size;
-    char *compressed, *ext;
-    struct hash *ext_mime;
+    struct table table;
+    char *ext;
+    struct hash *ext_mime, *mime_offsets;
     struct hash_iter iter;
     const char **exts, *key;
-    size_t i;
+    struct key *keys;
+    size_t i, n_keys;
 
     if (argc < 2) {
         fprintf(stderr, "Usage: %s /path/to/mime.types\n", argv[0]);
@@ -238,7 +310,7 @@ int main(int argc, char *argv[])
             continue;
 
         mime_type = start;
-        if (is_builtin_mime_type(mime_type))
+        if (streq(mime_type, "application/octet-stream")) /* The fallback. */
             continue;
 
         while (*tab && *tab == '\t') /* Find first extension. */
@@ -257,6 +329,8 @@ int main(int argc, char *argv[])
                 /* Truncate extensions over 8 characters.  See commit 2050759297. */
                 ext[8] = '\0';
             }
+            for (char *p = ext; *p; p++)
+                *p |= 0x20;
 
             k = strdup(ext);
             v = strdup(mime_type);
@@ -279,72 +353,107 @@ int main(int argc, char *argv[])
         }
     }
 
-    /* Get sorted list of extensions. */
-    exts = calloc(hash_get_count(ext_mime), sizeof(char *));
-    if (!exts) {
+    /* Get sorted list of extensions, so that the output doesn't depend on
+     * the order of the hash table. */
+    n_keys = hash_get_count(ext_mime);
+    exts = calloc(n_keys, sizeof(char *));
+    keys = calloc(n_keys, sizeof(*keys));
+    if (!exts || !keys) {
         fprintf(stderr, "Could not allocate extension array\n");
         return 1;
     }
     hash_iter_init(ext_mime, &iter);
     for (i = 0; hash_iter_next(&iter, (const void **)&key, NULL); i++)
         exts[i] = key;
-    qsort(exts, hash_get_count(ext_mime), sizeof(char *), compare_ext);
+    qsort(exts, n_keys, sizeof(char *), compare_ext);
 
-    /* Generate uncompressed blob. */
+    /* Every MIME type is stored only once, and referred to by its offset. */
     output.ptr = malloc(output.capacity);
-    if (!output.ptr) {
+    mime_offsets = hash_str_new(NULL, NULL);
+    if (!output.ptr || !mime_offsets) {
         fprintf(stderr, "Could not allocate temporary memory\n");
         return 1;
     }
-    for (i = 0; i < hash_get_count(ext_mime); i++) {
-        char ext_lower[9] = {0};
+    for (i = 0; i < n_keys; i++) {
+        const char *mime_type = hash_find(ext_mime, exts[i]);
 
-        strncpy(ext_lower, exts[i], 8);
+        keys[i] = (struct key){.key = ext_to_key(exts[i]), .mime_type = mime_type};
 
-        for (char *p = ext_lower; *p; p++)
-            *p |= 0x20;
-
-        if (output_append_padded(&output, ext_lower) < 0) {
+        if (hash_find(mime_offsets, mime_type))
+            continue;
+        if (hash_add(mime_offsets, mime_type,
+                     (void *)(uintptr_t)(output.used + 1)) < 0 ||
+            output_append(&output, mime_type) < 0) {
             fprintf(stderr, "Could not append to output\n");
             return 1;
         }
     }
-    for (i = 0; i < hash_get_count(ext_mime); i++) {
-        if (output_append(&output, hash_find(ext_mime, exts[i])) < 0) {
-            fprintf(stderr, "Could not append to output\n");
-            return 1;
-        }
+    if (output.used > UINT16_MAX) {
+        fprintf(stderr, "MIME types don't fit in 64KiB\n");
+        return 1;
     }
 
-    /* Compress blob. */
-    compressed = compress_output(&output, &compressed_size);
-    if (!compressed) {
-        fprintf(stderr, "Could not compress data\n");
+    if (!build_table(&table, keys, n_keys)) {
+        fprintf(stderr, "Could not build perfect hash table\n");
         return 1;
     }
 
     /* Print output. */
-#if defined(HAVE_BROTLI)
-    printf("/* Compressed with brotli */\n");
-#elif defined(HAVE_ZSTD)
-    printf("/* Compressed with zstd */\n");
-#elif defined(HAVE_ZOPFLI)
-    printf("/* Compressed with zopfli (deflate) */\n");
-#else
-    printf("/* Compressed with zlib (deflate) */\n");
-#endif
+    printf("/* Generated by mimegen; do not edit. */\n");
     printf("#pragma once\n");
-    printf("#define MIME_UNCOMPRESSED_LEN %zu\n", output.used);
-    printf("#define MIME_COMPRESSED_LEN %lu\n", compressed_size);
-    printf("#define MIME_ENTRIES %d\n", hash_get_count(ext_mime));
-    printf("static const unsigned char mime_entries_compressed[] = {\n");
-    for (i = 1; compressed_size; compressed_size--, i++)
-        printf("0x%02x,%c", compressed[i - 1] & 0xff, " \n"[i % 13 == 0]);
+    printf("#include <stdint.h>\n");
+    printf("#define MIME_ENTRIES %zu\n", n_keys);
+    printf("#define MIME_TABLE_BITS %u\n", table.table_bits);
+    printf("#define MIME_BUCKET_BITS %u\n", table.bucket_bits);
+    printf("#define MIME_HASH_MULTIPLIER 0x%016llxull\n",
+           (unsigned long long)table.multiplier);
+
+    printf("static const uint16_t mime_displacements[1 << MIME_BUCKET_BITS] = {\n");
+    for (i = 0; i < 1u << table.bucket_bits; i++)
+        printf("%u,%c", table.displacements[i], " \n"[(i + 1) % 16 == 0]);
     printf("};\n");
 
-    free(compressed);
+    printf("static const uint64_t mime_extensions[1 << MIME_TABLE_BITS] = {\n");
+    for (i = 0; i < 1u << table.table_bits; i++) {
+        printf("0x%llx,%c",
+               (unsigned long long)(table.slots[i] ? table.slots[i]->key : 0),
+               " \n"[(i + 1) % 6 == 0]);
+    }
+    printf("};\n");
+
+    printf("static const uint16_t mime_type_offsets[1 << MIME_TABLE_BITS] = {\n");
+    for (i = 0; i < 1u << table.table_bits; i++) {
+        const uintptr_t offset =
+            table.slots[i]
+                ? (uintptr_t)hash_find(mime_offsets, table.slots[i]->mime_type) - 1
+                : 0;
+
+        printf("%zu,%c", (size_t)offset, " \n"[(i + 1) % 16 == 0]);
+    }
+    printf("};\n");
+
+    printf("static const char mime_types[] =");
+    for (i = 0; i < output.used; i += strlen(output.ptr + i) + 1)
+        printf("\n    \"%s\\0\"", output.ptr + i);
+    printf(";\n");
+
+    printf("static inline uint32_t mime_slot(uint64_t key)\n");
+    printf("{\n");
+    printf("    const uint64_t h = key * MIME_HASH_MULTIPLIER;\n");
+    printf("    const uint32_t bucket = (uint32_t)(h >> (64 - MIME_BUCKET_BITS));\n");
+    printf("    const uint32_t base =\n");
+    printf("        (uint32_t)(h >> (64 - MIME_BUCKET_BITS - MIME_TABLE_BITS));\n");
+    printf("\n");
+    printf("    return (base + mime_displacements[bucket]) &\n");
+    printf("           ((1u << MIME_TABLE_BITS) - 1);\n");
+    printf("}\n");
+
     free(output.ptr);
     free(exts);
+    free(keys);
+    free(table.slots);
+    free(table.displacements);
+    hash_free(mime_offsets);
     hash_free(ext_mime);
     fclose(fp);
 
@@ -0,0 +1,349 @@
+/*
+ * packassets - pack a directory to be served by serve_files
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#if defined(HAVE_BROTLI)
+#include <brotli/encode.h>
+#endif
+
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+#include "../../lib/lwan-asset-pack.h"
+#include "../../lib/murmur3.h"
+
+struct file {
+    char *key;
+    struct stat st;
+};
+
+static struct {
+    struct file *files;
+    size_t n_files, capacity;
+    size_t root_len;
+} walk;
+
+static int add_file(const char *path,
+                    const struct stat *st,
+                    int type,
+                    struct FTW *ftw __attribute__((unused)))
+{
+    const mode_t world_readable = S_IRUSR | S_IRGRP | S_IROTH;
+
+    if (type != FTW_F || !S_ISREG(st->st_mode))
+        return 0;
+
+    /* serve_files wouldn't serve these either */
+    if ((st->st_mode & world_readable) != world_readable) {
+        fprintf(stderr, "Skipping %s: not world-readable\n", path);
+        return 0;
+    }
+
+    if (walk.n_files == walk.capacity) {
+        size_t capacity = walk.capacity ? walk.capacity * 2 : 64;
+        struct file *files = realloc(walk.files, capacity * sizeof(*files));
+
+        if (!files)
+            return -1;
+
+        walk.files = files;
+        walk.capacity = capacity;
+    }
+
+    walk.files[walk.n_files].key = strdup(path + walk.root_len + 1);
+    if (!walk.files[walk.n_files].key)
+        return -1;
+    walk.files[walk.n_files].st = *st;
+    walk.n_files++;
+
+    return 0;
+}
+
+static int compare_files(const void *a, const void *b)
+{
+    const struct file *fa = a, *fb = b;
+
+    return strcmp(fa->key, fb->key);
+}
+
+/* Each of these returns the compressed length, or 0 if the contents
+ * couldn't be compressed. */
+
+static size_t compress_deflate(const void *in, size_t in_len, void **out)
+{
+    uLongf len = compressBound((uLong)in_len);
+
+    if (!(*out = malloc(len)))
+        return 0;
+    if (compress2(*out, &len, in, (uLong)in_len, Z_BEST_COMPRESSION) != Z_OK)
+        return 0;
+
+    return len;
+}
+
+static size_t compress_gzip(const void *in, size_t in_len, void **out)
+{
+    z_stream stream = {
+        .next_in = (Bytef *)in,
+        .avail_in = (uInt)in_len,
+    };
+    size_t len = 0;
+
+    /* Adding 16 to the window bits asks for a gzip header and trailer. */
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+
+    stream.avail_out = (uInt)deflateBound(&stream, (uLong)in_len);
+    if ((*out = malloc(stream.avail_out))) {
+        stream.next_out = *out;
+        if (deflate(&stream, Z_FINISH) == Z_STREAM_END)
+            len = stream.total_out;
+    }
+
+    deflateEnd(&stream);
+    return len;
+}
+
+#if defined(HAVE_BROTLI)
+static size_t compress_brotli(const void *in, size_t in_len, void **out)
+{
+    size_t len = BrotliEncoderMaxCompressedSize(in_len);
+
+    if (!len || !(*out = malloc(len)))
+        return 0;
+    if (BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW,
+                              BROTLI_DEFAULT_MODE, in_len, in, &len,
+                              *out) != BROTLI_TRUE)
+        return 0;
+
+    return len;
+}
+#endif
+
+#if defined(HAVE_ZSTD)
+static size_t compress_zstd(const void *in, size_t in_len, void **out)
+{
+    size_t len = ZSTD_compressBound(in_len);
+
+    if (!(*out = malloc(len)))
+        return 0;
+    len = ZSTD_compress(*out, len, in, in_len, ZSTD_maxCLevel());
+
+    return ZSTD_isError(len) ? 0 : len;
+}
+#endif
+
+static size_t (*const compressors[ASSET_PACK_N_VARIANTS])(const void *in,
+                                                         size_t in_len,
+                                                         void **out) = {
+    [ASSET_PACK_DEFLATE] = compress_deflate,
+    [ASSET_PACK_GZIP] = compress_gzip,
+#if defined(HAVE_BROTLI)
+    [ASSET_PACK_BROTLI] = compress_brotli,
+#endif
+#if defined(HAVE_ZSTD)
+    [ASSET_PACK_ZSTD] = compress_zstd,
+#endif
+};
+
+static int write_blob(FILE *out, const void *data, size_t len, uint64_t *offset)
+{
+    off_t pos = ftello(out);
+
+    if (pos < 0)
+        return -errno;
+    if (len && fwrite(data, len, 1, out) != 1)
+        return -EIO;
+
+    *offset = (uint64_t)pos;
+    return 0;
+}
+
+static int pack_file(FILE *out,
+                     int root_fd,
+                     const struct file *file,
+                     struct asset_pack_entry *entry)
+{
+    size_t len = (size_t)file->st.st_size;
+    void *contents = NULL;
+    struct tm tm;
+    int fd, r;
+
+    *entry = (struct asset_pack_entry){.mtime = file->st.st_mtime};
+
+    r = write_blob(out, file->key, strlen(file->key) + 1, &entry->key_offset);
+    if (r < 0)
+        return r;
+
+    fd = openat(root_fd, file->key, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+    if (len) {
+        contents = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (contents == MAP_FAILED) {
+            close(fd);
+            return -errno;
+        }
+    }
+    close(fd);
+
+    r = write_blob(out, contents, len,
+                   &entry->variants[ASSET_PACK_IDENTITY].offset);
+    if (r < 0)
+        goto out;
+    entry->variants[ASSET_PACK_IDENTITY].len = len;
+
+    for (int v = 0; v < ASSET_PACK_N_VARIANTS; v++) {
+        void *compressed = NULL;
+        size_t compressed_len;
+
+        if (!compressors[v] || !len)
+            continue;
+
+        compressed_len = compressors[v](contents, len, &compressed);
+        if (compressed_len && compressed_len < len) {
+            r = write_blob(out, compressed, compressed_len,
+                           &entry->variants[v].offset);
+            entry->variants[v].len = compressed_len;
+        }
+        free(compressed);
+        if (r < 0)
+            goto out;
+    }
+
+    /* Same ETag that serve_files gives small files served from a
+     * directory, so clients keep their copies when switching to a pack. */
+    snprintf(entry->etag, sizeof(entry->etag), "\"%016" PRIx64 "\"",
+             murmur3_64(contents, len, 0));
+
+    if (!gmtime_r(&file->st.st_mtime, &tm) ||
+        !strftime(entry->last_modified, sizeof(entry->last_modified),
+                  "%a, %d %b %Y %H:%M:%S GMT", &tm))
+        r = -EINVAL;
+
+out:
+    if (contents)
+        munmap(contents, len);
+    return r;
+}
+
+static int pack(const char *root, const char *output)
+{
+    struct asset_pack_header header = {.version = ASSET_PACK_VERSION};
+    struct asset_pack_entry *entries = NULL;
+    FILE *out = NULL;
+    int root_fd, r = 0;
+
+    walk.root_len = strlen(root);
+    while (walk.root_len > 1 && root[walk.root_len - 1] == '/')
+        walk.root_len--;
+    if (nftw(root, add_file, 16, 0) < 0)
+        return -errno;
+    if (walk.n_files > UINT32_MAX)
+        return -EFBIG;
+    qsort(walk.files, walk.n_files, sizeof(*walk.files), compare_files);
+
+    root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0)
+        return -errno;
+
+    entries = calloc(walk.n_files ? walk.n_files : 1, sizeof(*entries));
+    if (!entries) {
+        r = -ENOMEM;
+        goto out;
+    }
+
+    out = fopen(output, "we");
+    if (!out) {
+        r = -errno;
+        goto out;
+    }
+
+    /* Entries are written once the offsets of every file are known. */
+    memcpy(header.magic, ASSET_PACK_MAGIC, sizeof(header.magic));
+    header.n_entries = (uint32_t)walk.n_files;
+    if (fseeko(out, (off_t)(sizeof(header) + walk.n_files * sizeof(*entries)),
+               SEEK_SET) < 0) {
+        r = -errno;
+        goto out;
+    }
+
+    for (size_t i = 0; i < walk.n_files; i++) {
+        r = pack_file(out, root_fd, &walk.files[i], &entries[i]);
+        if (r < 0) {
+            fprintf(stderr, "Could not pack %s: %s\n", walk.files[i].key,
+                    strerror(-r));
+            goto out;
+        }
+    }
+
+    rewind(out);
+    if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+        (walk.n_files &&
+         fwrite(entries, sizeof(*entries), walk.n_files, out) !=
+             walk.n_files)) {
+        r = -EIO;
+        goto out;
+    }
+
+out:
+    if (out && fclose(out) && !r)
+        r = -errno;
+    if (r < 0)
+        unlink(output);
+    free(entries);
+    close(root_fd);
+    return r;
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s /path/to/directory output.pack\n", argv[0]);
+        return 1;
+    }
+
+    r = pack(argv[1], argv[2]);
+    if (r < 0) {
+        fprintf(stderr, "%s: Could not pack %s into %s: %s\n", argv[0],
+                argv[1], argv[2], strerror(-r));
+        return 1;
+    }
+
+    fprintf(stderr, "Packed %zu files from %s into %s\n", walk.n_files,
+            argv[1], argv[2]);
+    return 0;
+}
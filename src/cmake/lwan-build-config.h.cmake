@@ -34,7 +34,9 @@
 #cmakedefine HAVE_READAHEAD
 #cmakedefine HAVE_REALLOCARRAY
 #cmakedefine HAVE_EVENTFD
+#cmakedefine HAVE_INOTIFY
 #cmakedefine HAVE_EPOLL
+#cmakedefine HAVE_IO_URING
 #cmakedefine HAVE_KQUEUE
 #cmakedefine HAVE_DLADDR
 #cmakedefine HAVE_POSIX_FADVISE
@@ -54,6 +56,11 @@
 #cmakedefine HAVE_BUILTIN_ADD_OVERFLOW
 #cmakedefine HAVE_BUILTIN_FPCLASSIFY
 
+/* Functions targeting instruction sets not enabled by default */
+#cmakedefine HAVE_TARGET_AVX2
+#cmakedefine HAVE_TARGET_AVX512F
+#cmakedefine HAVE_TARGET_SHA
+
 /* C11 _Static_assert() */
 #cmakedefine HAVE_STATIC_ASSERT
 
@@ -61,8 +68,15 @@
 #cmakedefine HAVE_LUA
 #cmakedefine HAVE_BROTLI
 #cmakedefine HAVE_ZSTD
+#cmakedefine HAVE_SQLITE
+#cmakedefine HAVE_MYSQL
+#cmakedefine HAVE_LIBXCRYPT
+#cmakedefine HAVE_KTLS
 #cmakedefine HAVE_LIBUCONTEXT
 
 /* Valgrind support for coroutines */
 #cmakedefine HAVE_VALGRIND
 
+/* USDT probes; see lwan-probes.h */
+#cmakedefine HAVE_SYS_SDT_H
+
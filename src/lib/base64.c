@@ -11,6 +11,19 @@
 
 #include "base64.h"
 
+/* Most of the input is encoded or decoded by the widest routine the CPU
+ * supports, picked once at startup; those work on whole vectors, and only
+ * on characters in the alphabet when decoding, leaving the rest to the
+ * portable code.  The vectorized routines are based on the work by
+ * Wojciech Mula, Daniel Lemire, and Alfred Klomp. */
+#if defined(__x86_64__) && defined(HAVE_BUILTIN_CPU_INIT)
+#define HAVE_BASE64_SSSE3
+#if defined(HAVE_TARGET_AVX2)
+#define HAVE_BASE64_AVX2
+#endif
+#include <immintrin.h>
+#endif
+
 static const unsigned char base64_table[65] =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
@@ -45,6 +58,263 @@ static const unsigned char base64_decode_table[256] = {
     0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
     0x80, 0x80, 0x80, 0x80};
 
+static size_t
+encode_scalar(const unsigned char *src, size_t len, unsigned char *dst)
+{
+    size_t i = 0;
+
+    for (; i + 3 <= len; i += 3) {
+        *dst++ = base64_table[src[i] >> 2];
+        *dst++ = base64_table[((src[i] & 0x03) << 4) | (src[i + 1] >> 4)];
+        *dst++ = base64_table[((src[i + 1] & 0x0f) << 2) | (src[i + 2] >> 6)];
+        *dst++ = base64_table[src[i + 2] & 0x3f];
+    }
+
+    return i;
+}
+
+static size_t decode_scalar(const unsigned char *src,
+                            size_t len,
+                            unsigned char *dst,
+                            size_t dst_len)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= len && dst_len >= 3; i += 4, dst_len -= 3) {
+        const unsigned char a = base64_decode_table[src[i]];
+        const unsigned char b = base64_decode_table[src[i + 1]];
+        const unsigned char c = base64_decode_table[src[i + 2]];
+        const unsigned char d = base64_decode_table[src[i + 3]];
+
+        if ((a | b | c | d) & 0x80 || src[i + 2] == '=' || src[i + 3] == '=')
+            break;
+
+        *dst++ = (unsigned char)((a << 2) | (b >> 4));
+        *dst++ = (unsigned char)((b << 4) | (c >> 2));
+        *dst++ = (unsigned char)((c << 6) | d);
+    }
+
+    return i;
+}
+
+#if defined(HAVE_BASE64_SSSE3)
+/* Characters are obtained by adding an offset to each 6-bit index; the
+ * offset depends on the range the index is in, which is reduced to a
+ * number between 0 and 13 to look it up. */
+#define ENCODE_OFFSETS                                                         \
+    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,      \
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0
+
+/* When decoding, the low and high nibbles of each character are looked
+ * up in two tables whose entries have no bits in common only for the
+ * characters in the alphabet; the offset to get back its 6-bit value
+ * depends only on the high nibble, save for '/'. */
+#define DECODE_LUT_LO                                                          \
+    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a,    \
+        0x1b, 0x1b, 0x1b, 0x1a
+#define DECODE_LUT_HI                                                          \
+    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10,    \
+        0x10, 0x10, 0x10, 0x10
+#define DECODE_LUT_ROLL 0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+
+__attribute__((target("ssse3"))) static size_t
+encode_ssse3(const unsigned char *src, size_t len, unsigned char *dst)
+{
+    const __m128i spread =
+        _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m128i offsets = _mm_setr_epi8(ENCODE_OFFSETS);
+    size_t i = 0;
+
+    /* 12 bytes are encoded at a time, but 16 are loaded. */
+    for (; i + 16 <= len; i += 12, dst += 16) {
+        const __m128i in = _mm_shuffle_epi8(
+            _mm_loadu_si128((const __m128i *)(src + i)), spread);
+
+        /* Split every 3 bytes, spread over 4, into four 6-bit indices. */
+        const __m128i indices = _mm_or_si128(
+            _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+                            _mm_set1_epi32(0x04000040)),
+            _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+                            _mm_set1_epi32(0x01000010)));
+
+        __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+        range = _mm_or_si128(
+            range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices),
+                                 _mm_set1_epi8(13)));
+
+        _mm_storeu_si128((__m128i *)dst,
+                         _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, range)));
+    }
+
+    return i + encode_scalar(src + i, len - i, dst);
+}
+
+__attribute__((target("ssse3"))) static size_t
+decode_ssse3(const unsigned char *src,
+             size_t len,
+             unsigned char *dst,
+             size_t dst_len)
+{
+    const __m128i lut_lo = _mm_setr_epi8(DECODE_LUT_LO);
+    const __m128i lut_hi = _mm_setr_epi8(DECODE_LUT_HI);
+    const __m128i lut_roll = _mm_setr_epi8(DECODE_LUT_ROLL);
+    const __m128i pack =
+        _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t i = 0, o = 0;
+
+    /* 16 characters are decoded at a time, but 16 bytes are stored. */
+    for (; i + 16 <= len && o + 16 <= dst_len; i += 16, o += 12) {
+        const __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+        const __m128i hi_nibbles =
+            _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+        const __m128i lo_nibbles = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+        const __m128i invalid =
+            _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo_nibbles),
+                          _mm_shuffle_epi8(lut_hi, hi_nibbles));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(invalid, _mm_setzero_si128())) !=
+            0xffff)
+            break;
+
+        const __m128i roll = _mm_shuffle_epi8(
+            lut_roll,
+            _mm_add_epi8(_mm_cmpeq_epi8(in, _mm_set1_epi8('/')), hi_nibbles));
+
+        /* Merge pairs of 6-bit values, then pairs of pairs, leaving 3
+         * bytes in every 32-bit lane. */
+        __m128i out = _mm_maddubs_epi16(_mm_add_epi8(in, roll),
+                                        _mm_set1_epi32(0x01400140));
+        out = _mm_madd_epi16(out, _mm_set1_epi32(0x00011000));
+
+        _mm_storeu_si128((__m128i *)(dst + o), _mm_shuffle_epi8(out, pack));
+    }
+
+    return i + decode_scalar(src + i, len - i, dst + o, dst_len - o);
+}
+#endif
+
+#if defined(HAVE_BASE64_AVX2)
+__attribute__((target("avx2"))) static size_t
+encode_avx2(const unsigned char *src, size_t len, unsigned char *dst)
+{
+    const __m256i spread = _mm256_broadcastsi128_si256(
+        _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+    const __m256i offsets =
+        _mm256_broadcastsi128_si256(_mm_setr_epi8(ENCODE_OFFSETS));
+    size_t i = 0;
+
+    /* 24 bytes are encoded at a time, 12 in each half of the vector, but
+     * 28 are loaded. */
+    for (; i + 28 <= len; i += 24, dst += 32) {
+        const __m256i in = _mm256_shuffle_epi8(
+            _mm256_inserti128_si256(
+                _mm256_castsi128_si256(
+                    _mm_loadu_si128((const __m128i *)(src + i))),
+                _mm_loadu_si128((const __m128i *)(src + i + 12)), 1),
+            spread);
+
+        const __m256i indices = _mm256_or_si256(
+            _mm256_mulhi_epu16(
+                _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)),
+                _mm256_set1_epi32(0x04000040)),
+            _mm256_mullo_epi16(
+                _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)),
+                _mm256_set1_epi32(0x01000010)));
+
+        __m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        range = _mm256_or_si256(
+            range,
+            _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices),
+                             _mm256_set1_epi8(13)));
+
+        _mm256_storeu_si256(
+            (__m256i *)dst,
+            _mm256_add_epi8(indices, _mm256_shuffle_epi8(offsets, range)));
+    }
+
+    return i + encode_ssse3(src + i, len - i, dst);
+}
+
+__attribute__((target("avx2"))) static size_t
+decode_avx2(const unsigned char *src,
+            size_t len,
+            unsigned char *dst,
+            size_t dst_len)
+{
+    const __m256i lut_lo =
+        _mm256_broadcastsi128_si256(_mm_setr_epi8(DECODE_LUT_LO));
+    const __m256i lut_hi =
+        _mm256_broadcastsi128_si256(_mm_setr_epi8(DECODE_LUT_HI));
+    const __m256i lut_roll =
+        _mm256_broadcastsi128_si256(_mm_setr_epi8(DECODE_LUT_ROLL));
+    const __m256i pack = _mm256_broadcastsi128_si256(
+        _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    size_t i = 0, o = 0;
+
+    /* 32 characters are decoded at a time, but 32 bytes are stored. */
+    for (; i + 32 <= len && o + 32 <= dst_len; i += 32, o += 24) {
+        const __m256i in = _mm256_loadu_si256((const __m256i *)(src + i));
+        const __m256i hi_nibbles =
+            _mm256_and_si256(_mm256_srli_epi32(in, 4), _mm256_set1_epi8(0x0f));
+        const __m256i lo_nibbles = _mm256_and_si256(in, _mm256_set1_epi8(0x0f));
+        const __m256i invalid =
+            _mm256_and_si256(_mm256_shuffle_epi8(lut_lo, lo_nibbles),
+                             _mm256_shuffle_epi8(lut_hi, hi_nibbles));
+
+        if (_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(invalid, _mm256_setzero_si256())) != -1)
+            break;
+
+        const __m256i roll = _mm256_shuffle_epi8(
+            lut_roll, _mm256_add_epi8(
+                          _mm256_cmpeq_epi8(in, _mm256_set1_epi8('/')),
+                          hi_nibbles));
+
+        __m256i out = _mm256_maddubs_epi16(_mm256_add_epi8(in, roll),
+                                           _mm256_set1_epi32(0x01400140));
+        out = _mm256_madd_epi16(out, _mm256_set1_epi32(0x00011000));
+        out = _mm256_shuffle_epi8(out, pack);
+
+        /* Each half has 12 bytes; move them next to each other. */
+        _mm256_storeu_si256((__m256i *)(dst + o),
+                            _mm256_permutevar8x32_epi32(out, compact));
+    }
+
+    return i + decode_ssse3(src + i, len - i, dst + o, dst_len - o);
+}
+#endif
+
+size_t base64_get_kernels(struct base64_kernel kernels[static 3])
+{
+    size_t n = 0;
+
+#if defined(HAVE_BASE64_SSSE3)
+    __builtin_cpu_init();
+#endif
+#if defined(HAVE_BASE64_AVX2)
+    if (__builtin_cpu_supports("avx2"))
+        kernels[n++] = (struct base64_kernel){"avx2", encode_avx2, decode_avx2};
+#endif
+#if defined(HAVE_BASE64_SSSE3)
+    if (__builtin_cpu_supports("ssse3"))
+        kernels[n++] = (struct base64_kernel){"ssse3", encode_ssse3, decode_ssse3};
+#endif
+    kernels[n++] = (struct base64_kernel){"scalar", encode_scalar, decode_scalar};
+
+    return n;
+}
+
+static struct base64_kernel kernel = {"scalar", encode_scalar, decode_scalar};
+
+__attribute__((constructor)) static void initialize_base64_kernel(void)
+{
+    struct base64_kernel kernels[3];
+
+    base64_get_kernels(kernels);
+    kernel = kernels[0];
+}
+
 bool
 base64_validate(const unsigned char *src, size_t len)
 {
@@ -84,8 +354,8 @@ base64_encode(const unsigned char *src, size_t len, size_t *out_len)
         return NULL;
 
     end = src + len;
-    in = src;
-    pos = out;
+    in = src + kernel.encode(src, len, out);
+    pos = out + (size_t)(in - src) / 3 * 4;
     while (end - in >= 3) {
         *pos++ = base64_table[in[0] >> 2];
         *pos++ = base64_table[((in[0] & 0x03) << 4) | (in[1] >> 4)];
@@ -126,25 +396,33 @@ unsigned char *
 base64_decode(const unsigned char *src, size_t len, size_t *out_len)
 {
     unsigned char *out, *pos, block[4];
-    size_t i, count, olen;
+    size_t i, count, olen, decoded;
     int pad = 0;
 
-    count = 0;
-    for (i = 0; i < len; i++) {
+    /* Characters that aren't in the alphabet are ignored, so this might
+     * be a bit more than necessary; counting them beforehand would take
+     * another pass over the input. */
+    olen = (len / 4 * 3) + 1;
+    pos = out = malloc(olen);
+    if (out == NULL)
+        return NULL;
+
+    decoded = kernel.decode(src, len, out, olen);
+    pos += decoded / 4 * 3;
+
+    count = decoded;
+    for (i = decoded; i < len; i++) {
         if (base64_decode_table[src[i]] != 0x80)
             count++;
     }
 
-    if (count == 0 || count % 4)
-        return NULL;
-
-    olen = (count / 4 * 3) + 1;
-    pos = out = malloc(olen);
-    if (out == NULL)
+    if (count == 0 || count % 4) {
+        free(out);
         return NULL;
+    }
 
     count = 0;
-    for (i = 0; i < len; i++) {
+    for (i = decoded; i < len; i++) {
         unsigned char tmp = base64_decode_table[src[i]];
         if (tmp == 0x80)
             continue;
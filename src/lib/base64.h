@@ -15,3 +15,19 @@ static inline size_t base64_encoded_len(size_t decoded_len)
     /* This counts the padding bytes (by rounding to the next multiple of 4). */
     return ((4u * decoded_len / 3u) + 3u) & ~3u;
 }
+
+/* Exposed for handshake_bench: every routine that encodes or decodes
+ * most of the input that this CPU supports, the first being the one in
+ * use.  The encoder stops before the last partial group of 3 bytes, and
+ * the decoder at the first group of 4 characters with padding or with
+ * anything that isn't in the alphabet; both return how much of the
+ * input they went through. */
+struct base64_kernel {
+    const char *name;
+    size_t (*encode)(const unsigned char *src, size_t len, unsigned char *dst);
+    size_t (*decode)(const unsigned char *src,
+                     size_t len,
+                     unsigned char *dst,
+                     size_t dst_len);
+};
+size_t base64_get_kernels(struct base64_kernel kernels[static 3]);
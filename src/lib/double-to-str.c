@@ -0,0 +1,414 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+
+#include "lwan-private.h"
+
+#include "double-to-str.h"
+#include "int-to-str.h"
+
+/* Doubles are formatted with the shortest sequence of digits that reads
+ * back as the same value, using the Grisu2 algorithm by Florian Loitsch
+ * ("Printing Floating-Point Numbers Quickly and Accurately with
+ * Integers", PLDI 2010), as in Milo Yip's implementation in RapidJSON.
+ * The output always round-trips; for a tiny fraction of values, it has
+ * a digit more than strictly necessary.  Digits are laid out like
+ * JavaScript's Number.prototype.toString() does, which is what JSON
+ * consumers usually expect: 0.1, 1.5, 100, 1e+21, 1e-7.  That's unlike
+ * printf("%f"), which always printed 6 decimal places. */
+
+struct diy_fp {
+    uint64_t f;
+    int e;
+};
+
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS (0x3ff + DP_SIGNIFICAND_SIZE)
+#define DP_MIN_EXPONENT (-DP_EXPONENT_BIAS)
+#define DP_EXPONENT_MASK UINT64_C(0x7ff0000000000000)
+#define DP_SIGNIFICAND_MASK UINT64_C(0x000fffffffffffff)
+#define DP_HIDDEN_BIT UINT64_C(0x0010000000000000)
+
+/* Normalized approximations of 10^k, for k = -348, -340, ..., 340. */
+static const struct {
+    uint64_t f;
+    int16_t e;
+} cached_powers[] = {
+    {0xfa8fd5a0081c0288, -1220}, /* 1e-348 */
+    {0xbaaee17fa23ebf76, -1193}, /* 1e-340 */
+    {0x8b16fb203055ac76, -1166}, /* 1e-332 */
+    {0xcf42894a5dce35ea, -1140}, /* 1e-324 */
+    {0x9a6bb0aa55653b2d, -1113}, /* 1e-316 */
+    {0xe61acf033d1a45df, -1087}, /* 1e-308 */
+    {0xab70fe17c79ac6ca, -1060}, /* 1e-300 */
+    {0xff77b1fcbebcdc4f, -1034}, /* 1e-292 */
+    {0xbe5691ef416bd60c, -1007}, /* 1e-284 */
+    {0x8dd01fad907ffc3c, -980}, /* 1e-276 */
+    {0xd3515c2831559a83, -954}, /* 1e-268 */
+    {0x9d71ac8fada6c9b5, -927}, /* 1e-260 */
+    {0xea9c227723ee8bcb, -901}, /* 1e-252 */
+    {0xaecc49914078536d, -874}, /* 1e-244 */
+    {0x823c12795db6ce57, -847}, /* 1e-236 */
+    {0xc21094364dfb5637, -821}, /* 1e-228 */
+    {0x9096ea6f3848984f, -794}, /* 1e-220 */
+    {0xd77485cb25823ac7, -768}, /* 1e-212 */
+    {0xa086cfcd97bf97f4, -741}, /* 1e-204 */
+    {0xef340a98172aace5, -715}, /* 1e-196 */
+    {0xb23867fb2a35b28e, -688}, /* 1e-188 */
+    {0x84c8d4dfd2c63f3b, -661}, /* 1e-180 */
+    {0xc5dd44271ad3cdba, -635}, /* 1e-172 */
+    {0x936b9fcebb25c996, -608}, /* 1e-164 */
+    {0xdbac6c247d62a584, -582}, /* 1e-156 */
+    {0xa3ab66580d5fdaf6, -555}, /* 1e-148 */
+    {0xf3e2f893dec3f126, -529}, /* 1e-140 */
+    {0xb5b5ada8aaff80b8, -502}, /* 1e-132 */
+    {0x87625f056c7c4a8b, -475}, /* 1e-124 */
+    {0xc9bcff6034c13053, -449}, /* 1e-116 */
+    {0x964e858c91ba2655, -422}, /* 1e-108 */
+    {0xdff9772470297ebd, -396}, /* 1e-100 */
+    {0xa6dfbd9fb8e5b88f, -369}, /* 1e-92 */
+    {0xf8a95fcf88747d94, -343}, /* 1e-84 */
+    {0xb94470938fa89bcf, -316}, /* 1e-76 */
+    {0x8a08f0f8bf0f156b, -289}, /* 1e-68 */
+    {0xcdb02555653131b6, -263}, /* 1e-60 */
+    {0x993fe2c6d07b7fac, -236}, /* 1e-52 */
+    {0xe45c10c42a2b3b06, -210}, /* 1e-44 */
+    {0xaa242499697392d3, -183}, /* 1e-36 */
+    {0xfd87b5f28300ca0e, -157}, /* 1e-28 */
+    {0xbce5086492111aeb, -130}, /* 1e-20 */
+    {0x8cbccc096f5088cc, -103}, /* 1e-12 */
+    {0xd1b71758e219652c, -77}, /* 1e-4 */
+    {0x9c40000000000000, -50}, /* 1e4 */
+    {0xe8d4a51000000000, -24}, /* 1e12 */
+    {0xad78ebc5ac620000, 3}, /* 1e20 */
+    {0x813f3978f8940984, 30}, /* 1e28 */
+    {0xc097ce7bc90715b3, 56}, /* 1e36 */
+    {0x8f7e32ce7bea5c70, 83}, /* 1e44 */
+    {0xd5d238a4abe98068, 109}, /* 1e52 */
+    {0x9f4f2726179a2245, 136}, /* 1e60 */
+    {0xed63a231d4c4fb27, 162}, /* 1e68 */
+    {0xb0de65388cc8ada8, 189}, /* 1e76 */
+    {0x83c7088e1aab65db, 216}, /* 1e84 */
+    {0xc45d1df942711d9a, 242}, /* 1e92 */
+    {0x924d692ca61be758, 269}, /* 1e100 */
+    {0xda01ee641a708dea, 295}, /* 1e108 */
+    {0xa26da3999aef774a, 322}, /* 1e116 */
+    {0xf209787bb47d6b85, 348}, /* 1e124 */
+    {0xb454e4a179dd1877, 375}, /* 1e132 */
+    {0x865b86925b9bc5c2, 402}, /* 1e140 */
+    {0xc83553c5c8965d3d, 428}, /* 1e148 */
+    {0x952ab45cfa97a0b3, 455}, /* 1e156 */
+    {0xde469fbd99a05fe3, 481}, /* 1e164 */
+    {0xa59bc234db398c25, 508}, /* 1e172 */
+    {0xf6c69a72a3989f5c, 534}, /* 1e180 */
+    {0xb7dcbf5354e9bece, 561}, /* 1e188 */
+    {0x88fcf317f22241e2, 588}, /* 1e196 */
+    {0xcc20ce9bd35c78a5, 614}, /* 1e204 */
+    {0x98165af37b2153df, 641}, /* 1e212 */
+    {0xe2a0b5dc971f303a, 667}, /* 1e220 */
+    {0xa8d9d1535ce3b396, 694}, /* 1e228 */
+    {0xfb9b7cd9a4a7443c, 720}, /* 1e236 */
+    {0xbb764c4ca7a44410, 747}, /* 1e244 */
+    {0x8bab8eefb6409c1a, 774}, /* 1e252 */
+    {0xd01fef10a657842c, 800}, /* 1e260 */
+    {0x9b10a4e5e9913129, 827}, /* 1e268 */
+    {0xe7109bfba19c0c9d, 853}, /* 1e276 */
+    {0xac2820d9623bf429, 880}, /* 1e284 */
+    {0x80444b5e7aa7cf85, 907}, /* 1e292 */
+    {0xbf21e44003acdd2d, 933}, /* 1e300 */
+    {0x8e679c2f5e44ff8f, 960}, /* 1e308 */
+    {0xd433179d9c8cb841, 986}, /* 1e316 */
+    {0x9e19db92b4e31ba9, 1013}, /* 1e324 */
+    {0xeb96bf6ebadf77d9, 1039}, /* 1e332 */
+    {0xaf87023b9bf0ee6b, 1066}, /* 1e340 */
+};
+
+static const uint32_t powers_of_10[] = {
+    1,      10,      100,      1000,      10000,
+    100000, 1000000, 10000000, 100000000, 1000000000,
+};
+
+static ALWAYS_INLINE struct diy_fp diy_fp_from_bits(uint64_t bits)
+{
+    const int biased_e = (int)((bits & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE);
+    const uint64_t significand = bits & DP_SIGNIFICAND_MASK;
+
+    if (biased_e)
+        return (struct diy_fp){significand + DP_HIDDEN_BIT,
+                               biased_e - DP_EXPONENT_BIAS};
+
+    return (struct diy_fp){significand, DP_MIN_EXPONENT + 1};
+}
+
+static ALWAYS_INLINE struct diy_fp diy_fp_mul(struct diy_fp x, struct diy_fp y)
+{
+#if defined(__SIZEOF_INT128__)
+    const unsigned __int128 p = (unsigned __int128)x.f * y.f;
+    uint64_t h = (uint64_t)(p >> 64);
+
+    if ((uint64_t)p & (UINT64_C(1) << 63))
+        h++; /* Round */
+
+    return (struct diy_fp){h, x.e + y.e + 64};
+#else
+    const uint64_t M32 = UINT32_MAX;
+    const uint64_t a = x.f >> 32, b = x.f & M32;
+    const uint64_t c = y.f >> 32, d = y.f & M32;
+    const uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32);
+
+    tmp += UINT64_C(1) << 31; /* Round */
+
+    return (struct diy_fp){ac + (ad >> 32) + (bc >> 32) + (tmp >> 32),
+                           x.e + y.e + 64};
+#endif
+}
+
+static ALWAYS_INLINE struct diy_fp diy_fp_normalize(struct diy_fp x)
+{
+    const int s = __builtin_clzll(x.f);
+
+    return (struct diy_fp){x.f << s, x.e - s};
+}
+
+static ALWAYS_INLINE void normalized_boundaries(struct diy_fp v,
+                                                struct diy_fp *minus,
+                                                struct diy_fp *plus)
+{
+    struct diy_fp pl = diy_fp_normalize(
+        (struct diy_fp){(v.f << 1) + 1, v.e - 1});
+    struct diy_fp mi;
+
+    /* The lower boundary is closer if v is a power of two (other than the
+     * smallest normal). */
+    if (v.f == DP_HIDDEN_BIT)
+        mi = (struct diy_fp){(v.f << 2) - 1, v.e - 2};
+    else
+        mi = (struct diy_fp){(v.f << 1) - 1, v.e - 1};
+
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
+
+    *minus = mi;
+    *plus = pl;
+}
+
+static ALWAYS_INLINE struct diy_fp cached_power(int e, int *k)
+{
+    /* Find a power of ten that brings the exponent of the product to
+     * [-60, -32], so that digits can be generated with 64-bit integers. */
+    const double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int ik = (int)dk;
+
+    if (dk - ik > 0.0)
+        ik++;
+
+    const unsigned int index = (unsigned int)((ik >> 3) + 1);
+    *k = -(-348 + (int)(index << 3));
+
+    return (struct diy_fp){cached_powers[index].f, cached_powers[index].e};
+}
+
+static ALWAYS_INLINE int count_digits(uint32_t n)
+{
+    int digits = 1;
+
+    while (digits < 10 && n >= powers_of_10[digits])
+        digits++;
+
+    return digits;
+}
+
+static ALWAYS_INLINE void grisu_round(char *buffer,
+                                      int len,
+                                      uint64_t delta,
+                                      uint64_t rest,
+                                      uint64_t ten_kappa,
+                                      uint64_t wp_w)
+{
+    /* Move the last digit towards the value being formatted while the
+     * result is still within the boundaries. */
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        buffer[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static int digit_gen(struct diy_fp w,
+                     struct diy_fp mp,
+                     uint64_t delta,
+                     char *buffer,
+                     int *k)
+{
+    const struct diy_fp one = {UINT64_C(1) << -mp.e, mp.e};
+    const uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+    uint64_t p2 = mp.f & (one.f - 1);
+    int kappa = count_digits(p1);
+    int len = 0;
+
+    while (kappa > 0) {
+        const uint32_t d = p1 / powers_of_10[kappa - 1];
+
+        p1 %= powers_of_10[kappa - 1];
+        if (d || len)
+            buffer[len++] = (char)('0' + d);
+        kappa--;
+
+        const uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+        if (rest <= delta) {
+            *k += kappa;
+            grisu_round(buffer, len, delta, rest,
+                        (uint64_t)powers_of_10[kappa] << -one.e, wp_w);
+            return len;
+        }
+    }
+
+    while (true) {
+        p2 *= 10;
+        delta *= 10;
+
+        const char d = (char)(p2 >> -one.e);
+        if (d || len)
+            buffer[len++] = (char)('0' + d);
+        p2 &= one.f - 1;
+        kappa--;
+
+        if (p2 < delta) {
+            *k += kappa;
+            grisu_round(buffer, len, delta, p2, one.f,
+                        -kappa < 10 ? wp_w * powers_of_10[-kappa] : 0);
+            return len;
+        }
+    }
+}
+
+/* Fills `buffer` with the shortest digits of a positive, finite, non-zero
+ * value, returning how many there are; the value is digits * 10^k. */
+static int grisu2(uint64_t bits, char buffer[static 24], int *k)
+{
+    const struct diy_fp v = diy_fp_from_bits(bits);
+    struct diy_fp w_m, w_p;
+
+    normalized_boundaries(v, &w_m, &w_p);
+
+    const struct diy_fp c_mk = cached_power(w_p.e, k);
+    const struct diy_fp w = diy_fp_mul(diy_fp_normalize(v), c_mk);
+    struct diy_fp wp = diy_fp_mul(w_p, c_mk);
+    struct diy_fp wm = diy_fp_mul(w_m, c_mk);
+
+    wm.f++;
+    wp.f--;
+
+    return digit_gen(w, wp, wp.f - wm.f, buffer, k);
+}
+
+static char *write_exponent(int e, char *p)
+{
+    *p++ = 'e';
+    if (e < 0) {
+        *p++ = '-';
+        e = -e;
+    } else {
+        *p++ = '+';
+    }
+
+    if (e >= 100) {
+        *p++ = (char)('0' + e / 100);
+        e %= 100;
+        memcpy(p, uint_to_string_2_digits((size_t)e), 2);
+        return p + 2;
+    }
+    if (e >= 10) {
+        memcpy(p, uint_to_string_2_digits((size_t)e), 2);
+        return p + 2;
+    }
+
+    *p++ = (char)('0' + e);
+    return p;
+}
+
+size_t double_to_string(double value,
+                        char buffer[static DOUBLE_TO_STR_BUFFER_SIZE])
+{
+    char digits[24];
+    uint64_t bits;
+    char *p = buffer;
+    int len, k, kk;
+
+    memcpy(&bits, &value, sizeof(bits));
+
+    if (UNLIKELY((bits & DP_EXPONENT_MASK) == DP_EXPONENT_MASK)) {
+        /* Same as printf() */
+        if (bits & DP_SIGNIFICAND_MASK)
+            return (size_t)(stpcpy(buffer, "nan") - buffer);
+        if (bits >> 63)
+            return (size_t)(stpcpy(buffer, "-inf") - buffer);
+        return (size_t)(stpcpy(buffer, "inf") - buffer);
+    }
+
+    if (bits >> 63) {
+        *p++ = '-';
+        bits &= ~(UINT64_C(1) << 63);
+    }
+
+    if (!bits) {
+        *p++ = '0';
+        *p = '\0';
+        return (size_t)(p - buffer);
+    }
+
+    len = grisu2(bits, digits, &k);
+    kk = len + k; /* 10^(kk - 1) <= value < 10^kk */
+
+    if (k >= 0 && kk <= 21) {
+        /* 1234e7 -> 12340000000 */
+        p = mempcpy(p, digits, (size_t)len);
+        memset(p, '0', (size_t)k);
+        p += k;
+    } else if (kk > 0 && kk <= 21) {
+        /* 1234e-2 -> 12.34 */
+        p = mempcpy(p, digits, (size_t)kk);
+        *p++ = '.';
+        p = mempcpy(p, digits + kk, (size_t)(len - kk));
+    } else if (kk > -6 && kk <= 0) {
+        /* 1234e-6 -> 0.001234 */
+        *p++ = '0';
+        *p++ = '.';
+        memset(p, '0', (size_t)-kk);
+        p += -kk;
+        p = mempcpy(p, digits, (size_t)len);
+    } else {
+        /* 1234e30 -> 1.234e+33 */
+        *p++ = digits[0];
+        if (len > 1) {
+            *p++ = '.';
+            p = mempcpy(p, digits + 1, (size_t)(len - 1));
+        }
+        p = write_exponent(kk - 1, p);
+    }
+
+    *p = '\0';
+    return (size_t)(p - buffer);
+}
@@ -32,52 +32,68 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "lwan-private.h"
 #include "hash.h"
 #include "murmur3.h"
 
-struct hash_bucket {
-    void **keys;
-    void **values;
-    unsigned int *hashvals;
-
-    unsigned int used;
-    unsigned int total;
+/* This is an open-addressing hash table, with a layout similar to
+ * Abseil's "Swiss tables": slots are grouped in runs of GROUP_SIZE, and
+ * each slot has a control byte in a separate array.  A control byte is
+ * either CTRL_EMPTY, CTRL_DELETED (a tombstone left by hash_del()), or,
+ * for slots that are in use, 7 bits of the hash value.  A whole group of
+ * control bytes can be compared against those 7 bits with a couple of
+ * SIMD instructions, so most slots are discarded without looking at
+ * them; the full hash value is stored in the slot as well, and is
+ * compared before the keys are, which avoids most string comparisons.
+ *
+ * Groups are probed in a triangular sequence, which visits every group
+ * once, as the number of groups is a power of 2.  A probe sequence
+ * stops at the first group with an empty slot. */
+
+struct hash_slot {
+    void *key;
+    void *value;
+    unsigned int hashval;
 };
 
 struct hash {
     unsigned int count;
-    unsigned int n_buckets_mask;
+    unsigned int n_deleted;
+    unsigned int n_slots_mask;
 
     unsigned (*hash_value)(const void *key);
     int (*key_equal)(const void *k1, const void *k2);
     void (*free_value)(void *value);
     void (*free_key)(void *value);
 
-    struct hash_bucket *buckets;
+    int8_t *ctrl;
+    struct hash_slot *slots;
 };
 
 struct hash_entry {
     void **key;
     void **value;
-    unsigned int *hashval;
 
     /* Only set when adding a new entry if it was already in the
      * hash table -- always 0/false otherwise. */
     bool existing;
 };
 
-#define MIN_BUCKETS 64
+#define CTRL_EMPTY ((int8_t)0x80)
+#define CTRL_DELETED ((int8_t)0xfe)
 
-/* Due to rehashing heuristics, most hash tables won't have more than 4
- * entries in each bucket.  Use a conservative allocation threshold to
- * curb wasteful allocations */
-#define STEPS 4
+#define GROUP_SIZE 16
+#define MIN_SLOTS 16
 
 #define DEFAULT_ODD_CONSTANT 0x27d4eb2d
 
-static_assert((MIN_BUCKETS & (MIN_BUCKETS - 1)) == 0,
-              "Bucket size is power of 2");
+static_assert((MIN_SLOTS & (MIN_SLOTS - 1)) == 0,
+              "Number of slots is power of 2");
+static_assert(MIN_SLOTS >= GROUP_SIZE, "Tables have at least one group");
 
 static inline unsigned int hash_int_shift_mult(const void *keyptr);
 
@@ -85,30 +101,62 @@ static unsigned int odd_constant = DEFAULT_ODD_CONSTANT;
 static unsigned (*hash_str)(const void *key) = murmur3_simple;
 static unsigned (*hash_int)(const void *key) = hash_int_shift_mult;
 
-static bool resize_bucket(struct hash_bucket *bucket, unsigned int new_size)
+/* Each of these return a mask with bit N set if the control byte for
+ * the Nth slot in the group matches. */
+#if defined(__SSE2__)
+static inline unsigned int group_match(const int8_t *ctrl, int8_t tag)
 {
-    void **new_keys;
-    void **new_values;
-    unsigned int *new_hashvals;
+    __m128i group = _mm_load_si128((const __m128i *)ctrl);
 
-    new_keys = reallocarray(bucket->keys, new_size, STEPS * sizeof(void *));
-    new_values = reallocarray(bucket->values, new_size, STEPS * sizeof(void *));
-    new_hashvals =
-        reallocarray(bucket->hashvals, new_size, STEPS * sizeof(unsigned int));
+    return (unsigned int)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+}
 
-    if (new_keys)
-        bucket->keys = new_keys;
-    if (new_values)
-        bucket->values = new_values;
-    if (new_hashvals)
-        bucket->hashvals = new_hashvals;
+static inline unsigned int group_match_free(const int8_t *ctrl)
+{
+    /* Both CTRL_EMPTY and CTRL_DELETED have the sign bit set. */
+    return (unsigned int)_mm_movemask_epi8(
+        _mm_load_si128((const __m128i *)ctrl));
+}
+#else
+static inline unsigned int group_match(const int8_t *ctrl, int8_t tag)
+{
+    unsigned int mask = 0;
 
-    if (new_keys && new_values && new_hashvals) {
-        bucket->total = new_size * STEPS;
-        return true;
-    }
+    for (unsigned int i = 0; i < GROUP_SIZE; i++)
+        mask |= (unsigned int)(ctrl[i] == tag) << i;
 
-    return false;
+    return mask;
+}
+
+static inline unsigned int group_match_free(const int8_t *ctrl)
+{
+    unsigned int mask = 0;
+
+    for (unsigned int i = 0; i < GROUP_SIZE; i++)
+        mask |= (unsigned int)(ctrl[i] < 0) << i;
+
+    return mask;
+}
+#endif
+
+static ALWAYS_INLINE int8_t hash_tag(unsigned int hashval)
+{
+    /* The lower bits select the group, so use the upper ones here. */
+    return (int8_t)(hashval >> 25);
+}
+
+static ALWAYS_INLINE unsigned int hash_first_group(const struct hash *hash,
+                                                   unsigned int hashval)
+{
+    return hashval & hash->n_slots_mask & ~(GROUP_SIZE - 1u);
+}
+
+static ALWAYS_INLINE unsigned int
+hash_next_group(const struct hash *hash, unsigned int pos, unsigned int *stride)
+{
+    *stride += GROUP_SIZE;
+    return (pos + *stride) & hash->n_slots_mask;
 }
 
 static unsigned int get_random_unsigned(void)
@@ -212,6 +260,7 @@ __attribute__((constructor(65535))) static void initialize_odd_constant(void)
 #endif
 }
 
+
 static inline int hash_int_key_equal(const void *k1, const void *k2)
 {
     return k1 == k2;
@@ -219,6 +268,30 @@ static inline int hash_int_key_equal(const void *k1, const void *k2)
 
 static void no_op(void *arg __attribute__((unused))) {}
 
+static bool hash_alloc_slots(struct hash *hash, unsigned int n_slots)
+{
+    int8_t *ctrl = lwan_aligned_alloc(n_slots, GROUP_SIZE);
+    struct hash_slot *slots;
+
+    if (!ctrl)
+        return false;
+
+    slots = reallocarray(NULL, n_slots, sizeof(*slots));
+    if (!slots) {
+        free(ctrl);
+        return false;
+    }
+
+    memset(ctrl, CTRL_EMPTY, n_slots);
+
+    hash->ctrl = ctrl;
+    hash->slots = slots;
+    hash->n_slots_mask = n_slots - 1;
+    hash->n_deleted = 0;
+
+    return true;
+}
+
 static struct hash *
 hash_internal_new(unsigned int (*hash_value)(const void *key),
                   int (*key_equal)(const void *k1, const void *k2),
@@ -230,8 +303,7 @@ hash_internal_new(unsigned int (*hash_value)(const void *key),
     if (hash == NULL)
         return NULL;
 
-    hash->buckets = calloc(MIN_BUCKETS, sizeof(struct hash_bucket));
-    if (hash->buckets == NULL) {
+    if (!hash_alloc_slots(hash, MIN_SLOTS)) {
         free(hash);
         return NULL;
     }
@@ -242,7 +314,6 @@ hash_internal_new(unsigned int (*hash_value)(const void *key),
     hash->free_value = free_value;
     hash->free_key = free_key;
 
-    hash->n_buckets_mask = MIN_BUCKETS - 1;
     hash->count = 0;
 
     return hash;
@@ -265,167 +336,172 @@ struct hash *hash_str_new(void (*free_key)(void *value),
 }
 
 static __attribute__((pure)) inline unsigned int
-hash_n_buckets(const struct hash *hash)
+hash_n_slots(const struct hash *hash)
 {
-    return hash->n_buckets_mask + 1;
+    return hash->n_slots_mask + 1;
 }
 
 void hash_free(struct hash *hash)
 {
-    struct hash_bucket *bucket, *bucket_end;
-
     if (hash == NULL)
         return;
 
-    bucket = hash->buckets;
-    bucket_end = hash->buckets + hash_n_buckets(hash);
-    for (; bucket < bucket_end; bucket++) {
-        for (unsigned int entry = 0; entry < bucket->used; entry++) {
-            hash->free_value(bucket->values[entry]);
-            hash->free_key(bucket->keys[entry]);
-        }
-        free(bucket->keys);
-        free(bucket->values);
-        free(bucket->hashvals);
+    for (unsigned int i = 0; i < hash_n_slots(hash); i++) {
+        if (hash->ctrl[i] < 0)
+            continue;
+
+        hash->free_value(hash->slots[i].value);
+        hash->free_key(hash->slots[i].key);
     }
-    free(hash->buckets);
+
+    free(hash->ctrl);
+    free(hash->slots);
     free(hash);
 }
 
-static struct hash_entry hash_add_entry_hashed(struct hash *hash,
-                                               const void *key,
-                                               unsigned int hashval)
+static inline struct hash_slot *
+hash_find_slot(const struct hash *hash, const void *key, unsigned int hashval)
 {
-    unsigned int pos = hashval & hash->n_buckets_mask;
-    struct hash_bucket *bucket = hash->buckets + pos;
-    unsigned int entry;
-    bool existing = false;
+    const int8_t tag = hash_tag(hashval);
+    unsigned int pos = hash_first_group(hash, hashval);
+    unsigned int stride = 0;
 
-    if (bucket->used + 1 >= bucket->total) {
-        unsigned int new_bucket_total;
+    while (true) {
+        const int8_t *ctrl = hash->ctrl + pos;
 
-        if (__builtin_add_overflow(bucket->total, 1, &new_bucket_total))
-            return (struct hash_entry) {};
+        for (unsigned int match = group_match(ctrl, tag); match;
+             match &= match - 1) {
+            struct hash_slot *slot =
+                &hash->slots[pos + (unsigned int)__builtin_ctz(match)];
 
-        if (!resize_bucket(bucket, new_bucket_total))
-            return (struct hash_entry) {};
-    }
-
-    for (entry = 0; entry < bucket->used; entry++) {
-        if (hashval != bucket->hashvals[entry])
-            continue;
-        if (hash->key_equal(key, bucket->keys[entry])) {
-            existing = true;
-            goto done;
+            if (slot->hashval == hashval && hash->key_equal(key, slot->key))
+                return slot;
         }
-    }
 
-    entry = bucket->used;
-
-    bucket->keys[entry] = NULL;
-    bucket->values[entry] = NULL;
-    bucket->hashvals[entry] = hashval;
-
-    bucket->used++;
-    hash->count++;
+        if (LIKELY(group_match(ctrl, CTRL_EMPTY)))
+            return NULL;
 
-done:
-    return (struct hash_entry){
-        .key = &bucket->keys[entry],
-        .value = &bucket->values[entry],
-        .hashval = &bucket->hashvals[entry],
-        .existing = existing,
-    };
+        pos = hash_next_group(hash, pos, &stride);
+    }
 }
 
-static void rehash(struct hash *hash, unsigned int new_bucket_size)
+static unsigned int hash_find_free_slot(const struct hash *hash,
+                                        unsigned int hashval)
 {
-    struct hash_bucket *buckets = calloc(new_bucket_size, sizeof(*buckets));
-    const unsigned int n_buckets = hash_n_buckets(hash);
-    struct hash hash_copy = *hash;
+    unsigned int pos = hash_first_group(hash, hashval);
+    unsigned int stride = 0;
 
-    assert((new_bucket_size & (new_bucket_size - 1)) == 0);
-    assert(hash_n_buckets(hash) != new_bucket_size);
+    /* Load factor is kept under 7/8 (counting tombstones), so there's
+     * always a free slot somewhere. */
+    while (true) {
+        unsigned int match = group_match_free(hash->ctrl + pos);
 
-    if (buckets == NULL)
-        return;
+        if (LIKELY(match))
+            return pos + (unsigned int)__builtin_ctz(match);
 
-    hash_copy.count = 0;
-    hash_copy.n_buckets_mask = new_bucket_size - 1;
-    hash_copy.buckets = buckets;
-
-    struct hash_bucket *bucket;
-    struct hash_bucket *bucket_end = hash->buckets + n_buckets;
-    for (bucket = hash->buckets; bucket < bucket_end; bucket++) {
-        for (unsigned int old = 0; old < bucket->used; old++) {
-            struct hash_entry new =
-                hash_add_entry_hashed(&hash_copy,
-                                      bucket->keys[old],
-                                      bucket->hashvals[old]);
-            if (UNLIKELY(!new.key))
-                goto fail;
-
-            *new.key = bucket->keys[old];
-            *new.value = bucket->values[old];
-        }
+        pos = hash_next_group(hash, pos, &stride);
     }
+}
 
-    /* Original table must remain untouched in the event resizing fails:
-     * previous loop may return early on allocation failure, so can't free
-     * bucket entry arrays there.  */
-    for (bucket = hash->buckets; bucket < bucket_end; bucket++) {
-        free(bucket->keys);
-        free(bucket->values);
-        free(bucket->hashvals);
-    }
-    free(hash->buckets);
+static bool rehash(struct hash *hash, unsigned int new_n_slots)
+{
+    const unsigned int n_slots = hash_n_slots(hash);
+    int8_t *old_ctrl = hash->ctrl;
+    struct hash_slot *old_slots = hash->slots;
 
-    hash->buckets = buckets;
-    hash->n_buckets_mask = new_bucket_size - 1;
+    assert((new_n_slots & (new_n_slots - 1)) == 0);
+    assert(new_n_slots >= MIN_SLOTS);
 
-    assert(hash_copy.count == hash->count);
+    /* Original table remains untouched in the event resizing fails. */
+    if (!hash_alloc_slots(hash, new_n_slots))
+        return false;
 
-    return;
+    for (unsigned int i = 0; i < n_slots; i++) {
+        if (old_ctrl[i] < 0)
+            continue;
 
-fail:
-    for (bucket_end = bucket, bucket = hash->buckets; bucket < bucket_end;
-         bucket++) {
-        free(bucket->keys);
-        free(bucket->values);
-        free(bucket->hashvals);
+        unsigned int new = hash_find_free_slot(hash, old_slots[i].hashval);
+        hash->ctrl[new] = old_ctrl[i];
+        hash->slots[new] = old_slots[i];
     }
 
-    free(buckets);
-}
-
-static struct hash_entry hash_add_entry(struct hash *hash, const void *key)
-{
-    unsigned int hashval = hash->hash_value(key);
+    free(old_ctrl);
+    free(old_slots);
 
-    return hash_add_entry_hashed(hash, key, hashval);
+    return true;
 }
 
 static inline bool need_rehash_grow(const struct hash *hash)
 {
-    /* The heuristic to rehash and grow the number of buckets is if there's
-     * more than 16 entries per bucket on average.  This is the number of
-     * elements in the hashvals array that would fit in a single cache line. */
-    return hash->count > hash_n_buckets(hash) * 16;
+    /* Tombstones make probe sequences longer just like slots in use do,
+     * so they're accounted for here; they're all gone after rehashing. */
+    const unsigned int n_slots = hash_n_slots(hash);
+
+    return hash->count + hash->n_deleted >= n_slots - n_slots / 8;
 }
 
 static inline bool need_rehash_shrink(const struct hash *hash)
 {
-    /* A hash table will be shrunk if, on average, more than 50% of its
-     * buckets are empty, but will never have less than MIN_BUCKETS buckets. */
-    const unsigned int n_buckets = hash_n_buckets(hash);
+    /* A hash table will be shrunk if less than 1/8 of its slots are in
+     * use, but will never have less than MIN_SLOTS slots. */
+    const unsigned int n_slots = hash_n_slots(hash);
 
-    if (n_buckets <= MIN_BUCKETS)
+    if (n_slots <= MIN_SLOTS)
         return false;
 
-    if (hash->count > n_buckets / 2)
-        return false;
+    return hash->count < n_slots / 8;
+}
 
-    return true;
+static struct hash_entry
+hash_add_entry(struct hash *hash, const void *key, unsigned int hashval)
+{
+    struct hash_slot *slot = hash_find_slot(hash, key, hashval);
+    unsigned int pos;
+
+    if (slot) {
+        return (struct hash_entry){
+            .key = &slot->key,
+            .value = &slot->value,
+            .existing = true,
+        };
+    }
+
+    if (need_rehash_grow(hash)) {
+        const unsigned int n_slots = hash_n_slots(hash);
+        unsigned int new_n_slots = n_slots;
+
+        /* If most of the load is due to tombstones, rehashing to a table
+         * of the same size is sufficient to get rid of them. */
+        if (hash->count >= n_slots / 2 &&
+            __builtin_mul_overflow(n_slots, 2, &new_n_slots)) {
+            errno = EOVERFLOW;
+            return (struct hash_entry){};
+        }
+
+        if (!rehash(hash, new_n_slots) &&
+            hash->count + hash->n_deleted + 1 >= n_slots) {
+            /* Couldn't rehash, and using up this slot would leave no
+             * empty slots to terminate probe sequences. */
+            errno = ENOMEM;
+            return (struct hash_entry){};
+        }
+    }
+
+    pos = hash_find_free_slot(hash, hashval);
+    if (hash->ctrl[pos] == CTRL_DELETED)
+        hash->n_deleted--;
+    hash->ctrl[pos] = hash_tag(hashval);
+    hash->count++;
+
+    slot = &hash->slots[pos];
+    slot->key = NULL;
+    slot->value = NULL;
+    slot->hashval = hashval;
+
+    return (struct hash_entry){
+        .key = &slot->key,
+        .value = &slot->value,
+    };
 }
 
 /*
@@ -436,7 +512,7 @@ static inline bool need_rehash_shrink(const struct hash *hash)
  */
 int hash_add(struct hash *hash, const void *key, const void *value)
 {
-    struct hash_entry entry = hash_add_entry(hash, key);
+    struct hash_entry entry = hash_add_entry(hash, key, hash->hash_value(key));
 
     if (!entry.key)
         return -errno;
@@ -448,16 +524,28 @@ int hash_add(struct hash *hash, const void *key, const void *value)
     *entry.key = (void *)key;
     *entry.value = (void *)value;
 
-    if (need_rehash_grow(hash))
-        rehash(hash, hash_n_buckets(hash) * 2);
-
     return 0;
 }
 
 /* similar to hash_add(), but fails if key already exists */
 int hash_add_unique(struct hash *hash, const void *key, const void *value)
 {
-    struct hash_entry entry = hash_add_entry(hash, key);
+    return hash_add_unique_hashed(hash, key, value, hash->hash_value(key));
+}
+
+/* similar to hash_add_unique(), but with a hash value previously obtained
+ * from hash_str_value() or hash_int_value(), depending on the kind of
+ * hash table */
+int hash_add_unique_hashed(struct hash *hash,
+                           const void *key,
+                           const void *value,
+                           unsigned int hashval)
+{
+    struct hash_entry entry;
+
+    assert(hashval == hash->hash_value(key));
+
+    entry = hash_add_entry(hash, key, hashval);
 
     if (!entry.key)
         return -errno;
@@ -467,88 +555,62 @@ int hash_add_unique(struct hash *hash, const void *key, const void *value)
     *entry.key = (void *)key;
     *entry.value = (void *)value;
 
-    if (need_rehash_grow(hash))
-        rehash(hash, hash_n_buckets(hash) * 2);
-
     return 0;
 }
 
-static inline struct hash_entry
-hash_find_entry(const struct hash *hash, const char *key, unsigned int hashval)
+void *hash_find(const struct hash *hash, const void *key)
 {
-    unsigned int pos = hashval & hash->n_buckets_mask;
-    const struct hash_bucket *bucket = hash->buckets + pos;
-
-    for (unsigned int entry = 0; entry < bucket->used; entry++) {
-        if (hashval != bucket->hashvals[entry])
-            continue;
-        if (hash->key_equal(key, bucket->keys[entry])) {
-            return (struct hash_entry){
-                .key = &bucket->keys[entry],
-                .value = &bucket->values[entry],
-                .hashval = &bucket->hashvals[entry],
-            };
-        }
-    }
+    const struct hash_slot *slot =
+        hash_find_slot(hash, key, hash->hash_value(key));
 
-    return (struct hash_entry){};
+    return slot ? slot->value : NULL;
 }
 
-void *hash_find(const struct hash *hash, const void *key)
+/* similar to hash_find(), but with a hash value previously obtained from
+ * hash_str_value() or hash_int_value(), depending on the kind of hash
+ * table.  Useful when the same key is looked up in more than one table. */
+void *hash_find_hashed(const struct hash *hash,
+                       const void *key,
+                       unsigned int hashval)
 {
-    struct hash_entry entry =
-        hash_find_entry(hash, key, hash->hash_value(key));
+    const struct hash_slot *slot;
+
+    assert(hashval == hash->hash_value(key));
 
-    return entry.key ? *entry.value : NULL;
+    slot = hash_find_slot(hash, key, hashval);
+    return slot ? slot->value : NULL;
 }
 
+unsigned int hash_str_value(const char *key) { return hash_str(key); }
+
+unsigned int hash_int_value(const void *key) { return hash_int(key); }
+
 int hash_del(struct hash *hash, const void *key)
 {
-    unsigned int hashval = hash->hash_value(key);
-    unsigned int pos = hashval & hash->n_buckets_mask;
-    struct hash_bucket *bucket = hash->buckets + pos;
+    struct hash_slot *slot = hash_find_slot(hash, key, hash->hash_value(key));
+    unsigned int pos;
 
-    struct hash_entry entry = hash_find_entry(hash, key, hashval);
-    if (entry.key == NULL)
+    if (slot == NULL)
         return -ENOENT;
 
-    hash->free_value(*entry.value);
-    hash->free_key(*entry.key);
-
-    if (bucket->used > 1) {
-        /* Instead of compacting the bucket array by moving elements, just copy
-         * over the last element on top of the element being removed.  This
-         * changes the ordering inside the bucket array, but it's much more
-         * efficient, as it always has to copy exactly at most 1 element instead
-         * of potentially bucket->used elements. */
-        void *last_key = &bucket->keys[bucket->used - 1];
-
-        /* FIXME: Is comparing these pointers UB after calling free_key()? */
-        if (entry.key != last_key) {
-            *entry.key = last_key;
-            *entry.value = bucket->values[bucket->used - 1];
-            *entry.hashval = bucket->hashvals[bucket->used - 1];
-        }
-    }
+    hash->free_value(slot->value);
+    hash->free_key(slot->key);
 
-    bucket->used--;
-    hash->count--;
-
-    if (need_rehash_shrink(hash)) {
-        rehash(hash, hash_n_buckets(hash) / 2);
+    /* If there's an empty slot in this group, no probe sequence has ever
+     * gone past it, so this slot can be marked as empty rather than
+     * leaving a tombstone behind. */
+    pos = (unsigned int)(slot - hash->slots);
+    if (group_match(hash->ctrl + (pos & ~(GROUP_SIZE - 1u)), CTRL_EMPTY)) {
+        hash->ctrl[pos] = CTRL_EMPTY;
     } else {
-        unsigned int steps_used = bucket->used / STEPS;
-        unsigned int steps_total = bucket->total / STEPS;
+        hash->ctrl[pos] = CTRL_DELETED;
+        hash->n_deleted++;
+    }
 
-        if (steps_used + 1 < steps_total) {
-            unsigned int new_total;
+    hash->count--;
 
-            if (__builtin_add_overflow(steps_used, 1, &new_total))
-                return -EOVERFLOW;
-
-            resize_bucket(bucket, new_total);
-        }
-    }
+    if (need_rehash_shrink(hash))
+        rehash(hash, hash_n_slots(hash) / 2);
 
     return 0;
 }
@@ -558,38 +620,29 @@ unsigned int hash_get_count(const struct hash *hash) { return hash->count; }
 void hash_iter_init(const struct hash *hash, struct hash_iter *iter)
 {
     iter->hash = hash;
-    iter->bucket = 0;
-    iter->entry = -1;
+    iter->slot = 0;
 }
 
 bool hash_iter_next(struct hash_iter *iter,
                     const void **key,
                     const void **value)
 {
-    const struct hash_bucket *b = iter->hash->buckets + iter->bucket;
-
-    iter->entry++;
+    const struct hash *hash = iter->hash;
 
-    if ((unsigned int)iter->entry >= b->used) {
-        unsigned int n_buckets = hash_n_buckets(iter->hash);
+    for (; iter->slot < hash_n_slots(hash); iter->slot++) {
+        const struct hash_slot *slot = &hash->slots[iter->slot];
 
-        iter->entry = 0;
-
-        for (iter->bucket++; iter->bucket < n_buckets; iter->bucket++) {
-            b = iter->hash->buckets + iter->bucket;
+        if (hash->ctrl[iter->slot] < 0)
+            continue;
 
-            if (b->used > 0)
-                break;
-        }
+        if (value != NULL)
+            *value = slot->value;
+        if (key != NULL)
+            *key = slot->key;
 
-        if (iter->bucket >= n_buckets)
-            return false;
+        iter->slot++;
+        return true;
     }
 
-    if (value != NULL)
-        *value = b->values[iter->entry];
-    if (key != NULL)
-        *key = b->keys[iter->entry];
-
-    return true;
+    return false;
 }
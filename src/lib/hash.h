@@ -7,8 +7,7 @@ struct hash;
 
 struct hash_iter {
     const struct hash *hash;
-    unsigned int bucket;
-    int entry;
+    unsigned int slot;
 };
 
 struct hash *hash_int_new(void (*free_key)(void *value),
@@ -21,6 +20,17 @@ int hash_add_unique(struct hash *hash, const void *key, const void *value);
 int hash_del(struct hash *hash, const void *key);
 void *hash_find(const struct hash *hash, const void *key);
 unsigned int hash_get_count(const struct hash *hash);
+
+unsigned int hash_str_value(const char *key);
+unsigned int hash_int_value(const void *key);
+int hash_add_unique_hashed(struct hash *hash,
+                           const void *key,
+                           const void *value,
+                           unsigned int hashval);
+void *hash_find_hashed(const struct hash *hash,
+                       const void *key,
+                       unsigned int hashval);
+
 void hash_iter_init(const struct hash *hash, struct hash_iter *iter);
 bool hash_iter_next(struct hash_iter *iter,
                     const void **key,
@@ -68,6 +68,50 @@ ALWAYS_INLINE char *uint_to_string(size_t value,
     return dst + next - 1;
 }
 
+ALWAYS_INLINE size_t uint_count_digits(size_t value)
+{
+    size_t n = 1;
+
+    while (true) {
+        if (value < 10)
+            return n;
+        if (value < 100)
+            return n + 1;
+        if (value < 1000)
+            return n + 2;
+        if (value < 10000)
+            return n + 3;
+
+        value /= 10000;
+        n += 4;
+    }
+}
+
+/* Writes exactly `n_digits` digits (as counted by uint_count_digits()),
+ * without a NUL terminator, so that numbers can be written straight into
+ * the buffer they're being appended to instead of being copied there. */
+ALWAYS_INLINE void uint_to_string_n(size_t value, char *dst, size_t n_digits)
+{
+    char *p = dst + n_digits;
+
+    while (value >= 100) {
+        const uint32_t i = (uint32_t)((value % 100) * 2);
+        value /= 100;
+        *--p = digits[i + 1];
+        *--p = digits[i];
+    }
+
+    if (value < 10) {
+        *--p = (char)('0' + (uint32_t)value);
+    } else {
+        const uint32_t i = (uint32_t)value * 2;
+        *--p = digits[i + 1];
+        *--p = digits[i];
+    }
+
+    assert(p == dst);
+}
+
 ALWAYS_INLINE char *int_to_string(ssize_t value,
                                   char dst[static INT_TO_STR_BUFFER_SIZE],
                                   size_t *length_out)
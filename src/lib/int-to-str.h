@@ -31,3 +31,6 @@ char *uint_to_string(size_t value,
                      size_t *len);
 
 const char *uint_to_string_2_digits(size_t value) __attribute__((pure));
+
+size_t uint_count_digits(size_t value) __attribute__((pure));
+void uint_to_string_n(size_t value, char *dst, size_t n_digits);
@@ -0,0 +1,1671 @@
+/*
+ * Copyright (c) 2017 Intel Corporation
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+#include "lwan-private.h"
+#include "int-to-str.h"
+
+struct token {
+    enum json_tokens type;
+    char *start;
+    char *end;
+    bool escaped;
+};
+
+struct lexer {
+    void *(*state)(struct lexer *lexer);
+    char *start;
+    char *pos;
+    char *end;
+    struct token token;
+};
+
+struct json_obj {
+    struct lexer lexer;
+};
+
+struct json_obj_key_value {
+    const char *key;
+    size_t key_len;
+    struct token value;
+};
+
+static bool lexer_consume(struct lexer *lexer,
+                          struct token *token,
+                          enum json_tokens empty_token)
+{
+    if (lexer->token.type == empty_token) {
+        return false;
+    }
+
+    *token = lexer->token;
+    lexer->token.type = empty_token;
+
+    return true;
+}
+
+static bool lexer_next(struct lexer *lexer, struct token *token)
+{
+    while (lexer->state) {
+        if (lexer_consume(lexer, token, JSON_TOK_NONE)) {
+            return true;
+        }
+
+        lexer->state = lexer->state(lexer);
+    }
+
+    return lexer_consume(lexer, token, JSON_TOK_EOF);
+}
+
+static void *lexer_json(struct lexer *lexer);
+
+static void emit(struct lexer *lexer, enum json_tokens token)
+{
+    lexer->token.type = token;
+    lexer->token.start = lexer->start;
+    lexer->token.end = lexer->pos;
+    lexer->token.escaped = false;
+    lexer->start = lexer->pos;
+}
+
+static void* emit_cont(struct lexer *lexer, enum json_tokens token)
+{
+    emit(lexer, token);
+    return lexer_json;
+}
+
+static void* emit_end(struct lexer *lexer, enum json_tokens token)
+{
+    emit(lexer, token);
+    return NULL;
+}
+
+static int next(struct lexer *lexer)
+{
+    if (lexer->pos >= lexer->end) {
+        lexer->pos = lexer->end + 1;
+
+        return '\0';
+    }
+
+    return *lexer->pos++;
+}
+
+static void ignore(struct lexer *lexer) { lexer->start = lexer->pos; }
+
+static void backup(struct lexer *lexer) { lexer->pos--; }
+
+static int peek(struct lexer *lexer)
+{
+    int chr = next(lexer);
+
+    backup(lexer);
+
+    return chr;
+}
+
+static void *lexer_string(struct lexer *lexer)
+{
+    bool escaped = false;
+
+    ignore(lexer);
+
+    while (true) {
+        int chr;
+
+        /* Skip over everything that isn't a quote, a backslash, or a
+         * control character, a vector at a time. */
+        lexer->pos += lwan_json_escape_span(
+            lexer->pos, (size_t)(lexer->end - lexer->pos));
+
+        chr = next(lexer);
+
+        if (chr == '"') {
+            backup(lexer);
+            emit(lexer, JSON_TOK_STRING);
+            lexer->token.escaped = escaped;
+
+            next(lexer);
+            ignore(lexer);
+
+            return lexer_json;
+        }
+
+        /* Control characters (and the end of the input) can't appear
+         * unescaped in a string. */
+        if (UNLIKELY(chr != '\\')) {
+            goto error;
+        }
+
+        escaped = true;
+
+        switch (next(lexer)) {
+        case '"':
+        case '\\':
+        case '/':
+        case 'b':
+        case 'f':
+        case 'n':
+        case 'r':
+        case 't':
+            continue;
+        case 'u':
+            if (UNLIKELY(!isxdigit(next(lexer)))) {
+                goto error;
+            }
+
+            if (UNLIKELY(!isxdigit(next(lexer)))) {
+                goto error;
+            }
+
+            if (UNLIKELY(!isxdigit(next(lexer)))) {
+                goto error;
+            }
+
+            if (UNLIKELY(!isxdigit(next(lexer)))) {
+                goto error;
+            }
+
+            continue;
+        default:
+            goto error;
+        }
+    }
+
+error:
+    return emit_end(lexer, JSON_TOK_ERROR);
+}
+
+static int accept_run(struct lexer *lexer, const char *run)
+{
+    for (; *run; run++) {
+        if (UNLIKELY(next(lexer) != *run)) {
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+static void *lexer_boolean(struct lexer *lexer)
+{
+    /* Already matched either `t' or `f' at this point */
+
+    switch (next(lexer)) {
+    case 'r':
+        if (LIKELY(!accept_run(lexer, "ue"))) {
+            return emit_cont(lexer, JSON_TOK_TRUE);
+        }
+        break;
+    case 'a':
+        if (LIKELY(!accept_run(lexer, "lse"))) {
+            return emit_cont(lexer, JSON_TOK_FALSE);
+        }
+        break;
+    }
+
+    return emit_end(lexer, JSON_TOK_ERROR);
+}
+
+static void *lexer_null(struct lexer *lexer)
+{
+    if (UNLIKELY(accept_run(lexer, "ull") < 0)) {
+        return emit_end(lexer, JSON_TOK_ERROR);
+    }
+
+    return emit_cont(lexer, JSON_TOK_NULL);
+}
+
+static void *lexer_number(struct lexer *lexer)
+{
+    while (true) {
+        int chr = next(lexer);
+
+        if (isdigit(chr) || chr == '.') {
+            continue;
+        }
+
+        backup(lexer);
+        return emit_cont(lexer, JSON_TOK_NUMBER);
+    }
+}
+
+static void *lexer_json(struct lexer *lexer)
+{
+    while (true) {
+        int chr = next(lexer);
+
+        switch (chr) {
+        case '\0':
+            return emit_end(lexer, JSON_TOK_EOF);
+
+        case '}':
+        case '{':
+        case '[':
+        case ']':
+        case ',':
+        case ':':
+            return emit_cont(lexer, (enum json_tokens)chr);
+
+        case '"':
+            return lexer_string;
+
+        case 'n':
+            return lexer_null;
+
+        case 't':
+        case 'f':
+            return lexer_boolean;
+
+        case '-':
+            if (LIKELY(isdigit(peek(lexer)))) {
+                return lexer_number;
+            }
+
+            /* fallthrough */
+        default:
+            if (chr == ' ' || chr == '\n' || chr == '\t' || chr == '\r') {
+                lexer->pos += lwan_json_whitespace_span(
+                    lexer->pos, (size_t)(lexer->end - lexer->pos));
+                ignore(lexer);
+                continue;
+            }
+
+            if (LIKELY(isdigit(chr))) {
+                return lexer_number;
+            }
+
+            return emit_end(lexer, JSON_TOK_ERROR);
+        }
+    }
+}
+
+static void lexer_init(struct lexer *lexer, char *data, size_t len)
+{
+    lexer->state = lexer_json;
+    lexer->start = data;
+    lexer->pos = data;
+    lexer->end = data + len;
+    lexer->token.type = JSON_TOK_NONE;
+}
+
+static int obj_init(struct json_obj *json, char *data, size_t len)
+{
+    struct token token;
+
+    lexer_init(&json->lexer, data, len);
+
+    if (UNLIKELY(!lexer_next(&json->lexer, &token))) {
+        return -EINVAL;
+    }
+
+    if (UNLIKELY(token.type != JSON_TOK_OBJECT_START)) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int element_token(enum json_tokens token)
+{
+    switch (token) {
+    case JSON_TOK_OBJECT_START:
+    case JSON_TOK_LIST_START:
+    case JSON_TOK_STRING:
+    case JSON_TOK_NUMBER:
+    case JSON_TOK_TRUE:
+    case JSON_TOK_FALSE:
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+static int obj_next(struct json_obj *json, struct json_obj_key_value *kv)
+{
+    struct token token;
+
+    if (UNLIKELY(!lexer_next(&json->lexer, &token))) {
+        return -EINVAL;
+    }
+
+    /* Match end of object or next key */
+    switch (token.type) {
+    case JSON_TOK_OBJECT_END:
+        kv->key = NULL;
+        kv->key_len = 0;
+        kv->value = token;
+
+        return 0;
+    case JSON_TOK_COMMA:
+        if (UNLIKELY(!lexer_next(&json->lexer, &token))) {
+            return -EINVAL;
+        }
+
+        if (UNLIKELY(token.type != JSON_TOK_STRING)) {
+            return -EINVAL;
+        }
+
+        /* fallthrough */
+    case JSON_TOK_STRING:
+        kv->key = token.start;
+        kv->key_len = (size_t)(token.end - token.start);
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    /* Match : after key */
+    if (UNLIKELY(!lexer_next(&json->lexer, &token))) {
+        return -EINVAL;
+    }
+
+    if (UNLIKELY(token.type != JSON_TOK_COLON)) {
+        return -EINVAL;
+    }
+
+    /* Match value */
+    if (UNLIKELY(!lexer_next(&json->lexer, &kv->value))) {
+        return -EINVAL;
+    }
+
+    return element_token(kv->value.type);
+}
+
+static int arr_next(struct json_obj *json, struct token *value)
+{
+    if (UNLIKELY(!lexer_next(&json->lexer, value))) {
+        return -EINVAL;
+    }
+
+    if (value->type == JSON_TOK_LIST_END) {
+        return 0;
+    }
+
+    if (value->type == JSON_TOK_COMMA) {
+        if (UNLIKELY(!lexer_next(&json->lexer, value))) {
+            return -EINVAL;
+        }
+    }
+
+    return element_token(value->type);
+}
+
+static int decode_num(const struct token *token, int32_t *num)
+{
+    /* FIXME: strtod() is not available in newlib/minimal libc,
+     * so using strtol() here.
+     */
+    char *endptr;
+    char prev_end;
+
+    prev_end = *token->end;
+    *token->end = '\0';
+
+    errno = 0;
+    long v = strtol(token->start, &endptr, 10);
+    if ((long)(int)v != v) {
+        return -ERANGE;
+    }
+
+    *num = (int)v;
+
+    *token->end = prev_end;
+
+    if (errno != 0) {
+        return -errno;
+    }
+
+    if (endptr != token->end) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static bool equivalent_types(enum json_tokens type1, enum json_tokens type2)
+{
+    if (type1 == JSON_TOK_TRUE || type1 == JSON_TOK_FALSE) {
+        return type2 == JSON_TOK_TRUE || type2 == JSON_TOK_FALSE;
+    }
+
+    return type1 == type2;
+}
+
+static uint32_t decode_hex4(const char *hex)
+{
+    uint32_t value = 0;
+
+    /* The lexer has already made sure these are hex digits. */
+    for (int i = 0; i < 4; i++) {
+        char chr = hex[i];
+
+        value <<= 4;
+        if (chr <= '9')
+            value |= (uint32_t)(chr - '0');
+        else
+            value |= (uint32_t)((chr | 0x20) - 'a' + 10);
+    }
+
+    return value;
+}
+
+static size_t encode_utf8(uint32_t code_point, char *out)
+{
+    if (code_point < 0x80) {
+        out[0] = (char)code_point;
+        return 1;
+    }
+    if (code_point < 0x800) {
+        out[0] = (char)(0xc0 | (code_point >> 6));
+        out[1] = (char)(0x80 | (code_point & 0x3f));
+        return 2;
+    }
+    if (code_point < 0x10000) {
+        out[0] = (char)(0xe0 | (code_point >> 12));
+        out[1] = (char)(0x80 | ((code_point >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (code_point & 0x3f));
+        return 3;
+    }
+
+    out[0] = (char)(0xf0 | (code_point >> 18));
+    out[1] = (char)(0x80 | ((code_point >> 12) & 0x3f));
+    out[2] = (char)(0x80 | ((code_point >> 6) & 0x3f));
+    out[3] = (char)(0x80 | (code_point & 0x3f));
+    return 4;
+}
+
+/* Decodes the escape sequences in a string token in place, moving its end
+ * back; a decoded escape sequence is never longer than the sequence
+ * itself, so this never needs more space.  Escaped NULs and unpaired
+ * surrogates are rejected, as strings are handed out NUL-terminated. */
+static int unescape_string(struct token *token)
+{
+    char *src = token->start;
+    char *dst = token->start;
+    char *end = token->end;
+
+    while (true) {
+        char *backslash = memchr(src, '\\', (size_t)(end - src));
+        size_t run = (size_t)((backslash ? backslash : end) - src);
+        uint32_t code_point;
+
+        memmove(dst, src, run);
+        dst += run;
+        if (!backslash)
+            break;
+
+        src = backslash + 2;
+        switch (backslash[1]) {
+        case 'b':
+            *dst++ = '\b';
+            continue;
+        case 'f':
+            *dst++ = '\f';
+            continue;
+        case 'n':
+            *dst++ = '\n';
+            continue;
+        case 'r':
+            *dst++ = '\r';
+            continue;
+        case 't':
+            *dst++ = '\t';
+            continue;
+        case 'u':
+            break;
+        default:
+            /* '"', '\\', and '/' stand for themselves. */
+            *dst++ = backslash[1];
+            continue;
+        }
+
+        code_point = decode_hex4(src);
+        src += 4;
+
+        if (code_point >= 0xd800 && code_point <= 0xdbff) {
+            uint32_t low;
+
+            if (UNLIKELY(end - src < 6 || src[0] != '\\' || src[1] != 'u'))
+                return -EINVAL;
+
+            low = decode_hex4(src + 2);
+            if (UNLIKELY(low < 0xdc00 || low > 0xdfff))
+                return -EINVAL;
+
+            code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+            src += 6;
+        } else if (UNLIKELY(!code_point ||
+                            (code_point >= 0xdc00 && code_point <= 0xdfff))) {
+            return -EINVAL;
+        }
+
+        dst += encode_utf8(code_point, dst);
+    }
+
+    token->end = dst;
+    return 0;
+}
+
+static int obj_parse(struct json_obj *obj,
+                     const struct json_obj_descr *descr,
+                     size_t descr_len,
+                     void *val);
+static int arr_parse(struct json_obj *obj,
+                     const struct json_obj_descr *elem_descr,
+                     size_t max_elements,
+                     void *field,
+                     void *val);
+
+static int decode_value(struct json_obj *obj,
+                        const struct json_obj_descr *descr,
+                        struct token *value,
+                        void *field,
+                        void *val)
+{
+
+    if (!equivalent_types(value->type, descr->type)) {
+        return -EINVAL;
+    }
+
+    switch (descr->type) {
+    case JSON_TOK_OBJECT_START:
+        return obj_parse(obj, descr->object.sub_descr,
+                         descr->object.sub_descr_len, field);
+    case JSON_TOK_LIST_START:
+        return arr_parse(obj, descr->array.element_descr,
+                         descr->array.n_elements, field, val);
+    case JSON_TOK_FALSE:
+    case JSON_TOK_TRUE: {
+        bool *v = field;
+
+        *v = value->type == JSON_TOK_TRUE;
+
+        return 0;
+    }
+    case JSON_TOK_NUMBER: {
+        int32_t *num = field;
+
+        return decode_num(value, num);
+    }
+    case JSON_TOK_STRING: {
+        char **str = field;
+
+        if (value->escaped) {
+            int ret = unescape_string(value);
+
+            if (UNLIKELY(ret < 0)) {
+                return ret;
+            }
+        }
+
+        *value->end = '\0';
+        *str = value->start;
+
+        return 0;
+    }
+    default:
+        return -EINVAL;
+    }
+}
+
+static ptrdiff_t get_elem_size(const struct json_obj_descr *descr)
+{
+    switch (descr->type) {
+    case JSON_TOK_NUMBER:
+        return sizeof(int32_t);
+    case JSON_TOK_STRING:
+        return sizeof(char *);
+    case JSON_TOK_TRUE:
+    case JSON_TOK_FALSE:
+        return sizeof(bool);
+    case JSON_TOK_LIST_START:
+        return (ptrdiff_t)descr->array.n_elements *
+               get_elem_size(descr->array.element_descr);
+    case JSON_TOK_OBJECT_START: {
+        ptrdiff_t total = 0;
+        size_t i;
+
+        for (i = 0; i < descr->object.sub_descr_len; i++) {
+            ptrdiff_t s = get_elem_size(&descr->object.sub_descr[i]);
+
+            total += (ptrdiff_t)ROUND_UP(s, descr->object.sub_descr[i].align);
+        }
+
+        return total;
+    }
+    default:
+        return -EINVAL;
+    }
+}
+
+static int arr_parse(struct json_obj *obj,
+                     const struct json_obj_descr *elem_descr,
+                     size_t max_elements,
+                     void *field,
+                     void *val)
+{
+    ptrdiff_t elem_size = get_elem_size(elem_descr);
+    void *last_elem = (char *)field + elem_size * (ptrdiff_t)max_elements;
+    size_t *elements = (size_t *)((char *)val + elem_descr->offset);
+    struct token value;
+
+    assert(elem_size > 0);
+
+    *elements = 0;
+
+    while (!arr_next(obj, &value)) {
+        if (value.type == JSON_TOK_LIST_END) {
+            return 0;
+        }
+
+        if (UNLIKELY(field == last_elem)) {
+            return -ENOSPC;
+        }
+
+        if (UNLIKELY(decode_value(obj, elem_descr, &value, field, val) < 0)) {
+            return -EINVAL;
+        }
+
+        (*elements)++;
+        field = (char *)field + elem_size;
+    }
+
+    return -EINVAL;
+}
+
+static int obj_parse(struct json_obj *obj,
+                     const struct json_obj_descr *descr,
+                     size_t descr_len,
+                     void *val)
+{
+    struct json_obj_key_value kv;
+    int32_t decoded_fields = 0;
+    size_t i;
+    int ret;
+
+    while (!obj_next(obj, &kv)) {
+        if (kv.value.type == JSON_TOK_OBJECT_END) {
+            return decoded_fields;
+        }
+
+        for (i = 0; i < descr_len; i++) {
+            void *decode_field = (char *)val + descr[i].offset;
+
+            /* Field has been decoded already, skip */
+            if (decoded_fields & (1 << i)) {
+                continue;
+            }
+
+            /* Check if it's the i-th field */
+            if (kv.key_len != descr[i].field_name_len) {
+                continue;
+            }
+
+            if (memcmp(kv.key, descr[i].field_name, descr[i].field_name_len)) {
+                continue;
+            }
+
+            /* Store the decoded value */
+            ret = decode_value(obj, &descr[i], &kv.value, decode_field, val);
+            if (UNLIKELY(UNLIKELY(ret < 0))) {
+                return ret;
+            }
+
+            decoded_fields |= 1 << i;
+            break;
+        }
+    }
+
+    return -EINVAL;
+}
+
+int json_obj_parse(char *payload,
+                   size_t len,
+                   const struct json_obj_descr *descr,
+                   size_t descr_len,
+                   void *val)
+{
+    struct json_obj obj;
+    int ret;
+
+    assert(descr_len < (sizeof(ret) * CHAR_BIT - 1));
+
+    ret = obj_init(&obj, payload, len);
+    if (UNLIKELY(ret < 0)) {
+        return ret;
+    }
+
+    return obj_parse(&obj, descr, descr_len, val);
+}
+
+enum lwan_http_status
+json_parse_request_body(struct lwan_request *request,
+                        const struct json_obj_descr *descr,
+                        size_t descr_len,
+                        void *val)
+{
+    const struct lwan_value *body = lwan_request_get_request_body(request);
+
+    if (UNLIKELY(!body->len)) {
+        return HTTP_BAD_REQUEST;
+    }
+
+    if (UNLIKELY(json_obj_parse(body->value, body->len, descr, descr_len,
+                                val) < 0)) {
+        return HTTP_BAD_REQUEST;
+    }
+
+    return HTTP_OK;
+}
+
+static char escape_as(char chr)
+{
+    switch (chr) {
+    case '"':
+        return '"';
+    case '\\':
+        return '\\';
+    case '\b':
+        return 'b';
+    case '\f':
+        return 'f';
+    case '\n':
+        return 'n';
+    case '\r':
+        return 'r';
+    case '\t':
+        return 't';
+    default:
+        return 0;
+    }
+}
+
+/* Writes the escape sequence for chr, which must be a character that
+ * lwan_json_escape_span() stops at, to buf (which must be at least 6 bytes
+ * long), returning its length.  Control characters without a short escape
+ * sequence are written as \u00XX. */
+static size_t escape_sequence(char chr, char buf[static 6])
+{
+    static const char hex[] = "0123456789abcdef";
+    char escaped = escape_as(chr);
+
+    buf[0] = '\\';
+    if (escaped) {
+        buf[1] = escaped;
+        return 2;
+    }
+
+    buf[1] = 'u';
+    buf[2] = '0';
+    buf[3] = '0';
+    buf[4] = hex[((uint8_t)chr >> 4) & 0xf];
+    buf[5] = hex[(uint8_t)chr & 0xf];
+    return 6;
+}
+
+static int escape_bytes(const char *str,
+                        size_t len,
+                        json_append_bytes_t append_bytes,
+                        void *data)
+{
+    int ret = 0;
+
+    while (true) {
+        size_t span = lwan_json_escape_span(str, len);
+        char bytes[6];
+
+        if (span)
+            ret |= append_bytes(str, span, data);
+        if (span == len)
+            return ret;
+
+        ret |= append_bytes(bytes, escape_sequence(str[span], bytes), data);
+
+        str += span + 1;
+        len -= span + 1;
+    }
+}
+
+static int json_escape_internal(const char *str,
+                                json_append_bytes_t append_bytes,
+                                void *data)
+{
+    return escape_bytes(str, strlen(str), append_bytes, data);
+}
+
+size_t json_calc_escaped_len(const char *str, size_t len)
+{
+    size_t escaped_len = len;
+
+    while (true) {
+        size_t span = lwan_json_escape_span(str, len);
+
+        if (span == len)
+            return escaped_len;
+
+        escaped_len += escape_as(str[span]) ? 1 : 5;
+
+        str += span + 1;
+        len -= span + 1;
+    }
+}
+
+ssize_t json_escape(char *str, size_t *len, size_t buf_size)
+{
+    char *next; /* Points after next character to escape. */
+    char *dest; /* Points after next place to write escaped character. */
+    size_t escaped_len = json_calc_escaped_len(str, *len);
+
+    if (escaped_len == *len) {
+        /*
+         * If no escape is necessary, there is nothing to do.
+         */
+        return 0;
+    }
+
+    if (UNLIKELY(escaped_len >= buf_size)) {
+        return -ENOMEM;
+    }
+
+    /*
+     * By walking backwards in the buffer from the end positions
+     * of both the original and escaped strings, we avoid using
+     * extra space. Characters in the original string are
+     * overwritten only after they have already been escaped.
+     */
+    str[escaped_len] = '\0';
+    for (next = &str[*len], dest = &str[escaped_len]; next != str;) {
+        char next_c = *(--next);
+
+        if (lwan_json_escape_span(next, 1) == 0) {
+            char bytes[6];
+            size_t bytes_len = escape_sequence(next_c, bytes);
+
+            dest -= bytes_len;
+            memcpy(dest, bytes, bytes_len);
+        } else {
+            *(--dest) = next_c;
+        }
+    }
+    *len = escaped_len;
+
+    return 0;
+}
+
+static int encode(const struct json_obj_descr *descr,
+                  const void *val,
+                  json_append_bytes_t append_bytes,
+                  void *data,
+                  bool escape_key);
+
+static int arr_encode(const struct json_obj_descr *elem_descr,
+                      const void *field,
+                      const void *val,
+                      json_append_bytes_t append_bytes,
+                      void *data,
+                      bool escape_key)
+{
+    ptrdiff_t elem_size = get_elem_size(elem_descr);
+    /*
+     * NOTE: Since an element descriptor's offset isn't meaningful (array
+     * elements occur at multiple offsets in `val'), we use its space in
+     * elem_descr to store the offset to the field containing the number of
+     * elements.
+     */
+    size_t n_elem = *(size_t *)((char *)val + elem_descr->offset);
+    int ret = append_bytes("[", 1, data);
+
+    if (LIKELY(n_elem)) {
+        n_elem--;
+        for (size_t i = 0; i < n_elem; i++) {
+            /*
+             * Though "field" points at the next element in the array which we
+             * need to encode, the value in elem_descr->offset is actually the
+             * offset of the length field in the "parent" struct containing the
+             * array.
+             *
+             * To patch things up, we lie to encode() about where the field is
+             * by exactly the amount it will offset it.  This is a size
+             * optimization for struct json_obj_descr: the alternative is to
+             * keep a separate field next to element_descr which is an offset to
+             * the length field in the parent struct, but that would add a
+             * size_t to every descriptor.
+             */
+            ret |= encode(elem_descr, (char *)field - elem_descr->offset,
+                          append_bytes, data, escape_key);
+
+            ret |= append_bytes(",", 1, data);
+
+            field = (char *)field + elem_size;
+        }
+
+        ret |= encode(elem_descr, (char *)field - elem_descr->offset,
+                      append_bytes, data, escape_key);
+    }
+
+    return ret | append_bytes("]", 1, data);
+}
+
+static int str_encode(const char **str,
+                      json_append_bytes_t append_bytes,
+                      void *data)
+{
+    int ret = append_bytes("\"", 1, data);
+
+    ret |= json_escape_internal(*str, append_bytes, data);
+
+    return ret | append_bytes("\"", 1, data);
+}
+
+static int
+num_encode(const int32_t *num, json_append_bytes_t append_bytes, void *data)
+{
+    char buf[INT_TO_STR_BUFFER_SIZE];
+    size_t len;
+    char *as_string = int_to_string(*num, buf, &len);
+
+    return append_bytes(as_string, len, data);
+}
+
+static int
+bool_encode(const bool *value, json_append_bytes_t append_bytes, void *data)
+{
+    if (*value) {
+        return append_bytes("true", 4, data);
+    }
+
+    return append_bytes("false", 5, data);
+}
+
+int json_arr_encode_full(const struct json_obj_descr *descr,
+                         const void *val,
+                         json_append_bytes_t append_bytes,
+                         void *data,
+                         bool escape_key)
+{
+    void *ptr = (char *)val + descr->offset;
+
+    return arr_encode(descr->array.element_descr, ptr, val, append_bytes, data,
+                      escape_key);
+}
+
+static int encode(const struct json_obj_descr *descr,
+                  const void *val,
+                  json_append_bytes_t append_bytes,
+                  void *data,
+                  bool escape_key)
+{
+    void *ptr = (char *)val + descr->offset;
+
+    switch (descr->type) {
+    case JSON_TOK_FALSE:
+    case JSON_TOK_TRUE:
+        return bool_encode(ptr, append_bytes, data);
+    case JSON_TOK_STRING:
+        return str_encode(ptr, append_bytes, data);
+    case JSON_TOK_LIST_START:
+        return arr_encode(descr->array.element_descr, ptr, val,
+                          append_bytes, data, escape_key);
+    case JSON_TOK_OBJECT_START:
+        return json_obj_encode_full(descr->object.sub_descr,
+                                    descr->object.sub_descr_len, ptr, append_bytes,
+                                    data, escape_key);
+    case JSON_TOK_NUMBER:
+        return num_encode(ptr, append_bytes, data);
+    default:
+        return -EINVAL;
+    }
+}
+
+static inline int encode_key(const struct json_obj_descr *descr,
+                             json_append_bytes_t append_bytes,
+                             void *data,
+                             bool escape_key)
+{
+    int ret;
+
+    if (!escape_key) {
+        /* Keys are encoded twice in the descriptor; once without quotes and
+         * the trailing comma, and one with.  Doing it like so cuts some
+         * indirect calls to append_bytes(), which in turn also potentially
+         * cuts some branches in most implementations of it.  */
+        ret = append_bytes(descr->field_name + descr->field_name_len,
+                           descr->field_name_len + 3 /* 3=len('"":') */, data);
+    } else {
+        ret = str_encode((const char **)&descr->field_name, append_bytes, data);
+        ret |= append_bytes(":", 1, data);
+    }
+
+    return ret;
+}
+
+int json_obj_encode_full(const struct json_obj_descr *descr,
+                         size_t descr_len,
+                         const void *val,
+                         json_append_bytes_t append_bytes,
+                         void *data,
+                         bool escape_key)
+{
+    int ret = append_bytes("{", 1, data);
+
+    if (LIKELY(descr_len)) {
+        /* To avoid checking if we're encoding the last element on each
+         * iteration of this loop, start at the second descriptor, and always
+         * write the comma. Then, after the loop, encode the first descriptor.
+         * If the descriptor array has only 1 element, this loop won't run. This
+         * is fine since order isn't important for objects, and we save some
+         * branches.  */
+
+        for (size_t i = 1; i < descr_len; i++) {
+            ret |= encode_key(&descr[i], append_bytes, data, escape_key);
+            ret |= encode(&descr[i], val, append_bytes, data, escape_key);
+            ret |= append_bytes(",", 1, data);
+        }
+
+        ret |= encode_key(&descr[0], append_bytes, data, escape_key);
+        ret |= encode(&descr[0], val, append_bytes, data, escape_key);
+    }
+
+    return ret | append_bytes("}", 1, data);
+}
+
+struct appender {
+    char *buffer;
+    size_t used;
+    size_t size;
+};
+
+static int append_bytes_to_buf(const char *bytes, size_t len, void *data)
+{
+    struct appender *appender = data;
+
+    if (UNLIKELY(len > appender->size - appender->used)) {
+        return -ENOMEM;
+    }
+
+    memcpy(appender->buffer + appender->used, bytes, len);
+    appender->used += len;
+    appender->buffer[appender->used] = '\0';
+
+    return 0;
+}
+
+int json_obj_encode_buf(const struct json_obj_descr *descr,
+                        size_t descr_len,
+                        const void *val,
+                        char *buffer,
+                        size_t buf_size)
+{
+    struct appender appender = {.buffer = buffer, .size = buf_size};
+
+    return json_obj_encode(descr, descr_len, val, append_bytes_to_buf,
+                           &appender);
+}
+
+static int
+measure_bytes(const char *bytes __attribute__((unused)), size_t len, void *data)
+{
+    ssize_t *total = data;
+
+    *total += (ssize_t)len;
+
+    return 0;
+}
+
+ssize_t json_calc_encoded_len(const struct json_obj_descr *descr,
+                              size_t descr_len,
+                              const void *val)
+{
+    ssize_t total = 0;
+    int ret;
+
+    ret = json_obj_encode(descr, descr_len, val, measure_bytes, &total);
+    if (UNLIKELY(ret < 0)) {
+        return ret;
+    }
+
+    return total;
+}
+
+/*
+ * Compiled encoder.  The first time an encoder is used, its descriptors
+ * are turned into a flat list of operations: the keys, along with the
+ * punctuation around them, are escaped and merged into literals, nested
+ * objects are inlined, and each array gets a sub-program for its elements,
+ * placed after the program that refers to it.  Encoding then writes
+ * directly into the strbuf, which is grown once beforehand by the size of
+ * the previous output, instead of going through append_bytes() for every
+ * token.
+ */
+
+enum json_op_type {
+    JSON_OP_LITERAL,
+    JSON_OP_STRING,
+    JSON_OP_NUMBER,
+    JSON_OP_BOOL,
+    JSON_OP_ARRAY,
+    JSON_OP_END,
+};
+
+struct json_op {
+    enum json_op_type type;
+
+    /* Offset of the value, from the start of the outermost struct (or of
+     * the array element) being encoded. */
+    uint32_t offset;
+
+    union {
+        struct {
+            uint32_t start;
+            uint32_t len;
+        } literal;
+        struct {
+            uint32_t len_offset;
+            uint32_t elem_program;
+            size_t max_elements;
+            size_t elem_size;
+        } array;
+    };
+};
+
+DEFINE_ARRAY_TYPE(json_op_array, struct json_op)
+
+struct json_program {
+    struct json_op_array ops;
+    struct lwan_strbuf literals;
+};
+
+struct json_pending_array {
+    size_t op;
+    const struct json_obj_descr *elem_descr;
+};
+
+DEFINE_ARRAY_TYPE(json_pending_array_array, struct json_pending_array)
+
+struct json_compiler {
+    struct json_program *program;
+    struct json_pending_array_array pending;
+    size_t literal_start;
+};
+
+static bool emit_op(struct json_compiler *compiler, struct json_op op)
+{
+    struct json_op *new_op = json_op_array_append(&compiler->program->ops);
+
+    if (UNLIKELY(!new_op))
+        return false;
+
+    *new_op = op;
+    return true;
+}
+
+static bool flush_literal(struct json_compiler *compiler)
+{
+    size_t end = lwan_strbuf_get_length(&compiler->program->literals);
+    size_t start = compiler->literal_start;
+
+    if (end == start)
+        return true;
+
+    compiler->literal_start = end;
+    return emit_op(compiler, (struct json_op){
+                                 .type = JSON_OP_LITERAL,
+                                 .literal = {.start = (uint32_t)start,
+                                             .len = (uint32_t)(end - start)},
+                             });
+}
+
+static int append_literal(const char *bytes, size_t len, void *data)
+{
+    struct json_compiler *compiler = data;
+
+    return lwan_strbuf_append_str(&compiler->program->literals, bytes, len)
+               ? 0
+               : -ENOMEM;
+}
+
+static int compile_object(struct json_compiler *compiler,
+                          const struct json_obj_descr *descr,
+                          size_t descr_len,
+                          uint32_t base);
+
+static int compile_array(struct json_compiler *compiler,
+                         const struct json_obj_descr *elem_descr,
+                         size_t max_elements,
+                         uint32_t offset,
+                         uint32_t len_offset)
+{
+    ptrdiff_t elem_size;
+
+    /* Arrays of arrays have their own offset conventions; they can still
+     * be encoded with json_obj_encode_full(). */
+    if (elem_descr->type == JSON_TOK_LIST_START)
+        return -ENOTSUP;
+
+    elem_size = get_elem_size(elem_descr);
+    if (UNLIKELY(elem_size < 0))
+        return (int)elem_size;
+
+    if (append_literal("[", 1, compiler) < 0 || !flush_literal(compiler))
+        return -ENOMEM;
+
+    struct json_pending_array *pending =
+        json_pending_array_array_append(&compiler->pending);
+    if (UNLIKELY(!pending))
+        return -ENOMEM;
+    *pending = (struct json_pending_array){
+        .op = json_op_array_len(&compiler->program->ops),
+        .elem_descr = elem_descr,
+    };
+
+    if (!emit_op(compiler, (struct json_op){
+                               .type = JSON_OP_ARRAY,
+                               .offset = offset,
+                               .array = {.len_offset = len_offset,
+                                         .max_elements = max_elements,
+                                         .elem_size = (size_t)elem_size},
+                           }))
+        return -ENOMEM;
+
+    return append_literal("]", 1, compiler);
+}
+
+static int compile_value(struct json_compiler *compiler,
+                         const struct json_obj_descr *descr,
+                         uint32_t offset,
+                         uint32_t base)
+{
+    enum json_op_type type;
+
+    switch (descr->type) {
+    case JSON_TOK_STRING:
+        type = JSON_OP_STRING;
+        break;
+    case JSON_TOK_NUMBER:
+        type = JSON_OP_NUMBER;
+        break;
+    case JSON_TOK_TRUE:
+    case JSON_TOK_FALSE:
+        type = JSON_OP_BOOL;
+        break;
+    case JSON_TOK_OBJECT_START:
+        return compile_object(compiler, descr->object.sub_descr,
+                              descr->object.sub_descr_len, offset);
+    case JSON_TOK_LIST_START:
+        /* See the comment in arr_encode() about the element descriptor's
+         * offset. */
+        return compile_array(compiler, descr->array.element_descr,
+                             descr->array.n_elements, offset,
+                             base + descr->array.element_descr->offset);
+    default:
+        return -EINVAL;
+    }
+
+    if (!flush_literal(compiler))
+        return -ENOMEM;
+
+    return emit_op(compiler, (struct json_op){.type = type, .offset = offset})
+               ? 0
+               : -ENOMEM;
+}
+
+static int compile_object(struct json_compiler *compiler,
+                          const struct json_obj_descr *descr,
+                          size_t descr_len,
+                          uint32_t base)
+{
+    int ret = append_literal("{", 1, compiler);
+
+    for (size_t i = 0; i < descr_len; i++) {
+        if (i)
+            ret |= append_literal(",", 1, compiler);
+        ret |= append_literal("\"", 1, compiler);
+        ret |= escape_bytes(descr[i].field_name, descr[i].field_name_len,
+                            append_literal, compiler);
+        ret |= append_literal("\":", 2, compiler);
+        if (ret < 0)
+            return ret;
+
+        ret = compile_value(compiler, &descr[i], base + descr[i].offset, base);
+        if (ret < 0)
+            return ret;
+    }
+
+    return ret | append_literal("}", 1, compiler);
+}
+
+static int compile_elements(struct json_compiler *compiler,
+                            const struct json_pending_array *pending)
+{
+    const struct json_obj_descr *elem_descr = pending->elem_descr;
+    struct json_op *op =
+        json_op_array_get_elem(&compiler->program->ops, pending->op);
+    int ret;
+
+    op->array.elem_program =
+        (uint32_t)json_op_array_len(&compiler->program->ops);
+
+    if (elem_descr->type == JSON_TOK_OBJECT_START) {
+        ret = compile_object(compiler, elem_descr->object.sub_descr,
+                             elem_descr->object.sub_descr_len, 0);
+    } else {
+        ret = compile_value(compiler, elem_descr, 0, 0);
+    }
+    if (ret < 0)
+        return ret;
+
+    if (!flush_literal(compiler) ||
+        !emit_op(compiler, (struct json_op){.type = JSON_OP_END}))
+        return -ENOMEM;
+
+    return 0;
+}
+
+static void free_program(struct json_program *program)
+{
+    json_op_array_reset(&program->ops);
+    lwan_strbuf_free(&program->literals);
+    free(program);
+}
+
+static struct json_program *compile_encoder(const struct json_encoder *encoder)
+{
+    struct json_program *program = malloc(sizeof(*program));
+    struct json_compiler compiler = {.program = program};
+    int ret;
+
+    if (UNLIKELY(!program))
+        return NULL;
+
+    json_op_array_init(&program->ops);
+    json_pending_array_array_init(&compiler.pending);
+    if (UNLIKELY(!lwan_strbuf_init(&program->literals))) {
+        free(program);
+        return NULL;
+    }
+
+    if (encoder->is_array) {
+        ret = compile_array(&compiler, encoder->descr->array.element_descr,
+                            encoder->descr->array.n_elements,
+                            encoder->descr->offset,
+                            encoder->descr->array.element_descr->offset);
+    } else {
+        ret = compile_object(&compiler, encoder->descr, encoder->descr_len, 0);
+    }
+    if (ret < 0)
+        goto error;
+
+    if (!flush_literal(&compiler) ||
+        !emit_op(&compiler, (struct json_op){.type = JSON_OP_END})) {
+        ret = -ENOMEM;
+        goto error;
+    }
+
+    /* Element programs can have arrays of their own, which are queued
+     * while they're compiled, so don't iterate with a cached length. */
+    for (size_t i = 0; i < json_pending_array_array_len(&compiler.pending);
+         i++) {
+        ret = compile_elements(
+            &compiler,
+            json_pending_array_array_get_elem(&compiler.pending, i));
+        if (ret < 0)
+            goto error;
+    }
+
+    json_pending_array_array_reset(&compiler.pending);
+    return program;
+
+error:
+    lwan_status_error("Could not compile JSON encoder: %s", strerror(-ret));
+    json_pending_array_array_reset(&compiler.pending);
+    free_program(program);
+    return NULL;
+}
+
+static struct json_program *get_program(struct json_encoder *encoder)
+{
+    struct json_program *program =
+        __atomic_load_n(&encoder->program, __ATOMIC_ACQUIRE);
+    struct json_program *expected = NULL;
+
+    if (LIKELY(program))
+        return program;
+
+    program = compile_encoder(encoder);
+    if (UNLIKELY(!program))
+        return NULL;
+
+    /* Another thread might have compiled this encoder in the meantime. */
+    if (!__atomic_compare_exchange_n(&encoder->program, &expected, program,
+                                     false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        free_program(program);
+        return expected;
+    }
+
+    return program;
+}
+
+struct json_writer {
+    struct lwan_strbuf *buf;
+    char *pos;
+    char *end;
+};
+
+static void writer_sync(struct json_writer *writer)
+{
+    writer->buf->used = (size_t)(writer->pos - writer->buf->buffer);
+}
+
+static bool writer_reserve_slow(struct json_writer *writer, size_t len)
+{
+    struct lwan_strbuf *buf = writer->buf;
+
+    writer_sync(writer);
+    if (UNLIKELY(!lwan_strbuf_grow_by(buf, len)))
+        return false;
+
+    writer->pos = buf->buffer + buf->used;
+    /* Leave room for the NUL terminator. */
+    writer->end = buf->buffer + buf->capacity - 1;
+    return true;
+}
+
+static ALWAYS_INLINE bool writer_reserve(struct json_writer *writer,
+                                         size_t len)
+{
+    if (LIKELY((size_t)(writer->end - writer->pos) >= len))
+        return true;
+
+    return writer_reserve_slow(writer, len);
+}
+
+static ALWAYS_INLINE bool
+writer_append(struct json_writer *writer, const char *bytes, size_t len)
+{
+    if (UNLIKELY(!writer_reserve(writer, len)))
+        return false;
+
+    memcpy(writer->pos, bytes, len);
+    writer->pos += len;
+    return true;
+}
+
+static bool writer_append_string(struct json_writer *writer, const char *str)
+{
+    size_t len = strlen(str);
+
+    if (UNLIKELY(!writer_reserve(writer, len + 2)))
+        return false;
+
+    *writer->pos++ = '"';
+
+    while (true) {
+        size_t span = lwan_json_escape_span(str, len);
+
+        memcpy(writer->pos, str, span);
+        writer->pos += span;
+        if (span == len)
+            break;
+
+        str += span;
+        len -= span;
+
+        /* Room for the rest of the string and the closing quote has
+         * already been reserved; the escaped character needs at most 5
+         * more bytes. */
+        if (UNLIKELY(!writer_reserve(writer, len + 6)))
+            return false;
+
+        writer->pos += escape_sequence(*str, writer->pos);
+        str++;
+        len--;
+    }
+
+    *writer->pos++ = '"';
+    return true;
+}
+
+static bool run_program(struct json_writer *writer,
+                        const struct json_program *program,
+                        const struct json_op *op,
+                        const char *val)
+{
+    const char *literals = lwan_strbuf_get_buffer(&program->literals);
+
+    for (;; op++) {
+        const char *ptr = val + op->offset;
+
+        switch (op->type) {
+        case JSON_OP_LITERAL:
+            if (UNLIKELY(!writer_append(writer, literals + op->literal.start,
+                                        op->literal.len)))
+                return false;
+            break;
+
+        case JSON_OP_STRING:
+            if (UNLIKELY(
+                    !writer_append_string(writer, *(const char *const *)ptr)))
+                return false;
+            break;
+
+        case JSON_OP_NUMBER: {
+            const int32_t value = *(const int32_t *)ptr;
+            const size_t abs_value =
+                value < 0 ? (size_t)-(int64_t)value : (size_t)value;
+            const size_t n_digits = uint_count_digits(abs_value);
+
+            if (UNLIKELY(!writer_reserve(writer, n_digits + 1)))
+                return false;
+            if (value < 0)
+                *writer->pos++ = '-';
+            uint_to_string_n(abs_value, writer->pos, n_digits);
+            writer->pos += n_digits;
+            break;
+        }
+
+        case JSON_OP_BOOL:
+            if (*(const bool *)ptr) {
+                if (UNLIKELY(!writer_append(writer, "true", 4)))
+                    return false;
+            } else if (UNLIKELY(!writer_append(writer, "false", 5))) {
+                return false;
+            }
+            break;
+
+        case JSON_OP_ARRAY: {
+            const struct json_op *elem_program =
+                (const struct json_op *)program->ops.base.base +
+                op->array.elem_program;
+            size_t n_elem =
+                LWAN_MIN(*(const size_t *)(val + op->array.len_offset),
+                         op->array.max_elements);
+
+            for (size_t i = 0; i < n_elem; i++) {
+                if (i && UNLIKELY(!writer_append(writer, ",", 1)))
+                    return false;
+                if (UNLIKELY(!run_program(writer, program, elem_program, ptr)))
+                    return false;
+
+                ptr += op->array.elem_size;
+            }
+            break;
+        }
+
+        case JSON_OP_END:
+            return true;
+        }
+    }
+}
+
+static void update_size_hint(struct json_encoder *encoder,
+                             size_t hint,
+                             size_t size)
+{
+    /* Same heuristic as the one used by templates: grow right away, shrink
+     * slowly. */
+    if (size > hint)
+        hint = size;
+    else
+        hint -= (hint - size) / 8;
+
+    __atomic_store_n(&encoder->size_hint, hint, __ATOMIC_RELAXED);
+}
+
+bool json_encode_strbuf(struct json_encoder *encoder,
+                        const void *val,
+                        struct lwan_strbuf *buf)
+{
+    const struct json_program *program = get_program(encoder);
+    const size_t hint = __atomic_load_n(&encoder->size_hint, __ATOMIC_RELAXED);
+    const size_t start = lwan_strbuf_get_length(buf);
+    struct json_writer writer = {.buf = buf};
+
+    if (UNLIKELY(!program))
+        return false;
+
+    if (UNLIKELY(!lwan_strbuf_grow_by(buf, hint)))
+        return false;
+    writer.pos = buf->buffer + buf->used;
+    writer.end = buf->buffer + buf->capacity - 1;
+
+    if (UNLIKELY(!run_program(&writer, program, program->ops.base.base, val))) {
+        buf->used = start;
+        buf->buffer[start] = '\0';
+        return false;
+    }
+
+    writer_sync(&writer);
+    *writer.pos = '\0';
+
+    if (buf->used - start != hint)
+        update_size_hint(encoder, hint, buf->used - start);
+
+    return true;
+}
+
+bool json_encode_response(struct json_encoder *encoder,
+                          const void *val,
+                          struct lwan_response *response)
+{
+    if (UNLIKELY(!json_encode_strbuf(encoder, val, response->buffer)))
+        return false;
+
+    response->mime_type = "application/json";
+    return true;
+}
@@ -7,14 +7,21 @@
 #ifndef ZEPHYR_INCLUDE_DATA_JSON_H_
 #define ZEPHYR_INCLUDE_DATA_JSON_H_
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
 
+#include "lwan.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+#endif
+
 #define ROUND_UP(x, align)                                                     \
     (((unsigned long)(x) + ((unsigned long)(align)-1)) &                       \
      ~((unsigned long)(align)-1))
@@ -501,10 +508,13 @@ typedef int (*json_append_bytes_t)(const char *bytes, size_t len, void *data);
  *       JSON_OBJ_DESCR_PRIM(struct s, bar, JSON_TOK_STRING),
  *    };
  *
+ * Parsing happens in place: strings are unescaped and NUL-terminated
+ * within @a json, and the char pointers stored in @a val point into it, so
+ * it must outlive them.
+ *
  * Since this parser is designed for machine-to-machine communications, some
  * liberties were taken to simplify the design:
- * (1) strings are not unescaped (but only valid escape sequences are
- * accepted);
+ * (1) strings containing escaped NULs are rejected;
  * (2) no UTF-8 validation is performed; and
  * (3) only integer numbers are supported (no strtod() in the minimal libc).
  *
@@ -529,6 +539,22 @@ int json_obj_parse(char *json,
                    size_t descr_len,
                    void *val);
 
+/**
+ * @brief Parses the body of @a request with json_obj_parse(), in place,
+ * so strings stored in @a val point into the request buffer and are valid
+ * until the request is done.  Fields not present in the body are left
+ * untouched, so initialize @a val with their defaults beforehand.
+ *
+ * @return HTTP_OK if the body was parsed, or HTTP_BAD_REQUEST if it's
+ * missing or doesn't match the descriptor; handlers can return the latter
+ * as is.
+ */
+enum lwan_http_status
+json_parse_request_body(struct lwan_request *request,
+                        const struct json_obj_descr *descr,
+                        size_t descr_len,
+                        void *val);
+
 /**
  * @brief Escapes the string so it can be used to encode JSON objects
  *
@@ -658,6 +684,114 @@ static inline int json_arr_encode(const struct json_obj_descr *descr,
     return json_arr_encode_full(descr, val, append_bytes, data, true);
 }
 
+/**
+ * @brief Helper macros to declare descriptors for the fields of the struct
+ * named by JSON_STRUCT, much like TPL_VAR_*() does for templates.  The
+ * maximum length of arrays is taken from the size of the array field.
+ *
+ * Here's an example of use:
+ *
+ *     struct item {
+ *         int id;
+ *         const char *name;
+ *     };
+ *     struct list {
+ *         struct item items[16];
+ *         size_t n_items;
+ *         bool more;
+ *     };
+ *
+ *     #undef JSON_STRUCT
+ *     #define JSON_STRUCT struct item
+ *     static const struct json_obj_descr item_descr[] = {
+ *         JSON_VAR_INT(id),
+ *         JSON_VAR_STR(name),
+ *     };
+ *
+ *     #undef JSON_STRUCT
+ *     #define JSON_STRUCT struct list
+ *     static const struct json_obj_descr list_descr[] = {
+ *         JSON_VAR_OBJ_ARRAY(items, n_items, item_descr),
+ *         JSON_VAR_BOOL(more),
+ *     };
+ *
+ *     static struct json_encoder list_encoder = JSON_ENCODER(list_descr);
+ */
+#define JSON_VAR_INT(field_name_)                                              \
+    JSON_OBJ_DESCR_PRIM(JSON_STRUCT, field_name_, JSON_TOK_NUMBER)
+
+#define JSON_VAR_STR(field_name_)                                              \
+    JSON_OBJ_DESCR_PRIM(JSON_STRUCT, field_name_, JSON_TOK_STRING)
+
+#define JSON_VAR_BOOL(field_name_)                                             \
+    JSON_OBJ_DESCR_PRIM(JSON_STRUCT, field_name_, JSON_TOK_TRUE)
+
+#define JSON_VAR_OBJECT(field_name_, sub_descr_)                               \
+    JSON_OBJ_DESCR_OBJECT(JSON_STRUCT, field_name_, sub_descr_)
+
+#define JSON_VAR_ARRAY(field_name_, len_field_, elem_type_)                    \
+    JSON_OBJ_DESCR_ARRAY(JSON_STRUCT, field_name_,                             \
+                         ARRAY_SIZE(((JSON_STRUCT *)0)->field_name_),          \
+                         len_field_, elem_type_)
+
+#define JSON_VAR_OBJ_ARRAY(field_name_, len_field_, elem_descr_)               \
+    JSON_OBJ_DESCR_OBJ_ARRAY(JSON_STRUCT, field_name_,                         \
+                             ARRAY_SIZE(((JSON_STRUCT *)0)->field_name_),      \
+                             len_field_, elem_descr_, ARRAY_SIZE(elem_descr_))
+
+struct json_program;
+
+/**
+ * @brief Encoder for an object (or an array) described by a descriptor
+ * table.  The table is compiled into a program the first time the encoder
+ * is used, and the program is kept for as long as the encoder exists;
+ * encoders are meant to be static, like descriptor tables.
+ *
+ * Use JSON_ENCODER() to initialize an encoder for an array of descriptors
+ * of an object, and JSON_ARR_ENCODER() for a single array descriptor (such
+ * as one declared with JSON_OBJ_DESCR_OBJ_ARRAY()), which encodes only
+ * that array.  Arrays of arrays aren't supported by the compiled encoder;
+ * use json_obj_encode_full() for those.
+ */
+struct json_encoder {
+    const struct json_obj_descr *descr;
+    size_t descr_len;
+    bool is_array;
+
+    struct json_program *program;
+    size_t size_hint;
+};
+
+#define JSON_ENCODER(descr_)                                                   \
+    {                                                                          \
+        .descr = descr_, .descr_len = ARRAY_SIZE(descr_)                       \
+    }
+
+#define JSON_ARR_ENCODER(descr_)                                               \
+    {                                                                          \
+        .descr = &(descr_), .descr_len = 1, .is_array = true                   \
+    }
+
+/**
+ * @brief Encodes val, appending it to buf.  Keys are escaped when the
+ * encoder is compiled, and fields are written in the order they appear in
+ * the descriptor table.
+ *
+ * @return true on success.  On failure, buf is left as it was.
+ */
+bool json_encode_strbuf(struct json_encoder *encoder,
+                        const void *val,
+                        struct lwan_strbuf *buf);
+
+/**
+ * @brief Encodes val into the response buffer, and sets the response MIME
+ * type to application/json.  Returns false if val couldn't be encoded; the
+ * handler should then return an error status.
+ */
+bool json_encode_response(struct json_encoder *encoder,
+                          const void *val,
+                          struct lwan_response *response);
+
 #ifdef __cplusplus
 }
 #endif
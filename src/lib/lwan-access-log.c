@@ -0,0 +1,571 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "lwan-access-log.h"
+#include "lwan-config.h"
+
+/* I/O threads only copy a few fields from the request into a fixed-size
+ * record, in a single-producer/single-consumer ring that belongs to that
+ * thread; a logger thread wakes up periodically to format the records and
+ * write them out in batches.  Records are dropped (and counted) if a ring
+ * is full, rather than making I/O threads wait for the logger. */
+
+#define ACCESS_LOG_PATH_MAX 98
+
+struct access_log_record {
+    int64_t time;
+    uint8_t address[16];
+    uint16_t status;
+    uint8_t family;
+    uint8_t method;
+    uint8_t is_http_1_0;
+    uint8_t path_len;
+    char path[ACCESS_LOG_PATH_MAX];
+};
+
+static_assert(sizeof(struct access_log_record) == 128,
+              "Access log records fill two cache lines");
+
+struct lwan_access_log_ring {
+    struct access_log_record *records;
+    uint32_t mask;
+
+    /* Only touched by the I/O thread */
+    unsigned int sample_counter;
+    uint64_t dropped;
+
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+};
+
+enum target_type {
+    TARGET_FD,
+    TARGET_PIPE,
+    TARGET_UDP,
+};
+
+#define OUTPUT_BUFFER_SIZE 65536
+/* Worst case: every character of the path is escaped. */
+#define MAX_LINE_SIZE (256 + ACCESS_LOG_PATH_MAX * 4)
+
+static struct {
+    bool enabled;
+    bool log_errors;
+    unsigned int sample;
+    uint32_t ring_size;
+    unsigned int flush_interval_ms;
+
+    enum target_type target_type;
+    int fd;
+    FILE *pipe;
+
+    struct lwan_access_log_ring **rings;
+    size_t n_rings;
+    uint64_t reported_dropped;
+
+    pthread_t self;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool running;
+
+    int64_t cached_time;
+    char cached_date[sizeof("[10/Oct/2000:13:55:36 +0000]")];
+
+    size_t output_len;
+    char output[OUTPUT_BUFFER_SIZE];
+} access_log = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int open_udp_target(const char *target)
+{
+    char *host = strdupa(target);
+    char *port = strrchr(host, ':');
+    struct addrinfo hints = {.ai_socktype = SOCK_DGRAM};
+    struct addrinfo *addrs, *addr;
+    int fd = -1;
+
+    if (!port)
+        return -1;
+    *port++ = '\0';
+
+    if (*host == '[') {
+        char *end = strchr(++host, ']');
+
+        if (!end)
+            return -1;
+        *end = '\0';
+    }
+
+    if (getaddrinfo(host, port, &hints, &addrs))
+        return -1;
+
+    for (addr = addrs; addr; addr = addr->ai_next) {
+        fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC,
+                    addr->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        if (!connect(fd, addr->ai_addr, addr->ai_addrlen))
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(addrs);
+    return fd;
+}
+
+static bool open_target(struct config *c, const char *target)
+{
+    if (!strncmp(target, "udp:", sizeof("udp:") - 1)) {
+        access_log.target_type = TARGET_UDP;
+        access_log.fd = open_udp_target(target + sizeof("udp:") - 1);
+        if (access_log.fd < 0) {
+            config_error(c, "Could not open UDP access log target: %s", target);
+            return false;
+        }
+    } else if (*target == '|') {
+        access_log.target_type = TARGET_PIPE;
+        access_log.pipe = popen(target + 1, "we");
+        if (!access_log.pipe) {
+            config_error(c, "Could not run access log command: %s", target + 1);
+            return false;
+        }
+        access_log.fd = fileno(access_log.pipe);
+    } else if (streq(target, "-")) {
+        access_log.target_type = TARGET_FD;
+        access_log.fd = dup(STDOUT_FILENO);
+        if (access_log.fd < 0) {
+            config_error(c, "Could not duplicate standard output");
+            return false;
+        }
+    } else {
+        access_log.target_type = TARGET_FD;
+        access_log.fd =
+            open(target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+        if (access_log.fd < 0) {
+            config_error(c, "Could not open access log file %s: %s", target,
+                         strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void lwan_access_log_parse_config(struct config *c)
+{
+    const struct config_line *l;
+    char *target = NULL;
+    long value;
+
+    if (access_log.enabled) {
+        config_error(c, "Only one access_log section can be declared");
+        return;
+    }
+
+    access_log.log_errors = true;
+    access_log.sample = 1;
+    access_log.ring_size = 4096;
+    access_log.flush_interval_ms = 100;
+
+    while ((l = config_read_line(c))) {
+        switch (l->type) {
+        case CONFIG_LINE_TYPE_LINE:
+            if (streq(l->key, "target")) {
+                free(target);
+                target = strdup(l->value);
+                if (!target)
+                    lwan_status_critical("Could not allocate memory");
+            } else if (streq(l->key, "sample")) {
+                value = parse_long(l->value, 0);
+                if (value <= 0 || value > 1000000) {
+                    config_error(c, "Sample must be between 1 and 1000000");
+                    goto out;
+                }
+                access_log.sample = (unsigned int)value;
+            } else if (streq(l->key, "log_errors")) {
+                access_log.log_errors = parse_bool(l->value, true);
+            } else if (streq(l->key, "buffer_size")) {
+                value = parse_long(l->value, 0);
+                if (value < 16 || value > 1 << 20) {
+                    config_error(c, "Buffer size must be between 16 and %d",
+                                 1 << 20);
+                    goto out;
+                }
+                access_log.ring_size = (uint32_t)lwan_nextpow2((size_t)value);
+            } else if (streq(l->key, "flush_interval")) {
+                value = parse_long(l->value, 0);
+                if (value <= 0 || value > 60000) {
+                    config_error(c, "Flush interval must be between 1 and "
+                                    "60000 milliseconds");
+                    goto out;
+                }
+                access_log.flush_interval_ms = (unsigned int)value;
+            } else {
+                config_error(c, "Unknown access log option: %s", l->key);
+                goto out;
+            }
+            break;
+
+        case CONFIG_LINE_TYPE_SECTION:
+            config_error(c, "Unexpected section: %s", l->key);
+            goto out;
+
+        case CONFIG_LINE_TYPE_SECTION_END:
+            if (!target) {
+                config_error(c, "Access log needs a target");
+                goto out;
+            }
+            if (open_target(c, target))
+                access_log.enabled = true;
+            goto out;
+        }
+    }
+
+    config_error(c, "Could not find end of access log section");
+
+out:
+    free(target);
+}
+
+struct lwan_access_log_ring *lwan_access_log_ring_new(void)
+{
+    struct lwan_access_log_ring *ring, **rings;
+
+    if (!access_log.enabled)
+        return NULL;
+
+    ring = lwan_aligned_alloc(sizeof(*ring), 64);
+    if (!ring)
+        lwan_status_critical("Could not allocate access log ring");
+    memset(ring, 0, sizeof(*ring));
+
+    ring->records = calloc(access_log.ring_size, sizeof(*ring->records));
+    if (!ring->records)
+        lwan_status_critical("Could not allocate access log records");
+    ring->mask = access_log.ring_size - 1;
+
+    rings = realloc(access_log.rings,
+                    (access_log.n_rings + 1) * sizeof(*access_log.rings));
+    if (!rings)
+        lwan_status_critical("Could not allocate access log rings");
+    rings[access_log.n_rings++] = ring;
+    access_log.rings = rings;
+
+    return ring;
+}
+
+void lwan_access_log_request(struct lwan_access_log_ring *ring,
+                             struct lwan_request *request,
+                             enum lwan_http_status status)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    struct access_log_record *record;
+    struct timespec ts;
+    uint32_t head;
+
+    if (!access_log.log_errors || status < HTTP_BAD_REQUEST) {
+        if (++ring->sample_counter < access_log.sample)
+            return;
+        ring->sample_counter = 0;
+    }
+
+    head = ring->head;
+    if (UNLIKELY(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >
+                 ring->mask)) {
+        ring->dropped++;
+        return;
+    }
+
+    record = &ring->records[head & ring->mask];
+
+#if defined(CLOCK_REALTIME_COARSE)
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+    record->time = ts.tv_sec;
+
+    if (request->flags & REQUEST_PROXIED) {
+        memcpy(&addr, &request->proxy->from, sizeof(request->proxy->from));
+    } else if (UNLIKELY(getpeername(request->fd, (struct sockaddr *)&addr,
+                                    &addr_len) < 0)) {
+        addr.ss_family = AF_UNSPEC;
+    }
+
+    record->family = (uint8_t)addr.ss_family;
+    if (addr.ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)&addr;
+        memcpy(record->address, &in->sin_addr, sizeof(in->sin_addr));
+    } else if (addr.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)&addr;
+        memcpy(record->address, &in6->sin6_addr, sizeof(in6->sin6_addr));
+    }
+
+    record->status = (uint16_t)status;
+    record->method = (uint8_t)lwan_request_get_method(request);
+    record->is_http_1_0 = !!(request->flags & REQUEST_IS_HTTP_1_0);
+    record->path_len =
+        (uint8_t)LWAN_MIN(request->original_url.len, sizeof(record->path));
+    memcpy(record->path, request->original_url.value, record->path_len);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static const char *method_name(uint8_t method)
+{
+#define GENERATE_CASE_STMT(upper, lower, mask, constant)                       \
+    case REQUEST_METHOD_##upper:                                               \
+        return #upper;
+
+    switch (method) {
+        FOR_EACH_REQUEST_METHOD(GENERATE_CASE_STMT)
+    default:
+        return "UNKNOWN";
+    }
+
+#undef GENERATE_CASE_STMT
+}
+
+static const char *format_date(int64_t t)
+{
+    if (t != access_log.cached_time) {
+        time_t tt = (time_t)t;
+        struct tm tm;
+
+        if (!gmtime_r(&tt, &tm) ||
+            !strftime(access_log.cached_date, sizeof(access_log.cached_date),
+                      "[%d/%b/%Y:%H:%M:%S +0000]", &tm)) {
+            strcpy(access_log.cached_date, "[-]");
+        }
+
+        access_log.cached_time = t;
+    }
+
+    return access_log.cached_date;
+}
+
+/* Formats a record in the Common Log Format.  Paths are escaped so that
+ * requests can't forge log lines. */
+static size_t format_record(const struct access_log_record *record, char *out)
+{
+    static const char hex[] = "0123456789abcdef";
+    char address[INET6_ADDRSTRLEN];
+    char *p = out;
+
+    if (record->family == AF_UNIX)
+        strcpy(address, "unix:");
+    else if (!inet_ntop(record->family, record->address, address,
+                        sizeof(address)))
+        strcpy(address, "-");
+
+    p += sprintf(p, "%s - - %s \"%s ", address, format_date(record->time),
+                 method_name(record->method));
+
+    for (uint8_t i = 0; i < record->path_len; i++) {
+        const unsigned char c = (unsigned char)record->path[i];
+
+        if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = 'x';
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 15];
+        } else {
+            *p++ = (char)c;
+        }
+    }
+
+    p += sprintf(p, " HTTP/%s\" %d -\n", record->is_http_1_0 ? "1.0" : "1.1",
+                 record->status);
+
+    return (size_t)(p - out);
+}
+
+static void flush_output(void)
+{
+    const char *p = access_log.output;
+    size_t len = access_log.output_len;
+
+    while (len) {
+        ssize_t written = write(access_log.fd, p, len);
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+
+            /* Nobody to tell but the console; don't retry, as it'd
+             * only make records pile up in the rings. */
+            lwan_status_perror("Could not write to access log");
+            break;
+        }
+
+        p += written;
+        len -= (size_t)written;
+    }
+
+    access_log.output_len = 0;
+}
+
+static void write_record(const struct access_log_record *record)
+{
+    if (access_log.target_type == TARGET_UDP) {
+        /* One syslog message (facility local0, severity info) per
+         * datagram. */
+        char line[sizeof("<134>lwan: ") + MAX_LINE_SIZE];
+        size_t len = sizeof("<134>lwan: ") - 1;
+
+        memcpy(line, "<134>lwan: ", len);
+        len += format_record(record, line + len) - 1;
+
+        if (send(access_log.fd, line, len, MSG_DONTWAIT) < 0 &&
+            errno != EAGAIN && errno != ECONNREFUSED)
+            lwan_status_perror("Could not send access log message");
+
+        return;
+    }
+
+    if (access_log.output_len + MAX_LINE_SIZE > sizeof(access_log.output))
+        flush_output();
+
+    access_log.output_len += format_record(
+        record, access_log.output + access_log.output_len);
+}
+
+static void drain_rings(void)
+{
+    uint64_t dropped = 0;
+
+    for (size_t i = 0; i < access_log.n_rings; i++) {
+        struct lwan_access_log_ring *ring = access_log.rings[i];
+        const uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint32_t tail = ring->tail;
+
+        for (; tail != head; tail++)
+            write_record(&ring->records[tail & ring->mask]);
+
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        dropped += ATOMIC_READ(ring->dropped);
+    }
+
+    if (access_log.output_len)
+        flush_output();
+
+    if (UNLIKELY(dropped != access_log.reported_dropped)) {
+        lwan_status_warning("Access log buffers were full; %" PRIu64
+                            " records dropped so far",
+                            dropped);
+        access_log.reported_dropped = dropped;
+    }
+}
+
+static void *logger_thread(void *data __attribute__((unused)))
+{
+    lwan_set_thread_name("access-log");
+
+    pthread_mutex_lock(&access_log.lock);
+
+    while (access_log.running) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)(access_log.flush_interval_ms % 1000) * 1000000;
+        deadline.tv_sec += access_log.flush_interval_ms / 1000 +
+                           deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+
+        pthread_cond_timedwait(&access_log.cond, &access_log.lock, &deadline);
+
+        drain_rings();
+    }
+
+    pthread_mutex_unlock(&access_log.lock);
+
+    return NULL;
+}
+
+void lwan_access_log_start(void)
+{
+    if (!access_log.enabled)
+        return;
+
+    lwan_status_debug("Starting access log thread");
+
+    access_log.running = true;
+    if (pthread_create(&access_log.self, NULL, logger_thread, NULL))
+        lwan_status_critical_perror("pthread_create");
+}
+
+void lwan_access_log_shutdown(void)
+{
+    if (!access_log.enabled)
+        return;
+
+    lwan_status_debug("Shutting down access log thread");
+
+    pthread_mutex_lock(&access_log.lock);
+    access_log.running = false;
+    pthread_cond_signal(&access_log.cond);
+    pthread_mutex_unlock(&access_log.lock);
+
+    pthread_join(access_log.self, NULL);
+
+    /* I/O threads are gone by now; write whatever they left behind. */
+    drain_rings();
+
+    for (size_t i = 0; i < access_log.n_rings; i++) {
+        free(access_log.rings[i]->records);
+        free(access_log.rings[i]);
+    }
+    free(access_log.rings);
+    access_log.rings = NULL;
+    access_log.n_rings = 0;
+
+    if (access_log.pipe)
+        pclose(access_log.pipe);
+    else
+        close(access_log.fd);
+    access_log.pipe = NULL;
+    access_log.fd = -1;
+
+    access_log.enabled = false;
+}
@@ -0,0 +1,43 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "lwan.h"
+
+struct config;
+struct lwan_access_log_ring;
+
+/* Parses the top-level `access_log` section, opening its target right
+ * away (so it happens before the straitjacket is enforced, if it's
+ * declared later in the configuration file). */
+void lwan_access_log_parse_config(struct config *c);
+
+/* Each I/O thread gets its own ring; NULL if access logging is disabled. */
+struct lwan_access_log_ring *lwan_access_log_ring_new(void);
+
+/* The logger thread is started after all rings have been created, and
+ * flushes whatever is left in them when shut down. */
+void lwan_access_log_start(void);
+void lwan_access_log_shutdown(void);
+
+/* Only called by the I/O thread owning @ring. */
+void lwan_access_log_request(struct lwan_access_log_ring *ring,
+                             struct lwan_request *request,
+                             enum lwan_http_status status);
@@ -0,0 +1,64 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Asset packs are written by the packassets tool and served by serve_files
+ * straight from memory.  A pack is a header, followed by an array of
+ * entries sorted by key (as in strcmp()), followed by the keys and the
+ * contents of every file.  Offsets are relative to the start of the pack,
+ * and everything is in the byte order of the machine that wrote it. */
+
+#define ASSET_PACK_MAGIC "LWANPACK"
+#define ASSET_PACK_VERSION 1
+
+enum asset_pack_variant {
+    ASSET_PACK_IDENTITY,
+    ASSET_PACK_DEFLATE,
+    ASSET_PACK_GZIP,
+    ASSET_PACK_BROTLI,
+    ASSET_PACK_ZSTD,
+
+    ASSET_PACK_N_VARIANTS
+};
+
+struct asset_pack_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_entries;
+};
+
+struct asset_pack_entry {
+    /* NUL-terminated path, relative to the packed directory */
+    uint64_t key_offset;
+    int64_t mtime;
+
+    /* Compressed variants are only present (non-zero length) if they're
+     * smaller than the file itself. */
+    struct {
+        uint64_t offset;
+        uint64_t len;
+    } variants[ASSET_PACK_N_VARIANTS];
+
+    /* NUL-terminated, ready to be sent as Last-Modified and ETag */
+    char last_modified[32];
+    char etag[24];
+};
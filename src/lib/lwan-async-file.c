@@ -0,0 +1,218 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+#include "lwan-uring.h"
+
+/* Regular files are always "ready" as far as poll() is concerned, so
+ * lwan_request_async_read() would block the I/O thread on disk I/O.  These
+ * functions suspend the coroutine instead: if the thread is driven by
+ * io_uring, the read or write is submitted to its ring and the request is
+ * resumed by the event loop once it completes; otherwise, pread() or
+ * pwrite() are called by the pool of threads for blocking calls.
+ *
+ * The kernel might still be using the buffer passed to io_uring after the
+ * coroutine is destroyed (e.g. if the connection times out), so that
+ * buffer is owned by the operation itself, which is freed by whoever
+ * finishes with it last; data is copied to or from the caller's buffer. */
+
+struct file_io {
+    int fd;
+    bool write;
+    void *buf;
+    size_t len;
+    off_t offset;
+
+    ssize_t result;
+    int error;
+};
+
+static void *file_io_blocking(void *data)
+{
+    struct file_io *io = data;
+
+    do {
+        io->result = io->write ? pwrite(io->fd, io->buf, io->len, io->offset)
+                               : pread(io->fd, io->buf, io->len, io->offset);
+    } while (io->result < 0 && errno == EINTR);
+
+    io->error = io->result < 0 ? errno : 0;
+
+    return io;
+}
+
+#if defined(HAVE_IO_URING)
+struct uring_file_op {
+    struct lwan_request *request;
+    int32_t result;
+    bool done;
+    bool abandoned;
+    char buffer[];
+};
+
+/* Set if the kernel doesn't know about IORING_OP_READ/WRITE (< 5.6). */
+static bool uring_file_io_unsupported;
+
+struct lwan_request *lwan_async_file_uring_done(void *data, int32_t result)
+{
+    struct uring_file_op *op = data;
+
+    /* Both this and the coroutine run in the same I/O thread. */
+    if (UNLIKELY(op->abandoned)) {
+        free(op);
+        return NULL;
+    }
+
+    op->result = result;
+    op->done = true;
+    return op->request;
+}
+
+static void finish_uring_file_op(void *data)
+{
+    struct uring_file_op *op = data;
+
+    if (LIKELY(op->done))
+        free(op);
+    else
+        op->abandoned = true;
+}
+
+static bool uring_file_io(struct lwan_request *request, struct file_io *io)
+{
+    struct lwan_uring *ring = request->conn->thread->uring;
+    struct coro *coro = request->conn->coro;
+    struct uring_file_op *op;
+    struct io_uring_sqe *sqe;
+    size_t generation;
+
+    if (!ring || uring_file_io_unsupported)
+        return false;
+
+    /* Short reads and writes are fine, as with pread() and pwrite(). */
+    if (io->len > INT32_MAX)
+        io->len = INT32_MAX;
+
+    op = malloc(sizeof(*op) + io->len);
+    if (UNLIKELY(!op))
+        return false;
+
+    sqe = lwan_uring_get_sqe(ring);
+    if (UNLIKELY(!sqe)) {
+        free(op);
+        return false;
+    }
+
+    *op = (struct uring_file_op){.request = request};
+    if (io->write)
+        memcpy(op->buffer, io->buf, io->len);
+
+    sqe->opcode = io->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = io->fd;
+    sqe->addr = (uint64_t)(uintptr_t)op->buffer;
+    sqe->len = (uint32_t)io->len;
+    sqe->off = (uint64_t)io->offset;
+    sqe->user_data = (uint64_t)(uintptr_t)op | LWAN_URING_FILE_IO;
+
+    generation = coro_deferred_get_generation(coro);
+    coro_defer(coro, finish_uring_file_op, op);
+
+    /* Submitted along with everything else once the thread waits for
+     * completions. */
+    while (!op->done)
+        coro_yield(coro, CONN_CORO_SUSPEND);
+
+    if (UNLIKELY(op->result == -EINVAL)) {
+        /* Either an invalid argument, or an old kernel; in the latter case,
+         * nothing will ever be read using io_uring, so stop trying. */
+        struct file_io probe = *io;
+
+        file_io_blocking(&probe);
+        if (probe.error != EINVAL)
+            uring_file_io_unsupported = true;
+        *io = probe;
+    } else if (op->result < 0) {
+        io->result = -1;
+        io->error = -op->result;
+    } else {
+        io->result = op->result;
+        io->error = 0;
+        if (!io->write)
+            memcpy(io->buf, op->buffer, (size_t)op->result);
+    }
+
+    coro_deferred_run(coro, generation);
+    return true;
+}
+#else
+static bool uring_file_io(struct lwan_request *request __attribute__((unused)),
+                          struct file_io *io __attribute__((unused)))
+{
+    return false;
+}
+#endif
+
+static ssize_t file_io(struct lwan_request *request, struct file_io *io)
+{
+    if (!uring_file_io(request, io))
+        lwan_request_run_blocking(request, file_io_blocking, io);
+
+    if (io->result < 0)
+        errno = io->error;
+    return io->result;
+}
+
+ssize_t lwan_request_async_pread(struct lwan_request *request,
+                                 int fd,
+                                 void *buf,
+                                 size_t len,
+                                 off_t offset)
+{
+    struct file_io io = {
+        .fd = fd,
+        .buf = buf,
+        .len = len,
+        .offset = offset,
+    };
+
+    return file_io(request, &io);
+}
+
+ssize_t lwan_request_async_pwrite(struct lwan_request *request,
+                                  int fd,
+                                  const void *buf,
+                                  size_t len,
+                                  off_t offset)
+{
+    struct file_io io = {
+        .fd = fd,
+        .write = true,
+        .buf = (void *)buf,
+        .len = len,
+        .offset = offset,
+    };
+
+    return file_io(request, &io);
+}
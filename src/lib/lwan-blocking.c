@@ -0,0 +1,205 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "lwan-private.h"
+#include "lwan-io-wrappers.h"
+#include "list.h"
+
+/* Calls made with lwan_request_run_blocking() are queued for a small pool
+ * of threads, while the calling coroutine is suspended.  Once a call
+ * returns, its request is woken up through the nudge eventfd of the I/O
+ * thread owning it, like subscribers of a pubsub topic are.  Calls live in
+ * the stack of their coroutines; if a coroutine is destroyed while its
+ * call is still queued, the call is dequeued, and if it's already running,
+ * the I/O thread waits for it to return, as the function being called
+ * might be using memory that would be freed otherwise. */
+
+enum blocking_call_state {
+    CALL_QUEUED,
+    CALL_RUNNING,
+    CALL_DONE,
+};
+
+struct blocking_call {
+    struct list_node calls;
+    struct lwan_thread_wakeup wakeup;
+
+    void *(*func)(void *data);
+    void *data;
+    void *result;
+
+    enum blocking_call_state state;
+    bool abandoned;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;      /* Signaled when a call is queued */
+    pthread_cond_t done_cond; /* Signaled when an abandoned call returns */
+    struct list_head calls;
+    pthread_t *threads;
+    unsigned int n_threads;
+    bool running;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *blocking_pool_thread(void *data __attribute__((unused)))
+{
+    lwan_set_thread_name("blocking");
+
+    while (true) {
+        struct blocking_call *call;
+        void *result;
+
+        pthread_mutex_lock(&pool.lock);
+        while (list_empty(&pool.calls) && pool.running)
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        call = list_pop(&pool.calls, struct blocking_call, calls);
+        if (call)
+            call->state = CALL_RUNNING;
+        pthread_mutex_unlock(&pool.lock);
+
+        if (!call)
+            break;
+
+        result = call->func(call->data);
+
+        /* The call can't go away while the lock is held, as its coroutine
+         * takes it before returning. */
+        pthread_mutex_lock(&pool.lock);
+        call->result = result;
+        __atomic_store_n(&call->state, CALL_DONE, __ATOMIC_RELEASE);
+        if (call->abandoned)
+            pthread_cond_broadcast(&pool.done_cond);
+        else
+            lwan_thread_wake(&call->wakeup);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    return NULL;
+}
+
+void lwan_blocking_init(unsigned int n_threads)
+{
+    assert(!pool.running);
+    assert(n_threads > 0);
+
+    lwan_status_debug("Starting %u threads for blocking calls", n_threads);
+
+    pool.threads = calloc(n_threads, sizeof(*pool.threads));
+    if (!pool.threads)
+        lwan_status_critical_perror("calloc");
+
+    list_head_init(&pool.calls);
+    pool.running = true;
+
+    for (unsigned int i = 0; i < n_threads; i++) {
+        if (pthread_create(&pool.threads[i], NULL, blocking_pool_thread, NULL))
+            lwan_status_critical_perror("pthread_create");
+    }
+
+    pool.n_threads = n_threads;
+}
+
+void lwan_blocking_shutdown(void)
+{
+    if (!pool.n_threads)
+        return;
+
+    lwan_status_debug("Shutting down threads for blocking calls");
+
+    pthread_mutex_lock(&pool.lock);
+    pool.running = false;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (unsigned int i = 0; i < pool.n_threads; i++)
+        pthread_join(pool.threads[i], NULL);
+
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.n_threads = 0;
+}
+
+static void finish_call(void *data)
+{
+    struct blocking_call *call = data;
+
+    pthread_mutex_lock(&pool.lock);
+    switch (call->state) {
+    case CALL_QUEUED:
+        list_del_from(&pool.calls, &call->calls);
+        break;
+    case CALL_RUNNING:
+        call->abandoned = true;
+        while (call->state != CALL_DONE)
+            pthread_cond_wait(&pool.done_cond, &pool.lock);
+        break;
+    case CALL_DONE:
+        /* Might still be queued if the coroutine was resumed for another
+         * reason before the thread got to look at its wakeups. */
+        lwan_thread_cancel_wake(&call->wakeup);
+        break;
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void *lwan_request_run_blocking(struct lwan_request *request,
+                                void *(*func)(void *data),
+                                void *data)
+{
+    struct coro *coro = request->conn->coro;
+    struct blocking_call call = {
+        .wakeup = {.request = request},
+        .func = func,
+        .data = data,
+        .state = CALL_QUEUED,
+    };
+    size_t generation;
+
+    /* Without the pool (e.g. in fuzzers), just block. */
+    if (UNLIKELY(!pool.n_threads))
+        return func(data);
+
+    /* Anything queued is sent before sleeping, as in lwan_request_sleep(). */
+    lwan_send_queued_responses(request);
+
+    generation = coro_deferred_get_generation(coro);
+    coro_defer(coro, finish_call, &call);
+
+    pthread_mutex_lock(&pool.lock);
+    list_add_tail(&pool.calls, &call.calls);
+    pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    while (__atomic_load_n(&call.state, __ATOMIC_ACQUIRE) != CALL_DONE)
+        coro_yield(coro, CONN_CORO_SUSPEND);
+
+    coro_deferred_run(coro, generation);
+
+    return call.result;
+}
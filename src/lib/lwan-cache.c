@@ -19,30 +19,46 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+
+#if defined(HAVE_EVENTFD)
+#include <sys/eventfd.h>
+#endif
 
 #include "lwan-private.h"
 
 #include "lwan-cache.h"
 #include "hash.h"
+#include "lwan-probes.h"
 
 #define GET_AND_REF_TRIES 5
 
 enum {
     /* Entry flags */
     FLOATING = 1 << 0,
-    TEMPORARY = 1 << 1,
-    FREE_KEY_ON_DESTROY = 1 << 2,
+    /* Set when an entry is found; see evict_over_budget() */
+    REFERENCED = 1 << 1,
+    /* Expired, but still served; see cache_set_stale_while_revalidate() */
+    STALE = 1 << 2,
+    REVALIDATE = 1 << 3,
 
     /* Cache flags */
-    SHUTTING_DOWN = 1 << 0
+    SHUTTING_DOWN = 1 << 0,
+    THREAD_CACHE = 1 << 1,
 };
 
-struct cache {
+/* Entries are spread over a number of shards, each with its own locks and
+ * pruning queue, so that threads looking up different keys don't contend
+ * on (or bounce the cache line of) a single lock. */
+#define CACHE_N_SHARDS 16
+
+struct cache_shard {
     struct {
         struct hash *table;
         pthread_rwlock_t lock;
@@ -53,16 +69,76 @@ struct cache {
         pthread_rwlock_t lock;
     } queue;
 
+    /* Held by the pruner while it works on a detached copy of the queue,
+     * and by cache_invalidate() so that it always sees every entry. */
+    pthread_mutex_t prune_lock;
+
+    /* Expired entries that are still in the hash table, in the order they
+     * expired.  Protected by the prune lock. */
+    struct list_head stale;
+
+    /* Bytes held by entries in this shard; see cache_set_max_size() */
+    size_t size;
+
+    /* Keys that couldn't be created, oldest first; see
+     * cache_set_negative_time_to_live().  Protected by the hash lock. */
+    struct {
+        struct hash *table;
+        struct list_head list;
+        unsigned int count;
+    } negative;
+} __attribute__((aligned(64)));
+
+struct negative_entry {
+    struct list_node entries;
+    time_t time_to_expire;
+    char key[];
+};
+
+struct cache {
+    struct cache_shard shards[CACHE_N_SHARDS];
+
+    /* See cache_set_name() and cache_stats_for_each() */
+    struct list_node caches;
+    char *name;
+
+    /* Incremented by cache_invalidate(); entries that were being created
+     * while the cache was invalidated might be stale, so they're not
+     * added to the hash table. */
+    unsigned int generation;
+
+    /* Entries being created by the async pool, keyed by cache key */
+    struct {
+        struct hash *table;
+        pthread_mutex_t lock;
+        pthread_cond_t finished;
+    } pending;
+
     struct {
         cache_create_entry_cb create_entry;
         cache_destroy_entry_cb destroy_entry;
+        cache_should_renew_entry_cb should_renew;
+        cache_serialize_entry_cb serialize_entry;
         void *context;
     } cb;
 
     struct {
         time_t time_to_live;
+        time_t grace_period;
+        time_t negative_time_to_live;
+        unsigned int max_shard_negative;
     } settings;
 
+    /* See cache_set_max_size(); the budget is split evenly among shards */
+    struct {
+        size_t max_size;
+        size_t max_shard_size;
+        cache_entry_size_cb entry_size;
+        /* Set when the pruner has been woken up to evict entries that
+         * couldn't be evicted when they were added */
+        bool prune_requested;
+    } budget;
+
     unsigned flags;
 
 #ifndef NDEBUG
@@ -74,31 +150,160 @@ struct cache {
 #endif
 };
 
+/* Entry creation for cache_coro_get_and_ref_entry_async().  Creating an
+ * entry might be expensive (e.g. opening, mapping and compressing a file),
+ * so it's performed by a small pool of threads instead of stalling every
+ * other connection handled by the I/O thread.  Coroutines waiting for an
+ * entry sleep on a file descriptor of their own, which is signaled once
+ * the entry has been created; concurrent requests for the same key share
+ * the same creation job.  Entries being created by cache_get_and_ref_entry()
+ * are tracked the same way, so that a key is only created once at a time
+ * regardless of how it's requested. */
+struct cache_pending {
+    struct list_node jobs;
+    struct list_head waiters;
+    struct cache *cache;
+    char *key;
+    unsigned int hash;
+};
+
+struct cache_waiter {
+    struct list_node waiters;
+    struct cache *cache;
+    struct cache_entry *entry;
+    bool done;
+    int fd[2];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct list_head jobs;
+    pthread_t *threads;
+    unsigned int n_threads;
+    bool running;
+} async_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Set in threads of the async pool: only they can wait for peers to send
+ * entries; see cache_peer_fetch(). */
+static __thread bool in_async_pool;
+
 static bool cache_pruner_job(void *data);
 
+static struct list_head all_caches = {{&all_caches.n, &all_caches.n}};
+static pthread_mutex_t all_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned int cache_key_hash(const char *key)
+{
+    /* The same hash value is used to pick a shard, a slot in the per-thread
+     * cache, and a slot in both the shard and the pending hash tables. */
+    return hash_str_value(key);
+}
+
+static struct cache_shard *get_shard(struct cache *cache, unsigned int hash)
+{
+    /* The hash table uses the lower bits of the hash to pick a group of
+     * slots, and the upper 7 bits to tell the slots in a group apart, so
+     * use the bits right below those here: otherwise, all keys in a shard
+     * would end up in a fraction of the slots of its table. */
+    static_assert((CACHE_N_SHARDS & (CACHE_N_SHARDS - 1)) == 0,
+                  "Number of shards is a power of 2");
+    const unsigned int shift =
+        sizeof(hash) * 8 - 7 - (unsigned int)__builtin_ctz(CACHE_N_SHARDS);
+
+    return &cache->shards[(hash >> shift) & (CACHE_N_SHARDS - 1)];
+}
+
+static bool shard_init(struct cache_shard *shard)
+{
+    shard->hash.table = hash_str_new(free, NULL);
+    if (!shard->hash.table)
+        return false;
+
+    if (pthread_rwlock_init(&shard->hash.lock, NULL))
+        goto error_no_hash_lock;
+    if (pthread_rwlock_init(&shard->queue.lock, NULL))
+        goto error_no_queue_lock;
+    if (pthread_mutex_init(&shard->prune_lock, NULL))
+        goto error_no_prune_lock;
+
+    list_head_init(&shard->queue.list);
+    list_head_init(&shard->stale);
+    list_head_init(&shard->negative.list);
+
+    return true;
+
+error_no_prune_lock:
+    pthread_rwlock_destroy(&shard->queue.lock);
+error_no_queue_lock:
+    pthread_rwlock_destroy(&shard->hash.lock);
+error_no_hash_lock:
+    hash_free(shard->hash.table);
+    return false;
+}
+
+static void remove_negative(struct cache_shard *shard,
+                            struct negative_entry *negative)
+{
+    hash_del(shard->negative.table, negative->key);
+    list_del_from(&shard->negative.list, &negative->entries);
+    shard->negative.count--;
+    free(negative);
+}
+
+static void remove_all_negatives(struct cache_shard *shard)
+{
+    struct negative_entry *negative, *next;
+
+    list_for_each_safe (&shard->negative.list, negative, next, entries)
+        remove_negative(shard, negative);
+}
+
+static void shard_destroy(struct cache_shard *shard)
+{
+    if (shard->negative.table) {
+        remove_all_negatives(shard);
+        hash_free(shard->negative.table);
+    }
+
+    pthread_rwlock_destroy(&shard->hash.lock);
+    pthread_rwlock_destroy(&shard->queue.lock);
+    pthread_mutex_destroy(&shard->prune_lock);
+    hash_free(shard->hash.table);
+}
+
 struct cache *cache_create(cache_create_entry_cb create_entry_cb,
                              cache_destroy_entry_cb destroy_entry_cb,
                              void *cb_context,
                              time_t time_to_live)
 {
     struct cache *cache;
+    size_t n_shards;
 
     assert(create_entry_cb);
     assert(destroy_entry_cb);
     assert(time_to_live > 0);
 
-    cache = calloc(1, sizeof(*cache));
+    cache = lwan_aligned_alloc(sizeof(*cache), 64);
     if (!cache)
         return NULL;
+    memset(cache, 0, sizeof(*cache));
 
-    cache->hash.table = hash_str_new(free, NULL);
-    if (!cache->hash.table)
-        goto error_no_hash;
+    for (n_shards = 0; n_shards < CACHE_N_SHARDS; n_shards++) {
+        if (!shard_init(&cache->shards[n_shards]))
+            goto error_no_shards;
+    }
 
-    if (pthread_rwlock_init(&cache->hash.lock, NULL))
-        goto error_no_hash_lock;
-    if (pthread_rwlock_init(&cache->queue.lock, NULL))
-        goto error_no_queue_lock;
+    cache->pending.table = hash_str_new(NULL, NULL);
+    if (!cache->pending.table)
+        goto error_no_shards;
+    if (pthread_mutex_init(&cache->pending.lock, NULL))
+        goto error_no_pending_lock;
+    if (pthread_cond_init(&cache->pending.finished, NULL))
+        goto error_no_pending_cond;
 
     cache->cb.create_entry = create_entry_cb;
     cache->cb.destroy_entry = destroy_entry_cb;
@@ -106,22 +311,192 @@ struct cache *cache_create(cache_create_entry_cb create_entry_cb,
 
     cache->settings.time_to_live = time_to_live;
 
-    list_head_init(&cache->queue.list);
+    lwan_job_add(cache_pruner_job, cache, "cache_pruner");
+    /* Entries expire up to half of their time to live late. */
+    lwan_job_set_interval(
+        cache_pruner_job, cache, 1000,
+        (unsigned int)LWAN_MIN(LWAN_MAX(time_to_live * 500, 1000), 16000));
 
-    lwan_job_add(cache_pruner_job, cache);
+    pthread_mutex_lock(&all_caches_lock);
+    list_add_tail(&all_caches, &cache->caches);
+    pthread_mutex_unlock(&all_caches_lock);
 
     return cache;
 
-error_no_queue_lock:
-    pthread_rwlock_destroy(&cache->hash.lock);
-error_no_hash_lock:
-    hash_free(cache->hash.table);
-error_no_hash:
+error_no_pending_cond:
+    pthread_mutex_destroy(&cache->pending.lock);
+error_no_pending_lock:
+    hash_free(cache->pending.table);
+error_no_shards:
+    while (n_shards--)
+        shard_destroy(&cache->shards[n_shards]);
     free(cache);
 
     return NULL;
 }
 
+/* Bounds the memory used by a cache: entry_size_cb() is called once for
+ * each new entry, and entries are evicted before their time to live expires
+ * if their total size goes over max_size.  With a max_size of 0, entries are
+ * only measured, so that cache_stats_for_each() can report their size.
+ * Must be called right after cache_create(), before any entry is added. */
+void cache_set_max_size(struct cache *cache,
+                        size_t max_size,
+                        cache_entry_size_cb entry_size_cb)
+{
+    assert(cache);
+    assert(!max_size || entry_size_cb);
+
+    cache->budget.max_size = max_size;
+    cache->budget.max_shard_size =
+        (max_size + CACHE_N_SHARDS - 1) / CACHE_N_SHARDS;
+    cache->budget.entry_size = entry_size_cb;
+}
+
+/* Keeps entries around for grace_period seconds after they expire: they're
+ * still returned by lookups while the pruner job creates them again, but
+ * only if they're looked up during that time.  As the pruner might take a
+ * couple of seconds to notice, the grace period shouldn't be too short.
+ * Must be called right after cache_create(). */
+void cache_set_stale_while_revalidate(struct cache *cache, time_t grace_period)
+{
+    assert(cache);
+    assert(grace_period >= 0);
+
+    cache->settings.grace_period = grace_period;
+}
+
+/* Entries for which should_renew() returns true don't expire: they get
+ * another time to live instead, and are only removed by cache_invalidate()
+ * or to stay within the budget set by cache_set_max_size().  Useful when
+ * something else notices entries going stale, and creating them again is
+ * expensive.  Must be called right after cache_create(). */
+void cache_set_should_renew(struct cache *cache,
+                            cache_should_renew_entry_cb should_renew)
+{
+    assert(cache);
+
+    cache->cb.should_renew = should_renew;
+}
+
+/* Remembers keys for which the create callback returned NULL with errno
+ * set to ENOENT: for time_to_live seconds, looking them up again fails
+ * with ENOENT without calling the callback.  At most max_entries keys are
+ * remembered, forgetting the oldest ones first, and cache_invalidate()
+ * forgets all of them.  Must be called right after cache_create(). */
+void cache_set_negative_time_to_live(struct cache *cache,
+                                     time_t time_to_live,
+                                     unsigned int max_entries)
+{
+    assert(cache);
+    assert(time_to_live >= 0);
+
+    if (!time_to_live || !max_entries)
+        return;
+
+    for (size_t i = 0; i < CACHE_N_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+
+        shard->negative.table = hash_str_new(NULL, NULL);
+        if (!shard->negative.table) {
+            lwan_status_warning("Could not allocate memory to remember "
+                                "missing keys");
+            while (i--) {
+                hash_free(cache->shards[i].negative.table);
+                cache->shards[i].negative.table = NULL;
+            }
+            return;
+        }
+    }
+
+    cache->settings.negative_time_to_live = time_to_live;
+    cache->settings.max_shard_negative =
+        LWAN_MAX(max_entries / CACHE_N_SHARDS, 1u);
+}
+
+/* Names the cache in cache_stats_for_each(), e.g. for the status module.
+ * The name is copied. */
+void cache_set_name(struct cache *cache, const char *name)
+{
+    assert(cache);
+
+    char *old_name = cache->name;
+    char *new_name = strdup(name);
+
+    if (!new_name)
+        return;
+
+    /* The pruner job shows up with the name of the cache as well. */
+    lwan_job_set_name(cache_pruner_job, cache, new_name);
+
+    pthread_mutex_lock(&all_caches_lock);
+    cache->name = new_name;
+    pthread_mutex_unlock(&all_caches_lock);
+
+    free(old_name);
+}
+
+/* Lets other instances in the cache_peers group (see
+ * lwan-mod-cache-peers.c) ask this one for the entries it owns, serialized
+ * by serialize_entry(), which returns false for entries that can't be
+ * sent.  The create_entry callback decides what to do with what it gets
+ * from cache_peer_fetch().  Caches are found by name, which has to be set
+ * with cache_set_name() and be the same in every instance. */
+void cache_set_peer_fill(struct cache *cache,
+                         cache_serialize_entry_cb serialize_entry)
+{
+    assert(cache);
+
+    cache->cb.serialize_entry = serialize_entry;
+}
+
+struct cache *lwan_cache_find_by_name(const char *name)
+{
+    struct cache *cache, *found = NULL;
+
+    pthread_mutex_lock(&all_caches_lock);
+    list_for_each (&all_caches, cache, caches) {
+        if (cache->name && streq(cache->name, name)) {
+            found = cache;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&all_caches_lock);
+
+    return found;
+}
+
+bool lwan_cache_serialize_entry(struct cache *cache,
+                                const struct cache_entry *entry,
+                                struct lwan_strbuf *buf)
+{
+    if (!cache->cb.serialize_entry)
+        return false;
+
+    return cache->cb.serialize_entry(entry, buf, cache->cb.context);
+}
+
+bool cache_peer_fetch(struct cache *cache,
+                      const char *key,
+                      struct lwan_value *serialized)
+{
+    if (!in_async_pool || !cache->cb.serialize_entry || !cache->name)
+        return false;
+
+    return lwan_cache_peers_fetch(cache->name, key, serialized);
+}
+
+/* Lets worker threads keep references to entries of this cache they've
+ * recently used, so that looking them up again with the coroutine variants
+ * of cache_get_and_ref_entry() only touches thread-local memory.  Entries
+ * might be kept alive for a while after being evicted from the cache. */
+void cache_enable_thread_cache(struct cache *cache)
+{
+    assert(cache);
+
+    cache->flags |= THREAD_CACHE;
+}
+
 void cache_destroy(struct cache *cache)
 {
     assert(cache);
@@ -132,20 +507,204 @@ void cache_destroy(struct cache *cache)
                       cache->stats.evicted);
 #endif
 
+    /* Entries being created by the async pool would be added to this
+     * cache once they're ready, so wait for them. */
+    pthread_mutex_lock(&cache->pending.lock);
+    while (hash_get_count(cache->pending.table))
+        pthread_cond_wait(&cache->pending.finished, &cache->pending.lock);
+    pthread_mutex_unlock(&cache->pending.lock);
+
+    pthread_mutex_lock(&all_caches_lock);
+    list_del_from(&all_caches, &cache->caches);
+    pthread_mutex_unlock(&all_caches_lock);
+
     lwan_job_del(cache_pruner_job, cache);
     cache->flags |= SHUTTING_DOWN;
     cache_pruner_job(cache);
-    pthread_rwlock_destroy(&cache->hash.lock);
-    pthread_rwlock_destroy(&cache->queue.lock);
-    hash_free(cache->hash.table);
+    for (size_t i = 0; i < CACHE_N_SHARDS; i++)
+        shard_destroy(&cache->shards[i]);
+    pthread_cond_destroy(&cache->pending.finished);
+    pthread_mutex_destroy(&cache->pending.lock);
+    hash_free(cache->pending.table);
+    free(cache->name);
     free(cache);
 }
 
-struct cache_entry *cache_get_and_ref_entry(struct cache *cache,
-                                              const char *key, int *error)
+bool cache_stats_for_each(bool (*cb)(const struct cache_stats *stats,
+                                     void *data),
+                          void *data)
+{
+    struct cache *cache;
+    bool ret = true;
+
+    pthread_mutex_lock(&all_caches_lock);
+    list_for_each (&all_caches, cache, caches) {
+        struct cache_stats stats = {
+            .name = cache->name ? cache->name : "unnamed",
+            .max_size = cache->budget.max_size,
+            .measured = cache->budget.entry_size != NULL,
+        };
+
+        for (size_t i = 0; i < CACHE_N_SHARDS; i++) {
+            struct cache_shard *shard = &cache->shards[i];
+
+            pthread_rwlock_rdlock(&shard->hash.lock);
+            stats.entries += hash_get_count(shard->hash.table);
+            pthread_rwlock_unlock(&shard->hash.lock);
+
+            stats.size += ATOMIC_READ(shard->size);
+        }
+
+        pthread_mutex_lock(&cache->pending.lock);
+        stats.pending = hash_get_count(cache->pending.table);
+        pthread_mutex_unlock(&cache->pending.lock);
+
+        if (!cb(&stats, data)) {
+            ret = false;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&all_caches_lock);
+
+    return ret;
+}
+
+static void evict_entry(struct cache *cache, struct cache_entry *node)
+{
+    if (ATOMIC_INC(node->refs) == 1) {
+        /* If the refcount was 0, and turned 1 after the increment, it means the item can
+         * be destroyed here. */
+        cache->cb.destroy_entry(node, cache->cb.context);
+    } else {
+        /* If not, some other thread had references to this object. */
+        ATOMIC_OP(&node->flags, or, FLOATING);
+        /* If in the time between the ref check above and setting the floating flag the
+         * thread holding the reference drops it, if our reference is 0 after dropping it,
+         * the pruner thread was the last thread holding the reference to this entry, so
+         * it's safe to destroy it at this point. */
+        if (!ATOMIC_DEC(node->refs))
+            cache->cb.destroy_entry(node, cache->cb.context);
+    }
+}
+
+/* Called with the prune lock, and both the hash table and the queue locks
+ * of the shard held.  Entries that have to go to bring the shard back under budget are moved
+ * to the victims list, to be destroyed by destroy_victims() once the locks
+ * are released.
+ *
+ * This is a CLOCK-like policy that keeps the queue in insertion order, as
+ * the pruner needs it to be: starting from the oldest entry, entries that
+ * have been found since they were last looked at get a second chance.  The
+ * entry that has just been added is never a victim, even if it alone goes
+ * over the budget of its shard. */
+static void evict_over_budget_locked(struct cache *cache,
+                                     struct cache_shard *shard,
+                                     struct cache_entry *newest,
+                                     struct list_head *victims)
+{
+    const size_t max_size = cache->budget.max_shard_size;
+    struct cache_entry *node, *next;
+
+    /* Entries that expired already are the first to go. */
+    list_for_each_safe (&shard->stale, node, next, entries) {
+        if (shard->size <= max_size)
+            return;
+
+        list_del_from(&shard->stale, &node->entries);
+        hash_del(shard->hash.table, node->key);
+        ATOMIC_SAF(&shard->size, node->size);
+        list_add_tail(victims, &node->entries);
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        list_for_each_safe (&shard->queue.list, node, next, entries) {
+            if (shard->size <= max_size || node == newest)
+                return;
+
+            if (node->flags & REFERENCED) {
+                ATOMIC_OP(&node->flags, and, ~REFERENCED);
+                continue;
+            }
+
+            list_del_from(&shard->queue.list, &node->entries);
+            hash_del(shard->hash.table, node->key);
+            ATOMIC_SAF(&shard->size, node->size);
+            list_add_tail(victims, &node->entries);
+        }
+    }
+}
+
+/* Called with both the hash table and the queue locks of the shard held. */
+static void evict_over_budget(struct cache *cache,
+                              struct cache_shard *shard,
+                              struct cache_entry *newest,
+                              struct list_head *victims)
+{
+    if (LIKELY(shard->size <= cache->budget.max_shard_size))
+        return;
+
+    /* If the pruner is running, most entries aren't in the queue; it'll
+     * bring the shard back under budget itself once it's done. */
+    if (pthread_mutex_trylock(&shard->prune_lock))
+        return;
+
+    evict_over_budget_locked(cache, shard, newest, victims);
+
+    pthread_mutex_unlock(&shard->prune_lock);
+}
+
+static unsigned int destroy_victims(struct cache *cache,
+                                    struct list_head *victims)
+{
+    struct cache_entry *node, *next;
+    unsigned int evicted = 0;
+
+    list_for_each_safe (victims, node, next, entries) {
+        list_del(&node->entries);
+        evict_entry(cache, node);
+        evicted++;
+    }
+
+#ifndef NDEBUG
+    if (evicted)
+        ATOMIC_AAF(&cache->stats.evicted, evicted);
+#endif
+
+    return evicted;
+}
+
+/* Called with both the hash table and the queue locks of the shard held,
+ * right after an entry has been added to both. */
+static void account_new_entry(struct cache *cache,
+                              struct cache_shard *shard,
+                              struct cache_entry *entry,
+                              struct list_head *victims)
+{
+    if (!cache->budget.entry_size)
+        return;
+
+    ATOMIC_AAF(&shard->size, entry->size);
+    if (!cache->budget.max_size)
+        return;
+
+    evict_over_budget(cache, shard, entry, victims);
+
+    /* Entries that couldn't be evicted now (e.g. because they were found
+     * recently, or because the pruner is holding them) are evicted by the
+     * pruner, which is woken up once rather than for every new entry. */
+    if (UNLIKELY(shard->size > cache->budget.max_shard_size) &&
+        __sync_bool_compare_and_swap(&cache->budget.prune_requested, false,
+                                     true))
+        lwan_job_wakeup(cache_pruner_job, cache);
+}
+
+static struct cache_entry *cache_find_and_ref_entry(struct cache *cache,
+                                                    struct cache_shard *shard,
+                                                    const char *key,
+                                                    unsigned int hash,
+                                                    int *error)
 {
     struct cache_entry *entry;
-    char *key_copy;
 
     assert(cache);
     assert(error);
@@ -156,85 +715,67 @@ struct cache_entry *cache_get_and_ref_entry(struct cache *cache,
     /* If the lock can't be obtained, return an error to allow, for instance,
      * yielding from the coroutine and trying to obtain the lock at a later
      * time. */
-    if (UNLIKELY(pthread_rwlock_tryrdlock(&cache->hash.lock) == EBUSY)) {
+    if (UNLIKELY(pthread_rwlock_tryrdlock(&shard->hash.lock) == EBUSY)) {
         *error = EWOULDBLOCK;
         return NULL;
     }
-    entry = hash_find(cache->hash.table, key);
+    entry = hash_find_hashed(shard->hash.table, key, hash);
     if (LIKELY(entry)) {
         ATOMIC_INC(entry->refs);
-        pthread_rwlock_unlock(&cache->hash.lock);
+        /* Only write to the entry if needed to avoid bouncing its cache
+         * line between threads. */
+        if (cache->budget.max_size && !(entry->flags & REFERENCED))
+            ATOMIC_OP(&entry->flags, or, REFERENCED);
+        if (UNLIKELY((entry->flags & (STALE | REVALIDATE)) == STALE))
+            ATOMIC_OP(&entry->flags, or, REVALIDATE);
+        pthread_rwlock_unlock(&shard->hash.lock);
 #ifndef NDEBUG
         ATOMIC_INC(cache->stats.hits);
 #endif
+        if (lwan_current_thread_metrics)
+            lwan_current_thread_metrics->cache_hits++;
+        LWAN_PROBE(cache_hit, cache, key);
         return entry;
     }
 
-    /* No need to keep the hash table lock locked while the item is being created. */
-    pthread_rwlock_unlock(&cache->hash.lock);
+    if (UNLIKELY(cache->settings.negative_time_to_live)) {
+        const struct negative_entry *negative =
+            hash_find_hashed(shard->negative.table, key, hash);
 
+        if (negative && lwan_clock_monotonic() < negative->time_to_expire) {
+            pthread_rwlock_unlock(&shard->hash.lock);
 #ifndef NDEBUG
-    ATOMIC_INC(cache->stats.misses);
+            ATOMIC_INC(cache->stats.hits);
 #endif
-
-    key_copy = strdup(key);
-    if (UNLIKELY(!key_copy)) {
-        *error = ENOMEM;
-        return NULL;
-    }
-
-    entry = cache->cb.create_entry(key, cache->cb.context);
-    if (UNLIKELY(!entry)) {
-        *error = ECANCELED;
-        free(key_copy);
-        return NULL;
-    }
-
-    *entry = (struct cache_entry) { .key =  key_copy, .refs = 1 };
-
-    if (pthread_rwlock_trywrlock(&cache->hash.lock) == EBUSY) {
-        /* Couldn't obtain hash write lock: instead of waiting, just return
-         * the recently-created item as a temporary item.  Might result in
-         * items not being added to the cache, though, so this might be
-         * changed back to pthread_rwlock_wrlock() again someday if this
-         * proves to be a problem.  */
-        entry->flags = TEMPORARY | FREE_KEY_ON_DESTROY;
-        return entry;
+            if (lwan_current_thread_metrics)
+                lwan_current_thread_metrics->cache_hits++;
+            LWAN_PROBE(cache_hit, cache, key);
+            *error = ENOENT;
+            return NULL;
+        }
     }
 
-    if (!hash_add_unique(cache->hash.table, entry->key, entry)) {
-        struct timespec now;
-
-        if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
-            lwan_status_critical("clock_gettime");
+    /* No need to keep the hash table lock locked while the item is being created. */
+    pthread_rwlock_unlock(&shard->hash.lock);
 
-        entry->time_to_expire = now.tv_sec + cache->settings.time_to_live;
+#ifndef NDEBUG
+    ATOMIC_INC(cache->stats.misses);
+#endif
+    if (lwan_current_thread_metrics)
+        lwan_current_thread_metrics->cache_misses++;
+    LWAN_PROBE(cache_miss, cache, key);
 
-        if (LIKELY(!pthread_rwlock_wrlock(&cache->queue.lock))) {
-            list_add_tail(&cache->queue.list, &entry->entries);
-            pthread_rwlock_unlock(&cache->queue.lock);
-        } else {
-            /* Key is freed when this entry is removed from the hash
-             * table below. */
-            entry->flags = TEMPORARY;
+    return NULL;
+}
 
-            /* Ensure item is removed from the hash table; otherwise,
-             * another thread could potentially get another reference
-             * to this entry and cause an invalid memory access. */
-            hash_del(cache->hash.table, entry->key);
-        }
-    } else {
-        /* Either there's another item with the same key (-EEXIST), or
-         * there was an error inside the hash table. In either case,
-         * just return a TEMPORARY entry so that it is destroyed the first
-         * time someone unrefs this entry. TEMPORARY entries are pretty much
-         * like FLOATING entries, but unreffing them do not use atomic
-         * operations. */
-        entry->flags = TEMPORARY | FREE_KEY_ON_DESTROY;
-    }
+/* Takes another reference to an entry that the caller already holds a
+ * reference to, e.g. to keep using it after the request that obtained it
+ * has been served.  Drop it with cache_entry_unref(). */
+void cache_entry_ref(struct cache_entry *entry)
+{
+    assert(entry);
 
-    pthread_rwlock_unlock(&cache->hash.lock);
-    return entry;
+    ATOMIC_INC(entry->refs);
 }
 
 void cache_entry_unref(struct cache *cache, struct cache_entry *entry)
@@ -242,121 +783,401 @@ void cache_entry_unref(struct cache *cache, struct cache_entry *entry)
     assert(entry);
 
     /* FIXME: There's a race condition in this function: if the cache is
-     * destroyed while there are either temporary or floating entries,
-     * calling the destroy_entry callback function will dereference
-     * deallocated memory. */
-
-    if (entry->flags & TEMPORARY) {
-        /* FREE_KEY_ON_DESTROY is set on elements that never got into the
-         * hash table, so their keys are never destroyed automatically. */
-        if (entry->flags & FREE_KEY_ON_DESTROY)
-            free(entry->key);
-
-        return cache->cb.destroy_entry(entry, cache->cb.context);
-    }
+     * destroyed while there are floating entries, calling the destroy_entry
+     * callback function will dereference deallocated memory. */
 
     if (ATOMIC_DEC(entry->refs))
         return;
 
     /* FLOATING entries without references won't be picked up by the pruner
      * job, so destroy them right here. */
-    if (entry->flags & FLOATING) {
-        assert(!(entry->flags & FREE_KEY_ON_DESTROY));
+    if (entry->flags & FLOATING)
         return cache->cb.destroy_entry(entry, cache->cb.context);
+}
+
+static void remove_expired_entry(struct cache *cache,
+                                 struct cache_shard *shard,
+                                 struct cache_entry *node)
+{
+    list_del(&node->entries);
+
+    if (UNLIKELY(pthread_rwlock_wrlock(&shard->hash.lock))) {
+        lwan_status_perror("pthread_rwlock_wrlock");
+        return;
     }
+
+    hash_del(shard->hash.table, node->key);
+    ATOMIC_SAF(&shard->size, node->size);
+
+    if (UNLIKELY(pthread_rwlock_unlock(&shard->hash.lock)))
+        lwan_status_perror("pthread_rwlock_unlock");
+
+    evict_entry(cache, node);
 }
 
-static bool cache_pruner_job(void *data)
+/* Called with the prune lock held. */
+static unsigned int prune_queue(struct cache *cache,
+                                struct cache_shard *shard,
+                                time_t now)
 {
-    struct cache *cache = data;
     struct cache_entry *node, *next;
-    struct timespec now;
     bool shutting_down = cache->flags & SHUTTING_DOWN;
-    struct list_head queue;
+    struct list_head queue, renewed;
     unsigned int evicted = 0;
 
-    if (UNLIKELY(pthread_rwlock_trywrlock(&cache->queue.lock) == EBUSY))
-        return false;
+    if (UNLIKELY(pthread_rwlock_trywrlock(&shard->queue.lock) == EBUSY))
+        return 0;
 
     /* If the queue is empty, there's nothing to do; unlock/return*/
-    if (list_empty(&cache->queue.list)) {
-        if (UNLIKELY(pthread_rwlock_unlock(&cache->queue.lock)))
+    if (list_empty(&shard->queue.list)) {
+        if (UNLIKELY(pthread_rwlock_unlock(&shard->queue.lock)))
             lwan_status_perror("pthread_rwlock_unlock");
-        return false;
+        return 0;
     }
 
     /* There are things to do; work on a local queue so the lock doesn't
      * need to be held while items are being pruned. */
     list_head_init(&queue);
-    list_append_list(&queue, &cache->queue.list);
-    list_head_init(&cache->queue.list);
+    list_head_init(&renewed);
+    list_append_list(&queue, &shard->queue.list);
+    list_head_init(&shard->queue.list);
 
-    if (UNLIKELY(pthread_rwlock_unlock(&cache->queue.lock))) {
+    if (UNLIKELY(pthread_rwlock_unlock(&shard->queue.lock))) {
         lwan_status_perror("pthread_rwlock_unlock");
-        goto end;
-    }
-
-    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0)) {
-        lwan_status_perror("clock_gettime");
-        goto end;
+        return 0;
     }
 
     list_for_each_safe(&queue, node, next, entries) {
-        char *key = node->key;
-
-        if (now.tv_sec < node->time_to_expire && LIKELY(!shutting_down))
+        if (now < node->time_to_expire && LIKELY(!shutting_down))
             break;
 
-        list_del(&node->entries);
+        if (cache->cb.should_renew && LIKELY(!shutting_down) &&
+            cache->cb.should_renew(node, cache->cb.context)) {
+            /* Expires after everything else in the queue. */
+            list_del(&node->entries);
+            node->time_to_expire = now + cache->settings.time_to_live;
+            list_add_tail(&renewed, &node->entries);
+            continue;
+        }
 
-        if (UNLIKELY(pthread_rwlock_wrlock(&cache->hash.lock))) {
-            lwan_status_perror("pthread_rwlock_wrlock");
+        if (cache->settings.grace_period && LIKELY(!shutting_down)) {
+            /* Still reachable through the hash table until it's either
+             * revalidated or its grace period is over. */
+            list_del(&node->entries);
+            node->time_to_expire = now + cache->settings.grace_period;
+            ATOMIC_OP(&node->flags, or, STALE);
+            list_add_tail(&shard->stale, &node->entries);
             continue;
         }
 
-        hash_del(cache->hash.table, key);
+        remove_expired_entry(cache, shard, node);
+        evicted++;
+    }
 
-        if (UNLIKELY(pthread_rwlock_unlock(&cache->hash.lock)))
-            lwan_status_perror("pthread_rwlock_unlock");
+    /* If local queue has been entirely processed, there's no need to
+     * append items in the cache queue to it; just return */
+    if (list_empty(&queue) && list_empty(&renewed))
+        return evicted;
 
-        if (ATOMIC_INC(node->refs) == 1) {
-            /* If the refcount was 0, and turned 1 after the increment, it means the item can
-             * be destroyed here. */
-            cache->cb.destroy_entry(node, cache->cb.context);
-        } else {
-            /* If not, some other thread had references to this object. */
-            ATOMIC_OP(&node->flags, or, FLOATING);
-            /* If in the time between the ref check above and setting the floating flag the
-             * thread holding the reference drops it, if our reference is 0 after dropping it,
-             * the pruner thread was the last thread holding the reference to this entry, so
-             * it's safe to destroy it at this point. */
-            if (!ATOMIC_DEC(node->refs))
-                cache->cb.destroy_entry(node, cache->cb.context);
-        }
+    /* Prepend local, unprocessed queue, to the cache queue. Since the cache
+     * item TTL is constant, items created later will be destroyed later;
+     * renewed items were "created" now, so they go last. */
+    if (LIKELY(!pthread_rwlock_wrlock(&shard->queue.lock))) {
+        list_prepend_list(&shard->queue.list, &queue);
+        list_append_list(&shard->queue.list, &renewed);
+        pthread_rwlock_unlock(&shard->queue.lock);
+    } else {
+        lwan_status_perror("pthread_rwlock_wrlock");
+    }
 
-        evicted++;
+    return evicted;
+}
+
+/* Called with the prune lock held.  Creates a stale entry again and puts
+ * the new one in its place, so that lookups never miss this key. */
+static void revalidate_entry(struct cache *cache,
+                             struct cache_shard *shard,
+                             struct cache_entry *stale)
+{
+    const unsigned int generation = ATOMIC_READ(cache->generation);
+    struct cache_entry *entry;
+    char *key_copy;
+    bool added;
+
+    /* If this fails, it's tried again the next time it's looked up. */
+    ATOMIC_OP(&stale->flags, and, ~REVALIDATE);
+
+    key_copy = strdup(stale->key);
+    if (UNLIKELY(!key_copy))
+        return;
+
+    entry = cache->cb.create_entry(key_copy, cache->cb.context);
+    if (UNLIKELY(!entry)) {
+        free(key_copy);
+        return;
     }
 
-    /* If local queue has been entirely processed, there's no need to
-     * append items in the cache queue to it; just update statistics and
-     * return */
-    if (list_empty(&queue))
-        goto end;
+    /* Unlike other new entries, nobody is holding a reference to it */
+    *entry = (struct cache_entry){.key = key_copy};
+    if (cache->budget.entry_size)
+        entry->size = cache->budget.entry_size(entry, cache->cb.context);
 
-    /* Prepend local, unprocessed queue, to the cache queue. Since the cache
-     * item TTL is constant, items created later will be destroyed later. */
-    if (LIKELY(!pthread_rwlock_wrlock(&cache->queue.lock))) {
-        list_prepend_list(&cache->queue.list, &queue);
-        pthread_rwlock_unlock(&cache->queue.lock);
-    } else {
+    if (UNLIKELY(pthread_rwlock_wrlock(&shard->hash.lock))) {
+        lwan_status_perror("pthread_rwlock_wrlock");
+        goto destroy_entry;
+    }
+    if (UNLIKELY(generation != ATOMIC_READ(cache->generation))) {
+        pthread_rwlock_unlock(&shard->hash.lock);
+        goto destroy_entry;
+    }
+    if (UNLIKELY(pthread_rwlock_wrlock(&shard->queue.lock))) {
+        lwan_status_perror("pthread_rwlock_wrlock");
+        pthread_rwlock_unlock(&shard->hash.lock);
+        goto destroy_entry;
+    }
+
+    /* Frees the key of the stale entry */
+    hash_del(shard->hash.table, stale->key);
+    list_del_from(&shard->stale, &stale->entries);
+    ATOMIC_SAF(&shard->size, stale->size);
+
+    added = !hash_add_unique(shard->hash.table, entry->key, entry);
+    if (LIKELY(added)) {
+        entry->time_to_expire =
+            lwan_clock_monotonic() + cache->settings.time_to_live;
+        list_add_tail(&shard->queue.list, &entry->entries);
+        ATOMIC_AAF(&shard->size, entry->size);
+    }
+
+    pthread_rwlock_unlock(&shard->queue.lock);
+    pthread_rwlock_unlock(&shard->hash.lock);
+
+    evict_entry(cache, stale);
+
+    if (LIKELY(added))
+        return;
+
+    /* The hash table couldn't grow; the key stays a miss until created
+     * again by a lookup. */
+destroy_entry:
+    free(key_copy);
+    cache->cb.destroy_entry(entry, cache->cb.context);
+}
+
+/* Called with the prune lock held. */
+static unsigned int prune_stale(struct cache *cache,
+                                struct cache_shard *shard,
+                                time_t now)
+{
+    bool shutting_down = cache->flags & SHUTTING_DOWN;
+    struct cache_entry *node, *next;
+    unsigned int evicted = 0;
+
+    list_for_each_safe (&shard->stale, node, next, entries) {
+        if (UNLIKELY(shutting_down)) {
+            remove_expired_entry(cache, shard, node);
+            evicted++;
+        } else if (node->flags & REVALIDATE) {
+            revalidate_entry(cache, shard, node);
+        } else if (now >= node->time_to_expire) {
+            remove_expired_entry(cache, shard, node);
+            evicted++;
+        }
+    }
+
+    return evicted;
+}
+
+static void prune_negatives(struct cache_shard *shard, time_t now)
+{
+    struct negative_entry *negative, *next;
+
+    if (UNLIKELY(pthread_rwlock_wrlock(&shard->hash.lock))) {
         lwan_status_perror("pthread_rwlock_wrlock");
+        return;
+    }
+
+    /* All negative entries have the same time to live, so the list is
+     * sorted by expiration time. */
+    list_for_each_safe (&shard->negative.list, negative, next, entries) {
+        if (now < negative->time_to_expire)
+            break;
+        remove_negative(shard, negative);
+    }
+
+    pthread_rwlock_unlock(&shard->hash.lock);
+}
+
+static unsigned int prune_shard(struct cache *cache,
+                                struct cache_shard *shard,
+                                bool *has_stale)
+{
+    unsigned int evicted;
+    time_t now;
+
+    if (UNLIKELY(pthread_mutex_trylock(&shard->prune_lock) == EBUSY))
+        return 0;
+
+    now = lwan_clock_monotonic();
+
+    evicted = prune_queue(cache, shard, now);
+    evicted += prune_stale(cache, shard, now);
+    if (!list_empty(&shard->stale))
+        *has_stale = true;
+    if (shard->negative.table)
+        prune_negatives(shard, now);
+
+    if (cache->budget.max_size &&
+        shard->size > cache->budget.max_shard_size) {
+        struct list_head victims;
+
+        list_head_init(&victims);
+
+        if (LIKELY(!pthread_rwlock_wrlock(&shard->hash.lock))) {
+            if (LIKELY(!pthread_rwlock_wrlock(&shard->queue.lock))) {
+                evict_over_budget_locked(cache, shard, NULL, &victims);
+                pthread_rwlock_unlock(&shard->queue.lock);
+            }
+            pthread_rwlock_unlock(&shard->hash.lock);
+        }
+
+        pthread_mutex_unlock(&shard->prune_lock);
+        return evicted + destroy_victims(cache, &victims);
     }
 
-end:
+    pthread_mutex_unlock(&shard->prune_lock);
+    return evicted;
+}
+
+static bool cache_pruner_job(void *data)
+{
+    struct cache *cache = data;
+    unsigned int evicted = 0;
+    bool has_stale = false;
+
+    __sync_bool_compare_and_swap(&cache->budget.prune_requested, true, false);
+
+    for (size_t i = 0; i < CACHE_N_SHARDS; i++)
+        evicted += prune_shard(cache, &cache->shards[i], &has_stale);
+
 #ifndef NDEBUG
     ATOMIC_AAF(&cache->stats.evicted, evicted);
 #endif
-    return evicted;
+    /* Keep the job thread from sleeping for too long while stale entries
+     * might need to be revalidated. */
+    return evicted || has_stale;
+}
+
+static unsigned int invalidate_shard(struct cache_shard *shard,
+                                     bool (*matches)(const struct cache_entry *,
+                                                     void *),
+                                     void *data,
+                                     struct list_head *invalidated)
+{
+    struct cache_entry *node, *next;
+    unsigned int count = 0;
+
+    /* Lock order: prune lock, then hash lock, then queue lock.  Holding
+     * the prune lock ensures that every entry is in the shard queue rather
+     * than in a copy of it that's being processed by the pruner. */
+    pthread_mutex_lock(&shard->prune_lock);
+
+    if (UNLIKELY(pthread_rwlock_wrlock(&shard->hash.lock))) {
+        lwan_status_perror("pthread_rwlock_wrlock");
+        goto unlock_prune_lock;
+    }
+    if (UNLIKELY(pthread_rwlock_wrlock(&shard->queue.lock))) {
+        lwan_status_perror("pthread_rwlock_wrlock");
+        goto unlock_hash_lock;
+    }
+
+    list_for_each_safe(&shard->queue.list, node, next, entries) {
+        if (!matches(node, data))
+            continue;
+
+        list_del_from(&shard->queue.list, &node->entries);
+        list_add_tail(invalidated, &node->entries);
+        hash_del(shard->hash.table, node->key);
+        ATOMIC_SAF(&shard->size, node->size);
+        count++;
+    }
+    list_for_each_safe(&shard->stale, node, next, entries) {
+        if (!matches(node, data))
+            continue;
+
+        list_del_from(&shard->stale, &node->entries);
+        list_add_tail(invalidated, &node->entries);
+        hash_del(shard->hash.table, node->key);
+        ATOMIC_SAF(&shard->size, node->size);
+        count++;
+    }
+
+    /* Keys aren't known to be missing anymore, no matter what the caller
+     * is invalidating. */
+    if (shard->negative.table)
+        remove_all_negatives(shard);
+
+    pthread_rwlock_unlock(&shard->queue.lock);
+unlock_hash_lock:
+    pthread_rwlock_unlock(&shard->hash.lock);
+unlock_prune_lock:
+    pthread_mutex_unlock(&shard->prune_lock);
+
+    return count;
+}
+
+unsigned int cache_invalidate(struct cache *cache,
+                              bool (*matches)(const struct cache_entry *entry,
+                                              void *data),
+                              void *data)
+{
+    struct cache_entry *node, *next;
+    struct list_head invalidated;
+    unsigned int count = 0;
+
+    list_head_init(&invalidated);
+
+    /* Bumped before going through the shards: entries being created now
+     * either are added before their shard is looked at here, or are
+     * discarded by the thread creating them. */
+    ATOMIC_INC(cache->generation);
+
+    for (size_t i = 0; i < CACHE_N_SHARDS; i++)
+        count += invalidate_shard(&cache->shards[i], matches, data,
+                                  &invalidated);
+
+    /* Entries aren't reachable anymore; references held by requests being
+     * served are dropped as usual, destroying the entries afterwards. */
+    list_for_each_safe(&invalidated, node, next, entries) {
+        list_del(&node->entries);
+        evict_entry(cache, node);
+    }
+
+#ifndef NDEBUG
+    ATOMIC_AAF(&cache->stats.evicted, count);
+#endif
+    return count;
+}
+
+/* Entries that have expired aren't visited.  The function is called with
+ * a shard locked, so it can't call into the cache. */
+void cache_for_each(struct cache *cache,
+                    void (*func)(const struct cache_entry *entry, void *data),
+                    void *data)
+{
+    for (size_t i = 0; i < CACHE_N_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+        struct cache_entry *node;
+
+        /* See comment in invalidate_shard() about the prune lock. */
+        pthread_mutex_lock(&shard->prune_lock);
+        if (LIKELY(!pthread_rwlock_rdlock(&shard->queue.lock))) {
+            list_for_each (&shard->queue.list, node, entries)
+                func(node, data);
+            pthread_rwlock_unlock(&shard->queue.lock);
+        }
+        pthread_mutex_unlock(&shard->prune_lock);
+    }
 }
 
 static void cache_entry_unref_defer(void *data1, void *data2)
@@ -364,13 +1185,618 @@ static void cache_entry_unref_defer(void *data1, void *data2)
     cache_entry_unref((struct cache *)data1, (struct cache_entry *)data2);
 }
 
+/* Direct-mapped, per worker thread cache in front of caches created with
+ * cache_enable_thread_cache().  Each slot owns a reference to its entry,
+ * and entries found here are handed to coroutines in this thread without
+ * touching their reference count; a slot isn't reused while coroutines are
+ * using its entry.  Entries are validated against the generation of their
+ * cache (bumped by cache_invalidate()), and dropped if they've been removed
+ * from the cache in any other way. */
+#define THREAD_CACHE_SLOTS 64
+
+struct thread_cache_slot {
+    struct cache *cache;
+    struct cache_entry *entry;
+    /* The key of an entry is freed as soon as it's evicted */
+    char *key;
+    unsigned int generation;
+    unsigned int users;
+};
+
+static __thread struct thread_cache_slot thread_cache[THREAD_CACHE_SLOTS];
+
+static void thread_cache_slot_release(struct thread_cache_slot *slot)
+{
+    cache_entry_unref(slot->cache, slot->entry);
+    free(slot->key);
+    slot->cache = NULL;
+    slot->entry = NULL;
+    slot->key = NULL;
+}
+
+static void thread_cache_slot_unuse(void *data)
+{
+    struct thread_cache_slot *slot = data;
+
+    slot->users--;
+}
+
+static struct thread_cache_slot *thread_cache_slot(unsigned int hash)
+{
+    static_assert((THREAD_CACHE_SLOTS & (THREAD_CACHE_SLOTS - 1)) == 0,
+                  "Number of slots is a power of 2");
+
+    return &thread_cache[hash & (THREAD_CACHE_SLOTS - 1)];
+}
+
+static struct cache_entry *thread_cache_find(struct cache *cache,
+                                             struct coro *coro,
+                                             unsigned int hash,
+                                             const char *key)
+{
+    struct thread_cache_slot *slot = thread_cache_slot(hash);
+    struct cache_entry *entry = slot->entry;
+
+    if (!entry || slot->cache != cache || strcmp(slot->key, key))
+        return NULL;
+
+    if (UNLIKELY(slot->generation != ATOMIC_READ(cache->generation) ||
+                 (ATOMIC_READ(entry->flags) & FLOATING))) {
+        if (!slot->users)
+            thread_cache_slot_release(slot);
+        return NULL;
+    }
+
+    if (cache->budget.max_size && !(entry->flags & REFERENCED))
+        ATOMIC_OP(&entry->flags, or, REFERENCED);
+    if (UNLIKELY((entry->flags & (STALE | REVALIDATE)) == STALE))
+        ATOMIC_OP(&entry->flags, or, REVALIDATE);
+
+    slot->users++;
+    coro_defer(coro, thread_cache_slot_unuse, slot);
+
+#ifndef NDEBUG
+    ATOMIC_INC(cache->stats.hits);
+#endif
+    if (lwan_current_thread_metrics)
+        lwan_current_thread_metrics->cache_hits++;
+    LWAN_PROBE(cache_hit, cache, key);
+
+    return entry;
+}
+
+static void thread_cache_add(struct cache *cache,
+                             unsigned int hash,
+                             const char *key,
+                             struct cache_entry *entry,
+                             unsigned int generation)
+{
+    struct thread_cache_slot *slot = thread_cache_slot(hash);
+    char *key_copy;
+
+    /* FLOATING entries aren't in the cache anymore. */
+    if (entry->flags & FLOATING)
+        return;
+    if (slot->users)
+        return;
+
+    key_copy = strdup(key);
+    if (UNLIKELY(!key_copy))
+        return;
+
+    if (slot->entry)
+        thread_cache_slot_release(slot);
+
+    ATOMIC_INC(entry->refs);
+    *slot = (struct thread_cache_slot){
+        .cache = cache,
+        .entry = entry,
+        .key = key_copy,
+        .generation = generation,
+    };
+}
+
+/* Called by worker threads before they exit, which happens before any
+ * cache is destroyed. */
+void lwan_cache_thread_shutdown(void)
+{
+    for (size_t i = 0; i < THREAD_CACHE_SLOTS; i++) {
+        struct thread_cache_slot *slot = &thread_cache[i];
+
+        assert(!slot->users);
+
+        if (slot->entry)
+            thread_cache_slot_release(slot);
+    }
+}
+
+static void add_negative(struct cache *cache,
+                         struct cache_shard *shard,
+                         const char *key,
+                         unsigned int hash,
+                         unsigned int generation)
+{
+    struct negative_entry *negative;
+    size_t key_len = strlen(key);
+
+    if (UNLIKELY(pthread_rwlock_wrlock(&shard->hash.lock))) {
+        lwan_status_perror("pthread_rwlock_wrlock");
+        return;
+    }
+
+    /* Whatever was missing might have been created since the callback
+     * gave up on it. */
+    if (generation != ATOMIC_READ(cache->generation))
+        goto out;
+
+    negative = hash_find_hashed(shard->negative.table, key, hash);
+    if (negative) {
+        remove_negative(shard, negative);
+    } else if (shard->negative.count >= cache->settings.max_shard_negative) {
+        remove_negative(shard, list_top(&shard->negative.list,
+                                        struct negative_entry, entries));
+    }
+
+    negative = malloc(sizeof(*negative) + key_len + 1);
+    if (UNLIKELY(!negative))
+        goto out;
+
+    memcpy(negative->key, key, key_len + 1);
+    negative->time_to_expire =
+        lwan_clock_monotonic() + cache->settings.negative_time_to_live;
+
+    if (UNLIKELY(hash_add_unique_hashed(shard->negative.table, negative->key,
+                                        negative, hash))) {
+        free(negative);
+        goto out;
+    }
+    list_add_tail(&shard->negative.list, &negative->entries);
+    shard->negative.count++;
+
+out:
+    pthread_rwlock_unlock(&shard->hash.lock);
+}
+
+static struct cache_entry *create_entry_blocking(struct cache *cache,
+                                                const char *key,
+                                                unsigned int hash)
+{
+    struct cache_shard *shard = get_shard(cache, hash);
+    struct cache_entry *entry, *existing = NULL;
+    struct list_head victims;
+    unsigned int generation;
+    int tries = GET_AND_REF_TRIES;
+    char *key_copy;
+
+    key_copy = strdup(key);
+    if (UNLIKELY(!key_copy))
+        return NULL;
+
+retry:
+    generation = ATOMIC_READ(cache->generation);
+
+    errno = 0;
+    entry = cache->cb.create_entry(key, cache->cb.context);
+    if (UNLIKELY(!entry)) {
+        if (errno == ENOENT && cache->settings.negative_time_to_live)
+            add_negative(cache, shard, key, hash, generation);
+        free(key_copy);
+        return NULL;
+    }
+
+    *entry = (struct cache_entry){.key = key_copy, .refs = 1};
+    if (cache->budget.entry_size)
+        entry->size = cache->budget.entry_size(entry, cache->cb.context);
+
+    /* This might block: the entry will be handed to everybody waiting for
+     * it, so it has to end up in the hash table. */
+    if (UNLIKELY(pthread_rwlock_wrlock(&shard->hash.lock))) {
+        lwan_status_perror("pthread_rwlock_wrlock");
+        goto destroy_entry;
+    }
+
+    if (UNLIKELY(generation != ATOMIC_READ(cache->generation)) && --tries) {
+        /* Invalidated while being created; create it again. */
+        pthread_rwlock_unlock(&shard->hash.lock);
+        cache->cb.destroy_entry(entry, cache->cb.context);
+        goto retry;
+    }
+
+    if (LIKELY(!hash_add_unique_hashed(shard->hash.table, entry->key, entry,
+                                       hash))) {
+        entry->time_to_expire =
+            lwan_clock_monotonic() + cache->settings.time_to_live;
+
+        if (UNLIKELY(pthread_rwlock_wrlock(&shard->queue.lock))) {
+            /* Key is freed by hash_del() */
+            hash_del(shard->hash.table, entry->key);
+            pthread_rwlock_unlock(&shard->hash.lock);
+            cache->cb.destroy_entry(entry, cache->cb.context);
+            return NULL;
+        }
+
+        list_head_init(&victims);
+        list_add_tail(&shard->queue.list, &entry->entries);
+        account_new_entry(cache, shard, entry, &victims);
+        pthread_rwlock_unlock(&shard->queue.lock);
+        pthread_rwlock_unlock(&shard->hash.lock);
+
+        destroy_victims(cache, &victims);
+        return entry;
+    }
+
+    /* Created in the meantime by cache_get_and_ref_entry(), or the hash
+     * table couldn't grow. */
+    existing = hash_find_hashed(shard->hash.table, key, hash);
+    if (existing)
+        ATOMIC_INC(existing->refs);
+    pthread_rwlock_unlock(&shard->hash.lock);
+
+destroy_entry:
+    free(key_copy);
+    cache->cb.destroy_entry(entry, cache->cb.context);
+    return existing;
+}
+
+static void wake_waiter(struct cache_waiter *waiter)
+{
+#if defined(HAVE_EVENTFD)
+    uint64_t event = 1;
+#else
+    char event = 1;
+#endif
+
+    /* Waiters in cache_coro_get_and_ref_entry() poll instead. */
+    if (waiter->fd[1] < 0)
+        return;
+
+    /* Errors are ignored: the descriptor is only used to wake up the
+     * coroutine, which checks if it's done under the pending lock. */
+    (void)write(waiter->fd[1], &event, sizeof(event));
+}
+
+static void finish_pending(struct cache_pending *pending,
+                           struct cache_entry *entry)
+{
+    struct cache *cache = pending->cache;
+    struct cache_waiter *waiter, *next;
+
+    pthread_mutex_lock(&cache->pending.lock);
+
+    hash_del(cache->pending.table, pending->key);
+
+    list_for_each_safe (&pending->waiters, waiter, next, waiters) {
+        list_del(&waiter->waiters);
+
+        if (entry) {
+            ATOMIC_INC(entry->refs);
+            waiter->entry = entry;
+        }
+        waiter->done = true;
+
+        wake_waiter(waiter);
+    }
+
+    pthread_cond_broadcast(&cache->pending.finished);
+    pthread_mutex_unlock(&cache->pending.lock);
+
+    /* Drop the reference held by this thread; waiters have their own. */
+    if (entry)
+        cache_entry_unref(cache, entry);
+
+    free(pending->key);
+    free(pending);
+}
+
+static void *async_pool_thread(void *data __attribute__((unused)))
+{
+    lwan_set_thread_name("cache");
+    in_async_pool = true;
+
+    while (true) {
+        struct cache_pending *pending;
+
+        pthread_mutex_lock(&async_pool.lock);
+        while (list_empty(&async_pool.jobs) && async_pool.running)
+            pthread_cond_wait(&async_pool.cond, &async_pool.lock);
+        pending = list_pop(&async_pool.jobs, struct cache_pending, jobs);
+        pthread_mutex_unlock(&async_pool.lock);
+
+        /* Jobs queued before shutdown are still finished, as coroutines
+         * might be waiting on them. */
+        if (!pending)
+            break;
+
+        finish_pending(pending, create_entry_blocking(pending->cache,
+                                                      pending->key,
+                                                      pending->hash));
+    }
+
+    return NULL;
+}
+
+void lwan_cache_async_init(unsigned int n_threads)
+{
+    assert(!async_pool.running);
+    assert(n_threads > 0);
+
+    lwan_status_debug("Starting %d cache entry creation threads", n_threads);
+
+    async_pool.threads = calloc(n_threads, sizeof(*async_pool.threads));
+    if (!async_pool.threads)
+        lwan_status_critical_perror("calloc");
+
+    list_head_init(&async_pool.jobs);
+    async_pool.running = true;
+
+    for (unsigned int i = 0; i < n_threads; i++) {
+        if (pthread_create(&async_pool.threads[i], NULL, async_pool_thread,
+                           NULL))
+            lwan_status_critical_perror("pthread_create");
+    }
+
+    async_pool.n_threads = n_threads;
+}
+
+void lwan_cache_async_shutdown(void)
+{
+    if (!async_pool.n_threads)
+        return;
+
+    lwan_status_debug("Shutting down cache entry creation threads");
+
+    pthread_mutex_lock(&async_pool.lock);
+    async_pool.running = false;
+    pthread_cond_broadcast(&async_pool.cond);
+    pthread_mutex_unlock(&async_pool.lock);
+
+    for (unsigned int i = 0; i < async_pool.n_threads; i++)
+        pthread_join(async_pool.threads[i], NULL);
+
+    free(async_pool.threads);
+    async_pool.threads = NULL;
+    async_pool.n_threads = 0;
+}
+
+/* Called with the pending lock held.  The entry is created either by the
+ * async pool or by the thread calling cache_get_and_ref_entry(), which then
+ * has to call finish_pending(). */
+static struct cache_pending *
+add_pending(struct cache *cache, const char *key, unsigned int hash)
+{
+    struct cache_pending *pending = malloc(sizeof(*pending));
+
+    if (UNLIKELY(!pending))
+        return NULL;
+
+    pending->key = strdup(key);
+    if (UNLIKELY(!pending->key)) {
+        free(pending);
+        return NULL;
+    }
+
+    if (UNLIKELY(hash_add_unique_hashed(cache->pending.table, pending->key,
+                                        pending, hash))) {
+        free(pending->key);
+        free(pending);
+        return NULL;
+    }
+
+    pending->cache = cache;
+    pending->hash = hash;
+    list_head_init(&pending->waiters);
+
+    return pending;
+}
+
+static bool add_waiter(struct cache *cache,
+                       struct cache_waiter *waiter,
+                       const char *key,
+                       unsigned int hash)
+{
+    struct cache_pending *pending;
+
+    *waiter = (struct cache_waiter){.cache = cache};
+
+#if defined(HAVE_EVENTFD)
+    waiter->fd[0] = waiter->fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (UNLIKELY(waiter->fd[0] < 0))
+        return false;
+#else
+    if (UNLIKELY(pipe2(waiter->fd, O_NONBLOCK | O_CLOEXEC) < 0))
+        return false;
+#endif
+
+    pthread_mutex_lock(&cache->pending.lock);
+
+    pending = hash_find_hashed(cache->pending.table, key, hash);
+    if (!pending) {
+        pending = add_pending(cache, key, hash);
+        if (UNLIKELY(!pending))
+            goto error;
+
+        pthread_mutex_lock(&async_pool.lock);
+        list_add_tail(&async_pool.jobs, &pending->jobs);
+        pthread_cond_signal(&async_pool.cond);
+        pthread_mutex_unlock(&async_pool.lock);
+    }
+
+    list_add_tail(&pending->waiters, &waiter->waiters);
+
+    pthread_mutex_unlock(&cache->pending.lock);
+    return true;
+
+error:
+    pthread_mutex_unlock(&cache->pending.lock);
+    close(waiter->fd[0]);
+#if !defined(HAVE_EVENTFD)
+    close(waiter->fd[1]);
+#endif
+    return false;
+}
+
+static bool waiter_is_done(struct cache_waiter *waiter)
+{
+    bool done;
+
+    pthread_mutex_lock(&waiter->cache->pending.lock);
+    done = waiter->done;
+    pthread_mutex_unlock(&waiter->cache->pending.lock);
+
+    return done;
+}
+
+static void remove_waiter(void *data)
+{
+    struct cache_waiter *waiter = data;
+
+    /* The coroutine might have been killed while waiting (e.g. because the
+     * connection timed out); the entry is still going to be created, but
+     * nobody will be woken up for it. */
+    pthread_mutex_lock(&waiter->cache->pending.lock);
+    if (!waiter->done)
+        list_del(&waiter->waiters);
+    pthread_mutex_unlock(&waiter->cache->pending.lock);
+
+    if (waiter->entry)
+        cache_entry_unref(waiter->cache, waiter->entry);
+
+    if (waiter->fd[0] < 0)
+        return;
+
+    close(waiter->fd[0]);
+#if !defined(HAVE_EVENTFD)
+    close(waiter->fd[1]);
+#endif
+}
+
+/* Waits for the entry being created by another thread or coroutine, sharing
+ * its outcome even if it couldn't be created.  Returns false if that has
+ * finished already, in which case the entry should be looked up again. */
+static bool wait_for_pending(struct cache *cache,
+                             struct coro *coro,
+                             const char *key,
+                             unsigned int hash,
+                             struct cache_entry **entry)
+{
+    const size_t generation = coro_deferred_get_generation(coro);
+    struct cache_waiter waiter = {.cache = cache, .fd = {-1, -1}};
+    struct cache_pending *pending;
+
+    pthread_mutex_lock(&cache->pending.lock);
+    pending = hash_find_hashed(cache->pending.table, key, hash);
+    if (pending)
+        list_add_tail(&pending->waiters, &waiter.waiters);
+    pthread_mutex_unlock(&cache->pending.lock);
+
+    if (!pending)
+        return false;
+
+    coro_defer(coro, remove_waiter, &waiter);
+
+    /* See comment in cache_coro_get_and_ref_entry() about yielding */
+    while (!waiter_is_done(&waiter))
+        coro_yield(coro, CONN_CORO_WANT_WRITE);
+
+    *entry = waiter.entry;
+    waiter.entry = NULL;
+
+    coro_deferred_run(coro, generation);
+
+    return true;
+}
+
+struct cache_entry *cache_get_and_ref_entry(struct cache *cache,
+                                              const char *key, int *error)
+{
+    return cache_get_and_ref_entry_hashed(cache, key, cache_key_hash(key),
+                                          error);
+}
+
+struct cache_entry *cache_get_and_ref_entry_hashed(struct cache *cache,
+                                                   const char *key,
+                                                   unsigned int hash,
+                                                   int *error)
+{
+    struct cache_shard *shard = get_shard(cache, hash);
+    struct cache_pending *pending;
+    struct cache_entry *entry;
+
+    entry = cache_find_and_ref_entry(cache, shard, key, hash, error);
+    if (LIKELY(entry) || UNLIKELY(*error))
+        return entry;
+
+    /* Only the first thread to miss a key creates its entry: everybody
+     * else is told to try again later, when it has been added to the
+     * cache, instead of creating (and then throwing away) one of their
+     * own. */
+    pthread_mutex_lock(&cache->pending.lock);
+    if (hash_find_hashed(cache->pending.table, key, hash)) {
+        pthread_mutex_unlock(&cache->pending.lock);
+        *error = EINPROGRESS;
+        return NULL;
+    }
+    pending = add_pending(cache, key, hash);
+    pthread_mutex_unlock(&cache->pending.lock);
+
+    if (UNLIKELY(!pending)) {
+        *error = ENOMEM;
+        return NULL;
+    }
+
+    /* The entry might have been added between the lookup above and the
+     * pending lock being obtained. */
+    entry = cache_find_and_ref_entry(cache, shard, key, hash, error);
+    if (!entry && *error != ENOENT) {
+        entry = create_entry_blocking(cache, key, hash);
+        *error = entry ? 0 : ECANCELED;
+    }
+
+    /* Coroutines waiting on this key in cache_coro_get_and_ref_entry_async()
+     * get their own references; the one passed here is dropped. */
+    if (entry)
+        ATOMIC_INC(entry->refs);
+    finish_pending(pending, entry);
+
+    return entry;
+}
+
 struct cache_entry *cache_coro_get_and_ref_entry(struct cache *cache,
                                                  struct coro *coro,
                                                  const char *key)
 {
-    for (int tries = GET_AND_REF_TRIES; tries; tries--) {
+    return cache_coro_get_and_ref_entry_hashed(cache, coro, key,
+                                               cache_key_hash(key));
+}
+
+struct cache_entry *cache_coro_get_and_ref_entry_hashed(struct cache *cache,
+                                                        struct coro *coro,
+                                                        const char *key,
+                                                        unsigned int hash)
+{
+    unsigned int cache_generation = 0;
+
+    if (cache->flags & THREAD_CACHE) {
+        struct cache_entry *ce;
+
+        ce = thread_cache_find(cache, coro, hash, key);
+        if (ce)
+            return ce;
+
+        cache_generation = ATOMIC_READ(cache->generation);
+    }
+
+    for (int tries = GET_AND_REF_TRIES; tries;) {
         int error;
-        struct cache_entry *ce = cache_get_and_ref_entry(cache, key, &error);
+        struct cache_entry *ce =
+            cache_get_and_ref_entry_hashed(cache, key, hash, &error);
+
+        if (UNLIKELY(!ce && error == EINPROGRESS)) {
+            if (!wait_for_pending(cache, coro, key, hash, &ce))
+                continue;
+            if (!ce)
+                break;
+        }
 
         if (LIKELY(ce)) {
             /*
@@ -379,6 +1805,8 @@ struct cache_entry *cache_coro_get_and_ref_entry(struct cache *cache,
              * freed.
              */
             coro_defer2(coro, cache_entry_unref_defer, cache, ce);
+            if (cache->flags & THREAD_CACHE)
+                thread_cache_add(cache, hash, key, ce, cache_generation);
             return ce;
         }
 
@@ -390,7 +1818,91 @@ struct cache_entry *cache_coro_get_and_ref_entry(struct cache *cache,
          * worker thread might never be resumed again; it's not always that
          * a socket can be read from, but you can always write to it.)  */
         coro_yield(coro, CONN_CORO_WANT_WRITE);
+        tries--;
+    }
+
+    return NULL;
+}
+
+struct cache_entry *cache_coro_get_and_ref_entry_async(
+    struct cache *cache, struct lwan_request *request, const char *key)
+{
+    return cache_coro_get_and_ref_entry_async_hashed(cache, request, key,
+                                                     cache_key_hash(key));
+}
+
+struct cache_entry *
+cache_coro_get_and_ref_entry_async_hashed(struct cache *cache,
+                                          struct lwan_request *request,
+                                          const char *key,
+                                          unsigned int hash)
+{
+    struct coro *coro = request->conn->coro;
+    struct cache_waiter waiter;
+    struct cache_entry *entry;
+    unsigned int cache_generation;
+    size_t generation;
+
+    /* Without the pool (e.g. in fuzzers), or in HTTP/2 streams (which
+     * can't await on other file descriptors), create entries in this
+     * thread. */
+    if (UNLIKELY(!async_pool.n_threads ||
+                 (request->conn->flags & CONN_IS_HTTP2_STREAM)))
+        return cache_coro_get_and_ref_entry_hashed(cache, coro, key, hash);
+
+    if (cache->flags & THREAD_CACHE) {
+        entry = thread_cache_find(cache, coro, hash, key);
+        if (entry)
+            return entry;
+    }
+
+    cache_generation = ATOMIC_READ(cache->generation);
+
+    for (int tries = GET_AND_REF_TRIES; tries; tries--) {
+        int error;
+
+        entry = cache_find_and_ref_entry(cache, get_shard(cache, hash), key,
+                                         hash, &error);
+        if (LIKELY(entry)) {
+            coro_defer2(coro, cache_entry_unref_defer, cache, entry);
+            if (cache->flags & THREAD_CACHE)
+                thread_cache_add(cache, hash, key, entry, cache_generation);
+            return entry;
+        }
+
+        if (!error)
+            goto miss;
+        if (error == ENOENT)
+            return NULL;
+
+        /* See comment in cache_coro_get_and_ref_entry() */
+        coro_yield(coro, CONN_CORO_WANT_WRITE);
     }
 
     return NULL;
+
+miss:
+    generation = coro_deferred_get_generation(coro);
+
+    if (UNLIKELY(!add_waiter(cache, &waiter, key, hash)))
+        return cache_coro_get_and_ref_entry_hashed(cache, coro, key, hash);
+    coro_defer(coro, remove_waiter, &waiter);
+
+    while (!waiter_is_done(&waiter))
+        lwan_request_await_read(request, waiter.fd[0]);
+
+    entry = waiter.entry;
+    waiter.entry = NULL;
+
+    /* Closes the file descriptor and stops awaiting on it, as the waiter
+     * lives in this stack frame. */
+    coro_deferred_run(coro, generation);
+
+    if (entry) {
+        coro_defer2(coro, cache_entry_unref_defer, cache, entry);
+        if (cache->flags & THREAD_CACHE)
+            thread_cache_add(cache, hash, key, entry, cache_generation);
+    }
+
+    return entry;
 }
@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <time.h>
 
 #include "list.h"
@@ -30,14 +31,36 @@ struct cache_entry {
   int refs;
   unsigned flags;
   time_t time_to_expire;
+  size_t size;
 };
 
 typedef struct cache_entry *(*cache_create_entry_cb)(
       const char *key, void *context);
 typedef void (*cache_destroy_entry_cb)(
       struct cache_entry *entry, void *context);
+typedef size_t (*cache_entry_size_cb)(
+      const struct cache_entry *entry, void *context);
+typedef bool (*cache_should_renew_entry_cb)(
+      const struct cache_entry *entry, void *context);
 
 struct cache;
+struct lwan_request;
+struct lwan_strbuf;
+struct lwan_value;
+
+typedef bool (*cache_serialize_entry_cb)(
+      const struct cache_entry *entry, struct lwan_strbuf *buf, void *context);
+
+struct cache_stats {
+    const char *name;
+    unsigned int entries;
+    /* Entries being created by the async pool */
+    unsigned int pending;
+    /* Only tracked if cache_set_max_size() has been called */
+    size_t size;
+    size_t max_size;
+    bool measured;
+};
 
 struct cache *cache_create(cache_create_entry_cb create_entry_cb,
       cache_destroy_entry_cb destroy_entry_cb,
@@ -45,8 +68,55 @@ struct cache *cache_create(cache_create_entry_cb create_entry_cb,
       time_t time_to_live);
 void cache_destroy(struct cache *cache);
 
+void cache_set_max_size(struct cache *cache, size_t max_size,
+      cache_entry_size_cb entry_size_cb);
+void cache_set_stale_while_revalidate(struct cache *cache,
+      time_t grace_period);
+void cache_set_should_renew(struct cache *cache,
+      cache_should_renew_entry_cb should_renew);
+void cache_set_negative_time_to_live(struct cache *cache,
+      time_t time_to_live, unsigned int max_entries);
+void cache_enable_thread_cache(struct cache *cache);
+void cache_set_name(struct cache *cache, const char *name);
+void cache_set_peer_fill(struct cache *cache,
+      cache_serialize_entry_cb serialize_entry);
+
+/* To be called by the create_entry callback of caches filled by peers:
+ * fetches @key, serialized by the instance in the cache_peers group that
+ * owns it, into @serialized (to be freed by the caller).  Fails if this
+ * instance owns the key, or if the entry isn't being created by the pool
+ * of cache_coro_get_and_ref_entry_async(), as this blocks. */
+bool cache_peer_fetch(struct cache *cache, const char *key,
+      struct lwan_value *serialized);
+
+bool cache_stats_for_each(bool (*cb)(const struct cache_stats *stats,
+                                     void *data),
+                          void *data);
+
+unsigned int cache_invalidate(struct cache *cache,
+      bool (*matches)(const struct cache_entry *entry, void *data),
+      void *data);
+void cache_for_each(struct cache *cache,
+      void (*func)(const struct cache_entry *entry, void *data),
+      void *data);
+
 struct cache_entry *cache_get_and_ref_entry(struct cache *cache,
       const char *key, int *error);
+void cache_entry_ref(struct cache_entry *entry);
 void cache_entry_unref(struct cache *cache, struct cache_entry *entry);
 struct cache_entry *cache_coro_get_and_ref_entry(struct cache *cache,
       struct coro *coro, const char *key);
+struct cache_entry *cache_coro_get_and_ref_entry_async(struct cache *cache,
+      struct lwan_request *request, const char *key);
+
+/* Variants of the functions above taking the value returned by
+ * cache_key_hash() for the key, so that callers looking up the same key
+ * more than once (or in more than one cache) can hash it only once. */
+unsigned int cache_key_hash(const char *key);
+struct cache_entry *cache_get_and_ref_entry_hashed(struct cache *cache,
+      const char *key, unsigned int hash, int *error);
+struct cache_entry *cache_coro_get_and_ref_entry_hashed(struct cache *cache,
+      struct coro *coro, const char *key, unsigned int hash);
+struct cache_entry *cache_coro_get_and_ref_entry_async_hashed(
+      struct cache *cache, struct lwan_request *request, const char *key,
+      unsigned int hash);
@@ -0,0 +1,981 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "lwan-private.h"
+
+#include "base64.h"
+#include "sha256.h"
+
+#if defined(HAVE_BROTLI)
+#include <brotli/encode.h>
+#endif
+
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+/* Output of handlers with HANDLER_COMPRESS_RESPONSE is compressed while
+ * it's being sent, so fast levels are used.  Whole responses are
+ * compressed in one go; chunked responses and event streams are flushed
+ * after every chunk or event, so clients can decode them right away. */
+#define ZLIB_LEVEL 4
+#define BROTLI_QUALITY 4
+#define ZSTD_LEVEL 3
+
+/* Not worth the trouble for anything smaller than this */
+#define MIN_COMPRESS_SIZE 256
+/* ...unless there's a dictionary the client already has: even a small
+ * response is likely to be mostly made of strings found in it. */
+#define MIN_DICT_COMPRESS_SIZE 64
+
+enum encoding {
+    ENCODING_DEFLATE,
+    ENCODING_GZIP,
+    ENCODING_BROTLI,
+    ENCODING_ZSTD,
+    /* Not used by the response cache: it depends on Available-Dictionary,
+     * not only on Accept-Encoding. */
+    ENCODING_DCZ,
+};
+
+enum compress_op {
+    COMPRESS_CONTINUE,
+    COMPRESS_FLUSH,
+    COMPRESS_FINISH,
+};
+
+struct lwan_compressor {
+    enum encoding encoding;
+    bool finished;
+    /* ENCODING_DCZ only: output starts with a header identifying the
+     * dictionary, written before anything else is compressed. */
+    bool wrote_dict_header;
+    const struct lwan_compress_dict *dict;
+
+    union {
+        z_stream *zlib;
+#if defined(HAVE_BROTLI)
+        BrotliEncoderState *brotli;
+#endif
+#if defined(HAVE_ZSTD)
+        ZSTD_CCtx *zstd;
+#endif
+    };
+
+    char *out;
+    size_t out_len, out_size;
+};
+
+static const char *const encoding_names[] = {
+    [ENCODING_DEFLATE] = "deflate",
+    [ENCODING_GZIP] = "gzip",
+    [ENCODING_BROTLI] = "br",
+    [ENCODING_ZSTD] = "zstd",
+    [ENCODING_DCZ] = "dcz",
+};
+
+/* Compression dictionaries, as in RFC9842 ("Compression Dictionary
+ * Transport").  A client that has fetched a dictionary (served with a
+ * Use-As-Dictionary header saying which URLs it's good for) sends its
+ * SHA-256 hash in Available-Dictionary, and accepts "dcz": a zstd frame
+ * compressed with the dictionary, after a header repeating the hash.
+ * Dictionaries are loaded once per file, and shared by every URL map and
+ * module using them. */
+struct lwan_compress_dict {
+    struct lwan_compress_dict *next;
+    char *path;
+    unsigned int refs;
+
+    struct lwan_value data;
+
+    /* Structured field byte sequence (":base64:"), as in the header */
+    char available[48];
+    /* Skippable zstd frame magic, frame length, and the SHA-256 hash */
+    unsigned char dcz_header[8 + 32];
+
+    /* Set if this dictionary is served by Lwan; see
+     * lwan_compress_dict_serve_at() */
+    char *url;
+    char *link;
+    struct lwan_key_value headers[3];
+
+#if defined(HAVE_ZSTD)
+    ZSTD_CDict *cdict;
+#endif
+};
+
+/* Only touched while reading the configuration file and shutting down */
+static struct lwan_compress_dict *dicts;
+
+/* Contexts are expensive to set up (zlib allocates ~256KiB for each
+ * stream), so one of each kind is kept around by every thread, and reset
+ * once a response is done with it.  Brotli encoders can't be reset, so
+ * they're always created from scratch. */
+static __thread struct {
+    z_stream *zlib[ENCODING_GZIP + 1];
+#if defined(HAVE_ZSTD)
+    ZSTD_CCtx *zstd;
+#endif
+} spare;
+
+static z_stream *zlib_get(enum encoding encoding)
+{
+    z_stream *z = spare.zlib[encoding];
+
+    if (z) {
+        spare.zlib[encoding] = NULL;
+        return z;
+    }
+
+    z = calloc(1, sizeof(*z));
+    if (UNLIKELY(!z))
+        return NULL;
+
+    /* Adding 16 to the window bits asks for a gzip header and trailer. */
+    if (UNLIKELY(deflateInit2(z, ZLIB_LEVEL, Z_DEFLATED,
+                              encoding == ENCODING_GZIP ? 15 + 16 : 15, 8,
+                              Z_DEFAULT_STRATEGY) != Z_OK)) {
+        free(z);
+        return NULL;
+    }
+
+    return z;
+}
+
+static void zlib_put(enum encoding encoding, z_stream *z)
+{
+    if (!spare.zlib[encoding] && deflateReset(z) == Z_OK) {
+        spare.zlib[encoding] = z;
+        return;
+    }
+
+    deflateEnd(z);
+    free(z);
+}
+
+#if defined(HAVE_ZSTD)
+static ZSTD_CCtx *zstd_get(void)
+{
+    ZSTD_CCtx *zstd = spare.zstd;
+
+    if (zstd) {
+        spare.zstd = NULL;
+        return zstd;
+    }
+
+    zstd = ZSTD_createCCtx();
+    if (UNLIKELY(!zstd))
+        return NULL;
+
+    if (UNLIKELY(ZSTD_isError(ZSTD_CCtx_setParameter(
+            zstd, ZSTD_c_compressionLevel, ZSTD_LEVEL)))) {
+        ZSTD_freeCCtx(zstd);
+        return NULL;
+    }
+
+    return zstd;
+}
+
+static void zstd_put(ZSTD_CCtx *zstd)
+{
+    /* Resetting only the session keeps the compression level. */
+    if (!spare.zstd &&
+        !ZSTD_isError(ZSTD_CCtx_reset(zstd, ZSTD_reset_session_only))) {
+        spare.zstd = zstd;
+        return;
+    }
+
+    ZSTD_freeCCtx(zstd);
+}
+#endif
+
+void lwan_compress_thread_shutdown(void)
+{
+    for (size_t i = 0; i < N_ELEMENTS(spare.zlib); i++) {
+        if (spare.zlib[i]) {
+            deflateEnd(spare.zlib[i]);
+            free(spare.zlib[i]);
+            spare.zlib[i] = NULL;
+        }
+    }
+
+#if defined(HAVE_ZSTD)
+    ZSTD_freeCCtx(spare.zstd);
+    spare.zstd = NULL;
+#endif
+}
+
+static void compressor_free(void *data)
+{
+    struct lwan_compressor *c = data;
+
+    switch (c->encoding) {
+    case ENCODING_DCZ:
+#if defined(HAVE_ZSTD)
+        if (c->zstd) {
+            /* Referenced dictionaries stick to the context otherwise. */
+            if (ZSTD_isError(ZSTD_CCtx_refCDict(c->zstd, NULL)))
+                ZSTD_freeCCtx(c->zstd);
+            else
+                zstd_put(c->zstd);
+        }
+#endif
+        break;
+    case ENCODING_DEFLATE:
+    case ENCODING_GZIP:
+        if (c->zlib)
+            zlib_put(c->encoding, c->zlib);
+        break;
+    case ENCODING_BROTLI:
+#if defined(HAVE_BROTLI)
+        if (c->brotli)
+            BrotliEncoderDestroyInstance(c->brotli);
+#endif
+        break;
+    case ENCODING_ZSTD:
+#if defined(HAVE_ZSTD)
+        if (c->zstd)
+            zstd_put(c->zstd);
+#endif
+        break;
+    }
+
+    free(c->out);
+}
+
+static bool is_compressible_mime_type(const char *mime_type)
+{
+    if (!strncmp(mime_type, "text/", 5))
+        return true;
+
+    return strstr(mime_type, "json") || strstr(mime_type, "javascript") ||
+           strstr(mime_type, "xml");
+}
+
+static bool has_content_encoding(const struct lwan_request *request)
+{
+    const struct lwan_key_value *header = request->response.headers;
+
+    if (!header)
+        return false;
+
+    for (; header->key; header++) {
+        if (!strcasecmp(header->key, "Content-Encoding"))
+            return true;
+    }
+
+    return false;
+}
+
+static bool has_dict(struct lwan_request *request,
+                     const struct lwan_compress_dict *dict)
+{
+    const char *available;
+
+    if (!dict || !(lwan_request_get_accept_encoding(request) &
+                   REQUEST_ACCEPT_DCZ))
+        return false;
+
+    available = lwan_request_get_header(request, "Available-Dictionary");
+    return available && streq(available, dict->available);
+}
+
+static bool negotiate_encoding(struct lwan_request *request,
+                               enum encoding *encoding)
+{
+    const enum lwan_request_flags accept =
+        lwan_request_get_accept_encoding(request);
+
+#if defined(HAVE_ZSTD)
+    if (has_dict(request, request->helper->compress_dict)) {
+        *encoding = ENCODING_DCZ;
+        return true;
+    }
+    if (accept & REQUEST_ACCEPT_ZSTD) {
+        *encoding = ENCODING_ZSTD;
+        return true;
+    }
+#endif
+#if defined(HAVE_BROTLI)
+    if (accept & REQUEST_ACCEPT_BROTLI) {
+        *encoding = ENCODING_BROTLI;
+        return true;
+    }
+#endif
+    if (accept & REQUEST_ACCEPT_GZIP) {
+        *encoding = ENCODING_GZIP;
+        return true;
+    }
+    if (accept & REQUEST_ACCEPT_DEFLATE) {
+        *encoding = ENCODING_DEFLATE;
+        return true;
+    }
+
+    return false;
+}
+
+static bool compressor_init(struct lwan_compressor *c,
+                            enum encoding encoding,
+                            const struct lwan_compress_dict *dict)
+{
+    *c = (struct lwan_compressor){.encoding = encoding};
+
+    switch (encoding) {
+    case ENCODING_DEFLATE:
+    case ENCODING_GZIP:
+        c->zlib = zlib_get(encoding);
+        return c->zlib != NULL;
+    case ENCODING_BROTLI:
+#if defined(HAVE_BROTLI)
+        c->brotli = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+        if (UNLIKELY(!c->brotli))
+            return false;
+        BrotliEncoderSetParameter(c->brotli, BROTLI_PARAM_QUALITY,
+                                  BROTLI_QUALITY);
+        return true;
+#else
+        return false;
+#endif
+    case ENCODING_ZSTD:
+#if defined(HAVE_ZSTD)
+        c->zstd = zstd_get();
+        return c->zstd != NULL;
+#else
+        return false;
+#endif
+    case ENCODING_DCZ:
+#if defined(HAVE_ZSTD)
+        c->zstd = zstd_get();
+        if (UNLIKELY(!c->zstd))
+            return false;
+        c->dict = dict;
+        return !ZSTD_isError(ZSTD_CCtx_refCDict(c->zstd, dict->cdict));
+#else
+        return false;
+#endif
+    }
+
+    return false;
+}
+
+static struct lwan_compressor *compressor_new(struct lwan_request *request,
+                                              size_t size)
+{
+    struct lwan_compressor *c;
+    enum encoding encoding;
+
+    if (!request->response.mime_type ||
+        !is_compressible_mime_type(request->response.mime_type))
+        return NULL;
+    if (request->conn->flags & CONN_IS_UPGRADE)
+        return NULL;
+    /* Handler already compressed its output */
+    if (has_content_encoding(request))
+        return NULL;
+    if (!negotiate_encoding(request, &encoding))
+        return NULL;
+    if (encoding != ENCODING_DCZ && size < MIN_COMPRESS_SIZE)
+        return NULL;
+
+    c = coro_malloc_full(request->conn->coro, sizeof(*c), compressor_free);
+    if (UNLIKELY(!c))
+        return NULL;
+
+    if (UNLIKELY(!compressor_init(c, encoding,
+                                  request->helper->compress_dict)))
+        return NULL;
+
+    return c;
+}
+
+static bool reserve_output(struct lwan_compressor *c)
+{
+    size_t size;
+    char *out;
+
+    if (c->out_size - c->out_len >= 256)
+        return true;
+
+    if (UNLIKELY(__builtin_mul_overflow(c->out_size ? c->out_size : 2048, 2,
+                                        &size)))
+        return false;
+
+    out = realloc(c->out, size);
+    if (UNLIKELY(!out))
+        return false;
+
+    c->out = out;
+    c->out_size = size;
+    return true;
+}
+
+static bool compress_zlib(struct lwan_compressor *c,
+                          const void *in,
+                          size_t in_len,
+                          enum compress_op op)
+{
+    static const int flush[] = {
+        [COMPRESS_CONTINUE] = Z_NO_FLUSH,
+        [COMPRESS_FLUSH] = Z_SYNC_FLUSH,
+        [COMPRESS_FINISH] = Z_FINISH,
+    };
+    z_stream *z = c->zlib;
+
+    if (UNLIKELY(in_len > UINT_MAX))
+        return false;
+
+    z->next_in = (Bytef *)in;
+    z->avail_in = (uInt)in_len;
+
+    while (true) {
+        uInt avail_out;
+        int r;
+
+        if (UNLIKELY(!reserve_output(c)))
+            return false;
+
+        avail_out = (uInt)LWAN_MIN(c->out_size - c->out_len, (size_t)UINT_MAX);
+        z->next_out = (Bytef *)c->out + c->out_len;
+        z->avail_out = avail_out;
+
+        r = deflate(z, flush[op]);
+        c->out_len += avail_out - z->avail_out;
+
+        if (r == Z_STREAM_END)
+            return true;
+        if (UNLIKELY(r != Z_OK && r != Z_BUF_ERROR))
+            return false;
+        /* Space left in the output buffer means that all the input has
+         * been consumed and flushed as requested. */
+        if (z->avail_out)
+            return op != COMPRESS_FINISH;
+    }
+}
+
+#if defined(HAVE_BROTLI)
+static bool compress_brotli(struct lwan_compressor *c,
+                            const void *in,
+                            size_t in_len,
+                            enum compress_op op)
+{
+    static const BrotliEncoderOperation operation[] = {
+        [COMPRESS_CONTINUE] = BROTLI_OPERATION_PROCESS,
+        [COMPRESS_FLUSH] = BROTLI_OPERATION_FLUSH,
+        [COMPRESS_FINISH] = BROTLI_OPERATION_FINISH,
+    };
+    const uint8_t *next_in = in;
+    size_t avail_in = in_len;
+
+    while (true) {
+        uint8_t *next_out;
+        size_t avail_out;
+
+        if (UNLIKELY(!reserve_output(c)))
+            return false;
+
+        next_out = (uint8_t *)c->out + c->out_len;
+        avail_out = c->out_size - c->out_len;
+
+        if (UNLIKELY(!BrotliEncoderCompressStream(c->brotli, operation[op],
+                                                  &avail_in, &next_in,
+                                                  &avail_out, &next_out, NULL)))
+            return false;
+        c->out_len = (size_t)((char *)next_out - c->out);
+
+        if (!avail_in && !BrotliEncoderHasMoreOutput(c->brotli)) {
+            if (op != COMPRESS_FINISH || BrotliEncoderIsFinished(c->brotli))
+                return true;
+        }
+    }
+}
+#endif
+
+#if defined(HAVE_ZSTD)
+static bool compress_zstd(struct lwan_compressor *c,
+                          const void *in,
+                          size_t in_len,
+                          enum compress_op op)
+{
+    static const ZSTD_EndDirective directive[] = {
+        [COMPRESS_CONTINUE] = ZSTD_e_continue,
+        [COMPRESS_FLUSH] = ZSTD_e_flush,
+        [COMPRESS_FINISH] = ZSTD_e_end,
+    };
+    ZSTD_inBuffer input = {.src = in, .size = in_len};
+
+    if (c->dict && !c->wrote_dict_header) {
+        if (UNLIKELY(!reserve_output(c)))
+            return false;
+
+        memcpy(c->out + c->out_len, c->dict->dcz_header,
+               sizeof(c->dict->dcz_header));
+        c->out_len += sizeof(c->dict->dcz_header);
+        c->wrote_dict_header = true;
+    }
+
+    while (true) {
+        ZSTD_outBuffer output;
+        size_t remaining;
+
+        if (UNLIKELY(!reserve_output(c)))
+            return false;
+
+        output = (ZSTD_outBuffer){
+            .dst = c->out + c->out_len,
+            .size = c->out_size - c->out_len,
+        };
+
+        remaining = ZSTD_compressStream2(c->zstd, &output, &input, directive[op]);
+        if (UNLIKELY(ZSTD_isError(remaining)))
+            return false;
+        c->out_len += output.pos;
+
+        /* Without flushing, zstd returns once the input has been consumed
+         * or the output buffer is full; otherwise, the return value is
+         * the amount of data that has yet to be flushed. */
+        if (op == COMPRESS_CONTINUE ? input.pos == input.size : !remaining)
+            return true;
+    }
+}
+#endif
+
+static bool compress_value(struct lwan_compressor *c,
+                           const void *in,
+                           size_t in_len,
+                           enum compress_op op)
+{
+    switch (c->encoding) {
+    case ENCODING_DEFLATE:
+    case ENCODING_GZIP:
+        return compress_zlib(c, in, in_len, op);
+#if defined(HAVE_BROTLI)
+    case ENCODING_BROTLI:
+        return compress_brotli(c, in, in_len, op);
+#endif
+#if defined(HAVE_ZSTD)
+    case ENCODING_ZSTD:
+    case ENCODING_DCZ:
+        return compress_zstd(c, in, in_len, op);
+#endif
+    default:
+        return false;
+    }
+}
+
+void lwan_compress_response_buffer(struct lwan_request *request)
+{
+    struct lwan_strbuf *buffer = request->response.buffer;
+    const size_t len = lwan_strbuf_get_length(buffer);
+    struct lwan_compressor *c;
+
+    if (len < MIN_DICT_COMPRESS_SIZE)
+        return;
+
+    c = compressor_new(request, len);
+    if (!c)
+        return;
+
+    if (!compress_value(c, lwan_strbuf_get_buffer(buffer), len,
+                        COMPRESS_FINISH))
+        return;
+    if (c->out_len >= len)
+        return;
+
+    /* The compressed buffer is freed once the response has been sent. */
+    c->finished = true;
+    request->helper->compressor = c;
+    lwan_strbuf_set_static(buffer, c->out, c->out_len);
+}
+
+void lwan_compress_response_stream(struct lwan_request *request)
+{
+    request->helper->compressor = compressor_new(request, SIZE_MAX);
+}
+
+bool lwan_compress_iov(struct lwan_request *request,
+                       const struct iovec *iov,
+                       int iovcnt,
+                       bool finish,
+                       struct lwan_value *out)
+{
+    struct lwan_compressor *c = request->helper->compressor;
+
+    /* Whatever was returned by the previous call has been sent by now. */
+    c->out_len = 0;
+
+    if (UNLIKELY(c->finished)) {
+        *out = (struct lwan_value){};
+        return true;
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        enum compress_op op = COMPRESS_CONTINUE;
+
+        if (i == iovcnt - 1)
+            op = finish ? COMPRESS_FINISH : COMPRESS_FLUSH;
+
+        if (UNLIKELY(!compress_value(c, iov[i].iov_base, iov[i].iov_len, op)))
+            return false;
+    }
+
+    if (!iovcnt && finish) {
+        if (UNLIKELY(!compress_value(c, NULL, 0, COMPRESS_FINISH)))
+            return false;
+    }
+
+    c->finished = finish;
+    *out = (struct lwan_value){.value = c->out, .len = c->out_len};
+    return true;
+}
+
+const char *lwan_compress_get_encoding(const struct lwan_request *request)
+{
+    return encoding_names[request->helper->compressor->encoding];
+}
+
+const char *lwan_compress_get_dict_link(const struct lwan_request *request)
+{
+    const struct lwan_compress_dict *dict = request->helper->compress_dict;
+
+    if (request->helper->compressor->encoding == ENCODING_DCZ)
+        return NULL;
+
+    return dict->link;
+}
+
+/* Used by the response cache, which keeps a compressed copy of each
+ * response for every encoding.  Encodings are numbered from 0 to
+ * LWAN_COMPRESS_N_ENCODINGS - 1, in no particular order.  On success,
+ * out->value has been allocated with malloc(). */
+bool lwan_compress_buffer(unsigned int encoding,
+                          const char *mime_type,
+                          const void *in,
+                          size_t in_len,
+                          struct lwan_value *out)
+{
+    struct lwan_compressor c;
+    bool compressed = false;
+
+    if (encoding >= LWAN_COMPRESS_N_ENCODINGS)
+        return false;
+    if (in_len < MIN_COMPRESS_SIZE || !is_compressible_mime_type(mime_type))
+        return false;
+
+    if (compressor_init(&c, (enum encoding)encoding, NULL) &&
+        compress_value(&c, in, in_len, COMPRESS_FINISH) && c.out_len < in_len) {
+        *out = (struct lwan_value){.value = c.out, .len = c.out_len};
+        c.out = NULL;
+        compressed = true;
+    }
+
+    compressor_free(&c);
+    return compressed;
+}
+
+const char *lwan_compress_encoding_name(unsigned int encoding)
+{
+    return encoding_names[encoding];
+}
+
+/* Picks the encoding the client prefers, out of the ones set in the
+ * @available bitmap (1 << encoding); returns -1 if there's none. */
+int lwan_compress_pick_encoding(struct lwan_request *request,
+                                unsigned int available)
+{
+    static const struct {
+        enum lwan_request_flags accept;
+        enum encoding encoding;
+    } preference[] = {
+        {REQUEST_ACCEPT_ZSTD, ENCODING_ZSTD},
+        {REQUEST_ACCEPT_BROTLI, ENCODING_BROTLI},
+        {REQUEST_ACCEPT_GZIP, ENCODING_GZIP},
+        {REQUEST_ACCEPT_DEFLATE, ENCODING_DEFLATE},
+    };
+    const enum lwan_request_flags accept =
+        lwan_request_get_accept_encoding(request);
+
+    for (size_t i = 0; i < N_ELEMENTS(preference); i++) {
+        if ((accept & preference[i].accept) &&
+            (available & 1u << preference[i].encoding))
+            return (int)preference[i].encoding;
+    }
+
+    return -1;
+}
+
+#if defined(HAVE_ZSTD)
+static bool read_dict(struct lwan_compress_dict *dict)
+{
+    struct stat st;
+    bool ok = false;
+    int fd;
+
+    fd = open(dict->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        lwan_status_perror("Could not open compression dictionary %s",
+                           dict->path);
+        return false;
+    }
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size) {
+        lwan_status_error("Compression dictionary %s isn't a regular, "
+                          "non-empty file",
+                          dict->path);
+        goto out;
+    }
+
+    dict->data.len = (size_t)st.st_size;
+    dict->data.value = malloc(dict->data.len);
+    if (!dict->data.value)
+        goto out;
+
+    for (size_t total = 0; total < dict->data.len;) {
+        ssize_t r = read(fd, dict->data.value + total, dict->data.len - total);
+
+        if (r <= 0) {
+            lwan_status_perror("Could not read compression dictionary %s",
+                               dict->path);
+            goto out;
+        }
+        total += (size_t)r;
+    }
+
+    ok = true;
+
+out:
+    close(fd);
+    return ok;
+}
+
+static bool hash_dict(struct lwan_compress_dict *dict)
+{
+    static const unsigned char magic[8] = {0x5e, 0x2a, 0x4d, 0x18,
+                                           0x20, 0x00, 0x00, 0x00};
+    unsigned char *hash = dict->dcz_header + sizeof(magic);
+    unsigned char *encoded;
+    size_t encoded_len;
+
+    sha256(dict->data.value, dict->data.len, hash);
+    memcpy(dict->dcz_header, magic, sizeof(magic));
+
+    encoded = base64_encode(hash, 32, &encoded_len);
+    if (!encoded)
+        return false;
+
+    snprintf(dict->available, sizeof(dict->available), ":%.*s:",
+             (int)encoded_len, encoded);
+    free(encoded);
+
+    return true;
+}
+#endif
+
+static void dict_free(struct lwan_compress_dict *dict)
+{
+#if defined(HAVE_ZSTD)
+    ZSTD_freeCDict(dict->cdict);
+#endif
+    free(dict->data.value);
+    free(dict->path);
+    free(dict->url);
+    free(dict->link);
+    free(dict->headers[0].value);
+    free(dict);
+}
+
+struct lwan_compress_dict *lwan_compress_dict_get(const char *path)
+{
+    struct lwan_compress_dict *dict;
+
+    for (dict = dicts; dict; dict = dict->next) {
+        if (streq(dict->path, path)) {
+            dict->refs++;
+            return dict;
+        }
+    }
+
+#if defined(HAVE_ZSTD)
+    dict = calloc(1, sizeof(*dict));
+    if (!dict)
+        return NULL;
+
+    dict->path = strdup(path);
+    if (!dict->path || !read_dict(dict) || !hash_dict(dict))
+        goto error;
+
+    /* Digested once, with the level used for dynamic responses; static
+     * files compressed with it use the same level. */
+    dict->cdict =
+        ZSTD_createCDict(dict->data.value, dict->data.len, ZSTD_LEVEL);
+    if (!dict->cdict) {
+        lwan_status_error("Could not load compression dictionary %s", path);
+        goto error;
+    }
+
+    lwan_status_debug("Loaded compression dictionary %s (%zu bytes), "
+                      "Available-Dictionary: %s",
+                      path, dict->data.len, dict->available);
+
+    dict->refs = 1;
+    dict->next = dicts;
+    dicts = dict;
+    return dict;
+
+error:
+    dict_free(dict);
+    return NULL;
+#else
+    lwan_status_error("Compression dictionary %s can't be used: Lwan has "
+                      "been built without zstd",
+                      path);
+    return NULL;
+#endif
+}
+
+void lwan_compress_dict_put(struct lwan_compress_dict *dict)
+{
+    struct lwan_compress_dict **iter;
+
+    if (!dict || --dict->refs)
+        return;
+
+    for (iter = &dicts; *iter; iter = &(*iter)->next) {
+        if (*iter == dict) {
+            *iter = dict->next;
+            break;
+        }
+    }
+
+    dict_free(dict);
+}
+
+bool lwan_compress_dict_serve_at(struct lwan_compress_dict *dict,
+                                 const char *url,
+                                 const char *match_prefix)
+{
+    char *match;
+
+    if (dict->url)
+        return streq(dict->url, url);
+
+    if (asprintf(&match, "match=\"%s*\"", match_prefix) < 0)
+        return false;
+    if (asprintf(&dict->link, "<%s>; rel=\"compression-dictionary\"", url) <
+        0) {
+        free(match);
+        return false;
+    }
+    dict->url = strdup(url);
+    if (!dict->url) {
+        free(match);
+        return false;
+    }
+
+    /* Clients keep dictionaries for as long as they'd keep anything else
+     * in their caches; one that has been replaced simply stops matching. */
+    dict->headers[0] = (struct lwan_key_value){"Use-As-Dictionary", match};
+    dict->headers[1] =
+        (struct lwan_key_value){"Cache-Control", "max-age=86400"};
+    dict->headers[2] = (struct lwan_key_value){};
+
+    return true;
+}
+
+enum lwan_http_status
+lwan_compress_dict_serve(struct lwan_request *request,
+                         struct lwan_response *response,
+                         void *data)
+{
+    const struct lwan_compress_dict *dict = data;
+
+    response->mime_type = "application/octet-stream";
+    response->headers = dict->headers;
+    lwan_strbuf_set_static(response->buffer, dict->data.value, dict->data.len);
+
+    return HTTP_OK;
+}
+
+bool lwan_compress_dict_accepted(struct lwan_request *request,
+                                 const struct lwan_compress_dict *dict)
+{
+    return has_dict(request, dict);
+}
+
+/* Compresses a whole buffer with a dictionary, as a "dcz" response body.
+ * Can be called from any thread; on success, out->value has been allocated
+ * with malloc(). */
+bool lwan_compress_dict_buffer(const struct lwan_compress_dict *dict,
+                               const void *in,
+                               size_t in_len,
+                               struct lwan_value *out)
+{
+#if defined(HAVE_ZSTD)
+    const size_t header_len = sizeof(dict->dcz_header);
+    ZSTD_CCtx *zstd = ZSTD_createCCtx();
+    size_t len;
+
+    if (!zstd)
+        return false;
+
+    out->value = malloc(header_len + ZSTD_compressBound(in_len));
+    if (!out->value)
+        goto error;
+
+    memcpy(out->value, dict->dcz_header, header_len);
+    len = ZSTD_compress_usingCDict(zstd, out->value + header_len,
+                                   ZSTD_compressBound(in_len), in, in_len,
+                                   dict->cdict);
+    if (ZSTD_isError(len)) {
+        free(out->value);
+        goto error;
+    }
+
+    ZSTD_freeCCtx(zstd);
+    out->len = header_len + len;
+
+    /* Kept for as long as the response is cached */
+    char *shrunk = realloc(out->value, out->len);
+    if (shrunk)
+        out->value = shrunk;
+
+    return true;
+
+error:
+    ZSTD_freeCCtx(zstd);
+    *out = (struct lwan_value){};
+    return false;
+#else
+    (void)dict;
+    (void)in;
+    (void)in_len;
+    *out = (struct lwan_value){};
+    return false;
+#endif
+}
@@ -30,8 +30,8 @@
 
 #include "lwan-private.h"
 
-#include "lwan-array.h"
 #include "lwan-coro.h"
+#include "lwan-probes.h"
 
 #if !defined(NDEBUG) && defined(HAVE_VALGRIND)
 #define INSTRUMENT_FOR_VALGRIND
@@ -50,20 +50,34 @@ void __asan_poison_memory_region(void const volatile *addr, size_t size);
 void __asan_unpoison_memory_region(void const volatile *addr, size_t size);
 #endif
 
-#if !defined(SIGSTKSZ)
-#define SIGSTKSZ 16384
-#endif
-
+/* These used to be multiples of SIGSTKSZ, which isn't a constant anymore
+ * in newer C libraries. */
 #ifdef HAVE_BROTLI
-#define CORO_STACK_SIZE (8 * SIGSTKSZ)
+#define CORO_DEFAULT_STACK_SIZE (64 * 1024)
 #else
-#define CORO_STACK_SIZE (4 * SIGSTKSZ)
+#define CORO_DEFAULT_STACK_SIZE (32 * 1024)
 #endif
+#define CORO_MIN_STACK_SIZE (4 * DEFAULT_BUFFER_SIZE)
+
+/* Bump pointer arenas are powers of two between these sizes.  Each arena a
+ * coroutine needs before the previous ones are released is twice as large
+ * as the previous one; see coro_malloc(). */
+#define CORO_ARENA_MIN_SHIFT 10
+#define CORO_ARENA_MAX_SHIFT 15
+#define CORO_ARENA_N_CLASSES (CORO_ARENA_MAX_SHIFT - CORO_ARENA_MIN_SHIFT + 1)
+#define CORO_ARENA_POOL_DEPTH 16
 
-#define CORO_BUMP_PTR_ALLOC_SIZE 1024
+/* Stacks are filled with this when measuring their usage. */
+#define CORO_STACK_CANARY 0xa5
 
-static_assert(DEFAULT_BUFFER_SIZE < CORO_STACK_SIZE,
+static_assert(REQUEST_BUFFER_SIZE < CORO_MIN_STACK_SIZE,
               "Request buffer fits inside coroutine stack");
+static_assert((CORO_DEFAULT_STACK_SIZE % PAGE_SIZE) == 0,
+              "Coroutine stack size is a multiple of page size");
+
+/* Only changed during initialization, before any coroutine is created. */
+static size_t coro_stack_size = CORO_DEFAULT_STACK_SIZE;
+static bool coro_measure_stack_usage = false;
 
 #if (!defined(NDEBUG) && defined(MAP_STACK)) || defined(__OpenBSD__)
 /* As an exploit mitigation, OpenBSD requires any stacks to be allocated via
@@ -73,11 +87,6 @@ static_assert(DEFAULT_BUFFER_SIZE < CORO_STACK_SIZE,
  * (MAP_STACK exists in Linux, but it's a no-op).  */
 
 #define ALLOCATE_STACK_WITH_MMAP
-
-static_assert((CORO_STACK_SIZE % PAGE_SIZE) == 0,
-              "Coroutine stack size is a multiple of page size");
-static_assert((CORO_STACK_SIZE >= PAGE_SIZE),
-              "Coroutine stack size is at least a page long");
 #endif
 
 typedef void (*defer1_func)(void *data);
@@ -98,20 +107,50 @@ struct coro_defer {
     bool has_two_args;
 };
 
-DEFINE_ARRAY_TYPE_INLINEFIRST(coro_defer_array, struct coro_defer)
+/* Deferred calls are kept in a stack made of fixed-size chunks: the first
+ * one lives in struct coro itself, and any others are allocated the first
+ * time they're needed and kept until the coroutine is freed, even if it's
+ * reused through a pool, so registering a deferred call never has to
+ * reallocate or move the ones already registered.  Chunks are linked in
+ * both directions, and the "generation" is simply how many calls are in
+ * the stack. */
+#define CORO_DEFER_CHUNK_SIZE 32
+
+struct coro_defer_chunk {
+    struct coro_defer_chunk *prev, *next;
+    size_t base; /* Deferred calls in the chunks before this one */
+    struct coro_defer defers[CORO_DEFER_CHUNK_SIZE];
+};
 
 struct coro {
     struct coro_switcher *switcher;
     coro_context context;
-    struct coro_defer_array defer;
+    struct {
+        struct coro_defer_chunk *chunk; /* Where the top of the stack is */
+        size_t count;
+        uint64_t registered; /* See coro_deferred_get_registered() */
+        struct coro_defer_chunk first;
+    } defer;
 
     int64_t yield_value;
 
+    /* Next coroutine in the pool, while this one isn't being used. */
+    struct coro *next_in_pool;
+    bool stack_released;
+
     struct {
         /* This allocator is instrumented on debug builds using asan and/or valgrind, if
          * enabled during configuration time.  See coro_malloc_bump_ptr() for details. */
         void *ptr;
         size_t remaining;
+
+        /* Arenas alive, and allocated since none were; once they're all
+         * released (usually at the end of a request), first_shift is
+         * adjusted so that the next request probably fits in one arena. */
+        unsigned int n_arenas;
+        unsigned int n_arenas_in_batch;
+        unsigned char first_shift;
+        unsigned char next_shift;
     } bump_ptr_alloc;
 
 #if defined(INSTRUMENT_FOR_VALGRIND)
@@ -127,12 +166,24 @@ struct coro {
 
 #if defined(__APPLE__)
 #define ASM_SYMBOL(name_) "_" #name_
+#define ASM_TYPE_AND_SIZE(name_) ""
 #else
 #define ASM_SYMBOL(name_) #name_
+#if defined(__aarch64__)
+/* "@" starts a comment in assembly for some architectures */
+#define ASM_FUNCTION_TYPE "%function"
+#else
+#define ASM_FUNCTION_TYPE "@function"
+#endif
+/* So that profilers can attribute samples in these routines to them */
+#define ASM_TYPE_AND_SIZE(name_)                                               \
+    ".type " ASM_SYMBOL(name_) ", " ASM_FUNCTION_TYPE "\n\t"                  \
+    ".size " ASM_SYMBOL(name_) ", .-" ASM_SYMBOL(name_) "\n\t"
 #endif
 
 #define ASM_ROUTINE(name_)                                                     \
     ".globl " ASM_SYMBOL(name_) "\n\t" ASM_SYMBOL(name_) ":\n\t"
+#define ASM_ROUTINE_END(name_) ASM_TYPE_AND_SIZE(name_)
 
 /*
  * This swapcontext() implementation was obtained from glibc and modified
@@ -150,6 +201,7 @@ coro_swapcontext(coro_context *current, coro_context *other);
 asm(".text\n\t"
     ".p2align 5\n\t"
     ASM_ROUTINE(coro_swapcontext)
+    ".cfi_startproc\n\t"
     "movq   %rbx,0(%rdi)\n\t"
     "movq   %rbp,8(%rdi)\n\t"
     "movq   %r12,16(%rdi)\n\t"
@@ -163,6 +215,10 @@ asm(".text\n\t"
     "leaq   0x8(%rsp),%rcx\n\t"
     "movq   %rcx,72(%rdi)\n\t"
     "movq   72(%rsi),%rsp\n\t"
+    /* Now on the other stack, as if its caller had returned already, but
+     * the return address is only known once it's loaded into RCX. */
+    ".cfi_def_cfa_offset 0\n\t"
+    ".cfi_undefined %rip\n\t"
     "movq   0(%rsi),%rbx\n\t"
     "movq   8(%rsi),%rbp\n\t"
     "movq   16(%rsi),%r12\n\t"
@@ -171,14 +227,18 @@ asm(".text\n\t"
     "movq   40(%rsi),%r15\n\t"
     "movq   48(%rsi),%rdi\n\t"
     "movq   64(%rsi),%rcx\n\t"
+    ".cfi_register %rip, %rcx\n\t"
     "movq   56(%rsi),%rsi\n\t"
-    "jmpq   *%rcx\n\t");
+    "jmpq   *%rcx\n\t"
+    ".cfi_endproc\n\t"
+    ASM_ROUTINE_END(coro_swapcontext));
 #elif defined(__i386__)
 void __attribute__((noinline, visibility("internal")))
 coro_swapcontext(coro_context *current, coro_context *other);
 asm(".text\n\t"
     ".p2align 5\n\t"
     ASM_ROUTINE(coro_swapcontext)
+    ".cfi_startproc\n\t"
     "movl   0x4(%esp),%eax\n\t"
     "movl   %ecx,0x1c(%eax)\n\t" /* ECX */
     "movl   %ebx,0x0(%eax)\n\t"  /* EBX */
@@ -192,13 +252,135 @@ asm(".text\n\t"
     "movl   8(%esp),%eax\n\t"
     "movl   0x14(%eax),%ecx\n\t" /* EIP (1) */
     "movl   0x18(%eax),%esp\n\t" /* ESP */
+    ".cfi_def_cfa_offset 0\n\t"
+    ".cfi_register %eip, %ecx\n\t"
     "pushl  %ecx\n\t"            /* EIP (2) */
+    ".cfi_def_cfa_offset 4\n\t"
+    ".cfi_offset %eip, -4\n\t"
     "movl   0x0(%eax),%ebx\n\t"  /* EBX */
     "movl   0x4(%eax),%esi\n\t"  /* ESI */
     "movl   0x8(%eax),%edi\n\t"  /* EDI */
     "movl   0xc(%eax),%ebp\n\t"  /* EBP */
     "movl   0x1c(%eax),%ecx\n\t" /* ECX */
-    "ret\n\t");
+    "ret\n\t"
+    ".cfi_endproc\n\t"
+    ASM_ROUTINE_END(coro_swapcontext));
+#elif defined(__aarch64__)
+/* Only callee-saved registers are switched: X19-X28, the frame pointer,
+ * the link register (where coro_swapcontext() returns to), the stack
+ * pointer, and the lower halves of V8-V15.  Context layout:
+ *     0-9: X19-X28, 10: X29 (FP), 11: X30 (LR), 12: SP, 13-20: D8-D15 */
+void __attribute__((noinline, visibility("internal")))
+coro_swapcontext(coro_context *current, coro_context *other);
+asm(".text\n\t"
+    ".p2align 5\n\t"
+    ASM_ROUTINE(coro_swapcontext)
+    ".cfi_startproc\n\t"
+    "mov    x9, sp\n\t"
+    "stp    x19, x20, [x0, #0]\n\t"
+    "stp    x21, x22, [x0, #16]\n\t"
+    "stp    x23, x24, [x0, #32]\n\t"
+    "stp    x25, x26, [x0, #48]\n\t"
+    "stp    x27, x28, [x0, #64]\n\t"
+    "stp    x29, x30, [x0, #80]\n\t"
+    "str    x9, [x0, #96]\n\t"
+    "stp    d8, d9, [x0, #104]\n\t"
+    "stp    d10, d11, [x0, #120]\n\t"
+    "stp    d12, d13, [x0, #136]\n\t"
+    "stp    d14, d15, [x0, #152]\n\t"
+    "ldp    x19, x20, [x1, #0]\n\t"
+    "ldp    x21, x22, [x1, #16]\n\t"
+    "ldp    x23, x24, [x1, #32]\n\t"
+    "ldp    x25, x26, [x1, #48]\n\t"
+    "ldp    x27, x28, [x1, #64]\n\t"
+    "ldp    x29, x30, [x1, #80]\n\t"
+    "ldr    x9, [x1, #96]\n\t"
+    "mov    sp, x9\n\t"
+    "ldp    d8, d9, [x1, #104]\n\t"
+    "ldp    d10, d11, [x1, #120]\n\t"
+    "ldp    d12, d13, [x1, #136]\n\t"
+    "ldp    d14, d15, [x1, #152]\n\t"
+    "ret\n\t"
+    ".cfi_endproc\n\t"
+    ASM_ROUTINE_END(coro_swapcontext));
+#elif defined(__riscv) && __riscv_xlen == 64
+/* Only callee-saved registers are switched: the return address (where
+ * coro_swapcontext() returns to), the stack pointer, S0-S11, and, with
+ * the D extension, FS0-FS11.  Context layout:
+ *     0: RA, 1: SP, 2-13: S0-S11, 14-25: FS0-FS11 */
+#if defined(__riscv_flen) && __riscv_flen != 64
+#error Unsupported RISC-V floating point ABI.
+#endif
+#if defined(__riscv_flen)
+#define RISCV_FP_SAVE                                                          \
+    "fsd    fs0, 112(a0)\n\t"                                                  \
+    "fsd    fs1, 120(a0)\n\t"                                                  \
+    "fsd    fs2, 128(a0)\n\t"                                                  \
+    "fsd    fs3, 136(a0)\n\t"                                                  \
+    "fsd    fs4, 144(a0)\n\t"                                                  \
+    "fsd    fs5, 152(a0)\n\t"                                                  \
+    "fsd    fs6, 160(a0)\n\t"                                                  \
+    "fsd    fs7, 168(a0)\n\t"                                                  \
+    "fsd    fs8, 176(a0)\n\t"                                                  \
+    "fsd    fs9, 184(a0)\n\t"                                                  \
+    "fsd    fs10, 192(a0)\n\t"                                                 \
+    "fsd    fs11, 200(a0)\n\t"
+#define RISCV_FP_RESTORE                                                       \
+    "fld    fs0, 112(a1)\n\t"                                                  \
+    "fld    fs1, 120(a1)\n\t"                                                  \
+    "fld    fs2, 128(a1)\n\t"                                                  \
+    "fld    fs3, 136(a1)\n\t"                                                  \
+    "fld    fs4, 144(a1)\n\t"                                                  \
+    "fld    fs5, 152(a1)\n\t"                                                  \
+    "fld    fs6, 160(a1)\n\t"                                                  \
+    "fld    fs7, 168(a1)\n\t"                                                  \
+    "fld    fs8, 176(a1)\n\t"                                                  \
+    "fld    fs9, 184(a1)\n\t"                                                  \
+    "fld    fs10, 192(a1)\n\t"                                                 \
+    "fld    fs11, 200(a1)\n\t"
+#else
+#define RISCV_FP_SAVE ""
+#define RISCV_FP_RESTORE ""
+#endif
+void __attribute__((noinline, visibility("internal")))
+coro_swapcontext(coro_context *current, coro_context *other);
+asm(".text\n\t"
+    ".p2align 5\n\t"
+    ASM_ROUTINE(coro_swapcontext)
+    ".cfi_startproc\n\t"
+    "sd     ra, 0(a0)\n\t"
+    "sd     sp, 8(a0)\n\t"
+    "sd     s0, 16(a0)\n\t"
+    "sd     s1, 24(a0)\n\t"
+    "sd     s2, 32(a0)\n\t"
+    "sd     s3, 40(a0)\n\t"
+    "sd     s4, 48(a0)\n\t"
+    "sd     s5, 56(a0)\n\t"
+    "sd     s6, 64(a0)\n\t"
+    "sd     s7, 72(a0)\n\t"
+    "sd     s8, 80(a0)\n\t"
+    "sd     s9, 88(a0)\n\t"
+    "sd     s10, 96(a0)\n\t"
+    "sd     s11, 104(a0)\n\t"
+    RISCV_FP_SAVE
+    "ld     ra, 0(a1)\n\t"
+    "ld     sp, 8(a1)\n\t"
+    "ld     s0, 16(a1)\n\t"
+    "ld     s1, 24(a1)\n\t"
+    "ld     s2, 32(a1)\n\t"
+    "ld     s3, 40(a1)\n\t"
+    "ld     s4, 48(a1)\n\t"
+    "ld     s5, 56(a1)\n\t"
+    "ld     s6, 64(a1)\n\t"
+    "ld     s7, 72(a1)\n\t"
+    "ld     s8, 80(a1)\n\t"
+    "ld     s9, 88(a1)\n\t"
+    "ld     s10, 96(a1)\n\t"
+    "ld     s11, 104(a1)\n\t"
+    RISCV_FP_RESTORE
+    "ret\n\t"
+    ".cfi_endproc\n\t"
+    ASM_ROUTINE_END(coro_swapcontext));
 #elif defined(HAVE_LIBUCONTEXT)
 #define coro_swapcontext(cur, oth) libucontext_swapcontext(cur, oth)
 #else
@@ -212,7 +394,7 @@ coro_entry_point(struct coro *coro, coro_function_t func, void *data)
     return (void)coro_yield(coro, func(coro, data));
 }
 
-#ifdef __x86_64__
+#if defined(__x86_64__)
 /* See comment in coro_reset() for an explanation of why this routine is
  * necessary. */
 void __attribute__((visibility("internal"))) coro_entry_point_x86_64();
@@ -220,33 +402,257 @@ void __attribute__((visibility("internal"))) coro_entry_point_x86_64();
 asm(".text\n\t"
     ".p2align 5\n\t"
     ASM_ROUTINE(coro_entry_point_x86_64)
+    /* Outermost frame of a coroutine: stop unwinding here. */
+    ".cfi_startproc\n\t"
+    ".cfi_undefined %rip\n\t"
     "mov %r15, %rdx\n\t"
     "jmp " ASM_SYMBOL(coro_entry_point) "\n\t"
-);
+    ".cfi_endproc\n\t"
+    ASM_ROUTINE_END(coro_entry_point_x86_64));
+#elif defined(__aarch64__)
+/* The arguments to coro_entry_point() aren't part of the context; they're
+ * passed in X19-X21 by coro_reset() instead. */
+void __attribute__((visibility("internal"))) coro_entry_point_aarch64();
+
+asm(".text\n\t"
+    ".p2align 5\n\t"
+    ASM_ROUTINE(coro_entry_point_aarch64)
+    /* Outermost frame of a coroutine: stop unwinding here. */
+    ".cfi_startproc\n\t"
+    ".cfi_undefined x30\n\t"
+    "mov    x0, x19\n\t"
+    "mov    x1, x20\n\t"
+    "mov    x2, x21\n\t"
+    "b      " ASM_SYMBOL(coro_entry_point) "\n\t"
+    ".cfi_endproc\n\t"
+    ASM_ROUTINE_END(coro_entry_point_aarch64));
+#elif defined(__riscv) && __riscv_xlen == 64
+/* The arguments to coro_entry_point() aren't part of the context; they're
+ * passed in S1-S3 by coro_reset() instead. */
+void __attribute__((visibility("internal"))) coro_entry_point_riscv64();
+
+asm(".text\n\t"
+    ".p2align 5\n\t"
+    ASM_ROUTINE(coro_entry_point_riscv64)
+    /* Outermost frame of a coroutine: stop unwinding here. */
+    ".cfi_startproc\n\t"
+    ".cfi_undefined ra\n\t"
+    "mv     a0, s1\n\t"
+    "mv     a1, s2\n\t"
+    "mv     a2, s3\n\t"
+    "tail   " ASM_SYMBOL(coro_entry_point) "\n\t"
+    ".cfi_endproc\n\t"
+    ASM_ROUTINE_END(coro_entry_point_riscv64));
 #endif
 
 void coro_deferred_run(struct coro *coro, size_t generation)
 {
-    struct lwan_array *array = (struct lwan_array *)&coro->defer;
-    struct coro_defer *defers = array->base;
+    struct coro_defer_chunk *chunk = coro->defer.chunk;
 
-    for (size_t i = array->elements; i != generation; i--) {
-        struct coro_defer *defer = &defers[i - 1];
+    assert(generation <= coro->defer.count);
 
+    while (coro->defer.count != generation) {
+        struct coro_defer *defer;
+
+        if (coro->defer.count == chunk->base) {
+            chunk = coro->defer.chunk = chunk->prev;
+            continue;
+        }
+
+        defer = &chunk->defers[--coro->defer.count - chunk->base];
         if (defer->has_two_args)
             defer->two.func(defer->two.data1, defer->two.data2);
         else
             defer->one.func(defer->one.data);
     }
-
-    array->elements = generation;
 }
 
 ALWAYS_INLINE size_t coro_deferred_get_generation(const struct coro *coro)
 {
-    const struct lwan_array *array = (struct lwan_array *)&coro->defer;
+    return coro->defer.count;
+}
+
+uint64_t coro_deferred_get_registered(const struct coro *coro)
+{
+    return coro->defer.registered;
+}
+
+static void defer_stack_init(struct coro *coro)
+{
+    coro->defer.first = (struct coro_defer_chunk){};
+    coro->defer.chunk = &coro->defer.first;
+    coro->defer.count = 0;
+    coro->defer.registered = 0;
+}
+
+static void defer_stack_free(struct coro *coro)
+{
+    struct coro_defer_chunk *chunk = coro->defer.first.next;
+
+    while (chunk) {
+        struct coro_defer_chunk *next = chunk->next;
+
+        free(chunk);
+        chunk = next;
+    }
+}
+
+static struct coro_defer *defer_stack_push(struct coro *coro)
+{
+    struct coro_defer_chunk *chunk = coro->defer.chunk;
+    size_t index = coro->defer.count - chunk->base;
+
+    if (UNLIKELY(index == CORO_DEFER_CHUNK_SIZE)) {
+        if (!chunk->next) {
+            struct coro_defer_chunk *next = malloc(sizeof(*next));
+
+            if (UNLIKELY(!next))
+                return NULL;
+
+            next->prev = chunk;
+            next->next = NULL;
+            next->base = chunk->base + CORO_DEFER_CHUNK_SIZE;
+            chunk->next = next;
+        }
+
+        chunk = coro->defer.chunk = chunk->next;
+        index = 0;
+    }
+
+    coro->defer.count++;
+    coro->defer.registered++;
+
+    return &chunk->defers[index];
+}
+
+void coro_set_stack_size(size_t size)
+{
+    size = LWAN_MAX(size, (size_t)CORO_MIN_STACK_SIZE);
+
+    coro_stack_size = (size + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+}
 
-    return array->elements;
+size_t coro_get_stack_size(void) { return coro_stack_size; }
+
+/* Stacks (with their struct coro, unless stacks are mapped on their own)
+ * can be carved out of a single region backed by huge pages, sized for
+ * the coroutines kept in the pools of all threads; coroutines created once
+ * it's exhausted are allocated as usual.  Slots are only taken and given
+ * back when coroutines are created and freed, which pools make rare, and
+ * coroutines can be freed by a thread other than the one that created
+ * them, so a lock is good enough. */
+static struct {
+    pthread_mutex_t lock;
+    char *start, *end;
+    char *unused;
+    void *free;
+    size_t slot_size;
+} stack_region = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static size_t stack_region_slot_size(void)
+{
+#if defined(ALLOCATE_STACK_WITH_MMAP)
+    return coro_stack_size;
+#else
+    return (sizeof(struct coro) + coro_stack_size + 63) & ~(size_t)63;
+#endif
+}
+
+bool coro_stack_region_init(size_t n_stacks)
+{
+    const size_t slot_size = stack_region_slot_size();
+    const size_t size = n_stacks * slot_size;
+    char *start;
+
+    assert(!stack_region.start);
+
+    start = lwan_huge_pages_alloc(size);
+    if (!start)
+        return false;
+
+    stack_region.start = stack_region.unused = start;
+    stack_region.end = start + size;
+    stack_region.slot_size = slot_size;
+
+    return true;
+}
+
+void coro_stack_region_shutdown(void)
+{
+    lwan_huge_pages_free(stack_region.start,
+                         (size_t)(stack_region.end - stack_region.start));
+    stack_region.start = stack_region.end = stack_region.unused = NULL;
+    stack_region.free = NULL;
+}
+
+static void *stack_region_get(void)
+{
+    void *slot;
+
+    if (!stack_region.start)
+        return NULL;
+
+    pthread_mutex_lock(&stack_region.lock);
+    if (stack_region.free) {
+        slot = stack_region.free;
+        stack_region.free = *(void **)slot;
+    } else if (stack_region.unused < stack_region.end) {
+        slot = stack_region.unused;
+        stack_region.unused += stack_region.slot_size;
+    } else {
+        slot = NULL;
+    }
+    pthread_mutex_unlock(&stack_region.lock);
+
+    return slot;
+}
+
+static inline bool stack_region_contains(const void *ptr)
+{
+    return (const char *)ptr >= stack_region.start &&
+           (const char *)ptr < stack_region.end;
+}
+
+static bool stack_region_put(void *slot)
+{
+    if (!stack_region_contains(slot))
+        return false;
+
+    pthread_mutex_lock(&stack_region.lock);
+    *(void **)slot = stack_region.free;
+    stack_region.free = slot;
+    pthread_mutex_unlock(&stack_region.lock);
+
+    return true;
+}
+
+void coro_set_stack_usage_measurement(bool enabled)
+{
+    coro_measure_stack_usage = enabled;
+}
+
+__attribute__((no_sanitize_address)) size_t
+coro_stack_high_water_mark(struct coro *coro)
+{
+    /* Must be called from within the coroutine.  Stacks grow downwards on
+     * all supported platforms, so look for the lowest address that has been
+     * written to since the stack was filled with canaries. */
+    unsigned char *stack = coro->stack;
+    unsigned char *frame = __builtin_frame_address(0);
+    unsigned char *lowest = stack;
+
+    assert(frame > stack && frame <= stack + coro_stack_size);
+
+    while (lowest < frame && *lowest == CORO_STACK_CANARY)
+        lowest++;
+
+    /* Everything below this function's frame is dead at this point, so
+     * refill it (leaving some room for the memset() frame itself) so that
+     * the next measurement only accounts for what happens from now on. */
+    if (frame - lowest > 512)
+        memset(lowest, CORO_STACK_CANARY, (size_t)(frame - lowest - 512));
+
+    return (size_t)(stack + coro_stack_size - lowest);
 }
 
 void coro_reset(struct coro *coro, coro_function_t func, void *data)
@@ -254,9 +660,18 @@ void coro_reset(struct coro *coro, coro_function_t func, void *data)
     unsigned char *stack = coro->stack;
 
     coro_deferred_run(coro, 0);
-    coro_defer_array_reset(&coro->defer);
     coro->bump_ptr_alloc.remaining = 0;
 
+    if (UNLIKELY(coro_measure_stack_usage))
+        memset(stack, CORO_STACK_CANARY, coro_stack_size);
+
+#if defined(INSTRUMENT_FOR_ASAN)
+    /* A coroutine that was never resumed until it finished (e.g. one
+     * serving a connection that was aborted) leaves the redzones of the
+     * frames it had on the stack poisoned; pooled coroutines reuse it. */
+    __asan_unpoison_memory_region(stack, coro_stack_size);
+#endif
+
 #if defined(__x86_64__)
     /* coro_entry_point() for x86-64 has 3 arguments, but RDX isn't
      * stored.  Use R15 instead, and implement the trampoline
@@ -270,12 +685,19 @@ void coro_reset(struct coro *coro, coro_function_t func, void *data)
     /* Ensure stack is properly aligned: it should be aligned to a
      * 16-bytes boundary so SSE will work properly, but should be
      * aligned on an 8-byte boundary right after calling a function. */
-    uintptr_t rsp = (uintptr_t)stack + CORO_STACK_SIZE;
+    uintptr_t rsp = (uintptr_t)stack + coro_stack_size;
 
 #define STACK_PTR 9
     coro->context[STACK_PTR] = (rsp & ~0xful) - 0x8ul;
+
+    /* coro_entry_point() is jumped to, not called, so its return address
+     * would be whatever was at the top of the stack; a NULL return address
+     * and frame pointer end the call chain there for unwinders (e.g. the
+     * ones in perf and bpftrace) instead of having them walk into garbage. */
+    *(uintptr_t *)coro->context[STACK_PTR] = 0;
+    coro->context[1 /* RBP */] = 0;
 #elif defined(__i386__)
-    stack = (unsigned char *)(uintptr_t)(stack + CORO_STACK_SIZE);
+    stack = (unsigned char *)(uintptr_t)(stack + coro_stack_size);
 
     /* Make room for 3 args */
     stack -= sizeof(uintptr_t) * 3;
@@ -289,14 +711,40 @@ void coro_reset(struct coro *coro, coro_function_t func, void *data)
     *argp++ = (uintptr_t)data;
 
     coro->context[5 /* EIP */] = (uintptr_t)coro_entry_point;
+    /* The first argument slot is the (NULL) return address; see above. */
+    coro->context[3 /* EBP */] = 0;
 
 #define STACK_PTR 6
     coro->context[STACK_PTR] = (uintptr_t)stack;
+#elif defined(__aarch64__)
+    coro->context[0 /* X19 */] = (uintptr_t)coro;
+    coro->context[1 /* X20 */] = (uintptr_t)func;
+    coro->context[2 /* X21 */] = (uintptr_t)data;
+    /* A NULL frame pointer ends the call chain for unwinders. */
+    coro->context[10 /* X29 */] = 0;
+    coro->context[11 /* X30 */] = (uintptr_t)coro_entry_point_aarch64;
+
+    /* The stack pointer must always be aligned to 16 bytes. */
+#define STACK_PTR 12
+    coro->context[STACK_PTR] =
+        ((uintptr_t)stack + coro_stack_size) & ~(uintptr_t)0xf;
+#elif defined(__riscv) && __riscv_xlen == 64
+    coro->context[0 /* RA */] = (uintptr_t)coro_entry_point_riscv64;
+    /* A NULL frame pointer ends the call chain for unwinders. */
+    coro->context[2 /* S0 */] = 0;
+    coro->context[3 /* S1 */] = (uintptr_t)coro;
+    coro->context[4 /* S2 */] = (uintptr_t)func;
+    coro->context[5 /* S3 */] = (uintptr_t)data;
+
+    /* The stack pointer must always be aligned to 16 bytes. */
+#define STACK_PTR 1
+    coro->context[STACK_PTR] =
+        ((uintptr_t)stack + coro_stack_size) & ~(uintptr_t)0xf;
 #elif defined(HAVE_LIBUCONTEXT)
     libucontext_getcontext(&coro->context);
 
     coro->context.uc_stack.ss_sp = stack;
-    coro->context.uc_stack.ss_size = CORO_STACK_SIZE;
+    coro->context.uc_stack.ss_size = coro_stack_size;
     coro->context.uc_stack.ss_flags = 0;
     coro->context.uc_link = NULL;
 
@@ -312,38 +760,58 @@ coro_new(struct coro_switcher *switcher, coro_function_t function, void *data)
     struct coro *coro;
 
 #if defined(ALLOCATE_STACK_WITH_MMAP)
-    void *stack = mmap(NULL, CORO_STACK_SIZE, PROT_READ | PROT_WRITE,
-                       MAP_STACK | MAP_ANON | MAP_PRIVATE, -1, 0);
-    if (UNLIKELY(stack == MAP_FAILED))
-        return NULL;
+    void *stack = stack_region_get();
+
+    if (!stack) {
+        stack = mmap(NULL, coro_stack_size, PROT_READ | PROT_WRITE,
+                     MAP_STACK | MAP_ANON | MAP_PRIVATE, -1, 0);
+        if (UNLIKELY(stack == MAP_FAILED))
+            return NULL;
+    }
 
     coro = lwan_aligned_alloc(sizeof(*coro), 64);
     if (UNLIKELY(!coro)) {
-        munmap(stack, CORO_STACK_SIZE);
+        if (!stack_region_put(stack))
+            munmap(stack, coro_stack_size);
         return NULL;
     }
 
     coro->stack = stack;
 #else
-    coro = lwan_aligned_alloc(sizeof(struct coro) + CORO_STACK_SIZE, 64);
-
-    if (UNLIKELY(!coro))
-        return NULL;
+    coro = stack_region_get();
+    if (!coro) {
+        coro = lwan_aligned_alloc(sizeof(struct coro) + coro_stack_size, 64);
+        if (UNLIKELY(!coro))
+            return NULL;
+    }
 #endif
 
-    coro_defer_array_init(&coro->defer);
+    defer_stack_init(coro);
+    lwan_memory_account(LWAN_MEMORY_CORO_STACKS,
+                        (int64_t)(sizeof(*coro) + coro_stack_size));
 
     coro->switcher = switcher;
+    coro->bump_ptr_alloc.n_arenas = 0;
+    coro->bump_ptr_alloc.n_arenas_in_batch = 0;
+    coro->bump_ptr_alloc.first_shift = CORO_ARENA_MIN_SHIFT;
+    coro->bump_ptr_alloc.next_shift = CORO_ARENA_MIN_SHIFT;
     coro_reset(coro, function, data);
 
 #if defined(INSTRUMENT_FOR_VALGRIND)
     coro->vg_stack_id = VALGRIND_STACK_REGISTER(
-        coro->stack, (char *)coro->stack + CORO_STACK_SIZE);
+        coro->stack, (char *)coro->stack + coro_stack_size);
 #endif
 
     return coro;
 }
 
+void coro_set_switcher(struct coro *coro, struct coro_switcher *switcher)
+{
+    /* Only safe to call while the coroutine is suspended, e.g. to move it
+     * to another thread. */
+    coro->switcher = switcher;
+}
+
 ALWAYS_INLINE int64_t coro_resume(struct coro *coro)
 {
     assert(coro);
@@ -351,9 +819,11 @@ ALWAYS_INLINE int64_t coro_resume(struct coro *coro)
 #if defined(STACK_PTR)
     assert(coro->context[STACK_PTR] >= (uintptr_t)coro->stack &&
            coro->context[STACK_PTR] <=
-               (uintptr_t)(coro->stack + CORO_STACK_SIZE));
+               (uintptr_t)(coro->stack + coro_stack_size));
 #endif
 
+    /* yield_value is why the coroutine yielded, or what it's resumed with */
+    LWAN_PROBE(coro_resume, coro, coro->yield_value);
     coro_swapcontext(&coro->switcher->caller, &coro->context);
 
     return coro->yield_value;
@@ -372,6 +842,7 @@ inline int64_t coro_yield(struct coro *coro, int64_t value)
     assert(coro);
 
     coro->yield_value = value;
+    LWAN_PROBE(coro_yield, coro, value);
     coro_swapcontext(&coro->context, &coro->switcher->caller);
 
     return coro->yield_value;
@@ -382,23 +853,118 @@ void coro_free(struct coro *coro)
     assert(coro);
 
     coro_deferred_run(coro, 0);
-    coro_defer_array_reset(&coro->defer);
+    defer_stack_free(coro);
+    lwan_memory_account(LWAN_MEMORY_CORO_STACKS,
+                        -(int64_t)(sizeof(*coro) + coro_stack_size));
 
 #if defined(INSTRUMENT_FOR_VALGRIND)
     VALGRIND_STACK_DEREGISTER(coro->vg_stack_id);
 #endif
 
 #if defined(ALLOCATE_STACK_WITH_MMAP)
-    int result = munmap(coro->stack, CORO_STACK_SIZE);
-    assert(result == 0);  /* only fails if addr, len are invalid */
-#endif
+    if (!stack_region_put(coro->stack)) {
+        int result = munmap(coro->stack, coro_stack_size);
+        assert(result == 0);  /* only fails if addr, len are invalid */
+    }
 
     free(coro);
+#else
+    if (!stack_region_put(coro))
+        free(coro);
+#endif
+}
+
+void coro_pool_init(struct coro_pool *pool, unsigned int max_count)
+{
+    *pool = (struct coro_pool){.max_count = max_count};
+}
+
+void coro_pool_shutdown(struct coro_pool *pool)
+{
+    while (pool->head) {
+        struct coro *coro = pool->head;
+
+        pool->head = coro->next_in_pool;
+        coro_free(coro);
+    }
+
+    pool->count = pool->min_count_since_trim = 0;
+}
+
+struct coro *coro_pool_get(struct coro_pool *pool,
+                           struct coro_switcher *switcher,
+                           coro_function_t function,
+                           void *data)
+{
+    struct coro *coro = pool->head;
+
+    if (!coro)
+        return coro_new(switcher, function, data);
+
+    pool->head = coro->next_in_pool;
+    pool->count--;
+    if (pool->count < pool->min_count_since_trim)
+        pool->min_count_since_trim = pool->count;
+
+    coro->switcher = switcher;
+    coro->stack_released = false;
+    coro_reset(coro, function, data);
+
+    return coro;
+}
+
+void coro_pool_put(struct coro_pool *pool, struct coro *coro)
+{
+    if (pool->count >= pool->max_count) {
+        coro_free(coro);
+        return;
+    }
+
+    /* Release resources held by the coroutine now rather than when it's
+     * reused. */
+    coro_deferred_run(coro, 0);
+
+    coro->next_in_pool = pool->head;
+    pool->head = coro;
+    pool->count++;
+}
+
+void coro_pool_release_cold_stacks(struct coro_pool *pool)
+{
+    /* The pool is used as a stack, so coroutines that haven't been taken
+     * out of the pool since the last call are the ones at the bottom.  Give
+     * their stack pages back to the kernel; they'll be faulted back in as
+     * zero-filled pages when used again. */
+    unsigned int n_hot = pool->count - pool->min_count_since_trim;
+    struct coro *coro = pool->head;
+
+    for (; coro && n_hot; coro = coro->next_in_pool)
+        n_hot--;
+
+    for (; coro && !coro->stack_released; coro = coro->next_in_pool) {
+        /* Releasing part of a huge page would split it. */
+        if (stack_region_contains(coro->stack)) {
+            coro->stack_released = true;
+            continue;
+        }
+
+        uintptr_t start = ((uintptr_t)coro->stack + PAGE_SIZE - 1) &
+                          ~((uintptr_t)PAGE_SIZE - 1);
+        uintptr_t end = ((uintptr_t)coro->stack + coro_stack_size) &
+                        ~((uintptr_t)PAGE_SIZE - 1);
+
+        if (end > start)
+            madvise((void *)start, end - start, MADV_DONTNEED);
+
+        coro->stack_released = true;
+    }
+
+    pool->min_count_since_trim = pool->count;
 }
 
 ALWAYS_INLINE void coro_defer(struct coro *coro, defer1_func func, void *data)
 {
-    struct coro_defer *defer = coro_defer_array_append(&coro->defer);
+    struct coro_defer *defer = defer_stack_push(coro);
 
     if (UNLIKELY(!defer)) {
         lwan_status_error("Could not add new deferred function for coro %p",
@@ -414,7 +980,7 @@ ALWAYS_INLINE void coro_defer(struct coro *coro, defer1_func func, void *data)
 ALWAYS_INLINE void
 coro_defer2(struct coro *coro, defer2_func func, void *data1, void *data2)
 {
-    struct coro_defer *defer = coro_defer_array_append(&coro->defer);
+    struct coro_defer *defer = defer_stack_push(coro);
 
     if (UNLIKELY(!defer)) {
         lwan_status_error("Could not add new deferred function for coro %p",
@@ -493,24 +1059,112 @@ static inline void *coro_malloc_bump_ptr(struct coro *coro, size_t aligned_size)
     coro_malloc_bump_ptr(coro_, aligned_size_)
 #endif
 
+/* Arenas released by coroutines running in a worker thread are kept by
+ * that thread, like buffers in lwan-strbuf.c, so that requests that need
+ * more than one arena don't have to go through malloc() and free() for
+ * each one of them.  Arenas are plain heap allocations, so they can be
+ * released by a thread other than the one that obtained them (e.g. if the
+ * connection has been moved to another thread).  Other threads don't pool
+ * arenas. */
+static __thread struct {
+    void *arenas[CORO_ARENA_N_CLASSES][CORO_ARENA_POOL_DEPTH];
+    unsigned int count[CORO_ARENA_N_CLASSES];
+    bool enabled;
+} arena_pool;
+
+void coro_thread_init(void)
+{
+    arena_pool.enabled = true;
+}
+
+void coro_thread_shutdown(void)
+{
+    arena_pool.enabled = false;
+
+    for (size_t i = 0; i < N_ELEMENTS(arena_pool.count); i++) {
+        while (arena_pool.count[i])
+            free(arena_pool.arenas[i][--arena_pool.count[i]]);
+    }
+}
+
+/* The arena size is stored in front of it, so that free_bump_ptr() knows
+ * where to return it to. */
+struct coro_arena {
+    size_t shift;
+    char data[] __attribute__((aligned(16)));
+};
+
+static struct coro_arena *arena_alloc(unsigned int shift)
+{
+    const unsigned int class = shift - CORO_ARENA_MIN_SHIFT;
+    struct coro_arena *arena;
+
+    if (arena_pool.count[class])
+        return arena_pool.arenas[class][--arena_pool.count[class]];
+
+    arena = malloc((size_t)1 << shift);
+    if (LIKELY(arena))
+        arena->shift = shift;
+
+    return arena;
+}
+
+static void arena_free(struct coro_arena *arena)
+{
+    const size_t class = arena->shift - CORO_ARENA_MIN_SHIFT;
+
+    if (arena_pool.enabled && arena_pool.count[class] < CORO_ARENA_POOL_DEPTH) {
+        arena_pool.arenas[class][arena_pool.count[class]++] = arena;
+        return;
+    }
+
+    free(arena);
+}
+
+static inline size_t arena_capacity(size_t shift)
+{
+    return ((size_t)1 << shift) - sizeof(struct coro_arena);
+}
+
 static void free_bump_ptr(void *arg1, void *arg2)
 {
     struct coro *coro = arg1;
+    struct coro_arena *arena = arg2;
 
 #if defined(INSTRUMENT_FOR_VALGRIND)
-    VALGRIND_MAKE_MEM_UNDEFINED(arg2, CORO_BUMP_PTR_ALLOC_SIZE);
+    VALGRIND_MAKE_MEM_UNDEFINED(arena->data, arena_capacity(arena->shift));
 #endif
 #if defined(INSTRUMENT_FOR_ASAN)
-    __asan_unpoison_memory_region(arg2, CORO_BUMP_PTR_ALLOC_SIZE);
+    __asan_unpoison_memory_region(arena->data, arena_capacity(arena->shift));
 #endif
 
+    if (!--coro->bump_ptr_alloc.n_arenas) {
+        unsigned int first_shift = coro->bump_ptr_alloc.first_shift;
+
+        if (coro->bump_ptr_alloc.n_arenas_in_batch > 1) {
+            /* The arenas allocated since the last time this happened added
+             * up to about twice the size of the last one. */
+            first_shift = coro->bump_ptr_alloc.next_shift;
+        } else if (first_shift > CORO_ARENA_MIN_SHIFT &&
+                   coro->bump_ptr_alloc.remaining >
+                       arena_capacity(arena->shift) / 4 * 3) {
+            /* Only this arena was needed, and it was mostly unused; a
+             * single large request shouldn't pin large arenas forever. */
+            first_shift--;
+        }
+
+        coro->bump_ptr_alloc.first_shift = (unsigned char)first_shift;
+        coro->bump_ptr_alloc.next_shift = (unsigned char)first_shift;
+        coro->bump_ptr_alloc.n_arenas_in_batch = 0;
+    }
+
     /* Instead of checking if bump_ptr_alloc.ptr is part of the allocation
      * with base in arg2, just zero out the arena for this coroutine to
      * prevent coro_malloc() from carving up this and any other
      * (potentially) freed arenas.  */
     coro->bump_ptr_alloc.remaining = 0;
 
-    return free(arg2);
+    arena_free(arena);
 }
 
 void *coro_malloc(struct coro *coro, size_t size)
@@ -528,27 +1182,36 @@ void *coro_malloc(struct coro *coro, size_t size)
     if (LIKELY(coro->bump_ptr_alloc.remaining >= aligned_size))
         return CORO_MALLOC_BUMP_PTR(coro, aligned_size, size);
 
-    /* This will allocate as many "bump pointer arenas" as necessary; the
-     * old ones will be freed automatically as each allocations coro_defers
-     * the free() call.   Just don't bother allocating an arena larger than
-     * CORO_BUMP_PTR_ALLOC.  */
-    if (LIKELY(aligned_size <= CORO_BUMP_PTR_ALLOC_SIZE)) {
-        coro->bump_ptr_alloc.ptr = malloc(CORO_BUMP_PTR_ALLOC_SIZE);
-        if (UNLIKELY(!coro->bump_ptr_alloc.ptr))
+    /* This will allocate as many "bump pointer arenas" as necessary, each
+     * one twice as large as the previous; the old ones will be released
+     * automatically as each allocation coro_defers that.  Just don't bother
+     * allocating an arena larger than the largest size class.  */
+    if (LIKELY(aligned_size <= arena_capacity(CORO_ARENA_MAX_SHIFT))) {
+        unsigned int shift = coro->bump_ptr_alloc.next_shift;
+        struct coro_arena *arena;
+
+        while (arena_capacity(shift) < aligned_size)
+            shift++;
+
+        arena = arena_alloc(shift);
+        if (UNLIKELY(!arena))
             return NULL;
 
-        coro->bump_ptr_alloc.remaining = CORO_BUMP_PTR_ALLOC_SIZE;
+        coro->bump_ptr_alloc.ptr = arena->data;
+        coro->bump_ptr_alloc.remaining = arena_capacity(shift);
+        coro->bump_ptr_alloc.n_arenas++;
+        coro->bump_ptr_alloc.n_arenas_in_batch++;
+        coro->bump_ptr_alloc.next_shift =
+            (unsigned char)LWAN_MIN(shift + 1, (unsigned int)CORO_ARENA_MAX_SHIFT);
 
 #if defined(INSTRUMENT_FOR_ASAN)
-        __asan_poison_memory_region(coro->bump_ptr_alloc.ptr,
-                                    CORO_BUMP_PTR_ALLOC_SIZE);
+        __asan_poison_memory_region(arena->data, arena_capacity(shift));
 #endif
 #if defined(INSTRUMENT_FOR_VALGRIND)
-        VALGRIND_MAKE_MEM_NOACCESS(coro->bump_ptr_alloc.ptr,
-                                   CORO_BUMP_PTR_ALLOC_SIZE);
+        VALGRIND_MAKE_MEM_NOACCESS(arena->data, arena_capacity(shift));
 #endif
 
-        coro_defer2(coro, free_bump_ptr, coro, coro->bump_ptr_alloc.ptr);
+        coro_defer2(coro, free_bump_ptr, coro, arena);
 
         return CORO_MALLOC_BUMP_PTR(coro, aligned_size, size);
     }
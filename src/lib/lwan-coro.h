@@ -20,6 +20,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -27,6 +28,10 @@
 typedef uintptr_t coro_context[10];
 #elif defined(__i386__)
 typedef uintptr_t coro_context[7];
+#elif defined(__aarch64__)
+typedef uintptr_t coro_context[21];
+#elif defined(__riscv) && __riscv_xlen == 64
+typedef uintptr_t coro_context[26];
 #elif defined(HAVE_LIBUCONTEXT)
 #include <libucontext/libucontext.h>
 typedef libucontext_ucontext_t coro_context;
@@ -42,11 +47,40 @@ struct coro_switcher {
     coro_context caller;
 };
 
+/* Per-thread cache of coroutines (and their stacks) that aren't being used,
+ * to avoid allocating a new stack for every connection. */
+struct coro_pool {
+    struct coro *head;
+    unsigned int count;
+    unsigned int max_count;
+    unsigned int min_count_since_trim;
+};
+
 struct coro *
 coro_new(struct coro_switcher *switcher, coro_function_t function, void *data);
 void coro_free(struct coro *coro);
 
 void coro_reset(struct coro *coro, coro_function_t func, void *data);
+void coro_set_switcher(struct coro *coro, struct coro_switcher *switcher);
+
+void coro_set_stack_size(size_t size);
+size_t coro_get_stack_size(void);
+void coro_set_stack_usage_measurement(bool enabled);
+bool coro_stack_region_init(size_t n_stacks);
+void coro_stack_region_shutdown(void);
+size_t coro_stack_high_water_mark(struct coro *coro);
+
+void coro_pool_init(struct coro_pool *pool, unsigned int max_count);
+void coro_pool_shutdown(struct coro_pool *pool);
+struct coro *coro_pool_get(struct coro_pool *pool,
+                           struct coro_switcher *switcher,
+                           coro_function_t function,
+                           void *data);
+void coro_pool_put(struct coro_pool *pool, struct coro *coro);
+void coro_pool_release_cold_stacks(struct coro_pool *pool);
+
+void coro_thread_init(void);
+void coro_thread_shutdown(void);
 
 int64_t coro_resume(struct coro *coro);
 int64_t coro_resume_value(struct coro *coro, int64_t value);
@@ -60,6 +94,8 @@ void coro_defer2(struct coro *coro,
 
 void coro_deferred_run(struct coro *coro, size_t generation);
 size_t coro_deferred_get_generation(const struct coro *coro);
+/* Deferred calls registered since the coroutine was created */
+uint64_t coro_deferred_get_registered(const struct coro *coro);
 
 void *coro_malloc(struct coro *coro, size_t sz) __attribute__((malloc));
 void *coro_malloc_full(struct coro *coro,
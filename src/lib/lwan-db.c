@@ -0,0 +1,900 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2014 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(HAVE_MYSQL)
+#include <mysql.h>
+#endif
+#if defined(HAVE_SQLITE)
+#include <sqlite3.h>
+#endif
+
+#include "lwan-private.h"
+
+#include "hash.h"
+#include "list.h"
+#include "lwan-db.h"
+
+#define MAX_THREADS 256
+
+struct db_stmt {
+    bool (*bind)(const struct db_stmt *stmt,
+                 struct db_row *rows,
+                 size_t n_rows);
+    bool (*step)(const struct db_stmt *stmt, const char *signature, va_list ap);
+    /* Makes a cached statement ready to be used by somebody else */
+    void (*reset)(struct db_stmt *stmt);
+    void (*finalize)(struct db_stmt *stmt);
+
+    /* Only set for statements in the cache of their connection */
+    char *sql;
+    struct list_node lru;
+    bool in_use;
+};
+
+struct db {
+    void (*disconnect)(struct db *db);
+    struct db_stmt *(*prepare)(const struct db *db,
+                               const char *sql,
+                               const size_t sql_len);
+    bool (*set_request)(struct db *db, struct lwan_request *request);
+
+    /* Cached statements, keyed by their SQL, most recently used first */
+    struct hash *stmts;
+    struct list_head lru;
+    unsigned int max_stmts;
+};
+
+static void db_init(struct db *db,
+                    void (*disconnect)(struct db *db),
+                    struct db_stmt *(*prepare)(const struct db *db,
+                                               const char *sql,
+                                               const size_t sql_len))
+{
+    *db = (struct db){
+        .disconnect = disconnect,
+        .prepare = prepare,
+    };
+    list_head_init(&db->lru);
+}
+
+/* MySQL */
+
+#if defined(HAVE_MYSQL)
+struct db_mysql {
+    struct db base;
+    MYSQL *con;
+
+    /* Only set for connections created by db_connect_mysql_async() */
+    struct lwan_request *request;
+    /* Waiting (or was waiting, if the request was aborted) for a reply */
+    bool busy;
+};
+
+struct db_stmt_mysql {
+    struct db_stmt base;
+    struct db_mysql *db;
+    MYSQL_STMT *stmt;
+    MYSQL_BIND *param_bind;
+    MYSQL_BIND *result_bind;
+    bool must_execute_again;
+};
+
+#if defined(MYSQL_WAIT_READ)
+/* MariaDB Connector/C can perform every call that talks to the server in
+ * steps: foo_start() returns the events it needs to wait for, if any, and
+ * foo_cont() is called once they happen, until it's done. */
+
+static int db_mysql_wait(struct db_mysql *db_mysql, int status)
+{
+    const int fd = (int)mysql_get_socket(db_mysql->con);
+
+    db_mysql->busy = true;
+
+    if ((status & (MYSQL_WAIT_READ | MYSQL_WAIT_WRITE)) ==
+        (MYSQL_WAIT_READ | MYSQL_WAIT_WRITE))
+        lwan_request_await_read_write(db_mysql->request, fd);
+    else if (status & MYSQL_WAIT_WRITE)
+        lwan_request_await_write(db_mysql->request, fd);
+    else
+        lwan_request_await_read(db_mysql->request, fd);
+
+    return status;
+}
+
+static void db_mysql_done(struct db_mysql *db_mysql)
+{
+    if (!db_mysql->busy)
+        return;
+
+    /* Until it's used again, nothing should wake up the request. */
+    lwan_request_await_forget(db_mysql->request,
+                              (int)mysql_get_socket(db_mysql->con));
+    db_mysql->busy = false;
+}
+
+typedef my_bool db_mysql_bool;
+
+#define DB_MYSQL_CALL(db_mysql_, ret_, fn_, handle_, ...)                      \
+    do {                                                                       \
+        if ((db_mysql_)->request) {                                            \
+            int status_ = fn_##_start(&(ret_), handle_, ##__VA_ARGS__);        \
+            while (status_) {                                                  \
+                status_ = fn_##_cont(&(ret_), handle_,                         \
+                                     db_mysql_wait(db_mysql_, status_));       \
+            }                                                                  \
+            db_mysql_done(db_mysql_);                                          \
+        } else {                                                               \
+            ret_ = fn_(handle_, ##__VA_ARGS__);                                \
+        }                                                                      \
+    } while (0)
+#else
+/* my_bool is gone from MySQL 8.0 */
+typedef bool db_mysql_bool;
+
+#define DB_MYSQL_CALL(db_mysql_, ret_, fn_, handle_, ...)                      \
+    do {                                                                       \
+        ret_ = fn_(handle_, ##__VA_ARGS__);                                    \
+    } while (0)
+#endif
+
+static bool db_stmt_bind_mysql(const struct db_stmt *stmt,
+                               struct db_row *rows,
+                               size_t n_rows)
+{
+    struct db_stmt_mysql *stmt_mysql = (struct db_stmt_mysql *)stmt;
+
+    stmt_mysql->must_execute_again = true;
+
+    if (!stmt_mysql->param_bind) {
+        stmt_mysql->param_bind = calloc(n_rows, sizeof(MYSQL_BIND));
+        if (!stmt_mysql->param_bind)
+            return false;
+    } else {
+        db_mysql_bool reset_failed;
+
+        DB_MYSQL_CALL(stmt_mysql->db, reset_failed, mysql_stmt_reset,
+                      stmt_mysql->stmt);
+        if (reset_failed)
+            return false;
+    }
+
+    for (size_t row = 0; row < n_rows && rows[row].kind; row++) {
+        MYSQL_BIND *param = &stmt_mysql->param_bind[row];
+
+        switch (rows[row].kind) {
+        case 's':
+            param->buffer_type = MYSQL_TYPE_STRING;
+            param->buffer = rows[row].u.s;
+            break;
+        case 'i':
+            param->buffer_type = MYSQL_TYPE_LONG;
+            param->buffer = &rows[row].u.i;
+            break;
+        default:
+            return false;
+        }
+
+        param->is_null = false;
+        param->length = 0;
+    }
+
+    return !mysql_stmt_bind_param(stmt_mysql->stmt, stmt_mysql->param_bind);
+}
+
+static bool db_stmt_step_mysql(const struct db_stmt *stmt,
+                               const char *signature,
+                               va_list ap)
+{
+    struct db_stmt_mysql *stmt_mysql = (struct db_stmt_mysql *)stmt;
+    int ret;
+
+    if (stmt_mysql->must_execute_again) {
+        stmt_mysql->must_execute_again = false;
+
+        DB_MYSQL_CALL(stmt_mysql->db, ret, mysql_stmt_execute,
+                      stmt_mysql->stmt);
+        if (ret)
+            return false;
+    }
+
+    if (!stmt_mysql->result_bind) {
+        if (*signature == '\0')
+            return false;
+
+        stmt_mysql->result_bind =
+            calloc(strlen(signature), sizeof(*stmt_mysql->result_bind));
+        if (!stmt_mysql->result_bind)
+            return false;
+
+        free(stmt_mysql->param_bind);
+        stmt_mysql->param_bind = NULL;
+
+        MYSQL_BIND *result = stmt_mysql->result_bind;
+        for (size_t r = 0; signature[r]; r++) {
+            switch (signature[r]) {
+            case 's':
+                result[r].buffer_type = MYSQL_TYPE_STRING;
+                result[r].buffer = va_arg(ap, char *);
+                result[r].buffer_length = va_arg(ap, size_t);
+                break;
+            case 'i':
+                result[r].buffer_type = MYSQL_TYPE_LONG;
+                result[r].buffer = va_arg(ap, long *);
+                result[r].buffer_length = 0;
+                break;
+            default:
+                goto out;
+            }
+
+            result[r].is_null = false;
+        }
+
+        if (mysql_stmt_bind_result(stmt_mysql->stmt, result))
+            goto out;
+    }
+
+    DB_MYSQL_CALL(stmt_mysql->db, ret, mysql_stmt_fetch, stmt_mysql->stmt);
+    return ret == 0;
+
+out:
+    free(stmt_mysql->result_bind);
+    stmt_mysql->result_bind = NULL;
+
+    return false;
+}
+
+static void db_stmt_reset_mysql(struct db_stmt *stmt)
+{
+    struct db_stmt_mysql *stmt_mysql = (struct db_stmt_mysql *)stmt;
+    db_mysql_bool free_failed;
+
+    /* Rows that haven't been fetched would be in the way of whatever is
+     * sent through this connection next. */
+    DB_MYSQL_CALL(stmt_mysql->db, free_failed, mysql_stmt_free_result,
+                  stmt_mysql->stmt);
+    (void)free_failed;
+
+    /* Results were bound to variables of whoever used it last. */
+    free(stmt_mysql->result_bind);
+    stmt_mysql->result_bind = NULL;
+    free(stmt_mysql->param_bind);
+    stmt_mysql->param_bind = NULL;
+
+    stmt_mysql->must_execute_again = true;
+}
+
+static void db_stmt_finalize_mysql(struct db_stmt *stmt)
+{
+    struct db_stmt_mysql *stmt_mysql = (struct db_stmt_mysql *)stmt;
+    db_mysql_bool close_failed;
+
+    DB_MYSQL_CALL(stmt_mysql->db, close_failed, mysql_stmt_close,
+                  stmt_mysql->stmt);
+    (void)close_failed;
+
+    free(stmt_mysql->result_bind);
+    free(stmt_mysql->param_bind);
+    free(stmt_mysql);
+}
+
+static struct db_stmt *
+db_prepare_mysql(const struct db *db, const char *sql, const size_t sql_len)
+{
+    struct db_mysql *db_mysql = (struct db_mysql *)db;
+    struct db_stmt_mysql *stmt_mysql = malloc(sizeof(*stmt_mysql));
+    int ret;
+
+    if (!stmt_mysql)
+        return NULL;
+
+    stmt_mysql->stmt = mysql_stmt_init(db_mysql->con);
+    if (!stmt_mysql->stmt)
+        goto out_free_stmt;
+
+    DB_MYSQL_CALL(db_mysql, ret, mysql_stmt_prepare, stmt_mysql->stmt, sql,
+                  (unsigned long)sql_len);
+    if (ret)
+        goto out_close_stmt;
+
+    stmt_mysql->base = (struct db_stmt){
+        .bind = db_stmt_bind_mysql,
+        .step = db_stmt_step_mysql,
+        .reset = db_stmt_reset_mysql,
+        .finalize = db_stmt_finalize_mysql,
+    };
+    stmt_mysql->db = db_mysql;
+    stmt_mysql->result_bind = NULL;
+    stmt_mysql->param_bind = NULL;
+    stmt_mysql->must_execute_again = true;
+
+    return (struct db_stmt *)stmt_mysql;
+
+out_close_stmt:
+    mysql_stmt_close(stmt_mysql->stmt);
+out_free_stmt:
+    free(stmt_mysql);
+
+    return NULL;
+}
+
+static void db_disconnect_mysql(struct db *db)
+{
+    struct db_mysql *db_mysql = (struct db_mysql *)db;
+
+    mysql_close(db_mysql->con);
+    free(db);
+}
+
+static struct db_mysql *db_mysql_new(void)
+{
+    struct db_mysql *db_mysql = malloc(sizeof(*db_mysql));
+
+    if (!db_mysql)
+        return NULL;
+
+    db_mysql->con = mysql_init(NULL);
+    if (!db_mysql->con) {
+        free(db_mysql);
+        return NULL;
+    }
+
+    db_init(&db_mysql->base, db_disconnect_mysql, db_prepare_mysql);
+    db_mysql->request = NULL;
+    db_mysql->busy = false;
+
+    return db_mysql;
+}
+
+struct db *db_connect_mysql(const char *host,
+                            const char *user,
+                            const char *pass,
+                            const char *database)
+{
+    struct db_mysql *db_mysql = db_mysql_new();
+
+    if (!db_mysql)
+        return NULL;
+
+    if (!mysql_real_connect(db_mysql->con, host, user, pass, database, 0, NULL,
+                            0))
+        goto error;
+
+    if (mysql_set_character_set(db_mysql->con, "utf8"))
+        goto error;
+
+    return (struct db *)db_mysql;
+
+error:
+    mysql_close(db_mysql->con);
+    free(db_mysql);
+    return NULL;
+}
+
+#if defined(MYSQL_WAIT_READ)
+static bool db_set_request_mysql(struct db *db, struct lwan_request *request)
+{
+    struct db_mysql *db_mysql = (struct db_mysql *)db;
+
+    /* If a request is aborted while waiting for a reply, it's not known
+     * where in the protocol the connection was left.  It's only good to
+     * be disconnected (with blocking calls) at this point. */
+    if (db_mysql->busy) {
+        db_mysql->request = NULL;
+        return false;
+    }
+
+    db_mysql->request = request;
+    return true;
+}
+
+struct db *db_connect_mysql_async(struct lwan_request *request,
+                                  const char *host,
+                                  const char *user,
+                                  const char *pass,
+                                  const char *database)
+{
+    struct db_mysql *db_mysql = db_mysql_new();
+    MYSQL *connected;
+    int ret;
+
+    if (!db_mysql)
+        return NULL;
+
+    if (mysql_options(db_mysql->con, MYSQL_OPT_NONBLOCK, 0))
+        goto error;
+
+    db_mysql->base.set_request = db_set_request_mysql;
+    db_mysql->request = request;
+
+    /* Host names are still resolved synchronously. */
+    DB_MYSQL_CALL(db_mysql, connected, mysql_real_connect, db_mysql->con, host,
+                  user, pass, database, 0, NULL, 0);
+    if (!connected)
+        goto error;
+
+    DB_MYSQL_CALL(db_mysql, ret, mysql_set_character_set, db_mysql->con,
+                  "utf8");
+    if (ret)
+        goto error;
+
+    return (struct db *)db_mysql;
+
+error:
+    mysql_close(db_mysql->con);
+    free(db_mysql);
+    return NULL;
+}
+#else
+struct db *db_connect_mysql_async(struct lwan_request *request
+                                  __attribute__((unused)),
+                                  const char *host __attribute__((unused)),
+                                  const char *user __attribute__((unused)),
+                                  const char *pass __attribute__((unused)),
+                                  const char *database __attribute__((unused)))
+{
+    return NULL;
+}
+#endif
+
+#else
+struct db *db_connect_mysql(const char *host __attribute__((unused)),
+                            const char *user __attribute__((unused)),
+                            const char *pass __attribute__((unused)),
+                            const char *database __attribute__((unused)))
+{
+    lwan_status_error("Lwan was built without MySQL support");
+    return NULL;
+}
+
+struct db *db_connect_mysql_async(struct lwan_request *request
+                                  __attribute__((unused)),
+                                  const char *host __attribute__((unused)),
+                                  const char *user __attribute__((unused)),
+                                  const char *pass __attribute__((unused)),
+                                  const char *database __attribute__((unused)))
+{
+    lwan_status_error("Lwan was built without MySQL support");
+    return NULL;
+}
+#endif
+
+/* SQLite */
+
+#if defined(HAVE_SQLITE)
+
+struct db_sqlite {
+    struct db base;
+    sqlite3 *sqlite;
+};
+
+struct db_stmt_sqlite {
+    struct db_stmt base;
+    sqlite3_stmt *sqlite;
+};
+
+static bool db_stmt_bind_sqlite(const struct db_stmt *stmt,
+                                struct db_row *rows,
+                                size_t n_rows)
+{
+    const struct db_stmt_sqlite *stmt_sqlite =
+        (const struct db_stmt_sqlite *)stmt;
+
+    sqlite3_reset(stmt_sqlite->sqlite);
+    sqlite3_clear_bindings(stmt_sqlite->sqlite);
+
+    for (size_t row = 1; row <= n_rows; row++) {
+        const struct db_row *r = &rows[row - 1];
+        int ret;
+
+        switch (r->kind) {
+        case 's':
+            ret = sqlite3_bind_text(stmt_sqlite->sqlite, (int)row, r->u.s, -1,
+                                    NULL);
+            break;
+        case 'i':
+            ret = sqlite3_bind_int(stmt_sqlite->sqlite, (int)row, r->u.i);
+            break;
+        default:
+            return false;
+        }
+
+        if (ret != SQLITE_OK)
+            return false;
+    }
+
+    return true;
+}
+
+static bool db_stmt_step_sqlite(const struct db_stmt *stmt,
+                                const char *signature,
+                                va_list ap)
+{
+    const struct db_stmt_sqlite *stmt_sqlite =
+        (const struct db_stmt_sqlite *)stmt;
+
+    if (sqlite3_step(stmt_sqlite->sqlite) != SQLITE_ROW)
+        return false;
+
+    for (int r = 0; signature[r]; r++) {
+        switch (signature[r]) {
+        case 'i':
+            *va_arg(ap, long *) = sqlite3_column_int(stmt_sqlite->sqlite, r);
+            break;
+        case 's': {
+            char *out = va_arg(ap, char *);
+            size_t bufsize = va_arg(ap, size_t);
+
+            strncpy(out,
+                    (const char *)sqlite3_column_text(stmt_sqlite->sqlite, r),
+                    bufsize);
+
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void db_stmt_reset_sqlite(struct db_stmt *stmt)
+{
+    struct db_stmt_sqlite *stmt_sqlite = (struct db_stmt_sqlite *)stmt;
+
+    sqlite3_reset(stmt_sqlite->sqlite);
+    sqlite3_clear_bindings(stmt_sqlite->sqlite);
+}
+
+static void db_stmt_finalize_sqlite(struct db_stmt *stmt)
+{
+    struct db_stmt_sqlite *stmt_sqlite = (struct db_stmt_sqlite *)stmt;
+
+    sqlite3_finalize(stmt_sqlite->sqlite);
+    free(stmt_sqlite);
+}
+
+static struct db_stmt *
+db_prepare_sqlite(const struct db *db, const char *sql, const size_t sql_len)
+{
+    const struct db_sqlite *db_sqlite = (const struct db_sqlite *)db;
+    struct db_stmt_sqlite *stmt_sqlite = malloc(sizeof(*stmt_sqlite));
+
+    if (!stmt_sqlite)
+        return NULL;
+
+    int ret = sqlite3_prepare_v2(db_sqlite->sqlite, sql, (int)sql_len,
+                                 &stmt_sqlite->sqlite, NULL);
+    if (ret != SQLITE_OK) {
+        free(stmt_sqlite);
+        return NULL;
+    }
+
+    stmt_sqlite->base = (struct db_stmt){
+        .bind = db_stmt_bind_sqlite,
+        .step = db_stmt_step_sqlite,
+        .reset = db_stmt_reset_sqlite,
+        .finalize = db_stmt_finalize_sqlite,
+    };
+
+    return (struct db_stmt *)stmt_sqlite;
+}
+
+static void db_disconnect_sqlite(struct db *db)
+{
+    struct db_sqlite *db_sqlite = (struct db_sqlite *)db;
+
+    sqlite3_close(db_sqlite->sqlite);
+    free(db);
+}
+
+struct db *
+db_connect_sqlite(const char *path, bool read_only, const char *pragmas[])
+{
+    struct db_sqlite *db_sqlite = malloc(sizeof(*db_sqlite));
+
+    if (!db_sqlite)
+        return NULL;
+
+    int flags = read_only ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE;
+    int ret = sqlite3_open_v2(path, &db_sqlite->sqlite, flags, NULL);
+    if (ret != SQLITE_OK) {
+        free(db_sqlite);
+        return NULL;
+    }
+
+    if (pragmas) {
+        for (size_t p = 0; pragmas[p]; p++)
+            sqlite3_exec(db_sqlite->sqlite, pragmas[p], NULL, NULL, NULL);
+    }
+
+    db_init(&db_sqlite->base, db_disconnect_sqlite, db_prepare_sqlite);
+
+    return (struct db *)db_sqlite;
+}
+#else
+struct db *db_connect_sqlite(const char *path __attribute__((unused)),
+                             bool read_only __attribute__((unused)),
+                             const char *pragmas[] __attribute__((unused)))
+{
+    lwan_status_error("Lwan was built without SQLite support");
+    return NULL;
+}
+#endif
+
+/* Generic */
+
+inline bool
+db_stmt_bind(const struct db_stmt *stmt, struct db_row *rows, size_t n_rows)
+{
+    return stmt->bind(stmt, rows, n_rows);
+}
+
+inline bool
+db_stmt_step(const struct db_stmt *stmt, const char *signature, ...)
+{
+    va_list ap;
+    bool ret;
+
+    va_start(ap, signature);
+    ret = stmt->step(stmt, signature, ap);
+    va_end(ap);
+
+    return ret;
+}
+
+static void uncache_stmt(struct db *db, struct db_stmt *stmt)
+{
+    hash_del(db->stmts, stmt->sql);
+    list_del(&stmt->lru);
+    free(stmt->sql);
+    stmt->sql = NULL;
+}
+
+void db_stmt_finalize(struct db_stmt *stmt)
+{
+    if (stmt->sql) {
+        stmt->reset(stmt);
+        stmt->in_use = false;
+        return;
+    }
+
+    stmt->finalize(stmt);
+}
+
+void db_disconnect(struct db *db)
+{
+    if (db->stmts) {
+        struct db_stmt *stmt, *next;
+
+        list_for_each_safe (&db->lru, stmt, next, lru) {
+            uncache_stmt(db, stmt);
+            stmt->finalize(stmt);
+        }
+        hash_free(db->stmts);
+    }
+
+    db->disconnect(db);
+}
+
+bool db_set_request(struct db *db, struct lwan_request *request)
+{
+    return db->set_request ? db->set_request(db, request) : true;
+}
+
+bool db_set_stmt_cache_size(struct db *db, unsigned int max_stmts)
+{
+    if (!db->stmts) {
+        db->stmts = hash_str_new(NULL, NULL);
+        if (!db->stmts)
+            return false;
+    }
+
+    db->max_stmts = max_stmts;
+    return true;
+}
+
+static void cache_stmt(struct db *db,
+                       struct db_stmt *stmt,
+                       const char *sql,
+                       size_t sql_len)
+{
+    if (hash_get_count(db->stmts) >= db->max_stmts) {
+        struct db_stmt *victim;
+
+        /* Statements being used can't be evicted; if all of them are, this
+         * one won't be cached. */
+        list_for_each_rev (&db->lru, victim, lru) {
+            if (!victim->in_use)
+                break;
+        }
+        if (&victim->lru == &db->lru.n)
+            return;
+
+        uncache_stmt(db, victim);
+        victim->finalize(victim);
+    }
+
+    stmt->sql = strndup(sql, sql_len);
+    if (!stmt->sql)
+        return;
+
+    if (hash_add_unique(db->stmts, stmt->sql, stmt) < 0) {
+        free(stmt->sql);
+        stmt->sql = NULL;
+        return;
+    }
+
+    list_add(&db->lru, &stmt->lru);
+}
+
+struct db_stmt *
+db_prepare_stmt(struct db *db, const char *sql, const size_t sql_len)
+{
+    struct db_stmt *stmt;
+
+    if (db->stmts) {
+        stmt = hash_find(db->stmts, sql);
+
+        if (stmt && !stmt->in_use) {
+            list_del(&stmt->lru);
+            list_add(&db->lru, &stmt->lru);
+            stmt->in_use = true;
+            return stmt;
+        }
+    }
+
+    stmt = db->prepare(db, sql, sql_len);
+    if (!stmt)
+        return NULL;
+
+    stmt->in_use = true;
+    if (db->stmts && db->max_stmts && !hash_find(db->stmts, sql))
+        cache_stmt(db, stmt, sql, sql_len);
+
+    return stmt;
+}
+
+/* Pools */
+
+struct db_pool_thread {
+    unsigned int max_idle;
+    unsigned int n_idle;
+    struct db *idle[];
+};
+
+struct db_pool {
+    struct db *(*connect)(struct lwan_request *request, void *data);
+    void *data;
+    unsigned int max_idle;
+    unsigned int max_stmts;
+
+    /* Allocated by each thread the first time it handles a request; only
+     * ever touched by that thread afterwards. */
+    struct db_pool_thread *threads[MAX_THREADS];
+};
+
+struct db_pool *
+db_pool_new(struct db *(*connect)(struct lwan_request *request, void *data),
+            void *data,
+            unsigned int max_idle,
+            unsigned int max_stmts)
+{
+    struct db_pool *pool = calloc(1, sizeof(*pool));
+
+    if (!pool)
+        return NULL;
+
+    pool->connect = connect;
+    pool->data = data;
+    pool->max_idle = max_idle;
+    pool->max_stmts = max_stmts;
+
+    return pool;
+}
+
+void db_pool_free(struct db_pool *pool)
+{
+    if (!pool)
+        return;
+
+    for (size_t i = 0; i < N_ELEMENTS(pool->threads); i++) {
+        struct db_pool_thread *thread = pool->threads[i];
+
+        if (!thread)
+            continue;
+
+        for (unsigned int c = 0; c < thread->n_idle; c++)
+            db_disconnect(thread->idle[c]);
+        free(thread);
+    }
+
+    free(pool);
+}
+
+static struct db_pool_thread *get_thread(struct db_pool *pool,
+                                         struct lwan_request *request)
+{
+    struct lwan_thread *t = request->conn->thread;
+    const size_t index = (size_t)(t - t->lwan->thread.threads);
+    struct db_pool_thread *thread;
+
+    if (UNLIKELY(index >= N_ELEMENTS(pool->threads)))
+        return NULL;
+
+    thread = pool->threads[index];
+    if (LIKELY(thread))
+        return thread;
+
+    thread = calloc(1, sizeof(*thread) + pool->max_idle * sizeof(struct db *));
+    if (UNLIKELY(!thread))
+        return NULL;
+
+    thread->max_idle = pool->max_idle;
+
+    pool->threads[index] = thread;
+    return thread;
+}
+
+static void put_db(void *data1, void *data2)
+{
+    struct db_pool_thread *thread = data1;
+    struct db *db = data2;
+
+    if (!db_set_request(db, NULL) || thread->n_idle == thread->max_idle) {
+        db_disconnect(db);
+        return;
+    }
+
+    thread->idle[thread->n_idle++] = db;
+}
+
+struct db *db_pool_get(struct db_pool *pool, struct lwan_request *request)
+{
+    struct db_pool_thread *thread = get_thread(pool, request);
+    struct db *db;
+
+    if (UNLIKELY(!thread))
+        return NULL;
+
+    if (thread->n_idle) {
+        db = thread->idle[--thread->n_idle];
+        db_set_request(db, request);
+    } else {
+        db = pool->connect(request, pool->data);
+        if (UNLIKELY(!db))
+            return NULL;
+
+        if (pool->max_stmts)
+            db_set_stmt_cache_size(db, pool->max_stmts);
+    }
+
+    /* Registered before anything is awaited, so this runs after the
+     * async/await flags for the connection have been reset. */
+    coro_defer2(request->conn->coro, put_db, thread, db);
+
+    return db;
+}
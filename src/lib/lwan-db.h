@@ -0,0 +1,96 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2014 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A thin layer over SQLite and MySQL, for whichever of them was found when
+ * Lwan was built; connecting with the other one fails. */
+
+struct lwan_request;
+struct db;
+struct db_stmt;
+
+struct db_row {
+    union {
+        char *s;
+        int i;
+    } u;
+    char kind; /* 's' = string, 'i' = 'int', '\0' = last */
+    size_t buffer_length;
+};
+
+bool db_stmt_bind(const struct db_stmt *stmt,
+                  struct db_row *rows,
+                  size_t n_rows);
+
+bool db_stmt_step(const struct db_stmt *stmt, const char *signature, ...);
+
+void db_stmt_finalize(struct db_stmt *stmt);
+void db_disconnect(struct db *db);
+bool db_set_request(struct db *db, struct lwan_request *request);
+struct db_stmt *
+db_prepare_stmt(struct db *db, const char *sql, const size_t sql_len);
+
+/* Keeps up to @max_stmts prepared statements around: db_prepare_stmt()
+ * then returns one prepared earlier with the same SQL (which must be
+ * NUL-terminated), if it's not being used, and db_stmt_finalize() resets
+ * it instead of throwing it away.  The least recently used statement is
+ * finalized when there's no room for another. */
+bool db_set_stmt_cache_size(struct db *db, unsigned int max_stmts);
+
+struct db *
+db_connect_sqlite(const char *path, bool read_only, const char *pragmas[]);
+struct db *db_connect_mysql(const char *host,
+                            const char *user,
+                            const char *pass,
+                            const char *database);
+
+/* Connections created by db_connect_mysql_async() don't block the thread
+ * while waiting for the database: the coroutine of the request set with
+ * db_set_request() is suspended instead, so a connection can be used by
+ * only one request at a time.  db_set_request() returns false if the
+ * connection can't be used anymore (e.g. a request was aborted while
+ * waiting for a reply), in which case it must be disconnected.  Requires
+ * MariaDB Connector/C; NULL is returned if it's not available. */
+struct db *db_connect_mysql_async(struct lwan_request *request,
+                                  const char *host,
+                                  const char *user,
+                                  const char *pass,
+                                  const char *database);
+
+/* Each I/O thread keeps its own connections, so no locks are taken.  A
+ * request gets a connection for itself (an idle one, or a new one from
+ * @connect), which is put back in the pool of its thread once the request
+ * is done; up to @max_idle connections are kept per thread, each with a
+ * cache of up to @max_stmts prepared statements.  @connect is called with
+ * the request that will use the connection. */
+struct db_pool;
+
+struct db_pool *
+db_pool_new(struct db *(*connect)(struct lwan_request *request, void *data),
+            void *data,
+            unsigned int max_idle,
+            unsigned int max_stmts);
+void db_pool_free(struct db_pool *pool);
+
+struct db *db_pool_get(struct db_pool *pool, struct lwan_request *request);
@@ -0,0 +1,261 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "lwan-private.h"
+
+/* Escaping strings is mostly a matter of copying long runs of characters
+ * that don't need to be escaped; these routines find how long those runs
+ * are, a vector at a time.  HTML needs < > & " ' / to be escaped, and JSON
+ * needs " \ and control characters to be escaped.  The JSON parser uses
+ * the same machinery to find where strings end, and to skip whitespace.
+ *
+ * Like websocket unmasking, the widest routine the CPU supports is picked
+ * once at startup. */
+#if defined(__x86_64__) && defined(HAVE_BUILTIN_CPU_INIT) &&                   \
+    defined(HAVE_TARGET_AVX2)
+#define HAVE_ESCAPE_AVX2
+#endif
+
+enum { ESCAPE_HTML = 1 << 0, ESCAPE_JSON = 1 << 1 };
+
+static const uint8_t escape_table[256] = {
+    [0x00 ... 0x1f] = ESCAPE_JSON,
+    ['"'] = ESCAPE_HTML | ESCAPE_JSON,
+    ['\\'] = ESCAPE_JSON,
+    ['<'] = ESCAPE_HTML,
+    ['>'] = ESCAPE_HTML,
+    ['&'] = ESCAPE_HTML,
+    ['\''] = ESCAPE_HTML,
+    ['/'] = ESCAPE_HTML,
+};
+
+static ALWAYS_INLINE size_t
+span_scalar(const char *str, size_t len, uint8_t set)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (escape_table[(uint8_t)str[i]] & set)
+            break;
+    }
+
+    return i;
+}
+
+static size_t html_span_scalar(const char *str, size_t len)
+{
+    return span_scalar(str, len, ESCAPE_HTML);
+}
+
+static size_t json_span_scalar(const char *str, size_t len)
+{
+    return span_scalar(str, len, ESCAPE_JSON);
+}
+
+/* JSON only allows these four characters as whitespace; unlike the other
+ * routines, this one finds how long a run of them is. */
+static size_t ws_span_scalar(const char *str, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        switch (str[i]) {
+        case ' ':
+        case '\t':
+        case '\n':
+        case '\r':
+            continue;
+        }
+        break;
+    }
+
+    return i;
+}
+
+#if defined(__x86_64__)
+static ALWAYS_INLINE __m128i html_mask_sse2(__m128i v)
+{
+    __m128i m;
+
+    m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('<')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+    return _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+}
+
+static ALWAYS_INLINE __m128i json_mask_sse2(__m128i v)
+{
+    /* Unsigned v <= 0x1f iff min(v, 0x1f) == v. */
+    __m128i m = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v);
+
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    return _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+}
+
+static ALWAYS_INLINE __m128i ws_mask_sse2(__m128i v)
+{
+    __m128i m;
+
+    m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    return _mm_xor_si128(m, _mm_set1_epi8(-1));
+}
+
+#define DEFINE_SPAN_SSE2(set_)                                                 \
+    static size_t set_##_span_sse2(const char *str, size_t len)                \
+    {                                                                          \
+        size_t i = 0;                                                          \
+                                                                               \
+        for (; i + 16 <= len; i += 16) {                                       \
+            __m128i v = _mm_loadu_si128((const __m128i *)(str + i));           \
+            int bits = _mm_movemask_epi8(set_##_mask_sse2(v));                 \
+                                                                               \
+            if (bits)                                                          \
+                return i + (size_t)__builtin_ctz((unsigned int)bits);          \
+        }                                                                      \
+                                                                               \
+        return i + set_##_span_scalar(str + i, len - i);                       \
+    }
+
+DEFINE_SPAN_SSE2(html)
+DEFINE_SPAN_SSE2(json)
+DEFINE_SPAN_SSE2(ws)
+
+#undef DEFINE_SPAN_SSE2
+#endif
+
+#if defined(HAVE_ESCAPE_AVX2)
+__attribute__((target("avx2"))) static ALWAYS_INLINE __m256i
+html_mask_avx2(__m256i v)
+{
+    __m256i m;
+
+    m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')));
+    return _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')));
+}
+
+__attribute__((target("avx2"))) static ALWAYS_INLINE __m256i
+json_mask_avx2(__m256i v)
+{
+    __m256i m = _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1f)), v);
+
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+    return _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+}
+
+__attribute__((target("avx2"))) static ALWAYS_INLINE __m256i
+ws_mask_avx2(__m256i v)
+{
+    __m256i m;
+
+    m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+    return _mm256_xor_si256(m, _mm256_set1_epi8(-1));
+}
+
+#define DEFINE_SPAN_AVX2(set_)                                                 \
+    __attribute__((target("avx2"))) static size_t set_##_span_avx2(           \
+        const char *str, size_t len)                                           \
+    {                                                                          \
+        size_t i = 0;                                                          \
+                                                                               \
+        for (; i + 32 <= len; i += 32) {                                       \
+            __m256i v = _mm256_loadu_si256((const __m256i *)(str + i));        \
+            unsigned int bits =                                                \
+                (unsigned int)_mm256_movemask_epi8(set_##_mask_avx2(v));       \
+                                                                               \
+            if (bits)                                                          \
+                return i + (size_t)__builtin_ctz(bits);                        \
+        }                                                                      \
+                                                                               \
+        return i + set_##_span_sse2(str + i, len - i);                         \
+    }
+
+DEFINE_SPAN_AVX2(html)
+DEFINE_SPAN_AVX2(json)
+DEFINE_SPAN_AVX2(ws)
+
+#undef DEFINE_SPAN_AVX2
+#endif
+
+size_t lwan_get_escape_kernels(struct lwan_escape_kernel kernels[static 3])
+{
+    size_t n = 0;
+
+#if defined(HAVE_ESCAPE_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[n++] = (struct lwan_escape_kernel){
+            "avx2", html_span_avx2, json_span_avx2, ws_span_avx2};
+    }
+#endif
+#if defined(__x86_64__)
+    kernels[n++] = (struct lwan_escape_kernel){"sse2", html_span_sse2,
+                                               json_span_sse2, ws_span_sse2};
+#endif
+    kernels[n++] = (struct lwan_escape_kernel){"scalar", html_span_scalar,
+                                               json_span_scalar, ws_span_scalar};
+
+    return n;
+}
+
+static struct lwan_escape_kernel kernel = {"scalar", html_span_scalar,
+                                           json_span_scalar, ws_span_scalar};
+
+__attribute__((constructor)) static void initialize_escape(void)
+{
+    struct lwan_escape_kernel kernels[3];
+
+    lwan_get_escape_kernels(kernels);
+    kernel = kernels[0];
+}
+
+size_t lwan_html_escape_span(const char *str, size_t len)
+{
+    return kernel.html_span(str, len);
+}
+
+size_t lwan_json_escape_span(const char *str, size_t len)
+{
+    return kernel.json_span(str, len);
+}
+
+size_t lwan_json_whitespace_span(const char *str, size_t len)
+{
+    return kernel.ws_span(str, len);
+}
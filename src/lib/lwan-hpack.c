@@ -0,0 +1,529 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+
+#include "lwan-private.h"
+#include "lwan-hpack.h"
+
+/* RFC 7541 Appendix A */
+static const struct {
+    const char *name, *value;
+    uint8_t name_len, value_len;
+} static_table[] = {
+#define ENTRY(name_, value_)                                                   \
+    {name_, value_, sizeof(name_) - 1, sizeof(value_) - 1}
+    [1] = ENTRY(":authority", ""),
+    [2] = ENTRY(":method", "GET"),
+    [3] = ENTRY(":method", "POST"),
+    [4] = ENTRY(":path", "/"),
+    [5] = ENTRY(":path", "/index.html"),
+    [6] = ENTRY(":scheme", "http"),
+    [7] = ENTRY(":scheme", "https"),
+    [8] = ENTRY(":status", "200"),
+    [9] = ENTRY(":status", "204"),
+    [10] = ENTRY(":status", "206"),
+    [11] = ENTRY(":status", "304"),
+    [12] = ENTRY(":status", "400"),
+    [13] = ENTRY(":status", "404"),
+    [14] = ENTRY(":status", "500"),
+    [15] = ENTRY("accept-charset", ""),
+    [16] = ENTRY("accept-encoding", "gzip, deflate"),
+    [17] = ENTRY("accept-language", ""),
+    [18] = ENTRY("accept-ranges", ""),
+    [19] = ENTRY("accept", ""),
+    [20] = ENTRY("access-control-allow-origin", ""),
+    [21] = ENTRY("age", ""),
+    [22] = ENTRY("allow", ""),
+    [23] = ENTRY("authorization", ""),
+    [24] = ENTRY("cache-control", ""),
+    [25] = ENTRY("content-disposition", ""),
+    [26] = ENTRY("content-encoding", ""),
+    [27] = ENTRY("content-language", ""),
+    [28] = ENTRY("content-length", ""),
+    [29] = ENTRY("content-location", ""),
+    [30] = ENTRY("content-range", ""),
+    [31] = ENTRY("content-type", ""),
+    [32] = ENTRY("cookie", ""),
+    [33] = ENTRY("date", ""),
+    [34] = ENTRY("etag", ""),
+    [35] = ENTRY("expect", ""),
+    [36] = ENTRY("expires", ""),
+    [37] = ENTRY("from", ""),
+    [38] = ENTRY("host", ""),
+    [39] = ENTRY("if-match", ""),
+    [40] = ENTRY("if-modified-since", ""),
+    [41] = ENTRY("if-none-match", ""),
+    [42] = ENTRY("if-range", ""),
+    [43] = ENTRY("if-unmodified-since", ""),
+    [44] = ENTRY("last-modified", ""),
+    [45] = ENTRY("link", ""),
+    [46] = ENTRY("location", ""),
+    [47] = ENTRY("max-forwards", ""),
+    [48] = ENTRY("proxy-authenticate", ""),
+    [49] = ENTRY("proxy-authorization", ""),
+    [50] = ENTRY("range", ""),
+    [51] = ENTRY("referer", ""),
+    [52] = ENTRY("refresh", ""),
+    [53] = ENTRY("retry-after", ""),
+    [54] = ENTRY("server", ""),
+    [55] = ENTRY("set-cookie", ""),
+    [56] = ENTRY("strict-transport-security", ""),
+    [57] = ENTRY("transfer-encoding", ""),
+    [58] = ENTRY("user-agent", ""),
+    [59] = ENTRY("vary", ""),
+    [60] = ENTRY("via", ""),
+    [61] = ENTRY("www-authenticate", ""),
+#undef ENTRY
+};
+
+#define STATIC_TABLE_LEN ((uint32_t)N_ELEMENTS(static_table) - 1)
+/* Entries before this one are pseudo-header fields. */
+#define STATIC_TABLE_FIRST_HEADER 15
+
+/* The Huffman code from RFC 7541 Appendix B is canonical: codes of the same
+ * length are consecutive integers, ordered by symbol, so the number of codes
+ * of each length and the symbols sorted by (length, symbol) are enough to
+ * decode it, one bit at a time.  Symbol 256 is EOS. */
+static const uint8_t huffman_count[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+static const uint16_t huffman_symbol[257] = {
+    48,  49,  50,  97,  99,  101, 105, 111, 115, 116, 32,  37,  45,  46,  47,
+    51,  52,  53,  54,  55,  56,  57,  61,  65,  95,  98,  100, 102, 103, 104,
+    108, 109, 110, 112, 114, 117, 58,  66,  67,  68,  69,  70,  71,  72,  73,
+    74,  75,  76,  77,  78,  79,  80,  81,  82,  83,  84,  85,  86,  87,  89,
+    106, 107, 113, 118, 119, 120, 121, 122, 38,  42,  44,  59,  88,  90,  33,
+    34,  40,  41,  63,  39,  43,  124, 35,  62,  0,   36,  64,  91,  93,  126,
+    94,  125, 60,  96,  123, 92,  195, 208, 128, 130, 131, 162, 184, 194, 224,
+    226, 153, 161, 167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170, 173, 178, 181,
+    185, 186, 187, 189, 190, 196, 198, 228, 232, 233, 1,   135, 137, 138, 139,
+    140, 141, 143, 147, 149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174,
+    175, 180, 182, 183, 188, 191, 197, 231, 239, 9,   142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202,
+    205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214,
+    221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254, 2,
+    3,   4,   5,   6,   7,   8,   11,  12,  14,  15,  16,  17,  18,  19,  20,
+    21,  23,  24,  25,  26,  27,  28,  29,  30,  31,  127, 220, 249, 10,  13,
+    22,  256,
+};
+
+#define HUFFMAN_EOS 256
+
+static ssize_t huffman_decode(const unsigned char *in, size_t len, char *out)
+{
+    const char *out_start = out;
+    uint32_t code = 0, first = 0;
+    unsigned int code_len = 0, index = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            code |= (uint32_t)(in[i] >> bit) & 1;
+            code_len++;
+
+            if (UNLIKELY(code_len >= N_ELEMENTS(huffman_count)))
+                return -1;
+
+            const uint32_t count = huffman_count[code_len];
+
+            if (code < first + count) {
+                const uint16_t symbol = huffman_symbol[index + code - first];
+
+                /* A string containing EOS is a decoding error (§5.2) */
+                if (UNLIKELY(symbol == HUFFMAN_EOS))
+                    return -1;
+
+                *out++ = (char)symbol;
+                code = first = 0;
+                code_len = index = 0;
+                continue;
+            }
+
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+    }
+
+    /* Padding must be shorter than 8 bits, and correspond to the most
+     * significant bits of EOS (i.e. all ones).  As the loop above shifts
+     * code in anticipation of the next bit, undo it before checking. */
+    if (UNLIKELY(code_len > 7 || (code >> 1) != (1u << code_len) - 1))
+        return -1;
+
+    return out - out_start;
+}
+
+static bool decode_int(const unsigned char **p,
+                       const unsigned char *end,
+                       unsigned int prefix_bits,
+                       uint32_t *value)
+{
+    const uint32_t max_prefix = (1u << prefix_bits) - 1;
+    uint32_t v = **p & max_prefix;
+
+    (*p)++;
+
+    if (v < max_prefix) {
+        *value = v;
+        return true;
+    }
+
+    /* Anything larger than 2^28 is way beyond any limit used here. */
+    for (unsigned int shift = 0; *p < end && shift <= 21; shift += 7) {
+        const unsigned char b = *(*p)++;
+
+        v += (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *value = v;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool decode_string(const unsigned char **p,
+                          const unsigned char *end,
+                          char **scratch,
+                          const char **str,
+                          size_t *str_len)
+{
+    uint32_t len;
+    bool huffman;
+
+    if (UNLIKELY(*p >= end))
+        return false;
+
+    huffman = **p & 0x80;
+    if (UNLIKELY(!decode_int(p, end, 7, &len)))
+        return false;
+    if (UNLIKELY(len > (size_t)(end - *p)))
+        return false;
+
+    if (huffman) {
+        ssize_t decoded_len = huffman_decode(*p, len, *scratch);
+
+        if (UNLIKELY(decoded_len < 0))
+            return false;
+
+        *str = *scratch;
+        *str_len = (size_t)decoded_len;
+        *scratch += decoded_len;
+    } else {
+        *str = (const char *)*p;
+        *str_len = len;
+    }
+
+    *p += len;
+    return true;
+}
+
+static bool lookup(const struct lwan_hpack_decoder *dec,
+                   uint32_t index,
+                   const char **name,
+                   size_t *name_len,
+                   const char **value,
+                   size_t *value_len)
+{
+    if (LIKELY(index && index <= STATIC_TABLE_LEN)) {
+        *name = static_table[index].name;
+        *name_len = static_table[index].name_len;
+        *value = static_table[index].value;
+        *value_len = static_table[index].value_len;
+        return true;
+    }
+
+    index -= STATIC_TABLE_LEN + 1;
+    if (UNLIKELY(index >= dec->count))
+        return false;
+
+    const struct lwan_hpack_entry *entry =
+        &dec->entries[(dec->first + index) % LWAN_HPACK_MAX_ENTRIES];
+    *name = entry->name;
+    *name_len = entry->name_len;
+    *value = entry->name + entry->name_len;
+    *value_len = entry->value_len;
+    return true;
+}
+
+static ALWAYS_INLINE size_t entry_size(size_t name_len, size_t value_len)
+{
+    /* §4.1 */
+    return name_len + value_len + 32;
+}
+
+static void evict_oldest(struct lwan_hpack_decoder *dec)
+{
+    struct lwan_hpack_entry *entry =
+        &dec->entries[(dec->first + dec->count - 1) % LWAN_HPACK_MAX_ENTRIES];
+
+    dec->size -= entry_size(entry->name_len, entry->value_len);
+    dec->count--;
+    free(entry->name);
+}
+
+static void evict_to_size(struct lwan_hpack_decoder *dec, size_t size)
+{
+    while (dec->count && dec->size > size)
+        evict_oldest(dec);
+}
+
+static bool insert(struct lwan_hpack_decoder *dec,
+                   const char *name,
+                   size_t name_len,
+                   const char *value,
+                   size_t value_len)
+{
+    const size_t size = entry_size(name_len, value_len);
+
+    if (size > dec->max_size) {
+        /* Not an error: this empties the table (§4.4). */
+        evict_to_size(dec, 0);
+        return true;
+    }
+
+    /* The name might be in an entry that's about to be evicted, so copy
+     * it before making room for the new entry. */
+    char *copy = malloc(name_len + value_len + 1);
+    if (UNLIKELY(!copy))
+        return false;
+    memcpy(copy, name, name_len);
+    memcpy(copy + name_len, value, value_len);
+
+    evict_to_size(dec, dec->max_size - size);
+
+    dec->first = (dec->first + LWAN_HPACK_MAX_ENTRIES - 1) % LWAN_HPACK_MAX_ENTRIES;
+    dec->entries[dec->first] = (struct lwan_hpack_entry){
+        .name = copy,
+        .name_len = (uint32_t)name_len,
+        .value_len = (uint32_t)value_len,
+    };
+    dec->count++;
+    dec->size += size;
+
+    return true;
+}
+
+void lwan_hpack_decoder_init(struct lwan_hpack_decoder *dec)
+{
+    dec->first = dec->count = 0;
+    dec->size = 0;
+    dec->max_size = LWAN_HPACK_TABLE_SIZE;
+    dec->scratch = NULL;
+    dec->scratch_size = 0;
+}
+
+void lwan_hpack_decoder_free(struct lwan_hpack_decoder *dec)
+{
+    evict_to_size(dec, 0);
+    free(dec->scratch);
+}
+
+bool lwan_hpack_decode(struct lwan_hpack_decoder *dec,
+                       const unsigned char *block,
+                       size_t len,
+                       void (*emit)(void *data,
+                                    const char *name,
+                                    size_t name_len,
+                                    const char *value,
+                                    size_t value_len),
+                       void *data)
+{
+    const unsigned char *p = block;
+    const unsigned char *end = block + len;
+
+    /* Huffman codes are at least 5 bits long, so a string can grow at most
+     * 8/5 times when decoded: twice the size of the block is enough room
+     * for the strings in any field. */
+    if (dec->scratch_size < len * 2) {
+        char *scratch = realloc(dec->scratch, len * 2);
+
+        if (UNLIKELY(!scratch))
+            return false;
+
+        dec->scratch = scratch;
+        dec->scratch_size = len * 2;
+    }
+
+    while (p < end) {
+        const unsigned char type = *p;
+        char *scratch = dec->scratch;
+        const char *name, *value;
+        size_t name_len, value_len;
+        uint32_t index;
+
+        if (type & 0x80) {
+            /* Indexed Header Field (§6.1) */
+            if (UNLIKELY(!decode_int(&p, end, 7, &index)))
+                return false;
+            if (UNLIKELY(!lookup(dec, index, &name, &name_len, &value,
+                                 &value_len)))
+                return false;
+
+            emit(data, name, name_len, value, value_len);
+            continue;
+        }
+
+        if ((type & 0xe0) == 0x20) {
+            /* Dynamic Table Size Update (§6.3) */
+            if (UNLIKELY(!decode_int(&p, end, 5, &index)))
+                return false;
+            if (UNLIKELY(index > LWAN_HPACK_TABLE_SIZE))
+                return false;
+
+            dec->max_size = index;
+            evict_to_size(dec, index);
+            continue;
+        }
+
+        /* Literal Header Field with Incremental Indexing (§6.2.1), without
+         * Indexing (§6.2.2), or Never Indexed (§6.2.3).  Lwan doesn't have
+         * anything to forward headers to, so the last two are the same. */
+        const bool add_to_table = (type & 0xc0) == 0x40;
+
+        if (UNLIKELY(!decode_int(&p, end, add_to_table ? 6 : 4, &index)))
+            return false;
+
+        if (index) {
+            if (UNLIKELY(!lookup(dec, index, &name, &name_len, &value,
+                                 &value_len)))
+                return false;
+        } else if (UNLIKELY(
+                       !decode_string(&p, end, &scratch, &name, &name_len))) {
+            return false;
+        }
+
+        if (UNLIKELY(!decode_string(&p, end, &scratch, &value, &value_len)))
+            return false;
+
+        emit(data, name, name_len, value, value_len);
+
+        if (add_to_table &&
+            UNLIKELY(!insert(dec, name, name_len, value, value_len)))
+            return false;
+    }
+
+    return true;
+}
+
+static bool encode_int(struct lwan_strbuf *out,
+                       unsigned char flags,
+                       unsigned int prefix_bits,
+                       size_t value)
+{
+    const size_t max_prefix = (1u << prefix_bits) - 1;
+    char buffer[16];
+    size_t len = 0;
+
+    if (value < max_prefix) {
+        buffer[len++] = (char)(flags | value);
+    } else {
+        buffer[len++] = (char)(flags | max_prefix);
+
+        for (value -= max_prefix; value >= 0x80; value >>= 7)
+            buffer[len++] = (char)(0x80 | (value & 0x7f));
+        buffer[len++] = (char)value;
+    }
+
+    return lwan_strbuf_append_str(out, buffer, len);
+}
+
+static bool encode_string(struct lwan_strbuf *out,
+                          const char *str,
+                          size_t len,
+                          bool lowercase)
+{
+    char *p;
+
+    if (UNLIKELY(!encode_int(out, 0x00, 7, len)))
+        return false;
+
+    if (!lowercase)
+        return lwan_strbuf_append_str(out, str, len);
+
+    p = lwan_strbuf_extend_unsafe(out, len);
+    if (UNLIKELY(!p))
+        return false;
+
+    for (size_t i = 0; i < len; i++)
+        p[i] = (str[i] >= 'A' && str[i] <= 'Z') ? (char)(str[i] | 0x20) : str[i];
+
+    return true;
+}
+
+bool lwan_hpack_encode_status(struct lwan_strbuf *out, unsigned int status)
+{
+    char value[3];
+
+    switch (status) {
+    case 200:
+        return lwan_strbuf_append_char(out, (char)(0x80 | 8));
+    case 204:
+        return lwan_strbuf_append_char(out, (char)(0x80 | 9));
+    case 206:
+        return lwan_strbuf_append_char(out, (char)(0x80 | 10));
+    case 304:
+        return lwan_strbuf_append_char(out, (char)(0x80 | 11));
+    case 400:
+        return lwan_strbuf_append_char(out, (char)(0x80 | 12));
+    case 404:
+        return lwan_strbuf_append_char(out, (char)(0x80 | 13));
+    case 500:
+        return lwan_strbuf_append_char(out, (char)(0x80 | 14));
+    }
+
+    if (UNLIKELY(status < 100 || status > 999))
+        return false;
+
+    value[0] = (char)('0' + status / 100);
+    value[1] = (char)('0' + status / 10 % 10);
+    value[2] = (char)('0' + status % 10);
+
+    /* Literal without indexing, with the name of static entry 8 */
+    return encode_int(out, 0x00, 4, 8) &&
+           encode_string(out, value, sizeof(value), false);
+}
+
+bool lwan_hpack_encode_header(struct lwan_strbuf *out,
+                              const char *name,
+                              size_t name_len,
+                              const char *value,
+                              size_t value_len)
+{
+    for (size_t i = STATIC_TABLE_FIRST_HEADER; i <= STATIC_TABLE_LEN; i++) {
+        if (static_table[i].name_len == name_len &&
+            !strncasecmp(static_table[i].name, name, name_len)) {
+            return encode_int(out, 0x00, 4, i) &&
+                   encode_string(out, value, value_len, false);
+        }
+    }
+
+    return lwan_strbuf_append_char(out, 0x00) &&
+           encode_string(out, name, name_len, true) &&
+           encode_string(out, value, value_len, false);
+}
@@ -0,0 +1,75 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lwan-strbuf.h"
+
+/* Default value for SETTINGS_HEADER_TABLE_SIZE (RFC 7541 §4.2).  Lwan never
+ * advertises anything else, so this is also the most entries (each one takes
+ * at least 32 bytes) the dynamic table can hold. */
+#define LWAN_HPACK_TABLE_SIZE 4096
+#define LWAN_HPACK_MAX_ENTRIES (LWAN_HPACK_TABLE_SIZE / 32)
+
+struct lwan_hpack_entry {
+    char *name; /* Value follows the name in the same allocation */
+    uint32_t name_len, value_len;
+};
+
+struct lwan_hpack_decoder {
+    struct lwan_hpack_entry entries[LWAN_HPACK_MAX_ENTRIES];
+    unsigned int first, count; /* entries[first] is the newest entry */
+    size_t size, max_size;
+
+    /* Huffman-encoded strings are decoded here. */
+    char *scratch;
+    size_t scratch_size;
+};
+
+void lwan_hpack_decoder_init(struct lwan_hpack_decoder *dec);
+void lwan_hpack_decoder_free(struct lwan_hpack_decoder *dec);
+
+/* Calls emit() for every header field in a header block.  Names and values
+ * aren't NUL-terminated, and are only valid during the callback.  Returns
+ * false if the header block couldn't be decoded, which makes the decoder
+ * state unusable (a COMPRESSION_ERROR for the whole connection). */
+bool lwan_hpack_decode(struct lwan_hpack_decoder *dec,
+                       const unsigned char *block,
+                       size_t len,
+                       void (*emit)(void *data,
+                                    const char *name,
+                                    size_t name_len,
+                                    const char *value,
+                                    size_t value_len),
+                       void *data);
+
+/* The encoder never adds anything to the peer's dynamic table, so it doesn't
+ * carry any state: every field is either in the static table or sent as a
+ * literal without indexing.  Names are lowercased. */
+bool lwan_hpack_encode_status(struct lwan_strbuf *out, unsigned int status);
+bool lwan_hpack_encode_header(struct lwan_strbuf *out,
+                              const char *name,
+                              size_t name_len,
+                              const char *value,
+                              size_t value_len);
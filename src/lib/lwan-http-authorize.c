@@ -18,16 +18,46 @@
  * USA.
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(HAVE_LIBXCRYPT)
+#include <crypt.h>
+#endif
+
+#include "lwan-private.h"
 
 #include "base64.h"
 #include "lwan-cache.h"
 #include "lwan-config.h"
 #include "lwan-http-authorize.h"
 
+/* Same as the time realm files are kept in the cache: credentials removed
+ * from a password file might be accepted for at most this long. */
+#define REALM_FILE_CACHE_PERIOD 60
+
+/* Verifying a hashed password is deliberately expensive, so each thread
+ * remembers the Authorization headers it has recently accepted.  Headers
+ * that were rejected aren't remembered (use a rate_limit section to make
+ * guessing passwords expensive).  This is a direct-mapped cache: a header
+ * evicts whatever was in its slot. */
+#define VERIFIED_CACHE_SLOTS 64
+#define VERIFIED_CACHE_HEADER_MAX 200
+
+struct verified_credential {
+    const char *password_file;
+    time_t expires;
+    size_t header_len;
+    char header[VERIFIED_CACHE_HEADER_MAX];
+};
+
+static __thread struct verified_credential
+    verified_credentials[VERIFIED_CACHE_SLOTS];
+
 struct realm_password_file_t {
     struct cache_entry base;
     struct hash *entries;
@@ -46,6 +76,16 @@ static void fourty_two_and_free(void *str)
     }
 }
 
+static bool is_supported_hash(const char *hash)
+{
+#if defined(HAVE_LIBXCRYPT)
+    return crypt_checksalt(hash) == CRYPT_SALT_OK;
+#else
+    (void)hash;
+    return false;
+#endif
+}
+
 static struct cache_entry *
 create_realm_file(const char *key, void *context __attribute__((unused)))
 {
@@ -72,9 +112,18 @@ create_realm_file(const char *key, void *context __attribute__((unused)))
         goto error_no_close;
 
     while ((l = config_read_line(f))) {
-        /* FIXME: Storing plain-text passwords in memory isn't a good idea. */
+        /* Passwords starting with '$' are hashes in the crypt(3) format
+         * (e.g. bcrypt or yescrypt); anything else is kept in memory as
+         * plain text. */
         switch (l->type) {
         case CONFIG_LINE_TYPE_LINE: {
+            if (l->value[0] == '$' && !is_supported_hash(l->value)) {
+                lwan_status_warning("Password hash for user \"%s\" isn't "
+                                    "supported, ignoring",
+                                    l->key);
+                continue;
+            }
+
             char *username = strdup(l->key);
             if (!username)
                 goto error;
@@ -133,14 +182,108 @@ static void destroy_realm_file(struct cache_entry *entry,
 
 bool lwan_http_authorize_init(void)
 {
-    realm_password_cache =
-        cache_create(create_realm_file, destroy_realm_file, NULL, 60);
+    realm_password_cache = cache_create(create_realm_file, destroy_realm_file,
+                                        NULL, REALM_FILE_CACHE_PERIOD);
+    if (!realm_password_cache)
+        return false;
 
-    return !!realm_password_cache;
+    cache_set_name(realm_password_cache, "realm_passwords");
+    return true;
 }
 
 void lwan_http_authorize_shutdown(void) { cache_destroy(realm_password_cache); }
 
+/* Takes the same time regardless of where the strings differ, so that
+ * response times don't tell how much of a password was guessed right. */
+static bool constant_time_streq(const char *a, const char *b)
+{
+    const size_t a_len = strlen(a);
+    const size_t b_len = strlen(b);
+    unsigned char diff = a_len != b_len;
+
+    for (size_t i = 0; i < a_len; i++)
+        diff |= (unsigned char)a[i] ^ (unsigned char)b[i % (b_len + 1)];
+
+    return !diff;
+}
+
+static bool check_password(const char *password, const char *stored)
+{
+    if (stored[0] != '$')
+        return constant_time_streq(password, stored);
+
+#if defined(HAVE_LIBXCRYPT)
+    /* struct crypt_data is ~32KiB, way too large for a coroutine stack. */
+    struct crypt_data *data = calloc(1, sizeof(*data));
+    bool ok = false;
+
+    if (UNLIKELY(!data))
+        return false;
+
+    const char *hashed = crypt_rn(password, stored, data, (int)sizeof(*data));
+    if (LIKELY(hashed))
+        ok = constant_time_streq(hashed, stored);
+
+    explicit_bzero(data, sizeof(*data));
+    free(data);
+
+    return ok;
+#else
+    return false;
+#endif
+}
+
+static time_t now_seconds(void)
+{
+    struct timespec ts;
+
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &ts) < 0))
+        return 0;
+
+    return ts.tv_sec;
+}
+
+static struct verified_credential *
+verified_credential_slot(const char *header, const char *password_file)
+{
+    const unsigned int hash =
+        hash_str_value(header) ^ hash_int_value(password_file);
+
+    return &verified_credentials[hash & (VERIFIED_CACHE_SLOTS - 1)];
+}
+
+static bool was_verified(const char *header,
+                         size_t header_len,
+                         const char *password_file,
+                         time_t now)
+{
+    const struct verified_credential *slot =
+        verified_credential_slot(header, password_file);
+
+    if (slot->password_file != password_file || slot->expires <= now ||
+        slot->header_len != header_len)
+        return false;
+
+    return constant_time_streq(slot->header, header);
+}
+
+static void remember_verified(const char *header,
+                              size_t header_len,
+                              const char *password_file,
+                              time_t now)
+{
+    struct verified_credential *slot;
+
+    if (header_len >= VERIFIED_CACHE_HEADER_MAX)
+        return;
+
+    slot = verified_credential_slot(header, password_file);
+    slot->password_file = password_file;
+    slot->expires = now + REALM_FILE_CACHE_PERIOD;
+    slot->header_len = header_len;
+    memcpy(slot->header, header, header_len + 1);
+}
+
 static bool authorize(struct coro *coro,
                       const char *header,
                       size_t header_len,
@@ -153,6 +296,10 @@ static bool authorize(struct coro *coro,
     char *looked_password;
     size_t decoded_len;
     bool password_ok = false;
+    const time_t now = now_seconds();
+
+    if (was_verified(header, header_len, password_file, now))
+        return true;
 
     rpf = (struct realm_password_file_t *)cache_coro_get_and_ref_entry(
         realm_password_cache, coro, password_file);
@@ -172,7 +319,10 @@ static bool authorize(struct coro *coro,
 
     looked_password = hash_find(rpf->entries, decoded);
     if (looked_password)
-        password_ok = streq(password, looked_password);
+        password_ok = check_password(password, looked_password);
+
+    if (password_ok)
+        remember_verified(header, header_len, password_file, now);
 
 out:
     free(decoded);
@@ -186,7 +336,7 @@ bool lwan_http_authorize(struct lwan_request *request,
     static const char authenticate_tmpl[] = "Basic realm=\"%s\"";
     static const size_t basic_len = sizeof("Basic ") - 1;
     const char *authorization =
-        lwan_request_get_header(request, "Authorization");
+        lwan_request_get_header_by_id(request, LWAN_HEADER_AUTHORIZATION);
 
     if (LIKELY(authorization && !strncmp(authorization, "Basic ", basic_len))) {
         const char *header = authorization + basic_len;
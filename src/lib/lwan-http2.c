@@ -0,0 +1,1578 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* HTTP/2 (RFC 9113) support.  The connection coroutine demultiplexes
+ * frames; once a request has been fully received, it's rewritten as an
+ * HTTP/1.1 request and handed to lwan_process_request() in a coroutine of
+ * its own, so that handlers and modules work unmodified.  Whatever these
+ * write to the socket through the I/O wrappers ends up here instead, where
+ * the response head is converted to a HEADERS frame and everything else to
+ * DATA frames, which are then sent by the connection coroutine. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "list.h"
+#include "lwan-hpack.h"
+#include "lwan-io-wrappers.h"
+
+#define H2_FRAME_HEADER_SIZE 9
+/* Lwan never changes SETTINGS_MAX_FRAME_SIZE from its default. */
+#define H2_MAX_FRAME_SIZE 16384
+#define H2_DEFAULT_WINDOW_SIZE 65535
+#define H2_MAX_WINDOW_SIZE 0x7fffffff
+#define H2_MAX_CONCURRENT_STREAMS 100
+#define H2_MAX_HEADER_BLOCK_SIZE (16 * DEFAULT_BUFFER_SIZE)
+/* Streams yield back to the connection coroutine, so it can send what they
+ * have written so far, once this much is waiting to be sent. */
+#define H2_OUTPUT_FLUSH_THRESHOLD (64 * 1024)
+
+enum h2_frame_type {
+    H2_DATA = 0x0,
+    H2_HEADERS = 0x1,
+    H2_PRIORITY = 0x2,
+    H2_RST_STREAM = 0x3,
+    H2_SETTINGS = 0x4,
+    H2_PUSH_PROMISE = 0x5,
+    H2_PING = 0x6,
+    H2_GOAWAY = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION = 0x9,
+};
+
+enum h2_frame_flags {
+    H2_FLAG_ACK = 0x1,
+    H2_FLAG_END_STREAM = 0x1,
+    H2_FLAG_END_HEADERS = 0x4,
+    H2_FLAG_PADDED = 0x8,
+    H2_FLAG_PRIORITY = 0x20,
+};
+
+enum h2_error {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb,
+};
+
+enum h2_setting {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    H2_SETTINGS_ENABLE_PUSH = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+};
+
+static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+#define PREFACE_LEN (sizeof(preface) - 1)
+
+struct h2_connection;
+
+struct h2_stream {
+    /* What the request sees as its connection; conn.coro is the coroutine
+     * of this stream.  See lwan_http2_stream_wake(). */
+    struct lwan_connection conn;
+
+    struct list_node list;
+    struct h2_connection *h2;
+    uint32_t id;
+
+    int64_t send_window;
+
+    /* The request, as HTTP/1.1: the head, followed by the body. */
+    struct lwan_strbuf request;
+    size_t head_len;
+    long long content_length; /* As sent by the client, or -1 */
+    enum lwan_http_status error_status;
+
+    /* The response head, until it's complete and sent as HEADERS. */
+    struct lwan_strbuf response_head;
+
+    bool end_stream_received;
+    bool dispatched;
+    bool sent_headers;
+    bool runnable;
+    bool blocked; /* On flow control */
+    bool finished;
+};
+
+/* Fields of the header block being decoded; see header_field(). */
+struct h2_header_fields {
+    struct lwan_strbuf headers, cookies;
+    struct lwan_strbuf method, path, authority, host;
+    long long content_length;
+    bool ignore;
+    bool malformed;
+    bool seen_regular;
+};
+
+struct h2_connection {
+    struct lwan *lwan;
+    /* Request of the connection coroutine; its file descriptor is the
+     * socket.  Frames are sent with it. */
+    struct lwan_request *request;
+    struct coro_switcher switcher;
+
+    struct list_head streams;
+    unsigned int n_streams;
+    uint32_t last_stream_id;
+
+    struct lwan_hpack_decoder decoder;
+    struct h2_header_fields fields;
+
+    struct lwan_strbuf header_block;
+    uint32_t header_block_stream;
+    bool header_block_end_stream;
+
+    struct lwan_strbuf out;
+    /* Offset in `out` and stream of the last HEADERS or DATA frame; the
+     * END_STREAM flag can be set there instead of sending another frame. */
+    size_t last_frame;
+    uint32_t last_frame_stream;
+
+    int64_t send_window;
+    uint32_t initial_window_size;
+    uint32_t max_frame_size;
+    uint32_t recv_window_credit;
+
+    bool goaway_sent;
+    bool goaway_received;
+
+    size_t in_len;
+    unsigned char in[H2_FRAME_HEADER_SIZE + H2_MAX_FRAME_SIZE +
+                     DEFAULT_BUFFER_SIZE];
+};
+
+static ALWAYS_INLINE uint32_t read_u24(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+}
+
+static ALWAYS_INLINE uint32_t read_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+           p[3];
+}
+
+static ALWAYS_INLINE void write_u32(char *p, uint32_t value)
+{
+    p[0] = (char)(value >> 24);
+    p[1] = (char)(value >> 16);
+    p[2] = (char)(value >> 8);
+    p[3] = (char)value;
+}
+
+static void write_frame_length(char *frame, size_t len)
+{
+    frame[0] = (char)(len >> 16);
+    frame[1] = (char)(len >> 8);
+    frame[2] = (char)len;
+}
+
+/* Returns a pointer to the payload of the new frame. */
+static char *append_frame(struct h2_connection *h2,
+                          enum h2_frame_type type,
+                          uint8_t flags,
+                          uint32_t stream_id,
+                          size_t len)
+{
+    char *frame = lwan_strbuf_extend_unsafe(&h2->out, H2_FRAME_HEADER_SIZE + len);
+
+    if (UNLIKELY(!frame))
+        return NULL;
+
+    write_frame_length(frame, len);
+    frame[3] = (char)type;
+    frame[4] = (char)flags;
+    write_u32(frame + 5, stream_id);
+
+    if (type == H2_DATA || type == H2_HEADERS) {
+        h2->last_frame = (size_t)(frame - lwan_strbuf_get_buffer(&h2->out));
+        h2->last_frame_stream = stream_id;
+    } else {
+        h2->last_frame_stream = 0;
+    }
+
+    return frame + H2_FRAME_HEADER_SIZE;
+}
+
+static bool send_rst_stream(struct h2_connection *h2,
+                            uint32_t stream_id,
+                            enum h2_error error)
+{
+    char *payload = append_frame(h2, H2_RST_STREAM, 0, stream_id, 4);
+
+    if (UNLIKELY(!payload))
+        return false;
+
+    write_u32(payload, error);
+    return true;
+}
+
+static bool send_window_update(struct h2_connection *h2,
+                               uint32_t stream_id,
+                               uint32_t increment)
+{
+    char *payload = append_frame(h2, H2_WINDOW_UPDATE, 0, stream_id, 4);
+
+    if (UNLIKELY(!payload))
+        return false;
+
+    write_u32(payload, increment);
+    return true;
+}
+
+static bool send_goaway(struct h2_connection *h2, enum h2_error error)
+{
+    char *payload = append_frame(h2, H2_GOAWAY, 0, 0, 8);
+
+    if (UNLIKELY(!payload))
+        return false;
+
+    write_u32(payload, h2->last_stream_id);
+    write_u32(payload + 4, error);
+    h2->goaway_sent = true;
+    return true;
+}
+
+static void flush(struct h2_connection *h2)
+{
+    if (h2->recv_window_credit) {
+        if (LIKELY(send_window_update(h2, 0, h2->recv_window_credit)))
+            h2->recv_window_credit = 0;
+    }
+
+    if (lwan_strbuf_get_length(&h2->out)) {
+        lwan_send(h2->request, lwan_strbuf_get_buffer(&h2->out),
+                  lwan_strbuf_get_length(&h2->out), 0);
+        lwan_strbuf_reset(&h2->out);
+    }
+
+    h2->last_frame_stream = 0;
+}
+
+static void __attribute__((noreturn))
+connection_error(struct h2_connection *h2, enum h2_error error)
+{
+    lwan_status_debug("HTTP/2 connection error 0x%x", error);
+
+    if (LIKELY(send_goaway(h2, error)))
+        flush(h2);
+
+    coro_yield(h2->request->conn->coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
+
+static struct h2_stream *find_stream(struct h2_connection *h2, uint32_t id)
+{
+    struct h2_stream *stream;
+
+    list_for_each (&h2->streams, stream, list) {
+        if (stream->id == id)
+            return stream;
+    }
+
+    return NULL;
+}
+
+static void close_stream(struct h2_connection *h2, struct h2_stream *stream)
+{
+    list_del(&stream->list);
+    h2->n_streams--;
+
+    /* Runs the deferred callbacks of the stream coroutine, even if it
+     * hasn't finished yet (e.g. the client reset the stream). */
+    if (stream->conn.coro)
+        coro_pool_put(&stream->conn.thread->coro_pool, stream->conn.coro);
+
+    lwan_strbuf_free(&stream->request);
+    lwan_strbuf_free(&stream->response_head);
+    free(stream);
+}
+
+static void
+reset_stream(struct h2_connection *h2, struct h2_stream *stream, enum h2_error error)
+{
+    if (UNLIKELY(!send_rst_stream(h2, stream->id, error)))
+        connection_error(h2, H2_INTERNAL_ERROR);
+
+    close_stream(h2, stream);
+}
+
+/* Functions called from the stream coroutines. */
+
+static ALWAYS_INLINE struct h2_stream *
+stream_from_request(struct lwan_request *request)
+{
+    return container_of(request->conn, struct h2_stream, conn);
+}
+
+static void __attribute__((noreturn)) abort_stream(struct h2_stream *stream)
+{
+    coro_yield(stream->conn.coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
+
+static bool is_connection_specific_header(const char *name, size_t len)
+{
+#define NAME_IS(lit_)                                                          \
+    (len == sizeof(lit_) - 1 && !strncasecmp(name, lit_, sizeof(lit_) - 1))
+
+    return NAME_IS("Connection") || NAME_IS("Keep-Alive") ||
+           NAME_IS("Proxy-Connection") || NAME_IS("Transfer-Encoding") ||
+           NAME_IS("Upgrade");
+
+#undef NAME_IS
+}
+
+/* `head` is a complete HTTP/1.x response head, as generated by
+ * lwan_prepare_response_header(): the status line is followed by header
+ * lines, all ending in CRLF (with an empty line at the end). */
+static bool send_response_headers(struct h2_stream *stream,
+                                  const char *head,
+                                  size_t head_len)
+{
+    struct h2_connection *h2 = stream->h2;
+    const char *end = head + head_len;
+    const char *p = head + sizeof("HTTP/1.1 ") - 1;
+    unsigned int status = 0;
+    char *payload;
+
+    if (UNLIKELY(head_len < sizeof("HTTP/1.1 200\r\n\r\n") - 1))
+        return false;
+    for (int i = 0; i < 3; i++) {
+        if (UNLIKELY(!lwan_char_isdigit(p[i])))
+            return false;
+        status = status * 10 + (unsigned int)(p[i] - '0');
+    }
+
+    payload = append_frame(h2, H2_HEADERS, H2_FLAG_END_HEADERS, stream->id, 0);
+    if (UNLIKELY(!payload))
+        return false;
+    const size_t frame = h2->last_frame;
+
+    if (UNLIKELY(!lwan_hpack_encode_status(&h2->out, status)))
+        return false;
+
+    p = memmem(p, (size_t)(end - p), "\r\n", 2);
+    for (p += 2; p < end;) {
+        const char *eol = memmem(p, (size_t)(end - p), "\r\n", 2);
+        const char *colon, *value;
+
+        if (!eol || eol == p)
+            break;
+
+        colon = memchr(p, ':', (size_t)(eol - p));
+        if (LIKELY(colon)) {
+            const size_t name_len = (size_t)(colon - p);
+
+            for (value = colon + 1; value < eol && *value == ' '; value++)
+                ;
+
+            if (!is_connection_specific_header(p, name_len) &&
+                UNLIKELY(!lwan_hpack_encode_header(&h2->out, p, name_len, value,
+                                                   (size_t)(eol - value))))
+                return false;
+        }
+
+        p = eol + 2;
+    }
+
+    /* Headers generated by Lwan are always way smaller than a frame can be,
+     * so CONTINUATION frames are never needed. */
+    const size_t len = lwan_strbuf_get_length(&h2->out) - frame -
+                       H2_FRAME_HEADER_SIZE;
+    if (UNLIKELY(len > h2->max_frame_size))
+        return false;
+    write_frame_length(lwan_strbuf_get_buffer(&h2->out) + frame, len);
+
+    stream->sent_headers = status >= 200;
+    return true;
+}
+
+/* Returns how many bytes from `buf` were part of the response head. */
+static size_t
+collect_response_head(struct h2_stream *stream, const char *buf, size_t len)
+{
+    struct lwan_strbuf *head = &stream->response_head;
+    const size_t prev_len = lwan_strbuf_get_length(head);
+    const size_t search_from = prev_len > 3 ? prev_len - 3 : 0;
+    const char *start, *end_of_head;
+
+    if (UNLIKELY(!lwan_strbuf_append_str(head, buf, len)))
+        abort_stream(stream);
+
+    start = lwan_strbuf_get_buffer(head);
+    end_of_head = memmem(start + search_from,
+                         lwan_strbuf_get_length(head) - search_from,
+                         "\r\n\r\n", 4);
+    if (!end_of_head) {
+        if (UNLIKELY(lwan_strbuf_get_length(head) > 4 * DEFAULT_BUFFER_SIZE))
+            abort_stream(stream);
+        return len;
+    }
+
+    const size_t head_len = (size_t)(end_of_head - start) + 4;
+    if (UNLIKELY(!send_response_headers(stream, start, head_len)))
+        abort_stream(stream);
+
+    /* Interim (1xx) responses have their own HEADERS frame, and the final
+     * response follows. */
+    lwan_strbuf_reset(head);
+
+    return head_len - prev_len;
+}
+
+static size_t wait_for_send_window(struct h2_stream *stream, size_t len)
+{
+    struct h2_connection *h2 = stream->h2;
+
+    while (true) {
+        const int64_t window = LWAN_MIN(stream->send_window, h2->send_window);
+
+        if (LIKELY(window > 0)) {
+            len = LWAN_MIN(len, (size_t)window);
+            return LWAN_MIN(len, (size_t)h2->max_frame_size);
+        }
+
+        stream->blocked = true;
+        coro_yield(stream->conn.coro, CONN_CORO_WANT_WRITE);
+    }
+}
+
+static void consume_send_window(struct h2_stream *stream, size_t len)
+{
+    stream->send_window -= (int64_t)len;
+    stream->h2->send_window -= (int64_t)len;
+
+    if (lwan_strbuf_get_length(&stream->h2->out) >= H2_OUTPUT_FLUSH_THRESHOLD)
+        coro_yield(stream->conn.coro, CONN_CORO_WANT_WRITE);
+}
+
+static void stream_write(struct h2_stream *stream, const char *buf, size_t len)
+{
+    while (UNLIKELY(!stream->sent_headers) && len) {
+        size_t head_len = collect_response_head(stream, buf, len);
+
+        buf += head_len;
+        len -= head_len;
+    }
+
+    while (len) {
+        const size_t frame_len = wait_for_send_window(stream, len);
+        char *payload =
+            append_frame(stream->h2, H2_DATA, 0, stream->id, frame_len);
+
+        if (UNLIKELY(!payload))
+            abort_stream(stream);
+
+        memcpy(payload, buf, frame_len);
+        buf += frame_len;
+        len -= frame_len;
+
+        consume_send_window(stream, frame_len);
+    }
+}
+
+ssize_t lwan_http2_stream_writev(struct lwan_request *request,
+                                 const struct iovec *iov,
+                                 int iov_count)
+{
+    struct h2_stream *stream = stream_from_request(request);
+    ssize_t total_written = 0;
+
+    for (int i = 0; i < iov_count; i++) {
+        stream_write(stream, iov[i].iov_base, iov[i].iov_len);
+        total_written += (ssize_t)iov[i].iov_len;
+    }
+
+    return total_written;
+}
+
+void lwan_http2_stream_sendfile(struct lwan_request *request,
+                                int in_fd,
+                                off_t offset,
+                                size_t count,
+                                const char *header,
+                                size_t header_len)
+{
+    struct h2_stream *stream = stream_from_request(request);
+
+    stream_write(stream, header, header_len);
+
+    /* File contents have to be framed, so they're read straight into the
+     * output buffer rather than being sent with sendfile(). */
+    while (count) {
+        const size_t frame_len = wait_for_send_window(stream, count);
+        char *payload =
+            append_frame(stream->h2, H2_DATA, 0, stream->id, frame_len);
+
+        if (UNLIKELY(!payload))
+            abort_stream(stream);
+
+        for (size_t have = 0; have < frame_len;) {
+            ssize_t r = pread(in_fd, payload + have, frame_len - have,
+                              offset + (off_t)have);
+
+            if (UNLIKELY(r <= 0)) {
+                if (r < 0 && (errno == EINTR || errno == EAGAIN))
+                    continue;
+                abort_stream(stream);
+            }
+
+            have += (size_t)r;
+        }
+
+        offset += (off_t)frame_len;
+        count -= frame_len;
+
+        consume_send_window(stream, frame_len);
+    }
+}
+
+struct lwan_connection *lwan_http2_stream_wake(struct lwan_connection *conn)
+{
+    struct h2_stream *stream = container_of(conn, struct h2_stream, conn);
+
+    conn->flags &= ~CONN_SUSPENDED;
+    stream->runnable = true;
+
+    return stream->h2->request->conn;
+}
+
+static void lwan_strbuf_free_defer(void *data)
+{
+    lwan_strbuf_free((struct lwan_strbuf *)data);
+}
+
+__attribute__((noreturn)) static int stream_coro(struct coro *coro,
+                                                 void *data)
+{
+    struct h2_stream *stream = data;
+    struct h2_connection *h2 = stream->h2;
+    struct lwan *lwan = h2->lwan;
+    struct lwan_strbuf strbuf = LWAN_STRBUF_STATIC_INIT;
+    struct lwan_value buffer = {
+        .value = lwan_strbuf_get_buffer(&stream->request),
+        .len = lwan_strbuf_get_length(&stream->request),
+    };
+    char *header_start[N_HEADER_START];
+    struct lwan_request_parser_helper helper = {
+        .buffer = &buffer,
+        .buffer_size = DEFAULT_BUFFER_SIZE,
+        .next_request = buffer.value,
+        .error_when_n_packets = lwan_calculate_n_packets(DEFAULT_BUFFER_SIZE),
+        .header_start = header_start,
+    };
+    struct lwan_request request = {
+        .conn = &stream->conn,
+        .global_response_headers = &lwan->headers,
+        .fd = h2->request->fd,
+        .response = {.buffer = &strbuf},
+        .flags = (lwan->config.request_flags & REQUEST_ALLOW_CORS) |
+                 (h2->request->flags & REQUEST_PROXIED),
+        .proxy = h2->request->proxy,
+        .helper = &helper,
+    };
+
+    coro_defer(coro, lwan_strbuf_free_defer, &strbuf);
+
+    if (UNLIKELY(stream->error_status))
+        lwan_default_response(&request, stream->error_status);
+    else
+        lwan_process_request(lwan, &request);
+
+    stream->finished = true;
+    coro_yield(coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
+
+/* Functions called from the connection coroutine. */
+
+static void finish_stream(struct h2_connection *h2, struct h2_stream *stream)
+{
+    if (UNLIKELY(!stream->sent_headers))
+        return reset_stream(h2, stream, H2_INTERNAL_ERROR);
+
+    if (h2->last_frame_stream == stream->id) {
+        lwan_strbuf_get_buffer(&h2->out)[h2->last_frame + 4] |=
+            H2_FLAG_END_STREAM;
+    } else if (UNLIKELY(!append_frame(h2, H2_DATA, H2_FLAG_END_STREAM,
+                                      stream->id, 0))) {
+        connection_error(h2, H2_INTERNAL_ERROR);
+    }
+
+    /* The response might have been sent before the whole request has been
+     * received (e.g. if it was too large); the client can stop sending. */
+    if (!stream->end_stream_received)
+        return reset_stream(h2, stream, H2_NO_ERROR);
+
+    close_stream(h2, stream);
+}
+
+static void run_stream(struct h2_connection *h2, struct h2_stream *stream)
+{
+    stream->runnable = false;
+    stream->blocked = false;
+
+    int64_t from_coro = coro_resume(stream->conn.coro);
+    enum lwan_connection_coro_yield yield_result = from_coro & 0xffffffff;
+
+    if (stream->finished)
+        return finish_stream(h2, stream);
+
+    switch (yield_result) {
+    case CONN_CORO_ABORT:
+        return reset_stream(h2, stream, H2_INTERNAL_ERROR);
+    case CONN_CORO_SUSPEND:
+        /* Sleeping; resumed by lwan_http2_stream_wake(). */
+        stream->conn.flags |= CONN_SUSPENDED;
+        return;
+    case CONN_CORO_WANT_WRITE:
+        /* Either waiting for WINDOW_UPDATE, or for the output to be sent. */
+        stream->runnable = !stream->blocked;
+        return;
+    case CONN_CORO_YIELD:
+    case CONN_CORO_WANT_READ:
+    case CONN_CORO_WANT_READ_WRITE:
+    case CONN_CORO_RESUME:
+        stream->runnable = true;
+        return;
+    default:
+        /* The socket is shared by all streams, so other file descriptors
+         * can't be awaited on as the connection is only resumed on its
+         * own events. */
+        lwan_status_debug("Streams can't await on file descriptors");
+        return reset_stream(h2, stream, H2_INTERNAL_ERROR);
+    }
+}
+
+static bool run_streams(struct h2_connection *h2)
+{
+    struct h2_stream *stream, *next;
+    bool ran = false;
+
+    list_for_each_safe (&h2->streams, stream, next, list) {
+        if (stream->runnable) {
+            run_stream(h2, stream);
+            ran = true;
+        }
+    }
+
+    return ran;
+}
+
+static bool has_runnable_streams(struct h2_connection *h2)
+{
+    struct h2_stream *stream;
+
+    list_for_each (&h2->streams, stream, list) {
+        if (stream->runnable)
+            return true;
+    }
+
+    return false;
+}
+
+static void unblock_streams(struct h2_connection *h2)
+{
+    struct h2_stream *stream;
+
+    list_for_each (&h2->streams, stream, list) {
+        if (stream->blocked) {
+            stream->blocked = false;
+            stream->runnable = true;
+        }
+    }
+}
+
+static void dispatch_stream(struct h2_connection *h2, struct h2_stream *stream)
+{
+    struct lwan_thread *thread = h2->request->conn->thread;
+
+    if (LIKELY(!stream->error_status)) {
+        const size_t body_len =
+            lwan_strbuf_get_length(&stream->request) - stream->head_len;
+        char end_of_head[sizeof("Content-Length: \r\n\r\n") + 3 * sizeof(size_t)];
+        int len;
+
+        if (UNLIKELY(stream->content_length >= 0 &&
+                     (size_t)stream->content_length != body_len))
+            return reset_stream(h2, stream, H2_PROTOCOL_ERROR);
+
+        if (body_len || stream->content_length >= 0) {
+            len = snprintf(end_of_head, sizeof(end_of_head),
+                           "Content-Length: %zu\r\n\r\n", body_len);
+        } else {
+            len = snprintf(end_of_head, sizeof(end_of_head), "\r\n");
+        }
+
+        if (UNLIKELY(len < 0 || (size_t)len >= sizeof(end_of_head) ||
+                     !lwan_strbuf_extend_unsafe(&stream->request, (size_t)len)))
+            return reset_stream(h2, stream, H2_INTERNAL_ERROR);
+
+        char *head_end = lwan_strbuf_get_buffer(&stream->request) + stream->head_len;
+        memmove(head_end + len, head_end, body_len);
+        memcpy(head_end, end_of_head, (size_t)len);
+        head_end[len + (int)body_len] = '\0';
+    }
+
+    struct coro *coro =
+        coro_pool_get(&thread->coro_pool, &h2->switcher, stream_coro, stream);
+    if (UNLIKELY(!coro))
+        return reset_stream(h2, stream, H2_REFUSED_STREAM);
+
+    stream->conn = (struct lwan_connection){
+        .flags = CONN_IS_HTTP2_STREAM | CONN_IS_KEEP_ALIVE,
+        .coro = coro,
+        .thread = thread,
+    };
+    stream->dispatched = true;
+    stream->runnable = true;
+}
+
+static void end_of_request(struct h2_connection *h2, struct h2_stream *stream)
+{
+    stream->end_stream_received = true;
+
+    if (!stream->dispatched)
+        dispatch_stream(h2, stream);
+}
+
+static bool is_valid_field_name(const char *name, size_t len)
+{
+    if (UNLIKELY(!len))
+        return false;
+
+    for (size_t i = 0; i < len; i++) {
+        const unsigned char c = (unsigned char)name[i];
+
+        if (c <= ' ' || c >= 0x7f || c == ':' || (c >= 'A' && c <= 'Z'))
+            return false;
+    }
+
+    return true;
+}
+
+static bool is_valid_field_value(const char *value, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (value[i] == '\0' || value[i] == '\r' || value[i] == '\n')
+            return false;
+    }
+
+    return true;
+}
+
+/* Pseudo-header fields end up in the request line. */
+static bool is_valid_request_line_part(const struct lwan_strbuf *part)
+{
+    const char *value = lwan_strbuf_get_buffer(part);
+    const size_t len = lwan_strbuf_get_length(part);
+
+    if (UNLIKELY(!len))
+        return false;
+
+    for (size_t i = 0; i < len; i++) {
+        const unsigned char c = (unsigned char)value[i];
+
+        if (c <= ' ' || c == 0x7f)
+            return false;
+    }
+
+    return true;
+}
+
+static long long parse_content_length(const char *value, size_t len)
+{
+    long long parsed = 0;
+
+    if (UNLIKELY(!len || len > 18))
+        return -1;
+
+    for (size_t i = 0; i < len; i++) {
+        if (UNLIKELY(!lwan_char_isdigit(value[i])))
+            return -1;
+        parsed = parsed * 10 + (value[i] - '0');
+    }
+
+    return parsed;
+}
+
+static void header_field(void *data,
+                         const char *name,
+                         size_t name_len,
+                         const char *value,
+                         size_t value_len)
+{
+    struct h2_header_fields *fields = data;
+    struct lwan_strbuf *dest;
+
+    if (fields->ignore || fields->malformed)
+        return;
+
+#define NAME_IS(lit_)                                                          \
+    (name_len == sizeof(lit_) - 1 && !memcmp(name, lit_, sizeof(lit_) - 1))
+
+    if (UNLIKELY(!is_valid_field_value(value, value_len)))
+        goto malformed;
+
+    if (name_len && name[0] == ':') {
+        if (UNLIKELY(fields->seen_regular))
+            goto malformed;
+
+        if (NAME_IS(":method")) {
+            dest = &fields->method;
+        } else if (NAME_IS(":path")) {
+            dest = &fields->path;
+        } else if (NAME_IS(":authority")) {
+            dest = &fields->authority;
+        } else if (NAME_IS(":scheme")) {
+            return;
+        } else {
+            goto malformed;
+        }
+
+        if (UNLIKELY(lwan_strbuf_get_length(dest) != 0))
+            goto malformed;
+        if (UNLIKELY(!lwan_strbuf_set(dest, value, value_len)))
+            goto malformed;
+        return;
+    }
+
+    fields->seen_regular = true;
+
+    if (UNLIKELY(!is_valid_field_name(name, name_len)))
+        goto malformed;
+
+    if (NAME_IS("cookie")) {
+        /* Cookies can be split in many fields (§8.2.3), but Lwan expects
+         * a single Cookie header. */
+        if (lwan_strbuf_get_length(&fields->cookies) &&
+            UNLIKELY(!lwan_strbuf_append_str(&fields->cookies, "; ", 2)))
+            goto malformed;
+        if (UNLIKELY(!lwan_strbuf_append_str(&fields->cookies, value, value_len)))
+            goto malformed;
+        return;
+    }
+
+    if (NAME_IS("host")) {
+        if (UNLIKELY(!lwan_strbuf_set(&fields->host, value, value_len)))
+            goto malformed;
+        return;
+    }
+
+    if (NAME_IS("content-length")) {
+        fields->content_length = parse_content_length(value, value_len);
+        if (UNLIKELY(fields->content_length < 0))
+            goto malformed;
+        return;
+    }
+
+    if (NAME_IS("te")) {
+        if (UNLIKELY(value_len != 8 || memcmp(value, "trailers", 8)))
+            goto malformed;
+        return;
+    }
+
+    /* The whole body has been received by the time the request is handled,
+     * so nobody is waiting for a 100-continue response. */
+    if (NAME_IS("expect"))
+        return;
+
+    /* Connection-specific fields make a request malformed (§8.2.2). */
+    if (UNLIKELY(is_connection_specific_header(name, name_len)))
+        goto malformed;
+
+#undef NAME_IS
+
+    struct lwan_strbuf *headers = &fields->headers;
+    if (UNLIKELY(!lwan_strbuf_append_str(headers, name, name_len) ||
+                 !lwan_strbuf_append_str(headers, ": ", 2) ||
+                 !lwan_strbuf_append_str(headers, value, value_len) ||
+                 !lwan_strbuf_append_str(headers, "\r\n", 2)))
+        goto malformed;
+
+    return;
+
+malformed:
+    fields->malformed = true;
+}
+
+static void decode_header_block(struct h2_connection *h2, bool ignore)
+{
+    struct h2_header_fields *fields = &h2->fields;
+
+    lwan_strbuf_reset(&fields->headers);
+    lwan_strbuf_reset(&fields->cookies);
+    lwan_strbuf_reset(&fields->method);
+    lwan_strbuf_reset(&fields->path);
+    lwan_strbuf_reset(&fields->authority);
+    lwan_strbuf_reset(&fields->host);
+    fields->content_length = -1;
+    fields->ignore = ignore;
+    fields->malformed = false;
+    fields->seen_regular = false;
+
+    /* This has to be done even for header blocks that are going to be
+     * ignored, so that the decoder state is the same as the encoder's. */
+    if (UNLIKELY(!lwan_hpack_decode(
+            &h2->decoder,
+            (const unsigned char *)lwan_strbuf_get_buffer(&h2->header_block),
+            lwan_strbuf_get_length(&h2->header_block), header_field, fields)))
+        connection_error(h2, H2_COMPRESSION_ERROR);
+}
+
+static bool build_request_head(struct h2_stream *stream,
+                               const struct h2_header_fields *fields)
+{
+    struct lwan_strbuf *request = &stream->request;
+    const struct lwan_strbuf *authority =
+        lwan_strbuf_get_length(&fields->authority) ? &fields->authority
+                                                   : &fields->host;
+
+    if (UNLIKELY(fields->malformed))
+        return false;
+    if (UNLIKELY(!is_valid_request_line_part(&fields->method)))
+        return false;
+    if (UNLIKELY(!is_valid_request_line_part(&fields->path)))
+        return false;
+
+#define APPEND(str_, len_)                                                     \
+    do {                                                                       \
+        if (UNLIKELY(!lwan_strbuf_append_str(request, (str_), (len_))))        \
+            return false;                                                      \
+    } while (0)
+#define APPEND_STRBUF(strbuf_)                                                 \
+    APPEND(lwan_strbuf_get_buffer(strbuf_), lwan_strbuf_get_length(strbuf_))
+#define APPEND_CONST(str_) APPEND((str_), sizeof(str_) - 1)
+
+    APPEND_STRBUF(&fields->method);
+    APPEND_CONST(" ");
+    APPEND_STRBUF(&fields->path);
+    APPEND_CONST(" HTTP/1.1\r\n");
+
+    if (lwan_strbuf_get_length(authority)) {
+        APPEND_CONST("Host: ");
+        APPEND_STRBUF(authority);
+        APPEND_CONST("\r\n");
+    }
+
+    APPEND_STRBUF(&fields->headers);
+
+    if (lwan_strbuf_get_length(&fields->cookies)) {
+        APPEND_CONST("Cookie: ");
+        APPEND_STRBUF(&fields->cookies);
+        APPEND_CONST("\r\n");
+    }
+
+#undef APPEND
+#undef APPEND_STRBUF
+#undef APPEND_CONST
+
+    stream->head_len = lwan_strbuf_get_length(request);
+    stream->content_length = fields->content_length;
+
+    /* Same limit as requests read by lwan_process_request() */
+    if (UNLIKELY(stream->head_len >= DEFAULT_BUFFER_SIZE))
+        stream->error_status = HTTP_TOO_LARGE;
+
+    return true;
+}
+
+static struct h2_stream *new_stream(struct h2_connection *h2, uint32_t id)
+{
+    struct h2_stream *stream = calloc(1, sizeof(*stream));
+
+    if (UNLIKELY(!stream))
+        return NULL;
+
+    stream->h2 = h2;
+    stream->id = id;
+    stream->send_window = h2->initial_window_size;
+    stream->request = LWAN_STRBUF_STATIC_INIT;
+    stream->response_head = LWAN_STRBUF_STATIC_INIT;
+    stream->content_length = -1;
+
+    list_add_tail(&h2->streams, &stream->list);
+    h2->n_streams++;
+
+    return stream;
+}
+
+static void end_of_header_block(struct h2_connection *h2)
+{
+    const uint32_t id = h2->header_block_stream;
+    const bool end_stream = h2->header_block_end_stream;
+    struct h2_stream *stream = find_stream(h2, id);
+
+    h2->header_block_stream = 0;
+
+    if (stream) {
+        /* Trailers.  Nothing in Lwan would look at them. */
+        decode_header_block(h2, true);
+
+        if (UNLIKELY(stream->end_stream_received))
+            return reset_stream(h2, stream, H2_STREAM_CLOSED);
+        if (UNLIKELY(!end_stream))
+            return reset_stream(h2, stream, H2_PROTOCOL_ERROR);
+
+        return end_of_request(h2, stream);
+    }
+
+    if (UNLIKELY(!(id & 1)))
+        connection_error(h2, H2_PROTOCOL_ERROR);
+
+    if (id <= h2->last_stream_id) {
+        /* Stream has been closed already. */
+        return decode_header_block(h2, true);
+    }
+
+    h2->last_stream_id = id;
+
+    if (UNLIKELY(h2->goaway_sent ||
+                 h2->n_streams >= H2_MAX_CONCURRENT_STREAMS ||
+                 !(stream = new_stream(h2, id)))) {
+        decode_header_block(h2, true);
+        if (UNLIKELY(!send_rst_stream(h2, id, H2_REFUSED_STREAM)))
+            connection_error(h2, H2_INTERNAL_ERROR);
+        return;
+    }
+
+    decode_header_block(h2, false);
+
+    if (UNLIKELY(!build_request_head(stream, &h2->fields)))
+        return reset_stream(h2, stream, H2_PROTOCOL_ERROR);
+
+    if (end_stream)
+        end_of_request(h2, stream);
+}
+
+static void append_header_block(struct h2_connection *h2,
+                                const unsigned char *fragment,
+                                size_t len)
+{
+    if (UNLIKELY(lwan_strbuf_get_length(&h2->header_block) + len >
+                 H2_MAX_HEADER_BLOCK_SIZE))
+        connection_error(h2, H2_ENHANCE_YOUR_CALM);
+
+    if (UNLIKELY(!lwan_strbuf_append_str(&h2->header_block,
+                                         (const char *)fragment, len)))
+        connection_error(h2, H2_INTERNAL_ERROR);
+}
+
+/* Returns the payload length without padding. */
+static size_t remove_padding(struct h2_connection *h2,
+                             uint8_t flags,
+                             const unsigned char **payload,
+                             size_t len)
+{
+    if (!(flags & H2_FLAG_PADDED))
+        return len;
+
+    if (UNLIKELY(!len))
+        connection_error(h2, H2_PROTOCOL_ERROR);
+
+    const size_t pad_len = (*payload)[0];
+    if (UNLIKELY(pad_len >= len))
+        connection_error(h2, H2_PROTOCOL_ERROR);
+
+    (*payload)++;
+    return len - 1 - pad_len;
+}
+
+static void handle_headers(struct h2_connection *h2,
+                           uint8_t flags,
+                           uint32_t id,
+                           const unsigned char *payload,
+                           size_t len)
+{
+    if (UNLIKELY(!id))
+        connection_error(h2, H2_PROTOCOL_ERROR);
+
+    len = remove_padding(h2, flags, &payload, len);
+
+    if (flags & H2_FLAG_PRIORITY) {
+        /* Priorities are ignored. */
+        if (UNLIKELY(len < 5))
+            connection_error(h2, H2_FRAME_SIZE_ERROR);
+        payload += 5;
+        len -= 5;
+    }
+
+    lwan_strbuf_reset(&h2->header_block);
+    append_header_block(h2, payload, len);
+
+    h2->header_block_stream = id;
+    h2->header_block_end_stream = flags & H2_FLAG_END_STREAM;
+
+    if (flags & H2_FLAG_END_HEADERS)
+        end_of_header_block(h2);
+}
+
+static void handle_continuation(struct h2_connection *h2,
+                                uint8_t flags,
+                                uint32_t id,
+                                const unsigned char *payload,
+                                size_t len)
+{
+    if (UNLIKELY(!h2->header_block_stream || id != h2->header_block_stream))
+        connection_error(h2, H2_PROTOCOL_ERROR);
+
+    append_header_block(h2, payload, len);
+
+    if (flags & H2_FLAG_END_HEADERS)
+        end_of_header_block(h2);
+}
+
+static void handle_data(struct h2_connection *h2,
+                        uint8_t flags,
+                        uint32_t id,
+                        const unsigned char *payload,
+                        size_t len)
+{
+    const struct lwan_config *config = &h2->lwan->config;
+    const size_t max_body_size =
+        LWAN_MAX(config->max_post_data_size, config->max_put_data_size);
+    struct h2_stream *stream;
+
+    if (UNLIKELY(!id))
+        connection_error(h2, H2_PROTOCOL_ERROR);
+
+    /* The whole frame counts towards flow control, including padding.
+     * Everything is buffered, so this is given back right away. */
+    h2->recv_window_credit += (uint32_t)len;
+
+    const size_t frame_len = len;
+    len = remove_padding(h2, flags, &payload, len);
+
+    stream = find_stream(h2, id);
+    if (!stream) {
+        if (UNLIKELY(id > h2->last_stream_id))
+            connection_error(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    if (UNLIKELY(stream->end_stream_received))
+        return reset_stream(h2, stream, H2_STREAM_CLOSED);
+
+    if (!stream->dispatched) {
+        const size_t body_len =
+            lwan_strbuf_get_length(&stream->request) - stream->head_len;
+
+        if (UNLIKELY(body_len + len > max_body_size)) {
+            /* Respond right away; the rest of the body is discarded. */
+            stream->error_status = HTTP_TOO_LARGE;
+            dispatch_stream(h2, stream);
+            return;
+        }
+
+        if (UNLIKELY(!lwan_strbuf_append_str(&stream->request,
+                                             (const char *)payload, len)))
+            return reset_stream(h2, stream, H2_INTERNAL_ERROR);
+    }
+
+    if (flags & H2_FLAG_END_STREAM)
+        return end_of_request(h2, stream);
+
+    /* Once dispatched, the rest of the body isn't wanted anymore. */
+    if (stream->dispatched || !frame_len)
+        return;
+
+    if (UNLIKELY(!send_window_update(h2, id, (uint32_t)frame_len)))
+        connection_error(h2, H2_INTERNAL_ERROR);
+}
+
+static void handle_settings(struct h2_connection *h2,
+                            uint8_t flags,
+                            uint32_t id,
+                            const unsigned char *payload,
+                            size_t len)
+{
+    if (UNLIKELY(id))
+        connection_error(h2, H2_PROTOCOL_ERROR);
+
+    if (flags & H2_FLAG_ACK) {
+        if (UNLIKELY(len != 0))
+            connection_error(h2, H2_FRAME_SIZE_ERROR);
+        return;
+    }
+
+    if (UNLIKELY(len % 6 != 0))
+        connection_error(h2, H2_FRAME_SIZE_ERROR);
+
+    for (; len; len -= 6, payload += 6) {
+        const uint16_t setting = (uint16_t)(payload[0] << 8 | payload[1]);
+        const uint32_t value = read_u32(payload + 2);
+
+        switch (setting) {
+        case H2_SETTINGS_ENABLE_PUSH:
+            if (UNLIKELY(value > 1))
+                connection_error(h2, H2_PROTOCOL_ERROR);
+            break;
+
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+            const int64_t delta = (int64_t)value - h2->initial_window_size;
+            struct h2_stream *stream;
+
+            if (UNLIKELY(value > H2_MAX_WINDOW_SIZE))
+                connection_error(h2, H2_FLOW_CONTROL_ERROR);
+
+            list_for_each (&h2->streams, stream, list) {
+                stream->send_window += delta;
+                if (UNLIKELY(stream->send_window > H2_MAX_WINDOW_SIZE))
+                    connection_error(h2, H2_FLOW_CONTROL_ERROR);
+            }
+
+            h2->initial_window_size = value;
+            if (delta > 0)
+                unblock_streams(h2);
+            break;
+        }
+
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            if (UNLIKELY(value < H2_MAX_FRAME_SIZE || value > 0xffffff))
+                connection_error(h2, H2_PROTOCOL_ERROR);
+            h2->max_frame_size = value;
+            break;
+
+        default:
+            /* SETTINGS_HEADER_TABLE_SIZE doesn't matter as the encoder never
+             * uses the dynamic table; others are either advisory or only
+             * relevant to server push, which isn't supported. */
+            break;
+        }
+    }
+
+    if (UNLIKELY(!append_frame(h2, H2_SETTINGS, H2_FLAG_ACK, 0, 0)))
+        connection_error(h2, H2_INTERNAL_ERROR);
+}
+
+static void handle_window_update(struct h2_connection *h2,
+                                 uint32_t id,
+                                 const unsigned char *payload,
+                                 size_t len)
+{
+    struct h2_stream *stream;
+
+    if (UNLIKELY(len != 4))
+        connection_error(h2, H2_FRAME_SIZE_ERROR);
+
+    const uint32_t increment = read_u32(payload) & 0x7fffffff;
+
+    if (!id) {
+        if (UNLIKELY(!increment))
+            connection_error(h2, H2_PROTOCOL_ERROR);
+
+        h2->send_window += increment;
+        if (UNLIKELY(h2->send_window > H2_MAX_WINDOW_SIZE))
+            connection_error(h2, H2_FLOW_CONTROL_ERROR);
+
+        return unblock_streams(h2);
+    }
+
+    stream = find_stream(h2, id);
+    if (!stream) {
+        if (UNLIKELY(id > h2->last_stream_id))
+            connection_error(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    if (UNLIKELY(!increment))
+        return reset_stream(h2, stream, H2_PROTOCOL_ERROR);
+
+    stream->send_window += increment;
+    if (UNLIKELY(stream->send_window > H2_MAX_WINDOW_SIZE))
+        return reset_stream(h2, stream, H2_FLOW_CONTROL_ERROR);
+
+    if (stream->blocked) {
+        stream->blocked = false;
+        stream->runnable = true;
+    }
+}
+
+static void handle_frame(struct h2_connection *h2,
+                         uint8_t type,
+                         uint8_t flags,
+                         uint32_t id,
+                         const unsigned char *payload,
+                         size_t len)
+{
+    struct h2_stream *stream;
+
+    /* Header blocks can't be interleaved with anything (§6.10). */
+    if (UNLIKELY(h2->header_block_stream && type != H2_CONTINUATION))
+        connection_error(h2, H2_PROTOCOL_ERROR);
+
+    switch (type) {
+    case H2_DATA:
+        return handle_data(h2, flags, id, payload, len);
+
+    case H2_HEADERS:
+        return handle_headers(h2, flags, id, payload, len);
+
+    case H2_CONTINUATION:
+        return handle_continuation(h2, flags, id, payload, len);
+
+    case H2_PRIORITY:
+        if (UNLIKELY(!id))
+            connection_error(h2, H2_PROTOCOL_ERROR);
+        if (UNLIKELY(len != 5 && !send_rst_stream(h2, id, H2_FRAME_SIZE_ERROR)))
+            connection_error(h2, H2_INTERNAL_ERROR);
+        return;
+
+    case H2_RST_STREAM:
+        if (UNLIKELY(!id || id > h2->last_stream_id))
+            connection_error(h2, H2_PROTOCOL_ERROR);
+        if (UNLIKELY(len != 4))
+            connection_error(h2, H2_FRAME_SIZE_ERROR);
+        if ((stream = find_stream(h2, id)))
+            close_stream(h2, stream);
+        return;
+
+    case H2_SETTINGS:
+        return handle_settings(h2, flags, id, payload, len);
+
+    case H2_PUSH_PROMISE:
+        /* Clients can't push. */
+        connection_error(h2, H2_PROTOCOL_ERROR);
+
+    case H2_PING:
+        if (UNLIKELY(id))
+            connection_error(h2, H2_PROTOCOL_ERROR);
+        if (UNLIKELY(len != 8))
+            connection_error(h2, H2_FRAME_SIZE_ERROR);
+        if (!(flags & H2_FLAG_ACK)) {
+            char *pong = append_frame(h2, H2_PING, H2_FLAG_ACK, 0, 8);
+
+            if (UNLIKELY(!pong))
+                connection_error(h2, H2_INTERNAL_ERROR);
+            memcpy(pong, payload, 8);
+        }
+        return;
+
+    case H2_GOAWAY:
+        if (UNLIKELY(id))
+            connection_error(h2, H2_PROTOCOL_ERROR);
+        h2->goaway_received = true;
+        return;
+
+    case H2_WINDOW_UPDATE:
+        return handle_window_update(h2, id, payload, len);
+
+    default:
+        /* Unknown frame types must be ignored (§5.5). */
+        return;
+    }
+}
+
+static void handle_frames(struct h2_connection *h2)
+{
+    const unsigned char *p = h2->in;
+    size_t avail = h2->in_len;
+
+    while (avail >= H2_FRAME_HEADER_SIZE) {
+        const size_t len = read_u24(p);
+
+        if (UNLIKELY(len > H2_MAX_FRAME_SIZE))
+            connection_error(h2, H2_FRAME_SIZE_ERROR);
+        if (avail < H2_FRAME_HEADER_SIZE + len)
+            break;
+
+        handle_frame(h2, p[3], p[4], read_u32(p + 5) & 0x7fffffff,
+                     p + H2_FRAME_HEADER_SIZE, len);
+
+        p += H2_FRAME_HEADER_SIZE + len;
+        avail -= H2_FRAME_HEADER_SIZE + len;
+    }
+
+    memmove(h2->in, p, avail);
+    h2->in_len = avail;
+}
+
+/* Returns false if nothing could be read without blocking. */
+static bool read_frames(struct h2_connection *h2)
+{
+    while (true) {
+        ssize_t n = read(h2->request->fd, h2->in + h2->in_len,
+                         sizeof(h2->in) - h2->in_len);
+
+        if (LIKELY(n > 0)) {
+            if ((size_t)n < sizeof(h2->in) - h2->in_len) {
+                lwan_connection_clear_ready(h2->request->conn,
+                                            CONN_READY_READ);
+            }
+            h2->in_len += (size_t)n;
+            return true;
+        }
+
+        if (n < 0) {
+            switch (errno) {
+            case EINTR:
+                continue;
+            case EAGAIN:
+                lwan_connection_clear_ready(h2->request->conn,
+                                            CONN_READY_READ);
+                return false;
+            }
+        }
+
+        /* Client closed the connection, or some unrecoverable error. */
+        coro_yield(h2->request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+}
+
+static void h2_connection_free(void *data)
+{
+    struct h2_connection *h2 = data;
+    struct h2_stream *stream, *next;
+
+    list_for_each_safe (&h2->streams, stream, next, list)
+        close_stream(h2, stream);
+
+    lwan_hpack_decoder_free(&h2->decoder);
+
+    lwan_strbuf_free(&h2->fields.headers);
+    lwan_strbuf_free(&h2->fields.cookies);
+    lwan_strbuf_free(&h2->fields.method);
+    lwan_strbuf_free(&h2->fields.path);
+    lwan_strbuf_free(&h2->fields.authority);
+    lwan_strbuf_free(&h2->fields.host);
+    lwan_strbuf_free(&h2->header_block);
+    lwan_strbuf_free(&h2->out);
+
+    free(h2);
+}
+
+/* `buffer` is NUL-terminated, and has at least MIN_REQUEST_SIZE bytes (which
+ * is the size of everything up to the first empty line in the preface); the
+ * rest of the preface might not have been read yet, but no HTTP/1.x request
+ * looks like this. */
+bool lwan_http2_is_preface(const char *buffer)
+{
+    return !strncmp(buffer, preface, sizeof("PRI * HTTP/2.0\r\n\r\n") - 1);
+}
+
+/* Takes over the connection after lwan_http2_is_preface() returned true for
+ * `start`, in the request buffer (following the PROXY header, if any).  A
+ * TLS layer would call this directly once "h2" has been negotiated with
+ * ALPN. */
+void lwan_http2_serve(struct lwan_request *request, const char *start)
+{
+    struct lwan_connection *conn = request->conn;
+    const struct lwan_value *buffer = request->helper->buffer;
+    const size_t start_len = (size_t)(buffer->value + buffer->len - start);
+    struct h2_connection *h2;
+
+    h2 = coro_malloc_full(conn->coro, sizeof(*h2), h2_connection_free);
+    if (UNLIKELY(!h2)) {
+        coro_yield(conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    *h2 = (struct h2_connection){
+        .lwan = conn->thread->lwan,
+        .request = request,
+        .fields =
+            {
+                .headers = LWAN_STRBUF_STATIC_INIT,
+                .cookies = LWAN_STRBUF_STATIC_INIT,
+                .method = LWAN_STRBUF_STATIC_INIT,
+                .path = LWAN_STRBUF_STATIC_INIT,
+                .authority = LWAN_STRBUF_STATIC_INIT,
+                .host = LWAN_STRBUF_STATIC_INIT,
+            },
+        .header_block = LWAN_STRBUF_STATIC_INIT,
+        .out = LWAN_STRBUF_STATIC_INIT,
+        .send_window = H2_DEFAULT_WINDOW_SIZE,
+        .initial_window_size = H2_DEFAULT_WINDOW_SIZE,
+        .max_frame_size = H2_MAX_FRAME_SIZE,
+    };
+    list_head_init(&h2->streams);
+    lwan_hpack_decoder_init(&h2->decoder);
+
+    /* Frames are written with this request, and they shouldn't be corked
+     * as if there were pipelined requests. */
+    request->helper->next_request = NULL;
+
+    assert(start_len < sizeof(h2->in));
+    memcpy(h2->in, start, start_len);
+    h2->in_len = start_len;
+
+    while (h2->in_len < PREFACE_LEN) {
+        if (!read_frames(h2))
+            coro_yield(conn->coro, CONN_CORO_WANT_READ);
+    }
+    if (UNLIKELY(memcmp(h2->in, preface, PREFACE_LEN))) {
+        coro_yield(conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+    h2->in_len -= PREFACE_LEN;
+    memmove(h2->in, h2->in + PREFACE_LEN, h2->in_len);
+
+    char *settings = append_frame(h2, H2_SETTINGS, 0, 0, 6);
+    if (UNLIKELY(!settings))
+        connection_error(h2, H2_INTERNAL_ERROR);
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    write_u32(settings + 2, H2_MAX_CONCURRENT_STREAMS);
+
+    while (true) {
+        handle_frames(h2);
+
+        while (run_streams(h2)) {
+            if (lwan_strbuf_get_length(&h2->out) >= H2_OUTPUT_FLUSH_THRESHOLD)
+                break;
+        }
+
+        flush(h2);
+
+        if ((h2->goaway_sent || h2->goaway_received) && !h2->n_streams)
+            break;
+
+        if (read_frames(h2) || has_runnable_streams(h2))
+            continue;
+
+        if (UNLIKELY(ATOMIC_READ(h2->lwan->draining)) && !h2->goaway_sent) {
+            if (UNLIKELY(!send_goaway(h2, H2_NO_ERROR)))
+                break;
+            continue;
+        }
+
+        coro_yield(conn->coro, CONN_CORO_WANT_READ);
+    }
+
+    coro_yield(conn->coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
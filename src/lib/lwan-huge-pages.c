@@ -0,0 +1,89 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "lwan-private.h"
+
+/* Large tables that are touched all over (such as the connection table,
+ * indexed by file descriptor) cost a TLB entry per 4KiB page; backing them
+ * with 2MiB pages cuts that by a factor of 512.  Pages reserved by the
+ * administrator (vm.nr_hugepages) are tried first, then transparent huge
+ * pages, which the kernel only uses for 2MiB-aligned ranges, and only if
+ * asked to when THP is in "madvise" mode. */
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+size_t lwan_huge_pages_size(size_t size)
+{
+    return (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+}
+
+void *lwan_huge_pages_alloc(size_t size)
+{
+    uintptr_t base, aligned;
+    void *ptr;
+
+    size = lwan_huge_pages_size(size);
+
+#if defined(MAP_HUGETLB)
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+        lwan_status_debug("Using %zu bytes of reserved huge pages at %p",
+                          size, ptr);
+        return ptr;
+    }
+#endif
+
+    ptr = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+        return NULL;
+
+    /* Trim the mapping so that it starts and ends at a huge page boundary. */
+    base = (uintptr_t)ptr;
+    aligned = (base + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    if (aligned > base)
+        munmap(ptr, aligned - base);
+    if (base + HUGE_PAGE_SIZE > aligned)
+        munmap((void *)(aligned + size), base + HUGE_PAGE_SIZE - aligned);
+
+#if defined(MADV_HUGEPAGE)
+    if (madvise((void *)aligned, size, MADV_HUGEPAGE) < 0) {
+        lwan_status_perror("Could not use transparent huge pages for %zu "
+                           "bytes, using regular pages",
+                           size);
+    } else {
+        lwan_status_debug("Using %zu bytes of transparent huge pages at %p",
+                          size, (void *)aligned);
+    }
+#endif
+
+    return (void *)aligned;
+}
+
+void lwan_huge_pages_free(void *ptr, size_t size)
+{
+    if (ptr)
+        munmap(ptr, lwan_huge_pages_size(size));
+}
@@ -18,25 +18,224 @@
  * USA.
  */
 
+#include <alloca.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <string.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#endif
+
 #include "lwan-io-wrappers.h"
 #include "lwan-private.h"
 
 static const int MAX_FAILED_TRIES = 5;
 
+/* Seconds a response has to be falling behind before its send rate is
+ * compared with min_send_rate; see check_send_rate(). */
+static const time_t SEND_RATE_WINDOW = 5;
+
+static ssize_t
+send_all(struct lwan_request *request, const void *buf, size_t count, int flags);
+static ssize_t
+writev_all(struct lwan_request *request, struct iovec *iov, int iov_count);
+
+/* Everything passed to the functions below is either written or the
+ * coroutine is aborted, so what's asked to be written is what's counted. */
+static ALWAYS_INLINE void count_bytes_sent(struct lwan_request *request,
+                                           size_t count)
+{
+    request->helper->bytes_sent += count;
+}
+
+static ALWAYS_INLINE size_t iov_total_len(const struct iovec *iov,
+                                          int iov_count)
+{
+    size_t total = 0;
+
+    for (int i = 0; i < iov_count; i++)
+        total += iov[i].iov_len;
+
+    return total;
+}
+
+static uint64_t send_progress(const struct lwan_request *request,
+                              const struct lwan_config *config,
+                              size_t pending)
+{
+#if defined(__linux__)
+    /* What was written might still be sitting in the socket buffer, which
+     * can be a few megabytes large; what the client has acknowledged is
+     * what it has actually read. */
+    if (config->send_rate_from_tcp_info) {
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+
+        if (!getsockopt(request->fd, IPPROTO_TCP, TCP_INFO, &info, &len) &&
+            len >= offsetof(struct tcp_info, tcpi_bytes_acked) +
+                       sizeof(info.tcpi_bytes_acked))
+            return info.tcpi_bytes_acked;
+    }
+#else
+    (void)config;
+#endif
+
+    /* Everything is counted in bytes_sent before it's written, so what's
+     * still pending in the current call hasn't been written yet. */
+    return LIKELY(request->helper->bytes_sent > pending)
+               ? request->helper->bytes_sent - pending
+               : 0;
+}
+
+/* Aborts the coroutine, freeing whatever the response holds (cache
+ * entries, buffers, the coroutine itself), if writing it has been blocking
+ * for a while and the client has been reading slower than min_send_rate.
+ * Blocking only now and then restarts the measurement, so that streams
+ * that are mostly idle aren't taken for slow clients. */
+static void check_send_rate(struct lwan_request *request,
+                            const struct lwan_config *config,
+                            size_t pending)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+    const time_t now = lwan_clock_monotonic();
+    const uint64_t progress = send_progress(request, config, pending);
+    time_t elapsed;
+
+    if (!helper->send_budget.since ||
+        now - helper->send_budget.last > SEND_RATE_WINDOW) {
+        helper->send_budget.since = helper->send_budget.last = now;
+        helper->send_budget.progress = progress;
+        return;
+    }
+
+    helper->send_budget.last = now;
+
+    elapsed = now - helper->send_budget.since;
+    if (elapsed < SEND_RATE_WINDOW)
+        return;
+    if (progress > helper->send_budget.progress &&
+        (progress - helper->send_budget.progress) / (uint64_t)elapsed >=
+            config->min_send_rate)
+        return;
+
+    lwan_status_debug("Closing connection reading %" PRIu64
+                      " bytes in %lds, slower than min_send_rate",
+                      progress - LWAN_MIN(progress, helper->send_budget.progress),
+                      (long)elapsed);
+    request->conn->thread->metrics.slow_clients++;
+    coro_yield(request->conn->coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
+
+/* Waits for the socket to be writable again, with pending bytes still to
+ * be written by the caller.  While it waits, the connection is kept in the
+ * part of the timeout queue where send_timeout applies. */
+static void wait_writable(struct lwan_request *request, size_t pending)
+{
+    struct lwan_connection *conn = request->conn;
+    const struct lwan_config *config = &conn->thread->lwan->config;
+
+    if (UNLIKELY(config->min_send_rate))
+        check_send_rate(request, config, pending);
+
+    conn->flags |= CONN_WRITE_BLOCKED;
+    coro_yield(conn->coro, CONN_CORO_WANT_WRITE);
+    conn->flags &= ~CONN_WRITE_BLOCKED;
+}
+
+/* Hints the kernel that more data follows if there are more pipelined
+ * requests in the request buffer already, as their responses follow. */
+static ALWAYS_INLINE int cork_flags(const struct lwan_request *request)
+{
+    const char *next_request = request->helper->next_request;
+
+    return (next_request && *next_request) ? MSG_MORE : 0;
+}
+
+/* Responses to pipelined requests might have been queued by lwan_response();
+ * they're sent together with whatever is written to the socket next.  The
+ * queue is detached from the request while that happens, so that writing
+ * it doesn't recurse. */
+static ALWAYS_INLINE struct lwan_strbuf *
+take_queued_responses(struct lwan_request *request)
+{
+    struct lwan_strbuf *queue = request->helper->queued_responses;
+
+    if (LIKELY(!queue || !lwan_strbuf_get_length(queue)))
+        return NULL;
+
+    request->helper->queued_responses = NULL;
+    return queue;
+}
+
+static void put_back_queued_responses(struct lwan_request *request,
+                                      struct lwan_strbuf *queue)
+{
+    lwan_strbuf_reset(queue);
+    request->helper->queued_responses = queue;
+}
+
+static ssize_t writev_with_queued_responses(struct lwan_request *request,
+                                            struct lwan_strbuf *queue,
+                                            const struct iovec *iov,
+                                            int iov_count)
+{
+    struct iovec *vec = alloca(sizeof(*vec) * (size_t)(iov_count + 1));
+    const size_t queued_len = lwan_strbuf_get_length(queue);
+    ssize_t written;
+
+    vec[0] = (struct iovec){.iov_base = lwan_strbuf_get_buffer(queue),
+                            .iov_len = queued_len};
+    memcpy(vec + 1, iov, sizeof(*iov) * (size_t)iov_count);
+
+    written = writev_all(request, vec, iov_count + 1);
+    put_back_queued_responses(request, queue);
+
+    return written - (ssize_t)queued_len;
+}
+
+void lwan_send_queued_responses(struct lwan_request *request)
+{
+    struct lwan_strbuf *queue = take_queued_responses(request);
+
+    if (UNLIKELY(queue != NULL)) {
+        /* Not corked: this is called before waiting for something else,
+         * so nothing is going to follow soon. */
+        send_all(request, lwan_strbuf_get_buffer(queue),
+                 lwan_strbuf_get_length(queue), 0);
+        put_back_queued_responses(request, queue);
+    }
+}
+
 ssize_t
 lwan_writev(struct lwan_request *request, struct iovec *iov, int iov_count)
+{
+    count_bytes_sent(request, iov_total_len(iov, iov_count));
+
+    if (UNLIKELY(request->conn->flags & CONN_IS_HTTP2_STREAM))
+        return lwan_http2_stream_writev(request, iov, iov_count);
+
+    struct lwan_strbuf *queue = take_queued_responses(request);
+    if (UNLIKELY(queue != NULL))
+        return writev_with_queued_responses(request, queue, iov, iov_count);
+
+    return writev_all(request, iov, iov_count);
+}
+
+static ssize_t
+writev_all(struct lwan_request *request, struct iovec *iov, int iov_count)
 {
     ssize_t total_written = 0;
     int curr_iov = 0;
-    int flags = (request->conn->flags & CONN_CORK) ? MSG_MORE : 0;
+    const int flags = cork_flags(request);
 
     for (int tries = MAX_FAILED_TRIES; tries;) {
         const int remaining_len = (int)(iov_count - curr_iov);
@@ -44,7 +243,8 @@ lwan_writev(struct lwan_request *request, struct iovec *iov, int iov_count)
 
         if (remaining_len == 1) {
             const struct iovec *vec = &iov[curr_iov];
-            return lwan_send(request, vec->iov_base, vec->iov_len, flags);
+            return total_written +
+                   send_all(request, vec->iov_base, vec->iov_len, flags);
         }
 
         if (flags) {
@@ -63,6 +263,8 @@ lwan_writev(struct lwan_request *request, struct iovec *iov, int iov_count)
 
             switch (errno) {
             case EAGAIN:
+                lwan_connection_clear_ready(request->conn, CONN_READY_WRITE);
+                goto try_again;
             case EINTR:
                 goto try_again;
             default:
@@ -83,9 +285,11 @@ lwan_writev(struct lwan_request *request, struct iovec *iov, int iov_count)
 
         iov[curr_iov].iov_base = (char *)iov[curr_iov].iov_base + written;
         iov[curr_iov].iov_len -= (size_t)written;
+        lwan_connection_clear_ready(request->conn, CONN_READY_WRITE);
 
     try_again:
-        coro_yield(request->conn->coro, CONN_CORO_WANT_WRITE);
+        wait_writable(request,
+                      iov_total_len(iov + curr_iov, iov_count - curr_iov));
     }
 
 out:
@@ -93,12 +297,157 @@ out:
     __builtin_unreachable();
 }
 
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+/* The kernel posts a notification to the socket error queue once it's done
+ * with the memory given to sendmsg(MSG_ZEROCOPY); notifications for
+ * consecutive calls are coalesced into a range.  A non-empty error queue
+ * is signaled with EPOLLERR, which resumes the connection even while it's
+ * suspended. */
+static void wait_zerocopy_completions(struct lwan_request *request,
+                                      uint32_t pending)
+{
+    struct lwan_connection *conn = request->conn;
+
+    while (pending) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                                sizeof(struct sockaddr_in6))];
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+
+        if (recvmsg(request->fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                coro_yield(conn->coro, CONN_CORO_SUSPEND);
+                /* Resumed by epoll rather than by lwan_thread_resume() */
+                conn->flags &= ~CONN_SUSPENDED;
+                continue;
+            }
+
+            coro_yield(conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            const struct sock_extended_err *err;
+            uint32_t completed;
+
+            if (!(cmsg->cmsg_level == SOL_IP &&
+                  cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 &&
+                  cmsg->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            err = (const struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno)
+                continue;
+
+            completed = err->ee_data - err->ee_info + 1;
+            pending = completed >= pending ? 0 : pending - completed;
+        }
+    }
+}
+
+/* Like lwan_writev(), but the kernel references the memory in the vector
+ * instead of copying it to the socket buffer.  This function only returns
+ * once the kernel is done with it, so it can be released or modified
+ * afterwards (e.g. by unreferencing the cache entry it belongs to).
+ * Pinning pages and waiting for the notification costs more than copying
+ * small buffers, so callers should only use this for large ones. */
+ssize_t lwan_writev_zerocopy(struct lwan_request *request,
+                             struct iovec *iov,
+                             int iov_count)
+{
+    static const int one = 1;
+    ssize_t total_written = 0;
+    uint32_t pending = 0;
+    int curr_iov = 0;
+
+    if (UNLIKELY(request->conn->flags & (CONN_IS_HTTP2_STREAM | CONN_TLS)))
+        return lwan_writev(request, iov, iov_count);
+    if (setsockopt(request->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+        return lwan_writev(request, iov, iov_count);
+
+    count_bytes_sent(request, iov_total_len(iov, iov_count));
+    lwan_send_queued_responses(request);
+
+    for (int tries = MAX_FAILED_TRIES; tries;) {
+        struct msghdr hdr = {
+            .msg_iov = iov + curr_iov,
+            .msg_iovlen = (size_t)(iov_count - curr_iov),
+        };
+        ssize_t written =
+            sendmsg(request->fd, &hdr, MSG_ZEROCOPY | cork_flags(request));
+
+        if (UNLIKELY(written < 0)) {
+            tries--;
+
+            switch (errno) {
+            case ENOBUFS:
+                /* Out of memory to pin pages; copy whatever is left. */
+                total_written +=
+                    writev_all(request, iov + curr_iov, iov_count - curr_iov);
+                goto out;
+            case EAGAIN:
+                lwan_connection_clear_ready(request->conn, CONN_READY_WRITE);
+                goto try_again;
+            case EINTR:
+                goto try_again;
+            default:
+                coro_yield(request->conn->coro, CONN_CORO_ABORT);
+                __builtin_unreachable();
+            }
+        }
+
+        total_written += written;
+        pending++;
+
+        while (curr_iov < iov_count &&
+               written >= (ssize_t)iov[curr_iov].iov_len) {
+            written -= (ssize_t)iov[curr_iov].iov_len;
+            curr_iov++;
+        }
+
+        if (curr_iov == iov_count)
+            goto out;
+
+        iov[curr_iov].iov_base = (char *)iov[curr_iov].iov_base + written;
+        iov[curr_iov].iov_len -= (size_t)written;
+        lwan_connection_clear_ready(request->conn, CONN_READY_WRITE);
+
+    try_again:
+        wait_writable(request,
+                      iov_total_len(iov + curr_iov, iov_count - curr_iov));
+    }
+
+    coro_yield(request->conn->coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+
+out:
+    wait_zerocopy_completions(request, pending);
+    return total_written;
+}
+#else
+ssize_t lwan_writev_zerocopy(struct lwan_request *request,
+                             struct iovec *iov,
+                             int iov_count)
+{
+    return lwan_writev(request, iov, iov_count);
+}
+#endif
+
 ssize_t
 lwan_readv(struct lwan_request *request, struct iovec *iov, int iov_count)
 {
     ssize_t total_bytes_read = 0;
     int curr_iov = 0;
 
+    /* The socket belongs to the HTTP/2 connection; the whole request body
+     * is in the request buffer already. */
+    if (UNLIKELY(request->conn->flags & CONN_IS_HTTP2_STREAM))
+        goto out;
+
     for (int tries = MAX_FAILED_TRIES; tries;) {
         ssize_t bytes_read =
             readv(request->fd, iov + curr_iov, iov_count - curr_iov);
@@ -108,6 +457,8 @@ lwan_readv(struct lwan_request *request, struct iovec *iov, int iov_count)
 
             switch (errno) {
             case EAGAIN:
+                lwan_connection_clear_ready(request->conn, CONN_READY_READ);
+                goto try_again;
             case EINTR:
                 goto try_again;
             default:
@@ -128,6 +479,7 @@ lwan_readv(struct lwan_request *request, struct iovec *iov, int iov_count)
 
         iov[curr_iov].iov_base = (char *)iov[curr_iov].iov_base + bytes_read;
         iov[curr_iov].iov_len -= (size_t)bytes_read;
+        lwan_connection_clear_ready(request->conn, CONN_READY_READ);
 
     try_again:
         coro_yield(request->conn->coro, CONN_CORO_WANT_READ);
@@ -143,18 +495,37 @@ ssize_t lwan_send(struct lwan_request *request,
                   size_t count,
                   int flags)
 {
-    ssize_t total_sent = 0;
+    count_bytes_sent(request, count);
 
-    if (request->conn->flags & CONN_CORK)
-        flags |= MSG_MORE;
+    if (UNLIKELY(request->conn->flags & CONN_IS_HTTP2_STREAM)) {
+        const struct iovec vec = {.iov_base = (void *)buf, .iov_len = count};
+        return lwan_http2_stream_writev(request, &vec, 1);
+    }
+
+    struct lwan_strbuf *queue = take_queued_responses(request);
+    if (UNLIKELY(queue != NULL)) {
+        const struct iovec vec = {.iov_base = (void *)buf, .iov_len = count};
+        return writev_with_queued_responses(request, queue, &vec, 1);
+    }
+
+    return send_all(request, buf, count, flags | cork_flags(request));
+}
+
+static ssize_t
+send_all(struct lwan_request *request, const void *buf, size_t count, int flags)
+{
+    ssize_t total_sent = 0;
 
     for (int tries = MAX_FAILED_TRIES; tries;) {
-        ssize_t written = send(request->fd, buf, count, flags);
+        ssize_t written =
+            send(request->fd, buf, count - (size_t)total_sent, flags);
         if (UNLIKELY(written < 0)) {
             tries--;
 
             switch (errno) {
             case EAGAIN:
+                lwan_connection_clear_ready(request->conn, CONN_READY_WRITE);
+                goto try_again;
             case EINTR:
                 goto try_again;
             default:
@@ -167,9 +538,10 @@ ssize_t lwan_send(struct lwan_request *request,
             return total_sent;
         if ((size_t)total_sent < count)
             buf = (char *)buf + written;
+        lwan_connection_clear_ready(request->conn, CONN_READY_WRITE);
 
     try_again:
-        coro_yield(request->conn->coro, CONN_CORO_WANT_WRITE);
+        wait_writable(request, count - (size_t)total_sent);
     }
 
 out:
@@ -182,15 +554,21 @@ lwan_recv(struct lwan_request *request, void *buf, size_t count, int flags)
 {
     ssize_t total_recv = 0;
 
+    if (UNLIKELY(request->conn->flags & CONN_IS_HTTP2_STREAM))
+        goto out;
+
     for (int tries = MAX_FAILED_TRIES; tries;) {
-        ssize_t recvd = recv(request->fd, buf, count, flags);
+        ssize_t recvd =
+            recv(request->fd, buf, count - (size_t)total_recv, flags);
         if (UNLIKELY(recvd < 0)) {
             tries--;
 
             switch (errno) {
             case EAGAIN:
-                if (flags & MSG_DONTWAIT)
-                    return total_recv;
+                lwan_connection_clear_ready(request->conn, CONN_READY_READ);
+                /* Once part of it has been received, wait for the rest. */
+                if ((flags & MSG_DONTWAIT) && !total_recv)
+                    return 0;
                 /* Fallthrough */
             case EINTR:
                 goto try_again;
@@ -204,6 +582,7 @@ lwan_recv(struct lwan_request *request, void *buf, size_t count, int flags)
             return total_recv;
         if ((size_t)total_recv < count)
             buf = (char *)buf + recvd;
+        lwan_connection_clear_ready(request->conn, CONN_READY_READ);
 
     try_again:
         coro_yield(request->conn->coro, CONN_CORO_WANT_READ);
@@ -222,16 +601,25 @@ void lwan_sendfile(struct lwan_request *request,
                    const char *header,
                    size_t header_len)
 {
+    if (UNLIKELY(request->conn->flags & CONN_IS_HTTP2_STREAM)) {
+        count_bytes_sent(request, header_len + count);
+        return lwan_http2_stream_sendfile(request, in_fd, offset, count,
+                                          header, header_len);
+    }
+
     size_t chunk_size = LWAN_MIN(count, 1ul << 17);
     size_t to_be_written = count;
 
     lwan_send(request, header, header_len, MSG_MORE);
+    count_bytes_sent(request, count);
 
     while (true) {
         ssize_t written = sendfile(request->fd, in_fd, &offset, chunk_size);
         if (written < 0) {
             switch (errno) {
             case EAGAIN:
+                lwan_connection_clear_ready(request->conn, CONN_READY_WRITE);
+                goto try_again;
             case EINTR:
                 goto try_again;
             default:
@@ -243,12 +631,14 @@ void lwan_sendfile(struct lwan_request *request,
         to_be_written -= (size_t)written;
         if (!to_be_written)
             break;
+        if ((size_t)written < chunk_size)
+            lwan_connection_clear_ready(request->conn, CONN_READY_WRITE);
 
         chunk_size = LWAN_MIN(to_be_written, 1ul << 19);
         lwan_readahead_queue(in_fd, offset, chunk_size);
 
     try_again:
-        coro_yield(request->conn->coro, CONN_CORO_WANT_WRITE);
+        wait_writable(request, to_be_written);
     }
 }
 #elif defined(__FreeBSD__) || defined(__APPLE__)
@@ -259,15 +649,24 @@ void lwan_sendfile(struct lwan_request *request,
                    const char *header,
                    size_t header_len)
 {
+    if (UNLIKELY(request->conn->flags & CONN_IS_HTTP2_STREAM)) {
+        count_bytes_sent(request, header_len + count);
+        return lwan_http2_stream_sendfile(request, in_fd, offset, count,
+                                          header, header_len);
+    }
+
     struct sf_hdtr headers = {.headers =
                                   (struct iovec[]){{.iov_base = (void *)header,
                                                     .iov_len = header_len}},
                               .hdr_cnt = 1};
     off_t sbytes = (off_t)count;
 
+    count_bytes_sent(request, header_len + count);
+    lwan_send_queued_responses(request);
+
     if (!count) {
         /* FreeBSD's sendfile() won't send the headers when count is 0. Why? */
-        return (void)lwan_writev(request, headers.headers, headers.hdr_cnt);
+        return (void)writev_all(request, headers.headers, headers.hdr_cnt);
     }
 
     while (true) {
@@ -283,6 +682,8 @@ void lwan_sendfile(struct lwan_request *request,
         if (UNLIKELY(r < 0)) {
             switch (errno) {
             case EAGAIN:
+                lwan_connection_clear_ready(request->conn, CONN_READY_WRITE);
+                /* Fallthrough */
             case EBUSY:
             case EINTR:
                 goto try_again;
@@ -297,7 +698,7 @@ void lwan_sendfile(struct lwan_request *request,
             break;
 
     try_again:
-        coro_yield(request->conn->coro, CONN_CORO_WANT_WRITE);
+        wait_writable(request, count);
     }
 }
 #else
@@ -345,6 +746,12 @@ void lwan_sendfile(struct lwan_request *request,
                    const char *header,
                    size_t header_len)
 {
+    if (UNLIKELY(request->conn->flags & CONN_IS_HTTP2_STREAM)) {
+        count_bytes_sent(request, header_len + count);
+        return lwan_http2_stream_sendfile(request, in_fd, offset, count,
+                                          header, header_len);
+    }
+
     unsigned char buffer[512];
 
     lwan_send(request, header, header_len, MSG_MORE);
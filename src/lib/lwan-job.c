@@ -25,42 +25,128 @@
 #include <sched.h>
 #include <stdbool.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "lwan-private.h"
 #include "lwan-status.h"
 #include "list.h"
 
+/* Jobs are kept in a list, rather than in a heap ordered by deadline, as
+ * there are rarely more than a few dozen of them (one per cache, mostly);
+ * workers go through it to find the next job to run.  Jobs run without
+ * any lock held, so a slow one doesn't delay others, and each job runs in
+ * a single worker at a time.
+ *
+ * How often a job runs depends on its own history: it runs again after
+ * its minimum interval if it had something to do, and backs off towards
+ * its maximum interval otherwise.  Jobs can also be woken up explicitly
+ * (e.g. when a cache goes over its budget). */
+
+#define DEFAULT_MIN_INTERVAL_MS 1000
+#define DEFAULT_MAX_INTERVAL_MS 16000
+
 struct job {
     struct list_node jobs;
     bool (*cb)(void *data);
     void *data;
+    struct lwan_job_stats stats;
+    unsigned int min_interval_ms;
+    unsigned int max_interval_ms;
+    uint64_t next_run_us;
+    bool running;
+    bool woken_while_running;
+    bool deleted;
 };
 
-static pthread_t self;
+static pthread_t *workers;
+static unsigned int n_workers;
 static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_wait_cond;
+static pthread_cond_t job_done_cond;
 static bool running = false;
 static struct list_head jobs;
 
-static pthread_mutex_t job_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t job_wait_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t clock_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
 
-static void
-timedwait(bool had_job)
+static void wait_until(uint64_t deadline_us)
 {
-    static int secs = 1;
-    struct timeval now;
+    struct timespec deadline = {
+        .tv_sec = (time_t)(deadline_us / 1000000),
+        .tv_nsec = (long)(deadline_us % 1000000) * 1000,
+    };
+
+    pthread_cond_timedwait(&job_wait_cond, &queue_mutex, &deadline);
+}
+
+/* Called with the queue lock held. */
+static struct job *next_job(void)
+{
+    struct job *job, *next = NULL;
+
+    list_for_each (&jobs, job, jobs) {
+        if (job->running || job->deleted)
+            continue;
+        if (!next || job->next_run_us < next->next_run_us)
+            next = job;
+    }
+
+    return next;
+}
+
+/* Called with the queue lock held; releases it while the job runs. */
+static void run_job(struct job *job, uint64_t now)
+{
+    uint64_t start, elapsed;
+    bool had_job;
+
+    if (now - job->next_run_us > job->stats.max_delay_us)
+        job->stats.max_delay_us = now - job->next_run_us;
+    job->running = true;
+
+    pthread_mutex_unlock(&queue_mutex);
+
+    start = clock_us();
+    had_job = job->cb(job->data);
+    elapsed = clock_us() - start;
+
+    pthread_mutex_lock(&queue_mutex);
+
+    job->running = false;
+    job->stats.runs++;
+    job->stats.runtime_us += elapsed;
+    job->stats.last_runtime_us = elapsed;
+    if (elapsed > job->stats.max_runtime_us)
+        job->stats.max_runtime_us = elapsed;
+
+    if (job->deleted) {
+        pthread_cond_broadcast(&job_done_cond);
+        return;
+    }
 
-    if (had_job)
-        secs = 1;
-    else if (secs <= 15)
-        secs++;
+    if (had_job) {
+        job->stats.interval_ms = job->min_interval_ms;
+    } else {
+        job->stats.interval_ms =
+            LWAN_MIN(job->stats.interval_ms * 2, job->max_interval_ms);
+    }
 
-    gettimeofday(&now, NULL);
+    if (job->woken_while_running) {
+        job->woken_while_running = false;
+        job->next_run_us = start + elapsed;
+    } else {
+        job->next_run_us = start + elapsed + job->stats.interval_ms * 1000ull;
+    }
 
-    struct timespec rgtp = { now.tv_sec + secs, now.tv_usec * 1000 };
-    pthread_cond_timedwait(&job_wait_cond, &job_wait_mutex, &rgtp);
+    /* Workers that found every job running wait for one to finish. */
+    pthread_cond_signal(&job_wait_cond);
 }
 
 static void*
@@ -73,80 +159,119 @@ job_thread(void *data __attribute__((unused)))
 
     lwan_set_thread_name("job");
 
-    if (pthread_mutex_lock(&job_wait_mutex))
-        lwan_status_critical("Could not lock job wait mutex");
-    
-    while (running) {
-        bool had_job = false;
+    if (pthread_mutex_lock(&queue_mutex))
+        lwan_status_critical("Could not lock job queue mutex");
 
-        if (LIKELY(!pthread_mutex_lock(&queue_mutex))) {
-            struct job *job;
+    while (running) {
+        struct job *job = next_job();
+        uint64_t now;
 
-            list_for_each(&jobs, job, jobs)
-                had_job |= job->cb(job->data);
+        if (!job) {
+            pthread_cond_wait(&job_wait_cond, &queue_mutex);
+            continue;
+        }
 
-            pthread_mutex_unlock(&queue_mutex);
+        now = clock_us();
+        if (job->next_run_us > now) {
+            wait_until(job->next_run_us);
+            continue;
         }
 
-        timedwait(had_job);
+        run_job(job, now);
     }
 
-    if (pthread_mutex_unlock(&job_wait_mutex))
-        lwan_status_critical("Could not lock job wait mutex");
+    if (pthread_mutex_unlock(&queue_mutex))
+        lwan_status_critical("Could not unlock job queue mutex");
 
     return NULL;
 }
 
 void lwan_job_thread_init(void)
 {
-    assert(!running);
+    pthread_condattr_t attr;
+    long n_cpus;
 
-    lwan_status_debug("Initializing low priority job thread");
+    assert(!running);
 
     list_head_init(&jobs);
 
+    if (pthread_condattr_init(&attr) ||
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) ||
+        pthread_cond_init(&job_wait_cond, &attr) ||
+        pthread_cond_init(&job_done_cond, NULL))
+        lwan_status_critical("Could not initialize job condition variables");
+    pthread_condattr_destroy(&attr);
+
+    n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n_workers = (unsigned int)LWAN_MIN(LWAN_MAX(n_cpus / 4, 2l), 4l);
+    workers = calloc(n_workers, sizeof(*workers));
+    if (!workers)
+        lwan_status_critical_perror("calloc");
+
+    lwan_status_debug("Initializing %u low priority job threads", n_workers);
+
     running = true;
-    if (pthread_create(&self, NULL, job_thread, NULL) < 0)
-        lwan_status_critical_perror("pthread_create");
+    for (unsigned int i = 0; i < n_workers; i++) {
+        if (pthread_create(&workers[i], NULL, job_thread, NULL))
+            lwan_status_critical_perror("pthread_create");
 
 #ifdef SCHED_IDLE
-    struct sched_param sched_param = {
-        .sched_priority = 0
-    };
-    if (pthread_setschedparam(self, SCHED_IDLE, &sched_param) < 0)
-        lwan_status_perror("pthread_setschedparam");
+        struct sched_param sched_param = {
+            .sched_priority = 0
+        };
+        if (pthread_setschedparam(workers[i], SCHED_IDLE, &sched_param) < 0)
+            lwan_status_perror("pthread_setschedparam");
 #endif  /* SCHED_IDLE */
+    }
 }
 
 void lwan_job_thread_shutdown(void)
 {
-    lwan_status_debug("Shutting down job thread");
+    struct job *node, *next;
 
-    if (LIKELY(!pthread_mutex_lock(&queue_mutex))) {
-        struct job *node, *next;
-        int r;
+    lwan_status_debug("Shutting down job threads");
 
-        list_for_each_safe(&jobs, node, next, jobs) {
-            list_del(&node->jobs);
-            free(node);
-        }
-        running = false;
+    pthread_mutex_lock(&queue_mutex);
+    running = false;
+    pthread_cond_broadcast(&job_wait_cond);
+    pthread_mutex_unlock(&queue_mutex);
 
-        pthread_cond_signal(&job_wait_cond);
+    for (unsigned int i = 0; i < n_workers; i++) {
+        int r = pthread_join(workers[i], NULL);
 
-        r = pthread_join(self, NULL);
         if (r) {
             errno = r;
             lwan_status_perror("pthread_join");
         }
+    }
 
-        pthread_mutex_unlock(&queue_mutex);
+    list_for_each_safe(&jobs, node, next, jobs) {
+        list_del(&node->jobs);
+        free(node);
     }
+
+    free(workers);
+    workers = NULL;
+    n_workers = 0;
+
+    pthread_cond_destroy(&job_wait_cond);
+    pthread_cond_destroy(&job_done_cond);
 }
 
-void lwan_job_add(bool (*cb)(void *data), void *data)
+#if defined(__linux__)
+void lwan_job_thread_set_affinity(const cpu_set_t *set)
+{
+    for (unsigned int i = 0; i < n_workers; i++) {
+        if (pthread_setaffinity_np(workers[i], sizeof(*set), set))
+            lwan_status_warning("Could not set affinity for job thread");
+    }
+}
+#endif
+
+void lwan_job_add(bool (*cb)(void *data), void *data, const char *name)
 {
     assert(cb);
+    assert(name);
 
     struct job *job = calloc(1, sizeof(*job));
     if (!job)
@@ -154,9 +279,15 @@ void lwan_job_add(bool (*cb)(void *data), void *data)
 
     job->cb = cb;
     job->data = data;
+    job->stats.name = name;
+    job->stats.interval_ms = DEFAULT_MIN_INTERVAL_MS;
+    job->min_interval_ms = DEFAULT_MIN_INTERVAL_MS;
+    job->max_interval_ms = DEFAULT_MAX_INTERVAL_MS;
+    job->next_run_us = clock_us() + DEFAULT_MIN_INTERVAL_MS * 1000ull;
 
     if (LIKELY(!pthread_mutex_lock(&queue_mutex))) {
         list_add(&jobs, &job->jobs);
+        pthread_cond_signal(&job_wait_cond);
         pthread_mutex_unlock(&queue_mutex);
     } else {
         lwan_status_warning("Couldn't lock job mutex");
@@ -164,6 +295,8 @@ void lwan_job_add(bool (*cb)(void *data), void *data)
     }
 }
 
+/* Once this returns, the job isn't running anymore, and won't run again.
+ * Must not be called by the job itself. */
 void lwan_job_del(bool (*cb)(void *data), void *data)
 {
     struct job *node, *next;
@@ -172,11 +305,112 @@ void lwan_job_del(bool (*cb)(void *data), void *data)
 
     if (LIKELY(!pthread_mutex_lock(&queue_mutex))) {
         list_for_each_safe(&jobs, node, next, jobs) {
-            if (cb == node->cb && data == node->data) {
-                list_del(&node->jobs);
-                free(node);
+            if (cb == node->cb && data == node->data)
+                node->deleted = true;
+        }
+        list_for_each_safe(&jobs, node, next, jobs) {
+            if (!node->deleted)
+                continue;
+            while (node->running)
+                pthread_cond_wait(&job_done_cond, &queue_mutex);
+            list_del(&node->jobs);
+            free(node);
+        }
+        pthread_mutex_unlock(&queue_mutex);
+    }
+}
+
+/* The name isn't copied, so it must outlive the job. */
+void lwan_job_set_name(bool (*cb)(void *data), void *data, const char *name)
+{
+    struct job *job;
+
+    assert(cb);
+    assert(name);
+
+    if (LIKELY(!pthread_mutex_lock(&queue_mutex))) {
+        list_for_each (&jobs, job, jobs) {
+            if (cb == job->cb && data == job->data)
+                job->stats.name = name;
+        }
+        pthread_mutex_unlock(&queue_mutex);
+    }
+}
+
+/* Jobs run again after min_ms if they had something to do, backing off
+ * exponentially up to max_ms otherwise. */
+void lwan_job_set_interval(bool (*cb)(void *data),
+                           void *data,
+                           unsigned int min_ms,
+                           unsigned int max_ms)
+{
+    struct job *job;
+
+    assert(cb);
+    assert(min_ms > 0 && min_ms <= max_ms);
+
+    if (LIKELY(!pthread_mutex_lock(&queue_mutex))) {
+        list_for_each (&jobs, job, jobs) {
+            if (cb != job->cb || data != job->data)
+                continue;
+
+            job->min_interval_ms = min_ms;
+            job->max_interval_ms = max_ms;
+            if (!job->running) {
+                uint64_t next_run_us = clock_us() + min_ms * 1000ull;
+
+                job->stats.interval_ms = min_ms;
+                if (next_run_us < job->next_run_us)
+                    job->next_run_us = next_run_us;
             }
         }
+        pthread_cond_broadcast(&job_wait_cond);
+        pthread_mutex_unlock(&queue_mutex);
+    }
+}
+
+/* Makes the job run as soon as a worker is available; if it's running
+ * already, it'll run again once it's done. */
+void lwan_job_wakeup(bool (*cb)(void *data), void *data)
+{
+    struct job *job;
+
+    assert(cb);
+
+    if (LIKELY(!pthread_mutex_lock(&queue_mutex))) {
+        list_for_each (&jobs, job, jobs) {
+            if (cb != job->cb || data != job->data)
+                continue;
+
+            job->stats.wakeups++;
+            if (job->running)
+                job->woken_while_running = true;
+            else
+                job->next_run_us = clock_us();
+        }
+        pthread_cond_signal(&job_wait_cond);
         pthread_mutex_unlock(&queue_mutex);
     }
 }
+
+bool lwan_job_stats_for_each(bool (*cb)(const struct lwan_job_stats *stats,
+                                        void *data),
+                             void *data)
+{
+    struct job *job;
+    bool ret = true;
+
+    if (UNLIKELY(pthread_mutex_lock(&queue_mutex)))
+        return false;
+
+    list_for_each (&jobs, job, jobs) {
+        if (!cb(&job->stats, data)) {
+            ret = false;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&queue_mutex);
+
+    return ret;
+}
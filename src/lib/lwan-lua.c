@@ -330,11 +330,10 @@ const char *lwan_lua_state_last_error(lua_State *L)
     return lua_tostring(L, -1);
 }
 
-lua_State *lwan_lua_create_state(const char *script_file, const char *script)
+static lua_State *new_state(void)
 {
-    lua_State *L;
+    lua_State *L = luaL_newstate();
 
-    L = luaL_newstate();
     if (UNLIKELY(!L))
         return NULL;
 
@@ -344,6 +343,17 @@ lua_State *lwan_lua_create_state(const char *script_file, const char *script)
     luaL_register(L, NULL, lwan_lua_method_array_get_array(&lua_methods));
     lua_setfield(L, -1, "__index");
 
+    return L;
+}
+
+lua_State *lwan_lua_create_state(const char *script_file, const char *script)
+{
+    lua_State *L;
+
+    L = new_state();
+    if (UNLIKELY(!L))
+        return NULL;
+
     if (script_file) {
         if (UNLIKELY(luaL_dofile(L, script_file) != 0)) {
             lwan_status_error("Error opening Lua script %s: %s", script_file,
@@ -368,6 +378,74 @@ close_lua_state:
     return NULL;
 }
 
+static int append_bytecode(lua_State *L __attribute__((unused)),
+                           const void *p,
+                           size_t sz,
+                           void *ud)
+{
+    return lwan_strbuf_append_str(ud, p, sz) ? 0 : 1;
+}
+
+bool lwan_lua_compile_script(const char *script_file,
+                             const char *script,
+                             struct lwan_strbuf *bytecode)
+{
+    /* Compiling doesn't need any library, so don't bother with them. */
+    lua_State *L = luaL_newstate();
+    bool ret = false;
+
+    if (UNLIKELY(!L))
+        return false;
+
+    if (script_file) {
+        if (UNLIKELY(luaL_loadfile(L, script_file) != 0)) {
+            lwan_status_error("Error opening Lua script %s: %s", script_file,
+                              lua_tostring(L, -1));
+            goto out;
+        }
+    } else if (script) {
+        if (UNLIKELY(luaL_loadstring(L, script) != 0)) {
+            lwan_status_error("Error compiling Lua script %s",
+                              lua_tostring(L, -1));
+            goto out;
+        }
+    } else {
+        lwan_status_error("Either file or inline script has to be provided");
+        goto out;
+    }
+
+    if (UNLIKELY(lua_dump(L, append_bytecode, bytecode) != 0)) {
+        lwan_status_error("Could not dump bytecode for Lua script");
+        goto out;
+    }
+
+    ret = true;
+
+out:
+    lua_close(L);
+    return ret;
+}
+
+lua_State *lwan_lua_create_state_from_bytecode(const char *bytecode,
+                                               size_t len)
+{
+    lua_State *L = new_state();
+
+    if (UNLIKELY(!L))
+        return NULL;
+
+    /* The chunk name is only used for source code; the bytecode carries
+     * the name the script was compiled with. */
+    if (UNLIKELY(luaL_loadbuffer(L, bytecode, len, "=bytecode") != 0 ||
+                 lua_pcall(L, 0, 0, 0) != 0)) {
+        lwan_status_error("Error running Lua script: %s", lua_tostring(L, -1));
+        lua_close(L);
+        return NULL;
+    }
+
+    return L;
+}
+
 void lwan_lua_state_push_request(lua_State *L, struct lwan_request *request)
 {
     struct lwan_request **userdata =
@@ -20,10 +20,21 @@
 #pragma once
 
 #include <lua.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 const char *lwan_lua_state_last_error(lua_State *L);
 lua_State *lwan_lua_create_state(const char *script_file, const char *script);
 
+/* Scripts can be compiled once and have their bytecode loaded by as many
+ * states as needed, without reading or parsing the script again. */
+struct lwan_strbuf;
+bool lwan_lua_compile_script(const char *script_file,
+                             const char *script,
+                             struct lwan_strbuf *bytecode);
+lua_State *lwan_lua_create_state_from_bytecode(const char *bytecode,
+                                               size_t len);
+
 void lwan_lua_state_push_request(lua_State *L, struct lwan_request *request);
 
 struct lwan_request;
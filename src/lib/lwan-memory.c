@@ -0,0 +1,71 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* Lightweight accounting of the memory used by a few subsystems, so that
+ * growth of the resident set size can be attributed to one of them.  I/O
+ * threads update counters of their own without atomic operations (see
+ * lwan_memory_account()); since memory allocated by a thread is often
+ * freed by another, only the sum over all threads makes sense. */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdint.h>
+
+#include "lwan-private.h"
+
+__thread int64_t *lwan_memory_counters;
+
+/* Memory accounted for by threads other than the I/O threads (e.g. the
+ * main thread while loading the configuration, or the job thread). */
+int64_t lwan_memory_unattributed[LWAN_MEMORY_N_SUBSYSTEMS];
+
+void lwan_memory_thread_init(int64_t *counters)
+{
+    lwan_memory_counters = counters;
+}
+
+int64_t lwan_memory_get(const struct lwan *l,
+                        enum lwan_memory_subsystem subsystem)
+{
+    int64_t total = ATOMIC_READ(lwan_memory_unattributed[subsystem]);
+
+    for (unsigned int i = 0; i < l->thread.count; i++)
+        total += ATOMIC_READ(l->thread.threads[i].metrics.memory[subsystem]);
+
+    /* Counters are read one after the other while being updated, so a
+     * free might be seen without the allocation that preceded it. */
+    return LWAN_MAX(total, 0);
+}
+
+const char *lwan_memory_subsystem_name(enum lwan_memory_subsystem subsystem)
+{
+    static const char *names[] = {
+        [LWAN_MEMORY_CORO_STACKS] = "coroutine_stacks",
+        [LWAN_MEMORY_STRBUFS] = "strbufs",
+        [LWAN_MEMORY_PUBSUB] = "pubsub",
+        [LWAN_MEMORY_WEBSOCKETS] = "websockets",
+        [LWAN_MEMORY_LUA] = "lua",
+    };
+
+    static_assert(N_ELEMENTS(names) == LWAN_MEMORY_N_SUBSYSTEMS,
+                  "Every subsystem has a name");
+
+    return names[subsystem];
+}
@@ -0,0 +1,704 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "lwan-cache.h"
+#include "lwan-mod-cache-peers.h"
+#include "lwan-upstream.h"
+#include "murmur3.h"
+
+/* Groupcache-style cache fill: every key of a cache is owned by one of the
+ * instances in the group, picked with consistent hashing, so that adding
+ * or removing an instance only moves the keys it owns.  An instance
+ * creating an entry for a key it doesn't own first asks the owner for it,
+ * through the handler in this module, so that the owner builds it once
+ * for the whole group.  If the owner can't be reached, or doesn't have
+ * it, the entry is created locally as usual.
+ *
+ * Peers are only asked by the cache entry creation threads, over blocking
+ * keep-alive connections with a short timeout; I/O threads never wait on
+ * them. */
+
+#define RING_POINTS_PER_PEER 64
+#define MAX_HEAD_SIZE 4096
+#define MAX_ENTRY_SIZE (64 * 1024 * 1024)
+
+struct peer {
+    char *name;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    pthread_mutex_t lock;
+    int *idle;
+    unsigned int n_idle;
+
+    /* Not asked for anything until then, after failing.  Updated without
+     * locks, like the health checks of upstreams. */
+    time_t down_until;
+};
+
+struct ring_point {
+    uint64_t hash;
+    size_t peer;
+};
+
+struct cache_peers {
+    struct peer *peers;
+    size_t n_peers;
+    size_t self;
+
+    struct ring_point *ring;
+    size_t n_points;
+
+    char *prefix;
+    int timeout_ms;
+    unsigned int max_idle;
+    time_t fail_timeout;
+};
+
+/* Only one group per process: caches don't know about modules, so they
+ * ask whatever group has been configured. */
+static struct {
+    pthread_rwlock_t lock;
+    struct cache_peers *group;
+} current = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+
+static uint64_t key_hash(const char *cache_name, const char *key)
+{
+    /* Must be the same in every instance, so no random seeds here. */
+    return murmur3_64(key, strlen(key), 0) ^
+           murmur3_64(cache_name, strlen(cache_name), 1);
+}
+
+static int ring_point_cmp(const void *a, const void *b)
+{
+    const struct ring_point *pa = a, *pb = b;
+
+    if (pa->hash < pb->hash)
+        return -1;
+    if (pa->hash > pb->hash)
+        return 1;
+    /* Same order everywhere even if two points collide. */
+    return pa->peer < pb->peer ? -1 : pa->peer > pb->peer;
+}
+
+static size_t owner_of(const struct cache_peers *group, uint64_t hash)
+{
+    size_t lo = 0, hi = group->n_points;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (group->ring[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return group->ring[lo == group->n_points ? 0 : lo].peer;
+}
+
+static bool build_ring(struct cache_peers *group)
+{
+    group->n_points = group->n_peers * RING_POINTS_PER_PEER;
+    group->ring = calloc(group->n_points, sizeof(*group->ring));
+    if (!group->ring)
+        return false;
+
+    for (size_t i = 0; i < group->n_peers; i++) {
+        const char *name = group->peers[i].name;
+
+        for (uint32_t j = 0; j < RING_POINTS_PER_PEER; j++) {
+            group->ring[i * RING_POINTS_PER_PEER + j] = (struct ring_point){
+                .hash = murmur3_64(name, strlen(name), j),
+                .peer = i,
+            };
+        }
+    }
+
+    qsort(group->ring, group->n_points, sizeof(*group->ring), ring_point_cmp);
+    return true;
+}
+
+static bool parse_peer(struct peer *peer, const char *spec)
+{
+    struct addrinfo *result;
+    char *copy = strdupa(spec);
+    char *host = copy, *port;
+    int ret;
+
+    if (*host == '[') {
+        char *bracket = strchr(++host, ']');
+
+        if (!bracket || bracket[1] != ':')
+            goto invalid;
+        *bracket = '\0';
+        port = bracket + 2;
+    } else {
+        port = strrchr(host, ':');
+        if (!port)
+            goto invalid;
+        *port++ = '\0';
+    }
+    if (!*host || !*port)
+        goto invalid;
+
+    ret = getaddrinfo(host, port,
+                      &(struct addrinfo){.ai_family = AF_UNSPEC,
+                                         .ai_socktype = SOCK_STREAM,
+                                         .ai_flags = AI_NUMERICSERV},
+                      &result);
+    if (ret) {
+        lwan_status_error("Could not resolve cache peer %s: %s", spec,
+                          gai_strerror(ret));
+        return false;
+    }
+
+    memcpy(&peer->addr, result->ai_addr, result->ai_addrlen);
+    peer->addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    return true;
+
+invalid:
+    lwan_status_error("Cache peers must be in the host:port format: %s", spec);
+    return false;
+}
+
+static void close_idle(struct peer *peer)
+{
+    while (peer->n_idle)
+        close(peer->idle[--peer->n_idle]);
+}
+
+static int take_idle(struct peer *peer)
+{
+    int fd = -1;
+
+    pthread_mutex_lock(&peer->lock);
+    while (peer->n_idle) {
+        char c;
+
+        fd = peer->idle[--peer->n_idle];
+
+        /* Closed by the peer (e.g. its keep-alive timeout expired) */
+        if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN)
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+    pthread_mutex_unlock(&peer->lock);
+
+    return fd;
+}
+
+static void put_idle(struct cache_peers *group, struct peer *peer, int fd)
+{
+    pthread_mutex_lock(&peer->lock);
+    if (peer->n_idle < group->max_idle) {
+        peer->idle[peer->n_idle++] = fd;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&peer->lock);
+
+    if (fd >= 0)
+        close(fd);
+}
+
+static int connect_peer(const struct cache_peers *group,
+                        const struct peer *peer)
+{
+    const struct timeval tv = {
+        .tv_sec = group->timeout_ms / 1000,
+        .tv_usec = (group->timeout_ms % 1000) * 1000,
+    };
+    int error;
+    socklen_t error_len = sizeof(error);
+    int fd;
+
+    fd = socket(peer->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                0);
+    if (fd < 0)
+        return -1;
+
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (int[]){1}, sizeof(int));
+
+    if (connect(fd, (const struct sockaddr *)&peer->addr, peer->addr_len) <
+        0) {
+        struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+
+        if (errno != EINPROGRESS)
+            goto error;
+        if (poll(&pfd, 1, group->timeout_ms) <= 0)
+            goto error;
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 ||
+            error)
+            goto error;
+    }
+
+    /* Everything else blocks, up to the timeout. */
+    if (fcntl(fd, F_SETFL, 0) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+        goto error;
+
+    return fd;
+
+error:
+    close(fd);
+    return -1;
+}
+
+static bool send_all(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t written = send(fd, buf, len, MSG_NOSIGNAL);
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        buf += written;
+        len -= (size_t)written;
+    }
+
+    return true;
+}
+
+static bool recv_all(int fd, char *buf, size_t len)
+{
+    while (len) {
+        ssize_t r = recv(fd, buf, len, 0);
+
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (!r)
+            return false;
+
+        buf += r;
+        len -= (size_t)r;
+    }
+
+    return true;
+}
+
+static const char *find_header(const char *head,
+                               const char *end,
+                               const char *name,
+                               size_t name_len)
+{
+    for (const char *line = strstr(head, "\r\n"); line && line < end;
+         line = strstr(line + 2, "\r\n")) {
+        if (!strncasecmp(line + 2, name, name_len))
+            return line + 2 + name_len;
+    }
+
+    return NULL;
+}
+
+enum fetch_result {
+    FETCH_OK,
+    /* The peer answered, but doesn't have it */
+    FETCH_MISS,
+    /* Nothing was read from a connection taken from the pool */
+    FETCH_STALE_CONN,
+    FETCH_FAILED,
+};
+
+static enum fetch_result fetch_from(int fd,
+                                    bool reused,
+                                    const struct lwan_strbuf *request,
+                                    struct lwan_value *serialized,
+                                    bool *keep_alive)
+{
+    char head[MAX_HEAD_SIZE];
+    const char *value, *head_end = NULL;
+    size_t head_len = 0, body_len;
+    unsigned long content_length;
+    int status;
+    char *body;
+
+    *keep_alive = false;
+
+    if (!send_all(fd, lwan_strbuf_get_buffer(request),
+                  lwan_strbuf_get_length(request)))
+        return reused ? FETCH_STALE_CONN : FETCH_FAILED;
+
+    while (!head_end) {
+        ssize_t r;
+
+        if (head_len == sizeof(head) - 1)
+            return FETCH_FAILED;
+
+        r = recv(fd, head + head_len, sizeof(head) - 1 - head_len, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return reused && !head_len ? FETCH_STALE_CONN : FETCH_FAILED;
+
+        head_len += (size_t)r;
+        head[head_len] = '\0';
+        head_end = strstr(head, "\r\n\r\n");
+    }
+
+    if (sscanf(head, "HTTP/1.%*c %d", &status) != 1)
+        return FETCH_FAILED;
+
+    value = find_header(head, head_end, "Content-Length:",
+                        sizeof("Content-Length:") - 1);
+    if (!value)
+        return FETCH_FAILED;
+    errno = 0;
+    content_length = strtoul(value, NULL, 10);
+    if (errno || content_length > MAX_ENTRY_SIZE)
+        return FETCH_FAILED;
+
+    body = malloc(content_length + 1);
+    if (!body)
+        return FETCH_FAILED;
+
+    head_end += 4;
+    body_len = LWAN_MIN((size_t)(head + head_len - head_end),
+                        (size_t)content_length);
+    memcpy(body, head_end, body_len);
+    if (!recv_all(fd, body + body_len, content_length - body_len)) {
+        free(body);
+        return FETCH_FAILED;
+    }
+
+    value = find_header(head, head_end, "Connection:",
+                        sizeof("Connection:") - 1);
+    *keep_alive = !value || strncasecmp(value + strspn(value, " "), "close",
+                                        sizeof("close") - 1);
+
+    if (status != HTTP_OK) {
+        free(body);
+        return FETCH_MISS;
+    }
+
+    *serialized = (struct lwan_value){.value = body, .len = content_length};
+    return FETCH_OK;
+}
+
+static bool build_request(const struct cache_peers *group,
+                          const struct peer *peer,
+                          const char *cache_name,
+                          const char *key,
+                          struct lwan_strbuf *request)
+{
+    return lwan_strbuf_append_printf(request, "GET %s/", group->prefix) &&
+           lwan_upstream_append_encoded(request, key, strlen(key), "-._~/") &&
+           lwan_strbuf_append_strz(request, "?cache=") &&
+           lwan_upstream_append_encoded(request, cache_name,
+                                        strlen(cache_name), "-._~") &&
+           lwan_strbuf_append_printf(request, " HTTP/1.1\r\nHost: %s\r\n\r\n",
+                                     peer->name);
+}
+
+static bool fetch(struct cache_peers *group,
+                  struct peer *peer,
+                  const char *cache_name,
+                  const char *key,
+                  struct lwan_value *serialized)
+{
+    struct lwan_strbuf request;
+    enum fetch_result result = FETCH_FAILED;
+    bool keep_alive;
+
+    lwan_strbuf_init(&request);
+    if (!build_request(group, peer, cache_name, key, &request))
+        goto out;
+
+    for (int tries = 2; tries; tries--) {
+        int fd = take_idle(peer);
+        bool reused = fd >= 0;
+
+        if (!reused) {
+            fd = connect_peer(group, peer);
+            if (fd < 0) {
+                result = FETCH_FAILED;
+                break;
+            }
+        }
+
+        result = fetch_from(fd, reused, &request, serialized, &keep_alive);
+        if (keep_alive && (result == FETCH_OK || result == FETCH_MISS))
+            put_idle(group, peer, fd);
+        else
+            close(fd);
+
+        if (result != FETCH_STALE_CONN)
+            break;
+    }
+
+    if (result == FETCH_FAILED || result == FETCH_STALE_CONN) {
+        peer->down_until = lwan_clock_monotonic() + group->fail_timeout;
+        lwan_status_warning("Could not fetch \"%s\" from cache peer %s, not "
+                            "asking it for %lds",
+                            key, peer->name, (long)group->fail_timeout);
+    }
+
+out:
+    lwan_strbuf_free(&request);
+    return result == FETCH_OK;
+}
+
+bool lwan_cache_peers_fetch(const char *cache_name,
+                            const char *key,
+                            struct lwan_value *serialized)
+{
+    struct cache_peers *group;
+    struct peer *peer;
+    bool fetched = false;
+
+    pthread_rwlock_rdlock(&current.lock);
+
+    group = current.group;
+    if (!group)
+        goto out;
+
+    peer = &group->peers[owner_of(group, key_hash(cache_name, key))];
+    if (peer == &group->peers[group->self])
+        goto out;
+    if (ATOMIC_READ(peer->down_until) > lwan_clock_monotonic())
+        goto out;
+
+    fetched = fetch(group, peer, cache_name, key, serialized);
+
+out:
+    pthread_rwlock_unlock(&current.lock);
+    return fetched;
+}
+
+static enum lwan_http_status
+cache_peers_handle_request(struct lwan_request *request,
+                           struct lwan_response *response,
+                           void *instance)
+{
+    struct cache_peers *group = instance;
+    const char *cache_name = lwan_request_get_query_param(request, "cache");
+    const char *key = request->url.value;
+    struct cache_entry *entry;
+    struct cache *cache;
+
+    if (lwan_request_get_method(request) != REQUEST_METHOD_GET)
+        return HTTP_NOT_ALLOWED;
+    if (!cache_name)
+        return HTTP_BAD_REQUEST;
+
+    while (*key == '/')
+        key++;
+
+    /* Instances that disagree on who owns a key would otherwise keep
+     * asking each other for it. */
+    if (owner_of(group, key_hash(cache_name, key)) != group->self)
+        return HTTP_CONFLICT;
+
+    cache = lwan_cache_find_by_name(cache_name);
+    if (!cache)
+        return HTTP_NOT_FOUND;
+
+    entry = cache_coro_get_and_ref_entry_async(cache, request, key);
+    if (!entry)
+        return HTTP_NOT_FOUND;
+
+    if (!lwan_cache_serialize_entry(cache, entry, response->buffer))
+        return HTTP_NOT_FOUND;
+
+    response->mime_type = "application/octet-stream";
+    return HTTP_OK;
+}
+
+static void cache_peers_destroy(void *data)
+{
+    struct cache_peers *group = data;
+
+    if (!group)
+        return;
+
+    pthread_rwlock_wrlock(&current.lock);
+    if (current.group == group)
+        current.group = NULL;
+    pthread_rwlock_unlock(&current.lock);
+
+    for (size_t i = 0; i < group->n_peers; i++) {
+        if (group->peers[i].idle) {
+            close_idle(&group->peers[i]);
+            pthread_mutex_destroy(&group->peers[i].lock);
+            free(group->peers[i].idle);
+        }
+        free(group->peers[i].name);
+    }
+
+    free(group->peers);
+    free(group->ring);
+    free(group->prefix);
+    free(group);
+}
+
+static bool add_peer(struct cache_peers *group, const char *spec)
+{
+    struct peer *peers =
+        reallocarray(group->peers, group->n_peers + 1, sizeof(*peers));
+    struct peer *peer;
+
+    if (!peers)
+        return false;
+    group->peers = peers;
+
+    peer = &peers[group->n_peers++];
+    *peer = (struct peer){};
+
+    peer->name = strdup(spec);
+    if (!peer->name)
+        return false;
+    if (!parse_peer(peer, spec))
+        return false;
+
+    peer->idle = calloc(LWAN_MAX(group->max_idle, 1u), sizeof(int));
+    if (!peer->idle)
+        return false;
+    if (pthread_mutex_init(&peer->lock, NULL)) {
+        free(peer->idle);
+        peer->idle = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+static void *cache_peers_create(const char *prefix, void *instance)
+{
+    struct lwan_cache_peers_settings *settings = instance;
+    struct cache_peers *group;
+    char *copy, *spec, *saveptr;
+    size_t prefix_len;
+
+    if (!settings->peers || !settings->self) {
+        lwan_status_error("Both peers and self must be specified");
+        return NULL;
+    }
+
+    group = calloc(1, sizeof(*group));
+    if (!group)
+        return NULL;
+
+    group->self = SIZE_MAX;
+    group->timeout_ms = (int)LWAN_MIN(LWAN_MAX(settings->timeout, 1u), 60000u);
+    group->max_idle = settings->max_idle;
+    group->fail_timeout = (time_t)settings->fail_timeout;
+
+    prefix_len = strlen(prefix);
+    while (prefix_len && prefix[prefix_len - 1] == '/')
+        prefix_len--;
+    group->prefix = strndup(prefix, prefix_len);
+    if (!group->prefix)
+        goto error;
+
+    copy = strdupa(settings->peers);
+    for (spec = strtok_r(copy, " \t,", &saveptr); spec;
+         spec = strtok_r(NULL, " \t,", &saveptr)) {
+        for (size_t i = 0; i < group->n_peers; i++) {
+            if (streq(group->peers[i].name, spec)) {
+                lwan_status_error("Cache peer %s listed more than once", spec);
+                goto error;
+            }
+        }
+
+        if (!add_peer(group, spec))
+            goto error;
+
+        if (streq(spec, settings->self))
+            group->self = group->n_peers - 1;
+    }
+
+    if (group->self == SIZE_MAX) {
+        lwan_status_error("This instance (%s) isn't one of the cache peers",
+                          settings->self);
+        goto error;
+    }
+
+    if (!build_ring(group))
+        goto error;
+
+    pthread_rwlock_wrlock(&current.lock);
+    if (current.group) {
+        pthread_rwlock_unlock(&current.lock);
+        lwan_status_error("Only one cache_peers group can be declared");
+        goto error;
+    }
+    current.group = group;
+    pthread_rwlock_unlock(&current.lock);
+
+    lwan_status_debug("Filling caches from %zu peers, as %s", group->n_peers,
+                      settings->self);
+
+    return group;
+
+error:
+    cache_peers_destroy(group);
+    return NULL;
+}
+
+static void *cache_peers_create_from_hash(const char *prefix,
+                                          const struct hash *hash)
+{
+    struct lwan_cache_peers_settings settings = {
+        .peers = hash_find(hash, "peers"),
+        .self = hash_find(hash, "self"),
+        .timeout = (unsigned int)LWAN_MAX(
+            parse_int(hash_find(hash, "timeout"), 250), 1),
+        .max_idle = (unsigned int)LWAN_MAX(
+            parse_int(hash_find(hash, "max_idle"), 4), 0),
+        .fail_timeout = (unsigned int)LWAN_MAX(
+            parse_int(hash_find(hash, "fail_timeout"), 5), 0),
+    };
+
+    return cache_peers_create(prefix, &settings);
+}
+
+static const struct lwan_module module = {
+    .create = cache_peers_create,
+    .create_from_hash = cache_peers_create_from_hash,
+    .destroy = cache_peers_destroy,
+    .handle_request = cache_peers_handle_request,
+};
+
+LWAN_REGISTER_MODULE(cache_peers, &module);
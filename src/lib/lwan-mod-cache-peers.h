@@ -0,0 +1,49 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "lwan.h"
+
+struct lwan_cache_peers_settings {
+    /* Space- or comma-separated list of host:port pairs, in any order, but
+     * the same in every instance of the group */
+    const char *peers;
+    /* How this instance is listed in peers */
+    const char *self;
+    /* Milliseconds to wait for a peer to connect or respond */
+    unsigned int timeout;
+    /* Idle connections kept per peer */
+    unsigned int max_idle;
+    /* Seconds a peer isn't asked for anything after failing */
+    unsigned int fail_timeout;
+};
+
+LWAN_MODULE_FORWARD_DECL(cache_peers)
+
+#define CACHE_PEERS(peers_, self_)                                             \
+    .module = LWAN_MODULE_REF(cache_peers),                                    \
+    .args = ((struct lwan_cache_peers_settings[]) {{                           \
+        .peers = (peers_),                                                     \
+        .self = (self_),                                                       \
+        .timeout = 250,                                                        \
+        .max_idle = 4,                                                         \
+        .fail_timeout = 5,                                                     \
+    }}),                                                                       \
+    .flags = (enum lwan_handler_flags)0
@@ -0,0 +1,1308 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "int-to-str.h"
+#include "lwan-mod-fastcgi.h"
+#include "lwan-upstream.h"
+
+/* Used to read records from the upstream and to send the request body;
+ * the response head (CGI headers) has to fit in a buffer of this size as
+ * well. */
+#define BUFFER_SIZE 16384
+#define MAX_HEADERS 64
+
+/* Output is buffered (and sent with a Content-Length header) until either
+ * the upstream makes the request wait or this much has been gathered;
+ * after that, it's streamed to the client in chunks. */
+#define MAX_BUFFERED_OUTPUT 65536
+
+#define FCGI_VERSION_1 1
+#define FCGI_HEADER_LEN 8
+#define FCGI_MAX_CONTENT_LEN 65535
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define FCGI_REQUEST_COMPLETE 0
+/* Connections aren't multiplexed, so every request can have the same ID. */
+#define FCGI_REQUEST_ID 1
+
+enum fcgi_record_type {
+    FCGI_BEGIN_REQUEST = 1,
+    FCGI_ABORT_REQUEST = 2,
+    FCGI_END_REQUEST = 3,
+    FCGI_PARAMS = 4,
+    FCGI_STDIN = 5,
+    FCGI_STDOUT = 6,
+    FCGI_STDERR = 7,
+};
+
+enum cgi_protocol {
+    PROTOCOL_FASTCGI,
+    PROTOCOL_UWSGI,
+};
+
+struct fastcgi_priv {
+    struct lwan_upstream_set *upstreams;
+    enum cgi_protocol protocol;
+
+    char *document_root;
+    size_t document_root_len;
+    char *script;
+};
+
+struct cgi_conn {
+    struct fastcgi_priv *priv;
+    struct lwan_upstream_conn *up;
+    struct lwan_request *request;
+
+    /* Raw bytes read from the upstream */
+    char *buffer;
+    size_t pos, used;
+    size_t received;
+
+    /* FastCGI record being read */
+    enum fcgi_record_type type;
+    size_t remaining;
+    size_t padding;
+
+    bool ended;
+};
+
+enum output_result {
+    OUTPUT_DATA,
+    OUTPUT_END,
+    OUTPUT_WOULD_BLOCK,
+    OUTPUT_ERROR,
+};
+
+static bool append_length(struct lwan_strbuf *buf,
+                          enum cgi_protocol protocol,
+                          size_t len)
+{
+    if (protocol == PROTOCOL_UWSGI) {
+        if (len > UINT16_MAX)
+            return false;
+        return lwan_strbuf_append_str(
+            buf, (const char[]){(char)(len & 0xff), (char)(len >> 8)}, 2);
+    }
+
+    if (len < 128)
+        return lwan_strbuf_append_char(buf, (char)len);
+    if (len > INT32_MAX)
+        return false;
+
+    return lwan_strbuf_append_str(buf,
+                                  (const char[]){
+                                      (char)((len >> 24) | 0x80),
+                                      (char)(len >> 16),
+                                      (char)(len >> 8),
+                                      (char)len,
+                                  },
+                                  4);
+}
+
+static bool add_param(struct lwan_strbuf *buf,
+                      enum cgi_protocol protocol,
+                      const char *key,
+                      size_t key_len,
+                      const char *value,
+                      size_t value_len)
+{
+    if (protocol == PROTOCOL_UWSGI) {
+        /* uwsgi has the length of the value right before it */
+        return append_length(buf, protocol, key_len) &&
+               lwan_strbuf_append_str(buf, key, key_len) &&
+               append_length(buf, protocol, value_len) &&
+               lwan_strbuf_append_str(buf, value, value_len);
+    }
+
+    return append_length(buf, protocol, key_len) &&
+           append_length(buf, protocol, value_len) &&
+           lwan_strbuf_append_str(buf, key, key_len) &&
+           lwan_strbuf_append_str(buf, value, value_len);
+}
+
+#define ADD_PARAM(buf_, protocol_, key_, value_, value_len_)                   \
+    add_param((buf_), (protocol_), (key_), sizeof(key_) - 1, (value_),         \
+              (value_len_))
+#define ADD_PARAM_STR(buf_, protocol_, key_, value_)                           \
+    ({                                                                         \
+        const char *v_ = (value_);                                             \
+        ADD_PARAM((buf_), (protocol_), (key_), v_, strlen(v_));                \
+    })
+
+/* Values that have to be encoded again are written straight to the
+ * buffer, with room for the largest length reserved before them; the
+ * length is filled in afterwards. */
+static ssize_t begin_long_param(struct lwan_strbuf *buf,
+                                enum cgi_protocol protocol,
+                                const char *key,
+                                size_t key_len)
+{
+    size_t value_len_pos;
+
+    if (protocol == PROTOCOL_UWSGI) {
+        if (!append_length(buf, protocol, key_len) ||
+            !lwan_strbuf_append_str(buf, key, key_len))
+            return -1;
+
+        value_len_pos = lwan_strbuf_get_length(buf);
+        return lwan_strbuf_append_str(buf, "\0\0", 2) ? (ssize_t)value_len_pos
+                                                      : -1;
+    }
+
+    if (!append_length(buf, protocol, key_len))
+        return -1;
+    value_len_pos = lwan_strbuf_get_length(buf);
+    if (!lwan_strbuf_append_str(buf, "\0\0\0\0", 4) ||
+        !lwan_strbuf_append_str(buf, key, key_len))
+        return -1;
+
+    return (ssize_t)value_len_pos;
+}
+
+static bool end_long_param(struct lwan_strbuf *buf,
+                           enum cgi_protocol protocol,
+                           size_t key_len,
+                           ssize_t value_len_pos)
+{
+    unsigned char *p =
+        (unsigned char *)lwan_strbuf_get_buffer(buf) + value_len_pos;
+    size_t len;
+
+    if (protocol == PROTOCOL_UWSGI) {
+        len = lwan_strbuf_get_length(buf) - (size_t)value_len_pos - 2;
+        if (len > UINT16_MAX)
+            return false;
+
+        p[0] = (unsigned char)(len & 0xff);
+        p[1] = (unsigned char)(len >> 8);
+        return true;
+    }
+
+    len = lwan_strbuf_get_length(buf) - (size_t)value_len_pos - 4 - key_len;
+    if (len > INT32_MAX)
+        return false;
+
+    /* The 4-byte form can be used for any length. */
+    p[0] = (unsigned char)((len >> 24) | 0x80);
+    p[1] = (unsigned char)(len >> 16);
+    p[2] = (unsigned char)(len >> 8);
+    p[3] = (unsigned char)len;
+    return true;
+}
+
+static bool add_request_uri(struct lwan_strbuf *buf,
+                            enum cgi_protocol protocol,
+                            struct lwan_request *request)
+{
+    static const char path_safe[] = "-._~!$&'()*+,;=:@/";
+    ssize_t pos = begin_long_param(buf, protocol, "REQUEST_URI",
+                                   sizeof("REQUEST_URI") - 1);
+
+    if (pos < 0)
+        return false;
+    if (!lwan_upstream_append_encoded(buf, request->original_url.value,
+                                      request->original_url.len, path_safe))
+        return false;
+    if (request->helper->query_string.len &&
+        (!lwan_strbuf_append_char(buf, '?') ||
+         !lwan_upstream_append_query(request, buf)))
+        return false;
+
+    return end_long_param(buf, protocol, sizeof("REQUEST_URI") - 1, pos);
+}
+
+static bool add_query_string(struct lwan_strbuf *buf,
+                             enum cgi_protocol protocol,
+                             struct lwan_request *request)
+{
+    const struct lwan_value *query = &request->helper->query_string;
+
+    if (!(request->flags & REQUEST_PARSED_QUERY_STRING))
+        return ADD_PARAM(buf, protocol, "QUERY_STRING", query->value,
+                         query->len);
+
+    ssize_t pos = begin_long_param(buf, protocol, "QUERY_STRING",
+                                   sizeof("QUERY_STRING") - 1);
+    return pos >= 0 && lwan_upstream_append_query(request, buf) &&
+           end_long_param(buf, protocol, sizeof("QUERY_STRING") - 1, pos);
+}
+
+#define HEADER_IS(name_, len_, const_)                                         \
+    ((len_) == sizeof(const_) - 1 &&                                           \
+     !strncasecmp((name_), (const_), sizeof(const_) - 1))
+
+/* Request headers become HTTP_* variables, with the name transformed as
+ * it's written to the buffer. */
+static bool add_header_params(struct lwan_strbuf *buf,
+                              enum cgi_protocol protocol,
+                              struct lwan_request *request)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+
+    for (size_t i = 0; i < helper->n_header_start; i++) {
+        const char *start = helper->header_start[i];
+        const char *end = helper->header_start[i + 1] - (sizeof("\r\n") - 1);
+        const char *colon = memchr(start, ':', (size_t)(end - start));
+        const char *value;
+        size_t name_len;
+        char *name;
+
+        if (UNLIKELY(!colon))
+            continue;
+
+        name_len = (size_t)(colon - start);
+        for (value = colon + 1; value < end && *value == ' '; value++)
+            ;
+
+        if (HEADER_IS(start, name_len, "Content-Type")) {
+            if (!ADD_PARAM(buf, protocol, "CONTENT_TYPE", value,
+                           (size_t)(end - value)))
+                return false;
+            continue;
+        }
+
+        /* CONTENT_LENGTH is sent separately, and HTTP_PROXY would be
+         * mistaken for the proxy to be used by some applications
+         * ("httpoxy").  Lwan takes care of the others. */
+        if (HEADER_IS(start, name_len, "Content-Length") ||
+            HEADER_IS(start, name_len, "Proxy") ||
+            HEADER_IS(start, name_len, "Connection") ||
+            HEADER_IS(start, name_len, "Transfer-Encoding") ||
+            HEADER_IS(start, name_len, "Expect"))
+            continue;
+
+        if (protocol == PROTOCOL_UWSGI) {
+            if (!append_length(buf, protocol, name_len + 5) ||
+                !lwan_strbuf_append_str(buf, "HTTP_", 5))
+                return false;
+        } else if (!append_length(buf, protocol, name_len + 5) ||
+                   !append_length(buf, protocol, (size_t)(end - value)) ||
+                   !lwan_strbuf_append_str(buf, "HTTP_", 5)) {
+            return false;
+        }
+
+        name = lwan_strbuf_extend_unsafe(buf, name_len);
+        if (UNLIKELY(!name))
+            return false;
+        for (size_t j = 0; j < name_len; j++) {
+            const char c = start[j];
+
+            if (c == '-')
+                name[j] = '_';
+            else if (c >= 'a' && c <= 'z')
+                name[j] = (char)(c - 'a' + 'A');
+            else
+                name[j] = c;
+        }
+
+        if (protocol == PROTOCOL_UWSGI &&
+            !append_length(buf, protocol, (size_t)(end - value)))
+            return false;
+        if (!lwan_strbuf_append_str(buf, value, (size_t)(end - value)))
+            return false;
+    }
+
+    return true;
+}
+
+static bool add_server_params(struct lwan_strbuf *buf,
+                              enum cgi_protocol protocol,
+                              struct lwan_request *request)
+{
+    const char *host = lwan_request_get_header_by_id(request, LWAN_HEADER_HOST);
+    char ip[INET6_ADDRSTRLEN];
+    char port_buf[INT_TO_STR_BUFFER_SIZE];
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    const char *remote;
+    const char *port = NULL;
+    size_t port_len = 0;
+
+    remote = lwan_request_get_remote_address(request, ip);
+    if (remote && !ADD_PARAM_STR(buf, protocol, "REMOTE_ADDR", remote))
+        return false;
+
+    if (host) {
+        const char *colon = strrchr(host, ':');
+
+        /* Leave IPv6 addresses without a port alone. */
+        if (colon && !strchr(colon, ']')) {
+            if (!ADD_PARAM(buf, protocol, "SERVER_NAME", host,
+                           (size_t)(colon - host)))
+                return false;
+        } else if (!ADD_PARAM_STR(buf, protocol, "SERVER_NAME", host)) {
+            return false;
+        }
+    } else if (!ADD_PARAM_STR(buf, protocol, "SERVER_NAME", "localhost")) {
+        return false;
+    }
+
+    if (!getsockname(request->fd, (struct sockaddr *)&addr, &addr_len)) {
+        if (addr.ss_family == AF_INET) {
+            port = uint_to_string(
+                ntohs(((struct sockaddr_in *)&addr)->sin_port), port_buf,
+                &port_len);
+        } else if (addr.ss_family == AF_INET6) {
+            port = uint_to_string(
+                ntohs(((struct sockaddr_in6 *)&addr)->sin6_port), port_buf,
+                &port_len);
+        }
+    }
+    if (port && !ADD_PARAM(buf, protocol, "SERVER_PORT", port, port_len))
+        return false;
+
+    if (request->conn->flags & CONN_TLS)
+        return ADD_PARAM_STR(buf, protocol, "HTTPS", "on");
+
+    return true;
+}
+
+static bool add_script_params(const struct fastcgi_priv *priv,
+                              struct lwan_strbuf *buf,
+                              struct lwan_request *request)
+{
+    const enum cgi_protocol protocol = priv->protocol;
+    /* The URL (as seen by the handler) is the end of the original URL,
+     * after the prefix. */
+    const size_t prefix_len = request->original_url.len - request->url.len;
+    const char *script_name = request->original_url.value;
+    size_t script_name_len = request->original_url.len;
+
+    if (priv->script) {
+        /* PATH_INFO keeps the slash that might end the prefix. */
+        script_name_len = prefix_len;
+        if (script_name_len && script_name[script_name_len - 1] == '/')
+            script_name_len--;
+
+        if (!ADD_PARAM_STR(buf, protocol, "SCRIPT_FILENAME", priv->script) ||
+            !ADD_PARAM(buf, protocol, "PATH_INFO",
+                       script_name + script_name_len,
+                       request->original_url.len - script_name_len))
+            return false;
+    } else if (priv->document_root) {
+        ssize_t pos = begin_long_param(buf, protocol, "SCRIPT_FILENAME",
+                                       sizeof("SCRIPT_FILENAME") - 1);
+
+        if (pos < 0 ||
+            !lwan_strbuf_append_str(buf, priv->document_root,
+                                    priv->document_root_len) ||
+            !lwan_strbuf_append_str(buf, script_name, script_name_len) ||
+            !end_long_param(buf, protocol, sizeof("SCRIPT_FILENAME") - 1, pos))
+            return false;
+    }
+
+    if (priv->document_root &&
+        !ADD_PARAM(buf, protocol, "DOCUMENT_ROOT", priv->document_root,
+                   priv->document_root_len))
+        return false;
+
+    return ADD_PARAM(buf, protocol, "SCRIPT_NAME", script_name,
+                     script_name_len) &&
+           ADD_PARAM(buf, protocol, "DOCUMENT_URI", request->original_url.value,
+                     request->original_url.len);
+}
+
+/* Builds the CGI variables from the request, straight into @buf. */
+static bool add_params(const struct fastcgi_priv *priv,
+                       struct lwan_strbuf *buf,
+                       struct lwan_request *request,
+                       bool *has_body)
+{
+    const enum cgi_protocol protocol = priv->protocol;
+    struct lwan_request_parser_helper *helper = request->helper;
+    const char *method = lwan_upstream_method_name(request);
+
+    if (UNLIKELY(!method))
+        return false;
+
+    if (!ADD_PARAM_STR(buf, protocol, "GATEWAY_INTERFACE", "CGI/1.1") ||
+        !ADD_PARAM_STR(buf, protocol, "SERVER_SOFTWARE", "lwan") ||
+        !ADD_PARAM_STR(buf, protocol, "SERVER_PROTOCOL",
+                       request->flags & REQUEST_IS_HTTP_1_0 ? "HTTP/1.0"
+                                                            : "HTTP/1.1") ||
+        !ADD_PARAM_STR(buf, protocol, "REQUEST_METHOD", method) ||
+        !add_request_uri(buf, protocol, request) ||
+        !add_query_string(buf, protocol, request) ||
+        !add_script_params(priv, buf, request) ||
+        !add_server_params(buf, protocol, request) ||
+        !add_header_params(buf, protocol, request))
+        return false;
+
+    *has_body = false;
+    if (helper->transfer_encoding.value) {
+        /* The length isn't known; FastCGI applications read until the end
+         * of the stream. */
+        *has_body = true;
+    } else if (helper->content_length.value &&
+               parse_long_long(helper->content_length.value, 0) > 0) {
+        *has_body = true;
+        return ADD_PARAM(buf, protocol, "CONTENT_LENGTH",
+                         helper->content_length.value,
+                         strlen(helper->content_length.value));
+    }
+
+    return true;
+}
+
+static void fcgi_header(char *out, enum fcgi_record_type type, size_t len)
+{
+    out[0] = FCGI_VERSION_1;
+    out[1] = (char)type;
+    out[2] = 0;
+    out[3] = FCGI_REQUEST_ID;
+    out[4] = (char)(len >> 8);
+    out[5] = (char)(len & 0xff);
+    out[6] = 0; /* No padding */
+    out[7] = 0;
+}
+
+/* The request is built in @buf, so that (most of the time) it can be sent
+ * with a single write: the FCGI_BEGIN_REQUEST record, the parameters, and,
+ * for requests without a body, the empty FCGI_STDIN record. */
+static enum lwan_http_status build_fastcgi_request(
+    const struct fastcgi_priv *priv,
+    struct lwan_request *request,
+    struct lwan_strbuf *buf,
+    bool *has_body)
+{
+    const size_t params_start = 2 * FCGI_HEADER_LEN + FCGI_HEADER_LEN;
+    char *p;
+    size_t params_len;
+
+    lwan_strbuf_reset(buf);
+    p = lwan_strbuf_extend_unsafe(buf, params_start);
+    if (UNLIKELY(!p))
+        return HTTP_INTERNAL_ERROR;
+
+    fcgi_header(p, FCGI_BEGIN_REQUEST, FCGI_HEADER_LEN);
+    memcpy(p + FCGI_HEADER_LEN,
+           (const char[]){0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0},
+           FCGI_HEADER_LEN);
+
+    if (UNLIKELY(!add_params(priv, buf, request, has_body)))
+        return HTTP_INTERNAL_ERROR;
+
+    params_len = lwan_strbuf_get_length(buf) - params_start;
+    if (params_len > FCGI_MAX_CONTENT_LEN)
+        return HTTP_TOO_LARGE;
+    fcgi_header(lwan_strbuf_get_buffer(buf) + 2 * FCGI_HEADER_LEN,
+                FCGI_PARAMS, params_len);
+
+    p = lwan_strbuf_extend_unsafe(buf, *has_body ? FCGI_HEADER_LEN
+                                                 : 2 * FCGI_HEADER_LEN);
+    if (UNLIKELY(!p))
+        return HTTP_INTERNAL_ERROR;
+    fcgi_header(p, FCGI_PARAMS, 0);
+    if (!*has_body)
+        fcgi_header(p + FCGI_HEADER_LEN, FCGI_STDIN, 0);
+
+    return HTTP_OK;
+}
+
+/* uwsgi packets are a 4-byte header followed by the variables; the body,
+ * if any, follows as is. */
+static enum lwan_http_status build_uwsgi_request(
+    const struct fastcgi_priv *priv,
+    struct lwan_request *request,
+    struct lwan_strbuf *buf,
+    bool *has_body)
+{
+    size_t vars_len;
+    unsigned char *p;
+
+    /* There's no way to tell where the body ends otherwise. */
+    if (request->helper->transfer_encoding.value)
+        return HTTP_LENGTH_REQUIRED;
+
+    lwan_strbuf_reset(buf);
+    if (UNLIKELY(!lwan_strbuf_extend_unsafe(buf, 4)))
+        return HTTP_INTERNAL_ERROR;
+
+    if (UNLIKELY(!add_params(priv, buf, request, has_body)))
+        return HTTP_TOO_LARGE;
+
+    vars_len = lwan_strbuf_get_length(buf) - 4;
+    if (vars_len > UINT16_MAX)
+        return HTTP_TOO_LARGE;
+
+    p = (unsigned char *)lwan_strbuf_get_buffer(buf);
+    p[0] = 0; /* modifier1: WSGI */
+    p[1] = (unsigned char)(vars_len & 0xff);
+    p[2] = (unsigned char)(vars_len >> 8);
+    p[3] = 0; /* modifier2 */
+
+    return HTTP_OK;
+}
+
+enum send_body_result {
+    SEND_BODY_OK,
+    SEND_BODY_UPSTREAM_ERROR,
+    SEND_BODY_CLIENT_ERROR,
+};
+
+static enum send_body_result send_body(struct cgi_conn *conn)
+{
+    const bool fastcgi = conn->priv->protocol == PROTOCOL_FASTCGI;
+    char *data = conn->buffer + FCGI_HEADER_LEN;
+
+    while (true) {
+        /* Reading the body might wait on the client. */
+        lwan_upstream_conn_park(conn->up);
+
+        ssize_t n = lwan_request_read_body(conn->request, data,
+                                           BUFFER_SIZE - FCGI_HEADER_LEN);
+        if (n < 0)
+            return SEND_BODY_CLIENT_ERROR;
+
+        if (!fastcgi) {
+            if (!n)
+                return SEND_BODY_OK;
+            if (!lwan_upstream_conn_write(conn->up, data, (size_t)n, 0))
+                return SEND_BODY_UPSTREAM_ERROR;
+            continue;
+        }
+
+        /* An empty record marks the end of the stream. */
+        fcgi_header(conn->buffer, FCGI_STDIN, (size_t)n);
+        if (!lwan_upstream_conn_write(conn->up, conn->buffer,
+                                      FCGI_HEADER_LEN + (size_t)n, 0))
+            return SEND_BODY_UPSTREAM_ERROR;
+        if (!n)
+            return SEND_BODY_OK;
+    }
+}
+
+/* Makes sure there are at least @need bytes in the buffer, reading more
+ * from the upstream if necessary. */
+static enum output_result fill(struct cgi_conn *conn, size_t need, bool block)
+{
+    ssize_t r;
+
+    if (conn->pos == conn->used) {
+        conn->pos = conn->used = 0;
+    } else if (conn->used - conn->pos >= need) {
+        return OUTPUT_DATA;
+    } else if (BUFFER_SIZE - conn->pos < need) {
+        memmove(conn->buffer, conn->buffer + conn->pos,
+                conn->used - conn->pos);
+        conn->used -= conn->pos;
+        conn->pos = 0;
+    }
+
+    while (conn->used - conn->pos < need) {
+        if (block) {
+            r = lwan_upstream_conn_read(conn->up, conn->buffer + conn->used,
+                                        BUFFER_SIZE - conn->used);
+        } else {
+            r = recv(conn->up->fd, conn->buffer + conn->used,
+                     BUFFER_SIZE - conn->used, MSG_DONTWAIT);
+            if (r < 0 && (errno == EAGAIN || errno == EINTR))
+                return OUTPUT_WOULD_BLOCK;
+        }
+
+        if (r < 0)
+            return OUTPUT_ERROR;
+        if (r == 0)
+            return OUTPUT_END;
+
+        conn->used += (size_t)r;
+        conn->received += (size_t)r;
+    }
+
+    return OUTPUT_DATA;
+}
+
+static enum output_result
+read_uwsgi_output(struct cgi_conn *conn, const char **data, size_t *len,
+                  bool block)
+{
+    enum output_result r;
+
+    if (conn->ended)
+        return OUTPUT_END;
+
+    r = fill(conn, 1, block);
+    if (r == OUTPUT_END) {
+        /* uwsgi responses end when the connection is closed. */
+        conn->ended = true;
+        return OUTPUT_END;
+    }
+    if (r != OUTPUT_DATA)
+        return r;
+
+    *data = conn->buffer + conn->pos;
+    *len = conn->used - conn->pos;
+    conn->pos = conn->used;
+    return OUTPUT_DATA;
+}
+
+static void log_stderr(const struct cgi_conn *conn, const char *data, size_t len)
+{
+    while (len && (data[len - 1] == '\n' || data[len - 1] == '\r'))
+        len--;
+
+    if (len) {
+        lwan_status_warning(
+            "%s: %.*s", lwan_upstream_name(conn->priv->upstreams,
+                                           conn->up->upstream),
+            (int)len, data);
+    }
+}
+
+/* Demultiplexes the records sent by the upstream, returning what's in
+ * FCGI_STDOUT records and logging what's in FCGI_STDERR records. */
+static enum output_result
+read_fastcgi_output(struct cgi_conn *conn, const char **data, size_t *len,
+                    bool block)
+{
+    while (!conn->ended) {
+        enum output_result r;
+
+        if (!conn->remaining && !conn->padding) {
+            const unsigned char *header;
+
+            r = fill(conn, FCGI_HEADER_LEN, block);
+            if (r != OUTPUT_DATA)
+                return r == OUTPUT_END ? OUTPUT_ERROR : r;
+
+            header = (const unsigned char *)conn->buffer + conn->pos;
+            if (header[0] != FCGI_VERSION_1 ||
+                ((header[2] << 8) | header[3]) != FCGI_REQUEST_ID)
+                return OUTPUT_ERROR;
+
+            conn->type = (enum fcgi_record_type)header[1];
+            conn->remaining = (size_t)((header[4] << 8) | header[5]);
+            conn->padding = header[6];
+            conn->pos += FCGI_HEADER_LEN;
+
+            if (conn->type == FCGI_END_REQUEST) {
+                const unsigned char *body;
+
+                if (conn->remaining != 8)
+                    return OUTPUT_ERROR;
+
+                r = fill(conn, conn->remaining + conn->padding, block);
+                if (r != OUTPUT_DATA)
+                    return r == OUTPUT_END ? OUTPUT_ERROR : r;
+
+                body = (const unsigned char *)conn->buffer + conn->pos;
+                conn->pos += conn->remaining + conn->padding;
+                conn->remaining = conn->padding = 0;
+                conn->ended = true;
+
+                /* Anything after this can't be trusted, so don't reuse the
+                 * connection if there's something left in the buffer. */
+                conn->up->reusable = body[4] == FCGI_REQUEST_COMPLETE &&
+                                     conn->pos == conn->used;
+                break;
+            }
+
+            continue;
+        }
+
+        r = fill(conn, 1, block);
+        if (r != OUTPUT_DATA)
+            return r == OUTPUT_END ? OUTPUT_ERROR : r;
+
+        size_t avail = conn->used - conn->pos;
+        if (!conn->remaining) {
+            size_t skip = LWAN_MIN(conn->padding, avail);
+
+            conn->pos += skip;
+            conn->padding -= skip;
+            continue;
+        }
+
+        size_t n = LWAN_MIN(conn->remaining, avail);
+        const char *p = conn->buffer + conn->pos;
+
+        conn->pos += n;
+        conn->remaining -= n;
+
+        if (conn->type == FCGI_STDOUT) {
+            *data = p;
+            *len = n;
+            return OUTPUT_DATA;
+        }
+        if (conn->type == FCGI_STDERR)
+            log_stderr(conn, p, n);
+    }
+
+    return OUTPUT_END;
+}
+
+static enum output_result
+read_output(struct cgi_conn *conn, const char **data, size_t *len, bool block)
+{
+    if (conn->priv->protocol == PROTOCOL_FASTCGI)
+        return read_fastcgi_output(conn, data, len, block);
+    return read_uwsgi_output(conn, data, len, block);
+}
+
+struct cgi_head {
+    char *buffer;
+    size_t used;
+
+    int code;
+    const char *content_type;
+    bool has_location;
+
+    struct lwan_key_value *headers;
+    size_t n_headers;
+
+    /* What came after the head */
+    const char *body;
+    size_t body_len;
+};
+
+static bool parse_header(struct cgi_head *head, char *line, char *line_end)
+{
+    char *colon = memchr(line, ':', (size_t)(line_end - line));
+    char *value;
+    size_t name_len;
+
+    if (!colon || colon == line)
+        return false;
+
+    name_len = (size_t)(colon - line);
+    for (value = colon + 1; value < line_end && *value == ' '; value++)
+        ;
+    *line_end = '\0';
+
+    if (HEADER_IS(line, name_len, "Status")) {
+        if (value[0] < '1' || value[0] > '5' || value[1] < '0' ||
+            value[1] > '9' || value[2] < '0' || value[2] > '9')
+            return false;
+
+        head->code =
+            (value[0] - '0') * 100 + (value[1] - '0') * 10 + (value[2] - '0');
+        return true;
+    }
+
+    if (HEADER_IS(line, name_len, "Content-Type")) {
+        head->content_type = value;
+        return true;
+    }
+
+    /* Lwan takes care of these. */
+    if (HEADER_IS(line, name_len, "Content-Length") ||
+        HEADER_IS(line, name_len, "Transfer-Encoding") ||
+        HEADER_IS(line, name_len, "Connection") ||
+        HEADER_IS(line, name_len, "Keep-Alive") ||
+        HEADER_IS(line, name_len, "Date") || HEADER_IS(line, name_len, "Server"))
+        return true;
+
+    if (HEADER_IS(line, name_len, "Location"))
+        head->has_location = true;
+
+    if (LIKELY(head->n_headers < MAX_HEADERS)) {
+        line[name_len] = '\0';
+        head->headers[head->n_headers++] =
+            (struct lwan_key_value){.key = line, .value = value};
+    }
+
+    return true;
+}
+
+/* Parses the CGI response head, which, unlike HTTP, might use bare line
+ * feeds.  uwsgi applications usually send a HTTP status line as well. */
+static bool parse_head(struct cgi_head *head, char *end)
+{
+    char *p = head->buffer;
+
+    head->code = 0;
+
+    if (!strncmp(p, "HTTP/1.", 7)) {
+        char *line_end = memchr(p, '\n', (size_t)(end - p));
+
+        if (!line_end || line_end - p < 12 || p[8] != ' ')
+            return false;
+        for (int i = 9; i < 12; i++) {
+            if (p[i] < '0' || p[i] > '9')
+                return false;
+        }
+
+        head->code = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+        p = line_end + 1;
+    }
+
+    while (p < end) {
+        char *line_end = memchr(p, '\n', (size_t)(end - p));
+        char *next = line_end + 1;
+
+        if (line_end > p && line_end[-1] == '\r')
+            line_end--;
+        if (line_end == p)
+            break;
+
+        if (!parse_header(head, p, line_end))
+            return false;
+
+        p = next;
+    }
+
+    if (!head->code)
+        head->code = head->has_location ? 302 : 200;
+
+    return true;
+}
+
+static char *find_end_of_head(char *buffer, size_t len)
+{
+    for (char *p = buffer; (p = memchr(p, '\n', len - (size_t)(p - buffer)));
+         p++) {
+        const size_t left = len - (size_t)(p - buffer) - 1;
+
+        if (left >= 1 && p[1] == '\n')
+            return p + 2;
+        if (left >= 2 && p[1] == '\r' && p[2] == '\n')
+            return p + 3;
+    }
+
+    return NULL;
+}
+
+enum read_head_result {
+    HEAD_OK,
+    HEAD_NO_RESPONSE,
+    HEAD_INVALID,
+};
+
+static enum read_head_result read_head(struct cgi_conn *conn,
+                                       struct cgi_head *head)
+{
+    size_t searched = 0;
+
+    head->used = 0;
+    head->n_headers = 0;
+    head->content_type = NULL;
+    head->has_location = false;
+
+    while (true) {
+        const char *data;
+        size_t len;
+        char *end;
+
+        switch (read_output(conn, &data, &len, true)) {
+        case OUTPUT_DATA:
+            break;
+        case OUTPUT_END:
+            /* The application finished without writing anything. */
+            if (!head->used && conn->priv->protocol == PROTOCOL_FASTCGI)
+                return HEAD_INVALID;
+            /* Fallthrough */
+        default:
+            return conn->received ? HEAD_INVALID : HEAD_NO_RESPONSE;
+        }
+
+        if (len > BUFFER_SIZE - 1 - head->used)
+            return HEAD_INVALID;
+        memcpy(head->buffer + head->used, data, len);
+        head->used += len;
+        head->buffer[head->used] = '\0';
+
+        end = find_end_of_head(head->buffer + searched, head->used - searched);
+        if (!end) {
+            searched = head->used > 2 ? head->used - 2 : 0;
+            continue;
+        }
+
+        if (!parse_head(head, end))
+            return HEAD_INVALID;
+
+        head->body = end;
+        head->body_len = head->used - (size_t)(end - head->buffer);
+        return HEAD_OK;
+    }
+}
+
+static enum lwan_http_status stream_output(struct cgi_conn *conn,
+                                           enum lwan_http_status status)
+{
+    struct lwan_request *request = conn->request;
+    struct lwan_strbuf *out = request->response.buffer;
+
+    lwan_upstream_conn_park(conn->up);
+    if (UNLIKELY(!lwan_response_set_chunked(request, status)))
+        return HTTP_INTERNAL_ERROR;
+
+    while (true) {
+        const char *data;
+        size_t len;
+        bool block = true;
+
+        lwan_response_send_chunk(request);
+
+        /* Gather whatever is available before sending the next chunk. */
+        while (lwan_strbuf_get_length(out) < MAX_BUFFERED_OUTPUT) {
+            switch (read_output(conn, &data, &len, block)) {
+            case OUTPUT_DATA:
+                if (UNLIKELY(!lwan_strbuf_append_str(out, data, len)))
+                    goto abort;
+                block = false;
+                continue;
+            case OUTPUT_END:
+                /* The final chunk is sent by lwan_response(), which
+                 * discards whatever is left in the buffer. */
+                lwan_upstream_conn_park(conn->up);
+                if (lwan_strbuf_get_length(out))
+                    lwan_response_send_chunk(request);
+                return status;
+            case OUTPUT_WOULD_BLOCK:
+                break;
+            case OUTPUT_ERROR:
+                goto abort;
+            }
+
+            break;
+        }
+
+        lwan_upstream_conn_park(conn->up);
+    }
+
+abort:
+    /* Too late to tell the client anything went wrong. */
+    coro_yield(request->conn->coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
+
+static enum lwan_http_status send_output(struct cgi_conn *conn,
+                                         struct cgi_head *head,
+                                         enum lwan_http_status status)
+{
+    struct lwan_request *request = conn->request;
+    struct lwan_strbuf *out = request->response.buffer;
+    const bool is_head =
+        lwan_request_get_method(request) == REQUEST_METHOD_HEAD;
+
+    if (!is_head && !lwan_strbuf_set(out, head->body, head->body_len))
+        return HTTP_INTERNAL_ERROR;
+
+    /* Responses that are available right away (which is usually the case)
+     * are sent in one go, with a Content-Length header. */
+    while (true) {
+        const char *data;
+        size_t len;
+
+        switch (read_output(conn, &data, &len, false)) {
+        case OUTPUT_DATA:
+            if (is_head)
+                continue;
+            if (UNLIKELY(!lwan_strbuf_append_str(out, data, len)))
+                return HTTP_INTERNAL_ERROR;
+            if (lwan_strbuf_get_length(out) >= MAX_BUFFERED_OUTPUT)
+                return stream_output(conn, status);
+            continue;
+
+        case OUTPUT_END:
+            lwan_upstream_conn_park(conn->up);
+            return status;
+
+        case OUTPUT_WOULD_BLOCK:
+            if (!is_head && lwan_strbuf_get_length(out))
+                return stream_output(conn, status);
+
+            switch (read_output(conn, &data, &len, true)) {
+            case OUTPUT_DATA:
+                if (!is_head && UNLIKELY(!lwan_strbuf_append_str(out, data, len)))
+                    return HTTP_INTERNAL_ERROR;
+                continue;
+            case OUTPUT_END:
+                lwan_upstream_conn_park(conn->up);
+                return status;
+            default:
+                break;
+            }
+            /* Fallthrough */
+        case OUTPUT_ERROR:
+            lwan_strbuf_reset(out);
+            return HTTP_BAD_GATEWAY;
+        }
+    }
+}
+
+static enum lwan_http_status
+fastcgi_handle_request(struct lwan_request *request,
+                       struct lwan_response *response,
+                       void *instance)
+{
+    struct fastcgi_priv *priv = instance;
+    struct coro *coro = request->conn->coro;
+    struct cgi_head head;
+    struct cgi_conn *conn;
+    enum lwan_http_status status;
+    size_t exclude = SIZE_MAX;
+    bool has_body;
+
+    /* Requests in HTTP/2 streams can't await on other file descriptors, as
+     * all streams share the connection socket. */
+    if (UNLIKELY(request->conn->flags & CONN_IS_HTTP2_STREAM))
+        return HTTP_NOT_IMPLEMENTED;
+
+    conn = coro_malloc(coro, sizeof(*conn));
+    head.buffer = coro_malloc(coro, BUFFER_SIZE);
+    head.headers = coro_malloc(coro, (MAX_HEADERS + 1) * sizeof(*head.headers));
+    if (UNLIKELY(!conn || !head.buffer || !head.headers))
+        return HTTP_INTERNAL_ERROR;
+
+    *conn = (struct cgi_conn){
+        .priv = priv,
+        .up = lwan_upstream_conn_new(priv->upstreams, request),
+        .request = request,
+        .buffer = coro_malloc(coro, BUFFER_SIZE),
+    };
+    if (UNLIKELY(!conn->up || !conn->buffer))
+        return HTTP_INTERNAL_ERROR;
+
+    /* The response buffer is used to build the request, as nothing is
+     * written to it until the response head is read. */
+    status = priv->protocol == PROTOCOL_FASTCGI
+                 ? build_fastcgi_request(priv, request, response->buffer,
+                                         &has_body)
+                 : build_uwsgi_request(priv, request, response->buffer,
+                                       &has_body);
+    if (UNLIKELY(status != HTTP_OK)) {
+        lwan_strbuf_reset(response->buffer);
+        return status;
+    }
+
+    /* One extra try for connections taken from the pool that have been
+     * closed by the upstream before this request could be sent. */
+    for (size_t tries = lwan_upstream_set_count(priv->upstreams) + 1; tries;
+         tries--) {
+        if (!lwan_upstream_conn_open(conn->up, exclude)) {
+            lwan_upstream_failed(priv->upstreams, conn->up->upstream);
+            lwan_upstream_conn_close(conn->up);
+            exclude = conn->up->upstream;
+            continue;
+        }
+
+        conn->pos = conn->used = conn->received = 0;
+        conn->remaining = conn->padding = 0;
+        conn->ended = false;
+
+        if (lwan_upstream_conn_write(conn->up,
+                                     lwan_strbuf_get_buffer(response->buffer),
+                                     lwan_strbuf_get_length(response->buffer),
+                                     0)) {
+            if (has_body) {
+                switch (send_body(conn)) {
+                case SEND_BODY_OK:
+                    break;
+                case SEND_BODY_CLIENT_ERROR:
+                    lwan_strbuf_reset(response->buffer);
+                    return HTTP_BAD_REQUEST;
+                case SEND_BODY_UPSTREAM_ERROR:
+                    goto failed;
+                }
+            }
+
+            switch (read_head(conn, &head)) {
+            case HEAD_OK:
+                lwan_upstream_succeeded(priv->upstreams, conn->up->upstream);
+                goto got_response;
+            case HEAD_INVALID:
+                lwan_status_error(
+                    "Invalid response from upstream %s",
+                    lwan_upstream_name(priv->upstreams, conn->up->upstream));
+                lwan_upstream_conn_close(conn->up);
+                lwan_strbuf_reset(response->buffer);
+                return HTTP_BAD_GATEWAY;
+            case HEAD_NO_RESPONSE:
+                break;
+            }
+        }
+
+    failed:
+        lwan_upstream_conn_close(conn->up);
+
+        /* Only requests that couldn't possibly have been seen by the
+         * upstream are tried again. */
+        if (!conn->up->reused) {
+            lwan_upstream_failed(priv->upstreams, conn->up->upstream);
+            break;
+        }
+        if (has_body)
+            break;
+    }
+
+    lwan_strbuf_reset(response->buffer);
+    return HTTP_BAD_GATEWAY;
+
+got_response:
+    lwan_strbuf_reset(response->buffer);
+
+    head.headers[head.n_headers] = (struct lwan_key_value){};
+    response->headers = head.headers;
+    response->mime_type =
+        head.content_type ? head.content_type : "application/octet-stream";
+
+    return send_output(conn, &head, lwan_upstream_status(head.code));
+}
+
+static void fastcgi_destroy(void *data)
+{
+    struct fastcgi_priv *priv = data;
+
+    if (priv) {
+        lwan_upstream_set_free(priv->upstreams);
+        free(priv->document_root);
+        free(priv->script);
+        free(priv);
+    }
+}
+
+static void *cgi_create(enum cgi_protocol protocol,
+                    const struct lwan_fastcgi_settings *settings)
+{
+    struct fastcgi_priv *priv = calloc(1, sizeof(*priv));
+
+    if (!priv)
+        return NULL;
+
+    priv->protocol = protocol;
+    priv->upstreams = lwan_upstream_set_new(
+        settings->upstreams,
+        &(struct lwan_upstream_options){
+            .least_connections = settings->least_connections,
+            /* uwsgi servers close the connection after each response. */
+            .max_idle = protocol == PROTOCOL_FASTCGI ? settings->max_idle : 0,
+            .max_fails = settings->max_fails,
+            .fail_timeout = settings->fail_timeout,
+        });
+    if (!priv->upstreams)
+        goto error;
+
+    if (settings->document_root) {
+        priv->document_root = strdup(settings->document_root);
+        if (!priv->document_root)
+            goto error;
+
+        priv->document_root_len = strlen(priv->document_root);
+        while (priv->document_root_len > 1 &&
+               priv->document_root[priv->document_root_len - 1] == '/')
+            priv->document_root[--priv->document_root_len] = '\0';
+    }
+
+    if (settings->script) {
+        priv->script = strdup(settings->script);
+        if (!priv->script)
+            goto error;
+    }
+
+    return priv;
+
+error:
+    fastcgi_destroy(priv);
+    return NULL;
+}
+
+static void *fastcgi_create(const char *prefix __attribute__((unused)),
+                            void *instance)
+{
+    return cgi_create(PROTOCOL_FASTCGI, instance);
+}
+
+static void *uwsgi_create(const char *prefix __attribute__((unused)),
+                          void *instance)
+{
+    return cgi_create(PROTOCOL_UWSGI, instance);
+}
+
+static bool settings_from_hash(struct lwan_fastcgi_settings *settings,
+                               const struct hash *hash)
+{
+    const char *balance = hash_find(hash, "balance");
+
+    *settings = (struct lwan_fastcgi_settings){
+        .upstreams = hash_find(hash, "upstreams"),
+        .document_root = hash_find(hash, "document_root"),
+        .script = hash_find(hash, "script"),
+        .max_idle = (unsigned int)LWAN_MAX(
+            parse_int(hash_find(hash, "max_idle"), 16), 0),
+        .max_fails = (unsigned int)LWAN_MAX(
+            parse_int(hash_find(hash, "max_fails"), 3), 1),
+        .fail_timeout = (unsigned int)LWAN_MAX(
+            parse_int(hash_find(hash, "fail_timeout"), 10), 0),
+    };
+
+    if (!balance || streq(balance, "round_robin"))
+        return true;
+    if (streq(balance, "least_connections")) {
+        settings->least_connections = true;
+        return true;
+    }
+
+    lwan_status_error("Unknown balancing method: %s", balance);
+    return false;
+}
+
+static void *fastcgi_create_from_hash(const char *prefix,
+                                      const struct hash *hash)
+{
+    struct lwan_fastcgi_settings settings;
+
+    if (!settings_from_hash(&settings, hash))
+        return NULL;
+
+    return fastcgi_create(prefix, &settings);
+}
+
+static void *uwsgi_create_from_hash(const char *prefix,
+                                    const struct hash *hash)
+{
+    struct lwan_fastcgi_settings settings;
+
+    if (!settings_from_hash(&settings, hash))
+        return NULL;
+
+    return uwsgi_create(prefix, &settings);
+}
+
+static const struct lwan_module fastcgi_module = {
+    .create = fastcgi_create,
+    .create_from_hash = fastcgi_create_from_hash,
+    .destroy = fastcgi_destroy,
+    .handle_request = fastcgi_handle_request,
+    .flags = HANDLER_STREAMS_BODY_DATA,
+};
+
+LWAN_REGISTER_MODULE(fastcgi, &fastcgi_module);
+
+static const struct lwan_module uwsgi_module = {
+    .create = uwsgi_create,
+    .create_from_hash = uwsgi_create_from_hash,
+    .destroy = fastcgi_destroy,
+    .handle_request = fastcgi_handle_request,
+    .flags = HANDLER_STREAMS_BODY_DATA,
+};
+
+LWAN_REGISTER_MODULE(uwsgi, &uwsgi_module);
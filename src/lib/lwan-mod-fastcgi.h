@@ -0,0 +1,62 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "lwan.h"
+
+/* Used by both the fastcgi and the uwsgi modules. */
+struct lwan_fastcgi_settings {
+    /* Space-separated list of host:port pairs or unix:/path/to/sockets */
+    const char *upstreams;
+    /* SCRIPT_FILENAME is the request path appended to this, unless... */
+    const char *document_root;
+    /* ...this is set, in which case all requests are handled by this
+     * script, with the request path as PATH_INFO */
+    const char *script;
+    bool least_connections;
+    /* Idle connections kept per upstream, per I/O thread (FastCGI only) */
+    unsigned int max_idle;
+    /* Consecutive failures before an upstream is taken out of rotation
+     * for fail_timeout seconds */
+    unsigned int max_fails;
+    unsigned int fail_timeout;
+};
+
+LWAN_MODULE_FORWARD_DECL(fastcgi)
+LWAN_MODULE_FORWARD_DECL(uwsgi)
+
+#define FASTCGI(upstreams_)                                                    \
+    .module = LWAN_MODULE_REF(fastcgi),                                        \
+    .args = ((struct lwan_fastcgi_settings[]) {{                               \
+        .upstreams = (upstreams_),                                             \
+        .max_idle = 16,                                                        \
+        .max_fails = 3,                                                        \
+        .fail_timeout = 10,                                                    \
+    }}),                                                                       \
+    .flags = HANDLER_STREAMS_BODY_DATA
+
+#define UWSGI(upstreams_)                                                      \
+    .module = LWAN_MODULE_REF(uwsgi),                                          \
+    .args = ((struct lwan_fastcgi_settings[]) {{                               \
+        .upstreams = (upstreams_),                                             \
+        .max_fails = 3,                                                        \
+        .fail_timeout = 10,                                                    \
+    }}),                                                                       \
+    .flags = HANDLER_STREAMS_BODY_DATA
@@ -36,8 +36,7 @@
 
 struct lwan_lua_priv {
     char *default_type;
-    char *script_file;
-    char *script;
+    struct lwan_strbuf bytecode;
     pthread_key_t cache_key;
     unsigned cache_period;
 };
@@ -45,8 +44,24 @@ struct lwan_lua_priv {
 struct lwan_lua_state {
     struct cache_entry base;
     lua_State *L;
+    /* See account_memory() */
+    int64_t accounted_size;
 };
 
+/* Lua keeps track of how much memory each state is using, so rather than
+ * giving states an allocator that accounts for every allocation (which
+ * LuaJIT doesn't allow on some 64-bit targets), the difference is accounted
+ * for whenever a request is done with a state. */
+static void account_memory(void *data)
+{
+    struct lwan_lua_state *state = data;
+    const int64_t size = (int64_t)lua_gc(state->L, LUA_GCCOUNT, 0) * 1024 +
+                         lua_gc(state->L, LUA_GCCOUNTB, 0);
+
+    lwan_memory_account(LWAN_MEMORY_LUA, size - state->accounted_size);
+    state->accounted_size = size;
+}
+
 static struct cache_entry *state_create(const char *key __attribute__((unused)),
                                         void *context)
 {
@@ -56,9 +71,14 @@ static struct cache_entry *state_create(const char *key __attribute__((unused)),
     if (UNLIKELY(!state))
         return NULL;
 
-    state->L = lwan_lua_create_state(priv->script_file, priv->script);
-    if (LIKELY(state->L))
+    state->L = lwan_lua_create_state_from_bytecode(
+        lwan_strbuf_get_buffer(&priv->bytecode),
+        lwan_strbuf_get_length(&priv->bytecode));
+    if (LIKELY(state->L)) {
+        state->accounted_size = 0;
+        account_memory(state);
         return (struct cache_entry *)state;
+    }
 
     free(state);
     return NULL;
@@ -70,6 +90,7 @@ static void state_destroy(struct cache_entry *entry,
     struct lwan_lua_state *state = (struct lwan_lua_state *)entry;
 
     lua_close(state->L);
+    lwan_memory_account(LWAN_MEMORY_LUA, -state->accounted_size);
     free(state);
 }
 
@@ -81,8 +102,14 @@ static struct cache *get_or_create_cache(struct lwan_lua_priv *priv)
         lwan_status_debug("Creating cache for this thread");
         cache =
             cache_create(state_create, state_destroy, priv, priv->cache_period);
-        if (UNLIKELY(!cache))
+        if (UNLIKELY(!cache)) {
             lwan_status_error("Could not create cache");
+            return NULL;
+        }
+        /* Let the cache pruner create a new state once the current one
+         * expires, rather than the request that happens to notice it. */
+        cache_set_stale_while_revalidate(cache, priv->cache_period);
+        cache_set_name(cache, "lua_states");
         /* FIXME: This cache instance leaks: store it somewhere and
          * free it on module shutdown */
         pthread_setspecific(priv->cache_key, cache);
@@ -188,6 +215,7 @@ static enum lwan_http_status lua_handle_request(struct lwan_request *request,
             cache, request->conn->coro, "");
     if (UNLIKELY(!state))
         return HTTP_NOT_FOUND;
+    coro_defer(request->conn->coro, account_memory, state);
 
     lua_State *L = push_newthread(state->L, request->conn->coro);
     if (UNLIKELY(!L))
@@ -242,23 +270,19 @@ static void *lua_create(const char *prefix __attribute__((unused)), void *data)
         goto error;
     }
 
-    if (settings->script) {
-        priv->script = strdup(settings->script);
-        if (!priv->script) {
-            lwan_status_perror("strdup");
-            goto error;
-        }
-    } else if (settings->script_file) {
-        priv->script_file = strdup(settings->script_file);
-        if (!priv->script_file) {
-            lwan_status_perror("strdup");
-            goto error;
-        }
-    } else {
+    if (!settings->script && !settings->script_file) {
         lwan_status_error("No Lua script_file or script provided");
         goto error;
     }
 
+    /* Per-thread states are created from this whenever they expire, so
+     * the script is only read and parsed once. */
+    lwan_strbuf_init(&priv->bytecode);
+    if (!lwan_lua_compile_script(
+            settings->script ? NULL : settings->script_file, settings->script,
+            &priv->bytecode))
+        goto error;
+
     if (pthread_key_create(&priv->cache_key, NULL)) {
         lwan_status_perror("pthread_key_create");
         goto error;
@@ -269,9 +293,8 @@ static void *lua_create(const char *prefix __attribute__((unused)), void *data)
     return priv;
 
 error:
-    free(priv->script_file);
+    lwan_strbuf_free(&priv->bytecode);
     free(priv->default_type);
-    free(priv->script);
     free(priv);
 
     return NULL;
@@ -284,8 +307,7 @@ static void lua_destroy(void *instance)
     if (priv) {
         pthread_key_delete(priv->cache_key);
         free(priv->default_type);
-        free(priv->script_file);
-        free(priv->script);
+        lwan_strbuf_free(&priv->bytecode);
         free(priv);
     }
 }
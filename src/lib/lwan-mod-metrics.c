@@ -0,0 +1,412 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "lwan-private.h"
+#include "lwan-mod-metrics.h"
+
+struct metric {
+    const char *name;
+    const char *type;
+    const char *help;
+    uint64_t (*get)(const struct lwan_thread *t);
+};
+
+#define GENERATE_COUNTER_GETTER(field_)                                        \
+    static uint64_t get_##field_(const struct lwan_thread *t)                  \
+    {                                                                          \
+        return ATOMIC_READ(t->metrics.field_);                                 \
+    }
+
+GENERATE_COUNTER_GETTER(requests)
+GENERATE_COUNTER_GETTER(accepted)
+GENERATE_COUNTER_GETTER(rejected)
+GENERATE_COUNTER_GETTER(donated)
+GENERATE_COUNTER_GETTER(slow_clients)
+GENERATE_COUNTER_GETTER(evicted)
+GENERATE_COUNTER_GETTER(match_budget_exhausted)
+GENERATE_COUNTER_GETTER(cache_hits)
+GENERATE_COUNTER_GETTER(cache_misses)
+GENERATE_COUNTER_GETTER(loops)
+GENERATE_COUNTER_GETTER(events)
+GENERATE_COUNTER_GETTER(defers)
+
+#undef GENERATE_COUNTER_GETTER
+
+static uint64_t get_open_connections(const struct lwan_thread *t)
+{
+    return ATOMIC_READ(t->n_connections);
+}
+
+static uint64_t get_pending_connections(const struct lwan_thread *t)
+{
+    return spsc_queue_length(&t->pending_fds);
+}
+
+static uint64_t get_pooled_coroutines(const struct lwan_thread *t)
+{
+    return ATOMIC_READ(t->coro_pool.count);
+}
+
+static uint64_t get_busy_poll_window(const struct lwan_thread *t)
+{
+    return ATOMIC_READ(t->busy_poll.window_us);
+}
+
+static const struct metric metrics[] = {
+    {"lwan_requests_total", "counter", "Requests processed.", get_requests},
+    {"lwan_connections_accepted_total", "counter",
+     "Connections accepted by an I/O thread.", get_accepted},
+    {"lwan_connections_rejected_total", "counter",
+     "Connections turned away with a 503 response.", get_rejected},
+    {"lwan_connections_donated_total", "counter",
+     "Idle connections handed over to another I/O thread.", get_donated},
+    {"lwan_connections_slow_clients_total", "counter",
+     "Connections closed for reading responses slower than min_send_rate.",
+     get_slow_clients},
+    {"lwan_connections_evicted_total", "counter",
+     "Idle connections closed to free up file descriptors or memory.",
+     get_evicted},
+    {"lwan_rewrite_match_budget_exhausted_total", "counter",
+     "Rewrite pattern searches given up for backtracking or recursing too "
+     "much.",
+     get_match_budget_exhausted},
+    {"lwan_cache_hits_total", "counter", "Cache lookups that found an entry.",
+     get_cache_hits},
+    {"lwan_cache_misses_total", "counter",
+     "Cache lookups that had to create an entry.", get_cache_misses},
+    {"lwan_event_loop_iterations_total", "counter",
+     "Times I/O threads woke up to handle events.", get_loops},
+    {"lwan_events_total", "counter", "Events handled by I/O threads.",
+     get_events},
+    {"lwan_deferred_calls_total", "counter",
+     "Cleanup calls registered by coroutines while handling requests.",
+     get_defers},
+    {"lwan_open_connections", "gauge", "Connections currently open.",
+     get_open_connections},
+    {"lwan_pending_connections", "gauge",
+     "Connections waiting to be picked up by an I/O thread.",
+     get_pending_connections},
+    {"lwan_pooled_coroutines", "gauge", "Idle coroutines kept for reuse.",
+     get_pooled_coroutines},
+    {"lwan_busy_poll_window_microseconds", "gauge",
+     "Current busy polling window.", get_busy_poll_window},
+};
+
+static bool append_header(struct lwan_strbuf *buffer,
+                          const char *name,
+                          const char *type,
+                          const char *help)
+{
+    return lwan_strbuf_append_printf(buffer, "# HELP %s %s\n# TYPE %s %s\n",
+                                     name, help, name, type);
+}
+
+static bool append_metric(struct lwan_strbuf *buffer,
+                          const struct lwan *l,
+                          const struct metric *metric,
+                          bool per_thread)
+{
+    uint64_t total = 0;
+
+    if (!append_header(buffer, metric->name, metric->type, metric->help))
+        return false;
+
+    for (unsigned int i = 0; i < l->thread.count; i++) {
+        uint64_t value = metric->get(&l->thread.threads[i]);
+
+        if (per_thread) {
+            if (!lwan_strbuf_append_printf(buffer, "%s{thread=\"%u\"} %" PRIu64
+                                           "\n", metric->name, i, value))
+                return false;
+        } else {
+            total += value;
+        }
+    }
+
+    if (per_thread)
+        return true;
+
+    return lwan_strbuf_append_printf(buffer, "%s %" PRIu64 "\n", metric->name,
+                                     total);
+}
+
+static bool append_responses(struct lwan_strbuf *buffer,
+                             const struct lwan *l,
+                             bool per_thread)
+{
+    static const char name[] = "lwan_responses_total";
+
+    if (!append_header(buffer, name, "counter",
+                       "Responses sent, by status code class."))
+        return false;
+
+    for (unsigned int class = 0; class < 5; class++) {
+        uint64_t total = 0;
+
+        for (unsigned int i = 0; i < l->thread.count; i++) {
+            const struct lwan_thread *t = &l->thread.threads[i];
+            uint64_t value = ATOMIC_READ(t->metrics.responses[class]);
+
+            if (per_thread) {
+                if (!lwan_strbuf_append_printf(
+                        buffer, "%s{thread=\"%u\",class=\"%uxx\"} %" PRIu64 "\n",
+                        name, i, class + 1, value))
+                    return false;
+            } else {
+                total += value;
+            }
+        }
+
+        if (!per_thread &&
+            !lwan_strbuf_append_printf(buffer,
+                                       "%s{class=\"%uxx\"} %" PRIu64 "\n", name,
+                                       class + 1, total))
+            return false;
+    }
+
+    return true;
+}
+
+static bool append_readahead(struct lwan_strbuf *buffer)
+{
+    static const char name[] = "lwan_readahead_commands_total";
+    struct lwan_readahead_stats stats;
+
+    lwan_readahead_get_stats(&stats);
+
+    return append_header(buffer, name, "counter",
+                         "Readahead commands, by what happened to them.") &&
+           lwan_strbuf_append_printf(
+               buffer,
+               "%s{result=\"queued\"} %" PRIu64 "\n"
+               "%s{result=\"coalesced\"} %" PRIu64 "\n"
+               "%s{result=\"dropped\"} %" PRIu64 "\n",
+               name, stats.queued, name, stats.coalesced, name,
+               stats.dropped) &&
+           append_header(buffer, "lwan_readahead_queue_depth", "gauge",
+                         "Readahead commands waiting to be issued.") &&
+           lwan_strbuf_append_printf(buffer, "lwan_readahead_queue_depth %u\n",
+                                     stats.depth) &&
+           append_header(buffer, "lwan_readahead_queue_max_depth", "gauge",
+                         "Most readahead commands ever waiting at once.") &&
+           lwan_strbuf_append_printf(buffer,
+                                     "lwan_readahead_queue_max_depth %u\n",
+                                     stats.max_depth);
+}
+
+static bool append_memory(struct lwan_strbuf *buffer, const struct lwan *l)
+{
+    static const char name[] = "lwan_memory_bytes";
+
+    if (!append_header(buffer, name, "gauge",
+                       "Memory allocated, by subsystem."))
+        return false;
+
+    for (enum lwan_memory_subsystem s = 0; s < LWAN_MEMORY_N_SUBSYSTEMS; s++) {
+        if (!lwan_strbuf_append_printf(buffer,
+                                       "%s{subsystem=\"%s\"} %" PRId64 "\n",
+                                       name, lwan_memory_subsystem_name(s),
+                                       lwan_memory_get(l, s)))
+            return false;
+    }
+
+    return true;
+}
+
+static const struct route_histogram_info {
+    const char *name;
+    const char *help;
+    /* Histograms are recorded in microseconds, but exported in seconds. */
+    bool seconds;
+} route_histograms[LWAN_ROUTE_N] = {
+    [LWAN_ROUTE_PARSE] = {"lwan_route_parse_duration_seconds",
+                          "Time to parse requests, by URL map.", true},
+    [LWAN_ROUTE_HANDLER] = {"lwan_route_handler_duration_seconds",
+                            "Time spent in handlers, by URL map.", true},
+    [LWAN_ROUTE_WRITE] = {"lwan_route_write_duration_seconds",
+                          "Time to write responses, by URL map.", true},
+    [LWAN_ROUTE_BYTES_OUT] = {"lwan_route_response_size_bytes",
+                              "Bytes sent in responses, by URL map.", false},
+};
+
+struct route_histogram {
+    struct lwan_strbuf *buffer;
+    const char *name;
+    unsigned int kind;
+    bool seconds;
+};
+
+static bool append_route_label(struct lwan_strbuf *buffer, const char *route)
+{
+    if (!lwan_strbuf_append_strz(buffer, "{route=\""))
+        return false;
+
+    for (const char *p = route; *p; p++) {
+        if ((*p == '"' || *p == '\\') && !lwan_strbuf_append_char(buffer, '\\'))
+            return false;
+        if (!lwan_strbuf_append_char(buffer, *p))
+            return false;
+    }
+
+    return lwan_strbuf_append_char(buffer, '"');
+}
+
+static bool append_route_value(const struct route_histogram *rh, uint64_t value)
+{
+    if (rh->seconds) {
+        return lwan_strbuf_append_printf(rh->buffer, "%" PRIu64 ".%06" PRIu64,
+                                         value / 1000000, value % 1000000);
+    }
+
+    return lwan_strbuf_append_printf(rh->buffer, "%" PRIu64, value);
+}
+
+static bool
+append_route_histogram(const char *route,
+                       const struct lwan_histogram merged[static LWAN_ROUTE_N],
+                       void *data)
+{
+    const struct route_histogram *rh = data;
+    const struct lwan_histogram *h = &merged[rh->kind];
+    struct lwan_strbuf *buffer = rh->buffer;
+    int last = LWAN_HISTOGRAM_BUCKETS - 2;
+    uint64_t count = 0;
+
+    /* Empty buckets at the end aren't interesting; the last bucket has no
+     * upper bound, so it's only represented by the "+Inf" one. */
+    while (last >= 0 && !h->buckets[last] && !h->buckets[last + 1])
+        last--;
+
+    for (int b = 0; b <= last; b++) {
+        count += h->buckets[b];
+
+        if (!lwan_strbuf_append_printf(buffer, "%s_bucket", rh->name) ||
+            !append_route_label(buffer, route) ||
+            !lwan_strbuf_append_strz(buffer, ",le=\"") ||
+            !append_route_value(rh, lwan_histogram_bucket_upper_bound(
+                                        (unsigned int)b)) ||
+            !lwan_strbuf_append_printf(buffer, "\"} %" PRIu64 "\n", count))
+            return false;
+    }
+    for (int b = last + 1; b < LWAN_HISTOGRAM_BUCKETS; b++)
+        count += h->buckets[b];
+
+    return lwan_strbuf_append_printf(buffer, "%s_bucket", rh->name) &&
+           append_route_label(buffer, route) &&
+           lwan_strbuf_append_printf(buffer, ",le=\"+Inf\"} %" PRIu64 "\n",
+                                     count) &&
+           lwan_strbuf_append_printf(buffer, "%s_sum", rh->name) &&
+           append_route_label(buffer, route) &&
+           lwan_strbuf_append_strz(buffer, "} ") &&
+           append_route_value(rh, h->sum) &&
+           lwan_strbuf_append_printf(buffer, "\n%s_count", rh->name) &&
+           append_route_label(buffer, route) &&
+           lwan_strbuf_append_printf(buffer, "} %" PRIu64 "\n", count);
+}
+
+static bool append_routes(struct lwan_strbuf *buffer)
+{
+    for (unsigned int kind = 0; kind < LWAN_ROUTE_N; kind++) {
+        const struct route_histogram_info *info = &route_histograms[kind];
+        struct route_histogram rh = {
+            .buffer = buffer,
+            .name = info->name,
+            .kind = kind,
+            .seconds = info->seconds,
+        };
+
+        if (!append_header(buffer, info->name, "histogram", info->help))
+            return false;
+        if (!lwan_route_stats_for_each(append_route_histogram, &rh))
+            return false;
+    }
+
+    return true;
+}
+
+static enum lwan_http_status
+metrics_handle_request(struct lwan_request *request,
+                       struct lwan_response *response,
+                       void *instance)
+{
+    const struct lwan_metrics_settings *settings = instance;
+    const struct lwan *l = request->conn->thread->lwan;
+
+    if (!append_responses(response->buffer, l, settings->per_thread))
+        return HTTP_INTERNAL_ERROR;
+    if (!append_readahead(response->buffer))
+        return HTTP_INTERNAL_ERROR;
+    if (!append_memory(response->buffer, l))
+        return HTTP_INTERNAL_ERROR;
+    if (!append_routes(response->buffer))
+        return HTTP_INTERNAL_ERROR;
+
+    for (size_t i = 0; i < N_ELEMENTS(metrics); i++) {
+        if (!append_metric(response->buffer, l, &metrics[i],
+                           settings->per_thread))
+            return HTTP_INTERNAL_ERROR;
+    }
+
+    response->mime_type = "text/plain; version=0.0.4";
+
+    return HTTP_OK;
+}
+
+static void *metrics_create(const char *prefix __attribute__((unused)),
+                            void *instance)
+{
+    struct lwan_metrics_settings *settings = instance;
+    struct lwan_metrics_settings *priv = malloc(sizeof(*priv));
+
+    if (!priv)
+        return NULL;
+
+    *priv = *settings;
+
+    return priv;
+}
+
+static void *metrics_create_from_hash(const char *prefix,
+                                      const struct hash *hash)
+{
+    struct lwan_metrics_settings settings = {
+        .per_thread = parse_bool(hash_find(hash, "per_thread"), false),
+    };
+
+    return metrics_create(prefix, &settings);
+}
+
+static void metrics_destroy(void *data)
+{
+    free(data);
+}
+
+static const struct lwan_module module = {
+    .create = metrics_create,
+    .create_from_hash = metrics_create_from_hash,
+    .destroy = metrics_destroy,
+    .handle_request = metrics_handle_request,
+};
+
+LWAN_REGISTER_MODULE(metrics, &module);
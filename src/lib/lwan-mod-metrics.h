@@ -0,0 +1,36 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include "lwan.h"
+
+struct lwan_metrics_settings {
+    bool per_thread;
+};
+
+LWAN_MODULE_FORWARD_DECL(metrics)
+
+#define METRICS(per_thread_)                                                   \
+    .module = LWAN_MODULE_REF(metrics),                                        \
+    .args = ((struct lwan_metrics_settings[]) {{                               \
+        .per_thread = (per_thread_),                                           \
+    }}),                                                                       \
+    .flags = (enum lwan_handler_flags)0
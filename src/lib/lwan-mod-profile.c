@@ -0,0 +1,146 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+
+#include "lwan-private.h"
+#include "lwan-mod-profile.h"
+
+/* Seconds sampled if the request doesn't say */
+#define DEFAULT_SECONDS 10
+
+struct profile_priv {
+    unsigned int frequency;
+    unsigned int max_seconds;
+};
+
+struct profile_session {
+    struct lwan *lwan;
+    bool finished;
+};
+
+static void cancel_session(void *data)
+{
+    struct profile_session *session = data;
+
+    /* The client went away while the profile was being taken. */
+    if (!session->finished)
+        lwan_profiler_cancel(session->lwan);
+}
+
+static enum lwan_http_status
+profile_handle_request(struct lwan_request *request,
+                       struct lwan_response *response,
+                       void *instance)
+{
+    const struct profile_priv *priv = instance;
+    struct lwan *l = request->conn->thread->lwan;
+    struct profile_session *session;
+    long seconds;
+
+    seconds = parse_long(lwan_request_get_query_param(request, "seconds"),
+                         DEFAULT_SECONDS);
+    if (seconds <= 0 || seconds > (long)priv->max_seconds)
+        return HTTP_BAD_REQUEST;
+
+    session = coro_malloc(request->conn->coro, sizeof(*session));
+    if (!session)
+        return HTTP_INTERNAL_ERROR;
+    *session = (struct profile_session){.lwan = l};
+
+    /* Timers count CPU time, which can't go faster than wall clock time;
+     * a few more samples leave room for timers firing a bit early. */
+    if (!lwan_profiler_start(
+            l, priv->frequency,
+            priv->frequency * ((unsigned int)seconds + 1))) {
+        switch (errno) {
+        case EBUSY:
+            return HTTP_CONFLICT;
+        case ENOTSUP:
+            return HTTP_NOT_IMPLEMENTED;
+        default:
+            return HTTP_INTERNAL_ERROR;
+        }
+    }
+    coro_defer(request->conn->coro, cancel_session, session);
+
+    lwan_request_sleep(request, (uint64_t)seconds * 1000);
+
+    session->finished = true;
+    if (!lwan_profiler_finish(l, response->buffer))
+        return HTTP_INTERNAL_ERROR;
+
+    response->mime_type = "text/plain";
+    return HTTP_OK;
+}
+
+static void *profile_create(const char *prefix __attribute__((unused)),
+                            void *instance)
+{
+    struct lwan_profile_settings *settings = instance;
+    struct profile_priv *priv;
+
+    if (!settings->frequency || settings->frequency > 1000) {
+        lwan_status_error("Profiler frequency must be between 1 and 1000");
+        return NULL;
+    }
+    if (!settings->max_seconds || settings->max_seconds > 3600) {
+        lwan_status_error("Profiles can't be longer than an hour");
+        return NULL;
+    }
+
+    priv = malloc(sizeof(*priv));
+    if (!priv)
+        return NULL;
+
+    priv->frequency = settings->frequency;
+    priv->max_seconds = settings->max_seconds;
+
+    /* Modules set up from the configuration file are created before I/O
+     * threads are; otherwise, requests will get a 501 response. */
+    lwan_profiler_enable();
+
+    return priv;
+}
+
+static void *profile_create_from_hash(const char *prefix,
+                                      const struct hash *hash)
+{
+    struct lwan_profile_settings settings = {
+        .frequency = (unsigned int)parse_int(hash_find(hash, "frequency"), 99),
+        .max_seconds =
+            (unsigned int)parse_int(hash_find(hash, "max_seconds"), 60),
+    };
+
+    return profile_create(prefix, &settings);
+}
+
+static void profile_destroy(void *instance) { free(instance); }
+
+static const struct lwan_module module = {
+    .create = profile_create,
+    .create_from_hash = profile_create_from_hash,
+    .destroy = profile_destroy,
+    .handle_request = profile_handle_request,
+};
+
+LWAN_REGISTER_MODULE(profile, &module);
@@ -0,0 +1,1226 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "int-to-str.h"
+#include "lwan-io-wrappers.h"
+#include "lwan-mod-proxy.h"
+#include "lwan-upstream.h"
+
+#define MAX_THREADS 256
+#define MAX_IDLE_PIPES 4
+
+/* Response heads have to fit in this buffer, which is also used to read
+ * (and write) bodies. */
+#define BUFFER_SIZE 16384
+#define MAX_HEADERS 64
+
+/* Fixed-length bodies with at least this much left to read after the
+ * response head are moved from the upstream to the client with splice(),
+ * through a pipe, without being copied to user space. */
+#define SPLICE_THRESHOLD 16384
+
+/* Room for the size of a chunk, in hex, when forwarding chunked bodies */
+#define CHUNK_SIZE_LEN 8
+
+/* Only ever touched by the I/O thread it belongs to. */
+struct proxy_pipes {
+    unsigned int n_pipes;
+    int pipes[MAX_IDLE_PIPES][2];
+};
+
+struct proxy_priv {
+    struct lwan_upstream_set *upstreams;
+
+    char *path;
+    size_t path_len;
+
+    /* "Host: ...\r\n\r\n" for each upstream */
+    char **host_lines;
+    bool preserve_host;
+
+    struct proxy_pipes pipes[MAX_THREADS];
+};
+
+struct proxy_conn {
+    struct proxy_priv *priv;
+    struct proxy_pipes *pipes;
+    struct lwan_upstream_conn *up;
+    struct lwan_request *request;
+
+    int pipe_fd[2];
+    size_t in_pipe;
+};
+
+enum body_framing {
+    BODY_NONE,
+    BODY_LENGTH,
+    BODY_CHUNKED,
+    BODY_UNTIL_CLOSE,
+};
+
+struct upstream_response {
+    int code;
+    enum body_framing framing;
+    size_t content_length;
+    const char *content_type;
+
+    struct lwan_key_value *headers;
+    size_t n_headers;
+
+    bool has_content_length;
+    bool keep_alive;
+
+    /* Read along with the head */
+    char *body;
+    size_t body_len;
+};
+
+enum chunked_state {
+    CHUNKED_SIZE,
+    CHUNKED_EXTENSION,
+    CHUNKED_DATA,
+    CHUNKED_DATA_CR,
+    CHUNKED_DATA_LF,
+    CHUNKED_TRAILER,
+    CHUNKED_DONE,
+};
+
+struct chunked_decoder {
+    enum chunked_state state;
+    size_t remaining;
+    unsigned int n_digits;
+    bool at_line_start;
+};
+
+static void release_pipe(void *data)
+{
+    struct proxy_conn *conn = data;
+    struct proxy_pipes *pipes = conn->pipes;
+
+    if (conn->pipe_fd[0] < 0)
+        return;
+
+    /* Pipes with something left in them (because splicing was cut short)
+     * can't be reused. */
+    if (!conn->in_pipe && pipes->n_pipes < MAX_IDLE_PIPES) {
+        pipes->pipes[pipes->n_pipes][0] = conn->pipe_fd[0];
+        pipes->pipes[pipes->n_pipes][1] = conn->pipe_fd[1];
+        pipes->n_pipes++;
+    } else {
+        close(conn->pipe_fd[0]);
+        close(conn->pipe_fd[1]);
+    }
+}
+
+static bool append_target(const struct proxy_priv *priv,
+                          struct lwan_request *request,
+                          struct lwan_strbuf *buf)
+{
+    static const char path_safe[] = "-._~!$&'()*+,;=:@/";
+    const char *url = request->url.value;
+    size_t url_len = request->url.len;
+
+    if (!lwan_strbuf_append_str(buf, priv->path, priv->path_len))
+        return false;
+    if (url_len && *url == '/' && priv->path[priv->path_len - 1] == '/') {
+        url++;
+        url_len--;
+    }
+    if (!lwan_upstream_append_encoded(buf, url, url_len, path_safe))
+        return false;
+
+    if (!request->helper->query_string.len)
+        return true;
+
+    return lwan_strbuf_append_char(buf, '?') &&
+           lwan_upstream_append_query(request, buf);
+}
+
+#define HEADER_IS(name_, len_, const_)                                         \
+    ((len_) == sizeof(const_) - 1 &&                                           \
+     !strncasecmp((name_), (const_), sizeof(const_) - 1))
+
+static bool is_hop_by_hop_header(const char *name, size_t len)
+{
+    return HEADER_IS(name, len, "Connection") ||
+           HEADER_IS(name, len, "Keep-Alive") ||
+           HEADER_IS(name, len, "Proxy-Authenticate") ||
+           HEADER_IS(name, len, "Proxy-Authorization") ||
+           HEADER_IS(name, len, "Proxy-Connection") ||
+           HEADER_IS(name, len, "TE") || HEADER_IS(name, len, "Trailer") ||
+           HEADER_IS(name, len, "Transfer-Encoding") ||
+           HEADER_IS(name, len, "Upgrade");
+}
+
+/* Headers listed in the Connection header are hop-by-hop as well. */
+static bool listed_in_connection(const struct lwan_value *connection,
+                                 const char *name,
+                                 size_t len)
+{
+    const char *p = connection->value;
+    const char *end = p + connection->len;
+
+    while (p < end) {
+        const char *token;
+
+        while (p < end && (*p == ' ' || *p == ','))
+            p++;
+
+        token = p;
+        while (p < end && *p != ' ' && *p != ',')
+            p++;
+
+        if ((size_t)(p - token) == len && !strncasecmp(token, name, len))
+            return true;
+    }
+
+    return false;
+}
+
+static bool forward_request_header(struct lwan_request_parser_helper *helper,
+                                   const char *name,
+                                   size_t len)
+{
+    if (is_hop_by_hop_header(name, len))
+        return false;
+
+    /* These are either added later, or taken care of by Lwan. */
+    if (HEADER_IS(name, len, "Host") || HEADER_IS(name, len, "Content-Length") ||
+        HEADER_IS(name, len, "Expect") ||
+        HEADER_IS(name, len, "X-Forwarded-For"))
+        return false;
+
+    return !helper->connection.len ||
+           !listed_in_connection(&helper->connection, name, len);
+}
+
+static bool build_request_head(const struct proxy_priv *priv,
+                               struct lwan_request *request,
+                               struct lwan_strbuf *buf,
+                               bool *has_body)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+    const char *method = lwan_upstream_method_name(request);
+    const char *forwarded_for;
+    const char *remote;
+    char ip[INET6_ADDRSTRLEN];
+
+    if (UNLIKELY(!method))
+        return false;
+
+    lwan_strbuf_reset(buf);
+    if (!lwan_strbuf_append_strz(buf, method) ||
+        !lwan_strbuf_append_char(buf, ' ') ||
+        !append_target(priv, request, buf) ||
+        !lwan_strbuf_append_strz(buf, " HTTP/1.1\r\n"))
+        return false;
+
+    for (size_t i = 0; i < helper->n_header_start; i++) {
+        const char *start = helper->header_start[i];
+        const char *end = helper->header_start[i + 1] - (sizeof("\r\n") - 1);
+        const char *colon = memchr(start, ':', (size_t)(end - start));
+
+        if (UNLIKELY(!colon))
+            continue;
+        if (!forward_request_header(helper, start, (size_t)(colon - start)))
+            continue;
+
+        /* Lookups might have replaced the line terminator with a NUL. */
+        if (!lwan_strbuf_append_str(buf, start, (size_t)(end - start)) ||
+            !lwan_strbuf_append_str(buf, "\r\n", 2))
+            return false;
+    }
+
+    remote = lwan_request_get_remote_address(request, ip);
+    forwarded_for =
+        lwan_request_get_header_by_id(request, LWAN_HEADER_X_FORWARDED_FOR);
+    if (remote) {
+        if (forwarded_for) {
+            if (!lwan_strbuf_append_printf(buf, "X-Forwarded-For: %s, %s\r\n",
+                                           forwarded_for, remote))
+                return false;
+        } else if (!lwan_strbuf_append_printf(buf, "X-Forwarded-For: %s\r\n",
+                                              remote)) {
+            return false;
+        }
+    }
+
+    /* Whatever the client used, it's decoded by Lwan and sent upstream
+     * with the same framing, so that it doesn't have to be buffered. */
+    if (helper->transfer_encoding.value) {
+        *has_body = true;
+        return lwan_strbuf_append_strz(buf, "Transfer-Encoding: chunked\r\n");
+    }
+    if (helper->content_length.value &&
+        parse_long_long(helper->content_length.value, 0) > 0) {
+        *has_body = true;
+        return lwan_strbuf_append_printf(buf, "Content-Length: %s\r\n",
+                                         helper->content_length.value);
+    }
+
+    *has_body = false;
+    return true;
+}
+
+static const char *host_line(const struct proxy_conn *conn, size_t *len)
+{
+    struct lwan_request *request = conn->request;
+    if (conn->priv->preserve_host) {
+        const char *host =
+            lwan_request_get_header_by_id(request, LWAN_HEADER_HOST);
+
+        if (host) {
+            char *line = coro_printf(request->conn->coro, "Host: %s\r\n\r\n",
+                                     host);
+            if (line) {
+                *len = strlen(line);
+                return line;
+            }
+        }
+    }
+
+    *len = strlen(conn->priv->host_lines[conn->up->upstream]);
+    return conn->priv->host_lines[conn->up->upstream];
+}
+
+enum send_body_result {
+    SEND_BODY_OK,
+    SEND_BODY_UPSTREAM_ERROR,
+    SEND_BODY_CLIENT_ERROR,
+};
+
+static enum send_body_result
+send_body(struct proxy_conn *conn, char *buffer, bool chunked)
+{
+    char *data = buffer + CHUNK_SIZE_LEN + 2;
+    const size_t max_len = BUFFER_SIZE - CHUNK_SIZE_LEN - 4;
+
+    while (true) {
+        /* Reading the body might wait on the client. */
+        lwan_upstream_conn_park(conn->up);
+
+        ssize_t n = lwan_request_read_body(conn->request, data, max_len);
+        if (n < 0)
+            return SEND_BODY_CLIENT_ERROR;
+
+        if (!chunked) {
+            if (!n)
+                return SEND_BODY_OK;
+            if (!lwan_upstream_conn_write(conn->up, data, (size_t)n, 0))
+                return SEND_BODY_UPSTREAM_ERROR;
+            continue;
+        }
+
+        if (!n) {
+            return lwan_upstream_conn_write(conn->up, "0\r\n\r\n", 5, 0)
+                       ? SEND_BODY_OK
+                       : SEND_BODY_UPSTREAM_ERROR;
+        }
+
+        char size[CHUNK_SIZE_LEN + 3];
+        int size_len = snprintf(size, sizeof(size), "%zx\r\n", (size_t)n);
+        char *chunk = data - size_len;
+
+        memcpy(chunk, size, (size_t)size_len);
+        memcpy(data + n, "\r\n", 2);
+        if (!lwan_upstream_conn_write(conn->up, chunk, (size_t)(size_len + n + 2), 0))
+            return SEND_BODY_UPSTREAM_ERROR;
+    }
+}
+
+static bool parse_content_length(const char *value, size_t *length)
+{
+    size_t parsed = 0;
+
+    if (!*value)
+        return false;
+
+    for (; *value; value++) {
+        if (*value < '0' || *value > '9')
+            return false;
+        if (__builtin_mul_overflow(parsed, 10, &parsed) ||
+            __builtin_add_overflow(parsed, (size_t)(*value - '0'), &parsed))
+            return false;
+    }
+
+    *length = parsed;
+    return true;
+}
+
+static bool ends_with_token(const char *value, const char *token)
+{
+    size_t value_len = strlen(value);
+    size_t token_len = strlen(token);
+
+    while (value_len && value[value_len - 1] == ' ')
+        value_len--;
+
+    return value_len >= token_len &&
+           !strncasecmp(value + value_len - token_len, token, token_len) &&
+           (value_len == token_len ||
+            value[value_len - token_len - 1] == ' ' ||
+            value[value_len - token_len - 1] == ',');
+}
+
+static bool parse_header(struct upstream_response *resp,
+                         char *name,
+                         size_t name_len,
+                         char *value,
+                         bool *chunked,
+                         bool *has_transfer_encoding)
+{
+    if (HEADER_IS(name, name_len, "Content-Length")) {
+        size_t length;
+
+        if (!parse_content_length(value, &length))
+            return false;
+        if (resp->has_content_length && length != resp->content_length)
+            return false;
+
+        resp->content_length = length;
+        resp->has_content_length = true;
+        return true;
+    }
+
+    if (HEADER_IS(name, name_len, "Transfer-Encoding")) {
+        *has_transfer_encoding = true;
+        *chunked = ends_with_token(value, "chunked");
+        return true;
+    }
+
+    if (HEADER_IS(name, name_len, "Connection")) {
+        const struct lwan_value connection = {.value = value,
+                                              .len = strlen(value)};
+
+        if (listed_in_connection(&connection, "close", 5))
+            resp->keep_alive = false;
+        else if (listed_in_connection(&connection, "keep-alive", 10))
+            resp->keep_alive = true;
+        return true;
+    }
+
+    if (HEADER_IS(name, name_len, "Content-Type")) {
+        resp->content_type = value;
+        return true;
+    }
+
+    /* Lwan generates these. */
+    if (is_hop_by_hop_header(name, name_len) ||
+        HEADER_IS(name, name_len, "Date") || HEADER_IS(name, name_len, "Server"))
+        return true;
+
+    if (LIKELY(resp->n_headers < MAX_HEADERS)) {
+        name[name_len] = '\0';
+        resp->headers[resp->n_headers++] =
+            (struct lwan_key_value){.key = name, .value = value};
+    }
+
+    return true;
+}
+
+/* Parses the response head in [buf, end), where end points right after the
+ * empty line.  Header names and values are terminated in place. */
+static bool parse_head(struct lwan_request *request,
+                       char *buf,
+                       char *end,
+                       struct upstream_response *resp)
+{
+    bool chunked = false, has_transfer_encoding = false;
+    char *p = buf;
+
+    if (strncmp(p, "HTTP/1.", 7) || (p[7] != '0' && p[7] != '1') ||
+        p[8] != ' ')
+        return false;
+    for (int i = 9; i < 12; i++) {
+        if (p[i] < '0' || p[i] > '9')
+            return false;
+    }
+    if (p[12] != ' ' && p[12] != '\r')
+        return false;
+
+    resp->code = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+    resp->keep_alive = p[7] == '1';
+    resp->has_content_length = false;
+    resp->content_type = NULL;
+    resp->n_headers = 0;
+
+    p = memchr(p, '\n', (size_t)(end - p)) + 1;
+    while (p < end - 2) {
+        char *line_end = memchr(p, '\n', (size_t)(end - p));
+        char *colon, *value, *value_end;
+
+        /* Obsolete line folding isn't supported. */
+        if (*p == ' ' || *p == '\t')
+            return false;
+
+        value_end = line_end;
+        if (value_end[-1] == '\r')
+            value_end--;
+        colon = memchr(p, ':', (size_t)(value_end - p));
+        if (!colon || colon == p)
+            return false;
+
+        for (value = colon + 1; value < value_end && *value == ' '; value++)
+            ;
+        while (value_end > value && value_end[-1] == ' ')
+            value_end--;
+        *value_end = '\0';
+
+        if (!parse_header(resp, p, (size_t)(colon - p), value, &chunked,
+                          &has_transfer_encoding))
+            return false;
+
+        p = line_end + 1;
+    }
+
+    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD ||
+        resp->code == 204 || resp->code == 304) {
+        resp->framing = BODY_NONE;
+    } else if (has_transfer_encoding) {
+        /* A response with both is sketchy; don't reuse the connection. */
+        if (resp->has_content_length)
+            resp->keep_alive = false;
+        resp->has_content_length = false;
+
+        if (chunked) {
+            resp->framing = BODY_CHUNKED;
+        } else {
+            resp->framing = BODY_UNTIL_CLOSE;
+            resp->keep_alive = false;
+        }
+    } else if (resp->has_content_length) {
+        resp->framing = BODY_LENGTH;
+    } else {
+        resp->framing = BODY_UNTIL_CLOSE;
+        resp->keep_alive = false;
+    }
+
+    return true;
+}
+
+enum read_head_result {
+    HEAD_OK,
+    HEAD_NO_RESPONSE,
+    HEAD_INVALID,
+};
+
+static enum read_head_result
+read_head(struct proxy_conn *conn, char *buf, struct upstream_response *resp)
+{
+    size_t used = 0;
+    size_t searched = 0;
+
+    while (true) {
+        ssize_t r = lwan_upstream_conn_read(conn->up, buf + used, BUFFER_SIZE - used);
+        char *end;
+
+        if (r <= 0)
+            return used ? HEAD_INVALID : HEAD_NO_RESPONSE;
+        used += (size_t)r;
+
+    find_end:
+        end = memmem(buf + searched, used - searched, "\r\n\r\n", 4);
+        if (!end) {
+            if (used == BUFFER_SIZE)
+                return HEAD_INVALID;
+
+            searched = used > 3 ? used - 3 : 0;
+            continue;
+        }
+        end += 4;
+
+        if (!parse_head(conn->request, buf, end, resp))
+            return HEAD_INVALID;
+
+        if (resp->code < 200) {
+            /* Interim responses (e.g. 103 Early Hints) aren't relayed. */
+            used -= (size_t)(end - buf);
+            memmove(buf, end, used);
+            searched = 0;
+            if (used)
+                goto find_end;
+            continue;
+        }
+
+        resp->body = end;
+        resp->body_len = used - (size_t)(end - buf);
+        return HEAD_OK;
+    }
+}
+
+static bool decode_chunked(struct chunked_decoder *decoder,
+                           const char **pos,
+                           const char *end,
+                           struct lwan_strbuf *out)
+{
+    const char *p = *pos;
+
+    while (p < end && decoder->state != CHUNKED_DONE) {
+        const char ch = *p;
+
+        switch (decoder->state) {
+        case CHUNKED_SIZE: {
+            int digit;
+
+            if (ch >= '0' && ch <= '9')
+                digit = ch - '0';
+            else if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f')
+                digit = (ch | 0x20) - 'a' + 10;
+            else if (ch == ';' || ch == ' ' || ch == '\r' || ch == '\n')
+                digit = -1;
+            else
+                return false;
+
+            if (digit >= 0) {
+                if (++decoder->n_digits > 15)
+                    return false;
+                decoder->remaining = decoder->remaining * 16 + (size_t)digit;
+                break;
+            }
+
+            if (!decoder->n_digits)
+                return false;
+            decoder->state = CHUNKED_EXTENSION;
+        }
+            /* Fallthrough */
+        case CHUNKED_EXTENSION:
+            if (ch == '\n') {
+                decoder->n_digits = 0;
+                if (decoder->remaining) {
+                    decoder->state = CHUNKED_DATA;
+                } else {
+                    decoder->state = CHUNKED_TRAILER;
+                    decoder->at_line_start = true;
+                }
+            }
+            break;
+
+        case CHUNKED_DATA: {
+            size_t len = LWAN_MIN(decoder->remaining, (size_t)(end - p));
+
+            if (!lwan_strbuf_append_str(out, p, len))
+                return false;
+
+            decoder->remaining -= len;
+            if (!decoder->remaining)
+                decoder->state = CHUNKED_DATA_CR;
+            p += len;
+            continue;
+        }
+
+        case CHUNKED_DATA_CR:
+            if (ch == '\n') {
+                decoder->state = CHUNKED_SIZE;
+                break;
+            }
+            if (ch != '\r')
+                return false;
+            decoder->state = CHUNKED_DATA_LF;
+            break;
+
+        case CHUNKED_DATA_LF:
+            if (ch != '\n')
+                return false;
+            decoder->state = CHUNKED_SIZE;
+            break;
+
+        case CHUNKED_TRAILER:
+            /* Trailer fields are dropped. */
+            if (ch == '\n') {
+                if (decoder->at_line_start)
+                    decoder->state = CHUNKED_DONE;
+                decoder->at_line_start = true;
+            } else if (ch != '\r') {
+                decoder->at_line_start = false;
+            }
+            break;
+
+        case CHUNKED_DONE:
+            break;
+        }
+
+        p++;
+    }
+
+    *pos = p;
+    return true;
+}
+
+/* Reads a chunked or a close-delimited body, either sending it to the
+ * client as it arrives (with chunked encoding), or keeping all of it in
+ * the response buffer. */
+static bool read_streamed_body(struct proxy_conn *conn,
+                               struct upstream_response *resp,
+                               bool stream)
+{
+    struct lwan_request *request = conn->request;
+    struct lwan_strbuf *out = request->response.buffer;
+    struct chunked_decoder decoder = {.state = CHUNKED_SIZE};
+    const char *pos = resp->body;
+    const char *end = pos + resp->body_len;
+    char *buffer = NULL;
+
+    while (true) {
+        ssize_t r;
+
+        if (resp->framing == BODY_CHUNKED) {
+            if (!decode_chunked(&decoder, &pos, end, out))
+                return false;
+
+            if (decoder.state == CHUNKED_DONE) {
+                /* Anything after the body can't be trusted. */
+                if (pos != end)
+                    resp->keep_alive = false;
+                if (stream && lwan_strbuf_get_length(out))
+                    lwan_response_send_chunk(request);
+                return true;
+            }
+        } else if (!lwan_strbuf_append_str(out, pos, (size_t)(end - pos))) {
+            return false;
+        }
+
+        if (stream && lwan_strbuf_get_length(out)) {
+            lwan_upstream_conn_park(conn->up);
+            lwan_response_send_chunk(request);
+        }
+
+        /* The head buffer can't be reused, as the response headers point
+         * to it. */
+        if (!buffer) {
+            buffer = coro_malloc(request->conn->coro, BUFFER_SIZE);
+            if (UNLIKELY(!buffer))
+                return false;
+        }
+
+        r = lwan_upstream_conn_read(conn->up, buffer, BUFFER_SIZE);
+        if (r < 0)
+            return false;
+        if (r == 0)
+            return resp->framing == BODY_UNTIL_CLOSE;
+
+        pos = buffer;
+        end = buffer + r;
+    }
+}
+
+static bool read_length_body(struct proxy_conn *conn,
+                             struct upstream_response *resp)
+{
+    struct lwan_strbuf *out = conn->request->response.buffer;
+    size_t have = LWAN_MIN(resp->body_len, resp->content_length);
+    size_t remaining = resp->content_length - have;
+    char *p;
+
+    if (resp->body_len > resp->content_length)
+        resp->keep_alive = false;
+
+    if (!lwan_strbuf_set(out, resp->body, have))
+        return false;
+    if (!remaining)
+        return true;
+
+    p = lwan_strbuf_extend_unsafe(out, remaining);
+    if (UNLIKELY(!p))
+        return false;
+
+    while (remaining) {
+        ssize_t r = lwan_upstream_conn_read(conn->up, p, remaining);
+
+        if (r <= 0)
+            return false;
+
+        p += r;
+        remaining -= (size_t)r;
+    }
+
+    return true;
+}
+
+static bool take_pipe(struct proxy_conn *conn)
+{
+    struct proxy_pipes *pipes = conn->pipes;
+
+    if (pipes->n_pipes) {
+        pipes->n_pipes--;
+        conn->pipe_fd[0] = pipes->pipes[pipes->n_pipes][0];
+        conn->pipe_fd[1] = pipes->pipes[pipes->n_pipes][1];
+        return true;
+    }
+
+    if (pipe2(conn->pipe_fd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        conn->pipe_fd[0] = conn->pipe_fd[1] = -1;
+        return false;
+    }
+
+    /* Larger pipes mean fewer calls to splice(); it's fine if this fails. */
+    (void)fcntl(conn->pipe_fd[1], F_SETPIPE_SZ, 1 << 20);
+    return true;
+}
+
+static void splice_body(struct proxy_conn *conn, size_t remaining)
+{
+    struct lwan_request *request = conn->request;
+    struct coro *coro = request->conn->coro;
+
+    while (remaining) {
+        ssize_t in = splice(conn->up->fd, NULL, conn->pipe_fd[1], NULL, remaining,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (in <= 0) {
+            if (in < 0 && errno == EAGAIN) {
+                lwan_upstream_conn_await(conn->up, false);
+                continue;
+            }
+            if (in < 0 && errno == EINTR)
+                continue;
+            goto abort;
+        }
+
+        conn->in_pipe += (size_t)in;
+        remaining -= (size_t)in;
+
+        while (conn->in_pipe) {
+            ssize_t out = splice(conn->pipe_fd[0], NULL, request->fd, NULL,
+                                 conn->in_pipe,
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK |
+                                     (remaining ? SPLICE_F_MORE : 0));
+
+            if (out < 0) {
+                if (errno == EAGAIN) {
+                    lwan_connection_clear_ready(request->conn,
+                                                CONN_READY_WRITE);
+                    lwan_upstream_conn_park(conn->up);
+                    coro_yield(coro, CONN_CORO_WANT_WRITE);
+                    continue;
+                }
+                if (errno == EINTR)
+                    continue;
+                goto abort;
+            }
+
+            conn->in_pipe -= (size_t)out;
+            request->helper->bytes_sent += (size_t)out;
+        }
+    }
+
+    return;
+
+abort:
+    coro_yield(coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
+
+/* The response head is sent by the module, rather than by lwan_response(),
+ * as it might not fit in the buffer used there, and because the length of
+ * the body is known before it is read. */
+static size_t prepare_response_head(struct proxy_conn *conn,
+                                    struct upstream_response *resp,
+                                    enum lwan_http_status status,
+                                    char *content_length,
+                                    char *headers,
+                                    size_t headers_size)
+{
+    struct lwan_request *request = conn->request;
+    size_t len;
+
+    if (resp->has_content_length && resp->code != 204) {
+        resp->headers[resp->n_headers++] = (struct lwan_key_value){
+            .key = "Content-Length",
+            .value = uint_to_string(resp->content_length, content_length, &len),
+        };
+    }
+    resp->headers[resp->n_headers] = (struct lwan_key_value){};
+
+    request->flags |= RESPONSE_NO_CONTENT_LENGTH;
+    len = lwan_prepare_response_header(request, status, headers, headers_size);
+    if (UNLIKELY(!len)) {
+        request->flags &= ~RESPONSE_NO_CONTENT_LENGTH;
+        request->response.headers = NULL;
+        return 0;
+    }
+
+    request->flags |= RESPONSE_SENT_HEADERS;
+    return len;
+}
+
+static enum lwan_http_status send_response(struct proxy_conn *conn,
+                                           struct upstream_response *resp,
+                                           enum lwan_http_status status)
+{
+    struct lwan_request *request = conn->request;
+    char content_length[INT_TO_STR_BUFFER_SIZE];
+    char headers[DEFAULT_BUFFER_SIZE];
+    size_t headers_len;
+
+    if (resp->framing == BODY_CHUNKED || resp->framing == BODY_UNTIL_CLOSE) {
+        lwan_upstream_conn_park(conn->up);
+        resp->headers[resp->n_headers] = (struct lwan_key_value){};
+        if (UNLIKELY(!lwan_response_set_chunked(request, status)))
+            return HTTP_BAD_GATEWAY;
+
+        if (!read_streamed_body(conn, resp, true)) {
+            /* Too late to tell the client anything went wrong. */
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+
+        conn->up->reusable = resp->keep_alive;
+        return status;
+    }
+
+    if (resp->framing == BODY_NONE) {
+        headers_len = prepare_response_head(conn, resp, status, content_length,
+                                            headers, sizeof(headers));
+        if (UNLIKELY(!headers_len))
+            return HTTP_BAD_GATEWAY;
+
+        lwan_upstream_conn_park(conn->up);
+        lwan_send(request, headers, headers_len, 0);
+
+        conn->up->reusable = resp->keep_alive && !resp->body_len;
+        return status;
+    }
+
+    const size_t remaining =
+        resp->content_length - LWAN_MIN(resp->body_len, resp->content_length);
+
+    if (remaining >= SPLICE_THRESHOLD && resp->body_len <= resp->content_length &&
+        take_pipe(conn)) {
+        headers_len = prepare_response_head(conn, resp, status, content_length,
+                                            headers, sizeof(headers));
+        if (UNLIKELY(!headers_len))
+            return HTTP_BAD_GATEWAY;
+
+        lwan_upstream_conn_park(conn->up);
+        lwan_send(request, headers, headers_len, MSG_MORE);
+        if (resp->body_len)
+            lwan_send(request, resp->body, resp->body_len, MSG_MORE);
+        splice_body(conn, remaining);
+
+        conn->up->reusable = resp->keep_alive;
+        return status;
+    }
+
+    if (!read_length_body(conn, resp))
+        return HTTP_BAD_GATEWAY;
+
+    headers_len = prepare_response_head(conn, resp, status, content_length,
+                                        headers, sizeof(headers));
+    if (UNLIKELY(!headers_len))
+        return HTTP_BAD_GATEWAY;
+
+    struct iovec vec[] = {
+        {.iov_base = headers, .iov_len = headers_len},
+        {.iov_base = lwan_strbuf_get_buffer(request->response.buffer),
+         .iov_len = lwan_strbuf_get_length(request->response.buffer)},
+    };
+    lwan_upstream_conn_park(conn->up);
+    lwan_writev(request, vec, N_ELEMENTS(vec));
+
+    conn->up->reusable = resp->keep_alive;
+    return status;
+}
+
+/* Error responses go through lwan_response(), which doesn't send most
+ * headers for these anyway. */
+static enum lwan_http_status buffer_response(struct proxy_conn *conn,
+                                             struct upstream_response *resp,
+                                             enum lwan_http_status status)
+{
+    bool ok;
+
+    switch (resp->framing) {
+    case BODY_NONE:
+        ok = true;
+        break;
+    case BODY_LENGTH:
+        ok = read_length_body(conn, resp);
+        break;
+    default:
+        ok = read_streamed_body(conn, resp, false);
+        break;
+    }
+
+    if (!ok) {
+        lwan_strbuf_reset(conn->request->response.buffer);
+        return HTTP_BAD_GATEWAY;
+    }
+
+    resp->headers[resp->n_headers] = (struct lwan_key_value){};
+    conn->up->reusable = resp->keep_alive;
+    return status;
+}
+
+static enum lwan_http_status
+proxy_handle_request(struct lwan_request *request,
+                     struct lwan_response *response,
+                     void *instance)
+{
+    struct proxy_priv *priv = instance;
+    struct coro *coro = request->conn->coro;
+    struct lwan_thread *t = request->conn->thread;
+    struct upstream_response resp;
+    struct proxy_conn *conn;
+    enum lwan_http_status status;
+    size_t exclude = SIZE_MAX;
+    bool has_body;
+    char *buffer;
+
+    /* Requests in HTTP/2 streams can't await on other file descriptors, as
+     * all streams share the connection socket. */
+    if (UNLIKELY(request->conn->flags & CONN_IS_HTTP2_STREAM))
+        return HTTP_NOT_IMPLEMENTED;
+
+    conn = coro_malloc(coro, sizeof(*conn));
+    buffer = coro_malloc(coro, BUFFER_SIZE);
+    resp.headers = coro_malloc(coro, (MAX_HEADERS + 2) * sizeof(*resp.headers));
+    if (UNLIKELY(!conn || !buffer || !resp.headers))
+        return HTTP_INTERNAL_ERROR;
+
+    *conn = (struct proxy_conn){
+        .priv = priv,
+        .pipes = &priv->pipes[t - t->lwan->thread.threads],
+        .up = lwan_upstream_conn_new(priv->upstreams, request),
+        .request = request,
+        .pipe_fd = {-1, -1},
+    };
+    if (UNLIKELY(!conn->up))
+        return HTTP_INTERNAL_ERROR;
+
+    coro_defer(coro, release_pipe, conn);
+
+    /* The response buffer is used to build the request head, as nothing
+     * is written to it until the response head is read. */
+    if (UNLIKELY(!build_request_head(priv, request, response->buffer,
+                                     &has_body)))
+        return HTTP_INTERNAL_ERROR;
+
+    /* One extra try for connections taken from the pool that have been
+     * closed by the upstream before this request could be sent. */
+    for (size_t tries = lwan_upstream_set_count(priv->upstreams) + 1; tries;
+         tries--) {
+        const char *host;
+        size_t host_len;
+
+        if (!lwan_upstream_conn_open(conn->up, exclude)) {
+            lwan_upstream_failed(priv->upstreams, conn->up->upstream);
+            lwan_upstream_conn_close(conn->up);
+            exclude = conn->up->upstream;
+            continue;
+        }
+
+        host = host_line(conn, &host_len);
+
+        if (lwan_upstream_conn_write(conn->up,
+                                     lwan_strbuf_get_buffer(response->buffer),
+                                     lwan_strbuf_get_length(response->buffer),
+                                     MSG_MORE) &&
+            lwan_upstream_conn_write(conn->up, host, host_len, 0)) {
+            if (has_body) {
+                switch (send_body(conn, buffer,
+                                  request->helper->transfer_encoding.value)) {
+                case SEND_BODY_OK:
+                    break;
+                case SEND_BODY_CLIENT_ERROR:
+                    lwan_strbuf_reset(response->buffer);
+                    return HTTP_BAD_REQUEST;
+                case SEND_BODY_UPSTREAM_ERROR:
+                    goto failed;
+                }
+            }
+
+            switch (read_head(conn, buffer, &resp)) {
+            case HEAD_OK:
+                lwan_upstream_succeeded(priv->upstreams, conn->up->upstream);
+                goto got_response;
+            case HEAD_INVALID:
+                lwan_status_error(
+                    "Invalid response from upstream %s",
+                    lwan_upstream_name(priv->upstreams, conn->up->upstream));
+                lwan_upstream_conn_close(conn->up);
+                lwan_strbuf_reset(response->buffer);
+                return HTTP_BAD_GATEWAY;
+            case HEAD_NO_RESPONSE:
+                break;
+            }
+        }
+
+    failed:
+        lwan_upstream_conn_close(conn->up);
+
+        /* Only requests that couldn't possibly have been seen by the
+         * upstream are tried again. */
+        if (!conn->up->reused) {
+            lwan_upstream_failed(priv->upstreams, conn->up->upstream);
+            break;
+        }
+        if (has_body)
+            break;
+    }
+
+    lwan_strbuf_reset(response->buffer);
+    return HTTP_BAD_GATEWAY;
+
+got_response:
+    lwan_strbuf_reset(response->buffer);
+
+    /* Bodies are relayed as encoded by the upstream. */
+    request->flags &= ~RESPONSE_COMPRESS;
+
+    status = lwan_upstream_status(resp.code);
+    response->mime_type =
+        resp.content_type ? resp.content_type : "application/octet-stream";
+    response->headers = resp.headers;
+
+    if (status >= HTTP_BAD_REQUEST)
+        status = buffer_response(conn, &resp, status);
+    else
+        status = send_response(conn, &resp, status);
+
+    /* The response (or what's left of it) is sent by Lwan after this. */
+    lwan_upstream_conn_park(conn->up);
+    return status;
+}
+
+static void proxy_destroy(void *data)
+{
+    struct proxy_priv *priv = data;
+
+    if (!priv)
+        return;
+
+    for (size_t i = 0; i < MAX_THREADS; i++) {
+        for (unsigned int j = 0; j < priv->pipes[i].n_pipes; j++) {
+            close(priv->pipes[i].pipes[j][0]);
+            close(priv->pipes[i].pipes[j][1]);
+        }
+    }
+
+    if (priv->host_lines) {
+        for (size_t i = 0; i < lwan_upstream_set_count(priv->upstreams); i++)
+            free(priv->host_lines[i]);
+        free(priv->host_lines);
+    }
+
+    lwan_upstream_set_free(priv->upstreams);
+    free(priv->path);
+    free(priv);
+}
+
+static void *proxy_create(const char *prefix __attribute__((unused)),
+                          void *instance)
+{
+    struct lwan_proxy_settings *settings = instance;
+    struct proxy_priv *priv;
+    size_t n_upstreams;
+
+    priv = calloc(1, sizeof(*priv));
+    if (!priv)
+        return NULL;
+
+    priv->path = strdup(settings->path ? settings->path : "/");
+    if (!priv->path)
+        goto error;
+    priv->path_len = strlen(priv->path);
+    if (*priv->path != '/') {
+        lwan_status_error("Upstream path must start with /");
+        goto error;
+    }
+
+    priv->upstreams = lwan_upstream_set_new(
+        settings->upstreams,
+        &(struct lwan_upstream_options){
+            .least_connections =
+                settings->balance == PROXY_BALANCE_LEAST_CONNECTIONS,
+            .max_idle = settings->max_idle,
+            .max_fails = settings->max_fails,
+            .fail_timeout = settings->fail_timeout,
+        });
+    if (!priv->upstreams)
+        goto error;
+
+    n_upstreams = lwan_upstream_set_count(priv->upstreams);
+    priv->host_lines = calloc(n_upstreams, sizeof(char *));
+    if (!priv->host_lines)
+        goto error;
+    for (size_t i = 0; i < n_upstreams; i++) {
+        if (asprintf(&priv->host_lines[i], "Host: %s\r\n\r\n",
+                     lwan_upstream_host(priv->upstreams, i)) < 0) {
+            priv->host_lines[i] = NULL;
+            goto error;
+        }
+    }
+
+    priv->preserve_host = settings->preserve_host;
+
+    return priv;
+
+error:
+    proxy_destroy(priv);
+    return NULL;
+}
+
+static void *proxy_create_from_hash(const char *prefix,
+                                    const struct hash *hash)
+{
+    const char *balance = hash_find(hash, "balance");
+    struct lwan_proxy_settings settings = {
+        .upstreams = hash_find(hash, "upstreams"),
+        .path = hash_find(hash, "path"),
+        .max_idle = (unsigned int)LWAN_MAX(
+            parse_int(hash_find(hash, "max_idle"), 16), 0),
+        .max_fails = (unsigned int)LWAN_MAX(
+            parse_int(hash_find(hash, "max_fails"), 3), 1),
+        .fail_timeout = (unsigned int)LWAN_MAX(
+            parse_int(hash_find(hash, "fail_timeout"), 10), 0),
+        .preserve_host = parse_bool(hash_find(hash, "preserve_host"), false),
+    };
+
+    if (!balance || streq(balance, "round_robin")) {
+        settings.balance = PROXY_BALANCE_ROUND_ROBIN;
+    } else if (streq(balance, "least_connections")) {
+        settings.balance = PROXY_BALANCE_LEAST_CONNECTIONS;
+    } else {
+        lwan_status_error("Unknown balancing method: %s", balance);
+        return NULL;
+    }
+
+    return proxy_create(prefix, &settings);
+}
+
+static const struct lwan_module module = {
+    .create = proxy_create,
+    .create_from_hash = proxy_create_from_hash,
+    .destroy = proxy_destroy,
+    .handle_request = proxy_handle_request,
+    .flags = HANDLER_STREAMS_BODY_DATA,
+};
+
+LWAN_REGISTER_MODULE(proxy, &module);
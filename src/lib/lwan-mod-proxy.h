@@ -0,0 +1,55 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "lwan.h"
+
+enum lwan_proxy_balance {
+    PROXY_BALANCE_ROUND_ROBIN,
+    PROXY_BALANCE_LEAST_CONNECTIONS,
+};
+
+struct lwan_proxy_settings {
+    /* Space-separated list of host:port pairs */
+    const char *upstreams;
+    /* Prepended to the request path; "/" if NULL */
+    const char *path;
+    enum lwan_proxy_balance balance;
+    /* Idle connections kept per upstream, per I/O thread */
+    unsigned int max_idle;
+    /* Consecutive failures before an upstream is taken out of rotation
+     * for fail_timeout seconds */
+    unsigned int max_fails;
+    unsigned int fail_timeout;
+    bool preserve_host;
+};
+
+LWAN_MODULE_FORWARD_DECL(proxy)
+
+#define PROXY(upstreams_)                                                      \
+    .module = LWAN_MODULE_REF(proxy),                                          \
+    .args = ((struct lwan_proxy_settings[]) {{                                 \
+        .upstreams = (upstreams_),                                             \
+        .balance = PROXY_BALANCE_ROUND_ROBIN,                                  \
+        .max_idle = 16,                                                        \
+        .max_fails = 3,                                                        \
+        .fail_timeout = 10,                                                    \
+    }}),                                                                       \
+    .flags = HANDLER_STREAMS_BODY_DATA
@@ -35,7 +35,13 @@
 #include <lua.h>
 #include <lualib.h>
 
+#include "int-to-str.h"
+#include "lwan-cache.h"
 #include "lwan-lua.h"
+
+/* How long, in seconds, a thread keeps a Lua state for a pattern around
+ * after creating it; same as the default for the Lua module. */
+#define LUA_STATE_CACHE_PERIOD 15
 #endif
 
 enum pattern_flag {
@@ -51,6 +57,7 @@ enum pattern_flag {
 struct pattern {
     char *pattern;
     char *expand_pattern;
+    struct str_pattern compiled;
     enum pattern_flag flags;
 };
 
@@ -58,6 +65,11 @@ DEFINE_ARRAY_TYPE(pattern_array, struct pattern)
 
 struct private_data {
     struct pattern_array patterns;
+    unsigned int match_step_budget;
+    int match_max_depth;
+#ifdef HAVE_LUA
+    pthread_key_t lua_cache_key;
+#endif
 };
 
 struct str_builder {
@@ -181,34 +193,120 @@ static const char *expand(struct pattern *pattern, const char *orig,
 }
 
 #ifdef HAVE_LUA
-static void
-lua_close_defer(void *data)
+/* Each thread keeps, for each pattern expanded with Lua, a state with the
+ * script already loaded and `handle_rewrite()` already looked up, keyed by
+ * the index of the pattern.  Calls to `handle_rewrite()` can't yield, so
+ * coroutines in the same thread can share a state. */
+struct lua_state {
+    struct cache_entry base;
+    lua_State *L;
+    int handle_rewrite_ref;
+};
+
+static struct cache_entry *lua_state_create(const char *key, void *context)
 {
-    lua_close((lua_State *)data);
+    struct private_data *pd = context;
+    const int index = parse_int(key, -1);
+    struct lua_state *state;
+    struct pattern *pattern;
+
+    if (UNLIKELY(index < 0 ||
+                 (size_t)index >= pattern_array_len(&pd->patterns)))
+        return NULL;
+    pattern = pattern_array_get_elem(&pd->patterns, (size_t)index);
+
+    state = malloc(sizeof(*state));
+    if (UNLIKELY(!state))
+        return NULL;
+
+    state->L = lwan_lua_create_state(NULL, pattern->expand_pattern);
+    if (UNLIKELY(!state->L))
+        goto out_free_state;
+
+    lua_getglobal(state->L, "handle_rewrite");
+    if (!lua_isfunction(state->L, -1)) {
+        lwan_status_error(
+            "Could not obtain reference to `handle_rewrite()` function: %s",
+            lwan_lua_state_last_error(state->L));
+        goto out_close_state;
+    }
+
+    /* Also pops the function from the stack. */
+    state->handle_rewrite_ref = luaL_ref(state->L, LUA_REGISTRYINDEX);
+
+    return (struct cache_entry *)state;
+
+out_close_state:
+    lua_close(state->L);
+out_free_state:
+    free(state);
+    return NULL;
+}
+
+static void lua_state_destroy(struct cache_entry *entry,
+                              void *context __attribute__((unused)))
+{
+    struct lua_state *state = (struct lua_state *)entry;
+
+    lua_close(state->L);
+    free(state);
+}
+
+static void destroy_lua_cache(void *data)
+{
+    /* Called as each thread exits; these are joined before the module
+     * instance is destroyed, so pd is still alive at this point. */
+    cache_destroy(data);
+}
+
+static struct cache *get_or_create_lua_cache(struct private_data *pd)
+{
+    struct cache *cache = pthread_getspecific(pd->lua_cache_key);
+
+    if (UNLIKELY(!cache)) {
+        lwan_status_debug("Creating Lua state cache for this thread");
+        cache = cache_create(lua_state_create, lua_state_destroy, pd,
+                             LUA_STATE_CACHE_PERIOD);
+        if (UNLIKELY(!cache)) {
+            lwan_status_error("Could not create Lua state cache");
+            return NULL;
+        }
+        cache_set_name(cache, "rewrite_lua_states");
+        pthread_setspecific(pd->lua_cache_key, cache);
+    }
+
+    return cache;
 }
 
 static const char *expand_lua(struct lwan_request *request,
+                              struct private_data *pd,
                               struct pattern *pattern, const char *orig,
                               char buffer[static PATH_MAX],
                               const struct str_find *sf, int captures)
 {
+    char key_buffer[INT_TO_STR_BUFFER_SIZE];
     const char *output;
+    const char *ret = NULL;
     size_t output_len;
+    size_t key_len;
     int i;
-    lua_State *L;
 
-    L = lwan_lua_create_state(NULL, pattern->expand_pattern);
-    if (UNLIKELY(!L))
+    struct cache *cache = get_or_create_lua_cache(pd);
+    if (UNLIKELY(!cache))
         return NULL;
-    coro_defer(request->conn->coro, lua_close_defer, L);
 
-    lua_getglobal(L, "handle_rewrite");
-    if (!lua_isfunction(L, -1)) {
-        lwan_status_error(
-            "Could not obtain reference to `handle_rewrite()` function: %s",
-            lwan_lua_state_last_error(L));
+    const char *key = uint_to_string(
+        pattern_array_get_elem_index(&pd->patterns, pattern), key_buffer,
+        &key_len);
+    struct lua_state *state = (struct lua_state *)cache_coro_get_and_ref_entry(
+        cache, request->conn->coro, key);
+    if (UNLIKELY(!state))
         return NULL;
-    }
+
+    lua_State *L = state->L;
+    const int top = lua_gettop(L);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, state->handle_rewrite_ref);
 
     lwan_lua_state_push_request(L, request);
 
@@ -223,17 +321,27 @@ static const char *expand_lua(struct lwan_request *request,
     if (lua_pcall(L, 2, 1, 0) != 0) {
         lwan_status_error("Could not execute `handle_rewrite()` function: %s",
                           lwan_lua_state_last_error(L));
-        return NULL;
+        goto out;
     }
 
     output = lua_tolstring(L, -1, &output_len);
+    if (UNLIKELY(!output)) {
+        lwan_status_error("`handle_rewrite()` didn't return a string");
+        goto out;
+    }
     if (output_len >= PATH_MAX) {
         lwan_status_error("Rewritten URL exceeds %d bytes (got %zu bytes)",
                           PATH_MAX, output_len);
-        return NULL;
+        goto out;
     }
 
-    return memcpy(buffer, output, output_len + 1);
+    ret = memcpy(buffer, output, output_len + 1);
+
+out:
+    /* The state is used again by the next request, so leave its stack
+     * the way it was found. */
+    lua_settop(L, top);
+    return ret;
 }
 #endif
 
@@ -244,23 +352,53 @@ rewrite_handle_request(struct lwan_request *request,
 {
     struct private_data *pd = instance;
     const char *url = request->url.value;
+    uint64_t url_bytes[4] = {};
     char final_url[PATH_MAX];
     struct pattern *p;
 
+    /* Patterns know which bytes all of their matches contain, so the
+     * set of bytes in the URL rules most of them out without running
+     * the matcher at all. */
+    for (size_t i = 0; i < request->url.len; i++) {
+        const unsigned char c = (unsigned char)url[i];
+
+        url_bytes[c / 64] |= 1ull << (c % 64);
+    }
+
     LWAN_ARRAY_FOREACH(&pd->patterns, p) {
+        const uint64_t *required = p->compiled.sp_required;
         struct str_find sf[MAXCAPTURES];
         const char *expanded = NULL;
         const char *errmsg;
         int captures;
 
-        captures = str_find(url, p->pattern, sf, MAXCAPTURES, &errmsg);
-        if (captures <= 0)
+        if ((required[0] & ~url_bytes[0]) | (required[1] & ~url_bytes[1]) |
+            (required[2] & ~url_bytes[2]) | (required[3] & ~url_bytes[3]))
+            continue;
+
+        captures = str_pattern_find(&p->compiled, url, request->url.len, sf,
+                                    MAXCAPTURES, &errmsg);
+        if (captures <= 0) {
+            /* Patterns were checked when loading the configuration, so
+             * the only errors left are the budget running out.  Treat
+             * those as not matching, so that a URL crafted to make one
+             * pattern backtrack doesn't keep the others from being
+             * tried, but keep count, as it might be a pattern that
+             * legitimately needs a bigger budget. */
+            if (UNLIKELY(errmsg != NULL)) {
+                if (lwan_current_thread_metrics)
+                    lwan_current_thread_metrics->match_budget_exhausted++;
+                lwan_status_debug("Gave up matching `%s`: %s", p->pattern,
+                                  errmsg);
+            }
             continue;
+        }
 
         switch (p->flags & PATTERN_EXPAND_MASK) {
 #ifdef HAVE_LUA
         case PATTERN_EXPAND_LUA:
-            expanded = expand_lua(request, p, url, final_url, sf, captures);
+            expanded =
+                expand_lua(request, pd, p, url, final_url, sf, captures);
             break;
 #endif
         case PATTERN_EXPAND_LWAN:
@@ -292,6 +430,15 @@ static void *rewrite_create(const char *prefix __attribute__((unused)),
         return NULL;
 
     pattern_array_init(&pd->patterns);
+    pd->match_step_budget = MAXSTEPS;
+    pd->match_max_depth = MAXCCALLS;
+
+#ifdef HAVE_LUA
+    if (pthread_key_create(&pd->lua_cache_key, destroy_lua_cache)) {
+        free(pd);
+        return NULL;
+    }
+#endif
 
     return pd;
 }
@@ -307,6 +454,9 @@ static void rewrite_destroy(void *instance)
     }
 
     pattern_array_reset(&pd->patterns);
+#ifdef HAVE_LUA
+    pthread_key_delete(pd->lua_cache_key);
+#endif
     free(pd);
 }
 
@@ -324,6 +474,7 @@ static bool rewrite_parse_conf_pattern(struct private_data *pd,
     struct pattern *pattern;
     char *redirect_to = NULL, *rewrite_as = NULL;
     bool expand_with_lua = false;
+    const char *errmsg;
 
     pattern = pattern_array_append0(&pd->patterns);
     if (!pattern)
@@ -333,6 +484,14 @@ static bool rewrite_parse_conf_pattern(struct private_data *pd,
     if (!pattern->pattern)
         goto out;
 
+    if (str_pattern_compile(&pattern->compiled, pattern->pattern,
+                            &errmsg) < 0) {
+        /* The pattern string is freed with the rest in rewrite_destroy(). */
+        config_error(config, "Invalid pattern `%s`: %s", pattern->pattern,
+                     errmsg);
+        return false;
+    }
+
     while ((line = config_read_line(config))) {
         switch (line->type) {
         case CONFIG_LINE_TYPE_LINE:
@@ -406,11 +565,34 @@ static bool rewrite_parse_conf(void *instance, struct config *config)
 {
     struct private_data *pd = instance;
     const struct config_line *line;
+    struct pattern *pattern;
+    long value;
 
     while ((line = config_read_line(config))) {
         switch (line->type) {
         case CONFIG_LINE_TYPE_LINE:
-            config_error(config, "Unknown option: %s", line->key);
+            if (streq(line->key, "match_step_budget")) {
+                value = parse_long(line->value, MAXSTEPS);
+                if (value <= 0 || value > INT_MAX) {
+                    config_error(config, "Invalid match step budget: %ld",
+                                 value);
+                    break;
+                }
+                pd->match_step_budget = (unsigned int)value;
+            } else if (streq(line->key, "match_max_depth")) {
+                value = parse_long(line->value, MAXCCALLS);
+                if (value <= 0 || value > MAXCCALLS) {
+                    /* Coroutine stacks are small, so this can only be
+                     * made stricter. */
+                    config_error(config,
+                                 "Match depth must be between 1 and %d",
+                                 MAXCCALLS);
+                    break;
+                }
+                pd->match_max_depth = (int)value;
+            } else {
+                config_error(config, "Unknown option: %s", line->key);
+            }
             break;
         case CONFIG_LINE_TYPE_SECTION:
             if (streq(line->key, "pattern")) {
@@ -424,6 +606,11 @@ static bool rewrite_parse_conf(void *instance, struct config *config)
         }
     }
 
+    LWAN_ARRAY_FOREACH(&pd->patterns, pattern) {
+        pattern->compiled.sp_maxsteps = pd->match_step_budget;
+        pattern->compiled.sp_maxdepth = pd->match_max_depth;
+    }
+
     return !config_last_error(config);
 }
 
@@ -22,23 +22,34 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <glob.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <zlib.h>
 
+#if defined(HAVE_INOTIFY)
+#include <sys/inotify.h>
+#endif
+
 #include "lwan-private.h"
 
 #include "hash.h"
 #include "realpathat.h"
+#include "lwan-asset-pack.h"
 #include "lwan-cache.h"
 #include "lwan-config.h"
 #include "lwan-io-wrappers.h"
 #include "lwan-mod-serve-files.h"
 #include "lwan-template.h"
 #include "int-to-str.h"
+#include "murmur3.h"
 
 #include "auto-index-icons.h"
 
@@ -56,20 +67,88 @@ static const struct lwan_key_value deflate_compression_hdr[] = {
 static const struct lwan_key_value gzip_compression_hdr[] = {
     {"Content-Encoding", "gzip"}, {}
 };
-#if defined(HAVE_BROTLI)
 static const struct lwan_key_value br_compression_hdr[] = {
     {"Content-Encoding", "br"}, {}
 };
-#endif
-#if defined(HAVE_ZSTD)
 static const struct lwan_key_value zstd_compression_hdr[] = {
     {"Content-Encoding", "zstd"}, {}
 };
+#if defined(HAVE_ZSTD)
+/* Caches must not hand this to clients without the same dictionary. */
+static const struct lwan_key_value dcz_compression_hdr[] = {
+    {"Content-Encoding", "dcz"},
+    {"Vary", "Accept-Encoding, Available-Dictionary"},
+    {},
+};
 #endif
 
+/* Files compressed ahead of time ($FILE.zst, etc.) that are served instead
+ * of $FILE; these don't need Lwan to be built with these libraries. */
+enum precompressed_encoding {
+    PRECOMPRESSED_ZSTD,
+    PRECOMPRESSED_BROTLI,
+    PRECOMPRESSED_GZIP,
+    PRECOMPRESSED_N_ENCODINGS,
+};
+
+static const struct {
+    const char *extension;
+    enum lwan_request_flags accept;
+    const struct lwan_key_value *header;
+} precompressed_encodings[] = {
+    [PRECOMPRESSED_ZSTD] = {".zst", REQUEST_ACCEPT_ZSTD, zstd_compression_hdr},
+    [PRECOMPRESSED_BROTLI] = {".br", REQUEST_ACCEPT_BROTLI, br_compression_hdr},
+    [PRECOMPRESSED_GZIP] = {".gz", REQUEST_ACCEPT_GZIP, gzip_compression_hdr},
+};
+
 static const int open_mode = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
 
+/* Quoted, 64-bit hash in hex, and the NUL terminator */
+#define ETAG_SIZE (1 + 16 + 1 + 1)
+
+/* Requests for more ranges than this are served as a whole */
+#define MAX_BYTE_RANGES 16
+
+/* Directory listings are paginated: only the first page is rendered (and
+ * compressed) when a listing is cached; other pages are rendered, when
+ * requested, from the sorted entries kept in the cache. */
+#define DIRLIST_ENTRIES_PER_PAGE 1000
+#define DIRLIST_GETDENTS_BUFFER_SIZE 65536
+
+/* Paths remembered as missing when "cache_not_found_for" is set */
+#define NOT_FOUND_MAX_ENTRIES 16384
+
+/* Files smaller than this are always kept in memory (and compressed) when
+ * cached; larger ones are served with sendfile(), unless they're promoted
+ * (see get_funcs()). */
+#define MMAP_SIZE_THRESHOLD 16384
+
+/* When hot files are recompressed in the background, files are first
+ * compressed with faster levels than usual when they're cached, as that
+ * happens while a request waits; hot files are then recompressed with the
+ * slowest, highest levels.  Deflate defaults to zlib's default level. */
+#if defined(HAVE_BROTLI)
+#define BROTLI_FAST_QUALITY 5
+#endif
+#if defined(HAVE_ZSTD)
+#define ZSTD_FAST_LEVEL 1
+#define ZSTD_SLOW_LEVEL 19
+#endif
+
+/* Separates parts of multipart/byteranges responses; set once, when the
+ * first instance of this module is created. */
+static char multipart_byteranges_type[] =
+    "multipart/byteranges; boundary=0000000000000000";
+static char *const byteranges_boundary =
+    multipart_byteranges_type + sizeof("multipart/byteranges; boundary=") - 1;
+static bool byteranges_boundary_set;
+
+struct asset_pack;
 struct file_cache_entry;
+struct file_watcher;
+struct preloader;
+struct recompressor;
+struct snapshot;
 
 struct serve_files_priv {
     struct cache *cache;
@@ -85,6 +164,35 @@ struct serve_files_priv {
 
     size_t read_ahead;
 
+    struct file_watcher *watcher;
+
+    char *snapshot_path;
+    struct snapshot *snapshot;
+
+    struct asset_pack *pack;
+
+    struct preloader *preloader;
+    /* Keys of preloaded files that are kept in the cache, if any */
+    struct hash *pinned;
+
+    struct recompressor *recompressor;
+    unsigned int recompress_after_hits;
+
+    /* Files too large to be kept in memory by default that have been
+     * requested often enough, by clients accepting encodings that are only
+     * available if they're compressed by Lwan, when they were last cached.
+     * See get_funcs() and update_promotion(). */
+    struct {
+        pthread_mutex_t lock;
+        struct hash *keys;
+        size_t size; /* Of the promoted entries in the cache */
+        size_t max_size;
+        size_t max_file_size;
+        unsigned int after_hits;
+    } promotion;
+
+    struct lwan_compress_dict *compress_dict;
+
     bool serve_precompressed_files;
     bool auto_index;
     bool auto_index_readme;
@@ -94,11 +202,25 @@ struct cache_funcs {
     enum lwan_http_status (*serve)(struct lwan_request *request, void *data);
     bool (*init)(struct file_cache_entry *ce,
                  struct serve_files_priv *priv,
+                 const char *key,
                  const char *full_path,
                  struct stat *st);
     void (*free)(struct file_cache_entry *ce);
 };
 
+/* Compressed versions of a hot file, created by the recompression thread.
+ * Each is only present (non-zero length) if it's smaller than the version
+ * created when the file was cached. */
+struct mmap_recompressed {
+    struct lwan_value deflated;
+#if defined(HAVE_BROTLI)
+    struct lwan_value brotli;
+#endif
+#if defined(HAVE_ZSTD)
+    struct lwan_value zstd;
+#endif
+};
+
 struct mmap_cache_data {
     struct lwan_value uncompressed;
     struct lwan_value gzip;
@@ -108,17 +230,49 @@ struct mmap_cache_data {
 #endif
 #if defined(HAVE_ZSTD)
     struct lwan_value zstd;
+    /* Compressed with the dictionary of this instance, if there's one;
+     * never recompressed. */
+    struct lwan_value dcz;
+    const struct lwan_compress_dict *dict;
 #endif
+
+    /* Set once, and never changed afterwards, by the recompression thread:
+     * requests being served might still be sending the other versions. */
+    struct mmap_recompressed *recompressed;
+    unsigned int hits;
 };
 
 struct sendfile_cache_data {
     struct {
         int fd;
         size_t size;
-    } compressed, uncompressed;
+    } compressed[PRECOMPRESSED_N_ENCODINGS], uncompressed;
+};
+
+struct dir_list_entry {
+    /* Offset into the name pool while the directory is being read */
+    union {
+        size_t offset;
+        const char *ptr;
+    } name;
+    const char *type;
+    off_t size;
+    bool is_dir;
 };
 
 struct dir_list_cache_data {
+    struct lwan_tpl *tpl;
+    char *full_path;
+    const char *rel_path;
+    const char *readme;
+    struct lwan_strbuf readme_buf;
+
+    /* Sorted by name */
+    struct dir_list_entry *entries;
+    size_t n_entries;
+    struct lwan_strbuf names;
+
+    /* Only the first page is kept rendered */
     struct lwan_strbuf rendered;
     struct lwan_value deflated;
 #if defined(HAVE_BROTLI)
@@ -138,9 +292,25 @@ struct file_cache_entry {
         time_t integer;
     } last_modified;
 
+    /* Strong validator sent as ETag; empty if there's none */
+    char etag[ETAG_SIZE];
+
     const char *mime_type;
     const struct cache_funcs *funcs;
 
+    /* Path of the file, relative to the root, if changes are watched */
+    char *watched_path;
+
+    /* Preloaded, and kept in the cache regardless of its time to live */
+    bool pinned;
+
+    /* Only if promote_after_hits is set; see count_promotion_hit() */
+    unsigned int hits;
+    /* Copy of the key of promoted entries, which are demoted when they're
+     * destroyed if they've cooled down; the key of the cache entry itself
+     * might have been freed by then. */
+    char *promoted_key;
+
     union {
         struct mmap_cache_data mmap_cache_data;
         struct sendfile_cache_data sendfile_cache_data;
@@ -153,6 +323,9 @@ struct file_list {
     const char *full_path;
     const char *rel_path;
     const char *readme;
+    int prev_page;
+    int next_page;
+    const struct dir_list_entry *first, *last;
     struct {
         coro_function_t generator;
 
@@ -171,8 +344,20 @@ struct file_list {
 
 static int directory_list_generator(struct coro *coro, void *data);
 
+static void lock_mmap_entry(struct file_cache_entry *fce);
+static void unlock_mmap_entry(struct file_cache_entry *fce);
+
+static bool snapshot_restore(struct serve_files_priv *priv,
+                             const char *key,
+                             const struct stat *st,
+                             struct file_cache_entry *ce);
+static bool peer_restore(struct serve_files_priv *priv,
+                         const char *key,
+                         struct file_cache_entry *ce);
+
 static bool mmap_init(struct file_cache_entry *ce,
                       struct serve_files_priv *priv,
+                      const char *key,
                       const char *full_path,
                       struct stat *st);
 static void mmap_free(struct file_cache_entry *ce);
@@ -181,6 +366,7 @@ static enum lwan_http_status mmap_serve(struct lwan_request *request,
 
 static bool sendfile_init(struct file_cache_entry *ce,
                           struct serve_files_priv *priv,
+                          const char *key,
                           const char *full_path,
                           struct stat *st);
 static void sendfile_free(struct file_cache_entry *ce);
@@ -189,6 +375,7 @@ static enum lwan_http_status sendfile_serve(struct lwan_request *request,
 
 static bool dirlist_init(struct file_cache_entry *ce,
                          struct serve_files_priv *priv,
+                         const char *key,
                          const char *full_path,
                          struct stat *st);
 static void dirlist_free(struct file_cache_entry *ce);
@@ -197,6 +384,7 @@ static enum lwan_http_status dirlist_serve(struct lwan_request *request,
 
 static bool redir_init(struct file_cache_entry *ce,
                        struct serve_files_priv *priv,
+                       const char *key,
                        const char *full_path,
                        struct stat *st);
 static void redir_free(struct file_cache_entry *ce);
@@ -233,6 +421,8 @@ static const struct lwan_var_descriptor file_list_desc[] = {
     TPL_VAR_STR_ESCAPE(full_path),
     TPL_VAR_STR_ESCAPE(rel_path),
     TPL_VAR_STR_ESCAPE(readme),
+    TPL_VAR_INT(prev_page),
+    TPL_VAR_INT(next_page),
     TPL_VAR_SEQUENCE(file_list,
                      directory_list_generator,
                      ((const struct lwan_var_descriptor[]){
@@ -291,6 +481,8 @@ static const char *directory_list_tpl_str =
     "    </tr>\n"
     "{{/file_list}}"
     "  </table>\n"
+    "{{prev_page?}}  <a href=\"?page={{prev_page}}\">Previous page</a>\n{{/prev_page?}}"
+    "{{next_page?}}  <a href=\"?page={{next_page}}\">Next page</a>\n{{/next_page?}}"
     "</body>\n"
     "</html>\n";
 
@@ -298,66 +490,42 @@ static int directory_list_generator(struct coro *coro, void *data)
 {
     static const char *zebra_classes[] = {"odd", "even"};
     struct file_list *fl = data;
-    struct dirent *entry;
     int zebra_class = 0;
-    DIR *dir;
-    int fd;
-
-    dir = opendir(fl->full_path);
-    if (!dir)
-        return 0;
-
-    fd = dirfd(dir);
-    if (fd < 0)
-        goto out;
-
-    while ((entry = readdir(dir))) {
-        struct stat st;
-
-        if (entry->d_name[0] == '.')
-            continue;
-
-        if (fstatat(fd, entry->d_name, &st, 0) < 0)
-            continue;
 
-        if (S_ISDIR(st.st_mode)) {
+    for (const struct dir_list_entry *entry = fl->first; entry < fl->last;
+         entry++) {
+        if (entry->is_dir) {
             fl->file_list.icon = "folder";
             fl->file_list.icon_alt = "DIR";
-            fl->file_list.type = "directory";
             fl->file_list.slash_if_dir = "/";
-        } else if (S_ISREG(st.st_mode)) {
+        } else {
             fl->file_list.icon = "file";
             fl->file_list.icon_alt = "FILE";
-            fl->file_list.type =
-                lwan_determine_mime_type_for_file_name(entry->d_name);
             fl->file_list.slash_if_dir = "";
-        } else {
-            continue;
         }
+        fl->file_list.type = entry->type;
 
-        if (st.st_size < 1024) {
-            fl->file_list.size = (int)st.st_size;
+        if (entry->size < 1024) {
+            fl->file_list.size = (int)entry->size;
             fl->file_list.unit = "B";
-        } else if (st.st_size < 1024 * 1024) {
-            fl->file_list.size = (int)(st.st_size / 1024);
+        } else if (entry->size < 1024 * 1024) {
+            fl->file_list.size = (int)(entry->size / 1024);
             fl->file_list.unit = "KiB";
-        } else if (st.st_size < 1024 * 1024 * 1024) {
-            fl->file_list.size = (int)(st.st_size / (1024 * 1024));
+        } else if (entry->size < 1024 * 1024 * 1024) {
+            fl->file_list.size = (int)(entry->size / (1024 * 1024));
             fl->file_list.unit = "MiB";
         } else {
-            fl->file_list.size = (int)(st.st_size / (1024 * 1024 * 1024));
+            fl->file_list.size = (int)(entry->size / (1024 * 1024 * 1024));
             fl->file_list.unit = "GiB";
         }
 
-        fl->file_list.name = entry->d_name;
+        fl->file_list.name = entry->name.ptr;
         fl->file_list.zebra_class = zebra_classes[zebra_class++ % 2];
 
         if (coro_yield(coro, 1))
             break;
     }
 
-out:
-    closedir(dir);
     return 0;
 }
 
@@ -381,7 +549,8 @@ static void realloc_if_needed(struct lwan_value *value, size_t bound)
 }
 
 static void deflate_value(const struct lwan_value *uncompressed,
-                          struct lwan_value *compressed)
+                          struct lwan_value *compressed,
+                          int level)
 {
     const unsigned long bound = compressBound(uncompressed->len);
 
@@ -390,9 +559,9 @@ static void deflate_value(const struct lwan_value *uncompressed,
     if (UNLIKELY(!(compressed->value = malloc(bound))))
         goto error_zero_out;
 
-    if (UNLIKELY(compress((Bytef *)compressed->value, &compressed->len,
-                          (Bytef *)uncompressed->value,
-                          uncompressed->len) != Z_OK))
+    if (UNLIKELY(compress2((Bytef *)compressed->value, &compressed->len,
+                           (Bytef *)uncompressed->value, uncompressed->len,
+                           level) != Z_OK))
         goto error_free_compressed;
 
     if (is_compression_worthy(compressed->len, uncompressed->len))
@@ -408,7 +577,8 @@ error_zero_out:
 #if defined(HAVE_BROTLI)
 static void brotli_value(const struct lwan_value *uncompressed,
                          struct lwan_value *brotli,
-                         const struct lwan_value *deflated)
+                         const struct lwan_value *deflated,
+                         int quality)
 {
     const unsigned long bound =
         BrotliEncoderMaxCompressedSize(uncompressed->len);
@@ -419,7 +589,7 @@ static void brotli_value(const struct lwan_value *uncompressed,
         goto error_zero_out;
 
     if (UNLIKELY(
-            BrotliEncoderCompress(BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW,
+            BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW,
                                   BROTLI_DEFAULT_MODE, uncompressed->len,
                                   (uint8_t *)uncompressed->value, &brotli->len,
                                   (uint8_t *)brotli->value) != BROTLI_TRUE))
@@ -441,7 +611,8 @@ error_zero_out:
 #if defined(HAVE_ZSTD)
 static void zstd_value(const struct lwan_value *uncompressed,
                        struct lwan_value *zstd,
-                       const struct lwan_value *deflated)
+                       const struct lwan_value *deflated,
+                       int level)
 {
     const size_t bound = ZSTD_compressBound(uncompressed->len);
 
@@ -451,7 +622,7 @@ static void zstd_value(const struct lwan_value *uncompressed,
         goto error_zero_out;
 
     zstd->len = ZSTD_compress(zstd->value, zstd->len, uncompressed->value,
-                              uncompressed->len, 1);
+                              uncompressed->len, level);
     if (UNLIKELY(ZSTD_isError(zstd->len)))
         goto error_free_compressed;
 
@@ -466,6 +637,30 @@ error_free_compressed:
 error_zero_out:
     zstd->len = 0;
 }
+
+static void dcz_value(const struct serve_files_priv *priv,
+                      struct mmap_cache_data *md)
+{
+    const size_t smallest = md->zstd.len ? md->zstd.len : md->uncompressed.len;
+
+    md->dict = priv->compress_dict;
+    md->dcz = (struct lwan_value){};
+
+    if (!md->dict)
+        return;
+    if (!lwan_compress_dict_buffer(md->dict, md->uncompressed.value,
+                                   md->uncompressed.len, &md->dcz))
+        return;
+
+    /* The dictionary has to beat zstd without it, or this is just zstd
+     * with a longer header. */
+    if (LIKELY(md->dcz.len < smallest &&
+               is_compression_worthy(md->dcz.len, md->uncompressed.len)))
+        return;
+
+    free(md->dcz.value);
+    md->dcz = (struct lwan_value){};
+}
 #endif
 
 static void
@@ -486,20 +681,21 @@ static bool is_world_readable(mode_t mode)
 }
 
 static int try_open_compressed(const char *relpath,
+                               const char *extension,
                                const struct serve_files_priv *priv,
                                const struct stat *uncompressed,
                                size_t *compressed_sz)
 {
-    char gzpath[PATH_MAX];
+    char path[PATH_MAX];
     struct stat st;
     int ret, fd;
 
-    /* Try to serve a compressed file using sendfile() if $FILENAME.gz exists */
-    ret = snprintf(gzpath, PATH_MAX, "%s.gz", relpath);
+    /* Try to serve a compressed file if $FILENAME.$EXTENSION exists */
+    ret = snprintf(path, PATH_MAX, "%s%s", relpath, extension);
     if (UNLIKELY(ret < 0 || ret >= PATH_MAX))
         goto out;
 
-    fd = openat(priv->root_fd, gzpath, open_mode);
+    fd = openat(priv->root_fd, path, open_mode);
     if (UNLIKELY(fd < 0))
         goto out;
 
@@ -552,8 +748,37 @@ fail:
     return false;
 }
 
+static const struct mmap_recompressed *
+get_recompressed(const struct mmap_cache_data *md)
+{
+    static const struct mmap_recompressed not_recompressed;
+    const struct mmap_recompressed *rc =
+        __atomic_load_n(&md->recompressed, __ATOMIC_ACQUIRE);
+
+    return LIKELY(!rc) ? &not_recompressed : rc;
+}
+
+/* Recompressed versions are smaller than the ones they replace, if they
+ * exist at all. */
+static ALWAYS_INLINE const struct lwan_value *
+recompressed_or(const struct lwan_value *recompressed,
+                const struct lwan_value *original)
+{
+    return recompressed->len ? recompressed : original;
+}
+
+static void set_etag(struct file_cache_entry *ce, const void *data, size_t len)
+{
+    /* Served files are hashed to build their ETag, so it's independent of
+     * metadata like the modification time.  The seed is fixed so that every
+     * instance serving the same file produces the same ETag. */
+    snprintf(ce->etag, sizeof(ce->etag), "\"%016" PRIx64 "\"",
+             murmur3_64(data, len, 0));
+}
+
 static bool mmap_init(struct file_cache_entry *ce,
                       struct serve_files_priv *priv,
+                      const char *key,
                       const char *full_path,
                       struct stat *st)
 {
@@ -571,19 +796,34 @@ static bool mmap_init(struct file_cache_entry *ce,
     if (LIKELY(priv->serve_precompressed_files)) {
         size_t compressed_size;
 
-        file_fd = try_open_compressed(path, priv, st, &compressed_size);
+        file_fd = try_open_compressed(
+            path, precompressed_encodings[PRECOMPRESSED_GZIP].extension, priv,
+            st, &compressed_size);
         mmap_fd(priv, file_fd, compressed_size, &md->gzip);
     } else {
         md->gzip = (struct lwan_value){};
     }
 
     md->uncompressed.len = (size_t)st->st_size;
-    deflate_value(&md->uncompressed, &md->deflated);
+    md->recompressed = NULL;
+    md->hits = 0;
+    set_etag(ce, md->uncompressed.value, md->uncompressed.len);
+    if (!snapshot_restore(priv, key, st, ce) && !peer_restore(priv, key, ce)) {
+        deflate_value(&md->uncompressed, &md->deflated,
+                      Z_DEFAULT_COMPRESSION);
 #if defined(HAVE_BROTLI)
-    brotli_value(&md->uncompressed, &md->brotli, &md->deflated);
+        brotli_value(&md->uncompressed, &md->brotli, &md->deflated,
+                     priv->recompressor ? BROTLI_FAST_QUALITY
+                                        : BROTLI_DEFAULT_QUALITY);
 #endif
 #if defined(HAVE_ZSTD)
-    zstd_value(&md->uncompressed, &md->zstd, &md->deflated);
+        zstd_value(&md->uncompressed, &md->zstd, &md->deflated,
+                   ZSTD_FAST_LEVEL);
+#endif
+    }
+#if defined(HAVE_ZSTD)
+    /* Not in snapshots, as the dictionary might have changed since. */
+    dcz_value(priv, md);
 #endif
 
     ce->mime_type =
@@ -594,6 +834,7 @@ static bool mmap_init(struct file_cache_entry *ce,
 
 static bool sendfile_init(struct file_cache_entry *ce,
                           struct serve_files_priv *priv,
+                          const char *key,
                           const char *full_path,
                           struct stat *st)
 {
@@ -610,8 +851,12 @@ static bool sendfile_init(struct file_cache_entry *ce,
         case EACCES:
             /* These errors should produce responses other than 404, so
              * store errno as the file descriptor.  */
-            sd->uncompressed.fd = sd->compressed.fd = -errno;
-            sd->compressed.size = sd->uncompressed.size = 0;
+            sd->uncompressed.fd = -errno;
+            sd->uncompressed.size = 0;
+            for (size_t i = 0; i < PRECOMPRESSED_N_ENCODINGS; i++) {
+                sd->compressed[i].fd = -ENOENT;
+                sd->compressed[i].size = 0;
+            }
 
             return true;
         }
@@ -619,18 +864,31 @@ static bool sendfile_init(struct file_cache_entry *ce,
         return false;
     }
 
-    /* If precompressed files can be served, try opening it */
-    if (LIKELY(priv->serve_precompressed_files)) {
-        size_t compressed_sz;
-        int fd = try_open_compressed(relpath, priv, st, &compressed_sz);
-
-        sd->compressed.fd = fd;
-        sd->compressed.size = compressed_sz;
+    /* If precompressed files can be served, try opening them all, so that
+     * the smallest one a client accepts can be picked for each request. */
+    for (size_t i = 0; i < PRECOMPRESSED_N_ENCODINGS; i++) {
+        if (LIKELY(priv->serve_precompressed_files)) {
+            sd->compressed[i].fd = try_open_compressed(
+                relpath, precompressed_encodings[i].extension, priv, st,
+                &sd->compressed[i].size);
+        } else {
+            sd->compressed[i].fd = -ENOENT;
+            sd->compressed[i].size = 0;
+        }
     }
 
     sd->uncompressed.size = (size_t)st->st_size;
     try_readahead(priv, sd->uncompressed.fd, sd->uncompressed.size);
 
+    /* Hashing large files would be too expensive; use their metadata. */
+    const uint64_t metadata[] = {
+        (uint64_t)st->st_dev,
+        (uint64_t)st->st_ino,
+        (uint64_t)st->st_size,
+        (uint64_t)st->st_mtime,
+    };
+    set_etag(ce, metadata, sizeof(metadata));
+
     return true;
 }
 
@@ -703,53 +961,272 @@ error:
     return NULL;
 }
 
+static bool dirlist_add_entry(struct dir_list_cache_data *dd,
+                              size_t *capacity,
+                              int dir_fd,
+                              const char *name)
+{
+    struct dir_list_entry *entry;
+    size_t name_len;
+    struct stat st;
+
+    if (name[0] == '.')
+        return true;
+
+    if (fstatat(dir_fd, name, &st, 0) < 0)
+        return true;
+
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+        return true;
+
+    if (dd->n_entries == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 64;
+        struct dir_list_entry *entries =
+            reallocarray(dd->entries, new_capacity, sizeof(*entries));
+
+        if (UNLIKELY(!entries))
+            return false;
+
+        dd->entries = entries;
+        *capacity = new_capacity;
+    }
+
+    entry = &dd->entries[dd->n_entries];
+    *entry = (struct dir_list_entry){
+        .name.offset = lwan_strbuf_get_length(&dd->names),
+        .size = st.st_size,
+    };
+    if (S_ISDIR(st.st_mode)) {
+        entry->type = "directory";
+        entry->is_dir = true;
+    } else {
+        entry->type = lwan_determine_mime_type_for_file_name(name);
+    }
+
+    name_len = strlen(name);
+    if (UNLIKELY(!lwan_strbuf_append_str(&dd->names, name, name_len + 1)))
+        return false;
+
+    dd->n_entries++;
+    return true;
+}
+
+#if defined(SYS_getdents64)
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static bool dirlist_read_entries(struct dir_list_cache_data *dd, int dir_fd)
+{
+    size_t capacity = 0;
+    bool ret = false;
+    char *buffer;
+
+    /* Big directories are read in batches of entries, without going
+     * through readdir() one entry at a time. */
+    buffer = malloc(DIRLIST_GETDENTS_BUFFER_SIZE);
+    if (UNLIKELY(!buffer))
+        return false;
+
+    while (true) {
+        long n = syscall(SYS_getdents64, dir_fd, buffer,
+                         DIRLIST_GETDENTS_BUFFER_SIZE);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            goto out;
+        }
+        if (!n)
+            break;
+
+        for (long offset = 0; offset < n;) {
+            const struct linux_dirent64 *entry =
+                (const struct linux_dirent64 *)(buffer + offset);
+
+            if (!dirlist_add_entry(dd, &capacity, dir_fd, entry->d_name))
+                goto out;
+
+            offset += entry->d_reclen;
+        }
+    }
+
+    ret = true;
+
+out:
+    free(buffer);
+    return ret;
+}
+#else
+static bool dirlist_read_entries(struct dir_list_cache_data *dd, int dir_fd)
+{
+    size_t capacity = 0;
+    struct dirent *entry;
+    bool ret = true;
+    DIR *dir;
+    int fd;
+
+    fd = dup(dir_fd);
+    if (fd < 0)
+        return false;
+
+    dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return false;
+    }
+
+    while ((entry = readdir(dir))) {
+        if (!dirlist_add_entry(dd, &capacity, dir_fd, entry->d_name)) {
+            ret = false;
+            break;
+        }
+    }
+
+    closedir(dir);
+    return ret;
+}
+#endif
+
+static int dirlist_entry_cmp(const void *a, const void *b)
+{
+    const struct dir_list_entry *ea = a;
+    const struct dir_list_entry *eb = b;
+
+    return strcmp(ea->name.ptr, eb->name.ptr);
+}
+
+static void dirlist_set_etag(struct file_cache_entry *ce)
+{
+    const struct dir_list_cache_data *dd = &ce->dir_list_cache_data;
+    uint64_t hash = 0;
+
+    /* Hashes the listing rather than a rendered page, so that every page
+     * shares the same ETag, and changes to any page change it. */
+    for (size_t i = 0; i < dd->n_entries; i++) {
+        const struct dir_list_entry *entry = &dd->entries[i];
+        const uint64_t size = (uint64_t)entry->size << 1 | entry->is_dir;
+
+        hash = murmur3_64(entry->name.ptr, strlen(entry->name.ptr) + 1,
+                          (uint32_t)hash);
+        hash ^= murmur3_64(&size, sizeof(size), (uint32_t)(hash >> 32));
+    }
+    if (dd->readme)
+        hash ^= murmur3_64(dd->readme, strlen(dd->readme), (uint32_t)hash);
+
+    snprintf(ce->etag, sizeof(ce->etag), "\"%016" PRIx64 "\"", hash);
+}
+
+static size_t dirlist_n_pages(const struct dir_list_cache_data *dd)
+{
+    if (!dd->n_entries)
+        return 1;
+
+    return (dd->n_entries + DIRLIST_ENTRIES_PER_PAGE - 1) /
+           DIRLIST_ENTRIES_PER_PAGE;
+}
+
+static bool dirlist_render_page(const struct dir_list_cache_data *dd,
+                                size_t page,
+                                struct lwan_strbuf *buffer)
+{
+    const size_t first = page * DIRLIST_ENTRIES_PER_PAGE;
+    const size_t last =
+        LWAN_MIN(first + DIRLIST_ENTRIES_PER_PAGE, dd->n_entries);
+    struct file_list vars = {
+        .full_path = dd->full_path,
+        .rel_path = dd->rel_path,
+        .readme = dd->readme,
+        /* Pages are numbered from 1 in the query string */
+        .prev_page = (int)page,
+        .next_page = page + 1 < dirlist_n_pages(dd) ? (int)page + 2 : 0,
+        .first = dd->entries + first,
+        .last = dd->entries + last,
+    };
+
+    return lwan_tpl_apply_with_buffer(dd->tpl, buffer, &vars);
+}
+
 static bool dirlist_init(struct file_cache_entry *ce,
                          struct serve_files_priv *priv,
+                         const char *key,
                          const char *full_path,
                          struct stat *st __attribute__((unused)))
 {
     struct dir_list_cache_data *dd = &ce->dir_list_cache_data;
-    struct lwan_strbuf readme;
-    bool ret = false;
+    int dir_fd;
 
-    if (!lwan_strbuf_init(&readme))
+    *dd = (struct dir_list_cache_data){.tpl = priv->directory_list_tpl};
+
+    if (!lwan_strbuf_init(&dd->readme_buf))
         return false;
-    if (!lwan_strbuf_init(&dd->rendered))
+    if (!lwan_strbuf_init(&dd->names))
         goto out_free_readme;
+    if (!lwan_strbuf_init(&dd->rendered))
+        goto out_free_names;
 
-    struct file_list vars = {
-        .full_path = full_path,
-        .rel_path = get_rel_path(full_path, priv),
-        .readme = dirlist_find_readme(&readme, priv, full_path),
-    };
-
-    if (!lwan_tpl_apply_with_buffer(priv->directory_list_tpl, &dd->rendered,
-                                    &vars))
+    dd->full_path = strdup(full_path);
+    if (!dd->full_path)
         goto out_free_rendered;
+    dd->rel_path = get_rel_path(dd->full_path, priv);
+    dd->readme = dirlist_find_readme(&dd->readme_buf, priv, full_path);
+
+    dir_fd = open(full_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0)
+        goto out_free_full_path;
+    if (!dirlist_read_entries(dd, dir_fd)) {
+        close(dir_fd);
+        goto out_free_entries;
+    }
+    close(dir_fd);
+
+    /* The name pool doesn't move anymore, so offsets can become pointers. */
+    for (size_t i = 0; i < dd->n_entries; i++) {
+        dd->entries[i].name.ptr =
+            lwan_strbuf_get_buffer(&dd->names) + dd->entries[i].name.offset;
+    }
+    if (dd->n_entries)
+        qsort(dd->entries, dd->n_entries, sizeof(*dd->entries),
+              dirlist_entry_cmp);
+
+    if (!dirlist_render_page(dd, 0, &dd->rendered))
+        goto out_free_entries;
 
     ce->mime_type = "text/html";
+    dirlist_set_etag(ce);
 
     struct lwan_value rendered = {
         .value = lwan_strbuf_get_buffer(&dd->rendered),
         .len = lwan_strbuf_get_length(&dd->rendered),
     };
-    deflate_value(&rendered, &dd->deflated);
+    deflate_value(&rendered, &dd->deflated, Z_DEFAULT_COMPRESSION);
 #if defined(HAVE_BROTLI)
-    brotli_value(&rendered, &dd->brotli, &dd->deflated);
+    brotli_value(&rendered, &dd->brotli, &dd->deflated,
+                 BROTLI_DEFAULT_QUALITY);
 #endif
 
-    ret = true;
-    goto out_free_readme;
+    return true;
 
+out_free_entries:
+    free(dd->entries);
+out_free_full_path:
+    free(dd->full_path);
 out_free_rendered:
     lwan_strbuf_free(&dd->rendered);
+out_free_names:
+    lwan_strbuf_free(&dd->names);
 out_free_readme:
-    lwan_strbuf_free(&readme);
-    return ret;
+    lwan_strbuf_free(&dd->readme_buf);
+    return false;
 }
 
 static bool redir_init(struct file_cache_entry *ce,
                        struct serve_files_priv *priv,
+                       const char *key,
                        const char *full_path,
                        struct stat *st __attribute__((unused)))
 {
@@ -758,6 +1235,32 @@ static bool redir_init(struct file_cache_entry *ce,
     return asprintf(&rd->redir_to, "%s/", get_rel_path(full_path, priv)) >= 0;
 }
 
+/* Values in priv->promotion.keys */
+#define PROMOTION_HOT ((void *)1)
+/* Promoted before, but not compressible, so not worth keeping in memory */
+#define PROMOTION_NOT_WORTH ((void *)2)
+
+static bool should_promote(struct serve_files_priv *priv,
+                           const char *key,
+                           const struct stat *st)
+{
+    bool promote;
+
+    if (!priv->promotion.after_hits ||
+        (size_t)st->st_size > priv->promotion.max_file_size)
+        return false;
+
+    pthread_mutex_lock(&priv->promotion.lock);
+    /* The budget might be exceeded by a few concurrently created entries;
+     * the size of the uncompressed file is only an estimate anyway. */
+    promote = hash_find(priv->promotion.keys, key) == PROMOTION_HOT &&
+              priv->promotion.size + (size_t)st->st_size <=
+                  priv->promotion.max_size;
+    pthread_mutex_unlock(&priv->promotion.lock);
+
+    return promote;
+}
+
 static const struct cache_funcs *get_funcs(struct serve_files_priv *priv,
                                            const char *key,
                                            char *full_path,
@@ -822,8 +1325,8 @@ static const struct cache_funcs *get_funcs(struct serve_files_priv *priv,
         return NULL;
 
     /* It's not a directory: choose the fastest way to serve the file
-     * judging by its size. */
-    if (st->st_size < 16384)
+     * judging by its size, and by how often it was requested. */
+    if (st->st_size < MMAP_SIZE_THRESHOLD || should_promote(priv, key, st))
         return &mmap_funcs;
 
     return &sendfile_funcs;
@@ -831,6 +1334,7 @@ static const struct cache_funcs *get_funcs(struct serve_files_priv *priv,
 
 static struct file_cache_entry *
 create_cache_entry_from_funcs(struct serve_files_priv *priv,
+                              const char *key,
                               const char *full_path,
                               struct stat *st,
                               const struct cache_funcs *funcs)
@@ -841,8 +1345,14 @@ create_cache_entry_from_funcs(struct serve_files_priv *priv,
     if (UNLIKELY(!fce))
         return NULL;
 
-    if (LIKELY(funcs->init(fce, priv, full_path, st))) {
+    fce->etag[0] = '\0';
+
+    if (LIKELY(funcs->init(fce, priv, key, full_path, st))) {
         fce->funcs = funcs;
+        fce->watched_path = NULL;
+        fce->pinned = false;
+        fce->hits = 0;
+        fce->promoted_key = NULL;
         return fce;
     }
 
@@ -851,18 +1361,114 @@ create_cache_entry_from_funcs(struct serve_files_priv *priv,
     if (funcs != &mmap_funcs)
         return NULL;
 
-    return create_cache_entry_from_funcs(priv, full_path, st, &sendfile_funcs);
+    return create_cache_entry_from_funcs(priv, key, full_path, st,
+                                         &sendfile_funcs);
+}
+
+static size_t mmap_entry_size(const struct mmap_cache_data *md)
+{
+    size_t size = md->uncompressed.len + md->gzip.len + md->deflated.len;
+
+#if defined(HAVE_BROTLI)
+    size += md->brotli.len;
+#endif
+#if defined(HAVE_ZSTD)
+    size += md->zstd.len + md->dcz.len;
+#endif
+
+    return size;
+}
+
+static size_t cache_entry_size(const struct cache_entry *entry,
+                               void *context __attribute__((unused)))
+{
+    const struct file_cache_entry *fce =
+        (const struct file_cache_entry *)entry;
+    size_t size = sizeof(*fce) + strlen(entry->key);
+
+    /* Files served with sendfile() only hold file descriptors; their
+     * contents are in the page cache, not in this process. */
+    if (fce->funcs == &mmap_funcs) {
+        size += mmap_entry_size(&fce->mmap_cache_data);
+    } else if (fce->funcs == &dirlist_funcs) {
+        const struct dir_list_cache_data *dd = &fce->dir_list_cache_data;
+
+        size += dd->n_entries * sizeof(*dd->entries) +
+                lwan_strbuf_get_length(&dd->names) +
+                lwan_strbuf_get_length(&dd->readme_buf) +
+                lwan_strbuf_get_length(&dd->rendered) + dd->deflated.len;
+#if defined(HAVE_BROTLI)
+        size += dd->brotli.len;
+#endif
+    }
+
+    return size;
+}
+
+/* Promoted entries are demoted once they expire, unless they've been
+ * requested often enough while cached; those that couldn't be compressed
+ * aren't promoted again. */
+static void demote_entry(struct serve_files_priv *priv,
+                         const struct file_cache_entry *fce)
+{
+    const char *key = fce->promoted_key;
+    const bool not_worth = !fce->mmap_cache_data.deflated.len;
+    const bool cooled_down =
+        ATOMIC_READ(fce->hits) < priv->promotion.after_hits;
+
+    pthread_mutex_lock(&priv->promotion.lock);
+
+    priv->promotion.size -= mmap_entry_size(&fce->mmap_cache_data);
+
+    if (not_worth) {
+        char *key_copy = strdup(key);
+
+        if (key_copy &&
+            hash_add(priv->promotion.keys, key_copy, PROMOTION_NOT_WORTH))
+            free(key_copy);
+    } else if (cooled_down) {
+        hash_del(priv->promotion.keys, key);
+    }
+
+    pthread_mutex_unlock(&priv->promotion.lock);
+
+    if (not_worth) {
+        lwan_status_debug("Not promoting %s again: not compressible", key);
+    } else if (cooled_down) {
+        lwan_status_debug("Demoting %s: requested %u times", key, fce->hits);
+    }
 }
 
-static void destroy_cache_entry(struct cache_entry *entry,
-                                void *context __attribute__((unused)))
+static void destroy_cache_entry(struct cache_entry *entry, void *context)
 {
     struct file_cache_entry *fce = (struct file_cache_entry *)entry;
 
+    /* Without a context, the entry was never added to the cache. */
+    if (fce->promoted_key && context)
+        demote_entry(context, fce);
+
     fce->funcs->free(fce);
+    free(fce->watched_path);
+    free(fce->promoted_key);
     free(fce);
 }
 
+/* Directory listings are expensive to build for big directories; if the
+ * file watcher invalidates them as soon as they change, there's no need
+ * for them to expire.  Pinned files never expire either. */
+static bool should_renew_cache_entry(const struct cache_entry *entry,
+                                     void *context)
+{
+    const struct file_cache_entry *fce =
+        (const struct file_cache_entry *)entry;
+    const struct serve_files_priv *priv = context;
+
+    if (fce->pinned)
+        return true;
+
+    return priv->watcher && fce->funcs == &dirlist_funcs;
+}
+
 static struct cache_entry *create_cache_entry(const char *key, void *context)
 {
     struct serve_files_priv *priv = context;
@@ -871,21 +1477,31 @@ static struct cache_entry *create_cache_entry(const char *key, void *context)
     const struct cache_funcs *funcs;
     char full_path[PATH_MAX];
 
+    /* Failing with errno set to ENOENT lets the cache remember that this
+     * file doesn't exist; see cache_set_negative_time_to_live(). */
     if (UNLIKELY(
-            !realpathat2(priv->root_fd, priv->root_path, key, full_path, &st)))
+            !realpathat2(priv->root_fd, priv->root_path, key, full_path, &st))) {
+        if (errno == ENOTDIR)
+            errno = ENOENT;
         return NULL;
+    }
+    errno = 0;
 
-    if (UNLIKELY(!is_world_readable(st.st_mode)))
+    if (UNLIKELY(!is_world_readable(st.st_mode))) {
+        errno = EACCES;
         return NULL;
+    }
 
-    if (UNLIKELY(strncmp(full_path, priv->root_path, priv->root_path_len)))
+    if (UNLIKELY(strncmp(full_path, priv->root_path, priv->root_path_len))) {
+        errno = EACCES;
         return NULL;
+    }
 
     funcs = get_funcs(priv, key, full_path, &st);
     if (UNLIKELY(!funcs))
         return NULL;
 
-    fce = create_cache_entry_from_funcs(priv, full_path, &st, funcs);
+    fce = create_cache_entry_from_funcs(priv, key, full_path, &st, funcs);
     if (UNLIKELY(!fce))
         return NULL;
 
@@ -896,83 +1512,1674 @@ static struct cache_entry *create_cache_entry(const char *key, void *context)
     }
     fce->last_modified.integer = st.st_mtime;
 
-    return (struct cache_entry *)fce;
-}
+    /* Only files that have been promoted are this large and in memory. */
+    if (fce->funcs == &mmap_funcs && st.st_size >= MMAP_SIZE_THRESHOLD) {
+        fce->promoted_key = strdup(key);
+        if (UNLIKELY(!fce->promoted_key)) {
+            destroy_cache_entry((struct cache_entry *)fce, NULL);
+            return NULL;
+        }
+    }
 
-static void mmap_free(struct file_cache_entry *fce)
-{
-    struct mmap_cache_data *md = &fce->mmap_cache_data;
+    if (priv->pinned && hash_find(priv->pinned, key)) {
+        fce->pinned = true;
+        if (fce->funcs == &mmap_funcs)
+            lock_mmap_entry(fce);
+    }
 
-    munmap(md->uncompressed.value, md->uncompressed.len);
-    if (md->gzip.value)
-        munmap(md->gzip.value, md->gzip.len);
+    if (priv->watcher) {
+        /* The root directory itself is resolved without a trailing slash. */
+        size_t full_path_len = strlen(full_path);
+        const char *rel_path = full_path_len > priv->root_path_len
+                                   ? full_path + priv->root_path_len
+                                   : "";
+
+        fce->watched_path = strdup(rel_path);
+        if (UNLIKELY(!fce->watched_path)) {
+            destroy_cache_entry((struct cache_entry *)fce, NULL);
+            return NULL;
+        }
+    }
+
+    if (fce->promoted_key) {
+        pthread_mutex_lock(&priv->promotion.lock);
+        priv->promotion.size += mmap_entry_size(&fce->mmap_cache_data);
+        pthread_mutex_unlock(&priv->promotion.lock);
+
+        lwan_status_debug("Promoted %s to be kept in memory", key);
+    }
+
+    return (struct cache_entry *)fce;
+}
+
+static void mmap_free(struct file_cache_entry *fce)
+{
+    struct mmap_cache_data *md = &fce->mmap_cache_data;
+
+    if (fce->pinned)
+        unlock_mmap_entry(fce);
+
+    munmap(md->uncompressed.value, md->uncompressed.len);
+    if (md->gzip.value)
+        munmap(md->gzip.value, md->gzip.len);
     free(md->deflated.value);
 #if defined(HAVE_BROTLI)
     free(md->brotli.value);
 #endif
 #if defined(HAVE_ZSTD)
     free(md->zstd.value);
+    free(md->dcz.value);
+#endif
+
+    if (md->recompressed) {
+        free(md->recompressed->deflated.value);
+#if defined(HAVE_BROTLI)
+        free(md->recompressed->brotli.value);
+#endif
+#if defined(HAVE_ZSTD)
+        free(md->recompressed->zstd.value);
+#endif
+        free(md->recompressed);
+    }
+}
+
+static void sendfile_free(struct file_cache_entry *fce)
+{
+    struct sendfile_cache_data *sd = &fce->sendfile_cache_data;
+
+    for (size_t i = 0; i < PRECOMPRESSED_N_ENCODINGS; i++) {
+        if (sd->compressed[i].fd >= 0)
+            close(sd->compressed[i].fd);
+    }
+    if (sd->uncompressed.fd >= 0)
+        close(sd->uncompressed.fd);
+}
+
+static void dirlist_free(struct file_cache_entry *fce)
+{
+    struct dir_list_cache_data *dd = &fce->dir_list_cache_data;
+
+    free(dd->full_path);
+    free(dd->entries);
+    lwan_strbuf_free(&dd->names);
+    lwan_strbuf_free(&dd->readme_buf);
+    lwan_strbuf_free(&dd->rendered);
+    free(dd->deflated.value);
+#if defined(HAVE_BROTLI)
+    free(dd->brotli.value);
+#endif
+}
+
+static void redir_free(struct file_cache_entry *fce)
+{
+    struct redir_cache_data *rd = &fce->redir_cache_data;
+
+    free(rd->redir_to);
+}
+
+static char *get_real_root_path(const char *root_path)
+{
+    char path_buf[PATH_MAX];
+    char *path;
+
+    path = realpath(root_path, path_buf);
+    if (!path)
+        return NULL;
+
+    char *last_slash = strrchr(path, '/');
+    if (!last_slash)
+        return NULL;
+
+    if (*(last_slash + 1) == '\0')
+        return strdup(path);
+
+    char *ret;
+    if (asprintf(&ret, "%s/", path))
+        return ret;
+
+    return NULL;
+}
+
+#if defined(HAVE_INOTIFY)
+/* Watches the root directory (and all directories below it) for changes,
+ * invalidating the affected cache entries as soon as files are modified,
+ * instead of waiting for them to expire.  Events are batched for a short
+ * while, so that a file being written in many chunks, or a bunch of files
+ * being copied over, only invalidate the cache once. */
+#define WATCH_MASK                                                             \
+    (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE |          \
+     IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#define WATCH_DEBOUNCE_MS 50
+#define WATCH_MAX_DEBOUNCE_ROUNDS 20
+
+struct file_watcher {
+    struct serve_files_priv *priv;
+
+    /* Watch descriptor -> directory, relative to the root */
+    struct hash *dirs;
+
+    /* Paths that changed, and directories that changed as a whole (e.g.
+     * moved or removed), relative to the root */
+    struct hash *changed;
+    struct hash *changed_trees;
+    bool invalidate_all;
+
+    pthread_t thread;
+    int inotify_fd;
+    int stop_fd[2];
+};
+
+static void watch_dir_tree(struct file_watcher *w, const char *rel_path)
+{
+    char path[PATH_MAX];
+    struct dirent *ent;
+    DIR *dir;
+    int wd, fd;
+
+    if (snprintf(path, sizeof(path), "%s%s", w->priv->root_path, rel_path) >=
+        (int)sizeof(path))
+        return;
+
+    wd = inotify_add_watch(w->inotify_fd, path, WATCH_MASK);
+    if (wd < 0) {
+        lwan_status_perror("Could not watch \"%s\" for changes", path);
+        return;
+    }
+
+    char *rel_path_copy = strdup(rel_path);
+    if (!rel_path_copy || hash_add(w->dirs, (void *)(intptr_t)wd,
+                                   rel_path_copy)) {
+        free(rel_path_copy);
+        inotify_rm_watch(w->inotify_fd, wd);
+        return;
+    }
+
+    fd = openat(w->priv->root_fd, *rel_path ? rel_path : ".",
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return;
+    }
+
+    while ((ent = readdir(dir))) {
+        if (ent->d_type != DT_DIR)
+            continue;
+        if (ent->d_name[0] == '.' &&
+            (ent->d_name[1] == '\0' ||
+             (ent->d_name[1] == '.' && ent->d_name[2] == '\0')))
+            continue;
+
+        if (snprintf(path, sizeof(path), "%s%s%s", rel_path,
+                     *rel_path ? "/" : "", ent->d_name) < (int)sizeof(path))
+            watch_dir_tree(w, path);
+    }
+
+    closedir(dir);
+}
+
+static void add_changed_path(struct hash *set, const char *path, size_t len)
+{
+    char *copy = strndup(path, len);
+
+    if (copy && hash_add_unique(set, copy, copy))
+        free(copy);
+}
+
+static void record_event(struct file_watcher *w,
+                         const struct inotify_event *event)
+{
+    const char *dir = hash_find(w->dirs, (void *)(intptr_t)event->wd);
+    char path[PATH_MAX];
+    const char *slash;
+    int len;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+        w->invalidate_all = true;
+        return;
+    }
+    if (!dir)
+        return;
+
+    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        if (!*dir)
+            w->invalidate_all = true;
+        else
+            add_changed_path(w->changed_trees, dir, strlen(dir));
+        return;
+    }
+    if (event->mask & IN_IGNORED) {
+        hash_del(w->dirs, (void *)(intptr_t)event->wd);
+        return;
+    }
+    if (!event->len)
+        return;
+
+    len = snprintf(path, sizeof(path), "%s%s%s", dir, *dir ? "/" : "",
+                   event->name);
+    if (len < 0 || len >= (int)sizeof(path)) {
+        w->invalidate_all = true;
+        return;
+    }
+
+    add_changed_path(w->changed, path, (size_t)len);
+
+    /* Directory listings and redirections are keyed by the directory. */
+    slash = memrchr(path, '/', (size_t)len);
+    add_changed_path(w->changed, path, slash ? (size_t)(slash - path) : 0);
+
+    /* Changing "foo.gz" changes what's served for "foo". */
+    if (len > 3 && !strcmp(path + len - 3, ".gz"))
+        add_changed_path(w->changed, path, (size_t)len - 3);
+
+    if (event->mask & IN_ISDIR) {
+        add_changed_path(w->changed_trees, path, (size_t)len);
+
+        if (event->mask & (IN_CREATE | IN_MOVED_TO))
+            watch_dir_tree(w, path);
+    }
+}
+
+static bool read_events(struct file_watcher *w)
+{
+    char buffer[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t r = read(w->inotify_fd, buffer, sizeof(buffer));
+
+    if (r <= 0)
+        return r < 0 && (errno == EAGAIN || errno == EINTR);
+
+    for (char *p = buffer; p < buffer + r;) {
+        const struct inotify_event *event = (const struct inotify_event *)p;
+
+        record_event(w, event);
+        p += sizeof(*event) + event->len;
+    }
+
+    return true;
+}
+
+static bool path_changed(const struct file_watcher *w, const char *path)
+{
+    char buffer[PATH_MAX];
+    size_t len = strlen(path);
+
+    if (len >= sizeof(buffer))
+        return true;
+
+    memcpy(buffer, path, len + 1);
+    while (len && buffer[len - 1] == '/')
+        buffer[--len] = '\0';
+
+    if (hash_find(w->changed, buffer))
+        return true;
+
+    /* Check if this path, or any directory containing it, was removed or
+     * moved as a whole. */
+    while (len) {
+        char *slash;
+
+        if (hash_find(w->changed_trees, buffer))
+            return true;
+
+        slash = memrchr(buffer, '/', len);
+        if (!slash)
+            break;
+
+        *slash = '\0';
+        len = (size_t)(slash - buffer);
+    }
+
+    return false;
+}
+
+static bool entry_changed(const struct cache_entry *entry, void *data)
+{
+    const struct file_cache_entry *fce =
+        (const struct file_cache_entry *)entry;
+    const struct file_watcher *w = data;
+
+    if (w->invalidate_all)
+        return true;
+
+    /* The key is the requested path, and the watched path is the file it
+     * resolved to (e.g. after following symlinks or picking an index file);
+     * a change to either might change the response. */
+    return path_changed(w, entry->key) ||
+           (fce->watched_path && path_changed(w, fce->watched_path));
+}
+
+static bool reset_changes(struct file_watcher *w)
+{
+    if (w->changed)
+        hash_free(w->changed);
+    if (w->changed_trees)
+        hash_free(w->changed_trees);
+
+    w->changed = hash_str_new(free, NULL);
+    w->changed_trees = hash_str_new(free, NULL);
+    w->invalidate_all = false;
+
+    return w->changed && w->changed_trees;
+}
+
+static void *file_watcher_thread(void *data)
+{
+    struct file_watcher *w = data;
+    struct pollfd fds[] = {
+        {.fd = w->inotify_fd, .events = POLLIN},
+        {.fd = w->stop_fd[0], .events = POLLIN},
+    };
+
+    lwan_set_thread_name("watcher");
+
+    while (true) {
+        if (poll(fds, N_ELEMENTS(fds), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            lwan_status_perror("poll");
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if (!read_events(w))
+            break;
+
+        /* Wait for things to settle down before invalidating the cache. */
+        for (int round = 0; round < WATCH_MAX_DEBOUNCE_ROUNDS; round++) {
+            if (poll(fds, 1, WATCH_DEBOUNCE_MS) <= 0 || !read_events(w))
+                break;
+        }
+
+        unsigned int invalidated =
+            cache_invalidate(w->priv->cache, entry_changed, w);
+        if (invalidated) {
+            lwan_status_debug("Invalidated %u cached files under %s",
+                              invalidated, w->priv->root_path);
+        }
+
+        if (!reset_changes(w)) {
+            lwan_status_error("Could not allocate memory to watch files");
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static struct file_watcher *file_watcher_new(struct serve_files_priv *priv)
+{
+    struct file_watcher *w = calloc(1, sizeof(*w));
+
+    if (!w)
+        return NULL;
+
+    w->priv = priv;
+
+    w->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->inotify_fd < 0) {
+        lwan_status_perror("inotify_init1");
+        goto out_free;
+    }
+
+    if (pipe2(w->stop_fd, O_CLOEXEC) < 0) {
+        lwan_status_perror("pipe2");
+        goto out_close_inotify;
+    }
+
+    w->dirs = hash_int_new(NULL, free);
+    if (!w->dirs)
+        goto out_close_pipe;
+    if (!reset_changes(w))
+        goto out_free_hashes;
+
+    watch_dir_tree(w, "");
+
+    if (pthread_create(&w->thread, NULL, file_watcher_thread, w)) {
+        lwan_status_perror("pthread_create");
+        goto out_free_hashes;
+    }
+
+    return w;
+
+out_free_hashes:
+    if (w->changed)
+        hash_free(w->changed);
+    if (w->changed_trees)
+        hash_free(w->changed_trees);
+    hash_free(w->dirs);
+out_close_pipe:
+    close(w->stop_fd[0]);
+    close(w->stop_fd[1]);
+out_close_inotify:
+    close(w->inotify_fd);
+out_free:
+    free(w);
+    return NULL;
+}
+
+static void file_watcher_free(struct file_watcher *w)
+{
+    if (!w)
+        return;
+
+    if (write(w->stop_fd[1], "", 1) < 0)
+        lwan_status_perror("write");
+    pthread_join(w->thread, NULL);
+
+    hash_free(w->changed);
+    hash_free(w->changed_trees);
+    hash_free(w->dirs);
+    close(w->stop_fd[0]);
+    close(w->stop_fd[1]);
+    close(w->inotify_fd);
+    free(w);
+}
+#else
+static struct file_watcher *file_watcher_new(struct serve_files_priv *priv
+                                             __attribute__((unused)))
+{
+    lwan_status_error("Watching files for changes isn't supported");
+    return NULL;
+}
+
+static void file_watcher_free(struct file_watcher *w __attribute__((unused)))
+{
+}
+#endif
+
+/* Files matching the "preload" patterns are cached as soon as the module
+ * is created, by a few threads of their own, so that the first requests
+ * after a restart don't wait for them to be opened, mapped, and
+ * compressed.  If they're pinned, they're also kept in the cache
+ * regardless of cache_for (see should_renew_cache_entry()), and small
+ * files are locked in memory. */
+#define PRELOAD_MAX_THREADS 4
+
+struct preloader {
+    struct serve_files_priv *priv;
+    glob_t glob;
+
+    size_t next;
+    unsigned int preloaded;
+    unsigned int running;
+    bool stop;
+
+    unsigned int n_threads;
+    pthread_t threads[];
+};
+
+static void lock_mmap_entry(struct file_cache_entry *fce)
+{
+    static bool warned;
+    const struct mmap_cache_data *md = &fce->mmap_cache_data;
+    const struct lwan_value *values[] = {
+        &md->uncompressed, &md->gzip, &md->deflated,
+#if defined(HAVE_BROTLI)
+        &md->brotli,
+#endif
+#if defined(HAVE_ZSTD)
+        &md->zstd, &md->dcz,
+#endif
+    };
+
+    for (size_t i = 0; i < N_ELEMENTS(values); i++) {
+        if (!values[i]->len)
+            continue;
+
+        if (mlock(values[i]->value, values[i]->len) < 0 &&
+            !__atomic_exchange_n(&warned, true, __ATOMIC_RELAXED)) {
+            lwan_status_perror("Could not lock pinned files in memory");
+        }
+    }
+}
+
+static void unlock_mmap_entry(struct file_cache_entry *fce)
+{
+    const struct mmap_cache_data *md = &fce->mmap_cache_data;
+
+    /* Mappings are unlocked when they're unmapped, but heap buffers have
+     * to be unlocked before they're freed. */
+    if (md->deflated.len)
+        munlock(md->deflated.value, md->deflated.len);
+#if defined(HAVE_BROTLI)
+    if (md->brotli.len)
+        munlock(md->brotli.value, md->brotli.len);
+#endif
+#if defined(HAVE_ZSTD)
+    if (md->zstd.len)
+        munlock(md->zstd.value, md->zstd.len);
+    if (md->dcz.len)
+        munlock(md->dcz.value, md->dcz.len);
 #endif
 }
 
-static void sendfile_free(struct file_cache_entry *fce)
+static void *preload_thread(void *data)
+{
+    struct preloader *p = data;
+    struct serve_files_priv *priv = p->priv;
+
+    lwan_set_thread_name("preload");
+
+    while (!__atomic_load_n(&p->stop, __ATOMIC_RELAXED)) {
+        size_t i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+        struct cache_entry *ce;
+        const char *path;
+        int error;
+
+        if (i >= p->glob.gl_pathc)
+            break;
+
+        /* Directories are marked with a trailing slash. */
+        path = p->glob.gl_pathv[i];
+        if (path[strlen(path) - 1] == '/')
+            continue;
+
+        ce = cache_get_and_ref_entry(priv->cache, path + priv->root_path_len,
+                                     &error);
+        if (ce) {
+            cache_entry_unref(priv->cache, ce);
+            __atomic_fetch_add(&p->preloaded, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (__atomic_sub_fetch(&p->running, 1, __ATOMIC_ACQ_REL) == 0) {
+        lwan_status_debug("Preloaded %u files under %s",
+                          __atomic_load_n(&p->preloaded, __ATOMIC_RELAXED),
+                          priv->root_path);
+    }
+
+    return NULL;
+}
+
+static bool preload_glob(struct preloader *p, const char *patterns)
+{
+    const struct serve_files_priv *priv = p->priv;
+    char *copy = strdup(patterns);
+    char *saveptr;
+    int flags = GLOB_MARK | GLOB_NOSORT;
+
+    if (!copy)
+        return false;
+
+#if defined(GLOB_BRACE)
+    flags |= GLOB_BRACE;
+#endif
+
+    for (char *pattern = strtok_r(copy, " \t,", &saveptr); pattern;
+         pattern = strtok_r(NULL, " \t,", &saveptr)) {
+        char path[PATH_MAX];
+        int r;
+
+        while (*pattern == '/')
+            pattern++;
+
+        if (snprintf(path, sizeof(path), "%s%s", priv->root_path, pattern) >=
+            (int)sizeof(path)) {
+            lwan_status_warning("Preload pattern \"%s\" is too long", pattern);
+            continue;
+        }
+
+        r = glob(path, flags, NULL, &p->glob);
+        if (r == GLOB_NOMATCH) {
+            lwan_status_warning("Preload pattern \"%s\" matches no files",
+                                pattern);
+        } else if (r) {
+            lwan_status_error("Could not expand preload pattern \"%s\"",
+                              pattern);
+            free(copy);
+            return false;
+        }
+
+        flags |= GLOB_APPEND;
+    }
+
+    free(copy);
+    return true;
+}
+
+static struct hash *preload_pinned_keys(const struct preloader *p)
+{
+    const struct serve_files_priv *priv = p->priv;
+    struct hash *keys = hash_str_new(free, NULL);
+
+    if (!keys)
+        return NULL;
+
+    for (size_t i = 0; i < p->glob.gl_pathc; i++) {
+        char *key = strdup(p->glob.gl_pathv[i] + priv->root_path_len);
+        int r;
+
+        if (!key) {
+            hash_free(keys);
+            return NULL;
+        }
+
+        r = hash_add_unique(keys, key, key);
+        if (r) {
+            free(key);
+            if (r != -EEXIST) {
+                hash_free(keys);
+                return NULL;
+            }
+        }
+    }
+
+    return keys;
+}
+
+static void preloader_free(struct preloader *p)
+{
+    if (!p)
+        return;
+
+    __atomic_store_n(&p->stop, true, __ATOMIC_RELAXED);
+    for (unsigned int i = 0; i < p->n_threads; i++)
+        pthread_join(p->threads[i], NULL);
+
+    if (p->glob.gl_pathc)
+        globfree(&p->glob);
+    free(p);
+}
+
+static struct preloader *preloader_new(struct serve_files_priv *priv,
+                                       const char *patterns,
+                                       bool pin)
+{
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int n_threads =
+        n_cpus > 0 ? (unsigned int)LWAN_MIN(n_cpus, PRELOAD_MAX_THREADS) : 1;
+    struct preloader *p;
+
+    p = calloc(1, sizeof(*p) + n_threads * sizeof(p->threads[0]));
+    if (!p)
+        return NULL;
+
+    p->priv = priv;
+    if (!preload_glob(p, patterns))
+        goto out_free;
+
+    if (pin) {
+        priv->pinned = preload_pinned_keys(p);
+        if (!priv->pinned)
+            goto out_free;
+    }
+
+    if (n_threads > p->glob.gl_pathc)
+        n_threads = (unsigned int)p->glob.gl_pathc;
+
+    p->running = n_threads;
+    for (; p->n_threads < n_threads; p->n_threads++) {
+        if (pthread_create(&p->threads[p->n_threads], NULL, preload_thread,
+                           p)) {
+            lwan_status_perror("pthread_create");
+            goto out_free;
+        }
+    }
+
+    return p;
+
+out_free:
+    preloader_free(p);
+    return NULL;
+}
+
+/* Snapshots let an instance start with the cache contents of the previous
+ * one: when the module is destroyed, the key of every cached entry is
+ * written to a file, along with the compressed versions of small files.
+ * When it's created again, a background thread goes through the keys and
+ * creates their entries as if they had been requested, reusing compressed
+ * versions of files if their size, modification time, and contents (as
+ * hashed for their ETag) haven't changed.
+ *
+ * Snapshots are only meant to be read by the same build that wrote them,
+ * so records are written in the native byte order, padded to keep their
+ * fields aligned. */
+#define SNAPSHOT_MAGIC "LWANSNAP"
+#define SNAPSHOT_VERSION 1
+
+enum snapshot_flags {
+    SNAPSHOT_HAS_BROTLI = 1 << 0,
+    SNAPSHOT_HAS_ZSTD = 1 << 1,
+};
+
+static const uint32_t snapshot_flags = 0
+#if defined(HAVE_BROTLI)
+                                       | SNAPSHOT_HAS_BROTLI
+#endif
+#if defined(HAVE_ZSTD)
+                                       | SNAPSHOT_HAS_ZSTD
+#endif
+    ;
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+};
+
+/* Followed by the NUL-terminated key and the deflated, brotli, and zstd
+ * versions of the file.  Entries that aren't small files only have their
+ * key; their ETag is empty. */
+struct snapshot_record {
+    uint64_t size;
+    int64_t mtime;
+    uint32_t key_len;
+    uint32_t deflated_len;
+    uint32_t brotli_len;
+    uint32_t zstd_len;
+    char etag[ETAG_SIZE];
+};
+
+#define SNAPSHOT_ALIGN sizeof(uint64_t)
+
+struct snapshot {
+    pthread_rwlock_t lock;
+    pthread_t thread;
+
+    /* Records by key, until the prewarm thread is done with them */
+    struct hash *records;
+
+    const char *map;
+    size_t map_len;
+
+    bool compressed_usable;
+    bool stop;
+};
+
+static const char *snapshot_record_key(const struct snapshot_record *record)
+{
+    return (const char *)(record + 1);
+}
+
+static uint64_t snapshot_record_len(const struct snapshot_record *record)
+{
+    return (uint64_t)sizeof(*record) + record->key_len + 1 +
+           record->deflated_len + record->brotli_len + record->zstd_len;
+}
+
+static const struct snapshot_record *
+snapshot_next_record(const struct snapshot *snapshot, size_t *offset)
+{
+    const struct snapshot_record *record;
+    uint64_t len;
+
+    if (*offset >= snapshot->map_len ||
+        snapshot->map_len - *offset < sizeof(*record))
+        return NULL;
+
+    record = (const struct snapshot_record *)(snapshot->map + *offset);
+    len = snapshot_record_len(record);
+    if (len > snapshot->map_len - *offset)
+        return NULL;
+    if (snapshot_record_key(record)[record->key_len] != '\0')
+        return NULL;
+    if (record->etag[ETAG_SIZE - 1] != '\0')
+        return NULL;
+
+    *offset += (size_t)((len + SNAPSHOT_ALIGN - 1) & ~(SNAPSHOT_ALIGN - 1));
+    return record;
+}
+
+static void copy_snapshot_value(struct lwan_value *value,
+                                const char **data,
+                                uint32_t len)
+{
+    if (len) {
+        value->value = malloc(len);
+        if (LIKELY(value->value)) {
+            memcpy(value->value, *data, len);
+            value->len = len;
+        } else {
+            value->len = 0;
+        }
+    } else {
+        *value = (struct lwan_value){};
+    }
+
+    *data += len;
+}
+
+static bool snapshot_restore(struct serve_files_priv *priv,
+                             const char *key,
+                             const struct stat *st,
+                             struct file_cache_entry *ce)
+{
+    struct snapshot *snapshot = priv->snapshot;
+    struct mmap_cache_data *md = &ce->mmap_cache_data;
+    const struct snapshot_record *record;
+    const char *data;
+    bool restored = false;
+
+    if (!snapshot)
+        return false;
+
+    pthread_rwlock_rdlock(&snapshot->lock);
+
+    if (!snapshot->records || !snapshot->compressed_usable)
+        goto out;
+
+    record = hash_find(snapshot->records, key);
+    if (!record || record->size != (uint64_t)st->st_size ||
+        record->mtime != (int64_t)st->st_mtime || strcmp(record->etag, ce->etag))
+        goto out;
+
+    /* Files that weren't worth compressing have no compressed versions;
+     * don't even try this time.  If memory for a compressed version can't
+     * be allocated, the file is served uncompressed. */
+    data = snapshot_record_key(record) + record->key_len + 1;
+    copy_snapshot_value(&md->deflated, &data, record->deflated_len);
+#if defined(HAVE_BROTLI)
+    copy_snapshot_value(&md->brotli, &data, record->brotli_len);
+#endif
+#if defined(HAVE_ZSTD)
+    copy_snapshot_value(&md->zstd, &data, record->zstd_len);
+#endif
+    restored = true;
+
+out:
+    pthread_rwlock_unlock(&snapshot->lock);
+    return restored;
+}
+
+static void *snapshot_prewarm_thread(void *data)
+{
+    struct serve_files_priv *priv = data;
+    struct snapshot *snapshot = priv->snapshot;
+    const struct snapshot_record *record;
+    size_t offset = sizeof(struct snapshot_header);
+    unsigned int prewarmed = 0;
+
+    lwan_set_thread_name("prewarm");
+
+    while (!__atomic_load_n(&snapshot->stop, __ATOMIC_RELAXED) &&
+           (record = snapshot_next_record(snapshot, &offset))) {
+        struct cache_entry *ce;
+        int error;
+
+        /* Keys being created by requests are skipped. */
+        ce = cache_get_and_ref_entry(priv->cache, snapshot_record_key(record),
+                                     &error);
+        if (ce) {
+            cache_entry_unref(priv->cache, ce);
+            prewarmed++;
+        }
+    }
+
+    lwan_status_debug("Prewarmed %u cached files under %s", prewarmed,
+                      priv->root_path);
+
+    pthread_rwlock_wrlock(&snapshot->lock);
+    hash_free(snapshot->records);
+    snapshot->records = NULL;
+    munmap((void *)snapshot->map, snapshot->map_len);
+    snapshot->map = NULL;
+    pthread_rwlock_unlock(&snapshot->lock);
+
+    return NULL;
+}
+
+static struct snapshot *snapshot_open(struct serve_files_priv *priv)
+{
+    const struct snapshot_header *header;
+    const struct snapshot_record *record;
+    struct snapshot *snapshot;
+    struct stat st;
+    size_t offset;
+    void *map;
+    int fd;
+
+    fd = open(priv->snapshot_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            lwan_status_perror("Could not open cache snapshot \"%s\"",
+                               priv->snapshot_path);
+        }
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 ||
+        (size_t)st.st_size < sizeof(struct snapshot_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    header = map;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+        header->version != SNAPSHOT_VERSION) {
+        lwan_status_warning("Ignoring cache snapshot \"%s\": unknown format",
+                            priv->snapshot_path);
+        goto out_unmap;
+    }
+
+    snapshot = calloc(1, sizeof(*snapshot));
+    if (!snapshot)
+        goto out_unmap;
+
+    snapshot->map = map;
+    snapshot->map_len = (size_t)st.st_size;
+    /* Entries are still prewarmed if this build has different compression
+     * libraries; compressed versions are created as usual, though. */
+    snapshot->compressed_usable = header->flags == snapshot_flags;
+
+    snapshot->records = hash_str_new(NULL, NULL);
+    if (!snapshot->records)
+        goto out_free;
+
+    offset = sizeof(*header);
+    while ((record = snapshot_next_record(snapshot, &offset))) {
+        if (hash_add(snapshot->records, snapshot_record_key(record), record))
+            goto out_free_records;
+    }
+
+    if (pthread_rwlock_init(&snapshot->lock, NULL))
+        goto out_free_records;
+
+    return snapshot;
+
+out_free_records:
+    hash_free(snapshot->records);
+out_free:
+    free(snapshot);
+out_unmap:
+    munmap(map, (size_t)st.st_size);
+    return NULL;
+}
+
+static void snapshot_free(struct snapshot *snapshot)
+{
+    if (!snapshot)
+        return;
+
+    __atomic_store_n(&snapshot->stop, true, __ATOMIC_RELAXED);
+    pthread_join(snapshot->thread, NULL);
+
+    pthread_rwlock_destroy(&snapshot->lock);
+    free(snapshot);
+}
+
+struct snapshot_writer {
+    FILE *file;
+    unsigned int n_records;
+    bool failed;
+};
+
+static void snapshot_write_value(struct snapshot_writer *writer,
+                                 const void *data,
+                                 size_t len)
+{
+    if (len && fwrite(data, len, 1, writer->file) != 1)
+        writer->failed = true;
+}
+
+/* Compressed versions of a small file, as written after its record */
+struct snapshot_values {
+    const struct lwan_value *deflated;
+    const struct lwan_value *brotli;
+    const struct lwan_value *zstd;
+};
+
+static void snapshot_record_init(const struct file_cache_entry *fce,
+                                 struct snapshot_record *record,
+                                 struct snapshot_values *values)
+{
+    *record = (struct snapshot_record){
+        .key_len = (uint32_t)strlen(fce->base.key),
+    };
+    *values = (struct snapshot_values){};
+
+    if (fce->funcs == &mmap_funcs) {
+        const struct mmap_cache_data *md = &fce->mmap_cache_data;
+        const struct mmap_recompressed *rc = get_recompressed(md);
+
+        record->size = md->uncompressed.len;
+        record->mtime = fce->last_modified.integer;
+        memcpy(record->etag, fce->etag, sizeof(record->etag));
+
+        /* Hot files come back with their recompressed versions. */
+        values->deflated = recompressed_or(&rc->deflated, &md->deflated);
+        record->deflated_len = (uint32_t)values->deflated->len;
+#if defined(HAVE_BROTLI)
+        values->brotli = recompressed_or(&rc->brotli, &md->brotli);
+        record->brotli_len = (uint32_t)values->brotli->len;
+#endif
+#if defined(HAVE_ZSTD)
+        values->zstd = recompressed_or(&rc->zstd, &md->zstd);
+        record->zstd_len = (uint32_t)values->zstd->len;
+#endif
+    }
+}
+
+static void snapshot_write_entry(const struct cache_entry *entry, void *data)
+{
+    const struct file_cache_entry *fce =
+        (const struct file_cache_entry *)entry;
+    static const char padding[SNAPSHOT_ALIGN];
+    struct snapshot_writer *writer = data;
+    struct snapshot_record record;
+    struct snapshot_values values;
+    uint64_t len;
+
+    if (writer->failed)
+        return;
+
+    snapshot_record_init(fce, &record, &values);
+
+    snapshot_write_value(writer, &record, sizeof(record));
+    snapshot_write_value(writer, entry->key, record.key_len + 1);
+    if (values.deflated)
+        snapshot_write_value(writer, values.deflated->value,
+                             values.deflated->len);
+    if (values.brotli)
+        snapshot_write_value(writer, values.brotli->value, values.brotli->len);
+    if (values.zstd)
+        snapshot_write_value(writer, values.zstd->value, values.zstd->len);
+
+    len = snapshot_record_len(&record);
+    snapshot_write_value(writer, padding,
+                         (size_t)((SNAPSHOT_ALIGN - len % SNAPSHOT_ALIGN) %
+                                  SNAPSHOT_ALIGN));
+
+    writer->n_records++;
+}
+
+static void snapshot_write(struct serve_files_priv *priv)
+{
+    struct snapshot_header header = {
+        .version = SNAPSHOT_VERSION,
+        .flags = snapshot_flags,
+    };
+    struct snapshot_writer writer = {};
+    char tmp_path[PATH_MAX];
+    int ret;
+
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+
+    /* Written to a temporary file first, so that an instance starting up
+     * never reads a partially written snapshot. */
+    ret = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", priv->snapshot_path);
+    if (ret < 0 || ret >= (int)sizeof(tmp_path))
+        return;
+
+    writer.file = fopen(tmp_path, "we");
+    if (!writer.file) {
+        lwan_status_perror("Could not write cache snapshot \"%s\"", tmp_path);
+        return;
+    }
+
+    snapshot_write_value(&writer, &header, sizeof(header));
+    cache_for_each(priv->cache, snapshot_write_entry, &writer);
+
+    if (fclose(writer.file) || writer.failed) {
+        lwan_status_error("Could not write cache snapshot \"%s\"", tmp_path);
+        unlink(tmp_path);
+        return;
+    }
+
+    if (rename(tmp_path, priv->snapshot_path) < 0) {
+        lwan_status_perror("Could not rename \"%s\" to \"%s\"", tmp_path,
+                           priv->snapshot_path);
+        unlink(tmp_path);
+        return;
+    }
+
+    lwan_status_debug("Wrote %u cached files under %s to snapshot \"%s\"",
+                      writer.n_records, priv->root_path, priv->snapshot_path);
+}
+
+/* Small files requested often enough are compressed again, with the
+ * highest levels, by a low-priority thread; requests keep being served
+ * with the versions created when the file was cached until it's done. */
+/* Sent to instances in the cache_peers group asking for small files owned
+ * by this one: the snapshot flags, followed by a snapshot record, so that
+ * compressed versions are only taken by instances supporting the same
+ * encodings.  Peers still read the file themselves, and only take the
+ * compressed versions if the ETag (a hash of the contents) matches; what
+ * they save is compressing it. */
+static bool peer_append_value(struct lwan_strbuf *buf,
+                              const struct lwan_value *value)
+{
+    if (!value || !value->len)
+        return true;
+
+    return lwan_strbuf_append_str(buf, value->value, value->len);
+}
+
+static bool peer_serialize_entry(const struct cache_entry *entry,
+                                 struct lwan_strbuf *buf,
+                                 void *context __attribute__((unused)))
+{
+    const struct file_cache_entry *fce =
+        (const struct file_cache_entry *)entry;
+    struct snapshot_record record;
+    struct snapshot_values values;
+
+    if (fce->funcs != &mmap_funcs)
+        return false;
+
+    snapshot_record_init(fce, &record, &values);
+
+    return lwan_strbuf_append_str(buf, (const char *)&snapshot_flags,
+                                  sizeof(snapshot_flags)) &&
+           lwan_strbuf_append_str(buf, (const char *)&record,
+                                  sizeof(record)) &&
+           lwan_strbuf_append_str(buf, entry->key, record.key_len + 1) &&
+           peer_append_value(buf, values.deflated) &&
+           peer_append_value(buf, values.brotli) &&
+           peer_append_value(buf, values.zstd);
+}
+
+static bool peer_restore(struct serve_files_priv *priv,
+                         const char *key,
+                         struct file_cache_entry *ce)
+{
+    struct mmap_cache_data *md = &ce->mmap_cache_data;
+    struct snapshot_record record;
+    struct lwan_value payload;
+    const char *data;
+    uint32_t flags;
+    bool restored = false;
+
+    if (!cache_peer_fetch(priv->cache, key, &payload))
+        return false;
+
+    if (payload.len < sizeof(flags) + sizeof(record))
+        goto out;
+
+    memcpy(&flags, payload.value, sizeof(flags));
+    memcpy(&record, payload.value + sizeof(flags), sizeof(record));
+    if (flags != snapshot_flags ||
+        snapshot_record_len(&record) != payload.len - sizeof(flags))
+        goto out;
+    if (record.size != md->uncompressed.len ||
+        record.etag[ETAG_SIZE - 1] != '\0' || strcmp(record.etag, ce->etag))
+        goto out;
+
+    data = payload.value + sizeof(flags) + sizeof(record);
+    if (record.key_len != strlen(key) || memcmp(data, key, record.key_len + 1))
+        goto out;
+    data += record.key_len + 1;
+
+    copy_snapshot_value(&md->deflated, &data, record.deflated_len);
+#if defined(HAVE_BROTLI)
+    copy_snapshot_value(&md->brotli, &data, record.brotli_len);
+#endif
+#if defined(HAVE_ZSTD)
+    copy_snapshot_value(&md->zstd, &data, record.zstd_len);
+#endif
+    restored = true;
+
+out:
+    free(payload.value);
+    return restored;
+}
+
+struct recompressor {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct list_head queue;
+    bool stop;
+};
+
+struct recompress_item {
+    struct list_node queue;
+    struct file_cache_entry *fce;
+};
+
+static void recompress_entry(struct file_cache_entry *fce)
+{
+    struct mmap_cache_data *md = &fce->mmap_cache_data;
+    struct mmap_recompressed *rc;
+    bool improved;
+
+    rc = calloc(1, sizeof(*rc));
+    if (UNLIKELY(!rc))
+        return;
+
+    deflate_value(&md->uncompressed, &rc->deflated, Z_BEST_COMPRESSION);
+    if (rc->deflated.len >= md->deflated.len) {
+        free(rc->deflated.value);
+        rc->deflated = (struct lwan_value){};
+    }
+    improved = rc->deflated.len;
+
+#if defined(HAVE_BROTLI)
+    brotli_value(&md->uncompressed, &rc->brotli,
+                 recompressed_or(&rc->deflated, &md->deflated),
+                 BROTLI_MAX_QUALITY);
+    if (md->brotli.len && rc->brotli.len >= md->brotli.len) {
+        free(rc->brotli.value);
+        rc->brotli = (struct lwan_value){};
+    }
+    improved |= rc->brotli.len;
+#endif
+
+#if defined(HAVE_ZSTD)
+    zstd_value(&md->uncompressed, &rc->zstd,
+               recompressed_or(&rc->deflated, &md->deflated), ZSTD_SLOW_LEVEL);
+    if (md->zstd.len && rc->zstd.len >= md->zstd.len) {
+        free(rc->zstd.value);
+        rc->zstd = (struct lwan_value){};
+    }
+    improved |= rc->zstd.len;
+#endif
+
+    if (!improved) {
+        free(rc);
+        return;
+    }
+
+    __atomic_store_n(&md->recompressed, rc, __ATOMIC_RELEASE);
+}
+
+static void *recompress_thread(void *data)
+{
+    struct serve_files_priv *priv = data;
+    struct recompressor *recompressor = priv->recompressor;
+
+    lwan_set_thread_name("recompress");
+
+    pthread_mutex_lock(&recompressor->lock);
+    while (!recompressor->stop) {
+        struct recompress_item *item =
+            list_pop(&recompressor->queue, struct recompress_item, queue);
+
+        if (!item) {
+            pthread_cond_wait(&recompressor->cond, &recompressor->lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&recompressor->lock);
+
+        recompress_entry(item->fce);
+        cache_entry_unref(priv->cache, &item->fce->base);
+        free(item);
+
+        pthread_mutex_lock(&recompressor->lock);
+    }
+    pthread_mutex_unlock(&recompressor->lock);
+
+    return NULL;
+}
+
+static struct recompressor *recompressor_new(struct serve_files_priv *priv)
+{
+    struct recompressor *recompressor = malloc(sizeof(*recompressor));
+
+    if (!recompressor)
+        return NULL;
+
+    list_head_init(&recompressor->queue);
+    recompressor->stop = false;
+
+    if (pthread_mutex_init(&recompressor->lock, NULL))
+        goto out_free;
+    if (pthread_cond_init(&recompressor->cond, NULL))
+        goto out_destroy_mutex;
+
+    priv->recompressor = recompressor;
+    if (pthread_create(&recompressor->thread, NULL, recompress_thread, priv)) {
+        priv->recompressor = NULL;
+        goto out_destroy_cond;
+    }
+
+#ifdef SCHED_IDLE
+    struct sched_param sched_param = {.sched_priority = 0};
+    if (pthread_setschedparam(recompressor->thread, SCHED_IDLE, &sched_param))
+        lwan_status_perror("Could not set scheduling policy of "
+                           "recompression thread to idle");
+#endif
+
+    return recompressor;
+
+out_destroy_cond:
+    pthread_cond_destroy(&recompressor->cond);
+out_destroy_mutex:
+    pthread_mutex_destroy(&recompressor->lock);
+out_free:
+    free(recompressor);
+    return NULL;
+}
+
+static void recompressor_free(struct serve_files_priv *priv)
+{
+    struct recompressor *recompressor = priv->recompressor;
+    struct recompress_item *item, *next;
+
+    if (!recompressor)
+        return;
+
+    pthread_mutex_lock(&recompressor->lock);
+    recompressor->stop = true;
+    pthread_cond_signal(&recompressor->cond);
+    pthread_mutex_unlock(&recompressor->lock);
+
+    pthread_join(recompressor->thread, NULL);
+
+    /* Entries must not be referenced anymore once the cache is destroyed. */
+    list_for_each_safe (&recompressor->queue, item, next, queue) {
+        cache_entry_unref(priv->cache, &item->fce->base);
+        free(item);
+    }
+
+    pthread_cond_destroy(&recompressor->cond);
+    pthread_mutex_destroy(&recompressor->lock);
+    free(recompressor);
+    priv->recompressor = NULL;
+}
+
+static void maybe_recompress(struct serve_files_priv *priv,
+                             struct file_cache_entry *fce)
+{
+    struct mmap_cache_data *md = &fce->mmap_cache_data;
+    struct recompressor *recompressor = priv->recompressor;
+    struct recompress_item *item;
+
+    /* Files that weren't worth compressing aren't worth recompressing.
+     * Hits stop being counted once the threshold is reached, to not keep
+     * writing to the entries of the hottest files. */
+    if (!md->deflated.len ||
+        ATOMIC_READ(md->hits) >= priv->recompress_after_hits ||
+        ATOMIC_INC(md->hits) != priv->recompress_after_hits)
+        return;
+
+    item = malloc(sizeof(*item));
+    if (UNLIKELY(!item))
+        return;
+
+    cache_entry_ref(&fce->base);
+    item->fce = fce;
+
+    pthread_mutex_lock(&recompressor->lock);
+    list_add_tail(&recompressor->queue, &item->queue);
+    pthread_cond_signal(&recompressor->cond);
+    pthread_mutex_unlock(&recompressor->lock);
+}
+
+/* Asset packs (see lwan-asset-pack.h) are served straight from a single
+ * read-only mapping: files are found with a binary search, and served like
+ * small files are, without a cache entry of their own. */
+struct asset_pack {
+    const char *map;
+    size_t map_len;
+    const struct asset_pack_entry *entries;
+    const char **mime_types;
+    uint32_t n_entries;
+};
+
+static const struct cache_funcs pack_funcs = {
+    .serve = mmap_serve,
+};
+
+static const char *asset_pack_key(const struct asset_pack *pack,
+                                  const struct asset_pack_entry *entry)
+{
+    return pack->map + entry->key_offset;
+}
+
+static bool asset_pack_entry_valid(const struct asset_pack *pack,
+                                   const struct asset_pack_entry *entry)
 {
-    struct sendfile_cache_data *sd = &fce->sendfile_cache_data;
+    const struct file_cache_entry *fce = NULL;
 
-    if (sd->compressed.fd >= 0)
-        close(sd->compressed.fd);
-    if (sd->uncompressed.fd >= 0)
-        close(sd->uncompressed.fd);
+    if (entry->key_offset >= pack->map_len ||
+        !memchr(asset_pack_key(pack, entry), '\0',
+                pack->map_len - entry->key_offset))
+        return false;
+
+    if (!memchr(entry->last_modified, '\0', sizeof(fce->last_modified.string)))
+        return false;
+    if (!memchr(entry->etag, '\0', sizeof(fce->etag)))
+        return false;
+
+    for (int v = 0; v < ASSET_PACK_N_VARIANTS; v++) {
+        if (entry->variants[v].offset > pack->map_len ||
+            entry->variants[v].len > pack->map_len - entry->variants[v].offset)
+            return false;
+    }
+
+    return true;
 }
 
-static void dirlist_free(struct file_cache_entry *fce)
+static struct asset_pack *asset_pack_open(const char *path)
 {
-    struct dir_list_cache_data *dd = &fce->dir_list_cache_data;
+    const struct asset_pack_header *header;
+    struct asset_pack *pack;
+    struct stat st;
+    void *map;
+    int fd;
 
-    lwan_strbuf_free(&dd->rendered);
-    free(dd->deflated.value);
-#if defined(HAVE_BROTLI)
-    free(dd->brotli.value);
-#endif
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        lwan_status_perror("Could not open asset pack \"%s\"", path);
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 ||
+        (size_t)st.st_size < sizeof(struct asset_pack_header)) {
+        lwan_status_error("Asset pack \"%s\" is too small", path);
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        lwan_status_perror("Could not map asset pack \"%s\"", path);
+        return NULL;
+    }
+
+    header = map;
+    if (memcmp(header->magic, ASSET_PACK_MAGIC, sizeof(header->magic)) ||
+        header->version != ASSET_PACK_VERSION) {
+        lwan_status_error("Asset pack \"%s\" has an unknown format", path);
+        goto out_unmap;
+    }
+    if ((uint64_t)header->n_entries * sizeof(struct asset_pack_entry) >
+        (size_t)st.st_size - sizeof(*header)) {
+        lwan_status_error("Asset pack \"%s\" is truncated", path);
+        goto out_unmap;
+    }
+
+    pack = malloc(sizeof(*pack));
+    if (!pack)
+        goto out_unmap;
+
+    *pack = (struct asset_pack){
+        .map = map,
+        .map_len = (size_t)st.st_size,
+        .entries = (const struct asset_pack_entry *)(header + 1),
+        .n_entries = header->n_entries,
+    };
+
+    pack->mime_types = calloc(LWAN_MAX(pack->n_entries, 1u),
+                              sizeof(*pack->mime_types));
+    if (!pack->mime_types)
+        goto out_free;
+
+    /* Everything is checked once, so that serving files from the pack
+     * doesn't have to. */
+    for (uint32_t i = 0; i < pack->n_entries; i++) {
+        const struct asset_pack_entry *entry = &pack->entries[i];
+
+        if (!asset_pack_entry_valid(pack, entry) ||
+            (i && strcmp(asset_pack_key(pack, entry - 1),
+                         asset_pack_key(pack, entry)) >= 0)) {
+            lwan_status_error("Asset pack \"%s\" is corrupted", path);
+            goto out_free_mime_types;
+        }
+
+        pack->mime_types[i] =
+            lwan_determine_mime_type_for_file_name(asset_pack_key(pack, entry));
+    }
+
+    lwan_madvise_queue(map, pack->map_len);
+    lwan_status_debug("Serving %u files from asset pack \"%s\"",
+                      pack->n_entries, path);
+
+    return pack;
+
+out_free_mime_types:
+    free(pack->mime_types);
+out_free:
+    free(pack);
+out_unmap:
+    munmap(map, (size_t)st.st_size);
+    return NULL;
 }
 
-static void redir_free(struct file_cache_entry *fce)
+static void asset_pack_free(struct asset_pack *pack)
 {
-    struct redir_cache_data *rd = &fce->redir_cache_data;
+    if (!pack)
+        return;
 
-    free(rd->redir_to);
+    munmap((void *)pack->map, pack->map_len);
+    free(pack->mime_types);
+    free(pack);
 }
 
-static char *get_real_root_path(const char *root_path)
+/* Compares key, followed by suffix, with entry_key, as strcmp() would. */
+static int
+asset_pack_key_cmp(const char *key, const char *suffix, const char *entry_key)
 {
-    char path_buf[PATH_MAX];
-    char *path;
+    for (; *key; key++, entry_key++) {
+        if (*key != *entry_key)
+            return (unsigned char)*key - (unsigned char)*entry_key;
+    }
 
-    path = realpath(root_path, path_buf);
-    if (!path)
-        return NULL;
+    return strcmp(suffix, entry_key);
+}
 
-    char *last_slash = strrchr(path, '/');
-    if (!last_slash)
-        return NULL;
+static struct lwan_value asset_pack_value(const struct asset_pack *pack,
+                                          const struct asset_pack_entry *entry,
+                                          enum asset_pack_variant variant)
+{
+    return (struct lwan_value){
+        .value = (char *)pack->map + entry->variants[variant].offset,
+        .len = (size_t)entry->variants[variant].len,
+    };
+}
 
-    if (*(last_slash + 1) == '\0')
-        return strdup(path);
+static struct file_cache_entry *
+asset_pack_find(const struct serve_files_priv *priv,
+                struct lwan_request *request)
+{
+    const struct asset_pack *pack = priv->pack;
+    const char *key = request->url.value;
+    const char *suffix = "";
+    uint32_t lo = 0, hi = pack->n_entries;
+
+    /* Directories are served by their index file, as they would be if
+     * files were served from a directory. */
+    if (!request->url.len || key[request->url.len - 1] == '/')
+        suffix = priv->index_html;
+
+    while (lo < hi) {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        const struct asset_pack_entry *entry = &pack->entries[mid];
+        int cmp = asset_pack_key_cmp(key, suffix, asset_pack_key(pack, entry));
+
+        if (cmp < 0) {
+            hi = mid;
+        } else if (cmp > 0) {
+            lo = mid + 1;
+        } else {
+            struct file_cache_entry *fce =
+                coro_malloc(request->conn->coro, sizeof(*fce));
+            struct mmap_cache_data *md;
 
-    char *ret;
-    if (asprintf(&ret, "%s/", path))
-        return ret;
+            if (UNLIKELY(!fce))
+                return NULL;
+
+            *fce = (struct file_cache_entry){
+                .last_modified.integer = (time_t)entry->mtime,
+                .mime_type = pack->mime_types[mid],
+                .funcs = &pack_funcs,
+            };
+            memcpy(fce->last_modified.string, entry->last_modified,
+                   sizeof(fce->last_modified.string));
+            memcpy(fce->etag, entry->etag, sizeof(fce->etag));
+
+            md = &fce->mmap_cache_data;
+            md->uncompressed = asset_pack_value(pack, entry, ASSET_PACK_IDENTITY);
+            md->deflated = asset_pack_value(pack, entry, ASSET_PACK_DEFLATE);
+            md->gzip = asset_pack_value(pack, entry, ASSET_PACK_GZIP);
+#if defined(HAVE_BROTLI)
+            md->brotli = asset_pack_value(pack, entry, ASSET_PACK_BROTLI);
+#endif
+#if defined(HAVE_ZSTD)
+            md->zstd = asset_pack_value(pack, entry, ASSET_PACK_ZSTD);
+#endif
+
+            return fce;
+        }
+    }
 
     return NULL;
 }
 
+static void set_byteranges_boundary(const struct serve_files_priv *priv)
+{
+    const uint64_t seed[] = {(uint64_t)time(NULL), (uint64_t)getpid(),
+                             (uint64_t)(uintptr_t)priv};
+
+    if (byteranges_boundary_set)
+        return;
+
+    snprintf(byteranges_boundary, 16 + 1, "%016" PRIx64,
+             murmur3_64(seed, sizeof(seed), 0));
+    byteranges_boundary_set = true;
+}
+
+static void promotion_free(struct serve_files_priv *priv)
+{
+    if (!priv->promotion.keys)
+        return;
+
+    hash_free(priv->promotion.keys);
+    pthread_mutex_destroy(&priv->promotion.lock);
+}
+
 static void *serve_files_create(const char *prefix, void *args)
 {
     struct lwan_serve_files_settings *settings = args;
     struct serve_files_priv *priv;
+    struct asset_pack *pack = NULL;
     char *canonical_root;
     int root_fd;
 
+    if (settings->asset_pack) {
+        pack = asset_pack_open(settings->asset_pack);
+        if (!pack)
+            return NULL;
+
+        if (!settings->root_path) {
+            /* Nothing but the pack is served; everything else is 404. */
+            priv = calloc(1, sizeof(*priv));
+            if (!priv) {
+                lwan_status_perror("calloc");
+                asset_pack_free(pack);
+                return NULL;
+            }
+
+            priv->pack = pack;
+            priv->root_fd = -1;
+            priv->index_html =
+                settings->index_html ? settings->index_html : "index.html";
+            set_byteranges_boundary(priv);
+
+            return priv;
+        }
+    }
+
     if (!settings->root_path) {
         lwan_status_error("root_path not specified");
         return NULL;
@@ -1003,6 +3210,19 @@ static void *serve_files_create(const char *prefix, void *args)
         lwan_status_error("Couldn't create cache");
         goto out_cache_create;
     }
+    char cache_name[128];
+    snprintf(cache_name, sizeof(cache_name), "serve_files %s", prefix);
+    cache_set_name(priv->cache, cache_name);
+    cache_set_peer_fill(priv->cache, peer_serialize_entry);
+    /* Measured even without a budget, for the status module. */
+    cache_set_max_size(priv->cache, settings->cache_max_size,
+                       cache_entry_size);
+    if (settings->thread_cache)
+        cache_enable_thread_cache(priv->cache);
+    if (settings->cache_not_found_for)
+        cache_set_negative_time_to_live(priv->cache,
+                                        settings->cache_not_found_for,
+                                        NOT_FOUND_MAX_ENTRIES);
 
     if (settings->directory_list_template) {
         priv->directory_list_tpl = lwan_tpl_compile_file(
@@ -1032,10 +3252,100 @@ static void *serve_files_create(const char *prefix, void *args)
     priv->auto_index = settings->auto_index;
     priv->auto_index_readme = settings->auto_index_readme;
     priv->read_ahead = settings->read_ahead;
+    priv->watcher = NULL;
+    priv->snapshot_path = NULL;
+    priv->snapshot = NULL;
+    priv->pack = pack;
+    priv->preloader = NULL;
+    priv->pinned = NULL;
+    priv->recompressor = NULL;
+    priv->recompress_after_hits = settings->recompress_after_hits;
+    priv->compress_dict = NULL;
+    priv->promotion.keys = NULL;
+    priv->promotion.size = 0;
+    priv->promotion.max_size = settings->promoted_memory_limit;
+    priv->promotion.max_file_size = settings->promote_max_file_size;
+    priv->promotion.after_hits = settings->promote_after_hits;
+
+    if (settings->promote_after_hits) {
+        priv->promotion.keys = hash_str_new(free, NULL);
+        if (!priv->promotion.keys) {
+            lwan_status_error("Could not allocate promoted files table");
+            goto out_promotion;
+        }
+        pthread_mutex_init(&priv->promotion.lock, NULL);
+    }
+
+    if (settings->compression_dictionary) {
+        priv->compress_dict =
+            lwan_compress_dict_get(settings->compression_dictionary);
+        if (!priv->compress_dict) {
+            lwan_status_error("Could not load compression dictionary");
+            goto out_compress_dict;
+        }
+    }
+
+    set_byteranges_boundary(priv);
+
+    /* Before any file is cached, as that changes compression levels. */
+    if (settings->recompress_after_hits && !recompressor_new(priv)) {
+        lwan_status_error("Could not create recompression thread");
+        goto out_recompressor;
+    }
+
+    if (settings->watch_for_changes) {
+        priv->watcher = file_watcher_new(priv);
+        if (!priv->watcher) {
+            lwan_status_error("Could not watch \"%s\" for changes",
+                              canonical_root);
+            goto out_watcher;
+        }
+    }
+
+    if (settings->cache_snapshot) {
+        priv->snapshot_path = strdup(settings->cache_snapshot);
+        if (!priv->snapshot_path) {
+            lwan_status_error("Could not copy snapshot path");
+            goto out_snapshot;
+        }
+
+        priv->snapshot = snapshot_open(priv);
+        if (priv->snapshot && pthread_create(&priv->snapshot->thread, NULL,
+                                             snapshot_prewarm_thread, priv)) {
+            lwan_status_perror("pthread_create");
+            hash_free(priv->snapshot->records);
+            munmap((void *)priv->snapshot->map, priv->snapshot->map_len);
+            pthread_rwlock_destroy(&priv->snapshot->lock);
+            free(priv->snapshot);
+            priv->snapshot = NULL;
+        }
+    }
+
+    if (settings->preload) {
+        priv->preloader =
+            preloader_new(priv, settings->preload, settings->preload_pin);
+        if (!priv->preloader)
+            lwan_status_error("Could not preload files under \"%s\"",
+                              canonical_root);
+    }
+
+    if (priv->watcher || priv->pinned)
+        cache_set_should_renew(priv->cache, should_renew_cache_entry);
 
     return priv;
 
+out_snapshot:
+    file_watcher_free(priv->watcher);
+out_watcher:
+    recompressor_free(priv);
+out_recompressor:
+    lwan_compress_dict_put(priv->compress_dict);
+out_compress_dict:
+    promotion_free(priv);
+out_promotion:
+    free(priv->prefix);
 out_tpl_prefix_copy:
+    lwan_tpl_free(priv->directory_list_tpl);
 out_tpl_compile:
     cache_destroy(priv->cache);
 out_cache_create:
@@ -1045,6 +3355,7 @@ out_malloc:
 out_open:
     free(canonical_root);
 out_realpath:
+    asset_pack_free(pack);
     return NULL;
 }
 
@@ -1064,6 +3375,28 @@ static void *serve_files_create_from_hash(const char *prefix,
             parse_bool(hash_find(hash, "auto_index_readme"), true),
         .cache_for = (time_t)parse_time_period(hash_find(hash, "cache_for"),
                                                SERVE_FILES_CACHE_FOR),
+        .watch_for_changes =
+            parse_bool(hash_find(hash, "watch_for_changes"), false),
+        .cache_max_size =
+            (size_t)parse_long_long(hash_find(hash, "cache_max_size"), 0),
+        .thread_cache = parse_bool(hash_find(hash, "thread_cache"), false),
+        .cache_snapshot = hash_find(hash, "cache_snapshot"),
+        .cache_not_found_for = (time_t)parse_time_period(
+            hash_find(hash, "cache_not_found_for"), 0),
+        .asset_pack = hash_find(hash, "asset_pack"),
+        .recompress_after_hits = (unsigned int)parse_long(
+            hash_find(hash, "recompress_after_hits"), 0),
+        .promote_after_hits = (unsigned int)parse_long(
+            hash_find(hash, "promote_after_hits"), 0),
+        .promote_max_file_size = (size_t)parse_long_long(
+            hash_find(hash, "promote_max_file_size"),
+            SERVE_FILES_PROMOTE_MAX_FILE_SIZE),
+        .promoted_memory_limit = (size_t)parse_long_long(
+            hash_find(hash, "promoted_memory_limit"),
+            SERVE_FILES_PROMOTED_MEMORY_LIMIT),
+        .preload = hash_find(hash, "preload"),
+        .preload_pin = parse_bool(hash_find(hash, "preload_pin"), false),
+        .compression_dictionary = hash_find(hash, "compression_dictionary"),
     };
 
     return serve_files_create(prefix, &settings);
@@ -1078,21 +3411,77 @@ static void serve_files_destroy(void *data)
         return;
     }
 
+    asset_pack_free(priv->pack);
+    if (!priv->cache) {
+        /* Only files in the asset pack were being served. */
+        free(priv);
+        return;
+    }
+
+    /* Stop prewarming before the snapshot is overwritten. */
+    preloader_free(priv->preloader);
+    snapshot_free(priv->snapshot);
+    if (priv->snapshot_path) {
+        snapshot_write(priv);
+        free(priv->snapshot_path);
+    }
+
+    file_watcher_free(priv->watcher);
+    recompressor_free(priv);
     lwan_tpl_free(priv->directory_list_tpl);
     cache_destroy(priv->cache);
+    if (priv->pinned)
+        hash_free(priv->pinned);
+    promotion_free(priv);
+    lwan_compress_dict_put(priv->compress_dict);
     close(priv->root_fd);
     free(priv->root_path);
     free(priv->prefix);
     free(priv);
 }
 
-static ALWAYS_INLINE bool client_has_fresh_content(struct lwan_request *request,
-                                                   time_t mtime)
+static ALWAYS_INLINE bool
+client_has_fresh_content(struct lwan_request *request,
+                         const struct file_cache_entry *fce)
 {
     time_t header;
-    int r = lwan_request_get_if_modified_since(request, &header);
+    int r;
+
+    /* If-None-Match takes precedence over If-Modified-Since; the latter is
+     * ignored if the former is present (RFC 7232, section 6). */
+    if (LIKELY(fce->etag[0])) {
+        r = lwan_request_get_if_none_match(request, fce->etag);
+        if (r != -ENOENT)
+            return !r;
+    }
+
+    r = lwan_request_get_if_modified_since(request, &header);
+
+    return LIKELY(!r) ? fce->last_modified.integer <= header : false;
+}
+
+/* The ETag is the same regardless of the content encoding used to transfer
+ * a file, as nginx and others do for precompressed files: all of them are
+ * derived from, and validated against, the same file. */
+static const struct lwan_key_value *
+with_etag(struct lwan_request *request,
+          const struct file_cache_entry *fce,
+          const struct lwan_key_value *encoding_hdr)
+{
+    /* Encoding headers have at most two entries (see dcz_compression_hdr). */
+    struct lwan_key_value headers[] = {
+        {"ETag", (char *)fce->etag},
+        encoding_hdr ? encoding_hdr[0] : (struct lwan_key_value){},
+        encoding_hdr ? encoding_hdr[1] : (struct lwan_key_value){},
+        {},
+    };
+    const struct lwan_key_value *copy;
 
-    return LIKELY(!r) ? mtime <= header : false;
+    if (!fce->etag[0])
+        return encoding_hdr;
+
+    copy = coro_memdup(request->conn->coro, headers, sizeof(headers));
+    return LIKELY(copy) ? copy : encoding_hdr;
 }
 
 static size_t prepare_headers(struct lwan_request *request,
@@ -1104,7 +3493,7 @@ static size_t prepare_headers(struct lwan_request *request,
 {
     char content_length[INT_TO_STR_BUFFER_SIZE];
     size_t discard;
-    struct lwan_key_value additional_headers[4] = {
+    struct lwan_key_value additional_headers[5] = {
         {
             .key = "Last-Modified",
             .value = fce->last_modified.string,
@@ -1114,9 +3503,13 @@ static size_t prepare_headers(struct lwan_request *request,
             .value = uint_to_string(size, content_length, &discard),
         },
     };
+    size_t n_headers = 2;
 
+    if (LIKELY(fce->etag[0]))
+        additional_headers[n_headers++] =
+            (struct lwan_key_value){.key = "ETag", .value = fce->etag};
     if (user_hdr)
-        additional_headers[2] = *user_hdr;
+        additional_headers[n_headers] = *user_hdr;
 
     return lwan_prepare_response_header_full(request, return_status, header_buf,
                                              DEFAULT_HEADERS_SIZE,
@@ -1165,6 +3558,36 @@ static inline bool accepts_encoding(struct lwan_request *request,
     return lwan_request_get_accept_encoding(request) & encoding;
 }
 
+static enum lwan_http_status status_from_fd_error(int fd)
+{
+    switch (-fd) {
+    case EACCES:
+        return HTTP_FORBIDDEN;
+    case EMFILE:
+    case ENFILE:
+        return HTTP_UNAVAILABLE;
+    default:
+        return HTTP_INTERNAL_ERROR;
+    }
+}
+
+static int sendfile_best_encoding(struct lwan_request *request,
+                                  const struct sendfile_cache_data *sd)
+{
+    size_t best_size = sd->uncompressed.size;
+    int best = -1;
+
+    for (int i = 0; i < PRECOMPRESSED_N_ENCODINGS; i++) {
+        if (sd->compressed[i].size && sd->compressed[i].size < best_size &&
+            accepts_encoding(request, precompressed_encodings[i].accept)) {
+            best = i;
+            best_size = sd->compressed[i].size;
+        }
+    }
+
+    return best;
+}
+
 static enum lwan_http_status sendfile_serve(struct lwan_request *request,
                                             void *data)
 {
@@ -1177,14 +3600,15 @@ static enum lwan_http_status sendfile_serve(struct lwan_request *request,
     off_t from, to;
     size_t size;
     int fd;
+    int encoding = sendfile_best_encoding(request, sd);
 
-    if (sd->compressed.size && accepts_encoding(request, REQUEST_ACCEPT_GZIP)) {
+    if (encoding >= 0) {
         from = 0;
-        to = (off_t)sd->compressed.size;
+        to = (off_t)sd->compressed[encoding].size;
 
-        compression_hdr = gzip_compression_hdr;
-        fd = sd->compressed.fd;
-        size = sd->compressed.size;
+        compression_hdr = precompressed_encodings[encoding].header;
+        fd = sd->compressed[encoding].fd;
+        size = sd->compressed[encoding].size;
 
         return_status = HTTP_OK;
     } else {
@@ -1197,17 +3621,8 @@ static enum lwan_http_status sendfile_serve(struct lwan_request *request,
         fd = sd->uncompressed.fd;
         size = (size_t)(to - from);
     }
-    if (UNLIKELY(fd < 0)) {
-        switch (-fd) {
-        case EACCES:
-            return HTTP_FORBIDDEN;
-        case EMFILE:
-        case ENFILE:
-            return HTTP_UNAVAILABLE;
-        default:
-            return HTTP_INTERNAL_ERROR;
-        }
-    }
+    if (UNLIKELY(fd < 0))
+        return status_from_fd_error(fd);
 
     header_len = prepare_headers(request, return_status, fce, size,
                                  compression_hdr, headers);
@@ -1263,22 +3678,32 @@ mmap_best_data(struct lwan_request *request,
                struct mmap_cache_data *md,
                const struct lwan_key_value **header)
 {
+    const struct mmap_recompressed *rc = get_recompressed(md);
     const struct lwan_value *best = &md->uncompressed;
+    const struct lwan_value *value;
 
     *header = NULL;
 
 #if defined(HAVE_ZSTD)
-    if (md->zstd.len && md->zstd.len < best->len &&
+    /* Smaller than anything else, if it's there at all. */
+    if (md->dcz.len && lwan_compress_dict_accepted(request, md->dict)) {
+        *header = dcz_compression_hdr;
+        return &md->dcz;
+    }
+
+    value = recompressed_or(&rc->zstd, &md->zstd);
+    if (value->len && value->len < best->len &&
         accepts_encoding(request, REQUEST_ACCEPT_ZSTD)) {
-        best = &md->zstd;
+        best = value;
         *header = zstd_compression_hdr;
     }
 #endif
 
 #if defined(HAVE_BROTLI)
-    if (md->brotli.len && md->brotli.len < best->len &&
+    value = recompressed_or(&rc->brotli, &md->brotli);
+    if (value->len && value->len < best->len &&
         accepts_encoding(request, REQUEST_ACCEPT_BROTLI)) {
-        best = &md->brotli;
+        best = value;
         *header = br_compression_hdr;
     }
 #endif
@@ -1289,9 +3714,10 @@ mmap_best_data(struct lwan_request *request,
         *header = gzip_compression_hdr;
     }
 
-    if (md->deflated.len && md->deflated.len < best->len &&
+    value = recompressed_or(&rc->deflated, &md->deflated);
+    if (value->len && value->len < best->len &&
         accepts_encoding(request, REQUEST_ACCEPT_DEFLATE)) {
-        best = &md->deflated;
+        best = value;
         *header = deflate_compression_hdr;
     }
 
@@ -1309,7 +3735,7 @@ static enum lwan_http_status mmap_serve(struct lwan_request *request,
 
     if (compression_hdr)
         return serve_value_ok(request, fce->mime_type, to_serve,
-                              compression_hdr);
+                              with_etag(request, fce, compression_hdr));
 
     off_t from, to;
     enum lwan_http_status status =
@@ -1318,7 +3744,8 @@ static enum lwan_http_status mmap_serve(struct lwan_request *request,
         return status;
 
     return serve_buffer(request, fce->mime_type, (char *)to_serve->value + from,
-                        (size_t)(to - from), NULL, status);
+                        (size_t)(to - from), with_etag(request, fce, NULL),
+                        status);
 }
 
 static enum lwan_http_status dirlist_serve(struct lwan_request *request,
@@ -1329,21 +3756,42 @@ static enum lwan_http_status dirlist_serve(struct lwan_request *request,
     const char *icon = lwan_request_get_query_param(request, "icon");
 
     if (!icon) {
+        const char *page_str = lwan_request_get_query_param(request, "page");
+
+        if (page_str) {
+            long page = parse_long(page_str, 0);
+
+            if (page < 1 || (size_t)page > dirlist_n_pages(dd))
+                return HTTP_NOT_FOUND;
+
+            if (page > 1) {
+                if (!dirlist_render_page(dd, (size_t)page - 1,
+                                         request->response.buffer))
+                    return HTTP_INTERNAL_ERROR;
+
+                request->response.mime_type = fce->mime_type;
+                request->response.headers = with_etag(request, fce, NULL);
+                return HTTP_OK;
+            }
+        }
+
 #if defined(HAVE_BROTLI)
         if (dd->brotli.len && accepts_encoding(request, REQUEST_ACCEPT_BROTLI)) {
             return serve_value_ok(request, fce->mime_type, &dd->brotli,
-                                  br_compression_hdr);
+                                  with_etag(request, fce, br_compression_hdr));
         }
 #endif
 
         if (dd->deflated.len && accepts_encoding(request, REQUEST_ACCEPT_DEFLATE)) {
-            return serve_value_ok(request, fce->mime_type, &dd->deflated,
-                                  deflate_compression_hdr);
+            return serve_value_ok(
+                request, fce->mime_type, &dd->deflated,
+                with_etag(request, fce, deflate_compression_hdr));
         }
 
         return serve_buffer(
             request, fce->mime_type, lwan_strbuf_get_buffer(&dd->rendered),
-            lwan_strbuf_get_length(&dd->rendered), NULL, HTTP_OK);
+            lwan_strbuf_get_length(&dd->rendered), with_etag(request, fce, NULL),
+            HTTP_OK);
     }
 
     STRING_SWITCH (icon) {
@@ -1376,6 +3824,230 @@ static enum lwan_http_status redir_serve(struct lwan_request *request,
                                      : HTTP_INTERNAL_ERROR;
 }
 
+struct byte_ranges {
+    struct file_cache_entry *fce;
+    size_t n_ranges;
+    struct lwan_byte_range ranges[MAX_BYTE_RANGES];
+};
+
+static inline bool is_mmap_entry(const struct file_cache_entry *fce)
+{
+    return fce->funcs->serve == mmap_serve;
+}
+
+static inline bool is_sendfile_entry(const struct file_cache_entry *fce)
+{
+    return fce->funcs->serve == sendfile_serve;
+}
+
+/* Sends a multipart/byteranges response.  Parts are sent straight from the
+ * mmap'd file contents with a single writev(), or with one sendfile() call
+ * per part; the file contents are never copied. */
+static enum lwan_http_status byte_ranges_serve(struct lwan_request *request,
+                                               void *data)
+{
+    const struct byte_ranges *br = data;
+    struct file_cache_entry *fce = br->fce;
+    struct iovec iov[2 + MAX_BYTE_RANGES * 2];
+    size_t part_header_len[MAX_BYTE_RANGES];
+    char headers[DEFAULT_HEADERS_SIZE];
+    char closing[sizeof("\r\n----\r\n") + 16];
+    size_t part_header_size, header_len, closing_len, total_len = 0;
+    off_t size;
+    char *part_headers;
+    int fd = -1;
+
+    if (is_mmap_entry(fce)) {
+        size = (off_t)fce->mmap_cache_data.uncompressed.len;
+    } else {
+        fd = fce->sendfile_cache_data.uncompressed.fd;
+        if (UNLIKELY(fd < 0))
+            return status_from_fd_error(fd);
+        size = (off_t)fce->sendfile_cache_data.uncompressed.size;
+    }
+
+    part_header_size = strlen(fce->mime_type) + 128;
+    part_headers = coro_malloc(request->conn->coro,
+                               part_header_size * br->n_ranges);
+    if (UNLIKELY(!part_headers))
+        return HTTP_INTERNAL_ERROR;
+
+    for (size_t i = 0; i < br->n_ranges; i++) {
+        const struct lwan_byte_range *r = &br->ranges[i];
+        int len = snprintf(part_headers + i * part_header_size,
+                           part_header_size,
+                           "\r\n--%s\r\n"
+                           "Content-Type: %s\r\n"
+                           "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                           byteranges_boundary, fce->mime_type,
+                           (long long)r->from, (long long)r->to - 1,
+                           (long long)size);
+        if (UNLIKELY(len < 0 || (size_t)len >= part_header_size))
+            return HTTP_INTERNAL_ERROR;
+
+        part_header_len[i] = (size_t)len;
+        total_len += (size_t)len + (size_t)(r->to - r->from);
+    }
+
+    closing_len = (size_t)snprintf(closing, sizeof(closing), "\r\n--%s--\r\n",
+                                   byteranges_boundary);
+    total_len += closing_len;
+
+    header_len = prepare_headers(request, HTTP_PARTIAL_CONTENT, fce, total_len,
+                                 NULL, headers);
+    if (UNLIKELY(!header_len))
+        return HTTP_INTERNAL_ERROR;
+
+    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD) {
+        lwan_send(request, headers, header_len, 0);
+        return HTTP_PARTIAL_CONTENT;
+    }
+
+    if (fd < 0) {
+        char *contents = fce->mmap_cache_data.uncompressed.value;
+        size_t n_iov = 0;
+
+        iov[n_iov++] = (struct iovec){.iov_base = headers,
+                                      .iov_len = header_len};
+        for (size_t i = 0; i < br->n_ranges; i++) {
+            const struct lwan_byte_range *r = &br->ranges[i];
+
+            iov[n_iov++] = (struct iovec){
+                .iov_base = part_headers + i * part_header_size,
+                .iov_len = part_header_len[i],
+            };
+            iov[n_iov++] = (struct iovec){
+                .iov_base = contents + r->from,
+                .iov_len = (size_t)(r->to - r->from),
+            };
+        }
+        iov[n_iov++] = (struct iovec){.iov_base = closing,
+                                      .iov_len = closing_len};
+
+        lwan_writev(request, iov, (int)n_iov);
+    } else {
+        lwan_send(request, headers, header_len, MSG_MORE);
+
+        for (size_t i = 0; i < br->n_ranges; i++) {
+            const struct lwan_byte_range *r = &br->ranges[i];
+
+            lwan_sendfile(request, fd, r->from, (size_t)(r->to - r->from),
+                          part_headers + i * part_header_size,
+                          part_header_len[i]);
+        }
+
+        lwan_send(request, closing, closing_len, 0);
+    }
+
+    return HTTP_PARTIAL_CONTENT;
+}
+
+/* Returns HTTP_OK if this isn't a request for multiple byte ranges, which
+ * should then be served as usual. */
+static enum lwan_http_status
+prepare_byte_ranges(struct lwan_request *request,
+                    struct lwan_response *response,
+                    struct file_cache_entry *fce)
+{
+    struct byte_ranges *br;
+    off_t size;
+    int n_ranges;
+
+    if (is_mmap_entry(fce))
+        size = (off_t)fce->mmap_cache_data.uncompressed.len;
+    else if (is_sendfile_entry(fce))
+        size = (off_t)fce->sendfile_cache_data.uncompressed.size;
+    else
+        return HTTP_OK;
+
+    br = coro_malloc(request->conn->coro, sizeof(*br));
+    if (UNLIKELY(!br))
+        return HTTP_INTERNAL_ERROR;
+
+    n_ranges = lwan_request_get_byte_ranges(request, size, br->ranges,
+                                            N_ELEMENTS(br->ranges));
+    if (n_ranges == -ERANGE)
+        return HTTP_RANGE_UNSATISFIABLE;
+    if (n_ranges < 2)
+        return HTTP_OK;
+
+    br->fce = fce;
+    br->n_ranges = (size_t)n_ranges;
+
+    response->mime_type = multipart_byteranges_type;
+    response->stream.callback = byte_ranges_serve;
+    response->stream.data = br;
+    request->flags |= RESPONSE_STREAM;
+
+    return HTTP_PARTIAL_CONTENT;
+}
+
+/* Encodings only available for files compressed by Lwan, i.e. those kept
+ * in memory. */
+static const enum lwan_request_flags in_memory_encodings =
+    REQUEST_ACCEPT_DEFLATE
+#if defined(HAVE_BROTLI)
+    | REQUEST_ACCEPT_BROTLI
+#endif
+#if defined(HAVE_ZSTD)
+    | REQUEST_ACCEPT_ZSTD
+#endif
+    ;
+
+static void mark_hot(struct serve_files_priv *priv, const char *key)
+{
+    char *key_copy;
+
+    pthread_mutex_lock(&priv->promotion.lock);
+    if (hash_find(priv->promotion.keys, key)) {
+        /* Already hot, or not worth promoting. */
+        key_copy = NULL;
+    } else {
+        key_copy = strdup(key);
+        if (key_copy &&
+            hash_add(priv->promotion.keys, key_copy, PROMOTION_HOT)) {
+            free(key_copy);
+            key_copy = NULL;
+        }
+    }
+    pthread_mutex_unlock(&priv->promotion.lock);
+
+    if (key_copy) {
+        lwan_status_debug("%s is hot, promoting once it expires", key);
+    }
+}
+
+/* Only requests that would be served a smaller response if the file were
+ * compressed in memory are counted, and only up to the threshold, to not
+ * keep writing to the entries of the hottest files.  Files served with
+ * sendfile() are marked as hot once the threshold is reached, and will be
+ * kept in memory when they're cached again; see get_funcs(). */
+static void count_promotion_hit(struct serve_files_priv *priv,
+                                struct lwan_request *request,
+                                struct file_cache_entry *fce)
+{
+    if (!(lwan_request_get_accept_encoding(request) & in_memory_encodings))
+        return;
+
+    if (is_sendfile_entry(fce)) {
+        const struct sendfile_cache_data *sd = &fce->sendfile_cache_data;
+
+        if (sd->uncompressed.fd < 0 ||
+            sd->uncompressed.size > priv->promotion.max_file_size ||
+            sendfile_best_encoding(request, sd) >= 0)
+            return;
+    } else if (!fce->promoted_key) {
+        return;
+    }
+
+    if (ATOMIC_READ(fce->hits) >= priv->promotion.after_hits ||
+        ATOMIC_INC(fce->hits) != priv->promotion.after_hits)
+        return;
+
+    if (is_sendfile_entry(fce))
+        mark_hot(priv, request->url.value);
+}
+
 static enum lwan_http_status
 serve_files_handle_request(struct lwan_request *request,
                            struct lwan_response *response,
@@ -1385,16 +4057,36 @@ serve_files_handle_request(struct lwan_request *request,
     struct file_cache_entry *fce;
     struct cache_entry *ce;
 
-    ce = cache_coro_get_and_ref_entry(priv->cache, request->conn->coro,
-                                      request->url.value);
+    if (priv->pack) {
+        fce = asset_pack_find(priv, request);
+        if (fce)
+            goto serve;
+        if (!priv->cache)
+            return HTTP_NOT_FOUND;
+    }
+
+    ce = cache_coro_get_and_ref_entry_async(priv->cache, request,
+                                            request->url.value);
     if (UNLIKELY(!ce))
         return HTTP_NOT_FOUND;
 
     fce = (struct file_cache_entry *)ce;
-    if (client_has_fresh_content(request, fce->last_modified.integer))
+serve:
+    if (client_has_fresh_content(request, fce)) {
+        response->headers = with_etag(request, fce, NULL);
         return HTTP_NOT_MODIFIED;
+    }
+
+    enum lwan_http_status status = prepare_byte_ranges(request, response, fce);
+    if (status != HTTP_OK)
+        return status;
+
+    if (priv->recompressor && fce->funcs == &mmap_funcs)
+        maybe_recompress(priv, fce);
+    if (priv->promotion.after_hits && fce->funcs != &pack_funcs)
+        count_promotion_hit(priv, request, fce);
 
-    if (fce->funcs->serve == sendfile_serve) {
+    if (is_sendfile_entry(fce)) {
         response->mime_type = fce->mime_type;
         response->stream.callback = fce->funcs->serve;
         response->stream.data = fce;
@@ -27,16 +27,31 @@ extern "C" {
 
 #define SERVE_FILES_READ_AHEAD_BYTES (128 * 1024)
 #define SERVE_FILES_CACHE_FOR 5
+#define SERVE_FILES_PROMOTE_MAX_FILE_SIZE (1024 * 1024)
+#define SERVE_FILES_PROMOTED_MEMORY_LIMIT (64 * 1024 * 1024)
 
 struct lwan_serve_files_settings {
   const char *root_path;
   const char *index_html;
   const char *directory_list_template;
+  const char *cache_snapshot;
+  const char *asset_pack;
+  const char *preload;
+  const char *compression_dictionary;
   size_t read_ahead;
   time_t cache_for;
+  time_t cache_not_found_for;
+  size_t cache_max_size;
+  unsigned int recompress_after_hits;
+  unsigned int promote_after_hits;
+  size_t promote_max_file_size;
+  size_t promoted_memory_limit;
   bool serve_precompressed_files;
   bool auto_index;
   bool auto_index_readme;
+  bool watch_for_changes;
+  bool thread_cache;
+  bool preload_pin;
 };
 
 LWAN_MODULE_FORWARD_DECL(serve_files);
@@ -52,6 +67,19 @@ LWAN_MODULE_FORWARD_DECL(serve_files);
     .auto_index = true, \
     .auto_index_readme = true, \
     .cache_for = SERVE_FILES_CACHE_FOR, \
+    .cache_max_size = 0, \
+    .watch_for_changes = false, \
+    .thread_cache = false, \
+    .cache_snapshot = NULL, \
+    .cache_not_found_for = 0, \
+    .asset_pack = NULL, \
+    .recompress_after_hits = 0, \
+    .promote_after_hits = 0, \
+    .promote_max_file_size = SERVE_FILES_PROMOTE_MAX_FILE_SIZE, \
+    .promoted_memory_limit = SERVE_FILES_PROMOTED_MEMORY_LIMIT, \
+    .preload = NULL, \
+    .preload_pin = false, \
+    .compression_dictionary = NULL, \
   }}), \
   .flags = (enum lwan_handler_flags)0
 
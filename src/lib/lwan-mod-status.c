@@ -0,0 +1,284 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "lwan-private.h"
+#include "lwan-cache.h"
+#include "lwan-mod-status.h"
+#include "lwan-tq.h"
+
+/* Unlike the metrics module, which is meant to be scraped periodically,
+ * this dumps the state of the server as it is right now, mostly gauges,
+ * as JSON.  Values are read from other threads without synchronization
+ * (other than what's needed to walk the lists of caches and jobs), so
+ * they're only approximately consistent with each other. */
+
+static bool append_string(struct lwan_strbuf *buffer, const char *str)
+{
+    if (!lwan_strbuf_append_char(buffer, '"'))
+        return false;
+
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        bool ok;
+
+        if (*p == '"' || *p == '\\')
+            ok = lwan_strbuf_append_char(buffer, '\\') &&
+                 lwan_strbuf_append_char(buffer, (char)*p);
+        else if (*p < 0x20)
+            ok = lwan_strbuf_append_printf(buffer, "\\u%04x", *p);
+        else
+            ok = lwan_strbuf_append_char(buffer, (char)*p);
+
+        if (!ok)
+            return false;
+    }
+
+    return lwan_strbuf_append_char(buffer, '"');
+}
+
+static bool append_thread(struct lwan_strbuf *buffer,
+                          const struct lwan *l,
+                          unsigned int i)
+{
+    const struct lwan_thread *t = &l->thread.threads[i];
+    const struct timeout_queue *tq = ATOMIC_READ(t->tq);
+    const uint64_t loops = ATOMIC_READ(t->metrics.loops);
+    const uint64_t events = ATOMIC_READ(t->metrics.events);
+    /* Hundredths of events per loop, to avoid floating point */
+    const uint64_t events_per_loop = loops ? events * 100 / loops : 0;
+    const uint64_t requests = ATOMIC_READ(t->metrics.requests);
+    const uint64_t defers = ATOMIC_READ(t->metrics.defers);
+    /* Likewise, hundredths of deferred calls per request */
+    const uint64_t defers_per_request = requests ? defers * 100 / requests : 0;
+    const uint64_t spills = ATOMIC_READ(t->metrics.request_buffer_spills);
+
+    return lwan_strbuf_append_printf(
+        buffer,
+        "%s{\"thread\":%u,"
+        "\"open_connections\":%u,"
+        "\"keep_alive_queue\":%u,"
+        "\"pending_connections\":%zu,"
+        "\"async_awaits\":%u,"
+        "\"pooled_coroutines\":%u,"
+        "\"loops\":%" PRIu64 ","
+        "\"events\":%" PRIu64 ","
+        "\"events_per_loop\":%" PRIu64 ".%02" PRIu64 ","
+        "\"requests\":%" PRIu64 ","
+        "\"defers_per_request\":%" PRIu64 ".%02" PRIu64 ","
+        "\"request_buffer_spills\":%" PRIu64 "}",
+        i ? "," : "", i, ATOMIC_READ(t->n_connections),
+        tq ? ATOMIC_READ(tq->n_conns) : 0u,
+        spsc_queue_length(&t->pending_fds), ATOMIC_READ(t->n_async_awaits),
+        ATOMIC_READ(t->coro_pool.count), loops, events, events_per_loop / 100,
+        events_per_loop % 100, requests, defers_per_request / 100,
+        defers_per_request % 100, spills);
+}
+
+static bool append_readahead(struct lwan_strbuf *buffer)
+{
+    struct lwan_readahead_stats stats;
+
+    lwan_readahead_get_stats(&stats);
+
+    return lwan_strbuf_append_printf(
+        buffer,
+        "\"readahead\":{\"queue_depth\":%u,\"queue_max_depth\":%u,"
+        "\"queued\":%" PRIu64 ",\"coalesced\":%" PRIu64
+        ",\"dropped\":%" PRIu64 "}",
+        stats.depth, stats.max_depth, stats.queued, stats.coalesced,
+        stats.dropped);
+}
+
+static bool append_slabs(struct lwan_strbuf *buffer)
+{
+    struct lwan_slab_stats stats[32];
+    size_t n_stats = lwan_slab_get_stats(stats, N_ELEMENTS(stats));
+    bool first = true;
+
+    if (!lwan_strbuf_append_strz(buffer, "\"slabs\":["))
+        return false;
+
+    /* Size classes that were never used aren't interesting */
+    for (size_t i = 0; i < n_stats; i++) {
+        if (!stats[i].slabs)
+            continue;
+
+        if (!lwan_strbuf_append_printf(
+                buffer,
+                "%s{\"object_size\":%zu,\"slabs\":%" PRIu64
+                ",\"objects\":%" PRIu64 ",\"capacity\":%" PRIu64 "}",
+                first ? "" : ",", stats[i].object_size, stats[i].slabs,
+                stats[i].objects,
+                stats[i].slabs * (uint64_t)stats[i].objects_per_slab))
+            return false;
+        first = false;
+    }
+
+    return lwan_strbuf_append_char(buffer, ']');
+}
+
+struct list_state {
+    struct lwan_strbuf *buffer;
+    bool first;
+};
+
+static bool append_separator(struct list_state *state)
+{
+    if (state->first) {
+        state->first = false;
+        return true;
+    }
+
+    return lwan_strbuf_append_char(state->buffer, ',');
+}
+
+static bool append_job(const struct lwan_job_stats *stats, void *data)
+{
+    struct list_state *state = data;
+
+    return append_separator(state) &&
+           lwan_strbuf_append_strz(state->buffer, "{\"name\":") &&
+           append_string(state->buffer, stats->name) &&
+           lwan_strbuf_append_printf(
+               state->buffer,
+               ",\"runs\":%" PRIu64 ",\"runtime_us\":%" PRIu64
+               ",\"last_runtime_us\":%" PRIu64 ",\"max_runtime_us\":%" PRIu64
+               ",\"max_delay_us\":%" PRIu64 ",\"wakeups\":%" PRIu64
+               ",\"interval_ms\":%u}",
+               stats->runs, stats->runtime_us, stats->last_runtime_us,
+               stats->max_runtime_us, stats->max_delay_us, stats->wakeups,
+               stats->interval_ms);
+}
+
+static bool append_cache(const struct cache_stats *stats, void *data)
+{
+    struct list_state *state = data;
+
+    if (!append_separator(state) ||
+        !lwan_strbuf_append_strz(state->buffer, "{\"name\":") ||
+        !append_string(state->buffer, stats->name) ||
+        !lwan_strbuf_append_printf(state->buffer,
+                                   ",\"entries\":%u,\"pending\":%u",
+                                   stats->entries, stats->pending))
+        return false;
+
+    /* Sizes are only known for caches that measure their entries */
+    if (!stats->measured)
+        return lwan_strbuf_append_strz(state->buffer,
+                                       ",\"bytes\":null,\"max_bytes\":null}");
+    if (!stats->max_size)
+        return lwan_strbuf_append_printf(state->buffer,
+                                         ",\"bytes\":%zu,\"max_bytes\":null}",
+                                         stats->size);
+
+    return lwan_strbuf_append_printf(state->buffer,
+                                     ",\"bytes\":%zu,\"max_bytes\":%zu}",
+                                     stats->size, stats->max_size);
+}
+
+static bool add_cache_size(const struct cache_stats *stats, void *data)
+{
+    size_t *total = data;
+
+    *total += stats->size;
+    return true;
+}
+
+static bool append_memory(struct lwan_strbuf *buffer, const struct lwan *l)
+{
+    size_t caches = 0;
+
+    if (!lwan_strbuf_append_strz(buffer, "\"memory\":{"))
+        return false;
+
+    for (enum lwan_memory_subsystem s = 0; s < LWAN_MEMORY_N_SUBSYSTEMS; s++) {
+        if (!lwan_strbuf_append_printf(buffer, "\"%s\":%" PRId64 ",",
+                                       lwan_memory_subsystem_name(s),
+                                       lwan_memory_get(l, s)))
+            return false;
+    }
+
+    cache_stats_for_each(add_cache_size, &caches);
+
+    return lwan_strbuf_append_printf(buffer, "\"caches\":%zu}", caches);
+}
+
+static enum lwan_http_status
+status_handle_request(struct lwan_request *request,
+                      struct lwan_response *response,
+                      void *instance __attribute__((unused)))
+{
+    const struct lwan *l = request->conn->thread->lwan;
+    struct lwan_strbuf *buffer = response->buffer;
+    struct list_state state = {.buffer = buffer};
+
+    if (!lwan_strbuf_append_strz(buffer, "{\"threads\":["))
+        return HTTP_INTERNAL_ERROR;
+    for (unsigned int i = 0; i < l->thread.count; i++) {
+        if (!append_thread(buffer, l, i))
+            return HTTP_INTERNAL_ERROR;
+    }
+
+    if (!lwan_strbuf_append_strz(buffer, "],") || !append_readahead(buffer) ||
+        !lwan_strbuf_append_char(buffer, ',') || !append_slabs(buffer) ||
+        !lwan_strbuf_append_char(buffer, ',') || !append_memory(buffer, l))
+        return HTTP_INTERNAL_ERROR;
+
+    state.first = true;
+    if (!lwan_strbuf_append_strz(buffer, ",\"jobs\":[") ||
+        !lwan_job_stats_for_each(append_job, &state))
+        return HTTP_INTERNAL_ERROR;
+
+    state.first = true;
+    if (!lwan_strbuf_append_strz(buffer, "],\"caches\":[") ||
+        !cache_stats_for_each(append_cache, &state) ||
+        !lwan_strbuf_append_strz(buffer, "]}"))
+        return HTTP_INTERNAL_ERROR;
+
+    response->mime_type = "application/json";
+
+    return HTTP_OK;
+}
+
+static void *status_create(const char *prefix __attribute__((unused)),
+                           void *instance __attribute__((unused)))
+{
+    /* Nothing to configure, but instances can't be NULL. */
+    static int dummy;
+
+    return &dummy;
+}
+
+static void *status_create_from_hash(const char *prefix,
+                                     const struct hash *hash
+                                     __attribute__((unused)))
+{
+    return status_create(prefix, NULL);
+}
+
+static const struct lwan_module module = {
+    .create = status_create,
+    .create_from_hash = status_create_from_hash,
+    .handle_request = status_handle_request,
+};
+
+LWAN_REGISTER_MODULE(status, &module);
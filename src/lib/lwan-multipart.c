@@ -0,0 +1,547 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+/* Parser for multipart/form-data bodies (RFC 7578).  If the handler streams
+ * its body, data is pulled with lwan_request_read_body() into a window that
+ * is never larger than MULTIPART_WINDOW_SIZE, regardless of the size of the
+ * parts; otherwise, the buffered body is parsed in place.  Part contents
+ * are only copied once: either to the caller's buffer, or to a temporary
+ * file.
+ *
+ * Each part is preceded by a delimiter, "\r\n--" followed by the boundary
+ * given in the Content-Type header; the delimiter before the first part
+ * doesn't have to start with "\r\n".  Only bytes that can't be the start of
+ * a delimiter are handed out as part data, and how far the window has been
+ * searched is remembered, so reading a part in small pieces doesn't scan
+ * the same bytes over and over. */
+
+#define MULTIPART_BOUNDARY_MAX 70
+#define MULTIPART_WINDOW_SIZE (4 * DEFAULT_BUFFER_SIZE)
+#define MULTIPART_HEADERS_SIZE DEFAULT_BUFFER_SIZE
+
+enum multipart_state {
+    MULTIPART_PREAMBLE,
+    MULTIPART_PART,
+    MULTIPART_DONE,
+    MULTIPART_ERROR,
+};
+
+struct lwan_multipart {
+    struct lwan_request *request;
+
+    char *pos, *end;  /* Data not consumed yet */
+    char *delimiter;  /* Next delimiter in [pos, end), if already found */
+    char *scanned;    /* No delimiter starts in [pos, scanned) */
+    bool eof;
+
+    enum multipart_state state;
+    int error;
+
+    size_t delimiter_len;
+    char delimiter_str[sizeof("\r\n--") - 1 + MULTIPART_BOUNDARY_MAX + 1];
+
+    /* Copy of the header block of the current part, which values in
+     * struct lwan_multipart_part point into. */
+    char headers[MULTIPART_HEADERS_SIZE];
+
+    char window[];
+};
+
+static int multipart_fail(struct lwan_multipart *mp, int error)
+{
+    mp->state = MULTIPART_ERROR;
+    mp->error = error;
+    return -error;
+}
+
+static bool parse_boundary(struct lwan_multipart *mp,
+                           const struct lwan_value *content_type)
+{
+    static const char type[] = "multipart/form-data";
+    const char *p = content_type->value;
+    const char *end = p + content_type->len;
+
+    if (content_type->len < sizeof(type) - 1 ||
+        strncasecmp(p, type, sizeof(type) - 1))
+        return false;
+
+    for (p += sizeof(type) - 1; p < end;) {
+        const char *value, *value_end;
+
+        p = memchr(p, ';', (size_t)(end - p));
+        if (!p)
+            return false;
+        for (p++; p < end && (*p == ' ' || *p == '\t'); p++)
+            ;
+
+        if ((size_t)(end - p) < sizeof("boundary=") - 1 ||
+            strncasecmp(p, "boundary=", sizeof("boundary=") - 1))
+            continue;
+
+        value = p + sizeof("boundary=") - 1;
+        if (value < end && *value == '"') {
+            value++;
+            value_end = memchr(value, '"', (size_t)(end - value));
+            if (!value_end)
+                return false;
+        } else {
+            for (value_end = value;
+                 value_end < end && *value_end != ';' && *value_end != ' ' &&
+                 *value_end != '\t';
+                 value_end++)
+                ;
+        }
+
+        size_t len = (size_t)(value_end - value);
+        if (!len || len > MULTIPART_BOUNDARY_MAX)
+            return false;
+
+        memcpy(mp->delimiter_str, "\r\n--", 4);
+        memcpy(mp->delimiter_str + 4, value, len);
+        mp->delimiter_str[4 + len] = '\0';
+        mp->delimiter_len = 4 + len;
+        return true;
+    }
+
+    return false;
+}
+
+struct lwan_multipart *lwan_multipart_open(struct lwan_request *request)
+{
+    const struct lwan_value *content_type =
+        lwan_request_get_content_type(request);
+    bool streaming = request->helper->body_stream != NULL;
+    struct lwan_multipart *mp;
+
+    mp = coro_malloc(request->conn->coro,
+                     sizeof(*mp) + (streaming ? MULTIPART_WINDOW_SIZE : 0));
+    if (UNLIKELY(!mp)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    mp->request = request;
+    mp->state = MULTIPART_PREAMBLE;
+    mp->delimiter = NULL;
+
+    if (!parse_boundary(mp, content_type)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (streaming) {
+        mp->pos = mp->end = mp->window;
+        mp->eof = false;
+    } else {
+        const struct lwan_value *body = lwan_request_get_request_body(request);
+
+        mp->pos = body->value;
+        mp->end = body->value + body->len;
+        mp->eof = true;
+    }
+    mp->scanned = mp->pos;
+
+    return mp;
+}
+
+static void close_fd(void *data)
+{
+    close((int)(intptr_t)data);
+}
+
+static void consume(struct lwan_multipart *mp, size_t n)
+{
+    mp->pos += n;
+    if (mp->delimiter && mp->pos > mp->delimiter)
+        mp->delimiter = NULL;
+    if (mp->scanned < mp->pos)
+        mp->scanned = mp->pos;
+}
+
+/* Returns 0 with more data in the window, or with mp->eof set; -errno
+ * otherwise. */
+static int fill_window(struct lwan_multipart *mp)
+{
+    char *window_end = mp->window + MULTIPART_WINDOW_SIZE;
+    ptrdiff_t shift = mp->pos - mp->window;
+    ssize_t n;
+
+    if (mp->eof)
+        return 0;
+
+    if (shift) {
+        memmove(mp->window, mp->pos, (size_t)(mp->end - mp->pos));
+        mp->pos -= shift;
+        mp->end -= shift;
+        mp->scanned -= shift;
+        if (mp->delimiter)
+            mp->delimiter -= shift;
+    }
+
+    if (UNLIKELY(mp->end == window_end))
+        return -ENOBUFS;
+
+    n = lwan_request_read_body(mp->request, mp->end,
+                               (size_t)(window_end - mp->end));
+    if (UNLIKELY(n < 0))
+        return -errno;
+    if (!n)
+        mp->eof = true;
+
+    mp->end += n;
+    return 0;
+}
+
+static int ensure_window(struct lwan_multipart *mp, size_t n)
+{
+    while ((size_t)(mp->end - mp->pos) < n) {
+        int r;
+
+        if (mp->eof)
+            return -EPROTO;
+        if (UNLIKELY((r = fill_window(mp)) < 0))
+            return r;
+    }
+
+    return 0;
+}
+
+static char *find_delimiter(struct lwan_multipart *mp)
+{
+    if (mp->delimiter)
+        return mp->delimiter;
+
+    mp->delimiter = memmem(mp->scanned, (size_t)(mp->end - mp->scanned),
+                           mp->delimiter_str, mp->delimiter_len);
+    if (!mp->delimiter) {
+        char *tail = mp->end - (mp->delimiter_len - 1);
+
+        if (tail > mp->scanned)
+            mp->scanned = tail;
+    }
+
+    return mp->delimiter;
+}
+
+/* Returns how many bytes of part data are at mp->pos, 0 if a delimiter is
+ * there, or -errno. */
+static ssize_t part_data_available(struct lwan_multipart *mp)
+{
+    while (true) {
+        char *delimiter = find_delimiter(mp);
+        char *limit = delimiter ? delimiter : mp->scanned;
+        int r;
+
+        if (limit > mp->pos)
+            return limit - mp->pos;
+        if (delimiter)
+            return 0;
+
+        if (mp->eof)
+            return multipart_fail(mp, EPROTO);
+        if (UNLIKELY((r = fill_window(mp)) < 0))
+            return multipart_fail(mp, -r);
+    }
+}
+
+ssize_t lwan_multipart_read(struct lwan_multipart *mp, void *buf, size_t len)
+{
+    ssize_t available;
+
+    if (UNLIKELY(mp->state == MULTIPART_ERROR)) {
+        errno = mp->error;
+        return -1;
+    }
+    if (mp->state != MULTIPART_PART || !len)
+        return 0;
+
+    available = part_data_available(mp);
+    if (UNLIKELY(available < 0)) {
+        errno = (int)-available;
+        return -1;
+    }
+
+    len = LWAN_MIN(len, (size_t)available);
+    memcpy(buf, mp->pos, len);
+    consume(mp, len);
+
+    return (ssize_t)len;
+}
+
+int lwan_multipart_save_part(struct lwan_multipart *mp, off_t *size)
+{
+    struct coro *coro = mp->request->conn->coro;
+    size_t generation;
+    off_t written = 0;
+    int fd;
+
+    if (UNLIKELY(mp->state == MULTIPART_ERROR))
+        return -mp->error;
+    if (UNLIKELY(mp->state != MULTIPART_PART))
+        return -EINVAL;
+
+    fd = lwan_create_temp_file();
+    if (UNLIKELY(fd < 0))
+        return fd;
+
+    generation = coro_deferred_get_generation(coro);
+    coro_defer(coro, close_fd, (void *)(intptr_t)fd);
+
+    while (true) {
+        ssize_t available = part_data_available(mp);
+
+        if (UNLIKELY(available < 0)) {
+            coro_deferred_run(coro, generation);
+            return (int)available;
+        }
+        if (!available)
+            break;
+
+        /* Temporary files are regular files, so writing to them could block
+         * the I/O thread; see lwan-async-file.c. */
+        ssize_t n = lwan_request_async_pwrite(mp->request, fd, mp->pos,
+                                              (size_t)available, written);
+        if (UNLIKELY(n <= 0)) {
+            int error = n < 0 ? errno : ENOSPC;
+
+            coro_deferred_run(coro, generation);
+            return -error;
+        }
+
+        consume(mp, (size_t)n);
+        written += n;
+    }
+
+    *size = written;
+    return fd;
+}
+
+static char *skip_spaces(char *p)
+{
+    while (*p == ' ' || *p == '\t')
+        p++;
+    return p;
+}
+
+static void trim_value(char *value, char *end)
+{
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    *end = '\0';
+}
+
+static void set_value(struct lwan_value *out, char *value)
+{
+    out->value = value;
+    out->len = strlen(value);
+}
+
+static void parse_content_disposition(struct lwan_multipart_part *part,
+                                      char *p)
+{
+    /* Parameters after the disposition type, which is always "form-data" */
+    for (p = strchr(p, ';'); p;) {
+        struct lwan_value *out = NULL;
+        char *value, *value_end, *next;
+
+        p = skip_spaces(p + 1);
+
+        if (!strncasecmp(p, "name=", sizeof("name=") - 1)) {
+            out = &part->name;
+            value = p + sizeof("name=") - 1;
+        } else if (!strncasecmp(p, "filename=", sizeof("filename=") - 1)) {
+            out = &part->filename;
+            value = p + sizeof("filename=") - 1;
+        } else {
+            value = p;
+        }
+
+        if (*value == '"') {
+            /* Browsers percent-encode quotes in names instead of escaping
+             * them with backslashes, so the first quote ends the value. */
+            value++;
+            value_end = strchr(value, '"');
+            if (!value_end)
+                return;
+            next = strchr(value_end + 1, ';');
+        } else {
+            value_end = strchrnul(value, ';');
+            next = *value_end ? value_end : NULL;
+        }
+
+        if (out) {
+            *value_end = '\0';
+            out->value = value;
+            out->len = (size_t)(value_end - value);
+        }
+
+        p = next;
+    }
+}
+
+static void parse_part_headers(struct lwan_multipart_part *part, char *p)
+{
+    *part = (struct lwan_multipart_part){
+        .content_type = {.value = "text/plain", .len = sizeof("text/plain") - 1},
+    };
+
+    while (*p) {
+        char *line_end = strstr(p, "\r\n");
+        char *next = line_end ? line_end + 2 : p + strlen(p);
+        char *colon;
+
+        if (line_end)
+            *line_end = '\0';
+
+        colon = strchr(p, ':');
+        if (colon) {
+            char *value = skip_spaces(colon + 1);
+            size_t name_len = (size_t)(colon - p);
+
+            trim_value(value, value + strlen(value));
+
+            if (name_len == sizeof("Content-Disposition") - 1 &&
+                !strncasecmp(p, "Content-Disposition", name_len)) {
+                parse_content_disposition(part, value);
+            } else if (name_len == sizeof("Content-Type") - 1 &&
+                       !strncasecmp(p, "Content-Type", name_len)) {
+                set_value(&part->content_type, value);
+            }
+        }
+
+        p = next;
+    }
+}
+
+static int skip_part(struct lwan_multipart *mp)
+{
+    while (true) {
+        ssize_t available = part_data_available(mp);
+
+        if (UNLIKELY(available < 0))
+            return (int)available;
+        if (!available)
+            return 0;
+
+        consume(mp, (size_t)available);
+    }
+}
+
+static int start_next_part(struct lwan_multipart *mp)
+{
+    char *headers_end;
+    size_t headers_len;
+    int r;
+
+    /* Skip transport padding after the boundary, then its line break, or
+     * the "--" that marks the end of the body. */
+    while (true) {
+        if ((r = ensure_window(mp, 2)) < 0)
+            return r;
+
+        if (mp->pos[0] == '-' && mp->pos[1] == '-') {
+            mp->state = MULTIPART_DONE;
+            /* Whatever comes after the last part (usually "\r\n") is
+             * ignored, but still read so the connection can be reused. */
+            while (!mp->eof) {
+                consume(mp, (size_t)(mp->end - mp->pos));
+                if ((r = fill_window(mp)) < 0)
+                    return r;
+            }
+            return 0;
+        }
+        if (mp->pos[0] == '\r' && mp->pos[1] == '\n')
+            break;
+        if (mp->pos[0] != ' ' && mp->pos[0] != '\t')
+            return -EPROTO;
+
+        consume(mp, 1);
+    }
+
+    /* The header block ends with an empty line, which comes right after
+     * the boundary if the part has no headers. */
+    while (!(headers_end = memmem(mp->pos, (size_t)(mp->end - mp->pos),
+                                  "\r\n\r\n", 4))) {
+        if ((size_t)(mp->end - mp->pos) > MULTIPART_HEADERS_SIZE)
+            return -ENOBUFS;
+        if (mp->eof)
+            return -EPROTO;
+        if ((r = fill_window(mp)) < 0)
+            return r;
+    }
+
+    headers_len = (size_t)(headers_end - mp->pos);
+    if (headers_len >= MULTIPART_HEADERS_SIZE)
+        return -ENOBUFS;
+    memcpy(mp->headers, mp->pos + 2, headers_len);
+    mp->headers[headers_len] = '\0';
+
+    consume(mp, headers_len + 4);
+    mp->state = MULTIPART_PART;
+
+    return 1;
+}
+
+int lwan_multipart_next_part(struct lwan_multipart *mp,
+                             struct lwan_multipart_part *part)
+{
+    int r;
+
+    switch (mp->state) {
+    case MULTIPART_ERROR:
+        return -mp->error;
+    case MULTIPART_DONE:
+        return 0;
+
+    case MULTIPART_PREAMBLE: {
+        /* The first delimiter might not be preceded by a line break. */
+        size_t len = mp->delimiter_len - 2;
+
+        if ((r = ensure_window(mp, len)) < 0)
+            return multipart_fail(mp, -r);
+        if (!memcmp(mp->pos, mp->delimiter_str + 2, len)) {
+            consume(mp, len);
+            break;
+        }
+    }
+        /* Fallthrough */
+    case MULTIPART_PART:
+        if ((r = skip_part(mp)) < 0)
+            return r;
+        consume(mp, mp->delimiter_len);
+        break;
+    }
+
+    r = start_next_part(mp);
+    if (UNLIKELY(r < 0))
+        return multipart_fail(mp, -r);
+    if (r > 0)
+        parse_part_headers(part, mp->headers);
+
+    return r;
+}
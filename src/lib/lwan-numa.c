@@ -0,0 +1,259 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#if defined(__linux__)
+#include <linux/mempolicy.h>
+
+#define MAX_NODES 1024
+#define BITS_PER_LONG (sizeof(unsigned long) * CHAR_BIT)
+
+/* Reads a list in the format used by sysfs (e.g. "0-3,8,10-11") and sets
+ * the corresponding bits in bitmap.  Returns the number of bits set. */
+static int read_list(const char *path, unsigned long *bitmap, size_t n_bits)
+{
+    char buffer[4096];
+    char *saveptr;
+    FILE *f;
+    int n = 0;
+
+    f = fopen(path, "re");
+    if (!f)
+        return -1;
+
+    if (!fgets(buffer, sizeof(buffer), f)) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    for (char *range = strtok_r(buffer, ",\n", &saveptr); range;
+         range = strtok_r(NULL, ",\n", &saveptr)) {
+        unsigned long first, last;
+        char *end;
+
+        first = last = strtoul(range, &end, 10);
+        if (*end == '-')
+            last = strtoul(end + 1, &end, 10);
+        if (*end != '\0' || last < first)
+            return -1;
+
+        for (unsigned long i = first; i <= last && i < n_bits; i++) {
+            bitmap[i / BITS_PER_LONG] |= 1ul << (i % BITS_PER_LONG);
+            n++;
+        }
+    }
+
+    return n;
+}
+
+static bool read_online_nodes(unsigned long nodes[MAX_NODES / BITS_PER_LONG])
+{
+    memset(nodes, 0, MAX_NODES / CHAR_BIT);
+
+    return read_list("/sys/devices/system/node/online", nodes, MAX_NODES) > 0;
+}
+
+unsigned int lwan_numa_cpu_nodes(unsigned int n_cpus, uint32_t cpu_node[])
+{
+    const size_t cpu_bitmap_len =
+        (n_cpus + BITS_PER_LONG - 1) / BITS_PER_LONG * sizeof(unsigned long);
+    unsigned long nodes[MAX_NODES / BITS_PER_LONG];
+    unsigned long *cpus;
+    unsigned int n_nodes = 0;
+
+    if (!read_online_nodes(nodes))
+        return 0;
+
+    cpus = malloc(cpu_bitmap_len);
+    if (!cpus)
+        return 0;
+
+    for (unsigned int i = 0; i < n_cpus; i++)
+        cpu_node[i] = 0;
+
+    for (unsigned int node = 0; node < MAX_NODES; node++) {
+        char path[PATH_MAX];
+
+        if (!(nodes[node / BITS_PER_LONG] & (1ul << (node % BITS_PER_LONG))))
+            continue;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist",
+                 node);
+
+        memset(cpus, 0, cpu_bitmap_len);
+        if (read_list(path, cpus, n_cpus) < 0) {
+            /* Memory-only nodes have an empty CPU list. */
+            continue;
+        }
+
+        for (unsigned int cpu = 0; cpu < n_cpus; cpu++) {
+            if (cpus[cpu / BITS_PER_LONG] & (1ul << (cpu % BITS_PER_LONG)))
+                cpu_node[cpu] = node;
+        }
+
+        n_nodes++;
+    }
+
+    free(cpus);
+
+    return n_nodes;
+}
+
+static bool read_llc_cpus(unsigned int cpu,
+                          unsigned long *cpus,
+                          unsigned int n_cpus)
+{
+    char path[PATH_MAX];
+    int llc_level = -1, llc_index = -1;
+
+    for (int index = 0;; index++) {
+        FILE *f;
+        int level;
+
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%u/cache/index%d/level", cpu,
+                 index);
+        f = fopen(path, "re");
+        if (!f)
+            break;
+        if (fscanf(f, "%d", &level) == 1 && level > llc_level) {
+            llc_level = level;
+            llc_index = index;
+        }
+        fclose(f);
+    }
+
+    if (llc_index >= 0) {
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%u/cache/index%d/shared_cpu_list",
+                 cpu, llc_index);
+        if (read_list(path, cpus, n_cpus) > 0)
+            return true;
+    }
+
+    /* Some arm64 systems don't describe their caches, but list the cores
+     * in the same cluster (which share their last level cache). */
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%u/topology/cluster_cpus_list", cpu);
+    return read_list(path, cpus, n_cpus) > 0;
+}
+
+/* Sets cpu_domain[cpu] to the lowest numbered CPU in the same physical core
+ * (or sharing the same last level cache) as cpu, returning the number of
+ * distinct domains, or 0 if the topology couldn't be read.  Works with
+ * anything that populates sysfs, regardless of the architecture. */
+unsigned int lwan_cpu_domains(enum lwan_cpu_domain domain,
+                              unsigned int n_cpus,
+                              uint32_t cpu_domain[])
+{
+    const size_t cpu_bitmap_len =
+        (n_cpus + BITS_PER_LONG - 1) / BITS_PER_LONG * sizeof(unsigned long);
+    unsigned long *cpus;
+    unsigned int n_domains = 0;
+
+    cpus = malloc(cpu_bitmap_len);
+    if (!cpus)
+        return 0;
+
+    for (unsigned int cpu = 0; cpu < n_cpus; cpu++) {
+        unsigned int first;
+        bool found;
+
+        memset(cpus, 0, cpu_bitmap_len);
+
+        if (domain == LWAN_CPU_DOMAIN_CORE) {
+            char path[PATH_MAX];
+
+            snprintf(path, sizeof(path),
+                     "/sys/devices/system/cpu/cpu%u/topology/"
+                     "thread_siblings_list",
+                     cpu);
+            found = read_list(path, cpus, n_cpus) > 0;
+        } else {
+            found = read_llc_cpus(cpu, cpus, n_cpus);
+        }
+
+        /* CPUs beyond n_cpus are ignored by read_list(); this happens in
+         * some containers, which filter what sysconf() returns but not
+         * what's in sysfs.  The CPU itself has to be in its own list. */
+        if (!found || !(cpus[cpu / BITS_PER_LONG] & (1ul << (cpu % BITS_PER_LONG)))) {
+            n_domains = 0;
+            break;
+        }
+
+        for (first = 0; first < cpu; first++) {
+            if (cpus[first / BITS_PER_LONG] & (1ul << (first % BITS_PER_LONG)))
+                break;
+        }
+
+        cpu_domain[cpu] = first;
+        if (first == cpu)
+            n_domains++;
+    }
+
+    free(cpus);
+
+    return n_domains;
+}
+
+void lwan_numa_interleave(void *ptr, size_t len)
+{
+    unsigned long nodes[MAX_NODES / BITS_PER_LONG];
+
+    if (!read_online_nodes(nodes))
+        return;
+
+    /* Pages that haven't been touched yet will be spread across all nodes,
+     * rather than being all placed in the node of the thread that happens
+     * to touch them first. */
+    if (syscall(__NR_mbind, ptr, len, MPOL_INTERLEAVE, nodes,
+                (unsigned long)MAX_NODES, 0) < 0)
+        lwan_status_perror("Could not interleave memory across NUMA nodes");
+}
+#else
+unsigned int lwan_numa_cpu_nodes(unsigned int n_cpus __attribute__((unused)),
+                                 uint32_t cpu_node[] __attribute__((unused)))
+{
+    return 0;
+}
+
+unsigned int lwan_cpu_domains(enum lwan_cpu_domain domain
+                              __attribute__((unused)),
+                              unsigned int n_cpus __attribute__((unused)),
+                              uint32_t cpu_domain[] __attribute__((unused)))
+{
+    return 0;
+}
+
+void lwan_numa_interleave(void *ptr __attribute__((unused)),
+                          size_t len __attribute__((unused)))
+{
+}
+#endif
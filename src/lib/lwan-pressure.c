@@ -0,0 +1,164 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* Idle keep-alive connections hold a file descriptor (and, unless they're
+ * parked, a coroutine) each, and are the cheapest thing to give up when
+ * the process runs low on either.  I/O threads ask, once per second,
+ * whether there's pressure; if so, they close the idle connections that
+ * have been waiting the longest (see timeout_queue_expire_oldest_idle()).
+ *
+ * File descriptor pressure is noticed when accepting connections: either
+ * the descriptor number crosses a watermark (the kernel hands out the
+ * lowest free number, so it's a good estimate of how many are open), or
+ * accept() fails with EMFILE.  In the latter case, a descriptor kept in
+ * reserve is given up to accept the connection and answer it with a 503,
+ * rather than leaving it in the backlog for accept() to fail again, and
+ * again.  Memory pressure is sampled from the resident set size. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+void lwan_pressure_init(struct lwan *l, size_t max_open_files)
+{
+    const struct lwan_config *config = &l->config;
+
+    l->pressure.fd_watermark = UINT_MAX;
+    l->pressure.statm_fd = -1;
+    l->pressure.reserve_fd = lwan_pressure_open_reserve_fd();
+
+    if (config->evict_idle_fd_watermark) {
+        l->pressure.fd_watermark = (unsigned int)(
+            max_open_files * config->evict_idle_fd_watermark / 100);
+    }
+
+    if (config->evict_idle_memory_watermark) {
+        l->pressure.statm_fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+        if (l->pressure.statm_fd < 0) {
+            lwan_status_perror("Could not open /proc/self/statm, memory "
+                               "usage won't be watched");
+        }
+
+        l->pressure.memory_watermark =
+            (size_t)config->evict_idle_memory_watermark * 1024 * 1024 /
+            (size_t)sysconf(_SC_PAGESIZE);
+    }
+}
+
+void lwan_pressure_shutdown(struct lwan *l)
+{
+    if (l->pressure.statm_fd >= 0)
+        close(l->pressure.statm_fd);
+    if (l->pressure.reserve_fd >= 0)
+        close(l->pressure.reserve_fd);
+}
+
+int lwan_pressure_open_reserve_fd(void)
+{
+    return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+void lwan_pressure_signal_fds(struct lwan *l)
+{
+    const time_t now = lwan_clock_monotonic();
+    const time_t until = ATOMIC_READ(l->pressure.fds_until);
+
+    if (until > now)
+        return;
+    if (until < now) {
+        lwan_status_warning("Running low on file descriptors, closing idle "
+                            "connections");
+    }
+
+    /* Lasts until the next time I/O threads look at it. */
+    __atomic_store_n(&l->pressure.fds_until, now + 1, __ATOMIC_RELAXED);
+}
+
+bool lwan_pressure_shed(struct lwan_thread *t, int listen_fd, int *reserve_fd)
+{
+    int fd;
+
+    /* Running out is the ultimate watermark, but idle connections are only
+     * given up if that has been asked for. */
+    if (t->lwan->pressure.fd_watermark != UINT_MAX)
+        lwan_pressure_signal_fds(t->lwan);
+
+    if (*reserve_fd < 0) {
+        /* Given up before, and couldn't be taken back then. */
+        *reserve_fd = lwan_pressure_open_reserve_fd();
+        return false;
+    }
+
+    close(*reserve_fd);
+    fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd >= 0)
+        lwan_thread_reject_client(t, fd);
+    *reserve_fd = lwan_pressure_open_reserve_fd();
+
+    return fd >= 0;
+}
+
+static bool memory_is_high(struct lwan *l)
+{
+    const time_t now = lwan_clock_monotonic();
+    time_t sampled_at = ATOMIC_READ(l->pressure.memory_sampled_at);
+    unsigned long size, resident;
+    char buffer[128];
+    ssize_t r;
+
+    /* Sampled by whichever thread gets here first every second. */
+    if (sampled_at == now ||
+        !__atomic_compare_exchange_n(&l->pressure.memory_sampled_at,
+                                     &sampled_at, now, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return ATOMIC_READ(l->pressure.memory_high);
+
+    r = pread(l->pressure.statm_fd, buffer, sizeof(buffer) - 1, 0);
+    if (r <= 0)
+        return false;
+    buffer[r] = '\0';
+
+    if (sscanf(buffer, "%lu %lu", &size, &resident) != 2)
+        return false;
+
+    const bool high = resident >= l->pressure.memory_watermark;
+    if (high && !ATOMIC_READ(l->pressure.memory_high)) {
+        lwan_status_warning("Resident set size over the watermark, closing "
+                            "idle connections");
+    }
+    __atomic_store_n(&l->pressure.memory_high, high, __ATOMIC_RELAXED);
+
+    return high;
+}
+
+bool lwan_pressure_is_high(struct lwan *l)
+{
+    if (ATOMIC_READ(l->pressure.fds_until) >= lwan_clock_monotonic())
+        return true;
+
+    return l->pressure.statm_fd >= 0 && memory_is_high(l);
+}
@@ -24,13 +24,36 @@
 
 #include "lwan.h"
 
+#define N_HEADER_START 64
+#define HEADER_INDEX_SIZE (N_HEADER_START * 2)
+
+struct lwan_request_body_stream;
+
+/* See lwan-watchdog.c */
+#define LWAN_TIMEOUT_SLOW_REQUEST 0x100 /* Not used by timeout.c */
+struct lwan_request_watch {
+    struct timeout timeout;
+    struct lwan_request *request;
+    const char *handler;
+    uint64_t started_at, last_yield_at; /* Milliseconds */
+    int64_t last_yield;
+};
+
 struct lwan_request_parser_helper {
     struct lwan_value *buffer;		/* The whole request buffer */
+    size_t buffer_size;			/* Including room for the NUL byte */
     char *next_request;			/* For pipelined requests */
+    struct lwan_strbuf *queued_responses; /* See lwan_response() */
 
     char **header_start;		/* Headers: n: start, n+1: end */
     size_t n_header_start;		/* len(header_start) */
 
+    /* Position in header_start + 1; 0 if the header isn't present. */
+    uint8_t well_known_headers[LWAN_HEADER_MAX];
+    /* Built the first time another header is looked up; see
+     * lwan_request_get_header(). */
+    uint8_t header_index[HEADER_INDEX_SIZE];
+
     struct lwan_value accept_encoding;	/* Accept-Encoding: */
 
     struct lwan_value query_string;	/* Stuff after ? and before # */
@@ -38,6 +61,22 @@ struct lwan_request_parser_helper {
     struct lwan_value body_data; /* Request body for POST and PUT */
     struct lwan_value content_type;	/* Content-Type: for POST and PUT */
     struct lwan_value content_length;	/* Content-Length: */
+    struct lwan_value transfer_encoding; /* Transfer-Encoding: */
+
+    /* Only for HANDLER_STREAMS_BODY_DATA; see lwan_request_read_body() */
+    struct lwan_request_body_stream *body_stream;
+
+    /* Only for HANDLER_COMPRESS_RESPONSE; see lwan-compress.c */
+    struct lwan_compressor *compressor;
+    const struct lwan_compress_dict *compress_dict;
+
+    /* See lwan_response_append_ref() */
+    struct lwan_response_segments *segments;
+
+    /* Only if permessage-deflate was negotiated; see lwan-websocket.c */
+    struct lwan_websocket_deflate *websocket_deflate;
+    /* See lwan_response_websocket_read_partial() */
+    struct lwan_websocket_stream *websocket_stream;
 
     struct lwan_value connection;	/* Connection: */
 
@@ -48,6 +87,8 @@ struct lwan_request_parser_helper {
         time_t parsed;
     } if_modified_since;
 
+    struct lwan_value if_none_match;	/* If-None-Match: */
+
     struct { /* Range: */
         struct lwan_value raw;
         off_t from, to;
@@ -56,12 +97,29 @@ struct lwan_request_parser_helper {
     time_t error_when_time;		/* Time to abort request read */
     int error_when_n_packets;		/* Max. number of packets */
     int urls_rewritten;			/* Times URLs have been rewritten */
+
+    uint64_t bytes_sent;		/* See lwan_route_stats_record() */
+
+    /* Only if min_send_rate is set; see wait_writable() */
+    struct {
+        time_t since;      /* When writing the response started blocking */
+        time_t last;       /* When it last blocked */
+        uint64_t progress; /* Bytes written (or acknowledged) at since */
+    } send_budget;
+
+    /* Only if slow_request_threshold is set */
+    struct lwan_request_watch watch;
 };
 
 #define DEFAULT_BUFFER_SIZE 4096
+
+/* Requests are read into a buffer of this size in the coroutine stack;
+ * larger ones spill to a buffer of max_request_header_size bytes. */
+#define REQUEST_BUFFER_SIZE 2048
 #define DEFAULT_HEADERS_SIZE 512
 
-#define N_HEADER_START 64
+/* Longest host name (without port) a virtual host can be looked up by */
+#define LWAN_VIRTUAL_HOST_NAME_MAX 256
 
 #define LWAN_CONCAT(a_, b_) a_ ## b_
 #define LWAN_TMP_ID_DETAIL(n_) LWAN_CONCAT(lwan_tmp_id, n_)
@@ -86,32 +144,371 @@ void lwan_response_init(struct lwan *l);
 void lwan_response_shutdown(struct lwan *l);
 
 void lwan_socket_init(struct lwan *l);
+int lwan_create_thread_listen_socket(const struct lwan *l,
+                                     bool print_listening_msg);
+bool lwan_socket_is_unix_address(const char *address);
 void lwan_socket_shutdown(struct lwan *l);
 
+/* Set by a process handing its listening socket over to a new process
+ * during an upgrade; see lwan_main_loop(). */
+#define LWAN_HANDOVER_FD_ENV "LWAN_HANDOVER_FD"
+int lwan_socket_send_listeners(int handover_fd,
+                               const int listen_fds[],
+                               unsigned int n_fds);
+
 void lwan_thread_init(struct lwan *l);
 void lwan_thread_shutdown(struct lwan *l);
+
+void lwan_pressure_init(struct lwan *l, size_t max_open_files);
+void lwan_pressure_shutdown(struct lwan *l);
+int lwan_pressure_open_reserve_fd(void);
+void lwan_pressure_signal_fds(struct lwan *l);
+bool lwan_pressure_shed(struct lwan_thread *t, int listen_fd, int *reserve_fd);
+bool lwan_pressure_is_high(struct lwan *l);
+
+static ALWAYS_INLINE void lwan_pressure_note_fd(struct lwan *l, int fd)
+{
+    if (UNLIKELY((unsigned int)fd >= l->pressure.fd_watermark))
+        lwan_pressure_signal_fds(l);
+}
+
+void lwan_watchdog_init(struct lwan *l);
+void lwan_watchdog_shutdown(struct lwan *l);
+void lwan_watchdog_request_start(struct lwan_request *request,
+                                 const struct lwan_url_map *url_map);
+void lwan_watchdog_request_timeout(struct timeout *timeout);
+int64_t lwan_watchdog_resume(struct lwan_connection *conn);
+
+/* See lwan-profiler.c */
+void lwan_profiler_enable(void);
+void lwan_profiler_init(struct lwan *l);
+void lwan_profiler_shutdown(struct lwan *l);
+void lwan_profiler_thread_init(struct lwan_thread *t);
+void lwan_profiler_thread_shutdown(struct lwan_thread *t);
+int64_t lwan_profiler_resume(struct lwan_connection *conn);
+void lwan_profiler_request_start(struct lwan_request *request,
+                                 const struct lwan_url_map *url_map);
+bool lwan_profiler_start(struct lwan *l,
+                         unsigned int frequency,
+                         unsigned int max_samples);
+bool lwan_profiler_finish(struct lwan *l, struct lwan_strbuf *output);
+void lwan_profiler_cancel(struct lwan *l);
+
 void lwan_thread_add_client(struct lwan_thread *t, int fd);
+void lwan_thread_reject_client(struct lwan_thread *t, int fd);
+struct lwan_thread *lwan_thread_for_fd(const struct lwan *l, int fd);
+bool lwan_thread_is_overloaded(const struct lwan_thread *t);
+/* NULL if the calling thread isn't an I/O thread. */
+extern __thread struct lwan_thread_metrics *lwan_current_thread_metrics;
 void lwan_thread_nudge(struct lwan_thread *t);
 
+/* See lwan-memory.c */
+extern __thread int64_t *lwan_memory_counters;
+extern int64_t lwan_memory_unattributed[LWAN_MEMORY_N_SUBSYSTEMS];
+static ALWAYS_INLINE void
+lwan_memory_account(enum lwan_memory_subsystem subsystem, int64_t delta)
+{
+    if (LIKELY(lwan_memory_counters))
+        lwan_memory_counters[subsystem] += delta;
+    else
+        __atomic_fetch_add(&lwan_memory_unattributed[subsystem], delta,
+                           __ATOMIC_RELAXED);
+}
+void lwan_memory_thread_init(int64_t *counters);
+int64_t lwan_memory_get(const struct lwan *l,
+                        enum lwan_memory_subsystem subsystem);
+const char *lwan_memory_subsystem_name(enum lwan_memory_subsystem subsystem);
+
+/* See lwan-timer.c */
+#define LWAN_TIMEOUT_TIMER 0x200 /* Not used by timeout.c */
+void lwan_timer_expired(struct timeout *timeout);
+void lwan_timer_thread_init(struct lwan_thread *t);
+void lwan_timer_thread_update(void);
+void lwan_timer_thread_shutdown(void);
+void lwan_timer_shutdown(void);
+
+/* Resumes a suspended request from any thread.  Wakeups are queued on the
+ * thread owning the request, which is nudged once for all the requests
+ * queued until it gets to resume them.  Wakeups have to be cancelled by the
+ * request's coroutine once it's resumed. */
+struct lwan_thread_wakeup {
+    struct list_node node;
+    struct lwan_request *request;
+    bool queued;
+};
+void lwan_thread_wake(struct lwan_thread_wakeup *wakeup);
+void lwan_thread_cancel_wake(struct lwan_thread_wakeup *wakeup);
+#if defined(HAVE_IO_URING)
+void lwan_thread_uring_cancel_poll(struct lwan_connection *conn);
+
+/* Poll request in flight for a file descriptor; see lwan-thread.c */
+struct lwan_uring_poll {
+    uint32_t generation;
+    uint32_t owner_fd;
+};
+
+/* Tags the user data of file reads and writes submitted to the io_uring of
+ * a thread; see lwan-async-file.c.  Returns the request to resume, if any. */
+#define LWAN_URING_FILE_IO (1ull << 63)
+struct lwan_request *lwan_async_file_uring_done(void *op, int32_t result);
+#endif
+
 void lwan_status_init(struct lwan *l);
 void lwan_status_shutdown(struct lwan *l);
 
+struct lwan_job_stats {
+    const char *name;
+    uint64_t runs;
+    uint64_t runtime_us;
+    uint64_t last_runtime_us;
+    uint64_t max_runtime_us;
+    uint64_t max_delay_us; /* How late it ran, at worst */
+    uint64_t wakeups;
+    unsigned int interval_ms;
+};
+
 void lwan_job_thread_init(void);
 void lwan_job_thread_shutdown(void);
-void lwan_job_add(bool (*cb)(void *data), void *data);
+
+void lwan_job_add(bool (*cb)(void *data), void *data, const char *name);
 void lwan_job_del(bool (*cb)(void *data), void *data);
+void lwan_job_set_name(bool (*cb)(void *data), void *data, const char *name);
+void lwan_job_set_interval(bool (*cb)(void *data),
+                           void *data,
+                           unsigned int min_ms,
+                           unsigned int max_ms);
+void lwan_job_wakeup(bool (*cb)(void *data), void *data);
+bool lwan_job_stats_for_each(bool (*cb)(const struct lwan_job_stats *stats,
+                                        void *data),
+                             void *data);
 
 void lwan_tables_init(void);
 void lwan_tables_shutdown(void);
 
-void lwan_readahead_init(void);
+void lwan_clock_init(const struct lwan *l);
+void lwan_clock_shutdown(void);
+void lwan_clock_get_dates(char date[static 29], char expires[static 29]);
+time_t lwan_clock_realtime(void);
+time_t lwan_clock_monotonic(void);
+
+void lwan_cache_async_init(unsigned int n_threads);
+void lwan_cache_async_shutdown(void);
+
+/* Used by the cache_peers module; see cache_set_peer_fill() */
+struct cache;
+struct cache_entry;
+struct cache *lwan_cache_find_by_name(const char *name);
+bool lwan_cache_serialize_entry(struct cache *cache,
+                                const struct cache_entry *entry,
+                                struct lwan_strbuf *buf);
+bool lwan_cache_peers_fetch(const char *cache_name,
+                            const char *key,
+                            struct lwan_value *serialized);
+
+void lwan_blocking_init(unsigned int n_threads);
+void lwan_blocking_shutdown(void);
+
+/* Unlinked file in the temporary directory, or -errno; see lwan-request.c */
+int lwan_create_temp_file(void);
+
+/* Per-thread allocator for small, long-lived objects; see lwan-slab.c */
+#define LWAN_SLAB_MAX_SIZE 4096
+struct lwan_slab_stats {
+    size_t object_size;
+    size_t objects_per_slab;
+    uint64_t slabs;
+    uint64_t objects;
+};
+void *lwan_slab_alloc(size_t size) __attribute__((malloc));
+void *lwan_slab_calloc(size_t size) __attribute__((malloc));
+void lwan_slab_free(void *ptr);
+size_t lwan_slab_get_stats(struct lwan_slab_stats *stats, size_t n_stats);
+void lwan_cache_thread_shutdown(void);
+
+void lwan_compress_thread_shutdown(void);
+void lwan_compress_response_buffer(struct lwan_request *request);
+void lwan_compress_response_stream(struct lwan_request *request);
+bool lwan_compress_iov(struct lwan_request *request,
+                       const struct iovec *iov,
+                       int iovcnt,
+                       bool finish,
+                       struct lwan_value *out);
+const char *lwan_compress_get_encoding(const struct lwan_request *request);
+const char *lwan_compress_get_dict_link(const struct lwan_request *request);
+
+/* Copies references added with lwan_response_append_ref() to the response
+ * buffer; see lwan-response-cache.c */
+bool lwan_response_flatten(struct lwan_request *request);
+
+#define LWAN_COMPRESS_N_ENCODINGS 4
+bool lwan_compress_buffer(unsigned int encoding,
+                          const char *mime_type,
+                          const void *in,
+                          size_t in_len,
+                          struct lwan_value *out);
+const char *lwan_compress_encoding_name(unsigned int encoding);
+int lwan_compress_pick_encoding(struct lwan_request *request,
+                                unsigned int available);
+
+/* Compression dictionaries; see lwan-compress.c */
+struct lwan_compress_dict *lwan_compress_dict_get(const char *path);
+void lwan_compress_dict_put(struct lwan_compress_dict *dict);
+bool lwan_compress_dict_serve_at(struct lwan_compress_dict *dict,
+                                 const char *url,
+                                 const char *match_prefix);
+enum lwan_http_status
+lwan_compress_dict_serve(struct lwan_request *request,
+                         struct lwan_response *response,
+                         void *data);
+bool lwan_compress_dict_accepted(struct lwan_request *request,
+                                 const struct lwan_compress_dict *dict);
+bool lwan_compress_dict_buffer(const struct lwan_compress_dict *dict,
+                               const void *in,
+                               size_t in_len,
+                               struct lwan_value *out);
+
+struct lwan_readahead_stats {
+    uint64_t queued, coalesced, dropped;
+    unsigned int depth, max_depth;
+};
+
+void lwan_readahead_init(unsigned int n_threads);
 void lwan_readahead_shutdown(void);
 void lwan_readahead_queue(int fd, off_t off, size_t size);
 void lwan_madvise_queue(void *addr, size_t size);
+void lwan_readahead_get_stats(struct lwan_readahead_stats *stats);
+
+#if defined(__linux__) && defined(CPU_SETSIZE)
+/* Keep low priority threads away from the CPUs I/O threads are pinned to */
+void lwan_readahead_set_affinity(const cpu_set_t *set);
+void lwan_job_thread_set_affinity(const cpu_set_t *set);
+#endif
+
+/* Log-bucketed histograms, per URL map and I/O thread; see
+ * lwan-route-stats.c */
+#define LWAN_HISTOGRAM_BUCKETS 64
+struct lwan_histogram {
+    uint64_t buckets[LWAN_HISTOGRAM_BUCKETS];
+    uint64_t sum;
+};
+
+enum {
+    LWAN_ROUTE_PARSE,     /* Microseconds */
+    LWAN_ROUTE_HANDLER,   /* Microseconds */
+    LWAN_ROUTE_WRITE,     /* Microseconds */
+    LWAN_ROUTE_BYTES_OUT,
+    LWAN_ROUTE_N,
+};
+
+uint64_t lwan_histogram_bucket_upper_bound(unsigned int bucket);
+void lwan_route_stats_record(struct lwan_request *request,
+                             struct lwan_url_map *url_map,
+                             const uint64_t values[static LWAN_ROUTE_N]);
+void lwan_route_stats_free(struct lwan_route_stats *stats);
+bool lwan_route_stats_for_each(
+    bool (*cb)(const char *prefix,
+               const struct lwan_histogram merged[static LWAN_ROUTE_N],
+               void *data),
+    void *data);
+
+unsigned int lwan_numa_cpu_nodes(unsigned int n_cpus, uint32_t cpu_node[]);
+void lwan_numa_interleave(void *ptr, size_t len);
+
+enum lwan_cpu_domain {
+    LWAN_CPU_DOMAIN_CORE,
+    LWAN_CPU_DOMAIN_LLC,
+};
+unsigned int lwan_cpu_domains(enum lwan_cpu_domain domain,
+                              unsigned int n_cpus,
+                              uint32_t cpu_domain[]);
+
+size_t lwan_huge_pages_size(size_t size);
+void *lwan_huge_pages_alloc(size_t size);
+void lwan_huge_pages_free(void *ptr, size_t size);
 
 char *lwan_strbuf_extend_unsafe(struct lwan_strbuf *s, size_t by);
+/* Events and websocket frames that are already framed, so they can be sent
+ * as-is to many clients; see lwan_pubsub_msg_send_event(). */
+void lwan_response_send_framed_event(struct lwan_request *request,
+                                     const struct lwan_value *event);
+void lwan_response_websocket_write_frame(struct lwan_request *request,
+                                         const struct lwan_value *frame);
+size_t lwan_websocket_frame_header(unsigned char frame[static 10],
+                                   unsigned char header_byte,
+                                   size_t len);
+
+/* permessage-deflate (RFC7692); see lwan-websocket.c */
+bool lwan_websocket_deflate_negotiate(struct lwan_request *request,
+                                      char response[static 128]);
+bool lwan_websocket_deflate_shareable(const struct lwan_request *request);
+bool lwan_websocket_deflate_message(struct lwan_request *request,
+                                    const struct lwan_value *msg,
+                                    struct lwan_value *deflated);
+void lwan_websocket_thread_shutdown(void);
+
+/* Used by I/O threads to keep idle websocket connections alive without
+ * resuming their coroutines; see lwan-websocket.c */
+enum lwan_websocket_control {
+    LWAN_WEBSOCKET_CONTROL_HANDLED,
+    LWAN_WEBSOCKET_CONTROL_NOT_HANDLED,
+    LWAN_WEBSOCKET_CONTROL_FAILED,
+};
+bool lwan_websocket_send_ping(int fd);
+enum lwan_websocket_control lwan_websocket_handle_control_frames(int fd);
+
+/* Exposed for websocket_bench; see lwan-websocket.c */
+struct lwan_websocket_unmask_kernel {
+    const char *name;
+    void (*unmask)(char *msg, size_t msg_len, const char mask[static 4]);
+};
+size_t lwan_websocket_get_unmask_kernels(
+    struct lwan_websocket_unmask_kernel kernels[static 4]);
+
+/* Both return how many bytes from the start of str don't need to be
+ * escaped (len if none does); see lwan-escape.c. */
+size_t lwan_html_escape_span(const char *str, size_t len);
+size_t lwan_json_escape_span(const char *str, size_t len);
+
+/* Returns how many bytes from the start of str are JSON whitespace. */
+size_t lwan_json_whitespace_span(const char *str, size_t len);
+
+/* Exposed for template_bench; see lwan-escape.c */
+struct lwan_escape_kernel {
+    const char *name;
+    size_t (*html_span)(const char *str, size_t len);
+    size_t (*json_span)(const char *str, size_t len);
+    size_t (*ws_span)(const char *str, size_t len);
+};
+size_t lwan_get_escape_kernels(struct lwan_escape_kernel kernels[static 3]);
+
+#define LWAN_UTF8_ACCEPT 0u
+#define LWAN_UTF8_REJECT UINT32_MAX
+uint32_t
+lwan_websocket_validate_utf8(uint32_t state, const char *str, size_t len);
+
+void lwan_strbuf_thread_init(void);
+void lwan_strbuf_thread_shutdown(void);
+
+void lwan_pubsub_thread_init(void);
+void lwan_pubsub_thread_shutdown(void);
+
+/* See lwan-pubsub-bridge.c */
+struct lwan_pubsub_topic;
+struct lwan_pubsub_msg;
+struct lwan_pubsub_bridge;
+bool lwan_pubsub_topic_set_bridge(struct lwan_pubsub_topic *topic,
+                                  struct lwan_pubsub_bridge *bridge);
+bool lwan_pubsub_publish_from_bridge(struct lwan_pubsub_topic *topic,
+                                     const void *contents,
+                                     size_t len);
+bool lwan_pubsub_bridge_queue(struct lwan_pubsub_bridge *bridge,
+                              struct lwan_pubsub_msg *msg);
 
 void lwan_process_request(struct lwan *l, struct lwan_request *request);
+
+void lwan_request_thread_init(void);
+void lwan_request_thread_shutdown(void);
+void lwan_request_buffer_put(char *buffer);
 size_t lwan_prepare_response_header_full(struct lwan_request *request,
      enum lwan_http_status status, char headers[],
      size_t headers_buf_size, const struct lwan_key_value *additional_headers);
@@ -120,6 +517,31 @@ void lwan_response(struct lwan_request *request, enum lwan_http_status status);
 void lwan_default_response(struct lwan_request *request,
                            enum lwan_http_status status);
 
+struct iovec;
+bool lwan_http2_is_preface(const char *buffer);
+void lwan_http2_serve(struct lwan_request *request, const char *start)
+    __attribute__((noreturn));
+ssize_t lwan_http2_stream_writev(struct lwan_request *request,
+                                 const struct iovec *iov,
+                                 int iov_count);
+void lwan_http2_stream_sendfile(struct lwan_request *request,
+                                int in_fd,
+                                off_t offset,
+                                size_t count,
+                                const char *header,
+                                size_t header_len);
+struct lwan_connection *lwan_http2_stream_wake(struct lwan_connection *conn);
+
+#if defined(HAVE_KTLS)
+struct lwan_tls_context *lwan_tls_context_new(const struct lwan *l,
+                                              const char *certificate,
+                                              const char *private_key);
+void lwan_tls_context_free(struct lwan_tls_context *tls);
+bool lwan_tls_handshake(struct lwan_tls_context *tls,
+                        struct lwan_connection *conn,
+                        int fd);
+#endif
+
 void lwan_straitjacket_enforce_from_config(struct config *c);
 
 const char *lwan_get_config_path(char *path_buf, size_t path_buf_len);
@@ -159,6 +581,11 @@ static ALWAYS_INLINE size_t lwan_nextpow2(size_t number)
 #include <lua.h>
 
 lua_State *lwan_lua_create_state(const char *script_file, const char *script);
+bool lwan_lua_compile_script(const char *script_file,
+                             const char *script,
+                             struct lwan_strbuf *bytecode);
+lua_State *lwan_lua_create_state_from_bytecode(const char *bytecode,
+                                               size_t len);
 void lwan_lua_state_push_request(lua_State *L, struct lwan_request *request);
 const char *lwan_lua_state_last_error(lua_State *L);
 #endif
@@ -189,6 +616,38 @@ const char *lwan_lua_state_last_error(lua_State *L);
 
 extern clockid_t monotonic_clock_id;
 
+/* Events for file descriptors awaited by a coroutine carry a tagged pointer
+ * to the connection, so that a hang-up in one of them is reported to the
+ * coroutine (as a failed read or write) rather than being mistaken for the
+ * client going away. */
+static inline void *lwan_connection_tag_awaited(struct lwan_connection *conn)
+{
+    return (void *)((uintptr_t)conn | 1);
+}
+
+static inline bool lwan_connection_is_tagged_awaited(const void *ptr)
+{
+    return (uintptr_t)ptr & 1;
+}
+
+static inline struct lwan_connection *
+lwan_connection_untag_awaited(void *ptr)
+{
+    return (struct lwan_connection *)((uintptr_t)ptr & ~(uintptr_t)1);
+}
+
+/* With edge-triggered events, a socket is only reported again once it
+ * becomes ready after a read or write on it came up short (or failed with
+ * EAGAIN), so code doing I/O on the socket of a connection has to clear
+ * its readiness when that happens.  Otherwise, the connection is resumed
+ * right away after yielding, rather than when there's something to do. */
+static inline void
+lwan_connection_clear_ready(struct lwan_connection *conn,
+                            enum lwan_connection_flags ready)
+{
+    conn->flags &= ~ready;
+}
+
 static inline void *
 lwan_aligned_alloc(size_t n, size_t alignment)
 {
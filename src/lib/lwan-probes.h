@@ -0,0 +1,39 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+/* Static probes (USDT), for perf, bpftrace, SystemTap, and the like.  A
+ * probe is a single nop instruction, plus a note in the ELF file that
+ * tells tracers where it is and where to find its arguments, so they're
+ * always built in if <sys/sdt.h> is available.  All of them belong to the
+ * "lwan" provider; see the "Profiling" section in the README for a list.
+ *
+ * Arguments are evaluated even if nothing is tracing, so keep them
+ * cheap (e.g. values already in registers). */
+
+#if defined(HAVE_SYS_SDT_H)
+#include <sys/sdt.h>
+
+#define LWAN_PROBE(name_, ...) STAP_PROBEV(lwan, name_, ##__VA_ARGS__)
+#else
+#define LWAN_PROBE(name_, ...)                                                 \
+    do {                                                                       \
+    } while (0)
+#endif
@@ -0,0 +1,555 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* Samples what I/O threads are doing, on demand, without the help of an
+ * external profiler.  While a profile is being taken, each I/O thread has
+ * a timer that measures its CPU time, and that sends it a SIGPROF every
+ * so often.  The signal handler, running in the interrupted thread,
+ * records the call stack and what the thread was up to: running its
+ * event loop, a coroutine between requests (e.g. parsing one), or the
+ * handler for an URL map.  Samples are then folded into one line per
+ * distinct stack, as understood by flame graph tools.
+ *
+ * Each thread has a buffer of samples that only its signal handler writes
+ * to, so no locks are needed; the number of samples is published after
+ * each one is written.  A signal might still be delivered after a timer
+ * is deleted, so buffers are only freed once the handler is known not to
+ * be using them.  Only one profile can be taken at a time. */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "hash.h"
+
+#if defined(__linux__) && !defined(sigev_notify_thread_id)
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define MAX_FRAMES 48
+/* The signal handler and the frame that called it, which is the
+ * trampoline the kernel returns through. */
+#define SKIP_FRAMES 2
+
+enum sample_state {
+    SAMPLE_EVENT_LOOP,
+    SAMPLE_COROUTINE,
+    SAMPLE_HANDLER,
+};
+
+struct profile_sample {
+    const char *handler;
+    enum sample_state state;
+    int n_frames;
+    void *frames[MAX_FRAMES];
+};
+
+struct lwan_thread_profile {
+    /* Connection being resumed by this thread, if any. */
+    struct lwan_connection *volatile running;
+
+    /* Only while a profile is being taken */
+    struct profile_sample *samples;
+    unsigned int n_samples;
+    unsigned int max_samples;
+    unsigned int dropped;
+    bool sampling; /* The signal handler is running */
+
+    pid_t tid;
+#if defined(__linux__)
+    timer_t timer;
+    bool has_timer;
+#endif
+    stack_t altstack;
+};
+
+static struct {
+    bool enabled;
+    bool running;
+
+    /* URL map prefix of the request each connection is handling, while a
+     * profile is being taken; indexed by file descriptor. */
+    const char *volatile *handlers;
+    size_t n_handlers;
+
+    struct lwan *lwan;
+} profiler;
+
+static __thread struct lwan_thread_profile *current_profile;
+
+void lwan_profiler_enable(void) { profiler.enabled = true; }
+
+static void take_sample(int signum __attribute__((unused)),
+                        siginfo_t *info __attribute__((unused)),
+                        void *context __attribute__((unused)))
+{
+    struct lwan_thread_profile *profile = current_profile;
+    const int saved_errno = errno;
+    struct profile_sample *samples;
+
+    if (UNLIKELY(!profile))
+        return;
+
+    /* See release_samples() */
+    __atomic_store_n(&profile->sampling, true, __ATOMIC_SEQ_CST);
+    samples = __atomic_load_n(&profile->samples, __ATOMIC_SEQ_CST);
+    if (UNLIKELY(!samples))
+        goto out;
+
+    const unsigned int n = profile->n_samples;
+    if (UNLIKELY(n >= profile->max_samples)) {
+        profile->dropped++;
+        goto out;
+    }
+
+    struct profile_sample *sample = &samples[n];
+    struct lwan_connection *conn = profile->running;
+
+    sample->handler = NULL;
+    if (!conn) {
+        sample->state = SAMPLE_EVENT_LOOP;
+    } else {
+        const int fd = lwan_connection_get_fd(profiler.lwan, conn);
+
+        sample->handler = profiler.handlers[fd];
+        sample->state = sample->handler ? SAMPLE_HANDLER : SAMPLE_COROUTINE;
+    }
+
+    /* backtrace() unwinds through the signal frame into the interrupted
+     * code, be it in a coroutine (whose outermost frame ends the chain)
+     * or not.  It has been called once by each thread before it could
+     * be interrupted by this, so it won't be loading libgcc now. */
+    sample->n_frames = backtrace(sample->frames, MAX_FRAMES);
+
+    __atomic_store_n(&profile->n_samples, n + 1, __ATOMIC_RELEASE);
+
+out:
+    __atomic_store_n(&profile->sampling, false, __ATOMIC_RELEASE);
+    errno = saved_errno;
+}
+
+void lwan_profiler_init(struct lwan *l)
+{
+    struct sigaction sa = {
+        .sa_sigaction = take_sample,
+        .sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK,
+    };
+
+    if (!profiler.enabled)
+        return;
+
+    profiler.lwan = l;
+    profiler.n_handlers = (size_t)l->thread.max_fd * l->thread.count;
+    profiler.handlers = calloc(profiler.n_handlers, sizeof(*profiler.handlers));
+    if (!profiler.handlers)
+        lwan_status_critical("Could not allocate memory for the profiler");
+
+    for (unsigned int i = 0; i < l->thread.count; i++) {
+        struct lwan_thread_profile *profile = calloc(1, sizeof(*profile));
+
+        if (!profile)
+            lwan_status_critical("Could not allocate memory for the profiler");
+
+        l->thread.threads[i].profile = profile;
+    }
+
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) < 0)
+        lwan_status_critical_perror("sigaction");
+}
+
+void lwan_profiler_shutdown(struct lwan *l)
+{
+    if (!profiler.handlers)
+        return;
+
+    signal(SIGPROF, SIG_IGN);
+
+    for (unsigned int i = 0; i < l->thread.count; i++) {
+        struct lwan_thread_profile *profile = l->thread.threads[i].profile;
+
+        free(profile);
+        l->thread.threads[i].profile = NULL;
+    }
+
+    free((void *)profiler.handlers);
+    profiler.handlers = NULL;
+}
+
+void lwan_profiler_thread_init(struct lwan_thread *t)
+{
+    struct lwan_thread_profile *profile = t->profile;
+    void *frames[1];
+
+    if (!profile)
+        return;
+
+    profile->tid = gettid();
+
+    /* Coroutine stacks are small, and the signal could arrive while one
+     * is nearly full; the handler and the unwinder run on a stack of
+     * their own instead. */
+    profile->altstack = (stack_t){
+        .ss_size = LWAN_MAX((size_t)SIGSTKSZ, (size_t)65536),
+    };
+    profile->altstack.ss_sp = malloc(profile->altstack.ss_size);
+    if (!profile->altstack.ss_sp ||
+        sigaltstack(&profile->altstack, NULL) < 0)
+        lwan_status_critical_perror("Could not set up the profiler stack");
+
+    /* The first call to backtrace() loads libgcc, which isn't something
+     * to be done in a signal handler. */
+    LWAN_NO_DISCARD(backtrace(frames, 1));
+
+    current_profile = profile;
+}
+
+void lwan_profiler_thread_shutdown(struct lwan_thread *t)
+{
+    struct lwan_thread_profile *profile = t->profile;
+
+    if (!profile)
+        return;
+
+    current_profile = NULL;
+    sigaltstack(&(stack_t){.ss_flags = SS_DISABLE}, NULL);
+    free(profile->altstack.ss_sp);
+}
+
+int64_t lwan_profiler_resume(struct lwan_connection *conn)
+{
+    struct lwan_thread_profile *profile = conn->thread->profile;
+    int64_t from_coro;
+
+    profile->running = conn;
+    from_coro = UNLIKELY(conn->thread->watch != NULL)
+                    ? lwan_watchdog_resume(conn)
+                    : coro_resume(conn->coro);
+    profile->running = NULL;
+
+    return from_coro;
+}
+
+static void request_end(void *data)
+{
+    profiler.handlers[(intptr_t)data] = NULL;
+}
+
+void lwan_profiler_request_start(struct lwan_request *request,
+                                 const struct lwan_url_map *url_map)
+{
+    /* Streams are resumed by the coroutine of their HTTP/2 connection,
+     * which shares their file descriptor. */
+    if (!ATOMIC_READ(profiler.running) ||
+        (request->conn->flags & CONN_IS_HTTP2_STREAM))
+        return;
+
+    profiler.handlers[request->fd] = url_map->prefix;
+    coro_defer(request->conn->coro, request_end, (void *)(intptr_t)request->fd);
+}
+
+#if defined(__linux__)
+static bool arm_timer(struct lwan_thread *t, unsigned int frequency)
+{
+    struct lwan_thread_profile *profile = t->profile;
+    const struct timespec interval = {
+        .tv_sec = frequency > 1 ? 0 : 1,
+        .tv_nsec = frequency > 1 ? 1000000000l / (long)frequency : 0,
+    };
+    struct sigevent sev = {
+        .sigev_notify = SIGEV_THREAD_ID,
+        .sigev_signo = SIGPROF,
+    };
+    clockid_t clock_id;
+
+    /* Only running threads are sampled, as they would be by perf. */
+    if (pthread_getcpuclockid(t->self, &clock_id))
+        return false;
+
+    sev.sigev_notify_thread_id = profile->tid;
+    if (timer_create(clock_id, &sev, &profile->timer) < 0)
+        return false;
+    profile->has_timer = true;
+
+    return !timer_settime(
+        profile->timer, 0,
+        &(struct itimerspec){
+            .it_interval = interval,
+            .it_value = interval,
+        },
+        NULL);
+}
+
+static void disarm_timer(struct lwan_thread *t)
+{
+    struct lwan_thread_profile *profile = t->profile;
+
+    if (profile->has_timer) {
+        timer_delete(profile->timer);
+        profile->has_timer = false;
+    }
+}
+#else
+static bool arm_timer(struct lwan_thread *t __attribute__((unused)),
+                      unsigned int frequency __attribute__((unused)))
+{
+    errno = ENOTSUP;
+    return false;
+}
+
+static void disarm_timer(struct lwan_thread *t __attribute__((unused))) {}
+#endif
+
+static void release_samples(struct lwan_thread_profile *profile)
+{
+    struct profile_sample *samples = profile->samples;
+
+    /* Pairs with take_sample(): once it's seen that the handler isn't
+     * running, it'll only see a NULL buffer if it runs again. */
+    __atomic_store_n(&profile->samples, NULL, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&profile->sampling, __ATOMIC_SEQ_CST))
+        sched_yield();
+
+    free(samples);
+}
+
+static void stop(struct lwan *l)
+{
+    for (unsigned int i = 0; i < l->thread.count; i++)
+        disarm_timer(&l->thread.threads[i]);
+}
+
+static void finish(struct lwan *l)
+{
+    for (unsigned int i = 0; i < l->thread.count; i++)
+        release_samples(l->thread.threads[i].profile);
+
+    /* Requests still being handled won't be attributed anymore, and their
+     * deferred callbacks will clear their slots when they're done. */
+    __atomic_store_n(&profiler.running, false, __ATOMIC_RELEASE);
+}
+
+bool lwan_profiler_start(struct lwan *l,
+                         unsigned int frequency,
+                         unsigned int max_samples)
+{
+    bool running = false;
+
+    if (!profiler.handlers) {
+        errno = ENOTSUP;
+        return false;
+    }
+
+    if (!__atomic_compare_exchange_n(&profiler.running, &running, true,
+                                     false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_RELAXED)) {
+        errno = EBUSY;
+        return false;
+    }
+
+    for (unsigned int i = 0; i < l->thread.count; i++) {
+        struct lwan_thread_profile *profile = l->thread.threads[i].profile;
+        struct profile_sample *samples = calloc(max_samples, sizeof(*samples));
+
+        if (!samples)
+            goto fail;
+
+        profile->n_samples = 0;
+        profile->max_samples = max_samples;
+        profile->dropped = 0;
+        __atomic_store_n(&profile->samples, samples, __ATOMIC_SEQ_CST);
+    }
+
+    for (unsigned int i = 0; i < l->thread.count; i++) {
+        if (!arm_timer(&l->thread.threads[i], frequency))
+            goto fail;
+    }
+
+    return true;
+
+fail:
+    lwan_status_perror("Could not start profiler");
+    stop(l);
+    finish(l);
+    return false;
+}
+
+void lwan_profiler_cancel(struct lwan *l)
+{
+    stop(l);
+    finish(l);
+}
+
+static const char *symbolize(struct hash *symbols, void *addr)
+{
+    const char *name = hash_find(symbols, addr);
+    char *new_name;
+    Dl_info info;
+
+    if (name)
+        return name;
+
+#if defined(HAVE_DLADDR)
+    if (dladdr(addr, &info) && info.dli_sname) {
+        new_name = strdup(info.dli_sname);
+    } else if (info.dli_fname) {
+        /* Static functions aren't in the dynamic symbol table; report the
+         * offset in their object so that addr2line(1) can find them. */
+        const char *base = strrchr(info.dli_fname, '/');
+
+        if (asprintf(&new_name, "%s+0x%" PRIxPTR, base ? base + 1 : info.dli_fname,
+                     (uintptr_t)addr - (uintptr_t)info.dli_fbase) < 0)
+            new_name = NULL;
+    } else
+#endif
+    {
+        (void)info;
+        if (asprintf(&new_name, "0x%" PRIxPTR, (uintptr_t)addr) < 0)
+            new_name = NULL;
+    }
+
+    if (!new_name)
+        return "?";
+    if (hash_add_unique(symbols, addr, new_name)) {
+        free(new_name);
+        return "?";
+    }
+
+    return new_name;
+}
+
+static bool fold_sample(struct hash *stacks,
+                        struct hash *symbols,
+                        struct lwan_strbuf *key,
+                        const struct profile_sample *sample)
+{
+    uint64_t *count;
+    char *key_copy;
+
+    lwan_strbuf_reset(key);
+
+    switch (sample->state) {
+    case SAMPLE_EVENT_LOOP:
+        lwan_strbuf_append_strz(key, "[event loop]");
+        break;
+    case SAMPLE_COROUTINE:
+        lwan_strbuf_append_strz(key, "[connection]");
+        break;
+    case SAMPLE_HANDLER:
+        lwan_strbuf_append_printf(key, "[handler %s]", sample->handler);
+        break;
+    }
+
+    /* Outermost frame first */
+    for (int i = sample->n_frames - 1; i >= SKIP_FRAMES; i--) {
+        const void *frame = sample->frames[i];
+
+        /* Return addresses point after the call; look up the call. */
+        if (i > SKIP_FRAMES)
+            frame = (const char *)frame - 1;
+
+        lwan_strbuf_append_char(key, ';');
+        lwan_strbuf_append_strz(key, symbolize(symbols, (void *)frame));
+    }
+
+    count = hash_find(stacks, lwan_strbuf_get_buffer(key));
+    if (count) {
+        (*count)++;
+        return true;
+    }
+
+    key_copy = strdup(lwan_strbuf_get_buffer(key));
+    count = malloc(sizeof(*count));
+    if (!key_copy || !count)
+        goto fail;
+    *count = 1;
+    if (!hash_add_unique(stacks, key_copy, count))
+        return true;
+
+fail:
+    free(key_copy);
+    free(count);
+    return false;
+}
+
+bool lwan_profiler_finish(struct lwan *l, struct lwan_strbuf *output)
+{
+    struct hash *stacks = hash_str_new(free, free);
+    struct hash *symbols = hash_int_new(NULL, free);
+    struct lwan_strbuf key;
+    unsigned int dropped = 0;
+    struct hash_iter iter;
+    const void *stack, *count;
+    bool ret = false;
+
+    stop(l);
+
+    if (!stacks || !symbols || !lwan_strbuf_init(&key))
+        goto out;
+
+    for (unsigned int i = 0; i < l->thread.count; i++) {
+        const struct lwan_thread_profile *profile =
+            l->thread.threads[i].profile;
+        const unsigned int n =
+            __atomic_load_n(&profile->n_samples, __ATOMIC_ACQUIRE);
+
+        for (unsigned int j = 0; j < n; j++) {
+            if (!fold_sample(stacks, symbols, &key, &profile->samples[j]))
+                goto out_free_key;
+        }
+
+        dropped += profile->dropped;
+    }
+
+    if (dropped)
+        lwan_status_warning("Profile buffers filled up; %u samples dropped",
+                            dropped);
+
+    hash_iter_init(stacks, &iter);
+    while (hash_iter_next(&iter, &stack, &count)) {
+        if (!lwan_strbuf_append_printf(output, "%s %" PRIu64 "\n",
+                                       (const char *)stack,
+                                       *(const uint64_t *)count))
+            goto out_free_key;
+    }
+
+    ret = true;
+
+out_free_key:
+    lwan_strbuf_free(&key);
+out:
+    finish(l);
+    if (stacks)
+        hash_free(stacks);
+    if (symbols)
+        hash_free(symbols);
+    return ret;
+}
@@ -0,0 +1,623 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* Messages published to a bridged topic are queued for the bridge thread,
+ * with a reference each, by the publishing thread (while it holds the
+ * topic lock, so the bridge can't go away under it); the bridge thread is
+ * only woken up when the queue goes from empty to not empty, and takes
+ * everything queued at once, so that the busier the topic, the larger the
+ * batches handed to the transport.  Messages from other nodes are
+ * published by the bridge thread itself, and aren't queued back.  The
+ * queue is bounded: if the transport can't keep up, messages published
+ * locally are still delivered to local subscribers, but not relayed. */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+#include "lwan-pubsub.h"
+
+#define BRIDGE_MAX_QUEUED 4096
+
+struct lwan_pubsub_bridge {
+    struct lwan_pubsub_topic *topic;
+    const struct lwan_pubsub_bridge_ops *ops;
+    void *data;
+
+    pthread_t self;
+    int wakeup_fd;
+    bool stop;
+
+    pthread_mutex_t lock;
+    struct lwan_pubsub_msg **queued;
+    unsigned int n_queued;
+    unsigned int n_dropped;
+
+    /* Only touched by the bridge thread */
+    struct lwan_pubsub_msg **sending;
+    const struct lwan_value **values;
+};
+
+bool lwan_pubsub_bridge_queue(struct lwan_pubsub_bridge *bridge,
+                              struct lwan_pubsub_msg *msg)
+{
+    bool was_empty;
+
+    pthread_mutex_lock(&bridge->lock);
+    if (UNLIKELY(bridge->n_queued == BRIDGE_MAX_QUEUED)) {
+        bridge->n_dropped++;
+        pthread_mutex_unlock(&bridge->lock);
+        return false;
+    }
+    was_empty = !bridge->n_queued;
+    bridge->queued[bridge->n_queued++] = msg;
+    pthread_mutex_unlock(&bridge->lock);
+
+    if (was_empty)
+        eventfd_write(bridge->wakeup_fd, 1);
+
+    return true;
+}
+
+static void send_queued(struct lwan_pubsub_bridge *bridge)
+{
+    struct lwan_pubsub_msg **msgs;
+    unsigned int n_msgs, n_dropped;
+
+    pthread_mutex_lock(&bridge->lock);
+    msgs = bridge->queued;
+    n_msgs = bridge->n_queued;
+    n_dropped = bridge->n_dropped;
+    bridge->queued = bridge->sending;
+    bridge->n_queued = bridge->n_dropped = 0;
+    pthread_mutex_unlock(&bridge->lock);
+
+    bridge->sending = msgs;
+
+    if (UNLIKELY(n_dropped)) {
+        lwan_status_warning("Pubsub bridge couldn't keep up, %u messages "
+                            "weren't relayed to other nodes",
+                            n_dropped);
+    }
+
+    if (!n_msgs)
+        return;
+
+    for (unsigned int i = 0; i < n_msgs; i++)
+        bridge->values[i] = lwan_pubsub_msg_value(msgs[i]);
+
+    bridge->ops->send(bridge->data, bridge->values, n_msgs);
+
+    for (unsigned int i = 0; i < n_msgs; i++)
+        lwan_pubsub_msg_done(msgs[i]);
+}
+
+static void *bridge_thread(void *data)
+{
+    struct lwan_pubsub_bridge *bridge = data;
+
+    lwan_set_thread_name("pubsub-bridge");
+
+    while (!ATOMIC_READ(bridge->stop)) {
+        struct pollfd fds[] = {
+            {.fd = bridge->wakeup_fd, .events = POLLIN},
+            {.fd = bridge->ops->get_fd(bridge->data), .events = POLLIN},
+        };
+        eventfd_t ignored;
+
+        if (UNLIKELY(poll(fds, N_ELEMENTS(fds), 1000) < 0)) {
+            if (errno == EINTR)
+                continue;
+            lwan_status_perror("poll");
+            break;
+        }
+
+        if (fds[1].revents)
+            bridge->ops->receive(bridge->data, bridge);
+
+        if (fds[0].revents & POLLIN) {
+            eventfd_read(bridge->wakeup_fd, &ignored);
+            send_queued(bridge);
+        }
+    }
+
+    return NULL;
+}
+
+struct lwan_pubsub_bridge *
+lwan_pubsub_bridge_new(struct lwan_pubsub_topic *topic,
+                       const struct lwan_pubsub_bridge_ops *ops,
+                       void *data)
+{
+    struct lwan_pubsub_bridge *bridge = calloc(1, sizeof(*bridge));
+
+    if (!bridge)
+        goto out_destroy_data;
+
+    bridge->topic = topic;
+    bridge->ops = ops;
+    bridge->data = data;
+
+    bridge->queued = calloc(BRIDGE_MAX_QUEUED, sizeof(*bridge->queued));
+    bridge->sending = calloc(BRIDGE_MAX_QUEUED, sizeof(*bridge->sending));
+    bridge->values = calloc(BRIDGE_MAX_QUEUED, sizeof(*bridge->values));
+    if (!bridge->queued || !bridge->sending || !bridge->values)
+        goto out_free_bridge;
+
+    bridge->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (bridge->wakeup_fd < 0) {
+        lwan_status_perror("eventfd");
+        goto out_free_bridge;
+    }
+
+    pthread_mutex_init(&bridge->lock, NULL);
+
+    if (!lwan_pubsub_topic_set_bridge(topic, bridge)) {
+        lwan_status_error("Pubsub topic already has a bridge");
+        goto out_close_wakeup_fd;
+    }
+
+    if (pthread_create(&bridge->self, NULL, bridge_thread, bridge)) {
+        lwan_status_perror("pthread_create");
+        lwan_pubsub_topic_set_bridge(topic, NULL);
+        goto out_drop_queued;
+    }
+
+    return bridge;
+
+out_drop_queued:
+    /* Messages might have been published before the thread failed to
+     * start. */
+    for (unsigned int i = 0; i < bridge->n_queued; i++)
+        lwan_pubsub_msg_done(bridge->queued[i]);
+out_close_wakeup_fd:
+    pthread_mutex_destroy(&bridge->lock);
+    close(bridge->wakeup_fd);
+out_free_bridge:
+    free(bridge->queued);
+    free(bridge->sending);
+    free(bridge->values);
+    free(bridge);
+out_destroy_data:
+    ops->destroy(data);
+    return NULL;
+}
+
+void lwan_pubsub_bridge_free(struct lwan_pubsub_bridge *bridge)
+{
+    if (!bridge)
+        return;
+
+    /* Takes the topic lock, so nothing is being queued after this. */
+    lwan_pubsub_topic_set_bridge(bridge->topic, NULL);
+
+    __atomic_store_n(&bridge->stop, true, __ATOMIC_RELAXED);
+    eventfd_write(bridge->wakeup_fd, 1);
+    pthread_join(bridge->self, NULL);
+
+    for (unsigned int i = 0; i < bridge->n_queued; i++)
+        lwan_pubsub_msg_done(bridge->queued[i]);
+
+    bridge->ops->destroy(bridge->data);
+
+    pthread_mutex_destroy(&bridge->lock);
+    close(bridge->wakeup_fd);
+    free(bridge->queued);
+    free(bridge->sending);
+    free(bridge->values);
+    free(bridge);
+}
+
+bool lwan_pubsub_bridge_deliver(struct lwan_pubsub_bridge *bridge,
+                                const void *contents,
+                                size_t len)
+{
+    return lwan_pubsub_publish_from_bridge(bridge->topic, contents, len);
+}
+
+/* Datagrams start with a header identifying the node that sent them (so
+ * that nodes can ignore their own datagrams, which are looped back to
+ * receive datagrams from other nodes on the same host) and the channel,
+ * followed by any number of messages, each prefixed by its length as a
+ * 32-bit big-endian integer. */
+#define UDP_MAGIC "LwPb"
+#define UDP_NODE_OFFSET 4
+#define UDP_CHANNEL_OFFSET 12
+#define UDP_MAX_CHANNEL_LEN 255
+#define UDP_DATAGRAM_SIZE 1400
+#define UDP_MAX_DATAGRAM_SIZE 65507
+#define UDP_SENDMMSG_BATCH 64
+#define UDP_RECV_BATCH 64
+
+struct udp_bridge {
+    int fd;
+    struct sockaddr_storage group;
+    socklen_t group_len;
+
+    size_t header_len;
+    char header[UDP_CHANNEL_OFFSET + 1 + UDP_MAX_CHANNEL_LEN];
+
+    struct lwan_strbuf out;
+    char *in;
+};
+
+static bool udp_flush(struct udp_bridge *udp,
+                      const size_t ends[],
+                      unsigned int n_datagrams)
+{
+    const char *buffer = lwan_strbuf_get_buffer(&udp->out);
+    struct mmsghdr msgs[UDP_SENDMMSG_BATCH];
+    struct iovec iov[UDP_SENDMMSG_BATCH];
+    unsigned int sent = 0;
+    size_t start = 0;
+
+    for (unsigned int i = 0; i < n_datagrams; i++) {
+        iov[i] = (struct iovec){
+            .iov_base = (char *)buffer + start,
+            .iov_len = ends[i] - start,
+        };
+        msgs[i] = (struct mmsghdr){
+            .msg_hdr = {
+                .msg_name = &udp->group,
+                .msg_namelen = udp->group_len,
+                .msg_iov = &iov[i],
+                .msg_iovlen = 1,
+            },
+        };
+        start = ends[i];
+    }
+
+    while (sent < n_datagrams) {
+        int r = sendmmsg(udp->fd, msgs + sent, n_datagrams - sent, 0);
+
+        if (UNLIKELY(r < 0)) {
+            if (errno == EINTR)
+                continue;
+            lwan_status_perror("Could not send messages to other nodes");
+            break;
+        }
+
+        sent += (unsigned int)r;
+    }
+
+    lwan_strbuf_reset(&udp->out);
+    return sent == n_datagrams;
+}
+
+/* Messages are packed into as few datagrams as possible, and datagrams
+ * are sent with as few system calls as possible. */
+static bool udp_send(void *data, const struct lwan_value *msgs[], size_t n_msgs)
+{
+    struct udp_bridge *udp = data;
+    const size_t max_msg_len = UDP_MAX_DATAGRAM_SIZE - udp->header_len - 4;
+    size_t ends[UDP_SENDMMSG_BATCH];
+    unsigned int n_datagrams = 0;
+    size_t datagram_start = 0;
+    bool ret = true;
+
+    lwan_strbuf_reset(&udp->out);
+
+    for (size_t i = 0; i < n_msgs; i++) {
+        const struct lwan_value *msg = msgs[i];
+        size_t datagram_len =
+            lwan_strbuf_get_length(&udp->out) - datagram_start;
+        uint32_t len_be;
+
+        if (UNLIKELY(msg->len > max_msg_len)) {
+            lwan_status_warning("Message with %zu bytes is too large for a "
+                                "UDP datagram, not relaying it",
+                                msg->len);
+            continue;
+        }
+
+        if (datagram_len && datagram_len + 4 + msg->len > UDP_DATAGRAM_SIZE) {
+            ends[n_datagrams++] = lwan_strbuf_get_length(&udp->out);
+            if (n_datagrams == UDP_SENDMMSG_BATCH) {
+                ret &= udp_flush(udp, ends, n_datagrams);
+                n_datagrams = 0;
+            }
+            datagram_start = lwan_strbuf_get_length(&udp->out);
+            datagram_len = 0;
+        }
+
+        len_be = htonl((uint32_t)msg->len);
+        if (UNLIKELY((!datagram_len && !lwan_strbuf_append_str(
+                                           &udp->out, udp->header,
+                                           udp->header_len)) ||
+                     !lwan_strbuf_append_str(&udp->out, (char *)&len_be,
+                                             sizeof(len_be)) ||
+                     !lwan_strbuf_append_str(&udp->out, msg->value,
+                                             msg->len))) {
+            lwan_status_error("Could not build datagram, dropping messages");
+            lwan_strbuf_reset(&udp->out);
+            return false;
+        }
+    }
+
+    if (lwan_strbuf_get_length(&udp->out) > datagram_start)
+        ends[n_datagrams++] = lwan_strbuf_get_length(&udp->out);
+    if (n_datagrams)
+        ret &= udp_flush(udp, ends, n_datagrams);
+
+    return ret;
+}
+
+static bool udp_receive(void *data, struct lwan_pubsub_bridge *bridge)
+{
+    struct udp_bridge *udp = data;
+
+    /* Other things get a chance to run every once in a while. */
+    for (int i = 0; i < UDP_RECV_BATCH; i++) {
+        ssize_t r = recv(udp->fd, udp->in, UDP_MAX_DATAGRAM_SIZE, MSG_DONTWAIT);
+        size_t len, offset;
+
+        if (r < 0) {
+            if (errno == EAGAIN)
+                return true;
+            if (errno == EINTR)
+                continue;
+            lwan_status_perror("Could not receive messages from other nodes");
+            return false;
+        }
+
+        len = (size_t)r;
+        if (len < udp->header_len ||
+            memcmp(udp->in, udp->header, UDP_NODE_OFFSET) ||
+            memcmp(udp->in + UDP_CHANNEL_OFFSET,
+                   udp->header + UDP_CHANNEL_OFFSET,
+                   udp->header_len - UDP_CHANNEL_OFFSET)) {
+            continue; /* Not for this topic */
+        }
+        if (!memcmp(udp->in + UDP_NODE_OFFSET, udp->header + UDP_NODE_OFFSET,
+                    UDP_CHANNEL_OFFSET - UDP_NODE_OFFSET)) {
+            continue; /* Sent by this node */
+        }
+
+        for (offset = udp->header_len; len - offset >= 4;) {
+            uint32_t msg_len;
+
+            memcpy(&msg_len, udp->in + offset, sizeof(msg_len));
+            msg_len = ntohl(msg_len);
+            offset += 4;
+
+            if (UNLIKELY(msg_len > len - offset))
+                break; /* Truncated */
+
+            lwan_pubsub_bridge_deliver(bridge, udp->in + offset, msg_len);
+            offset += msg_len;
+        }
+    }
+
+    return true;
+}
+
+static int udp_get_fd(void *data)
+{
+    const struct udp_bridge *udp = data;
+
+    return udp->fd;
+}
+
+static void udp_destroy(void *data)
+{
+    struct udp_bridge *udp = data;
+
+    if (udp->fd >= 0)
+        close(udp->fd);
+    lwan_strbuf_free(&udp->out);
+    free(udp->in);
+    free(udp);
+}
+
+static const struct lwan_pubsub_bridge_ops udp_ops = {
+    .send = udp_send,
+    .receive = udp_receive,
+    .get_fd = udp_get_fd,
+    .destroy = udp_destroy,
+};
+
+static uint64_t get_node_id(const void *fallback)
+{
+    uint64_t value;
+
+#if defined(SYS_getrandom)
+    if (syscall(SYS_getrandom, &value, sizeof(value), 0) == sizeof(value))
+        return value;
+#endif
+
+    value = (uint64_t)getpid() << 32 | (uint64_t)time(NULL);
+    return value ^ (uint64_t)(uintptr_t)fallback;
+}
+
+static bool udp_resolve_group(struct udp_bridge *udp, const char *address)
+{
+    char *copy = strdup(address);
+    char *node, *port;
+    struct addrinfo *ai;
+    bool ret = false;
+    int r;
+
+    if (!copy)
+        return false;
+
+    port = strrchr(copy, ':');
+    if (!port) {
+        lwan_status_error("Multicast address needs a port: %s", address);
+        goto out;
+    }
+    *port++ = '\0';
+
+    node = copy;
+    if (*node == '[') {
+        char *end = strchr(node, ']');
+
+        if (!end || end[1]) {
+            lwan_status_error("Invalid multicast address: %s", address);
+            goto out;
+        }
+        *end = '\0';
+        node++;
+    }
+
+    r = getaddrinfo(node, port,
+                    &(struct addrinfo){
+                        .ai_family = AF_UNSPEC,
+                        .ai_socktype = SOCK_DGRAM,
+                        .ai_flags = AI_NUMERICHOST | AI_NUMERICSERV,
+                    },
+                    &ai);
+    if (r) {
+        lwan_status_error("Invalid multicast address %s: %s", address,
+                          gai_strerror(r));
+        goto out;
+    }
+
+    if (ai->ai_family == AF_INET) {
+        const struct sockaddr_in *sin = (struct sockaddr_in *)ai->ai_addr;
+
+        ret = IN_MULTICAST(ntohl(sin->sin_addr.s_addr));
+    } else if (ai->ai_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ai->ai_addr;
+
+        ret = IN6_IS_ADDR_MULTICAST(&sin6->sin6_addr);
+    }
+
+    if (ret) {
+        memcpy(&udp->group, ai->ai_addr, ai->ai_addrlen);
+        udp->group_len = ai->ai_addrlen;
+    } else {
+        lwan_status_error("Not a multicast address: %s", address);
+    }
+
+    freeaddrinfo(ai);
+
+out:
+    free(copy);
+    return ret;
+}
+
+static bool udp_join_group(struct udp_bridge *udp)
+{
+    const int one = 1;
+
+    /* Every node on this host bound to this port gets a copy of each
+     * datagram sent to the group. */
+    if (setsockopt(udp->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) {
+        lwan_status_perror("setsockopt(SO_REUSEADDR)");
+        return false;
+    }
+
+    if (bind(udp->fd, (struct sockaddr *)&udp->group, udp->group_len) < 0) {
+        lwan_status_perror("Could not bind to multicast address");
+        return false;
+    }
+
+    if (udp->group.ss_family == AF_INET) {
+        const struct sockaddr_in *sin = (struct sockaddr_in *)&udp->group;
+        const struct ip_mreqn mreq = {.imr_multiaddr = sin->sin_addr};
+
+        if (setsockopt(udp->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                       sizeof(mreq)) < 0 ||
+            setsockopt(udp->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &one,
+                       sizeof(one)) < 0) {
+            lwan_status_perror("Could not join multicast group");
+            return false;
+        }
+    } else {
+        const struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&udp->group;
+        const struct ipv6_mreq mreq = {.ipv6mr_multiaddr = sin6->sin6_addr};
+
+        if (setsockopt(udp->fd, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP, &mreq,
+                       sizeof(mreq)) < 0 ||
+            setsockopt(udp->fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &one,
+                       sizeof(one)) < 0) {
+            lwan_status_perror("Could not join multicast group");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+struct lwan_pubsub_bridge *
+lwan_pubsub_bridge_new_udp_multicast(struct lwan_pubsub_topic *topic,
+                                     const char *address,
+                                     const char *channel)
+{
+    const size_t channel_len = strlen(channel);
+    struct udp_bridge *udp;
+    uint64_t node_id;
+
+    if (channel_len > UDP_MAX_CHANNEL_LEN) {
+        lwan_status_error("Pubsub bridge channel name is too long");
+        return NULL;
+    }
+
+    udp = calloc(1, sizeof(*udp));
+    if (!udp)
+        return NULL;
+
+    udp->fd = -1;
+    lwan_strbuf_init(&udp->out);
+
+    udp->in = malloc(UDP_MAX_DATAGRAM_SIZE);
+    if (!udp->in)
+        goto error;
+
+    node_id = get_node_id(udp);
+    memcpy(udp->header, UDP_MAGIC, UDP_NODE_OFFSET);
+    memcpy(udp->header + UDP_NODE_OFFSET, &node_id, sizeof(node_id));
+    udp->header[UDP_CHANNEL_OFFSET] = (char)channel_len;
+    memcpy(udp->header + UDP_CHANNEL_OFFSET + 1, channel, channel_len);
+    udp->header_len = UDP_CHANNEL_OFFSET + 1 + channel_len;
+
+    if (!udp_resolve_group(udp, address))
+        goto error;
+
+    udp->fd = socket(udp->group.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (udp->fd < 0) {
+        lwan_status_perror("socket");
+        goto error;
+    }
+
+    if (!udp_join_group(udp))
+        goto error;
+
+    lwan_status_debug("Bridging pubsub channel \"%s\" through %s", channel,
+                      address);
+
+    return lwan_pubsub_bridge_new(topic, &udp_ops, udp);
+
+error:
+    udp_destroy(udp);
+    return NULL;
+}
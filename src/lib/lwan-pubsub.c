@@ -19,24 +19,81 @@
  */
 
 #define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 
 #include "list.h"
 #include "ringbuffer.h"
 #include "lwan-private.h"
+#include "lwan-io-wrappers.h"
+#include "lwan-pubsub.h"
 
+/* Publishers only need to read the list of subscribers, so they can all
+ * publish at the same time; only subscribing and unsubscribing are
+ * serialized. */
 struct lwan_pubsub_topic {
     struct list_head subscribers;
-    pthread_mutex_t lock;
+    unsigned int n_subscribers;
+    unsigned int max_pending;
+    pthread_rwlock_t lock;
+
+    /* The most recent messages, oldest first, with a reference each, for
+     * subscribers resuming from a given event; see
+     * lwan_pubsub_topic_keep_events().  Publishers hold the lock while
+     * queueing, so that messages reach subscribers in the order of their
+     * ids, and subscribers are added with the topic lock held for writing,
+     * so the replayed messages and the published ones neither overlap nor
+     * leave a gap between them. */
+    struct {
+        pthread_mutex_t lock;
+        struct lwan_pubsub_msg **msgs;
+        unsigned int size;
+        unsigned int first;
+        unsigned int count;
+        uint64_t last_id;
+    } replay;
+
+    /* Relays messages to and from other nodes; see lwan-pubsub-bridge.c.
+     * Read by publishers with the topic lock held. */
+    struct lwan_pubsub_bridge *bridge;
 };
 
+/* Values up to this size are stored in the message itself. */
+#define MSG_INLINE_SIZE 192
+
 struct lwan_pubsub_msg {
     struct lwan_value value;
     unsigned int refcount;
+    uint64_t id; /* 0 unless the topic keeps events */
+
+    /* The message framed as a server-sent event and as a websocket frame
+     * (compressed or not), built by the first subscriber that needs them
+     * and shared by all. */
+    struct lwan_value *event;
+    struct lwan_value *websocket_frame;
+    struct lwan_value *websocket_deflate_frame;
+
+    char inline_value[MSG_INLINE_SIZE];
 };
 
+/* Messages all have the same size, so worker threads keep some of the ones
+ * they release to publish the next ones without calling malloc().  As with
+ * strbuf buffers, they're plain heap allocations that any thread can free,
+ * and other threads don't keep them. */
+#define MSG_POOL_DEPTH 64
+
+static __thread struct {
+    struct lwan_pubsub_msg *msgs[MSG_POOL_DEPTH];
+    unsigned int count;
+    bool enabled;
+} msg_pool;
+
 DEFINE_RING_BUFFER_TYPE(lwan_pubsub_msg_ref_ring, struct lwan_pubsub_msg *, 16)
 
 struct lwan_pubsub_msg_ref {
@@ -44,18 +101,161 @@ struct lwan_pubsub_msg_ref {
     struct lwan_pubsub_msg_ref_ring ring;
 };
 
+/* Each subscriber has a bounded queue that any number of publishers can
+ * put messages in without taking locks (each slot has a sequence number
+ * telling whether it's free or full for the current lap, as in Dmitry
+ * Vyukov's bounded MPMC queue), and that only the subscriber consumes.
+ *
+ * If a subscriber falls too far behind, messages go to an unbounded
+ * overflow queue, protected by a lock, until the subscriber catches up:
+ * while it is being used, all messages go there, so that they're consumed
+ * in the order they were published by each publisher. */
+#define SUB_RING_SIZE 64
+
 struct lwan_pubsub_subscriber {
     struct list_node subscriber;
 
+    struct {
+        size_t seq;
+        struct lwan_pubsub_msg *msg;
+    } ring[SUB_RING_SIZE];
+    size_t head; /* Only touched by the subscriber */
+    char cache_line_pad[64 - sizeof(size_t)];
+    size_t tail;
+    bool overflowing;
+
+    /* Only tracked for bounded topics; see lwan_pubsub_new_bounded_topic(). */
+    unsigned int max_pending;
+    unsigned int pending;
+    bool overrun;
+
+    /* See lwan_pubsub_subscribe_since() */
+    bool missed_events;
+
     pthread_mutex_t lock;
     struct list_head msg_refs;
+
+    /* Request is set while a coroutine waits in lwan_pubsub_wait(). */
+    struct lwan_thread_wakeup wakeup;
 };
 
+void lwan_pubsub_thread_init(void)
+{
+    msg_pool.enabled = true;
+}
+
+void lwan_pubsub_thread_shutdown(void)
+{
+    msg_pool.enabled = false;
+
+    while (msg_pool.count)
+        free(msg_pool.msgs[--msg_pool.count]);
+}
+
+static struct lwan_pubsub_msg *msg_alloc(void)
+{
+    if (msg_pool.count)
+        return msg_pool.msgs[--msg_pool.count];
+
+    return malloc(sizeof(struct lwan_pubsub_msg));
+}
+
+static int64_t encoded_size(const struct lwan_value *encoded)
+{
+    return encoded ? (int64_t)(sizeof(*encoded) + encoded->len) : 0;
+}
+
+/* Pooled messages aren't accounted for: only messages that have been
+ * published, and haven't been consumed by all subscribers yet, are. */
+static int64_t msg_size(const struct lwan_pubsub_msg *msg)
+{
+    int64_t size = (int64_t)sizeof(*msg);
+
+    if (msg->value.value != msg->inline_value)
+        size += (int64_t)msg->value.len;
+
+    return size + encoded_size(msg->event) +
+           encoded_size(msg->websocket_frame) +
+           encoded_size(msg->websocket_deflate_frame);
+}
+
+static void msg_free(struct lwan_pubsub_msg *msg)
+{
+    lwan_memory_account(LWAN_MEMORY_PUBSUB, -msg_size(msg));
+
+    if (msg->value.value != msg->inline_value)
+        free(msg->value.value);
+    free(msg->event);
+    free(msg->websocket_frame);
+    free(msg->websocket_deflate_frame);
+
+    if (msg_pool.enabled && msg_pool.count < MSG_POOL_DEPTH) {
+        msg_pool.msgs[msg_pool.count++] = msg;
+        return;
+    }
+
+    free(msg);
+}
+
 static void lwan_pubsub_queue_init(struct lwan_pubsub_subscriber *sub)
 {
+    for (size_t i = 0; i < SUB_RING_SIZE; i++)
+        sub->ring[i].seq = i;
+
     list_head_init(&sub->msg_refs);
 }
 
+static bool ring_try_put(struct lwan_pubsub_subscriber *sub,
+                         struct lwan_pubsub_msg *msg)
+{
+    size_t pos = __atomic_load_n(&sub->tail, __ATOMIC_RELAXED);
+
+    while (true) {
+        const size_t idx = pos & (SUB_RING_SIZE - 1);
+        const size_t seq = __atomic_load_n(&sub->ring[idx].seq, __ATOMIC_ACQUIRE);
+        const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&sub->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                sub->ring[idx].msg = msg;
+                __atomic_store_n(&sub->ring[idx].seq, pos + 1,
+                                 __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false; /* Full */
+        } else {
+            pos = __atomic_load_n(&sub->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static struct lwan_pubsub_msg *ring_get(struct lwan_pubsub_subscriber *sub)
+{
+    const size_t idx = sub->head & (SUB_RING_SIZE - 1);
+    struct lwan_pubsub_msg *msg;
+
+    if (__atomic_load_n(&sub->ring[idx].seq, __ATOMIC_ACQUIRE) != sub->head + 1)
+        return NULL;
+
+    msg = sub->ring[idx].msg;
+    __atomic_store_n(&sub->ring[idx].seq, sub->head + SUB_RING_SIZE,
+                     __ATOMIC_RELEASE);
+    sub->head++;
+
+    return msg;
+}
+
+static bool ring_empty(const struct lwan_pubsub_subscriber *sub)
+{
+    const size_t idx = sub->head & (SUB_RING_SIZE - 1);
+
+    return __atomic_load_n(&sub->ring[idx].seq, __ATOMIC_ACQUIRE) !=
+           sub->head + 1;
+}
+
 static bool lwan_pubsub_queue_put(struct lwan_pubsub_subscriber *sub,
                                   const struct lwan_pubsub_msg *msg)
 {
@@ -72,7 +272,7 @@ static bool lwan_pubsub_queue_put(struct lwan_pubsub_subscriber *sub,
             return true;
     }
 
-    ref = malloc(sizeof(*ref));
+    ref = lwan_slab_alloc(sizeof(*ref));
     if (!ref)
         return false;
 
@@ -93,13 +293,13 @@ lwan_pubsub_queue_get(struct lwan_pubsub_subscriber *sub)
 
         if (lwan_pubsub_msg_ref_ring_empty(&ref->ring)) {
             list_del(&ref->ref);
-            free(ref);
+            lwan_slab_free(ref);
             continue;
         }
 
         msg = lwan_pubsub_msg_ref_ring_get(&ref->ring);
 
-        if (ref->ref.next != ref->ref.prev) {
+        if (ref->ref.next != &sub->msg_refs.n) {
             /* If this segment isn't the last one, try pulling in just one
              * element from the next segment, as there's space in the
              * current segment now.
@@ -136,7 +336,7 @@ static void lwan_pubsub_unsubscribe_internal(struct lwan_pubsub_topic *topic,
                                              struct lwan_pubsub_subscriber *sub,
                                              bool take_topic_lock);
 
-struct lwan_pubsub_topic *lwan_pubsub_new_topic(void)
+struct lwan_pubsub_topic *lwan_pubsub_new_bounded_topic(unsigned int max_pending)
 {
     struct lwan_pubsub_topic *topic = calloc(1, sizeof(*topic));
 
@@ -144,61 +344,197 @@ struct lwan_pubsub_topic *lwan_pubsub_new_topic(void)
         return NULL;
 
     list_head_init(&topic->subscribers);
-    pthread_mutex_init(&topic->lock, NULL);
+    pthread_rwlock_init(&topic->lock, NULL);
+    topic->max_pending = max_pending;
 
     return topic;
 }
 
+struct lwan_pubsub_topic *lwan_pubsub_new_topic(void)
+{
+    return lwan_pubsub_new_bounded_topic(0);
+}
+
 void lwan_pubsub_free_topic(struct lwan_pubsub_topic *topic)
 {
     struct lwan_pubsub_subscriber *iter, *next;
 
-    pthread_mutex_lock(&topic->lock);
+    /* Stops publishing messages from other nodes before going away. */
+    if (topic->bridge)
+        lwan_pubsub_bridge_free(topic->bridge);
+
+    pthread_rwlock_wrlock(&topic->lock);
     list_for_each_safe (&topic->subscribers, iter, next, subscriber)
         lwan_pubsub_unsubscribe_internal(topic, iter, false);
-    pthread_mutex_unlock(&topic->lock);
+    pthread_rwlock_unlock(&topic->lock);
+
+    pthread_rwlock_destroy(&topic->lock);
 
-    pthread_mutex_destroy(&topic->lock);
+    if (topic->replay.size) {
+        for (unsigned int i = 0; i < topic->replay.count; i++) {
+            lwan_pubsub_msg_done(
+                topic->replay.msgs[(topic->replay.first + i) %
+                                   topic->replay.size]);
+        }
+        free(topic->replay.msgs);
+        pthread_mutex_destroy(&topic->replay.lock);
+    }
 
     free(topic);
 }
 
+bool lwan_pubsub_topic_keep_events(struct lwan_pubsub_topic *topic,
+                                   unsigned int n_events)
+{
+    assert(!topic->replay.size);
+    assert(n_events > 0);
+
+    topic->replay.msgs = calloc(n_events, sizeof(*topic->replay.msgs));
+    if (!topic->replay.msgs)
+        return false;
+
+    pthread_mutex_init(&topic->replay.lock, NULL);
+    topic->replay.size = n_events;
+
+    return true;
+}
+
+/* Called with the replay lock held.  Returns the message that had to make
+ * room for this one, if any; its reference is dropped by the caller once
+ * the lock is released. */
+static struct lwan_pubsub_msg *replay_put(struct lwan_pubsub_topic *topic,
+                                          struct lwan_pubsub_msg *msg)
+{
+    struct lwan_pubsub_msg *evicted = NULL;
+    unsigned int last;
+
+    if (topic->replay.count == topic->replay.size) {
+        evicted = topic->replay.msgs[topic->replay.first];
+        topic->replay.first = (topic->replay.first + 1) % topic->replay.size;
+        topic->replay.count--;
+    }
+
+    last = (topic->replay.first + topic->replay.count) % topic->replay.size;
+    topic->replay.msgs[last] = msg;
+    topic->replay.count++;
+
+    return evicted;
+}
+
 void lwan_pubsub_msg_done(struct lwan_pubsub_msg *msg)
 {
-    if (!ATOMIC_DEC(msg->refcount)) {
-        free(msg->value.value);
-        free(msg);
+    if (!ATOMIC_DEC(msg->refcount))
+        msg_free(msg);
+}
+
+static bool subscriber_put(struct lwan_pubsub_subscriber *sub,
+                           struct lwan_pubsub_msg *msg)
+{
+    bool queued = true;
+
+    if (sub->max_pending) {
+        if (__atomic_load_n(&sub->overrun, __ATOMIC_ACQUIRE))
+            return false;
+
+        if (ATOMIC_INC(sub->pending) > sub->max_pending) {
+            /* Too far behind: stop queueing messages for this subscriber,
+             * and wake it up so it can find out. */
+            __atomic_store_n(&sub->overrun, true, __ATOMIC_RELEASE);
+            queued = false;
+            goto wake;
+        }
+    }
+
+    if (LIKELY(!__atomic_load_n(&sub->overflowing, __ATOMIC_ACQUIRE) &&
+               ring_try_put(sub, msg)))
+        goto wake;
+
+    pthread_mutex_lock(&sub->lock);
+    if (sub->overflowing || !ring_try_put(sub, msg)) {
+        __atomic_store_n(&sub->overflowing, true, __ATOMIC_RELEASE);
+        queued = lwan_pubsub_queue_put(sub, msg);
+    }
+    pthread_mutex_unlock(&sub->lock);
+
+    if (UNLIKELY(!queued)) {
+        lwan_status_warning("Couldn't enqueue message, dropping");
+        if (sub->max_pending)
+            ATOMIC_DEC(sub->pending);
+        return false;
     }
+
+wake:
+    /* Pairs with the fence in lwan_pubsub_wait(): either the subscriber
+     * sees this message before sleeping, or this sees it waiting. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sub->wakeup.request, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&sub->lock);
+        if (sub->wakeup.request)
+            lwan_thread_wake(&sub->wakeup);
+        pthread_mutex_unlock(&sub->lock);
+    }
+
+    return queued;
 }
 
-static bool lwan_pubsub_publish_value(struct lwan_pubsub_topic *topic,
-                                      const struct lwan_value value)
+bool lwan_pubsub_topic_set_bridge(struct lwan_pubsub_topic *topic,
+                                  struct lwan_pubsub_bridge *bridge)
 {
-    struct lwan_pubsub_msg *msg = malloc(sizeof(*msg));
+    bool set = false;
+
+    pthread_rwlock_wrlock(&topic->lock);
+    if (!bridge || !topic->bridge) {
+        topic->bridge = bridge;
+        set = true;
+    }
+    pthread_rwlock_unlock(&topic->lock);
+
+    return set;
+}
+
+/* Messages that came from other nodes aren't handed back to the bridge,
+ * or they'd bounce between nodes forever. */
+static bool lwan_pubsub_publish_msg(struct lwan_pubsub_topic *topic,
+                                    struct lwan_pubsub_msg *msg,
+                                    bool from_bridge)
+{
+    struct lwan_pubsub_bridge *bridge;
+    struct lwan_pubsub_msg *evicted = NULL;
     struct lwan_pubsub_subscriber *sub;
 
-    if (!msg)
-        return false;
+    msg->event = msg->websocket_frame = msg->websocket_deflate_frame = NULL;
+    msg->id = 0;
+    lwan_memory_account(LWAN_MEMORY_PUBSUB, msg_size(msg));
 
-    /* Initialize refcount to 1, so we can drop one ref after publishing to
-     * all subscribers.  If it drops to 0, it means we didn't publish the
-     * message and we can free it. */
-    msg->refcount = 1;
-    msg->value = value;
+    pthread_rwlock_rdlock(&topic->lock);
 
-    pthread_mutex_lock(&topic->lock);
-    list_for_each (&topic->subscribers, sub, subscriber) {
-        ATOMIC_INC(msg->refcount);
+    /* Take a reference for every subscriber (and the bridge) up front, plus
+     * one that's dropped after publishing to all of them.  If it drops to
+     * 0, it means we didn't publish the message and we can free it. */
+    bridge = from_bridge ? NULL : topic->bridge;
+    msg->refcount = topic->n_subscribers + 1 + (bridge ? 1 : 0);
 
-        pthread_mutex_lock(&sub->lock);
-        if (!lwan_pubsub_queue_put(sub, msg)) {
-            lwan_status_warning("Couldn't enqueue message, dropping");
+    if (topic->replay.size) {
+        pthread_mutex_lock(&topic->replay.lock);
+        msg->id = ++topic->replay.last_id;
+        msg->refcount++;
+        evicted = replay_put(topic, msg);
+    }
+
+    list_for_each (&topic->subscribers, sub, subscriber) {
+        if (UNLIKELY(!subscriber_put(sub, msg)))
             ATOMIC_DEC(msg->refcount);
-        }
-        pthread_mutex_unlock(&sub->lock);
     }
-    pthread_mutex_unlock(&topic->lock);
 
+    if (bridge && UNLIKELY(!lwan_pubsub_bridge_queue(bridge, msg)))
+        ATOMIC_DEC(msg->refcount);
+
+    if (topic->replay.size)
+        pthread_mutex_unlock(&topic->replay.lock);
+    pthread_rwlock_unlock(&topic->lock);
+
+    if (evicted)
+        lwan_pubsub_msg_done(evicted);
     lwan_pubsub_msg_done(msg);
 
     return true;
@@ -211,66 +547,297 @@ static void *my_memdup(const void *src, size_t len)
     return dup ? memcpy(dup, src, len) : NULL;
 }
 
+static bool publish(struct lwan_pubsub_topic *topic,
+                    const void *contents,
+                    size_t len,
+                    bool from_bridge)
+{
+    struct lwan_pubsub_msg *msg = msg_alloc();
+
+    if (!msg)
+        return false;
+
+    if (len <= sizeof(msg->inline_value)) {
+        msg->value.value = memcpy(msg->inline_value, contents, len);
+    } else {
+        msg->value.value = my_memdup(contents, len);
+        if (!msg->value.value) {
+            free(msg);
+            return false;
+        }
+    }
+    msg->value.len = len;
+
+    return lwan_pubsub_publish_msg(topic, msg, from_bridge);
+}
+
 bool lwan_pubsub_publish(struct lwan_pubsub_topic *topic,
                          const void *contents,
                          size_t len)
 {
-    const struct lwan_value value = { .value = my_memdup(contents, len), .len = len };
-
-    if (!value.value)
-        return false;
+    return publish(topic, contents, len, false);
+}
 
-    return lwan_pubsub_publish_value(topic, value);
+bool lwan_pubsub_publish_from_bridge(struct lwan_pubsub_topic *topic,
+                                     const void *contents,
+                                     size_t len)
+{
+    return publish(topic, contents, len, true);
 }
 
 bool lwan_pubsub_publishf(struct lwan_pubsub_topic *topic,
                           const char *format,
                           ...)
 {
-    char *msg;
+    struct lwan_pubsub_msg *msg = msg_alloc();
+    va_list ap, ap_copy;
     int len;
-    va_list ap;
+
+    if (!msg)
+        return false;
 
     va_start(ap, format);
-    len = vasprintf(&msg, format, ap);
+    va_copy(ap_copy, ap);
+    len = vsnprintf(msg->inline_value, sizeof(msg->inline_value), format, ap);
+    if (len >= 0 && (size_t)len < sizeof(msg->inline_value)) {
+        msg->value.value = msg->inline_value;
+    } else if (len >= 0 && vasprintf(&msg->value.value, format, ap_copy) < 0) {
+        len = -1;
+    }
+    va_end(ap_copy);
     va_end(ap);
 
-    if (len < 0)
+    if (len < 0) {
+        free(msg);
         return false;
+    }
+    msg->value.len = (size_t)len;
 
-    const struct lwan_value value = { .value = msg, .len = (size_t)len };
-    return lwan_pubsub_publish_value(topic, value);
+    return lwan_pubsub_publish_msg(topic, msg, false);
 }
 
-struct lwan_pubsub_subscriber *
-lwan_pubsub_subscribe(struct lwan_pubsub_topic *topic)
+/* Called with the topic lock held for writing, so no message is being
+ * published. */
+static void replay_since(struct lwan_pubsub_topic *topic,
+                         struct lwan_pubsub_subscriber *sub,
+                         uint64_t last_event_id)
 {
-    struct lwan_pubsub_subscriber *sub = calloc(1, sizeof(*sub));
+    const uint64_t oldest_id = topic->replay.last_id - topic->replay.count + 1;
+
+    /* Either evicted already, or from before a restart. */
+    if (last_event_id > topic->replay.last_id ||
+        (topic->replay.count && last_event_id + 1 < oldest_id))
+        sub->missed_events = true;
+
+    for (unsigned int i = 0; i < topic->replay.count; i++) {
+        struct lwan_pubsub_msg *msg =
+            topic->replay.msgs[(topic->replay.first + i) % topic->replay.size];
+
+        if (msg->id <= last_event_id)
+            continue;
+
+        /* The replay ring holds a reference, so this never drops to 0. */
+        ATOMIC_INC(msg->refcount);
+        if (UNLIKELY(!subscriber_put(sub, msg))) {
+            ATOMIC_DEC(msg->refcount);
+            sub->missed_events = true;
+        }
+    }
+}
+
+static struct lwan_pubsub_subscriber *
+subscribe(struct lwan_pubsub_topic *topic, bool replay, uint64_t last_event_id)
+{
+    struct lwan_pubsub_subscriber *sub = lwan_slab_calloc(sizeof(*sub));
 
     if (!sub)
         return NULL;
 
+    lwan_memory_account(LWAN_MEMORY_PUBSUB, (int64_t)sizeof(*sub));
     pthread_mutex_init(&sub->lock, NULL);
     lwan_pubsub_queue_init(sub);
+    sub->max_pending = topic->max_pending;
 
-    pthread_mutex_lock(&topic->lock);
+    pthread_rwlock_wrlock(&topic->lock);
+    if (replay) {
+        if (topic->replay.size)
+            replay_since(topic, sub, last_event_id);
+        else
+            sub->missed_events = true;
+    }
     list_add(&topic->subscribers, &sub->subscriber);
-    pthread_mutex_unlock(&topic->lock);
+    topic->n_subscribers++;
+    pthread_rwlock_unlock(&topic->lock);
 
     return sub;
 }
 
-struct lwan_pubsub_msg *lwan_pubsub_consume(struct lwan_pubsub_subscriber *sub)
+struct lwan_pubsub_subscriber *
+lwan_pubsub_subscribe(struct lwan_pubsub_topic *topic)
 {
-    struct lwan_pubsub_msg *msg;
+    return subscribe(topic, false, 0);
+}
+
+struct lwan_pubsub_subscriber *
+lwan_pubsub_subscribe_since(struct lwan_pubsub_topic *topic,
+                            uint64_t last_event_id)
+{
+    return subscribe(topic, true, last_event_id);
+}
+
+struct lwan_pubsub_subscriber *
+lwan_pubsub_subscribe_request(struct lwan_pubsub_topic *topic,
+                              struct lwan_request *request)
+{
+    const char *last_event_id =
+        lwan_request_get_header(request, "Last-Event-ID");
+    unsigned long long id;
+    char *end;
+
+    if (!last_event_id)
+        return lwan_pubsub_subscribe(topic);
+
+    errno = 0;
+    id = strtoull(last_event_id, &end, 10);
+    if (errno || end == last_event_id || *end || *last_event_id == '-') {
+        /* Not an id given by this server: nothing to resume from. */
+        struct lwan_pubsub_subscriber *sub = lwan_pubsub_subscribe(topic);
+
+        if (sub)
+            sub->missed_events = true;
+        return sub;
+    }
+
+    return lwan_pubsub_subscribe_since(topic, (uint64_t)id);
+}
+
+bool lwan_pubsub_subscriber_missed_events(
+    const struct lwan_pubsub_subscriber *sub)
+{
+    return sub->missed_events;
+}
 
+static struct lwan_pubsub_msg *
+subscriber_get(struct lwan_pubsub_subscriber *sub)
+{
+    struct lwan_pubsub_msg *msg = ring_get(sub);
+
+    if (LIKELY(msg) || !__atomic_load_n(&sub->overflowing, __ATOMIC_ACQUIRE))
+        return msg;
+
+    /* The ring has been drained, so whatever overflowed comes next. */
     pthread_mutex_lock(&sub->lock);
     msg = lwan_pubsub_queue_get(sub);
+    if (!msg) {
+        __atomic_store_n(&sub->overflowing, false, __ATOMIC_RELEASE);
+        msg = ring_get(sub);
+    }
     pthread_mutex_unlock(&sub->lock);
 
     return msg;
 }
 
+struct lwan_pubsub_msg *lwan_pubsub_consume(struct lwan_pubsub_subscriber *sub)
+{
+    struct lwan_pubsub_msg *msg = subscriber_get(sub);
+
+    if (msg && sub->max_pending)
+        ATOMIC_DEC(sub->pending);
+
+    return msg;
+}
+
+bool lwan_pubsub_subscriber_overrun(const struct lwan_pubsub_subscriber *sub)
+{
+    return __atomic_load_n(&sub->overrun, __ATOMIC_ACQUIRE);
+}
+
+static bool subscriber_empty(const struct lwan_pubsub_subscriber *sub)
+{
+    /* Overrun subscribers are woken up, so they can find out. */
+    return ring_empty(sub) &&
+           !__atomic_load_n(&sub->overflowing, __ATOMIC_ACQUIRE) &&
+           !lwan_pubsub_subscriber_overrun(sub);
+}
+
+static void cancel_wait(void *data1, void *data2)
+{
+    struct lwan_pubsub_subscriber *sub = data1;
+    struct lwan_request *request = data2;
+
+    timeouts_del(request->conn->thread->wheel, &request->timeout);
+
+    pthread_mutex_lock(&sub->lock);
+    lwan_thread_cancel_wake(&sub->wakeup);
+    __atomic_store_n(&sub->wakeup.request, NULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&sub->lock);
+}
+
+void lwan_pubsub_wait(struct lwan_request *request,
+                      struct lwan_pubsub_subscriber *sub,
+                      uint64_t timeout_ms,
+                      bool wake_on_read)
+{
+    struct lwan_connection *conn = request->conn;
+    enum lwan_connection_coro_yield yield = CONN_CORO_SUSPEND;
+    size_t generation;
+
+    /* Anything queued is sent before sleeping, as in lwan_request_sleep(). */
+    lwan_send_queued_responses(request);
+
+    if (!subscriber_empty(sub))
+        return;
+
+    generation = coro_deferred_get_generation(conn->coro);
+    coro_defer2(conn->coro, cancel_wait, sub, request);
+
+    pthread_mutex_lock(&sub->lock);
+    __atomic_store_n(&sub->wakeup.request, request, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&sub->lock);
+
+    /* Pairs with the fence in subscriber_put(). */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (subscriber_empty(sub)) {
+        request->timeout = (struct timeout){};
+        if (timeout_ms)
+            timeouts_add(conn->thread->wheel, &request->timeout, timeout_ms);
+
+        /* HTTP/2 streams don't wait for their connection to be readable;
+         * they would just be resumed right away. */
+        if (wake_on_read && !(conn->flags & CONN_IS_HTTP2_STREAM))
+            yield = CONN_CORO_WANT_READ;
+        coro_yield(conn->coro, yield);
+    }
+
+    coro_deferred_run(conn->coro, generation);
+}
+
+int lwan_pubsub_websocket_read(struct lwan_request *request,
+                               struct lwan_pubsub_subscriber *sub)
+{
+    /* Wake up every now and then so the connection isn't considered idle,
+     * unless I/O threads ping idle websocket connections themselves. */
+    const struct lwan_config *config = &request->conn->thread->lwan->config;
+    const uint64_t timeout_ms =
+        config->websocket_ping ? 0 : config->keep_alive_timeout * 1000ull / 2;
+
+    while (true) {
+        struct lwan_pubsub_msg *msg;
+        int r = lwan_response_websocket_read(request);
+
+        if (r != EAGAIN)
+            return r;
+
+        while ((msg = lwan_pubsub_consume(sub)))
+            lwan_pubsub_msg_websocket_write(request, msg);
+
+        if (lwan_pubsub_subscriber_overrun(sub))
+            return ENOBUFS;
+
+        lwan_pubsub_wait(request, sub, timeout_ms, true);
+    }
+}
+
 static void lwan_pubsub_unsubscribe_internal(struct lwan_pubsub_topic *topic,
                                              struct lwan_pubsub_subscriber *sub,
                                              bool take_topic_lock)
@@ -278,18 +845,19 @@ static void lwan_pubsub_unsubscribe_internal(struct lwan_pubsub_topic *topic,
     struct lwan_pubsub_msg *iter;
 
     if (take_topic_lock)
-        pthread_mutex_lock(&topic->lock);
+        pthread_rwlock_wrlock(&topic->lock);
     list_del(&sub->subscriber);
+    topic->n_subscribers--;
     if (take_topic_lock)
-        pthread_mutex_unlock(&topic->lock);
+        pthread_rwlock_unlock(&topic->lock);
 
-    pthread_mutex_lock(&sub->lock);
-    while ((iter = lwan_pubsub_queue_get(sub)))
+    /* No publisher can reach this subscriber anymore. */
+    while ((iter = lwan_pubsub_consume(sub)))
         lwan_pubsub_msg_done(iter);
-    pthread_mutex_unlock(&sub->lock);
 
     pthread_mutex_destroy(&sub->lock);
-    free(sub);
+    lwan_slab_free(sub);
+    lwan_memory_account(LWAN_MEMORY_PUBSUB, -(int64_t)sizeof(*sub));
 }
 
 void lwan_pubsub_unsubscribe(struct lwan_pubsub_topic *topic,
@@ -302,3 +870,173 @@ const struct lwan_value *lwan_pubsub_msg_value(const struct lwan_pubsub_msg *msg
 {
     return &msg->value;
 }
+
+static struct lwan_value *new_encoded(size_t len)
+{
+    struct lwan_value *encoded = malloc(sizeof(*encoded) + len);
+
+    if (encoded) {
+        encoded->value = (char *)(encoded + 1);
+        encoded->len = len;
+    }
+
+    return encoded;
+}
+
+static struct lwan_value *encode_event(struct lwan_request *request
+                                       __attribute__((unused)),
+                                       const struct lwan_pubsub_msg *msg)
+{
+    static const char prefix[] = "data: ";
+    static const char suffix[] = "\r\n\r\n";
+    const struct lwan_value *value = &msg->value;
+    char id[sizeof("id: \r\n") + 3 * sizeof(msg->id)];
+    const size_t id_len =
+        msg->id ? (size_t)snprintf(id, sizeof(id), "id: %" PRIu64 "\r\n",
+                                   msg->id)
+                : 0;
+    struct lwan_value *encoded = new_encoded(
+        id_len + sizeof(prefix) - 1 + value->len + sizeof(suffix) - 1);
+
+    if (encoded) {
+        char *p = mempcpy(encoded->value, id, id_len);
+        p = mempcpy(p, prefix, sizeof(prefix) - 1);
+        p = mempcpy(p, value->value, value->len);
+        memcpy(p, suffix, sizeof(suffix) - 1);
+    }
+
+    return encoded;
+}
+
+static struct lwan_value *frame_websocket_message(unsigned char header_byte,
+                                                 const struct lwan_value *value)
+{
+    unsigned char header[10];
+    const size_t header_len =
+        lwan_websocket_frame_header(header, header_byte, value->len);
+    struct lwan_value *encoded = new_encoded(header_len + value->len);
+
+    if (encoded) {
+        char *p = mempcpy(encoded->value, header, header_len);
+        memcpy(p, value->value, value->len);
+    }
+
+    return encoded;
+}
+
+static struct lwan_value *
+encode_websocket_frame(struct lwan_request *request __attribute__((unused)),
+                       const struct lwan_pubsub_msg *msg)
+{
+    return frame_websocket_message(0x80 /* FIN */ | 1 /* Text */, &msg->value);
+}
+
+static struct lwan_value *
+encode_websocket_deflate_frame(struct lwan_request *request,
+                               const struct lwan_pubsub_msg *msg)
+{
+    struct lwan_value deflated;
+
+    /* Messages that don't compress well are shared uncompressed. */
+    if (!lwan_websocket_deflate_message(request, &msg->value, &deflated))
+        return encode_websocket_frame(request, msg);
+
+    return frame_websocket_message(
+        0x80 /* FIN */ | 0x40 /* RSV1: compressed */ | 1 /* Text */, &deflated);
+}
+
+static const struct lwan_value *
+get_encoded(struct lwan_value **encoded,
+            struct lwan_request *request,
+            const struct lwan_pubsub_msg *msg,
+            struct lwan_value *(*encode)(struct lwan_request *request,
+                                         const struct lwan_pubsub_msg *msg))
+{
+    struct lwan_value *enc = __atomic_load_n(encoded, __ATOMIC_ACQUIRE);
+    struct lwan_value *prev;
+
+    if (LIKELY(enc))
+        return enc;
+
+    enc = encode(request, msg);
+    if (UNLIKELY(!enc))
+        return NULL;
+
+    /* Subscribers on other threads might have been encoding it as well. */
+    prev = __sync_val_compare_and_swap(encoded, NULL, enc);
+    if (prev) {
+        free(enc);
+        return prev;
+    }
+
+    lwan_memory_account(LWAN_MEMORY_PUBSUB, encoded_size(enc));
+
+    return enc;
+}
+
+static void msg_done_defer(void *data)
+{
+    lwan_pubsub_msg_done(data);
+}
+
+void lwan_pubsub_msg_send_event(struct lwan_request *request,
+                                struct lwan_pubsub_msg *msg)
+{
+    struct coro *coro = request->conn->coro;
+    const struct lwan_value *event;
+    size_t generation;
+
+    /* Setting up the stream might allocate a compressor tied to this
+     * coroutine; do it before taking the generation so running the
+     * deferred statements below won't free it. */
+    if (!(request->flags & RESPONSE_SENT_HEADERS) &&
+        UNLIKELY(!lwan_response_set_event_stream(request, HTTP_OK))) {
+        lwan_pubsub_msg_done(msg);
+        return;
+    }
+
+    generation = coro_deferred_get_generation(coro);
+    event = get_encoded(&msg->event, request, msg, encode_event);
+
+    /* Writing might abort the coroutine, which runs this as well. */
+    coro_defer(coro, msg_done_defer, msg);
+
+    if (LIKELY(event)) {
+        lwan_response_send_framed_event(request, event);
+    } else if (lwan_strbuf_set(request->response.buffer, msg->value.value,
+                               msg->value.len)) {
+        lwan_response_send_event(request, NULL);
+    }
+
+    coro_deferred_run(coro, generation);
+}
+
+void lwan_pubsub_msg_websocket_write(struct lwan_request *request,
+                                     struct lwan_pubsub_msg *msg)
+{
+    struct coro *coro = request->conn->coro;
+    const size_t generation = coro_deferred_get_generation(coro);
+    const struct lwan_value *frame;
+
+    if (!request->helper->websocket_deflate) {
+        frame = get_encoded(&msg->websocket_frame, request, msg,
+                            encode_websocket_frame);
+    } else if (lwan_websocket_deflate_shareable(request)) {
+        frame = get_encoded(&msg->websocket_deflate_frame, request, msg,
+                            encode_websocket_deflate_frame);
+    } else {
+        /* Compressed with the context of this connection below. */
+        frame = NULL;
+    }
+
+    coro_defer(coro, msg_done_defer, msg);
+
+    if (LIKELY(frame)) {
+        lwan_response_websocket_write_frame(request, frame);
+    } else if (lwan_strbuf_set(request->response.buffer, msg->value.value,
+                               msg->value.len)) {
+        lwan_response_websocket_write(request);
+    }
+
+    coro_deferred_run(coro, generation);
+}
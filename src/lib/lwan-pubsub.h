@@ -25,10 +25,24 @@
 struct lwan_pubsub_topic;
 struct lwan_pubsub_msg;
 struct lwan_pubsub_subscriber;
+struct lwan_pubsub_bridge;
 
 struct lwan_pubsub_topic *lwan_pubsub_new_topic(void);
+/* Subscribers of bounded topics that have more than max_pending messages
+ * waiting to be consumed are considered too slow: they stop receiving
+ * messages, and lwan_pubsub_subscriber_overrun() returns true for them, so
+ * they can be disconnected instead of holding on to more memory. */
+struct lwan_pubsub_topic *lwan_pubsub_new_bounded_topic(unsigned int max_pending);
 void lwan_pubsub_free_topic(struct lwan_pubsub_topic *topic);
 
+/* Keep the last n_events messages published to a topic, numbered with
+ * increasing ids (sent as the id of server-sent events), so that clients
+ * that lose their connection can be sent what they missed when they come
+ * back, without rebuilding their state from elsewhere.  Must be called
+ * right after the topic is created. */
+bool lwan_pubsub_topic_keep_events(struct lwan_pubsub_topic *topic,
+                                   unsigned int n_events);
+
 bool lwan_pubsub_publish(struct lwan_pubsub_topic *topic,
                          const void *contents,
                          size_t len);
@@ -41,6 +55,101 @@ lwan_pubsub_subscribe(struct lwan_pubsub_topic *topic);
 void lwan_pubsub_unsubscribe(struct lwan_pubsub_topic *topic,
                              struct lwan_pubsub_subscriber *sub);
 
+/* Subscribe to a topic that keeps events, with the kept messages published
+ * after last_event_id already queued.  If some of them aren't kept anymore
+ * (or the id is unknown, e.g. because the server restarted), whatever is
+ * kept is queued, and lwan_pubsub_subscriber_missed_events() returns true,
+ * so that the handler can fall back to sending the whole state. */
+struct lwan_pubsub_subscriber *
+lwan_pubsub_subscribe_since(struct lwan_pubsub_topic *topic,
+                            uint64_t last_event_id);
+/* Resumes from the Last-Event-ID header that EventSource clients send when
+ * reconnecting, if any; otherwise, same as lwan_pubsub_subscribe(). */
+struct lwan_pubsub_subscriber *
+lwan_pubsub_subscribe_request(struct lwan_pubsub_topic *topic,
+                              struct lwan_request *request);
+bool lwan_pubsub_subscriber_missed_events(
+    const struct lwan_pubsub_subscriber *sub);
+
 struct lwan_pubsub_msg *lwan_pubsub_consume(struct lwan_pubsub_subscriber *sub);
+bool lwan_pubsub_subscriber_overrun(const struct lwan_pubsub_subscriber *sub);
+
+/* Suspend the coroutine handling a request until a message is published for
+ * a subscriber, or until timeout_ms milliseconds pass (keep it under the
+ * keep-alive timeout, or the connection will be closed while waiting; 0
+ * waits for as long as the connection isn't closed).
+ * Returns right away if messages are waiting to be consumed.  If
+ * wake_on_read is true, the coroutine is also resumed when the client sends
+ * something (e.g. a websocket frame). */
+void lwan_pubsub_wait(struct lwan_request *request,
+                      struct lwan_pubsub_subscriber *sub,
+                      uint64_t timeout_ms,
+                      bool wake_on_read);
 const struct lwan_value *lwan_pubsub_msg_value(const struct lwan_pubsub_msg *msg);
 void lwan_pubsub_msg_done(struct lwan_pubsub_msg *msg);
+
+/* Send a message to a subscriber as a server-sent event or as a websocket
+ * text frame.  Each message is framed only once, no matter how many
+ * subscribers it is sent to.  Both release the message (as in
+ * lwan_pubsub_msg_done()), even if the connection is closed while writing. */
+void lwan_pubsub_msg_send_event(struct lwan_request *request,
+                                struct lwan_pubsub_msg *msg);
+void lwan_pubsub_msg_websocket_write(struct lwan_request *request,
+                                     struct lwan_pubsub_msg *msg);
+
+/* Broadcast every message published for a subscriber to a websocket
+ * connection, until the client sends something.  Returns 0 once a message
+ * from the client is in the response buffer, ENOBUFS if the subscriber has
+ * been overrun, or any other error lwan_response_websocket_read() returns. */
+int lwan_pubsub_websocket_read(struct lwan_request *request,
+                               struct lwan_pubsub_subscriber *sub);
+
+/* Bridges relay messages published to a topic to the same topic in other
+ * nodes, through some external transport, and publish messages coming
+ * from other nodes locally, so that clients of a topic don't have to be
+ * connected to the same node.  Each node has a single subscription to the
+ * transport per topic, and messages are fanned out to local subscribers as
+ * usual.  A thread per bridge does the talking to the transport, sending
+ * messages published in the meantime in batches.
+ *
+ * Transports implement the functions below, called from the bridge thread:
+ * send() is given messages published locally; receive() is called when the
+ * file descriptor returned by get_fd() is readable, and passes every message
+ * that arrived to lwan_pubsub_bridge_deliver().  get_fd() is called before
+ * the bridge thread waits for something to happen, at least every second,
+ * and can return -1 (e.g. while reconnecting).  Messages that can't be
+ * sent are dropped: delivery to other nodes is only as reliable as the
+ * transport, and message ids used by lwan_pubsub_subscribe_since() are
+ * only meaningful within a node. */
+struct lwan_pubsub_bridge_ops {
+    bool (*send)(void *data, const struct lwan_value *msgs[], size_t n_msgs);
+    bool (*receive)(void *data, struct lwan_pubsub_bridge *bridge);
+    int (*get_fd)(void *data);
+    void (*destroy)(void *data);
+};
+
+/* A topic has at most one bridge, which is freed along with the topic if
+ * lwan_pubsub_bridge_free() isn't called before that.  On failure, data is
+ * destroyed with ops->destroy(). */
+struct lwan_pubsub_bridge *
+lwan_pubsub_bridge_new(struct lwan_pubsub_topic *topic,
+                       const struct lwan_pubsub_bridge_ops *ops,
+                       void *data);
+void lwan_pubsub_bridge_free(struct lwan_pubsub_bridge *bridge);
+bool lwan_pubsub_bridge_deliver(struct lwan_pubsub_bridge *bridge,
+                                const void *contents,
+                                size_t len);
+
+/* Bridges a topic through UDP multicast: address is a multicast group and
+ * port (e.g. "239.255.76.67:47001" or "[ff15::4c77]:47001"), joined by
+ * every node, and channel tells topics sharing a group apart.  Messages
+ * are packed in datagrams of up to 1400 bytes, or sent in a datagram of
+ * their own if larger, as long as they fit in a single UDP datagram.
+ * Datagrams can be lost or reordered, so this is best suited to messages
+ * that can be missed (e.g. presence, or notifications that clients can
+ * catch up with otherwise).  Multicast packets aren't routed beyond the
+ * local network. */
+struct lwan_pubsub_bridge *
+lwan_pubsub_bridge_new_udp_multicast(struct lwan_pubsub_topic *topic,
+                                     const char *address,
+                                     const char *channel);
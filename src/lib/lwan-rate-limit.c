@@ -0,0 +1,301 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "int-to-str.h"
+#include "lwan-config.h"
+#include "lwan-rate-limit.h"
+#include "murmur3.h"
+
+/* Tokens are kept in fixed point, so that fractional rates work. */
+#define TOKEN_SHIFT 16
+#define TOKEN (1u << TOKEN_SHIFT)
+
+#define DEFAULT_TABLE_SIZE 16384
+#define MAX_TABLE_SIZE (1 << 24)
+
+/* Buckets aren't keyed: requests are hashed into a fixed-size table of
+ * buckets, and requests with keys that collide share a bucket, making this
+ * stricter than it should be every once in a while.  Each bucket is a
+ * single 64-bit word (the time it was last updated, in milliseconds, and
+ * the number of tokens left), updated with compare-and-swap, so there's no
+ * locking nor allocation while handling requests. */
+struct lwan_rate_limit {
+    uint64_t *buckets;
+    uint32_t mask;
+    uint32_t seed;
+
+    uint32_t capacity;      /* burst << TOKEN_SHIFT */
+    uint32_t refill_per_ms; /* In 1/TOKEN units */
+
+    /* NULL to use the remote address */
+    char *header;
+
+    char retry_after[INT_TO_STR_BUFFER_SIZE];
+    struct lwan_key_value response_headers[2];
+};
+
+static const char too_many_requests[] = "429 Too many requests\n";
+
+static uint32_t get_seed(const void *fallback)
+{
+    uint32_t value;
+
+#if defined(SYS_getrandom)
+    if (syscall(SYS_getrandom, &value, sizeof(value), 0) == sizeof(value))
+        return value;
+#endif
+
+    /* Randomized by ASLR, at least. */
+    value = (uint32_t)(uintptr_t)fallback;
+    return value ^ (uint32_t)time(NULL);
+}
+
+/* Avoids linking with libm just for ceil(). */
+static long ceil_long(double value)
+{
+    long ret = (long)value;
+
+    return (double)ret < value ? ret + 1 : ret;
+}
+
+static uint32_t round_up_power_of_2(uint32_t n)
+{
+    return n <= 1 ? 1 : 1u << (32 - __builtin_clz(n - 1));
+}
+
+struct lwan_rate_limit *lwan_rate_limit_new_from_config(struct config *c)
+{
+    const struct config_line *l;
+    double rate = 0;
+    long burst = 0;
+    long table_size = DEFAULT_TABLE_SIZE;
+    char *header = NULL;
+    struct lwan_rate_limit *rl;
+
+    while ((l = config_read_line(c))) {
+        switch (l->type) {
+        case CONFIG_LINE_TYPE_LINE:
+            if (streq(l->key, "requests_per_second")) {
+                char *end;
+
+                rate = strtod(l->value, &end);
+                if (*end || !(rate >= 0.001 && rate <= 1e6)) {
+                    config_error(c, "Invalid rate: %s", l->value);
+                    goto error;
+                }
+            } else if (streq(l->key, "burst")) {
+                burst = parse_long(l->value, 0);
+                if (burst <= 0 || burst > 65535) {
+                    config_error(c, "Burst must be between 1 and 65535");
+                    goto error;
+                }
+            } else if (streq(l->key, "table_size")) {
+                table_size = parse_long(l->value, 0);
+                if (table_size <= 0 || table_size > MAX_TABLE_SIZE) {
+                    config_error(c, "Table size must be between 1 and %d",
+                                 MAX_TABLE_SIZE);
+                    goto error;
+                }
+            } else if (streq(l->key, "key")) {
+                free(header);
+                header = NULL;
+
+                if (!strncmp(l->value, "header:", sizeof("header:") - 1)) {
+                    header = strdup(l->value + sizeof("header:") - 1);
+                    if (!header || !*header) {
+                        config_error(c, "Invalid header name");
+                        goto error;
+                    }
+                } else if (!streq(l->value, "remote_address")) {
+                    config_error(c, "Unknown rate limit key: %s", l->value);
+                    goto error;
+                }
+            } else {
+                config_error(c, "Unknown rate limit option: %s", l->key);
+                goto error;
+            }
+            break;
+
+        case CONFIG_LINE_TYPE_SECTION:
+            config_error(c, "Unexpected section: %s", l->key);
+            goto error;
+
+        case CONFIG_LINE_TYPE_SECTION_END:
+            goto create;
+        }
+    }
+
+    config_error(c, "Could not find end of rate limit section");
+    goto error;
+
+create:
+    if (rate == 0) {
+        config_error(c, "Rate limit needs requests_per_second");
+        goto error;
+    }
+    if (!burst)
+        burst = LWAN_MIN(ceil_long(rate), 65535l);
+
+    rl = calloc(1, sizeof(*rl));
+    if (!rl)
+        goto error;
+
+    table_size = (long)round_up_power_of_2((uint32_t)table_size);
+    rl->buckets = calloc((size_t)table_size, sizeof(*rl->buckets));
+    if (!rl->buckets) {
+        free(rl);
+        goto error;
+    }
+
+    rl->mask = (uint32_t)table_size - 1;
+    rl->seed = get_seed(rl);
+    rl->header = header;
+    rl->capacity = (uint32_t)burst << TOKEN_SHIFT;
+    rl->refill_per_ms = (uint32_t)LWAN_MAX(rate * TOKEN / 1000.0, 1.0);
+
+    size_t len;
+    rl->response_headers[0] = (struct lwan_key_value){
+        .key = "Retry-After",
+        .value = uint_to_string((size_t)ceil_long(1.0 / rate), rl->retry_after,
+                                &len),
+    };
+
+    return rl;
+
+error:
+    free(header);
+    return NULL;
+}
+
+void lwan_rate_limit_free(struct lwan_rate_limit *rl)
+{
+    if (rl) {
+        free(rl->buckets);
+        free(rl->header);
+        free(rl);
+    }
+}
+
+static uint64_t hash_remote_address(const struct lwan_rate_limit *rl,
+                                    struct lwan_request *request)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if (request->flags & REQUEST_PROXIED) {
+        memcpy(&addr, &request->proxy->from, sizeof(request->proxy->from));
+    } else if (UNLIKELY(getpeername(request->fd, (struct sockaddr *)&addr,
+                                    &len) < 0)) {
+        return 0;
+    }
+
+    if (addr.ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)&addr;
+        return murmur3_64(&in->sin_addr, sizeof(in->sin_addr), rl->seed);
+    }
+
+    if (addr.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)&addr;
+        return murmur3_64(&in6->sin6_addr, sizeof(in6->sin6_addr), rl->seed);
+    }
+
+    /* Peers of a Unix domain socket have no address to tell them apart, so
+     * they all share the same bucket, as requests with no address do. */
+    return 0;
+}
+
+static uint64_t hash_request(const struct lwan_rate_limit *rl,
+                             struct lwan_request *request)
+{
+    if (rl->header) {
+        const char *value = lwan_request_get_header(request, rl->header);
+
+        /* Requests without the header are limited by their address. */
+        if (value)
+            return murmur3_64(value, strlen(value), rl->seed);
+    }
+
+    return hash_remote_address(rl, request);
+}
+
+static uint32_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(monotonic_clock_id, &ts);
+
+    /* Truncated: only differences between timestamps are used.  0 marks
+     * buckets that have never been used, so avoid it. */
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000) | 1;
+}
+
+bool lwan_rate_limit_request(struct lwan_rate_limit *rl,
+                             struct lwan_request *request)
+{
+    uint64_t *bucket = &rl->buckets[hash_request(rl, request) & rl->mask];
+    const uint32_t now = now_ms();
+    uint64_t old = ATOMIC_READ(*bucket);
+    uint64_t new;
+
+    do {
+        uint32_t stamp = now;
+        uint64_t tokens;
+
+        if (!old) {
+            tokens = rl->capacity;
+        } else {
+            const int32_t elapsed = (int32_t)(now - (uint32_t)(old >> 32));
+
+            if (elapsed < 0) {
+                /* Another thread got here with a newer timestamp. */
+                stamp = (uint32_t)(old >> 32);
+                tokens = (uint32_t)old;
+            } else {
+                tokens = (uint32_t)old + (uint64_t)elapsed * rl->refill_per_ms;
+                if (tokens > rl->capacity)
+                    tokens = rl->capacity;
+            }
+        }
+
+        if (tokens < TOKEN)
+            goto reject;
+
+        new = (uint64_t)stamp << 32 | (tokens - TOKEN);
+    } while (!__atomic_compare_exchange_n(bucket, &old, new, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return true;
+
+reject:
+    request->response.mime_type = "text/plain";
+    request->response.headers = rl->response_headers;
+    lwan_strbuf_set_static(request->response.buffer, too_many_requests,
+                           sizeof(too_many_requests) - 1);
+    return false;
+}
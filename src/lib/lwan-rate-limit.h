@@ -0,0 +1,42 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "lwan.h"
+
+struct lwan_rate_limit;
+struct config;
+
+/* Parses a `rate_limit` section inside a prefix section. */
+struct lwan_rate_limit *lwan_rate_limit_new_from_config(struct config *c);
+void lwan_rate_limit_free(struct lwan_rate_limit *rate_limit);
+
+/* Takes a token from the bucket the request falls into.  If there are no
+ * tokens left, the response is set to a prerendered 429 response, and
+ * false is returned. */
+bool lwan_rate_limit_request(struct lwan_rate_limit *rate_limit,
+                             struct lwan_request *request);
+
+static inline bool
+lwan_rate_limit_urlmap(struct lwan_request *request,
+                       const struct lwan_url_map *url_map)
+{
+    return lwan_rate_limit_request(url_map->rate_limit, request);
+}
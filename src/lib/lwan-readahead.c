@@ -20,6 +20,8 @@
 
 #define _GNU_SOURCE
 #include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <fcntl.h>
@@ -27,17 +29,21 @@
 #include <sys/mman.h>
 
 #include "lwan-private.h"
-
-#if defined(__linux__) && defined(O_DIRECT) && O_DIRECT
-#define PIPE_DIRECT_FLAG O_DIRECT
-#else
-#define PIPE_DIRECT_FLAG 0
-#endif
+#include "lwan-probes.h"
+
+/* Commands are queued by the I/O threads in a ring protected by a mutex,
+ * and taken by the readahead threads in batches.  A command for a range
+ * that's adjacent to, or overlaps with, a range that has been recently
+ * queued for the same file (or mapping) extends that range instead of
+ * taking another slot.  Readahead is just a hint, so commands are dropped
+ * if the ring is full. */
+#define QUEUE_SIZE 256
+#define BATCH_SIZE 16
+#define COALESCE_WINDOW 8
 
 enum readahead_cmd {
     READAHEAD,
     MADVISE,
-    SHUTDOWN,
 };
 
 struct lwan_readahead_cmd {
@@ -53,10 +59,25 @@ struct lwan_readahead_cmd {
             size_t length;
         } madvise;
     };
-} __attribute__((packed));
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    struct lwan_readahead_cmd cmds[QUEUE_SIZE];
+    unsigned int head, tail; /* Free-running; head == tail if empty */
+
+    struct lwan_readahead_stats stats;
+
+    pthread_t *threads;
+    unsigned int n_threads;
+    bool running;
+} queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
 
-static int readahead_pipe_fd[2] = {-1, -1};
-static pthread_t readahead_self;
 static long page_size = PAGE_SIZE;
 
 #ifdef _SC_PAGESIZE
@@ -69,24 +90,140 @@ __attribute__((constructor)) static void get_page_size(void)
 }
 #endif
 
-void lwan_readahead_shutdown(void)
+#if defined(__linux__)
+void lwan_readahead_set_affinity(const cpu_set_t *set)
 {
-    struct lwan_readahead_cmd cmd = {
-        .cmd = SHUTDOWN,
-    };
+    for (unsigned int i = 0; i < queue.n_threads; i++) {
+        if (pthread_setaffinity_np(queue.threads[i], sizeof(*set), set))
+            lwan_status_warning("Could not set affinity for readahead thread");
+    }
+}
+#endif
 
-    if (readahead_pipe_fd[0] == readahead_pipe_fd[1] &&
-        readahead_pipe_fd[0] == -1)
+void lwan_readahead_shutdown(void)
+{
+    if (!queue.n_threads)
         return;
 
-    lwan_status_debug("Shutting down readahead thread");
+    lwan_status_debug("Shutting down readahead threads");
+
+    pthread_mutex_lock(&queue.lock);
+    queue.running = false;
+    pthread_cond_broadcast(&queue.cond);
+    pthread_mutex_unlock(&queue.lock);
 
-    write(readahead_pipe_fd[1], &cmd, sizeof(cmd));
-    pthread_join(readahead_self, NULL);
+    for (unsigned int i = 0; i < queue.n_threads; i++)
+        pthread_join(queue.threads[i], NULL);
 
-    close(readahead_pipe_fd[0]);
-    close(readahead_pipe_fd[1]);
-    readahead_pipe_fd[0] = readahead_pipe_fd[1] = -1;
+    lwan_status_debug("Readahead queue: %" PRIu64 " commands queued, "
+                      "%" PRIu64 " coalesced, %" PRIu64 " dropped, "
+                      "maximum depth of %u",
+                      queue.stats.queued, queue.stats.coalesced,
+                      queue.stats.dropped, queue.stats.max_depth);
+
+    free(queue.threads);
+    queue.threads = NULL;
+    queue.n_threads = 0;
+    queue.head = queue.tail = 0;
+}
+
+void lwan_readahead_get_stats(struct lwan_readahead_stats *stats)
+{
+    pthread_mutex_lock(&queue.lock);
+    *stats = queue.stats;
+    stats->depth = queue.tail - queue.head;
+    pthread_mutex_unlock(&queue.lock);
+}
+
+static bool extend_range(uintptr_t *start,
+                         size_t *len,
+                         uintptr_t new_start,
+                         size_t new_len)
+{
+    const uintptr_t end = *start + *len;
+    const uintptr_t new_end = new_start + new_len;
+
+    if (new_start > end || new_end < *start)
+        return false;
+
+    *start = LWAN_MIN(*start, new_start);
+    *len = LWAN_MAX(end, new_end) - *start;
+    return true;
+}
+
+static bool coalesce(struct lwan_readahead_cmd *queued,
+                     const struct lwan_readahead_cmd *cmd)
+{
+    uintptr_t start;
+    size_t len;
+
+    if (queued->cmd != cmd->cmd)
+        return false;
+
+    switch (cmd->cmd) {
+    case READAHEAD:
+        if (queued->readahead.fd != cmd->readahead.fd)
+            return false;
+
+        start = (uintptr_t)queued->readahead.off;
+        len = queued->readahead.size;
+        if (!extend_range(&start, &len, (uintptr_t)cmd->readahead.off,
+                          cmd->readahead.size))
+            return false;
+
+        queued->readahead.off = (off_t)start;
+        queued->readahead.size = len;
+        return true;
+
+    case MADVISE:
+        start = (uintptr_t)queued->madvise.addr;
+        len = queued->madvise.length;
+        if (!extend_range(&start, &len, (uintptr_t)cmd->madvise.addr,
+                          cmd->madvise.length))
+            return false;
+
+        queued->madvise.addr = (void *)start;
+        queued->madvise.length = len;
+        return true;
+    }
+
+    return false;
+}
+
+static void enqueue(const struct lwan_readahead_cmd *cmd)
+{
+    unsigned int depth;
+
+    pthread_mutex_lock(&queue.lock);
+
+    if (UNLIKELY(!queue.running))
+        goto out;
+
+    depth = queue.tail - queue.head;
+
+    for (unsigned int i = 1; i <= LWAN_MIN(depth, (unsigned int)COALESCE_WINDOW); i++) {
+        if (coalesce(&queue.cmds[(queue.tail - i) % QUEUE_SIZE], cmd)) {
+            queue.stats.coalesced++;
+            goto out;
+        }
+    }
+
+    if (UNLIKELY(depth == QUEUE_SIZE)) {
+        queue.stats.dropped++;
+        goto out;
+    }
+
+    queue.cmds[queue.tail++ % QUEUE_SIZE] = *cmd;
+    queue.stats.queued++;
+    if (depth + 1 > queue.stats.max_depth)
+        queue.stats.max_depth = depth + 1;
+
+    /* Threads only sleep when the queue is empty */
+    if (!depth)
+        pthread_cond_signal(&queue.cond);
+
+out:
+    pthread_mutex_unlock(&queue.lock);
 }
 
 void lwan_readahead_queue(int fd, off_t off, size_t size)
@@ -94,13 +231,10 @@ void lwan_readahead_queue(int fd, off_t off, size_t size)
     if (size < (size_t)page_size)
         return;
 
-    struct lwan_readahead_cmd cmd = {
+    enqueue(&(struct lwan_readahead_cmd){
         .readahead = {.size = size, .fd = fd, .off = off},
         .cmd = READAHEAD,
-    };
-
-    /* Readahead is just a hint.  Failing to write is not an error. */
-    write(readahead_pipe_fd[1], &cmd, sizeof(cmd));
+    });
 }
 
 void lwan_madvise_queue(void *addr, size_t length)
@@ -108,13 +242,10 @@ void lwan_madvise_queue(void *addr, size_t length)
     if (length < (size_t)page_size)
         return;
 
-    struct lwan_readahead_cmd cmd = {
+    enqueue(&(struct lwan_readahead_cmd){
         .madvise = {.addr = addr, .length = length},
         .cmd = MADVISE,
-    };
-
-    /* Madvise is just a hint.  Failing to write is not an error. */
-    write(readahead_pipe_fd[1], &cmd, sizeof(cmd));
+    });
 }
 
 static void *lwan_readahead_loop(void *data __attribute__((unused)))
@@ -127,101 +258,90 @@ static void *lwan_readahead_loop(void *data __attribute__((unused)))
     lwan_set_thread_name("readahead");
 
     while (true) {
-        struct lwan_readahead_cmd cmd[16];
-        ssize_t n_bytes = read(readahead_pipe_fd[0], cmd, sizeof(cmd));
-        ssize_t cmds;
-
-        if (UNLIKELY(n_bytes < 0)) {
-            if (errno == EAGAIN || errno == EINTR)
-                continue;
-            lwan_status_perror("Ignoring error while reading from pipe (%d)",
-                               readahead_pipe_fd[0]);
-            continue;
-#if PIPE_DIRECT_FLAG
-        } else if (UNLIKELY(n_bytes % (ssize_t)sizeof(cmd[0]))) {
-            lwan_status_warning("Ignoring readahead packet read of %zd bytes",
-                                n_bytes);
-            continue;
-#endif
+        struct lwan_readahead_cmd cmd[BATCH_SIZE];
+        unsigned int cmds;
+
+        pthread_mutex_lock(&queue.lock);
+        while (queue.head == queue.tail && queue.running)
+            pthread_cond_wait(&queue.cond, &queue.lock);
+        if (!queue.running) {
+            pthread_mutex_unlock(&queue.lock);
+            break;
         }
 
-        cmds = n_bytes / (ssize_t)sizeof(struct lwan_readahead_cmd);
-        for (ssize_t i = 0; i < cmds; i++) {
+        cmds = LWAN_MIN(queue.tail - queue.head, (unsigned int)BATCH_SIZE);
+        for (unsigned int i = 0; i < cmds; i++)
+            cmd[i] = queue.cmds[queue.head++ % QUEUE_SIZE];
+
+        /* Let another thread take the rest */
+        if (queue.head != queue.tail)
+            pthread_cond_signal(&queue.cond);
+        pthread_mutex_unlock(&queue.lock);
+
+        for (unsigned int i = 0; i < cmds; i++) {
             switch (cmd[i].cmd) {
             case READAHEAD:
+                LWAN_PROBE(readahead, cmd[i].readahead.fd,
+                           cmd[i].readahead.off, cmd[i].readahead.size);
                 readahead(cmd[i].readahead.fd, cmd[i].readahead.off,
                           cmd[i].readahead.size);
                 break;
             case MADVISE:
+                LWAN_PROBE(madvise, cmd[i].madvise.addr,
+                           cmd[i].madvise.length);
                 madvise(cmd[i].madvise.addr, cmd[i].madvise.length,
                         MADV_WILLNEED);
                 mlock(cmd[i].madvise.addr, cmd[i].madvise.length);
                 break;
-            case SHUTDOWN:
-                goto out;
             }
         }
     }
 
-out:
     return NULL;
 }
 
-void lwan_readahead_init(void)
+void lwan_readahead_init(unsigned int n_threads)
 {
-    int flags;
-
-    if (readahead_pipe_fd[0] != readahead_pipe_fd[1])
+    if (queue.n_threads)
         return;
 
-    lwan_status_debug("Initializing low priority readahead thread");
+    lwan_status_debug("Starting %u low priority readahead threads",
+                      n_threads);
 
-    if (pipe2(readahead_pipe_fd, O_CLOEXEC | PIPE_DIRECT_FLAG) < 0) {
-        lwan_status_warning("Could not create pipe for readahead queue");
+    queue.threads = calloc(n_threads, sizeof(*queue.threads));
+    if (!queue.threads) {
+        lwan_status_warning("Could not allocate readahead threads");
         goto disable_readahead;
     }
 
-    /* Only write side should be non-blocking. */
-    flags = fcntl(readahead_pipe_fd[1], F_GETFL);
-    if (flags < 0) {
-        lwan_status_warning(
-            "Could not get flags for readahead pipe write side");
-        goto disable_readahead_close_pipe;
-    }
-    if (fcntl(readahead_pipe_fd[1], F_SETFL, flags | O_NONBLOCK) < 0) {
-        lwan_status_warning(
-            "Could not set readahead write side to be no-blocking");
-        goto disable_readahead_close_pipe;
-    }
+    queue.running = true;
 
-    if (pthread_create(&readahead_self, NULL, lwan_readahead_loop, NULL)) {
-        lwan_status_warning("Could not create low-priority readahead thread");
-        goto disable_readahead_close_pipe;
-    }
+    for (unsigned int i = 0; i < n_threads; i++) {
+        if (pthread_create(&queue.threads[i], NULL, lwan_readahead_loop,
+                           NULL)) {
+            lwan_status_warning("Could not create low-priority readahead "
+                                "thread");
+            break;
+        }
+
+        queue.n_threads++;
 
 #ifdef SCHED_IDLE
-    struct sched_param sched_param = {.sched_priority = 0};
-    if (pthread_setschedparam(readahead_self, SCHED_IDLE, &sched_param) < 0)
-        lwan_status_perror(
-            "Could not set scheduling policy of readahead thread to idle");
+        struct sched_param sched_param = {.sched_priority = 0};
+        if (pthread_setschedparam(queue.threads[i], SCHED_IDLE,
+                                  &sched_param) < 0)
+            lwan_status_perror("Could not set scheduling policy of readahead "
+                               "thread to idle");
 #endif /* SCHED_IDLE */
+    }
 
-    return;
+    if (queue.n_threads)
+        return;
 
-disable_readahead_close_pipe:
-    close(readahead_pipe_fd[0]);
-    close(readahead_pipe_fd[1]);
+    queue.running = false;
+    free(queue.threads);
+    queue.threads = NULL;
 
 disable_readahead:
-    /* Set these to -1 just to ensure that even if the page_size check inside
-     * the enqueuing functions fail, we don't write stuff to a file descriptor
-     * that's not the readahead queue. */
-    readahead_pipe_fd[0] = readahead_pipe_fd[1] = -1;
-
-    /* If page_size is 0, then the enqueuing functions won't write to the pipe.
-     * This way, we don't need to introduce new checks there for
-     * this corner case of not being able to create/set up the pipe. */
-    page_size = 0;
-
     lwan_status_warning("Readahead thread has been disabled");
 }
@@ -20,6 +20,7 @@
 #define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
@@ -29,6 +30,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -36,13 +38,22 @@
 #include <sys/vfs.h>
 #include <unistd.h>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #include "lwan-private.h"
 
 #include "base64.h"
+#include "hash.h"
 #include "list.h"
+#include "lwan-access-log.h"
 #include "lwan-config.h"
 #include "lwan-http-authorize.h"
+#include "lwan-rate-limit.h"
+#include "lwan-response-cache.h"
 #include "lwan-io-wrappers.h"
+#include "lwan-probes.h"
 #include "sha1.h"
 
 #define HEADER_TERMINATOR_LEN (sizeof("\r\n") - 1)
@@ -258,6 +269,63 @@ static ALWAYS_INLINE char *identify_http_method(struct lwan_request *request,
     return NULL;
 }
 
+/* Kernels for cr_scanner_find() and find_url_escape(): each returns a mask
+ * with one bit set for each position of the bytes they're looking for in a
+ * block of SCAN_WIDTH bytes. */
+#if defined(__AVX2__)
+#define SCAN_WIDTH 32
+
+static ALWAYS_INLINE uint64_t cr_scan_block(const char *p)
+{
+    const __m256i block = _mm256_loadu_si256((const __m256i *)p);
+    const __m256i cmp = _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\r'));
+
+    return (uint32_t)_mm256_movemask_epi8(cmp);
+}
+
+static ALWAYS_INLINE uint64_t url_escape_scan_block(const char *p)
+{
+    const __m256i block = _mm256_loadu_si256((const __m256i *)p);
+    const __m256i cmp =
+        _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('%')),
+                        _mm256_cmpeq_epi8(block, _mm256_set1_epi8('+')));
+
+    return (uint32_t)_mm256_movemask_epi8(
+        _mm256_or_si256(cmp, _mm256_cmpeq_epi8(block, _mm256_setzero_si256())));
+}
+#elif defined(__SSE2__)
+/* Two 16-byte blocks at a time; with blocks this small, memchr() in most C
+ * libraries would be just as fast. */
+#define SCAN_WIDTH 32
+
+static ALWAYS_INLINE uint64_t cr_scan_block(const char *p)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lo = _mm_loadu_si128((const __m128i *)p);
+    const __m128i hi = _mm_loadu_si128((const __m128i *)(p + 16));
+
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, cr)) |
+           (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, cr)) << 16;
+}
+
+static ALWAYS_INLINE __m128i url_escape_cmp(__m128i block)
+{
+    const __m128i cmp = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('%')),
+                                     _mm_cmpeq_epi8(block, _mm_set1_epi8('+')));
+
+    return _mm_or_si128(cmp, _mm_cmpeq_epi8(block, _mm_setzero_si128()));
+}
+
+static ALWAYS_INLINE uint64_t url_escape_scan_block(const char *p)
+{
+    const __m128i lo = _mm_loadu_si128((const __m128i *)p);
+    const __m128i hi = _mm_loadu_si128((const __m128i *)(p + 16));
+
+    return (uint32_t)_mm_movemask_epi8(url_escape_cmp(lo)) |
+           (uint32_t)_mm_movemask_epi8(url_escape_cmp(hi)) << 16;
+}
+#endif
+
 static ALWAYS_INLINE char decode_hex_digit(char ch)
 {
     static const char hex_digit_tbl[256] = {
@@ -269,14 +337,41 @@ static ALWAYS_INLINE char decode_hex_digit(char ch)
     return hex_digit_tbl[(unsigned char)ch];
 }
 
-static ssize_t url_decode(char *str)
+/* Returns the first '%', '+', or NUL in [p, end), or end. */
+static ALWAYS_INLINE char *find_url_escape(char *p, char *end)
+{
+#if defined(SCAN_WIDTH)
+    for (; end - p >= SCAN_WIDTH; p += SCAN_WIDTH) {
+        const uint64_t mask = url_escape_scan_block(p);
+
+        if (mask)
+            return p + __builtin_ctzll(mask);
+    }
+#endif
+
+    for (; p < end; p++) {
+        if (*p == '%' || *p == '+' || *p == '\0')
+            return p;
+    }
+
+    return end;
+}
+
+static ssize_t url_decode(char *str, size_t len)
 {
     if (UNLIKELY(!str))
         return -EINVAL;
 
-    char *ch, *decoded;
-    for (decoded = ch = str; *ch; ch++) {
+    char *end = str + len;
+    /* Nothing has to be moved around until the first escape sequence. */
+    char *ch = find_url_escape(str, end);
+    char *decoded = ch;
+
+    while (ch < end && *ch) {
         if (*ch == '%') {
+            if (UNLIKELY(end - ch < 3))
+                return -EINVAL;
+
             char tmp =
                 (char)(decode_hex_digit(ch[1]) << 4 | decode_hex_digit(ch[2]));
 
@@ -284,18 +379,30 @@ static ssize_t url_decode(char *str)
                 return -EINVAL;
 
             *decoded++ = tmp;
-            ch += 2;
-        } else if (*ch == '+') {
-            *decoded++ = ' ';
+            ch += 3;
         } else {
-            *decoded++ = *ch;
+            *decoded++ = ' ';
+            ch++;
         }
+
+        char *next = find_url_escape(ch, end);
+        const size_t run_len = (size_t)(next - ch);
+
+        memmove(decoded, ch, run_len);
+        decoded += run_len;
+        ch = next;
     }
 
     *decoded = '\0';
     return (ssize_t)(decoded - str);
 }
 
+/* Arrays with up to this many elements are kept in the order the keys
+ * appeared in the request, and searched linearly by value_lookup(): for
+ * the usual handful of query parameters or cookies, that's cheaper than
+ * sorting them so they can be binary-searched. */
+#define KEY_VALUE_LINEAR_LOOKUP_MAX 32
+
 static int key_value_compare(const void *a, const void *b)
 {
     return strcmp(((const struct lwan_key_value *)a)->key,
@@ -313,12 +420,13 @@ reset_key_value_array(void *data)
 static void parse_key_values(struct lwan_request *request,
                              struct lwan_value *helper_value,
                              struct lwan_key_value_array *array,
-                             ssize_t (*decode_value)(char *value),
+                             ssize_t (*decode_value)(char *value,
+                                                     size_t len),
                              const char separator)
 {
     struct lwan_key_value *kv;
     char *ptr = helper_value->value;
-    const char *end = helper_value->value + helper_value->len;
+    char *end = helper_value->value + helper_value->len;
 
     if (!helper_value->len)
         return;
@@ -329,7 +437,7 @@ static void parse_key_values(struct lwan_request *request,
     coro_defer(request->conn->coro, reset_key_value_array, array);
 
     do {
-        char *key, *value;
+        char *key, *key_end, *value;
 
         while (*ptr == ' ' || *ptr == separator)
             ptr++;
@@ -338,16 +446,20 @@ static void parse_key_values(struct lwan_request *request,
 
         key = ptr;
         ptr = strsep_char(key, end, separator);
+        key_end = ptr ? LWAN_MIN(ptr - 1, end) : end;
 
         value = strsep_char(key, end, '=');
         if (UNLIKELY(!value)) {
             value = "";
-        } else if (UNLIKELY(decode_value(value) < 0)) {
+        } else if (UNLIKELY(decode_value(value, (size_t)(key_end - value)) <
+                            0)) {
             /* Disallow values that failed decoding, but allow empty values */
             goto error;
+        } else {
+            key_end = value - 1;
         }
 
-        if (UNLIKELY(decode_value(key) <= 0)) {
+        if (UNLIKELY(decode_value(key, (size_t)(key_end - key)) <= 0)) {
             /* Disallow keys that failed decoding, or empty keys */
             goto error;
         }
@@ -360,7 +472,8 @@ static void parse_key_values(struct lwan_request *request,
         kv->value = value;
     } while (ptr);
 
-    lwan_key_value_array_sort(array, key_value_compare);
+    if (lwan_key_value_array_len(array) > KEY_VALUE_LINEAR_LOOKUP_MAX)
+        lwan_key_value_array_sort(array, key_value_compare);
 
     return;
 
@@ -369,14 +482,16 @@ error:
 }
 
 static ssize_t
-identity_decode(char *input __attribute__((unused)))
+identity_decode(char *input __attribute__((unused)),
+                size_t len __attribute__((unused)))
 {
     return 1;
 }
 
 static void parse_cookies(struct lwan_request *request)
 {
-    const char *cookies = lwan_request_get_header(request, "Cookie");
+    const char *cookies =
+        lwan_request_get_header_by_id(request, LWAN_HEADER_COOKIE);
 
     if (!cookies)
         return;
@@ -491,6 +606,27 @@ __attribute__((noinline)) static void set_header_value(
     }
 }
 
+static ALWAYS_INLINE void
+index_well_known_header(struct lwan_request_parser_helper *helper,
+                        enum lwan_header_id id,
+                        const char *name,
+                        size_t name_len,
+                        const char *p,
+                        const char *end,
+                        size_t header_idx)
+{
+    /* The first 4 characters have been matched already by the caller. */
+    if (UNLIKELY((size_t)(end - p) < name_len + sizeof(": ") - 1))
+        return;
+    if (strncasecmp(p + 4, name + 4, name_len - 4))
+        return;
+    if (UNLIKELY(string_as_uint16(p + name_len) != STR2_INT(':', ' ')))
+        return;
+
+    if (LIKELY(!helper->well_known_headers[id]))
+        helper->well_known_headers[id] = (uint8_t)(header_idx + 1);
+}
+
 #define HEADER_LENGTH(hdr)                                                     \
     ({                                                                         \
         if (UNLIKELY(end - sizeof(hdr) + 1 < p))                               \
@@ -504,16 +640,73 @@ __attribute__((noinline)) static void set_header_value(
         set_header_value(&(helper->dest), end, p, header_len);                 \
     } while (0)
 
-static bool parse_headers(struct lwan_request_parser_helper *helper,
-                          char *buffer)
+/* Finds line terminators in the request headers.  Rather than calling
+ * memchr() once per header, a block of the buffer is compared at a time,
+ * and the position of every CR found in it is kept in a bitmask that's
+ * consumed by subsequent calls, so each byte is loaded only once. */
+struct cr_scanner {
+    char *block;
+    char *end;
+    uint64_t mask;
+};
+
+static ALWAYS_INLINE void
+cr_scanner_init(struct cr_scanner *s, char *start, char *end)
+{
+    *s = (struct cr_scanner){.block = start, .end = end};
+
+#if defined(SCAN_WIDTH)
+    if (LIKELY(end - start >= SCAN_WIDTH))
+        s->mask = cr_scan_block(start);
+#endif
+}
+
+/* Returns the first CR in [from, end), or NULL.  Calls must be made with
+ * increasing values for from. */
+static ALWAYS_INLINE char *cr_scanner_find(struct cr_scanner *s, char *from)
+{
+#if defined(SCAN_WIDTH)
+    while (true) {
+        for (; s->mask; s->mask &= s->mask - 1) {
+            char *cr = s->block + __builtin_ctzll(s->mask);
+
+            if (cr >= from)
+                return cr;
+        }
+
+        if (UNLIKELY(s->end - s->block < 2 * SCAN_WIDTH)) {
+            /* Not enough bytes left for another block; memchr() can deal
+             * with the tail without reading past the buffer. */
+            break;
+        }
+
+        s->block += SCAN_WIDTH;
+        s->mask = cr_scan_block(s->block);
+    }
+#endif
+
+    if (UNLIKELY(from >= s->end))
+        return NULL;
+    return memchr(from, '\r', (size_t)(s->end - from));
+}
+
+/* Finds where each header starts and where they end, which is all that's
+ * needed to serve most requests.  Only the Connection header is looked at,
+ * as it determines what happens to the connection once the response is
+ * sent; everything else is left to parse_headers(). */
+static bool scan_headers(struct lwan_request_parser_helper *helper,
+                         char *buffer)
 {
     char *buffer_end = helper->buffer->value + helper->buffer->len;
     char **header_start = helper->header_start;
     size_t n_headers = 0;
+    struct cr_scanner scanner;
     char *next_header;
 
+    cr_scanner_init(&scanner, buffer + 1, buffer_end);
+
     for (char *next_chr = buffer + 1;;) {
-        next_header = memchr(next_chr, '\r', (size_t)(buffer_end - next_chr));
+        next_header = cr_scanner_find(&scanner, next_chr);
 
         if (UNLIKELY(!next_header))
             return false;
@@ -530,6 +723,15 @@ static bool parse_headers(struct lwan_request_parser_helper *helper,
 
         /* Is there at least a space for a minimal (H)eader and a (V)alue? */
         if (LIKELY(next_header - next_chr >= (ptrdiff_t)(sizeof("H: V") - 1))) {
+            STRING_SWITCH_L (next_chr) {
+            case STR4_INT_L('C', 'o', 'n', 'n'):
+                if (next_header - next_chr >= (ptrdiff_t)sizeof("Connection") &&
+                    !strncasecmp(next_chr + 4, "ection", sizeof("ection") - 1))
+                    set_header_value(&helper->connection, next_header,
+                                     next_chr, sizeof("Connection") - 1);
+                break;
+            }
+
             header_start[n_headers++] = next_chr;
 
             if (UNLIKELY(n_headers >= N_HEADER_START - 1))
@@ -545,6 +747,15 @@ static bool parse_headers(struct lwan_request_parser_helper *helper,
     }
 
     header_start[n_headers] = next_header;
+    helper->n_header_start = n_headers;
+
+    return true;
+}
+
+static void classify_headers(struct lwan_request_parser_helper *helper)
+{
+    char **header_start = helper->header_start;
+    const size_t n_headers = helper->n_header_start;
 
     for (size_t i = 0; i < n_headers; i++) {
         char *p = header_start[i];
@@ -560,9 +771,6 @@ static bool parse_headers(struct lwan_request_parser_helper *helper,
                 break;
             }
             break;
-        case STR4_INT_L('C', 'o', 'n', 'n'):
-            SET_HEADER_VALUE(connection, "Connection");
-            break;
         case STR4_INT_L('C', 'o', 'n', 't'):
             p += HEADER_LENGTH("Content");
 
@@ -578,18 +786,43 @@ static bool parse_headers(struct lwan_request_parser_helper *helper,
         case STR4_INT_L('I', 'f', '-', 'M'):
             SET_HEADER_VALUE(if_modified_since.raw, "If-Modified-Since");
             break;
+        case STR4_INT_L('I', 'f', '-', 'N'):
+            SET_HEADER_VALUE(if_none_match, "If-None-Match");
+            break;
         case STR4_INT_L('R', 'a', 'n', 'g'):
             SET_HEADER_VALUE(range.raw, "Range");
             break;
+        case STR4_INT_L('T', 'r', 'a', 'n'):
+            SET_HEADER_VALUE(transfer_encoding, "Transfer-Encoding");
+            break;
+
+#define INDEX_WELL_KNOWN_HEADER(id_, name_, prefix_)                           \
+        case prefix_:                                                          \
+            index_well_known_header(helper, LWAN_HEADER_##id_, name_,          \
+                                    sizeof(name_) - 1, p, end, i);             \
+            break;
+
+        FOR_EACH_WELL_KNOWN_HEADER(INDEX_WELL_KNOWN_HEADER)
+
+#undef INDEX_WELL_KNOWN_HEADER
         }
     }
-
-    helper->n_header_start = n_headers;
-    return true;
 }
 #undef HEADER_LENGTH
 #undef SET_HEADER_VALUE
 
+/* Headers are only classified once something asks for one of them: most
+ * handlers don't, so parsing a request usually stops at scan_headers().
+ * Requests with a body are always classified, as reading the body depends
+ * on Content-Length and Transfer-Encoding. */
+static ALWAYS_INLINE void parse_headers(struct lwan_request *request)
+{
+    if (!(request->flags & REQUEST_PARSED_HEADERS)) {
+        classify_headers(request->helper);
+        request->flags |= REQUEST_PARSED_HEADERS;
+    }
+}
+
 static void parse_if_modified_since(struct lwan_request_parser_helper *helper)
 {
     static const size_t header_len =
@@ -692,13 +925,10 @@ parse_accept_encoding(struct lwan_request *request)
         case STR4_INT(' ','g','z','i'):
             request->flags |= REQUEST_ACCEPT_GZIP;
             break;
-#if defined(HAVE_ZSTD)
         case STR4_INT('z','s','t','d'):
         case STR4_INT(' ','z','s','t'):
             request->flags |= REQUEST_ACCEPT_ZSTD;
             break;
-#endif
-#if defined(HAVE_BROTLI)
         default:
             while (lwan_char_isspace(*p))
                 p++;
@@ -707,8 +937,12 @@ parse_accept_encoding(struct lwan_request *request)
             case STR2_INT('b', 'r'):
                 request->flags |= REQUEST_ACCEPT_BROTLI;
                 break;
+            case STR2_INT('d', 'c'):
+                if (p[2] == 'z' && (!p[3] || p[3] == ',' || p[3] == ';' ||
+                                    lwan_char_isspace(p[3])))
+                    request->flags |= REQUEST_ACCEPT_DCZ;
+                break;
             }
-#endif
         }
 
         if (!(p = strchr(p, ',')))
@@ -757,6 +991,9 @@ out:
     if (LIKELY(!(request->flags & REQUEST_IS_HTTP_1_0)))
         has_keep_alive = !has_close;
 
+    if (UNLIKELY(ATOMIC_READ(request->conn->thread->lwan->draining)))
+        has_keep_alive = false;
+
     if (has_keep_alive)
         request->conn->flags |= CONN_IS_KEEP_ALIVE;
     else
@@ -805,10 +1042,87 @@ try_another_file_name:
 }
 #endif
 
+/* Requests that don't fit in the buffer in the coroutine stack (e.g. those
+ * carrying large cookies) are moved to a buffer of max_request_header_size
+ * bytes, kept only until the request (and whatever has been pipelined
+ * after it) has been handled.  I/O threads keep a few of these around so
+ * that clients that always send large requests don't keep calling malloc()
+ * and free().  Like the stack buffer, these might be released by a thread
+ * other than the one that obtained them if the connection is moved. */
+#define REQUEST_BUFFER_POOL_DEPTH 16
+
+static __thread struct {
+    char *buffers[REQUEST_BUFFER_POOL_DEPTH];
+    unsigned int count;
+    bool enabled;
+} request_buffer_pool;
+
+void lwan_request_thread_init(void)
+{
+    request_buffer_pool.enabled = true;
+}
+
+void lwan_request_thread_shutdown(void)
+{
+    request_buffer_pool.enabled = false;
+
+    while (request_buffer_pool.count)
+        free(request_buffer_pool.buffers[--request_buffer_pool.count]);
+}
+
+static char *request_buffer_get(size_t size)
+{
+    if (request_buffer_pool.count)
+        return request_buffer_pool.buffers[--request_buffer_pool.count];
+
+    return malloc(size);
+}
+
+void lwan_request_buffer_put(char *buffer)
+{
+    if (request_buffer_pool.enabled &&
+        request_buffer_pool.count < REQUEST_BUFFER_POOL_DEPTH) {
+        request_buffer_pool.buffers[request_buffer_pool.count++] = buffer;
+        return;
+    }
+
+    free(buffer);
+}
+
+static bool spill_request_buffer(struct lwan_request *request,
+                                 struct lwan_value *buffer)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+    struct lwan_thread *t = request->conn->thread;
+    const size_t size = t->lwan->config.max_request_header_size;
+    char *spilled;
+
+    /* Only the buffer in the stack of process_request_coro() is moved, and
+     * only once; request bodies (and HTTP/2 streams) have buffers of their
+     * own, of the right size. */
+    if (buffer != helper->buffer ||
+        helper->buffer_size != REQUEST_BUFFER_SIZE ||
+        helper->buffer_size >= size)
+        return false;
+
+    spilled = request_buffer_get(size);
+    if (UNLIKELY(!spilled))
+        return false;
+
+    /* Nothing points to the buffer yet: it's only parsed once the whole
+     * request has been read. */
+    buffer->value = memcpy(spilled, buffer->value, buffer->len);
+    helper->buffer_size = size;
+    helper->error_when_n_packets = lwan_calculate_n_packets(size);
+    t->metrics.request_buffer_spills++;
+
+    return true;
+}
+
 static enum lwan_http_status
 client_read(struct lwan_request *request,
             struct lwan_value *buffer,
-            const size_t want_to_read,
+            size_t want_to_read,
             enum lwan_read_finalizer (*finalizer)(const struct lwan_value *buffer,
                                                   size_t want_to_read,
                                                   const struct lwan_request *request,
@@ -837,16 +1151,27 @@ client_read(struct lwan_request *request,
     for (buffer->len = 0;; n_packets++) {
         size_t to_read = (size_t)(want_to_read - buffer->len);
 
-        if (UNLIKELY(to_read == 0))
-            return HTTP_TOO_LARGE;
+        if (UNLIKELY(to_read == 0)) {
+            if (!spill_request_buffer(request, buffer))
+                return HTTP_TOO_LARGE;
+
+            want_to_read = helper->buffer_size - 1 /* -1 for NUL byte */;
+            to_read = (size_t)(want_to_read - buffer->len);
+        }
 
         ssize_t n = read(request->fd, buffer->value + buffer->len, to_read);
         if (UNLIKELY(n <= 0)) {
             if (n < 0) {
                 switch (errno) {
-                case EINTR:
                 case EAGAIN:
+                    lwan_connection_clear_ready(request->conn,
+                                                CONN_READY_READ);
+                    /* Fallthrough */
+                case EINTR:
 yield_and_read_again:
+                    /* The client might be waiting for these before
+                     * sending the rest of the request. */
+                    lwan_send_queued_responses(request);
                     coro_yield(request->conn->coro, CONN_CORO_WANT_READ);
                     continue;
                 }
@@ -862,6 +1187,8 @@ yield_and_read_again:
         }
 
         buffer->len += (size_t)n;
+        if ((size_t)n < to_read)
+            lwan_connection_clear_ready(request->conn, CONN_READY_READ);
 
 try_to_finalize:
         switch (finalizer(buffer, want_to_read, request, n_packets)) {
@@ -940,7 +1267,7 @@ static ALWAYS_INLINE enum lwan_http_status
 read_request(struct lwan_request *request)
 {
     return client_read(request, request->helper->buffer,
-                       DEFAULT_BUFFER_SIZE - 1 /* -1 for NUL byte */,
+                       request->helper->buffer_size - 1 /* -1 for NUL byte */,
                        read_request_finalizer);
 }
 
@@ -958,7 +1285,7 @@ body_data_finalizer(const struct lwan_value *buffer,
     /* For POST requests, the body can be larger, and due to small MTUs on
      * most ethernet connections, responding with a timeout solely based on
      * number of packets doesn't work.  Use keepalive timeout instead.  */
-    if (UNLIKELY(time(NULL) > helper->error_when_time))
+    if (UNLIKELY(lwan_clock_monotonic() > helper->error_when_time))
         return FINALIZER_TIMEOUT;
 
     /* In addition to time, also estimate the number of packets based on an
@@ -1051,7 +1378,7 @@ __attribute__((constructor)) static void initialize_temp_dir(void)
     temp_dir = get_temp_dir();
 }
 
-static int create_temp_file(void)
+int lwan_create_temp_file(void)
 {
     char template[PATH_MAX];
     mode_t prev_mask;
@@ -1114,7 +1441,7 @@ alloc_body_buffer(struct coro *coro, size_t size, bool allow_file)
     if (UNLIKELY(!allow_file))
         return NULL;
 
-    fd = create_temp_file();
+    fd = lwan_create_temp_file();
     if (UNLIKELY(fd < 0))
         return NULL;
 
@@ -1184,6 +1511,159 @@ get_remaining_body_data_length(struct lwan_request *request,
     return HTTP_OK;
 }
 
+static void send_continue_if_expected(struct lwan_request *request)
+{
+    if (!(request->flags & REQUEST_IS_HTTP_1_0)) {
+        /* §8.2.3 https://www.w3.org/Protocols/rfc2616/rfc2616-sec8.html */
+        const char *expect =
+            lwan_request_get_header_by_id(request, LWAN_HEADER_EXPECT);
+
+        if (expect && strncmp(expect, "100-", 4) == 0) {
+            static const char continue_header[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+            lwan_send(request, continue_header, sizeof(continue_header) - 1, 0);
+        }
+    }
+}
+
+#if defined(__linux__)
+struct spliced_body {
+    int file_fd;
+    int pipe_fd[2];
+};
+
+static void close_spliced_body(void *data)
+{
+    struct spliced_body *body = data;
+
+    close(body->file_fd);
+    close(body->pipe_fd[0]);
+    close(body->pipe_fd[1]);
+}
+
+/* Bodies large enough to go to a temporary file are moved there with
+ * splice(), through a pipe, rather than being read into a mapping of that
+ * file: pages go from the socket to the page cache without being copied
+ * to and from user space.  The file is mapped once the whole body is in. */
+static int splice_body_data(struct lwan_request *request,
+                            size_t total,
+                            size_t have)
+{
+    const struct lwan_config *config = &request->conn->thread->lwan->config;
+    struct lwan_request_parser_helper *helper = request->helper;
+    struct coro *coro = request->conn->coro;
+    struct file_backed_buffer *buf;
+    struct spliced_body *body;
+    const size_t remaining = total - have;
+    size_t spliced = 0;
+    loff_t offset = 0;
+    int n_packets = 0;
+    void *ptr;
+
+    body = coro_malloc_full(coro, sizeof(*body), close_spliced_body);
+    if (UNLIKELY(!body))
+        return -HTTP_INTERNAL_ERROR;
+
+    *body = (struct spliced_body){.file_fd = -1, .pipe_fd = {-1, -1}};
+
+    body->file_fd = lwan_create_temp_file();
+    if (UNLIKELY(body->file_fd < 0))
+        return -HTTP_INTERNAL_ERROR;
+    /* One extra byte for the NUL terminator, as in alloc_body_buffer() */
+    if (UNLIKELY(ftruncate(body->file_fd, (off_t)total + 1) < 0))
+        return -HTTP_INTERNAL_ERROR;
+    if (UNLIKELY(pipe2(body->pipe_fd, O_NONBLOCK | O_CLOEXEC) < 0))
+        return -HTTP_INTERNAL_ERROR;
+
+    /* Larger pipes mean fewer calls to splice(); it's fine if this fails,
+     * as it will if the size is above /proc/sys/fs/pipe-max-size. */
+    fcntl(body->pipe_fd[1], F_SETPIPE_SZ, 1 << 20);
+
+    while (offset < (loff_t)have) {
+        ssize_t written = pwrite(body->file_fd, helper->next_request + offset,
+                                 have - (size_t)offset, offset);
+
+        if (UNLIKELY(written < 0)) {
+            if (errno == EINTR)
+                continue;
+            return -HTTP_INTERNAL_ERROR;
+        }
+
+        offset += written;
+    }
+    helper->next_request = NULL;
+
+    helper->error_when_time =
+        lwan_clock_monotonic() + config->keep_alive_timeout;
+    helper->error_when_n_packets = lwan_calculate_n_packets(remaining);
+
+    while (spliced < remaining) {
+        ssize_t in_pipe = splice(request->fd, NULL, body->pipe_fd[1], NULL,
+                                 remaining - spliced,
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (UNLIKELY(in_pipe <= 0)) {
+            if (in_pipe < 0 && (errno == EAGAIN || errno == EINTR)) {
+                if (errno == EAGAIN)
+                    lwan_connection_clear_ready(request->conn,
+                                                CONN_READY_READ);
+                /* The client might be waiting for these before
+                 * sending the rest of the request. */
+                lwan_send_queued_responses(request);
+                coro_yield(coro, CONN_CORO_WANT_READ);
+                continue;
+            }
+
+            /* Client went away before sending the whole body */
+            coro_yield(coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+
+        spliced += (size_t)in_pipe;
+
+        while (in_pipe) {
+            ssize_t written = splice(body->pipe_fd[0], NULL, body->file_fd,
+                                     &offset, (size_t)in_pipe, SPLICE_F_MOVE);
+
+            if (UNLIKELY(written <= 0)) {
+                if (written < 0 && (errno == EAGAIN || errno == EINTR))
+                    continue;
+                return -HTTP_INTERNAL_ERROR;
+            }
+
+            in_pipe -= written;
+        }
+
+        switch (body_data_finalizer(&(struct lwan_value){.len = spliced},
+                                    remaining, request, ++n_packets)) {
+        case FINALIZER_DONE:
+        case FINALIZER_TRY_AGAIN:
+            break;
+        case FINALIZER_TIMEOUT:
+            return -HTTP_TIMEOUT;
+        }
+    }
+
+    ptr = mmap(NULL, total + 1, PROT_READ | PROT_WRITE, MAP_SHARED,
+               body->file_fd, 0);
+    if (UNLIKELY(ptr == MAP_FAILED))
+        return -HTTP_INTERNAL_ERROR;
+
+    buf = coro_malloc_full(coro, sizeof(*buf), free_body_buffer);
+    if (UNLIKELY(!buf)) {
+        munmap(ptr, total + 1);
+        return -HTTP_INTERNAL_ERROR;
+    }
+
+    buf->ptr = ptr;
+    buf->size = total + 1;
+
+    helper->body_data.value = ptr;
+    helper->body_data.len = total;
+    return HTTP_OK;
+}
+#endif
+
 static int read_body_data(struct lwan_request *request)
 {
     /* Holy indirection, Batman! */
@@ -1207,16 +1687,13 @@ static int read_body_data(struct lwan_request *request)
     if (status != HTTP_PARTIAL_CONTENT)
         return -(int)status;
 
-    if (!(request->flags & REQUEST_IS_HTTP_1_0)) {
-        /* §8.2.3 https://www.w3.org/Protocols/rfc2616/rfc2616-sec8.html */
-        const char *expect = lwan_request_get_header(request, "Expect");
-
-        if (expect && strncmp(expect, "100-", 4) == 0) {
-            static const char continue_header[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    send_continue_if_expected(request);
 
-            lwan_send(request, continue_header, sizeof(continue_header) - 1, 0);
-        }
-    }
+#if defined(__linux__)
+    if (allow_temp_file && total + 1 >= body_buffer_temp_file_thresh &&
+        !(request->conn->flags & (CONN_TLS | CONN_IS_HTTP2_STREAM)))
+        return splice_body_data(request, total, have);
+#endif
 
     new_buffer =
         alloc_body_buffer(request->conn->coro, total + 1, allow_temp_file);
@@ -1231,57 +1708,394 @@ static int read_body_data(struct lwan_request *request)
     }
     helper->next_request = NULL;
 
-    helper->error_when_time = time(NULL) + config->keep_alive_timeout;
+    helper->error_when_time =
+        lwan_clock_monotonic() + config->keep_alive_timeout;
     helper->error_when_n_packets = lwan_calculate_n_packets(total);
 
     struct lwan_value buffer = {.value = new_buffer, .len = total};
     return (int)client_read(request, &buffer, total, body_data_finalizer);
 }
 
-static char *
-parse_proxy_protocol(struct lwan_request *request, char *buffer)
-{
-    STRING_SWITCH(buffer) {
-    case STR4_INT('P','R','O','X'):
-        return parse_proxy_protocol_v1(request, buffer);
-    case STR4_INT('\x0D','\x0A','\x0D','\x0A'):
-        return parse_proxy_protocol_v2(request, buffer);
-    }
+/* Bodies for handlers with HANDLER_STREAMS_BODY_DATA are never buffered in
+ * their entirety: whatever followed the request headers in the request
+ * buffer is handed out first, and the rest is read from the socket as the
+ * handler asks for it.  Chunked bodies are decoded through a small window
+ * so that the framing can be stripped; other bodies are read straight into
+ * the buffer given by the handler. */
+#define BODY_STREAM_WINDOW_SIZE DEFAULT_BUFFER_SIZE
+
+enum body_stream_state {
+    BODY_STREAM_IDENTITY,
+    BODY_STREAM_CHUNK_SIZE,
+    BODY_STREAM_CHUNK_EXTENSION,
+    BODY_STREAM_CHUNK_DATA,
+    BODY_STREAM_CHUNK_DATA_CR,
+    BODY_STREAM_CHUNK_DATA_LF,
+    BODY_STREAM_TRAILER,
+    BODY_STREAM_DONE,
+    BODY_STREAM_ERROR,
+};
 
-    return buffer;
-}
+struct lwan_request_body_stream {
+    char *pos, *end;       /* Read from the socket, but not consumed yet */
+    char *window;          /* NULL while pos points to the request buffer */
+    size_t remaining;      /* In the whole body, or in the current chunk */
+    enum body_stream_state state;
+    int error;             /* errno value if state is BODY_STREAM_ERROR */
+    unsigned int n_digits; /* Chunk size digits parsed so far */
+    bool at_line_start;    /* Trailer: an empty line ends the body */
+    bool tried_continue;
+};
 
-static enum lwan_http_status parse_http_request(struct lwan_request *request)
+static enum lwan_http_status init_body_stream(struct lwan_request *request)
 {
     struct lwan_request_parser_helper *helper = request->helper;
-    char *buffer = helper->buffer->value;
+    struct lwan_request_body_stream *stream;
 
-    if (request->flags & REQUEST_ALLOW_PROXY_REQS) {
-        /* REQUEST_ALLOW_PROXY_REQS will be cleared in lwan_process_request() */
+    stream = coro_malloc(request->conn->coro, sizeof(*stream));
+    if (UNLIKELY(!stream))
+        return HTTP_INTERNAL_ERROR;
 
-        buffer = parse_proxy_protocol(request, buffer);
-        if (UNLIKELY(!buffer))
+    *stream = (struct lwan_request_body_stream){};
+
+    if (helper->transfer_encoding.value) {
+        /* A body with both is a request smuggling attempt. */
+        if (UNLIKELY(helper->content_length.value != NULL))
             return HTTP_BAD_REQUEST;
-    }
+        if (UNLIKELY(helper->transfer_encoding.len != sizeof("chunked") - 1 ||
+                     strncasecmp(helper->transfer_encoding.value, "chunked",
+                                 sizeof("chunked") - 1)))
+            return HTTP_NOT_IMPLEMENTED;
 
-    buffer = ignore_leading_whitespace(buffer);
+        stream->state = BODY_STREAM_CHUNK_SIZE;
+    } else if (helper->content_length.value) {
+        long long parsed_size =
+            parse_long_long(helper->content_length.value, -1);
 
-    if (UNLIKELY(buffer > helper->buffer->value + helper->buffer->len -
-                               MIN_REQUEST_SIZE))
-        return HTTP_BAD_REQUEST;
+        if (UNLIKELY(parsed_size < 0))
+            return HTTP_BAD_REQUEST;
 
-    char *path = identify_http_method(request, buffer);
-    if (UNLIKELY(!path))
-        return HTTP_NOT_ALLOWED;
+        stream->remaining = (size_t)parsed_size;
+        stream->state =
+            stream->remaining ? BODY_STREAM_IDENTITY : BODY_STREAM_DONE;
+    } else {
+        /* §3.3.3 of RFC7230: no body if neither header is present. */
+        stream->state = BODY_STREAM_DONE;
+    }
 
-    buffer = identify_http_path(request, path);
-    if (UNLIKELY(!buffer))
-        return HTTP_BAD_REQUEST;
+    /* Anything after the headers belongs to the body now; this is given
+     * back in finish_body_stream() if the body ends before that. */
+    if (helper->next_request) {
+        stream->pos = helper->next_request;
+        stream->end = helper->buffer->value + helper->buffer->len;
+        helper->next_request = NULL;
+    }
 
-    if (UNLIKELY(!parse_headers(helper, buffer)))
-        return HTTP_BAD_REQUEST;
+    helper->body_stream = stream;
+    return HTTP_OK;
+}
 
-    ssize_t decoded_len = url_decode(request->url.value);
+static void finish_body_stream(struct lwan_request *request)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+    struct lwan_request_body_stream *stream = helper->body_stream;
+
+    if (!stream)
+        return;
+
+    if (LIKELY(stream->state == BODY_STREAM_DONE)) {
+        if (stream->pos == stream->end)
+            return;
+
+        /* Pipelined request still in the request buffer. */
+        if (!stream->window) {
+            helper->next_request = stream->pos;
+            return;
+        }
+    }
+
+    /* The handler didn't read the whole body (or it couldn't be read), or
+     * part of the next request has been read into the window: the only
+     * way to find where the next request begins is to close the
+     * connection. */
+    request->conn->flags &= ~CONN_IS_KEEP_ALIVE;
+}
+
+static ssize_t body_stream_fail(struct lwan_request_body_stream *stream,
+                                int error)
+{
+    stream->state = BODY_STREAM_ERROR;
+    stream->error = error;
+    errno = error;
+    return -1;
+}
+
+static ssize_t body_stream_read(struct lwan_request *request,
+                                struct lwan_request_body_stream *stream,
+                                char *buf,
+                                size_t len)
+{
+    if (!stream->tried_continue) {
+        /* Only needed if the client is waiting for it, i.e. if there's
+         * nothing buffered yet. */
+        send_continue_if_expected(request);
+        stream->tried_continue = true;
+    }
+
+    while (true) {
+        ssize_t n = read(request->fd, buf, len);
+
+        if (LIKELY(n > 0)) {
+            if ((size_t)n < len)
+                lwan_connection_clear_ready(request->conn, CONN_READY_READ);
+            return n;
+        }
+
+        if (!n)
+            return body_stream_fail(stream, ECONNRESET);
+
+        switch (errno) {
+        case EAGAIN:
+            lwan_connection_clear_ready(request->conn, CONN_READY_READ);
+            lwan_send_queued_responses(request);
+            coro_yield(request->conn->coro, CONN_CORO_WANT_READ);
+            /* Fallthrough */
+        case EINTR:
+            continue;
+        }
+
+        return body_stream_fail(stream, errno);
+    }
+}
+
+static bool parse_chunk_size_digit(struct lwan_request_body_stream *stream,
+                                   char ch)
+{
+    size_t digit;
+
+    if (ch >= '0' && ch <= '9')
+        digit = (size_t)(ch - '0');
+    else if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f')
+        digit = (size_t)((ch | 0x20) - 'a' + 10);
+    else
+        return false;
+
+    if (UNLIKELY(stream->remaining > SIZE_MAX >> 4)) {
+        body_stream_fail(stream, EPROTO);
+        return true;
+    }
+
+    stream->remaining = stream->remaining << 4 | digit;
+    stream->n_digits++;
+    return true;
+}
+
+/* Consumes framing and data from [pos, end), copying at most len bytes of
+ * data to buf.  Returns the number of bytes copied. */
+static size_t decode_chunked(struct lwan_request_body_stream *stream,
+                             char *buf,
+                             size_t len)
+{
+    size_t copied = 0;
+
+    while (stream->pos < stream->end && copied < len) {
+        char ch = *stream->pos;
+
+        switch (stream->state) {
+        case BODY_STREAM_CHUNK_DATA: {
+            size_t n = LWAN_MIN(stream->remaining,
+                                LWAN_MIN((size_t)(stream->end - stream->pos),
+                                         len - copied));
+
+            memcpy(buf + copied, stream->pos, n);
+            copied += n;
+            stream->pos += n;
+            stream->remaining -= n;
+            if (!stream->remaining)
+                stream->state = BODY_STREAM_CHUNK_DATA_CR;
+            continue;
+        }
+
+        case BODY_STREAM_CHUNK_SIZE:
+            if (parse_chunk_size_digit(stream, ch))
+                break;
+            if (UNLIKELY(!stream->n_digits)) {
+                body_stream_fail(stream, EPROTO);
+                return copied;
+            }
+            stream->state = BODY_STREAM_CHUNK_EXTENSION;
+            continue; /* Don't consume ch */
+
+        case BODY_STREAM_CHUNK_EXTENSION:
+            /* Extensions are ignored, as allowed by §4.1.1 of RFC7230. */
+            if (ch != '\n')
+                break;
+            if (stream->remaining) {
+                stream->state = BODY_STREAM_CHUNK_DATA;
+            } else {
+                stream->state = BODY_STREAM_TRAILER;
+                stream->at_line_start = true;
+            }
+            break;
+
+        case BODY_STREAM_CHUNK_DATA_CR:
+            if (ch == '\r') {
+                stream->state = BODY_STREAM_CHUNK_DATA_LF;
+                break;
+            }
+            /* Fallthrough */
+        case BODY_STREAM_CHUNK_DATA_LF:
+            if (UNLIKELY(ch != '\n')) {
+                body_stream_fail(stream, EPROTO);
+                return copied;
+            }
+            stream->state = BODY_STREAM_CHUNK_SIZE;
+            stream->n_digits = 0;
+            break;
+
+        case BODY_STREAM_TRAILER:
+            /* Trailer fields aren't made available to the handler. */
+            if (ch == '\n') {
+                if (stream->at_line_start) {
+                    stream->state = BODY_STREAM_DONE;
+                    stream->pos++;
+                    return copied;
+                }
+                stream->at_line_start = true;
+            } else if (ch != '\r') {
+                stream->at_line_start = false;
+            }
+            break;
+
+        default:
+            return copied;
+        }
+
+        stream->pos++;
+    }
+
+    return copied;
+}
+
+ssize_t lwan_request_read_body(struct lwan_request *request,
+                               void *buf,
+                               size_t len)
+{
+    struct lwan_request_body_stream *stream = request->helper->body_stream;
+
+    if (UNLIKELY(!stream)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (UNLIKELY(!len))
+        return 0;
+
+    while (true) {
+        ssize_t n;
+
+        switch (stream->state) {
+        case BODY_STREAM_DONE:
+            return 0;
+
+        case BODY_STREAM_ERROR:
+            errno = stream->error;
+            return -1;
+
+        case BODY_STREAM_IDENTITY:
+            len = LWAN_MIN(len, stream->remaining);
+
+            if (stream->pos < stream->end) {
+                n = (ssize_t)LWAN_MIN(len, (size_t)(stream->end - stream->pos));
+                memcpy(buf, stream->pos, (size_t)n);
+                stream->pos += n;
+            } else {
+                n = body_stream_read(request, stream, buf, len);
+                if (UNLIKELY(n < 0))
+                    return n;
+            }
+
+            stream->remaining -= (size_t)n;
+            if (!stream->remaining)
+                stream->state = BODY_STREAM_DONE;
+            return n;
+
+        default:
+            if (stream->pos < stream->end) {
+                size_t copied = decode_chunked(stream, buf, len);
+
+                if (copied)
+                    return (ssize_t)copied;
+                continue;
+            }
+
+            if (!stream->window) {
+                stream->window =
+                    coro_malloc(request->conn->coro, BODY_STREAM_WINDOW_SIZE);
+                if (UNLIKELY(!stream->window))
+                    return body_stream_fail(stream, ENOMEM);
+            }
+
+            n = body_stream_read(request, stream, stream->window,
+                                 BODY_STREAM_WINDOW_SIZE);
+            if (UNLIKELY(n < 0))
+                return n;
+
+            stream->pos = stream->window;
+            stream->end = stream->window + n;
+        }
+    }
+}
+
+static char *
+parse_proxy_protocol(struct lwan_request *request, char *buffer)
+{
+    STRING_SWITCH(buffer) {
+    case STR4_INT('P','R','O','X'):
+        return parse_proxy_protocol_v1(request, buffer);
+    case STR4_INT('\x0D','\x0A','\x0D','\x0A'):
+        return parse_proxy_protocol_v2(request, buffer);
+    }
+
+    return buffer;
+}
+
+static enum lwan_http_status parse_http_request(struct lwan_request *request)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+    char *buffer = helper->buffer->value;
+
+    if (request->flags & REQUEST_ALLOW_PROXY_REQS) {
+        /* REQUEST_ALLOW_PROXY_REQS will be cleared in lwan_process_request() */
+
+        buffer = parse_proxy_protocol(request, buffer);
+        if (UNLIKELY(!buffer))
+            return HTTP_BAD_REQUEST;
+    }
+
+    buffer = ignore_leading_whitespace(buffer);
+
+    if (UNLIKELY(buffer > helper->buffer->value + helper->buffer->len -
+                               MIN_REQUEST_SIZE))
+        return HTTP_BAD_REQUEST;
+
+    /* Like REQUEST_ALLOW_PROXY_REQS, only set for the first request in a
+     * connection, which is where the HTTP/2 connection preface goes. */
+    if (UNLIKELY(request->flags & REQUEST_ALLOW_HTTP2) &&
+        lwan_http2_is_preface(buffer))
+        lwan_http2_serve(request, buffer);
+
+    char *path = identify_http_method(request, buffer);
+    if (UNLIKELY(!path))
+        return HTTP_NOT_ALLOWED;
+
+    buffer = identify_http_path(request, path);
+    if (UNLIKELY(!buffer))
+        return HTTP_BAD_REQUEST;
+
+    if (UNLIKELY(!scan_headers(helper, buffer)))
+        return HTTP_BAD_REQUEST;
+
+    ssize_t decoded_len = url_decode(request->url.value, request->url.len);
     if (UNLIKELY(decoded_len < 0))
         return HTTP_BAD_REQUEST;
     request->original_url.len = request->url.len = (size_t)decoded_len;
@@ -1305,12 +2119,14 @@ prepare_websocket_handshake(struct lwan_request *request, char **encoded)
     if (UNLIKELY(!(request->conn->flags & CONN_IS_UPGRADE)))
         return HTTP_BAD_REQUEST;
 
-    const char *upgrade = lwan_request_get_header(request, "Upgrade");
+    const char *upgrade =
+        lwan_request_get_header_by_id(request, LWAN_HEADER_UPGRADE);
     if (UNLIKELY(!upgrade || !streq(upgrade, "websocket")))
         return HTTP_BAD_REQUEST;
 
     const char *sec_websocket_key =
-        lwan_request_get_header(request, "Sec-WebSocket-Key");
+        lwan_request_get_header_by_id(request,
+                                      LWAN_HEADER_SEC_WEBSOCKET_KEY);
     if (UNLIKELY(!sec_websocket_key))
         return HTTP_BAD_REQUEST;
 
@@ -1333,6 +2149,7 @@ enum lwan_http_status
 lwan_request_websocket_upgrade(struct lwan_request *request)
 {
     char header_buf[DEFAULT_HEADERS_SIZE];
+    char extensions[128];
     size_t header_buf_len;
     char *encoded;
 
@@ -1347,6 +2164,11 @@ lwan_request_websocket_upgrade(struct lwan_request *request)
             /* Connection: Upgrade is implicit if conn->flags & CONN_IS_UPGRADE */
             {.key = "Sec-WebSocket-Accept", .value = encoded},
             {.key = "Upgrade", .value = "websocket"},
+            /* Terminates the array early if no extension was negotiated */
+            {.key = lwan_websocket_deflate_negotiate(request, extensions)
+                        ? "Sec-WebSocket-Extensions"
+                        : NULL,
+             .value = extensions},
             {},
         });
     free(encoded);
@@ -1372,6 +2194,15 @@ maybe_read_body_data(const struct lwan_url_map *url_map,
 {
     int status = 0;
 
+    if (url_map->flags & HANDLER_STREAMS_BODY_DATA) {
+        status = init_body_stream(request);
+        if (LIKELY(status == HTTP_OK))
+            return HTTP_OK;
+
+        request->conn->flags &= ~CONN_IS_KEEP_ALIVE;
+        return (enum lwan_http_status)status;
+    }
+
     if (url_map->flags & HANDLER_EXPECTS_BODY_DATA) {
         status = read_body_data(request);
         if (status > 0)
@@ -1402,13 +2233,25 @@ static enum lwan_http_status prepare_for_response(const struct lwan_url_map *url
         request->url.len--;
     }
 
+    if (UNLIKELY(url_map->flags & HANDLER_RATE_LIMITED)) {
+        if (!lwan_rate_limit_urlmap(request, url_map))
+            return HTTP_TOO_MANY_REQUESTS;
+    }
+
     if (UNLIKELY(url_map->flags & HANDLER_MUST_AUTHORIZE)) {
         if (!lwan_http_authorize_urlmap(request, url_map))
             return HTTP_NOT_AUTHORIZED;
     }
 
-    if (UNLIKELY(request_has_body(request)))
+    if (url_map->flags & HANDLER_COMPRESS_RESPONSE) {
+        request->flags |= RESPONSE_COMPRESS;
+        request->helper->compress_dict = url_map->compress_dict;
+    }
+
+    if (UNLIKELY(request_has_body(request))) {
+        parse_headers(request);
         return maybe_read_body_data(url_map, request);
+    }
 
     return HTTP_OK;
 }
@@ -1450,10 +2293,14 @@ static void log_request(struct lwan_request *request,
                         enum lwan_http_status status)
 {
     char ip_buffer[INET6_ADDRSTRLEN];
+    char date[30], expires[29];
+
+    lwan_clock_get_dates(date, expires);
+    date[29] = '\0';
 
     lwan_status_debug("%s [%s] \"%s %s HTTP/%s\" %d %s",
                       lwan_request_get_remote_address(request, ip_buffer),
-                      request->conn->thread->date.date,
+                      date,
                       get_request_method(request), request->original_url.value,
                       request->flags & REQUEST_IS_HTTP_1_0 ? "1.0" : "1.1",
                       status, request->response.mime_type);
@@ -1462,40 +2309,217 @@ static void log_request(struct lwan_request *request,
 #define log_request(...)
 #endif
 
+static void record_stack_usage(struct lwan_request *request,
+                               struct lwan_url_map *url_map)
+{
+    size_t used = coro_stack_high_water_mark(request->conn->coro);
+
+    if (!url_map)
+        return;
+
+    /* Shared by all I/O threads. */
+    for (size_t hwm = ATOMIC_READ(url_map->stack_high_water_mark); used > hwm;
+         hwm = ATOMIC_READ(url_map->stack_high_water_mark)) {
+        if (__sync_bool_compare_and_swap(&url_map->stack_high_water_mark, hwm,
+                                         used))
+            break;
+    }
+}
+
+static ALWAYS_INLINE uint64_t route_clock_us(void)
+{
+    struct timespec now;
+
+    /* monotonic_clock_id might be a coarse clock, which doesn't have enough
+     * resolution for this; CLOCK_MONOTONIC is read through the vDSO. */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000ull + (uint64_t)now.tv_nsec / 1000ull;
+}
+
+static void record_route_stats(struct lwan_request *request,
+                               struct lwan_url_map *url_map,
+                               uint64_t t_start,
+                               uint64_t t_parsed,
+                               uint64_t t_handled)
+{
+    const uint64_t t_written = route_clock_us();
+
+    /* Errors before the handler runs are counted as parsing time. */
+    if (!t_handled)
+        t_handled = t_parsed = t_written;
+
+    lwan_route_stats_record(request, url_map,
+                            (const uint64_t[LWAN_ROUTE_N]){
+                                [LWAN_ROUTE_PARSE] = t_parsed - t_start,
+                                [LWAN_ROUTE_HANDLER] = t_handled - t_parsed,
+                                [LWAN_ROUTE_WRITE] = t_written - t_handled,
+                                [LWAN_ROUTE_BYTES_OUT] =
+                                    request->helper->bytes_sent,
+                            });
+}
+
+static ALWAYS_INLINE void count_response(struct lwan_request *request,
+                                         enum lwan_http_status status)
+{
+    struct lwan_thread_metrics *metrics = &request->conn->thread->metrics;
+    unsigned int class = (unsigned int)status / 100 - 1;
+
+    metrics->requests++;
+    if (LIKELY(class < N_ELEMENTS(metrics->responses)))
+        metrics->responses[class]++;
+}
+
+static struct lwan_trie *find_url_map_trie(const struct lwan_listener *listener,
+                                           struct lwan_request *request)
+{
+    char name[LWAN_VIRTUAL_HOST_NAME_MAX];
+    struct lwan_trie *trie;
+    const char *host;
+    size_t len;
+
+    if (LIKELY(!listener->virtual_hosts))
+        return (struct lwan_trie *)&listener->url_map_trie;
+
+    /* Well-known headers such as Host are located in a single pass the
+     * first time any of them is looked up. */
+    host = lwan_request_get_header_by_id(request, LWAN_HEADER_HOST);
+    if (UNLIKELY(!host))
+        goto not_found;
+
+    /* Host names are case-insensitive; strip the port (taking care of
+     * IPv6 literals) and any trailing dot as well. */
+    for (len = 0; host[len] && (host[len] != ':' || host[0] == '['); len++) {
+        if (UNLIKELY(len == sizeof(name) - 1))
+            goto not_found;
+
+        name[len] = (char)tolower((unsigned char)host[len]);
+        if (host[len] == ']') {
+            len++;
+            break;
+        }
+    }
+    if (len && name[len - 1] == '.')
+        len--;
+    name[len] = '\0';
+
+    trie = hash_find(listener->virtual_hosts, name);
+    if (trie)
+        return trie;
+
+    /* Try a wildcard, "*.example.com", for "www.example.com". */
+    char *dot = memchr(name, '.', len);
+    if (dot && dot > name) {
+        dot[-1] = '*';
+        trie = hash_find(listener->virtual_hosts, dot - 1);
+        if (trie)
+            return trie;
+    }
+
+not_found:
+    return (struct lwan_trie *)&listener->url_map_trie;
+}
+
+static struct lwan_url_map *
+find_url_map_for_method(struct lwan_url_map *url_map,
+                        const struct lwan_request *request)
+{
+    const uint32_t method = 1u << lwan_request_get_method(request);
+
+    for (; url_map; url_map = url_map->next_method) {
+        if (!url_map->methods || (url_map->methods & method))
+            return url_map;
+    }
+
+    return NULL;
+}
+
+static void set_conn_priority(struct lwan_connection *conn,
+                              enum lwan_handler_priority priority)
+{
+    static const enum lwan_connection_flags flags[] = {
+        [HANDLER_PRIORITY_NORMAL] = 0,
+        [HANDLER_PRIORITY_HIGH] = CONN_PRIORITY_HIGH,
+        [HANDLER_PRIORITY_LOW] = CONN_PRIORITY_LOW,
+    };
+
+    conn->flags = (conn->flags & ~CONN_PRIORITY_MASK) | flags[priority];
+}
+
 void lwan_process_request(struct lwan *l, struct lwan_request *request)
 {
     enum lwan_http_status status;
-    struct lwan_url_map *url_map;
+    struct lwan_url_map *url_map = NULL;
+    const struct lwan_listener *listener =
+        &l->listeners[l->conn_listener ? l->conn_listener[request->fd] : 0];
+    struct lwan_trie *url_map_trie;
+    uint64_t t_start, t_parsed = 0, t_handled = 0;
 
     status = read_request(request);
     if (UNLIKELY(status != HTTP_OK)) {
         /* If read_request() returns any error at this point, it's probably
-         * better to just send an error response and abort the coroutine and
-         * let the client handle the error instead: we don't have
+         * better to just send an error response and close the connection
+         * and let the client handle the error instead: we don't have
          * information to even log the request because it has not been
          * parsed yet at this stage.  Even if there are other requests waiting
-         * in the pipeline, this seems like the safer thing to do.  */
+         * in the pipeline, this seems like the safer thing to do.  The
+         * connection isn't aborted, though: the client is most likely still
+         * sending the rest of the request (e.g. if it's too large), and
+         * closing the socket with that unread would reset the connection,
+         * making the client drop the response.  process_request_coro()
+         * closes it gracefully instead, draining what's left.  */
+        request->conn->flags &= ~CONN_IS_KEEP_ALIVE;
         lwan_default_response(request, status);
-        coro_yield(request->conn->coro, CONN_CORO_ABORT);
-        __builtin_unreachable();
+        return;
     }
 
+    /* Time waiting for the request to arrive isn't accounted for. */
+    t_start = route_clock_us();
+
     status = parse_http_request(request);
     if (UNLIKELY(status != HTTP_OK))
         goto log_and_return;
 
+    LWAN_PROBE(request_parsed, request, request->fd, request->url.value);
+
+    url_map_trie = find_url_map_trie(listener, request);
+
 lookup_again:
-    url_map = lwan_trie_lookup_prefix(&l->url_map_trie, request->url.value);
+    url_map = lwan_trie_lookup_prefix(url_map_trie, request->url.value);
     if (UNLIKELY(!url_map)) {
         status = HTTP_NOT_FOUND;
         goto log_and_return;
     }
+    if (UNLIKELY(url_map->methods)) {
+        url_map = find_url_map_for_method(url_map, request);
+        if (!url_map) {
+            status = HTTP_NOT_ALLOWED;
+            goto log_and_return;
+        }
+    }
+
+    if (UNLIKELY(l->config.schedule_by_priority))
+        set_conn_priority(request->conn, url_map->priority);
 
     status = prepare_for_response(url_map, request);
     if (UNLIKELY(status != HTTP_OK))
         goto log_and_return;
 
-    status = url_map->handler(request, &request->response, url_map->data);
+    if (UNLIKELY(l->config.slow_request_threshold))
+        lwan_watchdog_request_start(request, url_map);
+    if (UNLIKELY(request->conn->thread->profile != NULL))
+        lwan_profiler_request_start(request, url_map);
+
+    t_parsed = route_clock_us();
+    LWAN_PROBE(handler_start, request, url_map->prefix);
+    if (UNLIKELY(url_map->flags & HANDLER_CACHES_RESPONSE))
+        status = lwan_response_cache_urlmap(request, url_map);
+    else
+        status = url_map->handler(request, &request->response, url_map->data);
+    LWAN_PROBE(handler_end, request, url_map->prefix, (int)status);
+    t_handled = route_clock_us();
+    if (UNLIKELY(url_map->flags & HANDLER_STREAMS_BODY_DATA))
+        finish_body_stream(request);
     if (UNLIKELY(url_map->flags & HANDLER_CAN_REWRITE_URL)) {
         if (request->flags & RESPONSE_URL_REWRITTEN) {
             if (LIKELY(handle_rewrite(request)))
@@ -1506,8 +2530,20 @@ lookup_again:
 
 log_and_return:
     log_request(request, status);
+    if (UNLIKELY(request->conn->thread->access_log != NULL))
+        lwan_access_log_request(request->conn->thread->access_log, request,
+                                status);
+
+    lwan_response(request, status);
+    LWAN_PROBE(request_done, request, (int)status);
+
+    count_response(request, status);
 
-    return (void)lwan_response(request, status);
+    if (LIKELY(url_map))
+        record_route_stats(request, url_map, t_start, t_parsed, t_handled);
+
+    if (UNLIKELY(l->config.measure_stack_usage))
+        record_stack_usage(request, url_map);
 }
 
 static inline void *
@@ -1515,7 +2551,14 @@ value_lookup(const struct lwan_key_value_array *array, const char *key)
 {
     const struct lwan_array *la = (const struct lwan_array *)array;
 
-    if (LIKELY(la->elements)) {
+    if (la->elements <= KEY_VALUE_LINEAR_LOOKUP_MAX) {
+        const struct lwan_key_value *kv = la->base;
+
+        for (size_t i = 0; i < la->elements; i++) {
+            if (kv[i].key[0] == key[0] && streq(kv[i].key, key))
+                return kv[i].value;
+        }
+    } else {
         struct lwan_key_value k = { .key = (char *)key };
         struct lwan_key_value *entry;
 
@@ -1545,32 +2588,130 @@ const char *lwan_request_get_cookie(struct lwan_request *request,
     return value_lookup(lwan_request_get_cookies(request), key);
 }
 
+static const uint8_t well_known_header_len[] = {
+#define GENERATE_HEADER_LEN(id, name, prefix) [LWAN_HEADER_##id] = sizeof(name) - 1,
+    FOR_EACH_WELL_KNOWN_HEADER(GENERATE_HEADER_LEN)
+#undef GENERATE_HEADER_LEN
+};
+
+const char *lwan_request_get_header_by_id(struct lwan_request *request,
+                                          enum lwan_header_id id)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+    uint8_t idx;
+
+    assert(id < LWAN_HEADER_MAX);
+
+    parse_headers(request);
+
+    idx = helper->well_known_headers[id];
+    if (!idx)
+        return NULL;
+
+    *(helper->header_start[idx] - HEADER_TERMINATOR_LEN) = '\0';
+    return helper->header_start[idx - 1] + well_known_header_len[id] +
+           sizeof(": ") - 1;
+}
+
+static enum lwan_header_id well_known_header_id(const char *header,
+                                                size_t len)
+{
+    if (UNLIKELY(len < 4))
+        return LWAN_HEADER_MAX;
+
+    STRING_SWITCH_L (header) {
+#define MATCH_WELL_KNOWN_HEADER(id_, name_, prefix_)                           \
+    case prefix_:                                                              \
+        if (len == sizeof(name_) - 1 && !strcasecmp(header, name_))            \
+            return LWAN_HEADER_##id_;                                          \
+        break;
+
+        FOR_EACH_WELL_KNOWN_HEADER(MATCH_WELL_KNOWN_HEADER)
+
+#undef MATCH_WELL_KNOWN_HEADER
+    }
+
+    return LWAN_HEADER_MAX;
+}
+
+static ALWAYS_INLINE uint32_t header_name_hash(const char *name, size_t len)
+{
+    /* FNV-1a; ORing with 0x20 folds the case of letters (other characters
+     * allowed in header names might collide, but they're compared anyway). */
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ ((uint8_t)name[i] | 0x20)) * 16777619u;
+
+    return hash;
+}
+
+static void build_header_index(struct lwan_request_parser_helper *helper)
+{
+    static_assert(HEADER_INDEX_SIZE >= N_HEADER_START &&
+                      (HEADER_INDEX_SIZE & (HEADER_INDEX_SIZE - 1)) == 0,
+                  "Header index has room for all headers, size is power of 2");
+
+    for (size_t i = 0; i < helper->n_header_start; i++) {
+        const char *start = helper->header_start[i];
+        const char *end = helper->header_start[i + 1] - HEADER_TERMINATOR_LEN;
+        const char *colon = memchr(start, ':', (size_t)(end - start));
+
+        if (UNLIKELY(!colon))
+            continue;
+
+        /* Linear probing keeps duplicate headers in the order they appear
+         * in the request; lookups return the first one, as before. */
+        uint32_t slot = header_name_hash(start, (size_t)(colon - start));
+        for (;; slot++) {
+            slot &= HEADER_INDEX_SIZE - 1;
+
+            if (!helper->header_index[slot]) {
+                helper->header_index[slot] = (uint8_t)(i + 1);
+                break;
+            }
+        }
+    }
+}
+
 const char *lwan_request_get_header(struct lwan_request *request,
                                     const char *header)
 {
-    char name[64];
-    int r;
+    struct lwan_request_parser_helper *helper = request->helper;
+    const size_t len = strlen(header);
+    enum lwan_header_id id;
 
     assert(strchr(header, ':') == NULL);
 
-    r = snprintf(name, sizeof(name), "%s: ", header);
-    if (UNLIKELY(r < 0 || r >= (int)sizeof(name)))
-        return NULL;
+    id = well_known_header_id(header, len);
+    if (id != LWAN_HEADER_MAX)
+        return lwan_request_get_header_by_id(request, id);
+
+    if (!(request->flags & REQUEST_PARSED_HEADER_INDEX)) {
+        build_header_index(helper);
+        request->flags |= REQUEST_PARSED_HEADER_INDEX;
+    }
+
+    for (uint32_t slot = header_name_hash(header, len);; slot++) {
+        slot &= HEADER_INDEX_SIZE - 1;
+
+        const uint8_t idx = helper->header_index[slot];
+        if (!idx)
+            return NULL;
 
-    for (size_t i = 0; i < request->helper->n_header_start; i++) {
-        const char *start = request->helper->header_start[i];
-        char *end = request->helper->header_start[i + 1] - HEADER_TERMINATOR_LEN;
+        char *start = helper->header_start[idx - 1];
+        char *end = helper->header_start[idx] - HEADER_TERMINATOR_LEN;
 
-        if (UNLIKELY(end - start < r))
+        if (UNLIKELY((size_t)(end - start) < len + sizeof(": ") - 1))
+            continue;
+        if (string_as_uint16(start + len) != STR2_INT(':', ' '))
             continue;
 
-        if (!strncasecmp(start, name, (size_t)r)) {
+        if (!strncasecmp(start, header, len)) {
             *end = '\0';
-            return start + r;
+            return start + len + sizeof(": ") - 1;
         }
     }
-
-    return NULL;
 }
 
 ALWAYS_INLINE int
@@ -1613,6 +2754,13 @@ lwan_request_get_remote_address(struct lwan_request *request,
                          buffer, INET6_ADDRSTRLEN);
     }
 
+    if (sock_addr->ss_family == AF_UNIX) {
+        /* Peers of a Unix domain socket are usually unnamed. */
+        static const char unix_socket[] = "unix:";
+
+        return memcpy(buffer, unix_socket, sizeof(unix_socket));
+    }
+
     return inet_ntop(AF_INET6, &((struct sockaddr_in6 *)sock_addr)->sin6_addr,
                      buffer, INET6_ADDRSTRLEN);
 }
@@ -1645,6 +2793,7 @@ void lwan_request_sleep(struct lwan_request *request, uint64_t ms)
         conn->flags |= CONN_HAS_REMOVE_SLEEP_DEFER;
     }
 
+    lwan_send_queued_responses(request);
     coro_yield(conn->coro, CONN_CORO_SUSPEND);
 }
 
@@ -1654,6 +2803,7 @@ lwan_request_get_range(struct lwan_request *request, off_t *from, off_t *to)
     struct lwan_request_parser_helper *helper = request->helper;
 
     if (!(request->flags & REQUEST_PARSED_RANGE)) {
+        parse_headers(request);
         parse_range(helper);
         request->flags |= REQUEST_PARSED_RANGE;
     }
@@ -1667,12 +2817,109 @@ lwan_request_get_range(struct lwan_request *request, off_t *from, off_t *to)
     return -ENOENT;
 }
 
+/* Parses every range in a "Range: bytes=..." header as specified by RFC
+ * 7233, where the last byte position is inclusive and "-N" refers to the
+ * last N bytes.  (lwan_request_get_range() predates this function and
+ * handles a single range with its own semantics.)  Returns the number of
+ * satisfiable ranges; 0 if the header should be ignored because it's not
+ * there, can't be parsed, or asks for too many ranges or bytes; or
+ * -ERANGE if none of the ranges can be satisfied. */
+int lwan_request_get_byte_ranges(struct lwan_request *request,
+                                 off_t size,
+                                 struct lwan_byte_range *ranges,
+                                 size_t max_ranges)
+{
+    const struct lwan_value *header;
+    const char *p, *end;
+    bool had_unsatisfiable = false;
+    size_t n_ranges = 0;
+    off_t total = 0;
+
+    parse_headers(request);
+    header = &request->helper->range.raw;
+
+    if (header->len <= sizeof("bytes=") - 1 ||
+        strncmp(header->value, "bytes=", sizeof("bytes=") - 1))
+        return 0;
+
+    p = header->value + sizeof("bytes=") - 1;
+    end = header->value + header->len;
+
+    while (p < end) {
+        struct lwan_byte_range range;
+        char *num_end;
+        off_t first, last;
+
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        if (p == end)
+            break;
+
+        if (*p == '-') {
+            if (!parse_off_without_sign(p + 1, &num_end, &last))
+                return 0;
+
+            if (!last) {
+                had_unsatisfiable = true;
+                goto next;
+            }
+
+            range.from = last < size ? size - last : 0;
+            range.to = size;
+        } else if (lwan_char_isdigit(*p)) {
+            if (!parse_off_without_sign(p, &num_end, &first) || *num_end != '-')
+                return 0;
+
+            p = num_end + 1;
+            if (lwan_char_isdigit(*p)) {
+                if (!parse_off_without_sign(p, &num_end, &last) || last < first)
+                    return 0;
+            } else {
+                num_end = (char *)p;
+                last = size - 1;
+            }
+
+            if (first >= size) {
+                had_unsatisfiable = true;
+                goto next;
+            }
+
+            range.from = first;
+            range.to = last >= size ? size : last + 1;
+        } else {
+            return 0;
+        }
+
+        if (n_ranges == max_ranges)
+            return 0;
+
+        /* Overlapping ranges could be used to make a small request produce
+         * a response many times larger than the file itself. */
+        total += range.to - range.from;
+        if (total > size)
+            return 0;
+
+        ranges[n_ranges++] = range;
+
+next:
+        p = num_end;
+        if (p < end && *p != ',' && *p != ' ' && *p != '\t')
+            return 0;
+    }
+
+    if (n_ranges)
+        return (int)n_ranges;
+
+    return had_unsatisfiable ? -ERANGE : 0;
+}
+
 ALWAYS_INLINE int
 lwan_request_get_if_modified_since(struct lwan_request *request, time_t *value)
 {
     struct lwan_request_parser_helper *helper = request->helper;
 
     if (!(request->flags & REQUEST_PARSED_IF_MODIFIED_SINCE)) {
+        parse_headers(request);
         parse_if_modified_since(helper);
         request->flags |= REQUEST_PARSED_IF_MODIFIED_SINCE;
     }
@@ -1685,6 +2932,71 @@ lwan_request_get_if_modified_since(struct lwan_request *request, time_t *value)
     return -ENOENT;
 }
 
+static inline bool is_etag_separator(char c)
+{
+    return c == ' ' || c == '\t' || c == ',';
+}
+
+/* Entity tags are compared using the weak comparison function, as required
+ * for If-None-Match (RFC 7232, section 3.2): the "W/" prefix is ignored. */
+static bool etag_list_contains(const char *list,
+                               size_t list_len,
+                               const char *etag,
+                               size_t etag_len)
+{
+    const char *end = list + list_len;
+
+    if (etag_len > 2 && etag[0] == 'W' && etag[1] == '/') {
+        etag += 2;
+        etag_len -= 2;
+    }
+
+    for (const char *p = list; p < end;) {
+        const char *closing;
+
+        if (is_etag_separator(*p)) {
+            p++;
+            continue;
+        }
+
+        if (*p == '*')
+            return true;
+
+        if (end - p > 2 && p[0] == 'W' && p[1] == '/')
+            p += 2;
+        if (UNLIKELY(*p != '"'))
+            return false;
+
+        closing = memchr(p + 1, '"', (size_t)(end - p - 1));
+        if (UNLIKELY(!closing))
+            return false;
+
+        if ((size_t)(closing - p + 1) == etag_len &&
+            !memcmp(p, etag, etag_len))
+            return true;
+
+        p = closing + 1;
+    }
+
+    return false;
+}
+
+int lwan_request_get_if_none_match(struct lwan_request *request,
+                                   const char *etag)
+{
+    const struct lwan_value *header;
+
+    parse_headers(request);
+
+    header = &request->helper->if_none_match;
+    if (LIKELY(!header->len))
+        return -ENOENT;
+
+    return etag_list_contains(header->value, header->len, etag, strlen(etag))
+               ? 0
+               : -ESRCH;
+}
+
 ALWAYS_INLINE const struct lwan_value *
 lwan_request_get_request_body(struct lwan_request *request)
 {
@@ -1694,6 +3006,8 @@ lwan_request_get_request_body(struct lwan_request *request)
 ALWAYS_INLINE const struct lwan_value *
 lwan_request_get_content_type(struct lwan_request *request)
 {
+    parse_headers(request);
+
     return &request->helper->content_type;
 }
 
@@ -1734,6 +3048,7 @@ ALWAYS_INLINE enum lwan_request_flags
 lwan_request_get_accept_encoding(struct lwan_request *request)
 {
     if (!(request->flags & REQUEST_PARSED_ACCEPT_ENCODING)) {
+        parse_headers(request);
         parse_accept_encoding(request);
         request->flags |= REQUEST_PARSED_ACCEPT_ENCODING;
     }
@@ -1801,6 +3116,7 @@ __attribute__((used)) int fuzz_parse_http_request(const uint8_t *data,
         size_t gen = coro_deferred_get_generation(coro);
 
         /* Only pointers were set in helper struct; actually parse them here. */
+        parse_headers(&request);
         parse_accept_encoding(&request);
 
         /* Requesting these items will force them to be parsed, and also
@@ -1823,6 +3139,11 @@ __attribute__((used)) int fuzz_parse_http_request(const uint8_t *data,
 
         lwan_request_get_if_modified_since(&request, &trash2);
         LWAN_NO_DISCARD(trash2);
+        LWAN_NO_DISCARD(
+            lwan_request_get_if_none_match(&request, "\"0123456789abcdef\""));
+        struct lwan_byte_range trash4[4];
+        LWAN_NO_DISCARD(lwan_request_get_byte_ranges(&request, 32768, trash4,
+                                                     N_ELEMENTS(trash4)));
 
         if (prepare_websocket_handshake(&request, &trash3) ==
             HTTP_SWITCHING_PROTOCOLS) {
@@ -1846,29 +3167,53 @@ make_async_yield_value(int fd, enum lwan_connection_coro_yield event)
     return (int64_t)(((uint64_t)fd << 32 | event));
 }
 
-static inline void async_await_fd(struct coro *coro,
+static inline void async_await_fd(struct lwan_request *request,
                                   int fd,
                                   enum lwan_connection_coro_yield events)
 {
     assert(events >= CONN_CORO_ASYNC_AWAIT_READ &&
            events <= CONN_CORO_ASYNC_AWAIT_READ_WRITE);
 
-    return (void)coro_yield(coro, make_async_yield_value(fd, events));
+    lwan_send_queued_responses(request);
+    return (void)coro_yield(request->conn->coro,
+                            make_async_yield_value(fd, events));
 }
 
 void lwan_request_await_read(struct lwan_request *r, int fd)
 {
-    return async_await_fd(r->conn->coro, fd, CONN_CORO_ASYNC_AWAIT_READ);
+    return async_await_fd(r, fd, CONN_CORO_ASYNC_AWAIT_READ);
 }
 
 void lwan_request_await_write(struct lwan_request *r, int fd)
 {
-    return async_await_fd(r->conn->coro, fd, CONN_CORO_ASYNC_AWAIT_WRITE);
+    return async_await_fd(r, fd, CONN_CORO_ASYNC_AWAIT_WRITE);
 }
 
 void lwan_request_await_read_write(struct lwan_request *r, int fd)
 {
-    return async_await_fd(r->conn->coro, fd, CONN_CORO_ASYNC_AWAIT_READ_WRITE);
+    return async_await_fd(r, fd, CONN_CORO_ASYNC_AWAIT_READ_WRITE);
+}
+
+void lwan_request_await_forget(struct lwan_request *r, int fd)
+{
+    struct lwan_thread *t = r->conn->thread;
+    struct lwan_connection *await_fd_conn = &t->lwan->conns[fd];
+
+    if (!(await_fd_conn->flags & CONN_ASYNC_AWAIT))
+        return;
+
+    if (t->uring) {
+        /* Polls are one-shot; if one is still pending, it'll be removed
+         * once the request is done. */
+        if (await_fd_conn->flags & CONN_POLL_ARMED)
+            return;
+    } else if (UNLIKELY(epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0)) {
+        lwan_status_perror("epoll_ctl");
+        return;
+    }
+
+    await_fd_conn->flags &= ~(CONN_ASYNC_AWAIT | CONN_EVENTS_MASK);
+    t->n_async_awaits--;
 }
 
 ssize_t lwan_request_async_read(struct lwan_request *request,
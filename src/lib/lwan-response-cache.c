@@ -0,0 +1,725 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "lwan-private.h"
+
+#include "hash.h"
+#include "lwan-cache.h"
+#include "lwan-config.h"
+#include "lwan-response-cache.h"
+
+#define DEFAULT_MAX_SIZE (16 * 1024 * 1024)
+#define MAX_VARY 8
+
+/* How often requests waiting for a response to be cached look again */
+#define WAIT_INTERVAL_MS 5
+
+/* Keys start with the time window they were created in, as a fixed-width
+ * hexadecimal number, so that the key for the previous window can be
+ * derived from it; see lwan_response_cache_handle(). */
+#define WINDOW_DIGITS 16
+
+struct vary {
+    char *name;
+    bool cookie;
+};
+
+struct lwan_response_cache {
+    struct cache *cache;
+    time_t time_to_live;
+    unsigned int lock_timeout_ms;
+
+    struct vary vary[MAX_VARY];
+    size_t n_vary;
+
+    /* Keys whose responses are being produced by a handler right now */
+    struct {
+        struct hash *table;
+        pthread_mutex_t lock;
+    } filling;
+};
+
+struct response_variant {
+    struct lwan_value body;
+    struct lwan_key_value *headers;
+};
+
+struct response_cache_entry {
+    struct cache_entry base;
+
+    enum lwan_http_status status;
+    char *mime_type;
+
+    /* Headers set by the handler, terminated by a NULL key */
+    struct lwan_key_value *headers;
+    size_t n_headers;
+
+    struct lwan_value body;
+
+    /* Bitmap (1 << encoding) of the variants in compressed[] */
+    unsigned int encodings;
+    struct response_variant compressed[LWAN_COMPRESS_N_ENCODINGS];
+};
+
+struct fill {
+    struct lwan_response_cache *rc;
+    const char *key;
+    bool released;
+};
+
+/* Responses are produced by handlers running in request coroutines, which
+ * can't be done from a cache_create_entry_cb: the coroutine could be
+ * killed while the cache waits for the callback to return.  Instead, the
+ * entry is prepared before the cache is asked for it, and the callback
+ * only hands it over.  Nothing yields in between. */
+static __thread struct response_cache_entry *staged_entry;
+
+static struct cache_entry *create_entry(const char *key __attribute__((unused)),
+                                        void *context __attribute__((unused)))
+{
+    struct response_cache_entry *entry = staged_entry;
+
+    staged_entry = NULL;
+    return (struct cache_entry *)entry;
+}
+
+static void free_headers(struct lwan_key_value *headers)
+{
+    if (!headers)
+        return;
+
+    for (struct lwan_key_value *header = headers; header->key; header++) {
+        free(header->key);
+        free(header->value);
+    }
+    free(headers);
+}
+
+static void destroy_entry(struct cache_entry *base,
+                          void *context __attribute__((unused)))
+{
+    struct response_cache_entry *entry = (struct response_cache_entry *)base;
+
+    for (unsigned int i = 0; i < LWAN_COMPRESS_N_ENCODINGS; i++) {
+        /* Strings are shared with entry->headers */
+        free(entry->compressed[i].headers);
+        free(entry->compressed[i].body.value);
+    }
+    free_headers(entry->headers);
+    free(entry->body.value);
+    free(entry->mime_type);
+    free(entry);
+}
+
+static size_t entry_size(const struct cache_entry *base,
+                         void *context __attribute__((unused)))
+{
+    const struct response_cache_entry *entry =
+        (const struct response_cache_entry *)base;
+    size_t size = sizeof(*entry) + entry->body.len;
+
+    for (unsigned int i = 0; i < LWAN_COMPRESS_N_ENCODINGS; i++)
+        size += entry->compressed[i].body.len;
+
+    return size;
+}
+
+static bool parse_vary(struct config *c,
+                       struct lwan_response_cache *rc,
+                       const char *value)
+{
+    char *copy = strdupa(value);
+    char *saveptr;
+
+    for (char *item = strtok_r(copy, " ,", &saveptr); item;
+         item = strtok_r(NULL, " ,", &saveptr)) {
+        struct vary *vary;
+
+        if (rc->n_vary == MAX_VARY) {
+            config_error(c, "At most %d items can be used in vary", MAX_VARY);
+            return false;
+        }
+
+        vary = &rc->vary[rc->n_vary];
+        if (!strncmp(item, "header:", sizeof("header:") - 1)) {
+            item += sizeof("header:") - 1;
+        } else if (!strncmp(item, "cookie:", sizeof("cookie:") - 1)) {
+            item += sizeof("cookie:") - 1;
+            vary->cookie = true;
+        } else {
+            config_error(c, "Expecting header:Name or cookie:name, got %s",
+                         item);
+            return false;
+        }
+
+        if (!*item) {
+            config_error(c, "Empty header or cookie name in vary");
+            return false;
+        }
+
+        vary->name = strdup(item);
+        if (!vary->name)
+            return false;
+        rc->n_vary++;
+    }
+
+    return true;
+}
+
+struct lwan_response_cache *lwan_response_cache_new_from_config(struct config *c)
+{
+    const struct config_line *l;
+    struct lwan_response_cache *rc;
+    long long max_size = DEFAULT_MAX_SIZE;
+    long time_to_live = 1;
+    long lock_timeout = 5;
+
+    rc = calloc(1, sizeof(*rc));
+    if (!rc)
+        return NULL;
+
+    while ((l = config_read_line(c))) {
+        switch (l->type) {
+        case CONFIG_LINE_TYPE_LINE:
+            if (streq(l->key, "time_to_live")) {
+                time_to_live = parse_long(l->value, 0);
+                if (time_to_live <= 0 || time_to_live > 86400) {
+                    config_error(c, "Time to live must be between 1 and "
+                                    "86400 seconds");
+                    goto error;
+                }
+            } else if (streq(l->key, "max_size")) {
+                max_size = parse_long_long(l->value, -1);
+                if (max_size < 0) {
+                    config_error(c, "Invalid maximum size: %s", l->value);
+                    goto error;
+                }
+            } else if (streq(l->key, "lock_timeout")) {
+                lock_timeout = parse_long(l->value, -1);
+                if (lock_timeout < 0 || lock_timeout > 60) {
+                    config_error(c, "Lock timeout must be between 0 and 60 "
+                                    "seconds");
+                    goto error;
+                }
+            } else if (streq(l->key, "vary")) {
+                if (!parse_vary(c, rc, l->value))
+                    goto error;
+            } else {
+                config_error(c, "Unknown response cache option: %s", l->key);
+                goto error;
+            }
+            break;
+
+        case CONFIG_LINE_TYPE_SECTION:
+            config_error(c, "Unexpected section: %s", l->key);
+            goto error;
+
+        case CONFIG_LINE_TYPE_SECTION_END:
+            goto create;
+        }
+    }
+
+    config_error(c, "Could not find end of response cache section");
+    goto error;
+
+create:
+    rc->time_to_live = (time_t)time_to_live;
+    rc->lock_timeout_ms = (unsigned int)lock_timeout * 1000;
+
+    rc->filling.table = hash_str_new(free, NULL);
+    if (!rc->filling.table)
+        goto error;
+    pthread_mutex_init(&rc->filling.lock, NULL);
+
+    /* Entries are kept for two windows: responses from the previous one
+     * are served while the current one is being filled. */
+    rc->cache =
+        cache_create(create_entry, destroy_entry, rc, rc->time_to_live * 2);
+    if (!rc->cache) {
+        pthread_mutex_destroy(&rc->filling.lock);
+        goto error;
+    }
+    cache_set_name(rc->cache, "response_cache");
+    cache_set_max_size(rc->cache, (size_t)max_size, entry_size);
+
+    return rc;
+
+error:
+    hash_free(rc->filling.table);
+    for (size_t i = 0; i < rc->n_vary; i++)
+        free(rc->vary[i].name);
+    free(rc);
+    return NULL;
+}
+
+void lwan_response_cache_free(struct lwan_response_cache *rc)
+{
+    if (!rc)
+        return;
+
+    cache_destroy(rc->cache);
+    hash_free(rc->filling.table);
+    pthread_mutex_destroy(&rc->filling.lock);
+    for (size_t i = 0; i < rc->n_vary; i++)
+        free(rc->vary[i].name);
+    free(rc);
+}
+
+static char *build_key(const struct lwan_response_cache *rc,
+                       struct lwan_request *request,
+                       time_t window)
+{
+    const struct lwan_value *query = &request->helper->query_string;
+    struct lwan_strbuf key;
+    char *ret = NULL;
+
+    if (!lwan_strbuf_init(&key))
+        return NULL;
+
+    if (!lwan_strbuf_printf(&key, "%0*llx\n%d\n%s\n%.*s", WINDOW_DIGITS,
+                            (unsigned long long)window,
+                            lwan_request_get_method(request),
+                            request->original_url.value, (int)query->len,
+                            query->value ? query->value : ""))
+        goto out;
+
+    /* Requests with and without a header (or cookie) are told apart from
+     * requests where it's empty. */
+    for (size_t i = 0; i < rc->n_vary; i++) {
+        const char *value =
+            rc->vary[i].cookie
+                ? lwan_request_get_cookie(request, rc->vary[i].name)
+                : lwan_request_get_header(request, rc->vary[i].name);
+
+        if (!lwan_strbuf_append_printf(&key, "\n%c%s", value ? '+' : '-',
+                                       value ? value : ""))
+            goto out;
+    }
+
+    ret = coro_strdup(request->conn->coro, lwan_strbuf_get_buffer(&key));
+
+out:
+    lwan_strbuf_free(&key);
+    return ret;
+}
+
+static char *previous_window_key(struct lwan_request *request,
+                                 const char *key,
+                                 time_t window)
+{
+    char digits[WINDOW_DIGITS + 1];
+    char *prev;
+
+    if (!window)
+        return NULL;
+
+    prev = coro_strdup(request->conn->coro, key);
+    if (!prev)
+        return NULL;
+
+    snprintf(digits, sizeof(digits), "%0*llx", WINDOW_DIGITS,
+             (unsigned long long)(window - 1));
+    memcpy(prev, digits, WINDOW_DIGITS);
+
+    return prev;
+}
+
+static struct response_cache_entry *
+lookup(struct lwan_response_cache *rc,
+       struct lwan_request *request,
+       const char *key)
+{
+    /* Misses go through create_entry(), which returns NULL unless an
+     * entry has been staged by this thread. */
+    return (struct response_cache_entry *)cache_coro_get_and_ref_entry(
+        rc->cache, request->conn->coro, key);
+}
+
+static enum lwan_http_status serve(struct lwan_request *request,
+                                   const struct response_cache_entry *entry)
+{
+    const struct lwan_value *body = &entry->body;
+    struct lwan_key_value *headers = entry->headers;
+
+    if (entry->encodings && (request->flags & RESPONSE_COMPRESS)) {
+        int encoding = lwan_compress_pick_encoding(request, entry->encodings);
+
+        if (encoding >= 0) {
+            body = &entry->compressed[encoding].body;
+            headers = entry->compressed[encoding].headers;
+        }
+    }
+
+    /* Already compressed, if it should be. */
+    request->flags &= ~RESPONSE_COMPRESS;
+
+    request->response.mime_type = entry->mime_type;
+    request->response.headers = headers;
+
+    /* The entry is referenced until the request has been handled, so its
+     * body can be sent without being copied. */
+    lwan_strbuf_reset(request->response.buffer);
+    if (!lwan_response_append_ref(request, body->value, body->len, NULL,
+                                  NULL))
+        return HTTP_INTERNAL_ERROR;
+
+    return entry->status;
+}
+
+static bool claim_fill(struct lwan_response_cache *rc,
+                       struct lwan_request *request,
+                       const char *key,
+                       struct fill **fill_out)
+{
+    struct fill *fill;
+    char *key_copy;
+    bool claimed = false;
+
+    fill = coro_malloc(request->conn->coro, sizeof(*fill));
+    if (UNLIKELY(!fill))
+        return false;
+    key_copy = strdup(key);
+    if (UNLIKELY(!key_copy))
+        return false;
+
+    pthread_mutex_lock(&rc->filling.lock);
+    if (!hash_find(rc->filling.table, key))
+        claimed = !hash_add(rc->filling.table, key_copy, fill);
+    pthread_mutex_unlock(&rc->filling.lock);
+
+    if (!claimed) {
+        free(key_copy);
+        return false;
+    }
+
+    *fill = (struct fill){.rc = rc, .key = key};
+    *fill_out = fill;
+    return true;
+}
+
+static void release_fill(void *data)
+{
+    struct fill *fill = data;
+
+    if (fill->released)
+        return;
+
+    pthread_mutex_lock(&fill->rc->filling.lock);
+    hash_del(fill->rc->filling.table, fill->key);
+    pthread_mutex_unlock(&fill->rc->filling.lock);
+
+    fill->released = true;
+}
+
+static bool is_being_filled(struct lwan_response_cache *rc, const char *key)
+{
+    bool filling;
+
+    pthread_mutex_lock(&rc->filling.lock);
+    filling = hash_find(rc->filling.table, key) != NULL;
+    pthread_mutex_unlock(&rc->filling.lock);
+
+    return filling;
+}
+
+static bool is_cacheable_status(enum lwan_http_status status)
+{
+    switch (status) {
+    case HTTP_OK:
+    case HTTP_NO_CONTENT:
+    case HTTP_MOVED_PERMANENTLY:
+    case HTTP_FOUND:
+    case HTTP_PERMANENT_REDIRECT:
+    case HTTP_NOT_FOUND:
+    case HTTP_GONE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_cacheable(const struct lwan_request *request,
+                         enum lwan_http_status status)
+{
+    const struct lwan_key_value *header = request->response.headers;
+
+    if (!is_cacheable_status(status) || !request->response.mime_type)
+        return false;
+    /* Sent already, or not generated by the handler itself */
+    if (request->flags & (RESPONSE_SENT_HEADERS | RESPONSE_CHUNKED_ENCODING |
+                          RESPONSE_NO_CONTENT_LENGTH | RESPONSE_STREAM |
+                          RESPONSE_URL_REWRITTEN))
+        return false;
+    if (request->conn->flags & CONN_IS_UPGRADE)
+        return false;
+
+    for (; header && header->key; header++) {
+        if (!strcasecmp(header->key, "Set-Cookie"))
+            return false;
+        if (!strcasecmp(header->key, "Cache-Control") &&
+            (strcasestr(header->value, "no-store") ||
+             strcasestr(header->value, "no-cache") ||
+             strcasestr(header->value, "private")))
+            return false;
+    }
+
+    return true;
+}
+
+static bool copy_headers(struct response_cache_entry *entry,
+                         const struct lwan_key_value *headers)
+{
+    size_t n = 0;
+
+    if (!headers)
+        return true;
+
+    while (headers[n].key)
+        n++;
+
+    entry->headers = calloc(n + 1, sizeof(*entry->headers));
+    if (!entry->headers)
+        return false;
+
+    for (size_t i = 0; i < n; i++) {
+        entry->headers[i].key = strdup(headers[i].key);
+        entry->headers[i].value = strdup(headers[i].value);
+        if (!entry->headers[i].key || !entry->headers[i].value) {
+            /* Keep the array terminated for free_headers() */
+            free(entry->headers[i].key);
+            free(entry->headers[i].value);
+            entry->headers[i] = (struct lwan_key_value){};
+            return false;
+        }
+    }
+    entry->n_headers = n;
+
+    return true;
+}
+
+static bool has_content_encoding(const struct response_cache_entry *entry)
+{
+    for (size_t i = 0; i < entry->n_headers; i++) {
+        if (!strcasecmp(entry->headers[i].key, "Content-Encoding"))
+            return true;
+    }
+
+    return false;
+}
+
+static void compress_variants(struct response_cache_entry *entry)
+{
+    /* Handler already compressed its output */
+    if (has_content_encoding(entry))
+        return;
+
+    for (unsigned int i = 0; i < LWAN_COMPRESS_N_ENCODINGS; i++) {
+        struct response_variant *variant = &entry->compressed[i];
+
+        if (!lwan_compress_buffer(i, entry->mime_type, entry->body.value,
+                                  entry->body.len, &variant->body))
+            continue;
+
+        variant->headers =
+            calloc(entry->n_headers + 3, sizeof(*variant->headers));
+        if (!variant->headers) {
+            free(variant->body.value);
+            variant->body = (struct lwan_value){};
+            continue;
+        }
+
+        variant->headers[0] = (struct lwan_key_value){
+            .key = "Content-Encoding",
+            .value = (char *)lwan_compress_encoding_name(i),
+        };
+        variant->headers[1] = (struct lwan_key_value){
+            .key = "Vary",
+            .value = "Accept-Encoding",
+        };
+        if (entry->n_headers) {
+            memcpy(variant->headers + 2, entry->headers,
+                   entry->n_headers * sizeof(*entry->headers));
+        }
+
+        entry->encodings |= 1u << i;
+    }
+}
+
+static struct response_cache_entry *entry_new(struct lwan_request *request,
+                                              enum lwan_http_status status)
+{
+    struct lwan_strbuf *buffer = request->response.buffer;
+    struct response_cache_entry *entry;
+    size_t len;
+
+    /* Handlers might have added references to their own memory to the
+     * response; those have to be copied. */
+    if (!lwan_response_flatten(request))
+        return NULL;
+
+    entry = calloc(1, sizeof(*entry));
+    if (!entry)
+        return NULL;
+
+    entry->status = status;
+    entry->mime_type = strdup(request->response.mime_type);
+    if (!entry->mime_type)
+        goto error;
+
+    len = lwan_strbuf_get_length(buffer);
+    entry->body.value = malloc(len + 1);
+    if (!entry->body.value)
+        goto error;
+    memcpy(entry->body.value, lwan_strbuf_get_buffer(buffer), len);
+    entry->body.len = len;
+
+    if (!copy_headers(entry, request->response.headers))
+        goto error;
+
+    if (request->flags & RESPONSE_COMPRESS)
+        compress_variants(entry);
+
+    return entry;
+
+error:
+    destroy_entry(&entry->base, NULL);
+    return NULL;
+}
+
+static void unref_entry(void *data1, void *data2)
+{
+    cache_entry_unref(data1, data2);
+}
+
+static struct response_cache_entry *store(struct lwan_response_cache *rc,
+                                          struct lwan_request *request,
+                                          const char *key,
+                                          struct response_cache_entry *entry)
+{
+    struct cache_entry *stored;
+    int error;
+
+    staged_entry = entry;
+    stored = cache_get_and_ref_entry(rc->cache, key, &error);
+    if (staged_entry) {
+        /* Not handed over to the cache (e.g. because the hash table lock
+         * couldn't be obtained without blocking); try again next time. */
+        staged_entry = NULL;
+        destroy_entry(&entry->base, NULL);
+    }
+
+    if (stored)
+        coro_defer2(request->conn->coro, unref_entry, rc->cache, stored);
+
+    return (struct response_cache_entry *)stored;
+}
+
+static enum lwan_http_status fill(struct lwan_response_cache *rc,
+                                  const struct lwan_url_map *url_map,
+                                  struct lwan_request *request,
+                                  const char *key,
+                                  struct fill *fill)
+{
+    enum lwan_http_status status;
+    struct response_cache_entry *entry;
+
+    /* If the coroutine is killed while the handler is running, let
+     * somebody else try. */
+    coro_defer(request->conn->coro, release_fill, fill);
+
+    status = url_map->handler(request, &request->response, url_map->data);
+
+    if (is_cacheable(request, status)) {
+        entry = entry_new(request, status);
+        if (entry) {
+            entry = store(rc, request, key, entry);
+            if (entry)
+                status = serve(request, entry);
+        }
+    }
+
+    release_fill(fill);
+    return status;
+}
+
+enum lwan_http_status
+lwan_response_cache_handle(struct lwan_response_cache *rc,
+                           const struct lwan_url_map *url_map,
+                           struct lwan_request *request)
+{
+    const enum lwan_request_flags method = lwan_request_get_method(request);
+    const time_t window = lwan_clock_monotonic() / rc->time_to_live;
+    struct response_cache_entry *entry;
+    struct fill *filling;
+    char *key;
+
+    if (method != REQUEST_METHOD_GET && method != REQUEST_METHOD_HEAD)
+        goto uncached;
+
+    key = build_key(rc, request, window);
+    if (UNLIKELY(!key))
+        goto uncached;
+
+    entry = lookup(rc, request, key);
+    if (LIKELY(entry))
+        return serve(request, entry);
+
+    if (claim_fill(rc, request, key, &filling))
+        return fill(rc, url_map, request, key, filling);
+
+    /* Somebody else is producing this response: serve the one from the
+     * previous window meanwhile, if it's still around... */
+    const char *prev_key = previous_window_key(request, key, window);
+    if (prev_key) {
+        entry = lookup(rc, request, prev_key);
+        if (entry)
+            return serve(request, entry);
+    }
+
+    /* ...or wait for it, like everybody else.  HTTP/2 streams can't sleep
+     * on their own, so they don't wait. */
+    if (request->conn->flags & CONN_IS_HTTP2_STREAM)
+        goto uncached;
+
+    for (unsigned int waited = 0; waited < rc->lock_timeout_ms;
+         waited += WAIT_INTERVAL_MS) {
+        lwan_request_sleep(request, WAIT_INTERVAL_MS);
+
+        if (is_being_filled(rc, key))
+            continue;
+
+        entry = lookup(rc, request, key);
+        if (entry)
+            return serve(request, entry);
+
+        /* The response couldn't be cached; if it's still not being
+         * produced by anybody else, produce it here. */
+        if (claim_fill(rc, request, key, &filling))
+            return fill(rc, url_map, request, key, filling);
+    }
+
+uncached:
+    return url_map->handler(request, &request->response, url_map->data);
+}
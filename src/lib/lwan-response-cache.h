@@ -0,0 +1,44 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "lwan.h"
+
+struct lwan_response_cache;
+struct config;
+
+/* Parses a `response_cache` section inside a prefix section. */
+struct lwan_response_cache *lwan_response_cache_new_from_config(struct config *c);
+void lwan_response_cache_free(struct lwan_response_cache *response_cache);
+
+/* Serves GET and HEAD requests from the cache if possible; otherwise, calls
+ * the handler, and keeps its response around if it can be cached. */
+enum lwan_http_status
+lwan_response_cache_handle(struct lwan_response_cache *response_cache,
+                           const struct lwan_url_map *url_map,
+                           struct lwan_request *request);
+
+static inline enum lwan_http_status
+lwan_response_cache_urlmap(struct lwan_request *request,
+                           const struct lwan_url_map *url_map)
+{
+    return lwan_response_cache_handle(url_map->response_cache, url_map,
+                                      request);
+}
@@ -102,6 +102,270 @@ static inline bool has_response_body(enum lwan_request_flags method,
     return (method & 1 << 0) || status != HTTP_NOT_MODIFIED;
 }
 
+/* References to memory owned by handlers (see lwan_response_append_ref())
+ * are kept in a list of segments, interleaved with the parts of the response
+ * buffer written between them.  References shorter than MIN_REF_LEN are
+ * copied to the buffer instead, as writev() has to validate and copy the
+ * iovec anyway, and so are those that don't fit in the list. */
+#define MIN_REF_LEN 128
+#define MAX_SEGMENTS 32
+
+struct response_segment {
+    /* NULL for parts of the response buffer, which might move while it
+     * grows, so those are kept as offsets */
+    const char *base;
+    size_t offset;
+    size_t len;
+};
+
+struct lwan_response_segments {
+    size_t refs_len;    /* Sum of the lengths of all references */
+    size_t buffer_mark; /* Response buffer up to here is in a segment */
+    unsigned int n;
+    struct response_segment segment[MAX_SEGMENTS];
+
+    /* Headers, segments, and what's left of the response buffer */
+    struct iovec iov[MAX_SEGMENTS + 2];
+};
+
+static size_t response_body_length(const struct lwan_request *request)
+{
+    const struct lwan_response_segments *segs = request->helper->segments;
+    size_t len = lwan_strbuf_get_length(request->response.buffer);
+
+    return segs ? len + segs->refs_len : len;
+}
+
+static void reset_segments(struct lwan_request *request)
+{
+    struct lwan_response_segments *segs = request->helper->segments;
+
+    if (segs) {
+        segs->refs_len = segs->buffer_mark = 0;
+        segs->n = 0;
+    }
+}
+
+bool lwan_response_append_ref(struct lwan_request *request,
+                              const void *data,
+                              size_t len,
+                              void (*release)(void *data),
+                              void *release_data)
+{
+    struct lwan_response_segments *segs = request->helper->segments;
+    struct lwan_strbuf *buffer = request->response.buffer;
+    const size_t buffer_len = lwan_strbuf_get_length(buffer);
+
+    /* Whether the reference is kept or copied, it's released only once
+     * the request has been handled. */
+    if (release)
+        coro_defer(request->conn->coro, release, release_data);
+
+    if (len < MIN_REF_LEN)
+        return lwan_strbuf_append_str(buffer, data, len);
+
+    if (!segs) {
+        segs = coro_malloc(request->conn->coro, sizeof(*segs));
+        if (UNLIKELY(!segs))
+            return false;
+
+        request->helper->segments = segs;
+        reset_segments(request);
+    }
+
+    if (segs->n + 2 > MAX_SEGMENTS)
+        return lwan_strbuf_append_str(buffer, data, len);
+
+    if (buffer_len > segs->buffer_mark) {
+        segs->segment[segs->n++] = (struct response_segment){
+            .offset = segs->buffer_mark,
+            .len = buffer_len - segs->buffer_mark,
+        };
+        segs->buffer_mark = buffer_len;
+    }
+
+    segs->segment[segs->n++] = (struct response_segment){
+        .base = data,
+        .len = len,
+    };
+    segs->refs_len += len;
+
+    return true;
+}
+
+static int segments_to_iov(struct lwan_request *request, struct iovec *iov)
+{
+    const struct lwan_response_segments *segs = request->helper->segments;
+    char *buffer = lwan_strbuf_get_buffer(request->response.buffer);
+    const size_t buffer_len = lwan_strbuf_get_length(request->response.buffer);
+    int n = 0;
+
+    for (unsigned int i = 0; i < segs->n; i++) {
+        if (segs->segment[i].base) {
+            iov[n++] = (struct iovec){
+                .iov_base = (void *)segs->segment[i].base,
+                .iov_len = segs->segment[i].len,
+            };
+        } else if (LIKELY(segs->segment[i].offset + segs->segment[i].len <=
+                          buffer_len)) {
+            iov[n++] = (struct iovec){
+                .iov_base = buffer + segs->segment[i].offset,
+                .iov_len = segs->segment[i].len,
+            };
+        }
+    }
+
+    if (buffer_len > segs->buffer_mark) {
+        iov[n++] = (struct iovec){
+            .iov_base = buffer + segs->buffer_mark,
+            .iov_len = buffer_len - segs->buffer_mark,
+        };
+    }
+
+    return n;
+}
+
+/* Copies all references to the response buffer, for responses that are
+ * compressed or sent in pieces. */
+static bool flatten_segments(struct lwan_request *request)
+{
+    struct lwan_response_segments *segs = request->helper->segments;
+    struct lwan_strbuf flat;
+    bool flattened = false;
+    int iovcnt;
+
+    if (LIKELY(!segs || !segs->n))
+        return true;
+
+    if (UNLIKELY(!lwan_strbuf_init_with_size(&flat,
+                                             response_body_length(request))))
+        return false;
+
+    iovcnt = segments_to_iov(request, segs->iov);
+    for (int i = 0; i < iovcnt; i++) {
+        if (UNLIKELY(!lwan_strbuf_append_str(&flat, segs->iov[i].iov_base,
+                                             segs->iov[i].iov_len)))
+            goto out;
+    }
+
+    flattened = lwan_strbuf_set(request->response.buffer,
+                                lwan_strbuf_get_buffer(&flat),
+                                lwan_strbuf_get_length(&flat));
+    if (flattened)
+        reset_segments(request);
+
+out:
+    lwan_strbuf_free(&flat);
+    return flattened;
+}
+
+bool lwan_response_flatten(struct lwan_request *request)
+{
+    return flatten_segments(request);
+}
+
+static struct lwan_value compress_or_abort(struct lwan_request *request,
+                                           const struct iovec *iov,
+                                           int iovcnt,
+                                           bool finish)
+{
+    struct lwan_value out;
+
+    if (UNLIKELY(!lwan_compress_iov(request, iov, iovcnt, finish, &out))) {
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    return out;
+}
+
+/* Headers, chunks, and events that are small enough are appended to the
+ * queue used for pipelined responses instead of being written right away.
+ * That queue is written together with whatever is sent next, or before the
+ * connection waits for anything (reading the next request or the request
+ * body, sleeping, awaiting on a file descriptor, or once the request has
+ * been handled), so handlers producing many small pieces don't pay for a
+ * system call and a TCP segment for each one of them. */
+#define COALESCE_SIZE 16384
+
+static bool coalesce(struct lwan_request *request,
+                     const struct iovec *iov,
+                     int iovcnt)
+{
+    struct lwan_strbuf *queue = request->helper->queued_responses;
+    size_t len;
+
+    /* HTTP/2 streams have their own framing and flow control. */
+    if (!queue || (request->conn->flags & CONN_IS_HTTP2_STREAM))
+        return false;
+
+    len = lwan_strbuf_get_length(queue);
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if (len > COALESCE_SIZE || !lwan_strbuf_grow_to(queue, len))
+        return false;
+
+    request->helper->bytes_sent += len - lwan_strbuf_get_length(queue);
+    for (int i = 0; i < iovcnt; i++)
+        lwan_strbuf_append_str(queue, iov[i].iov_base, iov[i].iov_len);
+
+    return true;
+}
+
+void lwan_response_flush(struct lwan_request *request)
+{
+    lwan_send_queued_responses(request);
+}
+
+static void send_compressed(struct lwan_request *request,
+                            const struct iovec *iov,
+                            int iovcnt,
+                            bool finish)
+{
+    struct lwan_value out = compress_or_abort(request, iov, iovcnt, finish);
+    struct iovec vec = {.iov_base = out.value, .iov_len = out.len};
+
+    if (out.len && !coalesce(request, &vec, 1))
+        lwan_send(request, out.value, out.len, 0);
+}
+
+static void send_response(struct lwan_request *request,
+                          struct iovec *iov,
+                          int iovcnt,
+                          size_t body_len)
+{
+    const unsigned int zerocopy_threshold =
+        request->conn->thread->lwan->config.zerocopy_threshold;
+
+    if (UNLIKELY(zerocopy_threshold && body_len >= zerocopy_threshold))
+        lwan_writev_zerocopy(request, iov, iovcnt);
+    else
+        lwan_writev(request, iov, iovcnt);
+}
+
+static void send_or_queue(struct lwan_request *request,
+                          const char *buffer,
+                          size_t len)
+{
+    struct lwan_request_parser_helper *helper = request->helper;
+    struct lwan_strbuf *queue = helper->queued_responses;
+
+    /* If the client pipelined requests and there are more of them in the
+     * request buffer already, queue the response (which will be sent by
+     * the next write to the socket), so that they're sent with a single
+     * system call.  lwan_send() sends the queue if it'd grow too large. */
+    if (queue && helper->next_request && *helper->next_request &&
+        lwan_strbuf_get_length(queue) + len <=
+            request->conn->thread->lwan->config.pipeline_buffer_size) {
+        if (LIKELY(lwan_strbuf_append_str(queue, buffer, len))) {
+            helper->bytes_sent += len;
+            return;
+        }
+    }
+
+    lwan_send(request, buffer, len, 0);
+}
+
 void lwan_response(struct lwan_request *request, enum lwan_http_status status)
 {
     const struct lwan_response *response = &request->response;
@@ -110,11 +374,16 @@ void lwan_response(struct lwan_request *request, enum lwan_http_status status)
     if (UNLIKELY(request->flags & RESPONSE_CHUNKED_ENCODING)) {
         /* Send last, 0-sized chunk */
         lwan_strbuf_reset(response->buffer);
+        reset_segments(request);
         lwan_response_send_chunk(request);
         return;
     }
 
     if (UNLIKELY(request->flags & RESPONSE_SENT_HEADERS)) {
+        /* Event streams end once the handler returns */
+        if (UNLIKELY(request->helper->compressor != NULL))
+            send_compressed(request, NULL, 0, true);
+
         lwan_status_debug("Headers already sent, ignoring call");
         return;
     }
@@ -140,13 +409,30 @@ void lwan_response(struct lwan_request *request, enum lwan_http_status status)
         return;
     }
 
+    if (UNLIKELY(request->flags & RESPONSE_COMPRESS) &&
+        has_response_body(lwan_request_get_method(request), status)) {
+        if (UNLIKELY(!flatten_segments(request)))
+            return lwan_default_response(request, HTTP_INTERNAL_ERROR);
+
+        lwan_compress_response_buffer(request);
+    }
+
     size_t header_len =
         lwan_prepare_response_header(request, status, headers, sizeof(headers));
     if (UNLIKELY(!header_len))
         return lwan_default_response(request, HTTP_INTERNAL_ERROR);
 
     if (!has_response_body(lwan_request_get_method(request), status))
-        return (void)lwan_send(request, headers, header_len, 0);
+        return send_or_queue(request, headers, header_len);
+
+    if (UNLIKELY(request->helper->segments && request->helper->segments->n)) {
+        struct iovec *iov = request->helper->segments->iov;
+
+        iov[0] = (struct iovec){.iov_base = headers, .iov_len = header_len};
+        return send_response(request, iov,
+                             1 + segments_to_iov(request, iov + 1),
+                             response_body_length(request));
+    }
 
     char *resp_buf = lwan_strbuf_get_buffer(response->buffer);
     const size_t resp_len = lwan_strbuf_get_length(response->buffer);
@@ -155,7 +441,7 @@ void lwan_response(struct lwan_request *request, enum lwan_http_status status)
          * so use send() for responses small enough to fit the headers
          * buffer.  On Linux, this is ~10% faster.  */
         memcpy(headers + header_len, resp_buf, resp_len);
-        return (void)lwan_send(request, headers, header_len + resp_len, 0);
+        return send_or_queue(request, headers, header_len + resp_len);
     }
 
     struct iovec response_vec[] = {
@@ -163,13 +449,15 @@ void lwan_response(struct lwan_request *request, enum lwan_http_status status)
         {.iov_base = resp_buf, .iov_len = resp_len},
     };
 
-    return (void)lwan_writev(request, response_vec, N_ELEMENTS(response_vec));
+    return send_response(request, response_vec, N_ELEMENTS(response_vec),
+                         resp_len);
 }
 
 void lwan_default_response(struct lwan_request *request,
                            enum lwan_http_status status)
 {
     request->response.mime_type = "text/html";
+    reset_segments(request);
 
     lwan_tpl_apply_with_buffer(
         error_template, request->response.buffer,
@@ -216,6 +504,195 @@ void lwan_default_response(struct lwan_request *request,
 #define APPEND_CONSTANT(const_str_)                                            \
     APPEND_STRING_LEN((const_str_), sizeof(const_str_) - 1)
 
+/* Most responses differ only in their Content-Length, Date, and Expires
+ * headers (and whatever headers the handler added), so the rest of the
+ * header block is rendered once for each combination of status, MIME
+ * type, HTTP version and keep-alive, and kept in a small per-thread cache.
+ * A template is split in two parts: everything up to the Content-Length
+ * value, and everything after the handler headers, with placeholders for
+ * the date strings that are patched in place.  The output is the same as
+ * what the slow path would produce. */
+#define HEADER_TEMPLATE_CACHE_SIZE 8
+
+enum header_template_flags {
+    HEADER_TEMPLATE_HTTP_1_0 = 1 << 0,
+    HEADER_TEMPLATE_KEEP_ALIVE = 1 << 1,
+};
+
+struct header_template {
+    const struct lwan_strbuf *global_headers;
+    enum lwan_http_status status;
+    enum header_template_flags flags;
+    uint16_t prefix_len;
+    uint16_t suffix_len;
+    /* Offsets are relative to the start of the suffix */
+    uint16_t mime_type_offset;
+    uint16_t mime_type_len;
+    uint16_t date_offset;
+    uint16_t expires_offset;
+    char buffer[384];
+};
+
+static __thread struct header_template header_templates[HEADER_TEMPLATE_CACHE_SIZE];
+
+static size_t build_header_template(struct header_template *tpl,
+                                    const struct lwan_request *request,
+                                    enum lwan_http_status status,
+                                    enum header_template_flags flags,
+                                    const char *mime_type,
+                                    size_t mime_type_len)
+{
+    char *p_headers = tpl->buffer;
+    char *p_headers_end = tpl->buffer + sizeof(tpl->buffer);
+    char date[29], expires[29];
+    char *suffix;
+
+    if (flags & HEADER_TEMPLATE_HTTP_1_0)
+        APPEND_CONSTANT("HTTP/1.0 ");
+    else
+        APPEND_CONSTANT("HTTP/1.1 ");
+    APPEND_STRING(lwan_http_status_as_string_with_code(status));
+    APPEND_CONSTANT("\r\nContent-Length: ");
+    tpl->prefix_len = (uint16_t)(p_headers - tpl->buffer);
+
+    suffix = p_headers;
+    if (flags & HEADER_TEMPLATE_KEEP_ALIVE)
+        APPEND_CONSTANT("\r\nConnection: keep-alive");
+    else
+        APPEND_CONSTANT("\r\nConnection: close");
+
+    APPEND_CONSTANT("\r\nContent-Type: ");
+    tpl->mime_type_offset = (uint16_t)(p_headers - suffix);
+    tpl->mime_type_len = (uint16_t)mime_type_len;
+    APPEND_STRING_LEN(mime_type, mime_type_len);
+
+    /* Patched every time the template is used */
+    lwan_clock_get_dates(date, expires);
+
+    APPEND_CONSTANT("\r\nDate: ");
+    tpl->date_offset = (uint16_t)(p_headers - suffix);
+    APPEND_STRING_LEN(date, sizeof(date));
+
+    APPEND_CONSTANT("\r\nExpires: ");
+    tpl->expires_offset = (uint16_t)(p_headers - suffix);
+    APPEND_STRING_LEN(expires, sizeof(expires));
+
+    APPEND_STRING_LEN(lwan_strbuf_get_buffer(request->global_response_headers),
+                      lwan_strbuf_get_length(request->global_response_headers));
+    tpl->suffix_len = (uint16_t)(p_headers - suffix);
+
+    tpl->global_headers = request->global_response_headers;
+    tpl->status = status;
+    tpl->flags = flags;
+
+    return (size_t)(p_headers - tpl->buffer);
+}
+
+static inline bool
+can_use_header_template(const struct lwan_request *request,
+                        enum lwan_http_status status,
+                        const struct lwan_key_value *additional_headers)
+{
+    if (request->flags & (RESPONSE_CHUNKED_ENCODING |
+                          RESPONSE_NO_CONTENT_LENGTH | RESPONSE_STREAM |
+                          REQUEST_ALLOW_CORS))
+        return false;
+    if (request->conn->flags & CONN_IS_UPGRADE)
+        return false;
+    if (!request->response.mime_type)
+        return false;
+    if ((request->flags & RESPONSE_COMPRESS) && request->helper->compressor)
+        return false;
+
+    /* Additional headers are ignored for errors, except for
+     * WWW-Authenticate and Retry-After. */
+    return (status != HTTP_NOT_AUTHORIZED &&
+            status != HTTP_TOO_MANY_REQUESTS) ||
+           !additional_headers;
+}
+
+static size_t prepare_response_header_from_template(
+    struct lwan_request *request,
+    enum lwan_http_status status,
+    char headers[],
+    size_t headers_buf_size,
+    const struct lwan_key_value *additional_headers)
+{
+    const char *mime_type = request->response.mime_type;
+    const size_t mime_type_len = strlen(mime_type);
+    enum header_template_flags flags = 0;
+    struct header_template *tpl;
+    char *p_headers;
+    char *p_headers_end = headers + headers_buf_size;
+    char buffer[INT_TO_STR_BUFFER_SIZE];
+    char *suffix;
+
+    if (request->flags & REQUEST_IS_HTTP_1_0)
+        flags |= HEADER_TEMPLATE_HTTP_1_0;
+    if (request->conn->flags & CONN_IS_KEEP_ALIVE)
+        flags |= HEADER_TEMPLATE_KEEP_ALIVE;
+
+    /* MIME types are usually string constants, so the pointer is a cheap
+     * hash; the contents are compared anyway, as handlers might reuse the
+     * same buffer for different types. */
+    tpl = &header_templates[((uintptr_t)mime_type >> 3 ^ (uintptr_t)status ^
+                             (uintptr_t)flags) %
+                            HEADER_TEMPLATE_CACHE_SIZE];
+    if (UNLIKELY(tpl->status != status || tpl->flags != flags ||
+                 tpl->global_headers != request->global_response_headers ||
+                 tpl->mime_type_len != mime_type_len ||
+                 memcmp(tpl->buffer + tpl->prefix_len + tpl->mime_type_offset,
+                        mime_type, mime_type_len))) {
+        if (UNLIKELY(!build_header_template(tpl, request, status, flags,
+                                            mime_type, mime_type_len))) {
+            /* Too large to be cached (e.g. lots of global headers); make
+             * sure this half-built template won't match anything. */
+            tpl->global_headers = NULL;
+            return 0;
+        }
+    }
+
+    p_headers = headers;
+    APPEND_STRING_LEN(tpl->buffer, tpl->prefix_len);
+    APPEND_UINT(response_body_length(request));
+
+    if (status < HTTP_BAD_REQUEST && additional_headers) {
+        const struct lwan_key_value *header;
+
+        for (header = additional_headers; header->key; header++) {
+            STRING_SWITCH_L(header->key) {
+            case STR4_INT_L('S', 'e', 'r', 'v'):
+                if (LIKELY(streq(header->key + 4, "er")))
+                    continue;
+                break;
+            case STR4_INT_L('D', 'a', 't', 'e'):
+                if (LIKELY(*(header->key + 4) == '\0'))
+                    return 0;
+                break;
+            case STR4_INT_L('E', 'x', 'p', 'i'):
+                if (LIKELY(streq(header->key + 4, "res")))
+                    return 0;
+                break;
+            }
+
+            RETURN_0_ON_OVERFLOW(4);
+            APPEND_CHAR_NOCHECK('\r');
+            APPEND_CHAR_NOCHECK('\n');
+            APPEND_STRING(header->key);
+            APPEND_CHAR_NOCHECK(':');
+            APPEND_CHAR_NOCHECK(' ');
+            APPEND_STRING(header->value);
+        }
+    }
+
+    suffix = p_headers;
+    APPEND_STRING_LEN(tpl->buffer + tpl->prefix_len, tpl->suffix_len);
+    lwan_clock_get_dates(suffix + tpl->date_offset,
+                         suffix + tpl->expires_offset);
+
+    return (size_t)(p_headers - headers);
+}
+
 size_t lwan_prepare_response_header_full(
     struct lwan_request *request,
     enum lwan_http_status status,
@@ -234,6 +711,14 @@ size_t lwan_prepare_response_header_full(
 
     assert(request->global_response_headers);
 
+    if (LIKELY(can_use_header_template(request, status, additional_headers))) {
+        size_t len = prepare_response_header_from_template(
+            request, status, headers, headers_buf_size, additional_headers);
+
+        if (LIKELY(len))
+            return len;
+    }
+
     p_headers = headers;
 
     if (UNLIKELY(request->flags & REQUEST_IS_HTTP_1_0))
@@ -248,7 +733,7 @@ size_t lwan_prepare_response_header_full(
         /* Do nothing. */
     } else if (!(request->flags & RESPONSE_STREAM)) {
         APPEND_CONSTANT("\r\nContent-Length: ");
-        APPEND_UINT(lwan_strbuf_get_length(request->response.buffer));
+        APPEND_UINT(response_body_length(request));
     }
 
     if (LIKELY((status < HTTP_BAD_REQUEST && additional_headers))) {
@@ -288,6 +773,16 @@ size_t lwan_prepare_response_header_full(
                 break;
             }
         }
+    } else if (UNLIKELY(status == HTTP_TOO_MANY_REQUESTS) && additional_headers) {
+        const struct lwan_key_value *header;
+
+        for (header = additional_headers; header->key; header++) {
+            if (streq(header->key, "Retry-After")) {
+                APPEND_CONSTANT("\r\nRetry-After: ");
+                APPEND_STRING(header->value);
+                break;
+            }
+        }
     }
 
     if (UNLIKELY(request->conn->flags & CONN_IS_UPGRADE)) {
@@ -307,16 +802,41 @@ size_t lwan_prepare_response_header_full(
             APPEND_CONSTANT("\r\nContent-Type: ");
             APPEND_STRING(request->response.mime_type);
         }
-    }
 
-    if (LIKELY(!date_overridden)) {
-        APPEND_CONSTANT("\r\nDate: ");
-        APPEND_STRING_LEN(request->conn->thread->date.date, 29);
+        if (UNLIKELY(request->flags & RESPONSE_COMPRESS) &&
+            request->helper->compressor) {
+            APPEND_CONSTANT("\r\nContent-Encoding: ");
+            APPEND_STRING(lwan_compress_get_encoding(request));
+
+            if (request->helper->compress_dict) {
+                const char *link = lwan_compress_get_dict_link(request);
+
+                APPEND_CONSTANT(
+                    "\r\nVary: Accept-Encoding, Available-Dictionary");
+                if (link) {
+                    APPEND_CONSTANT("\r\nLink: ");
+                    APPEND_STRING(link);
+                }
+            } else {
+                APPEND_CONSTANT("\r\nVary: Accept-Encoding");
+            }
+        }
     }
 
-    if (LIKELY(!expires_overridden)) {
-        APPEND_CONSTANT("\r\nExpires: ");
-        APPEND_STRING_LEN(request->conn->thread->date.expires, 29);
+    if (LIKELY(!date_overridden || !expires_overridden)) {
+        char date[29], expires[29];
+
+        lwan_clock_get_dates(date, expires);
+
+        if (LIKELY(!date_overridden)) {
+            APPEND_CONSTANT("\r\nDate: ");
+            APPEND_STRING_LEN(date, sizeof(date));
+        }
+
+        if (LIKELY(!expires_overridden)) {
+            APPEND_CONSTANT("\r\nExpires: ");
+            APPEND_STRING_LEN(expires, sizeof(expires));
+        }
     }
 
     if (UNLIKELY(request->flags & REQUEST_ALLOW_CORS)) {
@@ -360,13 +880,18 @@ bool lwan_response_set_chunked(struct lwan_request *request,
         return false;
 
     request->flags |= RESPONSE_CHUNKED_ENCODING;
+    if (request->flags & RESPONSE_COMPRESS)
+        lwan_compress_response_stream(request);
     buffer_len = lwan_prepare_response_header(request, status, buffer,
                                               DEFAULT_BUFFER_SIZE);
     if (UNLIKELY(!buffer_len))
         return false;
 
     request->flags |= RESPONSE_SENT_HEADERS;
-    lwan_send(request, buffer, buffer_len, MSG_MORE);
+    if (!coalesce(request,
+                  &(struct iovec){.iov_base = buffer, .iov_len = buffer_len},
+                  1))
+        lwan_send(request, buffer, buffer_len, MSG_MORE);
 
     return true;
 }
@@ -378,7 +903,34 @@ void lwan_response_send_chunk(struct lwan_request *request)
             return;
     }
 
+    if (UNLIKELY(!flatten_segments(request))) {
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    char *buffer = lwan_strbuf_get_buffer(request->response.buffer);
     size_t buffer_len = lwan_strbuf_get_length(request->response.buffer);
+    const bool last = !buffer_len;
+
+    if (UNLIKELY(request->helper->compressor != NULL)) {
+        struct iovec vec = {.iov_base = buffer, .iov_len = buffer_len};
+        struct lwan_value out =
+            compress_or_abort(request, &vec, last ? 0 : 1, last);
+
+        buffer = out.value;
+        buffer_len = out.len;
+    }
+
+    if (UNLIKELY(request->conn->flags & CONN_IS_HTTP2_STREAM)) {
+        /* HTTP/2 has its own framing; the end of the stream is signaled
+         * once the handler returns. */
+        if (buffer_len) {
+            lwan_send(request, buffer, buffer_len, 0);
+            lwan_strbuf_reset(request->response.buffer);
+        }
+        return;
+    }
+
     if (UNLIKELY(!buffer_len)) {
         static const char last_chunk[] = "0\r\n\r\n";
         lwan_send(request, last_chunk, sizeof(last_chunk) - 1, 0);
@@ -395,14 +947,19 @@ void lwan_response_send_chunk(struct lwan_request *request)
     }
     size_t chunk_size_len = (size_t)converted_len;
 
+    /* The compressed stream trailer goes out with the last chunk. */
     struct iovec chunk_vec[] = {
         {.iov_base = chunk_size, .iov_len = chunk_size_len},
-        {.iov_base = lwan_strbuf_get_buffer(request->response.buffer),
-         .iov_len = buffer_len},
+        {.iov_base = buffer, .iov_len = buffer_len},
         {.iov_base = "\r\n", .iov_len = 2},
+        {.iov_base = "0\r\n\r\n", .iov_len = 5},
     };
 
-    lwan_writev(request, chunk_vec, N_ELEMENTS(chunk_vec));
+    if (last) {
+        lwan_writev(request, chunk_vec, N_ELEMENTS(chunk_vec));
+    } else if (!coalesce(request, chunk_vec, N_ELEMENTS(chunk_vec) - 1)) {
+        lwan_writev(request, chunk_vec, N_ELEMENTS(chunk_vec) - 1);
+    }
 
     lwan_strbuf_reset(request->response.buffer);
 }
@@ -418,13 +975,18 @@ bool lwan_response_set_event_stream(struct lwan_request *request,
 
     request->response.mime_type = "text/event-stream";
     request->flags |= RESPONSE_NO_CONTENT_LENGTH;
+    if (request->flags & RESPONSE_COMPRESS)
+        lwan_compress_response_stream(request);
     buffer_len = lwan_prepare_response_header(request, status, buffer,
                                               DEFAULT_BUFFER_SIZE);
     if (UNLIKELY(!buffer_len))
         return false;
 
     request->flags |= RESPONSE_SENT_HEADERS;
-    lwan_send(request, buffer, buffer_len, MSG_MORE);
+    if (!coalesce(request,
+                  &(struct iovec){.iov_base = buffer, .iov_len = buffer_len},
+                  1))
+        lwan_send(request, buffer, buffer_len, MSG_MORE);
 
     return true;
 }
@@ -439,6 +1001,11 @@ void lwan_response_send_event(struct lwan_request *request, const char *event)
             return;
     }
 
+    if (UNLIKELY(!flatten_segments(request))) {
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
     if (event) {
         vec[last++] = (struct iovec){
             .iov_base = "event: ",
@@ -471,8 +1038,29 @@ void lwan_response_send_event(struct lwan_request *request, const char *event)
         .iov_len = 4,
     };
 
-    lwan_writev(request, vec, last);
+    if (UNLIKELY(request->helper->compressor != NULL))
+        send_compressed(request, vec, last, false);
+    else if (!coalesce(request, vec, last))
+        lwan_writev(request, vec, last);
 
     lwan_strbuf_reset(request->response.buffer);
     coro_yield(request->conn->coro, CONN_CORO_WANT_WRITE);
 }
+
+void lwan_response_send_framed_event(struct lwan_request *request,
+                                     const struct lwan_value *event)
+{
+    struct iovec vec = {.iov_base = event->value, .iov_len = event->len};
+
+    if (!(request->flags & RESPONSE_SENT_HEADERS)) {
+        if (UNLIKELY(!lwan_response_set_event_stream(request, HTTP_OK)))
+            return;
+    }
+
+    if (UNLIKELY(request->helper->compressor != NULL))
+        send_compressed(request, &vec, 1, false);
+    else if (!coalesce(request, &vec, 1))
+        lwan_writev(request, &vec, 1);
+
+    coro_yield(request->conn->coro, CONN_CORO_WANT_WRITE);
+}
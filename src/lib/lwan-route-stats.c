@@ -0,0 +1,186 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwan-private.h"
+
+#include "list.h"
+
+/* Histograms are kept for every URL map, in every I/O thread.  Only the
+ * thread owning a histogram writes to it, without atomic operations nor
+ * locks; the metrics module reads (and merges) them whenever it's asked
+ * to, and might see a request counted in a bucket but not in the sum yet,
+ * which is fine.  The block of histograms for a URL map is allocated by
+ * the first thread handling a request for it, and is added to a list,
+ * protected by a lock, that the metrics module goes through. */
+
+struct lwan_route_stats {
+    struct list_node list;
+    const char *prefix;
+    unsigned int n_threads;
+
+    struct {
+        struct lwan_histogram histograms[LWAN_ROUTE_N];
+    } __attribute__((aligned(64))) thread[];
+};
+
+static struct list_head all_stats = {{&all_stats.n, &all_stats.n}};
+static pthread_mutex_t all_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Two buckets per power of 2: values 0 and 1 have their own buckets, and
+ * every other value v, with 2^e <= v < 2^(e+1), goes either to bucket 2e
+ * (if v < 1.5 * 2^e) or to bucket 2e + 1.  This is good to ~25%, and the
+ * last bucket takes everything from 1.5 * 2^31 up. */
+static ALWAYS_INLINE unsigned int bucket_index(uint64_t value)
+{
+    unsigned int e, index;
+
+    if (value < 2)
+        return (unsigned int)value;
+
+    e = 63u - (unsigned int)__builtin_clzll(value);
+    index = 2 * e + (unsigned int)((value >> (e - 1)) & 1);
+
+    return LWAN_MIN(index, LWAN_HISTOGRAM_BUCKETS - 1u);
+}
+
+static uint64_t bucket_lower_bound(unsigned int bucket)
+{
+    if (bucket < 2)
+        return bucket;
+
+    const unsigned int e = bucket / 2;
+    return (1ull << e) + (bucket & 1) * (1ull << (e - 1));
+}
+
+uint64_t lwan_histogram_bucket_upper_bound(unsigned int bucket)
+{
+    if (bucket >= LWAN_HISTOGRAM_BUCKETS - 1)
+        return UINT64_MAX;
+
+    return bucket_lower_bound(bucket + 1) - 1;
+}
+
+static struct lwan_route_stats *stats_new(struct lwan_url_map *url_map,
+                                          unsigned int n_threads)
+{
+    struct lwan_route_stats *stats, *expected = NULL;
+    size_t size = sizeof(*stats) + n_threads * sizeof(stats->thread[0]);
+
+    if (UNLIKELY(posix_memalign((void **)&stats, 64, size)))
+        return NULL;
+
+    memset(stats, 0, size);
+    stats->prefix = url_map->prefix;
+    stats->n_threads = n_threads;
+
+    /* Another thread might be doing this for the same map. */
+    if (!__atomic_compare_exchange_n(&url_map->stats, &expected, stats, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(stats);
+        return expected;
+    }
+
+    pthread_mutex_lock(&all_stats_lock);
+    list_add_tail(&all_stats, &stats->list);
+    pthread_mutex_unlock(&all_stats_lock);
+
+    return stats;
+}
+
+void lwan_route_stats_record(struct lwan_request *request,
+                             struct lwan_url_map *url_map,
+                             const uint64_t values[static LWAN_ROUTE_N])
+{
+    const struct lwan_thread *t = request->conn->thread;
+    const struct lwan *l = t->lwan;
+    struct lwan_route_stats *stats =
+        __atomic_load_n(&url_map->stats, __ATOMIC_ACQUIRE);
+    struct lwan_histogram *histograms;
+
+    /* Requests can be processed by threads other than the I/O threads
+     * (e.g. by benchmarks or tests calling lwan_process_request()), and
+     * there's no slot for them. */
+    if (UNLIKELY((uintptr_t)t < (uintptr_t)l->thread.threads ||
+                 (uintptr_t)t >=
+                     (uintptr_t)(l->thread.threads + l->thread.count)))
+        return;
+
+    if (UNLIKELY(!stats)) {
+        stats = stats_new(url_map, l->thread.count);
+        if (UNLIKELY(!stats))
+            return;
+    }
+
+    histograms = stats->thread[t - l->thread.threads].histograms;
+    for (int i = 0; i < LWAN_ROUTE_N; i++) {
+        histograms[i].buckets[bucket_index(values[i])]++;
+        histograms[i].sum += values[i];
+    }
+}
+
+void lwan_route_stats_free(struct lwan_route_stats *stats)
+{
+    if (!stats)
+        return;
+
+    pthread_mutex_lock(&all_stats_lock);
+    list_del_from(&all_stats, &stats->list);
+    pthread_mutex_unlock(&all_stats_lock);
+
+    free(stats);
+}
+
+bool lwan_route_stats_for_each(
+    bool (*cb)(const char *prefix,
+               const struct lwan_histogram merged[static LWAN_ROUTE_N],
+               void *data),
+    void *data)
+{
+    struct lwan_histogram merged[LWAN_ROUTE_N];
+    struct lwan_route_stats *stats;
+    bool ret = true;
+
+    pthread_mutex_lock(&all_stats_lock);
+    list_for_each (&all_stats, stats, list) {
+        memset(merged, 0, sizeof(merged));
+
+        for (unsigned int t = 0; t < stats->n_threads; t++) {
+            const struct lwan_histogram *h = stats->thread[t].histograms;
+
+            for (int i = 0; i < LWAN_ROUTE_N; i++) {
+                for (int b = 0; b < LWAN_HISTOGRAM_BUCKETS; b++)
+                    merged[i].buckets[b] += ATOMIC_READ(h[i].buckets[b]);
+                merged[i].sum += ATOMIC_READ(h[i].sum);
+            }
+        }
+
+        if (!cb(stats->prefix, merged, data)) {
+            ret = false;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&all_stats_lock);
+
+    return ret;
+}
@@ -0,0 +1,383 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lwan-private.h"
+
+#include "hash.h"
+#include "list.h"
+#include "lwan-shared-dict.h"
+
+#define SHARED_DICT_N_STRIPES 16
+
+struct entry {
+    /* Most recently used entries are at the head of the stripe list */
+    struct list_node lru;
+    uint64_t expires_ms; /* 0 if the entry doesn't expire */
+    int64_t integer;
+    size_t len;
+    bool is_integer;
+    /* String value (if any), followed by the NUL-terminated key */
+    char data[];
+};
+
+struct stripe {
+    struct hash *table;
+    struct list_head lru;
+    pthread_mutex_t lock;
+} __attribute__((aligned(64)));
+
+struct lwan_shared_dict {
+    struct stripe stripes[SHARED_DICT_N_STRIPES];
+    unsigned int max_entries_per_stripe;
+};
+
+static struct hash *named_dicts;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &ts) < 0))
+        return 0;
+
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t expires_ms(uint64_t ttl_ms)
+{
+    return ttl_ms ? now_ms() + ttl_ms : 0;
+}
+
+static inline const char *entry_key(const struct entry *entry)
+{
+    return entry->data + entry->len;
+}
+
+static inline bool entry_expired(const struct entry *entry, uint64_t now)
+{
+    return entry->expires_ms && entry->expires_ms <= now;
+}
+
+static inline struct stripe *stripe_for_hash(struct lwan_shared_dict *dict,
+                                             unsigned int hash)
+{
+    /* Same reasoning as in lwan-cache.c: the hash table uses the lower
+     * bits and the upper 7 bits, so use the bits right below those. */
+    static_assert((SHARED_DICT_N_STRIPES & (SHARED_DICT_N_STRIPES - 1)) == 0,
+                  "Number of stripes is a power of 2");
+    const unsigned int shift =
+        sizeof(hash) * 8 - 7 - (unsigned int)__builtin_ctz(SHARED_DICT_N_STRIPES);
+
+    return &dict->stripes[(hash >> shift) & (SHARED_DICT_N_STRIPES - 1)];
+}
+
+struct lwan_shared_dict *lwan_shared_dict_new(size_t max_entries)
+{
+    struct lwan_shared_dict *dict;
+    size_t per_stripe;
+    int i;
+
+    if (!max_entries)
+        return NULL;
+
+    dict = calloc(1, sizeof(*dict));
+    if (!dict)
+        return NULL;
+
+    per_stripe = (max_entries + SHARED_DICT_N_STRIPES - 1) / SHARED_DICT_N_STRIPES;
+    dict->max_entries_per_stripe =
+        (unsigned int)LWAN_MIN(per_stripe, (size_t)UINT_MAX);
+
+    for (i = 0; i < SHARED_DICT_N_STRIPES; i++) {
+        struct stripe *stripe = &dict->stripes[i];
+
+        /* Keys live inside the entries, so only those are freed. */
+        stripe->table = hash_str_new(NULL, free);
+        if (!stripe->table)
+            goto error;
+
+        if (pthread_mutex_init(&stripe->lock, NULL)) {
+            hash_free(stripe->table);
+            goto error;
+        }
+
+        list_head_init(&stripe->lru);
+    }
+
+    return dict;
+
+error:
+    while (--i >= 0) {
+        hash_free(dict->stripes[i].table);
+        pthread_mutex_destroy(&dict->stripes[i].lock);
+    }
+    free(dict);
+    return NULL;
+}
+
+void lwan_shared_dict_free(struct lwan_shared_dict *dict)
+{
+    if (!dict)
+        return;
+
+    for (int i = 0; i < SHARED_DICT_N_STRIPES; i++) {
+        hash_free(dict->stripes[i].table);
+        pthread_mutex_destroy(&dict->stripes[i].lock);
+    }
+
+    free(dict);
+}
+
+static void remove_entry(struct stripe *stripe, struct entry *entry)
+{
+    list_del_from(&stripe->lru, &entry->lru);
+    hash_del(stripe->table, entry_key(entry));
+}
+
+/* Must be called with the stripe lock held.  Expired entries are removed
+ * as they're found. */
+static struct entry *
+find_entry(struct stripe *stripe, const char *key, unsigned int hash)
+{
+    struct entry *entry = hash_find_hashed(stripe->table, key, hash);
+
+    if (!entry)
+        return NULL;
+
+    if (entry_expired(entry, now_ms())) {
+        remove_entry(stripe, entry);
+        return NULL;
+    }
+
+    list_del_from(&stripe->lru, &entry->lru);
+    list_add(&stripe->lru, &entry->lru);
+
+    return entry;
+}
+
+/* Must be called with the stripe lock held. */
+static void make_room(struct lwan_shared_dict *dict, struct stripe *stripe)
+{
+    struct entry *entry;
+
+    if (hash_get_count(stripe->table) < dict->max_entries_per_stripe)
+        return;
+
+    /* The least recently used entry is evicted, whether it expired or not. */
+    entry = list_tail(&stripe->lru, struct entry, lru);
+    if (entry)
+        remove_entry(stripe, entry);
+}
+
+/* Must be called with the stripe lock held.  Replaces any entry with the
+ * same key. */
+static struct entry *add_entry(struct lwan_shared_dict *dict,
+                               struct stripe *stripe,
+                               const char *key,
+                               unsigned int hash,
+                               const char *value,
+                               size_t len)
+{
+    struct entry *old = hash_find_hashed(stripe->table, key, hash);
+    size_t key_len = strlen(key);
+    struct entry *entry;
+
+    entry = malloc(sizeof(*entry) + len + key_len + 1);
+    if (!entry)
+        return NULL;
+
+    entry->len = len;
+    entry->integer = 0;
+    entry->is_integer = false;
+    entry->expires_ms = 0;
+    if (len)
+        memcpy(entry->data, value, len);
+    memcpy(entry->data + len, key, key_len + 1);
+
+    if (old)
+        remove_entry(stripe, old);
+    else
+        make_room(dict, stripe);
+
+    if (hash_add(stripe->table, entry_key(entry), entry) < 0) {
+        free(entry);
+        return NULL;
+    }
+
+    list_add(&stripe->lru, &entry->lru);
+
+    return entry;
+}
+
+bool lwan_shared_dict_set(struct lwan_shared_dict *dict,
+                          const char *key,
+                          const char *value,
+                          size_t len,
+                          uint64_t ttl_ms)
+{
+    const unsigned int hash = hash_str_value(key);
+    struct stripe *stripe = stripe_for_hash(dict, hash);
+    struct entry *entry;
+
+    pthread_mutex_lock(&stripe->lock);
+    entry = add_entry(dict, stripe, key, hash, value, len);
+    if (entry)
+        entry->expires_ms = expires_ms(ttl_ms);
+    pthread_mutex_unlock(&stripe->lock);
+
+    return entry != NULL;
+}
+
+bool lwan_shared_dict_set_integer(struct lwan_shared_dict *dict,
+                                  const char *key,
+                                  int64_t value,
+                                  uint64_t ttl_ms)
+{
+    const unsigned int hash = hash_str_value(key);
+    struct stripe *stripe = stripe_for_hash(dict, hash);
+    struct entry *entry;
+
+    pthread_mutex_lock(&stripe->lock);
+    entry = add_entry(dict, stripe, key, hash, NULL, 0);
+    if (entry) {
+        entry->is_integer = true;
+        entry->integer = value;
+        entry->expires_ms = expires_ms(ttl_ms);
+    }
+    pthread_mutex_unlock(&stripe->lock);
+
+    return entry != NULL;
+}
+
+enum lwan_shared_dict_value_type
+lwan_shared_dict_get(struct lwan_shared_dict *dict,
+                     const char *key,
+                     struct lwan_strbuf *string,
+                     int64_t *integer)
+{
+    const unsigned int hash = hash_str_value(key);
+    struct stripe *stripe = stripe_for_hash(dict, hash);
+    enum lwan_shared_dict_value_type type = LWAN_SHARED_DICT_NOT_FOUND;
+    struct entry *entry;
+
+    pthread_mutex_lock(&stripe->lock);
+    entry = find_entry(stripe, key, hash);
+    if (entry) {
+        if (entry->is_integer) {
+            *integer = entry->integer;
+            type = LWAN_SHARED_DICT_INTEGER;
+        } else if (lwan_strbuf_set(string, entry->data, entry->len)) {
+            type = LWAN_SHARED_DICT_STRING;
+        }
+    }
+    pthread_mutex_unlock(&stripe->lock);
+
+    return type;
+}
+
+bool lwan_shared_dict_incr(struct lwan_shared_dict *dict,
+                           const char *key,
+                           int64_t delta,
+                           uint64_t ttl_ms,
+                           int64_t *result)
+{
+    const unsigned int hash = hash_str_value(key);
+    struct stripe *stripe = stripe_for_hash(dict, hash);
+    struct entry *entry;
+    bool ret = false;
+
+    pthread_mutex_lock(&stripe->lock);
+    entry = find_entry(stripe, key, hash);
+    if (!entry) {
+        entry = add_entry(dict, stripe, key, hash, NULL, 0);
+        if (!entry)
+            goto out;
+
+        entry->is_integer = true;
+        entry->expires_ms = expires_ms(ttl_ms);
+    } else if (!entry->is_integer) {
+        goto out;
+    }
+
+    entry->integer += delta;
+    *result = entry->integer;
+    ret = true;
+
+out:
+    pthread_mutex_unlock(&stripe->lock);
+    return ret;
+}
+
+bool lwan_shared_dict_delete(struct lwan_shared_dict *dict, const char *key)
+{
+    const unsigned int hash = hash_str_value(key);
+    struct stripe *stripe = stripe_for_hash(dict, hash);
+    struct entry *entry;
+
+    pthread_mutex_lock(&stripe->lock);
+    entry = hash_find_hashed(stripe->table, key, hash);
+    if (entry)
+        remove_entry(stripe, entry);
+    pthread_mutex_unlock(&stripe->lock);
+
+    return entry != NULL;
+}
+
+static void free_named_dict(void *value) { lwan_shared_dict_free(value); }
+
+bool lwan_shared_dict_register(const char *name, struct lwan_shared_dict *dict)
+{
+    char *key;
+
+    if (!named_dicts) {
+        named_dicts = hash_str_new(free, free_named_dict);
+        if (!named_dicts)
+            return false;
+    }
+
+    key = strdup(name);
+    if (!key)
+        return false;
+
+    if (hash_add_unique(named_dicts, key, dict) < 0) {
+        free(key);
+        return false;
+    }
+
+    return true;
+}
+
+struct lwan_shared_dict *lwan_shared_dict_find(const char *name)
+{
+    /* No locking: the registry isn't modified after initialization. */
+    return named_dicts ? hash_find(named_dicts, name) : NULL;
+}
+
+void lwan_shared_dict_shutdown(void)
+{
+    hash_free(named_dicts);
+    named_dicts = NULL;
+}
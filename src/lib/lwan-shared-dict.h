@@ -0,0 +1,80 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A key/value dictionary shared by all threads, holding at most a fixed
+ * number of entries (least recently used entries are evicted to make room
+ * for new ones).  Values are either strings or integers, and may expire
+ * after a while.  Keys are spread over a number of independently locked
+ * stripes, so threads working on different keys seldom contend. */
+
+struct lwan_shared_dict;
+struct lwan_strbuf;
+
+enum lwan_shared_dict_value_type {
+    LWAN_SHARED_DICT_NOT_FOUND,
+    LWAN_SHARED_DICT_STRING,
+    LWAN_SHARED_DICT_INTEGER,
+};
+
+struct lwan_shared_dict *lwan_shared_dict_new(size_t max_entries);
+void lwan_shared_dict_free(struct lwan_shared_dict *dict);
+
+/* A time to live of 0 means that the entry doesn't expire. */
+bool lwan_shared_dict_set(struct lwan_shared_dict *dict,
+                          const char *key,
+                          const char *value,
+                          size_t len,
+                          uint64_t ttl_ms);
+bool lwan_shared_dict_set_integer(struct lwan_shared_dict *dict,
+                                  const char *key,
+                                  int64_t value,
+                                  uint64_t ttl_ms);
+
+/* String values are copied to @string, integers to @integer. */
+enum lwan_shared_dict_value_type
+lwan_shared_dict_get(struct lwan_shared_dict *dict,
+                     const char *key,
+                     struct lwan_strbuf *string,
+                     int64_t *integer);
+
+/* Atomically adds @delta to an integer entry, storing the new value in
+ * @result.  Entries that don't exist (or have expired) are created with
+ * @delta as their value and @ttl_ms as their time to live; the time to live
+ * of existing entries is kept.  Fails if the entry holds a string. */
+bool lwan_shared_dict_incr(struct lwan_shared_dict *dict,
+                           const char *key,
+                           int64_t delta,
+                           uint64_t ttl_ms,
+                           int64_t *result);
+
+bool lwan_shared_dict_delete(struct lwan_shared_dict *dict, const char *key);
+
+/* Dictionaries can be given a name, so that they can be found by handlers
+ * and Lua scripts.  Names can only be registered during initialization,
+ * before any I/O thread is started; the dictionary is then owned by the
+ * registry, and is freed by lwan_shared_dict_shutdown(). */
+bool lwan_shared_dict_register(const char *name, struct lwan_shared_dict *dict);
+struct lwan_shared_dict *lwan_shared_dict_find(const char *name);
+void lwan_shared_dict_shutdown(void);
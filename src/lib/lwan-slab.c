@@ -0,0 +1,424 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwan-private.h"
+#include "list.h"
+
+/* Small objects that live as long as a connection or a subscription (e.g.
+ * pubsub subscribers and their queues, or WebSocket compression state) are
+ * allocated from slabs: SLAB_SIZE-aligned blocks, each one carved into
+ * objects of a single size class, owned by the thread that allocated them.
+ * Objects of the same kind end up next to each other instead of scattered
+ * among short-lived allocations, and slabs are given back to the system as
+ * soon as they're empty (except for one per size class), which keeps
+ * long-running processes from growing because of fragmentation.
+ *
+ * The slab an object belongs to is found by masking its address.  The
+ * owning thread allocates and frees without any atomic operations; other
+ * threads push the objects they free to a lock-free list in the slab,
+ * which the owner takes back once it runs out of free objects.  When a
+ * thread exits, its slabs are marked as orphaned; objects still alive at
+ * that point are freed under a global lock, and the slabs are released as
+ * they become empty. */
+
+#define SLAB_SIZE ((size_t)64 * 1024)
+#define SLAB_HEADER_SIZE ((sizeof(struct slab) + 63) & ~(size_t)63)
+#define SLAB_N_CLASSES 17 /* 16, 24, 32, 48, ..., 3072, 4096 */
+
+static_assert(LWAN_SLAB_MAX_SIZE == 4096, "Size classes end at the maximum");
+
+struct slab_object {
+    struct slab_object *next;
+};
+
+struct slab_heap;
+
+struct slab {
+    struct list_node slabs;
+    struct slab_heap *heap;
+    struct slab_object *free; /* Only touched by the owner */
+    char *unused;             /* Objects past this were never handed out */
+    unsigned int class;
+    unsigned int used;
+    bool full;                /* Moved to the tail of the list */
+
+    /* Pushed to by other threads; (void *)-1 once orphaned */
+    struct slab_object *remote_free __attribute__((aligned(64)));
+};
+
+#define SLAB_ORPHANED ((struct slab_object *)(intptr_t)-1)
+
+struct slab_heap {
+    struct list_node heaps;
+    struct list_head slabs[SLAB_N_CLASSES]; /* Slabs with free objects first */
+
+    /* Read without locks by lwan_slab_get_stats() */
+    struct {
+        uint64_t slabs;
+        uint64_t objects;
+    } stats[SLAB_N_CLASSES];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    pthread_key_t key;
+    struct list_head heaps;
+} registry = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+    .heaps = {.n = {.next = &registry.heaps.n, .prev = &registry.heaps.n}},
+};
+
+static __thread struct slab_heap *current_heap;
+
+static inline size_t class_size(unsigned int class)
+{
+    if (!class)
+        return 16;
+    if (class & 1)
+        return (size_t)3 << (class / 2 + 3);
+    return (size_t)16 << (class / 2);
+}
+
+static inline unsigned int size_class(size_t size)
+{
+    unsigned int shift, class;
+
+    if (size <= 16)
+        return 0;
+
+    /* Each power of two is split in two classes: 2^n and 1.5 * 2^n. */
+    shift = (unsigned int)(63 - __builtin_clzl(size - 1));
+    class = (shift - 4) * 2 + 1;
+    if (size > (size_t)3 << (shift - 1))
+        class++;
+
+    return class;
+}
+
+static inline struct slab *slab_of(const void *ptr)
+{
+    return (struct slab *)((uintptr_t)ptr & ~(SLAB_SIZE - 1));
+}
+
+static struct slab *slab_new(struct slab_heap *heap, unsigned int class)
+{
+    struct slab *slab = aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+
+    if (UNLIKELY(!slab))
+        return NULL;
+
+    *slab = (struct slab){
+        .heap = heap,
+        .class = class,
+        .unused = (char *)slab + SLAB_HEADER_SIZE,
+    };
+
+    list_add(&heap->slabs[class], &slab->slabs);
+    heap->stats[class].slabs++;
+
+    return slab;
+}
+
+static void slab_release(struct slab *slab)
+{
+    struct slab_heap *heap = slab->heap;
+
+    list_del_from(&heap->slabs[slab->class], &slab->slabs);
+    heap->stats[slab->class].slabs--;
+    free(slab);
+}
+
+/* Takes back objects freed by other threads, replacing their list with
+ * new_head; owner only, or with the registry lock held if orphaned. */
+static unsigned int slab_reclaim(struct slab *slab,
+                                 struct slab_object *new_head)
+{
+    struct slab_object *obj =
+        __atomic_exchange_n(&slab->remote_free, new_head, __ATOMIC_ACQUIRE);
+    unsigned int n = 0;
+
+    while (obj) {
+        struct slab_object *next = obj->next;
+
+        obj->next = slab->free;
+        slab->free = obj;
+        obj = next;
+        n++;
+    }
+
+    slab->used -= n;
+    slab->heap->stats[slab->class].objects -= n;
+
+    return n;
+}
+
+static void *slab_take(struct slab *slab)
+{
+    struct slab_object *obj = slab->free;
+
+    if (obj) {
+        slab->free = obj->next;
+    } else if (slab->unused + class_size(slab->class) <=
+               (char *)slab + SLAB_SIZE) {
+        obj = (struct slab_object *)slab->unused;
+        slab->unused += class_size(slab->class);
+    } else {
+        return NULL;
+    }
+
+    slab->used++;
+    slab->heap->stats[slab->class].objects++;
+
+    return obj;
+}
+
+static void orphan_heap(void *data)
+{
+    struct slab_heap *heap = data;
+    bool empty = true;
+
+    current_heap = NULL;
+
+    pthread_mutex_lock(&registry.lock);
+
+    for (unsigned int class = 0; class < SLAB_N_CLASSES; class++) {
+        struct slab *slab, *next;
+
+        list_for_each_safe (&heap->slabs[class], slab, next, slabs) {
+            /* Objects freed from now on go through free_orphaned(). */
+            slab_reclaim(slab, SLAB_ORPHANED);
+
+            if (slab->used)
+                empty = false;
+            else
+                slab_release(slab);
+        }
+    }
+
+    if (empty) {
+        list_del_from(&registry.heaps, &heap->heaps);
+        free(heap);
+    }
+
+    pthread_mutex_unlock(&registry.lock);
+}
+
+static void create_key(void)
+{
+    if (pthread_key_create(&registry.key, orphan_heap))
+        lwan_status_critical_perror("pthread_key_create");
+}
+
+static struct slab_heap *get_heap(void)
+{
+    struct slab_heap *heap = current_heap;
+
+    if (LIKELY(heap))
+        return heap;
+
+    pthread_once(&registry.once, create_key);
+
+    heap = calloc(1, sizeof(*heap));
+    if (UNLIKELY(!heap))
+        return NULL;
+
+    for (unsigned int class = 0; class < SLAB_N_CLASSES; class++)
+        list_head_init(&heap->slabs[class]);
+
+    /* The destructor orphans the heap when the thread exits. */
+    if (UNLIKELY(pthread_setspecific(registry.key, heap))) {
+        free(heap);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&registry.lock);
+    list_add_tail(&registry.heaps, &heap->heaps);
+    pthread_mutex_unlock(&registry.lock);
+
+    return current_heap = heap;
+}
+
+void *lwan_slab_alloc(size_t size)
+{
+    struct slab_heap *heap;
+    struct slab *slab;
+    unsigned int class;
+    void *obj;
+
+    if (UNLIKELY(size > LWAN_SLAB_MAX_SIZE))
+        return NULL;
+
+    heap = get_heap();
+    if (UNLIKELY(!heap))
+        return NULL;
+
+    class = size_class(size);
+
+    /* Slabs with free objects are kept at the head of the list; full slabs
+     * are moved to the tail, and only looked at again once a new slab would
+     * be needed otherwise, in case other threads freed objects in them. */
+    while ((slab = list_top(&heap->slabs[class], struct slab, slabs)) &&
+           !slab->full) {
+        obj = slab_take(slab);
+        if (LIKELY(obj))
+            return obj;
+
+        if (slab_reclaim(slab, NULL))
+            return slab_take(slab);
+
+        slab->full = true;
+        list_del_from(&heap->slabs[class], &slab->slabs);
+        list_add_tail(&heap->slabs[class], &slab->slabs);
+    }
+
+    list_for_each (&heap->slabs[class], slab, slabs) {
+        if (__atomic_load_n(&slab->remote_free, __ATOMIC_RELAXED) &&
+            slab_reclaim(slab, NULL)) {
+            slab->full = false;
+            list_del_from(&heap->slabs[class], &slab->slabs);
+            list_add(&heap->slabs[class], &slab->slabs);
+            return slab_take(slab);
+        }
+    }
+
+    slab = slab_new(heap, class);
+    if (UNLIKELY(!slab))
+        return NULL;
+
+    return slab_take(slab);
+}
+
+void *lwan_slab_calloc(size_t size)
+{
+    void *obj = lwan_slab_alloc(size);
+
+    if (LIKELY(obj))
+        memset(obj, 0, size);
+
+    return obj;
+}
+
+/* Returns true if the slab became empty; releasing it is up to the caller. */
+static bool free_local(struct slab *slab, struct slab_object *obj)
+{
+    struct slab_heap *heap = slab->heap;
+
+    obj->next = slab->free;
+    slab->free = obj;
+    slab->used--;
+    heap->stats[slab->class].objects--;
+
+    if (slab->full) {
+        slab->full = false;
+        list_del_from(&heap->slabs[slab->class], &slab->slabs);
+        list_add(&heap->slabs[slab->class], &slab->slabs);
+    }
+
+    return !slab->used;
+}
+
+static void free_orphaned(struct slab *slab, struct slab_object *obj)
+{
+    struct slab_heap *heap = slab->heap;
+    bool heap_empty = true;
+
+    pthread_mutex_lock(&registry.lock);
+
+    if (free_local(slab, obj)) {
+        slab_release(slab);
+
+        for (unsigned int class = 0; class < SLAB_N_CLASSES; class++) {
+            if (!list_empty(&heap->slabs[class])) {
+                heap_empty = false;
+                break;
+            }
+        }
+        if (heap_empty) {
+            list_del_from(&registry.heaps, &heap->heaps);
+            free(heap);
+        }
+    }
+
+    pthread_mutex_unlock(&registry.lock);
+}
+
+void lwan_slab_free(void *ptr)
+{
+    struct slab_object *obj = ptr;
+    struct slab *slab;
+    struct slab_object *head;
+
+    if (UNLIKELY(!ptr))
+        return;
+
+    slab = slab_of(ptr);
+    if (LIKELY(slab->heap == current_heap)) {
+        /* Keep one slab around for each size class, even if empty, so that
+         * a connection coming and going doesn't allocate and free a slab. */
+        if (free_local(slab, obj) &&
+            current_heap->stats[slab->class].slabs > 1)
+            slab_release(slab);
+        return;
+    }
+
+    head = __atomic_load_n(&slab->remote_free, __ATOMIC_RELAXED);
+    do {
+        if (UNLIKELY(head == SLAB_ORPHANED)) {
+            free_orphaned(slab, obj);
+            return;
+        }
+        obj->next = head;
+    } while (!__atomic_compare_exchange_n(&slab->remote_free, &head, obj,
+                                          true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+size_t lwan_slab_get_stats(struct lwan_slab_stats *stats, size_t n_stats)
+{
+    const size_t n = LWAN_MIN(n_stats, (size_t)SLAB_N_CLASSES);
+    struct slab_heap *heap;
+
+    for (size_t class = 0; class < n; class++) {
+        const size_t size = class_size((unsigned int)class);
+
+        stats[class] = (struct lwan_slab_stats){
+            .object_size = size,
+            .objects_per_slab = (SLAB_SIZE - SLAB_HEADER_SIZE) / size,
+        };
+    }
+
+    pthread_mutex_lock(&registry.lock);
+    list_for_each (&registry.heaps, heap, heaps) {
+        for (size_t class = 0; class < n; class++) {
+            stats[class].slabs += ATOMIC_READ(heap->stats[class].slabs);
+            stats[class].objects += ATOMIC_READ(heap->stats[class].objects);
+        }
+    }
+    pthread_mutex_unlock(&registry.lock);
+
+    return n;
+}
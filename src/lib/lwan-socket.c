@@ -20,14 +20,19 @@
 
 #define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "lwan-private.h"
@@ -71,17 +76,117 @@ static int set_socket_flags(int fd)
     return fd;
 }
 
-static int setup_socket_from_systemd(void)
+static bool is_listening_stream_socket(int fd)
 {
-    int fd = SD_LISTEN_FDS_START;
+    return sd_is_socket_inet(fd, AF_UNSPEC, SOCK_STREAM, 1, 0) > 0 ||
+           sd_is_socket_unix(fd, SOCK_STREAM, 1, NULL, 0) > 0;
+}
 
-    if (!sd_is_socket_inet(fd, AF_UNSPEC, SOCK_STREAM, 1, 0))
+static int setup_socket_from_systemd(int fd)
+{
+    if (!is_listening_stream_socket(fd))
         lwan_status_critical("Passed file descriptor is not a "
-                             "listening TCP socket");
+                             "listening TCP or Unix domain socket");
 
     return set_socket_flags(fd);
 }
 
+int lwan_socket_send_listeners(int handover_fd,
+                               const int listen_fds[],
+                               unsigned int n_fds)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * LWAN_MAX_LISTENERS)];
+        struct cmsghdr align;
+    } control = {};
+    struct iovec iov = {.iov_base = (char[]){'L'}, .iov_len = 1};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * n_fds),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    assert(n_fds > 0 && n_fds <= LWAN_MAX_LISTENERS);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+    memcpy(CMSG_DATA(cmsg), listen_fds, sizeof(int) * n_fds);
+
+    return sendmsg(handover_fd, &msg, MSG_NOSIGNAL) < 0 ? -errno : 0;
+}
+
+static unsigned int receive_handed_over_sockets(int handover_fd, int fds[])
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * LWAN_MAX_LISTENERS)];
+        struct cmsghdr align;
+    } control;
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg;
+    unsigned int n_fds;
+
+    while (recvmsg(handover_fd, &msg, MSG_CMSG_CLOEXEC) < 0) {
+        if (errno != EINTR)
+            lwan_status_critical_perror("Could not receive listening sockets");
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len <= CMSG_LEN(0))
+        lwan_status_critical("Previous process didn't send any socket");
+
+    n_fds = (unsigned int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n_fds);
+
+    for (unsigned int i = 0; i < n_fds; i++) {
+        if (!is_listening_stream_socket(fds[i]))
+            lwan_status_critical("Socket received from previous process is "
+                                 "not a listening TCP or Unix domain socket");
+
+        set_socket_flags(fds[i]);
+    }
+
+    lwan_status_info("Using %u listening sockets from previous process",
+                     n_fds);
+
+    return n_fds;
+}
+
+static int get_handover_fd(void)
+{
+    const char *value = getenv(LWAN_HANDOVER_FD_ENV);
+    int fd;
+
+    if (!value)
+        return -1;
+
+    fd = parse_int(value, -1);
+    /* Processes spawned by this one shouldn't think they're being handed
+     * over a socket too. */
+    unsetenv(LWAN_HANDOVER_FD_ENV);
+    if (fd < 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+        lwan_status_warning("Ignoring invalid %s", LWAN_HANDOVER_FD_ENV);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool lwan_socket_is_unix_address(const char *address)
+{
+    return !strncmp(address, "unix:", sizeof("unix:") - 1);
+}
+
 static sa_family_t parse_listener_ipv4(char *listener, char **node, char **port)
 {
     char *colon = strrchr(listener, ':');
@@ -150,11 +255,16 @@ static sa_family_t parse_listener(char *listener, char **node, char **port)
     return parse_listener_ipv4(listener, node, port);
 }
 
-static int listen_addrinfo(int fd, const struct addrinfo *addr)
+static int listen_addrinfo(int fd,
+                           const struct addrinfo *addr,
+                           bool print_listening_msg)
 {
     if (listen(fd, lwan_socket_get_backlog_size()) < 0)
         lwan_status_critical_perror("listen");
 
+    if (!print_listening_msg)
+        return set_socket_flags(fd);
+
     char host_buf[NI_MAXHOST], serv_buf[NI_MAXSERV];
     int ret = getnameinfo(addr->ai_addr, addr->ai_addrlen, host_buf,
                           sizeof(host_buf), serv_buf, sizeof(serv_buf),
@@ -184,7 +294,9 @@ static int listen_addrinfo(int fd, const struct addrinfo *addr)
             lwan_status_warning("%s not supported by the kernel", #_option);   \
     } while (0)
 
-static int bind_and_listen_addrinfos(struct addrinfo *addrs, bool reuse_port)
+static int bind_and_listen_addrinfos(struct addrinfo *addrs,
+                                     bool reuse_port,
+                                     bool print_listening_msg)
 {
     const struct addrinfo *addr;
 
@@ -206,7 +318,7 @@ static int bind_and_listen_addrinfos(struct addrinfo *addrs, bool reuse_port)
 #endif
 
         if (!bind(fd, addr->ai_addr, addr->ai_addrlen))
-            return listen_addrinfo(fd, addr);
+            return listen_addrinfo(fd, addr, print_listening_msg);
 
         close(fd);
     }
@@ -214,15 +326,69 @@ static int bind_and_listen_addrinfos(struct addrinfo *addrs, bool reuse_port)
     lwan_status_critical("Could not bind socket");
 }
 
-static int setup_socket_normally(struct lwan *l)
+static int setup_unix_socket(const char *address, bool print_listening_msg)
+{
+    /* unix:/path/to/socket binds to a path in the filesystem, and
+     * unix:@name to a name in the abstract namespace (Linux only), which
+     * doesn't leave a file behind and isn't subject to file permissions. */
+    const char *path = address + sizeof("unix:") - 1;
+    struct sockaddr_un sun = {.sun_family = AF_UNIX};
+    size_t path_len = strlen(path);
+    socklen_t sun_len;
+    int fd;
+
+    if (!path_len || path_len >= sizeof(sun.sun_path) ||
+        (*path == '@' && path_len == 1))
+        lwan_status_critical("Invalid Unix domain socket listener: %s",
+                             address);
+
+    memcpy(sun.sun_path, path, path_len);
+    if (*path == '@') {
+        sun.sun_path[0] = '\0';
+        sun_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path_len);
+    } else {
+        struct stat st;
+
+        /* A socket file left behind by a previous process would make bind()
+         * fail; it's not removed on shutdown as it might have been handed
+         * over to a new process. */
+        if (!lstat(path, &st) && S_ISSOCK(st.st_mode) && unlink(path) < 0)
+            lwan_status_critical_perror("Could not remove stale socket %s",
+                                        path);
+
+        sun_len =
+            (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path_len + 1);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        lwan_status_critical_perror("socket");
+
+    if (bind(fd, (struct sockaddr *)&sun, sun_len) < 0)
+        lwan_status_critical_perror("Could not bind to %s", address);
+
+    if (listen(fd, lwan_socket_get_backlog_size()) < 0)
+        lwan_status_critical_perror("listen");
+
+    if (print_listening_msg)
+        lwan_status_info("Listening on %s", address);
+
+    return set_socket_flags(fd);
+}
+
+static int setup_socket_normally(const char *address,
+                                 bool reuse_port,
+                                 bool print_listening_msg)
 {
     char *node, *port;
-    char *listener = strdupa(l->config.listener);
+
+    if (lwan_socket_is_unix_address(address))
+        return setup_unix_socket(address, print_listening_msg);
+
+    char *listener = strdupa(address);
     sa_family_t family = parse_listener(listener, &node, &port);
-    if (family == AF_MAX) {
-        lwan_status_critical("Could not parse listener: %s",
-                             l->config.listener);
-    }
+    if (family == AF_MAX)
+        lwan_status_critical("Could not parse listener: %s", address);
 
     struct addrinfo *addrs;
     struct addrinfo hints = {.ai_family = family,
@@ -233,29 +399,32 @@ static int setup_socket_normally(struct lwan *l)
     if (ret)
         lwan_status_critical("getaddrinfo: %s", gai_strerror(ret));
 
-    int fd = bind_and_listen_addrinfos(addrs, l->config.reuse_port);
+    int fd = bind_and_listen_addrinfos(addrs, reuse_port, print_listening_msg);
     freeaddrinfo(addrs);
     return fd;
 }
 
-void lwan_socket_init(struct lwan *l)
+static bool is_unix_socket(int fd)
 {
-    int fd, n;
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
 
-    lwan_status_debug("Initializing sockets");
+    if (getsockname(fd, (struct sockaddr *)&addr, &len) < 0)
+        lwan_status_critical_perror("getsockname");
 
-    n = sd_listen_fds(1);
-    if (n > 1) {
-        lwan_status_critical("Too many file descriptors received");
-    } else if (n == 1) {
-        fd = setup_socket_from_systemd();
-    } else {
-        fd = setup_socket_normally(l);
-    }
+    return addr.ss_family == AF_UNIX;
+}
 
+static int set_socket_options(const struct lwan *l, int fd)
+{
     SET_SOCKET_OPTION(SOL_SOCKET, SO_LINGER,
                       (&(struct linger){.l_onoff = 1, .l_linger = 1}));
 
+    /* Sockets from systemd or from a previous process can be of either
+     * family, regardless of how the listener has been configured. */
+    if (is_unix_socket(fd))
+        return fd;
+
 #ifdef __linux__
 
 #ifndef TCP_FASTOPEN
@@ -266,9 +435,71 @@ void lwan_socket_init(struct lwan *l)
     SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_QUICKACK, (int[]){0});
     SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_DEFER_ACCEPT,
                                (int[]){(int)l->config.keep_alive_timeout});
+
+#ifdef SO_BUSY_POLL
+    if (l->config.busy_poll_sockets && l->config.busy_poll_us) {
+        SET_SOCKET_OPTION_MAY_FAIL(SOL_SOCKET, SO_BUSY_POLL,
+                                   (int[]){(int)l->config.busy_poll_us});
+    }
+#endif
 #endif
 
-    l->main_socket = fd;
+    return fd;
+}
+
+int lwan_create_thread_listen_socket(const struct lwan *l,
+                                     bool print_listening_msg)
+{
+    /* Each I/O thread gets its own socket bound to the same address; the
+     * kernel then load balances incoming connections between them. */
+    int fd = setup_socket_normally(l->listeners[0].address, true,
+                                   print_listening_msg);
+
+    return set_socket_options(l, fd);
+}
+
+void lwan_socket_init(struct lwan *l)
+{
+    int handed_over[LWAN_MAX_LISTENERS];
+    unsigned int n_handed_over = 0;
+    int n_systemd;
+
+    l->handover_fd = get_handover_fd();
+
+    if (l->config.per_thread_listeners) {
+        lwan_status_debug("Using per-thread listening sockets");
+        return;
+    }
+
+    lwan_status_debug("Initializing sockets");
+
+    if (l->handover_fd >= 0)
+        n_handed_over = receive_handed_over_sockets(l->handover_fd, handed_over);
+
+    n_systemd = sd_listen_fds(1);
+    if (n_systemd > (int)l->n_listeners)
+        lwan_status_critical("Too many file descriptors received");
+
+    for (unsigned int i = 0; i < l->n_listeners; i++) {
+        struct lwan_listener *listener = &l->listeners[i];
+        int fd;
+
+        /* Sockets from a previous process or from systemd are matched to
+         * listeners in the order they appear in the configuration file. */
+        if (i < n_handed_over) {
+            fd = handed_over[i];
+        } else if ((int)i < n_systemd) {
+            fd = setup_socket_from_systemd(SD_LISTEN_FDS_START + (int)i);
+        } else {
+            fd = setup_socket_normally(listener->address, l->config.reuse_port,
+                                       true);
+        }
+
+        listener->fd = set_socket_options(l, fd);
+    }
+
+    for (unsigned int i = l->n_listeners; i < n_handed_over; i++)
+        close(handed_over[i]);
 }
 
 #undef SET_SOCKET_OPTION
@@ -29,9 +29,87 @@
 static const unsigned int BUFFER_MALLOCD = 1 << 0;
 static const unsigned int STRBUF_MALLOCD = 1 << 1;
 
+/* Worker threads keep a few buffers of each power-of-two size, from
+ * POOL_MIN_SIZE to POOL_MAX_SIZE, that have been released by strbufs, so
+ * that building responses, and connections coming and going, don't keep
+ * calling malloc() and free().  Buffers are plain heap allocations, so
+ * they can be released by a thread other than the one that obtained
+ * them.  Other threads don't pool buffers. */
+#define POOL_MIN_SHIFT 6
+#define POOL_MAX_SHIFT 14
+#define POOL_MIN_SIZE ((size_t)1 << POOL_MIN_SHIFT)
+#define POOL_MAX_SIZE ((size_t)1 << POOL_MAX_SHIFT)
+#define POOL_DEPTH 16
+
+static __thread struct {
+    char *buffers[POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1][POOL_DEPTH];
+    unsigned int count[POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1];
+    bool enabled;
+} pool;
+
+void lwan_strbuf_thread_init(void)
+{
+    pool.enabled = true;
+}
+
+void lwan_strbuf_thread_shutdown(void)
+{
+    pool.enabled = false;
+
+    for (size_t i = 0; i < N_ELEMENTS(pool.count); i++) {
+        while (pool.count[i]) {
+            free(pool.buffers[i][--pool.count[i]]);
+            lwan_memory_account(LWAN_MEMORY_STRBUFS,
+                                -((int64_t)POOL_MIN_SIZE << i));
+        }
+    }
+}
+
+static inline int pool_class(size_t capacity)
+{
+    if (capacity < POOL_MIN_SIZE || capacity > POOL_MAX_SIZE)
+        return -1;
+    if (capacity & (capacity - 1))
+        return -1;
+
+    return __builtin_ctzl(capacity) - POOL_MIN_SHIFT;
+}
+
+/* Pooled buffers are still accounted for as strbuf memory: they're only
+ * accounted for when they're really allocated or freed. */
+static char *buffer_alloc(size_t capacity)
+{
+    const int class = pool_class(capacity);
+    char *buffer;
+
+    if (class >= 0 && pool.count[class])
+        return pool.buffers[class][--pool.count[class]];
+
+    buffer = malloc(capacity);
+    if (LIKELY(buffer))
+        lwan_memory_account(LWAN_MEMORY_STRBUFS, (int64_t)capacity);
+
+    return buffer;
+}
+
+static void buffer_free(char *buffer, size_t capacity)
+{
+    const int class = pool_class(capacity);
+
+    if (pool.enabled && class >= 0 && pool.count[class] < POOL_DEPTH) {
+        pool.buffers[class][pool.count[class]++] = buffer;
+        return;
+    }
+
+    free(buffer);
+    lwan_memory_account(LWAN_MEMORY_STRBUFS, -(int64_t)capacity);
+}
+
 static inline size_t align_size(size_t unaligned_size)
 {
-    const size_t aligned_size = lwan_nextpow2(unaligned_size);
+    /* Smaller buffers would just have to grow again soon. */
+    const size_t aligned_size =
+        lwan_nextpow2(LWAN_MAX(unaligned_size, POOL_MIN_SIZE - 1));
 
     if (UNLIKELY(unaligned_size >= aligned_size))
         return 0;
@@ -46,7 +124,7 @@ static bool grow_buffer_if_needed(struct lwan_strbuf *s, size_t size)
         if (UNLIKELY(!aligned_size))
             return false;
 
-        char *buffer = malloc(aligned_size);
+        char *buffer = buffer_alloc(aligned_size);
         if (UNLIKELY(!buffer))
             return false;
 
@@ -65,9 +143,23 @@ static bool grow_buffer_if_needed(struct lwan_strbuf *s, size_t size)
         if (UNLIKELY(!aligned_size))
             return false;
 
-        char *buffer = realloc(s->buffer, aligned_size);
-        if (UNLIKELY(!buffer))
-            return false;
+        char *buffer;
+
+        if (pool_class(s->capacity) < 0 && pool_class(aligned_size) < 0) {
+            buffer = realloc(s->buffer, aligned_size);
+            if (UNLIKELY(!buffer))
+                return false;
+
+            lwan_memory_account(LWAN_MEMORY_STRBUFS,
+                                (int64_t)aligned_size - (int64_t)s->capacity);
+        } else {
+            buffer = buffer_alloc(aligned_size);
+            if (UNLIKELY(!buffer))
+                return false;
+
+            memcpy(buffer, s->buffer, LWAN_MIN(s->used + 1, s->capacity));
+            buffer_free(s->buffer, s->capacity);
+        }
 
         s->buffer = buffer;
         s->capacity = aligned_size;
@@ -141,7 +233,7 @@ void lwan_strbuf_free(struct lwan_strbuf *s)
     if (UNLIKELY(!s))
         return;
     if (s->flags & BUFFER_MALLOCD)
-        free(s->buffer);
+        buffer_free(s->buffer, s->capacity);
     if (s->flags & STRBUF_MALLOCD)
         free(s);
 }
@@ -172,7 +264,7 @@ bool lwan_strbuf_append_str(struct lwan_strbuf *s1, const char *s2, size_t sz)
 bool lwan_strbuf_set_static(struct lwan_strbuf *s1, const char *s2, size_t sz)
 {
     if (s1->flags & BUFFER_MALLOCD)
-        free(s1->buffer);
+        buffer_free(s1->buffer, s1->capacity);
 
     s1->buffer = (char *)s2;
     s1->used = s1->capacity = sz;
@@ -193,22 +285,40 @@ bool lwan_strbuf_set(struct lwan_strbuf *s1, const char *s2, size_t sz)
     return true;
 }
 
-static ALWAYS_INLINE bool
-internal_printf(struct lwan_strbuf *s1,
-                bool (*save_str)(struct lwan_strbuf *, const char *, size_t),
-                const char *fmt,
-                va_list values)
+static bool internal_printf(struct lwan_strbuf *s,
+                            size_t offset,
+                            const char *fmt,
+                            va_list values)
 {
-    char *s2;
+    /* Format straight into the buffer rather than going through
+     * vasprintf(), growing it and formatting again if it was too small. */
+    va_list copy;
     int len;
 
-    if (UNLIKELY((len = vasprintf(&s2, fmt, values)) < 0))
+    if (UNLIKELY(!grow_buffer_if_needed(s, offset + 1)))
         return false;
 
-    bool success = save_str(s1, s2, (size_t)len);
-    free(s2);
+    va_copy(copy, values);
+    len = vsnprintf(s->buffer + offset, s->capacity - offset, fmt, copy);
+    va_end(copy);
+    if (UNLIKELY(len < 0))
+        goto out_error;
+
+    if ((size_t)len >= s->capacity - offset) {
+        if (UNLIKELY(!grow_buffer_if_needed(s, offset + (size_t)len + 1)))
+            goto out_error;
+
+        vsnprintf(s->buffer + offset, s->capacity - offset, fmt, values);
+    }
+
+    s->used = offset + (size_t)len;
+    return true;
 
-    return success;
+out_error:
+    /* Whatever was there past the offset has been overwritten. */
+    s->used = offset;
+    s->buffer[offset] = '\0';
+    return false;
 }
 
 bool lwan_strbuf_printf(struct lwan_strbuf *s, const char *fmt, ...)
@@ -217,7 +327,7 @@ bool lwan_strbuf_printf(struct lwan_strbuf *s, const char *fmt, ...)
     va_list values;
 
     va_start(values, fmt);
-    could_printf = internal_printf(s, lwan_strbuf_set, fmt, values);
+    could_printf = internal_printf(s, 0, fmt, values);
     va_end(values);
 
     return could_printf;
@@ -229,7 +339,7 @@ bool lwan_strbuf_append_printf(struct lwan_strbuf *s, const char *fmt, ...)
     va_list values;
 
     va_start(values, fmt);
-    could_printf = internal_printf(s, lwan_strbuf_append_str, fmt, values);
+    could_printf = internal_printf(s, s->used, fmt, values);
     va_end(values);
 
     return could_printf;
@@ -268,10 +378,10 @@ void lwan_strbuf_reset_trim(struct lwan_strbuf *s, size_t trim_thresh)
         /* Not using realloc() here because we don't care about the contents
          * of this buffer after reset is called, but we want to maintain a
          * buffer already allocated of up to trim_thresh bytes. */
-        void *tmp = malloc(trim_thresh);
+        char *tmp = buffer_alloc(trim_thresh);
 
         if (tmp) {
-            free(s->buffer);
+            buffer_free(s->buffer, s->capacity);
             s->buffer = tmp;
             s->capacity = trim_thresh;
         }
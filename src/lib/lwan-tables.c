@@ -22,68 +22,14 @@
 #include <string.h>
 #include <stdlib.h>
 
-#if defined(HAVE_BROTLI)
-#include <brotli/decode.h>
-#elif defined(HAVE_ZSTD)
-#include <zstd.h>
-#else
-#include <zlib.h>
-#endif
-
 #include "lwan-private.h"
 
 #include "mime-types.h"
 
-static unsigned char uncompressed_mime_entries[MIME_UNCOMPRESSED_LEN];
-static char *mime_types[MIME_ENTRIES];
-static bool mime_entries_initialized = false;
-
 void lwan_tables_init(void)
 {
-    if (mime_entries_initialized)
-        return;
-
-    lwan_status_debug("Uncompressing MIME type table: %u->%u bytes, %d entries",
-                      MIME_COMPRESSED_LEN, MIME_UNCOMPRESSED_LEN, MIME_ENTRIES);
-
-#if defined(HAVE_BROTLI)
-    size_t uncompressed_length = MIME_UNCOMPRESSED_LEN;
-    BrotliDecoderResult ret;
-
-    ret = BrotliDecoderDecompress(MIME_COMPRESSED_LEN, mime_entries_compressed,
-                                  &uncompressed_length,
-                                  uncompressed_mime_entries);
-    if (ret != BROTLI_DECODER_RESULT_SUCCESS)
-        lwan_status_critical("Error while uncompressing table with Brotli");
-#elif defined(HAVE_ZSTD)
-    size_t uncompressed_length =
-        ZSTD_decompress(uncompressed_mime_entries, MIME_UNCOMPRESSED_LEN,
-                        mime_entries_compressed, MIME_COMPRESSED_LEN);
-    if (ZSTD_isError(uncompressed_length))
-        lwan_status_critical("Error while uncompressing table with Zstd");
-#else
-    uLongf uncompressed_length = MIME_UNCOMPRESSED_LEN;
-    int ret =
-        uncompress((Bytef *)uncompressed_mime_entries, &uncompressed_length,
-                   (const Bytef *)mime_entries_compressed, MIME_COMPRESSED_LEN);
-    if (ret != Z_OK) {
-        lwan_status_critical("Error while uncompressing table: zlib error %d",
-                             ret);
-    }
-#endif
-
-    if (uncompressed_length != MIME_UNCOMPRESSED_LEN) {
-        lwan_status_critical("Expected uncompressed length %d, got %ld",
-                             MIME_UNCOMPRESSED_LEN, uncompressed_length);
-    }
-
-    unsigned char *ptr = uncompressed_mime_entries + 8 * MIME_ENTRIES;
-    for (size_t i = 0; i < MIME_ENTRIES; i++) {
-        mime_types[i] = (char *)ptr;
-        ptr += strlen((const char *)ptr) + 1;
-    }
-
-    mime_entries_initialized = true;
+    lwan_status_debug("Using MIME type table with %d entries in %d slots",
+                      MIME_ENTRIES, 1 << MIME_TABLE_BITS);
 
     assert(streq(lwan_determine_mime_type_for_file_name(".mkv"),
                  "video/x-matroska"));
@@ -95,12 +41,16 @@ void lwan_tables_init(void)
                  "application/octet-stream"));
     assert(streq(lwan_determine_mime_type_for_file_name(""),
                  "application/octet-stream"));
+    assert(streq(lwan_determine_mime_type_for_file_name("trailingdot."),
+                 "application/octet-stream"));
     assert(streq(lwan_determine_mime_type_for_file_name(".gif"),
                  "image/gif"));
     assert(streq(lwan_determine_mime_type_for_file_name(".JS"),
                  "application/javascript"));
     assert(streq(lwan_determine_mime_type_for_file_name(".BZ2"),
                  "application/x-bzip2"));
+    assert(streq(lwan_determine_mime_type_for_file_name("a.jpeg"),
+                 "image/jpeg"));
 }
 
 void
@@ -108,46 +58,26 @@ lwan_tables_shutdown(void)
 {
 }
 
-static int
-compare_mime_entry(const void *a, const void *b)
-{
-    const char *exta = (const char *)a;
-    const char *extb = (const char *)b;
-
-    return strncmp(exta, extb, 8);
-}
-
 const char *
 lwan_determine_mime_type_for_file_name(const char *file_name)
 {
-    char *last_dot = strrchr(file_name, '.');
-    if (UNLIKELY(!last_dot))
-        goto fallback;
+    const char *last_dot = strrchr(file_name, '.');
+    uint64_t key = 0;
+    uint32_t slot;
 
-    STRING_SWITCH_L(last_dot) {
-    case STR4_INT_L('.','c','s','s'): return "text/css";
-    case STR4_INT_L('.','g','i','f'): return "image/gif";
-    case STR4_INT_L('.','h','t','m'): return "text/html";
-    case STR4_INT_L('.','j','p','g'): return "image/jpeg";
-    case STR4_INT_L('.','j','s',' '): return "application/javascript";
-    case STR4_INT_L('.','p','n','g'): return "image/png";
-    case STR4_INT_L('.','t','x','t'): return "text/plain";
-    }
-
-    if (LIKELY(*last_dot)) {
-        char key[9];
-        const unsigned char *extension;
+    if (UNLIKELY(!last_dot || !last_dot[1]))
+        goto fallback;
 
-        strncpy(key, last_dot + 1, 8);
-        key[8] = '\0';
-        for (char *p = key; *p; p++)
-            *p |= 0x20;
+    /* The table generated by mimegen is a perfect hash table keyed on the
+     * first 8 characters of the extension, lowercased, packed in a 64-bit
+     * integer: if the extension is in the table at all, it's in this
+     * slot. */
+    for (size_t i = 0; i < 8 && last_dot[i + 1]; i++)
+        key |= (uint64_t)(unsigned char)(last_dot[i + 1] | 0x20) << (i * 8);
 
-        extension = bsearch(key, uncompressed_mime_entries, MIME_ENTRIES, 8,
-                            compare_mime_entry);
-        if (LIKELY(extension))
-            return mime_types[(extension - uncompressed_mime_entries) / 8];
-    }
+    slot = mime_slot(key);
+    if (LIKELY(mime_extensions[slot] == key))
+        return &mime_types[mime_type_offsets[slot]];
 
 fallback:
     return "application/octet-stream";
@@ -41,11 +41,13 @@
 
 #include "lwan-private.h"
 
+#include "double-to-str.h"
 #include "hash.h"
 #include "int-to-str.h"
 #include "list.h"
 #include "ringbuffer.h"
 #include "lwan-array.h"
+#include "lwan-cache.h"
 #include "lwan-strbuf.h"
 #include "lwan-template.h"
 
@@ -61,11 +63,13 @@ enum action {
     ACTION_VARIABLE,
     ACTION_VARIABLE_STR,
     ACTION_VARIABLE_STR_ESCAPE,
+    ACTION_VARIABLE_INT,
     ACTION_START_ITER,
     ACTION_END_ITER,
     ACTION_IF_VARIABLE_NOT_EMPTY,
     ACTION_END_IF_VARIABLE_NOT_EMPTY,
     ACTION_APPLY_TPL,
+    ACTION_APPLY_CACHED_TPL,
     ACTION_LAST
 };
 
@@ -107,7 +111,16 @@ DEFINE_ARRAY_TYPE(chunk_array, struct chunk)
 
 struct lwan_tpl {
     struct chunk_array chunks;
+    /* Number of bytes of text in the template, plus a few bytes for each
+     * variable: no output can be shorter than this. */
     size_t minimum_size;
+    /* Estimate of how large the output is going to be, given the size of
+     * the previous outputs.  This accounts for what depends on the
+     * variables (strings and sequences, mostly), and is used to grow the
+     * buffer only once before applying the template.  Updated without
+     * synchronization, as templates are usually shared between threads
+     * and this is only a hint. */
+    size_t size_hint;
     bool dispatch_table_direct;
 };
 
@@ -154,6 +167,26 @@ struct chunk_descriptor {
     struct lwan_var_descriptor *descriptor;
 };
 
+/* Partials included with {{>file key}} are rendered once for each value
+ * that the key variable takes, and what has been rendered is kept in a
+ * cache; these are meant for parts of a page that only depend on data that
+ * rarely changes (navigation bars, footers, ...), with the key being
+ * something like a version number for that data. */
+struct cached_partial {
+    struct lwan_tpl *tpl;
+    const struct lwan_var_descriptor *key;
+    struct cache *cache;
+};
+
+struct cached_partial_entry {
+    struct cache_entry base;
+    struct lwan_strbuf buffer;
+};
+
+/* Rendered partials that haven't been used for this many seconds are
+ * dropped from the cache. */
+#define CACHED_PARTIAL_TIME_TO_LIVE 60
+
 static const char left_meta[] = "{{";
 static const char right_meta[] = "}}";
 static_assert(sizeof(left_meta) == sizeof(right_meta),
@@ -175,6 +208,8 @@ static void *parser_identifier(struct parser *parser, struct lexeme *lexeme);
 static void *parser_slash(struct parser *parser, struct lexeme *lexeme);
 static void *parser_text(struct parser *parser, struct lexeme *lexeme);
 
+static void free_chunk(struct chunk *chunk);
+
 static void error_vlexeme(struct lexeme *lexeme, const char *msg, va_list ap)
     __attribute__((format(printf, 2, 0)));
 static void *error_lexeme(struct lexeme *lexeme, const char *msg, ...)
@@ -553,10 +588,10 @@ static void parser_push_lexeme(struct parser *parser, struct lexeme *lexeme)
     list_add(&parser->stack, &stacked_lexeme->stack);
 }
 
-static void emit_chunk(struct parser *parser,
-                       enum action action,
-                       enum flags flags,
-                       void *data)
+static struct chunk *emit_chunk(struct parser *parser,
+                                enum action action,
+                                enum flags flags,
+                                void *data)
 {
     struct chunk *chunk;
 
@@ -567,6 +602,8 @@ static void emit_chunk(struct parser *parser,
     chunk->action = action;
     chunk->flags = flags;
     chunk->data = data;
+
+    return chunk;
 }
 
 static bool parser_stack_top_matches(struct parser *parser,
@@ -788,6 +825,84 @@ static void *parser_identifier(struct parser *parser, struct lexeme *lexeme)
     return unexpected_lexeme(next);
 }
 
+/* The cache callbacks only get the key; this is how the variables get to
+ * create_cached_partial() when a partial has to be rendered. */
+static __thread void *cached_partial_variables;
+
+static struct cache_entry *
+create_cached_partial(const char *key __attribute__((unused)), void *context)
+{
+    struct cached_partial *partial = context;
+    struct cached_partial_entry *entry = malloc(sizeof(*entry));
+
+    if (UNLIKELY(!entry))
+        return NULL;
+
+    lwan_strbuf_init(&entry->buffer);
+    if (UNLIKELY(!lwan_tpl_apply_with_buffer(partial->tpl, &entry->buffer,
+                                             cached_partial_variables))) {
+        lwan_strbuf_free(&entry->buffer);
+        free(entry);
+        return NULL;
+    }
+
+    return &entry->base;
+}
+
+static void destroy_cached_partial(struct cache_entry *entry,
+                                   void *context __attribute__((unused)))
+{
+    struct cached_partial_entry *cpe = (struct cached_partial_entry *)entry;
+
+    lwan_strbuf_free(&cpe->buffer);
+    free(cpe);
+}
+
+static void *parser_partial_key(struct parser *parser, struct lexeme *lexeme)
+{
+    struct lwan_var_descriptor *symbol;
+    struct cached_partial *partial;
+    struct chunk *chunk;
+
+    if (lexeme->type == LEXEME_RIGHT_META)
+        return parser_text;
+    if (lexeme->type != LEXEME_IDENTIFIER)
+        return unexpected_lexeme(lexeme);
+
+    symbol = symtab_lookup_lexeme(parser, lexeme);
+    if (!symbol) {
+        return error_lexeme(lexeme, "Unknown variable: %.*s",
+                            (int)lexeme->value.len, lexeme->value.value);
+    }
+    if (!symbol->append_to_strbuf) {
+        return error_lexeme(lexeme, "Sequence %.*s can't be a partial key",
+                            (int)lexeme->value.len, lexeme->value.value);
+    }
+
+    partial = malloc(sizeof(*partial));
+    if (!partial)
+        return error_lexeme(lexeme, "Out of memory");
+
+    partial->cache = cache_create(create_cached_partial, destroy_cached_partial,
+                                  partial, CACHED_PARTIAL_TIME_TO_LIVE);
+    if (!partial->cache) {
+        free(partial);
+        return error_lexeme(lexeme, "Could not create cache for partial");
+    }
+    cache_set_name(partial->cache, "template_partials");
+
+    /* parser_partial() has just emitted this chunk. */
+    chunk = chunk_array_get_elem(&parser->chunks,
+                                 chunk_array_len(&parser->chunks) - 1);
+    partial->tpl = chunk->data;
+    partial->key = symbol;
+
+    chunk->action = ACTION_APPLY_CACHED_TPL;
+    chunk->data = partial;
+
+    return parser_right_meta;
+}
+
 static void *parser_partial(struct parser *parser, struct lexeme *lexeme)
 {
     struct lwan_tpl *tpl;
@@ -799,7 +914,7 @@ static void *parser_partial(struct parser *parser, struct lexeme *lexeme)
     tpl = lwan_tpl_compile_file(filename, parser->descriptor);
     if (tpl) {
         emit_chunk(parser, ACTION_APPLY_TPL, 0, tpl);
-        return parser_right_meta;
+        return parser_partial_key;
     }
 
     return error_lexeme(lexeme, "Could not compile template ``%s''", filename);
@@ -835,17 +950,84 @@ static void *parser_meta(struct parser *parser, struct lexeme *lexeme)
     }
 }
 
-static struct lwan_strbuf *lwan_strbuf_from_lexeme(struct parser *parser,
-                                                   struct lexeme *lexeme)
+static bool set_text_chunk(struct chunk *chunk,
+                           const char *text,
+                           size_t len,
+                           bool text_is_const)
 {
-    if (parser->template_flags & LWAN_TPL_FLAG_CONST_TEMPLATE)
-        return lwan_strbuf_new_static(lexeme->value.value, lexeme->value.len);
+    struct lwan_strbuf *buf;
 
-    struct lwan_strbuf *buf = lwan_strbuf_new_with_size(lexeme->value.len);
-    if (buf)
-        lwan_strbuf_set(buf, lexeme->value.value, lexeme->value.len);
+    if (len <= sizeof(void *)) {
+        uintptr_t tmp = 0;
 
-    return buf;
+        memcpy(&tmp, text, len);
+        chunk->action = ACTION_APPEND_SMALL;
+        chunk->data = (void *)tmp;
+        return true;
+    }
+
+    if (text_is_const) {
+        buf = lwan_strbuf_new_static(text, len);
+    } else {
+        buf = lwan_strbuf_new_with_size(len);
+        if (buf)
+            lwan_strbuf_set(buf, text, len);
+    }
+    if (!buf)
+        return false;
+
+    chunk->action = ACTION_APPEND;
+    chunk->data = buf;
+    return true;
+}
+
+static struct chunk *last_text_chunk(struct parser *parser)
+{
+    size_t len = chunk_array_len(&parser->chunks);
+    struct chunk *chunk;
+
+    if (!len)
+        return NULL;
+
+    chunk = chunk_array_get_elem(&parser->chunks, len - 1);
+    if (chunk->action == ACTION_APPEND || chunk->action == ACTION_APPEND_SMALL)
+        return chunk;
+
+    return NULL;
+}
+
+/* Text separated only by comments ends up in consecutive lexemes; rather
+ * than having one instruction for each, the previous text chunk is
+ * extended.  (Jumps only ever land on the beginning of a chunk, so this
+ * doesn't change where they go.) */
+static bool merge_text_chunk(struct chunk *chunk, struct lexeme *lexeme)
+{
+    uintptr_t small_text = (uintptr_t)chunk->data;
+    const char *text;
+    size_t len;
+    char *merged;
+    bool ret;
+
+    if (chunk->action == ACTION_APPEND_SMALL) {
+        text = (const char *)&small_text;
+        len = strnlen(text, sizeof(small_text));
+    } else {
+        text = lwan_strbuf_get_buffer(chunk->data);
+        len = lwan_strbuf_get_length(chunk->data);
+    }
+
+    merged = malloc(len + lexeme->value.len);
+    if (!merged)
+        return false;
+
+    memcpy(merged, text, len);
+    memcpy(merged + len, lexeme->value.value, lexeme->value.len);
+
+    free_chunk(chunk);
+    ret = set_text_chunk(chunk, merged, len + lexeme->value.len, false);
+
+    free(merged);
+    return ret;
 }
 
 static void *parser_text(struct parser *parser, struct lexeme *lexeme)
@@ -854,17 +1036,19 @@ static void *parser_text(struct parser *parser, struct lexeme *lexeme)
         return parser_meta;
 
     if (lexeme->type == LEXEME_TEXT) {
-        if (lexeme->value.len <= sizeof(void *)) {
-            uintptr_t tmp = 0;
+        struct chunk *chunk = last_text_chunk(parser);
 
-            memcpy(&tmp, lexeme->value.value, lexeme->value.len);
-            emit_chunk(parser, ACTION_APPEND_SMALL, 0, (void*)tmp);
-        } else {
-            struct lwan_strbuf *buf = lwan_strbuf_from_lexeme(parser, lexeme);
-            if (!buf)
+        if (chunk) {
+            if (!merge_text_chunk(chunk, lexeme))
                 return error_lexeme(lexeme, "Out of memory");
+        } else {
+            bool text_is_const =
+                parser->template_flags & LWAN_TPL_FLAG_CONST_TEMPLATE;
 
-            emit_chunk(parser, ACTION_APPEND, 0, buf);
+            chunk = emit_chunk(parser, ACTION_APPEND_SMALL, 0, NULL);
+            if (!set_text_chunk(chunk, lexeme->value.value, lexeme->value.len,
+                                text_is_const))
+                return error_lexeme(lexeme, "Out of memory");
         }
         parser->tpl->minimum_size += lexeme->value.len;
         return parser_text;
@@ -880,19 +1064,39 @@ static void *parser_text(struct parser *parser, struct lexeme *lexeme)
 
 void lwan_append_int_to_strbuf(struct lwan_strbuf *buf, void *ptr)
 {
-    char convertbuf[INT_TO_STR_BUFFER_SIZE];
-    size_t len;
-    char *converted;
+    const int value = *(int *)ptr;
+    const size_t abs_value =
+        value < 0 ? (size_t)-(long long)value : (size_t)value;
+    const size_t n_digits = uint_count_digits(abs_value);
+    const size_t len = n_digits + (value < 0);
+    char *p;
+
+    /* Digits are written straight into the buffer, which always has room
+     * for the NUL terminator. */
+    p = lwan_strbuf_extend_unsafe(buf, len);
+    if (UNLIKELY(!p))
+        return;
 
-    converted = int_to_string(*(int *)ptr, convertbuf, &len);
-    lwan_strbuf_append_str(buf, converted, len);
+    if (value < 0)
+        *p++ = '-';
+    uint_to_string_n(abs_value, p, n_digits);
+    p[n_digits] = '\0';
 }
 
 bool lwan_tpl_int_is_empty(void *ptr) { return (*(int *)ptr) == 0; }
 
 void lwan_append_double_to_strbuf(struct lwan_strbuf *buf, void *ptr)
 {
-    lwan_strbuf_append_printf(buf, "%f", *(double *)ptr);
+    size_t len;
+
+    /* Formatted right where it's going to be; the length is only known
+     * afterwards. */
+    if (UNLIKELY(!lwan_strbuf_grow_by(buf, DOUBLE_TO_STR_BUFFER_SIZE)))
+        return;
+
+    len = double_to_string(*(double *)ptr, lwan_strbuf_get_buffer(buf) +
+                                               lwan_strbuf_get_length(buf));
+    lwan_strbuf_extend_unsafe(buf, len);
 }
 
 bool lwan_tpl_double_is_empty(void *ptr)
@@ -913,53 +1117,8 @@ void lwan_append_str_to_strbuf(struct lwan_strbuf *buf, void *ptr)
         lwan_strbuf_append_strz(buf, str);
 }
 
-#if __x86_64__
-#include <emmintrin.h>
-#endif
-
-static ALWAYS_INLINE int escaped_index(char ch)
-{
-#if __x86_64__
-    /* FIXME: instead of calling escaped_index() for each byte that needs to be
-     * escaped, use SIMD to leap through input string until an escapable character
-     * is found. */
-    const __m128i ch_mask = _mm_set1_epi8(ch);
-    const __m128i escapable =
-        _mm_set_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '<', '>', '&', '"', '\'', '/');
-
-    return __builtin_ffs(_mm_movemask_epi8(_mm_cmpeq_epi8(ch_mask, escapable)));
-#else
-    switch (ch) {
-    default:
-        return 0;
-    case '/':
-        return 1;
-    case '\'':
-        return 2;
-    case '"':
-        return 3;
-    case '&':
-        return 4;
-    case '>':
-        return 5;
-    case '<':
-        return 6;
-    }
-#endif
-}
-
 void lwan_append_str_escaped_to_strbuf(struct lwan_strbuf *buf, void *ptr)
 {
-    static const struct lwan_value escaped[] = {
-        {},
-        { /* / */ "&#x2f;", 6 },
-        { /* ' */ "&#x27;", 6 },
-        { /* " */ "&quot;", 6 },
-        { /* & */ "&amp;", 5 },
-        { /* > */ "&gt;", 4 },
-        { /* < */ "&lt;", 4 },
-    };
-
     if (UNLIKELY(!ptr))
         return;
 
@@ -967,20 +1126,38 @@ void lwan_append_str_escaped_to_strbuf(struct lwan_strbuf *buf, void *ptr)
     if (UNLIKELY(!str))
         return;
 
-    const char *last, *p;
-    for (last = p = str; *p; p++) {
-        int index = escaped_index(*p);
+    size_t len = strlen(str);
+    while (true) {
+        size_t span = lwan_html_escape_span(str, len);
 
-        if (index) {
-            lwan_strbuf_append_str(buf, last, (size_t)(p - last));
-            last = p + 1;
+        lwan_strbuf_append_str(buf, str, span);
+        if (span == len)
+            return;
 
-            lwan_strbuf_append_str(buf, escaped[index].value, escaped[index].len);
+        switch (str[span]) {
+        case '/':
+            lwan_strbuf_append_str(buf, "&#x2f;", 6);
+            break;
+        case '\'':
+            lwan_strbuf_append_str(buf, "&#x27;", 6);
+            break;
+        case '"':
+            lwan_strbuf_append_str(buf, "&quot;", 6);
+            break;
+        case '&':
+            lwan_strbuf_append_str(buf, "&amp;", 5);
+            break;
+        case '>':
+            lwan_strbuf_append_str(buf, "&gt;", 4);
+            break;
+        case '<':
+            lwan_strbuf_append_str(buf, "&lt;", 4);
+            break;
         }
-    }
 
-    if (last != p)
-        lwan_strbuf_append_str(buf, last, (size_t)(p - last));
+        str += span + 1;
+        len -= span + 1;
+    }
 }
 
 bool lwan_tpl_str_is_empty(void *ptr)
@@ -1005,6 +1182,7 @@ static void free_chunk(struct chunk *chunk)
     case ACTION_VARIABLE:
     case ACTION_VARIABLE_STR:
     case ACTION_VARIABLE_STR_ESCAPE:
+    case ACTION_VARIABLE_INT:
     case ACTION_END_IF_VARIABLE_NOT_EMPTY:
     case ACTION_END_ITER:
         /* do nothing */
@@ -1019,6 +1197,14 @@ static void free_chunk(struct chunk *chunk)
     case ACTION_APPLY_TPL:
         lwan_tpl_free(chunk->data);
         break;
+    case ACTION_APPLY_CACHED_TPL: {
+        struct cached_partial *partial = chunk->data;
+
+        cache_destroy(partial->cache);
+        lwan_tpl_free(partial->tpl);
+        free(partial);
+        break;
+    }
     }
 }
 
@@ -1114,18 +1300,29 @@ static bool post_process_template(struct parser *parser)
             struct lwan_var_descriptor *descriptor = chunk->data;
             bool escape = chunk->flags & FLAGS_QUOTE;
 
+            /* Variables of the built-in types get their own instructions,
+             * with the offset baked in, so that applying them doesn't
+             * involve an indirect call through the descriptor. */
             if (descriptor->append_to_strbuf == lwan_append_str_to_strbuf) {
                 if (escape)
                     chunk->action = ACTION_VARIABLE_STR_ESCAPE;
                 else
                     chunk->action = ACTION_VARIABLE_STR;
                 chunk->data = (void *)(uintptr_t)descriptor->offset;
+            } else if (descriptor->append_to_strbuf ==
+                       lwan_append_str_escaped_to_strbuf) {
+                chunk->action = ACTION_VARIABLE_STR_ESCAPE;
+                chunk->data = (void *)(uintptr_t)descriptor->offset;
             } else if (escape) {
                 lwan_status_error("Variable must be string to be escaped");
                 return false;
             } else if (!descriptor->append_to_strbuf) {
                 lwan_status_error("Invalid variable descriptor");
                 return false;
+            } else if (descriptor->append_to_strbuf ==
+                       lwan_append_int_to_strbuf) {
+                chunk->action = ACTION_VARIABLE_INT;
+                chunk->data = (void *)(uintptr_t)descriptor->offset;
             }
         } else if (chunk->action == ACTION_LAST) {
             break;
@@ -1208,6 +1405,15 @@ static bool parser_shutdown(struct parser *parser, struct lexeme *lexeme)
         lwan_status_error("Parser error: unmatched quote");
         success = false;
     }
+    /* Errors found by the lexer, or by the parser states, stop parsing
+     * before the end of the template was reached. */
+    if (!chunk_array_len(&parser->chunks) ||
+        chunk_array_get_elem(&parser->chunks,
+                             chunk_array_len(&parser->chunks) - 1)
+                ->action != ACTION_LAST) {
+        lwan_status_error("Parser error: template has not been fully parsed");
+        success = false;
+    }
 
     success = success && post_process_template(parser);
 
@@ -1304,6 +1510,9 @@ static void dump_program(const struct lwan_tpl *tpl)
         case ACTION_VARIABLE_STR_ESCAPE:
             printf("%s", instr("APPEND_VAR_STR_ESCAPE", instr_buf));
             break;
+        case ACTION_VARIABLE_INT:
+            printf("%s", instr("APPEND_VAR_INT", instr_buf));
+            break;
         case ACTION_START_ITER: {
             struct chunk_descriptor *descriptor = iter->data;
 
@@ -1332,6 +1541,13 @@ static void dump_program(const struct lwan_tpl *tpl)
         case ACTION_APPLY_TPL:
             printf("%s", instr("APPLY_TEMPLATE", instr_buf));
             break;
+        case ACTION_APPLY_CACHED_TPL: {
+            struct cached_partial *partial = iter->data;
+
+            printf("%s [%s]", instr("APPLY_CACHED_TEMPLATE", instr_buf),
+                   partial->key->name);
+            break;
+        }
         case ACTION_LAST:
             printf("%s", instr("LAST", instr_buf));
         }
@@ -1418,6 +1634,9 @@ bake_direct_addresses(struct lwan_tpl *tpl,
     LWAN_ARRAY_FOREACH (&tpl->chunks, iter) {
         if (iter->action == ACTION_APPLY_TPL)
             bake_direct_addresses(iter->data, dispatch_table);
+        else if (iter->action == ACTION_APPLY_CACHED_TPL)
+            bake_direct_addresses(
+                ((struct cached_partial *)iter->data)->tpl, dispatch_table);
 
         iter->instruction = dispatch_table[iter->action];
     }
@@ -1425,15 +1644,56 @@ bake_direct_addresses(struct lwan_tpl *tpl,
     tpl->dispatch_table_direct = true;
 }
 
+/* When applying a template to a chunked response, what has been rendered
+ * so far is sent whenever the buffer grows past this many bytes.  This is
+ * checked once per item of a sequence; it's the largest size the buffer
+ * pool keeps, so the buffer is recycled after the response. */
+#define CHUNKED_FLUSH_THRESHOLD ((size_t)16384)
+
+static void free_coro_defer(void *data)
+{
+    coro_free(data);
+}
+
+static struct coro *iter_coro_new(struct coro_switcher *switcher,
+                                  coro_function_t generator,
+                                  void *variables,
+                                  struct lwan_request *request,
+                                  size_t *generation)
+{
+    struct coro *coro = coro_new(switcher, generator, variables);
+
+    /* Sending a chunk might abort the connection, in which case apply()
+     * never returns; have the request coroutine free the generator
+     * coroutine if that happens. */
+    if (request && LIKELY(coro)) {
+        *generation = coro_deferred_get_generation(request->conn->coro);
+        coro_defer(request->conn->coro, free_coro_defer, coro);
+    }
+
+    return coro;
+}
+
+static void
+iter_coro_free(struct coro *coro, struct lwan_request *request, size_t generation)
+{
+    if (request)
+        coro_deferred_run(request->conn->coro, generation);
+    else
+        coro_free(coro);
+}
+
 static const struct chunk *apply(struct lwan_tpl *tpl,
                                  const struct chunk *chunks,
                                  struct lwan_strbuf *buf,
                                  void *variables,
-                                 const void *data)
+                                 const void *data,
+                                 struct lwan_request *request)
 {
     struct coro_switcher switcher;
     struct coro *coro = NULL;
     const struct chunk *chunk = chunks;
+    size_t generation = 0;
 
     if (UNLIKELY(!chunk))
         return NULL;
@@ -1445,9 +1705,11 @@ static const struct chunk *apply(struct lwan_tpl *tpl,
             [ACTION_VARIABLE] = &&action_variable,
             [ACTION_VARIABLE_STR] = &&action_variable_str,
             [ACTION_VARIABLE_STR_ESCAPE] = &&action_variable_str_escape,
+            [ACTION_VARIABLE_INT] = &&action_variable_int,
             [ACTION_IF_VARIABLE_NOT_EMPTY] = &&action_if_variable_not_empty,
             [ACTION_END_IF_VARIABLE_NOT_EMPTY] = &&action_end_if_variable_not_empty,
             [ACTION_APPLY_TPL] = &&action_apply_tpl,
+            [ACTION_APPLY_CACHED_TPL] = &&action_apply_cached_tpl,
             [ACTION_START_ITER] = &&action_start_iter,
             [ACTION_END_ITER] = &&action_end_iter,
             [ACTION_LAST] = &&finalize,
@@ -1514,6 +1776,18 @@ action_variable_str_escape:
                                       (uintptr_t)chunk->data);
     DISPATCH_NEXT_ACTION_FAST();
 
+action_variable_int: {
+        char convertbuf[INT_TO_STR_BUFFER_SIZE];
+        size_t len;
+        char *converted;
+
+        converted = int_to_string(
+            *(int *)((char *)variables + (uintptr_t)chunk->data), convertbuf,
+            &len);
+        lwan_strbuf_append_str(buf, converted, len);
+        DISPATCH_NEXT_ACTION_FAST();
+    }
+
 action_if_variable_not_empty: {
         struct chunk_descriptor *cd = chunk->data;
         bool empty = cd->descriptor->get_is_empty((char *)variables +
@@ -1524,7 +1798,7 @@ action_if_variable_not_empty: {
             chunk = cd->chunk;
             DISPATCH_NEXT_ACTION_FAST();
         } else {
-            chunk = apply(tpl, chunk + 1, buf, variables, cd->chunk);
+            chunk = apply(tpl, chunk + 1, buf, variables, cd->chunk, request);
             DISPATCH_NEXT_ACTION_CHECK();
         }
     }
@@ -1539,7 +1813,7 @@ action_apply_tpl: {
 
         if (LIKELY(lwan_strbuf_grow_by(buf, inner_tpl->minimum_size))) {
             if (!apply(inner_tpl, chunk_array_get_array(&inner_tpl->chunks),
-                       buf, variables, NULL)) {
+                       buf, variables, NULL, request)) {
                 lwan_status_warning("Could not apply subtemplate");
                 return NULL;
             }
@@ -1552,6 +1826,45 @@ action_apply_tpl: {
         DISPATCH_NEXT_ACTION_FAST();
     }
 
+action_apply_cached_tpl: {
+        struct cached_partial *partial = chunk->data;
+        struct cache_entry *entry;
+        struct lwan_strbuf key;
+        int error;
+
+        lwan_strbuf_init(&key);
+        partial->key->append_to_strbuf(&key, (char *)variables +
+                                                 partial->key->offset);
+
+        cached_partial_variables = variables;
+        entry = cache_get_and_ref_entry(partial->cache,
+                                        lwan_strbuf_get_buffer(&key), &error);
+        cached_partial_variables = NULL;
+
+        lwan_strbuf_free(&key);
+
+        if (UNLIKELY(!entry)) {
+            /* Another thread is rendering this partial for the cache (or
+             * it couldn't be cached): render it without the cache. */
+            if (!apply(partial->tpl,
+                       chunk_array_get_array(&partial->tpl->chunks), buf,
+                       variables, NULL, request)) {
+                lwan_status_warning("Could not apply subtemplate");
+                return NULL;
+            }
+
+            DISPATCH_NEXT_ACTION_FAST();
+        }
+
+        struct lwan_strbuf *rendered =
+            &((struct cached_partial_entry *)entry)->buffer;
+        lwan_strbuf_append_str(buf, lwan_strbuf_get_buffer(rendered),
+                               lwan_strbuf_get_length(rendered));
+        cache_entry_unref(partial->cache, entry);
+
+        DISPATCH_NEXT_ACTION_FAST();
+    }
+
 action_start_iter:
     if (UNLIKELY(coro != NULL)) {
         lwan_status_warning("Coroutine is not NULL when starting iteration");
@@ -1559,7 +1872,12 @@ action_start_iter:
     }
 
     struct chunk_descriptor *cd = chunk->data;
-    coro = coro_new(&switcher, cd->descriptor->generator, variables);
+    coro = iter_coro_new(&switcher, cd->descriptor->generator, variables,
+                         request, &generation);
+    if (UNLIKELY(!coro)) {
+        lwan_status_warning("Could not create coroutine for iteration");
+        return NULL;
+    }
 
     bool resumed = coro_resume_value(coro, 0);
     bool negate = chunk->flags & FLAGS_NEGATE;
@@ -1571,16 +1889,14 @@ action_start_iter:
         if (negate)
             coro_resume_value(coro, 1);
 
-        coro_free(coro);
+        iter_coro_free(coro, request, generation);
         coro = NULL;
 
-        if (negate)
-            DISPATCH_ACTION_FAST();
-
-        DISPATCH_NEXT_ACTION_FAST();
+        /* cd->chunk is the chunk right after {{/sequence}}. */
+        DISPATCH_ACTION_FAST();
     }
 
-    chunk = apply(tpl, chunk + 1, buf, variables, chunk);
+    chunk = apply(tpl, chunk + 1, buf, variables, chunk, request);
     DISPATCH_ACTION_CHECK();
 
 action_end_iter:
@@ -1595,14 +1911,26 @@ action_end_iter:
         DISPATCH_NEXT_ACTION_FAST();
     }
 
+    if (chunk->flags & FLAGS_NEGATE) {
+        /* The body of {{^#sequence}} is applied only once, when the
+         * generator finished without yielding anything. */
+        iter_coro_free(coro, request, generation);
+        coro = NULL;
+        DISPATCH_NEXT_ACTION_FAST();
+    }
+
+    if (request &&
+        lwan_strbuf_get_length(buf) >= CHUNKED_FLUSH_THRESHOLD)
+        lwan_response_send_chunk(request);
+
     if (!coro_resume_value(coro, 0)) {
-        coro_free(coro);
+        iter_coro_free(coro, request, generation);
         coro = NULL;
         DISPATCH_NEXT_ACTION_FAST();
     }
 
     chunk = apply(tpl, ((struct chunk *)chunk->data) + 1, buf, variables,
-                  chunk->data);
+                  chunk->data, request);
     DISPATCH_ACTION_CHECK();
 
 finalize:
@@ -1616,18 +1944,74 @@ finalize:
 #undef RETURN_IF_NO_CHUNK
 }
 
+static void update_size_hint(struct lwan_tpl *tpl, size_t hint, size_t size)
+{
+    /* Outputs larger than the estimate raise it right away, otherwise the
+     * next ones would need to grow the buffer as well.  Smaller outputs
+     * only bring it down slowly, so that an unusually short page here and
+     * there doesn't cause the buffer to be grown for the following ones. */
+    if (size > hint)
+        hint = size;
+    else
+        hint -= (hint - size) / 8;
+
+    __atomic_store_n(&tpl->size_hint, hint, __ATOMIC_RELAXED);
+}
+
 bool lwan_tpl_apply_with_buffer(struct lwan_tpl *tpl,
                                 struct lwan_strbuf *buf,
                                 void *variables)
 {
+    const size_t hint = __atomic_load_n(&tpl->size_hint, __ATOMIC_RELAXED);
+
     lwan_strbuf_reset(buf);
 
-    if (UNLIKELY(!lwan_strbuf_grow_to(buf, tpl->minimum_size)))
+    if (UNLIKELY(!lwan_strbuf_grow_to(buf, LWAN_MAX(tpl->minimum_size, hint))))
         return false;
 
-    if (!apply(tpl, tpl->chunks.base.base, buf, variables, NULL))
+    if (!apply(tpl, tpl->chunks.base.base, buf, variables, NULL, NULL))
         return false;
 
+    if (lwan_strbuf_get_length(buf) != hint)
+        update_size_hint(tpl, hint, lwan_strbuf_get_length(buf));
+
+    return true;
+}
+
+bool lwan_tpl_apply_chunked(struct lwan_tpl *tpl,
+                            struct lwan_request *request,
+                            void *variables)
+{
+    struct lwan_strbuf *buf = request->response.buffer;
+    const size_t hint = __atomic_load_n(&tpl->size_hint, __ATOMIC_RELAXED);
+
+    lwan_strbuf_reset(buf);
+
+    if (UNLIKELY(!lwan_strbuf_grow_to(
+            buf, LWAN_MIN(LWAN_MAX(tpl->minimum_size, hint),
+                          CHUNKED_FLUSH_THRESHOLD * 2))))
+        return false;
+
+    /* Headers are sent before applying the template so that (1) the client
+     * gets something right away, and (2) whatever setting up the chunked
+     * response defers to the request coroutine isn't run when a sequence
+     * finishes (see iter_coro_free()). */
+    if (!(request->flags & RESPONSE_SENT_HEADERS) &&
+        UNLIKELY(!lwan_response_set_chunked(request, HTTP_OK)))
+        return false;
+
+    if (UNLIKELY(!apply(tpl, tpl->chunks.base.base, buf, variables, NULL,
+                        request))) {
+        /* Part of the response might have been sent already, and there's
+         * no way to signal an error in a chunked response other than not
+         * sending the last chunk. */
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    if (lwan_strbuf_get_length(buf))
+        lwan_response_send_chunk(request);
+
     return true;
 }
 
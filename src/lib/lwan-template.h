@@ -23,6 +23,8 @@
 #include "lwan-strbuf.h"
 #include <stddef.h>
 
+struct lwan_request;
+
 enum lwan_tpl_flag { LWAN_TPL_FLAG_CONST_TEMPLATE = 1 << 0 };
 
 struct lwan_var_descriptor {
@@ -94,4 +96,15 @@ struct lwan_strbuf *lwan_tpl_apply(struct lwan_tpl *tpl, void *variables);
 bool lwan_tpl_apply_with_buffer(struct lwan_tpl *tpl,
                                 struct lwan_strbuf *buf,
                                 void *variables);
+
+/* Applies the template to a chunked response (the status is 200 OK if
+ * the response headers haven't been sent yet), sending what has been
+ * rendered so far whenever it grows large enough while going through
+ * sequences, so that large pages don't need to be kept in memory.  Returns
+ * false if the response couldn't be started; the handler should then
+ * return an error status as usual.  Otherwise, the handler just returns
+ * HTTP_OK once this returns. */
+bool lwan_tpl_apply_chunked(struct lwan_tpl *tpl,
+                            struct lwan_request *request,
+                            void *variables);
 void lwan_tpl_free(struct lwan_tpl *tpl);
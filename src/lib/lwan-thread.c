@@ -22,8 +22,10 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <sched.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
@@ -31,22 +33,47 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
-#if defined(HAVE_EVENTFD)
+#if !defined(HAVE_EPOLL) && defined(HAVE_KQUEUE)
+/* Threads are nudged with an EVFILT_USER event; see lwan_thread_nudge(). */
+#define NUDGE_WITH_KEVENT
+#include <sys/event.h>
+#elif defined(HAVE_EVENTFD)
 #include <sys/eventfd.h>
 #endif
 
+#if defined(__linux__)
+#include <linux/filter.h>
+#endif
+
 #include "lwan-private.h"
+#include "lwan-access-log.h"
+#include "lwan-io-wrappers.h"
+#include "lwan-probes.h"
 #include "lwan-tq.h"
+#include "lwan-uring.h"
 #include "list.h"
 
+__thread struct lwan_thread_metrics *lwan_current_thread_metrics;
+
 static void lwan_strbuf_free_defer(void *data)
 {
     lwan_strbuf_free((struct lwan_strbuf *)data);
 }
 
+static void release_request_buffer(void *data1, void *data2)
+{
+    struct lwan_value *buffer = data1;
+    char *stack_buffer = data2;
+
+    if (buffer->value != stack_buffer) {
+        lwan_request_buffer_put(buffer->value);
+        buffer->value = stack_buffer;
+    }
+}
+
 static void graceful_close(struct lwan *l,
                            struct lwan_connection *conn,
-                           char buffer[static DEFAULT_BUFFER_SIZE])
+                           char buffer[static REQUEST_BUFFER_SIZE])
 {
     int fd = lwan_connection_get_fd(l, conn);
 
@@ -71,7 +98,7 @@ static void graceful_close(struct lwan *l,
     }
 
     for (int tries = 0; tries < 20; tries++) {
-        ssize_t r = read(fd, buffer, DEFAULT_BUFFER_SIZE);
+        ssize_t r = read(fd, buffer, REQUEST_BUFFER_SIZE);
 
         if (!r)
             break;
@@ -79,12 +106,15 @@ static void graceful_close(struct lwan *l,
         if (r < 0) {
             switch (errno) {
             case EAGAIN:
+                lwan_connection_clear_ready(conn, CONN_READY_READ);
                 break;
             case EINTR:
                 continue;
             default:
                 return;
             }
+        } else if (r < REQUEST_BUFFER_SIZE) {
+            lwan_connection_clear_ready(conn, CONN_READY_READ);
         }
 
         coro_yield(conn->coro, CONN_CORO_WANT_READ);
@@ -93,6 +123,48 @@ static void graceful_close(struct lwan *l,
     /* close(2) will be called when the coroutine yields with CONN_CORO_ABORT */
 }
 
+#if defined(HAVE_KTLS)
+static void setup_tls(struct coro *coro, struct lwan_connection *conn, int fd)
+{
+    const struct lwan *lwan = conn->thread->lwan;
+    const struct lwan_listener *listener =
+        &lwan->listeners[lwan->conn_listener ? lwan->conn_listener[fd] : 0];
+
+    /* Coroutines for parked connections start over, but the kernel still
+     * has the keys from the first handshake. */
+    if (LIKELY(!listener->tls) || (conn->flags & CONN_TLS))
+        return;
+
+    if (UNLIKELY(!lwan_tls_handshake(listener->tls, conn, fd)))
+        coro_yield(coro, CONN_CORO_ABORT);
+
+    conn->flags |= CONN_TLS;
+}
+#endif
+
+/* Parked connections (see park_coro()) are read into a buffer shared by
+ * every connection handled by an I/O thread, and only get a coroutine once
+ * something has been read: a client closing an idle keep-alive connection,
+ * which is what usually wakes parked connections up, never gets one.
+ * Whatever has been read is moved to the request buffer in the stack of the
+ * new coroutine before it has a chance to yield. */
+static __thread struct {
+    char buffer[REQUEST_BUFFER_SIZE];
+    size_t len;
+} parked_recv;
+
+static size_t take_parked_recv(char buffer[static REQUEST_BUFFER_SIZE])
+{
+    size_t len = parked_recv.len;
+
+    if (len) {
+        memcpy(buffer, parked_recv.buffer, len);
+        parked_recv.len = 0;
+    }
+
+    return len;
+}
+
 __attribute__((noreturn)) static int process_request_coro(struct coro *coro,
                                                           void *data)
 {
@@ -104,22 +176,34 @@ __attribute__((noreturn)) static int process_request_coro(struct coro *coro,
     int fd = lwan_connection_get_fd(lwan, conn);
     enum lwan_request_flags flags = lwan->config.request_flags;
     struct lwan_strbuf strbuf = LWAN_STRBUF_STATIC_INIT;
-    char request_buffer[DEFAULT_BUFFER_SIZE];
-    struct lwan_value buffer = {.value = request_buffer, .len = 0};
-    char *next_request = NULL;
+    struct lwan_strbuf queued_responses = LWAN_STRBUF_STATIC_INIT;
+    char request_buffer[REQUEST_BUFFER_SIZE];
+    struct lwan_value buffer = {.value = request_buffer,
+                                .len = take_parked_recv(request_buffer)};
+    size_t buffer_size = sizeof(request_buffer);
+    /* Data read while parked is handled like a pipelined request. */
+    char *next_request = buffer.len ? request_buffer : NULL;
     char *header_start[N_HEADER_START];
     struct lwan_proxy proxy;
-    const int error_when_n_packets = lwan_calculate_n_packets(DEFAULT_BUFFER_SIZE);
+    const int error_when_n_packets = lwan_calculate_n_packets(REQUEST_BUFFER_SIZE);
+
+#if defined(HAVE_KTLS)
+    setup_tls(coro, conn, fd);
+#endif
 
     coro_defer(coro, lwan_strbuf_free_defer, &strbuf);
+    coro_defer(coro, lwan_strbuf_free_defer, &queued_responses);
+    coro_defer2(coro, release_request_buffer, &buffer, request_buffer);
 
-    const size_t init_gen = 1; /* 1 call to coro_defer() */
+    const size_t init_gen = 3; /* 3 calls to coro_defer() */
     assert(init_gen == coro_deferred_get_generation(coro));
 
     while (true) {
         struct lwan_request_parser_helper helper = {
             .buffer = &buffer,
+            .buffer_size = buffer_size,
             .next_request = next_request,
+            .queued_responses = &queued_responses,
             .error_when_n_packets = error_when_n_packets,
             .header_start = header_start,
         };
@@ -131,26 +215,49 @@ __attribute__((noreturn)) static int process_request_coro(struct coro *coro,
                                        .proxy = &proxy,
                                        .helper = &helper};
 
+        const uint64_t registered = coro_deferred_get_registered(coro);
+
         lwan_process_request(lwan, &request);
 
+        conn->thread->metrics.defers +=
+            coro_deferred_get_registered(coro) - registered;
+
         /* Run the deferred instructions now (except those used to initialize
          * the coroutine), so that if the connection is gracefully closed,
          * the storage for ``helper'' is still there. */
         coro_deferred_run(coro, init_gen);
 
+        /* Usually sent with the response to the last pipelined request
+         * already in the buffer, but that might not have been written with
+         * lwan_response() (or written at all). */
+        if (!(helper.next_request && *helper.next_request))
+            lwan_send_queued_responses(&request);
+
         if (UNLIKELY(!(conn->flags & CONN_IS_KEEP_ALIVE))) {
             graceful_close(lwan, conn, request_buffer);
             break;
         }
 
-        if (next_request && *next_request) {
-            conn->flags |= CONN_CORK;
-
+        if (helper.next_request && *helper.next_request) {
             if (!(conn->flags & CONN_EVENTS_WRITE))
                 coro_yield(coro, CONN_CORO_WANT_WRITE);
         } else {
-            conn->flags &= ~CONN_CORK;
+            /* The request might have been parsed before draining started;
+             * don't wait for the next timer tick to close the connection. */
+            if (UNLIKELY(ATOMIC_READ(lwan->draining))) {
+                graceful_close(lwan, conn, request_buffer);
+                break;
+            }
+
+            /* Connections waiting for a request don't hold on to a
+             * buffer that has been spilled to; see spill_request_buffer(). */
+            release_request_buffer(&buffer, request_buffer);
+            helper.buffer_size = sizeof(request_buffer);
+
+            conn->flags &= ~CONN_PRIORITY_MASK;
+            conn->flags |= CONN_BETWEEN_REQUESTS;
             coro_yield(coro, CONN_CORO_WANT_READ);
+            conn->flags &= ~CONN_BETWEEN_REQUESTS;
         }
 
         /* Ensure string buffer is reset between requests, and that the backing
@@ -160,6 +267,7 @@ __attribute__((noreturn)) static int process_request_coro(struct coro *coro,
         /* Only allow flags from config. */
         flags = request.flags & (REQUEST_PROXIED | REQUEST_ALLOW_CORS);
         next_request = helper.next_request;
+        buffer_size = helper.buffer_size;
     }
 
     coro_yield(coro, CONN_CORO_ABORT);
@@ -179,6 +287,188 @@ conn_flags_to_epoll_events(enum lwan_connection_flags flags)
     return map[flags & CONN_EVENTS_MASK];
 }
 
+/* With edge-triggered events, sockets of connections are registered once,
+ * for both reads and writes, and whatever epoll reports is remembered in
+ * the connection flags until a read or write comes up short (see
+ * lwan_connection_clear_ready()).  Coroutines are then only resumed if
+ * the socket is ready for what they're waiting for, and changing that
+ * doesn't need an epoll_ctl() call.  Connections that yield while still
+ * ready won't be reported again, so they're queued to be resumed in the
+ * next iteration of the event loop. */
+#define EDGE_TRIGGERED_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+static ALWAYS_INLINE uint32_t conn_epoll_events(const struct lwan_thread *t,
+                                                enum lwan_connection_flags flags)
+{
+    if (t->lwan->config.edge_triggered_events)
+        return EDGE_TRIGGERED_EVENTS;
+
+    return conn_flags_to_epoll_events(flags);
+}
+
+static ALWAYS_INLINE bool conn_is_ready(enum lwan_connection_flags flags)
+{
+    return ((flags & CONN_EVENTS_READ) && (flags & CONN_READY_READ)) ||
+           ((flags & CONN_EVENTS_WRITE) && (flags & CONN_READY_WRITE));
+}
+
+static ALWAYS_INLINE bool conn_edge_is_ready(struct lwan_connection *conn,
+                                             uint32_t events)
+{
+    if (events & EPOLLIN)
+        conn->flags |= CONN_READY_READ;
+    if (events & EPOLLOUT)
+        conn->flags |= CONN_READY_WRITE;
+
+    /* Completions of zero-copy writes are signaled with EPOLLERR, and the
+     * coroutine waiting for them is suspended. */
+    return (events & EPOLLERR) || conn_is_ready(conn->flags);
+}
+
+static void queue_ready_conn(struct lwan_thread *t,
+                             struct lwan_connection *conn,
+                             int fd,
+                             int epoll_fd)
+{
+    if (conn->flags & CONN_READY_QUEUED)
+        return;
+
+    if (UNLIKELY(t->ready.count == t->ready.size)) {
+        const unsigned int size = t->ready.size ? t->ready.size * 2 : 64;
+        int *fds = reallocarray(t->ready.fds, size, sizeof(*fds));
+
+        if (UNLIKELY(!fds)) {
+            /* Modifying the registration of a socket makes epoll report it
+             * again if it's ready. */
+            struct epoll_event event = {
+                .events = EDGE_TRIGGERED_EVENTS,
+                .data.ptr = conn,
+            };
+            if (UNLIKELY(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0))
+                lwan_status_perror("epoll_ctl");
+            return;
+        }
+
+        t->ready.fds = fds;
+        t->ready.size = size;
+    }
+
+    t->ready.fds[t->ready.count++] = fd;
+    conn->flags |= CONN_READY_QUEUED;
+}
+
+#if defined(HAVE_IO_URING)
+/* Unlike epoll, io_uring doesn't keep an interest list: a poll request is
+ * armed for a file descriptor and is consumed once it completes.  The user
+ * data for each request encodes the file descriptor being polled and the
+ * generation of the requests for it, which changes whenever one of them is
+ * cancelled: completions for cancelled requests (or for requests completing
+ * while being cancelled) arrive late, and would otherwise be mistaken for
+ * completions of requests for a connection reusing the file descriptor,
+ * even in another thread.  The file descriptor of the connection that has
+ * to be resumed is kept alongside the generation in lwan->uring_polls, as
+ * it differs when a coroutine is awaiting on another file descriptor.
+ * (File reads and writes are tagged with LWAN_URING_FILE_IO instead.) */
+#define URING_NUDGE_OWNER UINT32_MAX
+#define URING_LISTENER_OWNER (UINT32_MAX - 1)
+#define URING_IGNORE_COMPLETION UINT64_MAX
+
+static ALWAYS_INLINE uint64_t uring_user_data(int polled_fd, uint32_t generation)
+{
+    return (uint64_t)(uint32_t)polled_fd << 32 | generation;
+}
+
+static bool uring_poll_add(struct lwan_thread *t,
+                           int polled_fd,
+                           uint32_t owner_fd,
+                           uint32_t events)
+{
+    struct lwan_uring_poll *poll = &t->lwan->uring_polls[polled_fd];
+    struct io_uring_sqe *sqe = lwan_uring_get_sqe(t->uring);
+
+    if (UNLIKELY(!sqe)) {
+        lwan_status_error("Could not obtain io_uring submission entry");
+        return false;
+    }
+
+    poll->owner_fd = owner_fd;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = polled_fd;
+    sqe->poll32_events = events;
+    sqe->user_data = uring_user_data(polled_fd, poll->generation);
+
+    return true;
+}
+
+static void uring_poll_remove(struct lwan_thread *t,
+                              int polled_fd,
+                              uint32_t owner_fd,
+                              uint32_t update_events,
+                              uint32_t flags)
+{
+    struct lwan_uring_poll *poll = &t->lwan->uring_polls[polled_fd];
+    struct io_uring_sqe *sqe = lwan_uring_get_sqe(t->uring);
+
+    if (UNLIKELY(!sqe)) {
+        lwan_status_error("Could not obtain io_uring submission entry");
+        return;
+    }
+
+    /* Also used to update the events of a poll request in flight, if
+     * IORING_POLL_UPDATE_EVENTS is passed as flags. */
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = uring_user_data(polled_fd, poll->generation);
+    sqe->len = flags;
+    sqe->poll32_events = update_events;
+    sqe->user_data = URING_IGNORE_COMPLETION;
+
+    if (flags & IORING_POLL_UPDATE_EVENTS)
+        poll->owner_fd = owner_fd;
+    else
+        poll->generation++;
+}
+
+static void uring_watch(struct lwan_thread *t,
+                        int polled_fd,
+                        uint32_t owner_fd,
+                        uint32_t events)
+{
+    struct lwan_connection *polled = &t->lwan->conns[polled_fd];
+
+    if (polled->flags & CONN_POLL_ARMED) {
+        uring_poll_remove(t, polled_fd, owner_fd, events,
+                          IORING_POLL_UPDATE_EVENTS);
+    } else if (uring_poll_add(t, polled_fd, owner_fd, events)) {
+        polled->flags |= CONN_POLL_ARMED;
+    }
+}
+
+void lwan_thread_uring_cancel_poll(struct lwan_connection *conn)
+{
+    struct lwan_thread *t = conn->thread;
+    int fd = lwan_connection_get_fd(t->lwan, conn);
+
+    /* Closing a file descriptor doesn't cancel a poll request in flight (and
+     * the request keeps a reference to the socket, so it's not closed either).
+     * The completion is ignored, as the generation changes. */
+    uring_poll_remove(t, fd, (uint32_t)fd, 0, 0);
+    conn->flags &= ~CONN_POLL_ARMED;
+}
+
+static void update_uring_poll(int fd,
+                              struct lwan_connection *conn,
+                              enum lwan_connection_flags prev_flags)
+{
+    if ((conn->flags & CONN_POLL_ARMED) && conn->flags == prev_flags)
+        return;
+
+    uring_watch(conn->thread, fd, (uint32_t)fd,
+                conn_flags_to_epoll_events(conn->flags));
+}
+#endif
+
 static void update_epoll_flags(int fd,
                                struct lwan_connection *conn,
                                int epoll_fd,
@@ -221,6 +511,17 @@ static void update_epoll_flags(int fd,
     conn->flags |= or_mask[yield_result];
     conn->flags &= and_mask[yield_result];
 
+#if defined(HAVE_IO_URING)
+    if (conn->thread->uring)
+        return update_uring_poll(fd, conn, prev_flags);
+#endif
+
+    if (conn->thread->lwan->config.edge_triggered_events) {
+        if (conn_is_ready(conn->flags))
+            queue_ready_conn(conn->thread, conn, fd, epoll_fd);
+        return;
+    }
+
     if (conn->flags == prev_flags)
         return;
 
@@ -233,12 +534,70 @@ static void update_epoll_flags(int fd,
         lwan_status_perror("epoll_ctl");
 }
 
-static void clear_async_await_flag(void *data)
+static void clear_async_await_flag(void *data1, void *data2)
+{
+    struct lwan_connection *async_fd_conn = data1;
+    struct lwan_thread *t = data2;
+
+    /* Might have been cleared by lwan_request_await_forget() already */
+    if (async_fd_conn->flags & CONN_ASYNC_AWAIT) {
+        async_fd_conn->flags &= ~CONN_ASYNC_AWAIT;
+        t->n_async_awaits--;
+    }
+}
+
+#if defined(HAVE_IO_URING)
+static void clear_async_await_flag_uring(void *data1, void *data2)
+{
+    struct lwan_connection *async_fd_conn = data1;
+    struct lwan_connection *conn = data2;
+
+    if (!(async_fd_conn->flags & CONN_ASYNC_AWAIT))
+        return; /* See lwan_request_await_forget() */
+
+    if (async_fd_conn->flags & CONN_POLL_ARMED) {
+        struct lwan *l = conn->thread->lwan;
+
+        uring_poll_remove(conn->thread,
+                          lwan_connection_get_fd(l, async_fd_conn),
+                          (uint32_t)lwan_connection_get_fd(l, conn), 0, 0);
+    }
+
+    async_fd_conn->flags &= ~(CONN_ASYNC_AWAIT | CONN_POLL_ARMED);
+    conn->thread->n_async_awaits--;
+}
+
+static enum lwan_connection_coro_yield
+resume_async_uring(struct lwan_connection *conn,
+                   struct lwan_connection *await_fd_conn,
+                   int await_fd,
+                   enum lwan_connection_flags flags)
 {
-    struct lwan_connection *async_fd_conn = data;
+    struct lwan_thread *t = conn->thread;
+
+    if (LIKELY(await_fd_conn->flags & CONN_ASYNC_AWAIT)) {
+        const enum lwan_connection_flags mask =
+            CONN_EVENTS_MASK | CONN_POLL_ARMED;
+
+        if (LIKELY((await_fd_conn->flags & mask) == (flags | CONN_POLL_ARMED)))
+            return CONN_CORO_SUSPEND;
+    } else {
+        await_fd_conn->flags |= CONN_ASYNC_AWAIT;
+        t->n_async_awaits++;
+        coro_defer2(conn->coro, clear_async_await_flag_uring, await_fd_conn,
+                    conn);
+    }
+
+    uring_watch(t, await_fd, (uint32_t)lwan_connection_get_fd(t->lwan, conn),
+                conn_flags_to_epoll_events(flags));
+    if (UNLIKELY(!(await_fd_conn->flags & CONN_POLL_ARMED)))
+        return CONN_CORO_ABORT;
 
-    async_fd_conn->flags &= ~CONN_ASYNC_AWAIT;
+    await_fd_conn->flags &= ~CONN_EVENTS_MASK;
+    await_fd_conn->flags |= flags;
+    return CONN_CORO_SUSPEND;
 }
+#endif
 
 static enum lwan_connection_coro_yield
 resume_async(struct timeout_queue *tq,
@@ -263,6 +622,12 @@ resume_async(struct timeout_queue *tq,
     flags = to_connection_flags[yield_result];
 
     struct lwan_connection *await_fd_conn = &tq->lwan->conns[await_fd];
+
+#if defined(HAVE_IO_URING)
+    if (conn->thread->uring)
+        return resume_async_uring(conn, await_fd_conn, await_fd, flags);
+#endif
+
     if (LIKELY(await_fd_conn->flags & CONN_ASYNC_AWAIT)) {
         if (LIKELY((await_fd_conn->flags & CONN_EVENTS_MASK) == flags))
             return CONN_CORO_SUSPEND;
@@ -271,11 +636,13 @@ resume_async(struct timeout_queue *tq,
     } else {
         op = EPOLL_CTL_ADD;
         flags |= CONN_ASYNC_AWAIT;
-        coro_defer(conn->coro, clear_async_await_flag, await_fd_conn);
+        conn->thread->n_async_awaits++;
+        coro_defer2(conn->coro, clear_async_await_flag, await_fd_conn,
+                    conn->thread);
     }
 
     struct epoll_event event = {.events = conn_flags_to_epoll_events(flags),
-                                .data.ptr = conn};
+                                .data.ptr = lwan_connection_tag_awaited(conn)};
     if (LIKELY(!epoll_ctl(epoll_fd, op, await_fd, &event))) {
         await_fd_conn->flags &= ~CONN_EVENTS_MASK;
         await_fd_conn->flags |= flags;
@@ -285,13 +652,97 @@ resume_async(struct timeout_queue *tq,
     return CONN_CORO_ABORT;
 }
 
+static void park_coro(struct lwan_connection *conn)
+{
+    /* Nothing in the coroutine stack needs to survive between requests
+     * (the string buffer is released by a deferred callback), so the next
+     * request can be handled by a brand new coroutine. */
+    coro_pool_put(&conn->thread->coro_pool, conn->coro);
+
+    conn->coro = NULL;
+    conn->flags &= ~CONN_BETWEEN_REQUESTS;
+    conn->flags |= CONN_PARKED;
+}
+
+static bool unpark_coro(struct lwan_connection *conn,
+                        struct coro_switcher *switcher)
+{
+    conn->coro = coro_pool_get(&conn->thread->coro_pool, switcher,
+                               process_request_coro, conn);
+    if (UNLIKELY(!conn->coro))
+        return false;
+
+    conn->flags &= ~CONN_PARKED;
+    return true;
+}
+
+enum parked_recv_result {
+    PARKED_RECV_DATA,
+    PARKED_RECV_NOTHING,
+    PARKED_RECV_CLOSED,
+};
+
+static enum parked_recv_result recv_while_parked(struct lwan_connection *conn,
+                                                 int fd)
+{
+    /* -1 for the NUL byte client_read() appends to the request buffer */
+    const size_t to_read = sizeof(parked_recv.buffer) - 1;
+    ssize_t r;
+
+    assert(!parked_recv.len);
+
+    do {
+        r = read(fd, parked_recv.buffer, to_read);
+    } while (UNLIKELY(r < 0 && errno == EINTR));
+
+    if (LIKELY(r > 0)) {
+        if ((size_t)r < to_read)
+            lwan_connection_clear_ready(conn, CONN_READY_READ);
+        parked_recv.len = (size_t)r;
+        return PARKED_RECV_DATA;
+    }
+
+    if (r < 0 && errno == EAGAIN) {
+        lwan_connection_clear_ready(conn, CONN_READY_READ);
+        return PARKED_RECV_NOTHING;
+    }
+
+    return PARKED_RECV_CLOSED;
+}
+
 static ALWAYS_INLINE void resume_coro(struct timeout_queue *tq,
                                       struct lwan_connection *conn,
+                                      struct coro_switcher *switcher,
                                       int epoll_fd)
 {
+    if (UNLIKELY(conn->flags & CONN_PARKED)) {
+        const int fd = lwan_connection_get_fd(tq->lwan, conn);
+
+        switch (recv_while_parked(conn, fd)) {
+        case PARKED_RECV_DATA:
+            break;
+        case PARKED_RECV_NOTHING:
+            return update_epoll_flags(fd, conn, epoll_fd, CONN_CORO_WANT_READ);
+        case PARKED_RECV_CLOSED:
+            return timeout_queue_expire(tq, conn);
+        }
+
+        if (UNLIKELY(!unpark_coro(conn, switcher))) {
+            parked_recv.len = 0;
+            lwan_status_error("Could not create coroutine, dropping connection");
+            return timeout_queue_expire(tq, conn);
+        }
+    }
+
     assert(conn->coro);
 
-    int64_t from_coro = coro_resume(conn->coro);
+    int64_t from_coro;
+    if (UNLIKELY(conn->thread->profile != NULL))
+        from_coro = lwan_profiler_resume(conn);
+    else if (UNLIKELY(conn->thread->watch != NULL))
+        from_coro = lwan_watchdog_resume(conn);
+    else
+        from_coro = coro_resume(conn->coro);
     enum lwan_connection_coro_yield yield_result = from_coro & 0xffffffff;
 
     if (UNLIKELY(yield_result >= CONN_CORO_ASYNC))
@@ -300,24 +751,74 @@ static ALWAYS_INLINE void resume_coro(struct timeout_queue *tq,
     if (UNLIKELY(yield_result == CONN_CORO_ABORT))
         return timeout_queue_expire(tq, conn);
 
+    if (tq->lwan->config.park_idle_connections &&
+        (conn->flags & CONN_BETWEEN_REQUESTS))
+        park_coro(conn);
+
     return update_epoll_flags(lwan_connection_get_fd(tq->lwan, conn), conn,
                               epoll_fd, yield_result);
 }
 
-static void update_date_cache(struct lwan_thread *thread)
+/* Sent to clients that can't be served right now.  There's no coroutine
+ * (and no request has been read) at this point, so this is written straight
+ * to the socket; it's small enough to fit in an empty socket buffer. */
+static const char busy_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 19\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "Service Unavailable";
+
+void lwan_thread_reject_client(struct lwan_thread *t, int fd)
+{
+    ATOMIC_INC(t->metrics.rejected);
+
+    (void)send(fd, busy_response, sizeof(busy_response) - 1,
+               MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    shutdown(fd, SHUT_RDWR);
+    close(fd);
+}
+
+bool lwan_thread_is_overloaded(const struct lwan_thread *t)
+{
+    const struct lwan_config *config = &t->lwan->config;
+
+    if (config->max_connections_per_thread &&
+        ATOMIC_READ(t->n_connections) >= config->max_connections_per_thread)
+        return true;
+
+    if (config->max_pending_per_thread &&
+        spsc_queue_length(&t->pending_fds) >= config->max_pending_per_thread)
+        return true;
+
+    return false;
+}
+
+/* New connections are parked right away if idle connections are parked,
+ * so that they only get a coroutine once the client sends something;
+ * connections to TLS listeners need one to perform the handshake. */
+static bool park_new_conn(const struct lwan *l, int fd)
 {
-    time_t now = time(NULL);
+    if (!l->config.park_idle_connections)
+        return false;
 
-    lwan_format_rfc_time(now, thread->date.date);
-    lwan_format_rfc_time(now + (time_t)thread->lwan->config.expires,
-                         thread->date.expires);
+#if defined(HAVE_KTLS)
+    if (l->listeners[l->conn_listener ? l->conn_listener[fd] : 0].tls)
+        return false;
+#endif
+
+    return true;
 }
 
-static ALWAYS_INLINE void spawn_coro(struct lwan_connection *conn,
+static ALWAYS_INLINE bool spawn_coro(struct lwan_connection *conn,
                                      struct coro_switcher *switcher,
                                      struct timeout_queue *tq)
 {
     struct lwan_thread *t = conn->thread;
+    const int fd = lwan_connection_get_fd(tq->lwan, conn);
 
     assert(!conn->coro);
     assert(t);
@@ -325,155 +826,714 @@ static ALWAYS_INLINE void spawn_coro(struct lwan_connection *conn,
     assert((uintptr_t)t <
            (uintptr_t)(tq->lwan->thread.threads + tq->lwan->thread.count));
 
-    *conn = (struct lwan_connection) {
-        .coro = coro_new(switcher, process_request_coro, conn),
-        .flags = CONN_EVENTS_READ,
-        .time_to_expire = tq->current_time + tq->move_to_last_bump,
-        .thread = t,
-    };
-    if (UNLIKELY(!conn->coro)) {
-        /* FIXME: send a "busy" response to this client? we don't have a coroutine
-         * at this point, can't use lwan_send() here */
-        lwan_status_error("Could not create coroutine, dropping connection");
+    if (park_new_conn(tq->lwan, fd)) {
+        *conn = (struct lwan_connection) {
+            .flags = CONN_EVENTS_READ | CONN_PARKED,
+            .time_to_expire = tq->current_time + tq->move_to_last_bump,
+            .thread = t,
+        };
+    } else {
+        *conn = (struct lwan_connection) {
+            .coro = coro_pool_get(&t->coro_pool, switcher,
+                                  process_request_coro, conn),
+            .flags = CONN_EVENTS_READ,
+            .time_to_expire = tq->current_time + tq->move_to_last_bump,
+            .thread = t,
+        };
+        if (UNLIKELY(!conn->coro)) {
+            lwan_status_error(
+                "Could not create coroutine, dropping connection");
+
+            conn->flags = 0;
+            lwan_thread_reject_client(t, fd);
 
-        conn->flags = 0;
+            return false;
+        }
+    }
+
+    ATOMIC_INC(t->n_connections);
+    t->metrics.accepted++;
+    timeout_queue_insert(tq, conn);
 
-        int fd = lwan_connection_get_fd(tq->lwan, conn);
-        shutdown(fd, SHUT_RDWR);
-        close(fd);
+    return true;
+}
 
+static void add_client(struct lwan_thread *t,
+                       struct lwan_connection *conn,
+                       int new_fd,
+                       struct timeout_queue *tq,
+                       struct coro_switcher *switcher,
+                       int epoll_fd)
+{
+#if defined(HAVE_IO_URING)
+    if (t->uring) {
+        if (LIKELY(spawn_coro(conn, switcher, tq))) {
+            uring_watch(t, new_fd, (uint32_t)new_fd,
+                        conn_flags_to_epoll_events(CONN_EVENTS_READ));
+        }
         return;
     }
+#endif
 
-    timeout_queue_insert(tq, conn);
+    struct epoll_event ev = {
+        .data.ptr = conn,
+        .events = conn_epoll_events(t, CONN_EVENTS_READ),
+    };
+
+    if (LIKELY(!epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_fd, &ev)))
+        spawn_coro(conn, switcher, tq);
 }
 
-static void accept_nudge(int pipe_fd,
-                         struct lwan_thread *t,
-                         struct lwan_connection *conns,
-                         struct timeout_queue *tq,
-                         struct coro_switcher *switcher,
-                         int epoll_fd)
+/* Connections past this many in a single wakeup are candidates to be
+ * donated to idle threads, if work stealing is enabled. */
+#define DONATE_AFTER_N_EVENTS 16
+
+static struct lwan_thread *find_idle_thread(struct lwan_thread *t)
 {
-    uint64_t event;
-    int new_fd;
+    struct lwan *l = t->lwan;
+    const struct lwan_thread_pool *pool = &t->pool;
+    const unsigned int self = (unsigned int)(t - l->thread.threads) - pool->first;
 
-    /* Errors are ignored here as pipe_fd serves just as a way to wake the
-     * thread from epoll_wait().  It's fine to consume the queue at this
-     * point, regardless of the error type. */
-    (void)read(pipe_fd, &event, sizeof(event));
+    /* Connections never leave the pool of threads of their listener. */
+    for (unsigned int i = 1; i < pool->count; i++) {
+        struct lwan_thread *other =
+            &l->thread.threads[pool->first + (self + i) % pool->count];
 
-    while (spsc_queue_pop(&t->pending_fds, &new_fd)) {
-        struct lwan_connection *conn = &conns[new_fd];
-        struct epoll_event ev = {
-            .data.ptr = conn,
-            .events = conn_flags_to_epoll_events(CONN_EVENTS_READ),
-        };
+        if (!ATOMIC_READ(other->waiting))
+            continue;
+        if (ATOMIC_READ(other->donated.count) >= N_ELEMENTS(other->donated.fds))
+            continue;
 
-        if (LIKELY(!epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_fd, &ev)))
-            spawn_coro(conn, switcher, tq);
+        return other;
     }
 
-    timeouts_add(t->wheel, &tq->timeout, 1000);
+    return NULL;
 }
 
-static bool process_pending_timers(struct timeout_queue *tq,
-                                   struct lwan_thread *t,
-                                   int epoll_fd)
+static bool try_donate_conn(struct lwan_thread *t,
+                            struct timeout_queue *tq,
+                            struct lwan_connection *conn,
+                            int epoll_fd,
+                            struct lwan_thread **target)
 {
-    struct timeout *timeout;
-    bool should_expire_timers = false;
-
-    while ((timeout = timeouts_get(t->wheel))) {
-        struct lwan_request *request;
+    /* Only connections waiting for the next request in a keep-alive
+     * connection can be moved: anything else might have timers, awaited
+     * file descriptors, or deferred callbacks tied to this thread. */
+    if (!(conn->flags & (CONN_BETWEEN_REQUESTS | CONN_PARKED)))
+        return false;
+    /* Nor can connections in the list of ready connections. */
+    if (conn->flags & CONN_READY_QUEUED)
+        return false;
+
+    if (!*target) {
+        *target = find_idle_thread(t);
+        if (!*target)
+            return false;
+    }
 
-        if (timeout == &tq->timeout) {
-            should_expire_timers = true;
-            continue;
-        }
+    struct lwan_thread *other = *target;
+    int fd = lwan_connection_get_fd(tq->lwan, conn);
+    bool donated = false;
 
-        request = container_of(timeout, struct lwan_request, timeout);
+    pthread_mutex_lock(&other->donated.lock);
+    if (other->donated.count < N_ELEMENTS(other->donated.fds)) {
+        if (t->uring || !epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL)) {
+            timeout_queue_remove(tq, conn);
+            ATOMIC_DEC(t->n_connections);
 
-        update_epoll_flags(request->fd, request->conn, epoll_fd,
-                           CONN_CORO_RESUME);
+            other->donated.fds[other->donated.count++] = fd;
+            t->metrics.donated++;
+            donated = true;
+        }
     }
+    pthread_mutex_unlock(&other->donated.lock);
 
-    if (should_expire_timers) {
-        timeout_queue_expire_waiting(tq);
+    if (!donated) {
+        /* Inbox is full (or the fd couldn't be unwatched): wake the thread
+         * and look for another one next time. */
+        lwan_thread_nudge(other);
+        *target = NULL;
+    }
 
-        /* tq timeout expires every 1000ms if there are connections, so
-         * update the date cache at this point as well.  */
-        update_date_cache(t);
+    return donated;
+}
 
-        if (!timeout_queue_empty(tq)) {
-            timeouts_add(t->wheel, &tq->timeout, 1000);
-            return true;
+static void adopt_donated_conns(struct lwan_thread *t,
+                                struct lwan_connection *conns,
+                                struct timeout_queue *tq,
+                                struct coro_switcher *switcher,
+                                int epoll_fd)
+{
+    int fds[N_ELEMENTS(t->donated.fds)];
+    unsigned int n_fds;
+
+    pthread_mutex_lock(&t->donated.lock);
+    n_fds = t->donated.count;
+    memcpy(fds, t->donated.fds, n_fds * sizeof(*fds));
+    t->donated.count = 0;
+    pthread_mutex_unlock(&t->donated.lock);
+
+    for (unsigned int i = 0; i < n_fds; i++) {
+        struct lwan_connection *conn = &conns[fds[i]];
+
+        conn->thread = t;
+        if (conn->coro)
+            coro_set_switcher(conn->coro, switcher);
+        conn->time_to_expire = tq->current_time + tq->move_to_last_bump;
+        timeout_queue_insert(tq, conn);
+        ATOMIC_INC(t->n_connections);
+
+        /* Readiness is level-triggered, so the event that caused the
+         * donation will be reported again by this thread.  (With
+         * edge-triggered events, it's reported when the socket is added,
+         * so what the previous thread knew is forgotten.) */
+        conn->flags &= ~(CONN_READY_READ | CONN_READY_WRITE);
+#if defined(HAVE_IO_URING)
+        if (t->uring) {
+            uring_watch(t, fds[i], (uint32_t)fds[i],
+                        conn_flags_to_epoll_events(conn->flags));
+            continue;
         }
+#endif
+
+        struct epoll_event ev = {
+            .data.ptr = conn,
+            .events = conn_epoll_events(t, conn->flags),
+        };
+        if (UNLIKELY(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i], &ev) < 0))
+            timeout_queue_expire(tq, conn);
+    }
+}
+
+static void drain_thread(struct lwan_thread *t, struct timeout_queue *tq)
+{
+    /* Listening sockets shared by all threads are closed by the main
+     * thread; per-thread listeners have to be closed by their owners. */
+    if (t->listen_fd >= 0) {
+#if defined(HAVE_IO_URING)
+        if (t->uring)
+            uring_poll_remove(t, t->listen_fd, URING_LISTENER_OWNER,
+                              0, 0);
+        else
+#endif
+            epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, t->listen_fd, NULL);
 
-        timeouts_del(t->wheel, &tq->timeout);
+        close(t->listen_fd);
+        t->listen_fd = -1;
     }
 
-    return false;
+    /* Connections with requests in flight are closed after their response
+     * is sent with "Connection: close"; idle ones won't get another one. */
+    timeout_queue_expire_idle(tq);
 }
 
-static int
-turn_timer_wheel(struct timeout_queue *tq, struct lwan_thread *t, int epoll_fd)
+static void resume_suspended_request(struct lwan_request *request,
+                                     int epoll_fd)
 {
-    const int infinite_timeout = -1;
-    timeout_t wheel_timeout;
-    struct timespec now;
+    struct lwan_connection *conn = request->conn;
 
-    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
-        lwan_status_critical("Could not get monotonic time");
+    /* Sleeping HTTP/2 streams are resumed by their connection. */
+    if (UNLIKELY(conn->flags & CONN_IS_HTTP2_STREAM))
+        conn = lwan_http2_stream_wake(conn);
 
-    timeouts_update(t->wheel,
-                    (timeout_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000));
+    update_epoll_flags(request->fd, conn, epoll_fd, CONN_CORO_RESUME);
+}
 
-    /* Check if there's an expired timer. */
-    wheel_timeout = timeouts_timeout(t->wheel);
-    if (wheel_timeout > 0) {
-        return (int)wheel_timeout; /* No, but will soon. Wake us up in
-                                      wheel_timeout ms. */
+static void resume_woken_requests(struct lwan_thread *t, int epoll_fd)
+{
+    struct lwan_thread_wakeup *wakeup;
+
+    /* Wakeups are cancelled by their coroutines, which can't run while
+     * this list is being walked, so every request here is still
+     * suspended. */
+    pthread_mutex_lock(&t->wakeups.lock);
+    while ((wakeup = list_pop(&t->wakeups.requests, struct lwan_thread_wakeup,
+                              node))) {
+        wakeup->queued = false;
+        resume_suspended_request(wakeup->request, epoll_fd);
     }
+    pthread_mutex_unlock(&t->wakeups.lock);
+}
 
-    if (UNLIKELY((int64_t)wheel_timeout < 0))
-        return infinite_timeout; /* None found. */
+/* The timeout queue is processed once per second, when the clock of the
+ * timer wheel crosses into the next one, for as long as there are
+ * connections.  A tick that's already pending is left alone: scheduling it
+ * again every time the thread is woken up would keep pushing it back,
+ * and idle connections would never expire on a thread that keeps getting
+ * new ones. */
+static void schedule_timeout_queue_tick(struct lwan_thread *t,
+                                        struct timeout_queue *tq)
+{
+    if (!tq->timeout.pending) {
+        timeouts_add(t->wheel, &tq->timeout,
+                     ((timeout_t)tq->current_time + 1) * 1000);
+    }
+}
 
-    if (!process_pending_timers(tq, t, epoll_fd))
-        return infinite_timeout; /* No more timers to process. */
+/* The clock is updated every time the timer wheel is turned, which happens
+ * at least once a second while there are connections; otherwise, the
+ * thread might have been sleeping for a while. */
+static void update_timeout_queue_clock(struct timeout_queue *tq)
+{
+    struct timespec now;
 
-    /* After processing pending timers, determine when to wake up. */
-    return (int)timeouts_timeout(t->wheel);
+    if (timeout_queue_empty(tq) &&
+        LIKELY(!clock_gettime(monotonic_clock_id, &now)))
+        tq->current_time = (unsigned int)now.tv_sec;
 }
 
-static void *thread_io_loop(void *data)
+static void accept_nudge(int pipe_fd,
+                         struct lwan_thread *t,
+                         struct lwan_connection *conns,
+                         struct timeout_queue *tq,
+                         struct coro_switcher *switcher,
+                         int epoll_fd)
+{
+    uint64_t event;
+    int new_fd;
+
+    /* Errors are ignored here as pipe_fd serves just as a way to wake the
+     * thread from epoll_wait().  It's fine to consume the queue at this
+     * point, regardless of the error type.  (There's nothing to read if
+     * the nudge came from an EVFILT_USER event.) */
+    if (pipe_fd >= 0)
+        (void)read(pipe_fd, &event, sizeof(event));
+
+    update_timeout_queue_clock(tq);
+
+    while (spsc_queue_pop(&t->pending_fds, &new_fd))
+        add_client(t, &conns[new_fd], new_fd, tq, switcher, epoll_fd);
+
+    resume_woken_requests(t, epoll_fd);
+
+    lwan_timer_thread_update();
+
+    if (t->lwan->config.work_stealing)
+        adopt_donated_conns(t, conns, tq, switcher, epoll_fd);
+
+    /* The main thread nudges every thread once draining starts; this is
+     * handled by process_pending_timers() rather than here, as events for
+     * the per-thread listening socket might still be pending. */
+    if (UNLIKELY(ATOMIC_READ(t->lwan->draining)))
+        timeouts_add(t->wheel, &tq->timeout, 0);
+    else
+        schedule_timeout_queue_tick(t, tq);
+}
+
+static void accept_waiting_clients(struct lwan_thread *t,
+                                   struct lwan_connection *conns,
+                                   struct timeout_queue *tq,
+                                   struct coro_switcher *switcher,
+                                   int epoll_fd)
+{
+    update_timeout_queue_clock(tq);
+
+    while (true) {
+        int new_fd =
+            accept4(t->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (UNLIKELY(new_fd < 0)) {
+            switch (errno) {
+            case ECONNABORTED:
+            case EINTR:
+                continue;
+            case EAGAIN:
+                break;
+            case EMFILE:
+            case ENFILE:
+                if (lwan_pressure_shed(t, t->listen_fd, &t->reserve_fd))
+                    continue;
+                break;
+            default:
+                lwan_status_perror("accept");
+            }
+            break;
+        }
+
+        LWAN_PROBE(accept, new_fd);
+        lwan_pressure_note_fd(t->lwan, new_fd);
+
+        if (UNLIKELY(lwan_thread_is_overloaded(t))) {
+            lwan_thread_reject_client(t, new_fd);
+            continue;
+        }
+
+        /* The connection slot might have been pre-scheduled to another
+         * thread; this thread owns it now, as it accepted it. */
+        conns[new_fd].thread = t;
+        add_client(t, &conns[new_fd], new_fd, tq, switcher, epoll_fd);
+    }
+
+    schedule_timeout_queue_tick(t, tq);
+}
+
+/* A fraction of the connections is looked at every second while there's
+ * pressure, so that a few seconds of it don't close every idle connection
+ * at once, and clients have a chance to reconnect gradually. */
+static void evict_idle_connections(struct lwan_thread *t,
+                                   struct timeout_queue *tq)
+{
+    t->metrics.evicted +=
+        timeout_queue_expire_oldest_idle(tq, tq->n_conns / 8 + 1);
+}
+
+static void process_pending_timers(struct timeout_queue *tq,
+                                   struct lwan_thread *t,
+                                   int epoll_fd)
+{
+    struct timeout *timeout;
+    bool should_expire_timers = false;
+
+    while ((timeout = timeouts_get(t->wheel))) {
+        struct lwan_request *request;
+
+        if (timeout == &tq->timeout) {
+            should_expire_timers = true;
+            continue;
+        }
+        if (UNLIKELY(timeout->flags & LWAN_TIMEOUT_SLOW_REQUEST)) {
+            lwan_watchdog_request_timeout(timeout);
+            continue;
+        }
+        if (timeout->flags & LWAN_TIMEOUT_TIMER) {
+            lwan_timer_expired(timeout);
+            continue;
+        }
+
+        request = container_of(timeout, struct lwan_request, timeout);
+        resume_suspended_request(request, epoll_fd);
+    }
+
+    if (should_expire_timers) {
+        timeout_queue_expire_waiting(tq);
+
+        if (UNLIKELY(lwan_pressure_is_high(t->lwan)))
+            evict_idle_connections(t, tq);
+
+        coro_pool_release_cold_stacks(&t->coro_pool);
+
+        /* Checked every time, as connections that were in the middle of a
+         * request when draining started only become idle afterwards. */
+        if (UNLIKELY(ATOMIC_READ(t->lwan->draining)))
+            drain_thread(t, tq);
+
+        if (!timeout_queue_empty(tq))
+            schedule_timeout_queue_tick(t, tq);
+    }
+}
+
+static int
+turn_timer_wheel(struct timeout_queue *tq, struct lwan_thread *t, int epoll_fd)
+{
+    const int infinite_timeout = -1;
+    timeout_t wheel_timeout;
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
+        lwan_status_critical("Could not get monotonic time");
+
+    timeouts_update(t->wheel,
+                    (timeout_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000));
+    tq->current_time = (unsigned int)now.tv_sec;
+
+    /* Check if there's an expired timer. */
+    wheel_timeout = timeouts_timeout(t->wheel);
+    if (wheel_timeout > 0) {
+        return (int)wheel_timeout; /* No, but will soon. Wake us up in
+                                      wheel_timeout ms. */
+    }
+
+    if (UNLIKELY((int64_t)wheel_timeout < 0))
+        return infinite_timeout; /* None found. */
+
+    process_pending_timers(tq, t, epoll_fd);
+
+    /* After processing pending timers, determine when to wake up.  Even if
+     * the timeout queue is empty, requests might still be sleeping, and
+     * slow requests might still be watched. */
+    wheel_timeout = timeouts_timeout(t->wheel);
+    if ((int64_t)wheel_timeout < 0)
+        return infinite_timeout; /* No more timers to process. */
+
+    return (int)wheel_timeout;
+}
+
+/* Smallest busy polling window; if it shrinks below this, busy polling
+ * stops until events arrive while blocked again.  */
+#define BUSY_POLL_MIN_WINDOW_US 4u
+
+static uint64_t busy_poll_clock_ns(void)
+{
+    struct timespec now;
+
+    /* monotonic_clock_id might be a coarse clock, which doesn't have enough
+     * resolution for this. */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * UINT64_C(1000000000) + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t
+busy_poll_deadline(const struct lwan_thread *t, int timeout, uint64_t start)
+{
+    uint64_t window = t->busy_poll.window_us * UINT64_C(1000);
+
+    if (timeout >= 0)
+        window = LWAN_MIN(window, (uint64_t)timeout * UINT64_C(1000000));
+
+    return start + window;
+}
+
+static int busy_poll_finish(struct lwan_thread *t,
+                            uint64_t start,
+                            bool found_events,
+                            int timeout)
+{
+    const uint64_t spent_ns = busy_poll_clock_ns() - start;
+
+    t->busy_poll.spin_ns += spent_ns;
+    t->busy_poll.n_spins++;
+
+    if (found_events) {
+        t->busy_poll.n_hits++;
+    } else {
+        /* Spinning didn't pay off; don't burn as much CPU next time. */
+        t->busy_poll.window_us /= 2;
+        if (t->busy_poll.window_us < BUSY_POLL_MIN_WINDOW_US)
+            t->busy_poll.window_us = 0;
+    }
+
+    if (timeout > 0)
+        timeout = LWAN_MAX(0, timeout - (int)(spent_ns / 1000000));
+
+    return timeout;
+}
+
+static void busy_poll_grow(struct lwan_thread *t)
+{
+    /* Events arrived while blocked, so there's some load: open up the
+     * busy polling window for the next wait. */
+    const unsigned int max_window_us = t->lwan->config.busy_poll_us;
+    const unsigned int window_us = t->busy_poll.window_us;
+
+    if (!max_window_us)
+        return;
+
+    t->busy_poll.window_us =
+        window_us ? LWAN_MIN(window_us * 2, max_window_us)
+                  : LWAN_MIN(BUSY_POLL_MIN_WINDOW_US, max_window_us);
+}
+
+static int epoll_wait_busy(struct lwan_thread *t,
+                           int epoll_fd,
+                           struct epoll_event *events,
+                           int max_events,
+                           int timeout)
+{
+    int n_fds;
+
+    if (t->busy_poll.window_us && timeout != 0) {
+        const uint64_t start = busy_poll_clock_ns();
+        const uint64_t deadline = busy_poll_deadline(t, timeout, start);
+
+        do {
+            n_fds = epoll_wait(epoll_fd, events, max_events, 0);
+            if (n_fds) {
+                busy_poll_finish(t, start, n_fds > 0, timeout);
+                return n_fds;
+            }
+        } while (busy_poll_clock_ns() < deadline);
+
+        timeout = busy_poll_finish(t, start, false, timeout);
+    }
+
+    n_fds = epoll_wait(epoll_fd, events, max_events, timeout);
+    if (n_fds > 0)
+        busy_poll_grow(t);
+
+    return n_fds;
+}
+
+/* If any URL map has a priority, coroutines of connections handling a
+ * request for a high priority map are resumed as soon as their events are
+ * seen, while the others are queued to be resumed after all the events of
+ * the current loop iteration: normal priority ones first, and then the low
+ * priority ones, up to low_priority_resumes_per_loop of them.  Low priority
+ * connections beyond that wait for the next iteration, which won't block
+ * waiting for events while there are any of them.  Connections are queued
+ * only once; with level-triggered events, the events reported for queued
+ * connections in the meantime are ignored. */
+static bool sched_list_append(struct lwan_thread_fd_list *list, int fd)
+{
+    if (UNLIKELY(list->count == list->size)) {
+        const unsigned int size = list->size ? list->size * 2 : 64;
+        int *fds = reallocarray(list->fds, size, sizeof(*fds));
+
+        if (UNLIKELY(!fds))
+            return false;
+
+        list->fds = fds;
+        list->size = size;
+    }
+
+    list->fds[list->count++] = fd;
+    return true;
+}
+
+static ALWAYS_INLINE void schedule_resume(struct lwan_thread *t,
+                                          struct timeout_queue *tq,
+                                          struct lwan_connection *conn,
+                                          struct coro_switcher *switcher,
+                                          int epoll_fd)
+{
+    if (UNLIKELY(t->lwan->config.schedule_by_priority) &&
+        !(conn->flags & CONN_PRIORITY_HIGH)) {
+        struct lwan_thread_fd_list *list =
+            (conn->flags & CONN_PRIORITY_LOW) ? &t->sched_low : &t->sched_normal;
+
+        if (conn->flags & CONN_SCHED_QUEUED)
+            return;
+        /* If the list can't grow, the connection is resumed right away. */
+        if (LIKELY(sched_list_append(list,
+                                     lwan_connection_get_fd(t->lwan, conn)))) {
+            conn->flags |= CONN_SCHED_QUEUED;
+            return;
+        }
+    }
+
+    resume_coro(tq, conn, switcher, epoll_fd);
+    timeout_queue_move_to_last(tq, conn);
+}
+
+static void resume_sched_list(struct lwan_thread *t,
+                              struct lwan_thread_fd_list *list,
+                              unsigned int max_resumes,
+                              struct timeout_queue *tq,
+                              struct coro_switcher *switcher,
+                              int epoll_fd)
+{
+    const unsigned int n_resumes = LWAN_MIN(list->count, max_resumes);
+
+    for (unsigned int i = 0; i < n_resumes; i++) {
+        struct lwan_connection *conn = &t->lwan->conns[list->fds[i]];
+
+        /* See resume_ready_conns(). */
+        if (!(conn->flags & CONN_SCHED_QUEUED))
+            continue;
+        conn->flags &= ~CONN_SCHED_QUEUED;
+        if (!(conn->coro || (conn->flags & CONN_PARKED)))
+            continue;
+
+        resume_coro(tq, conn, switcher, epoll_fd);
+        timeout_queue_move_to_last(tq, conn);
+    }
+
+    list->count -= n_resumes;
+    memmove(list->fds, list->fds + n_resumes, list->count * sizeof(*list->fds));
+}
+
+static void resume_scheduled_conns(struct lwan_thread *t,
+                                   struct timeout_queue *tq,
+                                   struct coro_switcher *switcher,
+                                   int epoll_fd)
+{
+    resume_sched_list(t, &t->sched_normal, UINT_MAX, tq, switcher, epoll_fd);
+    resume_sched_list(t, &t->sched_low,
+                      t->lwan->config.low_priority_resumes_per_loop, tq,
+                      switcher, epoll_fd);
+}
+
+static void resume_ready_conns(struct lwan_thread *t,
+                               struct timeout_queue *tq,
+                               struct coro_switcher *switcher,
+                               int epoll_fd)
+{
+    /* Connections queued while these are resumed wait for the next
+     * iteration of the event loop, so that others get a chance to run. */
+    const unsigned int n_ready = t->ready.count;
+
+    for (unsigned int i = 0; i < n_ready; i++) {
+        struct lwan_connection *conn = &t->lwan->conns[t->ready.fds[i]];
+
+        /* Closed connections keep their flags until the file descriptor
+         * is reused, but their coroutines are gone. */
+        if (!(conn->flags & CONN_READY_QUEUED))
+            continue;
+        conn->flags &= ~CONN_READY_QUEUED;
+        if (!(conn->coro || (conn->flags & CONN_PARKED)))
+            continue;
+
+        /* Might have been resumed by an event after being queued. */
+        if (!conn_is_ready(conn->flags))
+            continue;
+
+        schedule_resume(t, tq, conn, switcher, epoll_fd);
+    }
+
+    t->ready.count -= n_ready;
+    memmove(t->ready.fds, t->ready.fds + n_ready,
+            t->ready.count * sizeof(*t->ready.fds));
+}
+
+/* Pings and pongs sent to websocket connections waiting for the next frame
+ * are dealt with without resuming their coroutines, which would otherwise
+ * be woken up just to answer them.  TLS connections are left alone, as the
+ * kernel might have more than application data to hand out. */
+static bool handle_websocket_control_frames(struct timeout_queue *tq,
+                                            struct lwan_connection *conn)
+{
+    if ((conn->flags & (CONN_IS_WEBSOCKET | CONN_WEBSOCKET_IDLE |
+                        CONN_EVENTS_WRITE | CONN_SUSPENDED | CONN_TLS |
+                        CONN_IS_HTTP2_STREAM)) !=
+        (CONN_IS_WEBSOCKET | CONN_WEBSOCKET_IDLE))
+        return false;
+
+    switch (lwan_websocket_handle_control_frames(
+        lwan_connection_get_fd(tq->lwan, conn))) {
+    case LWAN_WEBSOCKET_CONTROL_HANDLED:
+        timeout_queue_move_to_last(tq, conn);
+        return true;
+    case LWAN_WEBSOCKET_CONTROL_FAILED:
+        timeout_queue_expire(tq, conn);
+        return true;
+    case LWAN_WEBSOCKET_CONTROL_NOT_HANDLED:
+        break;
+    }
+
+    return false;
+}
+
+static void epoll_io_loop(struct lwan_thread *t,
+                          struct timeout_queue *tq,
+                          struct coro_switcher *switcher)
 {
-    struct lwan_thread *t = data;
     int epoll_fd = t->epoll_fd;
     const int read_pipe_fd = t->pipe_fd[0];
     const int max_events = LWAN_MIN((int)t->lwan->thread.max_fd, 1024);
     struct lwan *lwan = t->lwan;
+    const struct lwan_connection *listen_conn =
+        t->listen_fd >= 0 ? &lwan->conns[t->listen_fd] : NULL;
+    const bool work_stealing = lwan->config.work_stealing;
+    const bool edge_triggered = lwan->config.edge_triggered_events;
     struct epoll_event *events;
-    struct coro_switcher switcher;
-    struct timeout_queue tq;
-
-    lwan_status_debug("Worker thread #%zd starting",
-                      t - t->lwan->thread.threads + 1);
-    lwan_set_thread_name("worker");
 
     events = calloc((size_t)max_events, sizeof(*events));
     if (UNLIKELY(!events))
         lwan_status_critical("Could not allocate memory for events");
 
-    update_date_cache(t);
+    for (;;) {
+        int timeout = turn_timer_wheel(tq, t, epoll_fd);
+        struct lwan_thread *donate_to = NULL;
+        int n_fds;
 
-    timeout_queue_init(&tq, lwan);
+        if (t->ready.count || t->sched_low.count)
+            timeout = 0;
 
-    pthread_barrier_wait(&lwan->thread.barrier);
-
-    for (;;) {
-        int timeout = turn_timer_wheel(&tq, t, epoll_fd);
-        int n_fds = epoll_wait(epoll_fd, events, max_events, timeout);
+        if (work_stealing)
+            __atomic_store_n(&t->waiting, true, __ATOMIC_RELAXED);
+        n_fds = epoll_wait_busy(t, epoll_fd, events, max_events, timeout);
+        if (work_stealing)
+            __atomic_store_n(&t->waiting, false, __ATOMIC_RELAXED);
 
         if (UNLIKELY(n_fds < 0)) {
             if (errno == EBADF || errno == EINVAL)
@@ -481,31 +1541,290 @@ static void *thread_io_loop(void *data)
             continue;
         }
 
+        t->metrics.loops++;
+        t->metrics.events += (unsigned int)n_fds;
+
+        const bool should_donate = work_stealing && n_fds > DONATE_AFTER_N_EVENTS;
+
         for (struct epoll_event *event = events; n_fds--; event++) {
             struct lwan_connection *conn;
 
             if (UNLIKELY(!event->data.ptr)) {
-                accept_nudge(read_pipe_fd, t, lwan->conns, &tq, &switcher,
+                accept_nudge(read_pipe_fd, t, lwan->conns, tq, switcher,
                              epoll_fd);
                 continue;
             }
 
+            if (lwan_connection_is_tagged_awaited(event->data.ptr)) {
+                conn = lwan_connection_untag_awaited(event->data.ptr);
+                goto resume;
+            }
+
             conn = event->data.ptr;
 
+            if (UNLIKELY(conn == listen_conn)) {
+                accept_waiting_clients(t, lwan->conns, tq, switcher, epoll_fd);
+                continue;
+            }
+
             if (UNLIKELY(event->events & (EPOLLRDHUP | EPOLLHUP))) {
-                timeout_queue_expire(&tq, conn);
+                timeout_queue_expire(tq, conn);
+                continue;
+            }
+
+            if (edge_triggered && !conn_edge_is_ready(conn, event->events))
+                continue;
+
+            if (conn->flags & CONN_SCHED_QUEUED)
+                continue;
+
+            /* The ready flags used with edge-triggered events assume that
+             * the coroutine is the one reading from the socket. */
+            if (UNLIKELY(conn->flags & CONN_WEBSOCKET_IDLE) &&
+                !edge_triggered && handle_websocket_control_frames(tq, conn))
+                continue;
+
+            if (should_donate && event - events >= DONATE_AFTER_N_EVENTS &&
+                try_donate_conn(t, tq, conn, epoll_fd, &donate_to))
+                continue;
+
+        resume:
+            schedule_resume(t, tq, conn, switcher, epoll_fd);
+        }
+
+        if (donate_to)
+            lwan_thread_nudge(donate_to);
+
+        if (t->ready.count)
+            resume_ready_conns(t, tq, switcher, epoll_fd);
+        if (t->sched_normal.count || t->sched_low.count)
+            resume_scheduled_conns(t, tq, switcher, epoll_fd);
+    }
+
+    free(t->ready.fds);
+    free(t->sched_normal.fds);
+    free(t->sched_low.fds);
+    free(events);
+}
+
+#if defined(HAVE_IO_URING)
+static int uring_wait_busy(struct lwan_thread *t, int timeout)
+{
+    struct lwan_uring *ring = t->uring;
+    int r;
+
+    if (t->busy_poll.window_us && timeout != 0) {
+        /* Submit pending requests without waiting, then spin looking at the
+         * completion queue, which doesn't require any system call. */
+        r = lwan_uring_submit_and_wait(ring, 0);
+        if (UNLIKELY(r < 0))
+            return r;
+
+        const uint64_t start = busy_poll_clock_ns();
+        const uint64_t deadline = busy_poll_deadline(t, timeout, start);
+
+        do {
+            if (lwan_uring_peek_cqe(ring)) {
+                busy_poll_finish(t, start, true, timeout);
+                return 0;
+            }
+        } while (busy_poll_clock_ns() < deadline);
+
+        timeout = busy_poll_finish(t, start, false, timeout);
+    }
+
+    r = lwan_uring_submit_and_wait(ring, timeout);
+    if (r == 0 && lwan_uring_peek_cqe(ring))
+        busy_poll_grow(t);
+
+    return r;
+}
+
+static void uring_io_loop(struct lwan_thread *t,
+                          struct timeout_queue *tq,
+                          struct coro_switcher *switcher)
+{
+    struct lwan_uring *ring = t->uring;
+    struct lwan_connection *conns = t->lwan->conns;
+    const struct lwan_uring_poll *polls = t->lwan->uring_polls;
+    const int read_pipe_fd = t->pipe_fd[0];
+    const bool work_stealing = t->lwan->config.work_stealing;
+
+    if (!uring_poll_add(t, read_pipe_fd, URING_NUDGE_OWNER, EPOLLIN))
+        lwan_status_critical("Could not watch for nudges using io_uring");
+    if (t->listen_fd >= 0 &&
+        !uring_poll_add(t, t->listen_fd, URING_LISTENER_OWNER, EPOLLIN))
+        lwan_status_critical("Could not watch listening socket using io_uring");
+
+    for (;;) {
+        /* Pending poll requests (additions, updates, and cancellations) are
+         * submitted in the same system call that waits for completions. */
+        int timeout = turn_timer_wheel(tq, t, t->epoll_fd);
+        struct lwan_thread *donate_to = NULL;
+        unsigned int n_resumed = 0;
+        int r;
+
+        if (t->sched_low.count)
+            timeout = 0;
+
+        if (work_stealing)
+            __atomic_store_n(&t->waiting, true, __ATOMIC_RELAXED);
+        r = uring_wait_busy(t, timeout);
+        if (work_stealing)
+            __atomic_store_n(&t->waiting, false, __ATOMIC_RELAXED);
+
+        if (UNLIKELY(r < 0)) {
+            if (r == -EBADF || r == -EINVAL || r == -EOPNOTSUPP)
+                break;
+            continue;
+        }
+
+        t->metrics.loops++;
+
+        for (struct io_uring_cqe *cqe; (cqe = lwan_uring_peek_cqe(ring));) {
+            const uint64_t user_data = cqe->user_data;
+            const int32_t res = cqe->res;
+
+            lwan_uring_cqe_seen(ring);
+
+            if (user_data == URING_IGNORE_COMPLETION)
+                continue;
+
+            t->metrics.events++;
+
+            if (user_data & LWAN_URING_FILE_IO) {
+                struct lwan_request *request = lwan_async_file_uring_done(
+                    (void *)(uintptr_t)(user_data & ~LWAN_URING_FILE_IO), res);
+
+                if (request)
+                    resume_suspended_request(request, t->epoll_fd);
+                continue;
+            }
+
+            const int polled_fd = (int)(user_data >> 32);
+            const struct lwan_uring_poll *poll = &polls[polled_fd];
+            if (UNLIKELY((uint32_t)user_data != poll->generation)) {
+                /* Completion for a request that has been cancelled. */
+                continue;
+            }
+            const uint32_t owner_fd = poll->owner_fd;
+
+            if (UNLIKELY(owner_fd == URING_NUDGE_OWNER)) {
+                accept_nudge(read_pipe_fd, t, conns, tq, switcher, t->epoll_fd);
+                uring_poll_add(t, read_pipe_fd, URING_NUDGE_OWNER, EPOLLIN);
+                continue;
+            }
+            if (UNLIKELY(owner_fd == URING_LISTENER_OWNER)) {
+                if (UNLIKELY(t->listen_fd < 0))
+                    continue; /* Cancelled by drain_thread(). */
+                accept_waiting_clients(t, conns, tq, switcher, t->epoll_fd);
+                uring_poll_add(t, t->listen_fd, URING_LISTENER_OWNER,
+                               EPOLLIN);
                 continue;
             }
 
-            resume_coro(&tq, conn, epoll_fd);
-            timeout_queue_move_to_last(&tq, conn);
+            struct lwan_connection *polled = &conns[polled_fd];
+            if (UNLIKELY(!(polled->flags & CONN_POLL_ARMED))) {
+                /* Completion for a request that has been cancelled. */
+                continue;
+            }
+            polled->flags &= ~CONN_POLL_ARMED;
+
+            struct lwan_connection *conn = &conns[owner_fd];
+            if (UNLIKELY(!conn->coro && !(conn->flags & CONN_PARKED)))
+                continue;
+
+            /* Awaited file descriptors other than the connection socket
+             * report hang-ups to the coroutine. */
+            if (UNLIKELY(res < 0 || (res & (EPOLLRDHUP | EPOLLHUP))) &&
+                (uint32_t)polled_fd == owner_fd) {
+                timeout_queue_expire(tq, conn);
+                continue;
+            }
+
+            if (conn->flags & CONN_SCHED_QUEUED)
+                continue;
+
+            if (work_stealing && n_resumed >= DONATE_AFTER_N_EVENTS &&
+                try_donate_conn(t, tq, conn, t->epoll_fd, &donate_to))
+                continue;
+
+            schedule_resume(t, tq, conn, switcher, t->epoll_fd);
+            n_resumed++;
         }
+
+        if (donate_to)
+            lwan_thread_nudge(donate_to);
+
+        if (t->sched_normal.count || t->sched_low.count)
+            resume_scheduled_conns(t, tq, switcher, t->epoll_fd);
     }
 
+    free(t->sched_normal.fds);
+    free(t->sched_low.fds);
+}
+#endif
+
+static void *thread_io_loop(void *data)
+{
+    struct lwan_thread *t = data;
+    struct lwan *lwan = t->lwan;
+    struct coro_switcher switcher;
+    struct timeout_queue tq;
+
+    lwan_status_debug("Worker thread #%zd starting",
+                      t - t->lwan->thread.threads + 1);
+    lwan_set_thread_name("worker");
+
+    lwan_current_thread_metrics = &t->metrics;
+    lwan_memory_thread_init(t->metrics.memory);
+    lwan_strbuf_thread_init();
+    lwan_pubsub_thread_init();
+
+    timeout_queue_init(&tq, lwan);
+    t->tq = &tq;
+    coro_pool_init(&t->coro_pool, lwan->config.coro_pool_size);
+    coro_thread_init();
+    lwan_request_thread_init();
+    lwan_timer_thread_init(t);
+
+    pthread_barrier_wait(&lwan->thread.barrier);
+
+    lwan_profiler_thread_init(t);
+
+#if defined(HAVE_IO_URING)
+    if (t->uring)
+        uring_io_loop(t, &tq, &switcher);
+    else
+#endif
+        epoll_io_loop(t, &tq, &switcher);
+
     pthread_barrier_wait(&lwan->thread.barrier);
 
+    /* Connections donated by other threads while this one was shutting down
+     * still have to be closed. */
+    if (lwan->config.work_stealing)
+        adopt_donated_conns(t, lwan->conns, &tq, &switcher, t->epoll_fd);
+
     timeout_queue_expire_all(&tq);
-    free(events);
+    lwan_timer_thread_shutdown();
+    coro_pool_shutdown(&t->coro_pool);
+    coro_thread_shutdown();
+    lwan_request_thread_shutdown();
+    lwan_cache_thread_shutdown();
+    lwan_compress_thread_shutdown();
+    lwan_websocket_thread_shutdown();
+    lwan_strbuf_thread_shutdown();
+    lwan_pubsub_thread_shutdown();
+    lwan_profiler_thread_shutdown(t);
+
+    if (lwan->config.busy_poll_us) {
+        lwan_status_info("Worker thread #%zd spent %" PRIu64 "ms busy polling, "
+                         "finding events in %" PRIu64 " of %" PRIu64 " spins",
+                         t - lwan->thread.threads + 1,
+                         t->busy_poll.spin_ns / 1000000, t->busy_poll.n_hits,
+                         t->busy_poll.n_spins);
+    }
 
     return NULL;
 }
@@ -516,14 +1835,55 @@ static void create_thread(struct lwan *l, struct lwan_thread *thread,
     int ignore;
     pthread_attr_t attr;
 
+    const struct lwan_thread_pool pool = thread->pool;
+
     memset(thread, 0, sizeof(*thread));
     thread->lwan = l;
+    thread->pool = pool;
+
+    thread->listen_fd = -1;
+    thread->reserve_fd = -1;
+    if (l->config.per_thread_listeners) {
+        thread->listen_fd = lwan_create_thread_listen_socket(
+            l, thread == l->thread.threads);
+        thread->reserve_fd = lwan_pressure_open_reserve_fd();
+    }
 
     thread->wheel = timeouts_open(&ignore);
     if (!thread->wheel)
         lwan_status_critical("Could not create timer wheel");
 
-    if ((thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    thread->epoll_fd = -1;
+
+    thread->access_log = lwan_access_log_ring_new();
+
+    if (pthread_mutex_init(&thread->donated.lock, NULL))
+        lwan_status_critical_perror("pthread_mutex_init");
+
+    if (pthread_mutex_init(&thread->wakeups.lock, NULL))
+        lwan_status_critical_perror("pthread_mutex_init");
+    list_head_init(&thread->wakeups.requests);
+
+#if defined(HAVE_IO_URING)
+    if (l->config.use_io_uring) {
+        thread->uring = malloc(sizeof(*thread->uring));
+        if (!thread->uring)
+            lwan_status_critical("Could not allocate memory for io_uring");
+
+        if (!lwan_uring_init(thread->uring,
+                             LWAN_MIN(l->thread.max_fd, 1024u))) {
+            lwan_status_warning("Could not initialize io_uring, "
+                                "falling back to epoll");
+            free(thread->uring);
+            thread->uring = NULL;
+        }
+    }
+#else
+    if (l->config.use_io_uring)
+        lwan_status_warning("io_uring support not built in, using epoll");
+#endif
+
+    if (!thread->uring && (thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
         lwan_status_critical_perror("epoll_create");
 
     if (pthread_attr_init(&attr))
@@ -535,7 +1895,21 @@ static void create_thread(struct lwan *l, struct lwan_thread *thread,
     if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE))
         lwan_status_critical_perror("pthread_attr_setdetachstate");
 
-#if defined(HAVE_EVENTFD)
+#if defined(NUDGE_WITH_KEVENT)
+    /* Nothing to read from; the other descriptor is a duplicate of the
+     * kqueue, so that the thread can still be nudged after epoll_fd has
+     * been closed by lwan_thread_shutdown(). */
+    struct kevent nudge;
+
+    thread->pipe_fd[0] = -1;
+    thread->pipe_fd[1] = fcntl(thread->epoll_fd, F_DUPFD_CLOEXEC, 0);
+    if (thread->pipe_fd[1] < 0)
+        lwan_status_critical_perror("fcntl");
+
+    EV_SET(&nudge, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    if (kevent(thread->epoll_fd, &nudge, 1, NULL, 0, NULL) < 0)
+        lwan_status_critical_perror("kevent");
+#elif defined(HAVE_EVENTFD)
     int efd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE | EFD_CLOEXEC);
     if (efd < 0)
         lwan_status_critical_perror("eventfd");
@@ -546,13 +1920,36 @@ static void create_thread(struct lwan *l, struct lwan_thread *thread,
         lwan_status_critical_perror("pipe");
 #endif
 
-    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
-    if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->pipe_fd[0], &event) < 0)
-        lwan_status_critical_perror("epoll_ctl");
+    if (!thread->uring) {
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+#if !defined(NUDGE_WITH_KEVENT)
+        if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->pipe_fd[0],
+                      &event) < 0)
+            lwan_status_critical_perror("epoll_ctl");
+#endif
+
+        if (thread->listen_fd >= 0) {
+            event.data.ptr = &l->conns[thread->listen_fd];
+            if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->listen_fd,
+                          &event) < 0)
+                lwan_status_critical_perror("epoll_ctl");
+        }
+    }
+
+    /* Block SIGINT (and the signals used to upgrade) in I/O threads so that
+     * they're always handled by the main thread (see lwan_main_loop()). */
+    sigset_t sigint_mask, old_mask;
+    sigemptyset(&sigint_mask);
+    sigaddset(&sigint_mask, SIGINT);
+    sigaddset(&sigint_mask, SIGHUP);
+    sigaddset(&sigint_mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &sigint_mask, &old_mask);
 
     if (pthread_create(&thread->self, &attr, thread_io_loop, thread))
         lwan_status_critical_perror("pthread_create");
 
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
     if (pthread_attr_destroy(&attr))
         lwan_status_critical_perror("pthread_attr_destroy");
 
@@ -564,14 +1961,58 @@ static void create_thread(struct lwan *l, struct lwan_thread *thread,
 
 void lwan_thread_nudge(struct lwan_thread *t)
 {
+#if defined(NUDGE_WITH_KEVENT)
+    struct kevent event;
+
+    EV_SET(&event, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    if (UNLIKELY(kevent(t->pipe_fd[1], &event, 1, NULL, 0, NULL) < 0))
+        lwan_status_perror("kevent");
+#else
     uint64_t event = 1;
 
     if (UNLIKELY(write(t->pipe_fd[1], &event, sizeof(event)) < 0))
         lwan_status_perror("write");
+#endif
+}
+
+void lwan_thread_wake(struct lwan_thread_wakeup *wakeup)
+{
+    struct lwan_thread *t = wakeup->request->conn->thread;
+    bool nudge = false;
+
+    pthread_mutex_lock(&t->wakeups.lock);
+    if (!wakeup->queued) {
+        /* Only the first wakeup queued since the thread last looked at
+         * the list has to nudge it; the others are resumed along. */
+        nudge = list_empty(&t->wakeups.requests);
+        list_add_tail(&t->wakeups.requests, &wakeup->node);
+        wakeup->queued = true;
+    }
+    pthread_mutex_unlock(&t->wakeups.lock);
+
+    if (nudge)
+        lwan_thread_nudge(t);
+}
+
+void lwan_thread_cancel_wake(struct lwan_thread_wakeup *wakeup)
+{
+    struct lwan_thread *t = wakeup->request->conn->thread;
+
+    pthread_mutex_lock(&t->wakeups.lock);
+    if (wakeup->queued) {
+        list_del_from(&t->wakeups.requests, &wakeup->node);
+        wakeup->queued = false;
+    }
+    pthread_mutex_unlock(&t->wakeups.lock);
 }
 
 void lwan_thread_add_client(struct lwan_thread *t, int fd)
 {
+    if (UNLIKELY(lwan_thread_is_overloaded(t))) {
+        lwan_thread_reject_client(t, fd);
+        return;
+    }
+
     for (int i = 0; i < 10; i++) {
         bool pushed = spsc_queue_push(&t->pending_fds, fd);
 
@@ -583,76 +2024,20 @@ void lwan_thread_add_client(struct lwan_thread *t, int fd)
     }
 
     lwan_status_error("Dropping connection %d", fd);
-    /* FIXME: send "busy" response now, even without receiving request? */
-    close(fd);
+    lwan_thread_reject_client(t, fd);
 }
 
-#if defined(__linux__) && defined(__x86_64__)
+#if defined(__linux__)
 static bool read_cpu_topology(struct lwan *l, uint32_t siblings[])
 {
-    char path[PATH_MAX];
-
-    for (uint32_t i = 0; i < l->available_cpus; i++)
-        siblings[i] = 0xbebacafe;
-
-    for (unsigned int i = 0; i < l->available_cpus; i++) {
-        FILE *sib;
-        uint32_t id, sibling;
-        char separator;
-
-        snprintf(path, sizeof(path),
-                 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
-                 i);
-
-        sib = fopen(path, "re");
-        if (!sib) {
-            lwan_status_warning("Could not open `%s` to determine CPU topology",
-                                path);
-            return false;
-        }
-
-        switch (fscanf(sib, "%u%c%u", &id, &separator, &sibling)) {
-        case 2: /* No SMT */
-            siblings[i] = id;
-            break;
-        case 3: /* SMT */
-            if (!(separator == ',' || separator == '-')) {
-                lwan_status_critical("Expecting either ',' or '-' for sibling separator");
-                __builtin_unreachable();
-            }
-
-            siblings[i] = sibling;
-            break;
-        default:
-            lwan_status_critical("%s has invalid format", path);
-            __builtin_unreachable();
-        }
-
-        fclose(sib);
-    }
-
-    /* Perform a sanity check here, as some systems seem to filter out the
-     * result of sysconf() to obtain the number of configured and online
-     * CPUs but don't bother changing what's available through sysfs as far
-     * as the CPU topology information goes.  It's better to fall back to a
-     * possibly non-optimal setup than just crash during startup while
-     * trying to perform an out-of-bounds array access.  */
-    for (unsigned int i = 0; i < l->available_cpus; i++) {
-        if (siblings[i] == 0xbebacafe) {
-            lwan_status_warning("Could not determine sibling for CPU %d", i);
-            return false;
-        }
-
-        if (siblings[i] >= l->available_cpus) {
-            lwan_status_warning("CPU information topology says CPU %d exists, "
-                                "but max available CPUs is %d (online CPUs: %d). "
-                                "Is Lwan running in a (broken) container?",
-                                siblings[i], l->available_cpus, l->online_cpus);
-            return false;
-        }
-    }
+    if (lwan_cpu_domains(LWAN_CPU_DOMAIN_CORE, l->available_cpus, siblings))
+        return true;
 
-    return true;
+    lwan_status_warning("Could not read the CPU topology from sysfs for %d "
+                        "CPUs (online CPUs: %d). Is Lwan running in a "
+                        "(broken) container?",
+                        l->available_cpus, l->online_cpus);
+    return false;
 }
 
 static void
@@ -673,12 +2058,40 @@ siblings_to_schedtbl(struct lwan *l, uint32_t siblings[], uint32_t schedtbl[])
         }
     }
 
-    if (n_schedtbl != l->available_cpus)
-        memcpy(schedtbl, seen, l->available_cpus * sizeof(int));
+    if (n_schedtbl != l->available_cpus) {
+        for (uint32_t i = 0; i < l->available_cpus; i++)
+            schedtbl[i] = i;
+    }
+}
+
+static void group_by_numa_node(struct lwan *l,
+                               uint32_t affinity[],
+                               const uint32_t cpu_node[])
+{
+    /* Stable insertion sort, so that siblings (which are in the same node)
+     * remain next to each other, and threads with adjacent indices end up
+     * in the same node. */
+    for (uint32_t i = 1; i < l->available_cpus; i++) {
+        uint32_t cpu = affinity[i];
+        uint32_t j = i;
+
+        for (; j > 0 && cpu_node[affinity[j - 1]] > cpu_node[cpu]; j--)
+            affinity[j] = affinity[j - 1];
+
+        affinity[j] = cpu;
+    }
 }
 
-static bool
-topology_to_schedtbl(struct lwan *l, uint32_t schedtbl[], uint32_t n_threads)
+/* Thread i runs on thread_cpu[i] (or in the domain of that CPU, depending
+ * on the affinity policy).  CPUs are ordered so that siblings are next to
+ * each other, and file descriptors are handed to threads in order, so
+ * that both connections sharing a cache line are handled by threads on
+ * the same physical core. */
+static bool topology_to_schedtbl(struct lwan *l,
+                                 uint32_t schedtbl[],
+                                 uint32_t n_threads,
+                                 uint32_t thread_cpu[],
+                                 const uint32_t *cpu_node)
 {
     uint32_t *siblings = alloca(l->available_cpus * sizeof(uint32_t));
 
@@ -686,9 +2099,13 @@ topology_to_schedtbl(struct lwan *l, uint32_t schedtbl[], uint32_t n_threads)
         uint32_t *affinity = alloca(l->available_cpus * sizeof(uint32_t));
 
         siblings_to_schedtbl(l, siblings, affinity);
+        if (cpu_node)
+            group_by_numa_node(l, affinity, cpu_node);
 
+        for (uint32_t i = 0; i < l->thread.count; i++)
+            thread_cpu[i] = affinity[i % l->available_cpus];
         for (uint32_t i = 0; i < n_threads; i++)
-            schedtbl[i] = affinity[i % l->available_cpus];
+            schedtbl[i] = i % l->thread.count;
         return true;
     }
 
@@ -697,31 +2114,258 @@ topology_to_schedtbl(struct lwan *l, uint32_t schedtbl[], uint32_t n_threads)
     return false;
 }
 
-static void
-adjust_threads_affinity(struct lwan *l, uint32_t *schedtbl, uint32_t mask)
+static void cpu_set_for_thread(const struct lwan *l,
+                               const uint32_t thread_cpu[],
+                               const uint32_t *cpu_domain,
+                               uint32_t thread,
+                               cpu_set_t *set)
 {
+    const uint32_t cpu = thread_cpu[thread];
+
+    CPU_ZERO(set);
+
+    if (!cpu_domain) {
+        CPU_SET(cpu, set);
+        return;
+    }
+
+    for (uint32_t i = 0; i < l->available_cpus; i++) {
+        if (cpu_domain[i] == cpu_domain[cpu])
+            CPU_SET(i, set);
+    }
+}
+
+static void adjust_threads_affinity(struct lwan *l,
+                                    const uint32_t thread_cpu[],
+                                    const uint32_t *cpu_domain,
+                                    cpu_set_t *workers)
+{
+    CPU_ZERO(workers);
+
     for (uint32_t i = 0; i < l->thread.count; i++) {
         cpu_set_t set;
 
-        CPU_ZERO(&set);
-        CPU_SET(schedtbl[i & mask], &set);
+        cpu_set_for_thread(l, thread_cpu, cpu_domain, i, &set);
+        CPU_OR(workers, workers, &set);
 
         if (pthread_setaffinity_np(l->thread.threads[i].self, sizeof(set),
                                    &set))
             lwan_status_warning("Could not set affinity for thread %d", i);
     }
 }
-#elif defined(__x86_64__)
-static bool
-topology_to_schedtbl(struct lwan *l, uint32_t schedtbl[], uint32_t n_threads)
+
+/* Keeps the low priority threads from competing with I/O threads for the
+ * CPUs they've been pinned to, if there are CPUs left over for them. */
+static void adjust_helper_threads_affinity(const struct lwan *l,
+                                           const cpu_set_t *workers)
+{
+    cpu_set_t helpers;
+
+    CPU_ZERO(&helpers);
+    for (uint32_t i = 0; i < l->available_cpus; i++) {
+        if (!CPU_ISSET(i, workers))
+            CPU_SET(i, &helpers);
+    }
+
+    if (!CPU_COUNT(&helpers))
+        return;
+
+    lwan_status_debug("Moving low priority threads to %d CPUs not used by "
+                      "I/O threads",
+                      CPU_COUNT(&helpers));
+    lwan_job_thread_set_affinity(&helpers);
+    lwan_readahead_set_affinity(&helpers);
+}
+
+static uint32_t nth_thread_in_group(const struct lwan *l,
+                                    const uint32_t thread_cpu[],
+                                    const uint32_t cpu_group[],
+                                    uint32_t cpu,
+                                    uint32_t *round_robin)
+{
+    uint32_t n_same_group = 0;
+
+    for (uint32_t i = 0; i < l->thread.count; i++) {
+        if (cpu_group[thread_cpu[i]] == cpu_group[cpu])
+            n_same_group++;
+    }
+    if (!n_same_group)
+        return UINT32_MAX;
+
+    uint32_t nth = (*round_robin)++ % n_same_group;
+    for (uint32_t i = 0; i < l->thread.count; i++) {
+        if (cpu_group[thread_cpu[i]] == cpu_group[cpu] && !nth--)
+            return i;
+    }
+
+    __builtin_unreachable();
+}
+
+static uint32_t thread_for_cpu(const struct lwan *l,
+                               const uint32_t thread_cpu[],
+                               const uint32_t *cpu_domain,
+                               const uint32_t *cpu_node,
+                               uint32_t cpu,
+                               uint32_t *round_robin)
+{
+    for (uint32_t i = 0; i < l->thread.count; i++) {
+        if (thread_cpu[i] == cpu)
+            return i;
+    }
+
+    /* No thread is running on this CPU: pick one that can run on it, or
+     * one running in the same NUMA node, so that the connection doesn't
+     * cross nodes. */
+    if (cpu_domain) {
+        uint32_t thread =
+            nth_thread_in_group(l, thread_cpu, cpu_domain, cpu, round_robin);
+        if (thread != UINT32_MAX)
+            return thread;
+    }
+
+    if (!cpu_node)
+        return UINT32_MAX;
+
+    return nth_thread_in_group(l, thread_cpu, cpu_node, cpu, round_robin);
+}
+
+static void steer_listeners_by_cpu(struct lwan *l,
+                                   const uint32_t thread_cpu[],
+                                   const uint32_t *cpu_domain,
+                                   const uint32_t *cpu_node)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+    /* Each thread is pinned to a CPU (or a group of them), so make the
+     * kernel hand connections to the listening socket owned by the thread
+     * running on the CPU handling the incoming packet.  The index of each
+     * socket in the reuseport group is the index of the thread owning it.
+     * Other CPUs are mapped to a thread in the same NUMA node, if known,
+     * or return an out-of-bounds index, making the kernel fall back to
+     * hashing.  */
+    const size_t max_insns = 2 * (size_t)l->available_cpus + 2;
+    struct sock_filter *code;
+    struct sock_filter *insn;
+    uint32_t round_robin = 0;
+
+    if (max_insns > BPF_MAXINSNS) {
+        lwan_status_warning("Too many CPUs to steer connections to listeners");
+        return;
+    }
+
+    code = alloca(max_insns * sizeof(*code));
+    insn = code;
+
+    *insn++ = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                           (uint32_t)(SKF_AD_OFF + SKF_AD_CPU));
+    for (uint32_t cpu = 0; cpu < l->available_cpus; cpu++) {
+        uint32_t thread = thread_for_cpu(l, thread_cpu, cpu_domain, cpu_node,
+                                         cpu, &round_robin);
+
+        if (thread == UINT32_MAX)
+            continue;
+
+        *insn++ = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpu,
+                                               0, 1);
+        *insn++ = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, thread);
+    }
+    *insn++ = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, UINT32_MAX);
+
+    struct sock_fprog prog = {.len = (unsigned short)(insn - code),
+                              .filter = code};
+    if (setsockopt(l->thread.threads[0].listen_fd, SOL_SOCKET,
+                   SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        lwan_status_perror("Could not attach CPU steering program to "
+                           "listening sockets");
+    }
+#endif
+}
+
+/* Returns the domain of each CPU for the affinity policy, NULL if threads
+ * are pinned to a single CPU.  Falls back to that if the domains can't be
+ * determined. */
+static uint32_t *cpu_domains_for_policy(struct lwan *l, uint32_t *cpu_node)
+{
+    uint32_t *cpu_domain;
+    enum lwan_cpu_domain domain;
+
+    switch (l->config.thread_affinity) {
+    case LWAN_AFFINITY_CORE:
+        domain = LWAN_CPU_DOMAIN_CORE;
+        break;
+    case LWAN_AFFINITY_CLUSTER:
+        domain = LWAN_CPU_DOMAIN_LLC;
+        break;
+    case LWAN_AFFINITY_NODE:
+        if (cpu_node)
+            return cpu_node;
+        lwan_status_warning("Could not read NUMA topology, pinning threads "
+                            "to a CPU each");
+        return NULL;
+    default:
+        return NULL;
+    }
+
+    cpu_domain = malloc(l->available_cpus * sizeof(uint32_t));
+    if (!cpu_domain)
+        return NULL;
+
+    unsigned int n_domains =
+        lwan_cpu_domains(domain, l->available_cpus, cpu_domain);
+    if (!n_domains) {
+        lwan_status_warning("Could not read CPU %s topology, pinning threads "
+                            "to a CPU each",
+                            domain == LWAN_CPU_DOMAIN_CORE ? "core" : "cache");
+        free(cpu_domain);
+        return NULL;
+    }
+
+    lwan_status_debug("Pinning threads to %u CPU %s", n_domains,
+                      domain == LWAN_CPU_DOMAIN_CORE ? "cores" : "clusters");
+    return cpu_domain;
+}
+
+static void pin_threads(struct lwan *l,
+                        const uint32_t thread_cpu[],
+                        uint32_t *cpu_node)
+{
+    uint32_t *cpu_domain;
+    cpu_set_t workers;
+
+    if (l->config.thread_affinity == LWAN_AFFINITY_NONE)
+        return;
+
+    if (l->available_cpus > CPU_SETSIZE) {
+        lwan_status_warning("Too many CPUs to pin threads to them");
+        return;
+    }
+
+    cpu_domain = cpu_domains_for_policy(l, cpu_node);
+
+    adjust_threads_affinity(l, thread_cpu, cpu_domain, &workers);
+    adjust_helper_threads_affinity(l, &workers);
+
+    if (l->config.per_thread_listeners)
+        steer_listeners_by_cpu(l, thread_cpu, cpu_domain, cpu_node);
+
+    if (cpu_domain != cpu_node)
+        free(cpu_domain);
+}
+#else
+static bool topology_to_schedtbl(struct lwan *l,
+                                 uint32_t schedtbl[],
+                                 uint32_t n_threads,
+                                 uint32_t thread_cpu[] __attribute__((unused)),
+                                 const uint32_t *cpu_node
+                                 __attribute__((unused)))
 {
     for (uint32_t i = 0; i < n_threads; i++)
         schedtbl[i] = (i / 2) % l->thread.count;
     return false;
 }
 
-static void
-adjust_threads_affinity(struct lwan *l, uint32_t *schedtbl, uint32_t n)
+static void pin_threads(struct lwan *l __attribute__((unused)),
+                        const uint32_t thread_cpu[] __attribute__((unused)),
+                        uint32_t *cpu_node __attribute__((unused)))
 {
 }
 #endif
@@ -734,10 +2378,19 @@ void lwan_thread_init(struct lwan *l)
 
     lwan_status_debug("Initializing threads");
 
-    l->thread.threads =
-        calloc((size_t)l->thread.count, sizeof(struct lwan_thread));
+    l->thread.threads = lwan_aligned_alloc(
+        (size_t)l->thread.count * sizeof(struct lwan_thread), 64);
     if (!l->thread.threads)
         lwan_status_critical("Could not allocate memory for threads");
+    memset(l->thread.threads, 0,
+           (size_t)l->thread.count * sizeof(struct lwan_thread));
+
+    for (unsigned int i = 0; i < l->n_listeners; i++) {
+        const struct lwan_thread_pool *pool = &l->listeners[i].pool;
+
+        for (unsigned int j = pool->first; j < pool->first + pool->count; j++)
+            l->thread.threads[j].pool = *pool;
+    }
 
     const size_t n_queue_fds = LWAN_MIN(l->thread.max_fd / l->thread.count,
                                         (size_t)(2 * lwan_socket_get_backlog_size()));
@@ -745,54 +2398,90 @@ void lwan_thread_init(struct lwan *l)
     for (unsigned int i = 0; i < l->thread.count; i++)
         create_thread(l, &l->thread.threads[i], n_queue_fds);
 
-    const unsigned int total_conns = l->thread.max_fd * l->thread.count;
-#ifdef __x86_64__
+    /* Threads are waiting on the barrier below, so this is fine */
+    lwan_watchdog_init(l);
+    lwan_profiler_init(l);
+
+#if defined(__x86_64__) || defined(__aarch64__)
     static_assert(sizeof(struct lwan_connection) == 32,
                   "Two connections per cache line");
+#endif
 
     lwan_status_debug("%d CPUs of %d are online. "
                       "Reading topology to pre-schedule clients",
                       l->online_cpus, l->available_cpus);
 
     /*
-     * Pre-schedule each file descriptor, to reduce some operations in the
-     * fast path.
+     * Build a table to schedule each file descriptor to a thread the first
+     * time it's accepted (see lwan_thread_for_fd()), rather than assigning
+     * all of them here, which would touch the whole connection table.
      *
-     * Since struct lwan_connection is guaranteed to be 32-byte long, two of
-     * them can fill up a cache line.  Assume siblings share cache lines and
-     * use the CPU topology to group two connections per cache line in such
-     * a way that false sharing is avoided.
+     * Since struct lwan_connection is 32-byte long on 64-bit targets, two
+     * of them can fill up a cache line.  Assume siblings share cache lines
+     * and use the CPU topology to group two connections per cache line in
+     * such a way that false sharing is avoided.
      */
     uint32_t n_threads = (uint32_t)lwan_nextpow2((size_t)((l->thread.count - 1) * 2));
-    uint32_t *schedtbl = alloca(n_threads * sizeof(uint32_t));
-
-    bool adj_affinity = topology_to_schedtbl(l, schedtbl, n_threads);
-
-    n_threads--; /* Transform count into mask for AND below */
+    uint32_t *schedtbl = calloc(n_threads, sizeof(uint32_t));
+    if (!schedtbl)
+        lwan_status_critical_perror("calloc");
+
+    uint32_t *cpu_node = NULL;
+    if (l->config.numa_aware ||
+        l->config.thread_affinity == LWAN_AFFINITY_NODE) {
+        cpu_node = alloca(l->available_cpus * sizeof(uint32_t));
+
+        unsigned int n_nodes = lwan_numa_cpu_nodes(l->available_cpus, cpu_node);
+        if (n_nodes > 1) {
+            lwan_status_debug("Grouping threads in %u NUMA nodes", n_nodes);
+        } else if (!n_nodes) {
+            lwan_status_warning("Could not read NUMA topology");
+            cpu_node = NULL;
+        } else if (l->config.thread_affinity != LWAN_AFFINITY_NODE) {
+            cpu_node = NULL; /* Nothing to group */
+        }
+    }
 
-    if (adj_affinity)
-        adjust_threads_affinity(l, schedtbl, n_threads);
+    uint32_t *thread_cpu = alloca(l->thread.count * sizeof(uint32_t));
+    if (topology_to_schedtbl(l, schedtbl, n_threads, thread_cpu, cpu_node))
+        pin_threads(l, thread_cpu, cpu_node);
 
-    for (unsigned int i = 0; i < total_conns; i++)
-        l->conns[i].thread = &l->thread.threads[schedtbl[i & n_threads]];
-#else
-    for (unsigned int i = 0; i < total_conns; i++)
-        l->conns[i].thread = &l->thread.threads[i % l->thread.count];
-#endif
+    l->thread.schedtbl = schedtbl;
+    l->thread.schedtbl_mask = n_threads - 1;
 
     pthread_barrier_wait(&l->thread.barrier);
 
     lwan_status_debug("Worker threads created and ready to serve");
 }
 
+struct lwan_thread *lwan_thread_for_fd(const struct lwan *l, int fd)
+{
+    return &l->thread.threads[l->thread.schedtbl[(uint32_t)fd &
+                                                 l->thread.schedtbl_mask]];
+}
+
 void lwan_thread_shutdown(struct lwan *l)
 {
     lwan_status_debug("Shutting down threads");
 
+    lwan_watchdog_shutdown(l);
+
     for (unsigned int i = 0; i < l->thread.count; i++) {
         struct lwan_thread *t = &l->thread.threads[i];
 
-        close(t->epoll_fd);
+        if (t->listen_fd >= 0)
+            close(t->listen_fd);
+        if (t->reserve_fd >= 0)
+            close(t->reserve_fd);
+
+#if defined(HAVE_IO_URING)
+        /* Like epoll below, closing the ring makes the next call to
+         * io_uring_enter() fail, exiting the loop after the nudge. */
+        if (t->uring)
+            close(t->uring->fd);
+        else
+#endif
+            close(t->epoll_fd);
         lwan_thread_nudge(t);
     }
 
@@ -802,15 +2491,32 @@ void lwan_thread_shutdown(struct lwan *l)
     for (unsigned int i = 0; i < l->thread.count; i++) {
         struct lwan_thread *t = &l->thread.threads[i];
 
+#if defined(NUDGE_WITH_KEVENT)
+        close(t->pipe_fd[1]);
+#else
         close(t->pipe_fd[0]);
 #if !defined(HAVE_EVENTFD)
         close(t->pipe_fd[1]);
+#endif
 #endif
 
         pthread_join(l->thread.threads[i].self, NULL);
         spsc_queue_free(&t->pending_fds);
         timeouts_close(t->wheel);
+        pthread_mutex_destroy(&t->donated.lock);
+        pthread_mutex_destroy(&t->wakeups.lock);
+
+#if defined(HAVE_IO_URING)
+        if (t->uring) {
+            t->uring->fd = -1; /* Already closed above */
+            lwan_uring_shutdown(t->uring);
+            free(t->uring);
+        }
+#endif
     }
 
+    lwan_profiler_shutdown(l);
+
     free(l->thread.threads);
+    free(l->thread.schedtbl);
 }
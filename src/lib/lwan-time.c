@@ -20,6 +20,9 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
 #include <time.h>
 
 #include "lwan-private.h"
@@ -157,3 +160,167 @@ int lwan_format_rfc_time(const time_t in, char out[static 30])
 
     return 0;
 }
+
+/* A single thread keeps the time: once a second, it formats the Date and
+ * Expires headers, and publishes them together with the current time
+ * (both wall clock and coarse monotonic) through a seqlock.  I/O threads
+ * only copy these values, so there's no need for each of them to keep
+ * its own cache or to call time functions while handling requests. */
+
+static struct {
+    unsigned int seq;
+    time_t realtime;
+    time_t monotonic;
+    char date[29];
+    char expires[29];
+} clock_state;
+
+static time_t clock_expires;
+static pthread_t clock_self;
+static bool clock_running;
+static pthread_mutex_t clock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t clock_cond = PTHREAD_COND_INITIALIZER;
+
+static void clock_publish(void)
+{
+    struct timespec monotonic;
+    char date[30], expires[30];
+    time_t now = time(NULL);
+    unsigned int seq = clock_state.seq;
+
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &monotonic) < 0))
+        lwan_status_critical("Could not get monotonic time");
+
+    lwan_format_rfc_time(now, date);
+    lwan_format_rfc_time(now + clock_expires, expires);
+
+    /* Only this thread writes, so an odd sequence number means that an
+     * update is in progress. */
+    __atomic_store_n(&clock_state.seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(clock_state.date, date, sizeof(clock_state.date));
+    memcpy(clock_state.expires, expires, sizeof(clock_state.expires));
+    __atomic_store_n(&clock_state.realtime, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&clock_state.monotonic, monotonic.tv_sec,
+                     __ATOMIC_RELAXED);
+
+    __atomic_store_n(&clock_state.seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void *clock_thread(void *data __attribute__((unused)))
+{
+    lwan_set_thread_name("clock");
+
+    if (pthread_mutex_lock(&clock_mutex))
+        lwan_status_critical("Could not lock clock mutex");
+
+    while (clock_running) {
+        struct timespec next;
+
+        clock_publish();
+
+        /* Wake up right as the second changes, so Date headers aren't
+         * late by up to a second. */
+        if (UNLIKELY(clock_gettime(CLOCK_REALTIME, &next) < 0))
+            lwan_status_critical("Could not get current time");
+        next.tv_sec++;
+        next.tv_nsec = 0;
+
+        pthread_cond_timedwait(&clock_cond, &clock_mutex, &next);
+    }
+
+    if (pthread_mutex_unlock(&clock_mutex))
+        lwan_status_critical("Could not unlock clock mutex");
+
+    return NULL;
+}
+
+void lwan_clock_init(const struct lwan *l)
+{
+    assert(!clock_running);
+
+    lwan_status_debug("Initializing clock thread");
+
+    clock_expires = (time_t)l->config.expires;
+    clock_publish();
+
+    clock_running = true;
+    if (pthread_create(&clock_self, NULL, clock_thread, NULL))
+        lwan_status_critical_perror("pthread_create");
+}
+
+void lwan_clock_shutdown(void)
+{
+    int r;
+
+    if (!clock_running)
+        return;
+
+    lwan_status_debug("Shutting down clock thread");
+
+    if (pthread_mutex_lock(&clock_mutex))
+        lwan_status_critical("Could not lock clock mutex");
+    clock_running = false;
+    pthread_cond_signal(&clock_cond);
+    pthread_mutex_unlock(&clock_mutex);
+
+    r = pthread_join(clock_self, NULL);
+    if (r) {
+        errno = r;
+        lwan_status_perror("pthread_join");
+    }
+}
+
+void lwan_clock_get_dates(char date[static 29], char expires[static 29])
+{
+    while (true) {
+        unsigned int seq = __atomic_load_n(&clock_state.seq, __ATOMIC_ACQUIRE);
+
+        if (UNLIKELY(!seq)) {
+            /* Clock thread isn't running (e.g. in fuzzers); this is rare
+             * enough that formatting these strings every time is fine. */
+            char buffer[30];
+            time_t now = time(NULL);
+
+            lwan_format_rfc_time(now, buffer);
+            memcpy(date, buffer, 29);
+            lwan_format_rfc_time(now + clock_expires, buffer);
+            memcpy(expires, buffer, 29);
+            return;
+        }
+
+        if (LIKELY(!(seq & 1))) {
+            memcpy(date, clock_state.date, sizeof(clock_state.date));
+            memcpy(expires, clock_state.expires, sizeof(clock_state.expires));
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (LIKELY(__atomic_load_n(&clock_state.seq, __ATOMIC_RELAXED) ==
+                       seq))
+                return;
+        }
+    }
+}
+
+time_t lwan_clock_realtime(void)
+{
+    time_t now = __atomic_load_n(&clock_state.realtime, __ATOMIC_RELAXED);
+
+    return LIKELY(now) ? now : time(NULL);
+}
+
+time_t lwan_clock_monotonic(void)
+{
+    time_t now = __atomic_load_n(&clock_state.monotonic, __ATOMIC_RELAXED);
+
+    if (UNLIKELY(!now)) {
+        struct timespec ts;
+
+        if (UNLIKELY(clock_gettime(monotonic_clock_id, &ts) < 0))
+            lwan_status_critical("Could not get monotonic time");
+
+        return ts.tv_sec;
+    }
+
+    return now;
+}
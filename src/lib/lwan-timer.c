@@ -0,0 +1,221 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "lwan-private.h"
+#include "list.h"
+
+/* Timers live in the timer wheel of an I/O thread, alongside sleeping
+ * requests and the keep-alive queue, and their callbacks are called by
+ * the event loop of that thread, outside of any coroutine.  They're meant
+ * for cheap work, such as housekeeping of per-thread state, that would
+ * otherwise need a thread of its own or a request looping with
+ * lwan_request_sleep().
+ *
+ * Timers are owned by the thread that added them, and can only be
+ * cancelled by it.  Timers to be added to every I/O thread are kept in
+ * a global list; threads that are already running are nudged to pick up
+ * new ones. */
+
+struct lwan_timer {
+    struct timeout timeout;
+    struct list_node timers;
+    lwan_timer_func func;
+    void *data;
+    unsigned int interval_ms;
+    bool running;
+    bool cancelled;
+};
+
+struct per_thread_timer {
+    lwan_timer_func func;
+    void *data;
+    unsigned int interval_ms;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct per_thread_timer *timers;
+    unsigned int count;
+} per_thread = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static __thread struct {
+    struct lwan_thread *thread;
+    struct list_head timers;
+    unsigned int n_per_thread;
+} current;
+
+static struct lwan_timer *timer_add(unsigned int timeout_ms,
+                                    unsigned int interval_ms,
+                                    lwan_timer_func func,
+                                    void *data)
+{
+    struct lwan_timer *timer;
+
+    timer = malloc(sizeof(*timer));
+    if (UNLIKELY(!timer))
+        return NULL;
+
+    *timer = (struct lwan_timer){
+        .timeout.flags = LWAN_TIMEOUT_TIMER,
+        .func = func,
+        .data = data,
+        .interval_ms = interval_ms,
+    };
+    list_add_tail(&current.timers, &timer->timers);
+    timeouts_add(current.thread->wheel, &timer->timeout, timeout_ms);
+
+    return timer;
+}
+
+struct lwan_timer *lwan_timer_add(unsigned int timeout_ms,
+                                  unsigned int interval_ms,
+                                  lwan_timer_func func,
+                                  void *data)
+{
+    if (UNLIKELY(!current.thread)) {
+        errno = EPERM;
+        return NULL;
+    }
+
+    return timer_add(timeout_ms, interval_ms, func, data);
+}
+
+static void timer_free(struct lwan_timer *timer)
+{
+    timeouts_del(current.thread->wheel, &timer->timeout);
+    list_del_from(&current.timers, &timer->timers);
+    free(timer);
+}
+
+void lwan_timer_cancel(struct lwan_timer *timer)
+{
+    if (!timer)
+        return;
+
+    /* Freed once the callback returns. */
+    if (timer->running) {
+        timer->cancelled = true;
+        return;
+    }
+
+    timer_free(timer);
+}
+
+void lwan_timer_expired(struct timeout *timeout)
+{
+    struct lwan_timer *timer =
+        container_of(timeout, struct lwan_timer, timeout);
+
+    timer->running = true;
+    timer->func(timer, timer->data);
+    timer->running = false;
+
+    if (timer->cancelled || !timer->interval_ms) {
+        timer_free(timer);
+        return;
+    }
+
+    timeouts_add(current.thread->wheel, &timer->timeout, timer->interval_ms);
+}
+
+int lwan_timer_add_per_thread(struct lwan *l,
+                              unsigned int interval_ms,
+                              lwan_timer_func func,
+                              void *data)
+{
+    struct per_thread_timer *timers;
+
+    if (!interval_ms)
+        return -EINVAL;
+
+    pthread_mutex_lock(&per_thread.lock);
+
+    timers = reallocarray(per_thread.timers, per_thread.count + 1,
+                          sizeof(*timers));
+    if (UNLIKELY(!timers)) {
+        pthread_mutex_unlock(&per_thread.lock);
+        return -ENOMEM;
+    }
+
+    timers[per_thread.count] = (struct per_thread_timer){
+        .func = func,
+        .data = data,
+        .interval_ms = interval_ms,
+    };
+    per_thread.timers = timers;
+    ATOMIC_INC(per_thread.count);
+
+    pthread_mutex_unlock(&per_thread.lock);
+
+    /* Threads that haven't started yet pick it up in
+     * lwan_timer_thread_init(); nudging them is harmless. */
+    for (unsigned int i = 0; i < l->thread.count; i++)
+        lwan_thread_nudge(&l->thread.threads[i]);
+
+    return 0;
+}
+
+void lwan_timer_thread_update(void)
+{
+    if (LIKELY(ATOMIC_READ(per_thread.count) == current.n_per_thread))
+        return;
+
+    pthread_mutex_lock(&per_thread.lock);
+    for (; current.n_per_thread < per_thread.count; current.n_per_thread++) {
+        const struct per_thread_timer *ptt =
+            &per_thread.timers[current.n_per_thread];
+
+        if (!timer_add(ptt->interval_ms, ptt->interval_ms, ptt->func,
+                       ptt->data)) {
+            lwan_status_error("Could not add timer to I/O thread");
+        }
+    }
+    pthread_mutex_unlock(&per_thread.lock);
+}
+
+void lwan_timer_thread_init(struct lwan_thread *t)
+{
+    current.thread = t;
+    current.n_per_thread = 0;
+    list_head_init(&current.timers);
+
+    lwan_timer_thread_update();
+}
+
+void lwan_timer_thread_shutdown(void)
+{
+    struct lwan_timer *timer, *next;
+
+    list_for_each_safe (&current.timers, timer, next, timers)
+        timer_free(timer);
+
+    current.thread = NULL;
+}
+
+void lwan_timer_shutdown(void)
+{
+    free(per_thread.timers);
+    per_thread.timers = NULL;
+    per_thread.count = 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+
+#include "lwan-private.h"
+
+#if defined(HAVE_KTLS)
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+/* Only the handshake is performed in userspace.  Once it's done, OpenSSL
+ * installs the session keys in the socket (TLS_TX and TLS_RX), and the
+ * SSL object is thrown away: from then on, the kernel encrypts whatever is
+ * written to the socket, including with sendfile(), and decrypts whatever
+ * is read from it.  Connections where this isn't possible (e.g. the tls
+ * kernel module isn't available, or the negotiated cipher isn't supported
+ * by the kernel) are dropped. */
+
+struct lwan_tls_context {
+    SSL_CTX *ctx;
+    const struct lwan *lwan;
+};
+
+static void log_openssl_errors(const char *what)
+{
+    unsigned long error;
+
+    while ((error = ERR_get_error())) {
+        char buffer[256];
+
+        ERR_error_string_n(error, buffer, sizeof(buffer));
+        lwan_status_error("%s: %s", what, buffer);
+    }
+}
+
+static int select_alpn(SSL *ssl __attribute__((unused)),
+                       const unsigned char **out,
+                       unsigned char *out_len,
+                       const unsigned char *in,
+                       unsigned int in_len,
+                       void *data)
+{
+    static const unsigned char with_h2[] = "\x02h2\x08http/1.1";
+    static const unsigned char without_h2[] = "\x08http/1.1";
+    const struct lwan_tls_context *tls = data;
+    const unsigned char *protos;
+    unsigned int protos_len;
+    unsigned char *selected;
+
+    /* Connections negotiating h2 are handled like prior-knowledge h2c
+     * ones: by the time the first request is read, the client preface is
+     * there. */
+    if (tls->lwan->config.http2) {
+        protos = with_h2;
+        protos_len = sizeof(with_h2) - 1;
+    } else {
+        protos = without_h2;
+        protos_len = sizeof(without_h2) - 1;
+    }
+
+    if (SSL_select_next_proto(&selected, out_len, protos, protos_len, in,
+                              in_len) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+struct lwan_tls_context *lwan_tls_context_new(const struct lwan *l,
+                                              const char *certificate,
+                                              const char *private_key)
+{
+    struct lwan_tls_context *tls = malloc(sizeof(*tls));
+
+    if (!tls)
+        return NULL;
+
+    tls->lwan = l;
+    tls->ctx = SSL_CTX_new(TLS_server_method());
+    if (!tls->ctx)
+        goto error;
+
+    SSL_CTX_set_options(tls->ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_COMPRESSION |
+                                      SSL_OP_NO_RENEGOTIATION);
+    SSL_CTX_set_min_proto_version(tls->ctx, TLS1_2_VERSION);
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+    /* Older OpenSSL versions can't set up kTLS receive offload for TLS 1.3
+     * connections, which couldn't be handed over to the kernel then. */
+    SSL_CTX_set_max_proto_version(tls->ctx, TLS1_2_VERSION);
+#endif
+
+    /* AEAD ciphers the kernel implements. */
+    if (!SSL_CTX_set_cipher_list(tls->ctx,
+                                 "ECDHE+AESGCM:ECDHE+CHACHA20:DHE+AESGCM"))
+        goto error;
+    if (!SSL_CTX_set_ciphersuites(tls->ctx,
+                                  "TLS_AES_128_GCM_SHA256:"
+                                  "TLS_AES_256_GCM_SHA384:"
+                                  "TLS_CHACHA20_POLY1305_SHA256"))
+        goto error;
+
+    SSL_CTX_set_alpn_select_cb(tls->ctx, select_alpn, tls);
+
+    if (SSL_CTX_use_certificate_chain_file(tls->ctx, certificate) != 1)
+        goto error;
+    if (SSL_CTX_use_PrivateKey_file(tls->ctx, private_key, SSL_FILETYPE_PEM) !=
+        1)
+        goto error;
+    if (SSL_CTX_check_private_key(tls->ctx) != 1)
+        goto error;
+
+    return tls;
+
+error:
+    log_openssl_errors("Could not initialize TLS context");
+    SSL_CTX_free(tls->ctx);
+    free(tls);
+    return NULL;
+}
+
+void lwan_tls_context_free(struct lwan_tls_context *tls)
+{
+    if (tls) {
+        SSL_CTX_free(tls->ctx);
+        free(tls);
+    }
+}
+
+static void ssl_free_defer(void *data)
+{
+    SSL_free(data);
+}
+
+bool lwan_tls_handshake(struct lwan_tls_context *tls,
+                        struct lwan_connection *conn,
+                        int fd)
+{
+    struct coro *coro = conn->coro;
+    const size_t generation = coro_deferred_get_generation(coro);
+    bool offloaded = false;
+    SSL *ssl;
+
+    ssl = SSL_new(tls->ctx);
+    if (UNLIKELY(!ssl))
+        return false;
+
+    /* In case the connection is dropped during the handshake */
+    coro_defer(coro, ssl_free_defer, ssl);
+
+    if (UNLIKELY(!SSL_set_fd(ssl, fd)))
+        goto out;
+
+    while (true) {
+        int r = SSL_accept(ssl);
+
+        if (LIKELY(r == 1))
+            break;
+
+        switch (SSL_get_error(ssl, r)) {
+        case SSL_ERROR_WANT_READ:
+            lwan_connection_clear_ready(conn, CONN_READY_READ);
+            coro_yield(coro, CONN_CORO_WANT_READ);
+            continue;
+        case SSL_ERROR_WANT_WRITE:
+            lwan_connection_clear_ready(conn, CONN_READY_WRITE);
+            coro_yield(coro, CONN_CORO_WANT_WRITE);
+            continue;
+        default:
+            /* Usually a client going away, or not speaking TLS at all. */
+            ERR_clear_error();
+            goto out;
+        }
+    }
+
+    offloaded = BIO_get_ktls_send(SSL_get_wbio(ssl)) &&
+                BIO_get_ktls_recv(SSL_get_rbio(ssl));
+    if (UNLIKELY(!offloaded)) {
+        lwan_status_debug("Could not set up kernel TLS, dropping connection");
+    }
+
+out:
+    /* The socket BIO won't close the file descriptor. */
+    coro_deferred_run(coro, generation);
+    return offloaded;
+}
+
+#endif
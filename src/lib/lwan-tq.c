@@ -23,29 +23,45 @@
 #include "lwan-private.h"
 #include "lwan-tq.h"
 
+/* The list heads aren't in the connection table, so they get negative
+ * indices: -1 for the keep-alive list, -2 for the write list. */
 static inline int timeout_queue_node_to_idx(struct timeout_queue *tq,
                                             struct lwan_connection *conn)
 {
-    return (conn == &tq->head) ? -1 : (int)(intptr_t)(conn - tq->conns);
+    if (conn == &tq->head)
+        return -1;
+    if (conn == &tq->write_head)
+        return -2;
+    return (int)(intptr_t)(conn - tq->conns);
 }
 
 static inline struct lwan_connection *
 timeout_queue_idx_to_node(struct timeout_queue *tq, int idx)
 {
-    return (idx < 0) ? &tq->head : &tq->conns[idx];
+    if (LIKELY(idx >= 0))
+        return &tq->conns[idx];
+    return (idx == -1) ? &tq->head : &tq->write_head;
+}
+
+static inline void timeout_queue_insert_into(struct timeout_queue *tq,
+                                             struct lwan_connection *list,
+                                             struct lwan_connection *new_node)
+{
+    new_node->next = timeout_queue_node_to_idx(tq, list);
+    new_node->prev = list->prev;
+    struct lwan_connection *prev = timeout_queue_idx_to_node(tq, list->prev);
+    list->prev = prev->next = timeout_queue_node_to_idx(tq, new_node);
+    tq->n_conns++;
 }
 
 inline void timeout_queue_insert(struct timeout_queue *tq,
                                  struct lwan_connection *new_node)
 {
-    new_node->next = -1;
-    new_node->prev = tq->head.prev;
-    struct lwan_connection *prev = timeout_queue_idx_to_node(tq, tq->head.prev);
-    tq->head.prev = prev->next = timeout_queue_node_to_idx(tq, new_node);
+    timeout_queue_insert_into(tq, &tq->head, new_node);
 }
 
-static inline void timeout_queue_remove(struct timeout_queue *tq,
-                                        struct lwan_connection *node)
+void timeout_queue_remove(struct timeout_queue *tq,
+                          struct lwan_connection *node)
 {
     struct lwan_connection *prev = timeout_queue_idx_to_node(tq, node->prev);
     struct lwan_connection *next = timeout_queue_idx_to_node(tq, node->next);
@@ -54,20 +70,57 @@ static inline void timeout_queue_remove(struct timeout_queue *tq,
     prev->next = node->next;
 
     node->next = node->prev = -1;
+    tq->n_conns--;
+}
+
+static inline bool timeout_queue_list_empty(const struct lwan_connection *list)
+{
+    return list->next < 0;
 }
 
-bool timeout_queue_empty(struct timeout_queue *tq) { return tq->head.next < 0; }
+bool timeout_queue_empty(struct timeout_queue *tq)
+{
+    return timeout_queue_list_empty(&tq->head) &&
+           timeout_queue_list_empty(&tq->write_head);
+}
 
 void timeout_queue_move_to_last(struct timeout_queue *tq,
                                 struct lwan_connection *conn)
 {
+    /* Connections waiting to write are only kept in their own list if
+     * they expire at a different pace than the others. */
+    struct lwan_connection *list =
+        UNLIKELY((conn->flags & CONN_WRITE_BLOCKED) &&
+                 tq->write_bump != tq->move_to_last_bump)
+            ? &tq->write_head
+            : &tq->head;
+    const unsigned int time_to_expire =
+        tq->current_time +
+        (list == &tq->head ? tq->move_to_last_bump : tq->write_bump);
+
     /* CONN_IS_KEEP_ALIVE isn't checked here because non-keep-alive connections
      * are closed in the request processing coroutine after they have been
-     * served.  In practice, if this is called, it's a keep-alive connection. */
-    conn->time_to_expire = tq->current_time + tq->move_to_last_bump;
+     * served.  That might have just happened, though, in which case the
+     * connection isn't in the queue anymore; unlinking it again would
+     * unlink every other connection as well. */
+    if (UNLIKELY(!conn->coro && !(conn->flags & CONN_PARKED)))
+        return;
+
+    conn->flags &= ~CONN_WEBSOCKET_PINGED;
+
+    /* Connections are kept sorted by expiration time, which only changes
+     * once per tick, so a connection that was already moved to the end
+     * during this tick is still in the right place.  This avoids touching
+     * its neighbors (each one in a different cache line of the connection
+     * table) after every request of a busy keep-alive connection.  (If
+     * it's in the other list, it's still where it belongs in there.) */
+    if (conn->time_to_expire == time_to_expire)
+        return;
+
+    conn->time_to_expire = time_to_expire;
 
     timeout_queue_remove(tq, conn);
-    timeout_queue_insert(tq, conn);
+    timeout_queue_insert_into(tq, list, conn);
 }
 
 void timeout_queue_init(struct timeout_queue *tq, const struct lwan *lwan)
@@ -77,9 +130,15 @@ void timeout_queue_init(struct timeout_queue *tq, const struct lwan *lwan)
         .conns = lwan->conns,
         .current_time = 0,
         .move_to_last_bump = lwan->config.keep_alive_timeout,
+        .write_bump = lwan->config.send_timeout
+                          ? lwan->config.send_timeout
+                          : lwan->config.keep_alive_timeout,
+        .n_conns = 0,
         .head.next = -1,
         .head.prev = -1,
-        .timeout = (struct timeout){},
+        .write_head.next = -2,
+        .write_head.prev = -2,
+        .timeout = (struct timeout){.flags = TIMEOUT_ABS},
     };
 }
 
@@ -88,37 +147,122 @@ void timeout_queue_expire(struct timeout_queue *tq,
 {
     timeout_queue_remove(tq, conn);
 
-    if (LIKELY(conn->coro)) {
-        coro_free(conn->coro);
-        conn->coro = NULL;
+    if (LIKELY(conn->coro || (conn->flags & CONN_PARKED))) {
+        if (conn->coro) {
+            coro_pool_put(&conn->thread->coro_pool, conn->coro);
+            conn->coro = NULL;
+        }
+        conn->flags &= ~CONN_PARKED;
+
+        ATOMIC_DEC(conn->thread->n_connections);
+
+#if defined(HAVE_IO_URING)
+        if (conn->flags & CONN_POLL_ARMED)
+            lwan_thread_uring_cancel_poll(conn);
+#endif
 
         close(lwan_connection_get_fd(tq->lwan, conn));
     }
 }
 
-void timeout_queue_expire_waiting(struct timeout_queue *tq)
+/* Idle websocket connections are pinged instead of being closed the first
+ * time they expire, and get another keep_alive_timeout to show any sign of
+ * life (a pong, most likely), without their coroutines ever being resumed.
+ * Connections in the middle of writing something can't have a ping
+ * interleaved with it, and expire as usual. */
+static bool timeout_queue_ping(struct timeout_queue *tq,
+                               struct lwan_connection *conn)
+{
+    if ((conn->flags & (CONN_IS_WEBSOCKET | CONN_WEBSOCKET_PINGED |
+                        CONN_EVENTS_WRITE | CONN_WRITE_BLOCKED |
+                        CONN_IS_HTTP2_STREAM)) != CONN_IS_WEBSOCKET)
+        return false;
+
+    if (!lwan_websocket_send_ping(lwan_connection_get_fd(tq->lwan, conn)))
+        return false;
+
+    conn->flags |= CONN_WEBSOCKET_PINGED;
+    conn->time_to_expire = tq->current_time + tq->move_to_last_bump;
+    timeout_queue_remove(tq, conn);
+    timeout_queue_insert_into(tq, &tq->head, conn);
+
+    return true;
+}
+
+static void timeout_queue_expire_list(struct timeout_queue *tq,
+                                      struct lwan_connection *list)
 {
-    tq->current_time++;
+    const bool ping = tq->lwan->config.websocket_ping;
 
-    while (!timeout_queue_empty(tq)) {
+    /* Everything that expires in the current second is expired at once, as
+     * each list is sorted by expiration time. */
+    while (!timeout_queue_list_empty(list)) {
         struct lwan_connection *conn =
-            timeout_queue_idx_to_node(tq, tq->head.next);
+            timeout_queue_idx_to_node(tq, list->next);
 
         if (conn->time_to_expire > tq->current_time)
             return;
 
+        if (ping && timeout_queue_ping(tq, conn))
+            continue;
+
         timeout_queue_expire(tq, conn);
     }
+}
 
-    /* Timeout queue exhausted: reset epoch */
-    tq->current_time = 0;
+void timeout_queue_expire_waiting(struct timeout_queue *tq)
+{
+    timeout_queue_expire_list(tq, &tq->head);
+    timeout_queue_expire_list(tq, &tq->write_head);
 }
 
 void timeout_queue_expire_all(struct timeout_queue *tq)
 {
-    while (!timeout_queue_empty(tq)) {
-        struct lwan_connection *conn =
-            timeout_queue_idx_to_node(tq, tq->head.next);
-        timeout_queue_expire(tq, conn);
+    struct lwan_connection *lists[] = {&tq->head, &tq->write_head};
+
+    for (size_t i = 0; i < N_ELEMENTS(lists); i++) {
+        while (!timeout_queue_list_empty(lists[i])) {
+            struct lwan_connection *conn =
+                timeout_queue_idx_to_node(tq, lists[i]->next);
+            timeout_queue_expire(tq, conn);
+        }
     }
 }
+
+void timeout_queue_expire_idle(struct timeout_queue *tq)
+{
+    int idx = tq->head.next;
+
+    /* Idle connections are waiting for a request that hasn't arrived yet,
+     * so they can be closed without interrupting anything. */
+    while (idx >= 0) {
+        struct lwan_connection *conn = timeout_queue_idx_to_node(tq, idx);
+
+        idx = conn->next;
+
+        if (conn->flags & (CONN_BETWEEN_REQUESTS | CONN_PARKED))
+            timeout_queue_expire(tq, conn);
+    }
+}
+
+unsigned int timeout_queue_expire_oldest_idle(struct timeout_queue *tq,
+                                              unsigned int max)
+{
+    unsigned int expired = 0;
+    int idx = tq->head.next;
+
+    /* The keep-alive list is sorted by expiration time, so the connections
+     * that have been idle the longest come first. */
+    while (idx >= 0 && expired < max) {
+        struct lwan_connection *conn = timeout_queue_idx_to_node(tq, idx);
+
+        idx = conn->next;
+
+        if (conn->flags & (CONN_BETWEEN_REQUESTS | CONN_PARKED)) {
+            timeout_queue_expire(tq, conn);
+            expired++;
+        }
+    }
+
+    return expired;
+}
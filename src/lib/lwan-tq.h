@@ -24,20 +24,35 @@ struct timeout_queue {
     const struct lwan *lwan;
     struct lwan_connection *conns;
     struct lwan_connection head;
+    /* Connections waiting to write a response, if send_timeout differs
+     * from keep_alive_timeout.  Expiration times only grow along each
+     * list, as the bump is the same for all connections in it. */
+    struct lwan_connection write_head;
+    /* Ticks when the clock of the thread's timer wheel crosses into a new
+     * second; see lwan-thread.c */
     struct timeout timeout;
+    /* Seconds, from the clock of the thread's timer wheel */
     unsigned int current_time;
     unsigned int move_to_last_bump;
+    unsigned int write_bump;
+    /* Read by other threads for the status module */
+    unsigned int n_conns;
 };
 
 void timeout_queue_init(struct timeout_queue *tq, const struct lwan *l);
 
 void timeout_queue_insert(struct timeout_queue *tq,
                           struct lwan_connection *new_node);
+void timeout_queue_remove(struct timeout_queue *tq,
+                          struct lwan_connection *node);
 void timeout_queue_expire(struct timeout_queue *tq, struct lwan_connection *node);
 void timeout_queue_move_to_last(struct timeout_queue *tq,
                                 struct lwan_connection *conn);
 
 void timeout_queue_expire_waiting(struct timeout_queue *tq);
 void timeout_queue_expire_all(struct timeout_queue *tq);
+void timeout_queue_expire_idle(struct timeout_queue *tq);
+unsigned int timeout_queue_expire_oldest_idle(struct timeout_queue *tq,
+                                              unsigned int max);
 
 bool timeout_queue_empty(struct timeout_queue *tq);
@@ -21,169 +21,267 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "lwan-private.h"
 
 struct lwan_trie_node {
-    struct lwan_trie_node *next[8];
-    struct lwan_trie_leaf *leaf;
-    int ref_count;
+    /* Label of the edge leading to this node, as an offset into
+     * trie->labels.  Its first character is also in trie->child_chars,
+     * at the same index as the node. */
+    uint32_t label;
+    uint32_t label_len;
+
+    /* Children are stored contiguously, starting at this index */
+    uint32_t children;
+    uint32_t n_children;
+
+    /* Non-NULL if a key ends at this node */
+    void *data;
 };
 
 struct lwan_trie_leaf {
     char *key;
     void *data;
-    struct lwan_trie_leaf *next;
+};
+
+/* Pending work while building the tree: the node at the same index will
+ * hold the leaves in [lo, hi), whose keys share their first depth chars. */
+struct build_range {
+    size_t lo, hi;
+    size_t depth;
 };
 
 bool lwan_trie_init(struct lwan_trie *trie, void (*free_node)(void *data))
 {
     if (!trie)
         return false;
-    trie->root = NULL;
-    trie->free_node = free_node;
+
+    *trie = (struct lwan_trie){.free_node = free_node};
     return true;
 }
 
-static ALWAYS_INLINE struct lwan_trie_leaf *
-find_leaf_with_key(struct lwan_trie_node *node, const char *key, size_t len)
+static size_t common_prefix_len(const char *a, const char *b)
 {
-    struct lwan_trie_leaf *leaf = node->leaf;
+    size_t len = 0;
 
-    if (!leaf)
-        return NULL;
+    while (a[len] && a[len] == b[len])
+        len++;
 
-    if (!leaf->next) /* No collisions -- no need to strncmp() */
-        return leaf;
+    return len;
+}
 
-    for (; leaf; leaf = leaf->next) {
-        if (!strncmp(leaf->key, key, len - 1))
-            return leaf;
+static bool rebuild(struct lwan_trie *trie)
+{
+    const struct lwan_trie_leaf *leaves = trie->leaves;
+    /* Every node, except for the root, either has a key ending on it, or
+     * has at least two children, so this is an upper bound. */
+    const size_t max_nodes = 2 * trie->n_leaves + 1;
+    struct build_range *ranges;
+    struct lwan_trie_node *nodes;
+    unsigned char *child_chars;
+    size_t labels_len = 0;
+    size_t n_nodes = 1;
+    char *labels;
+    char *block;
+
+    for (size_t i = 0; i < trie->n_leaves; i++)
+        labels_len += strlen(leaves[i].key);
+
+    /* Children are looked up 16 characters at a time, so pad the array of
+     * child characters to avoid reading past the allocation. */
+    block = lwan_aligned_alloc(
+        max_nodes * sizeof(*nodes) + max_nodes + 16 + labels_len, 64);
+    if (!block)
+        return false;
+
+    ranges = calloc(max_nodes, sizeof(*ranges));
+    if (!ranges) {
+        free(block);
+        return false;
     }
 
-    return NULL;
+    nodes = (struct lwan_trie_node *)block;
+    child_chars = (unsigned char *)(nodes + max_nodes);
+    labels = (char *)(child_chars + max_nodes + 16);
+    memset(child_chars, 0, max_nodes + 16);
+    labels_len = 0;
+
+    /* Nodes are built in breadth-first order, so that the children of any
+     * node are next to each other. */
+    ranges[0] = (struct build_range){.lo = 0, .hi = trie->n_leaves};
+    for (size_t i = 0; i < n_nodes; i++) {
+        size_t lo = ranges[i].lo, hi = ranges[i].hi;
+        const size_t depth = ranges[i].depth;
+        const char *key = leaves[lo].key;
+        size_t end;
+
+        /* Leaves are sorted, so the first and last keys in the range have
+         * the shortest common prefix of them all. */
+        end = depth + common_prefix_len(key + depth, leaves[hi - 1].key + depth);
+        if (lo + 1 == hi)
+            end = depth + strlen(key + depth);
+
+        nodes[i] = (struct lwan_trie_node){
+            .label = (uint32_t)labels_len,
+            .label_len = (uint32_t)(end - depth),
+            .children = (uint32_t)n_nodes,
+        };
+        child_chars[i] = (unsigned char)key[depth];
+        memcpy(labels + labels_len, key + depth, end - depth);
+        labels_len += end - depth;
+
+        /* A key that's a prefix of all others sorts before them. */
+        if (!key[end]) {
+            nodes[i].data = leaves[lo].data;
+            lo++;
+        }
+
+        while (lo < hi) {
+            const char c = leaves[lo].key[end];
+            size_t next = lo + 1;
+
+            while (next < hi && leaves[next].key[end] == c)
+                next++;
+
+            ranges[n_nodes++] = (struct build_range){lo, next, end};
+            nodes[i].n_children++;
+            lo = next;
+        }
+    }
+
+    free(ranges);
+    free(trie->nodes);
+
+    trie->nodes = nodes;
+    trie->child_chars = child_chars;
+    trie->labels = labels;
+
+    return true;
 }
 
-#define GET_NODE()                                                             \
-    do {                                                                       \
-        if (!(node = *knode)) {                                                \
-            *knode = node = lwan_aligned_alloc(sizeof(*node), 64);             \
-            if (!node)                                                         \
-                goto oom;                                                      \
-            memset(node, 0, sizeof(*node));                                    \
-        }                                                                      \
-        ++node->ref_count;                                                     \
-    } while (0)
+static int compare_leaf_key(const void *key, const void *leaf)
+{
+    return strcmp(key, ((const struct lwan_trie_leaf *)leaf)->key);
+}
 
 void lwan_trie_add(struct lwan_trie *trie, const char *key, void *data)
 {
     if (UNLIKELY(!trie || !key || !data))
         return;
 
-    struct lwan_trie_node **knode, *node;
-    const char *orig_key = key;
-
-    /* Traverse the trie, allocating nodes if necessary */
-    for (knode = &trie->root; *key; knode = &node->next[(int)(*key++ & 7)])
-        GET_NODE();
-
-    /* Get the leaf node (allocate it if necessary) */
-    GET_NODE();
-
+    /* bsearch() can't be given a NULL array, even if it's empty. */
     struct lwan_trie_leaf *leaf =
-        find_leaf_with_key(node, orig_key, (size_t)(key - orig_key));
-    bool had_key = leaf;
-    if (!leaf) {
-        leaf = lwan_aligned_alloc(sizeof(*leaf), 64);
-        if (!leaf)
-            lwan_status_critical_perror("malloc");
-    } else if (trie->free_node) {
-        trie->free_node(leaf->data);
-    }
+        trie->n_leaves ? bsearch(key, trie->leaves, trie->n_leaves,
+                                 sizeof(*leaf), compare_leaf_key)
+                       : NULL;
+    if (leaf) {
+        if (trie->free_node)
+            trie->free_node(leaf->data);
+        leaf->data = data;
+    } else {
+        struct lwan_trie_leaf *leaves;
+        size_t pos;
+
+        leaves = realloc(trie->leaves, (trie->n_leaves + 1) * sizeof(*leaves));
+        if (!leaves)
+            lwan_status_critical_perror("realloc");
+        trie->leaves = leaves;
+
+        for (pos = 0; pos < trie->n_leaves; pos++) {
+            if (strcmp(leaves[pos].key, key) > 0)
+                break;
+        }
+        memmove(&leaves[pos + 1], &leaves[pos],
+                (trie->n_leaves - pos) * sizeof(*leaves));
 
-    leaf->data = data;
-    if (!had_key) {
-        leaf->key = strdup(orig_key);
-        leaf->next = node->leaf;
-        node->leaf = leaf;
+        leaves[pos] = (struct lwan_trie_leaf){.key = strdup(key), .data = data};
+        if (!leaves[pos].key)
+            lwan_status_critical_perror("strdup");
+        trie->n_leaves++;
     }
-    return;
 
-oom:
-    lwan_status_critical_perror("calloc");
+    if (!rebuild(trie))
+        lwan_status_critical_perror("lwan_aligned_alloc");
 }
 
-#undef GET_NODE
-
-static ALWAYS_INLINE struct lwan_trie_node *
-lookup_node(struct lwan_trie_node *root, const char *key, size_t *prefix_len)
+static ALWAYS_INLINE int
+find_child(const unsigned char *chars, uint32_t n_children, unsigned char c)
 {
-    struct lwan_trie_node *node, *previous_node = NULL;
-    const char *orig_key = key;
-
-    for (node = root; node && *key; node = node->next[(int)(*key++ & 7)]) {
-        if (node->leaf)
-            previous_node = node;
+#if defined(__SSE2__)
+    const __m128i needle = _mm_set1_epi8((char)c);
+
+    for (uint32_t i = 0; i < n_children; i += 16) {
+        const __m128i haystack = _mm_loadu_si128((const __m128i *)(chars + i));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(haystack, needle));
+
+        if (n_children - i < 16)
+            mask &= (1u << (n_children - i)) - 1;
+        if (mask)
+            return (int)(i + (uint32_t)__builtin_ctz(mask));
     }
 
-    *prefix_len = (size_t)(key - orig_key);
+    return -1;
+#else
+    const unsigned char *found = memchr(chars, c, n_children);
 
-    if (node && node->leaf)
-        return node;
-
-    return previous_node;
+    return found ? (int)(found - chars) : -1;
+#endif
 }
 
-ALWAYS_INLINE void *lwan_trie_lookup_prefix(struct lwan_trie *trie,
-                                            const char *key)
+void *lwan_trie_lookup_prefix(struct lwan_trie *trie, const char *key)
 {
     assert(trie);
     assert(key);
 
-    size_t prefix_len;
-    struct lwan_trie_node *node = lookup_node(trie->root, key, &prefix_len);
-
-    if (node) {
-        struct lwan_trie_leaf *leaf = find_leaf_with_key(node, key, prefix_len);
-
-        if (leaf)
-            return leaf->data;
-    }
-
-    return NULL;
-}
+    const struct lwan_trie_node *node = trie->nodes;
+    void *data = NULL;
 
-static void lwan_trie_node_destroy(struct lwan_trie *trie,
-                                   struct lwan_trie_node *node)
-{
-    if (!node)
-        return;
+    if (UNLIKELY(!node))
+        return NULL;
 
-    int32_t nodes_destroyed = node->ref_count;
+    while (true) {
+        /* Labels don't contain NUL characters, so this stops at the end
+         * of the key. */
+        if (strncmp(key, trie->labels + node->label, node->label_len))
+            break;
 
-    for (struct lwan_trie_leaf *leaf = node->leaf; leaf;) {
-        struct lwan_trie_leaf *tmp = leaf->next;
+        key += node->label_len;
+        if (node->data)
+            data = node->data;
 
-        if (trie->free_node)
-            trie->free_node(leaf->data);
+        if (!*key || !node->n_children)
+            break;
 
-        free(leaf->key);
-        free(leaf);
-        leaf = tmp;
-    }
+        int child = find_child(trie->child_chars + node->children,
+                               node->n_children, (unsigned char)*key);
+        if (child < 0)
+            break;
 
-    for (int32_t i = 0; nodes_destroyed > 0 && i < 8; i++) {
-        if (node->next[i]) {
-            lwan_trie_node_destroy(trie, node->next[i]);
-            --nodes_destroyed;
-        }
+        node = &trie->nodes[node->children + (uint32_t)child];
     }
 
-    free(node);
+    return data;
 }
 
 void lwan_trie_destroy(struct lwan_trie *trie)
 {
-    if (!trie || !trie->root)
+    if (!trie)
         return;
-    lwan_trie_node_destroy(trie, trie->root);
+
+    for (size_t i = 0; i < trie->n_leaves; i++) {
+        if (trie->free_node)
+            trie->free_node(trie->leaves[i].data);
+        free(trie->leaves[i].key);
+    }
+
+    free(trie->leaves);
+    free(trie->nodes);
+
+    trie->leaves = NULL;
+    trie->n_leaves = 0;
+    trie->nodes = NULL;
 }
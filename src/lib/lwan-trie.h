@@ -24,9 +24,20 @@
 #include <stdint.h>
 
 struct lwan_trie_node;
+struct lwan_trie_leaf;
 
+/* A path-compressed radix tree, rebuilt whenever a key is added, and laid
+ * out in a single allocation, with the children of each node next to each
+ * other.  Keys are meant to be added during initialization only. */
 struct lwan_trie {
-    struct lwan_trie_node *root;
+    struct lwan_trie_node *nodes;
+    const unsigned char *child_chars;
+    const char *labels;
+
+    /* Sorted by key */
+    struct lwan_trie_leaf *leaves;
+    size_t n_leaves;
+
     void (*free_node)(void *data);
 };
 
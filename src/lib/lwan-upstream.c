@@ -0,0 +1,673 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+
+#include "lwan-upstream.h"
+
+#define MAX_THREADS 256
+
+struct upstream {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    char *name;
+    const char *host;
+
+    /* Passive health checks.  These are shared by all I/O threads, but are
+     * updated without locks: losing an update every once in a while under
+     * contention is harmless. */
+    unsigned int fails;
+    uint64_t down_until_ms;
+};
+
+struct pool {
+    int *idle;
+    unsigned int n_idle;
+    /* Connections to this upstream being used by this thread; used by the
+     * least-connections balancer. */
+    unsigned int active;
+};
+
+/* Only ever touched by the I/O thread it belongs to, so there's no need
+ * for locks. */
+struct lwan_upstream_thread {
+    struct lwan_thread *io_thread;
+    unsigned int next;
+    struct pool pools[];
+};
+
+struct lwan_upstream_set {
+    struct upstream *upstreams;
+    size_t n_upstreams;
+
+    bool least_connections;
+    unsigned int max_idle;
+    unsigned int max_fails;
+    uint64_t fail_timeout_ms;
+
+    /* Allocated by each thread the first time it handles a request */
+    struct lwan_upstream_thread *threads[MAX_THREADS];
+};
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &ts) < 0))
+        return 0;
+
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+void lwan_upstream_failed(struct lwan_upstream_set *set, size_t index)
+{
+    struct upstream *upstream = &set->upstreams[index];
+
+    if (ATOMIC_INC(upstream->fails) < set->max_fails)
+        return;
+
+    upstream->fails = 0;
+    upstream->down_until_ms = now_ms() + set->fail_timeout_ms;
+
+    lwan_status_warning("Upstream %s failed %u times in a row, not using it "
+                        "for %" PRIu64 "ms",
+                        upstream->name, set->max_fails, set->fail_timeout_ms);
+}
+
+void lwan_upstream_succeeded(struct lwan_upstream_set *set, size_t index)
+{
+    struct upstream *upstream = &set->upstreams[index];
+
+    if (UNLIKELY(ATOMIC_READ(upstream->fails)))
+        upstream->fails = 0;
+}
+
+static size_t pick_upstream(const struct lwan_upstream_set *set,
+                            struct lwan_upstream_thread *thread,
+                            size_t exclude)
+{
+    const size_t start = thread->next++ % set->n_upstreams;
+    const uint64_t now = now_ms();
+    size_t best = SIZE_MAX;
+
+    for (size_t i = 0; i < set->n_upstreams; i++) {
+        const size_t index = (start + i) % set->n_upstreams;
+
+        if (index == exclude)
+            continue;
+        if (ATOMIC_READ(set->upstreams[index].down_until_ms) > now)
+            continue;
+
+        if (!set->least_connections)
+            return index;
+
+        /* Starting from a different upstream every time spreads requests
+         * among the ones with the same number of connections. */
+        if (best == SIZE_MAX ||
+            thread->pools[index].active < thread->pools[best].active)
+            best = index;
+    }
+
+    /* If every upstream is down, try one anyway rather than failing right
+     * away: it might be back already. */
+    return best != SIZE_MAX ? best : start;
+}
+
+static struct lwan_upstream_thread *get_thread(struct lwan_upstream_set *set,
+                                               struct lwan_request *request)
+{
+    struct lwan_thread *t = request->conn->thread;
+    const size_t index = (size_t)(t - t->lwan->thread.threads);
+    struct lwan_upstream_thread *thread = set->threads[index];
+    int *idle;
+
+    if (LIKELY(thread))
+        return thread;
+
+    thread = calloc(1, sizeof(*thread) +
+                           set->n_upstreams * sizeof(struct pool) +
+                           set->n_upstreams * set->max_idle * sizeof(int));
+    if (UNLIKELY(!thread))
+        return NULL;
+
+    idle = (int *)&thread->pools[set->n_upstreams];
+    for (size_t i = 0; i < set->n_upstreams; i++)
+        thread->pools[i].idle = idle + i * set->max_idle;
+
+    thread->io_thread = t;
+    /* So that threads don't all start with the same upstream. */
+    thread->next = (unsigned int)index;
+
+    set->threads[index] = thread;
+    return thread;
+}
+
+void lwan_upstream_conn_await(struct lwan_upstream_conn *conn, bool write)
+{
+    conn->armed = true;
+
+    if (write)
+        lwan_request_await_write(conn->request, conn->fd);
+    else
+        lwan_request_await_read(conn->request, conn->fd);
+}
+
+/* The epoll set is level-triggered: if the upstream connection is left
+ * registered while the request waits on the client connection (e.g.
+ * because the client is slower than the upstream), the coroutine would be
+ * resumed over and over again for nothing.  io_uring polls are one-shot,
+ * so there's no need to do anything in that case. */
+void lwan_upstream_conn_park(struct lwan_upstream_conn *conn)
+{
+    struct lwan_thread *t = conn->thread->io_thread;
+
+    if (!conn->armed)
+        return;
+
+    conn->armed = false;
+    if (t->uring)
+        return;
+
+    /* Hang-ups are always reported; make that happen only once. */
+    struct epoll_event event = {
+        .events = EPOLLET,
+        .data.ptr = lwan_connection_tag_awaited(conn->request->conn),
+    };
+    if (LIKELY(!epoll_ctl(t->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event)))
+        t->lwan->conns[conn->fd].flags &= ~CONN_EVENTS_MASK;
+}
+
+void lwan_upstream_conn_close(struct lwan_upstream_conn *conn)
+{
+    if (conn->fd < 0)
+        return;
+
+    /* A new connection to retry the request might get the same file
+     * descriptor before the async/await flags are reset once the request
+     * is done. */
+    conn->thread->io_thread->lwan->conns[conn->fd].flags &=
+        ~(CONN_ASYNC_AWAIT | CONN_EVENTS_MASK);
+    close(conn->fd);
+
+    conn->thread->pools[conn->upstream].active--;
+    conn->fd = -1;
+    conn->armed = false;
+}
+
+static void release_conn(void *data)
+{
+    struct lwan_upstream_conn *conn = data;
+    struct lwan_thread *t = conn->thread->io_thread;
+    struct pool *pool;
+
+    if (conn->fd < 0)
+        return;
+
+    pool = &conn->thread->pools[conn->upstream];
+    if (!conn->reusable || pool->n_idle >= conn->set->max_idle)
+        return lwan_upstream_conn_close(conn);
+
+    /* Idle connections must not wake up whatever request happens to be
+     * using the client connection that used them last.  (This runs after
+     * the async/await flags have been reset, and, with io_uring, after the
+     * poll request has been removed.) */
+    if (!t->uring)
+        epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+
+    pool->idle[pool->n_idle++] = conn->fd;
+    pool->active--;
+    conn->fd = -1;
+}
+
+struct lwan_upstream_conn *
+lwan_upstream_conn_new(struct lwan_upstream_set *set,
+                       struct lwan_request *request)
+{
+    struct coro *coro = request->conn->coro;
+    struct lwan_upstream_thread *thread = get_thread(set, request);
+    struct lwan_upstream_conn *conn;
+
+    if (UNLIKELY(!thread))
+        return NULL;
+
+    conn = coro_malloc(coro, sizeof(*conn));
+    if (UNLIKELY(!conn))
+        return NULL;
+
+    *conn = (struct lwan_upstream_conn){
+        .set = set,
+        .thread = thread,
+        .request = request,
+        .fd = -1,
+    };
+
+    /* Registered before anything is awaited, so this runs after the
+     * async/await flags have been reset. */
+    coro_defer(coro, release_conn, conn);
+
+    return conn;
+}
+
+static int take_idle_conn(struct pool *pool)
+{
+    while (pool->n_idle) {
+        int fd = pool->idle[--pool->n_idle];
+        char c;
+
+        /* Upstreams close idle connections whenever they please; catch
+         * most of those before sending a request through them. */
+        if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN)
+            return fd;
+
+        close(fd);
+    }
+
+    return -1;
+}
+
+static bool connect_conn(struct lwan_upstream_conn *conn)
+{
+    const struct upstream *upstream = &conn->set->upstreams[conn->upstream];
+    int error;
+    socklen_t error_len = sizeof(error);
+
+    conn->fd = socket(upstream->addr.ss_family,
+                      SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (UNLIKELY(conn->fd < 0)) {
+        lwan_status_perror("Could not create socket for upstream %s",
+                           upstream->name);
+        return false;
+    }
+
+    conn->thread->pools[conn->upstream].active++;
+
+    if (upstream->addr.ss_family != AF_UNIX) {
+        (void)setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, (int[]){1},
+                         sizeof(int));
+    }
+
+    if (!connect(conn->fd, (const struct sockaddr *)&upstream->addr,
+                 upstream->addr_len))
+        return true;
+    /* UNIX sockets fail with EAGAIN if the backlog is full. */
+    if (errno != EINPROGRESS)
+        return false;
+
+    lwan_upstream_conn_await(conn, true);
+
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0)
+        return false;
+    if (error) {
+        lwan_status_debug("Could not connect to upstream %s: %s",
+                          upstream->name, strerror(error));
+        return false;
+    }
+
+    return true;
+}
+
+bool lwan_upstream_conn_open(struct lwan_upstream_conn *conn, size_t exclude)
+{
+    struct pool *pool;
+
+    conn->upstream = pick_upstream(conn->set, conn->thread, exclude);
+    conn->reusable = false;
+    pool = &conn->thread->pools[conn->upstream];
+
+    conn->fd = take_idle_conn(pool);
+    if (conn->fd >= 0) {
+        pool->active++;
+        conn->reused = true;
+        return true;
+    }
+
+    conn->reused = false;
+    return connect_conn(conn);
+}
+
+bool lwan_upstream_conn_write(struct lwan_upstream_conn *conn,
+                              const void *buf,
+                              size_t len,
+                              int flags)
+{
+    const char *p = buf;
+
+    while (len) {
+        ssize_t written =
+            send(conn->fd, p, len, MSG_DONTWAIT | MSG_NOSIGNAL | flags);
+
+        if (written < 0) {
+            switch (errno) {
+            case EAGAIN:
+                lwan_upstream_conn_await(conn, true);
+                /* Fallthrough */
+            case EINTR:
+                continue;
+            }
+
+            return false;
+        }
+
+        p += written;
+        len -= (size_t)written;
+    }
+
+    return true;
+}
+
+ssize_t
+lwan_upstream_conn_read(struct lwan_upstream_conn *conn, void *buf, size_t len)
+{
+    while (true) {
+        ssize_t r = recv(conn->fd, buf, len, MSG_DONTWAIT);
+
+        if (r < 0) {
+            switch (errno) {
+            case EAGAIN:
+                lwan_upstream_conn_await(conn, false);
+                /* Fallthrough */
+            case EINTR:
+                continue;
+            }
+        }
+
+        return r;
+    }
+}
+
+const char *lwan_upstream_method_name(struct lwan_request *request)
+{
+#define GENERATE_CASE_STMT(upper, lower, mask, constant)                       \
+    case REQUEST_METHOD_##upper:                                               \
+        return #upper;
+
+    switch (lwan_request_get_method(request)) {
+        FOR_EACH_REQUEST_METHOD(GENERATE_CASE_STMT)
+    default:
+        return NULL;
+    }
+
+#undef GENERATE_CASE_STMT
+}
+
+/* The path and query string have been decoded in place by the time the
+ * handler is called, so they have to be encoded again. */
+bool lwan_upstream_append_encoded(struct lwan_strbuf *buf,
+                                  const char *str,
+                                  size_t len,
+                                  const char *safe)
+{
+    static const char hex_digit[] = "0123456789ABCDEF";
+
+    for (size_t i = 0; i < len; i++) {
+        const unsigned char c = (unsigned char)str[i];
+
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+            (c >= '0' && c <= '9') || (c && strchr(safe, c))) {
+            if (!lwan_strbuf_append_char(buf, (char)c))
+                return false;
+        } else {
+            const char encoded[] = {'%', hex_digit[c >> 4], hex_digit[c & 15]};
+
+            if (!lwan_strbuf_append_str(buf, encoded, sizeof(encoded)))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+bool lwan_upstream_append_query(struct lwan_request *request,
+                                struct lwan_strbuf *buf)
+{
+    static const char query_safe[] = "-._~!$'()*,;:@/?";
+    const struct lwan_value *query = &request->helper->query_string;
+
+    if (!query->len)
+        return true;
+
+    if (!(request->flags & REQUEST_PARSED_QUERY_STRING)) {
+        /* Still as sent by the client. */
+        return lwan_strbuf_append_str(buf, query->value, query->len);
+    }
+
+    /* Parsing the query string splits and decodes it in place; what's sent
+     * upstream is equivalent, but not necessarily in the same order. */
+    const struct lwan_key_value_array *params =
+        lwan_request_get_query_params(request);
+    const struct lwan_key_value *kv;
+    bool first = true;
+
+    LWAN_ARRAY_FOREACH (params, kv) {
+        if (!first && !lwan_strbuf_append_char(buf, '&'))
+            return false;
+        if (!lwan_upstream_append_encoded(buf, kv->key, strlen(kv->key),
+                                          query_safe) ||
+            !lwan_strbuf_append_char(buf, '=') ||
+            !lwan_upstream_append_encoded(buf, kv->value, strlen(kv->value),
+                                          query_safe))
+            return false;
+
+        first = false;
+    }
+
+    return true;
+}
+
+enum lwan_http_status lwan_upstream_status(int code)
+{
+    const char *known =
+        lwan_http_status_as_string_with_code((enum lwan_http_status)code);
+
+    if (code >= 100 && code <= 599 && strncmp(known, "999", 3))
+        return (enum lwan_http_status)code;
+
+    /* Lwan only knows how to send the codes it knows about. */
+    switch (code / 100) {
+    case 2:
+        return HTTP_OK;
+    case 3:
+        return HTTP_TEMPORARY_REDIRECT;
+    case 4:
+        return HTTP_BAD_REQUEST;
+    default:
+        return HTTP_BAD_GATEWAY;
+    }
+}
+
+size_t lwan_upstream_set_count(const struct lwan_upstream_set *set)
+{
+    return set->n_upstreams;
+}
+
+const char *lwan_upstream_name(const struct lwan_upstream_set *set,
+                               size_t upstream)
+{
+    return set->upstreams[upstream].name;
+}
+
+const char *lwan_upstream_host(const struct lwan_upstream_set *set,
+                               size_t upstream)
+{
+    return set->upstreams[upstream].host;
+}
+
+static bool parse_unix_upstream(struct upstream *upstream, const char *path)
+{
+    struct sockaddr_un *un = (struct sockaddr_un *)&upstream->addr;
+
+    if (!*path || strlen(path) >= sizeof(un->sun_path)) {
+        lwan_status_error("Invalid UNIX socket path: %s", path);
+        return false;
+    }
+
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, path);
+    upstream->addr_len = sizeof(*un);
+    upstream->host = "localhost";
+
+    return true;
+}
+
+static bool parse_upstream(struct upstream *upstream, const char *spec)
+{
+    struct addrinfo *result;
+    char *copy, *host, *port;
+    int ret;
+
+    upstream->name = strdup(spec);
+    if (!upstream->name)
+        return false;
+
+    if (!strncmp(spec, "unix:", sizeof("unix:") - 1))
+        return parse_unix_upstream(upstream, spec + sizeof("unix:") - 1);
+
+    upstream->host = upstream->name;
+
+    copy = strdupa(spec);
+    host = copy;
+    if (*host == '[') {
+        char *bracket = strchr(++host, ']');
+
+        if (!bracket || bracket[1] != ':')
+            goto invalid;
+        *bracket = '\0';
+        port = bracket + 2;
+    } else {
+        port = strrchr(host, ':');
+        if (!port)
+            goto invalid;
+        *port++ = '\0';
+    }
+    if (!*host || !*port)
+        goto invalid;
+
+    ret = getaddrinfo(host, port,
+                      &(struct addrinfo){.ai_family = AF_UNSPEC,
+                                         .ai_socktype = SOCK_STREAM,
+                                         .ai_flags = AI_NUMERICSERV},
+                      &result);
+    if (ret) {
+        lwan_status_error("Could not resolve upstream %s: %s", spec,
+                          gai_strerror(ret));
+        return false;
+    }
+
+    memcpy(&upstream->addr, result->ai_addr, result->ai_addrlen);
+    upstream->addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    return true;
+
+invalid:
+    lwan_status_error("Upstream must be in the host:port or unix:/path "
+                      "format: %s",
+                      spec);
+    return false;
+}
+
+void lwan_upstream_set_free(struct lwan_upstream_set *set)
+{
+    if (!set)
+        return;
+
+    for (size_t i = 0; i < MAX_THREADS; i++) {
+        struct lwan_upstream_thread *thread = set->threads[i];
+
+        if (!thread)
+            continue;
+
+        for (size_t u = 0; u < set->n_upstreams; u++) {
+            for (unsigned int j = 0; j < thread->pools[u].n_idle; j++)
+                close(thread->pools[u].idle[j]);
+        }
+
+        free(thread);
+    }
+
+    for (size_t i = 0; i < set->n_upstreams; i++)
+        free(set->upstreams[i].name);
+
+    free(set->upstreams);
+    free(set);
+}
+
+struct lwan_upstream_set *
+lwan_upstream_set_new(const char *upstreams,
+                      const struct lwan_upstream_options *options)
+{
+    struct lwan_upstream_set *set;
+    char *copy, *spec, *saveptr;
+
+    if (!upstreams) {
+        lwan_status_error("No upstreams were specified");
+        return NULL;
+    }
+
+    set = calloc(1, sizeof(*set));
+    if (!set)
+        return NULL;
+
+    copy = strdupa(upstreams);
+    for (spec = strtok_r(copy, " \t,", &saveptr); spec;
+         spec = strtok_r(NULL, " \t,", &saveptr)) {
+        struct upstream *new_upstreams = reallocarray(
+            set->upstreams, set->n_upstreams + 1, sizeof(*set->upstreams));
+
+        if (!new_upstreams)
+            goto error;
+
+        set->upstreams = new_upstreams;
+        set->upstreams[set->n_upstreams] = (struct upstream){};
+        set->n_upstreams++;
+
+        if (!parse_upstream(&set->upstreams[set->n_upstreams - 1], spec))
+            goto error;
+    }
+
+    if (!set->n_upstreams) {
+        lwan_status_error("No upstreams were specified");
+        goto error;
+    }
+
+    set->least_connections = options->least_connections;
+    set->max_idle = options->max_idle;
+    set->max_fails = LWAN_MAX(options->max_fails, 1u);
+    set->fail_timeout_ms = (uint64_t)options->fail_timeout * 1000;
+
+    return set;
+
+error:
+    lwan_upstream_set_free(set);
+    return NULL;
+}
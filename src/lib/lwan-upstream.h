@@ -0,0 +1,114 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include "lwan.h"
+
+/* Connections to a set of upstream servers, shared by the modules that
+ * forward requests somewhere else (proxy, fastcgi, uwsgi).  Each I/O thread
+ * keeps its own pool of idle connections to each upstream, so no locks are
+ * taken while handling requests. */
+
+struct lwan_upstream_set;
+struct lwan_upstream_thread;
+
+struct lwan_upstream_options {
+    bool least_connections;
+    /* Idle connections kept per upstream, per I/O thread */
+    unsigned int max_idle;
+    /* Consecutive failures before an upstream is taken out of rotation
+     * for fail_timeout seconds */
+    unsigned int max_fails;
+    unsigned int fail_timeout;
+};
+
+struct lwan_upstream_conn {
+    struct lwan_upstream_set *set;
+    struct lwan_upstream_thread *thread;
+    struct lwan_request *request;
+
+    size_t upstream;
+    int fd;
+
+    /* Taken from the pool of idle connections */
+    bool reused;
+    /* Set once the response has been completely read */
+    bool reusable;
+    /* Registered in the epoll set to wake up this request */
+    bool armed;
+};
+
+/* @upstreams is a space- or comma-separated list of host:port,
+ * [address]:port, or unix:/path/to/socket. */
+struct lwan_upstream_set *
+lwan_upstream_set_new(const char *upstreams,
+                      const struct lwan_upstream_options *options);
+void lwan_upstream_set_free(struct lwan_upstream_set *set);
+
+size_t lwan_upstream_set_count(const struct lwan_upstream_set *set);
+const char *lwan_upstream_name(const struct lwan_upstream_set *set,
+                               size_t upstream);
+/* "localhost" for UNIX sockets */
+const char *lwan_upstream_host(const struct lwan_upstream_set *set,
+                               size_t upstream);
+
+/* Allocated in the request coroutine, and put back in the pool (if
+ * reusable) or closed once the request is done.  NULL on failure. */
+struct lwan_upstream_conn *
+lwan_upstream_conn_new(struct lwan_upstream_set *set,
+                       struct lwan_request *request);
+
+/* Picks an upstream (other than @exclude, if possible), and either takes
+ * an idle connection to it or connects to it. */
+bool lwan_upstream_conn_open(struct lwan_upstream_conn *conn, size_t exclude);
+void lwan_upstream_conn_close(struct lwan_upstream_conn *conn);
+
+/* Must be called before waiting on the client connection (e.g. reading the
+ * request body or sending a response), so that the coroutine isn't resumed
+ * over and over because the upstream connection is readable. */
+void lwan_upstream_conn_park(struct lwan_upstream_conn *conn);
+void lwan_upstream_conn_await(struct lwan_upstream_conn *conn, bool write);
+
+bool lwan_upstream_conn_write(struct lwan_upstream_conn *conn,
+                              const void *buf,
+                              size_t len,
+                              int flags);
+ssize_t
+lwan_upstream_conn_read(struct lwan_upstream_conn *conn, void *buf, size_t len);
+
+/* Passive health checks */
+void lwan_upstream_failed(struct lwan_upstream_set *set, size_t upstream);
+void lwan_upstream_succeeded(struct lwan_upstream_set *set, size_t upstream);
+
+const char *lwan_upstream_method_name(struct lwan_request *request);
+
+/* Appends the query string as sent by the client (without the leading
+ * '?'), encoding it again if it has been parsed already. */
+bool lwan_upstream_append_query(struct lwan_request *request,
+                                struct lwan_strbuf *buf);
+bool lwan_upstream_append_encoded(struct lwan_strbuf *buf,
+                                  const char *str,
+                                  size_t len,
+                                  const char *safe);
+
+/* Maps a response code from an upstream to one Lwan can send. */
+enum lwan_http_status lwan_upstream_status(int code);
@@ -0,0 +1,213 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+#include "lwan-uring.h"
+
+#if defined(HAVE_IO_URING)
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd,
+                          unsigned int to_submit,
+                          unsigned int min_complete,
+                          unsigned int flags,
+                          void *arg,
+                          size_t arg_size)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, arg, arg_size);
+}
+
+static void *map_ring(int fd, size_t size, off_t offset)
+{
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, offset);
+
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+bool lwan_uring_init(struct lwan_uring *ring, unsigned int entries)
+{
+    struct io_uring_params params = {};
+
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = io_uring_setup(entries, &params);
+    if (ring->fd < 0)
+        return false;
+
+    /* Waiting for completions with a timeout requires EXT_ARG (Linux 5.11);
+     * the poll updates used by the worker threads require Linux 5.13. */
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        lwan_status_debug("io_uring doesn't support EXT_ARG");
+        goto close_fd;
+    }
+
+    ring->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = map_ring(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+    if (!ring->sq_ring)
+        goto close_fd;
+
+    ring->cq_ring = map_ring(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+    if (!ring->cq_ring)
+        goto unmap_sq_ring;
+
+    ring->sq.sqes = map_ring(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+    if (!ring->sq.sqes)
+        goto unmap_cq_ring;
+
+    ring->sq.head = (unsigned int *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq.tail = (unsigned int *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq.ring_mask =
+        (unsigned int *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq.array =
+        (unsigned int *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->sq.local_tail = *ring->sq.tail;
+
+    ring->cq.head = (unsigned int *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq.tail = (unsigned int *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq.ring_mask =
+        (unsigned int *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cq.cqes =
+        (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+
+    return true;
+
+unmap_cq_ring:
+    munmap(ring->cq_ring, ring->cq_ring_size);
+unmap_sq_ring:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+close_fd:
+    close(ring->fd);
+    ring->fd = -1;
+    return false;
+}
+
+void lwan_uring_shutdown(struct lwan_uring *ring)
+{
+    munmap(ring->sq.sqes, ring->sqes_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+
+    if (ring->fd >= 0) {
+        close(ring->fd);
+        ring->fd = -1;
+    }
+}
+
+static void flush_sq(struct lwan_uring *ring)
+{
+    /* Pairs with the acquire load of the SQ tail in the kernel. */
+    __atomic_store_n(ring->sq.tail, ring->sq.local_tail, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe *lwan_uring_get_sqe(struct lwan_uring *ring)
+{
+    const unsigned int mask = *ring->sq.ring_mask;
+    unsigned int head = __atomic_load_n(ring->sq.head, __ATOMIC_ACQUIRE);
+
+    if (UNLIKELY(ring->sq.local_tail - head > mask)) {
+        /* Submission queue is full: hand what we have to the kernel without
+         * waiting for anything, so that this call never fails in practice. */
+        flush_sq(ring);
+        if (io_uring_enter(ring->fd, ring->pending, 0, 0, NULL, 0) < 0)
+            return NULL;
+        ring->pending = 0;
+
+        head = __atomic_load_n(ring->sq.head, __ATOMIC_ACQUIRE);
+        if (ring->sq.local_tail - head > mask)
+            return NULL;
+    }
+
+    unsigned int idx = ring->sq.local_tail & mask;
+    struct io_uring_sqe *sqe = &ring->sq.sqes[idx];
+
+    ring->sq.array[idx] = idx;
+    ring->sq.local_tail++;
+    ring->pending++;
+
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int lwan_uring_submit_and_wait(struct lwan_uring *ring, int timeout_ms)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = {
+        .sigmask_sz = _NSIG / 8,
+    };
+    unsigned int to_submit = ring->pending;
+    int r;
+
+    if (timeout_ms >= 0) {
+        ts = (struct __kernel_timespec){
+            .tv_sec = timeout_ms / 1000,
+            .tv_nsec = (timeout_ms % 1000) * 1000000ll,
+        };
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    flush_sq(ring);
+    r = io_uring_enter(ring->fd, to_submit, 1,
+                       IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                       sizeof(arg));
+    if (r >= 0) {
+        ring->pending -= LWAN_MIN(ring->pending, (unsigned int)r);
+        return 0;
+    }
+
+    /* ETIME means that the timeout expired; not an error. */
+    return errno == ETIME ? 0 : -errno;
+}
+
+struct io_uring_cqe *lwan_uring_peek_cqe(struct lwan_uring *ring)
+{
+    unsigned int head = *ring->cq.head;
+
+    if (head == __atomic_load_n(ring->cq.tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &ring->cq.cqes[head & *ring->cq.ring_mask];
+}
+
+void lwan_uring_cqe_seen(struct lwan_uring *ring)
+{
+    __atomic_store_n(ring->cq.head, *ring->cq.head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#if defined(HAVE_IO_URING)
+#include <linux/io_uring.h>
+
+/* Minimal io_uring wrapper, just enough to drive the worker thread event
+ * loop without depending on liburing. */
+struct lwan_uring {
+    struct {
+        unsigned int *head;
+        unsigned int *tail;
+        unsigned int *ring_mask;
+        unsigned int *array;
+        struct io_uring_sqe *sqes;
+        unsigned int local_tail;
+    } sq;
+    struct {
+        unsigned int *head;
+        unsigned int *tail;
+        unsigned int *ring_mask;
+        struct io_uring_cqe *cqes;
+    } cq;
+
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    unsigned int pending;
+    int fd;
+};
+
+bool lwan_uring_init(struct lwan_uring *ring, unsigned int entries);
+void lwan_uring_shutdown(struct lwan_uring *ring);
+
+struct io_uring_sqe *lwan_uring_get_sqe(struct lwan_uring *ring);
+int lwan_uring_submit_and_wait(struct lwan_uring *ring, int timeout_ms);
+
+struct io_uring_cqe *lwan_uring_peek_cqe(struct lwan_uring *ring);
+void lwan_uring_cqe_seen(struct lwan_uring *ring);
+#endif
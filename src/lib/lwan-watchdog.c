@@ -0,0 +1,340 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lwan-private.h"
+
+/* Finds requests that take longer than slow_request_threshold to be
+ * handled, in two ways:
+ *
+ *  - Requests that yield (e.g. waiting for an upstream, or sleeping) are
+ *    found by a timer, in the timer wheel of their I/O thread, which fires
+ *    once they've been in their handler for that long.
+ *
+ *  - Code that doesn't yield stalls the whole I/O thread, so its timer
+ *    wheel can't be relied on.  Every time a coroutine is resumed, what
+ *    it's doing is copied to a per-thread slot, which a watchdog thread
+ *    looks at periodically; how long it took to yield back is logged
+ *    afterwards as well.
+ *
+ * The per-thread slot is written only by its I/O thread, and is read by
+ * the watchdog without locks: its sequence number is odd while a
+ * coroutine is running, and changes before the I/O thread writes to it
+ * again, so the watchdog can tell if what it read is consistent. */
+
+struct lwan_thread_watch {
+    unsigned int seq;
+    int fd;
+    int64_t last_yield;
+    uint64_t resumed_at;
+    const char *handler;
+    char url[64];
+};
+
+static struct {
+    /* What request, if any, each connection is handling; indexed by file
+     * descriptor, and only touched by the I/O thread owning it. */
+    struct lwan_request_watch **requests;
+    unsigned int threshold_ms;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool running;
+} watchdog = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static const char *yield_name(int64_t value)
+{
+    static const char *const names[] = {
+        [CONN_CORO_ABORT] = "CONN_CORO_ABORT",
+        [CONN_CORO_YIELD] = "CONN_CORO_YIELD",
+        [CONN_CORO_WANT_READ] = "CONN_CORO_WANT_READ",
+        [CONN_CORO_WANT_WRITE] = "CONN_CORO_WANT_WRITE",
+        [CONN_CORO_WANT_READ_WRITE] = "CONN_CORO_WANT_READ_WRITE",
+        [CONN_CORO_SUSPEND] = "CONN_CORO_SUSPEND",
+        [CONN_CORO_RESUME] = "CONN_CORO_RESUME",
+        [CONN_CORO_ASYNC_AWAIT_READ] = "CONN_CORO_ASYNC_AWAIT_READ",
+        [CONN_CORO_ASYNC_AWAIT_WRITE] = "CONN_CORO_ASYNC_AWAIT_WRITE",
+        [CONN_CORO_ASYNC_AWAIT_READ_WRITE] = "CONN_CORO_ASYNC_AWAIT_READ_WRITE",
+    };
+    /* Async yields have the file descriptor in the upper 32 bits. */
+    const uint32_t index = (uint32_t)(value & 0xffffffff);
+
+    return index < N_ELEMENTS(names) ? names[index] : "unknown";
+}
+
+static uint64_t clock_ms(void)
+{
+    struct timespec now;
+
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
+        return 0;
+
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+static const char *request_url(const struct lwan_request *request)
+{
+    return request->original_url.len ? request->original_url.value : "/";
+}
+
+static void publish(struct lwan_thread_watch *slot,
+                    const struct lwan_request_watch *watch)
+{
+    if (watch) {
+        slot->last_yield = watch->last_yield;
+        slot->handler = watch->handler;
+        strncpy(slot->url, request_url(watch->request), sizeof(slot->url) - 1);
+        slot->url[sizeof(slot->url) - 1] = '\0';
+    } else {
+        slot->last_yield = CONN_CORO_RESUME;
+        slot->handler = NULL;
+    }
+}
+
+static void watch_end(void *data)
+{
+    struct lwan_request_watch *watch = data;
+    struct lwan_request *request = watch->request;
+
+    timeouts_del(request->conn->thread->wheel, &watch->timeout);
+
+    watchdog.requests[request->fd] = NULL;
+}
+
+void lwan_watchdog_request_start(struct lwan_request *request,
+                                 const struct lwan_url_map *url_map)
+{
+    struct lwan_request_watch *watch = &request->helper->watch;
+    struct lwan_connection *conn = request->conn;
+
+    /* Streams share the socket with their HTTP/2 connection, and are
+     * resumed by its coroutine. */
+    if (UNLIKELY(conn->flags & CONN_IS_HTTP2_STREAM))
+        return;
+    /* Already being watched (e.g. the URL has been rewritten) */
+    if (watchdog.requests[request->fd] == watch)
+        return;
+
+    *watch = (struct lwan_request_watch){
+        .timeout = {.flags = LWAN_TIMEOUT_SLOW_REQUEST},
+        .request = request,
+        .handler = url_map->prefix,
+        .started_at = clock_ms(),
+        .last_yield = CONN_CORO_RESUME,
+    };
+    watch->last_yield_at = watch->started_at;
+
+    timeouts_add(conn->thread->wheel, &watch->timeout, watchdog.threshold_ms);
+    coro_defer(conn->coro, watch_end, watch);
+
+    watchdog.requests[request->fd] = watch;
+
+    /* The handler is about to be called in the coroutine that is running
+     * right now, so the watchdog needs to know about it already, in case
+     * it doesn't yield.  The slot is marked as being written to first. */
+    struct lwan_thread_watch *slot = conn->thread->watch;
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+    publish(slot, watch);
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+void lwan_watchdog_request_timeout(struct timeout *timeout)
+{
+    struct lwan_request_watch *watch =
+        container_of(timeout, struct lwan_request_watch, timeout);
+    const struct lwan_request *request = watch->request;
+    const uint64_t now = clock_ms();
+
+    /* Websockets and event streams are supposed to be handled for as long
+     * as clients are connected. */
+    if (request->conn->flags & CONN_IS_UPGRADE ||
+        request->flags & RESPONSE_SENT_HEADERS)
+        return;
+
+    lwan_status_warning(
+        "Slow request: %s (handler %s) running for %" PRIu64
+        " ms, yielded with %s %" PRIu64 " ms ago",
+        request_url(request), watch->handler, now - watch->started_at,
+        yield_name(watch->last_yield), now - watch->last_yield_at);
+}
+
+int64_t lwan_watchdog_resume(struct lwan_connection *conn)
+{
+    struct lwan_thread_watch *slot = conn->thread->watch;
+    const int fd = lwan_connection_get_fd(conn->thread->lwan, conn);
+    struct lwan_request_watch *watch = watchdog.requests[fd];
+    int64_t from_coro;
+    uint64_t now;
+
+    slot->fd = fd;
+    slot->resumed_at = clock_ms();
+    publish(slot, watch);
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+
+    from_coro = coro_resume(conn->coro);
+
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+    now = clock_ms();
+
+    if (UNLIKELY(now - slot->resumed_at >= watchdog.threshold_ms)) {
+        lwan_status_warning(
+            "Connection %d blocked its I/O thread for %" PRIu64
+            " ms, then yielded with %s (request: %s, handler: %s)",
+            fd, now - slot->resumed_at, yield_name(from_coro),
+            slot->handler ? slot->url : "none",
+            slot->handler ? slot->handler : "none");
+    }
+
+    /* The request might have finished while it was running. */
+    watch = watchdog.requests[fd];
+    if (watch) {
+        watch->last_yield = from_coro;
+        watch->last_yield_at = now;
+    }
+
+    return from_coro;
+}
+
+static void check_thread(struct lwan_thread *t, unsigned int *reported_seq)
+{
+    const struct lwan_thread_watch *slot = t->watch;
+    struct lwan_thread_watch copy;
+    unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    uint64_t now;
+
+    /* Not running anything, or already reported */
+    if (!(seq & 1) || seq == *reported_seq)
+        return;
+
+    memcpy(&copy, slot, sizeof(copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+        return;
+
+    now = clock_ms();
+    if (now - copy.resumed_at < watchdog.threshold_ms)
+        return;
+
+    copy.url[sizeof(copy.url) - 1] = '\0';
+    lwan_status_warning(
+        "I/O thread %td has been running connection %d for %" PRIu64
+        " ms without yielding; it was resumed after yielding with %s "
+        "(request: %s, handler: %s)",
+        t - t->lwan->thread.threads, copy.fd, now - copy.resumed_at,
+        yield_name(copy.last_yield), copy.handler ? copy.url : "none",
+        copy.handler ? copy.handler : "none");
+
+    *reported_seq = seq;
+}
+
+static void *watchdog_thread(void *data)
+{
+    struct lwan *l = data;
+    unsigned int *reported_seq = calloc(l->thread.count, sizeof(unsigned int));
+    const unsigned int interval_ms = LWAN_MAX(watchdog.threshold_ms / 2, 1u);
+
+    if (!reported_seq)
+        return NULL;
+
+    lwan_set_thread_name("watchdog");
+
+    pthread_mutex_lock(&watchdog.lock);
+    while (watchdog.running) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval_ms / 1000;
+        deadline.tv_nsec += (long)(interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        if (pthread_cond_timedwait(&watchdog.cond, &watchdog.lock,
+                                   &deadline) != ETIMEDOUT)
+            continue;
+
+        for (unsigned int i = 0; i < l->thread.count; i++)
+            check_thread(&l->thread.threads[i], &reported_seq[i]);
+    }
+    pthread_mutex_unlock(&watchdog.lock);
+
+    free(reported_seq);
+    return NULL;
+}
+
+void lwan_watchdog_init(struct lwan *l)
+{
+    const size_t n_fds = (size_t)l->thread.max_fd * l->thread.count;
+
+    if (!l->config.slow_request_threshold)
+        return;
+
+    watchdog.threshold_ms = l->config.slow_request_threshold;
+    watchdog.requests = calloc(n_fds, sizeof(*watchdog.requests));
+    if (!watchdog.requests)
+        lwan_status_critical("Could not allocate memory for the watchdog");
+
+    for (unsigned int i = 0; i < l->thread.count; i++) {
+        l->thread.threads[i].watch =
+            lwan_aligned_alloc(sizeof(struct lwan_thread_watch), 64);
+        if (!l->thread.threads[i].watch)
+            lwan_status_critical("Could not allocate memory for the watchdog");
+        memset(l->thread.threads[i].watch, 0, sizeof(struct lwan_thread_watch));
+    }
+
+    watchdog.running = true;
+    if (pthread_create(&watchdog.thread, NULL, watchdog_thread, l))
+        lwan_status_critical_perror("pthread_create");
+
+    lwan_status_debug("Reporting requests taking longer than %u ms",
+                      watchdog.threshold_ms);
+}
+
+void lwan_watchdog_shutdown(struct lwan *l)
+{
+    if (!watchdog.requests)
+        return;
+
+    pthread_mutex_lock(&watchdog.lock);
+    watchdog.running = false;
+    pthread_cond_signal(&watchdog.cond);
+    pthread_mutex_unlock(&watchdog.lock);
+
+    pthread_join(watchdog.thread, NULL);
+
+    for (unsigned int i = 0; i < l->thread.count; i++) {
+        free(l->thread.threads[i].watch);
+        l->thread.threads[i].watch = NULL;
+    }
+
+    free(watchdog.requests);
+    watchdog.requests = NULL;
+}
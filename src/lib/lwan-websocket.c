@@ -22,11 +22,16 @@
 #include <assert.h>
 #include <endian.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
+#include <zlib.h>
 
 #if defined(__x86_64__)
-#include <emmintrin.h>
+#include <immintrin.h>
 #endif
 
 #include "lwan-io-wrappers.h"
@@ -55,31 +60,563 @@ enum ws_opcode {
     WS_OPCODE_INVALID = 16,
 };
 
-static void write_websocket_frame(struct lwan_request *request,
-                                  unsigned char header_byte,
-                                  char *msg,
-                                  size_t len)
+size_t lwan_websocket_frame_header(unsigned char frame[static 10],
+                                   unsigned char header_byte,
+                                   size_t len)
 {
-    uint8_t frame[9];
-    size_t frame_len;
+    frame[0] = header_byte;
 
     if (len <= 125) {
-        frame[0] = (uint8_t)len;
-        frame_len = 1;
-    } else if (len <= 65535) {
-        frame[0] = 0x7e;
-        memcpy(frame + 1, &(uint16_t){htons((uint16_t)len)}, sizeof(uint16_t));
-        frame_len = 3;
+        frame[1] = (uint8_t)len;
+        return 2;
+    }
+
+    if (len <= 65535) {
+        frame[1] = 0x7e;
+        memcpy(frame + 2, &(uint16_t){htons((uint16_t)len)}, sizeof(uint16_t));
+        return 4;
+    }
+
+    frame[1] = 0x7f;
+    memcpy(frame + 2, &(uint64_t){htobe64((uint64_t)len)}, sizeof(uint64_t));
+    return 10;
+}
+
+/* permessage-deflate (RFC7692).  Messages are compressed as raw deflate
+ * streams flushed with Z_SYNC_FLUSH, minus the 00 00 ff ff trailer that
+ * every flush ends with; the receiving end appends it before inflating. */
+
+#define DEFLATE_LEVEL 4
+
+/* Not worth the trouble for anything smaller than this. */
+#define DEFLATE_MIN_SIZE 64
+
+struct lwan_websocket_deflate {
+    /* Only with context takeover; otherwise, each message is compressed or
+     * decompressed on its own, using the streams kept by each thread. */
+    z_stream *deflate;
+    z_stream *inflate;
+
+    /* Compressed messages are written from, and decompressed messages
+     * inflated to, this buffer. */
+    char *out;
+    size_t out_size;
+
+    int server_window_bits;
+    int client_window_bits;
+    bool server_takeover;
+    bool client_takeover;
+};
+
+struct deflate_offer {
+    int server_max_window_bits; /* 0 if not present */
+    int client_max_window_bits; /* -1 if not present, 0 if without a value */
+    bool server_no_context_takeover;
+    bool client_no_context_takeover;
+};
+
+static __thread struct {
+    z_stream *deflate;
+    int deflate_window_bits;
+    z_stream *inflate;
+} spare;
+
+static const unsigned char deflate_trailer[] = {0x00, 0x00, 0xff, 0xff};
+
+/* Most of the memory used by compressed connections is zlib's state, which
+ * it allocates itself; zfree() isn't told the size of what it's freeing, so
+ * it's kept before the allocation to account for it. */
+union zalloc_header {
+    size_t size;
+    long double align;
+};
+
+static voidpf zalloc_accounted(voidpf opaque __attribute__((unused)),
+                               uInt items,
+                               uInt size)
+{
+    union zalloc_header *header;
+    size_t total;
+
+    if (__builtin_mul_overflow((size_t)items, (size_t)size, &total) ||
+        __builtin_add_overflow(total, sizeof(*header), &total))
+        return Z_NULL;
+
+    header = malloc(total);
+    if (UNLIKELY(!header))
+        return Z_NULL;
+
+    header->size = total;
+    lwan_memory_account(LWAN_MEMORY_WEBSOCKETS, (int64_t)total);
+
+    return header + 1;
+}
+
+static void zfree_accounted(voidpf opaque __attribute__((unused)),
+                            voidpf address)
+{
+    union zalloc_header *header = (union zalloc_header *)address - 1;
+
+    lwan_memory_account(LWAN_MEMORY_WEBSOCKETS, -(int64_t)header->size);
+    free(header);
+}
+
+static z_stream *deflate_new(int window_bits)
+{
+    z_stream *z = lwan_slab_calloc(sizeof(*z));
+
+    if (UNLIKELY(!z))
+        return NULL;
+
+    z->zalloc = zalloc_accounted;
+    z->zfree = zfree_accounted;
+
+    /* Negative window bits ask for a raw stream.  zlib uses 2^(memLevel + 9)
+     * bytes for its hash tables, on top of twice the window size: scale it
+     * down with the window, so that the window bits bound the memory used by
+     * connections that keep their own stream. */
+    if (UNLIKELY(deflateInit2(z, DEFLATE_LEVEL, Z_DEFLATED, -window_bits,
+                              LWAN_MIN(8, window_bits - 7),
+                              Z_DEFAULT_STRATEGY) != Z_OK)) {
+        lwan_slab_free(z);
+        return NULL;
+    }
+
+    return z;
+}
+
+static void deflate_free(z_stream *z)
+{
+    if (z) {
+        deflateEnd(z);
+        lwan_slab_free(z);
+    }
+}
+
+static z_stream *inflate_new(int window_bits)
+{
+    z_stream *z = lwan_slab_calloc(sizeof(*z));
+
+    if (UNLIKELY(!z))
+        return NULL;
+
+    z->zalloc = zalloc_accounted;
+    z->zfree = zfree_accounted;
+
+    if (UNLIKELY(inflateInit2(z, -window_bits) != Z_OK)) {
+        lwan_slab_free(z);
+        return NULL;
+    }
+
+    return z;
+}
+
+static void inflate_free(z_stream *z)
+{
+    if (z) {
+        inflateEnd(z);
+        lwan_slab_free(z);
+    }
+}
+
+void lwan_websocket_thread_shutdown(void)
+{
+    deflate_free(spare.deflate);
+    inflate_free(spare.inflate);
+    spare.deflate = spare.inflate = NULL;
+}
+
+static void websocket_deflate_free(void *data)
+{
+    struct lwan_websocket_deflate *wsd = data;
+
+    deflate_free(wsd->deflate);
+    inflate_free(wsd->inflate);
+    free(wsd->out);
+    lwan_memory_account(LWAN_MEMORY_WEBSOCKETS, -(int64_t)wsd->out_size);
+    lwan_slab_free(wsd);
+}
+
+static z_stream *get_deflate(struct lwan_websocket_deflate *wsd)
+{
+    if (wsd->server_takeover) {
+        if (!wsd->deflate)
+            wsd->deflate = deflate_new(wsd->server_window_bits);
+        return wsd->deflate;
+    }
+
+    if (spare.deflate && spare.deflate_window_bits != wsd->server_window_bits) {
+        deflate_free(spare.deflate);
+        spare.deflate = NULL;
+    }
+    if (!spare.deflate) {
+        spare.deflate = deflate_new(wsd->server_window_bits);
+        spare.deflate_window_bits = wsd->server_window_bits;
+    }
+    return spare.deflate;
+}
+
+static void put_deflate(struct lwan_websocket_deflate *wsd)
+{
+    if (!wsd->server_takeover && deflateReset(spare.deflate) != Z_OK) {
+        deflate_free(spare.deflate);
+        spare.deflate = NULL;
+    }
+}
+
+static z_stream *get_inflate(struct lwan_websocket_deflate *wsd)
+{
+    if (wsd->client_takeover) {
+        if (!wsd->inflate)
+            wsd->inflate = inflate_new(wsd->client_window_bits);
+        return wsd->inflate;
+    }
+
+    /* The largest window can inflate messages compressed with any other. */
+    if (!spare.inflate)
+        spare.inflate = inflate_new(15);
+    return spare.inflate;
+}
+
+static void put_inflate(struct lwan_websocket_deflate *wsd)
+{
+    if (!wsd->client_takeover && inflateReset(spare.inflate) != Z_OK) {
+        inflate_free(spare.inflate);
+        spare.inflate = NULL;
+    }
+}
+
+static bool grow_out(struct lwan_websocket_deflate *wsd, size_t size)
+{
+    if (size <= wsd->out_size)
+        return true;
+
+    char *out = realloc(wsd->out, size);
+    if (UNLIKELY(!out))
+        return false;
+
+    lwan_memory_account(LWAN_MEMORY_WEBSOCKETS,
+                        (int64_t)size - (int64_t)wsd->out_size);
+    wsd->out = out;
+    wsd->out_size = size;
+    return true;
+}
+
+static bool parse_window_bits(const char *value, int *bits)
+{
+    size_t len = strlen(value);
+
+    /* Values might be quoted; see RFC7692 section 7.1. */
+    if (len >= 2 && value[0] == '"' && value[len - 1] == '"') {
+        value++;
+        len -= 2;
+    }
+
+    if (len == 1 && value[0] >= '8' && value[0] <= '9') {
+        *bits = value[0] - '0';
+        return true;
+    }
+    if (len == 2 && value[0] == '1' && value[1] >= '0' && value[1] <= '5') {
+        *bits = 10 + value[1] - '0';
+        return true;
+    }
+
+    return false;
+}
+
+static char *trim_spaces(char *str)
+{
+    char *end;
+
+    while (*str == ' ' || *str == '\t')
+        str++;
+    for (end = str + strlen(str); end > str; end--) {
+        if (end[-1] != ' ' && end[-1] != '\t')
+            break;
+    }
+    *end = '\0';
+
+    return str;
+}
+
+static bool parse_deflate_offer(char *offer, struct deflate_offer *parsed)
+{
+    char *param = strsep(&offer, ";");
+
+    if (strcasecmp(trim_spaces(param), "permessage-deflate"))
+        return false;
+
+    *parsed = (struct deflate_offer){.client_max_window_bits = -1};
+
+    while ((param = strsep(&offer, ";"))) {
+        char *value = strchr(param, '=');
+
+        if (value) {
+            *value = '\0';
+            value = trim_spaces(value + 1);
+        }
+        param = trim_spaces(param);
+
+        /* Offers with unknown, repeated, or invalid parameters must be
+         * declined (RFC7692 section 7). */
+        if (!strcasecmp(param, "server_no_context_takeover")) {
+            if (value || parsed->server_no_context_takeover)
+                return false;
+            parsed->server_no_context_takeover = true;
+        } else if (!strcasecmp(param, "client_no_context_takeover")) {
+            if (value || parsed->client_no_context_takeover)
+                return false;
+            parsed->client_no_context_takeover = true;
+        } else if (!strcasecmp(param, "server_max_window_bits")) {
+            if (!value || parsed->server_max_window_bits ||
+                !parse_window_bits(value, &parsed->server_max_window_bits))
+                return false;
+        } else if (!strcasecmp(param, "client_max_window_bits")) {
+            if (parsed->client_max_window_bits >= 0)
+                return false;
+            if (!value)
+                parsed->client_max_window_bits = 0;
+            else if (!parse_window_bits(value, &parsed->client_max_window_bits))
+                return false;
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool lwan_websocket_deflate_negotiate(struct lwan_request *request,
+                                      char response[static 128])
+{
+    const struct lwan_config *config = &request->conn->thread->lwan->config;
+    const int window_bits = (int)config->websocket_deflate_window_bits;
+    struct lwan_websocket_deflate *wsd;
+    struct deflate_offer offer;
+    char offers_buf[256];
+    char *offers = offers_buf;
+    int server_bits;
+    char *p;
+
+    if (!config->websocket_deflate)
+        return false;
+
+    const char *extensions =
+        lwan_request_get_header(request, "Sec-WebSocket-Extensions");
+    if (!extensions)
+        return false;
+
+    const size_t extensions_len = strlen(extensions);
+    if (extensions_len >= sizeof(offers_buf))
+        return false;
+    memcpy(offers_buf, extensions, extensions_len + 1);
+
+    /* Clients may offer more than one set of parameters, in order of
+     * preference; pick the first one that can be accepted. */
+    while ((p = strsep(&offers, ","))) {
+        if (!parse_deflate_offer(p, &offer))
+            continue;
+
+        server_bits = window_bits;
+        if (offer.server_max_window_bits)
+            server_bits = LWAN_MIN(server_bits, offer.server_max_window_bits);
+
+        /* zlib won't produce raw streams with 8-bit windows. */
+        if (server_bits >= 9)
+            goto accept;
+    }
+
+    return false;
+
+accept:
+    wsd = lwan_slab_alloc(sizeof(*wsd));
+    if (UNLIKELY(!wsd))
+        return false;
+    coro_defer(request->conn->coro, websocket_deflate_free, wsd);
+
+    *wsd = (struct lwan_websocket_deflate){
+        .server_window_bits = server_bits,
+        .client_window_bits = 15,
+        .server_takeover = config->websocket_deflate_context_takeover &&
+                           !offer.server_no_context_takeover,
+        .client_takeover = config->websocket_deflate_context_takeover &&
+                           !offer.client_no_context_takeover,
+    };
+
+    p = stpcpy(response, "permessage-deflate");
+    if (!wsd->server_takeover)
+        p = stpcpy(p, "; server_no_context_takeover");
+    if (!wsd->client_takeover)
+        p = stpcpy(p, "; client_no_context_takeover");
+    if (offer.server_max_window_bits || server_bits < 15)
+        p += sprintf(p, "; server_max_window_bits=%d", server_bits);
+
+    /* The window used by clients only matters if a stream is kept for
+     * each connection, and can only be limited if they say they support
+     * it. */
+    if (wsd->client_takeover && offer.client_max_window_bits >= 0) {
+        int client_bits = window_bits;
+
+        if (offer.client_max_window_bits)
+            client_bits = LWAN_MIN(client_bits, offer.client_max_window_bits);
+        if (client_bits < 15) {
+            sprintf(p, "; client_max_window_bits=%d", client_bits);
+            wsd->client_window_bits = client_bits;
+        }
+    }
+
+    request->helper->websocket_deflate = wsd;
+    return true;
+}
+
+bool lwan_websocket_deflate_shareable(const struct lwan_request *request)
+{
+    const struct lwan_websocket_deflate *wsd =
+        request->helper->websocket_deflate;
+
+    /* Without context takeover, the same compressed message can be sent to
+     * every connection that agreed to the configured window size. */
+    return wsd && !wsd->server_takeover &&
+           wsd->server_window_bits ==
+               (int)request->conn->thread->lwan->config
+                   .websocket_deflate_window_bits;
+}
+
+bool lwan_websocket_deflate_message(struct lwan_request *request,
+                                    const struct lwan_value *msg,
+                                    struct lwan_value *deflated)
+{
+    struct lwan_websocket_deflate *wsd = request->helper->websocket_deflate;
+    z_stream *z;
+
+    if (!wsd || msg->len < DEFLATE_MIN_SIZE || msg->len > UINT_MAX / 2)
+        return false;
+
+    z = get_deflate(wsd);
+    if (UNLIKELY(!z))
+        return false;
+
+    /* Enough for incompressible data, the flush, and a partial block. */
+    const size_t bound = deflateBound(z, msg->len) + 16;
+    if (UNLIKELY(!grow_out(wsd, bound)))
+        return false;
+
+    z->next_in = (Bytef *)msg->value;
+    z->avail_in = (uInt)msg->len;
+    z->next_out = (Bytef *)wsd->out;
+    z->avail_out = (uInt)bound;
+
+    const int r = deflate(z, Z_SYNC_FLUSH);
+    const size_t len = bound - z->avail_out;
+    const bool ok = r == Z_OK && !z->avail_in && z->avail_out &&
+                    len >= sizeof(deflate_trailer) &&
+                    !memcmp(wsd->out + len - sizeof(deflate_trailer),
+                            deflate_trailer, sizeof(deflate_trailer));
+
+    if (wsd->server_takeover) {
+        /* The message is now part of the context, so it has to be sent
+         * compressed no matter what, or the client's context would be out
+         * of sync with ours. */
+        if (UNLIKELY(!ok)) {
+            lwan_status_error("Could not compress websocket message");
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
     } else {
-        frame[0] = 0x7f;
-        memcpy(frame + 1, &(uint64_t){htobe64((uint64_t)len)},
-               sizeof(uint64_t));
-        frame_len = 9;
+        put_deflate(wsd);
+
+        if (!ok || len - sizeof(deflate_trailer) >= msg->len)
+            return false;
     }
 
+    deflated->value = wsd->out;
+    deflated->len = len - sizeof(deflate_trailer);
+    return true;
+}
+
+static void inflate_message(struct lwan_request *request)
+{
+    struct lwan_websocket_deflate *wsd = request->helper->websocket_deflate;
+    const size_t max_size =
+        request->conn->thread->lwan->config.max_post_data_size;
+    struct lwan_strbuf *buffer = request->response.buffer;
+    const size_t in_len = lwan_strbuf_get_length(buffer);
+    bool fed_trailer = false;
+    bool out_full = false;
+    size_t used = 0;
+    z_stream *z;
+
+    if (UNLIKELY(in_len > UINT_MAX))
+        goto abort;
+
+    z = get_inflate(wsd);
+    if (UNLIKELY(!z))
+        goto abort;
+
+    z->next_in = (Bytef *)lwan_strbuf_get_buffer(buffer);
+    z->avail_in = (uInt)in_len;
+
+    while (true) {
+        if (!z->avail_in && !out_full) {
+            if (fed_trailer)
+                break;
+
+            z->next_in = (Bytef *)deflate_trailer;
+            z->avail_in = sizeof(deflate_trailer);
+            fed_trailer = true;
+        }
+
+        if (used == wsd->out_size) {
+            /* Growing to one byte past the limit is enough to tell if a
+             * message is too large. */
+            const size_t size =
+                LWAN_MIN(LWAN_MAX(wsd->out_size * 2, (size_t)1024), max_size + 1);
+            if (UNLIKELY(size <= used || !grow_out(wsd, size)))
+                goto abort_put;
+        }
+
+        z->next_out = (Bytef *)wsd->out + used;
+        z->avail_out = (uInt)(wsd->out_size - used);
+
+        const int r = inflate(z, Z_SYNC_FLUSH);
+
+        used = wsd->out_size - z->avail_out;
+        out_full = !z->avail_out;
+
+        if (UNLIKELY(used > max_size)) {
+            lwan_status_debug("Decompressed websocket message is too large");
+            goto abort_put;
+        }
+        if (r == Z_STREAM_END)
+            break;
+        if (UNLIKELY(r != Z_OK && r != Z_BUF_ERROR)) {
+            lwan_status_debug("Could not decompress websocket message");
+            goto abort_put;
+        }
+    }
+
+    put_inflate(wsd);
+
+    if (LIKELY(lwan_strbuf_set(buffer, wsd->out, used)))
+        return;
+    goto abort;
+
+abort_put:
+    put_inflate(wsd);
+abort:
+    coro_yield(request->conn->coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
+
+static void write_websocket_frame(struct lwan_request *request,
+                                  unsigned char header_byte,
+                                  char *msg,
+                                  size_t len)
+{
+    unsigned char frame[10];
     struct iovec vec[] = {
-        {.iov_base = &header_byte, .iov_len = 1},
-        {.iov_base = frame, .iov_len = frame_len},
+        {.iov_base = frame,
+         .iov_len = lwan_websocket_frame_header(frame, header_byte, len)},
         {.iov_base = msg, .iov_len = len},
     };
 
@@ -88,8 +625,11 @@ static void write_websocket_frame(struct lwan_request *request,
 
 void lwan_response_websocket_write(struct lwan_request *request)
 {
-    size_t len = lwan_strbuf_get_length(request->response.buffer);
-    char *msg = lwan_strbuf_get_buffer(request->response.buffer);
+    struct lwan_value msg = {
+        .value = lwan_strbuf_get_buffer(request->response.buffer),
+        .len = lwan_strbuf_get_length(request->response.buffer),
+    };
+    struct lwan_value deflated;
     /* FIXME: does it make a difference if we use WS_OPCODE_TEXT or
      * WS_OPCODE_BINARY? */
     unsigned char header = 0x80 | WS_OPCODE_TEXT;
@@ -97,24 +637,22 @@ void lwan_response_websocket_write(struct lwan_request *request)
     if (!(request->conn->flags & CONN_IS_WEBSOCKET))
         return;
 
-    write_websocket_frame(request, header, msg, len);
+    if (lwan_websocket_deflate_message(request, &msg, &deflated)) {
+        header |= 0x40; /* RSV1: compressed message */
+        msg = deflated;
+    }
+
+    write_websocket_frame(request, header, msg.value, msg.len);
     lwan_strbuf_reset(request->response.buffer);
 }
 
-static void send_websocket_pong(struct lwan_request *request, size_t len)
+void lwan_response_websocket_write_frame(struct lwan_request *request,
+                                         const struct lwan_value *frame)
 {
-    char temp[128];
-
-    if (UNLIKELY(len > 125)) {
-        lwan_status_debug("Received PING opcode with length %zu."
-                          "Max is 125. Aborting connection.",
-                          len);
-        coro_yield(request->conn->coro, CONN_CORO_ABORT);
-        __builtin_unreachable();
-    }
+    if (!(request->conn->flags & CONN_IS_WEBSOCKET))
+        return;
 
-    lwan_recv(request, temp, len, 0);
-    write_websocket_frame(request, WS_OPCODE_PONG, temp, len);
+    lwan_send(request, frame->value, frame->len, 0);
 }
 
 static size_t get_frame_length(struct lwan_request *request, uint16_t header)
@@ -157,34 +695,26 @@ static size_t get_frame_length(struct lwan_request *request, uint16_t header)
     }
 }
 
-static void discard_frame(struct lwan_request *request, uint16_t header)
-{
-    size_t len = get_frame_length(request, header);
-
-    for (char buffer[128]; len;)
-        len -= (size_t)lwan_recv(request, buffer, sizeof(buffer), 0);
-}
+/* Unmasking is done by the widest routine the CPU supports, picked once
+ * at startup.  All of them process whole vectors from the start of the
+ * message (so the mask repeats the same way in every vector), leaving the
+ * remainder to a narrower one. */
+#if defined(__x86_64__) && defined(HAVE_BUILTIN_CPU_INIT)
+#if defined(HAVE_TARGET_AVX2)
+#define HAVE_UNMASK_AVX2
+#endif
+#if defined(HAVE_TARGET_AVX2) && defined(HAVE_TARGET_AVX512F)
+#define HAVE_UNMASK_AVX512
+#endif
+#endif
 
-static void unmask(char *msg, size_t msg_len, char mask[static 4])
+static void unmask_scalar(char *msg, size_t msg_len, const char mask[static 4])
 {
     const uint32_t mask32 = string_as_uint32(mask);
     char *msg_end = msg + msg_len;
 
     if (sizeof(void *) == 8) {
         const uint64_t mask64 = (uint64_t)mask32 << 32 | mask32;
-
-#if defined(__x86_64__)
-        const size_t len128 = msg_len / 16;
-        if (len128) {
-            const __m128i mask128 = _mm_setr_epi64((__m64)mask64, (__m64)mask64);
-            for (size_t i = 0; i < len128; i++) {
-                __m128i v = _mm_loadu_si128((__m128i *)msg);
-                _mm_storeu_si128((__m128i *)msg, _mm_xor_si128(v, mask128));
-                msg += 16;
-            }
-        }
-#endif
-
         const size_t len64 = (size_t)((msg_end - msg) / 8);
         for (size_t i = 0; i < len64; i++) {
             uint64_t v = string_as_uint64(msg);
@@ -210,29 +740,331 @@ static void unmask(char *msg, size_t msg_len, char mask[static 4])
     }
 }
 
-int lwan_response_websocket_read_hint(struct lwan_request *request, size_t size_hint)
+#if defined(__x86_64__)
+static void unmask_sse2(char *msg, size_t msg_len, const char mask[static 4])
 {
-    enum ws_opcode opcode = WS_OPCODE_INVALID;
-    enum ws_opcode last_opcode;
-    uint16_t header;
-    bool continuation = false;
+    const __m128i mask128 = _mm_set1_epi32((int)string_as_uint32(mask));
+    size_t i = 0;
 
-    if (!(request->conn->flags & CONN_IS_WEBSOCKET))
-        return ENOTCONN;
+    for (; i + 16 <= msg_len; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i *)(msg + i));
+        _mm_storeu_si128((__m128i *)(msg + i), _mm_xor_si128(v, mask128));
+    }
 
-    lwan_strbuf_reset_trim(request->response.buffer, size_hint);
+    unmask_scalar(msg + i, msg_len - i, mask);
+}
+#endif
 
-next_frame:
-    last_opcode = opcode;
+#if defined(HAVE_UNMASK_AVX2)
+__attribute__((target("avx2"))) static void
+unmask_avx2(char *msg, size_t msg_len, const char mask[static 4])
+{
+    const __m256i mask256 = _mm256_set1_epi32((int)string_as_uint32(mask));
+    size_t i = 0;
 
-    if (!lwan_recv(request, &header, sizeof(header), continuation ? 0 : MSG_DONTWAIT))
-        return EAGAIN;
+    for (; i + 64 <= msg_len; i += 64) {
+        __m256i v0 = _mm256_loadu_si256((__m256i *)(msg + i));
+        __m256i v1 = _mm256_loadu_si256((__m256i *)(msg + i + 32));
+        _mm256_storeu_si256((__m256i *)(msg + i), _mm256_xor_si256(v0, mask256));
+        _mm256_storeu_si256((__m256i *)(msg + i + 32),
+                            _mm256_xor_si256(v1, mask256));
+    }
+    if (i + 32 <= msg_len) {
+        __m256i v = _mm256_loadu_si256((__m256i *)(msg + i));
+        _mm256_storeu_si256((__m256i *)(msg + i), _mm256_xor_si256(v, mask256));
+        i += 32;
+    }
+
+    unmask_sse2(msg + i, msg_len - i, mask);
+}
+#endif
+
+#if defined(HAVE_UNMASK_AVX512)
+__attribute__((target("avx512f"))) static void
+unmask_avx512(char *msg, size_t msg_len, const char mask[static 4])
+{
+    const __m512i mask512 = _mm512_set1_epi32((int)string_as_uint32(mask));
+    size_t i = 0;
+
+    for (; i + 128 <= msg_len; i += 128) {
+        __m512i v0 = _mm512_loadu_si512((void *)(msg + i));
+        __m512i v1 = _mm512_loadu_si512((void *)(msg + i + 64));
+        _mm512_storeu_si512((void *)(msg + i), _mm512_xor_si512(v0, mask512));
+        _mm512_storeu_si512((void *)(msg + i + 64),
+                            _mm512_xor_si512(v1, mask512));
+    }
+
+    /* Masked stores would avoid this, but they're slower than narrower
+     * vectors for short payloads and tails. */
+    unmask_avx2(msg + i, msg_len - i, mask);
+}
+#endif
+
+size_t lwan_websocket_get_unmask_kernels(
+    struct lwan_websocket_unmask_kernel kernels[static 4])
+{
+    size_t n = 0;
+
+#if defined(HAVE_UNMASK_AVX2) || defined(HAVE_UNMASK_AVX512)
+    __builtin_cpu_init();
+#endif
+#if defined(HAVE_UNMASK_AVX512)
+    if (__builtin_cpu_supports("avx512f"))
+        kernels[n++] = (struct lwan_websocket_unmask_kernel){"avx512", unmask_avx512};
+#endif
+#if defined(HAVE_UNMASK_AVX2)
+    if (__builtin_cpu_supports("avx2"))
+        kernels[n++] = (struct lwan_websocket_unmask_kernel){"avx2", unmask_avx2};
+#endif
+#if defined(__x86_64__)
+    kernels[n++] = (struct lwan_websocket_unmask_kernel){"sse2", unmask_sse2};
+#endif
+    kernels[n++] = (struct lwan_websocket_unmask_kernel){"scalar", unmask_scalar};
+
+    return n;
+}
+
+static void (*unmask)(char *msg,
+                      size_t msg_len,
+                      const char mask[static 4]) = unmask_scalar;
+
+__attribute__((constructor)) static void initialize_unmask(void)
+{
+    struct lwan_websocket_unmask_kernel kernels[4];
+
+    lwan_websocket_get_unmask_kernels(kernels);
+    unmask = kernels[0].unmask;
+}
+
+/* Text messages must be valid UTF-8 (RFC6455 section 8.1).  Messages can
+ * be validated in pieces: the state packs how many continuation bytes are
+ * still expected (in the lowest byte) and the range the next one must be
+ * in (RFC3629 section 4), so that overlong encodings, surrogates, and code
+ * points past U+10FFFF are rejected as well. */
+static const unsigned char *skip_ascii(const unsigned char *s,
+                                      const unsigned char *end)
+{
+    const uint64_t high_bits = 0x8080808080808080ull;
+
+    while (end - s >= 16 && !((string_as_uint64((const char *)s) |
+                               string_as_uint64((const char *)s + 8)) &
+                              high_bits))
+        s += 16;
+    while (end - s >= 8 && !(string_as_uint64((const char *)s) & high_bits))
+        s += 8;
+
+    return s;
+}
+
+uint32_t lwan_websocket_validate_utf8(uint32_t state, const char *str, size_t len)
+{
+    const unsigned char *s = (const unsigned char *)str;
+    const unsigned char *end = s + len;
+    unsigned int remaining = state & 0xff;
+    unsigned int lo = (state >> 8) & 0xff;
+    unsigned int hi = (state >> 16) & 0xff;
+
+    if (UNLIKELY(state == LWAN_UTF8_REJECT))
+        return LWAN_UTF8_REJECT;
+    if (!remaining)
+        s = skip_ascii(s, end);
+
+    while (s < end) {
+        unsigned int c;
+
+        if (remaining) {
+            c = *s++;
+            if (UNLIKELY(c < lo || c > hi))
+                return LWAN_UTF8_REJECT;
+
+            remaining--;
+            lo = 0x80;
+            hi = 0xbf;
+            continue;
+        }
+
+        c = *s++;
+        if (c < 0x80) {
+            s = skip_ascii(s, end);
+            continue;
+        }
+
+        if (c < 0xc2) {
+            /* Continuation bytes, or overlong 2-byte sequences */
+            return LWAN_UTF8_REJECT;
+        } else if (c < 0xe0) {
+            remaining = 1;
+            lo = 0x80;
+            hi = 0xbf;
+        } else if (c < 0xf0) {
+            remaining = 2;
+            lo = c == 0xe0 ? 0xa0 : 0x80; /* Overlong */
+            hi = c == 0xed ? 0x9f : 0xbf; /* Surrogates */
+        } else if (c < 0xf5) {
+            remaining = 3;
+            lo = c == 0xf0 ? 0x90 : 0x80; /* Overlong */
+            hi = c == 0xf4 ? 0x8f : 0xbf; /* Past U+10FFFF */
+        } else {
+            return LWAN_UTF8_REJECT;
+        }
+    }
+
+    return remaining ? remaining | lo << 8 | hi << 16 : LWAN_UTF8_ACCEPT;
+}
+
+static void check_utf8(struct lwan_request *request, uint32_t state)
+{
+    /* RFC6455: ...MUST _Fail the WebSocket Connection_ */
+    if (UNLIKELY(state == LWAN_UTF8_REJECT)) {
+        lwan_status_debug("Text message isn't valid UTF-8, aborting");
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+}
+
+/* Messages can't end in the middle of a sequence, either. */
+static void check_utf8_end(struct lwan_request *request, uint32_t state)
+{
+    check_utf8(request,
+               state == LWAN_UTF8_ACCEPT ? LWAN_UTF8_ACCEPT : LWAN_UTF8_REJECT);
+}
+
+static void send_websocket_pong(struct lwan_request *request, uint16_t header)
+{
+    const size_t len = header & 0x7f;
+    char mask[4];
+    char temp[125];
+
+    /* Control frames can't be fragmented or use extended lengths. */
+    if (UNLIKELY(len > 125 || !(header & 0x8000))) {
+        lwan_status_debug("Received PING opcode with length %zu."
+                          "Max is 125. Aborting connection.",
+                          len);
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    struct iovec vec[] = {
+        {.iov_base = mask, .iov_len = sizeof(mask)},
+        {.iov_base = temp, .iov_len = len},
+    };
+    lwan_readv(request, vec, N_ELEMENTS(vec));
+    unmask(temp, len, mask);
+
+    write_websocket_frame(request, 0x80 | WS_OPCODE_PONG, temp, len);
+}
+
+static void discard_frame(struct lwan_request *request, uint16_t header)
+{
+    /* The masking key is discarded along with the payload. */
+    size_t len = get_frame_length(request, header) + 4;
+
+    for (char buffer[128]; len;) {
+        len -= (size_t)lwan_recv(request, buffer, LWAN_MIN(len, sizeof(buffer)),
+                                 0);
+    }
+}
+
+static const unsigned char ping_frame[] = {0x80 | WS_OPCODE_PING, 0};
+
+bool lwan_websocket_send_ping(int fd)
+{
+    return send(fd, ping_frame, sizeof(ping_frame),
+                MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t)sizeof(ping_frame);
+}
+
+/* Called by the I/O thread when a websocket connection becomes readable
+ * while its coroutine waits for a frame to start arriving (i.e. with
+ * CONN_WEBSOCKET_IDLE set).  If everything that has been received is
+ * complete pings and pongs, they're consumed and answered right here, and
+ * the coroutine doesn't have to be resumed.  Anything else (including
+ * malformed control frames, which fail the connection) is left for the
+ * coroutine to deal with in read_data_frame_header(). */
+enum lwan_websocket_control
+lwan_websocket_handle_control_frames(int fd)
+{
+    unsigned char in[256];
+    unsigned char out[sizeof(in)];
+    size_t in_len, out_len = 0;
+    ssize_t r;
+
+    r = recv(fd, in, sizeof(in), MSG_PEEK | MSG_DONTWAIT);
+    if (r <= 0)
+        return LWAN_WEBSOCKET_CONTROL_NOT_HANDLED;
+    in_len = (size_t)r;
+
+    for (size_t offset = 0; offset < in_len;) {
+        const unsigned char *frame = in + offset;
+        size_t len;
+
+        if (in_len - offset < 2)
+            return LWAN_WEBSOCKET_CONTROL_NOT_HANDLED;
+        if (frame[0] != (0x80 | WS_OPCODE_PING) &&
+            frame[0] != (0x80 | WS_OPCODE_PONG))
+            return LWAN_WEBSOCKET_CONTROL_NOT_HANDLED;
+        if (!(frame[1] & 0x80))
+            return LWAN_WEBSOCKET_CONTROL_NOT_HANDLED;
+
+        /* Lengths up to 125 are always encoded in the 7-bit field. */
+        len = frame[1] & 0x7f;
+        if (len > 125 || in_len - offset < 2 + 4 + len)
+            return LWAN_WEBSOCKET_CONTROL_NOT_HANDLED;
+
+        if (frame[0] == (0x80 | WS_OPCODE_PING)) {
+            char *payload = (char *)out + out_len + 2;
+
+            out[out_len] = 0x80 | WS_OPCODE_PONG;
+            out[out_len + 1] = (unsigned char)len;
+            memcpy(payload, frame + 6, len);
+            unmask(payload, len, (const char *)frame + 2);
+            out_len += 2 + len;
+        }
+
+        offset += 2 + 4 + len;
+    }
+
+    /* Pongs are sent before the pings are consumed, so the coroutine can
+     * still answer them if the socket buffer is full; a pong that's only
+     * partially sent, however, can't be completed by anyone. */
+    if (out_len) {
+        r = send(fd, out, out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (r < 0) {
+            return errno == EAGAIN ? LWAN_WEBSOCKET_CONTROL_NOT_HANDLED
+                                   : LWAN_WEBSOCKET_CONTROL_FAILED;
+        }
+        if ((size_t)r != out_len)
+            return LWAN_WEBSOCKET_CONTROL_FAILED;
+    }
+
+    if (recv(fd, in, in_len, MSG_DONTWAIT) != (ssize_t)in_len)
+        return LWAN_WEBSOCKET_CONTROL_FAILED;
+
+    return LWAN_WEBSOCKET_CONTROL_HANDLED;
+}
+
+/* Reads frame headers, answering or skipping control frames, until a data
+ * frame or a close frame arrives.  Only waits for one in the middle of a
+ * fragmented message; otherwise, returns false if none is available. */
+static bool read_data_frame_header(struct lwan_request *request,
+                                   bool in_message,
+                                   uint16_t *header_out,
+                                   enum ws_opcode *opcode_out)
+{
+    enum ws_opcode opcode;
+    uint16_t header;
+
+next_frame:
+    request->conn->flags &= ~CONN_WEBSOCKET_IDLE;
+    if (!lwan_recv(request, &header, sizeof(header),
+                   in_message ? 0 : MSG_DONTWAIT)) {
+        request->conn->flags |= CONN_WEBSOCKET_IDLE;
+        return false;
+    }
     header = htons(header);
-    continuation = false;
 
-    if (UNLIKELY(header & 0x7000)) {
-        lwan_status_debug("RSV1...RSV3 has non-zero value %d, aborting", header & 0x7000);
-        /* No extensions are supported yet, so fail connection per RFC6455. */
+    if (UNLIKELY(header & 0x3000)) {
+        lwan_status_debug("RSV2...RSV3 has non-zero value %d, aborting", header & 0x3000);
+        /* No extensions use these bits, so fail connection per RFC6455. */
         coro_yield(request->conn->coro, CONN_CORO_ABORT);
         __builtin_unreachable();
     }
@@ -243,19 +1075,34 @@ next_frame:
     }
 
     opcode = (header & 0x0f00) >> 8;
+
+    /* RSV1 marks messages compressed with permessage-deflate, and is only
+     * allowed in the first frame of a data message (RFC7692 section 6). */
+    if (UNLIKELY((header & 0x4000) &&
+                 (!request->helper->websocket_deflate ||
+                  (opcode != WS_OPCODE_TEXT && opcode != WS_OPCODE_BINARY)))) {
+        lwan_status_debug("Unexpected RSV1 bit in frame, aborting");
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
     switch (opcode) {
     case WS_OPCODE_CONTINUATION:
-        if (UNLIKELY(last_opcode > WS_OPCODE_BINARY)) {
-            /* Continuation frames are only available for opcodes [0..2] */
+        if (UNLIKELY(!in_message)) {
+            /* Continuation frames only follow non-final text or binary
+             * frames */
             coro_yield(request->conn->coro, CONN_CORO_ABORT);
             __builtin_unreachable();
         }
-
-        continuation = true;
         break;
 
     case WS_OPCODE_TEXT:
     case WS_OPCODE_BINARY:
+        if (UNLIKELY(in_message)) {
+            /* Messages can't be interleaved with the fragments of another */
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
         break;
 
     case WS_OPCODE_CLOSE:
@@ -263,7 +1110,7 @@ next_frame:
         break;
 
     case WS_OPCODE_PING:
-        send_websocket_pong(request, header & 0x7f);
+        send_websocket_pong(request, header);
         goto next_frame;
 
     case WS_OPCODE_PONG:
@@ -279,6 +1126,13 @@ next_frame:
         __builtin_unreachable();
     }
 
+    *header_out = header;
+    *opcode_out = opcode;
+    return true;
+}
+
+static void read_frame_payload(struct lwan_request *request, uint16_t header)
+{
     size_t frame_len = get_frame_length(request, header);
     char *msg = lwan_strbuf_extend_unsafe(request->response.buffer, frame_len);
     if (UNLIKELY(!msg)) {
@@ -293,11 +1147,170 @@ next_frame:
     };
     lwan_readv(request, vec, N_ELEMENTS(vec));
     unmask(msg, frame_len, mask);
+}
 
-    if (continuation && !(header & 0x8000))
-        goto next_frame;
+/* Appends the payload of a frame, and of the frames that follow it if the
+ * message is fragmented, to the response buffer. */
+static int read_message(struct lwan_request *request,
+                        uint16_t header,
+                        enum ws_opcode opcode)
+{
+    struct lwan_strbuf *buffer = request->response.buffer;
+    const bool compressed = header & 0x4000;
+    const bool text = opcode == WS_OPCODE_TEXT;
+    uint32_t utf8 = LWAN_UTF8_ACCEPT;
+
+    while (true) {
+        const size_t offset = lwan_strbuf_get_length(buffer);
+
+        read_frame_payload(request, header);
+
+        /* Validated frame by frame, while the payload is still in cache. */
+        if (text && !compressed) {
+            utf8 = lwan_websocket_validate_utf8(
+                utf8, lwan_strbuf_get_buffer(buffer) + offset,
+                lwan_strbuf_get_length(buffer) - offset);
+            check_utf8(request, utf8);
+        }
+
+        if ((header & 0x8000) || opcode == WS_OPCODE_CLOSE)
+            break;
+
+        read_data_frame_header(request, true, &header, &opcode);
+    }
+
+    if (!(request->conn->flags & CONN_IS_WEBSOCKET))
+        return ECONNRESET;
+
+    if (compressed) {
+        inflate_message(request);
+
+        if (text) {
+            utf8 = lwan_websocket_validate_utf8(utf8,
+                                                lwan_strbuf_get_buffer(buffer),
+                                                lwan_strbuf_get_length(buffer));
+        }
+    }
+
+    check_utf8_end(request, utf8);
+
+    return 0;
+}
+
+int lwan_response_websocket_read_hint(struct lwan_request *request, size_t size_hint)
+{
+    enum ws_opcode opcode;
+    uint16_t header;
+
+    if (!(request->conn->flags & CONN_IS_WEBSOCKET))
+        return ENOTCONN;
+
+    lwan_strbuf_reset_trim(request->response.buffer, size_hint);
+
+    if (!read_data_frame_header(request, false, &header, &opcode))
+        return EAGAIN;
+
+    return read_message(request, header, opcode);
+}
+
+struct lwan_websocket_stream {
+    size_t frame_left; /* Payload bytes yet to be read in this frame */
+    char mask[4];
+    size_t mask_offset;
+    uint32_t utf8; /* See lwan_websocket_validate_utf8() */
+    bool last_frame;
+    bool in_message;
+    bool text;
+};
+
+int lwan_response_websocket_read_partial(struct lwan_request *request,
+                                         size_t max_size,
+                                         bool *last)
+{
+    struct lwan_websocket_stream *stream = request->helper->websocket_stream;
+    struct lwan_strbuf *buffer = request->response.buffer;
+
+    if (!(request->conn->flags & CONN_IS_WEBSOCKET))
+        return ENOTCONN;
+    if (UNLIKELY(!max_size))
+        return EINVAL;
+
+    if (!stream) {
+        stream = coro_malloc(request->conn->coro, sizeof(*stream));
+        if (UNLIKELY(!stream))
+            return ENOMEM;
+
+        *stream = (struct lwan_websocket_stream){};
+        request->helper->websocket_stream = stream;
+    }
+
+    lwan_strbuf_reset_trim(buffer, max_size);
+
+    if (!stream->frame_left) {
+        enum ws_opcode opcode;
+        uint16_t header;
+
+        if (!read_data_frame_header(request, stream->in_message, &header,
+                                    &opcode))
+            return EAGAIN;
+
+        if (opcode == WS_OPCODE_CLOSE || (header & 0x4000)) {
+            /* Compressed messages are inflated whole, limited by
+             * max_post_data_size, rather than keeping a decompression
+             * stream around between calls. */
+            stream->in_message = false;
+            *last = true;
+            return read_message(request, header, opcode);
+        }
+
+        if (opcode != WS_OPCODE_CONTINUATION) {
+            stream->text = opcode == WS_OPCODE_TEXT;
+            stream->utf8 = LWAN_UTF8_ACCEPT;
+        }
+
+        stream->frame_left = get_frame_length(request, header);
+        stream->mask_offset = 0;
+        stream->last_frame = header & 0x8000;
+        stream->in_message = true;
+        lwan_recv(request, stream->mask, sizeof(stream->mask), 0);
+    }
+
+    const size_t len = LWAN_MIN(stream->frame_left, max_size);
+    if (len) {
+        char *fragment = lwan_strbuf_extend_unsafe(buffer, len);
+        char mask[4];
+
+        if (UNLIKELY(!fragment)) {
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+
+        lwan_recv(request, fragment, len, 0);
+
+        /* Rotate the mask so it lines up with where this piece starts. */
+        for (size_t i = 0; i < sizeof(mask); i++)
+            mask[i] = stream->mask[(stream->mask_offset + i) % sizeof(mask)];
+        unmask(fragment, len, mask);
+
+        stream->mask_offset = (stream->mask_offset + len) % sizeof(mask);
+        stream->frame_left -= len;
+
+        if (stream->text) {
+            stream->utf8 =
+                lwan_websocket_validate_utf8(stream->utf8, fragment, len);
+            check_utf8(request, stream->utf8);
+        }
+    }
+
+    *last = !stream->frame_left && stream->last_frame;
+    if (*last) {
+        stream->in_message = false;
+
+        if (stream->text)
+            check_utf8_end(request, stream->utf8);
+    }
 
-    return (request->conn->flags & CONN_IS_WEBSOCKET) ? 0 : ECONNRESET;
+    return 0;
 }
 
 inline int lwan_response_websocket_read(struct lwan_request *request)
@@ -26,18 +26,29 @@
 #include <fcntl.h>
 #include <libproc.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "lwan-private.h"
 
+#include "lwan-access-log.h"
 #include "lwan-config.h"
 #include "lwan-http-authorize.h"
+#include "lwan-probes.h"
+#include "lwan-rate-limit.h"
+#include "lwan-response-cache.h"
+#include "lwan-shared-dict.h"
+#include "sd-daemon.h"
 
 #if defined(HAVE_LUA)
 #include "lwan-lua.h"
@@ -55,6 +66,11 @@ clockid_t monotonic_clock_id = CLOCK_MONOTONIC;
 static const struct lwan_config default_config = {
     .listener = "localhost:8080",
     .keep_alive_timeout = 15,
+    .send_timeout = 0,
+    .min_send_rate = 0,
+    .send_rate_from_tcp_info = false,
+    .evict_idle_fd_watermark = 0,
+    .evict_idle_memory_watermark = 0,
     .quiet = false,
     .reuse_port = false,
     .proxy_protocol = false,
@@ -64,7 +80,35 @@ static const struct lwan_config default_config = {
     .max_post_data_size = 10 * DEFAULT_BUFFER_SIZE,
     .allow_post_temp_file = false,
     .max_put_data_size = 10 * DEFAULT_BUFFER_SIZE,
+    .max_request_header_size = 4 * DEFAULT_BUFFER_SIZE,
     .allow_put_temp_file = false,
+    .use_io_uring = false,
+    .per_thread_listeners = false,
+    .load_aware_scheduling = false,
+    .work_stealing = false,
+    .edge_triggered_events = false,
+    .max_connections_per_thread = 0,
+    .max_pending_per_thread = 0,
+    .pause_accept_on_overload = false,
+    .busy_poll_us = 0,
+    .busy_poll_sockets = false,
+    .thread_affinity = LWAN_AFFINITY_CPU,
+    .numa_aware = false,
+    .huge_pages = false,
+    .coro_pool_size = 0,
+    .park_idle_connections = false,
+    .coro_stack_size = 0,
+    .measure_stack_usage = false,
+    .drain_timeout = 30,
+    .pipeline_buffer_size = 0,
+    .zerocopy_threshold = 0,
+    .slow_request_threshold = 0,
+    .low_priority_resumes_per_loop = 32,
+    .http2 = false,
+    .websocket_deflate = false,
+    .websocket_deflate_context_takeover = false,
+    .websocket_deflate_window_bits = 15,
+    .websocket_ping = false,
 };
 
 LWAN_HANDLER(brew_coffee)
@@ -104,6 +148,7 @@ static const struct lwan_module *find_module(const char *name)
 static void destroy_urlmap(void *data)
 {
     struct lwan_url_map *url_map = data;
+    struct lwan_url_map *next_method = url_map->next_method;
 
     if (url_map->module) {
         const struct lwan_module *module = url_map->module;
@@ -114,10 +159,24 @@ static void destroy_urlmap(void *data)
         hash_free(url_map->data);
     }
 
+    if (url_map->stack_high_water_mark) {
+        lwan_status_info("Coroutine stack high-water mark for %s: %zu of %zu "
+                         "bytes",
+                         url_map->prefix, url_map->stack_high_water_mark,
+                         coro_get_stack_size());
+    }
+
     free(url_map->authorization.realm);
     free(url_map->authorization.password_file);
+    lwan_rate_limit_free(url_map->rate_limit);
+    lwan_response_cache_free(url_map->response_cache);
+    lwan_compress_dict_put(url_map->compress_dict);
+    lwan_route_stats_free(url_map->stats);
     free((char *)url_map->prefix);
     free(url_map);
+
+    if (next_method)
+        destroy_urlmap(next_method);
 }
 
 static struct lwan_url_map *add_url_map(struct lwan_trie *t, const char *prefix,
@@ -135,6 +194,19 @@ static struct lwan_url_map *add_url_map(struct lwan_trie *t, const char *prefix,
         lwan_status_critical_perror("Could not copy URL prefix");
 
     copy->prefix_len = strlen(copy->prefix);
+    copy->next_method = NULL;
+
+    /* Maps restricted to some methods don't replace maps for the same
+     * prefix; they're tried in the order they were declared. */
+    struct lwan_url_map *existing = lwan_trie_lookup_prefix(t, copy->prefix);
+    if (existing && streq(existing->prefix, copy->prefix) &&
+        (existing->methods || copy->methods)) {
+        while (existing->next_method)
+            existing = existing->next_method;
+        existing->next_method = copy;
+        return copy;
+    }
+
     lwan_trie_add(t, copy->prefix, copy);
 
     return copy;
@@ -157,6 +229,8 @@ static bool can_override_header(const char *name)
         return false;
     if (!strcasecmp(name, "Transfer-Encoding"))
         return false;
+    if (!strcasecmp(name, "Content-Encoding"))
+        return false;
     if (!strncasecmp(name, "Access-Control-Allow-",
                      sizeof("Access-Control-Allow-") - 1))
         return false;
@@ -191,6 +265,58 @@ static void build_response_headers(struct lwan *l,
     lwan_strbuf_append_strz(&l->headers, "\r\n\r\n");
 }
 
+static void parse_shared_dict(struct config *c, const struct config_line *l)
+{
+    struct lwan_shared_dict *dict;
+    long max_entries = 1024;
+    char *name;
+
+    if (!l->value || !*l->value) {
+        config_error(c, "Shared dictionaries must be given a name");
+        return;
+    }
+
+    name = strdupa(l->value);
+
+    while ((l = config_read_line(c))) {
+        switch (l->type) {
+        case CONFIG_LINE_TYPE_LINE:
+            if (streq(l->key, "max_entries")) {
+                max_entries = parse_long(l->value, 0);
+                if (max_entries <= 0) {
+                    config_error(c, "Invalid maximum number of entries: %ld",
+                                 max_entries);
+                    return;
+                }
+            } else {
+                config_error(c, "Unknown shared dictionary option: %s", l->key);
+                return;
+            }
+            break;
+
+        case CONFIG_LINE_TYPE_SECTION:
+            config_error(c, "No sections are supported under a shared "
+                            "dictionary section");
+            return;
+
+        case CONFIG_LINE_TYPE_SECTION_END:
+            dict = lwan_shared_dict_new((size_t)max_entries);
+            if (!dict) {
+                lwan_status_critical_perror(
+                    "Could not create shared dictionary %s", name);
+            }
+
+            if (!lwan_shared_dict_register(name, dict)) {
+                lwan_shared_dict_free(dict);
+                config_error(c, "Shared dictionary %s already declared", name);
+            }
+            return;
+        }
+    }
+
+    config_error(c, "Expecting section end while parsing shared dictionary");
+}
+
 static void parse_global_headers(struct config *c,
                                  struct lwan *lwan)
 {
@@ -312,9 +438,48 @@ static const char *get_module_name(const struct lwan_module *module)
     return "<unknown>";
 }
 
+static bool parse_methods(const char *value, uint32_t *methods)
+{
+    char *names = strdupa(value);
+    char *saveptr;
+
+    *methods = 0;
+
+    for (char *name = strtok_r(names, " \t,", &saveptr); name;
+         name = strtok_r(NULL, " \t,", &saveptr)) {
+#define PARSE_METHOD(upper, lower, mask, constant)                             \
+    if (!strcasecmp(name, #upper)) {                                           \
+        *methods |= 1u << REQUEST_METHOD_##upper;                              \
+        continue;                                                              \
+    }
+        FOR_EACH_REQUEST_METHOD(PARSE_METHOD)
+#undef PARSE_METHOD
+
+        return false;
+    }
+
+    return *methods != 0;
+}
+
+static bool parse_priority(const char *value,
+                           enum lwan_handler_priority *priority)
+{
+    if (!strcasecmp(value, "high"))
+        *priority = HANDLER_PRIORITY_HIGH;
+    else if (!strcasecmp(value, "normal"))
+        *priority = HANDLER_PRIORITY_NORMAL;
+    else if (!strcasecmp(value, "low"))
+        *priority = HANDLER_PRIORITY_LOW;
+    else
+        return false;
+
+    return true;
+}
+
 static void parse_listener_prefix(struct config *c,
                                   const struct config_line *l,
                                   struct lwan *lwan,
+                                  struct lwan_trie *url_map_trie,
                                   const struct lwan_module *module,
                                   void *handler)
 {
@@ -341,6 +506,19 @@ static void parse_listener_prefix(struct config *c,
         case CONFIG_LINE_TYPE_SECTION:
             if (streq(l->key, "authorization")) {
                 parse_listener_prefix_authorization(c, l, &url_map);
+            } else if (streq(l->key, "rate_limit")) {
+                lwan_rate_limit_free(url_map.rate_limit);
+                url_map.rate_limit = lwan_rate_limit_new_from_config(c);
+                if (!url_map.rate_limit)
+                    goto out;
+                url_map.flags |= HANDLER_RATE_LIMITED;
+            } else if (streq(l->key, "response_cache")) {
+                lwan_response_cache_free(url_map.response_cache);
+                url_map.response_cache =
+                    lwan_response_cache_new_from_config(c);
+                if (!url_map.response_cache)
+                    goto out;
+                url_map.flags |= HANDLER_CACHES_RESPONSE;
             } else if (!config_skip_section(c, l)) {
                 config_error(c, "Could not skip section");
                 goto out;
@@ -358,6 +536,70 @@ static void parse_listener_prefix(struct config *c,
 add_map:
     assert((handler && !module) || (!handler && module));
 
+    const char *stack_size = hash_find(hash, "coro_stack_size");
+    if (stack_size) {
+        long size = parse_long(stack_size, 0);
+
+        if (size <= 0 || size > 16 * (1 << 20)) {
+            config_error(c, "Invalid coroutine stack size: %s", stack_size);
+            goto out;
+        }
+
+        url_map.coro_stack_size = (size_t)size;
+        lwan->config.handler_coro_stack_size =
+            LWAN_MAX(lwan->config.handler_coro_stack_size, (size_t)size);
+    }
+
+    /* Read before the hash table is handed over to the handler below. */
+    const bool stream_request_body =
+        parse_bool(hash_find(hash, "stream_request_body"), false);
+    const bool compress_response =
+        parse_bool(hash_find(hash, "compress_response"), false);
+    const char *dict_path = hash_find(hash, "compression_dictionary");
+    const char *dict_url = hash_find(hash, "compression_dictionary_url");
+    if (dict_path) {
+        url_map.compress_dict = lwan_compress_dict_get(dict_path);
+        if (!url_map.compress_dict) {
+            config_error(c, "Could not load compression dictionary: %s",
+                         dict_path);
+            goto out;
+        }
+
+        if (dict_url) {
+            if (*dict_url != '/') {
+                config_error(c, "Compression dictionary URL must be a "
+                                "path: %s",
+                             dict_url);
+                goto out;
+            }
+            if (!lwan_compress_dict_serve_at(url_map.compress_dict, dict_url,
+                                             prefix)) {
+                config_error(c, "Compression dictionary %s is already "
+                                "served at another URL",
+                             dict_path);
+                goto out;
+            }
+        }
+    } else if (dict_url) {
+        config_error(c, "compression_dictionary_url needs a "
+                        "compression_dictionary");
+        goto out;
+    }
+    const char *methods = hash_find(hash, "methods");
+    if (methods && !parse_methods(methods, &url_map.methods)) {
+        config_error(c, "Invalid list of methods: %s", methods);
+        goto out;
+    }
+    const char *priority = hash_find(hash, "priority");
+    if (priority) {
+        if (!parse_priority(priority, &url_map.priority)) {
+            config_error(c, "Invalid priority: %s", priority);
+            goto out;
+        }
+        if (url_map.priority != HANDLER_PRIORITY_NORMAL)
+            lwan->config.schedule_by_priority = true;
+    }
+
     if (handler) {
         url_map.handler = handler;
         url_map.flags |= HANDLER_PARSE_MASK | HANDLER_DATA_IS_HASH_TABLE;
@@ -394,21 +636,45 @@ add_map:
         goto out;
     }
 
-    add_url_map(&lwan->url_map_trie, prefix, &url_map);
+    if (stream_request_body)
+        url_map.flags |= HANDLER_STREAMS_BODY_DATA;
+    if (compress_response)
+        url_map.flags |= HANDLER_COMPRESS_RESPONSE;
+
+    if (dict_url) {
+        /* Takes a reference of its own, as it's destroyed separately. */
+        add_url_map(url_map_trie, dict_url,
+                    &(struct lwan_url_map){
+                        .handler = lwan_compress_dict_serve,
+                        .data = url_map.compress_dict,
+                        .compress_dict =
+                            lwan_compress_dict_get(dict_path),
+                    });
+    }
+
+    add_url_map(url_map_trie, prefix, &url_map);
+    url_map.compress_dict = NULL;
 
 out:
+    lwan_compress_dict_put(url_map.compress_dict);
     hash_free(hash);
     config_close(isolated);
 }
 
 void lwan_set_url_map(struct lwan *l, const struct lwan_url_map *map)
 {
-    lwan_trie_destroy(&l->url_map_trie);
-    if (UNLIKELY(!lwan_trie_init(&l->url_map_trie, destroy_urlmap)))
+    /* Maps set through this function always apply to the first listener. */
+    struct lwan_trie *trie = &l->listeners[0].url_map_trie;
+
+    lwan_trie_destroy(trie);
+    if (UNLIKELY(!lwan_trie_init(trie, destroy_urlmap)))
         lwan_status_critical_perror("Could not initialize trie");
 
     for (; map->prefix; map++) {
-        struct lwan_url_map *copy = add_url_map(&l->url_map_trie, NULL, map);
+        struct lwan_url_map *copy = add_url_map(trie, NULL, map);
+
+        if (copy->priority != HANDLER_PRIORITY_NORMAL)
+            l->config.schedule_by_priority = true;
 
         if (copy->module && copy->module->create) {
             lwan_status_debug("Initializing module %s from struct",
@@ -423,17 +689,156 @@ void lwan_set_url_map(struct lwan *l, const struct lwan_url_map *map)
             copy->flags = copy->module->flags;
             copy->handler = copy->module->handle_request;
         } else {
-            copy->flags = HANDLER_PARSE_MASK;
+            copy->flags =
+                HANDLER_PARSE_MASK | (map->flags & HANDLER_STREAMS_BODY_DATA);
         }
     }
 }
 
-static void parse_listener(struct config *c,
-                           const struct config_line *l,
-                           struct lwan *lwan)
+static struct lwan_listener *add_listener(struct lwan *l, const char *address)
+{
+    struct lwan_listener *listener;
+
+    if (l->n_listeners == LWAN_MAX_LISTENERS)
+        return NULL;
+
+    listener = &l->listeners[l->n_listeners++];
+    *listener = (struct lwan_listener){.address = strdup(address), .fd = -1};
+    if (!listener->address)
+        lwan_status_critical_perror("strdup");
+
+    if (!lwan_trie_init(&listener->url_map_trie, destroy_urlmap))
+        lwan_status_critical_perror("Could not initialize trie");
+
+    return listener;
+}
+
+static void setup_listener_tls(struct config *c,
+                               const struct lwan *lwan,
+                               struct lwan_listener *listener,
+                               const char *certificate,
+                               const char *private_key)
+{
+#if defined(HAVE_KTLS)
+    if (!certificate || !private_key) {
+        config_error(c, "Both tls_certificate and tls_private_key are needed");
+        return;
+    }
+
+    /* Kernel TLS is only available for TCP sockets. */
+    if (lwan_socket_is_unix_address(listener->address)) {
+        config_error(c, "TLS can't be used with Unix domain socket listeners");
+        return;
+    }
+
+    /* Files are loaded right away, in case the straitjacket drops the
+     * privileges needed to read them. */
+    listener->tls = lwan_tls_context_new(lwan, certificate, private_key);
+    if (!listener->tls)
+        config_error(c, "Could not set up TLS for listener %s",
+                     listener->address);
+#else
+    (void)lwan;
+    (void)listener;
+    (void)certificate;
+    (void)private_key;
+
+    config_error(c, "Lwan has been built without kernel TLS support");
+#endif
+}
+
+static bool parse_url_map_section(struct config *c,
+                                  const struct config_line *l,
+                                  struct lwan *lwan,
+                                  struct lwan_trie *url_map_trie)
+{
+    if (l->key[0] == '&') {
+        void *handler = find_handler(l->key + 1);
+        if (handler) {
+            parse_listener_prefix(c, l, lwan, url_map_trie, NULL, handler);
+            return true;
+        }
+
+        config_error(c, "Could not find handler name: %s", l->key + 1);
+        return false;
+    }
+
+    const struct lwan_module *module = find_module(l->key);
+    if (module) {
+        parse_listener_prefix(c, l, lwan, url_map_trie, module, NULL);
+        return true;
+    }
+
+    config_error(c, "Invalid section or module not found: %s", l->key);
+    return false;
+}
+
+static struct lwan_trie *add_virtual_host(struct lwan_listener *listener)
+{
+    struct lwan_trie **tries;
+    struct lwan_trie *trie;
+
+    if (!listener->virtual_hosts) {
+        listener->virtual_hosts = hash_str_new(free, NULL);
+        if (!listener->virtual_hosts)
+            lwan_status_critical_perror("Could not allocate hash table");
+    }
+
+    tries = reallocarray(listener->virtual_host_tries,
+                         listener->n_virtual_hosts + 1, sizeof(*tries));
+    if (!tries)
+        lwan_status_critical_perror("Could not allocate virtual host");
+    listener->virtual_host_tries = tries;
+
+    trie = malloc(sizeof(*trie));
+    if (!trie || !lwan_trie_init(trie, destroy_urlmap))
+        lwan_status_critical_perror("Could not initialize trie");
+
+    tries[listener->n_virtual_hosts++] = trie;
+    return trie;
+}
+
+static void parse_virtual_host(struct config *c,
+                               const struct config_line *l,
+                               struct lwan *lwan,
+                               struct lwan_listener *listener)
 {
-    free(lwan->config.listener);
-    lwan->config.listener = strdup(l->value);
+    struct lwan_trie *trie = add_virtual_host(listener);
+    char *names = strdupa(l->value);
+    char *saveptr;
+    bool has_names = false;
+
+    for (char *name = strtok_r(names, " \t,", &saveptr); name;
+         name = strtok_r(NULL, " \t,", &saveptr)) {
+        size_t len = strlen(name);
+        char *key;
+
+        if (len && name[len - 1] == '.')
+            name[--len] = '\0';
+        if (!len || len >= LWAN_VIRTUAL_HOST_NAME_MAX) {
+            config_error(c, "Invalid virtual host name: %s", name);
+            return;
+        }
+
+        key = strdup(name);
+        if (!key)
+            lwan_status_critical_perror("strdup");
+        for (char *p = key; *p; p++)
+            *p = (char)tolower((unsigned char)*p);
+
+        if (hash_add_unique(listener->virtual_hosts, key, trie) < 0) {
+            config_error(c, "Virtual host %s declared more than once", key);
+            free(key);
+            return;
+        }
+
+        has_names = true;
+    }
+
+    if (!has_names) {
+        config_error(c, "Virtual hosts must be given at least one name");
+        return;
+    }
 
     while ((l = config_read_line(c))) {
         switch (l->type) {
@@ -441,31 +846,77 @@ static void parse_listener(struct config *c,
             config_error(c, "Expecting prefix section");
             return;
         case CONFIG_LINE_TYPE_SECTION:
-            if (l->key[0] == '&') {
-                void *handler = find_handler(l->key + 1);
-                if (handler) {
-                    parse_listener_prefix(c, l, lwan, NULL, handler);
-                    continue;
-                }
-
-                config_error(c, "Could not find handler name: %s", l->key + 1);
+            if (!parse_url_map_section(c, l, lwan, trie))
                 return;
-            }
+            break;
+        case CONFIG_LINE_TYPE_SECTION_END:
+            return;
+        }
+    }
+
+    config_error(c, "Expecting section end while parsing virtual host");
+}
+
+static void parse_listener(struct config *c,
+                           const struct config_line *l,
+                           struct lwan *lwan)
+{
+    struct lwan_listener *listener = add_listener(lwan, l->value);
+    char *tls_certificate = NULL, *tls_private_key = NULL;
 
-            const struct lwan_module *module = find_module(l->key);
-            if (module) {
-                parse_listener_prefix(c, l, lwan, module, NULL);
+    if (!listener) {
+        config_error(c, "At most %d listeners are supported",
+                     LWAN_MAX_LISTENERS);
+        return;
+    }
+
+    while ((l = config_read_line(c))) {
+        switch (l->type) {
+        case CONFIG_LINE_TYPE_LINE:
+            if (streq(l->key, "threads")) {
+                long n_threads = parse_long(l->value, 0);
+                if (n_threads < 0 || n_threads > 255) {
+                    config_error(c, "Invalid number of threads: %ld",
+                                 n_threads);
+                    goto out;
+                }
+                listener->n_threads = (unsigned int)n_threads;
+                continue;
+            }
+            if (streq(l->key, "tls_certificate")) {
+                free(tls_certificate);
+                tls_certificate = strdup(l->value);
+                continue;
+            }
+            if (streq(l->key, "tls_private_key")) {
+                free(tls_private_key);
+                tls_private_key = strdup(l->value);
                 continue;
             }
 
-            config_error(c, "Invalid section or module not found: %s", l->key);
-            return;
+            config_error(c, "Expecting prefix section");
+            goto out;
+        case CONFIG_LINE_TYPE_SECTION:
+            if (streq(l->key, "virtual_host")) {
+                parse_virtual_host(c, l, lwan, listener);
+                continue;
+            }
+            if (!parse_url_map_section(c, l, lwan, &listener->url_map_trie))
+                goto out;
+            continue;
         case CONFIG_LINE_TYPE_SECTION_END:
-            return;
+            if (tls_certificate || tls_private_key)
+                setup_listener_tls(c, lwan, listener, tls_certificate,
+                                   tls_private_key);
+            goto out;
         }
     }
 
     config_error(c, "Expecting section end while parsing listener");
+
+out:
+    free(tls_certificate);
+    free(tls_private_key);
 }
 
 const char *lwan_get_config_path(char *path_buf, size_t path_buf_len)
@@ -492,7 +943,6 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
 {
     const struct config_line *line;
     struct config *conf;
-    bool has_listener = false;
     char path_buf[PATH_MAX];
 
     if (!path)
@@ -503,9 +953,6 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
     if (!conf)
         return false;
 
-    if (!lwan_trie_init(&lwan->url_map_trie, destroy_urlmap))
-        return false;
-
     while ((line = config_read_line(conf))) {
         switch (line->type) {
         case CONFIG_LINE_TYPE_LINE:
@@ -521,6 +968,18 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
             } else if (streq(line->key, "proxy_protocol")) {
                 lwan->config.proxy_protocol =
                     parse_bool(line->value, default_config.proxy_protocol);
+            } else if (streq(line->key, "work_stealing")) {
+                lwan->config.work_stealing =
+                    parse_bool(line->value, default_config.work_stealing);
+            } else if (streq(line->key, "load_aware_scheduling")) {
+                lwan->config.load_aware_scheduling = parse_bool(
+                    line->value, default_config.load_aware_scheduling);
+            } else if (streq(line->key, "per_thread_listeners")) {
+                lwan->config.per_thread_listeners = parse_bool(
+                    line->value, default_config.per_thread_listeners);
+            } else if (streq(line->key, "use_io_uring")) {
+                lwan->config.use_io_uring =
+                    parse_bool(line->value, default_config.use_io_uring);
             } else if (streq(line->key, "allow_cors")) {
                 lwan->config.allow_cors =
                     parse_bool(line->value, default_config.allow_cors);
@@ -537,6 +996,175 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
                     config_error(conf, "Invalid number of threads: %ld",
                                  n_threads);
                 lwan->config.n_threads = (unsigned int)n_threads;
+            } else if (streq(line->key, "max_connections_per_thread")) {
+                long max_conns = parse_long(
+                    line->value, default_config.max_connections_per_thread);
+                if (max_conns < 0)
+                    config_error(conf, "Invalid maximum connections: %ld",
+                                 max_conns);
+                lwan->config.max_connections_per_thread =
+                    (unsigned int)max_conns;
+            } else if (streq(line->key, "max_pending_per_thread")) {
+                long max_pending = parse_long(
+                    line->value, default_config.max_pending_per_thread);
+                if (max_pending < 0)
+                    config_error(conf, "Invalid maximum pending connections: %ld",
+                                 max_pending);
+                lwan->config.max_pending_per_thread = (unsigned int)max_pending;
+            } else if (streq(line->key, "pause_accept_on_overload")) {
+                lwan->config.pause_accept_on_overload = parse_bool(
+                    line->value, default_config.pause_accept_on_overload);
+            } else if (streq(line->key, "busy_poll_us")) {
+                long busy_poll_us =
+                    parse_long(line->value, default_config.busy_poll_us);
+                if (busy_poll_us < 0 || busy_poll_us > 1000000)
+                    config_error(conf, "Invalid busy polling window: %ld",
+                                 busy_poll_us);
+                lwan->config.busy_poll_us = (unsigned int)busy_poll_us;
+            } else if (streq(line->key, "coro_pool_size")) {
+                long pool_size =
+                    parse_long(line->value, default_config.coro_pool_size);
+                if (pool_size < 0)
+                    config_error(conf, "Invalid coroutine pool size: %ld",
+                                 pool_size);
+                lwan->config.coro_pool_size = (unsigned int)pool_size;
+            } else if (streq(line->key, "coro_stack_size")) {
+                long stack_size =
+                    parse_long(line->value, default_config.coro_stack_size);
+                if (stack_size < 0 || stack_size > 16 * (1 << 20))
+                    config_error(conf, "Invalid coroutine stack size: %ld",
+                                 stack_size);
+                lwan->config.coro_stack_size = (unsigned int)stack_size;
+            } else if (streq(line->key, "pipeline_buffer_size")) {
+                long buffer_size = parse_long(
+                    line->value, default_config.pipeline_buffer_size);
+                if (buffer_size < 0 || buffer_size > 1 << 20)
+                    config_error(conf, "Invalid pipeline buffer size: %ld",
+                                 buffer_size);
+                lwan->config.pipeline_buffer_size = (unsigned int)buffer_size;
+            } else if (streq(line->key, "zerocopy_threshold")) {
+                long threshold = parse_long(
+                    line->value, default_config.zerocopy_threshold);
+                if (threshold < 0 || threshold > INT_MAX)
+                    config_error(conf, "Invalid zerocopy threshold: %ld",
+                                 threshold);
+                lwan->config.zerocopy_threshold = (unsigned int)threshold;
+            } else if (streq(line->key, "slow_request_threshold")) {
+                long threshold = parse_long(
+                    line->value, default_config.slow_request_threshold);
+                if (threshold < 0 || threshold > 3600000)
+                    config_error(conf, "Invalid slow request threshold: %ld",
+                                 threshold);
+                lwan->config.slow_request_threshold = (unsigned int)threshold;
+            } else if (streq(line->key, "low_priority_resumes_per_loop")) {
+                long resumes = parse_long(
+                    line->value, default_config.low_priority_resumes_per_loop);
+                if (resumes < 1 || resumes > 1 << 20)
+                    config_error(conf,
+                                 "Invalid number of low priority resumes "
+                                 "per loop: %ld",
+                                 resumes);
+                lwan->config.low_priority_resumes_per_loop =
+                    (unsigned int)resumes;
+            } else if (streq(line->key, "drain_timeout")) {
+                long drain_timeout =
+                    parse_long(line->value, default_config.drain_timeout);
+                if (drain_timeout < 0 || drain_timeout > 3600)
+                    config_error(conf, "Invalid drain timeout: %ld",
+                                 drain_timeout);
+                lwan->config.drain_timeout = (unsigned int)drain_timeout;
+            } else if (streq(line->key, "send_timeout")) {
+                long send_timeout =
+                    parse_long(line->value, default_config.send_timeout);
+                if (send_timeout < 0 || send_timeout > 3600)
+                    config_error(conf, "Invalid send timeout: %ld",
+                                 send_timeout);
+                lwan->config.send_timeout = (unsigned int)send_timeout;
+            } else if (streq(line->key, "min_send_rate")) {
+                long min_send_rate =
+                    parse_long(line->value, default_config.min_send_rate);
+                if (min_send_rate < 0 || min_send_rate > INT_MAX)
+                    config_error(conf, "Invalid minimum send rate: %ld",
+                                 min_send_rate);
+                lwan->config.min_send_rate = (unsigned int)min_send_rate;
+            } else if (streq(line->key, "send_rate_from_tcp_info")) {
+                lwan->config.send_rate_from_tcp_info = parse_bool(
+                    line->value, default_config.send_rate_from_tcp_info);
+            } else if (streq(line->key, "evict_idle_fd_watermark")) {
+                long watermark = parse_long(
+                    line->value, default_config.evict_idle_fd_watermark);
+                if (watermark < 0 || watermark > 100)
+                    config_error(conf, "Invalid file descriptor watermark: %ld",
+                                 watermark);
+                lwan->config.evict_idle_fd_watermark = (unsigned int)watermark;
+            } else if (streq(line->key, "evict_idle_memory_watermark")) {
+                long watermark = parse_long(
+                    line->value, default_config.evict_idle_memory_watermark);
+                if (watermark < 0 || watermark > INT_MAX)
+                    config_error(conf, "Invalid memory watermark: %ld",
+                                 watermark);
+                lwan->config.evict_idle_memory_watermark =
+                    (unsigned int)watermark;
+            } else if (streq(line->key, "measure_stack_usage")) {
+                lwan->config.measure_stack_usage = parse_bool(
+                    line->value, default_config.measure_stack_usage);
+            } else if (streq(line->key, "http2")) {
+                lwan->config.http2 =
+                    parse_bool(line->value, default_config.http2);
+            } else if (streq(line->key, "websocket_deflate")) {
+                lwan->config.websocket_deflate =
+                    parse_bool(line->value, default_config.websocket_deflate);
+            } else if (streq(line->key, "websocket_deflate_context_takeover")) {
+                lwan->config.websocket_deflate_context_takeover = parse_bool(
+                    line->value,
+                    default_config.websocket_deflate_context_takeover);
+            } else if (streq(line->key, "websocket_deflate_window_bits")) {
+                long window_bits = parse_long(
+                    line->value, default_config.websocket_deflate_window_bits);
+                /* zlib can't produce raw deflate streams with 8-bit windows. */
+                if (window_bits < 9 || window_bits > 15)
+                    config_error(conf, "Invalid websocket deflate window bits: %ld",
+                                 window_bits);
+                lwan->config.websocket_deflate_window_bits =
+                    (unsigned int)window_bits;
+            } else if (streq(line->key, "websocket_ping")) {
+                lwan->config.websocket_ping =
+                    parse_bool(line->value, default_config.websocket_ping);
+            } else if (streq(line->key, "edge_triggered_events")) {
+                lwan->config.edge_triggered_events = parse_bool(
+                    line->value, default_config.edge_triggered_events);
+            } else if (streq(line->key, "park_idle_connections")) {
+                lwan->config.park_idle_connections = parse_bool(
+                    line->value, default_config.park_idle_connections);
+            } else if (streq(line->key, "thread_affinity")) {
+                static const char *const policies[] = {
+                    [LWAN_AFFINITY_CPU] = "cpu",
+                    [LWAN_AFFINITY_CORE] = "core",
+                    [LWAN_AFFINITY_CLUSTER] = "cluster",
+                    [LWAN_AFFINITY_NODE] = "node",
+                    [LWAN_AFFINITY_NONE] = "none",
+                };
+                size_t i;
+
+                for (i = 0; i < N_ELEMENTS(policies); i++) {
+                    if (streq(line->value, policies[i])) {
+                        lwan->config.thread_affinity =
+                            (enum lwan_thread_affinity)i;
+                        break;
+                    }
+                }
+                if (i == N_ELEMENTS(policies))
+                    config_error(conf, "Unknown thread affinity: %s",
+                                 line->value);
+            } else if (streq(line->key, "numa_aware")) {
+                lwan->config.numa_aware =
+                    parse_bool(line->value, default_config.numa_aware);
+            } else if (streq(line->key, "huge_pages")) {
+                lwan->config.huge_pages =
+                    parse_bool(line->value, default_config.huge_pages);
+            } else if (streq(line->key, "busy_poll_sockets")) {
+                lwan->config.busy_poll_sockets =
+                    parse_bool(line->value, default_config.busy_poll_sockets);
             } else if (streq(line->key, "max_post_data_size")) {
                 long max_post_data_size = parse_long(
                     line->value, (long)default_config.max_post_data_size);
@@ -555,6 +1183,18 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
                     config_error(conf,
                                  "Maximum put data can't be over 128MiB");
                 lwan->config.max_put_data_size = (size_t)max_put_data_size;
+            } else if (streq(line->key, "max_request_header_size")) {
+                long max_request_header_size = parse_long(
+                    line->value, (long)default_config.max_request_header_size);
+                if (max_request_header_size < REQUEST_BUFFER_SIZE)
+                    config_error(conf, "Maximum request header size can't be "
+                                       "under %d bytes",
+                                 REQUEST_BUFFER_SIZE);
+                else if (max_request_header_size > 1 << 20)
+                    config_error(conf, "Maximum request header size can't be "
+                                       "over 1MiB");
+                lwan->config.max_request_header_size =
+                    (size_t)max_request_header_size;
             } else if (streq(line->key, "allow_temp_files")) {
                 bool has_post, has_put;
 
@@ -573,16 +1213,15 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
             break;
         case CONFIG_LINE_TYPE_SECTION:
             if (streq(line->key, "listener")) {
-                if (!has_listener) {
-                    parse_listener(conf, line, lwan);
-                    has_listener = true;
-                } else {
-                    config_error(conf, "Only one listener supported");
-                }
+                parse_listener(conf, line, lwan);
             } else if (streq(line->key, "straitjacket")) {
                 lwan_straitjacket_enforce_from_config(conf);
             } else if (streq(line->key, "headers")) {
                 parse_global_headers(conf, lwan);
+            } else if (streq(line->key, "shared_dict")) {
+                parse_shared_dict(conf, line);
+            } else if (streq(line->key, "access_log")) {
+                lwan_access_log_parse_config(conf);
             } else {
                 config_error(conf, "Unknown section type: %s", line->key);
             }
@@ -616,7 +1255,8 @@ static void try_setup_from_config(struct lwan *l,
 
     l->config.request_flags =
         (l->config.proxy_protocol ? REQUEST_ALLOW_PROXY_REQS : 0) |
-        (l->config.allow_cors ? REQUEST_ALLOW_CORS : 0);
+        (l->config.allow_cors ? REQUEST_ALLOW_CORS : 0) |
+        (l->config.http2 ? REQUEST_ALLOW_HTTP2 : 0);
 }
 
 static rlim_t setup_open_file_count_limits(void)
@@ -658,11 +1298,85 @@ static void allocate_connections(struct lwan *l, size_t max_open_files)
 {
     const size_t sz = max_open_files * sizeof(struct lwan_connection);
 
-    l->conns = lwan_aligned_alloc(sz, 64);
-    if (UNLIKELY(!l->conns))
-        lwan_status_critical_perror("lwan_alloc_aligned");
+    /* The table is sized for the largest possible file descriptor, which
+     * might be in the millions, so it's only reserved here: pages are
+     * zero-filled by the kernel as they're first touched, making memory
+     * usage follow the number of connections actually seen. */
+    if (l->config.huge_pages) {
+        l->conns = lwan_huge_pages_alloc(sz);
+        if (l->conns) {
+            l->conns_mapping_size = lwan_huge_pages_size(sz);
+        } else {
+            lwan_status_perror("Could not map %zu bytes for the connection "
+                               "table, using regular pages",
+                               lwan_huge_pages_size(sz));
+        }
+    }
+
+    if (!l->conns) {
+        l->conns = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (UNLIKELY(l->conns == MAP_FAILED))
+            lwan_status_critical_perror("mmap");
+        l->conns_mapping_size = sz;
+    }
+
+    if (l->config.numa_aware) {
+        /* Connections are scheduled to threads in every node with a cache
+         * line granularity, so the table can't be split per node; spread
+         * it instead.  This has to happen before it's touched. */
+        lwan_numa_interleave(l->conns, sz);
+    }
 
-    memset(l->conns, 0, sz);
+    if (l->n_listeners > 1) {
+        l->conn_listener = calloc(max_open_files, sizeof(*l->conn_listener));
+        if (UNLIKELY(!l->conn_listener))
+            lwan_status_critical_perror("calloc");
+    }
+
+#if defined(HAVE_IO_URING)
+    if (l->config.use_io_uring) {
+        l->uring_polls = calloc(max_open_files, sizeof(*l->uring_polls));
+        if (UNLIKELY(!l->uring_polls))
+            lwan_status_critical_perror("calloc");
+    }
+#endif
+}
+
+static void setup_thread_pools(struct lwan *l)
+{
+    const unsigned int n_shared = l->thread.count;
+    unsigned int n_threads = 0;
+
+    /* Threads shared by listeners without their own come first, but are
+     * only created if there's any such listener. */
+    for (unsigned int i = 0; i < l->n_listeners; i++) {
+        if (!l->listeners[i].n_threads) {
+            n_threads = n_shared;
+            break;
+        }
+    }
+
+    for (unsigned int i = 0; i < l->n_listeners; i++) {
+        struct lwan_listener *listener = &l->listeners[i];
+
+        if (listener->n_threads) {
+            listener->pool = (struct lwan_thread_pool){
+                .first = n_threads,
+                .count = listener->n_threads,
+            };
+            n_threads += listener->n_threads;
+        } else {
+            listener->pool =
+                (struct lwan_thread_pool){.first = 0, .count = n_shared};
+        }
+    }
+
+    if (n_threads > 256)
+        lwan_status_critical("%d threads requested, but max 256 supported",
+                             n_threads);
+
+    l->thread.count = n_threads;
 }
 
 static void get_number_of_cpus(struct lwan *l)
@@ -699,6 +1413,34 @@ static char *dup_or_null(const char *s)
     return s ? strdup(s) : NULL;
 }
 
+static void setup_coro_stacks(struct lwan *l)
+{
+    size_t stack_size = l->config.coro_stack_size ? l->config.coro_stack_size
+                                                  : coro_get_stack_size();
+
+    /* Stacks are created before knowing which handler will be used, so
+     * they have to be large enough for the most demanding one. */
+    coro_set_stack_size(
+        LWAN_MAX(stack_size, l->config.handler_coro_stack_size));
+    coro_set_stack_usage_measurement(l->config.measure_stack_usage);
+
+    lwan_status_debug("Using %zu bytes for coroutine stacks%s",
+                      coro_get_stack_size(),
+                      l->config.measure_stack_usage ? " (measuring usage)" : "");
+}
+
+/* Path to the executable, used to start a new process during upgrades.
+ * It's obtained during initialization, before the executable is possibly
+ * replaced by a new version (or the process is chrooted). */
+static char self_exe[PATH_MAX];
+
+static void record_self_exe(void)
+{
+    ssize_t len = readlink("/proc/self/exe", self_exe, sizeof(self_exe) - 1);
+
+    self_exe[len < 0 ? 0 : len] = '\0';
+}
+
 void lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
 {
     /* Load defaults */
@@ -711,6 +1453,8 @@ void lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
      * their initialization. */
     lwan_status_init(l);
 
+    record_self_exe();
+
     /* These will only print debugging messages. Debug messages are always
      * printed if we're on a debug build, so the quiet setting will be
      * respected. */
@@ -719,6 +1463,15 @@ void lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
 
     try_setup_from_config(l, config);
 
+    lwan_clock_init(l);
+
+    if (!l->n_listeners) {
+        add_listener(l, l->config.listener ? l->config.listener
+                                           : default_config.listener);
+    }
+
+    setup_coro_stacks(l);
+
     if (!lwan_strbuf_get_length(&l->headers))
         build_response_headers(l, config->global_headers);
 
@@ -748,8 +1501,19 @@ void lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
         l->thread.count = l->config.n_threads;
     }
 
+    setup_thread_pools(l);
+
+    if (l->config.huge_pages && l->config.coro_pool_size) {
+        if (!coro_stack_region_init((size_t)l->config.coro_pool_size *
+                                    l->thread.count)) {
+            lwan_status_perror("Could not map a region for coroutine stacks, "
+                               "allocating them individually");
+        }
+    }
+
     rlim_t max_open_files = setup_open_file_count_limits();
     allocate_connections(l, (size_t)max_open_files);
+    lwan_pressure_init(l, (size_t)max_open_files);
 
     l->thread.max_fd = (unsigned)max_open_files / (unsigned)l->thread.count;
     lwan_status_info("Using %d threads, maximum %d sockets per thread",
@@ -757,8 +1521,38 @@ void lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
 
     signal(SIGPIPE, SIG_IGN);
 
-    lwan_readahead_init();
+    if (l->config.park_idle_connections && l->config.proxy_protocol) {
+        /* Information from the PROXY header is kept in the coroutine stack
+         * for the whole connection. */
+        lwan_status_warning("Idle connections can't be parked with the "
+                            "PROXY protocol enabled, disabling");
+        l->config.park_idle_connections = false;
+    }
+
+    if (l->config.per_thread_listeners && l->n_listeners > 1) {
+        lwan_status_warning("Per-thread listeners can't be used with "
+                            "more than one listener, disabling");
+        l->config.per_thread_listeners = false;
+    }
+
+    if (l->config.per_thread_listeners &&
+        lwan_socket_is_unix_address(l->listeners[0].address)) {
+        lwan_status_warning("Per-thread listeners can't be used with "
+                            "Unix domain sockets, disabling");
+        l->config.per_thread_listeners = false;
+    }
+
+    if (l->config.per_thread_listeners && sd_listen_fds(0) > 0) {
+        lwan_status_warning("Per-thread listeners can't be used with "
+                            "socket activation, disabling");
+        l->config.per_thread_listeners = false;
+    }
+
+    lwan_readahead_init(LWAN_MIN(LWAN_MAX(l->online_cpus / 4, 1u), 4u));
+    lwan_cache_async_init(LWAN_MIN(LWAN_MAX(l->online_cpus / 4, 1u), 4u));
+    lwan_blocking_init(LWAN_MAX(l->online_cpus, 4u));
     lwan_thread_init(l);
+    lwan_access_log_start();
     lwan_socket_init(l);
     lwan_http_authorize_init();
 }
@@ -773,43 +1567,193 @@ void lwan_shutdown(struct lwan *l)
 
     lwan_job_thread_shutdown();
     lwan_thread_shutdown(l);
+    lwan_timer_shutdown();
+    lwan_access_log_shutdown();
+    lwan_clock_shutdown();
 
     lwan_status_debug("Shutting down URL handlers");
-    lwan_trie_destroy(&l->url_map_trie);
+    for (unsigned int i = 0; i < l->n_listeners; i++) {
+        lwan_trie_destroy(&l->listeners[i].url_map_trie);
+        for (unsigned int j = 0; j < l->listeners[i].n_virtual_hosts; j++) {
+            lwan_trie_destroy(l->listeners[i].virtual_host_tries[j]);
+            free(l->listeners[i].virtual_host_tries[j]);
+        }
+        free(l->listeners[i].virtual_host_tries);
+        hash_free(l->listeners[i].virtual_hosts);
+        free(l->listeners[i].address);
+#if defined(HAVE_KTLS)
+        lwan_tls_context_free(l->listeners[i].tls);
+#endif
+    }
 
     lwan_strbuf_free(&l->headers);
-    free(l->conns);
+    munmap(l->conns, l->conns_mapping_size);
+    free(l->conn_listener);
+    free(l->uring_polls);
+    coro_stack_region_shutdown();
 
     lwan_response_shutdown(l);
     lwan_tables_shutdown();
     lwan_status_shutdown(l);
     lwan_http_authorize_shutdown();
+    lwan_shared_dict_shutdown();
+    lwan_cache_async_shutdown();
+    lwan_blocking_shutdown();
     lwan_readahead_shutdown();
+    lwan_pressure_shutdown(l);
 }
 
-static ALWAYS_INLINE int schedule_client(struct lwan *l, int fd)
+static ALWAYS_INLINE unsigned int thread_load(const struct lwan_thread *t)
 {
-    struct lwan_thread *thread = l->conns[fd].thread;
-
-    lwan_thread_add_client(thread, fd);
+    return ATOMIC_READ(t->n_connections) +
+           (unsigned int)spsc_queue_length(&t->pending_fds);
+}
 
-    return (int)(thread - l->thread.threads);
+static struct lwan_thread *pick_least_loaded_thread(struct lwan *l,
+                                                    struct lwan_thread *thread)
+{
+    /* Only used by the main thread, so no locking is necessary. */
+    static uint32_t state = 0x2545f491;
+
+    /* Power of two choices: compare the load of the thread this file
+     * descriptor was scheduled to (which preserves the cache-line sharing
+     * by siblings set up by lwan_thread_init()) with a random thread, and
+     * pick the least loaded one.  This avoids both the herd effect of
+     * always picking the least loaded thread with stale information, and
+     * the cost of scanning every thread for each connection.  */
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    const struct lwan_thread_pool *pool = &thread->pool;
+    struct lwan_thread *other =
+        &l->thread.threads[pool->first +
+                           (((uint64_t)state * pool->count) >> 32)];
+
+    return thread_load(other) < thread_load(thread) ? other : thread;
 }
 
-static volatile sig_atomic_t main_socket = -1;
+static volatile sig_atomic_t listen_fds[LWAN_MAX_LISTENERS] = {
+    [0 ... LWAN_MAX_LISTENERS - 1] = -1,
+};
+static unsigned int n_listen_fds;
+static volatile sig_atomic_t received_sigint = 0;
+static volatile sig_atomic_t received_upgrade = 0;
+static pthread_t main_thread;
 
-static_assert(sizeof(main_socket) >= sizeof(int),
+static_assert(sizeof(listen_fds[0]) >= sizeof(int),
               "size of sig_atomic_t > size of int");
 
 static void sigint_handler(int signal_number __attribute__((unused)))
 {
-    if (main_socket < 0)
-        return;
+    /* Counted, so that a second SIGINT can cut draining short. */
+    received_sigint++;
+
+    for (unsigned int i = 0; i < n_listen_fds; i++) {
+        int fd = (int)listen_fds[i];
+
+        if (fd < 0)
+            continue;
+
+        shutdown(fd, SHUT_RDWR);
+        close(fd);
+
+        listen_fds[i] = -1;
+    }
+}
+
+static void sigupgrade_handler(int signal_number)
+{
+    received_upgrade = 1;
+
+    /* The main thread has to be interrupted while blocked in accept();
+     * I/O threads block this signal, but other helper threads don't. */
+    if (!pthread_equal(pthread_self(), main_thread))
+        pthread_kill(main_thread, signal_number);
+}
+
+static struct lwan_thread *thread_with_capacity(struct lwan *l,
+                                                struct lwan_thread *preferred)
+{
+    const struct lwan_thread_pool *pool = &preferred->pool;
+
+    if (!lwan_thread_is_overloaded(preferred))
+        return preferred;
 
-    shutdown((int)main_socket, SHUT_RDWR);
-    close((int)main_socket);
+    for (unsigned int i = pool->first; i < pool->first + pool->count; i++) {
+        if (!lwan_thread_is_overloaded(&l->thread.threads[i]))
+            return &l->thread.threads[i];
+    }
 
-    main_socket = -1;
+    return NULL;
+}
+
+static struct lwan_thread *wait_for_capacity(struct lwan *l,
+                                             struct lwan_thread *preferred)
+{
+    struct lwan_thread *thread;
+
+    /* Connections are left in the listen backlog while every I/O thread is
+     * overloaded; once the backlog is full, the kernel stops completing
+     * handshakes and clients retry, rather than being reset. */
+    while (!(thread = thread_with_capacity(l, preferred))) {
+        struct timespec ts = {.tv_nsec = 5 * 1000000};
+
+        if (received_sigint)
+            return preferred;
+
+        /* Threads might not have been told about connections accepted
+         * before pausing yet. */
+        for (unsigned int i = 0; i < l->thread.count; i++) {
+            if (spsc_queue_length(&l->thread.threads[i].pending_fds))
+                lwan_thread_nudge(&l->thread.threads[i]);
+        }
+
+        nanosleep(&ts, NULL);
+    }
+
+    return thread;
+}
+
+static ALWAYS_INLINE int
+schedule_client(struct lwan *l, int fd, unsigned int listener_idx)
+{
+    struct lwan_thread *thread = l->conns[fd].thread;
+
+    /* File descriptors are scheduled to a thread the first time they're
+     * accepted; afterwards, they stay with the thread that last had them. */
+    if (UNLIKELY(!thread))
+        thread = l->conns[fd].thread = lwan_thread_for_fd(l, fd);
+
+    if (l->conn_listener) {
+        const struct lwan_thread_pool *pool = &l->listeners[listener_idx].pool;
+
+        l->conn_listener[fd] = (uint8_t)listener_idx;
+
+        /* File descriptors are pre-scheduled to threads regardless of the
+         * listener they'll come from. */
+        if (UNLIKELY((unsigned int)(thread - l->thread.threads) - pool->first >=
+                     pool->count)) {
+            thread = &l->thread.threads[pool->first + (unsigned int)fd % pool->count];
+        }
+        l->conns[fd].thread = thread;
+    }
+
+    if (l->config.load_aware_scheduling) {
+        thread = pick_least_loaded_thread(l, thread);
+
+        /* Published to the I/O thread when fd is pushed to its queue. */
+        l->conns[fd].thread = thread;
+    }
+
+    if (UNLIKELY(l->config.pause_accept_on_overload)) {
+        thread = wait_for_capacity(l, thread);
+        l->conns[fd].thread = thread;
+    }
+
+    lwan_thread_add_client(thread, fd);
+
+    return (int)(thread - l->thread.threads);
 }
 
 enum herd_accept { HERD_MORE = 0, HERD_GONE = -1, HERD_SHUTDOWN = 1 };
@@ -819,12 +1763,16 @@ struct core_bitmap {
 };
 
 static ALWAYS_INLINE enum herd_accept
-accept_one(struct lwan *l, struct core_bitmap *cores)
+accept_one(struct lwan *l, unsigned int listener_idx, struct core_bitmap *cores)
 {
-    int fd = accept4((int)main_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    int fd = accept4((int)listen_fds[listener_idx], NULL, NULL,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
 
     if (LIKELY(fd >= 0)) {
-        int core = schedule_client(l, fd);
+        LWAN_PROBE(accept, fd);
+        lwan_pressure_note_fd(l, fd);
+
+        int core = schedule_client(l, fd, listener_idx);
 
         cores->bitmap[core / 64] |= UINT64_C(1)<<(core % 64);
 
@@ -833,49 +1781,455 @@ accept_one(struct lwan *l, struct core_bitmap *cores)
 
     switch (errno) {
     case EAGAIN:
+    case EINTR:
         return HERD_GONE;
 
     case EBADF:
     case ECONNABORTED:
     case EINVAL:
-        if (main_socket < 0) {
+        if (received_sigint) {
             lwan_status_info("Signal 2 (Interrupt) received");
         } else {
             lwan_status_info("Main socket closed for unknown reasons");
         }
         return HERD_SHUTDOWN;
 
+    case EMFILE:
+    case ENFILE: {
+        struct lwan_thread *t =
+            &l->thread.threads[l->listeners[listener_idx].pool.first];
+
+        if (lwan_pressure_shed(t, (int)listen_fds[listener_idx],
+                               &l->pressure.reserve_fd))
+            return HERD_MORE;
+
+        /* Nothing was waiting, or there's no descriptor in reserve right
+         * now; accept() would fail right away again. */
+        nanosleep(&(struct timespec){.tv_nsec = 10 * 1000000}, NULL);
+        return HERD_GONE;
+    }
+
     default:
         lwan_status_perror("accept");
         return HERD_MORE;
     }
 }
 
+static struct lwan_thread *listener_pool_thread(struct lwan *l,
+                                                unsigned int listener_idx)
+{
+    return &l->thread.threads[l->listeners[listener_idx].pool.first];
+}
+
+static enum herd_accept accept_herd(struct lwan *l,
+                                    unsigned int listener_idx,
+                                    struct core_bitmap *cores,
+                                    bool pause_on_overload)
+{
+    enum herd_accept ha;
+
+    do {
+        if (UNLIKELY(pause_on_overload &&
+                     !thread_with_capacity(
+                         l, listener_pool_thread(l, listener_idx))))
+            return HERD_GONE;
+
+        ha = accept_one(l, listener_idx, cores);
+    } while (ha == HERD_MORE);
+
+    return ha;
+}
+
+static enum herd_accept accept_from_listener(struct lwan *l,
+                                             struct core_bitmap *cores,
+                                             bool pause_on_overload)
+{
+    const int fd = l->listeners[0].fd;
+    enum herd_accept ha;
+
+    if (UNLIKELY(pause_on_overload))
+        wait_for_capacity(l, listener_pool_thread(l, 0));
+
+    fcntl(fd, F_SETFL, 0);
+    ha = accept_one(l, 0, cores);
+    if (ha == HERD_MORE) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        ha = accept_herd(l, 0, cores, pause_on_overload);
+    }
+
+    return ha;
+}
+
+static enum herd_accept accept_from_listeners(struct lwan *l,
+                                              struct core_bitmap *cores,
+                                              bool pause_on_overload)
+{
+    struct pollfd fds[LWAN_MAX_LISTENERS];
+    unsigned int listener_idx[LWAN_MAX_LISTENERS];
+    nfds_t n_fds = 0;
+    int n_ready;
+
+    for (unsigned int i = 0; i < l->n_listeners; i++) {
+        /* Listeners whose threads are all overloaded are left alone for a
+         * while, without holding back the other listeners. */
+        if (UNLIKELY(pause_on_overload &&
+                     !thread_with_capacity(l, listener_pool_thread(l, i))))
+            continue;
+
+        fds[n_fds] = (struct pollfd){.fd = l->listeners[i].fd, .events = POLLIN};
+        listener_idx[n_fds] = i;
+        n_fds++;
+    }
+
+    n_ready = poll(fds, n_fds, n_fds == l->n_listeners ? -1 : 5);
+    if (n_ready < 0) {
+        if (errno == EINTR && received_sigint) {
+            lwan_status_info("Signal 2 (Interrupt) received");
+            return HERD_SHUTDOWN;
+        }
+        return HERD_GONE;
+    }
+
+    for (nfds_t i = 0; n_ready && i < n_fds; i++) {
+        enum herd_accept ha;
+
+        if (!fds[i].revents)
+            continue;
+
+        n_ready--;
+        ha = accept_herd(l, listener_idx[i], cores, pause_on_overload);
+        if (UNLIKELY(ha > HERD_MORE))
+            return ha;
+    }
+
+    return HERD_GONE;
+}
+
+/* Maximum amount of time a new process has to become ready to serve
+ * requests during an upgrade. */
+#define HANDOVER_TIMEOUT_MS (30 * 1000)
+
+static char *read_self_cmdline(size_t *len)
+{
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE *f;
+
+    f = fopen("/proc/self/cmdline", "re");
+    if (!f)
+        return NULL;
+
+    *len = 0;
+    while (true) {
+        if (*len == size) {
+            char *tmp = realloc(buffer, size + 4096);
+
+            if (!tmp) {
+                free(buffer);
+                buffer = NULL;
+                break;
+            }
+            buffer = tmp;
+            size += 4096;
+        }
+
+        size_t r = fread(buffer + *len, 1, size - *len, f);
+        if (!r)
+            break;
+        *len += r;
+    }
+
+    fclose(f);
+    return buffer;
+}
+
+static char **build_argv(char *cmdline, size_t len)
+{
+    size_t n_args = 0;
+    char **argv;
+
+    for (size_t i = 0; i < len; i++)
+        n_args += cmdline[i] == '\0';
+
+    argv = calloc(n_args + 1, sizeof(*argv));
+    if (!argv)
+        return NULL;
+
+    for (size_t i = 0, arg = 0; arg < n_args; arg++) {
+        argv[arg] = cmdline + i;
+        i += strlen(cmdline + i) + 1;
+    }
+
+    return argv;
+}
+
+static char **build_envp(char *handover_var)
+{
+    extern char **environ;
+    size_t n_vars = 0;
+    char **envp;
+
+    while (environ[n_vars])
+        n_vars++;
+
+    envp = calloc(n_vars + 2, sizeof(*envp));
+    if (!envp)
+        return NULL;
+
+    size_t j = 0;
+    for (size_t i = 0; i < n_vars; i++) {
+        if (strncmp(environ[i], LWAN_HANDOVER_FD_ENV "=",
+                    sizeof(LWAN_HANDOVER_FD_ENV)))
+            envp[j++] = environ[i];
+    }
+    envp[j] = handover_var;
+
+    return envp;
+}
+
+static pid_t spawn_new_process(int handover_fd)
+{
+    char handover_var[sizeof(LWAN_HANDOVER_FD_ENV) + 3 * sizeof(int) + 1];
+    char **argv = NULL, **envp = NULL;
+    char *cmdline;
+    size_t len;
+    pid_t pid = -1;
+
+    cmdline = read_self_cmdline(&len);
+    if (!cmdline)
+        goto out;
+
+    snprintf(handover_var, sizeof(handover_var), "%s=%d",
+             LWAN_HANDOVER_FD_ENV, handover_fd);
+
+    argv = build_argv(cmdline, len);
+    envp = build_envp(handover_var);
+    if (!argv || !argv[0] || !envp)
+        goto out;
+
+    pid = fork();
+    if (!pid) {
+        /* Only async-signal-safe functions can be called here. */
+        if (fcntl(handover_fd, F_SETFD, 0) < 0)
+            _exit(127);
+
+        execve(self_exe, argv, envp);
+        _exit(127);
+    }
+
+out:
+    free(envp);
+    free(argv);
+    free(cmdline);
+
+    return pid;
+}
+
+static bool wait_for_new_process(int handover_fd, pid_t pid)
+{
+    struct pollfd pfd = {.fd = handover_fd, .events = POLLIN};
+    char byte;
+    int r;
+
+    do {
+        r = poll(&pfd, 1, HANDOVER_TIMEOUT_MS);
+    } while (r < 0 && errno == EINTR && !received_sigint);
+
+    if (r == 1 && read(handover_fd, &byte, 1) == 1)
+        return true;
+
+    if (r == 0)
+        lwan_status_error("New process %d didn't become ready in time", pid);
+    else
+        lwan_status_error("New process %d exited before becoming ready", pid);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return false;
+}
+
+static bool hand_listeners_over(struct lwan *l)
+{
+    int fds[LWAN_MAX_LISTENERS];
+    int sv[2];
+    pid_t pid;
+    bool ok = false;
+
+    received_upgrade = 0;
+
+    if (!self_exe[0]) {
+        lwan_status_error("Path to executable unknown, can't upgrade");
+        return false;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        lwan_status_perror("socketpair");
+        return false;
+    }
+
+    lwan_status_info("Starting %s to take over the listening sockets",
+                     self_exe);
+
+    /* Sockets are queued in the socket pair buffer until the new process
+     * picks them up from lwan_socket_init(). */
+    for (unsigned int i = 0; i < l->n_listeners; i++)
+        fds[i] = l->listeners[i].fd;
+    int r = lwan_socket_send_listeners(sv[0], fds, l->n_listeners);
+    if (r < 0) {
+        errno = -r;
+        lwan_status_perror("Could not send listening sockets");
+        goto out;
+    }
+
+    pid = spawn_new_process(sv[1]);
+    if (pid < 0) {
+        lwan_status_perror("Could not start new process");
+        goto out;
+    }
+
+    close(sv[1]);
+    sv[1] = -1;
+
+    ok = wait_for_new_process(sv[0], pid);
+    if (ok)
+        lwan_status_info("Process %d took over the listening sockets", pid);
+
+out:
+    close(sv[0]);
+    if (sv[1] >= 0)
+        close(sv[1]);
+
+    return ok;
+}
+
+static unsigned int count_open_connections(const struct lwan *l)
+{
+    unsigned int n = 0;
+
+    for (unsigned int i = 0; i < l->thread.count; i++)
+        n += ATOMIC_READ(l->thread.threads[i].n_connections);
+
+    return n;
+}
+
+static void drain_connections(struct lwan *l)
+{
+    const struct timespec ts = {.tv_nsec = 100 * 1000000};
+    const sig_atomic_t n_sigints = received_sigint;
+    unsigned int n_tries = l->config.drain_timeout * 10;
+    unsigned int n_conns;
+
+    /* Requests received from now on won't keep their connections alive.
+     * Threads are nudged so that they close idle connections and stop
+     * accepting on their own listening sockets, if any. */
+    __atomic_store_n(&l->draining, true, __ATOMIC_RELEASE);
+    for (unsigned int i = 0; i < l->thread.count; i++)
+        lwan_thread_nudge(&l->thread.threads[i]);
+
+    n_conns = count_open_connections(l);
+    if (n_conns && n_tries) {
+        lwan_status_info("Waiting up to %us for %u connections to finish",
+                         l->config.drain_timeout, n_conns);
+    }
+
+    while ((n_conns = count_open_connections(l)) && n_tries-- &&
+           received_sigint == n_sigints)
+        nanosleep(&ts, NULL);
+
+    if (n_conns) {
+        lwan_status_warning("Closing %u connections that didn't drain",
+                            n_conns);
+    }
+}
+
+static void wait_for_sigint(void)
+{
+    sigset_t mask, old_mask;
+
+    /* I/O threads accept connections by themselves, so there's nothing
+     * to do here but wait.  SIGINT is blocked in I/O threads, so it can
+     * only be delivered to this thread. */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    while (!received_sigint) {
+        sigsuspend(&old_mask);
+
+        if (received_upgrade) {
+            lwan_status_error("Upgrades aren't supported with per-thread "
+                              "listeners");
+            received_upgrade = 0;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    lwan_status_info("Signal 2 (Interrupt) received");
+}
+
 void lwan_main_loop(struct lwan *l)
 {
     struct core_bitmap cores = {};
 
-    assert(main_socket == -1);
-    main_socket = l->main_socket;
+    assert(n_listen_fds == 0);
+    if (!l->config.per_thread_listeners) {
+        for (unsigned int i = 0; i < l->n_listeners; i++)
+            listen_fds[i] = l->listeners[i].fd;
+        n_listen_fds = l->n_listeners;
+    }
 
     if (signal(SIGINT, sigint_handler) == SIG_ERR)
         lwan_status_critical("Could not set signal handler");
 
+    /* No SA_RESTART, so that accept() returns early. */
+    main_thread = pthread_self();
+    struct sigaction sa = {.sa_handler = sigupgrade_handler};
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGHUP, &sa, NULL) < 0 || sigaction(SIGUSR2, &sa, NULL) < 0)
+        lwan_status_critical_perror("Could not set signal handler");
+
+    if (l->handover_fd >= 0) {
+        /* Let the previous process know it can stop accepting connections. */
+        if (write(l->handover_fd, "R", 1) < 0)
+            lwan_status_perror("Could not notify previous process");
+        close(l->handover_fd);
+        l->handover_fd = -1;
+    }
+
     lwan_status_info("Ready to serve");
 
+    if (l->config.per_thread_listeners) {
+        wait_for_sigint();
+        return drain_connections(l);
+    }
+
+    const bool pause_on_overload = l->config.pause_accept_on_overload;
+
+    /* With more than one listener, sockets are polled instead of having
+     * the main thread block on accept(). */
+    for (unsigned int i = 0; l->n_listeners > 1 && i < l->n_listeners; i++)
+        fcntl(l->listeners[i].fd, F_SETFL, O_NONBLOCK);
+
     while (true) {
         enum herd_accept ha;
 
-        fcntl(l->main_socket, F_SETFL, 0);
-        ha = accept_one(l, &cores);
-        if (ha == HERD_MORE) {
-            fcntl(l->main_socket, F_SETFL, O_NONBLOCK);
-
-            do {
-                ha = accept_one(l, &cores);
-            } while (ha == HERD_MORE);
+        if (UNLIKELY(received_upgrade) && hand_listeners_over(l)) {
+            /* The new process is accepting on these sockets as well, so
+             * they can't be shutdown(2) like it's done in sigint_handler(). */
+            for (unsigned int i = 0; i < l->n_listeners; i++) {
+                listen_fds[i] = -1;
+                close(l->listeners[i].fd);
+                l->listeners[i].fd = -1;
+            }
+            break;
         }
 
+        if (l->n_listeners == 1)
+            ha = accept_from_listener(l, &cores, pause_on_overload);
+        else
+            ha = accept_from_listeners(l, &cores, pause_on_overload);
+
         if (UNLIKELY(ha > HERD_MORE))
             break;
 
@@ -887,6 +2241,8 @@ void lwan_main_loop(struct lwan *l)
         }
         cores = (struct core_bitmap){};
     }
+
+    drain_connections(l);
 }
 
 #ifdef CLOCK_MONOTONIC_COARSE
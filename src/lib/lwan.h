@@ -178,23 +178,35 @@ static ALWAYS_INLINE uint64_t string_as_uint64(const char *s)
 #define FOR_EACH_HTTP_STATUS(X)                                                                                                             \
     X(SWITCHING_PROTOCOLS, 101, "Switching protocols", "Protocol is switching over from HTTP")                                              \
     X(OK, 200, "OK", "Success")                                                                                                             \
+    X(CREATED, 201, "Created", "The request has been fulfilled and a new resource has been created")                                        \
+    X(ACCEPTED, 202, "Accepted", "The request has been accepted for processing")                                                            \
+    X(NO_CONTENT, 204, "No content", "The request has been fulfilled and there is no content to send")                                      \
     X(PARTIAL_CONTENT, 206, "Partial content", "Delivering part of requested resource")                                                     \
     X(MOVED_PERMANENTLY, 301, "Moved permanently", "This content has moved to another place")                                               \
+    X(FOUND, 302, "Found", "This content can be found at a different location")                                                             \
+    X(SEE_OTHER, 303, "See other", "The response can be found at a different location")                                                     \
     X(NOT_MODIFIED, 304, "Not modified", "The content has not changed since previous request")                                              \
     X(TEMPORARY_REDIRECT, 307, "Temporary Redirect", "This content can be temporarily found at a different location")                       \
+    X(PERMANENT_REDIRECT, 308, "Permanent redirect", "This content has permanently moved to another place")                                 \
     X(BAD_REQUEST, 400, "Bad request", "The client has issued a bad request")                                                               \
     X(NOT_AUTHORIZED, 401, "Not authorized", "Client has no authorization to access this resource")                                         \
     X(FORBIDDEN, 403, "Forbidden", "Access to this resource has been denied")                                                               \
     X(NOT_FOUND, 404, "Not found", "The requested resource could not be found on this server")                                              \
     X(NOT_ALLOWED, 405, "Not allowed", "The requested method is not allowed by this server")                                                \
     X(TIMEOUT, 408, "Request timeout", "Client did not produce a request within expected timeframe")                                        \
+    X(CONFLICT, 409, "Conflict", "The request conflicts with the current state of the resource")                                            \
+    X(GONE, 410, "Gone", "The requested resource is no longer available")                                                                   \
+    X(LENGTH_REQUIRED, 411, "Length required", "The request did not specify the length of its content")                                     \
     X(TOO_LARGE, 413, "Request too large", "The request entity is too large")                                                               \
     X(RANGE_UNSATISFIABLE, 416, "Requested range unsatisfiable", "The server can't supply the requested portion of the requested resource") \
     X(I_AM_A_TEAPOT, 418, "I'm a teapot", "Client requested to brew coffee but device is a teapot")                                         \
     X(CLIENT_TOO_HIGH, 420, "Client too high", "Client is too high to make a request")                                                      \
+    X(TOO_MANY_REQUESTS, 429, "Too many requests", "Client has sent too many requests in a given amount of time")                          \
     X(INTERNAL_ERROR, 500, "Internal server error", "The server encountered an internal error that couldn't be recovered from")             \
     X(NOT_IMPLEMENTED, 501, "Not implemented", "Server lacks the ability to fulfil the request")                                            \
+    X(BAD_GATEWAY, 502, "Bad gateway", "The server received an invalid response from an upstream server")                                   \
     X(UNAVAILABLE, 503, "Service unavailable", "The server is either overloaded or down for maintenance")                                   \
+    X(GATEWAY_TIMEOUT, 504, "Gateway timeout", "The server did not receive a timely response from an upstream server")                      \
     X(SERVER_TOO_HIGH, 520, "Server too high", "The server is too high to answer the request")
 
 #define GENERATE_ENUM_ITEM(id, code, short, long) HTTP_ ## id = code,
@@ -214,10 +226,28 @@ enum lwan_handler_flags {
     HANDLER_MUST_AUTHORIZE = 1 << 1,
     HANDLER_CAN_REWRITE_URL = 1 << 2,
     HANDLER_DATA_IS_HASH_TABLE = 1 << 3,
+    /* Body is read by the handler with lwan_request_read_body(); takes
+     * precedence over HANDLER_EXPECTS_BODY_DATA. */
+    HANDLER_STREAMS_BODY_DATA = 1 << 4,
+    /* Output is compressed according to Accept-Encoding; see
+     * lwan-compress.c. */
+    HANDLER_COMPRESS_RESPONSE = 1 << 5,
+    /* Requests go through a token bucket before reaching the handler; see
+     * lwan-rate-limit.c. */
+    HANDLER_RATE_LIMITED = 1 << 6,
+    /* Responses are kept around for a while and served without calling
+     * the handler; see lwan-response-cache.c. */
+    HANDLER_CACHES_RESPONSE = 1 << 7,
 
     HANDLER_PARSE_MASK = HANDLER_EXPECTS_BODY_DATA,
 };
 
+enum lwan_handler_priority {
+    HANDLER_PRIORITY_NORMAL,
+    HANDLER_PRIORITY_HIGH,
+    HANDLER_PRIORITY_LOW,
+};
+
 /* 1<<0 set: response has body; see has_response_body() in lwan-response.c */
 /* 1<<3 set: request has body; see request_has_body() in lwan-request.c */
 #define FOR_EACH_REQUEST_METHOD(X)                                             \
@@ -241,7 +271,7 @@ enum lwan_request_flags {
     REQUEST_ACCEPT_GZIP = 1 << 5,
     REQUEST_ACCEPT_BROTLI = 1 << 6,
     REQUEST_ACCEPT_ZSTD = 1 << 7,
-    REQUEST_ACCEPT_MASK = 1 << 4 | 1 << 5 | 1 << 6 | 1 << 7,
+    REQUEST_ACCEPT_MASK = 1 << 4 | 1 << 5 | 1 << 6 | 1 << 7 | 1 << 27,
 
     REQUEST_IS_HTTP_1_0 = 1 << 8,
     REQUEST_ALLOW_PROXY_REQS = 1 << 9,
@@ -261,11 +291,44 @@ enum lwan_request_flags {
     REQUEST_PARSED_FORM_DATA = 1 << 20,
     REQUEST_PARSED_COOKIES = 1 << 21,
     REQUEST_PARSED_ACCEPT_ENCODING = 1 << 22,
+    REQUEST_PARSED_HEADER_INDEX = 1 << 23,
+
+    REQUEST_ALLOW_HTTP2 = 1 << 24,
+
+    RESPONSE_COMPRESS = 1 << 25,
+
+    REQUEST_PARSED_HEADERS = 1 << 26,
+
+    /* Dictionary-compressed zstd; see lwan-compress.c */
+    REQUEST_ACCEPT_DCZ = 1 << 27,
 };
 
 #undef SELECT_MASK
 #undef GENERATE_ENUM_ITEM
 
+/* Headers that are located while the request is parsed, so that looking
+ * them up doesn't require going through all headers.  The constant is the
+ * first four characters of the header name, for STRING_SWITCH_L(). */
+#define FOR_EACH_WELL_KNOWN_HEADER(X)                                          \
+    X(AUTHORIZATION, "Authorization", STR4_INT_L('A', 'u', 't', 'h'))          \
+    X(COOKIE, "Cookie", STR4_INT_L('C', 'o', 'o', 'k'))                        \
+    X(EXPECT, "Expect", STR4_INT_L('E', 'x', 'p', 'e'))                        \
+    X(HOST, "Host", STR4_INT_L('H', 'o', 's', 't'))                            \
+    X(REFERER, "Referer", STR4_INT_L('R', 'e', 'f', 'e'))                      \
+    X(SEC_WEBSOCKET_KEY, "Sec-WebSocket-Key", STR4_INT_L('S', 'e', 'c', '-'))  \
+    X(UPGRADE, "Upgrade", STR4_INT_L('U', 'p', 'g', 'r'))                      \
+    X(USER_AGENT, "User-Agent", STR4_INT_L('U', 's', 'e', 'r'))                \
+    X(X_FORWARDED_FOR, "X-Forwarded-For", STR4_INT_L('X', '-', 'F', 'o'))
+
+#define GENERATE_ENUM_ITEM(id, name, prefix) LWAN_HEADER_##id,
+
+enum lwan_header_id {
+    FOR_EACH_WELL_KNOWN_HEADER(GENERATE_ENUM_ITEM)
+    LWAN_HEADER_MAX,
+};
+
+#undef GENERATE_ENUM_ITEM
+
 enum lwan_connection_flags {
     CONN_MASK = -1,
 
@@ -285,12 +348,64 @@ enum lwan_connection_flags {
     CONN_SUSPENDED = 1 << 5,
     CONN_HAS_REMOVE_SLEEP_DEFER = 1 << 6,
 
-    CONN_CORK = 1 << 7,
-
     /* Set only on file descriptors being watched by async/await to determine
      * which epoll operation to use when suspending/resuming (ADD/MOD). Reset
      * whenever associated client connection is closed. */
     CONN_ASYNC_AWAIT = 1 << 8,
+
+    /* Only used by the io_uring event loop: set on file descriptors that
+     * have a poll request in flight, as these are consumed when they fire
+     * and must be either re-armed or updated. */
+    CONN_POLL_ARMED = 1 << 9,
+
+    /* Set while the request processing coroutine waits for the next request
+     * in a keep-alive connection.  At this point, no timers, async/await
+     * file descriptors, or deferred callbacks refer to the thread owning
+     * the connection, so it can be moved to another thread. */
+    CONN_BETWEEN_REQUESTS = 1 << 10,
+
+    /* Keep-alive connection waiting for the next request without a
+     * coroutine; one is created when there's something to read. */
+    CONN_PARKED = 1 << 11,
+
+    /* Not a real connection: the one seen by requests in an HTTP/2 stream.
+     * I/O wrappers hand everything written to it to lwan-http2.c. */
+    CONN_IS_HTTP2_STREAM = 1 << 12,
+
+    /* TLS handshake done, and records are handled by the kernel from now
+     * on, so the socket can be used as if it were a plain-text one. */
+    CONN_TLS = 1 << 13,
+
+    /* Only used with edge-triggered events: the socket was reported as
+     * readable/writable by epoll, and no read/write came up short since.
+     * CONN_READY_QUEUED is set while the connection is in the list of
+     * connections to be resumed without waiting for epoll. */
+    CONN_READY_READ = 1 << 14,
+    CONN_READY_WRITE = 1 << 15,
+    CONN_READY_QUEUED = 1 << 16,
+
+    /* Set while the request processing coroutine waits for the socket to
+     * become writable again, so that the connection is kept in the part
+     * of the timeout queue where send_timeout applies. */
+    CONN_WRITE_BLOCKED = 1 << 17,
+
+    /* Set while the coroutine of a websocket connection waits for a frame
+     * that hasn't started arriving yet, so that the I/O thread can answer
+     * control frames by itself.  CONN_WEBSOCKET_PINGED is set once the
+     * I/O thread sends a ping to an idle connection, and reset when
+     * anything happens to it.  See lwan_websocket_handle_control_frames(). */
+    CONN_WEBSOCKET_IDLE = 1 << 18,
+    CONN_WEBSOCKET_PINGED = 1 << 19,
+
+    /* Scheduling class of the request being handled, from the priority of
+     * its URL map; connections waiting for a request are in the normal
+     * class.  CONN_SCHED_QUEUED is set while the connection waits in one
+     * of the lists of coroutines to be resumed once the events of the
+     * current loop iteration have been seen; see schedule_resume(). */
+    CONN_PRIORITY_HIGH = 1 << 20,
+    CONN_PRIORITY_LOW = 1 << 21,
+    CONN_PRIORITY_MASK = 1 << 20 | 1 << 21,
+    CONN_SCHED_QUEUED = 1 << 22,
 };
 
 enum lwan_connection_coro_yield {
@@ -345,9 +460,14 @@ struct lwan_value {
     size_t len;
 };
 
+/* A byte range, from the first byte to one past the last one */
+struct lwan_byte_range {
+    off_t from, to;
+};
+
 struct lwan_connection {
-    /* This structure is exactly 32-bytes on x86-64. If it is changed,
-     * make sure the scheduler (lwan-thread.c) is updated as well. */
+    /* This structure is exactly 32-bytes on x86-64 and arm64. If it is
+     * changed, make sure the scheduler (lwan-thread.c) is updated as well. */
     enum lwan_connection_flags flags;
     unsigned int time_to_expire;
     struct coro *coro;
@@ -429,16 +549,124 @@ struct lwan_url_map {
         char *realm;
         char *password_file;
     } authorization;
+
+    struct lwan_rate_limit *rate_limit;
+    struct lwan_response_cache *response_cache;
+    struct lwan_compress_dict *compress_dict;
+    struct lwan_route_stats *stats; /* Created on first request */
+
+    /* Minimum coroutine stack size this handler needs (0 if no specific
+     * requirement), and the largest stack usage measured so far, if the
+     * measurement is enabled. */
+    size_t coro_stack_size;
+    size_t stack_high_water_mark;
+
+    /* Bitmap of methods (1 << REQUEST_METHOD_*) handled by this map, or 0
+     * for all of them.  Maps for the same prefix handling other methods
+     * are chained through next_method. */
+    uint32_t methods;
+    struct lwan_url_map *next_method;
+
+    /* Class used to schedule the coroutines of connections handling a
+     * request for this map when the I/O thread is busy. */
+    enum lwan_handler_priority priority;
+};
+
+struct lwan_uring;
+
+/* Subsystems whose memory usage is accounted for; see lwan_memory_account()
+ * and lwan_memory_get().  Caches aren't here: they keep track of the size of
+ * their entries themselves (see cache_set_max_size()). */
+enum lwan_memory_subsystem {
+    LWAN_MEMORY_CORO_STACKS,
+    LWAN_MEMORY_STRBUFS,
+    LWAN_MEMORY_PUBSUB,
+    LWAN_MEMORY_WEBSOCKETS,
+    LWAN_MEMORY_LUA,
+    LWAN_MEMORY_N_SUBSYSTEMS,
+};
+
+/* Counters in this struct are only written by the thread that owns it
+ * (except where noted), so they're incremented without atomic operations;
+ * readers in other threads might see slightly stale values.  It's kept in
+ * its own cache line so that reading it won't bounce the rest of the
+ * thread struct around. */
+struct lwan_thread_metrics {
+    uint64_t requests;
+    uint64_t responses[5]; /* 1xx, 2xx, 3xx, 4xx, 5xx */
+    uint64_t accepted;
+    uint64_t donated;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t loops;  /* Times the event loop woke up */
+    uint64_t events; /* Events handled by the event loop */
+    uint64_t defers; /* Deferred calls registered while handling requests */
+    uint64_t request_buffer_spills; /* See spill_request_buffer() */
+    uint64_t slow_clients; /* Connections closed for reading too slowly */
+    uint64_t evicted; /* Idle connections closed under resource pressure */
+    uint64_t match_budget_exhausted; /* Rewrite pattern searches given up */
+    /* Bytes allocated minus bytes freed by this thread.  Memory is often
+     * freed by a thread other than the one that allocated it, so only the
+     * sum over all threads is meaningful. */
+    int64_t memory[LWAN_MEMORY_N_SUBSYSTEMS];
+    /* Might also be incremented by the main thread, atomically. */
+    uint64_t rejected;
+} __attribute__((aligned(64)));
+
+/* Range of I/O threads in struct lwan that connections are scheduled to. */
+struct lwan_thread_pool {
+    unsigned int first;
+    unsigned int count;
 };
 
 struct lwan_thread {
     struct lwan *lwan;
-    struct {
-        char date[30];
-        char expires[30];
-    } date;
     struct spsc_queue pending_fds;
     struct timeouts *wheel;
+    unsigned int n_connections;
+    struct {
+        pthread_mutex_t lock;
+        unsigned int count;
+        int fds[32];
+    } donated;
+    struct {
+        pthread_mutex_t lock;
+        struct list_head requests;
+    } wakeups;
+    bool waiting;
+    struct {
+        unsigned int window_us;
+        uint64_t spin_ns;
+        uint64_t n_spins;
+        uint64_t n_hits;
+    } busy_poll;
+    struct {
+        int *fds;
+        unsigned int count;
+        unsigned int size;
+    } ready;
+    /* Only if URL maps have priorities: normal and low priority
+     * connections with pending events, resumed after the high priority
+     * ones; see schedule_resume(). */
+    struct lwan_thread_fd_list {
+        int *fds;
+        unsigned int count;
+        unsigned int size;
+    } sched_normal, sched_low;
+    struct coro_pool coro_pool;
+    struct lwan_thread_pool pool;
+    struct lwan_thread_metrics metrics;
+    /* Lives in the thread's stack; see thread_io_loop() */
+    const struct timeout_queue *tq;
+    unsigned int n_async_awaits;
+    struct lwan_uring *uring;
+    struct lwan_access_log_ring *access_log;
+    /* Only if slow_request_threshold is set; see lwan-watchdog.c */
+    struct lwan_thread_watch *watch;
+    /* Only if the profile module is used; see lwan-profiler.c */
+    struct lwan_thread_profile *profile;
+    int listen_fd;
+    int reserve_fd; /* Only with listen_fd; see lwan_pressure_shed() */
     int epoll_fd;
     int pipe_fd[2];
     pthread_t self;
@@ -450,6 +678,14 @@ struct lwan_straitjacket {
     bool drop_capabilities;
 };
 
+enum lwan_thread_affinity {
+    LWAN_AFFINITY_CPU,
+    LWAN_AFFINITY_CORE,
+    LWAN_AFFINITY_CLUSTER,
+    LWAN_AFFINITY_NODE,
+    LWAN_AFFINITY_NONE,
+};
+
 struct lwan_config {
     /* Field will be overridden during initialization. */
     enum lwan_request_flags request_flags;
@@ -461,10 +697,28 @@ struct lwan_config {
 
     size_t max_post_data_size;
     size_t max_put_data_size;
+    size_t max_request_header_size;
 
     unsigned int keep_alive_timeout;
+    unsigned int send_timeout;
+    unsigned int min_send_rate;
     unsigned int expires;
     unsigned int n_threads;
+    unsigned int max_connections_per_thread;
+    unsigned int max_pending_per_thread;
+    unsigned int busy_poll_us;
+    unsigned int coro_pool_size;
+    unsigned int coro_stack_size;
+    unsigned int drain_timeout;
+    unsigned int pipeline_buffer_size;
+    unsigned int zerocopy_threshold;
+    unsigned int slow_request_threshold;
+    unsigned int low_priority_resumes_per_loop;
+    unsigned int websocket_deflate_window_bits;
+    unsigned int evict_idle_fd_watermark;     /* Percent of RLIMIT_NOFILE */
+    unsigned int evict_idle_memory_watermark; /* MiB */
+    /* Largest coroutine stack size requested by a URL map. */
+    size_t handler_coro_stack_size;
 
     bool quiet;
     bool reuse_port;
@@ -472,16 +726,71 @@ struct lwan_config {
     bool allow_cors;
     bool allow_post_temp_file;
     bool allow_put_temp_file;
+    bool use_io_uring;
+    bool per_thread_listeners;
+    bool load_aware_scheduling;
+    bool work_stealing;
+    bool edge_triggered_events;
+    bool pause_accept_on_overload;
+    bool busy_poll_sockets;
+    enum lwan_thread_affinity thread_affinity;
+    bool numa_aware;
+    bool huge_pages;
+    bool park_idle_connections;
+    bool measure_stack_usage;
+    bool http2;
+    bool websocket_deflate;
+    bool websocket_deflate_context_takeover;
+    bool websocket_ping;
+    bool send_rate_from_tcp_info;
+    /* Set if any URL map has a priority other than the normal one. */
+    bool schedule_by_priority;
 };
 
-struct lwan {
+#define LWAN_MAX_LISTENERS 16
+
+struct lwan_tls_context;
+
+struct lwan_listener {
+    char *address;
     struct lwan_trie url_map_trie;
+    /* Host names (lowercase, without port) mapped to the URL map trie of
+     * the virtual host serving them; NULL if there are no virtual hosts,
+     * and url_map_trie is used for hosts that aren't found. */
+    struct hash *virtual_hosts;
+    struct lwan_trie **virtual_host_tries;
+    unsigned int n_virtual_hosts;
+    /* NULL unless this listener accepts TLS connections; see lwan-tls.c */
+    struct lwan_tls_context *tls;
+    int fd;
+    /* Number of I/O threads dedicated to this listener; if 0, threads are
+     * shared with other listeners that don't have their own. */
+    unsigned int n_threads;
+    struct lwan_thread_pool pool;
+};
+
+struct lwan {
+    struct lwan_listener listeners[LWAN_MAX_LISTENERS];
+    unsigned int n_listeners;
+
+    /* Indexed by file descriptor; pages are only populated once the
+     * corresponding file descriptors are used. */
     struct lwan_connection *conns;
+    size_t conns_mapping_size;
+    /* Index in listeners[] of the listener that accepted each connection;
+     * only allocated if there's more than one listener. */
+    uint8_t *conn_listener;
+    /* Indexed by file descriptor; only allocated if io_uring is used. */
+    struct lwan_uring_poll *uring_polls;
     struct lwan_strbuf headers;
 
     struct {
         pthread_barrier_t barrier;
         struct lwan_thread *threads;
+        /* Thread each file descriptor is scheduled to the first time it's
+         * accepted, indexed by fd & schedtbl_mask; see lwan_thread_for_fd() */
+        uint32_t *schedtbl;
+        uint32_t schedtbl_mask;
         unsigned int max_fd;
         unsigned int count;
     } thread;
@@ -489,7 +798,20 @@ struct lwan {
     struct lwan_config config;
     struct coro_switcher switcher;
 
-    int main_socket;
+    int handover_fd;
+    /* Set while connections are drained after an upgrade. */
+    bool draining;
+
+    /* See lwan-pressure.c */
+    struct {
+        unsigned int fd_watermark;
+        int reserve_fd; /* For the main thread; see lwan_pressure_shed() */
+        int statm_fd;
+        size_t memory_watermark; /* In pages */
+        time_t fds_until;
+        time_t memory_sampled_at;
+        bool memory_high;
+    } pressure;
 
     unsigned int online_cpus;
     unsigned int available_cpus;
@@ -516,9 +838,38 @@ const char *lwan_request_get_cookie(struct lwan_request *request,
 const char *lwan_request_get_header(struct lwan_request *request,
                                     const char *header)
     __attribute__((warn_unused_result));
+const char *lwan_request_get_header_by_id(struct lwan_request *request,
+                                          enum lwan_header_id id)
+    __attribute__((warn_unused_result));
 
 void lwan_request_sleep(struct lwan_request *request, uint64_t ms);
 
+/* Timers run on the I/O thread that added them, outside of coroutines, so
+ * callbacks must not block or yield.  Timers with a non-zero interval
+ * repeat until cancelled; one-shot timers are freed after their callback
+ * returns and must not be cancelled afterwards.  Timers can only be added
+ * from, and cancelled by, the I/O thread they run on (e.g. from a request
+ * handler or from another timer callback).  lwan_timer_add_per_thread()
+ * can be called from any thread, after lwan_init(), to add a periodic
+ * timer to every I/O thread. */
+struct lwan_timer;
+typedef void (*lwan_timer_func)(struct lwan_timer *timer, void *data);
+struct lwan_timer *lwan_timer_add(unsigned int timeout_ms,
+                                  unsigned int interval_ms,
+                                  lwan_timer_func func,
+                                  void *data);
+void lwan_timer_cancel(struct lwan_timer *timer);
+int lwan_timer_add_per_thread(struct lwan *l,
+                              unsigned int interval_ms,
+                              lwan_timer_func func,
+                              void *data);
+
+bool lwan_response_append_ref(struct lwan_request *request,
+                              const void *data,
+                              size_t len,
+                              void (*release)(void *data),
+                              void *release_data);
+
 bool lwan_response_set_chunked(struct lwan_request *request,
                                enum lwan_http_status status);
 void lwan_response_send_chunk(struct lwan_request *request);
@@ -526,6 +877,7 @@ void lwan_response_send_chunk(struct lwan_request *request);
 bool lwan_response_set_event_stream(struct lwan_request *request,
                                     enum lwan_http_status status);
 void lwan_response_send_event(struct lwan_request *request, const char *event);
+void lwan_response_flush(struct lwan_request *request);
 
 
 const char *lwan_http_status_as_string(enum lwan_http_status status)
@@ -566,12 +918,46 @@ lwan_request_get_method(const struct lwan_request *request)
 int lwan_request_get_range(struct lwan_request *request,
                            off_t *from,
                            off_t *to);
+int lwan_request_get_byte_ranges(struct lwan_request *request,
+                                 off_t size,
+                                 struct lwan_byte_range *ranges,
+                                 size_t max_ranges);
 int lwan_request_get_if_modified_since(struct lwan_request *request,
                                        time_t *value);
+int lwan_request_get_if_none_match(struct lwan_request *request,
+                                   const char *etag);
 const struct lwan_value *
 lwan_request_get_request_body(struct lwan_request *request);
 const struct lwan_value *
 lwan_request_get_content_type(struct lwan_request *request);
+ssize_t lwan_request_read_body(struct lwan_request *request,
+                               void *buf,
+                               size_t len);
+
+/* Parts of a multipart/form-data body, read as they arrive if the handler
+ * streams its body.  Values point to memory that's valid until the next
+ * call to lwan_multipart_next_part(); filename.value is NULL for parts that
+ * aren't file uploads, and content_type defaults to "text/plain". */
+struct lwan_multipart;
+struct lwan_multipart_part {
+    struct lwan_value name;
+    struct lwan_value filename;
+    struct lwan_value content_type;
+};
+/* NULL with errno set if the body isn't multipart/form-data */
+struct lwan_multipart *lwan_multipart_open(struct lwan_request *request);
+/* 1 if *part has been filled, 0 after the last part, or -errno */
+int lwan_multipart_next_part(struct lwan_multipart *mp,
+                             struct lwan_multipart_part *part);
+/* Like read(2), returning 0 at the end of the current part */
+ssize_t lwan_multipart_read(struct lwan_multipart *mp, void *buf, size_t len);
+/* Writes what's left of the current part to an unlinked temporary file,
+ * returning its descriptor (closed when the request ends) or -errno */
+int lwan_multipart_save_part(struct lwan_multipart *mp, off_t *size);
+
+/* Elements are in the order they appear in the request, unless there are
+ * more than 32 of them, in which case they're sorted by key.  Callers that
+ * need a particular order must not rely on either. */
 const struct lwan_key_value_array *
 lwan_request_get_cookies(struct lwan_request *request);
 const struct lwan_key_value_array *
@@ -586,12 +972,41 @@ lwan_request_websocket_upgrade(struct lwan_request *request);
 void lwan_response_websocket_write(struct lwan_request *request);
 int lwan_response_websocket_read(struct lwan_request *request);
 int lwan_response_websocket_read_hint(struct lwan_request *request, size_t size_hint);
+/* Reads a message in pieces of up to max_size bytes into the response
+ * buffer, setting *last on its final piece, rather than buffering it whole.
+ * Don't mix with the functions above while a message is being read. */
+int lwan_response_websocket_read_partial(struct lwan_request *request,
+                                         size_t max_size,
+                                         bool *last);
 
 void lwan_request_await_read(struct lwan_request *r, int fd);
 void lwan_request_await_write(struct lwan_request *r, int fd);
 void lwan_request_await_read_write(struct lwan_request *r, int fd);
+/* Stops waking up @r when @fd, which has been awaited on, becomes ready.
+ * Meant for file descriptors that outlive the request, such as pooled
+ * connections, and that would otherwise stay watched (and wake it up for
+ * nothing) until the request is done.  Awaiting on @fd again is fine. */
+void lwan_request_await_forget(struct lwan_request *r, int fd);
 ssize_t lwan_request_async_read(struct lwan_request *r, int fd, void *buf, size_t len);
 ssize_t lwan_request_async_write(struct lwan_request *r, int fd, const void *buf, size_t len);
+/* Like pread() and pwrite(), for regular files, which can't be awaited on:
+ * the request is suspended until the I/O completes, using io_uring if the
+ * thread is driven by it, or the pool of threads for blocking calls
+ * otherwise.  See lwan-async-file.c. */
+ssize_t lwan_request_async_pread(struct lwan_request *r, int fd, void *buf,
+                                 size_t len, off_t offset);
+ssize_t lwan_request_async_pwrite(struct lwan_request *r, int fd,
+                                  const void *buf, size_t len, off_t offset);
+
+/* Calls @func(@data) in a thread from a pool meant for functions that
+ * block (e.g. libraries without a non-blocking API), returning what it
+ * returned.  The request is suspended meanwhile, so that the I/O thread
+ * can serve other connections; @data can be in the stack of the handler.
+ * If the request is aborted while @func is running, its I/O thread waits
+ * for @func to return before cleaning it up. */
+void *lwan_request_run_blocking(struct lwan_request *request,
+                                void *(*func)(void *data),
+                                void *data);
 
 #if defined(__cplusplus)
 }
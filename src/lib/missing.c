@@ -139,46 +139,75 @@ int clock_gettime(clockid_t clk_id, struct timespec *ts)
 #include <sys/time.h>
 #include <sys/types.h>
 
-#include "hash.h"
+/* kqueue takes a list of changes with every call to kevent(), so, rather
+ * than a system call for each call to epoll_ctl(), changes made by the
+ * thread waiting on a kqueue are accumulated and submitted together with
+ * the next call to epoll_wait().  Changes to kqueues of other threads are
+ * submitted right away, so they're never left behind.
+ *
+ * Errors from accumulated changes are only seen by kevent() at that point,
+ * so epoll_ctl() succeeds as long as the change could be queued.  Changes
+ * are made so they can't fail for reasons other than a file descriptor
+ * that has been closed in the meantime: filters that shouldn't report
+ * anything are disabled rather than deleted, as deleting a filter that
+ * wasn't added is an error.  (Closing a file descriptor removes all of its
+ * filters.) */
+
+#define MAX_PENDING_CHANGES 256
+
+static __thread struct {
+    int kq;
+    int n_changes;
+    struct kevent changes[MAX_PENDING_CHANGES];
+} pending = {.kq = -1};
 
 int epoll_create1(int flags __attribute__((unused))) { return kqueue(); }
 
-static int epoll_no_event_marker;
+/* With EV_RECEIPT, every change is applied even if some of them fail, and
+ * only their results are returned, leaving pending events alone. */
+static int submit_pending_changes(void)
+{
+    struct kevent receipts[MAX_PENDING_CHANGES];
+    int r;
+
+    for (int i = 0; i < pending.n_changes; i++)
+        pending.changes[i].flags |= EV_RECEIPT;
+
+    r = kevent(pending.kq, pending.changes, pending.n_changes, receipts,
+               pending.n_changes, &(struct timespec){});
+
+    pending.n_changes = 0;
+    return r;
+}
 
 int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 {
-    struct kevent ev;
+    struct kevent changes[2];
+    unsigned short read_flags, write_flags;
+    void *udata = NULL;
 
     switch (op) {
     case EPOLL_CTL_ADD:
     case EPOLL_CTL_MOD: {
-        int events = 0;
-        void *udata = event->data.ptr;
-        int flags = EV_ADD;
-
-        if (event->events & EPOLLIN) {
-            events = EVFILT_READ;
-        } else if (event->events & EPOLLOUT) {
-            events = EVFILT_WRITE;
-        } else {
-            events = EVFILT_WRITE;
-            udata = &epoll_no_event_marker;
-        }
+        unsigned short flags = EV_ADD;
 
         if (event->events & EPOLLONESHOT)
             flags |= EV_ONESHOT;
         if (event->events & EPOLLET)
             flags |= EV_CLEAR;
 
-        flags |= EV_ERROR; /* EPOLLERR is always set. */
-        flags |= EV_EOF;   /* EPOLLHUP is always set. */
-
-        EV_SET(&ev, fd, events, flags, 0, 0, udata);
+        /* Unlike epoll, kqueue keeps a filter for each direction, so
+         * whatever isn't asked for has to be turned off. */
+        read_flags =
+            flags | ((event->events & EPOLLIN) ? EV_ENABLE : EV_DISABLE);
+        write_flags =
+            flags | ((event->events & EPOLLOUT) ? EV_ENABLE : EV_DISABLE);
+        udata = event->data.ptr;
         break;
     }
 
     case EPOLL_CTL_DEL:
-        EV_SET(&ev, fd, 0, EV_DELETE, 0, 0, 0);
+        read_flags = write_flags = EV_ADD | EV_DISABLE;
         break;
 
     default:
@@ -186,7 +215,20 @@ int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
         return -1;
     }
 
-    return kevent(epfd, &ev, 1, NULL, 0, NULL);
+    EV_SET(&changes[0], (uintptr_t)fd, EVFILT_READ, read_flags, 0, 0, udata);
+    EV_SET(&changes[1], (uintptr_t)fd, EVFILT_WRITE, write_flags, 0, 0, udata);
+
+    if (epfd != pending.kq)
+        return kevent(epfd, changes, 2, NULL, 0, NULL);
+
+    if (pending.n_changes + 2 > MAX_PENDING_CHANGES &&
+        submit_pending_changes() < 0)
+        return -1;
+
+    memcpy(&pending.changes[pending.n_changes], changes, sizeof(changes));
+    pending.n_changes += 2;
+
+    return 0;
 }
 
 static struct timespec *to_timespec(struct timespec *t, int ms)
@@ -200,61 +242,105 @@ static struct timespec *to_timespec(struct timespec *t, int ms)
     return t;
 }
 
+static uint32_t kevent_to_epoll_events(const struct kevent *kev)
+{
+    uint32_t events = 0;
+
+    switch (kev->filter) {
+    case EVFILT_READ:
+        events |= EPOLLIN;
+        break;
+    case EVFILT_WRITE:
+        events |= EPOLLOUT;
+        break;
+    }
+
+    if (kev->flags & EV_EOF)
+        events |= kev->fflags ? (EPOLLRDHUP | EPOLLERR) : EPOLLRDHUP;
+
+    return events;
+}
+
 int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
 {
-    struct epoll_event *ev = events;
     struct kevent evs[maxevents];
+    /* Both filters of a file descriptor might have fired; epoll reports
+     * them as a single event.  Maps idents to events, with open
+     * addressing, in a table at least twice as large as the number of
+     * events. */
+    unsigned int table_size = 1;
     struct timespec tmspec;
-    struct hash *coalesce;
-    int i, r;
+    int n_events = 0;
+    int r;
 
-    coalesce = hash_int_new(NULL, NULL);
-    if (UNLIKELY(!coalesce))
-        return -1;
+    if (pending.kq != epfd) {
+        /* Threads only ever wait on one kqueue; if it's been closed, and
+         * its descriptor reused, whatever was queued for it is moot. */
+        pending.kq = epfd;
+        pending.n_changes = 0;
+    } else if (pending.n_changes > maxevents) {
+        /* Failed changes take room in evs[]; if there's not enough room
+         * for them, kevent() fails without waiting. */
+        (void)submit_pending_changes();
+    }
 
-    r = kevent(epfd, NULL, 0, evs, maxevents, to_timespec(&tmspec, timeout));
+    r = kevent(epfd, pending.changes, pending.n_changes, evs, maxevents,
+               to_timespec(&tmspec, timeout));
+    /* Changes are applied even if kevent() is interrupted; other errors
+     * are either about the kqueue itself, or reported in evs[]. */
+    pending.n_changes = 0;
     if (UNLIKELY(r < 0)) {
-        hash_free(coalesce);
+        if (errno == EBADF)
+            pending.kq = -1;
         return -1;
     }
 
-    for (i = 0; i < r; i++) {
-        struct kevent *kev = &evs[i];
-        uint32_t mask = (uint32_t)(uintptr_t)hash_find(
-            coalesce, (void *)(intptr_t)evs[i].ident);
+    while (table_size < (unsigned int)r * 2)
+        table_size <<= 1;
 
-        if (kev->flags & EV_ERROR)
-            mask |= EPOLLERR;
-        if (kev->flags & EV_EOF)
-            mask |= EPOLLRDHUP;
-
-        if (kev->filter == EVFILT_READ)
-            mask |= EPOLLIN;
-        else if (kev->filter == EVFILT_WRITE && evs[i].udata != &epoll_no_event_marker)
-            mask |= EPOLLOUT;
-
-        hash_add(coalesce, (void *)(intptr_t)evs[i].ident,
-                 (void *)(uintptr_t)mask);
-    }
+    struct {
+        uintptr_t ident;
+        int event;
+    } table[table_size];
+    memset(table, 0, sizeof(table[0]) * table_size);
 
-    for (i = 0; i < r; i++) {
-        void *maskptr;
+    for (int i = 0; i < r; i++) {
+        const struct kevent *kev = &evs[i];
+        unsigned int slot;
 
-        maskptr = hash_find(coalesce, (void *)(intptr_t)evs[i].ident);
-        if (maskptr) {
-            struct kevent *kev = &evs[i];
+        /* Failed changes, e.g. for file descriptors that have been closed
+         * with changes still queued. */
+        if (kev->flags & EV_ERROR)
+            continue;
+
+        /* See lwan_thread_nudge() */
+        if (kev->filter == EVFILT_USER) {
+            events[n_events++] = (struct epoll_event){
+                .events = EPOLLIN,
+                .data.ptr = kev->udata,
+            };
+            continue;
+        }
 
-            if (kev->udata == &epoll_no_event_marker)
-                continue;
+        for (slot = (unsigned int)kev->ident & (table_size - 1);
+             table[slot].ident && table[slot].ident != kev->ident + 1;
+             slot = (slot + 1) & (table_size - 1))
+            ;
 
-            ev->data.ptr = kev->udata;
-            ev->events = (uint32_t)(uintptr_t)maskptr;
-            ev++;
+        if (table[slot].ident) {
+            events[table[slot].event].events |= kevent_to_epoll_events(kev);
+            continue;
         }
+
+        table[slot].ident = kev->ident + 1;
+        table[slot].event = n_events;
+        events[n_events++] = (struct epoll_event){
+            .events = kevent_to_epoll_events(kev),
+            .data.ptr = kev->udata,
+        };
     }
 
-    hash_free(coalesce);
-    return (int)(intptr_t)(ev - events);
+    return n_events;
 }
 #elif !defined(HAVE_EPOLL)
 #error epoll() not implemented for this platform
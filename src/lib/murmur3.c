@@ -350,6 +350,17 @@ murmur3_simple(const void *keyptr)
 #endif
 }
 
+/* Unlike murmur3_simple(), doesn't depend on the (random) seed used by the
+ * hash tables, so it can be used for values that are persisted or sent to
+ * clients. */
+uint64_t
+murmur3_64(const void *data, size_t len, uint32_t seed)
+{
+    uint64_t hash[2];
+    MurmurHash3_x64_128(data, len, seed, hash);
+    return hash[0] ^ hash[1];
+}
+
 void
 murmur3_set_seed(const uint32_t seed)
 {
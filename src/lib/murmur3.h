@@ -5,11 +5,13 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 //-----------------------------------------------------------------------------
 
 void murmur3_set_seed(const uint32_t seed);
 unsigned int murmur3_simple(const void *key);
+uint64_t murmur3_64(const void *data, size_t len, uint32_t seed);
 
 //-----------------------------------------------------------------------------
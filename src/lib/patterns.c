@@ -49,6 +49,7 @@
 struct match_state {
 	int matchdepth;		/* control for recursive depth (to avoid C
 				 * stack overflow) */
+	unsigned int matchsteps; /* calls to match() left before giving up */
 	int repetitioncounter;	/* control the repetition items */
 	int maxcaptures;	/* configured capture limit */
 	const char *src_init;	/* init of source string */
@@ -70,6 +71,8 @@ static int
 match_error(struct match_state *ms, const char *error)
 {
 	ms->error = ms->error == NULL ? error : ms->error;
+	/* any backtracking still pending fails right away */
+	ms->matchsteps = 0;
 	return (-1);
 }
 
@@ -323,6 +326,12 @@ match(struct match_state *ms, const char *s, const char *p)
 	const char *ep, *res;
 	char previous;
 
+	if (UNLIKELY(ms->matchsteps == 0)) {
+		match_error(ms, "pattern match step budget exhausted");
+		return (NULL);
+	}
+	ms->matchsteps--;
+
 	if (UNLIKELY(ms->matchdepth-- == 0)) {
 		match_error(ms, "pattern too complex");
 		return (NULL);
@@ -561,16 +570,32 @@ nospecials(const char *p, size_t l)
 	return (1);
 }
 
+static void
+pattern_init(struct str_pattern *sp, const char *pattern)
+{
+	memset(sp, 0, sizeof(*sp));
+	sp->sp_pattern = pattern;
+	sp->sp_len = strlen(pattern);
+
+	if (nospecials(pattern, sp->sp_len)) {
+		sp->sp_plain = 1;
+	} else if (*pattern == '^') {
+		sp->sp_anchor = 1;
+		sp->sp_pattern++;
+		sp->sp_len--;	/* skip anchor character */
+	}
+}
+
 static int
-str_find_aux(struct match_state *ms, const char *pattern, const char *string,
-    struct str_find *sm, size_t nsm, off_t init)
+str_find_aux(struct match_state *ms, const struct str_pattern *sp,
+    const char *string, size_t ls, struct str_find *sm, size_t nsm,
+    off_t init)
 {
-	size_t		 ls = strlen(string);
-	size_t		 lp = strlen(pattern);
 	const char	*s = string;
-	const char	*p = pattern;
+	const char	*p = sp->sp_pattern;
+	size_t		 lp = sp->sp_len;
 	const char	*s1, *s2;
-	int		 anchor, i;
+	int		 i;
 
 	if (init < 0)
 		init = 0;
@@ -578,7 +603,7 @@ str_find_aux(struct match_state *ms, const char *pattern, const char *string,
 		return match_error(ms, "starting after string's end");
 	s1 = s + init;
 
-	if (nospecials(p, lp)) {
+	if (sp->sp_plain) {
 		/* do a plain search */
 		s2 = lmemfind(s1, ls - (size_t)init, p, lp);
 		if (s2 == NULL)
@@ -595,19 +620,30 @@ str_find_aux(struct match_state *ms, const char *pattern, const char *string,
 		return (i + 1);
 	}
 
-	anchor = (*p == '^');
-	if (anchor) {
-		p++;
-		lp--;	/* skip anchor character */
-	}
 	ms->maxcaptures = (int)((nsm > MAXCAPTURES ? MAXCAPTURES : nsm) - 1);
-	ms->matchdepth = MAXCCALLS;
+	ms->matchdepth = sp->sp_maxdepth ? sp->sp_maxdepth : MAXCCALLS;
+	ms->matchsteps = sp->sp_maxsteps ? sp->sp_maxsteps : MAXSTEPS;
 	ms->repetitioncounter = MAXREPETITION;
 	ms->src_init = s;
 	ms->src_end = s + ls;
 	ms->p_end = p + lp;
+
+	if (sp->sp_anchor && sp->sp_prefixlen != 0 &&
+	    ((size_t)(ms->src_end - s1) < sp->sp_prefixlen ||
+	    memcmp(s1, sp->sp_prefix, sp->sp_prefixlen) != 0))
+		return (0);
+
 	do {
 		const char *res;
+
+		if (!sp->sp_anchor && sp->sp_prefixlen != 0) {
+			/* a match can only start where its prefix is */
+			s1 = lmemfind(s1, (size_t)(ms->src_end - s1),
+			    sp->sp_prefix, sp->sp_prefixlen);
+			if (s1 == NULL)
+				return (0);
+		}
+
 		ms->level = 0;
 		if ((res = match(ms, s1, p)) != NULL) {
 			sm->sm_so = 0;
@@ -617,7 +653,7 @@ str_find_aux(struct match_state *ms, const char *pattern, const char *string,
 		} else if (ms->error != NULL) {
 			return 0;
 		}
-	} while (s1++ < ms->src_end && !anchor);
+	} while (s1++ < ms->src_end && !sp->sp_anchor);
 
 	return 0;
 }
@@ -625,6 +661,142 @@ str_find_aux(struct match_state *ms, const char *pattern, const char *string,
 int
 str_find(const char *string, const char *pattern, struct str_find *sm,
     size_t nsm, const char **errstr)
+{
+	struct str_pattern	sp;
+
+	pattern_init(&sp, pattern);
+
+	return str_pattern_find(&sp, string, strlen(string), sm, nsm, errstr);
+}
+
+static void
+pattern_require(struct str_pattern *sp, int c, int inprefix)
+{
+	sp->sp_required[uchar(c) / 64] |= 1ull << (uchar(c) % 64);
+
+	if (inprefix && sp->sp_prefixlen < sizeof(sp->sp_prefix))
+		sp->sp_prefix[sp->sp_prefixlen++] = (char)c;
+}
+
+/*
+ * Walks the pattern once, reporting the errors that match() would
+ * otherwise only find once a string happens to reach them, and noting
+ * the literal characters every match has to contain.  Lua patterns
+ * have no alternation, so any single character item that isn't
+ * followed by '*', '?' or '-' is required; those up to the first item
+ * that isn't a literal also form the prefix of every match.
+ */
+int
+str_pattern_compile(struct str_pattern *sp, const char *pattern,
+    const char **errstr)
+{
+	struct match_state	 ms;
+	const char		*p, *ep;
+	int			 c, suffix, inprefix = 1;
+	int			 ncaptures = 0, open = 0;
+	size_t			 i;
+
+	memset(&ms, 0, sizeof(ms));
+	pattern_init(sp, pattern);
+
+	if (sp->sp_plain) {
+		for (i = 0; i < sp->sp_len; i++)
+			pattern_require(sp, sp->sp_pattern[i], 1);
+		*errstr = NULL;
+		return (0);
+	}
+
+	p = sp->sp_pattern;
+	ms.p_end = p + sp->sp_len;
+	while (p < ms.p_end && ms.error == NULL) {
+		switch (*p) {
+		case '(':
+			/* captures don't consume anything */
+			if (++ncaptures >= MAXCAPTURES)
+				match_error(&ms, "too many captures");
+			open++;
+			p++;
+			continue;
+		case ')':
+			if (--open < 0)
+				match_error(&ms, "invalid pattern capture");
+			p++;
+			continue;
+		case '$':
+			if (p + 1 == ms.p_end) {
+				p++;
+				continue;
+			}
+			break;
+		case L_ESC:
+			switch (*(p + 1)) {
+			case 'b':
+				if (p + 3 >= ms.p_end) {
+					match_error(&ms, "malformed pattern "
+					    "(missing arguments to '%b')");
+					continue;
+				}
+				pattern_require(sp, p[2], inprefix);
+				pattern_require(sp, p[3], 0);
+				inprefix = 0;
+				p += 4;
+				continue;
+			case 'f':
+				p += 2;
+				if (*p != '[') {
+					match_error(&ms, "missing '['"
+					    " after '%f' in pattern");
+					continue;
+				}
+				p = classend(&ms, p);
+				inprefix = 0;
+				continue;
+			case '0' ... '9':
+				p += 2;
+				inprefix = 0;
+				continue;
+			}
+			break;
+		}
+
+		/* single character class plus optional suffix */
+		ep = classend(&ms, p);
+		if (ms.error != NULL)
+			break;
+		suffix = ep < ms.p_end ? *ep : '\0';
+		if (suffix == '*' || suffix == '?' || suffix == '-') {
+			inprefix = 0;
+			p = ep + 1;
+			continue;
+		}
+
+		if (*p == L_ESC)
+			c = isalnum(uchar(*(p + 1))) ? -1 : *(p + 1);
+		else if (*p == '[' || *p == '.')
+			c = -1;
+		else
+			c = *p;
+		if (c < 0)
+			inprefix = 0;
+		else
+			pattern_require(sp, c, inprefix);
+
+		if (suffix == '+') {
+			inprefix = 0;
+			ep++;
+		}
+		p = ep;
+	}
+	if (ms.error == NULL && open > 0)
+		match_error(&ms, "unfinished capture");
+
+	*errstr = ms.error;
+	return (ms.error != NULL ? -1 : 0);
+}
+
+int
+str_pattern_find(const struct str_pattern *sp, const char *string,
+    size_t len, struct str_find *sm, size_t nsm, const char **errstr)
 {
 	struct match_state	ms;
 	int			ret;
@@ -632,7 +804,7 @@ str_find(const char *string, const char *pattern, struct str_find *sm,
 	memset(&ms, 0, sizeof(ms));
 	memset(sm, 0, nsm * sizeof(*sm));
 
-	ret = str_find_aux(&ms, pattern, string, sm, nsm, 0);
+	ret = str_find_aux(&ms, sp, string, len, sm, nsm, 0);
 	if (ms.error != NULL) {
 		/* Return 0 on error and store the error string */
 		*errstr = ms.error;
@@ -648,6 +820,7 @@ str_match(const char *string, const char *pattern, struct str_match *m,
     const char **errstr)
 {
 	struct str_find		 sm[MAXCAPTURES];
+	struct str_pattern	 sp;
 	struct match_state	 ms;
 	int			 i, ret;
 	size_t			 len, nsm;
@@ -656,8 +829,9 @@ str_match(const char *string, const char *pattern, struct str_match *m,
 	memset(&ms, 0, sizeof(ms));
 	memset(sm, 0, sizeof(sm));
 	memset(m, 0, sizeof(*m));
+	pattern_init(&sp, pattern);
 
-	ret = str_find_aux(&ms, pattern, string, sm, nsm, 0);
+	ret = str_find_aux(&ms, &sp, string, strlen(string), sm, nsm, 0);
 	if (ret <= 0 || ms.error != NULL) {
 		/* Return -1 on error and store the error string */
 		*errstr = ms.error;
@@ -20,9 +20,11 @@
 #define PATTERNS_H
 
 #include <sys/types.h>
+#include <stdint.h>
 
 #define MAXCAPTURES	32	/* Max no. of allowed captures in pattern */
 #define MAXCCALLS	200	/* Max recusion depth in pattern matching */
+#define MAXSTEPS	100000	/* Default budget of match() calls per search */
 #define MAXREPETITION	0xfffff	/* Max for repetition items */
 
 struct str_find {
@@ -35,8 +37,34 @@ struct str_match {
 	int		  sm_nmatch; /* number of elements in array */
 };
 
+/*
+ * A pattern checked once and analyzed ahead of matching: every match
+ * starts with sp_prefix, and contains every byte set in sp_required.
+ * sp_pattern points into the string given to str_pattern_compile(),
+ * which has to outlive it.  Searches give up, with an error, once
+ * they've backtracked sp_maxsteps times or recursed sp_maxdepth levels
+ * deep, so that no string takes too long to be ruled out.
+ */
+struct str_pattern {
+	const char	*sp_pattern;	/* pattern, without the '^' anchor */
+	size_t		 sp_len;	/* length of sp_pattern */
+	int		 sp_anchor;	/* pattern starts with '^' */
+	int		 sp_plain;	/* no specials: plain substring search */
+	size_t		 sp_prefixlen;	/* length of sp_prefix */
+	char		 sp_prefix[32];	/* literal all matches start with */
+	uint64_t	 sp_required[4]; /* bytes all matches contain */
+	unsigned int	 sp_maxsteps;	/* match() calls per search, or 0 for
+					 * MAXSTEPS */
+	int		 sp_maxdepth;	/* max recursion depth, or 0 for
+					 * MAXCCALLS */
+};
+
 int	 str_find(const char *, const char *, struct str_find *, size_t,
 	    const char **);
+int	 str_pattern_compile(struct str_pattern *, const char *,
+	    const char **);
+int	 str_pattern_find(const struct str_pattern *, const char *, size_t,
+	    struct str_find *, size_t, const char **);
 int	 str_match(const char *, const char *, struct str_match *,
 	    const char **);
 void	 str_match_free(struct str_match *);
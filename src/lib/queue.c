@@ -113,3 +113,12 @@ bool spsc_queue_pop(struct spsc_queue *q, int *output)
 
     return false;
 }
+
+size_t spsc_queue_length(const struct spsc_queue *q)
+{
+    /* Might be called by a thread other than the producer or the consumer,
+     * so this is only an approximation. */
+    const size_t tail = ATOMIC_LOAD(&q->tail, ATOMIC_ACQUIRE);
+
+    return (ATOMIC_LOAD(&q->head, ATOMIC_ACQUIRE) - tail) & q->mask;
+}
@@ -32,3 +32,5 @@ void spsc_queue_free(struct spsc_queue *q);
 bool spsc_queue_push(struct spsc_queue *q, int input);
 
 bool spsc_queue_pop(struct spsc_queue *q, int *output);
+
+size_t spsc_queue_length(const struct spsc_queue *q);
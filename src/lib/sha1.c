@@ -49,7 +49,7 @@ A million repetitions of "a"
 
 #define STATE(i)		state[(index + (i)) % 5]
 
-static void sha1_transform(uint32_t orig_state[5], const unsigned char buffer[64])
+static void sha1_transform_block(uint32_t orig_state[5], const unsigned char buffer[64])
 {
     uint32_t state[5];
     uint32_t block[16];
@@ -91,6 +91,164 @@ static void sha1_transform(uint32_t orig_state[5], const unsigned char buffer[64
     __asm__ volatile("" : : "g"(block), "g"(state) : "memory");
 }
 
+static void sha1_transform_scalar(uint32_t state[5],
+                                  const unsigned char *data,
+                                  size_t n_blocks)
+{
+    for (; n_blocks; n_blocks--, data += 64)
+        sha1_transform_block(state, data);
+}
+
+/* Blocks are preferably hashed with the SHA extensions of x86 (picked at
+ * runtime): they do four rounds per instruction and also take care of most
+ * of the message schedule.  This follows the public domain implementation
+ * by Sean Gulley. */
+#if defined(__x86_64__) && defined(HAVE_BUILTIN_CPU_INIT) &&                  \
+    defined(HAVE_TARGET_SHA)
+#define HAVE_SHA1_SHANI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(HAVE_SHA1_SHANI)
+/* Four rounds, using (and discarding) e_in, and saving the current state
+ * in e_out to derive E for the next four rounds. */
+#define SHANI_ROUNDS(e_in, e_out, msg, func)                                   \
+    do {                                                                       \
+        e_in = _mm_sha1nexte_epu32(e_in, msg);                                 \
+        e_out = abcd;                                                          \
+        abcd = _mm_sha1rnds4_epu32(abcd, e_in, func);                          \
+    } while (0)
+
+/* Works on W[t+4..t+16) while W[t..t+4) (cur) is being used. */
+#define SHANI_SCHEDULE(cur, next, prev, prev2)                                 \
+    do {                                                                       \
+        next = _mm_sha1msg2_epu32(next, cur);                                  \
+        prev = _mm_sha1msg1_epu32(prev, cur);                                  \
+        prev2 = _mm_xor_si128(prev2, cur);                                     \
+    } while (0)
+
+__attribute__((target("sha,sse4.1"))) static void
+sha1_transform_shani(uint32_t state[5], const unsigned char *data, size_t n_blocks)
+{
+    const __m128i bswap =
+        _mm_set_epi64x(0x0001020304050607ll, 0x08090a0b0c0d0e0fll);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)state), 0x1b);
+    __m128i e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+
+#if defined(__AVX__)
+    /* The SHA instructions only have legacy SSE encodings, and mixing them
+     * with dirty upper halves of the AVX registers is very slow. */
+    _mm256_zeroupper();
+#endif
+
+    for (; n_blocks; n_blocks--, data += 64) {
+        const __m128i abcd_saved = abcd;
+        const __m128i e0_saved = e0;
+        __m128i e1;
+        __m128i m0 =
+            _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(data + 0)), bswap);
+        __m128i m1 =
+            _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(data + 16)), bswap);
+        __m128i m2 =
+            _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(data + 32)), bswap);
+        __m128i m3 =
+            _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(data + 48)), bswap);
+
+        /* Rounds 0-3 */
+        e0 = _mm_add_epi32(e0, m0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        /* Rounds 4-15 */
+        SHANI_ROUNDS(e1, e0, m1, 0);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+        SHANI_ROUNDS(e0, e1, m2, 0);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+        SHANI_ROUNDS(e1, e0, m3, 0);
+        SHANI_SCHEDULE(m3, m0, m2, m1);
+
+        /* Rounds 16-63 */
+        SHANI_ROUNDS(e0, e1, m0, 0);
+        SHANI_SCHEDULE(m0, m1, m3, m2);
+        SHANI_ROUNDS(e1, e0, m1, 1);
+        SHANI_SCHEDULE(m1, m2, m0, m3);
+        SHANI_ROUNDS(e0, e1, m2, 1);
+        SHANI_SCHEDULE(m2, m3, m1, m0);
+        SHANI_ROUNDS(e1, e0, m3, 1);
+        SHANI_SCHEDULE(m3, m0, m2, m1);
+        SHANI_ROUNDS(e0, e1, m0, 1);
+        SHANI_SCHEDULE(m0, m1, m3, m2);
+        SHANI_ROUNDS(e1, e0, m1, 1);
+        SHANI_SCHEDULE(m1, m2, m0, m3);
+        SHANI_ROUNDS(e0, e1, m2, 2);
+        SHANI_SCHEDULE(m2, m3, m1, m0);
+        SHANI_ROUNDS(e1, e0, m3, 2);
+        SHANI_SCHEDULE(m3, m0, m2, m1);
+        SHANI_ROUNDS(e0, e1, m0, 2);
+        SHANI_SCHEDULE(m0, m1, m3, m2);
+        SHANI_ROUNDS(e1, e0, m1, 2);
+        SHANI_SCHEDULE(m1, m2, m0, m3);
+        SHANI_ROUNDS(e0, e1, m2, 2);
+        SHANI_SCHEDULE(m2, m3, m1, m0);
+        SHANI_ROUNDS(e1, e0, m3, 3);
+        SHANI_SCHEDULE(m3, m0, m2, m1);
+
+        /* Rounds 64-79 */
+        SHANI_ROUNDS(e0, e1, m0, 3);
+        SHANI_SCHEDULE(m0, m1, m3, m2);
+        SHANI_ROUNDS(e1, e0, m1, 3);
+        m2 = _mm_sha1msg2_epu32(m2, m1);
+        m3 = _mm_xor_si128(m3, m1);
+        SHANI_ROUNDS(e0, e1, m2, 3);
+        m3 = _mm_sha1msg2_epu32(m3, m2);
+        SHANI_ROUNDS(e1, e0, m3, 3);
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_saved);
+        abcd = _mm_add_epi32(abcd, abcd_saved);
+    }
+
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+#undef SHANI_ROUNDS
+#undef SHANI_SCHEDULE
+#endif
+
+size_t sha1_get_transform_kernels(struct sha1_transform_kernel kernels[static 2])
+{
+    size_t n = 0;
+
+#if defined(HAVE_SHA1_SHANI)
+    unsigned int eax, ebx, ecx, edx;
+
+    /* Not every compiler knows about __builtin_cpu_supports("sha"), so
+     * look at the CPUID bit directly. */
+    __builtin_cpu_init();
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+        (ebx & bit_SHA) && __builtin_cpu_supports("sse4.1")) {
+        kernels[n++] = (struct sha1_transform_kernel){"sha-ni", sha1_transform_shani};
+    }
+#endif
+    kernels[n++] = (struct sha1_transform_kernel){"scalar", sha1_transform_scalar};
+
+    return n;
+}
+
+static void (*sha1_transform)(uint32_t state[5],
+                              const unsigned char *data,
+                              size_t n_blocks) = sha1_transform_scalar;
+
+__attribute__((constructor)) static void initialize_sha1_transform(void)
+{
+    struct sha1_transform_kernel kernels[2];
+
+    sha1_get_transform_kernels(kernels);
+    sha1_transform = kernels[0].transform;
+}
+
 /* sha1_init - Initialize new context */
 
 void sha1_init(sha1_context *context)
@@ -115,22 +273,21 @@ void sha1_update(sha1_context *context, const unsigned char *data, size_t len)
     if ((context->count[0] += len << 3) < j)
         context->count[1]++;
     context->count[1] += (len >> 29);
-
     j = (j >> 3) & 63;
-
     if ((j + len) > 63) {
         i = 64 - j;
         memcpy(&context->buffer[j], data, i);
-        sha1_transform(context->state, context->buffer);
-
-        for (; i + 63 < len; i += 64)
-            sha1_transform(context->state, &data[i]);
+        sha1_transform(context->state, context->buffer, 1);
+        if (len - i >= 64) {
+            const size_t n_blocks = (len - i) / 64;
 
+            sha1_transform(context->state, &data[i], n_blocks);
+            i += n_blocks * 64;
+        }
         j = 0;
     } else {
         i = 0;
     }
-
     memcpy(&context->buffer[j], &data[i], len - i);
 }
 
@@ -138,9 +295,9 @@ void sha1_update(sha1_context *context, const unsigned char *data, size_t len)
 
 void sha1_finalize(sha1_context *context, unsigned char digest[20])
 {
-    unsigned i;
+    size_t used = (context->count[0] >> 3) & 63;
     unsigned char finalcount[8];
-    unsigned char c;
+    unsigned i;
 
     for (i = 0; i < 8; i++) {
         finalcount[i] = (unsigned char)((context->count[(i >= 4 ? 0 : 1)] >>
@@ -148,23 +305,26 @@ void sha1_finalize(sha1_context *context, unsigned char digest[20])
                                         255); /* Endian independent */
     }
 
-    c = 0200;
-    sha1_update(context, &c, 1);
-    while ((context->count[0] & 504) != 448) {
-        c = 0000;
-        sha1_update(context, &c, 1);
+    /* Padding is written straight into the buffer: a 1 bit, zeros, and
+     * the message length in bits, possibly spilling into another block. */
+    context->buffer[used++] = 0200;
+    if (used > 56) {
+        memset(&context->buffer[used], 0, 64 - used);
+        sha1_transform(context->state, context->buffer, 1);
+        used = 0;
     }
-    sha1_update(context, finalcount, 8); /* Should cause a sha1_transform() */
+    memset(&context->buffer[used], 0, 56 - used);
+    memcpy(&context->buffer[56], finalcount, 8);
+    sha1_transform(context->state, context->buffer, 1);
+
     for (i = 0; i < 20; i++) {
         digest[i] =
             (unsigned char)((context->state[i >> 2] >> ((3 - (i & 3)) * 8)) &
                             255);
     }
-
     /* Wipe variables */
     memset(context, '\0', sizeof(*context));
     __asm__ volatile("" : : "g"(context) : "memory");
-
     memset(&finalcount, '\0', sizeof(finalcount));
     __asm__ volatile("" : : "g"(finalcount) : "memory");
 }
@@ -18,3 +18,13 @@ typedef struct {
 void sha1_init(sha1_context* context);
 void sha1_update(sha1_context* context, const unsigned char* data, size_t len);
 void sha1_finalize(sha1_context* context, unsigned char digest[20]);
+
+/* Exposed for handshake_bench: every routine to hash whole blocks that
+ * this CPU supports, the first being the one in use. */
+struct sha1_transform_kernel {
+    const char *name;
+    void (*transform)(uint32_t state[5],
+                      const unsigned char *data,
+                      size_t n_blocks);
+};
+size_t sha1_get_transform_kernels(struct sha1_transform_kernel kernels[static 2]);
@@ -0,0 +1,666 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2024 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/* Load generator for the chatr sample: connects a number of users to the
+ * chat room, has a few of them send messages at a fixed rate, and measures
+ * how many messages were delivered to everybody and how long it took for
+ * them to arrive.  Users are plain non-blocking sockets handled by a few
+ * epoll threads, so that hundreds of thousands of them can be simulated by
+ * a single process; when connecting to a loopback address, connections are
+ * spread among 127.0.0.0/8 source addresses so that the number of users
+ * isn't limited by the range of ephemeral ports. */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PENDING_FRAME 512
+#define MAX_CONNECTING_PER_THREAD 256
+#define USERS_PER_SOURCE_ADDRESS 20000
+#define LATENCY_BUCKETS 32
+
+enum user_state {
+    USER_IDLE,
+    USER_CONNECTING,
+    USER_UPGRADING,
+    USER_HANDSHAKING,
+    USER_READY,
+    USER_CLOSED,
+};
+
+struct user {
+    int fd;
+    unsigned int id;
+    enum user_state state;
+    uint64_t next_send_ns;
+    uint16_t pending_len;
+    unsigned char pending[MAX_PENDING_FRAME];
+};
+
+struct worker {
+    pthread_t thread;
+    int epoll_fd;
+
+    struct user *users;
+    unsigned int n_users;
+    unsigned int next_to_connect;
+    unsigned int connecting;
+
+    uint64_t sent;
+    uint64_t delivered;
+    uint64_t disconnects;
+    uint64_t latency[LATENCY_BUCKETS]; /* log2 of microseconds */
+    uint64_t max_latency_ns;
+};
+
+static struct {
+    struct sockaddr_in server;
+    bool loopback;
+    unsigned int users;
+    unsigned int senders;
+    unsigned int rate;
+    unsigned int duration;
+    unsigned int n_workers;
+} config = {
+    .users = 10000,
+    .senders = 10,
+    .rate = 10,
+    .duration = 10,
+    .n_workers = 2,
+};
+
+enum phase { PHASE_CONNECTING, PHASE_SENDING, PHASE_DRAINING, PHASE_DONE };
+
+static unsigned int users_ready;
+static enum phase phase = PHASE_CONNECTING;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    /* Messages are small enough to fit in the socket buffer; if they
+     * don't, the server isn't keeping up, so give up on this user. */
+    return write(fd, buf, len) == (ssize_t)len;
+}
+
+static bool send_frame(struct user *user, const char *payload, size_t len)
+{
+    unsigned char frame[256];
+    size_t header_len;
+
+    if (len > sizeof(frame) - 8)
+        return false;
+
+    /* Client frames must be masked; a zero masking key leaves the payload
+     * as is, which is all a load generator needs. */
+    frame[0] = 0x81; /* FIN + text */
+    if (len < 126) {
+        frame[1] = 0x80 | (unsigned char)len;
+        header_len = 2;
+    } else {
+        frame[1] = 0x80 | 126;
+        frame[2] = (unsigned char)(len >> 8);
+        frame[3] = (unsigned char)len;
+        header_len = 4;
+    }
+    memset(frame + header_len, 0, 4);
+    header_len += 4;
+    memcpy(frame + header_len, payload, len);
+
+    return write_all(user->fd, frame, header_len + len);
+}
+
+static void close_user(struct worker *worker, struct user *user)
+{
+    if (user->state == USER_CONNECTING || user->state == USER_UPGRADING ||
+        user->state == USER_HANDSHAKING)
+        worker->connecting--;
+    else if (user->state == USER_READY)
+        worker->disconnects++;
+
+    close(user->fd);
+    user->fd = -1;
+    user->state = USER_CLOSED;
+}
+
+static bool connect_user(struct worker *worker, struct user *user)
+{
+    struct epoll_event event = {.events = EPOLLOUT, .data.ptr = user};
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return false;
+
+    if (config.loopback) {
+        struct sockaddr_in source = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr =
+                htonl(INADDR_LOOPBACK + user->id / USERS_PER_SOURCE_ADDRESS),
+        };
+        int one = 1;
+
+        /* Let connect() pick the port, so that it's unique per source
+         * address rather than globally */
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *)&source, sizeof(source)) < 0) {
+            close(fd);
+            return false;
+        }
+    }
+
+    if (connect(fd, (struct sockaddr *)&config.server, sizeof(config.server)) <
+            0 &&
+        errno != EINPROGRESS) {
+        close(fd);
+        return false;
+    }
+
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        close(fd);
+        return false;
+    }
+
+    user->fd = fd;
+    user->state = USER_CONNECTING;
+    worker->connecting++;
+    return true;
+}
+
+static void connect_more_users(struct worker *worker)
+{
+    while (worker->connecting < MAX_CONNECTING_PER_THREAD &&
+           worker->next_to_connect < worker->n_users) {
+        struct user *user = &worker->users[worker->next_to_connect++];
+
+        if (!connect_user(worker, user)) {
+            fprintf(stderr, "Could not connect user %u: %s\n", user->id,
+                    strerror(errno));
+            user->state = USER_CLOSED;
+        }
+    }
+}
+
+static bool send_upgrade(struct worker *worker, struct user *user)
+{
+    static const char request[] = "GET /chat HTTP/1.1\r\n"
+                                  "Host: localhost\r\n"
+                                  "Upgrade: websocket\r\n"
+                                  "Connection: Upgrade\r\n"
+                                  "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                  "Sec-WebSocket-Version: 13\r\n"
+                                  "\r\n";
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = user};
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+
+    if (getsockopt(user->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 ||
+        error)
+        return false;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, user->fd, &event) < 0)
+        return false;
+    if (!write_all(user->fd, request, sizeof(request) - 1))
+        return false;
+
+    user->state = USER_UPGRADING;
+    return true;
+}
+
+static void record_delivery(struct worker *worker, const char *record)
+{
+    const char *args = strstr(record, "\"arguments\":[\"");
+    uint64_t sent_ns, latency_ns, latency_us;
+    unsigned int bucket;
+
+    worker->delivered++;
+
+    /* The second argument is the time the message was sent */
+    if (!args || !(args = strstr(args, "\",\"")))
+        return;
+    sent_ns = strtoull(args + 3, NULL, 10);
+    if (!sent_ns)
+        return;
+
+    latency_ns = now_ns() - sent_ns;
+    if (latency_ns > worker->max_latency_ns)
+        worker->max_latency_ns = latency_ns;
+
+    latency_us = latency_ns / 1000;
+    bucket = latency_us ? 64 - (unsigned int)__builtin_clzll(latency_us) : 0;
+    if (bucket >= LATENCY_BUCKETS)
+        bucket = LATENCY_BUCKETS - 1;
+    worker->latency[bucket]++;
+}
+
+static bool handle_payload(struct worker *worker,
+                           struct user *user,
+                           char *payload,
+                           size_t len)
+{
+    char *end = payload + len;
+
+    while (payload < end) {
+        char *separator = memchr(payload, '\x1e', (size_t)(end - payload));
+
+        if (!separator)
+            break;
+        *separator = '\0';
+
+        if (user->state == USER_HANDSHAKING) {
+            if (strcmp(payload, "{}"))
+                return false;
+            user->state = USER_READY;
+            worker->connecting--;
+            __atomic_fetch_add(&users_ready, 1, __ATOMIC_RELAXED);
+        } else if (strstr(payload, "\"target\":\"send\"")) {
+            record_delivery(worker, payload);
+        }
+
+        payload = separator + 1;
+    }
+
+    return true;
+}
+
+/* Returns the number of bytes consumed, or -1 on error */
+static ssize_t handle_frames(struct worker *worker,
+                             struct user *user,
+                             unsigned char *buf,
+                             size_t len)
+{
+    size_t consumed = 0;
+
+    while (len - consumed >= 2) {
+        unsigned char *frame = buf + consumed;
+        size_t available = len - consumed;
+        size_t header_len = 2;
+        uint64_t payload_len = frame[1] & 0x7f;
+
+        if (payload_len == 126) {
+            if (available < 4)
+                break;
+            payload_len = (uint64_t)frame[2] << 8 | frame[3];
+            header_len = 4;
+        } else if (payload_len == 127) {
+            return -1; /* Nothing this big is expected */
+        }
+
+        if (available < header_len + payload_len)
+            break;
+
+        switch (frame[0] & 0x0f) {
+        case 0x1: /* Text */
+            if (!handle_payload(worker, user, (char *)frame + header_len,
+                                (size_t)payload_len))
+                return -1;
+            break;
+        case 0x8: /* Close */
+            return -1;
+        }
+
+        consumed += header_len + (size_t)payload_len;
+    }
+
+    return (ssize_t)consumed;
+}
+
+static bool handle_upgrade_response(struct user *user,
+                                    char *buf,
+                                    size_t len,
+                                    size_t *consumed)
+{
+    static const char handshake[] = "{\"protocol\":\"json\",\"version\":1}\x1e";
+    char *end_of_headers = memmem(buf, len, "\r\n\r\n", 4);
+
+    /* The response to the upgrade request is small enough to be read at
+     * once */
+    if (!end_of_headers || strncmp(buf, "HTTP/1.1 101 ", 13))
+        return false;
+
+    *consumed = (size_t)(end_of_headers + 4 - buf);
+    user->state = USER_HANDSHAKING;
+
+    return send_frame(user, handshake, sizeof(handshake) - 1);
+}
+
+static bool read_from_user(struct worker *worker, struct user *user)
+{
+    static __thread unsigned char buf[65536 + MAX_PENDING_FRAME];
+
+    while (true) {
+        size_t len = user->pending_len;
+        size_t offset = 0;
+        ssize_t r;
+
+        memcpy(buf, user->pending, len);
+        r = read(user->fd, buf + len, sizeof(buf) - len);
+        if (r < 0)
+            return errno == EAGAIN;
+        if (r == 0)
+            return false;
+        len += (size_t)r;
+
+        if (user->state == USER_UPGRADING &&
+            !handle_upgrade_response(user, (char *)buf, len, &offset))
+            return false;
+
+        r = handle_frames(worker, user, buf + offset, len - offset);
+        if (r < 0)
+            return false;
+        offset += (size_t)r;
+
+        if (len - offset > MAX_PENDING_FRAME)
+            return false;
+        user->pending_len = (uint16_t)(len - offset);
+        memcpy(user->pending, buf + offset, user->pending_len);
+    }
+}
+
+static void send_messages(struct worker *worker)
+{
+    const uint64_t now = now_ns();
+    const uint64_t interval = 1000000000ull / config.rate;
+
+    for (unsigned int i = 0; i < worker->n_users; i++) {
+        struct user *user = &worker->users[i];
+        char message[128];
+        int len;
+
+        if (user->id >= config.senders)
+            break; /* Senders come first */
+        if (user->state != USER_READY || user->next_send_ns > now)
+            continue;
+
+        len = snprintf(message, sizeof(message),
+                       "{\"type\":1,\"target\":\"send\","
+                       "\"arguments\":[\"user%u\",\"%" PRIu64 "\"]}\x1e",
+                       user->id, now);
+        if (!send_frame(user, message, (size_t)len)) {
+            close_user(worker, user);
+            continue;
+        }
+
+        worker->sent++;
+        /* Don't try to catch up if the loop fell behind */
+        user->next_send_ns =
+            user->next_send_ns + interval > now ? user->next_send_ns + interval
+                                                : now + interval;
+    }
+}
+
+static void *worker_thread(void *data)
+{
+    struct worker *worker = data;
+    struct epoll_event events[256];
+    uint64_t sending_since = 0;
+
+    while (true) {
+        enum phase current = __atomic_load_n(&phase, __ATOMIC_ACQUIRE);
+        int n_events;
+
+        if (current == PHASE_DONE)
+            break;
+
+        connect_more_users(worker);
+
+        if (current == PHASE_SENDING) {
+            if (!sending_since) {
+                const uint64_t interval = 1000000000ull / config.rate;
+
+                /* Spread senders over the interval between messages */
+                sending_since = now_ns();
+                for (unsigned int i = 0; i < worker->n_users; i++) {
+                    if (worker->users[i].id >= config.senders)
+                        break;
+                    worker->users[i].next_send_ns =
+                        sending_since +
+                        interval * worker->users[i].id / config.senders;
+                }
+            }
+            send_messages(worker);
+        }
+
+        n_events = epoll_wait(worker->epoll_fd, events, 256,
+                              current == PHASE_SENDING ? 1 : 100);
+        for (int i = 0; i < n_events; i++) {
+            struct user *user = events[i].data.ptr;
+            bool ok;
+
+            if (user->state == USER_CONNECTING)
+                ok = send_upgrade(worker, user);
+            else
+                ok = !(events[i].events & (EPOLLERR | EPOLLHUP)) &&
+                     read_from_user(worker, user);
+
+            if (!ok)
+                close_user(worker, user);
+        }
+    }
+
+    return NULL;
+}
+
+static void raise_fd_limit(void)
+{
+    struct rlimit r;
+
+    if (getrlimit(RLIMIT_NOFILE, &r) < 0)
+        return;
+    if (r.rlim_cur != r.rlim_max) {
+        r.rlim_cur = r.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &r);
+    }
+    if (r.rlim_cur < config.users + 64) {
+        fprintf(stderr,
+                "Warning: can only open %lu files; not all users might be "
+                "able to connect\n",
+                (unsigned long)r.rlim_cur);
+    }
+}
+
+static uint64_t latency_percentile(const uint64_t latency[], double p)
+{
+    uint64_t total = 0, seen = 0;
+
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+        total += latency[i];
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += latency[i];
+        if (seen && (double)seen >= (double)total * p)
+            return i ? 1ull << i : 1; /* Upper bound of the bucket, in us */
+    }
+    return 0;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [-a address] [-p port] [-u users] [-s senders]\n"
+            "       [-r messages per second per sender] [-d seconds] "
+            "[-t threads]\n",
+            argv0);
+    exit(1);
+}
+
+static unsigned int parse_uint(const char *argv0, const char *arg)
+{
+    char *end;
+    unsigned long value = strtoul(arg, &end, 10);
+
+    if (*end || !value || value > UINT32_MAX)
+        usage(argv0);
+    return (unsigned int)value;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *address = "127.0.0.1";
+    unsigned int port = 8080;
+    struct worker *workers;
+    uint64_t connect_start, connect_end, sending_start, sending_end;
+    uint64_t sent = 0, delivered = 0, disconnects = 0, max_latency_ns = 0;
+    uint64_t latency[LATENCY_BUCKETS] = {};
+    unsigned int connected;
+    double elapsed;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:p:u:s:r:d:t:")) != -1) {
+        switch (opt) {
+        case 'a': address = optarg; break;
+        case 'p': port = parse_uint(argv[0], optarg); break;
+        case 'u': config.users = parse_uint(argv[0], optarg); break;
+        case 's': config.senders = parse_uint(argv[0], optarg); break;
+        case 'r': config.rate = parse_uint(argv[0], optarg); break;
+        case 'd': config.duration = parse_uint(argv[0], optarg); break;
+        case 't': config.n_workers = parse_uint(argv[0], optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (config.senders > config.users || port > 65535)
+        usage(argv[0]);
+
+    config.server.sin_family = AF_INET;
+    config.server.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, address, &config.server.sin_addr) != 1)
+        usage(argv[0]);
+    config.loopback = (ntohl(config.server.sin_addr.s_addr) >> 24) == 127;
+
+    raise_fd_limit();
+
+    workers = calloc(config.n_workers, sizeof(*workers));
+    if (!workers) {
+        perror("calloc");
+        return 1;
+    }
+
+    for (unsigned int w = 0; w < config.n_workers; w++) {
+        struct worker *worker = &workers[w];
+
+        worker->n_users = config.users / config.n_workers +
+                          (w < config.users % config.n_workers);
+        worker->users = calloc(worker->n_users, sizeof(*worker->users));
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (!worker->users || worker->epoll_fd < 0) {
+            perror("Could not create worker");
+            return 1;
+        }
+
+        /* User IDs are interleaved among workers, so senders (with the
+         * lowest IDs) are spread among them and come first in each */
+        for (unsigned int i = 0; i < worker->n_users; i++) {
+            worker->users[i].id = i * config.n_workers + w;
+            worker->users[i].fd = -1;
+        }
+    }
+
+    printf("Connecting %u users to %s:%u...\n", config.users, address, port);
+    connect_start = now_ns();
+    for (unsigned int w = 0; w < config.n_workers; w++) {
+        if (pthread_create(&workers[w].thread, NULL, worker_thread,
+                           &workers[w])) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    /* Wait until every user has connected, or no more progress is made */
+    for (unsigned int last = 0, stalled = 0; stalled < 50;) {
+        unsigned int pending = 0;
+
+        usleep(100000);
+
+        connected = __atomic_load_n(&users_ready, __ATOMIC_RELAXED);
+        if (connected == config.users)
+            break;
+        for (unsigned int w = 0; w < config.n_workers; w++) {
+            pending += __atomic_load_n(&workers[w].connecting,
+                                       __ATOMIC_RELAXED) +
+                       workers[w].n_users -
+                       __atomic_load_n(&workers[w].next_to_connect,
+                                       __ATOMIC_RELAXED);
+        }
+        if (!pending)
+            break;
+        stalled = connected == last ? stalled + 1 : 0;
+        last = connected;
+    }
+    connect_end = now_ns();
+    connected = __atomic_load_n(&users_ready, __ATOMIC_RELAXED);
+    printf("%u users connected in %.2fs\n", connected,
+           (double)(connect_end - connect_start) / 1e9);
+
+    printf("%u senders sending %u messages/s each for %us...\n",
+           config.senders, config.rate, config.duration);
+    sending_start = now_ns();
+    __atomic_store_n(&phase, PHASE_SENDING, __ATOMIC_RELEASE);
+    sleep(config.duration);
+    sending_end = now_ns();
+
+    /* Give some time for messages in flight to arrive */
+    __atomic_store_n(&phase, PHASE_DRAINING, __ATOMIC_RELEASE);
+    sleep(2);
+    __atomic_store_n(&phase, PHASE_DONE, __ATOMIC_RELEASE);
+
+    for (unsigned int w = 0; w < config.n_workers; w++) {
+        pthread_join(workers[w].thread, NULL);
+
+        sent += workers[w].sent;
+        delivered += workers[w].delivered;
+        disconnects += workers[w].disconnects;
+        if (workers[w].max_latency_ns > max_latency_ns)
+            max_latency_ns = workers[w].max_latency_ns;
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+            latency[i] += workers[w].latency[i];
+    }
+
+    elapsed = (double)(sending_end - sending_start) / 1e9;
+    printf("Messages sent: %" PRIu64 " (%.1f/s)\n", sent,
+           (double)sent / elapsed);
+    printf("Messages delivered: %" PRIu64 " of %" PRIu64 " expected "
+           "(%.1f/s)\n",
+           delivered, sent * connected, (double)delivered / elapsed);
+    printf("Users disconnected: %" PRIu64 "\n", disconnects);
+    printf("Delivery latency: p50 <= %" PRIu64 "us, p99 <= %" PRIu64
+           "us, max %.1fms\n",
+           latency_percentile(latency, 0.5), latency_percentile(latency, 0.99),
+           (double)max_latency_ns / 1e6);
+
+    return 0;
+}
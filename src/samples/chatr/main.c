@@ -18,62 +18,37 @@
  * USA.
  */
 
+#define _GNU_SOURCE
+#include <errno.h>
 #include <stdlib.h>
-#include <pthread.h>
+#include <string.h>
 
 #include "lwan.h"
-#include "hash.h"
-#include "ringbuffer.h"
-#include "../techempower/json.h"
+#include "lwan-pubsub.h"
+#include "json.h"
 
-struct sync_map {
-    struct hash *table;
-    pthread_mutex_t mutex;
-};
-
-#define SYNC_MAP_INITIALIZER(free_key_func_, free_value_func_)                 \
-    (struct sync_map)                                                          \
-    {                                                                          \
-        .mutex = PTHREAD_MUTEX_INITIALIZER,                                    \
-        .table = hash_str_new(free_key_func_, free_value_func_)                \
-    }
-
-DEFINE_RING_BUFFER_TYPE(msg_ring_buffer, char *, 32)
-struct msg_ring {
-    struct msg_ring_buffer rb;
-    pthread_mutex_t mutex;
-};
-
-#define MSG_RING_INITIALIZER                                                   \
-    (struct msg_ring) { .mutex = PTHREAD_MUTEX_INITIALIZER }
-
-struct available_transport {
-    const char *transport;
-    const char *transferFormats[4];
-    size_t numTransferFormats;
-};
-static const struct json_obj_descr available_transport_descr[] = {
-    JSON_OBJECT_DESCR_PRIM(struct available_transport, transport, JSON_TOK_STRING),
-    JSON_OBJECT_DESCR_ARRAY(struct available_transport,
-                            transferFormats,
-                            1,
-                            numTransferFormats,
-                            JSON_TOK_STRING),
-};
-
-struct negotiate_response {
-    const char *connectionId;
-    struct available_transports availableTransports[4];
-    size_t numAvailableTransports;
-};
-static const struct json_obj_descr negotiate_response_descr[] = {
-    JSON_OBJ_DESCR_PRIM(struct negotiate_response, connectionId, JSON_TOK_STRING),
-    JSON_OBJ_DESCR_OBJ_ARRAY(struct negotiate_response,
-                             availableTransports,
-                             4,
-                             numAvailableTransports,
-                             available_transport_descr,
-                             ARRAY_SIZE(available_transport_descr)),
+/* A chat room speaking the JSON hub protocol used by SignalR clients: once
+ * a client has negotiated and upgraded to a websocket, every record it
+ * sends is a JSON object terminated by a record separator.  Messages sent
+ * to the "send" target are broadcast to everybody in the room.
+ *
+ * This is meant as a reference for fan-out workloads.  Broadcasts are
+ * encoded and framed once, when they're published, and written as is to
+ * every connection; publishing doesn't take locks that subscribers take;
+ * and connections sleep until either their client sends something or a
+ * message is published to the room, so idle users cost nothing but memory.
+ * Users that can't keep up with the room are disconnected rather than
+ * buffering messages for them.  See chatr-load.c for a load generator. */
+
+#define RECORD_SEPARATOR '\x1e'
+#define MAX_PENDING_MESSAGES 256
+#define MAX_ARGUMENTS 8
+
+enum message_type {
+    MESSAGE_INVOCATION = 1,
+    MESSAGE_COMPLETION = 3,
+    MESSAGE_PING = 6,
+    MESSAGE_CLOSE = 7,
 };
 
 struct handshake_request {
@@ -82,32 +57,36 @@ struct handshake_request {
 };
 static const struct json_obj_descr handshake_request_descr[] = {
     JSON_OBJ_DESCR_PRIM(struct handshake_request, protocol, JSON_TOK_STRING),
-    JSON_OBJ_DESCR_PRIM(struct handshake_request, versoin, JSON_TOK_NUMBER),
-};
-
-struct message {
-    int type;
-};
-static const struct json_obj_descr message_descr[] = {
-    JSON_OBJ_DESCR_PRIM(struct message, type, JSON_TOK_NUMBER),
+    JSON_OBJ_DESCR_PRIM(struct handshake_request, version, JSON_TOK_NUMBER),
 };
 
 struct invocation_message {
     int type;
     const char *target;
     const char *invocationId;
-    const char *arguments[10];
+    const char *arguments[MAX_ARGUMENTS];
     size_t numArguments;
 };
-static const struct json_obj_descr invocation_message[] = {
+static const struct json_obj_descr invocation_message_descr[] = {
+    JSON_OBJ_DESCR_PRIM(struct invocation_message, type, JSON_TOK_NUMBER),
     JSON_OBJ_DESCR_PRIM(struct invocation_message, target, JSON_TOK_STRING),
-    JSON_OBJ_DESCR_PRIM(struct invocation_message, invocationId, JSON_TOK_STRING),
+    JSON_OBJ_DESCR_PRIM(struct invocation_message, invocationId,
+                        JSON_TOK_STRING),
     JSON_OBJ_DESCR_ARRAY(struct invocation_message,
                          arguments,
-                         10,
+                         MAX_ARGUMENTS,
                          numArguments,
                          JSON_TOK_STRING),
+};
+/* Broadcasts are invocations without an ID, as no completion is expected */
+static const struct json_obj_descr broadcast_message_descr[] = {
     JSON_OBJ_DESCR_PRIM(struct invocation_message, type, JSON_TOK_NUMBER),
+    JSON_OBJ_DESCR_PRIM(struct invocation_message, target, JSON_TOK_STRING),
+    JSON_OBJ_DESCR_ARRAY(struct invocation_message,
+                         arguments,
+                         MAX_ARGUMENTS,
+                         numArguments,
+                         JSON_TOK_STRING),
 };
 
 struct completion_message {
@@ -116,400 +95,370 @@ struct completion_message {
     const char *result;
     const char *error;
 };
-static const struct json_obj_descr invocation_message[] = {
+static const struct json_obj_descr completion_result_descr[] = {
     JSON_OBJ_DESCR_PRIM(struct completion_message, type, JSON_TOK_NUMBER),
-    JSON_OBJ_DESCR_PRIM(struct completion_message, invocationId, JSON_TOK_STRING),
+    JSON_OBJ_DESCR_PRIM(struct completion_message, invocationId,
+                        JSON_TOK_STRING),
     JSON_OBJ_DESCR_PRIM(struct completion_message, result, JSON_TOK_STRING),
+};
+static const struct json_obj_descr completion_error_descr[] = {
+    JSON_OBJ_DESCR_PRIM(struct completion_message, type, JSON_TOK_NUMBER),
+    JSON_OBJ_DESCR_PRIM(struct completion_message, invocationId,
+                        JSON_TOK_STRING),
     JSON_OBJ_DESCR_PRIM(struct completion_message, error, JSON_TOK_STRING),
 };
 
-static bool msg_ring_try_put(struct msg_ring *ring, const char *msg)
-{
-    /* FIXME: find a way to use coro_strdup() here?  should make cleanup easier */
-    char *copy = strdup(msg);
-    bool ret;
-
-    pthread_mutex_lock(&sync_map->mutex);
-    ret = msg_ring_buffer_try_put(&ring->rb, copy);
-    if (!ret)
-        free(copy);
-    pthread_mutex_unlock(&sync_map->mutex);
+static struct lwan_pubsub_topic *room;
 
-    return ret;
-}
-
-static void msg_ring_consume(struct msg_ring *ring,
-                             bool (*iter_func)(char *msg, void *data),
-                             void *data)
-{
-    char *msg;
-
-    pthread_mutex_lock(&ring->mutex);
-
-    while ((msg = msg_ring_buffer_get_ptr_or_null(&ring->rb))) {
-        bool cont = iter(msg, data);
-
-        free(msg);
-        if (!cont)
-            break;
-    }
-
-    pthread_mutex_unlock(&ring->mutex);
-}
-
-static bool free_ring_msg(char *msg, void *data)
-{
-    free(msg);
-    return true;
-}
-
-static void msg_ring_free(struct msg_ring *ring)
-{
-    msg_ring_consume(ring, free_ring_msg, NULL);
-    pthread_mutex_destroy(&ring->mutex);
-}
-
-static int sync_map_add(struct sync_map *sync_map, const char *key, const void *value)
+static int append_to_strbuf(const char *bytes, size_t len, void *data)
 {
-    int ret;
-
-    pthread_mutex_lock(&sync_map->mutex);
-    ret = hash_add(sync_map->table, key, value);
-    pthread_mutex_unlock(&sync_map->mutex);
+    struct lwan_strbuf *strbuf = data;
 
-    return ret;
+    return !lwan_strbuf_append_str(strbuf, bytes, len);
 }
 
-static void
-sync_map_range(struct sync_map *sync_map,
-               bool (*iter_func)(const char *key, void *value, void *data),
-               void *data)
+static bool append_record(struct lwan_strbuf *buffer,
+                          const struct json_obj_descr *descr,
+                          size_t descr_len,
+                          const void *value)
 {
-    struct hash_iter iter;
-    const void *key;
-    void *value;
-
-    pthread_mutex_lock(&sync_map->mutex);
-    hash_iter_init(&sync_map->table, &iter);
-    while (hash_iter_next(&iter, &key, &value)) {
-        if (!iter_func(key, value, data))
-            break;
-    }
-    pthread_mutex_unlock(&sync_map->mutex);
+    return json_obj_encode_full(descr, descr_len, value, append_to_strbuf,
+                                buffer, false) == 0 &&
+           lwan_strbuf_append_char(buffer, RECORD_SEPARATOR);
 }
 
-static const char *get_connection_id(char connection_id[static 17])
+static void get_connection_id(char connection_id[static 23])
 {
-    /* FIXME: use a better PRNG */
-    /* FIXME: maybe base64? */
     static const char alphabet[] =
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwvyz01234567890";
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    uint64_t bits[2] = {(uint64_t)random() << 32 ^ (uint64_t)random(),
+                        (uint64_t)random() << 32 ^ (uint64_t)random()};
 
-    for (int i = 0; i < 16; i++)
-        connection_id[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
-
-    connection_id[16] = '\0';
-
-    return connection_id;
-}
-
-static int append_to_strbuf(const char *bytes, size_t len, void *data)
-{
-    struct lwan_strbuf *strbuf = data;
-
-    return !lwan_strbuf_append_str(strbuf, bytes, len);
+    for (int i = 0; i < 22; i++) {
+        connection_id[i] = alphabet[bits[i & 1] & 63];
+        bits[i & 1] >>= 6;
+    }
+    connection_id[22] = '\0';
 }
 
 LWAN_HANDLER(negotiate)
 {
-    char connection_id[17];
+    char connection_id[23];
 
     if (lwan_request_get_method(request) != REQUEST_METHOD_POST)
-        return HTTP_BAD_REQUEST;
-
-    struct negotiate_response response = {
-        .connectionId = get_connection_id(connection_id),
-        .availableTransports =
-            (struct available_transport[]){
-                {
-                    .transport : "WebSockets",
-                    .transferFormats : (const char *[]){"Text", "Binary"},
-                    .numTransferFormats : 2,
-                },
-            },
-        .numAvailableTransports = 1,
-    };
+        return HTTP_NOT_ALLOWED;
 
-    if (json_obj_encode_full(negotiate_response_descr,
-                             ARRAY_SIZE(negotiate_response_descr), &response,
-                             append_to_strbuf, response->buffer, false) != 0)
-        return HTTP_INTERNAL_ERROR;
+    get_connection_id(connection_id);
 
+    lwan_strbuf_printf(response->buffer,
+                       "{\"connectionId\":\"%s\","
+                       "\"availableTransports\":[{\"transport\":\"WebSockets\","
+                       "\"transferFormats\":[\"Text\"]}]}",
+                       connection_id);
     response->mime_type = "application/json";
+
     return HTTP_OK;
 }
 
-static bool trim_record_separator(struct lwan_strbuf *buf)
+/* Splits the message in the response buffer in records, which are
+ * NUL-terminated in place. */
+static char *next_record(struct lwan_strbuf *buffer, char **cursor)
 {
-    char *separator =
-        memrchr(lwan_strbuf_get_buffer(buf), 0x1e, lwan_strbuf_get_length(buf));
+    char *end = lwan_strbuf_get_buffer(buffer) + lwan_strbuf_get_length(buffer);
+    char *record = *cursor;
+    char *separator;
 
-    if (separator) {
-        buf->used = separator - buf->buffer;
-        *separator = '\0';
-        return true;
-    }
+    if (record >= end)
+        return NULL;
+
+    separator = memchr(record, RECORD_SEPARATOR, (size_t)(end - record));
+    if (!separator)
+        return NULL;
 
-    return false;
+    *separator = '\0';
+    *cursor = separator + 1;
+    return record;
 }
 
-static int parse_json(struct lwan_response *response,
-                      const struct json_obj_descr *descr,
-                      size_t descr_len,
-                      void *data)
+static bool process_handshake(struct lwan_request *request,
+                              struct lwan_response *response)
 {
-    if (!trim_record_separator(response->buffer))
-        return -EINVAL;
+    struct handshake_request handshake = {};
+    const char *error = NULL;
+    char *cursor;
+    char *record;
+    int ret;
 
-    return json_obj_parse(lwan_strbuf_get_buffer(response->buffer),
-                          lwan_strbuf_get_len(response->buffer), descr,
-                          descr_len, data);
-}
+    /* Clients that never send the handshake will time out as if they
+     * were idle keep-alive connections */
+    while ((ret = lwan_response_websocket_read(request)) == EAGAIN)
+        coro_yield(request->conn->coro, CONN_CORO_WANT_READ);
+    if (ret)
+        return false;
 
-static int send_json(struct lwan_response *request,
-                     const struct json_obj_descr *descr,
-                     size_t descr_len,
-                     void *data)
-{
-    int ret = json_obj_encode_full(descr, descr_len, data, append_to_strbuf,
-                                   request->response->buffer, false);
-    if (ret == 0) {
-        lwan_strbuf_append_char(request->response->buffer, '\x1e');
-        lwan_response_websocket_send(request);
-    }
+    cursor = lwan_strbuf_get_buffer(response->buffer);
+    record = next_record(response->buffer, &cursor);
+    if (!record)
+        return false;
 
-    return ret;
+    ret = json_obj_parse(record, strlen(record), handshake_request_descr,
+                         N_ELEMENTS(handshake_request_descr), &handshake);
+    if (ret < 0)
+        error = "Could not parse handshake";
+    else if (!(ret & 1 << 0) || strcmp(handshake.protocol, "json"))
+        error = "Only the `json' protocol is supported";
+    else if (!(ret & 1 << 1) || handshake.version != 1)
+        error = "Only version 1 of the protocol is supported";
+
+    if (error)
+        lwan_strbuf_printf(response->buffer, "{\"error\":\"%s\"}\x1e", error);
+    else
+        lwan_strbuf_set_staticz(response->buffer, "{}\x1e");
+    lwan_response_websocket_write(request);
+
+    return !error;
 }
 
-static bool send_error(struct lwan_request *request, const char *error)
+static bool broadcast(const struct invocation_message *message)
 {
-    lwan_strbuf_set_printf(request->response->buffer,
-                           "{\"error\":\"%s\"}\x1e", error);
-    lwan_response_websocket_send(request);
-    return false;
-}
+    struct invocation_message msg = {
+        .type = MESSAGE_INVOCATION,
+        .target = "send",
+        .numArguments = message->numArguments,
+    };
+    struct lwan_strbuf buffer;
+    bool ret;
 
-static bool process_handshake(struct lwan_request *request,
-                              struct lwan_response *response)
-{
-    if (!lwan_response_websocket_read(request))
+    if (!lwan_strbuf_init(&buffer))
         return false;
 
-    struct handshake_request handshake;
-    int ret = parse_json(response, handshake_request_descr,
-                         ARRAY_SIZE(handshake_request_descr), &handshake);
-    if (ret < 0)
-        return send_error(request, "Could not parse handshake JSON");
-    if (!(ret & 1 << 0))
-        return send_error(request, "Protocol not specified");
-    if (!(ret & 1 << 1))
-        return send_error(request, "Version not specified");
-
-    if (handshake.version != 0)
-        return send_error(request, "Only version 0 is supported");
-    if (!streq(handshake.protocol, "json"))
-        return send_error(request, "Only `json' protocol supported");
-
-    lwan_strbuf_set_static(response->buffer, "{}\x1e", 3);
-    lwan_response_websocket_send(request);
+    memcpy(msg.arguments, message->arguments,
+           message->numArguments * sizeof(msg.arguments[0]));
 
-    return true;
-}
+    /* Encoded here, and framed by the pubsub topic, only once no matter
+     * how many users are in the room */
+    ret = append_record(&buffer, broadcast_message_descr,
+                        N_ELEMENTS(broadcast_message_descr), &msg) &&
+          lwan_pubsub_publish(room, lwan_strbuf_get_buffer(&buffer),
+                              lwan_strbuf_get_length(&buffer));
 
-static void handle_ping(struct lwan_request *request)
-{
-    lwan_strbuf_set_staticz("{\"type\":6}\x1e");
-    lwan_response_websocket_send(request);
+    lwan_strbuf_free(&buffer);
+    return ret;
 }
 
-static bool broadcast_msg(const void *key, void *value, void *data)
+static void append_completion(struct lwan_strbuf *replies,
+                              const char *invocation_id,
+                              const char *result,
+                              const char *error)
 {
-    struct msg_ring *messages = value;
+    struct completion_message completion = {
+        .type = MESSAGE_COMPLETION,
+        .invocationId = invocation_id,
+        .result = result,
+        .error = error,
+    };
 
-    if (message->numArguments == 1)
-        return msg_ring_try_put(messages, message->arguments[0]);
+    /* Invocations without an ID don't expect a completion */
+    if (!invocation_id)
+        return;
 
-    return false;
+    if (error) {
+        append_record(replies, completion_error_descr,
+                      N_ELEMENTS(completion_error_descr), &completion);
+    } else {
+        append_record(replies, completion_result_descr,
+                      N_ELEMENTS(completion_result_descr), &completion);
+    }
 }
 
-static struct completion_message
-handle_invocation_send(struct lwan_request *request,
-                       struct invocation_message *message,
-                       struct sync_map *clients)
+/* Returns false if the client asked to close the connection */
+static bool process_record(char *record,
+                           struct lwan_strbuf *replies)
 {
-    if (message->numArguments == 0)
-        return (struct completion_message){.error = "No arguments were passed"};
+    struct invocation_message message = {};
+    int ret = json_obj_parse(record, strlen(record), invocation_message_descr,
+                             N_ELEMENTS(invocation_message_descr), &message);
 
-    sync_map_range(clients, broadcast_msg, NULL);
-
-    return (struct completion_message){
-        .result = coro_printf(request->conn->coro,
-                              "Got your message with %d arguments",
-                              message->numArguments),
-    };
-}
+    /* Malformed records, and those without a type, are ignored */
+    if (ret < 0 || !(ret & 1 << 0))
+        return true;
 
-static bool send_completion_response(struct lwan_request *request,
-                                     const char *invocation_id,
-                                     struct completion_message completion)
-{
-    completion = (struct completion_message){
-        .type = 3,
-        .invocationId = invocation_id,
-        .error = completion.error,
-        .result = completion.result,
-    };
+    switch (message.type) {
+    case MESSAGE_INVOCATION:
+        if (!(ret & 1 << 1)) {
+            append_completion(replies, message.invocationId, NULL,
+                              "Target not specified");
+        } else if (strcmp(message.target, "send")) {
+            append_completion(replies, message.invocationId, NULL,
+                              "Unknown target");
+        } else if (!(ret & 1 << 3) || !message.numArguments) {
+            append_completion(replies, message.invocationId, NULL,
+                              "No arguments were passed");
+        } else if (!broadcast(&message)) {
+            append_completion(replies, message.invocationId, NULL,
+                              "Could not send message");
+        } else {
+            append_completion(replies, message.invocationId, "Sent", NULL);
+        }
+        return true;
 
-    return send_json(request, completion_message_descr,
-                     ARRAY_SIZE(completion_message_descr), &completion) == 0;
-}
+    case MESSAGE_PING:
+        lwan_strbuf_append_strz(replies, "{\"type\":6}\x1e");
+        return true;
 
-static bool handle_invocation(struct lwan_request *request,
-                              struct sync_map *clients)
-{
-    struct invocation_message message;
-    int ret = parse_json(request->response, invocation_message_descr,
-                         ARRAY_SIZE(invocation_message_descr), &message);
+    case MESSAGE_CLOSE:
+        return false;
 
-    if (ret < 0)
-        return send_error(request, "JSON could not be parsed");
-    if (!(ret & 1 << 0))
-        return send_error(request, "`target' not present or unparsable");
-    if (!(ret & 1 << 1))
-        return send_error(request, "`invocationId' not present or unparsable");
-    if (!(ret & 1 << 2))
-        return send_error(request, "`arguments' not present or unparsable");
-
-    if (streq(message.target, "send")) {
-        return send_completion_response(
-            request, message.invocationId,
-            handle_invocation_send(request, &message, clients));
+    default:
+        return true;
     }
-
-    return send_error(request, "Unknown target");
 }
 
-static bool hub_msg_ring_send_message(char *msg, void *data)
+static void unsubscribe(void *data)
 {
-    struct lwan_request *request = data;
-    struct invocation_message invocation = {
-        .type = 1,
-        .target = "send",
-        .arguments[0] = msg,
-        .numArguments = 1,
-    };
-
-    return send_json(response, invocation_message_descr,
-                     ARRAY_SIZE(invocation_message_descr), &invocation) == 0;
+    lwan_pubsub_unsubscribe(room, data);
 }
 
-static void parse_hub_msg(struct lwan_request *request,
-                          struct sync_map *clients)
+LWAN_HANDLER(chat)
 {
-    struct message message;
-    int ret = parse_json(response, message_descr,
-                         ARRAY_SIZE(message_descr), &message);
-    if (ret < 0)
-        return;
-    if (!(ret & 1 << 0)) /* `type` not present, ignore */
-        return;
+    struct lwan_pubsub_subscriber *sub;
+    struct lwan_strbuf replies;
+    enum lwan_http_status status;
 
-    switch (message.type) {
-    case 1:
-        return handle_invocation(request, clients);
-    case 6:
-        return handle_ping(request);
-    }
-}
+    status = lwan_request_websocket_upgrade(request);
+    if (status != HTTP_SWITCHING_PROTOCOLS)
+        return status;
 
-static enum lwan_http_status
-hub_connection_handler(struct lwan_request *request,
-                       struct lwan_response *response,
-                       const char *connection_id,
-                       void *data)
-{
-    struct sync_map *clients = data;
-    struct msg_ring msg_ring = MSG_RING_INITIALIZER;
+    if (!process_handshake(request, response))
+        goto out;
 
-    if (sync_map_add(clients, connection_id, &msg_ring) != 0) {
-        send_error(request, "Could not register client ID");
-        msg_ring_free(messages);
-        return HTTP_INTERNAL_ERROR;
-    }
-    coro_defer2(request->conn->coro, remove_client, clients, connection_id);
-    coro_defer(request->conn->coro, msg_ring_free, messages);
+    sub = lwan_pubsub_subscribe(room);
+    if (!sub)
+        goto out;
+    coro_defer(request->conn->coro, unsubscribe, sub);
+
+    if (!lwan_strbuf_init(&replies))
+        goto out;
+    coro_defer(request->conn->coro, (void (*)(void *))lwan_strbuf_free,
+               &replies);
 
     while (true) {
-        switch (lwan_response_websocket_read(request)) {
-        case ENOTCONN:
-            /* Shouldn't happen because if we get here, this connection
-             * has been upgraded to a websocket. */
-            return HTTP_INTERNAL_ERROR;
-
-        case ECONNRESET:
-            /* Connection has been closed by the peer. */
-            return HTTP_UNAVAILABLE;
-
-        case EAGAIN:
-            msg_ring_consume(&msg_ring, hub_msg_ring_send_message, request);
-
-            /* FIXME: ideally, websocket_read() should have a timeout; this is
-             * just a workaround */
-            lwan_request_sleep(1000);
-            break;
+        bool keep_going = true;
+        char *cursor;
+        char *record;
 
+        /* Sleeps until the client sends something, writing messages
+         * published to the room in the meantime */
+        switch (lwan_pubsub_websocket_read(request, sub)) {
         case 0:
-            parse_hub_msg(request, clients);
             break;
+        case ENOBUFS: /* Not keeping up with the room */
+        default:
+            goto out;
         }
-    }
-}
 
-LWAN_HANDLER(chat)
-{
-    static const char handshake_response[] = "{}\x1e";
-    const char *connection_id;
+        cursor = lwan_strbuf_get_buffer(response->buffer);
+        while (keep_going && (record = next_record(response->buffer, &cursor)))
+            keep_going = process_record(record, &replies);
 
-    if (lwan_request_websocket_upgrade(request) != HTTP_SWITCHING_PROTOCOLS)
-        return HTTP_BAD_REQUEST;
+        if (lwan_strbuf_get_length(&replies)) {
+            lwan_strbuf_set(response->buffer, lwan_strbuf_get_buffer(&replies),
+                            lwan_strbuf_get_length(&replies));
+            lwan_strbuf_reset(&replies);
+            lwan_response_websocket_write(request);
+        }
 
-    connection_id = lwan_request_get_query_param(request, "id");
-    if (!connecton_id || *connection_id == '\0')
-        connection_id = get_connection_id(coro_malloc(request->conn->coro, 17));
+        if (!keep_going)
+            break;
+    }
 
-    if (!process_handshake(request, response))
-        return HTTP_BAD_REQUEST;
+out:
+    /* This isn't a HTTP connection anymore, so there's no response to
+     * send; just close it. */
+    coro_yield(request->conn->coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
+
+LWAN_HANDLER(index)
+{
+    static const char message[] =
+        "<html>\n"
+        "<head>\n"
+        "<title>Lwan chat room</title>\n"
+        "<script type=\"text/javascript\">\n"
+        "let socket;\n"
+        "function connect() {\n"
+        "  const url = location.origin.replace(/^http/, 'ws') + '/chat';\n"
+        "  socket = new WebSocket(url);\n"
+        "  socket.onopen = function() {\n"
+        "    socket.send(JSON.stringify({protocol: 'json', version: 1}) + "
+        "'\\x1e');\n"
+        "  };\n"
+        "  socket.onmessage = function(event) {\n"
+        "    for (const record of event.data.split('\\x1e')) {\n"
+        "      if (!record) continue;\n"
+        "      const msg = JSON.parse(record);\n"
+        "      if (msg.type === 1 && msg.target === 'send')\n"
+        "        document.getElementById('log').value += msg.arguments.join(': ') "
+        "+ '\\n';\n"
+        "      else if (msg.error)\n"
+        "        document.getElementById('log').value += '*** ' + msg.error + "
+        "'\\n';\n"
+        "    }\n"
+        "  };\n"
+        "}\n"
+        "function send() {\n"
+        "  const user = document.getElementById('user').value || 'Anonymous';\n"
+        "  const input = document.getElementById('input');\n"
+        "  socket.send(JSON.stringify({type: 1, target: 'send', "
+        "arguments: [user, input.value]}) + '\\x1e');\n"
+        "  input.value = '';\n"
+        "}\n"
+        "</script>\n"
+        "</head>\n"
+        "<body onload=\"connect()\">\n"
+        "  <h1>Lwan chat room</h1>\n"
+        "  <textarea id=\"log\" rows=\"20\" cols=\"80\" readonly></textarea>\n"
+        "  <p>Name: <input id=\"user\" size=\"12\"> "
+        "Message: <input id=\"input\" size=\"50\"> "
+        "<button onclick=\"send()\">Send</button></p>\n"
+        "</body>\n"
+        "</html>";
+
+    response->mime_type = "text/html";
+    lwan_strbuf_set_static(response->buffer, message, sizeof(message) - 1);
 
-    return hub_connection_handler(request, response, connection_id, data);
+    return HTTP_OK;
 }
 
 int main(void)
 {
-    struct sync_map clients = SYNC_MAP_INITIALIZER(NULL, NULL);
     const struct lwan_url_map default_map[] = {
-        {.prefix = "/chat", .handler = LWAN_HANDLER_REF(chat), .data = &clients},
         {.prefix = "/chat/negotiate", .handler = LWAN_HANDLER_REF(negotiate)},
-        {.prefix = "/", .module = SERVE_FILES("wwwroot")},
+        {.prefix = "/chat", .handler = LWAN_HANDLER_REF(chat)},
+        {.prefix = "/", .handler = LWAN_HANDLER_REF(index)},
         {},
     };
     struct lwan l;
 
     lwan_init(&l);
 
+    room = lwan_pubsub_new_bounded_topic(MAX_PENDING_MESSAGES);
+    if (!room)
+        lwan_status_critical("Could not create chat room");
+
+    /* Users connected to any instance joining the same group (e.g.
+     * CHATR_MULTICAST=239.255.76.67:47002) share the room. */
+    const char *multicast = getenv("CHATR_MULTICAST");
+    if (multicast &&
+        !lwan_pubsub_bridge_new_udp_multicast(room, multicast, "chatr"))
+        lwan_status_critical("Could not bridge chat room to %s", multicast);
+
     lwan_set_url_map(&l, default_map);
     lwan_main_loop(&l);
 
     lwan_shutdown(&l);
+    lwan_pubsub_free_topic(room);
 
     return 0;
 }
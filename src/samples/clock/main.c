@@ -18,10 +18,13 @@
  * USA.
  */
 
-#include <stdlib.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include "lwan.h"
+#include "lwan-pubsub.h"
 #include "lwan-template.h"
 #include "lwan-mod-redirect.h"
 #include "gifenc.h"
@@ -45,184 +48,361 @@ static const struct lwan_key_value seriously_do_not_cache[] = {
     {},
 };
 
-static const uint16_t width = 3 * 6 /* 6*3px wide digits */ +
-                              3 * 1 /* 3*1px wide decimal digit space */ +
-                              3 * 2 /* 2*3px wide minutes+seconds dots */;
-static const uint16_t height = 5;
-
-static void destroy_gif(void *data)
-{
-    ge_GIF *gif = data;
-
-    ge_close_gif(gif);
-}
-
 struct tm* my_localtime(const time_t *t)
 {
     static __thread struct tm result;
     return localtime_r(t, &result);
 }
 
-LWAN_HANDLER(clock)
-{
-    static const uint8_t base_offsets[] = {0, 0, 2, 2, 4, 4};
-    ge_GIF *gif = ge_new_gif(response->buffer, width, height, NULL, 2, -1);
-    uint8_t dot_visible = 0;
+/* Every viewer of an animation sees the same frames, so each animation is
+ * drawn and encoded only once, by a thread of its own, and the encoded
+ * frames are published to a topic its viewers are subscribed to.  Frames
+ * only contain what changed since the previous one; viewers are sent a
+ * complete frame when they join, and those that can't keep up are
+ * disconnected rather than skipping frames.  Animations are paused while
+ * nobody is watching them. */
+#define MAX_PENDING_FRAMES 64
+
+struct gif_animation {
+    uint16_t width, height;
+    int depth;
+    /* Whether the frame time is also set as the frame delay in the GIF */
+    bool delay_frames;
+
+    void *(*new)(ge_GIF *gif);
+    /* Returns how long to wait until the next frame, in ms */
+    uint64_t (*draw)(void *state);
+    void (*free)(void *state);
+};
 
-    if (!gif)
-        return HTTP_INTERNAL_ERROR;
+struct gif_stream {
+    const struct gif_animation *animation;
 
-    coro_defer(request->conn->coro, destroy_gif, gif);
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct lwan_pubsub_topic *topic;
+    struct lwan_strbuf frame;
+    ge_GIF *gif;
+    void *state;
+    unsigned int viewers;
+    bool running;
 
-    response->mime_type = "image/gif";
-    response->headers = (struct lwan_key_value *)seriously_do_not_cache;
+    pthread_t thread;
+};
 
-    memset(gif->frame, 0, (size_t)(width * height));
+struct clock {
+    ge_GIF *gif;
+    uint8_t dot_visible;
+};
 
-    for (int frame = 0; frame < 3600 * 2; frame++) {
-        time_t curtime;
-        char digits[8];
-        int digit, line, base;
+static void *clock_new(ge_GIF *gif)
+{
+    struct clock *clock = malloc(sizeof(*clock));
 
-        curtime = time(NULL);
-        strftime(digits, sizeof(digits), "%H%M%S", my_localtime(&curtime));
+    if (clock)
+        *clock = (struct clock){.gif = gif};
 
-        for (digit = 0; digit < 6; digit++) {
-            int dig = digits[digit] - '0';
-            uint8_t off = base_offsets[digit];
+    return clock;
+}
 
-            for (line = 0, base = digit * 4; line < 5; line++, base += width) {
-                gif->frame[base + 0 + off] = !!(digital_clock_font[dig][line] & 1<<2);
-                gif->frame[base + 1 + off] = !!(digital_clock_font[dig][line] & 1<<1);
-                gif->frame[base + 2 + off] = !!(digital_clock_font[dig][line] & 1<<0);
-            }
+static uint64_t clock_draw(void *state)
+{
+    static const uint8_t base_offsets[] = {0, 0, 2, 2, 4, 4};
+    struct clock *clock = state;
+    uint8_t *frame = clock->gif->frame;
+    const int width = clock->gif->w;
+    time_t curtime;
+    char digits[8];
+    int digit, line, base;
+
+    curtime = time(NULL);
+    strftime(digits, sizeof(digits), "%H%M%S", my_localtime(&curtime));
+
+    for (digit = 0; digit < 6; digit++) {
+        int dig = digits[digit] - '0';
+        uint8_t off = base_offsets[digit];
+
+        for (line = 0, base = digit * 4; line < 5; line++, base += width) {
+            frame[base + 0 + off] = !!(digital_clock_font[dig][line] & 1<<2);
+            frame[base + 1 + off] = !!(digital_clock_font[dig][line] & 1<<1);
+            frame[base + 2 + off] = !!(digital_clock_font[dig][line] & 1<<0);
         }
+    }
 
-        gif->frame[8 + width] = dot_visible;
-        gif->frame[18 + width] = dot_visible;
-        gif->frame[8 + width * 3] = dot_visible;
-        gif->frame[18 + width * 3] = dot_visible;
-        dot_visible = dot_visible ? 0 : 3;
+    frame[8 + width] = clock->dot_visible;
+    frame[18 + width] = clock->dot_visible;
+    frame[8 + width * 3] = clock->dot_visible;
+    frame[18 + width * 3] = clock->dot_visible;
+    clock->dot_visible = clock->dot_visible ? 0 : 3;
 
-        ge_add_frame(gif, 0);
-        lwan_response_send_chunk(request);
-        lwan_request_sleep(request, 500);
-    }
+    return 500;
+}
 
-    return HTTP_OK;
+static void *dali_new(ge_GIF *gif)
+{
+    return xdaliclock_new(gif);
 }
 
-static void destroy_xdaliclock(void *data)
+static uint64_t dali_draw(void *state)
 {
-    struct xdaliclock *xdc = data;
+    struct xdaliclock *xdc = state;
+
+    xdaliclock_update(xdc);
 
-    xdaliclock_free(xdc);
+    return xdaliclock_get_frame_time(xdc);
 }
 
-LWAN_HANDLER(dali)
+static void dali_free(void *state)
 {
-    ge_GIF *gif = ge_new_gif(response->buffer, 320, 64, NULL, 2, -1);
-    struct xdaliclock *xdc;
-    uint32_t one_hour;
+    xdaliclock_free(state);
+}
 
-    if (!gif)
-        return HTTP_INTERNAL_ERROR;
+struct blocks_clock {
+    struct blocks blocks;
+    time_t last;
+    bool odd_second;
+};
 
-    coro_defer(request->conn->coro, destroy_gif, gif);
+static void *blocks_new(ge_GIF *gif)
+{
+    struct blocks_clock *clock = calloc(1, sizeof(*clock));
 
-    xdc = xdaliclock_new(gif);
-    if (!xdc)
-        return HTTP_INTERNAL_ERROR;
+    if (clock)
+        blocks_init(&clock->blocks, gif);
 
-    coro_defer(request->conn->coro, destroy_xdaliclock, xdc);
+    return clock;
+}
 
-    response->mime_type = "image/gif";
-    response->headers = seriously_do_not_cache;
+static uint64_t blocks_clock_draw(void *state)
+{
+    struct blocks_clock *clock = state;
+    time_t curtime;
 
-    memset(gif->frame, 0, (size_t)(width * height));
+    curtime = time(NULL);
+    if (curtime != clock->last) {
+        char digits[5];
 
-    one_hour = 3600 * 1000 / xdaliclock_get_frame_time(xdc);
-    for (uint32_t frame = 0; frame < one_hour; frame++) {
-        xdaliclock_update(xdc);
+        strftime(digits, sizeof(digits), "%H%M", my_localtime(&curtime));
+        clock->last = curtime;
+        clock->odd_second = clock->last & 1;
 
-        ge_add_frame(gif, 0);
-        lwan_response_send_chunk(request);
-        lwan_request_sleep(request, xdaliclock_get_frame_time(xdc));
+        for (int i = 0; i < 4; i++)
+            clock->blocks.states[i].num_to_draw = digits[i] - '0';
     }
 
-    return HTTP_OK;
+    return blocks_draw(&clock->blocks, clock->odd_second);
 }
 
-LWAN_HANDLER(blocks)
+static void *pong_new(ge_GIF *gif)
 {
-    ge_GIF *gif = ge_new_gif(response->buffer, 32, 16, NULL, 4, -1);
-    struct blocks blocks;
-    uint64_t total_waited = 0;
-    time_t last = 0;
-    bool odd_second = false;
+    struct pong *pong = malloc(sizeof(*pong));
 
-    if (!gif)
-        return HTTP_INTERNAL_ERROR;
+    if (pong)
+        pong_init(pong, gif);
 
-    coro_defer(request->conn->coro, destroy_gif, gif);
+    return pong;
+}
 
-    blocks_init(&blocks, gif);
+static uint64_t pong_clock_draw(void *state)
+{
+    return pong_draw(state);
+}
 
-    response->mime_type = "image/gif";
-    response->headers = seriously_do_not_cache;
+static const struct gif_animation clock_animation = {
+    .width = 3 * 6 /* 6*3px wide digits */ +
+             3 * 1 /* 3*1px wide decimal digit space */ +
+             3 * 2 /* 2*3px wide minutes+seconds dots */,
+    .height = 5,
+    .depth = 2,
+    .new = clock_new,
+    .draw = clock_draw,
+    .free = free,
+};
 
-    while (total_waited <= 3600000) {
-        uint64_t timeout;
-        time_t curtime;
+static const struct gif_animation dali_animation = {
+    .width = 320,
+    .height = 64,
+    .depth = 2,
+    .new = dali_new,
+    .draw = dali_draw,
+    .free = dali_free,
+};
+
+static const struct gif_animation blocks_animation = {
+    .width = 32,
+    .height = 16,
+    .depth = 4,
+    .new = blocks_new,
+    .draw = blocks_clock_draw,
+    .free = free,
+};
+
+static const struct gif_animation pong_animation = {
+    .width = 64,
+    .height = 32,
+    .depth = 4,
+    .delay_frames = true,
+    .new = pong_new,
+    .draw = pong_clock_draw,
+    .free = free,
+};
 
-        curtime = time(NULL);
-        if (curtime != last) {
-            char digits[5];
+static void *gif_stream_producer(void *data)
+{
+    struct gif_stream *stream = data;
+    const struct gif_animation *animation = stream->animation;
 
-            strftime(digits, sizeof(digits), "%H%M", my_localtime(&curtime));
-            last = curtime;
-            odd_second = last & 1;
+    pthread_mutex_lock(&stream->lock);
+    while (stream->running) {
+        uint64_t timeout;
 
-            for (int i = 0; i < 4; i++)
-                blocks.states[i].num_to_draw = digits[i] - '0';
+        if (!stream->viewers) {
+            pthread_cond_wait(&stream->cond, &stream->lock);
+            continue;
         }
 
-        timeout = blocks_draw(&blocks, odd_second);
-        total_waited += timeout;
+        timeout = animation->draw(stream->state);
 
-        ge_add_frame(gif, 0);
-        lwan_response_send_chunk(request);
-        lwan_request_sleep(request, timeout);
+        /* Published with the lock held, so that viewers joining in the
+         * meantime get the frame this one is relative to. */
+        lwan_strbuf_reset(&stream->frame);
+        ge_add_frame(stream->gif,
+                     animation->delay_frames ? (uint16_t)timeout : 0);
+        lwan_pubsub_publish(stream->topic,
+                            lwan_strbuf_get_buffer(&stream->frame),
+                            lwan_strbuf_get_length(&stream->frame));
+
+        pthread_mutex_unlock(&stream->lock);
+        usleep((useconds_t)(timeout * 1000));
+        pthread_mutex_lock(&stream->lock);
     }
+    pthread_mutex_unlock(&stream->lock);
 
-    return HTTP_OK;
+    return NULL;
+}
+
+static void gif_stream_init(struct gif_stream *stream,
+                            const struct gif_animation *animation)
+{
+    *stream = (struct gif_stream){
+        .animation = animation,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .running = true,
+    };
+
+    lwan_strbuf_init(&stream->frame);
+
+    stream->topic = lwan_pubsub_new_bounded_topic(MAX_PENDING_FRAMES);
+    if (!stream->topic)
+        lwan_status_critical("Could not create topic");
+
+    stream->gif = ge_new_gif(&stream->frame, animation->width,
+                             animation->height, NULL, animation->depth, -1);
+    if (!stream->gif)
+        lwan_status_critical("Could not create GIF encoder");
+
+    stream->state = animation->new(stream->gif);
+    if (!stream->state)
+        lwan_status_critical("Could not create animation");
+
+    if (pthread_create(&stream->thread, NULL, gif_stream_producer, stream))
+        lwan_status_critical_perror("pthread_create");
+}
+
+static void gif_stream_shutdown(struct gif_stream *stream)
+{
+    pthread_mutex_lock(&stream->lock);
+    stream->running = false;
+    pthread_cond_signal(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+
+    pthread_join(stream->thread, NULL);
+
+    stream->animation->free(stream->state);
+    free(stream->gif);
+    lwan_pubsub_free_topic(stream->topic);
+    lwan_strbuf_free(&stream->frame);
 }
 
-LWAN_HANDLER(pong)
+static struct lwan_pubsub_subscriber *
+gif_stream_join(struct gif_stream *stream, struct lwan_strbuf *buffer)
 {
-    ge_GIF *gif = ge_new_gif(response->buffer, 64, 32, NULL, 4, -1);
-    struct pong pong;
-    uint64_t total_waited = 0;
+    const struct gif_animation *animation = stream->animation;
+    struct lwan_pubsub_subscriber *sub;
+    ge_GIF *gif;
 
+    /* Writes the header for the new viewer */
+    gif = ge_new_gif(buffer, animation->width, animation->height, NULL,
+                     animation->depth, -1);
     if (!gif)
-        return HTTP_INTERNAL_ERROR;
+        return NULL;
+
+    pthread_mutex_lock(&stream->lock);
+    sub = lwan_pubsub_subscribe(stream->topic);
+    if (sub) {
+        memcpy(gif->frame, stream->gif->back,
+               (size_t)(animation->width * animation->height));
+        if (!stream->viewers++)
+            pthread_cond_signal(&stream->cond);
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    /* The first frame added to a GIF is always a complete one */
+    if (sub)
+        ge_add_frame(gif, 0);
+
+    /* Not ge_close_gif(), as the stream goes on */
+    free(gif);
 
-    coro_defer(request->conn->coro, destroy_gif, gif);
+    return sub;
+}
+
+static void gif_stream_leave(void *data1, void *data2)
+{
+    struct gif_stream *stream = data1;
+    struct lwan_pubsub_subscriber *sub = data2;
 
-    pong_init(&pong, gif);
+    pthread_mutex_lock(&stream->lock);
+    lwan_pubsub_unsubscribe(stream->topic, sub);
+    stream->viewers--;
+    pthread_mutex_unlock(&stream->lock);
+}
+
+LWAN_HANDLER(gif_stream)
+{
+    struct gif_stream *stream = data;
+    struct lwan_pubsub_subscriber *sub;
+    const time_t until = time(NULL) + 3600;
 
     response->mime_type = "image/gif";
     response->headers = seriously_do_not_cache;
 
-    while (total_waited <= 3600000) {
-        uint64_t timeout;
+    sub = gif_stream_join(stream, response->buffer);
+    if (!sub)
+        return HTTP_INTERNAL_ERROR;
+
+    coro_defer2(request->conn->coro, gif_stream_leave, stream, sub);
+
+    lwan_response_send_chunk(request);
+
+    while (time(NULL) < until) {
+        struct lwan_pubsub_msg *msg;
+
+        lwan_pubsub_wait(request, sub, 1000, false);
 
-        timeout = pong_draw(&pong);
-        total_waited += timeout;
+        if (lwan_pubsub_subscriber_overrun(sub))
+            break;
 
-        ge_add_frame(gif, (uint16_t)timeout);
-        lwan_response_send_chunk(request);
-        lwan_request_sleep(request, timeout);
+        while ((msg = lwan_pubsub_consume(sub))) {
+            const struct lwan_value *frame = lwan_pubsub_msg_value(msg);
+
+            lwan_strbuf_append_str(response->buffer, frame->value, frame->len);
+            lwan_pubsub_msg_done(msg);
+        }
+
+        if (lwan_strbuf_get_length(response->buffer))
+            lwan_response_send_chunk(request);
     }
 
     return HTTP_OK;
@@ -342,6 +522,14 @@ static void setup_timezone(void)
 
 int main(void)
 {
+    enum { CLOCK, DALI, BLOCKS, PONG, N_STREAMS };
+    static const struct gif_animation *animations[] = {
+        [CLOCK] = &clock_animation,
+        [DALI] = &dali_animation,
+        [BLOCKS] = &blocks_animation,
+        [PONG] = &pong_animation,
+    };
+    struct gif_stream streams[N_STREAMS];
     struct index sample_clock = {
         .title = "Lwan Sample Clock",
         .variant = "clock",
@@ -365,19 +553,23 @@ int main(void)
     const struct lwan_url_map default_map[] = {
         {
             .prefix = "/clock.gif",
-            .handler = LWAN_HANDLER_REF(clock),
+            .handler = LWAN_HANDLER_REF(gif_stream),
+            .data = &streams[CLOCK],
         },
         {
             .prefix = "/dali.gif",
-            .handler = LWAN_HANDLER_REF(dali),
+            .handler = LWAN_HANDLER_REF(gif_stream),
+            .data = &streams[DALI],
         },
         {
             .prefix = "/blocks.gif",
-            .handler = LWAN_HANDLER_REF(blocks),
+            .handler = LWAN_HANDLER_REF(gif_stream),
+            .data = &streams[BLOCKS],
         },
         {
             .prefix = "/pong.gif",
-            .handler = LWAN_HANDLER_REF(pong),
+            .handler = LWAN_HANDLER_REF(gif_stream),
+            .data = &streams[PONG],
         },
         {
             .prefix = "/clock",
@@ -411,10 +603,16 @@ int main(void)
 
     lwan_init(&l);
 
+    for (int i = 0; i < N_STREAMS; i++)
+        gif_stream_init(&streams[i], animations[i]);
+
     lwan_set_url_map(&l, default_map);
     lwan_main_loop(&l);
 
     lwan_shutdown(&l);
 
+    for (int i = 0; i < N_STREAMS; i++)
+        gif_stream_shutdown(&streams[i]);
+
     return 0;
 }
@@ -23,12 +23,15 @@
 
 #define _DEFAULT_SOURCE
 #include <arpa/inet.h>
+#include <errno.h>
 #include <sqlite3.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "lwan.h"
 #include "lwan-cache.h"
+#include "hash.h"
 #include "lwan-mod-serve-files.h"
 #include "lwan-template.h"
 
@@ -36,23 +39,47 @@
 #define QUERIES_PER_HOUR 10000
 
 struct ip_info {
-    struct cache_entry base;
     struct {
-        char *code;
-        char *name;
+        const char *code;
+        const char *name;
     } country, region;
     struct {
-        char *name;
-        char *zip_code;
+        const char *name;
+        const char *zip_code;
     } city;
     double latitude, longitude;
     struct {
-        char *code, *area;
+        const char *code, *area;
     } metro;
-    char *ip;
+    const char *ip;
     const char *callback;
 };
 
+/* Strings are offsets into ipdb.strings; 0 is the empty string. */
+struct ip_location {
+    uint32_t country_code, country_name;
+    uint32_t region_code, region_name;
+    uint32_t city_name, zip_code;
+    uint32_t metro_code, area_code;
+    double latitude, longitude;
+};
+
+/* The whole database is loaded when the server starts, so that lookups
+ * don't have to go through SQLite on the request path.  Blocks are kept
+ * sorted by their first address, which is stored apart from the location
+ * it maps to so that the binary search touches as few cache lines as
+ * possible; every distinct string is stored only once. */
+static struct {
+    uint32_t *starts;
+    uint32_t *location_of;
+    size_t n_blocks;
+
+    struct ip_location *locations;
+    size_t n_locations;
+
+    struct lwan_strbuf strings;
+} ipdb;
+
 struct template_mime {
     struct lwan_tpl *tpl;
     const char *mime_type;
@@ -115,23 +142,30 @@ static const char csv_template_str[] = "\"{{ip}}\","
                                        "\"{{metro.code}}\","
                                        "\"{{metro.area}}\"";
 
-static const char ip_to_city_query[] =
+static const char locations_query[] =
     "SELECT "
+    "   city_location.rowid,"
     "   city_location.country_code, country_blocks.country_name,"
     "   city_location.region_code, region_names.region_name,"
     "   city_location.city_name, city_location.postal_code,"
     "   city_location.latitude, city_location.longitude,"
     "   city_location.metro_code, city_location.area_code "
-    "FROM city_blocks "
-    "   NATURAL JOIN city_location "
+    "FROM city_location "
     "   INNER JOIN country_blocks ON "
     "      city_location.country_code = country_blocks.country_code "
     "   INNER JOIN region_names ON "
     "      city_location.country_code = region_names.country_code "
     "      AND "
-    "      city_location.region_code = region_names.region_code "
-    "WHERE city_blocks.ip_start <= ? "
-    "ORDER BY city_blocks.ip_start DESC LIMIT 1";
+    "      city_location.region_code = region_names.region_code";
+
+/* Blocks whose location isn't known (because it lacks a country or a
+ * region) are skipped while loading, so a lookup falls back to the
+ * previous block, like the single query used before did. */
+static const char blocks_query[] =
+    "SELECT city_blocks.ip_start, city_location.rowid "
+    "FROM city_blocks "
+    "   NATURAL JOIN city_location "
+    "ORDER BY city_blocks.ip_start";
 
 union ip_to_octet {
     unsigned char octet[sizeof(in_addr_t)];
@@ -179,8 +213,6 @@ struct query_limit {
 static struct cache *query_limit;
 #endif
 
-static struct cache *cache = NULL;
-static sqlite3 *db = NULL;
 
 static bool net_contains_ip(const struct ip_net *net, in_addr_t ip)
 {
@@ -205,89 +237,234 @@ static bool is_reserved_ip(in_addr_t ip)
     return false;
 }
 
-static void destroy_ipinfo(struct cache_entry *entry,
-                           void *context __attribute__((unused)))
+static uint32_t intern_string(struct hash *interned, const unsigned char *str)
 {
-    struct ip_info *ip_info = (struct ip_info *)entry;
-
-    if (!ip_info)
-        return;
-
-    free(ip_info->country.code);
-    free(ip_info->country.name);
-    free(ip_info->region.code);
-    free(ip_info->region.name);
-    free(ip_info->city.name);
-    free(ip_info->city.zip_code);
-    free(ip_info->metro.code);
-    free(ip_info->metro.area);
-    free(ip_info->ip);
-    free(ip_info);
+    uintptr_t offset;
+    size_t len;
+    char *key;
+
+    if (!str || !*str)
+        return 0;
+
+    offset = (uintptr_t)hash_find(interned, str);
+    if (offset)
+        return (uint32_t)offset;
+
+    offset = lwan_strbuf_get_length(&ipdb.strings);
+    if (UNLIKELY(offset > UINT32_MAX))
+        lwan_status_critical("Too many strings in the database");
+
+    /* Copy the terminating NUL as well */
+    len = strlen((const char *)str) + 1;
+    if (UNLIKELY(!lwan_strbuf_append_str(&ipdb.strings, (const char *)str, len)))
+        lwan_status_critical("Could not intern string");
+
+    key = strdup((const char *)str);
+    if (UNLIKELY(!key || hash_add(interned, key, (void *)offset) < 0))
+        lwan_status_critical("Could not intern string");
+
+    return (uint32_t)offset;
 }
 
-static ALWAYS_INLINE char *text_column_helper(sqlite3_stmt *stmt, int ind)
+static void *grow_array(void *array, size_t *capacity, size_t elem_size)
 {
-    const unsigned char *value;
+    size_t new_capacity = *capacity ? *capacity * 2 : 1024;
 
-    value = sqlite3_column_text(stmt, ind);
-    return value ? strdup((char *)value) : NULL;
+    array = reallocarray(array, new_capacity, elem_size);
+    if (UNLIKELY(!array))
+        lwan_status_critical("Could not allocate memory for the database");
+
+    *capacity = new_capacity;
+    return array;
 }
 
-static struct cache_entry *create_ipinfo(const char *key,
-                                         void *context __attribute__((unused)))
+static sqlite3_stmt *prepare_query(sqlite3 *db, const char *sql, size_t len)
 {
     sqlite3_stmt *stmt;
-    struct ip_info *ip_info = NULL;
-    struct in_addr addr;
 
-    if (UNLIKELY(!inet_aton(key, &addr)))
-        goto end_no_finalize;
+    if (sqlite3_prepare_v2(db, sql, (int)len, &stmt, NULL) != SQLITE_OK)
+        lwan_status_critical("Could not prepare query: %s", sqlite3_errmsg(db));
 
-    if (is_reserved_ip(addr.s_addr)) {
-        ip_info = calloc(1, sizeof(*ip_info));
-        if (LIKELY(ip_info)) {
-            ip_info->country.code = strdup("RD");
-            ip_info->country.name = strdup("Reserved");
-            ip_info->ip = strdup(key);
-        }
-        goto end_no_finalize;
-    }
+    return stmt;
+}
 
-    if (sqlite3_prepare(db, ip_to_city_query, sizeof(ip_to_city_query) - 1,
-                        &stmt, NULL) != SQLITE_OK)
-        goto end_no_finalize;
+static void load_locations(sqlite3 *db, struct hash *location_ids)
+{
+    struct hash *interned = hash_str_new(free, NULL);
+    sqlite3_stmt *stmt;
+    size_t capacity = 0;
 
-    if (sqlite3_bind_int64(stmt, 1, ntohl(addr.s_addr)) != SQLITE_OK)
-        goto end;
+    if (UNLIKELY(!interned))
+        lwan_status_critical("Could not create string table");
 
-    if (sqlite3_step(stmt) != SQLITE_ROW)
-        goto end;
+    stmt = prepare_query(db, locations_query, sizeof(locations_query) - 1);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const intptr_t id = (intptr_t)sqlite3_column_int64(stmt, 0);
+        struct ip_location *location;
 
-    ip_info = malloc(sizeof(*ip_info));
-    if (!ip_info)
-        goto end;
+        /* A country can span more than one block, so the same location
+         * might show up more than once; the first one wins. */
+        if (hash_find(location_ids, (void *)id))
+            continue;
 
-#define TEXT_COLUMN(index) text_column_helper(stmt, index)
+        if (ipdb.n_locations == capacity) {
+            ipdb.locations = grow_array(ipdb.locations, &capacity,
+                                        sizeof(*ipdb.locations));
+        }
+        location = &ipdb.locations[ipdb.n_locations++];
 
-    ip_info->country.code = TEXT_COLUMN(0);
-    ip_info->country.name = TEXT_COLUMN(1);
-    ip_info->region.code = TEXT_COLUMN(2);
-    ip_info->region.name = TEXT_COLUMN(3);
-    ip_info->city.name = TEXT_COLUMN(4);
-    ip_info->city.zip_code = TEXT_COLUMN(5);
-    ip_info->latitude = sqlite3_column_double(stmt, 6);
-    ip_info->longitude = sqlite3_column_double(stmt, 7);
-    ip_info->metro.code = TEXT_COLUMN(8);
-    ip_info->metro.area = TEXT_COLUMN(9);
+#define TEXT_COLUMN(index) intern_string(interned, sqlite3_column_text(stmt, index))
+
+        location->country_code = TEXT_COLUMN(1);
+        location->country_name = TEXT_COLUMN(2);
+        location->region_code = TEXT_COLUMN(3);
+        location->region_name = TEXT_COLUMN(4);
+        location->city_name = TEXT_COLUMN(5);
+        location->zip_code = TEXT_COLUMN(6);
+        location->latitude = sqlite3_column_double(stmt, 7);
+        location->longitude = sqlite3_column_double(stmt, 8);
+        location->metro_code = TEXT_COLUMN(9);
+        location->area_code = TEXT_COLUMN(10);
 
 #undef TEXT_COLUMN
 
-    ip_info->ip = strdup(key);
+        /* Indices are off by one, as hash_find() returns NULL if the
+         * key isn't there */
+        if (UNLIKELY(hash_add(location_ids, (void *)id,
+                              (void *)(uintptr_t)ipdb.n_locations) < 0))
+            lwan_status_critical("Could not index location");
+    }
+
+    sqlite3_finalize(stmt);
+    hash_free(interned);
+}
+
+static void load_blocks(sqlite3 *db, struct hash *location_ids)
+{
+    sqlite3_stmt *stmt;
+    size_t capacity = 0;
+
+    stmt = prepare_query(db, blocks_query, sizeof(blocks_query) - 1);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const sqlite3_int64 start = sqlite3_column_int64(stmt, 0);
+        const intptr_t id = (intptr_t)sqlite3_column_int64(stmt, 1);
+        const uintptr_t location = (uintptr_t)hash_find(location_ids, (void *)id);
+
+        if (!location || start < 0 || start > UINT32_MAX)
+            continue;
+        if (ipdb.n_blocks && ipdb.starts[ipdb.n_blocks - 1] == start)
+            continue;
+
+        if (ipdb.n_blocks == capacity) {
+            size_t location_of_capacity = capacity;
+
+            ipdb.starts =
+                grow_array(ipdb.starts, &capacity, sizeof(*ipdb.starts));
+            ipdb.location_of =
+                grow_array(ipdb.location_of, &location_of_capacity,
+                           sizeof(*ipdb.location_of));
+        }
+
+        ipdb.starts[ipdb.n_blocks] = (uint32_t)start;
+        ipdb.location_of[ipdb.n_blocks] = (uint32_t)(location - 1);
+        ipdb.n_blocks++;
+    }
 
-end:
     sqlite3_finalize(stmt);
-end_no_finalize:
-    return (struct cache_entry *)ip_info;
+}
+
+static void load_database(const char *path)
+{
+    struct hash *location_ids;
+    sqlite3 *db;
+
+    if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+        lwan_status_critical("Could not open database: %s", sqlite3_errmsg(db));
+
+    location_ids = hash_int_new(NULL, NULL);
+    if (UNLIKELY(!location_ids))
+        lwan_status_critical("Could not create location table");
+
+    lwan_strbuf_init(&ipdb.strings);
+    if (UNLIKELY(!lwan_strbuf_append_str(&ipdb.strings, "", 1)))
+        lwan_status_critical("Could not allocate string table");
+
+    load_locations(db, location_ids);
+    load_blocks(db, location_ids);
+
+    hash_free(location_ids);
+    sqlite3_close(db);
+
+    lwan_status_info("Loaded %zu blocks, %zu locations, %zu bytes of strings",
+                     ipdb.n_blocks, ipdb.n_locations,
+                     lwan_strbuf_get_length(&ipdb.strings));
+}
+
+static void free_database(void)
+{
+    free(ipdb.starts);
+    free(ipdb.location_of);
+    free(ipdb.locations);
+    lwan_strbuf_free(&ipdb.strings);
+}
+
+static const struct ip_location *find_location(uint32_t ip)
+{
+    const uint32_t *base = ipdb.starts;
+    size_t n = ipdb.n_blocks;
+
+    if (UNLIKELY(!n || ip < base[0]))
+        return NULL;
+
+    /* Finds the last block starting at or before @ip.  The loop runs
+     * log2(n) times regardless of the data, and the comparison is turned
+     * into a conditional move, so there are no branches to mispredict. */
+    while (n > 1) {
+        const size_t half = n / 2;
+
+        base = (base[half] <= ip) ? base + half : base;
+        n -= half;
+    }
+
+    return &ipdb.locations[ipdb.location_of[base - ipdb.starts]];
+}
+
+static bool lookup_ipinfo(const char *key, struct ip_info *ip_info)
+{
+    const struct ip_location *location;
+    const char *strings;
+    struct in_addr addr;
+
+    if (UNLIKELY(!inet_aton(key, &addr)))
+        return false;
+
+    if (is_reserved_ip(addr.s_addr)) {
+        *ip_info = (struct ip_info){
+            .country = {.code = "RD", .name = "Reserved"},
+            .ip = key,
+        };
+        return true;
+    }
+
+    location = find_location(ntohl(addr.s_addr));
+    if (!location)
+        return false;
+
+    strings = lwan_strbuf_get_buffer(&ipdb.strings);
+    *ip_info = (struct ip_info){
+        .country = {.code = strings + location->country_code,
+                    .name = strings + location->country_name},
+        .region = {.code = strings + location->region_code,
+                   .name = strings + location->region_name},
+        .city = {.name = strings + location->city_name,
+                 .zip_code = strings + location->zip_code},
+        .latitude = location->latitude,
+        .longitude = location->longitude,
+        .metro = {.code = strings + location->metro_code,
+                  .area = strings + location->area_code},
+        .ip = key,
+    };
+    return true;
 }
 
 #if QUERIES_PER_HOUR != 0
@@ -309,8 +486,9 @@ static void destroy_query_limit(struct cache_entry *entry,
 }
 #endif
 
-static struct ip_info *internal_query(struct lwan_request *request,
-                                      const char *ip_address)
+static bool internal_query(struct lwan_request *request,
+                           const char *ip_address,
+                           struct ip_info *info)
 {
     const char *query;
 
@@ -321,10 +499,9 @@ static struct ip_info *internal_query(struct lwan_request *request,
     else
         query = request->url.value;
     if (UNLIKELY(!query))
-        return NULL;
+        return false;
 
-    return (struct ip_info *)cache_coro_get_and_ref_entry(
-        cache, request->conn->coro, query);
+    return lookup_ipinfo(query, info);
 }
 
 #if QUERIES_PER_HOUR != 0
@@ -336,8 +513,11 @@ static bool is_rate_limited(const char *ip_address)
 
     limit = (struct query_limit *)cache_get_and_ref_entry(query_limit,
                                                           ip_address, &error);
-    if (!limit)
-        return true;
+    if (!limit) {
+        /* Let the request through if the entry for this address is being
+         * created by another request. */
+        return error != EINPROGRESS;
+    }
 
     limited = ATOMIC_AAF(&limit->queries, 1) > QUERIES_PER_HOUR;
     cache_entry_unref(query_limit, &limit->base);
@@ -350,7 +530,7 @@ LWAN_HANDLER(templated_output)
 {
     const struct template_mime *tm = data;
     const char *ip_address;
-    struct ip_info *info;
+    struct ip_info info;
     char ip_address_buf[INET6_ADDRSTRLEN];
 
     ip_address = lwan_request_get_remote_address(request, ip_address_buf);
@@ -362,16 +542,12 @@ LWAN_HANDLER(templated_output)
         return HTTP_FORBIDDEN;
 #endif
 
-    info = internal_query(request, ip_address);
-    if (UNLIKELY(!info))
+    if (UNLIKELY(!internal_query(request, ip_address, &info)))
         return HTTP_NOT_FOUND;
 
-    const char *callback = lwan_request_get_query_param(request, "callback");
-    struct ip_info info_with_callback = *info;
-    info_with_callback.callback = callback;
+    info.callback = lwan_request_get_query_param(request, "callback");
 
-    if (!lwan_tpl_apply_with_buffer(tm->tpl, response->buffer,
-                                    &info_with_callback)) {
+    if (!lwan_tpl_apply_with_buffer(tm->tpl, response->buffer, &info)) {
         return HTTP_INTERNAL_ERROR;
     }
 
@@ -407,15 +583,7 @@ int main(void)
     struct template_mime xml_tpl =
         compile_template(xml_template_str, "text/plain; charset=UTF-8");
 
-    int result =
-        sqlite3_open_v2("./db/ipdb.sqlite", &db, SQLITE_OPEN_READONLY, NULL);
-    if (result != SQLITE_OK)
-        lwan_status_critical("Could not open database: %s", sqlite3_errmsg(db));
-    cache = cache_create(create_ipinfo, destroy_ipinfo, NULL, 10);
-
-    sqlite3_exec(db, "PRAGMA mmap_size=123217920", NULL, NULL, NULL);
-    sqlite3_exec(db, "PRAGMA journal_mode=OFF", NULL, NULL, NULL);
-    sqlite3_exec(db, "PRAGMA locking_mode=EXCLUSIVE", NULL, NULL, NULL);
+    load_database("./db/ipdb.sqlite");
 
 #if QUERIES_PER_HOUR != 0
     lwan_status_info("Limiting to %d queries per hour per client",
@@ -450,8 +618,7 @@ int main(void)
 #if QUERIES_PER_HOUR != 0
     cache_destroy(query_limit);
 #endif
-    cache_destroy(cache);
-    sqlite3_close(db);
+    free_database();
 
     return 0;
 }
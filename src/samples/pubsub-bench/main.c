@@ -0,0 +1,165 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lwan.h"
+#include "lwan-pubsub.h"
+
+/* Measures how many messages per second can be published to a topic, and
+ * delivered to all of its subscribers, as the number of subscribers grows.
+ * Publishers and consumers are plain threads; consumers poll their share
+ * of the subscribers instead of sleeping like coroutines would.  Numbers
+ * are only meaningful in release builds: debug builds check the integrity
+ * of linked lists every time they're touched. */
+
+#define N_PUBLISHERS 4
+#define N_CONSUMERS 4
+#define DELIVERIES_PER_RUN 4000000
+
+static struct lwan_pubsub_topic *topic;
+static unsigned int msgs_per_publisher;
+
+struct consumer {
+    pthread_t self;
+    struct lwan_pubsub_subscriber **subs;
+    size_t n_subs;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void *publish(void *data __attribute__((unused)))
+{
+    for (unsigned int i = 0; i < msgs_per_publisher; i++) {
+        if (!lwan_pubsub_publishf(topic, "Message #%u", i))
+            abort();
+    }
+
+    return NULL;
+}
+
+static void *consume(void *data)
+{
+    struct consumer *consumer = data;
+    uint64_t expected = (uint64_t)consumer->n_subs * N_PUBLISHERS *
+                        msgs_per_publisher;
+
+    while (expected) {
+        uint64_t received = 0;
+
+        for (size_t i = 0; i < consumer->n_subs; i++) {
+            struct lwan_pubsub_msg *msg;
+
+            while ((msg = lwan_pubsub_consume(consumer->subs[i]))) {
+                lwan_pubsub_msg_done(msg);
+                received++;
+            }
+        }
+
+        if (!received)
+            sched_yield();
+        expected -= received;
+    }
+
+    return NULL;
+}
+
+static void run(size_t n_subs)
+{
+    struct lwan_pubsub_subscriber **subs = calloc(n_subs, sizeof(*subs));
+    struct consumer consumers[N_CONSUMERS];
+    pthread_t publishers[N_PUBLISHERS];
+    double start, published, delivered;
+    uint64_t n_msgs;
+
+    if (!subs)
+        abort();
+
+    msgs_per_publisher =
+        (unsigned int)(DELIVERIES_PER_RUN / n_subs / N_PUBLISHERS);
+    if (msgs_per_publisher < 1000)
+        msgs_per_publisher = 1000;
+    n_msgs = (uint64_t)msgs_per_publisher * N_PUBLISHERS;
+
+    topic = lwan_pubsub_new_topic();
+    if (!topic)
+        abort();
+    for (size_t i = 0; i < n_subs; i++) {
+        subs[i] = lwan_pubsub_subscribe(topic);
+        if (!subs[i])
+            abort();
+    }
+
+    for (size_t i = 0; i < N_CONSUMERS; i++) {
+        const size_t first = n_subs * i / N_CONSUMERS;
+        const size_t last = n_subs * (i + 1) / N_CONSUMERS;
+
+        consumers[i].subs = subs + first;
+        consumers[i].n_subs = last - first;
+        if (pthread_create(&consumers[i].self, NULL, consume, &consumers[i]))
+            abort();
+    }
+
+    start = now();
+    for (size_t i = 0; i < N_PUBLISHERS; i++) {
+        if (pthread_create(&publishers[i], NULL, publish, NULL))
+            abort();
+    }
+    for (size_t i = 0; i < N_PUBLISHERS; i++)
+        pthread_join(publishers[i], NULL);
+    published = now();
+    for (size_t i = 0; i < N_CONSUMERS; i++)
+        pthread_join(consumers[i].self, NULL);
+    delivered = now();
+
+    printf("%11zu %12" PRIu64 " %15.0f %15.0f\n", n_subs, n_msgs,
+           (double)n_msgs / (published - start),
+           (double)(n_msgs * n_subs) / (delivered - start));
+
+    lwan_pubsub_free_topic(topic);
+    free(subs);
+}
+
+int main(void)
+{
+    static const size_t n_subs[] = {1, 4, 16, 64, 256, 1024};
+
+    printf("%d publisher threads, %d consumer threads\n", N_PUBLISHERS,
+           N_CONSUMERS);
+    printf("%11s %12s %15s %15s\n", "subscribers", "messages", "published/s",
+           "delivered/s");
+
+    for (size_t i = 0; i < N_ELEMENTS(n_subs); i++)
+        run(n_subs[i]);
+
+    return 0;
+}
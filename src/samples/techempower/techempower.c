@@ -29,7 +29,7 @@
 #include "lwan-mod-lua.h"
 #include "int-to-str.h"
 
-#include "database.h"
+#include "lwan-db.h"
 #include "json.h"
 
 enum db_connect_type { DB_CONN_MYSQL, DB_CONN_SQLITE };
@@ -50,12 +50,25 @@ static struct db_connection_params {
     };
 } db_connection_params;
 
+/* Fetch all rows for /queries with a single statement, rather than one
+ * round trip per row.  Much faster, but the TechEmpower benchmark rules
+ * don't allow it ("It is not acceptable to retrieve all required rows
+ * using a SELECT ... WHERE id IN (...) clause"), so it's opt-in. */
+static bool batch_queries;
+
 static const char hello_world[] = "Hello, World!";
 static const char random_number_query[] =
     "SELECT randomNumber, id FROM world WHERE id=?";
 static const char cached_random_number_query[] =
     "SELECT randomNumber, id FROM world WHERE id=?";
 
+struct fortune_row {
+    int id;
+    char *message;
+};
+
+DEFINE_ARRAY_TYPE_INLINEFIRST(fortune_array, struct fortune_row)
+
 struct Fortune {
     struct {
         coro_function_t generator;
@@ -63,9 +76,11 @@ struct Fortune {
         int id;
         char *message;
     } item;
-};
 
-DEFINE_ARRAY_TYPE_INLINEFIRST(fortune_array, struct Fortune)
+    /* Queried by the handler: the generator runs in a coroutine of its
+     * own, which can't be suspended to wait for the database. */
+    struct fortune_array fortunes;
+};
 
 static const char fortunes_template_str[] =
     "<!DOCTYPE html>"
@@ -101,95 +116,115 @@ static struct lwan_tpl *fortune_tpl;
 struct hello_world_json {
     const char *message;
 };
+#undef JSON_STRUCT
+#define JSON_STRUCT struct hello_world_json
 static const struct json_obj_descr hello_world_json_desc[] = {
-    JSON_OBJ_DESCR_PRIM(struct hello_world_json, message, JSON_TOK_STRING),
+    JSON_VAR_STR(message),
 };
+static struct json_encoder hello_world_json_encoder =
+    JSON_ENCODER(hello_world_json_desc);
 
 struct db_json {
     int id;
     int randomNumber;
 };
+#undef JSON_STRUCT
+#define JSON_STRUCT struct db_json
 static const struct json_obj_descr db_json_desc[] = {
-    JSON_OBJ_DESCR_PRIM(struct db_json, id, JSON_TOK_NUMBER),
-    JSON_OBJ_DESCR_PRIM(struct db_json, randomNumber, JSON_TOK_NUMBER),
+    JSON_VAR_INT(id),
+    JSON_VAR_INT(randomNumber),
 };
+static struct json_encoder db_json_encoder = JSON_ENCODER(db_json_desc);
 
 struct queries_json {
     struct db_json queries[500];
     size_t queries_len;
 };
+#undef JSON_STRUCT
+#define JSON_STRUCT struct queries_json
 static const struct json_obj_descr queries_array_desc =
-    JSON_OBJ_DESCR_OBJ_ARRAY(struct queries_json,
-                             queries,
-                             500,
-                             queries_len,
-                             db_json_desc,
-                             N_ELEMENTS(db_json_desc));
-
-static struct db *get_db(void)
+    JSON_VAR_OBJ_ARRAY(queries, queries_len, db_json_desc);
+static struct json_encoder queries_json_encoder =
+    JSON_ARR_ENCODER(queries_array_desc);
+
+/* Connections (and prepared statements) kept by each I/O thread */
+#define MAX_IDLE_DB_CONNECTIONS 16
+#define MAX_CACHED_STMTS 16
+
+static struct db_pool *db_pool;
+
+static struct db *connect_db(struct lwan_request *request,
+                             void *data __attribute__((unused)))
+{
+    switch (db_connection_params.type) {
+    case DB_CONN_MYSQL:
+        if (request) {
+            struct db *database = db_connect_mysql_async(
+                request, db_connection_params.mysql.hostname,
+                db_connection_params.mysql.user,
+                db_connection_params.mysql.password,
+                db_connection_params.mysql.database);
+
+            if (database)
+                return database;
+        }
+
+        return db_connect_mysql(db_connection_params.mysql.hostname,
+                                db_connection_params.mysql.user,
+                                db_connection_params.mysql.password,
+                                db_connection_params.mysql.database);
+    case DB_CONN_SQLITE:
+        return db_connect_sqlite(db_connection_params.sqlite.path, true,
+                                 db_connection_params.sqlite.pragmas);
+    }
+
+    return NULL;
+}
+
+/* Requests take a connection from a per-thread pool: with MariaDB
+ * Connector/C, waiting for the database then suspends only them, rather
+ * than the whole I/O thread.  Without a request (e.g. when creating cache
+ * entries), each thread has a blocking connection of its own. */
+static struct db *get_db(struct lwan_request *request)
 {
     static __thread struct db *database;
 
+    if (request)
+        return db_pool_get(db_pool, request);
+
     if (!database) {
-        switch (db_connection_params.type) {
-        case DB_CONN_MYSQL:
-            database = db_connect_mysql(db_connection_params.mysql.hostname,
-                                        db_connection_params.mysql.user,
-                                        db_connection_params.mysql.password,
-                                        db_connection_params.mysql.database);
-            break;
-        case DB_CONN_SQLITE:
-            database = db_connect_sqlite(db_connection_params.sqlite.path, true,
-                                         db_connection_params.sqlite.pragmas);
-            break;
-        }
+        database = connect_db(NULL, NULL);
         if (!database)
             lwan_status_critical("Could not connect to the database");
+
+        db_set_stmt_cache_size(database, MAX_CACHED_STMTS);
     }
 
     return database;
 }
 
-static int append_to_strbuf(const char *bytes, size_t len, void *data)
-{
-    struct lwan_strbuf *strbuf = data;
-
-    return !lwan_strbuf_append_str(strbuf, bytes, len);
-}
-
-static enum lwan_http_status
-json_response_obj(struct lwan_response *response,
-                  const struct json_obj_descr *descr,
-                  size_t descr_len,
-                  const void *data)
+static struct db_stmt *prepare_stmt(struct lwan_request *request,
+                                    const char *sql,
+                                    size_t sql_len)
 {
-    if (json_obj_encode_full(descr, descr_len, data, append_to_strbuf,
-                             response->buffer, false) != 0)
-        return HTTP_INTERNAL_ERROR;
+    struct db *database = get_db(request);
 
-    response->mime_type = "application/json";
-    return HTTP_OK;
+    return LIKELY(database) ? db_prepare_stmt(database, sql, sql_len) : NULL;
 }
 
-static enum lwan_http_status
-json_response_arr(struct lwan_response *response,
-                  const struct json_obj_descr *descr,
-                  const void *data)
+static enum lwan_http_status json_response(struct lwan_response *response,
+                                          struct json_encoder *encoder,
+                                          const void *data)
 {
-    if (json_arr_encode_full(descr, data, append_to_strbuf, response->buffer,
-                             false) != 0)
-        return HTTP_INTERNAL_ERROR;
-
-    response->mime_type = "application/json";
-    return HTTP_OK;
+    return json_encode_response(encoder, data, response) ? HTTP_OK
+                                                          : HTTP_INTERNAL_ERROR;
 }
 
 LWAN_HANDLER(json)
 {
     struct hello_world_json j = {.message = hello_world};
 
-    return json_response_obj(response, hello_world_json_desc,
-                             N_ELEMENTS(hello_world_json_desc), &j);
+    return json_response(response, &hello_world_json_encoder, &j);
 }
 
 static bool db_query_key(struct db_stmt *stmt, struct db_json *out, int key)
@@ -216,8 +251,8 @@ static inline bool db_query(struct db_stmt *stmt, struct db_json *out)
 
 LWAN_HANDLER(db)
 {
-    struct db_stmt *stmt = db_prepare_stmt(get_db(), random_number_query,
-                                           sizeof(random_number_query) - 1);
+    struct db_stmt *stmt = prepare_stmt(request, random_number_query,
+                                        sizeof(random_number_query) - 1);
     struct db_json db_json;
 
     if (UNLIKELY(!stmt)) {
@@ -232,8 +267,97 @@ LWAN_HANDLER(db)
     if (!queried)
         return HTTP_INTERNAL_ERROR;
 
-    return json_response_obj(response, db_json_desc, N_ELEMENTS(db_json_desc),
-                         &db_json);
+    return json_response(response, &db_json_encoder, &db_json);
+}
+
+static int compare_ints(const void *a, const void *b)
+{
+    const int ia = *(const int *)a;
+    const int ib = *(const int *)b;
+
+    return (ia > ib) - (ia < ib);
+}
+
+static bool db_query_batch(struct lwan_request *request,
+                           struct queries_json *qj)
+{
+    static const char prefix[] =
+        "SELECT randomNumber, id FROM world WHERE id IN (";
+    struct batch {
+        int keys[N_ELEMENTS(qj->queries)];
+        int random_numbers[N_ELEMENTS(qj->queries)];
+        struct db_row rows[N_ELEMENTS(qj->queries)];
+        char sql[sizeof(prefix) + 2 * N_ELEMENTS(qj->queries)];
+    } *batch;
+    struct db_stmt *stmt;
+    size_t n_keys = 0;
+    bool ret = false;
+
+    /* Too big for the coroutine stack */
+    batch = coro_malloc(request->conn->coro, sizeof(*batch));
+    if (UNLIKELY(!batch))
+        return false;
+
+    for (size_t i = 0; i < qj->queries_len; i++) {
+        qj->queries[i].id = rand() % 10000 + 1;
+        batch->keys[i] = qj->queries[i].id;
+    }
+
+    /* Each row is fetched only once, no matter how many times it has been
+     * picked; rows are then looked up by id. */
+    qsort(batch->keys, qj->queries_len, sizeof(int), compare_ints);
+    for (size_t i = 0; i < qj->queries_len; i++) {
+        if (!n_keys || batch->keys[n_keys - 1] != batch->keys[i])
+            batch->keys[n_keys++] = batch->keys[i];
+    }
+
+    char *sql = batch->sql + sizeof(prefix) - 1;
+    memcpy(batch->sql, prefix, sizeof(prefix) - 1);
+    for (size_t i = 0; i < n_keys; i++) {
+        *sql++ = '?';
+        *sql++ = i + 1 < n_keys ? ',' : ')';
+        batch->rows[i] = (struct db_row){.kind = 'i', .u.i = batch->keys[i]};
+        batch->random_numbers[i] = -1;
+    }
+
+    /* Statements are cached by their (NUL-terminated) SQL */
+    *sql = '\0';
+
+    stmt = prepare_stmt(request, batch->sql, (size_t)(sql - batch->sql));
+    if (UNLIKELY(!stmt))
+        return false;
+
+    if (UNLIKELY(!db_stmt_bind(stmt, batch->rows, n_keys)))
+        goto out;
+
+    long random_number;
+    long id;
+    while (db_stmt_step(stmt, "ii", &random_number, &id)) {
+        const int key = (int)id;
+        const int *found =
+            bsearch(&key, batch->keys, n_keys, sizeof(int), compare_ints);
+
+        if (LIKELY(found))
+            batch->random_numbers[found - batch->keys] = (int)random_number;
+    }
+
+    for (size_t i = 0; i < qj->queries_len; i++) {
+        const int *found = bsearch(&qj->queries[i].id, batch->keys, n_keys,
+                                   sizeof(int), compare_ints);
+        const int value = batch->random_numbers[found - batch->keys];
+
+        /* Missing from the table */
+        if (UNLIKELY(value < 0))
+            goto out;
+
+        qj->queries[i].randomNumber = value;
+    }
+
+    ret = true;
+
+out:
+    db_stmt_finalize(stmt);
+    return ret;
 }
 
 LWAN_HANDLER(queries)
@@ -246,8 +370,18 @@ LWAN_HANDLER(queries)
                   ? LWAN_MIN(500, LWAN_MAX(1, parse_long(queries_str, -1)))
                   : 1;
 
-    struct db_stmt *stmt = db_prepare_stmt(get_db(), random_number_query,
-                                           sizeof(random_number_query) - 1);
+    if (batch_queries) {
+        struct queries_json qj = {.queries_len = (size_t)queries};
+
+        if (UNLIKELY(!db_query_batch(request, &qj)))
+            return HTTP_INTERNAL_ERROR;
+
+        lwan_strbuf_grow_to(response->buffer, (size_t)(32l * queries));
+        return json_response(response, &queries_json_encoder, &qj);
+    }
+
+    struct db_stmt *stmt = prepare_stmt(request, random_number_query,
+                                        sizeof(random_number_query) - 1);
     if (UNLIKELY(!stmt))
         return HTTP_INTERNAL_ERROR;
 
@@ -262,7 +396,7 @@ LWAN_HANDLER(queries)
      * so this is a good approximation.  */
     lwan_strbuf_grow_to(response->buffer, (size_t)(32l * queries));
 
-    ret = json_response_arr(response, &queries_array_desc, &qj);
+    ret = json_response(response, &queries_json_encoder, &qj);
 
 out:
     db_stmt_finalize(stmt);
@@ -285,8 +419,9 @@ static struct cache_entry *cached_queries_new(const char *key, void *context)
     if (UNLIKELY(!entry))
         return NULL;
 
-    stmt = db_prepare_stmt(get_db(), cached_random_number_query,
-                           sizeof(cached_random_number_query) - 1);
+    /* Not necessarily called from a request handler */
+    stmt = prepare_stmt(NULL, cached_random_number_query,
+                        sizeof(cached_random_number_query) - 1);
     if (UNLIKELY(!stmt)) {
         free(entry);
         return NULL;
@@ -319,15 +454,19 @@ static struct cache_entry *my_cache_coro_get_and_ref_entry(struct cache *cache,
      * For large number of cached elements, too, this will reduce the number of
      * indirect calls that are performed every time a request is serviced.
      */
+    const unsigned int hash = cache_key_hash(key);
 
     for (int tries = 64; tries; tries--) {
         int error;
-        struct cache_entry *ce = cache_get_and_ref_entry(cache, key, &error);
+        struct cache_entry *ce =
+            cache_get_and_ref_entry_hashed(cache, key, hash, &error);
 
         if (LIKELY(ce))
             return ce;
 
-        if (error != EWOULDBLOCK)
+        /* EINPROGRESS: another request is querying the database for this
+         * entry already. */
+        if (error != EWOULDBLOCK && error != EINPROGRESS)
             break;
 
         coro_yield(request->conn->coro, CONN_CORO_WANT_WRITE);
@@ -370,7 +509,7 @@ LWAN_HANDLER(cached_queries)
      * so this is a good approximation.  */
     lwan_strbuf_grow_to(response->buffer, (size_t)(32l * queries));
 
-    return json_response_arr(response, &queries_array_desc, &qj);
+    return json_response(response, &queries_json_encoder, &qj);
 }
 
 LWAN_HANDLER(plaintext)
@@ -384,10 +523,10 @@ LWAN_HANDLER(plaintext)
 
 static int fortune_compare(const void *a, const void *b)
 {
-    const struct Fortune *fortune_a = (const struct Fortune *)a;
-    const struct Fortune *fortune_b = (const struct Fortune *)b;
+    const struct fortune_row *fortune_a = (const struct fortune_row *)a;
+    const struct fortune_row *fortune_b = (const struct fortune_row *)b;
 
-    return strcmp(fortune_a->item.message, fortune_b->item.message);
+    return strcmp(fortune_a->message, fortune_b->message);
 }
 
 static bool append_fortune(struct coro *coro,
@@ -395,7 +534,7 @@ static bool append_fortune(struct coro *coro,
                            int id,
                            const char *message)
 {
-    struct Fortune *fortune;
+    struct fortune_row *fortune;
     char *message_copy;
 
     message_copy = coro_strdup(coro, message);
@@ -406,63 +545,77 @@ static bool append_fortune(struct coro *coro,
     if (UNLIKELY(!fortune))
         return false;
 
-    fortune->item.id = id;
-    fortune->item.message = message_copy;
+    fortune->id = id;
+    fortune->message = message_copy;
 
     return true;
 }
 
-static int fortune_list_generator(struct coro *coro, void *data)
+static bool query_fortunes(struct lwan_request *request,
+                           struct fortune_array *fortunes)
 {
     static const char fortune_query[] = "SELECT * FROM Fortune";
-    struct Fortune *fortune = data;
-    struct fortune_array fortunes;
+    struct coro *coro = request->conn->coro;
     struct db_stmt *stmt;
+    bool ret = false;
 
-    stmt = db_prepare_stmt(get_db(), fortune_query, sizeof(fortune_query) - 1);
+    stmt = prepare_stmt(request, fortune_query, sizeof(fortune_query) - 1);
     if (UNLIKELY(!stmt))
-        return 0;
-
-    fortune_array_init(&fortunes);
+        return false;
 
     long id;
     char fortune_buffer[256];
     while (db_stmt_step(stmt, "is", &id, &fortune_buffer, sizeof(fortune_buffer))) {
-        if (!append_fortune(coro, &fortunes, (int)id, fortune_buffer))
+        if (!append_fortune(coro, fortunes, (int)id, fortune_buffer))
             goto out;
     }
 
-    if (!append_fortune(coro, &fortunes, 0,
+    if (!append_fortune(coro, fortunes, 0,
                         "Additional fortune added at request time."))
         goto out;
 
-    fortune_array_sort(&fortunes, fortune_compare);
+    fortune_array_sort(fortunes, fortune_compare);
+    ret = true;
 
-    struct Fortune *iter;
-    LWAN_ARRAY_FOREACH (&fortunes, iter) {
-        fortune->item.id = iter->item.id;
-        fortune->item.message = iter->item.message;
+out:
+    db_stmt_finalize(stmt);
+    return ret;
+}
+
+static int fortune_list_generator(struct coro *coro, void *data)
+{
+    struct Fortune *fortune = data;
+    struct fortune_row *iter;
+
+    LWAN_ARRAY_FOREACH (&fortune->fortunes, iter) {
+        fortune->item.id = iter->id;
+        fortune->item.message = iter->message;
         coro_yield(coro, 1);
     }
 
-out:
-    fortune_array_reset(&fortunes);
-    db_stmt_finalize(stmt);
     return 0;
 }
 
 LWAN_HANDLER(fortunes)
 {
     struct Fortune fortune;
+    enum lwan_http_status status = HTTP_INTERNAL_ERROR;
 
-    lwan_strbuf_grow_to(response->buffer, 1500);
+    fortune_array_init(&fortune.fortunes);
+
+    if (UNLIKELY(!query_fortunes(request, &fortune.fortunes)))
+        goto out;
 
     if (UNLIKELY(!lwan_tpl_apply_with_buffer(fortune_tpl, response->buffer,
                                              &fortune)))
-        return HTTP_INTERNAL_ERROR;
+        goto out;
 
     response->mime_type = "text/html; charset=UTF-8";
-    return HTTP_OK;
+    status = HTTP_OK;
+
+out:
+    fortune_array_reset(&fortune.fortunes);
+    return status;
 }
 
 LWAN_HANDLER(quit_lwan)
@@ -479,6 +632,8 @@ int main(void)
 
     srand((unsigned int)time(NULL));
 
+    batch_queries = !!getenv("BATCH_QUERIES");
+
     if (getenv("USE_MYSQL")) {
         db_connection_params = (struct db_connection_params){
             .type = DB_CONN_MYSQL,
@@ -507,6 +662,11 @@ int main(void)
         };
     }
 
+    db_pool = db_pool_new(connect_db, NULL, MAX_IDLE_DB_CONNECTIONS,
+                          MAX_CACHED_STMTS);
+    if (!db_pool)
+        lwan_status_critical("Could not create database connection pool");
+
     fortune_tpl = lwan_tpl_compile_string_full(
         fortunes_template_str, fortune_desc, LWAN_TPL_FLAG_CONST_TEMPLATE);
     if (!fortune_tpl)
@@ -518,10 +678,14 @@ int main(void)
                                         3600 /* 1 hour */);
     if (!cached_queries_cache)
         lwan_status_critical("Could not create cached queries cache");
+    /* Rows expiring together would otherwise be queried again by the
+     * requests that find them missing. */
+    cache_set_stale_while_revalidate(cached_queries_cache, 60);
 
     lwan_main_loop(&l);
 
     cache_destroy(cached_queries_cache);
+    db_pool_free(db_pool);
     lwan_tpl_free(fortune_tpl);
     lwan_shutdown(&l);
 
@@ -19,6 +19,7 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
 #include <stdlib.h>
 
 #include "lwan.h"
@@ -102,6 +103,56 @@ out:
     __builtin_unreachable();
 }
 
+/* Large binary messages don't have to be buffered whole: this reads them
+ * in small pieces as they arrive, and replies with their size and a hash
+ * of their contents once each one is done. */
+LWAN_HANDLER(ws_upload)
+{
+    enum lwan_http_status status = lwan_request_websocket_upgrade(request);
+    uint64_t size = 0;
+    uint32_t hash = 2166136261u;
+
+    if (status != HTTP_SWITCHING_PROTOCOLS)
+        return status;
+
+    while (true) {
+        bool last;
+
+        switch (lwan_response_websocket_read_partial(request, 4096, &last)) {
+        case EAGAIN:
+            /* Wait for the next frame, rather than polling for it. */
+            coro_yield(request->conn->coro, CONN_CORO_WANT_READ);
+            break;
+
+        case 0: {
+            const unsigned char *piece =
+                (const unsigned char *)lwan_strbuf_get_buffer(response->buffer);
+            const size_t len = lwan_strbuf_get_length(response->buffer);
+
+            /* FNV-1a */
+            for (size_t i = 0; i < len; i++)
+                hash = (hash ^ piece[i]) * 16777619u;
+            size += len;
+
+            if (last) {
+                lwan_strbuf_printf(response->buffer,
+                                   "Received %" PRIu64 " bytes (hash %08x)",
+                                   size, hash);
+                lwan_response_websocket_write(request);
+
+                size = 0;
+                hash = 2166136261u;
+            }
+            break;
+        }
+
+        default:
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+    }
+}
+
 static void unsub_chat(void *data1, void *data2)
 {
     lwan_pubsub_unsubscribe((struct lwan_pubsub_topic *)data1,
@@ -124,7 +175,6 @@ static void pub_depart_message(void *data1, void *data2)
 LWAN_HANDLER(ws_chat)
 {
     struct lwan_pubsub_subscriber *sub;
-    struct lwan_pubsub_msg *msg;
     enum lwan_http_status status;
     static int total_user_count;
     int user_id;
@@ -149,28 +199,14 @@ LWAN_HANDLER(ws_chat)
     lwan_pubsub_publishf(chat, "*** User%d has joined the chat!\n", user_id);
 
     while (true) {
-        switch (lwan_response_websocket_read(request)) {
+        /* Messages from other clients are framed once and broadcast to
+         * every subscriber while waiting for this client to say something. */
+        switch (lwan_pubsub_websocket_read(request, sub)) {
         case ENOTCONN:   /* read() called before connection is websocket */
         case ECONNRESET: /* Client closed the connection */
+        case ENOBUFS:    /* Client isn't keeping up with the chat */
             goto out;
 
-        case EAGAIN: /* Nothing is available from other clients */
-            while ((msg = lwan_pubsub_consume(sub))) {
-                const struct lwan_value *value = lwan_pubsub_msg_value(msg);
-
-                lwan_strbuf_set(response->buffer, value->value, value->len);
-
-                /* Mark as done before writing: websocket_write() can abort the
-                 * coroutine and we want to drop the reference before this
-                 * happens. */
-                lwan_pubsub_msg_done(msg);
-
-                lwan_response_websocket_write(request);
-            }
-
-            lwan_request_sleep(request, 1000);
-            break;
-
         case 0: /* We got something! Copy it to echo it back */
             lwan_pubsub_publishf(chat, "User%d: %.*s\n", user_id,
                                  (int)lwan_strbuf_get_length(response->buffer),
@@ -268,6 +304,7 @@ int main(void)
     const struct lwan_url_map default_map[] = {
         {.prefix = "/ws-write", .handler = LWAN_HANDLER_REF(ws_write)},
         {.prefix = "/ws-read", .handler = LWAN_HANDLER_REF(ws_read)},
+        {.prefix = "/ws-upload", .handler = LWAN_HANDLER_REF(ws_upload)},
         {.prefix = "/ws-chat", .handler = LWAN_HANDLER_REF(ws_chat)},
         {.prefix = "/", .handler = LWAN_HANDLER_REF(index)},
         {},
@@ -276,7 +313,7 @@ int main(void)
 
     lwan_init(&l);
 
-    chat = lwan_pubsub_new_topic();
+    chat = lwan_pubsub_new_bounded_topic(256);
 
     lwan_set_url_map(&l, default_map);
     lwan_main_loop(&l);
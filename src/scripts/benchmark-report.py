@@ -0,0 +1,232 @@
+#!/usr/bin/python
+# Runs the scenarios in src/bin/lwan-bench/scenarios/testrunner.conf against
+# the testrunner, and writes a JSON report with what lwan-bench measured
+# (requests/s, latency percentiles) alongside what the server used to
+# serve them (RSS, CPU time, and system calls per request), so that
+# performance can be tracked across releases.
+#
+# Usage: benchmark-report.py [build-dir] [--output report.json]
+#                            [--duration 10s] [scenario...]
+#
+# System calls are counted with `perf stat` if it's installed and allowed
+# to trace the raw_syscalls:sys_enter tracepoint; otherwise, only the
+# read-like and write-like ones accounted for in /proc/PID/io are counted,
+# which is noted in the report.
+
+import datetime
+import json
+import os
+import platform
+import re
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import time
+
+BUILD_DIR = './build'
+for arg in sys.argv[1:]:
+  if not arg.startswith('-') and os.path.isdir(arg):
+    BUILD_DIR = arg
+    sys.argv.remove(arg)
+
+TESTRUNNER = os.path.join(BUILD_DIR, 'src/bin/testrunner/testrunner')
+LWAN_BENCH = os.path.join(BUILD_DIR, 'src/bin/lwan-bench/lwan-bench')
+SCENARIOS = 'src/bin/lwan-bench/scenarios/testrunner.conf'
+FILES_TO_COPY = ('src/bin/testrunner/testrunner.conf',
+                 'src/bin/testrunner/test.lua')
+# Pin everything the configuration file reads from the environment, so
+# reports generated on different machines use the same settings.
+ENVIRONMENT = {
+  'KEEP_ALIVE_TIMEOUT': '15',
+  'PER_THREAD_LISTENERS': 'false',
+  'WORK_STEALING': 'false',
+  'USE_IO_URING': 'false',
+  'CACHE_FOR': '5',
+}
+
+
+def cmdlinearg(arg, default=None):
+  if arg not in sys.argv:
+    return default
+  index = sys.argv.index(arg)
+  del sys.argv[index]
+  return sys.argv.pop(index)
+
+
+def scenario_names():
+  with open(SCENARIOS) as f:
+    return re.findall(r'^scenario\s+(\S+)\s*{', f.read(), re.MULTILINE)
+
+
+def proc_fields(pid, name):
+  fields = {}
+  with open('/proc/%d/%s' % (pid, name)) as f:
+    for line in f:
+      key, _, value = line.partition(':')
+      fields[key] = value.split()[0] if value.split() else ''
+  return fields
+
+
+def sample(pid):
+  status = proc_fields(pid, 'status')
+  with open('/proc/%d/stat' % pid) as f:
+    # The command name can contain spaces, so split after it
+    stat = f.read().rsplit(')', 1)[1].split()
+  ticks = os.sysconf('SC_CLK_TCK')
+  try:
+    io = proc_fields(pid, 'io')
+    syscalls = int(io['syscr']) + int(io['syscw'])
+  except (OSError, KeyError):
+    syscalls = None
+
+  return {
+    'rss_kb': int(status['VmRSS']),
+    'rss_peak_kb': int(status['VmHWM']),
+    'cpu_sec': (int(stat[11]) + int(stat[12])) / ticks,
+    'context_switches': int(status['voluntary_ctxt_switches']) +
+                        int(status['nonvoluntary_ctxt_switches']),
+    'rw_syscalls': syscalls,
+  }
+
+
+def start_perf(pid):
+  if shutil.which('perf') is None:
+    return None
+  perf = subprocess.Popen(('perf', 'stat', '-x', ',', '-e',
+                           'raw_syscalls:sys_enter', '-p', str(pid)),
+                          stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+                          universal_newlines=True)
+  time.sleep(0.2)
+  if perf.poll() is not None:
+    return None
+  return perf
+
+
+def stop_perf(perf):
+  if perf is None:
+    return None
+  perf.send_signal(signal.SIGINT)
+  _, output = perf.communicate()
+  for line in output.splitlines():
+    fields = line.split(',')
+    if len(fields) > 2 and fields[2] == 'raw_syscalls:sys_enter':
+      try:
+        return int(fields[0])
+      except ValueError:
+        return None
+  return None
+
+
+def wait_for_server(server):
+  for _ in range(50):
+    if server.poll() is not None:
+      raise Exception('testrunner exited with status %d' % server.returncode)
+    try:
+      socket.create_connection(('127.0.0.1', 8080), timeout=1).close()
+      return
+    except OSError:
+      time.sleep(0.1)
+  raise Exception('testrunner is not accepting connections')
+
+
+def run_scenario(pid, name, duration):
+  command = [LWAN_BENCH, '--json']
+  if duration:
+    command += ['--duration', duration]
+  command += [SCENARIOS, name]
+
+  before = sample(pid)
+  perf = start_perf(pid)
+  output = subprocess.check_output(command, universal_newlines=True)
+  syscalls = stop_perf(perf)
+  after = sample(pid)
+
+  result = json.loads(output.strip().splitlines()[-1])
+  requests = max(result['requests'], 1)
+
+  if syscalls is not None:
+    source = 'perf'
+  else:
+    source = 'proc-io'
+    if after['rw_syscalls'] is not None:
+      syscalls = after['rw_syscalls'] - before['rw_syscalls']
+
+  cpu_sec = after['cpu_sec'] - before['cpu_sec']
+  result['server'] = {
+    'rss_kb': after['rss_kb'],
+    'rss_peak_kb': after['rss_peak_kb'],
+    'rss_growth_kb': after['rss_kb'] - before['rss_kb'],
+    'cpu_sec': round(cpu_sec, 3),
+    'cpu_us_per_request': round(cpu_sec * 1e6 / requests, 3),
+    'context_switches': after['context_switches'] - before['context_switches'],
+    'syscalls': syscalls,
+    'syscalls_per_request': None if syscalls is None
+                            else round(syscalls / requests, 3),
+    'syscalls_source': source,
+  }
+  return result
+
+
+def git_describe():
+  try:
+    return subprocess.check_output(('git', 'describe', '--always', '--dirty'),
+                                   stderr=subprocess.DEVNULL,
+                                   universal_newlines=True).strip()
+  except (OSError, subprocess.CalledProcessError):
+    return None
+
+
+if __name__ == '__main__':
+  output_path = cmdlinearg('--output')
+  duration = cmdlinearg('--duration')
+  names = [arg for arg in sys.argv[1:] if not arg.startswith('-')]
+  names = names or scenario_names()
+
+  for path in (TESTRUNNER, LWAN_BENCH):
+    if not os.path.exists(path):
+      print('%s not found; build it first' % path, file=sys.stderr)
+      sys.exit(1)
+
+  for path in FILES_TO_COPY:
+    shutil.copyfile(path, os.path.basename(path))
+  open('htpasswd', 'w').close()
+
+  env = dict(os.environ, **ENVIRONMENT)
+  server = subprocess.Popen([TESTRUNNER], env=env, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.STDOUT)
+  report = {
+    'version': git_describe(),
+    'date': datetime.datetime.now(datetime.timezone.utc).isoformat(),
+    'machine': {
+      'system': platform.system(),
+      'release': platform.release(),
+      'arch': platform.machine(),
+      'cpus': os.cpu_count(),
+    },
+    'scenarios': [],
+  }
+
+  try:
+    wait_for_server(server)
+    for name in names:
+      print('*** Running scenario %s' % name, file=sys.stderr)
+      report['scenarios'].append(run_scenario(server.pid, name, duration))
+  finally:
+    server.send_signal(signal.SIGINT)
+    try:
+      server.wait(timeout=5)
+    except subprocess.TimeoutExpired:
+      server.kill()
+    for path in FILES_TO_COPY:
+      os.remove(os.path.basename(path))
+    os.remove('htpasswd')
+
+  if output_path:
+    with open(output_path, 'w') as f:
+      json.dump(report, f, indent=2)
+      f.write('\n')
+  else:
+    json.dump(report, sys.stdout, indent=2)
+    print()
@@ -3,6 +3,7 @@
 #       performs certain system calls. This should speed up the mmap tests
 #       considerably and make it possible to perform more low-level tests.
 
+import concurrent.futures
 import hashlib
 import os
 import random
@@ -12,10 +13,12 @@ import shutil
 import signal
 import socket
 import string
+import struct
 import subprocess
 import sys
 import time
 import unittest
+import zlib
 import logging
 
 BUILD_DIR = './build'
@@ -183,6 +186,33 @@ class TestPost(LwanTest):
     self.assertHttpResponseValid(r, 200, 'application/json')
     self.assertEqual(r.json(), {'did-it-blend': 'oh-hell-yeah'})
 
+  def test_json_body(self):
+    data = {
+      'name': 'caf\u00e9 "quoted" \\ \n\U0001f600',
+      'count': -42,
+      'tags': ['a', 'b/c'],
+      'valid': True,
+    }
+
+    r = requests.post('http://127.0.0.1:8080/post/json', json=data)
+    self.assertHttpResponseValid(r, 200, 'application/json')
+    self.assertEqual(r.json(), data)
+
+  def test_json_body_missing_fields(self):
+    r = requests.post('http://127.0.0.1:8080/post/json',
+      data='{"count": 1}', headers={'Content-Type': 'application/json'})
+    self.assertHttpResponseValid(r, 200, 'application/json')
+    self.assertEqual(r.json(), {'name': '', 'count': 1, 'tags': [], 'valid': False})
+
+  def test_json_body_invalid(self):
+    for body in ('', '{', '[]', '{"count": "1"}', '{"name": "\\x"}',
+                 '{"name": "\\u0000"}', '{"name": "\\ud800"}',
+                 '{"name": "tab\tinside"}',
+                 '{"tags": ["a", "b", "c", "d", "e"]}'):
+      r = requests.post('http://127.0.0.1:8080/post/json', data=body,
+        headers={'Content-Type': 'application/json'})
+      self.assertHttpResponseValid(r, 400, 'text/html')
+
   def make_request_with_size(self, size):
     random.seed(size)
 
@@ -197,6 +227,66 @@ class TestPost(LwanTest):
       'sum': sum(ord(b) for b in data)
     })
 
+  def test_streamed_request(self):
+    random.seed(42)
+    data = "".join(random.choice(string.printable) for c in range(100000))
+    expected = {'received': len(data), 'sum': sum(ord(b) for b in data)}
+
+    r = requests.post('http://127.0.0.1:8080/post/stream', data=data)
+    self.assertHttpResponseValid(r, 200, 'application/json')
+    self.assertEqual(r.json(), expected)
+
+    def chunks():
+      for i in range(0, len(data), 1000):
+        yield data[i:i + 1000].encode()
+
+    r = requests.post('http://127.0.0.1:8080/post/stream', data=chunks())
+    self.assertHttpResponseValid(r, 200, 'application/json')
+    self.assertEqual(r.json(), expected)
+
+  def test_multipart_request(self):
+    random.seed(42)
+    blob = bytes(random.randrange(256) for c in range(100000))
+    files = {
+      'text': (None, 'hello world'),
+      'blob': ('blob.bin', blob, 'application/x-test'),
+    }
+    expected = [
+      {'name': 'text', 'type': 'text/plain', 'size': 11,
+       'sum': sum(b'hello world')},
+      {'name': 'blob', 'type': 'application/x-test', 'filename': 'blob.bin',
+       'size': len(blob), 'sum': sum(blob)},
+    ]
+
+    for url in ('/post/multipart', '/post/multipart/stream'):
+      r = requests.post('http://127.0.0.1:8080' + url, files=files)
+      self.assertHttpResponseValid(r, 200, 'application/json')
+      self.assertEqual(r.json(), expected)
+
+  def test_multipart_request_without_headers_and_padding(self):
+    body = (b'preamble\r\n--xyz\r\n\r\nno headers\r\n--xyz \t\r\n'
+            b'Content-Disposition: form-data; name="b"\r\n\r\n--xyz-ish\r\n'
+            b'--xyz--\r\nepilogue')
+    headers = {'Content-Type': 'multipart/form-data; boundary="xyz"'}
+    expected = [
+      {'name': '', 'type': 'text/plain', 'size': 10, 'sum': sum(b'no headers')},
+      {'name': 'b', 'type': 'text/plain', 'size': 9, 'sum': sum(b'--xyz-ish')},
+    ]
+
+    for url in ('/post/multipart', '/post/multipart/stream'):
+      r = requests.post('http://127.0.0.1:8080' + url, data=body,
+                        headers=headers)
+      self.assertHttpResponseValid(r, 200, 'application/json')
+      self.assertEqual(r.json(), expected)
+
+  def test_truncated_multipart_request(self):
+    headers = {'Content-Type': 'multipart/form-data; boundary=xyz'}
+
+    for url in ('/post/multipart', '/post/multipart/stream'):
+      r = requests.post('http://127.0.0.1:8080' + url,
+                        data=b'--xyz\r\n\r\ntruncated', headers=headers)
+      self.assertEqual(r.status_code, 400)
+
   def test_small_request(self): self.make_request_with_size(10)
   def test_medium_request(self): self.make_request_with_size(100)
   def test_large_request(self): self.make_request_with_size(1000)
@@ -306,6 +396,33 @@ class TestFileServing(LwanTest):
 
     self.assertEqual(r.text, '\0' * 32718)
 
+  def test_range_multiple(self):
+    r = requests.get('http://127.0.0.1:8080/zero',
+          headers={'Range': 'bytes=0-9, 20-29, -5'})
+
+    self.assertEqual(r.status_code, 206)
+    content_type = r.headers['content-type']
+    self.assertTrue(content_type.startswith('multipart/byteranges; boundary='))
+    boundary = content_type.split('=', 1)[1]
+
+    parts = r.content.split(b'\r\n--' + boundary.encode())
+    self.assertEqual(parts[0], b'')
+    self.assertEqual(parts[-1], b'--\r\n')
+    self.assertEqual(len(parts), 5)
+
+    for part, content_range, length in zip(parts[1:-1],
+          ('0-9', '20-29', '32763-32767'), (10, 10, 5)):
+      headers, body = part.split(b'\r\n\r\n', 1)
+      self.assertTrue(b'Content-Type: application/octet-stream' in headers)
+      self.assertTrue(('Content-Range: bytes %s/32768' % content_range).encode() in headers)
+      self.assertEqual(body, b'\0' * length)
+
+  def test_range_multiple_unsatisfiable(self):
+    r = requests.get('http://127.0.0.1:8080/zero',
+          headers={'Range': 'bytes=40000-, 50000-'})
+
+    self.assertHttpResponseValid(r, 416, 'text/html')
+
 
   def test_slash_slash_slash_does_not_matter_404(self):
     r = requests.get('http://127.0.0.1:8080//////////etc/passwd')
@@ -433,6 +550,156 @@ class TestFileServing(LwanTest):
     self.assertTrue('location' in r.headers)
     self.assertEqual(r.headers['location'], 'icons/')
 
+class TestPrecompressedFiles(LwanTest):
+  # Sidecars don't have to be valid compressed data: Lwan only compares
+  # sizes, so the encoding served can be told apart by the length alone.
+  sidecars = (('.gz', 'gzip', 30000), ('.br', 'br', 20000),
+              ('.zst', 'zstd', 25000))
+
+  def setUp(self):
+    with open('wwwroot/precompressed.txt', 'w') as f:
+      f.write('X' * 100000)
+    for extension, _, size in self.sidecars:
+      with open('wwwroot/precompressed.txt' + extension, 'w') as f:
+        f.write('Y' * size)
+    super().setUp()
+
+  def tearDown(self):
+    super().tearDown()
+    for extension in ('',) + tuple(s[0] for s in self.sidecars):
+      os.remove('wwwroot/precompressed.txt' + extension)
+
+  def assertEncoding(self, accept, encoding, size):
+    r = requests.get('http://127.0.0.1:8080/precompressed.txt',
+                     headers={'Accept-Encoding': accept}, stream=True)
+
+    self.assertEqual(r.status_code, 200)
+    self.assertEqual(r.headers.get('content-encoding'), encoding)
+    self.assertEqual(r.headers['content-length'], str(size))
+    r.close()
+
+  def test_each_encoding(self):
+    for _, encoding, size in self.sidecars:
+      self.assertEncoding(encoding, encoding, size)
+
+  def test_smallest_accepted_encoding(self):
+    self.assertEncoding('gzip, zstd', 'zstd', 25000)
+    self.assertEncoding('gzip, deflate, br, zstd', 'br', 20000)
+
+  def test_identity(self):
+    self.assertEncoding('identity', None, 100000)
+
+
+class TestPromotedFiles(LwanTest):
+  # Served by an instance that caches files for 1s, promoting those
+  # requested 3 times while cached.
+  def setUp(self):
+    with open('wwwroot/promoted.txt', 'w') as f:
+      for n in range(5000):
+        f.write('line %d of a file that is worth compressing\n' % n)
+    super().setUp()
+
+  def tearDown(self):
+    super().tearDown()
+    os.remove('wwwroot/promoted.txt')
+
+  def get(self, accept):
+    return requests.get('http://127.0.0.1:8080/promoted/promoted.txt',
+                        headers={'Accept-Encoding': accept})
+
+  def test_hot_file_is_compressed(self):
+    with open('wwwroot/promoted.txt', 'rb') as f:
+      contents = f.read()
+
+    r = self.get('deflate')
+    self.assertEqual(r.status_code, 200)
+    self.assertFalse('content-encoding' in r.headers)
+
+    # Entries expire a while after their time to live, when the cache is
+    # pruned.
+    for _ in range(40):
+      for _ in range(3):
+        r = self.get('deflate')
+      if 'content-encoding' in r.headers:
+        break
+      time.sleep(0.5)
+
+    self.assertEqual(r.headers.get('content-encoding'), 'deflate')
+    self.assertEqual(r.content, contents)
+    self.assertTrue(int(r.headers['content-length']) < len(contents))
+
+    r = self.get('identity')
+    self.assertFalse('content-encoding' in r.headers)
+    self.assertEqual(r.content, contents)
+
+
+class TestCachePeers(LwanTest):
+  # testrunner.conf lists this instance twice, as 127.0.0.1:8080 (itself)
+  # and as localhost:8080 (the "other" peer), so some of these files are
+  # owned by each name.
+  names = ['peer-%d.txt' % n for n in range(8)]
+
+  def setUp(self):
+    for name in self.names:
+      with open('wwwroot/' + name, 'w') as f:
+        f.write(name * 1000)
+    super().setUp()
+
+  def tearDown(self):
+    super().tearDown()
+    for name in self.names:
+      os.remove('wwwroot/' + name)
+
+  def fetch(self, name, cache='serve_files /'):
+    return requests.get('http://127.0.0.1:8080/cache-peers/' + name,
+                        params={'cache': cache})
+
+  def test_owned_files_are_serialized(self):
+    owned = 0
+
+    for name in self.names:
+      r = self.fetch(name)
+      if r.status_code == 409:
+        continue
+
+      self.assertEqual(r.status_code, 200)
+      self.assertEqual(r.headers['content-type'], 'application/octet-stream')
+
+      with open('wwwroot/' + name, 'rb') as f:
+        contents = f.read()
+      etag = requests.get('http://127.0.0.1:8080/' + name).headers['etag']
+
+      # Snapshot flags, followed by a snapshot record: size, mtime, key
+      # length, compressed lengths, ETag; then the key and compressed data.
+      _, size, _, key_len, deflated_len, brotli_len, zstd_len = \
+        struct.unpack('=IQqIIII', r.content[:36])
+      self.assertEqual(size, len(contents))
+      self.assertEqual(key_len, len(name))
+      self.assertEqual(r.content[36:36 + len(etag)].decode(), etag)
+
+      key = r.content.index(name.encode() + b'\0', 36)
+      values = r.content[key + key_len + 1:]
+      self.assertEqual(len(values), deflated_len + brotli_len + zstd_len)
+      self.assertEqual(zlib.decompress(values[:deflated_len]), contents)
+
+      owned += 1
+
+    self.assertTrue(0 < owned < len(self.names))
+
+  def test_files_owned_by_peer_are_served(self):
+    for name in self.names:
+      r = requests.get('http://127.0.0.1:8080/' + name,
+                       headers={'Accept-Encoding': 'deflate'})
+
+      self.assertEqual(r.status_code, 200)
+      self.assertEqual(r.content, (name * 1000).encode())
+
+  def test_requires_cache_name(self):
+    r = requests.get('http://127.0.0.1:8080/cache-peers/' + self.names[0])
+
+    self.assertEqual(r.status_code, 400)
+
+
 class TestRedirect(LwanTest):
   def test_redirect_default(self):
     r = requests.get('http://127.0.0.1:8080/elsewhere', allow_redirects=False)
@@ -477,6 +744,27 @@ class TestRewrite(LwanTest):
     self.assertFalse('location' in r.headers)
     self.assertEqual(r.text, 'Hello, rewritten42!')
 
+  def test_pattern_step_budget(self):
+    def exhausted():
+      r = requests.get('http://127.0.0.1:8080/metrics')
+      for line in r.text.splitlines():
+        if line.startswith('lwan_rewrite_match_budget_exhausted_total '):
+          return float(line.split()[1])
+      self.fail('budget exhaustion counter not found')
+
+    before = exhausted()
+
+    r = requests.get('http://127.0.0.1:8080/pattern-budget/aaaae')
+    self.assertResponsePlain(r, 200)
+    self.assertEqual(r.text, 'Hello, matched!')
+    self.assertEqual(exhausted(), before)
+
+    # Would take millions of steps to rule out without a budget.
+    r = requests.get('http://127.0.0.1:8080/pattern-budget/e' + 'a' * 200 + 'x')
+    self.assertResponsePlain(r, 200)
+    self.assertEqual(r.text, 'Hello, gaveup!')
+    self.assertEqual(exhausted(), before + 1)
+
 class SocketTest(LwanTest):
   class WrappedSock:
     def __init__(self, sock):
@@ -518,6 +806,36 @@ class SocketTest(LwanTest):
     return SocketTest.WrappedSock(sock)
 
 
+class TestUnixSocketListener(SocketTest):
+  def connect_unix(self):
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect('\0lwan-testrunner')
+    return SocketTest.WrappedSock(sock)
+
+  def test_request(self):
+    with self.connect_unix() as sock:
+      sock.send('GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n')
+      response = sock.recv(4096)
+
+      self.assertTrue(response.startswith('HTTP/1.1 200 OK'))
+      self.assertTrue(response.endswith('Hello, world!'))
+
+  def test_remote_address(self):
+    with self.connect_unix() as sock:
+      sock.send('GET /proxy HTTP/1.1\r\nHost: localhost\r\n\r\n')
+      response = sock.recv(4096)
+
+      self.assertTrue('\r\nX-Proxy: unix:\r\n' in response)
+
+  def test_proxy_protocol(self):
+    with self.connect_unix() as sock:
+      sock.send('PROXY TCP4 192.168.242.221 192.168.242.242 56324 31337\r\n'
+                'GET /proxy HTTP/1.1\r\nHost: localhost\r\n\r\n')
+      response = sock.recv(4096)
+
+      self.assertTrue('\r\nX-Proxy: 192.168.242.221\r\n' in response)
+
+
 class TestMinimalRequests(SocketTest):
   def assertHttpCode(self, sock, code):
     contents = sock.recv(128)
@@ -578,6 +896,23 @@ class TestMalformedRequests(SocketTest):
       self.assertHttpCode(sock, 400)
 
 
+  def test_large_request_headers(self):
+    # Doesn't fit in the request buffer in the coroutine stack, but is
+    # under max_request_header_size.
+    cookie = 'X' * 12000
+
+    with self.connect() as sock:
+      # Twice, to also check that the connection is still usable.
+      for _ in range(2):
+        sock.send('GET /hello HTTP/1.1\r\nCookie: c=%s\r\n\r\n' % cookie)
+
+        response = ''
+        while not response.endswith('Hello, world!'):
+          chunk = sock.recv(4096)
+          self.assertTrue(chunk)
+          response += chunk
+        self.assertTrue(response.startswith('HTTP/1.1 200 OK'))
+
   def test_request_too_large(self):
     try:
       r = requests.get('http://127.0.0.1:8080/' + 'X' * 100000)
@@ -600,6 +935,210 @@ class TestChunkedEncoding(LwanTest):
       ''.join('*This is chunk %d*\n' % i for i in range(11)) +
       'Last chunk\n')
 
+  def test_chunked_template(self):
+    for rows in (0, 10, 100000):
+      r = requests.get('http://localhost:8080/chunked-template?rows=%d' % rows)
+      self.assertResponsePlain(r)
+      self.assertFalse('Content-Length' in r.headers)
+      self.assertEqual(r.headers['Transfer-Encoding'], 'chunked')
+      self.assertEqual(r.text,
+        '%d rows:\n' % rows +
+        ''.join('This is row %d\n' % i for i in range(rows)) +
+        'End\n')
+
+class TestCompressedResponses(LwanTest):
+  query = 'dump_vars=1&' + '&'.join('key%d=value%d' % (i, i) for i in range(20))
+  chunked = ('Testing chunked encoding! First chunk\n' +
+             ''.join('*This is chunk %d*\n' % i for i in range(11)) +
+             'Last chunk\n').encode()
+
+  def get_raw(self, path, encoding):
+    # Bypass the decoding done by requests, so that what Lwan sent is
+    # what's checked.
+    r = requests.get('http://127.0.0.1:8080' + path,
+                     headers={'Accept-Encoding': encoding}, stream=True)
+    self.assertEqual(r.status_code, 200)
+    body = r.raw.read(decode_content=False)
+    r.close()
+    return r, body
+
+  def zstd_decompress(self, r, body):
+    if r.headers.get('content-encoding') != 'zstd':
+      self.skipTest('Lwan built without zstd')
+    if not shutil.which('zstd'):
+      self.skipTest('zstd not installed')
+    return subprocess.run(['zstd', '-d', '-c'], input=body,
+                          stdout=subprocess.PIPE, check=True).stdout
+
+  def test_whole_response(self):
+    _, expected = self.get_raw('/compressed?' + self.query, 'identity')
+
+    r, body = self.get_raw('/compressed?' + self.query, 'gzip')
+    self.assertEqual(r.headers['content-encoding'], 'gzip')
+    self.assertEqual(r.headers['content-length'], str(len(body)))
+    self.assertEqual(zlib.decompress(body, 16 + zlib.MAX_WBITS), expected)
+
+    r, body = self.get_raw('/compressed?' + self.query, 'deflate')
+    self.assertEqual(r.headers['content-encoding'], 'deflate')
+    self.assertEqual(zlib.decompress(body), expected)
+
+    r, body = self.get_raw('/compressed?' + self.query, 'zstd')
+    self.assertEqual(r.headers['content-length'], str(len(body)))
+    self.assertEqual(self.zstd_decompress(r, body), expected)
+
+  def test_small_response_is_not_compressed(self):
+    r, body = self.get_raw('/compressed', 'gzip, deflate, zstd')
+    self.assertFalse('content-encoding' in r.headers)
+    self.assertEqual(body, b'Hello, world!')
+
+  def test_chunked_response(self):
+    r, body = self.get_raw('/compressed-chunked', 'gzip')
+    self.assertEqual(r.headers['transfer-encoding'], 'chunked')
+    self.assertEqual(r.headers['content-encoding'], 'gzip')
+    self.assertEqual(zlib.decompress(body, 16 + zlib.MAX_WBITS), self.chunked)
+
+    r, body = self.get_raw('/compressed-chunked', 'deflate')
+    self.assertEqual(r.headers['content-encoding'], 'deflate')
+    self.assertEqual(zlib.decompress(body), self.chunked)
+
+    r, body = self.get_raw('/compressed-chunked', 'zstd')
+    self.assertEqual(r.headers['transfer-encoding'], 'chunked')
+    self.assertEqual(self.zstd_decompress(r, body), self.chunked)
+
+
+class TestTemplate(LwanTest):
+  def test_cached_partial(self):
+    def get(version):
+      r = requests.get('http://localhost:8080/cached-partial?version=%d' % version)
+      self.assertResponsePlain(r)
+      request, partial = r.text.splitlines()
+      self.assertTrue(request.startswith('Request '))
+      return int(request[len('Request '):]), partial
+
+    request, partial = get(1)
+    self.assertEqual(partial,
+      'Partial for version 1 rendered by request %d' % request)
+
+    # Same version: the partial isn't rendered again
+    for _ in range(3):
+      self.assertEqual(get(1)[1], partial)
+
+    request, partial = get(2)
+    self.assertEqual(partial,
+      'Partial for version 2 rendered by request %d' % request)
+
+class TestServerSentEvents(LwanTest):
+  def test_pubsub_events(self):
+    r = requests.get('http://localhost:8080/sse-pubsub')
+
+    self.assertEqual(r.status_code, 200)
+    self.assertEqual(r.headers['Content-Type'], 'text/event-stream')
+    self.assertEqual(r.text,
+      ''.join('data: Current value is %d\r\n\r\n' % i for i in range(11)))
+
+  def test_sse_replay(self):
+    # Event streams only end when the connection is closed.
+    def get(last_event_id=None):
+      headers = {'Connection': 'close'}
+      if last_event_id is not None:
+        headers['Last-Event-ID'] = last_event_id
+      r = requests.get('http://localhost:8080/sse-replay', headers=headers)
+      self.assertEqual(r.status_code, 200)
+      self.assertEqual(r.headers['Content-Type'], 'text/event-stream')
+      return r.text
+
+    def event(id, value):
+      return 'id: %d\r\ndata: %s\r\n\r\n' % (id, value)
+
+    missed = 'event: reset\r\ndata: missed\r\n\r\n'
+
+    # Other tests might have published already: find out the last id.
+    r = requests.get('http://localhost:8080/sse-replay-publish?value=first')
+    self.assertEqual(r.status_code, 200)
+    first = int(get('0').rsplit('id: ', 1)[1].split('\r\n', 1)[0])
+
+    for value in 'abcde':
+      r = requests.get('http://localhost:8080/sse-replay-publish?value=%s' % value)
+      self.assertEqual(r.status_code, 200)
+
+    # New clients don't get old events.
+    self.assertEqual(get(), '')
+
+    # Only the last 4 events are kept.
+    self.assertEqual(get(str(first + 3)),
+                     event(first + 4, 'd') + event(first + 5, 'e'))
+    self.assertEqual(get(str(first + 5)), '')
+    self.assertEqual(get(str(first)),
+                     missed + ''.join(event(first + 2 + i, v)
+                                      for i, v in enumerate('bcde')))
+
+    # Ids that weren't given by this server can't be resumed from.
+    self.assertEqual(get(str(first + 100)), missed)
+    self.assertEqual(get('not-an-id'), missed)
+
+class TestPubsubBridge(LwanTest):
+  group = ('239.255.76.67', 47001)
+
+  def node(self):
+    # Another node bridging the same topic, as far as testrunner knows.
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(self.group)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP,
+                    struct.pack('4s4s', socket.inet_aton(self.group[0]),
+                                socket.inet_aton('0.0.0.0')))
+    sock.settimeout(2)
+    return sock
+
+  def datagram(self, node_id, *msgs):
+    header = b'LwPb' + node_id + bytes([len(b'testrunner')]) + b'testrunner'
+    return header + b''.join(struct.pack('>I', len(m)) + m for m in msgs)
+
+  def test_bridge(self):
+    r = requests.get('http://localhost:8080/bridge-publish?value=local')
+    if r.status_code == 503:
+      self.skipTest('Multicast not available')
+    self.assertEqual(r.status_code, 200)
+
+    with self.node() as sock:
+      # Messages published locally are sent to the group...
+      r = requests.get('http://localhost:8080/bridge-publish?value=hello')
+      self.assertEqual(r.status_code, 200)
+      while True:
+        data = sock.recv(65536)
+        if data.endswith(b'hello'):
+          break
+      self.assertEqual(data[:4], b'LwPb')
+      self.assertEqual(data[12:], b'\x0atestrunner' + struct.pack('>I', 5) +
+                       b'hello')
+
+      # ...and messages from other nodes are published locally, and not
+      # sent back to the group.
+      sock.sendto(self.datagram(b'12345678', b'from', b'afar'), self.group)
+      sock.sendto(self.datagram(data[4:12], b'echo'), self.group)
+      for _ in range(20):
+        r = requests.get('http://localhost:8080/bridge-events',
+                         headers={'Connection': 'close', 'Last-Event-ID': '0'})
+        if 'data: afar' in r.text:
+          break
+        time.sleep(0.1)
+      self.assertTrue(r.text.endswith('data: afar\r\n\r\n'))
+      self.assertIn('data: from\r\n\r\n', r.text)
+      self.assertNotIn('echo', r.text)
+
+
+class TestResponseRefs(LwanTest):
+  def test_response_refs(self):
+    line = "This line is longer than what's copied to the response buffer, " \
+           "so it is referenced by the response and written from here instead.\n"
+    expected = 'First line\n' + line + 'Line 2\n' + line + \
+               'Short line\nLast line\n'
+
+    r = requests.get('http://localhost:8080/refs')
+    self.assertResponsePlain(r)
+    self.assertEqual(r.headers['Content-Length'], str(len(expected)))
+    self.assertEqual(r.text, expected)
+
 class TestLua(LwanTest):
   def test_brew_coffee(self):
     r = requests.get('http://127.0.0.1:8080/lua/brew_coffee')
@@ -928,6 +1467,135 @@ Accept: text/plain,text/html;q=0.9,application/xhtml+xml;q=0.9,application/xml;q
       responses = responses.replace(s, '')
 
 
+class TestPipelinedRequestsEdgeTriggered(TestPipelinedRequests):
+  def setUp(self):
+    new_environment = os.environ.copy()
+    new_environment.update({'EDGE_TRIGGERED_EVENTS': 'true'})
+    super().setUp(env=new_environment)
+
+
+class TestFileServingEdgeTriggered(TestFileServing):
+  def setUp(self):
+    new_environment = os.environ.copy()
+    new_environment.update({'EDGE_TRIGGERED_EVENTS': 'true'})
+    super().setUp(env=new_environment)
+
+
+class TestKeepAliveTimeout(LwanTest):
+  def setUp(self):
+    new_environment = os.environ.copy()
+    new_environment.update({'KEEP_ALIVE_TIMEOUT': '2'})
+    super().setUp(env=new_environment)
+
+  def request(self, sock, close=False):
+    sock.sendall(b'GET /hello HTTP/1.1\r\nHost: localhost\r\n' +
+                 (b'Connection: close\r\n' if close else b'') + b'\r\n')
+    self.assertTrue(sock.recv(4096).startswith(b'HTTP/1.1 200 OK'))
+
+  def test_idle_connections_expire(self):
+    idle = socket.create_connection(('127.0.0.1', 8080))
+    for _ in range(4):
+      self.request(idle)
+
+    # A connection closed while being served shouldn't take the others
+    # out of the timeout queue.
+    with socket.create_connection(('127.0.0.1', 8080)) as closed:
+      self.request(closed, close=True)
+
+    idle.settimeout(10)
+    self.assertEqual(idle.recv(4096), b'')
+    idle.close()
+
+  def test_idle_connections_expire_while_accepting(self):
+    idle = socket.create_connection(('127.0.0.1', 8080))
+    self.request(idle)
+    idle.setblocking(False)
+
+    # New connections wake the thread up more often than once a second.
+    deadline = time.time() + 8
+    while time.time() < deadline:
+      socket.create_connection(('127.0.0.1', 8080)).close()
+      time.sleep(0.25)
+
+      try:
+        if idle.recv(4096) == b'':
+          break
+      except BlockingIOError:
+        pass
+    else:
+      self.fail('Idle connection was not closed')
+
+    idle.close()
+
+
+class TestHTTP2(SocketTest):
+  preface = b'PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n'
+
+  def frame(self, type, flags, stream_id, payload=b''):
+    return struct.pack('>I', len(payload))[1:] + \
+        struct.pack('>BBI', type, flags, stream_id) + payload
+
+  def get(self, stream_id, path):
+    # :method GET, :scheme http, and :path as a literal without indexing
+    block = b'\x82\x86\x04' + bytes([len(path)]) + bytes(path, 'UTF-8')
+    return self.frame(0x1, 0x5, stream_id, block)  # END_STREAM|END_HEADERS
+
+  def read_frames(self, sock, until_stream_ends):
+    frames, buf, ended = [], b'', set()
+    while not until_stream_ends <= ended:
+      data = sock._wrapped_sock.recv(65536)
+      if not data:
+        break
+      buf += data
+      while len(buf) >= 9:
+        length = struct.unpack('>I', b'\x00' + buf[:3])[0]
+        if len(buf) < 9 + length:
+          break
+        type, flags, stream_id = struct.unpack('>BBI', buf[3:9])
+        frames.append((type, flags, stream_id, buf[9:9 + length]))
+        if type in (0x0, 0x1) and flags & 0x1:
+          ended.add(stream_id)
+        buf = buf[9 + length:]
+    return frames
+
+  def test_get(self):
+    with self.connect() as sock:
+      sock._wrapped_sock.sendall(self.preface + self.frame(0x4, 0, 0) +
+                                 self.get(1, '/hello'))
+      frames = self.read_frames(sock, {1})
+
+    self.assertEqual(frames[0][0], 0x4) # Server SETTINGS come first
+    headers = [f for f in frames if f[0] == 0x1]
+    self.assertEqual(len(headers), 1)
+    self.assertEqual(headers[0][3][0], 0x88) # :status 200 (static table)
+    body = b''.join(f[3] for f in frames if f[0] == 0x0 and f[2] == 1)
+    self.assertEqual(body, b'Hello, world!')
+
+  def test_multiplexed_streams(self):
+    names = ['stream%d' % n for n in range(1, 20, 2)]
+
+    with self.connect() as sock:
+      sock._wrapped_sock.sendall(self.preface + self.frame(0x4, 0, 0) +
+          b''.join(self.get(n, '/hello?name=stream%d' % n)
+                   for n in range(1, 20, 2)))
+      frames = self.read_frames(sock, set(range(1, 20, 2)))
+
+    for n in range(1, 20, 2):
+      body = b''.join(f[3] for f in frames if f[0] == 0x0 and f[2] == n)
+      self.assertEqual(body, b'Hello, stream%d!' % n)
+
+  def test_connection_error(self):
+    with self.connect() as sock:
+      # HEADERS frames on even-numbered streams can't come from the client
+      sock._wrapped_sock.sendall(self.preface + self.frame(0x4, 0, 0) +
+                                 self.get(2, '/hello'))
+      frames = self.read_frames(sock, {2})
+
+    goaway = [f for f in frames if f[0] == 0x7]
+    self.assertEqual(len(goaway), 1)
+    self.assertEqual(struct.unpack('>II', goaway[0][3]), (0, 0x1))
+
+
 class TestArtificialResponse(LwanTest):
   def test_brew_coffee(self):
     r = requests.get('http://127.0.0.1:8080/brew-coffee')
@@ -935,6 +1603,143 @@ class TestArtificialResponse(LwanTest):
     self.assertEqual(r.status_code, 418)
 
 
+class TestRateLimit(LwanTest):
+  def test_rate_limit(self):
+    for _ in range(2):
+      r = requests.get('http://127.0.0.1:8080/rate-limited',
+                       headers={'X-Client': 'a'})
+      self.assertEqual(r.status_code, 418)
+
+    r = requests.get('http://127.0.0.1:8080/rate-limited',
+                     headers={'X-Client': 'a'})
+    self.assertHttpResponseValid(r, 429, 'text/plain')
+    self.assertEqual(r.headers['retry-after'], '100')
+
+    r = requests.get('http://127.0.0.1:8080/rate-limited',
+                     headers={'X-Client': 'b'})
+    self.assertEqual(r.status_code, 418)
+
+
+class TestMetrics(LwanTest):
+  def test_metrics(self):
+    requests.get('http://127.0.0.1:8080/hello')
+    requests.get('http://127.0.0.1:8080/brew-coffee')
+
+    r = requests.get('http://127.0.0.1:8080/metrics')
+
+    self.assertHttpResponseValid(r, 200, 'text/plain; version=0.0.4')
+
+    values = {}
+    for line in r.text.splitlines():
+      if line.startswith('#'):
+        continue
+      name, value = line.rsplit(' ', 1)
+      values[name] = float(value)
+
+    self.assertTrue(values['lwan_requests_total'] >= 2)
+    self.assertTrue(values['lwan_responses_total{class="2xx"}'] >= 1)
+    self.assertTrue(values['lwan_responses_total{class="4xx"}'] >= 1)
+    self.assertTrue('lwan_open_connections' in values)
+    self.assertTrue(values['lwan_deferred_calls_total'] >= 0)
+
+    for h in ('parse_duration_seconds', 'handler_duration_seconds',
+              'write_duration_seconds', 'response_size_bytes'):
+      name = 'lwan_route_%s' % h
+      count = values['%s_count{route="/hello"}' % name]
+      self.assertTrue(count >= 1)
+      self.assertEqual(values['%s_bucket{route="/hello",le="+Inf"}' % name],
+                       count)
+      self.assertTrue(values['%s_sum{route="/hello"}' % name] >= 0)
+
+    self.assertTrue(
+      values['lwan_route_response_size_bytes_sum{route="/hello"}'] > 0)
+
+
+class TestProfile(LwanTest):
+  def test_profile(self):
+    r = requests.get('http://127.0.0.1:8080/debug/profile?seconds=1')
+
+    self.assertHttpResponseValid(r, 200, 'text/plain')
+    # An idle server might not have used enough CPU time to be sampled.
+    for line in r.text.splitlines():
+      stack, count = line.rsplit(' ', 1)
+      self.assertTrue(stack.startswith('['))
+      self.assertTrue(int(count) > 0)
+
+  def test_profile_duration(self):
+    for seconds in ('0', '-1', '6'):
+      r = requests.get('http://127.0.0.1:8080/debug/profile?seconds=' + seconds)
+      self.assertEqual(r.status_code, 400)
+
+
+class TestStatus(LwanTest):
+  def test_status(self):
+    requests.get('http://127.0.0.1:8080/hello')
+
+    r = requests.get('http://127.0.0.1:8080/status')
+
+    self.assertHttpResponseValid(r, 200, 'application/json')
+
+    status = r.json()
+
+    self.assertTrue(len(status['threads']) >= 1)
+    for thread in status['threads']:
+      for key in ('open_connections', 'keep_alive_queue',
+                  'pending_connections', 'async_awaits', 'loops', 'events',
+                  'events_per_loop', 'requests', 'defers_per_request',
+                  'request_buffer_spills'):
+        self.assertTrue(thread[key] >= 0)
+    self.assertTrue(sum(t['open_connections'] for t in status['threads']) >= 1)
+
+    self.assertTrue(status['readahead']['queue_depth'] >= 0)
+    for slab in status['slabs']:
+      self.assertTrue(slab['slabs'] >= 1)
+      self.assertTrue(slab['capacity'] >= slab['objects'])
+
+    self.assertTrue(any(c['name'].startswith('serve_files ')
+                        for c in status['caches']))
+    for job in status['jobs']:
+      self.assertTrue(job['runs'] >= 0)
+      self.assertTrue(job['max_runtime_us'] >= job['last_runtime_us'])
+      self.assertTrue(job['max_delay_us'] >= 0)
+      self.assertTrue(job['wakeups'] >= 0)
+      self.assertTrue(job['interval_ms'] >= 1000)
+
+    # At least the coroutine handling this request has a stack.
+    memory = status['memory']
+    self.assertTrue(memory['coroutine_stacks'] > 0)
+    for key in ('strbufs', 'pubsub', 'websockets', 'lua', 'caches'):
+      self.assertTrue(memory[key] >= 0)
+
+
+class TestReverseProxy(LwanTest):
+  def test_proxied_request(self):
+    r = requests.get('http://127.0.0.1:8080/upstream/hello?name=proxy')
+
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, 'Hello, proxy!')
+
+  def test_proxied_not_found(self):
+    r = requests.get('http://127.0.0.1:8080/upstream/this-does-not-exist')
+
+    self.assertEqual(r.status_code, 404)
+
+  def test_proxied_large_file(self):
+    r = requests.get('http://127.0.0.1:8080/upstream/100.html')
+    d = requests.get('http://127.0.0.1:8080/100.html')
+
+    self.assertEqual(r.status_code, 200)
+    self.assertEqual(r.content, d.content)
+
+  def test_proxied_post_body(self):
+    data = 'x' * 100000
+    r = requests.post('http://127.0.0.1:8080/upstream/post/stream', data=data)
+    d = requests.post('http://127.0.0.1:8080/post/stream', data=data)
+
+    self.assertEqual(r.status_code, d.status_code)
+    self.assertEqual(r.text, d.text)
+
+
 class TestSleep(LwanTest):
   def test_sleep(self):
     now = time.time()
@@ -944,6 +1749,162 @@ class TestSleep(LwanTest):
     self.assertTrue(1.450 < diff < 1.550)
 
 
+class TestSleepEdgeTriggered(TestSleep):
+  def setUp(self):
+    new_environment = os.environ.copy()
+    new_environment.update({'EDGE_TRIGGERED_EVENTS': 'true'})
+    super().setUp(env=new_environment)
+
+
+class TestBlocking(LwanTest):
+  def test_blocking_calls_dont_block_io_threads(self):
+    def get(url):
+      return requests.get(url)
+
+    # As many calls as there are threads for them at least; if any of
+    # them blocked an I/O thread, this would take longer.
+    urls = ['http://127.0.0.1:8080/blocking?ms=500'] * 4
+    now = time.time()
+    with concurrent.futures.ThreadPoolExecutor(max_workers=len(urls)) as e:
+      responses = list(e.map(get, urls))
+    diff = time.time() - now
+
+    for r in responses:
+      self.assertHttpResponseValid(r, 200, 'text/plain')
+      self.assertEqual(r.text, 'Blocked for 500ms')
+    self.assertTrue(diff < 0.950)
+
+
+class TestTimers(LwanTest):
+  def test_per_thread_timer_ticks(self):
+    r = requests.get('http://127.0.0.1:8080/timer-ticks')
+    self.assertHttpResponseValid(r, 200, 'text/plain')
+    before = int(r.text)
+
+    time.sleep(1)
+
+    r = requests.get('http://127.0.0.1:8080/timer-ticks')
+    self.assertHttpResponseValid(r, 200, 'text/plain')
+    # At least one I/O thread, ticking every 100ms.
+    self.assertGreaterEqual(int(r.text) - before, 8)
+
+  def test_oneshot_and_periodic_timers(self):
+    r = requests.get('http://127.0.0.1:8080/timers')
+    self.assertHttpResponseValid(r, 200, 'text/plain')
+    self.assertEqual(r.text, 'oneshot=1 periodic=3')
+
+  def test_timers_cancelled_when_connection_aborted(self):
+    sock = socket.create_connection(('127.0.0.1', 8080))
+    sock.sendall(b'GET /timers HTTP/1.1\r\nHost: localhost\r\n\r\n')
+    sock.close()
+    time.sleep(0.3)
+
+    r = requests.get('http://127.0.0.1:8080/timers')
+    self.assertHttpResponseValid(r, 200, 'text/plain')
+    self.assertEqual(r.text, 'oneshot=1 periodic=3')
+
+
+class TestAsyncFile(LwanTest):
+  def test_async_file_io(self):
+    r = requests.get('http://127.0.0.1:8080/async-file')
+
+    self.assertHttpResponseValid(r, 200, 'text/html')
+    with open('wwwroot/100.html', 'rb') as f:
+      self.assertEqual(r.content, f.read())
+
+
+class TestAsyncFileIoUring(TestAsyncFile):
+  def setUp(self):
+    new_environment = os.environ.copy()
+    new_environment.update({'USE_IO_URING': 'true'})
+    super().setUp(env=new_environment)
+
+
+class TestHugePages(LwanTest):
+  def setUp(self):
+    new_environment = os.environ.copy()
+    new_environment.update({'HUGE_PAGES': 'true', 'CORO_POOL_SIZE': '4'})
+    super().setUp(env=new_environment)
+
+  @classmethod
+  def setUpClass(cls):
+    if os.uname().sysname != 'Linux':
+      raise unittest.SkipTest
+
+  def test_more_connections_than_pooled_stacks(self):
+    # Some coroutines get stacks from the huge page region, the others
+    # are allocated individually; both have to be usable and freed.
+    for _ in range(3):
+      sockets = []
+      for _ in range(32):
+        s = socket.create_connection(('127.0.0.1', 8080))
+        s.sendall(b'GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n')
+        sockets.append(s)
+
+      for s in sockets:
+        self.assertTrue(s.recv(4096).startswith(b'HTTP/1.1 200 OK'))
+        s.close()
+
+    r = requests.get('http://127.0.0.1:8080/hello')
+    self.assertResponsePlain(r)
+
+
+class TestThreadAffinity(LwanTest):
+  affinity = 'core'
+
+  def setUp(self):
+    new_environment = os.environ.copy()
+    new_environment.update({'THREAD_AFFINITY': self.affinity})
+    super().setUp(env=new_environment)
+
+  @classmethod
+  def setUpClass(cls):
+    if os.uname().sysname != 'Linux':
+      raise unittest.SkipTest
+
+  def test_connections_spread_across_threads(self):
+    sockets = []
+    for _ in range(16):
+      s = socket.create_connection(('127.0.0.1', 8080))
+      s.sendall(b'GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n')
+      self.assertTrue(s.recv(4096).startswith(b'HTTP/1.1 200 OK'))
+      sockets.append(s)
+
+    status = requests.get('http://127.0.0.1:8080/status').json()
+    for thread in status['threads']:
+      self.assertTrue(thread['open_connections'] >= 1)
+
+    for s in sockets:
+      s.close()
+
+
+class TestThreadAffinityNode(TestThreadAffinity):
+  affinity = 'node'
+
+
+class TestResponseCache(LwanTest):
+  def test_response_cache(self):
+    r1 = requests.get('http://127.0.0.1:8080/cached-sleep?ms=300')
+    self.assertHttpResponseValid(r1, 200, 'text/plain')
+
+    # Served from the cache, without sleeping again
+    now = time.time()
+    r2 = requests.get('http://127.0.0.1:8080/cached-sleep?ms=300')
+    diff = time.time() - now
+    self.assertEqual(r2.text, r1.text)
+    self.assertTrue(diff < 0.250)
+
+    # Different query string and value of a "vary" header: different keys
+    r3 = requests.get('http://127.0.0.1:8080/cached-sleep?ms=10')
+    self.assertNotEqual(r3.text, r1.text)
+
+    now = time.time()
+    requests.get('http://127.0.0.1:8080/cached-sleep?ms=300',
+                 headers={'X-Variant': 'other'})
+    diff = time.time() - now
+    self.assertTrue(diff >= 0.250)
+
+
 class TestRequest(LwanTest):
   def test_custom_header_exists(self):
     h = {'Marco': 'Polo'}
@@ -957,6 +1918,12 @@ class TestRequest(LwanTest):
 
     self.assertEqual(r.status_code, 404)
 
+  def test_well_known_header_any_case(self):
+    h = {'user-agent': 'Marco Polo'}
+    r = requests.get('http://127.0.0.1:8080/customhdr?hdr=User-Agent', headers = h)
+
+    self.assertEqual(r.text, "Header value: 'Marco Polo'")
+
 
 class TestFuzzRegressionBase(SocketTest):
   def setUp(self):